@@ -1,4 +1,4 @@
-/* contrib/pg_stat_statements/pg_stat_statements--1.1.sql */
+/* contrib/pg_stat_statements/pg_stat_statements--1.2.sql */
 
 -- complain if script is sourced in psql, rather than via CREATE EXTENSION
 \echo Use "CREATE EXTENSION pg_stat_statements" to load this file. \quit
@@ -27,7 +27,9 @@ CREATE FUNCTION pg_stat_statements(
     OUT temp_blks_read int8,
     OUT temp_blks_written int8,
     OUT blk_read_time float8,
-    OUT blk_write_time float8
+    OUT blk_write_time float8,
+    OUT queryid int8,
+    OUT parent_queryid int8
 )
 RETURNS SETOF record
 AS 'MODULE_PATHNAME'
@@ -67,7 +67,7 @@ PG_MODULE_MAGIC;
 #define PGSS_DUMP_FILE	"global/pg_stat_statements.stat"
 
 /* This constant defines the magic number in the stats file header */
-static const uint32 PGSS_FILE_HEADER = 0x20120328;
+static const uint32 PGSS_FILE_HEADER = 0x20130214;
 
 /* XXX: Should USAGE_EXEC reflect execution time and/or buffer usage? */
 #define USAGE_EXEC(duration)	(1.0)
@@ -93,6 +93,8 @@ typedef struct pgssHashKey
 	Oid			dbid;			/* database OID */
 	int			encoding;		/* query encoding */
 	uint32		queryid;		/* query identifier */
+	uint32		parentid;		/* queryid of enclosing top-level statement,
+								 * or 0 if this is a top-level statement */
 } pgssHashKey;
 
 /*
@@ -176,9 +178,12 @@ typedef struct pgssJumbleState
 
 /*---- Local variables ----*/
 
-/* Current nesting depth of ExecutorRun+ProcessUtility calls */
+/* Current nesting depth of Executor*+ProcessUtility calls */
 static int	nested_level = 0;
 
+/* queryid of the top-level statement now running, charged for nested ones */
+static uint32 top_queryid = 0;
+
 /* Saved hook values in case of unload */
 static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
 static post_parse_analyze_hook_type prev_post_parse_analyze_hook = NULL;
@@ -676,10 +681,28 @@ pgss_post_parse_analyze(ParseState *pstate, Query *query)
 static void
 pgss_ExecutorStart(QueryDesc *queryDesc, int eflags)
 {
-	if (prev_ExecutorStart)
-		prev_ExecutorStart(queryDesc, eflags);
-	else
-		standard_ExecutorStart(queryDesc, eflags);
+	if (nested_level == 0)
+		top_queryid = queryDesc->plannedstmt->queryId;
+
+	/*
+	 * Statements run while the executor starts up, such as the queries a
+	 * Recommend node issues to load its model, are nested in this one.
+	 */
+	nested_level++;
+	PG_TRY();
+	{
+		if (prev_ExecutorStart)
+			prev_ExecutorStart(queryDesc, eflags);
+		else
+			standard_ExecutorStart(queryDesc, eflags);
+		nested_level--;
+	}
+	PG_CATCH();
+	{
+		nested_level--;
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
 
 	/*
 	 * If query has queryId zero, don't track it.  This prevents double
@@ -774,10 +797,22 @@ pgss_ExecutorEnd(QueryDesc *queryDesc)
 				   NULL);
 	}
 
-	if (prev_ExecutorEnd)
-		prev_ExecutorEnd(queryDesc);
-	else
-		standard_ExecutorEnd(queryDesc);
+	/* Likewise for any statements run while the plan is shut down */
+	nested_level++;
+	PG_TRY();
+	{
+		if (prev_ExecutorEnd)
+			prev_ExecutorEnd(queryDesc);
+		else
+			standard_ExecutorEnd(queryDesc);
+		nested_level--;
+	}
+	PG_CATCH();
+	{
+		nested_level--;
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
 }
 
 /*
@@ -800,6 +835,11 @@ pgss_ProcessUtility(Node *parsetree, const char *queryString,
 	 * ensuing EXECUTEs.  This would be confusing, and inconsistent with other
 	 * cases where planning time is not included at all.
 	 */
+	if (nested_level == 0 &&
+		!IsA(parsetree, ExecuteStmt) &&
+		!IsA(parsetree, PrepareStmt))
+		top_queryid = pgss_hash_string(queryString);
+
 	if (pgss_track_utility && pgss_enabled() &&
 		!IsA(parsetree, ExecuteStmt) &&
 		!IsA(parsetree, PrepareStmt))
@@ -898,7 +938,8 @@ pgss_hash_fn(const void *key, Size keysize)
 	/* we don't bother to include encoding in the hash */
 	return hash_uint32((uint32) k->userid) ^
 		hash_uint32((uint32) k->dbid) ^
-		hash_uint32((uint32) k->queryid);
+		hash_uint32((uint32) k->queryid) ^
+		hash_uint32((uint32) k->parentid);
 }
 
 /*
@@ -913,7 +954,8 @@ pgss_match_fn(const void *key1, const void *key2, Size keysize)
 	if (k1->userid == k2->userid &&
 		k1->dbid == k2->dbid &&
 		k1->encoding == k2->encoding &&
-		k1->queryid == k2->queryid)
+		k1->queryid == k2->queryid &&
+		k1->parentid == k2->parentid)
 		return 0;
 	else
 		return 1;
@@ -959,6 +1001,13 @@ pgss_store(const char *query, uint32 queryId,
 	key.encoding = GetDatabaseEncoding();
 	key.queryid = queryId;
 
+	/*
+	 * A nested statement is counted separately for each top-level statement
+	 * it runs under, so that the internal queries of a function or a
+	 * RECOMMEND can be told apart and added up by their caller.
+	 */
+	key.parentid = (nested_level > 0) ? top_queryid : 0;
+
 	/* Lookup the hash table entry with shared lock. */
 	LWLockAcquire(pgss->lock, LW_SHARED);
 
@@ -1065,7 +1114,8 @@ pg_stat_statements_reset(PG_FUNCTION_ARGS)
 }
 
 #define PG_STAT_STATEMENTS_COLS_V1_0	14
-#define PG_STAT_STATEMENTS_COLS			18
+#define PG_STAT_STATEMENTS_COLS_V1_1	18
+#define PG_STAT_STATEMENTS_COLS			20
 
 /*
  * Retrieve statement statistics.
@@ -1083,6 +1133,7 @@ pg_stat_statements(PG_FUNCTION_ARGS)
 	HASH_SEQ_STATUS hash_seq;
 	pgssEntry  *entry;
 	bool		sql_supports_v1_1_counters = true;
+	bool		sql_supports_v1_2_ids = true;
 
 	if (!pgss || !pgss_hash)
 		ereport(ERROR,
@@ -1105,6 +1156,8 @@ pg_stat_statements(PG_FUNCTION_ARGS)
 		elog(ERROR, "return type must be a row type");
 	if (tupdesc->natts == PG_STAT_STATEMENTS_COLS_V1_0)
 		sql_supports_v1_1_counters = false;
+	if (tupdesc->natts != PG_STAT_STATEMENTS_COLS)
+		sql_supports_v1_2_ids = false;
 
 	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
 	oldcontext = MemoryContextSwitchTo(per_query_ctx);
@@ -1181,9 +1234,18 @@ pg_stat_statements(PG_FUNCTION_ARGS)
 			values[i++] = Float8GetDatumFast(tmp.blk_read_time);
 			values[i++] = Float8GetDatumFast(tmp.blk_write_time);
 		}
+		if (sql_supports_v1_2_ids)
+		{
+			values[i++] = Int64GetDatum((int64) entry->key.queryid);
+			if (entry->key.parentid != 0)
+				values[i++] = Int64GetDatum((int64) entry->key.parentid);
+			else
+				nulls[i++] = true;
+		}
 
-		Assert(i == (sql_supports_v1_1_counters ?
-					 PG_STAT_STATEMENTS_COLS : PG_STAT_STATEMENTS_COLS_V1_0));
+		Assert(i == (sql_supports_v1_2_ids ? PG_STAT_STATEMENTS_COLS :
+					 sql_supports_v1_1_counters ? PG_STAT_STATEMENTS_COLS_V1_1 :
+					 PG_STAT_STATEMENTS_COLS_V1_0));
 
 		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
 	}
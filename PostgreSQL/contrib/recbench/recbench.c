@@ -0,0 +1,593 @@
+/*
+ * recbench.c
+ *
+ * A benchmark for RecDB's recommendation queries.
+ *
+ * Each client sends RECOMMEND queries for users drawn from a skewed
+ * distribution, as fast as it can, and mixes in INSERTs of new events
+ * at a fixed overall rate, so the recommender's models go stale the way
+ * they would in use. At the end we report the throughput of both and
+ * the spread of their latencies.
+ *
+ * contrib/recbench/recbench.c
+ */
+
+#include "postgres_fe.h"
+
+#include "getopt_long.h"
+#include "libpq-fe.h"
+#include "portability/instr_time.h"
+
+#include <math.h>
+
+#ifndef WIN32
+#include <unistd.h>
+#endif   /* ! WIN32 */
+
+#if defined(ENABLE_THREAD_SAFETY) && !defined(WIN32)
+#include <pthread.h>
+#define RECBENCH_THREADS
+#endif
+
+#define DEFAULT_DURATION	60
+#define DEFAULT_LIMIT		10
+
+/* connection and workload settings */
+static char *pghost = NULL;
+static char *pgport = NULL;
+static char *login = NULL;
+static char *dbName = NULL;
+
+static char *eventtable = "ratings";
+static char *userkey = "userid";
+static char *itemkey = "itemid";
+static char *eventval = "ratingval";
+static char *method = "ItemCosCF";
+
+static int	nclients = 1;
+static int	duration = DEFAULT_DURATION;
+static int	reclimit = DEFAULT_LIMIT;
+static double insert_rate = 0.0;	/* events per second, over all clients */
+static double skew = 1.0;			/* Zipf exponent, zero for uniform */
+
+/* what we learn about the data before we start */
+static int *users;					/* heaviest users first */
+static int	numusers;
+static double *usercdf;				/* cumulative Zipf weights */
+static int *items;
+static int	numitems;
+static int	minrating;
+static int	maxrating;
+
+/* latencies, in milliseconds, kept for the percentiles */
+typedef struct
+{
+	double	   *values;
+	long		count;
+	long		size;
+} LatencyList;
+
+typedef struct
+{
+	int			id;
+#ifdef RECBENCH_THREADS
+	pthread_t	thread;
+#endif
+	unsigned short random_state[3];
+	LatencyList reads;
+	LatencyList inserts;
+	long		failures;
+} ClientState;
+
+static instr_time start_time;
+
+static void
+usage(const char *progname)
+{
+	printf("%s runs a recommendation workload against RecDB.\n\n"
+		   "Usage:\n"
+		   "  %s [OPTION]... [DBNAME]\n"
+		   "\nWorkload options:\n"
+		   "  -c NUM       number of concurrent clients (default: 1)\n"
+		   "  -T NUM       duration of the run in seconds (default: %d)\n"
+		   "  -R NUM       events to insert per second, over all clients (default: 0)\n"
+		   "  -s NUM       Zipf exponent of the user distribution, 0 for uniform (default: 1.0)\n"
+		   "  -k NUM       recommendations per query (default: %d)\n"
+		   "\nData options:\n"
+		   "  -t TABLE     events table (default: ratings)\n"
+		   "  -u COLUMN    user column (default: userid)\n"
+		   "  -i COLUMN    item column (default: itemid)\n"
+		   "  -e COLUMN    event column (default: ratingval)\n"
+		   "  -m METHOD    recommendation method (default: ItemCosCF)\n"
+		   "\nConnection options:\n"
+		   "  -h HOSTNAME  database server host or socket directory\n"
+		   "  -p PORT      database server port number\n"
+		   "  -U USERNAME  connect as specified database user\n"
+		   "  --help       show this help, then exit\n",
+		   progname, progname, DEFAULT_DURATION, DEFAULT_LIMIT);
+}
+
+static void *
+xmalloc(size_t size)
+{
+	void	   *result;
+
+	result = malloc(size);
+	if (!result)
+	{
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	return result;
+}
+
+static PGconn *
+doConnect(void)
+{
+	PGconn	   *conn;
+
+	conn = PQsetdbLogin(pghost, pgport, NULL, NULL, dbName, login, NULL);
+	if (conn == NULL)
+	{
+		fprintf(stderr, "connection to database \"%s\" failed\n", dbName);
+		return NULL;
+	}
+	if (PQstatus(conn) == CONNECTION_BAD)
+	{
+		fprintf(stderr, "connection to database \"%s\" failed:\n%s",
+				dbName, PQerrorMessage(conn));
+		PQfinish(conn);
+		return NULL;
+	}
+	return conn;
+}
+
+static PGresult *
+fetchRows(PGconn *conn, const char *sql)
+{
+	PGresult   *res;
+
+	res = PQexec(conn, sql);
+	if (PQresultStatus(res) != PGRES_TUPLES_OK)
+	{
+		fprintf(stderr, "%s", PQerrorMessage(conn));
+		fprintf(stderr, "query was: %s\n", sql);
+		exit(1);
+	}
+	return res;
+}
+
+/*
+ * Read the users, items and rating range out of the events table. The
+ * users are ordered from the most events to the fewest, so the Zipf
+ * distribution puts most of the queries on the heaviest users, as a
+ * real workload would.
+ */
+static void
+loadData(PGconn *conn)
+{
+	char		sql[1024];
+	PGresult   *res;
+	double		total;
+	int			i;
+
+	snprintf(sql, sizeof(sql),
+			 "SELECT %s FROM %s GROUP BY %s ORDER BY count(*) DESC",
+			 userkey, eventtable, userkey);
+	res = fetchRows(conn, sql);
+	numusers = PQntuples(res);
+	users = (int *) xmalloc(Max(numusers, 1) * sizeof(int));
+	for (i = 0; i < numusers; i++)
+		users[i] = atoi(PQgetvalue(res, i, 0));
+	PQclear(res);
+
+	snprintf(sql, sizeof(sql), "SELECT DISTINCT %s FROM %s",
+			 itemkey, eventtable);
+	res = fetchRows(conn, sql);
+	numitems = PQntuples(res);
+	items = (int *) xmalloc(Max(numitems, 1) * sizeof(int));
+	for (i = 0; i < numitems; i++)
+		items[i] = atoi(PQgetvalue(res, i, 0));
+	PQclear(res);
+
+	if (numusers == 0 || numitems == 0)
+	{
+		fprintf(stderr, "table \"%s\" has no events\n", eventtable);
+		exit(1);
+	}
+
+	snprintf(sql, sizeof(sql), "SELECT floor(min(%s)), ceil(max(%s)) FROM %s",
+			 eventval, eventval, eventtable);
+	res = fetchRows(conn, sql);
+	minrating = atoi(PQgetvalue(res, 0, 0));
+	maxrating = atoi(PQgetvalue(res, 0, 1));
+	PQclear(res);
+
+	/* The rank-k user gets weight 1/k^s. */
+	usercdf = (double *) xmalloc(numusers * sizeof(double));
+	total = 0.0;
+	for (i = 0; i < numusers; i++)
+	{
+		total += 1.0 / pow((double) (i + 1), skew);
+		usercdf[i] = total;
+	}
+	for (i = 0; i < numusers; i++)
+		usercdf[i] /= total;
+}
+
+static int
+chooseUser(ClientState *client)
+{
+	double		r = pg_erand48(client->random_state);
+	int			lo = 0,
+				hi = numusers - 1;
+
+	while (lo < hi)
+	{
+		int			mid = (lo + hi) / 2;
+
+		if (usercdf[mid] < r)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return users[lo];
+}
+
+static int
+chooseRandom(ClientState *client, int min, int max)
+{
+	return min + (int) ((max - min + 1) * pg_erand48(client->random_state));
+}
+
+static void
+addLatency(LatencyList *list, double value)
+{
+	if (list->count == list->size)
+	{
+		list->size = list->size ? list->size * 2 : 1024;
+		list->values = (double *) realloc(list->values,
+										  list->size * sizeof(double));
+		if (!list->values)
+		{
+			fprintf(stderr, "out of memory\n");
+			exit(1);
+		}
+	}
+	list->values[list->count++] = value;
+}
+
+static double
+elapsedSeconds(void)
+{
+	instr_time	now;
+
+	INSTR_TIME_SET_CURRENT(now);
+	INSTR_TIME_SUBTRACT(now, start_time);
+	return INSTR_TIME_GET_DOUBLE(now);
+}
+
+/*
+ * Run one command and record how long it took. A failure is counted,
+ * not timed, and we carry on.
+ */
+static void
+runTimed(PGconn *conn, ClientState *client, const char *sql,
+		 LatencyList *list)
+{
+	instr_time	before,
+				after;
+	PGresult   *res;
+	ExecStatusType status;
+
+	INSTR_TIME_SET_CURRENT(before);
+	res = PQexec(conn, sql);
+	INSTR_TIME_SET_CURRENT(after);
+	INSTR_TIME_SUBTRACT(after, before);
+
+	status = PQresultStatus(res);
+	if (status == PGRES_TUPLES_OK || status == PGRES_COMMAND_OK)
+		addLatency(list, INSTR_TIME_GET_MILLISEC(after));
+	else
+	{
+		if (client->failures == 0)
+			fprintf(stderr, "client %d: %s", client->id, PQerrorMessage(conn));
+		client->failures++;
+	}
+	PQclear(res);
+}
+
+static void *
+clientRun(void *arg)
+{
+	ClientState *client = (ClientState *) arg;
+	PGconn	   *conn;
+	char		sql[1024];
+	double		interval = 0.0;
+	double		next_insert = 0.0;
+
+	conn = doConnect();
+	if (conn == NULL)
+	{
+		client->failures++;
+		return NULL;
+	}
+
+	/* Each client takes its share of the inserts, evenly spaced. */
+	if (insert_rate > 0.0)
+	{
+		interval = nclients / insert_rate;
+		next_insert = interval * pg_erand48(client->random_state);
+	}
+
+	for (;;)
+	{
+		double		now = elapsedSeconds();
+
+		if (now >= duration)
+			break;
+
+		if (interval > 0.0 && now >= next_insert)
+		{
+			snprintf(sql, sizeof(sql),
+					 "INSERT INTO %s (%s, %s, %s) VALUES (%d, %d, %d)",
+					 eventtable, userkey, itemkey, eventval,
+					 chooseUser(client),
+					 items[chooseRandom(client, 0, numitems - 1)],
+					 chooseRandom(client, minrating, maxrating));
+			runTimed(conn, client, sql, &client->inserts);
+			next_insert += interval;
+		}
+		else
+		{
+			snprintf(sql, sizeof(sql),
+					 "SELECT R.%s FROM %s R "
+					 "RECOMMEND R.%s TO R.%s ON R.%s USING %s "
+					 "WHERE R.%s = %d ORDER BY R.%s DESC LIMIT %d",
+					 itemkey, eventtable,
+					 itemkey, userkey, eventval, method,
+					 userkey, chooseUser(client), eventval, reclimit);
+			runTimed(conn, client, sql, &client->reads);
+		}
+	}
+
+	PQfinish(conn);
+	return NULL;
+}
+
+static int
+compareDouble(const void *a, const void *b)
+{
+	double		x = *(const double *) a;
+	double		y = *(const double *) b;
+
+	return (x > y) - (x < y);
+}
+
+static double
+percentile(LatencyList *list, double p)
+{
+	long		idx = (long) ceil(p * list->count) - 1;
+
+	if (idx < 0)
+		idx = 0;
+	return list->values[idx];
+}
+
+static void
+mergeLatencies(LatencyList *into, LatencyList *from)
+{
+	long		i;
+
+	for (i = 0; i < from->count; i++)
+		addLatency(into, from->values[i]);
+}
+
+static void
+printLatencies(const char *label, LatencyList *list, double seconds)
+{
+	double		sum = 0.0;
+	long		i;
+
+	if (list->count == 0)
+	{
+		printf("%s: none\n", label);
+		return;
+	}
+
+	qsort(list->values, list->count, sizeof(double), compareDouble);
+	for (i = 0; i < list->count; i++)
+		sum += list->values[i];
+
+	printf("%s: %ld in %.1f s, %.2f per second\n",
+		   label, list->count, seconds, list->count / seconds);
+	printf("  latency (ms): avg %.3f  p50 %.3f  p95 %.3f  p99 %.3f  max %.3f\n",
+		   sum / list->count,
+		   percentile(list, 0.50),
+		   percentile(list, 0.95),
+		   percentile(list, 0.99),
+		   list->values[list->count - 1]);
+}
+
+int
+main(int argc, char **argv)
+{
+	static struct option long_options[] = {
+		{"help", no_argument, NULL, '?'},
+		{NULL, 0, NULL, 0}
+	};
+
+	const char *progname;
+	int			c;
+	int			optindex;
+	int			i;
+	PGconn	   *conn;
+	ClientState *clients;
+	LatencyList reads = {NULL, 0, 0};
+	LatencyList inserts = {NULL, 0, 0};
+	long		failures = 0;
+	double		seconds;
+
+	progname = get_progname(argv[0]);
+
+	if (argc > 1 &&
+		(strcmp(argv[1], "--help") == 0 || strcmp(argv[1], "-?") == 0))
+	{
+		usage(progname);
+		exit(0);
+	}
+
+	while ((c = getopt_long(argc, argv, "h:p:U:c:T:R:s:k:t:u:i:e:m:",
+							long_options, &optindex)) != -1)
+	{
+		switch (c)
+		{
+			case 'h':
+				pghost = optarg;
+				break;
+			case 'p':
+				pgport = optarg;
+				break;
+			case 'U':
+				login = optarg;
+				break;
+			case 'c':
+				nclients = atoi(optarg);
+				if (nclients <= 0)
+				{
+					fprintf(stderr, "invalid number of clients: %s\n", optarg);
+					exit(1);
+				}
+				break;
+			case 'T':
+				duration = atoi(optarg);
+				if (duration <= 0)
+				{
+					fprintf(stderr, "invalid duration: %s\n", optarg);
+					exit(1);
+				}
+				break;
+			case 'R':
+				insert_rate = atof(optarg);
+				if (insert_rate < 0.0)
+				{
+					fprintf(stderr, "invalid insert rate: %s\n", optarg);
+					exit(1);
+				}
+				break;
+			case 's':
+				skew = atof(optarg);
+				if (skew < 0.0)
+				{
+					fprintf(stderr, "invalid skew: %s\n", optarg);
+					exit(1);
+				}
+				break;
+			case 'k':
+				reclimit = atoi(optarg);
+				if (reclimit <= 0)
+				{
+					fprintf(stderr, "invalid number of recommendations: %s\n", optarg);
+					exit(1);
+				}
+				break;
+			case 't':
+				eventtable = optarg;
+				break;
+			case 'u':
+				userkey = optarg;
+				break;
+			case 'i':
+				itemkey = optarg;
+				break;
+			case 'e':
+				eventval = optarg;
+				break;
+			case 'm':
+				method = optarg;
+				break;
+			default:
+				fprintf(stderr, _("Try \"%s --help\" for more information.\n"), progname);
+				exit(1);
+				break;
+		}
+	}
+
+	if (argc > optind)
+		dbName = argv[optind];
+	else
+	{
+		if ((dbName = getenv("PGDATABASE")) != NULL && *dbName != '\0')
+			;
+		else if (login != NULL && *login != '\0')
+			dbName = login;
+		else
+			dbName = "";
+	}
+
+#ifndef RECBENCH_THREADS
+	if (nclients > 1)
+	{
+		fprintf(stderr, "this build of recbench supports only one client\n");
+		exit(1);
+	}
+#endif
+
+	conn = doConnect();
+	if (conn == NULL)
+		exit(1);
+	loadData(conn);
+	PQfinish(conn);
+
+	printf("recbench: %d clients, %d s, %s on %s(%s, %s, %s)\n",
+		   nclients, duration, method, eventtable, userkey, itemkey, eventval);
+	printf("%d users with skew %.2f, %d items, %.1f inserts per second\n",
+		   numusers, skew, numitems, insert_rate);
+
+	clients = (ClientState *) xmalloc(nclients * sizeof(ClientState));
+	memset(clients, 0, nclients * sizeof(ClientState));
+	srandom((unsigned int) time(NULL));
+	for (i = 0; i < nclients; i++)
+	{
+		clients[i].id = i;
+		clients[i].random_state[0] = random();
+		clients[i].random_state[1] = random();
+		clients[i].random_state[2] = random();
+	}
+
+	INSTR_TIME_SET_CURRENT(start_time);
+
+#ifdef RECBENCH_THREADS
+	for (i = 0; i < nclients; i++)
+	{
+		int			err = pthread_create(&clients[i].thread, NULL,
+										 clientRun, &clients[i]);
+
+		if (err != 0)
+		{
+			fprintf(stderr, "cannot create thread: %s\n", strerror(err));
+			exit(1);
+		}
+	}
+	for (i = 0; i < nclients; i++)
+		pthread_join(clients[i].thread, NULL);
+#else
+	clientRun(&clients[0]);
+#endif
+
+	seconds = elapsedSeconds();
+
+	for (i = 0; i < nclients; i++)
+	{
+		mergeLatencies(&reads, &clients[i].reads);
+		mergeLatencies(&inserts, &clients[i].inserts);
+		failures += clients[i].failures;
+	}
+
+	printLatencies("recommendations", &reads, seconds);
+	printLatencies("inserts", &inserts, seconds);
+	if (failures > 0)
+		printf("failed commands: %ld\n", failures);
+
+	return failures > 0 ? 1 : 0;
+}
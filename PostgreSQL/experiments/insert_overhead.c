@@ -0,0 +1,176 @@
+/*
+ * insert_overhead.c
+ *
+ * Measures what the recommenders on an events table cost the INSERTs into
+ * it. For 0, 1 and up to N recommenders on a synthetic ratings table, and
+ * for each update_threshold given, we insert single ratings one statement
+ * at a time and time each. Every BATCH inserts we call recathon_maintain()
+ * on the table, as the maintenance script would, and time that separately,
+ * since that's where the counters are brought up to date and any models
+ * that have come due are rebuilt. Run it against a server with no
+ * maintenance script running, or its rebuilds will be mixed in.
+ *
+ * Usage: insert_overhead database inserts max_recommenders threshold...
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+#include "libpq-fe.h"
+
+#define BASE_EVENTS 20000
+#define USERS 500
+#define ITEMS 200
+#define BATCH 100
+
+/* Every recommender on the table needs a method of its own. */
+static const char *methods[] = {
+	"ItemCosCF", "UserCosCF", "SVD", "ItemPearCF",
+	"UserPearCF", "ItemJaccardCF", "ALS"
+};
+#define MAX_RECS ((int) (sizeof(methods) / sizeof(methods[0])))
+
+static PGconn *psql;
+
+// Runs a command we don't need the result of, bailing out if it fails.
+static void command(char *querystring) {
+	PGresult *result;
+
+	result = PQexec(psql,querystring);
+	if (PQresultStatus(result) != PGRES_COMMAND_OK &&
+	    PQresultStatus(result) != PGRES_TUPLES_OK) {
+		fprintf(stderr,"insert_overhead: %s failed: %s",querystring,PQerrorMessage(psql));
+		PQclear(result);
+		PQfinish(psql);
+		exit(1);
+	}
+	PQclear(result);
+}
+
+static double elapsed(struct timeval *start_time, struct timeval *end_time) {
+	return ((double)(end_time->tv_sec - start_time->tv_sec))*1000000.0 +
+		(end_time->tv_usec - start_time->tv_usec);
+}
+
+static int compare_doubles(const void *a, const void *b) {
+	double x = *(const double *) a;
+	double y = *(const double *) b;
+
+	return (x > y) - (x < y);
+}
+
+/*
+ * One configuration: a fresh table with nrecs recommenders on it, at the
+ * given update threshold. Prints a line of results.
+ */
+static void run(int inserts, int nrecs, float threshold) {
+	int i, calls = 0, rebuilds = 0;
+	double total = 0.0, maintain = 0.0;
+	double *latency;
+	char querystring[512];
+	struct timeval start_time, end_time;
+
+	command("DROP TABLE IF EXISTS ovh_events;");
+	command("CREATE TABLE ovh_events (userid INTEGER, itemid INTEGER, ratingval REAL);");
+	sprintf(querystring,"INSERT INTO ovh_events SELECT DISTINCT ON (u, i) u, i, r "
+		"FROM (SELECT 1 + (n * 7919) %% %d AS u, 1 + (n * 104729) %% %d AS i, "
+		"(1 + n %% 5)::real AS r FROM generate_series(1, %d) n) s;",
+		USERS,ITEMS,BASE_EVENTS);
+	command(querystring);
+
+	for (i = 0; i < nrecs; i++) {
+		sprintf(querystring,"CREATE RECOMMENDER ovh_rec%d ON ovh_events "
+			"USERS FROM userid ITEMS FROM itemid EVENTS FROM ratingval USING %s;",
+			i,methods[i]);
+		command(querystring);
+	}
+	if (nrecs > 0) {
+		sprintf(querystring,"UPDATE recdbproperties SET update_threshold = %f;",threshold);
+		command(querystring);
+	}
+
+	// Start from a table the maintenance pass has just seen.
+	command("SELECT recathon_maintain('ovh_events');");
+
+	latency = (double*) malloc(inserts*sizeof(double));
+	for (i = 0; i < inserts; i++) {
+		sprintf(querystring,"INSERT INTO ovh_events VALUES (%d, %d, %d);",
+			1 + (i * 31) % USERS, 1 + (i * 17) % ITEMS, 1 + i % 5);
+		gettimeofday(&start_time,NULL);
+		command(querystring);
+		gettimeofday(&end_time,NULL);
+		latency[i] = elapsed(&start_time,&end_time);
+		total += latency[i];
+
+		if ((i + 1) % BATCH == 0 || i + 1 == inserts) {
+			PGresult *result;
+
+			gettimeofday(&start_time,NULL);
+			result = PQexec(psql,"SELECT recathon_maintain('ovh_events');");
+			gettimeofday(&end_time,NULL);
+			if (PQresultStatus(result) != PGRES_TUPLES_OK) {
+				fprintf(stderr,"insert_overhead: recathon_maintain failed: %s",PQerrorMessage(psql));
+				exit(1);
+			}
+			rebuilds += atoi(PQgetvalue(result,0,0));
+			PQclear(result);
+			maintain += elapsed(&start_time,&end_time);
+			calls++;
+		}
+	}
+
+	qsort(latency,inserts,sizeof(double),compare_doubles);
+	printf("%4d %9.3f %10.0f %9.1f %9.1f %9.1f %9.1f %6d %8d %12.1f\n",
+		nrecs,threshold,inserts / (total / 1000000.0),total / inserts,
+		latency[inserts / 2],latency[(int) (inserts * 0.99)],latency[inserts - 1],
+		calls,rebuilds,maintain / 1000.0);
+	free(latency);
+
+	for (i = 0; i < nrecs; i++) {
+		sprintf(querystring,"DROP RECOMMENDER ovh_rec%d;",i);
+		command(querystring);
+	}
+	command("DROP TABLE ovh_events;");
+}
+
+int main(int argc, char *argv[]) {
+	int i, inserts, maxrecs;
+	char connectstring[256];
+
+	if (argc < 5) {
+		printf("Usage: ./insert_overhead database inserts max_recommenders threshold...\n");
+		exit(0);
+	}
+	inserts = atoi(argv[2]);
+	maxrecs = atoi(argv[3]);
+	if (inserts < 1 || maxrecs < 1 || maxrecs > MAX_RECS) {
+		printf("insert_overhead: need at least one insert, and from 1 to %d recommenders.\n",MAX_RECS);
+		exit(0);
+	}
+
+	/* Connect to the database. */
+	snprintf(connectstring,sizeof(connectstring),"host = 'localhost' port = '5432' dbname = '%s'",argv[1]);
+	psql = PQconnectdb(connectstring);
+	if (PQstatus(psql) != CONNECTION_OK) {
+		printf("insert_overhead error: Bad connection.\n");
+		exit(1);
+	}
+	command("SET client_min_messages = warning;");
+
+	// Latencies are in microseconds, maintenance time in milliseconds.
+	printf("recs threshold   inserts/s   mean_us    p50_us    p99_us    max_us  calls rebuilds  maintain_ms\n");
+
+	// With no recommenders the threshold doesn't matter, so that's run once.
+	run(inserts,0,0.0);
+	for (i = 4; i < argc; i++) {
+		float threshold = atof(argv[i]);
+
+		run(inserts,1,threshold);
+		if (maxrecs > 1)
+			run(inserts,maxrecs,threshold);
+	}
+
+	PQfinish(psql);
+	return 0;
+}
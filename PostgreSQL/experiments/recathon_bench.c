@@ -0,0 +1,503 @@
+/*
+ * recathon_bench.c
+ *
+ * Runs the cell and view-maintenance experiments against the current
+ * engine, from one program. The older drivers here (celladjust,
+ * rec_workload, workload_record, numrecs and the jars) were written for
+ * the first Recathon, with its hand-set Alpha to Delta cell types and its
+ * old query syntax; this does the same experiments with what replaced
+ * them. Each run starts from a fresh synthetic ratings table, so numbers
+ * from different runs, and different servers, can be compared.
+ *
+ *	cells alpha beta gamma delta
+ *		A recommender partitioned by zip code, with adaptive = 10, whose
+ *		cells are split between four workloads in the given percentages:
+ *		alpha cells are queried over and over by a few heavy users, beta
+ *		cells are queried and updated, gamma cells are mostly updated and
+ *		delta cells are left alone. Each round runs every cell's share and
+ *		then a maintenance pass, which may move cells between the model,
+ *		generating on the fly and the RecView. Prints a line per workload,
+ *		with the levels its cells ended up at.
+ *	levelone rounds
+ *		Level-one view maintenance: the same half-query, half-insert
+ *		workload against a plain recommender, one materialized into its
+ *		RecView, and one materialized for its heavy users only.
+ *	leveltwo rounds
+ *		Partial level-two maintenance: inserts that only touch a few hot
+ *		items, against a recommender that rebuilds its whole model and one
+ *		with partial_refresh, which recomputes only the rows that changed.
+ *	mix query_percent rounds
+ *		A mix of queries and inserts, in the given proportions, against
+ *		the plain, materialized and adaptive policies.
+ *	all
+ *		Everything above, with the settings the original experiments used.
+ *
+ * Every round is OPS operations followed by a call to recathon_maintain()
+ * on the table, as the maintenance script would make; run it against a
+ * server with no maintenance script running, or its passes will be mixed
+ * in. Latencies are in microseconds, maintenance time in milliseconds.
+ *
+ * Usage: recathon_bench database experiment [arguments]
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+#include "libpq-fe.h"
+
+#define BASE_EVENTS 20000
+#define USERS 500
+#define ITEMS 200
+#define ZIPS 10
+#define OPS 200
+#define THRESHOLD 0.05
+#define TOPK 10
+
+// The users each cell is queried for, as in the original experiments.
+#define CELL_USERS 10
+#define HEAVY_USERS 3
+// The items the level-two inserts are confined to.
+#define HOT_ITEMS 10
+
+// What each kind of cell gets in a round: queries, then inserts.
+typedef enum {
+	CELL_ALPHA,
+	CELL_BETA,
+	CELL_GAMMA,
+	CELL_DELTA
+} bench_cell;
+#define CELL_TYPES 4
+
+static const char *cellnames[] = { "alpha", "beta", "gamma", "delta" };
+static const int cellqueries[] = { 20, 20, 1, 0 };
+static const int cellinserts[] = { 0, 20, 40, 0 };
+
+typedef struct CellInfo {
+	char		*zipcode;
+	bench_cell	celltype;
+	int		numusers;
+	int		users[CELL_USERS];
+} CellInfo;
+
+// Latencies gathered for one kind of operation.
+typedef struct Timings {
+	int		count;
+	int		size;
+	double		total;
+	double		*values;
+} Timings;
+
+static PGconn *psql;
+static unsigned int seed = 1;
+
+// Runs a command we don't need the result of, bailing out if it fails.
+static void command(char *querystring) {
+	PGresult *result;
+
+	result = PQexec(psql,querystring);
+	if (PQresultStatus(result) != PGRES_COMMAND_OK &&
+	    PQresultStatus(result) != PGRES_TUPLES_OK) {
+		fprintf(stderr,"recathon_bench: %s failed: %s",querystring,PQerrorMessage(psql));
+		PQclear(result);
+		PQfinish(psql);
+		exit(1);
+	}
+	PQclear(result);
+}
+
+static double elapsed(struct timeval *start_time, struct timeval *end_time) {
+	return ((double)(end_time->tv_sec - start_time->tv_sec))*1000000.0 +
+		(end_time->tv_usec - start_time->tv_usec);
+}
+
+static int compare_doubles(const void *a, const void *b) {
+	double x = *(const double *) a;
+	double y = *(const double *) b;
+
+	return (x > y) - (x < y);
+}
+
+// Our own generator, so that every run makes the same choices.
+static int next_random(int n) {
+	seed = seed * 1103515245 + 12345;
+	return (int) ((seed >> 16) % n);
+}
+
+static void timings_add(Timings *t, double value) {
+	if (t->count == t->size) {
+		t->size = t->size ? 2 * t->size : 1024;
+		t->values = (double*) realloc(t->values,t->size*sizeof(double));
+	}
+	t->values[t->count++] = value;
+	t->total += value;
+}
+
+// Prints the count, mean, median and 99th percentile.
+static void timings_print(Timings *t) {
+	if (t->count == 0) {
+		printf(" %7d %9s %9s %9s",0,"-","-","-");
+		return;
+	}
+	qsort(t->values,t->count,sizeof(double),compare_doubles);
+	printf(" %7d %9.1f %9.1f %9.1f",t->count,t->total / t->count,
+		t->values[t->count / 2],t->values[(int) (t->count * 0.99)]);
+}
+
+static void timings_free(Timings *t) {
+	free(t->values);
+	memset(t,0,sizeof(Timings));
+}
+
+// A fresh ratings table, and the users' zip codes.
+static void setup(void) {
+	char querystring[512];
+
+	seed = 1;
+	command("DROP TABLE IF EXISTS bench_events;");
+	command("DROP TABLE IF EXISTS bench_users;");
+	sprintf(querystring,"CREATE TABLE bench_users AS SELECT u AS userid, "
+		"(1 + u %% %d)::text AS zipcode FROM generate_series(1, %d) u;",
+		ZIPS,USERS);
+	command(querystring);
+	command("CREATE TABLE bench_events (userid INTEGER, itemid INTEGER, ratingval REAL);");
+	sprintf(querystring,"INSERT INTO bench_events SELECT DISTINCT ON (u, i) u, i, r "
+		"FROM (SELECT 1 + (n * 7919) %% %d AS u, 1 + (n * 104729) %% %d AS i, "
+		"(1 + n %% 5)::real AS r FROM generate_series(1, %d) n) s;",
+		USERS,ITEMS,BASE_EVENTS);
+	command(querystring);
+	sprintf(querystring,"UPDATE recdbproperties SET update_threshold = %f;",THRESHOLD);
+	command(querystring);
+}
+
+static void teardown(char *recname) {
+	char querystring[256];
+
+	sprintf(querystring,"DROP RECOMMENDER %s;",recname);
+	command(querystring);
+	command("DROP TABLE bench_events;");
+	command("DROP TABLE bench_users;");
+}
+
+static void create_recommender(char *recname, char *clauses) {
+	char querystring[512];
+
+	sprintf(querystring,"CREATE RECOMMENDER %s ON bench_events "
+		"USERS FROM userid ITEMS FROM itemid EVENTS FROM ratingval "
+		"USING ItemCosCF %s;",recname,clauses);
+	command(querystring);
+	// Start from a table the maintenance pass has just seen.
+	command("SELECT recathon_maintain('bench_events');");
+}
+
+static void timed_query(int userid, Timings *t) {
+	char querystring[512];
+	struct timeval start_time, end_time;
+
+	sprintf(querystring,"SELECT R.itemid FROM bench_events R "
+		"RECOMMEND R.itemid TO R.userid ON R.ratingval USING ItemCosCF "
+		"WHERE R.userid = %d ORDER BY R.ratingval DESC LIMIT %d;",userid,TOPK);
+	gettimeofday(&start_time,NULL);
+	command(querystring);
+	gettimeofday(&end_time,NULL);
+	timings_add(t,elapsed(&start_time,&end_time));
+}
+
+static void timed_insert(int userid, int itemid, Timings *t) {
+	char querystring[256];
+	struct timeval start_time, end_time;
+
+	sprintf(querystring,"INSERT INTO bench_events VALUES (%d, %d, %d);",
+		userid,itemid,1 + next_random(5));
+	gettimeofday(&start_time,NULL);
+	command(querystring);
+	gettimeofday(&end_time,NULL);
+	timings_add(t,elapsed(&start_time,&end_time));
+}
+
+// One maintenance pass; returns the number of models it rebuilt.
+static int timed_maintain(double *total) {
+	int rebuilds;
+	PGresult *result;
+	struct timeval start_time, end_time;
+
+	gettimeofday(&start_time,NULL);
+	result = PQexec(psql,"SELECT recathon_maintain('bench_events');");
+	gettimeofday(&end_time,NULL);
+	if (PQresultStatus(result) != PGRES_TUPLES_OK) {
+		fprintf(stderr,"recathon_bench: recathon_maintain failed: %s",PQerrorMessage(psql));
+		exit(1);
+	}
+	rebuilds = atoi(PQgetvalue(result,0,0));
+	PQclear(result);
+	(*total) += elapsed(&start_time,&end_time);
+	return rebuilds;
+}
+
+/*
+ * One policy under a workload of queries and inserts: rounds of OPS
+ * operations, of which qpct percent are queries, spread evenly through
+ * the round. Inserts go to hotitems items if that's nonzero, and to any
+ * item otherwise. Prints a line of results.
+ */
+static void run_policy(char *experiment, char *policy, char *clauses,
+		int qpct, int rounds, int hotitems) {
+	int r, i, rebuilds = 0;
+	double maintain = 0.0, work;
+	Timings queries, inserts;
+	struct timeval start_time, end_time;
+
+	memset(&queries,0,sizeof(Timings));
+	memset(&inserts,0,sizeof(Timings));
+	setup();
+	create_recommender("bench_rec",clauses);
+
+	gettimeofday(&start_time,NULL);
+	for (r = 0; r < rounds; r++) {
+		for (i = 0; i < OPS; i++) {
+			int userid = 1 + next_random(USERS);
+
+			if ((i + 1) * qpct / 100 > i * qpct / 100)
+				timed_query(userid,&queries);
+			else
+				timed_insert(userid,1 + next_random(hotitems ? hotitems : ITEMS),
+					&inserts);
+		}
+		rebuilds += timed_maintain(&maintain);
+	}
+	gettimeofday(&end_time,NULL);
+	work = elapsed(&start_time,&end_time);
+
+	printf("%-9s %-12s %4d %6d",experiment,policy,qpct,rounds);
+	timings_print(&queries);
+	timings_print(&inserts);
+	printf(" %11.1f %8d %9.0f\n",maintain / 1000.0,rebuilds,
+		(double) rounds * OPS / (work / 1000000.0));
+
+	timings_free(&queries);
+	timings_free(&inserts);
+	teardown("bench_rec");
+}
+
+static void print_policy_header(void) {
+	printf("%-9s %-12s %4s %6s %7s %9s %9s %9s %7s %9s %9s %9s %11s %8s %9s\n",
+		"test","policy","q%","rounds","queries","q_mean_us","q_p50_us","q_p99_us",
+		"inserts","i_mean_us","i_p50_us","i_p99_us","maintain_ms","rebuilds","ops/s");
+}
+
+static void levelone(int rounds) {
+	run_policy("levelone","model","",50,rounds,0);
+	run_policy("levelone","materialize","WITH (materialize = 10)",50,rounds,0);
+	run_policy("levelone","hybrid","WITH (materialize = 10, hybrid = true)",50,rounds,0);
+}
+
+static void leveltwo(int rounds) {
+	run_policy("leveltwo","full","",50,rounds,HOT_ITEMS);
+	run_policy("leveltwo","partial","WITH (partial_refresh = true)",50,rounds,HOT_ITEMS);
+}
+
+static void mix(int qpct, int rounds) {
+	run_policy("mix","model","",qpct,rounds,0);
+	run_policy("mix","materialize","WITH (materialize = 10)",qpct,rounds,0);
+	run_policy("mix","adaptive","WITH (adaptive = 10)",qpct,rounds,0);
+}
+
+/*
+ * The cell experiment. The cells are dealt out to the four workloads in
+ * turn, as celladjust did, until each has its share, so the same split
+ * always gives the same cells the same workloads.
+ */
+static void cells(int shares[CELL_TYPES], int rounds) {
+	int i, j, r, c, numcells, extra, rebuilds = 0;
+	int wanted[CELL_TYPES];
+	int levels[CELL_TYPES][3];
+	double maintain = 0.0;
+	char querystring[512];
+	Timings queries[CELL_TYPES], inserts[CELL_TYPES];
+	CellInfo *cellinfo;
+	PGresult *result;
+
+	setup();
+	create_recommender("bench_cells","PARTITION BY zipcode FROM bench_users WITH (adaptive = 10)");
+
+	result = PQexec(psql,"SELECT partitionvalue FROM RecModelsCatalogue "
+		"WHERE lower(partitionof) = 'bench_cells' ORDER BY recommendername;");
+	if (PQresultStatus(result) != PGRES_TUPLES_OK || PQntuples(result) == 0) {
+		fprintf(stderr,"recathon_bench: the recommender has no cells: %s",PQerrorMessage(psql));
+		exit(1);
+	}
+	numcells = PQntuples(result);
+	cellinfo = (CellInfo*) malloc(numcells*sizeof(CellInfo));
+	for (i = 0; i < numcells; i++)
+		cellinfo[i].zipcode = strdup(PQgetvalue(result,i,0));
+	PQclear(result);
+
+	// Work out how many cells each workload gets, handing out what's
+	// left over from rounding down in order.
+	extra = numcells;
+	for (c = 0; c < CELL_TYPES; c++) {
+		wanted[c] = numcells * shares[c] / 100;
+		extra -= wanted[c];
+	}
+	for (c = 0; c < CELL_TYPES && extra > 0; c++) {
+		if (shares[c] > 0) {
+			wanted[c]++;
+			extra--;
+		}
+	}
+	c = CELL_DELTA;
+	for (i = 0; i < numcells; i++) {
+		do {
+			c = (c + 1) % CELL_TYPES;
+		} while (wanted[c] == 0);
+		wanted[c]--;
+		cellinfo[i].celltype = (bench_cell) c;
+
+		sprintf(querystring,"SELECT userid FROM bench_users WHERE zipcode = '%s' ORDER BY userid LIMIT %d;",
+			cellinfo[i].zipcode,CELL_USERS);
+		result = PQexec(psql,querystring);
+		cellinfo[i].numusers = PQntuples(result);
+		for (j = 0; j < cellinfo[i].numusers; j++)
+			cellinfo[i].users[j] = atoi(PQgetvalue(result,j,0));
+		PQclear(result);
+	}
+
+	memset(queries,0,sizeof(queries));
+	memset(inserts,0,sizeof(inserts));
+	for (r = 0; r < rounds; r++) {
+		for (i = 0; i < numcells; i++) {
+			CellInfo *cell = &cellinfo[i];
+
+			if (cell->numusers == 0)
+				continue;
+			c = cell->celltype;
+			// Alpha cells are asked about their heavy users.
+			for (j = 0; j < cellqueries[c]; j++)
+				timed_query(cell->users[next_random(c == CELL_ALPHA ?
+					(cell->numusers < HEAVY_USERS ? cell->numusers : HEAVY_USERS) :
+					cell->numusers)],&queries[c]);
+			for (j = 0; j < cellinserts[c]; j++)
+				timed_insert(cell->users[next_random(cell->numusers)],
+					1 + next_random(ITEMS),&inserts[c]);
+		}
+		rebuilds += timed_maintain(&maintain);
+	}
+
+	// Where the maintenance passes left the cells.
+	memset(levels,0,sizeof(levels));
+	result = PQexec(psql,"SELECT partitionvalue, level FROM RecModelsCatalogue "
+		"WHERE lower(partitionof) = 'bench_cells';");
+	for (j = 0; j < PQntuples(result); j++) {
+		int level = atoi(PQgetvalue(result,j,1));
+
+		for (i = 0; i < numcells; i++) {
+			if (strcmp(cellinfo[i].zipcode,PQgetvalue(result,j,0)) == 0 &&
+			    level >= 0 && level < 3)
+				levels[cellinfo[i].celltype][level]++;
+		}
+	}
+	PQclear(result);
+
+	printf("%-6s %5s %7s %9s %9s %9s %7s %9s %9s %9s %5s %5s %5s\n",
+		"cells","share","queries","q_mean_us","q_p50_us","q_p99_us",
+		"inserts","i_mean_us","i_p50_us","i_p99_us","model","fly","view");
+	for (c = 0; c < CELL_TYPES; c++) {
+		printf("%-6s %4d%%",cellnames[c],shares[c]);
+		timings_print(&queries[c]);
+		timings_print(&inserts[c]);
+		printf(" %5d %5d %5d\n",levels[c][0],levels[c][1],levels[c][2]);
+		timings_free(&queries[c]);
+		timings_free(&inserts[c]);
+	}
+	printf("%d cells, %d rounds, %d rebuilds, %.1f ms of maintenance\n",
+		numcells,rounds,rebuilds,maintain / 1000.0);
+
+	for (i = 0; i < numcells; i++)
+		free(cellinfo[i].zipcode);
+	free(cellinfo);
+	teardown("bench_cells");
+}
+
+static void usage(void) {
+	printf("Usage: ./recathon_bench database experiment [arguments]\n");
+	printf("  cells alpha beta gamma delta   percentages of cells, summing to 100\n");
+	printf("  levelone rounds\n");
+	printf("  leveltwo rounds\n");
+	printf("  mix query_percent rounds\n");
+	printf("  all\n");
+	exit(0);
+}
+
+int main(int argc, char *argv[]) {
+	char connectstring[256];
+	char *experiment;
+
+	if (argc < 3)
+		usage();
+	experiment = argv[2];
+
+	/* Connect to the database. */
+	snprintf(connectstring,sizeof(connectstring),"host = 'localhost' port = '5432' dbname = '%s'",argv[1]);
+	psql = PQconnectdb(connectstring);
+	if (PQstatus(psql) != CONNECTION_OK) {
+		printf("recathon_bench error: Bad connection.\n");
+		exit(1);
+	}
+	command("SET client_min_messages = warning;");
+
+	if (strcmp(experiment,"cells") == 0) {
+		int c, shares[CELL_TYPES], sum = 0;
+
+		if (argc != 7)
+			usage();
+		for (c = 0; c < CELL_TYPES; c++) {
+			shares[c] = atoi(argv[3 + c]);
+			if (shares[c] < 0)
+				usage();
+			sum += shares[c];
+		}
+		if (sum != 100) {
+			printf("The values for alpha, beta, gamma and delta need to be integers that sum to 100.\n");
+			exit(0);
+		}
+		cells(shares,20);
+	} else if (strcmp(experiment,"levelone") == 0 ||
+		   strcmp(experiment,"leveltwo") == 0) {
+		int rounds;
+
+		if (argc != 4 || (rounds = atoi(argv[3])) < 1)
+			usage();
+		print_policy_header();
+		if (strcmp(experiment,"levelone") == 0)
+			levelone(rounds);
+		else
+			leveltwo(rounds);
+	} else if (strcmp(experiment,"mix") == 0) {
+		int qpct, rounds;
+
+		if (argc != 5)
+			usage();
+		qpct = atoi(argv[3]);
+		rounds = atoi(argv[4]);
+		if (qpct < 0 || qpct > 100 || rounds < 1)
+			usage();
+		print_policy_header();
+		mix(qpct,rounds);
+	} else if (strcmp(experiment,"all") == 0) {
+		// The split workload_record ran with.
+		int shares[CELL_TYPES] = { 50, 0, 50, 0 };
+
+		cells(shares,20);
+		printf("\n");
+		print_policy_header();
+		levelone(20);
+		leveltwo(20);
+		mix(20,20);
+		mix(50,20);
+		mix(80,20);
+	} else
+		usage();
+
+	PQfinish(psql);
+	return 0;
+}
@@ -14,6 +14,12 @@ SELECT * FROM ml_ratings RECOMMEND itemid TO userid ON ratingval USING itempearc
 DROP RECOMMENDER MovieRec;
 SELECT * FROM ml_ratings RECOMMEND itemid TO userid ON ratingval USING itempearcf WHERE userid = 1;
 
+/* ItemJaccardCF. */
+CREATE RECOMMENDER MovieRec ON ml_ratings USERS FROM userid ITEMS FROM itemid EVENTS FROM ratingval USING itemjaccardcf;
+SELECT * FROM ml_ratings RECOMMEND itemid TO userid ON ratingval USING itemjaccardcf WHERE userid = 1;
+DROP RECOMMENDER MovieRec;
+SELECT * FROM ml_ratings RECOMMEND itemid TO userid ON ratingval USING itemjaccardcf WHERE userid = 1;
+
 /* UserCosCF. */
 CREATE RECOMMENDER MovieRec ON ml_ratings USERS FROM userid ITEMS FROM itemid EVENTS FROM ratingval USING usercoscf;
 SELECT * FROM ml_ratings RECOMMEND itemid TO userid ON ratingval USING usercoscf WHERE userid = 1;
@@ -32,6 +38,18 @@ SELECT * FROM ml_ratings RECOMMEND itemid TO userid ON ratingval USING svd WHERE
 DROP RECOMMENDER MovieRec;
 SELECT * FROM ml_ratings RECOMMEND itemid TO userid ON ratingval USING svd WHERE userid = 1;
 
+/* ALS. The model has a row for every user and item. Expected:
+ *  method | users | items | features
+ * --------+-------+-------+----------
+ *  als    | t     | t     |       50
+ * (1 row)
+ */
+CREATE RECOMMENDER MovieRec ON ml_ratings USERS FROM userid ITEMS FROM itemid EVENTS FROM ratingval USING als;
+SELECT method, users = (SELECT count(DISTINCT userid) FROM ml_ratings) AS users, items = (SELECT count(DISTINCT itemid) FROM ml_ratings) AS items, features FROM recathon_model_stats('MovieRec');
+SELECT * FROM ml_ratings RECOMMEND itemid TO userid ON ratingval USING als WHERE userid = 1;
+DROP RECOMMENDER MovieRec;
+SELECT * FROM ml_ratings RECOMMEND itemid TO userid ON ratingval USING als WHERE userid = 1;
+
 /* Miscellaneous. */
 CREATE RECOMMENDER MovieRec ON ml_ratings USERS FROM userid ITEMS FROM itemid EVENTS FROM ratingval USING itemcoscf;
 SELECT * FROM ml_ratings RECOMMEND itemid TO userid ON ratingval USING itemcoscf WHERE userid IN (1,2,3,5,9) AND itemid < 7;
@@ -40,3 +58,226 @@ SELECT * FROM ml_ratings RECOMMEND itemid TO userid ON ratingval USING itemcoscf
 SELECT r.itemid,r.ratingval,i.name,i.genre FROM ml_ratings r, ml_items i RECOMMEND r.itemid TO r.userid ON r.ratingval USING itemcoscf WHERE r.userid = 1 AND r.itemid = i.itemid AND i.genre ILIKE '%action%' ORDER BY ratingval DESC LIMIT 5;
 SELECT * FROM ml_ratings RECOMMEND itemid TO userid ON ratingval USING itemcoscf WHERE userid = 1 AND ratingval >= 4.5;
 DROP RECOMMENDER MovieRec;
+
+/* Rebuilding an SVD recommender keeps its options, and starts from the
+ * factors it had. Expected:
+ *  features | build_strategy
+ * ----------+----------------
+ *        10 | warm started
+ * (1 row)
+ */
+CREATE RECOMMENDER MovieRec ON ml_ratings USERS FROM userid ITEMS FROM itemid EVENTS FROM ratingval USING svd WITH (features = 10, max_epochs = 20);
+ALTER RECOMMENDER MovieRec REFRESH;
+SELECT features, build_strategy FROM recathon_model_stats('MovieRec');
+DROP RECOMMENDER MovieRec;
+
+/* Rebuilding an ALS recommender keeps the options it was created with.
+ * Expected:
+ *  features | maxepochs | regularization | parallelworkers
+ * ----------+-----------+----------------+-----------------
+ *        12 |         5 |            0.1 |               2
+ * (1 row)
+ *
+ *  features
+ * ----------
+ *        12
+ * (1 row)
+ */
+CREATE RECOMMENDER MovieRec ON ml_ratings USERS FROM userid ITEMS FROM itemid EVENTS FROM ratingval USING als WITH (features = 12, max_epochs = 5, regularization = 0.1, parallel_workers = 2);
+ALTER RECOMMENDER MovieRec REFRESH;
+SELECT features, maxepochs, regularization, parallelworkers FROM RecModelsCatalogue WHERE recommendername = 'movierec';
+SELECT features FROM recathon_model_stats('MovieRec');
+DROP RECOMMENDER MovieRec;
+
+/* A recommender with TIME FROM only learns from the events in its
+ * window, and with DECAY, weighs each by its age. Expected:
+ *  windowed | decayed
+ * ----------+---------
+ *  t        | t
+ * (1 row)
+ *
+ *  scored
+ * --------
+ *  t
+ * (1 row)
+ */
+CREATE TABLE ml_dated_ratings AS SELECT userid, itemid, ratingval, now() - (ratingid % 60) * interval '1 day' AS ratedat FROM ml_ratings;
+CREATE RECOMMENDER MovieRec ON ml_dated_ratings USERS FROM userid ITEMS FROM itemid EVENTS FROM ratingval TIME FROM ratedat WINDOW '30 days' DECAY '7 days' USING itemcoscf;
+SELECT count(*) = (SELECT count(*) FROM ml_dated_ratings WHERE ratedat >= now() - interval '30 days') AS windowed, bool_and(w.ratingval <= r.ratingval) AS decayed FROM MovieRecIndexWindow w, ml_dated_ratings r WHERE r.userid = w.userid AND r.itemid = w.itemid AND r.ratedat = w.ratedat;
+CREATE TEMP TABLE window_recs (itemid INTEGER, ratingval REAL);
+INSERT INTO window_recs SELECT itemid, ratingval FROM ml_dated_ratings RECOMMEND itemid TO userid ON ratingval USING itemcoscf WHERE userid = 1;
+SELECT count(*) > 0 AS scored FROM window_recs;
+DROP RECOMMENDER MovieRec;
+DROP TABLE window_recs, ml_dated_ratings;
+
+/* REFRESH rebuilds the models there and then, and with no new events,
+ * queries give the same recommendations as before. REFRESH CONCURRENTLY
+ * leaves the rebuild to the next maintenance pass. Expected:
+ *  changed
+ * ---------
+ *        0
+ * (1 row)
+ *
+ *  maintained
+ * ------------
+ *  t
+ * (1 row)
+ *
+ *  changed
+ * ---------
+ *        0
+ * (1 row)
+ */
+CREATE RECOMMENDER MovieRec ON ml_ratings USERS FROM userid ITEMS FROM itemid EVENTS FROM ratingval USING itemcoscf;
+CREATE TEMP TABLE before_refresh (itemid INTEGER, ratingval REAL);
+CREATE TEMP TABLE after_refresh (itemid INTEGER, ratingval REAL);
+INSERT INTO before_refresh SELECT itemid, ratingval FROM ml_ratings RECOMMEND itemid TO userid ON ratingval USING itemcoscf WHERE userid = 1;
+ALTER RECOMMENDER MovieRec REFRESH;
+INSERT INTO after_refresh SELECT itemid, ratingval FROM ml_ratings RECOMMEND itemid TO userid ON ratingval USING itemcoscf WHERE userid = 1;
+SELECT count(*) AS changed FROM before_refresh b FULL JOIN after_refresh a USING (itemid) WHERE a.ratingval IS DISTINCT FROM b.ratingval;
+TRUNCATE after_refresh;
+ALTER RECOMMENDER MovieRec REFRESH CONCURRENTLY;
+SELECT recathon_maintain('ml_ratings') >= 0 AS maintained;
+INSERT INTO after_refresh SELECT itemid, ratingval FROM ml_ratings RECOMMEND itemid TO userid ON ratingval USING itemcoscf WHERE userid = 1;
+SELECT count(*) AS changed FROM before_refresh b FULL JOIN after_refresh a USING (itemid) WHERE a.ratingval IS DISTINCT FROM b.ratingval;
+DROP RECOMMENDER MovieRec;
+DROP TABLE before_refresh, after_refresh;
+
+/* A recommender built from the events that meet a condition answers the
+ * queries whose WHERE clause has it, so only its items are scored.
+ * Expected:
+ *  filtered
+ * ----------
+ *  t
+ * (1 row)
+ *
+ *  items | filtered
+ * -------+----------
+ *  t     | t
+ * (1 row)
+ */
+CREATE RECOMMENDER MovieRec ON ml_ratings USERS FROM userid ITEMS FROM itemid EVENTS FROM ratingval USING itemcoscf;
+CREATE RECOMMENDER EarlyMovieRec ON ml_ratings WHERE (itemid < 100) USERS FROM userid ITEMS FROM itemid EVENTS FROM ratingval USING itemcoscf;
+SELECT count(*) = (SELECT count(*) FROM ml_ratings WHERE itemid < 100) AS filtered FROM EarlyMovieRecIndexFilter;
+CREATE TEMP TABLE filter_recs (itemid INTEGER, ratingval REAL);
+INSERT INTO filter_recs SELECT itemid, ratingval FROM ml_ratings RECOMMEND itemid TO userid ON ratingval USING itemcoscf WHERE itemid < 100 AND userid = 1;
+SELECT count(*) = (SELECT count(DISTINCT itemid) FROM ml_ratings WHERE itemid < 100) AS items, bool_and(itemid < 100) AS filtered FROM filter_recs;
+DROP RECOMMENDER EarlyMovieRec;
+DROP RECOMMENDER MovieRec;
+DROP TABLE filter_recs;
+
+/* EXCLUDE RATED leaves out the items the user has rated, and INCLUDE
+ * RATED keeps them. Expected:
+ *  rated | all_items
+ * -------+-----------
+ *      0 | t
+ * (1 row)
+ */
+CREATE RECOMMENDER MovieRec ON ml_ratings USERS FROM userid ITEMS FROM itemid EVENTS FROM ratingval USING itemcoscf;
+CREATE TEMP TABLE excluded_recs (itemid INTEGER, ratingval REAL);
+CREATE TEMP TABLE included_recs (itemid INTEGER, ratingval REAL);
+INSERT INTO excluded_recs SELECT itemid, ratingval FROM ml_ratings RECOMMEND itemid TO userid ON ratingval USING itemcoscf EXCLUDE RATED WHERE userid = 1;
+INSERT INTO included_recs SELECT itemid, ratingval FROM ml_ratings RECOMMEND itemid TO userid ON ratingval USING itemcoscf INCLUDE RATED WHERE userid = 1;
+SELECT (SELECT count(*) FROM excluded_recs e, ml_ratings r WHERE r.userid = 1 AND r.itemid = e.itemid) AS rated, (SELECT count(*) FROM excluded_recs) + (SELECT count(*) FROM ml_ratings WHERE userid = 1) = (SELECT count(*) FROM included_recs) AS all_items;
+DROP RECOMMENDER MovieRec;
+DROP TABLE excluded_recs, included_recs;
+
+/* An ensemble gives each item the weighted average of its methods'
+ * predictions. Expected:
+ *  items | mismatched
+ * -------+------------
+ *  t     |          0
+ * (1 row)
+ *
+ * ERROR:  an ensemble needs at least two methods
+ */
+CREATE TEMP TABLE cos_recs (itemid INTEGER, ratingval REAL);
+CREATE TEMP TABLE pear_recs (itemid INTEGER, ratingval REAL);
+CREATE TEMP TABLE ensemble_recs (itemid INTEGER, ratingval REAL);
+INSERT INTO cos_recs SELECT itemid, ratingval FROM ml_ratings RECOMMEND itemid TO userid ON ratingval USING itemcoscf WHERE userid = 1;
+INSERT INTO pear_recs SELECT itemid, ratingval FROM ml_ratings RECOMMEND itemid TO userid ON ratingval USING itempearcf WHERE userid = 1;
+INSERT INTO ensemble_recs SELECT itemid, ratingval FROM ml_ratings RECOMMEND itemid TO userid ON ratingval USING ensemble(itemcoscf 0.6, itempearcf 0.4) WHERE userid = 1;
+SELECT (SELECT count(*) FROM ensemble_recs) = (SELECT count(*) FROM cos_recs) AS items, count(*) AS mismatched FROM ensemble_recs e, cos_recs c, pear_recs p WHERE c.itemid = e.itemid AND p.itemid = e.itemid AND abs(e.ratingval - (0.6 * c.ratingval + 0.4 * p.ratingval)) > 0.001;
+SELECT * FROM ml_ratings RECOMMEND itemid TO userid ON ratingval USING ensemble(itemcoscf 1.0) WHERE userid = 1;
+DROP TABLE cos_recs, pear_recs, ensemble_recs;
+
+/* CANDIDATES FROM has one method pick the items another scores: the
+ * picking method's best 50, each with the main method's prediction.
+ * Expected:
+ *  items | unpicked | mismatched
+ * -------+----------+------------
+ *     50 |        0 |          0
+ * (1 row)
+ */
+CREATE TEMP TABLE cos_recs (itemid INTEGER, ratingval REAL);
+CREATE TEMP TABLE pear_recs (itemid INTEGER, ratingval REAL);
+CREATE TEMP TABLE candidate_recs (itemid INTEGER, ratingval REAL);
+INSERT INTO cos_recs SELECT itemid, ratingval FROM ml_ratings RECOMMEND itemid TO userid ON ratingval USING itemcoscf WHERE userid = 1;
+INSERT INTO pear_recs SELECT itemid, ratingval FROM ml_ratings RECOMMEND itemid TO userid ON ratingval USING itempearcf WHERE userid = 1;
+INSERT INTO candidate_recs SELECT itemid, ratingval FROM ml_ratings RECOMMEND itemid TO userid ON ratingval USING itempearcf CANDIDATES FROM itemcoscf LIMIT 50 WHERE userid = 1;
+SELECT (SELECT count(*) FROM candidate_recs) AS items, (SELECT count(*) FROM candidate_recs r, cos_recs c WHERE c.itemid = r.itemid AND c.ratingval < (SELECT ratingval FROM cos_recs ORDER BY ratingval DESC OFFSET 49 LIMIT 1)) AS unpicked, (SELECT count(*) FROM candidate_recs r, pear_recs p WHERE p.itemid = r.itemid AND abs(p.ratingval - r.ratingval) > 0.001) AS mismatched;
+DROP TABLE cos_recs, pear_recs, candidate_recs;
+
+/* The set-returning functions of a built recommender. Expected:
+ *  written
+ * ---------
+ *  t
+ * (1 row)
+ *
+ *  users | items
+ * -------+-------
+ *  t     | t
+ * (1 row)
+ *
+ *  items | others
+ * -------+--------
+ *      5 | t
+ * (1 row)
+ *
+ *  items | unrated
+ * -------+---------
+ *      5 | t
+ * (1 row)
+ *
+ *  items | candidates
+ * -------+------------
+ *      2 | t
+ * (1 row)
+ *
+ *  userid | items
+ * --------+-------
+ *       1 |     5
+ *       2 |     5
+ *       3 |     5
+ * (3 rows)
+ *
+ *  items | unrated
+ * -------+---------
+ *      5 | t
+ * (1 row)
+ *
+ * ERROR:  unrecognized group aggregate "median"
+ * HINT:  Valid aggregates are "avg", "min" or "least_misery", and "max" or "most_pleasure".
+ *  scored | rmse | precision | recall
+ * --------+------+-----------+--------
+ *  t      | t    | t         | t
+ * (1 row)
+ *
+ *   method   | users | items | events | features | similarities
+ * -----------+-------+-------+--------+----------+--------------
+ *  itemcoscf | t     | t     | t      |          | t
+ * (1 row)
+ */
+CREATE RECOMMENDER MovieRec ON ml_ratings USERS FROM userid ITEMS FROM itemid EVENTS FROM ratingval USING itemcoscf;
+SELECT recathon_export('MovieRec', 'movie_recs', 5) = 5 * (SELECT count(DISTINCT userid) FROM ml_ratings) AS written;
+SELECT count(DISTINCT userid) = (SELECT count(DISTINCT userid) FROM ml_ratings) AS users, max(itemid) IS NOT NULL AS items FROM movie_recs;
+DROP TABLE movie_recs;
+SELECT count(*) AS items, bool_and(item <> 1) AS others FROM recathon_similar_items('MovieRec', 1, 5);
+SELECT count(*) AS items, bool_and(NOT EXISTS (SELECT 1 FROM ml_ratings r WHERE r.userid = 1 AND r.itemid = s.item)) AS unrated FROM recathon_recommend('MovieRec', 1, 5) s;
+SELECT count(*) AS items, bool_and(item = ANY(ARRAY[300, 400, 500, 600])) AS candidates FROM recathon_recommend('MovieRec', 1, 2, ARRAY[300, 400, 500, 600]);
+SELECT userid, count(*) AS items FROM recathon_recommend_batch('MovieRec', ARRAY[1, 2, 3], 5) GROUP BY userid ORDER BY userid;
+SELECT count(*) AS items, bool_and(NOT EXISTS (SELECT 1 FROM ml_ratings r WHERE r.userid IN (1, 2) AND r.itemid = g.item)) AS unrated FROM recathon_recommend_group('MovieRec', ARRAY[1, 2], 5, 'least_misery') g;
+SELECT * FROM recathon_recommend_group('MovieRec', ARRAY[1, 2], 5, 'median');
+SELECT users > 0 AS scored, rmse > 0 AS rmse, precision BETWEEN 0 AND 1 AS precision, recall BETWEEN 0 AND 1 AS recall FROM recathon_evaluate('MovieRec', 0.2, 10);
+SELECT method, users = (SELECT count(DISTINCT userid) FROM ml_ratings) AS users, items = (SELECT count(DISTINCT itemid) FROM ml_ratings) AS items, events = (SELECT count(*) FROM ml_ratings) AS events, features, similarity_min <= similarity_max AS similarities FROM recathon_model_stats('MovieRec');
+DROP RECOMMENDER MovieRec;
@@ -0,0 +1,40 @@
+#!/usr/bin/perl
+
+# Run RecDB model maintenance in the background. INSERTs into an events
+# table only queue a notification; this process picks up the work,
+# updating cell counters and rebuilding recommenders that have gone
+# past the update threshold. With the result cache on, it also scores
+# again the cached recommendations of users who have new events. Each
+# time it finds the server has (re)started, it first preloads the
+# recommenders listed in recathon_preload_recommenders.
+
+use strict;
+use warnings;
+
+open FILE, "<", "install.properties" or die $!;
+my @path = <FILE>;
+close FILE or die $!;
+chomp (@path);
+
+# Usage: perl scripts/recdbmaintain.pl [db_name] [interval] [server_host]
+my $arg_length = (scalar @ARGV);
+my $interval = 10;
+my $host = "localhost";
+if ($arg_length >= 2) {
+	$interval = $ARGV[1];
+}
+if ($arg_length >= 3) {
+	$host = $ARGV[2];
+}
+
+print "Running RecDB maintenance on $ARGV[0] every $interval seconds.\n";
+my $started = "";
+while (1) {
+	my $now = `$path[0]/bin/psql -h $host -q -t -A -c "SELECT pg_postmaster_start_time();" $ARGV[0]`;
+	if ($? == 0 && $now ne $started) {
+		system "$path[0]/bin/psql", "-h", "$host", "-q", "-t", "-c", "SELECT recathon_preload();", "$ARGV[0]";
+		$started = $now;
+	}
+	system "$path[0]/bin/psql", "-h", "$host", "-q", "-t", "-c", "SELECT recathon_maintain(); SELECT recathon_prewarm();", "$ARGV[0]";
+	sleep $interval;
+}
@@ -35,6 +35,7 @@ typedef struct
 {
 	bool		isUnique;
 	bool		haveDead;
+	bool		presorted;		/* loading the heap's order directly? */
 	Relation	heapRel;
 	BTSpool    *spool;
 
@@ -90,6 +91,7 @@ btbuild(PG_FUNCTION_ARGS)
 
 	buildstate.isUnique = indexInfo->ii_Unique;
 	buildstate.haveDead = false;
+	buildstate.presorted = bt_build_presorted && !indexInfo->ii_Concurrent;
 	buildstate.heapRel = heap;
 	buildstate.spool = NULL;
 	buildstate.spool2 = NULL;
@@ -108,6 +110,29 @@ btbuild(PG_FUNCTION_ARGS)
 		elog(ERROR, "index \"%s\" already contains data",
 			 RelationGetRelationName(index));
 
+	/*
+	 * If the caller says the heap is already in index order, try loading it
+	 * as it's scanned, with no sort.  The scan mustn't be synchronized, or
+	 * it would start partway through.  If the order turns out to be wrong,
+	 * or a unique index meets a dead tuple, which would want a spool of its
+	 * own, we build the index again the usual way.
+	 */
+	if (buildstate.presorted)
+	{
+		buildstate.spool = _bt_presortinit(index, indexInfo->ii_Unique);
+		reltuples = IndexBuildHeapScan(heap, index, indexInfo, false,
+									   btbuildCallback, (void *) &buildstate);
+		if (_bt_presortdone(buildstate.spool, buildstate.haveDead))
+		{
+			_bt_spooldestroy(buildstate.spool);
+			goto done;
+		}
+		_bt_spooldestroy(buildstate.spool);
+		buildstate.presorted = false;
+		buildstate.haveDead = false;
+		buildstate.indtuples = 0;
+	}
+
 	buildstate.spool = _bt_spoolinit(index, indexInfo->ii_Unique, false);
 
 	/*
@@ -139,6 +164,7 @@ btbuild(PG_FUNCTION_ARGS)
 	if (buildstate.spool2)
 		_bt_spooldestroy(buildstate.spool2);
 
+done:
 #ifdef BTREE_BUILD_STATS
 	if (log_btree_build_stats)
 	{
@@ -180,6 +206,15 @@ btbuildCallback(Relation index,
 	BTBuildState *buildstate = (BTBuildState *) state;
 	IndexTuple	itup;
 
+	/* a presorted unique build that has met a dead tuple is given up */
+	if (buildstate->presorted && buildstate->haveDead)
+		return;
+	if (buildstate->presorted && !tupleIsAlive && buildstate->isUnique)
+	{
+		buildstate->haveDead = true;
+		return;
+	}
+
 	/* form an index tuple and point it at the heap tuple */
 	itup = index_form_tuple(RelationGetDescr(index), values, isnull);
 	itup->t_tid = htup->t_self;
@@ -55,6 +55,14 @@
  * This code isn't concerned about the FSM at all. The caller is responsible
  * for initializing that.
  *
+ * When the caller knows that the heap was filled in index order, as a
+ * freshly written recommender model is, it can set bt_build_presorted.
+ * Then there's no sort at all: the heap is scanned without synchronizing
+ * with other scans, and each tuple goes straight into the leaf pages as
+ * it arrives, after checking that it sorts after the one before.  Should
+ * one turn out not to, the pages written so far are thrown away, and the
+ * caller builds the index again the usual way.
+ *
  * Portions Copyright (c) 1996-2012, PostgreSQL Global Development Group
  * Portions Copyright (c) 1994, Regents of the University of California
  *
@@ -66,7 +74,9 @@
 
 #include "postgres.h"
 
+#include "access/genam.h"
 #include "access/nbtree.h"
+#include "catalog/storage.h"
 #include "miscadmin.h"
 #include "storage/smgr.h"
 #include "tcop/tcopprot.h"
@@ -74,16 +84,27 @@
 #include "utils/tuplesort.h"
 
 
+/* GUC-like hint from the caller: is the heap in index order? */
+bool		bt_build_presorted = false;
+
 /*
  * Status record for spooling/sorting phase.  (Note we may have two of
  * these due to the special requirements for uniqueness-checking with
- * dead tuples.)
+ * dead tuples.)  A spool for presorted input has no sortstate; its
+ * tuples are loaded into the leaf pages as they come.
  */
 struct BTSpool
 {
 	Tuplesortstate *sortstate;	/* state data for tuplesort.c */
 	Relation	index;
 	bool		isunique;
+
+	struct BTWriteState *wstate;	/* writing state for presorted input */
+	struct BTPageState *pagestate;	/* leaf level being loaded */
+	ScanKey		indexScanKey;	/* for checking the order */
+	IndexTuple	lasttup;		/* copy of the last tuple loaded */
+	Size		lastsize;		/* space allocated for lasttup */
+	bool		inorder;		/* has every tuple come in order? */
 };
 
 /*
@@ -133,6 +154,10 @@ static void _bt_buildadd(BTWriteState *wstate, BTPageState *state,
 static void _bt_uppershutdown(BTWriteState *wstate, BTPageState *state);
 static void _bt_load(BTWriteState *wstate,
 		 BTSpool *btspool, BTSpool *btspool2);
+static void _bt_initwstate(BTWriteState *wstate, Relation index);
+static int32 _bt_keycompare(ScanKey indexScanKey, TupleDesc tupdes, int keysz,
+			   IndexTuple itup, IndexTuple itup2, bool *hasnull);
+static void _bt_presortadd(IndexTuple itup, BTSpool *btspool);
 
 
 /*
@@ -167,23 +192,83 @@ _bt_spoolinit(Relation index, bool isunique, bool isdead)
 	return btspool;
 }
 
+/*
+ * create and initialize a spool structure for input that's expected to
+ * come in index order, which is loaded as it's spooled.
+ */
+BTSpool *
+_bt_presortinit(Relation index, bool isunique)
+{
+	BTSpool    *btspool = (BTSpool *) palloc0(sizeof(BTSpool));
+
+	btspool->index = index;
+	btspool->isunique = isunique;
+	btspool->wstate = (BTWriteState *) palloc(sizeof(BTWriteState));
+	_bt_initwstate(btspool->wstate, index);
+	btspool->indexScanKey = _bt_mkscankey_nodata(index);
+	btspool->inorder = true;
+
+	return btspool;
+}
+
 /*
  * clean up a spool structure and its substructures.
  */
 void
 _bt_spooldestroy(BTSpool *btspool)
 {
-	tuplesort_end(btspool->sortstate);
+	if (btspool->sortstate)
+		tuplesort_end(btspool->sortstate);
+	if (btspool->indexScanKey)
+		_bt_freeskey(btspool->indexScanKey);
+	if (btspool->lasttup)
+		pfree(btspool->lasttup);
+	if (btspool->wstate)
+		pfree(btspool->wstate);
 	pfree(btspool);
 }
 
 /*
- * spool an index entry into the sort file.
+ * spool an index entry into the sort file, or straight into the index
+ * if the input is presorted.
  */
 void
 _bt_spool(IndexTuple itup, BTSpool *btspool)
 {
-	tuplesort_putindextuple(btspool->sortstate, itup);
+	if (btspool->sortstate)
+		tuplesort_putindextuple(btspool->sortstate, itup);
+	else
+		_bt_presortadd(itup, btspool);
+}
+
+/*
+ * finish an index loaded from presorted input by _bt_spool.  Returns false
+ * if the input wasn't in order after all, or if the caller gives up on it,
+ * in which case the index is truncated back to nothing, ready to be built
+ * again from a sort.
+ */
+bool
+_bt_presortdone(BTSpool *btspool, bool giveup)
+{
+	BTWriteState *wstate = btspool->wstate;
+
+	if (giveup || !btspool->inorder)
+	{
+		if (wstate->btws_pages_written > 0)
+			RelationTruncate(wstate->index, 0);
+		return false;
+	}
+
+	/* Close down final pages and write the metapage */
+	_bt_uppershutdown(wstate, btspool->pagestate);
+
+	/* See _bt_load for why we sync even when WAL-logging */
+	if (RelationNeedsWAL(wstate->index))
+	{
+		RelationOpenSmgr(wstate->index);
+		smgrimmedsync(wstate->index->rd_smgr, MAIN_FORKNUM);
+	}
+	return true;
 }
 
 /*
@@ -207,26 +292,152 @@ _bt_leafbuild(BTSpool *btspool, BTSpool *btspool2)
 	if (btspool2)
 		tuplesort_performsort(btspool2->sortstate);
 
-	wstate.index = btspool->index;
+	_bt_initwstate(&wstate, btspool->index);
+	_bt_load(&wstate, btspool, btspool2);
+}
+
+
+/*
+ * Internal routines.
+ */
+
+
+/*
+ * set up the state for writing out an index.
+ */
+static void
+_bt_initwstate(BTWriteState *wstate, Relation index)
+{
+	wstate->index = index;
 
 	/*
 	 * We need to log index creation in WAL iff WAL archiving/streaming is
 	 * enabled UNLESS the index isn't WAL-logged anyway.
 	 */
-	wstate.btws_use_wal = XLogIsNeeded() && RelationNeedsWAL(wstate.index);
+	wstate->btws_use_wal = XLogIsNeeded() && RelationNeedsWAL(index);
 
 	/* reserve the metapage */
-	wstate.btws_pages_alloced = BTREE_METAPAGE + 1;
-	wstate.btws_pages_written = 0;
-	wstate.btws_zeropage = NULL;	/* until needed */
-
-	_bt_load(&wstate, btspool, btspool2);
+	wstate->btws_pages_alloced = BTREE_METAPAGE + 1;
+	wstate->btws_pages_written = 0;
+	wstate->btws_zeropage = NULL;	/* until needed */
 }
 
+/*
+ * compare the keys of two index tuples, as the finished index orders them.
+ * *hasnull is set if any key compared was null.
+ */
+static int32
+_bt_keycompare(ScanKey indexScanKey, TupleDesc tupdes, int keysz,
+			   IndexTuple itup, IndexTuple itup2, bool *hasnull)
+{
+	int			i;
+
+	for (i = 1; i <= keysz; i++)
+	{
+		ScanKey		entry;
+		Datum		attrDatum1,
+					attrDatum2;
+		bool		isNull1,
+					isNull2;
+		int32		compare;
+
+		entry = indexScanKey + i - 1;
+		attrDatum1 = index_getattr(itup, i, tupdes, &isNull1);
+		attrDatum2 = index_getattr(itup2, i, tupdes, &isNull2);
+		if (isNull1 || isNull2)
+			*hasnull = true;
+		if (isNull1)
+		{
+			if (isNull2)
+				compare = 0;		/* NULL "=" NULL */
+			else if (entry->sk_flags & SK_BT_NULLS_FIRST)
+				compare = -1;		/* NULL "<" NOT_NULL */
+			else
+				compare = 1;		/* NULL ">" NOT_NULL */
+		}
+		else if (isNull2)
+		{
+			if (entry->sk_flags & SK_BT_NULLS_FIRST)
+				compare = 1;		/* NOT_NULL ">" NULL */
+			else
+				compare = -1;		/* NOT_NULL "<" NULL */
+		}
+		else
+		{
+			compare =
+				DatumGetInt32(FunctionCall2Coll(&entry->sk_func,
+												entry->sk_collation,
+												attrDatum1,
+												attrDatum2));
+
+			if (entry->sk_flags & SK_BT_DESC)
+				compare = -compare;
+		}
+		if (compare != 0)
+			return compare;
+	}
+	return 0;
+}
 
 /*
- * Internal routines.
+ * load one tuple of presorted input into the leaf level, checking that
+ * it sorts after the last, and that it isn't a duplicate if it mustn't
+ * be.  Once a tuple comes out of order, we ignore the rest.
  */
+static void
+_bt_presortadd(IndexTuple itup, BTSpool *btspool)
+{
+	TupleDesc	tupdes = RelationGetDescr(btspool->index);
+	int			keysz = RelationGetNumberOfAttributes(btspool->index);
+	Size		itupsz = IndexTupleSize(itup);
+
+	if (!btspool->inorder)
+		return;
+
+	if (btspool->lasttup != NULL)
+	{
+		bool		hasnull = false;
+		int32		compare;
+
+		compare = _bt_keycompare(btspool->indexScanKey, tupdes, keysz,
+								 btspool->lasttup, itup, &hasnull);
+		if (compare > 0)
+		{
+			btspool->inorder = false;
+			return;
+		}
+		if (compare == 0 && btspool->isunique && !hasnull)
+		{
+			Datum		values[INDEX_MAX_KEYS];
+			bool		isnull[INDEX_MAX_KEYS];
+
+			index_deform_tuple(itup, tupdes, values, isnull);
+			ereport(ERROR,
+					(errcode(ERRCODE_UNIQUE_VIOLATION),
+					 errmsg("could not create unique index \"%s\"",
+							RelationGetRelationName(btspool->index)),
+					 errdetail("Key %s is duplicated.",
+							   BuildIndexValueDescription(btspool->index,
+														  values, isnull))));
+		}
+	}
+
+	/* Keep a copy, since the caller frees the tuple */
+	if (itupsz > btspool->lastsize)
+	{
+		if (btspool->lasttup)
+			pfree(btspool->lasttup);
+		btspool->lasttup = (IndexTuple) palloc(itupsz);
+		btspool->lastsize = itupsz;
+	}
+	memcpy(btspool->lasttup, itup, itupsz);
+
+	/* When we see first tuple, create first index page */
+	if (btspool->pagestate == NULL)
+		btspool->pagestate = _bt_pagestate(btspool->wstate, 0);
+
+	_bt_buildadd(btspool->wstate, btspool->pagestate, itup);
+}
 
 
 /*
@@ -677,8 +888,7 @@ _bt_load(BTWriteState *wstate, BTSpool *btspool, BTSpool *btspool2)
 				should_free2,
 				load1;
 	TupleDesc	tupdes = RelationGetDescr(wstate->index);
-	int			i,
-				keysz = RelationGetNumberOfAttributes(wstate->index);
+	int			keysz = RelationGetNumberOfAttributes(wstate->index);
 	ScanKey		indexScanKey = NULL;
 
 	if (merge)
@@ -705,53 +915,11 @@ _bt_load(BTWriteState *wstate, BTSpool *btspool, BTSpool *btspool2)
 			}
 			else if (itup != NULL)
 			{
-				for (i = 1; i <= keysz; i++)
-				{
-					ScanKey		entry;
-					Datum		attrDatum1,
-								attrDatum2;
-					bool		isNull1,
-								isNull2;
-					int32		compare;
-
-					entry = indexScanKey + i - 1;
-					attrDatum1 = index_getattr(itup, i, tupdes, &isNull1);
-					attrDatum2 = index_getattr(itup2, i, tupdes, &isNull2);
-					if (isNull1)
-					{
-						if (isNull2)
-							compare = 0;		/* NULL "=" NULL */
-						else if (entry->sk_flags & SK_BT_NULLS_FIRST)
-							compare = -1;		/* NULL "<" NOT_NULL */
-						else
-							compare = 1;		/* NULL ">" NOT_NULL */
-					}
-					else if (isNull2)
-					{
-						if (entry->sk_flags & SK_BT_NULLS_FIRST)
-							compare = 1;		/* NOT_NULL ">" NULL */
-						else
-							compare = -1;		/* NOT_NULL "<" NULL */
-					}
-					else
-					{
-						compare =
-							DatumGetInt32(FunctionCall2Coll(&entry->sk_func,
-														 entry->sk_collation,
-															attrDatum1,
-															attrDatum2));
-
-						if (entry->sk_flags & SK_BT_DESC)
-							compare = -compare;
-					}
-					if (compare > 0)
-					{
-						load1 = false;
-						break;
-					}
-					else if (compare < 0)
-						break;
-				}
+				bool		hasnull = false;
+
+				if (_bt_keycompare(indexScanKey, tupdes, keysz,
+								   itup, itup2, &hasnull) > 0)
+					load1 = false;
 			}
 			else
 				load1 = false;
@@ -22,6 +22,7 @@
 #include "commands/sequence.h"
 #include "commands/tablespace.h"
 #include "storage/standby.h"
+#include "utils/recathonxlog.h"
 #include "utils/relmapper.h"
 
 
@@ -42,5 +43,6 @@ const RmgrData RmgrTable[RM_MAX_ID + 1] = {
 	{"Gin", gin_redo, gin_desc, gin_xlog_startup, gin_xlog_cleanup, gin_safe_restartpoint},
 	{"Gist", gist_redo, gist_desc, gist_xlog_startup, gist_xlog_cleanup, NULL},
 	{"Sequence", seq_redo, seq_desc, NULL, NULL, NULL},
-	{"SPGist", spg_redo, spg_desc, spg_xlog_startup, spg_xlog_cleanup, NULL}
+	{"SPGist", spg_redo, spg_desc, spg_xlog_startup, spg_xlog_cleanup, NULL},
+	{"Recathon", recathon_redo, recathon_desc, NULL, NULL, NULL}
 };
@@ -2373,6 +2373,7 @@ AbortTransaction(void)
 		AtEOXact_HashTables(false);
 		AtEOXact_PgStat(false);
 		pgstat_report_xact_timestamp(0);
+		pgstat_progress_end();
 	}
 
 	/*
@@ -632,6 +632,46 @@ CREATE VIEW pg_stat_user_functions AS
     WHERE P.prolang != 12  -- fast check to eliminate built-in functions
           AND pg_stat_get_function_calls(P.oid) IS NOT NULL;
 
+CREATE VIEW pg_stat_recommenders AS
+    SELECT
+            S.recname,
+            S.queries,
+            S.predictions,
+            S.internal_queries,
+            S.avg_latency,
+            S.max_latency,
+            S.rebuilds,
+            S.last_rebuild,
+            S.last_rebuild_duration,
+            S.events_since_rebuild,
+            S.disk_size,
+            S.memory_size
+    FROM pg_stat_get_recommenders() AS S;
+
+CREATE VIEW pg_stat_progress_recommender AS
+    SELECT
+            S.pid,
+            S.recname,
+            S.phase,
+            S.done,
+            S.total,
+            S.build_start,
+            S.phase_start,
+            S.phase_eta
+    FROM pg_stat_get_recommender_progress() AS S;
+
+CREATE VIEW pg_stat_recommender_latency AS
+    SELECT
+            S.recname,
+            S.phase,
+            S.count,
+            S.mean,
+            S.p50,
+            S.p90,
+            S.p99,
+            S.p999
+    FROM pg_stat_get_recommender_latency() AS S;
+
 CREATE VIEW pg_stat_xact_user_functions AS
     SELECT
             P.oid AS funcid,
@@ -43,6 +43,7 @@
 #include "utils/builtins.h"
 #include "utils/lsyscache.h"
 #include "utils/memutils.h"
+#include "utils/recathon.h"
 #include "utils/rel.h"
 #include "utils/snapmgr.h"
 
@@ -2061,6 +2062,17 @@ CopyFrom(CopyState cstate)
 			if (cstate->rel->rd_att->constr)
 				ExecConstraints(resultRelInfo, slot, estate);
 
+			/*************************************************************
+			 * ADDED CONTENT FOR RECATHON
+			 *************************************************************/
+
+			/* Note whose recommendations the new event changes. */
+			recordEventUser(cstate->rel, tuple);
+
+			/*************************************************************
+			 * END CONTENT FOR RECATHON
+			 *************************************************************/
+
 			if (useHeapMultiInsert)
 			{
 				/* Add this tuple to the tuple buffer */
@@ -2126,6 +2138,18 @@ CopyFrom(CopyState cstate)
 	/* Execute AFTER STATEMENT insertion triggers */
 	ExecASInsertTriggers(estate, resultRelInfo);
 
+	/*************************************************************
+	 * ADDED CONTENT FOR RECATHON
+	 *************************************************************/
+
+	/* Let the recommenders know about the new events. */
+	if (processed > 0)
+		updateCellCounter(RelationGetRelationName(cstate->rel));
+
+	/*************************************************************
+	 * END CONTENT FOR RECATHON
+	 *************************************************************/
+
 	/* Handle queued AFTER triggers */
 	AfterTriggerEndQuery(estate);
 
@@ -28,6 +28,7 @@
 #include "utils/builtins.h"
 #include "utils/json.h"
 #include "utils/lsyscache.h"
+#include "utils/recathon.h"
 #include "utils/rel.h"
 #include "utils/snapmgr.h"
 #include "utils/tuplesort.h"
@@ -81,6 +82,10 @@ static void show_hash_info(HashState *hashstate, ExplainState *es);
 static void show_instrumentation_count(const char *qlabel, int which,
 						   PlanState *planstate, ExplainState *es);
 static void show_foreignscan_info(ForeignScanState *fsstate, ExplainState *es);
+static void show_recscan_info(RecScanState *recstate, ExplainState *es);
+static void show_recscan_ensemble(RecScan *plan, ExplainState *es);
+static void show_recscan_candidates(RecScan *plan, ExplainState *es);
+static void show_recscan_model(RecScan *plan, ExplainState *es);
 static const char *explain_get_index_name(Oid indexId);
 static void ExplainIndexScanDetails(Oid indexid, ScanDirection indexorderdir,
 						ExplainState *es);
@@ -794,6 +799,18 @@ ExplainNode(PlanState *planstate, List *ancestors,
 						strategy = "Recommend ???";
 						break;
 				}
+
+				/* The executor may answer from the RecView, the
+				 * result cache, or other nodes, instead. */
+				if (IsA(planstate, RecScanState) &&
+					((RecScanState *) planstate)->useRecView)
+					strategy = "IndexRecommend";
+				else if (IsA(planstate, RecScanState) &&
+					((RecScanState *) planstate)->useResultCache)
+					strategy = "CachedRecommend";
+				else if (IsA(planstate, RecScanState) &&
+					((RecScanState *) planstate)->useShards)
+					strategy = "ShardedRecommend";
 			}
 			break;
 		case T_Material:
@@ -1161,6 +1178,19 @@ ExplainNode(PlanState *planstate, List *ancestors,
 			if (plan->qual)
 				show_instrumentation_count("Rows Removed by Filter", 1,
 										   planstate, es);
+			if (IsA(plan, RecScan) && ((RecScan *) plan)->topK > 0)
+				ExplainPropertyInteger("Top-K", ((RecScan *) plan)->topK, es);
+			if (IsA(plan, RecScan))
+			{
+				show_recscan_ensemble((RecScan *) plan, es);
+				show_recscan_candidates((RecScan *) plan, es);
+				show_recscan_model((RecScan *) plan, es);
+			}
+			if (IsA(planstate, RecScanState) &&
+				((RecScanState *) planstate)->excludeRated)
+				ExplainPropertyText("Rated Items", "excluded", es);
+			if (IsA(planstate, RecScanState))
+				show_recscan_info((RecScanState *) planstate, es);
 			break;
 		case T_FunctionScan:
 			if (es->verbose)
@@ -1672,6 +1702,147 @@ show_sort_info(SortState *sortstate, ExplainState *es)
 	}
 }
 
+/*
+ * Show the methods an ensemble RecScan blends, and their weights.
+ */
+static void
+show_recscan_ensemble(RecScan *plan, ExplainState *es)
+{
+	AttributeInfo *attributes;
+	StringInfoData str;
+	ListCell   *lc;
+
+	attributes = ((RecommendInfo *) plan->recommender)->attributes;
+	if (attributes->ensemble == NIL)
+		return;
+
+	initStringInfo(&str);
+	appendStringInfo(&str, "%s %g",
+					 recMethodName((recMethod) attributes->method),
+					 attributes->weight);
+	foreach(lc, attributes->ensemble)
+	{
+		AttributeInfo *member = (AttributeInfo *) lfirst(lc);
+
+		appendStringInfo(&str, ", %s %g",
+						 recMethodName((recMethod) member->method),
+						 member->weight);
+	}
+	ExplainPropertyText("Ensemble", str.data, es);
+	pfree(str.data);
+}
+
+/*
+ * Show the method that picks the items a RecScan scores, and how many.
+ */
+static void
+show_recscan_candidates(RecScan *plan, ExplainState *es)
+{
+	AttributeInfo *attributes;
+	char		buf[NAMEDATALEN + 32];
+
+	attributes = ((RecommendInfo *) plan->recommender)->attributes;
+	if (!attributes->candidates)
+		return;
+
+	snprintf(buf, sizeof(buf), "%s (limit %d)",
+			 recMethodName((recMethod) attributes->candidates->method),
+			 attributes->candidateLimit);
+	ExplainPropertyText("Candidates", buf, es);
+}
+
+/*
+ * Show whether the planner chose a RecScan's built model or generating
+ * it on the fly, and what it thought each would cost.
+ */
+static void
+show_recscan_model(RecScan *plan, ExplainState *es)
+{
+	AttributeInfo *attributes;
+	bool		generated;
+	char		buf[128];
+
+	attributes = ((RecommendInfo *) plan->recommender)->attributes;
+	if (attributes->modelCost <= 0 && attributes->generateCost <= 0)
+		return;
+
+	generated = (attributes->opType == OP_GENERATE ||
+				 attributes->opType == OP_GENERATEJOIN);
+	if (es->format == EXPLAIN_FORMAT_TEXT)
+	{
+		snprintf(buf, sizeof(buf), "%s (cost %.2f, %s %.2f)",
+				 generated ? "on the fly" : "built",
+				 generated ? attributes->generateCost : attributes->modelCost,
+				 generated ? "built" : "on the fly",
+				 generated ? attributes->modelCost : attributes->generateCost);
+		ExplainPropertyText("Model", buf, es);
+	}
+	else
+	{
+		ExplainPropertyText("Model", generated ? "on the fly" : "built", es);
+		ExplainPropertyFloat("Built Model Cost", attributes->modelCost, 2, es);
+		ExplainPropertyFloat("Generated Model Cost", attributes->generateCost,
+							 2, es);
+	}
+}
+
+/*
+ * Show where a RECOMMEND spent its time and memory, for EXPLAIN ANALYZE.
+ */
+static void
+show_recscan_info(RecScanState *recstate, ExplainState *es)
+{
+	double		init_ms;
+	double		prep_ms;
+	double		score_ms;
+	long		spaceUsed;
+
+	if (!es->analyze || !recstate->initialized)
+		return;
+
+	init_ms = 1000.0 * INSTR_TIME_GET_DOUBLE(recstate->initTime);
+	prep_ms = 1000.0 * INSTR_TIME_GET_DOUBLE(recstate->prepTime);
+	score_ms = 1000.0 * INSTR_TIME_GET_DOUBLE(recstate->scoreTime);
+	spaceUsed = (recstate->peakSpace + 1023) / 1024;
+
+	if (es->format == EXPLAIN_FORMAT_TEXT)
+	{
+		if (es->timing)
+		{
+			appendStringInfoSpaces(es->str, es->indent * 2);
+			appendStringInfo(es->str,
+							 "Recommender Time: init=%.3f prep=%.3f score=%.3f\n",
+							 init_ms, prep_ms, score_ms);
+		}
+		appendStringInfoSpaces(es->str, es->indent * 2);
+		appendStringInfo(es->str,
+						 "Recommender Work: users=%ld items=%ld queries=%ld  Memory: %ldkB\n",
+						 recstate->usersScored, recstate->itemsScored,
+						 recstate->internalQueries, spaceUsed);
+		if (recstate->timedOut)
+		{
+			appendStringInfoSpaces(es->str, es->indent * 2);
+			appendStringInfoString(es->str,
+								   "Partial Result: time budget used up\n");
+		}
+	}
+	else
+	{
+		if (es->timing)
+		{
+			ExplainPropertyFloat("Recommender Init Time", init_ms, 3, es);
+			ExplainPropertyFloat("Recommender Prep Time", prep_ms, 3, es);
+			ExplainPropertyFloat("Recommender Score Time", score_ms, 3, es);
+		}
+		ExplainPropertyLong("Users Scored", recstate->usersScored, es);
+		ExplainPropertyLong("Items Scored", recstate->itemsScored, es);
+		ExplainPropertyLong("Internal Queries", recstate->internalQueries, es);
+		ExplainPropertyLong("Recommender Memory", spaceUsed, es);
+		ExplainPropertyText("Partial Result",
+							recstate->timedOut ? "true" : "false", es);
+	}
+}
+
 /*
  * Show information on hash buckets/batches.
  */
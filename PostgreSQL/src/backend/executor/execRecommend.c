@@ -19,16 +19,35 @@
  */
 #include "postgres.h"
 
+#include "access/nbtree.h"
+#include "access/sysattr.h"
+#include "access/xact.h"
+#include "catalog/pg_opfamily.h"
 #include "catalog/pg_type.h"
 #include "executor/executor.h"
 #include "executor/execRecommend.h"
 #include "executor/nodeSeqscan.h"
+#include "libpq/pqsignal.h"
 #include "miscadmin.h"
 #include "nodes/parsenodes.h"
+#include "optimizer/var.h"
+#include "pg_trace.h"
+#include "pgstat.h"
+#include "tcop/tcopprot.h"
+#include "utils/array.h"
 #include "utils/builtins.h"
+#include "utils/lsyscache.h"
 #include "utils/memutils.h"
 #include "utils/recathon.h"
+#include "utils/recathonbuilds.h"
+#include "utils/recathoncache.h"
+#include "utils/recathonlatency.h"
+#include "utils/recathonresults.h"
+#include "utils/rel.h"
+#include <math.h>
 #include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
 #include <sys/socket.h>
 #include <sys/wait.h>
 #include <unistd.h>
@@ -36,71 +55,221 @@
 #define DEBUG 0
 #define VERBOSE 0
 
+/* What the trace probes call a recommender: its index table, or the
+ * events table when there's no model. */
+#define recTraceName(attributes) \
+	((attributes)->recIndexName ? (attributes)->recIndexName : (attributes)->eventtable)
+
+/*
+ * When a query wants recommendations for every user, the users can be
+ * shared out among worker processes forked from the backend, each of
+ * which gets a copy-on-write image of the model we've loaded. They
+ * send their predictions back to us through pipes, one record each,
+ * and we apply the quals and pass them up the plan. A worker can't
+ * run queries, so any user it could only prepare with one is sent back
+ * to be prepared and scored by the backend itself.
+ */
+typedef struct rec_record
+{
+	int32		kind;			/* REC_RECORD_SCORE or REC_RECORD_DEFER */
+	int32		userID;
+	int32		itemID;			/* or the user's index, to defer them */
+	float4		score;
+} rec_record;
+
+#define REC_RECORD_SCORE	0
+#define REC_RECORD_DEFER	1
+
+/* How many records we read from a worker at a time. */
+#define REC_WORKER_RECORDS	1024
+
+/* The fewest of a user's items worth a worker of their own. */
+#define REC_WORKER_MIN_ITEMS	(16 * RECATHON_SCORE_BATCH)
+
+typedef struct rec_worker
+{
+	pid_t		pid;			/* the process, or 0 once reaped */
+	int			fd;				/* the read end of its pipe, or -1 */
+	int			lastUser;		/* the user it last sent a score for */
+	int			start;			/* the first unreturned byte in buf */
+	int			len;			/* the bytes in buf */
+	char		buf[REC_WORKER_RECORDS * sizeof(rec_record)];
+} rec_worker;
+
+typedef struct rec_workers_t
+{
+	int			numWorkers;
+	rec_worker *workers;
+	int			nextWorker;		/* the worker we look to first */
+	int			deferItemNum;	/* the next item for a user we're scoring
+								 * ourselves, or -1 */
+	struct rec_workers_t *next;	/* in the list of running sets */
+} rec_workers_t;
+
+/* Every set of workers still running, so aborts can stop them. */
+static rec_workers_t *recathon_worker_sets = NULL;
+static bool recathon_worker_callback_registered = false;
+
 static TupleTableSlot* ExecIndexRecommend(RecScanState *recnode,
 					 ExecScanAccessMtd accessMtd,
 					 ExecScanRecheckMtd recheckMtd);
 static TupleTableSlot* ExecFilterRecommend(RecScanState *recnode,
 					 ExecScanAccessMtd accessMtd,
 					 ExecScanRecheckMtd recheckMtd);
+static TupleTableSlot* ExecTopKRecommend(RecScanState *recnode,
+					 ExecScanAccessMtd accessMtd,
+					 ExecScanRecheckMtd recheckMtd);
 static void InitializeRecommender(RecScanState *recstate);
+static void InitializeEnsemble(RecScanState *recstate);
+static void InitializeCandidates(RecScanState *recstate);
+static void InitializeRecView(RecScanState *recstate);
+static void InitializeResultCache(RecScanState *recstate);
+static void InitializeShards(RecScanState *recstate);
+static bool qualUsesOnly(RecScanState *recstate, RecScan *node, bool allowScore);
+static void recSplitQuals(RecScanState *recstate, RecScan *node);
+static bool recTakeQual(RecScanState *recstate, Expr *expr, Index varno,
+			AttrNumber itemattno, AttrNumber scoreattno);
+static void InitializeItemQuals(RecScanState *recstate);
+static bool recItemPasses(RecScanState *recnode, int itemindex);
+static bool recScorePasses(RecScanState *recnode, TupleTableSlot *slot);
+static bool recViewCovers(RecScanState *recstate, RecScan *node);
+static bool shardsCover(RecScanState *recstate, RecScan *node);
+static List *bindUserParams(List *paramList, ParamListInfo params);
+static List *arrayUserIDs(ArrayType *array);
+static void resultCacheLookup(RecScanState *recstate, RecScan *node);
+static void storeTopKResults(RecScanState *recnode);
+static bool topKAccepts(RecScanState *recnode, float score);
+static void topKInsert(RecScanState *recnode, TupleTableSlot *slot,
+			 int item, float score);
+static void topKOfferBatch(RecScanState *recnode, const int *itemindexes,
+			 const float *scores, int n);
+static void recNextItem(RecScanState *recnode);
+static void recInstrStart(RecScanState *recnode, instr_time *starttime,
+			  MemoryContext *oldcontext);
+static void recInstrStop(RecScanState *recnode, instr_time *starttime,
+			 instr_time *total, MemoryContext oldcontext);
+static void recScoreItem(RecScanState *recnode, TupleTableSlot *slot,
+			 int itemID, int itemindex);
+static bool recSkipsRated(RecScanState *recnode, int itemindex);
+static void recScoreBatch(RecScanState *recnode, int pos);
+static int	recBeatenItems(RecScanState *recnode, int pos);
+static void recScoreAt(RecScanState *recnode, TupleTableSlot *slot,
+			 int pos, int itemID, int itemindex);
+static TupleTableSlot *recProjectTuple(RecScanState *recnode,
+			 TupleTableSlot *slot);
+static bool recParallelEligible(RecScanState *recnode);
+static void recStartWorkers(RecScanState *recnode, ExprContext *econtext,
+			 TupleTableSlot *slot);
+static bool recItemParallelEligible(RecScanState *recnode);
+static void recStartItemWorkers(RecScanState *recnode, ExprContext *econtext,
+			 TupleTableSlot *slot);
+static void recForkWorkers(RecScanState *recnode, TupleTableSlot *slot,
+			 int *users, int numUsers, int numWorkers, bool keepBest);
+static void recWorkerRun(RecScanState *recnode, TupleTableSlot *slot,
+			 int *users, int numUsers, int worker, int numWorkers, int fd);
+static void recItemWorkerRun(RecScanState *recnode, int worker, int numWorkers,
+			 bool keepBest, int fd);
+static bool recWorkersNext(RecScanState *recnode, TupleTableSlot *slot);
+static void recStopWorkers(RecScanState *recnode);
+static void recWorkersRelease(rec_workers_t *ws);
+static void recWorkersAtEOXact(XactEvent event, void *arg);
 
 /*
- * ExecRecFetch -- fetch next potential tuple
- *
- * This routine is concerned with substituting a test tuple if we are
- * inside an EvalPlanQual recheck.	If we aren't, just execute
- * the access method's next-tuple routine.
+ * ExecRecSlot
  *
- * This method is identical to ExecScanFetch, we just want to avoid
- * possible duplicate function issues.
+ * Returns the slot we build all of our tuples in, making it the
+ * first time through.
  */
-static inline TupleTableSlot *
-ExecRecFetch(ScanState *node,
-			  ExecScanAccessMtd accessMtd,
-			  ExecScanRecheckMtd recheckMtd)
+static TupleTableSlot*
+ExecRecSlot(RecScanState *recnode)
 {
-	EState	   *estate = node->ps.state;
+	TupleTableSlot *slot;
+	AttributeInfo *attributes;
+	TupleDesc	tupdesc;
+	Plan	   *plan;
+	List	   *exprs;
+	int natts, i;
 
-	if (estate->es_epqTuple != NULL)
-	{
-		/*
-		 * We are inside an EvalPlanQual recheck.  Return the test tuple if
-		 * one is available, after rechecking any access-method-specific
-		 * conditions.
-		 */
-		Index		scanrelid = ((Scan *) node->ps.plan)->scanrelid;
+	attributes = (AttributeInfo*) recnode->attributes;
 
-		Assert(scanrelid > 0);
-		if (estate->es_epqTupleSet[scanrelid - 1])
-		{
-			TupleTableSlot *slot = node->ss_ScanTupleSlot;
+	/* All we need from the events table is its tuple descriptor,
+	 * which the subscan's slot already has from the relation, so
+	 * we never read a tuple of it. We can use this tuple descriptor
+	 * to make as many new tuples as we want. */
+	if (recnode->base_slot == NULL)
+		recnode->base_slot = CreateTupleDescCopy(
+			recnode->subscan->ss_ScanTupleSlot->tts_tupleDescriptor);
+	tupdesc = recnode->base_slot;
+	natts = tupdesc->natts;
+
+	/* While we're here, record what tuple attributes
+	 * correspond to our key columns. This will save
+	 * us unnecessary strcmp functions. */
+	if (recnode->useratt < 0) {
+		for (i = 0; i < natts; i++) {
+			char* col_name = tupdesc->attrs[i]->attname.data;
+
+			if (strcmp(col_name,attributes->userkey) == 0)
+				recnode->useratt = i;
+			else if (strcmp(col_name,attributes->itemkey) == 0)
+				recnode->itematt = i;
+			else if (strcmp(col_name,attributes->eventval) == 0)
+				recnode->eventatt = i;
+		}
+	}
 
-			/* Return empty slot if we already returned a tuple */
-			if (estate->es_epqScanDone[scanrelid - 1])
-				return ExecClearTuple(slot);
-			/* Else mark to remember that we shouldn't return more */
-			estate->es_epqScanDone[scanrelid - 1] = true;
+	/* We build every tuple in the same slot. Each tuple overwrites
+	 * the user, item and event values, and the rest never change,
+	 * so we only need to set them once. */
+	if (recnode->recSlot == NULL) {
+		plan = recnode->ss.ps.plan;
+		slot = MakeSingleTupleTableSlot(tupdesc);
+		exprs = list_make2(plan->targetlist, plan->qual);
+		ExecRecBlankSlot(recnode, slot, (Node *) exprs,
+						 ((Scan *) plan)->scanrelid);
+		list_free(exprs);
+		recnode->recSlot = slot;
+	}
+	slot = recnode->recSlot;
 
-			/* Return empty slot if we haven't got a test tuple */
-			if (estate->es_epqTuple[scanrelid - 1] == NULL)
-				return ExecClearTuple(slot);
+	/* Mark all slots as usable. */
+	slot->tts_isempty = false;
+	slot->tts_nvalid = natts;
 
-			/* Store test tuple in the plan node's scan slot */
-			ExecStoreTuple(estate->es_epqTuple[scanrelid - 1],
-						   slot, InvalidBuffer, false);
+	return slot;
+}
 
-			/* Check if it meets the access-method conditions */
-			if (!(*recheckMtd) (node, slot))
-				ExecClearTuple(slot);	/* would not be returned by scan */
+/*
+ * ExecRecBlankSlot
+ *
+ * Sets up a slot for building tuples of the events table in. The
+ * columns that exprs reads through varno start out zero, and the
+ * others are null, so that a tuple made from the slot carries
+ * nothing the query doesn't look at; on a wide events table, the
+ * columns besides the user, item and event are most of it. Those
+ * three are always there, since we fill them in for every tuple.
+ */
+void
+ExecRecBlankSlot(RecScanState *recnode, TupleTableSlot *slot,
+				 Node *exprs, Index varno)
+{
+	Bitmapset  *attrs = NULL;
+	bool		wholeRow;
+	int			natts, i;
 
-			return slot;
-		}
-	}
+	pull_varattnos(exprs, varno, &attrs);
+	wholeRow = bms_is_member(0 - FirstLowInvalidHeapAttributeNumber, attrs);
 
-	/*
-	 * Run the node-type-specific access method function to get the next tuple
-	 */
-	return (*accessMtd) (node);
+	natts = slot->tts_tupleDescriptor->natts;
+	for (i = 0; i < natts; i++) {
+		bool used = wholeRow || i == recnode->useratt ||
+			i == recnode->itematt || i == recnode->eventatt ||
+			bms_is_member(i + 1 - FirstLowInvalidHeapAttributeNumber, attrs);
+
+		slot->tts_values[i] = Int32GetDatum(0);
+		slot->tts_isnull[i] = !used;
+	}
+	bms_free(attrs);
 }
 
 /* ----------------------------------------------------------------
@@ -117,9 +286,9 @@ ExecRecFetch(ScanState *node,
  *		that are implemented internal to the access method.
  *
  *		This version of the function usually will not obtain tuples from
- *		the table. Instead, we'll fetch only one tuple just so we can use
- *		its TupleDesc to create entirely new tuples, then fill them in with
- *		synthetic data.
+ *		the table. Instead, we use its TupleDesc to create entirely new
+ *		tuples, fill them in with synthetic data, and project out only
+ *		the columns the query uses.
  *
  *		Conditions:
  *		  -- the "cursor" maintained by the AMI is positioned at the tuple
@@ -135,9 +304,11 @@ ExecRecommend(RecScanState *recnode,
 		 ExecScanAccessMtd accessMtd,	/* function returning a tuple */
 		 ExecScanRecheckMtd recheckMtd)
 {
-	/* We hand the legwork off to one of two functions. */
-	if (recnode->useRecView)
+	/* We hand the legwork off to one of three functions. */
+	if (recnode->useRecView || recnode->useResultCache || recnode->useShards)
 		return ExecIndexRecommend(recnode,accessMtd,recheckMtd);
+	else if (recnode->topK > 0)
+		return ExecTopKRecommend(recnode,accessMtd,recheckMtd);
 	else
 		return ExecFilterRecommend(recnode,accessMtd,recheckMtd);
 }
@@ -145,8 +316,12 @@ ExecRecommend(RecScanState *recnode,
 /*
  * ExecIndexRecommend
  *
- * This function obtains data directly from the RecView, which we
- * assume is populated with predictions for this user.
+ * This function obtains data directly from the RecView, which holds
+ * the best few predictions for every user. For each user the query
+ * names, we read their list, best first, with a single index range
+ * scan, and stop as soon as enough of it has passed the quals; the
+ * rest of the list can only be worse. A list from the result cache,
+ * or from the nodes that serve the recommender, is read the same way.
  */
 static TupleTableSlot*
 ExecIndexRecommend(RecScanState *recnode,
@@ -194,50 +369,73 @@ ExecIndexRecommend(RecScanState *recnode,
 	ResetExprContext(econtext);
 
 	/*
-	 * get a tuple from the access method.	Loop until we obtain a tuple that
+	 * get a tuple from the RecView.	Loop until we obtain a tuple that
 	 * passes the qualification.
 	 */
 	for (;;)
 	{
 		TupleTableSlot *slot;
-		int userID;
-		bool recQual = true;
+		int userID, row;
 
 		CHECK_FOR_INTERRUPTS();
 
-		slot = recnode->ss.ps.ps_ResultTupleSlot;
-
-		/* If we're using the RecView, we're going to fetch a new
-		 * tuple every time. */
-		slot = ExecRecFetch(node, accessMtd, recheckMtd);
-
-		/* If the slot is null now, then we've run out of tuples
-		 * to return, so we're done. */
-		if (TupIsNull(slot))
-		{
-			if (projInfo)
-				return ExecClearTuple(projInfo->pi_slot);
+		/* If the view turns out not to know one of our users,
+		 * we score them all the usual way instead. */
+		if (!recnode->initialized) {
+			instr_time starttime;
+			MemoryContext oldcontext;
+
+			recInstrStart(recnode, &starttime, &oldcontext);
+			if (recnode->useResultCache)
+				InitializeResultCache(recnode);
+			else if (recnode->useShards)
+				InitializeShards(recnode);
 			else
-				return slot;
+				InitializeRecView(recnode);
+			recInstrStop(recnode, &starttime, &recnode->initTime, oldcontext);
+			if (!recnode->useRecView && !recnode->useResultCache &&
+				!recnode->useShards)
+				return ExecRecommend(recnode, accessMtd, recheckMtd);
 		}
 
-		/*
-		 * Before we check the qualifications, we're going to manually check
-		 * to see that the tuple matches the provided user ID, because this
-		 * is always necessary and it's easier than messing with the target
-		 * list.
-		 */
+		/* Move on to the next user once we're done with this one.
+		 * After the last user, we're finished, and we reset in
+		 * case we get rescanned. */
+		if (!recnode->newUser &&
+			(recnode->viewRowNum >= recnode->numViewRows ||
+			 recnode->viewReturned >= recnode->topK)) {
+			recnode->userNum++;
+			recnode->newUser = true;
+		}
+		if (recnode->newUser) {
+			if (recnode->userNum >= recnode->totalUsers) {
+				recnode->userNum = 0;
+				return NULL;
+			}
 
-		/* First, we'll make sure we're dealing with the right user. */
-		userID = getTupleInt(slot,attributes->userkey);
+			userID = recnode->userList[recnode->userNum];
+			attributes->userID = userID;
+			recnode->viewRowNum = 0;
+			if (recnode->useResultCache)
+				recnode->numViewRows = recnode->numCachedResults;
+			else if (recnode->useShards) {
+				/* Every user's predictions came at once. */
+				recnode->viewRowNum = recnode->shardStart[recnode->userNum];
+				recnode->numViewRows = recnode->shardStart[recnode->userNum+1];
+			}
+			else
+				recnode->numViewRows = loadRecViewUser(recnode, userID);
+			recnode->viewReturned = 0;
+			recnode->newUser = false;
+			continue;
+		}
 
-		/* How we could fail to find the user ID, I don't know. */
-		if (userID < 0)
-			elog(ERROR, "user ID column not found");
-		/* If this tuple doesn't match the user ID, just skip it
-		 * and move on. */
-		if (userID != attributes->userID)
-			recQual = false;
+		/* Get the slot we build our tuples in, and fill it in. */
+		slot = ExecRecSlot(recnode);
+		row = recnode->viewRowNum++;
+		slot->tts_values[recnode->useratt] = Int32GetDatum(attributes->userID);
+		slot->tts_values[recnode->itematt] = Int32GetDatum(recnode->viewItems[row]);
+		slot->tts_values[recnode->eventatt] = Float4GetDatum(recnode->viewScores[row]);
 
 		/*
 		 * place the current tuple into the expr context
@@ -250,14 +448,13 @@ ExecIndexRecommend(RecScanState *recnode,
 		 * check for non-nil qual here to avoid a function call to ExecQual()
 		 * when the qual is nil ... saves only a few cycles, but they add up
 		 * ...
-		 *
-		 * we also make sure that the tuple passes our recommender qual
 		 */
-		if (recQual && (!qual || ExecQual(qual, econtext, false)))
+		if (!qual || ExecQual(qual, econtext, false))
 		{
 			/*
 			 * Found a satisfactory scan tuple.
 			 */
+			recnode->viewReturned++;
 			if (projInfo)
 			{
 				/*
@@ -290,7 +487,6 @@ ExecIndexRecommend(RecScanState *recnode,
 		 */
 		ResetExprContext(econtext);
 	}
-
 }
 
 /*
@@ -316,9 +512,10 @@ ExecFilterRecommend(RecScanState *recnode,
 	attributes = (AttributeInfo*) recnode->attributes;
 
 	/*
-	 * Fetch data from node
+	 * Fetch data from node. Conditions on the item ID and the score
+	 * aren't left to ExecQual.
 	 */
-	qual = node->ps.qual;
+	qual = recnode->scanQual;
 	userqual = recnode->userqual;
 	projInfo = node->ps.ps_ProjInfo;
 	econtext = node->ps.ps_ExprContext;
@@ -352,7 +549,7 @@ ExecFilterRecommend(RecScanState *recnode,
 	for (;;)
 	{
 		TupleTableSlot *slot;
-		int natts, i, userID, userindex, itemID, itemindex;
+		int userID, userindex, itemID, itemindex, itempos, skipped;
 
 		CHECK_FOR_INTERRUPTS();
 
@@ -360,8 +557,14 @@ ExecFilterRecommend(RecScanState *recnode,
 
 		/* The first thing we need to do is initialize our recommender
 		 * model and other things, if we haven't done so already. */
-		if (!recnode->initialized)
+		if (!recnode->initialized) {
+			instr_time starttime;
+			MemoryContext oldcontext;
+
+			recInstrStart(recnode, &starttime, &oldcontext);
 			InitializeRecommender(recnode);
+			recInstrStop(recnode, &starttime, &recnode->initTime, oldcontext);
+		}
 
 		/*
 		 * If we've exhausted our item list, then we're totally
@@ -371,53 +574,65 @@ ExecFilterRecommend(RecScanState *recnode,
 		 * we have to do this again, though our JoinRecommend
 		 * should assure this doesn't happen.
 		 */
-		if (recnode->finished) {
+		if (recnode->finished || recnode->totalUsers <= 0) {
 			recnode->finished = false;
 			recnode->userNum = 0;
 			recnode->fullItemNum = 0;
 			return NULL;
 		}
 
-		/* We're only going to fetch one tuple and store its tuple
-		 * descriptor. We can use this tuple descriptor to make as
-		 * many new tuples as we want. */
-		if (recnode->base_slot == NULL) {
-			slot = ExecRecFetch(node, accessMtd, recheckMtd);
-			recnode->base_slot = CreateTupleDescCopy(slot->tts_tupleDescriptor);
+		/* A query for the best few with a time budget stops once
+		 * it's used up, but not before it has enough tuples to
+		 * fill the list, so as to have something to return. */
+		if (recnode->timeBudget > 0 && recnode->topKCount >= recnode->topK &&
+		    recPastBudget(recnode, RECATHON_BUDGET_ROWS)) {
+			recnode->userNum = 0;
+			recnode->fullItemNum = 0;
+			recnode->newUser = true;
+			return NULL;
 		}
 
-		/* Create a new slot to operate on. */
-		slot = MakeSingleTupleTableSlot(recnode->base_slot);
-		slot->tts_isempty = false;
+		/* Get the slot we build our tuples in. */
+		slot = ExecRecSlot(recnode);
 
 		/*
 		 * place the current tuple into the expr context
 		 */
 		econtext->ecxt_scantuple = slot;
 
-		/* Mark all slots as usable. */
-		natts = slot->tts_tupleDescriptor->natts;
-		for (i = 0; i < natts; i++) {
-			/* Mark slot. */
-			slot->tts_values[i] = Int32GetDatum(0);
-			slot->tts_isnull[i] = false;
-			slot->tts_nvalid++;
-		}
-
-		/* While we're here, record what tuple attributes
-		 * correspond to our key columns. This will save
-		 * us unnecessary strcmp functions. */
-		if (recnode->useratt < 0) {
-			for (i = 0; i < natts; i++) {
-				char* col_name = slot->tts_tupleDescriptor->attrs[i]->attname.data;
-//printf("%s\n",col_name);
-				if (strcmp(col_name,attributes->userkey) == 0)
-					recnode->useratt = i;
-				else if (strcmp(col_name,attributes->itemkey) == 0)
-					recnode->itematt = i;
-				else if (strcmp(col_name,attributes->eventval) == 0)
-					recnode->eventatt = i;
+		/*
+		 * Scoring every user can be shared out among worker processes,
+		 * and so can scoring the items of a single user. Their tuples
+		 * come to us already scored, so all we do is check the quals.
+		 */
+		if (!recnode->parallelTried) {
+			recnode->parallelTried = true;
+			if (recParallelEligible(recnode))
+				recStartWorkers(recnode, econtext, slot);
+			else if (recItemParallelEligible(recnode))
+				recStartItemWorkers(recnode, econtext, slot);
+		}
+		if (recnode->workers) {
+			if (!recWorkersNext(recnode, slot)) {
+				recStopWorkers(recnode);
+				recnode->parallelTried = false;
+				recnode->newUser = true;
+				return NULL;
+			}
+
+			if (recItemPasses(recnode, itemIndex(recnode,
+					DatumGetInt32(slot->tts_values[recnode->itematt]))) &&
+				recScorePasses(recnode, slot) &&
+				(!qual || ExecQual(qual, econtext, false))) {
+				resultSlot = recProjectTuple(recnode, slot);
+				if (resultSlot)
+					return resultSlot;
 			}
+			else
+				InstrCountFiltered1(node, 1);
+
+			ResetExprContext(econtext);
+			continue;
 		}
 
 		/*
@@ -476,16 +691,57 @@ ExecFilterRecommend(RecScanState *recnode,
 		 * data structures, or report that this user is invalid. We have
 		 * to do this here, so we can establish the item list. */
 		if (recnode->newUser) {
+			instr_time starttime;
+			MemoryContext oldcontext;
+
+			recInstrStart(recnode, &starttime, &oldcontext);
 			recnode->validUser = prepUserForRating(recnode,userID);
+			recInstrStop(recnode, &starttime, &recnode->prepTime, oldcontext);
+			if (recnode->validUser)
+				recnode->usersScored++;
 			recnode->newUser = false;
+			recnode->batchCount = 0;
 		}
 
 		/* Now replace the item ID, if the user is valid. Otherwise,
 		 * leave the item ID as is, as it doesn't matter what it is. We'll
 		 * move on to the next user, as well. */
+		/* With an approximate top-k index, we only go through the
+		 * candidate items picked for this user. */
+		if (recnode->validUser && recnode->itemCandidates &&
+				recnode->numCandidates == 0) {
+			recnode->userNum++;
+			recnode->newUser = true;
+			recnode->fullItemNum = 0;
+			if (recnode->userNum >= recnode->totalUsers)
+				recnode->finished = true;
+			continue;
+		}
 		if (recnode->validUser) {
-			itemID = recnode->fullItemList[recnode->fullItemNum];
-			itemindex = recnode->fullItemNum;
+			itempos = recnode->fullItemNum;
+			if (recnode->itemCandidates)
+				itemindex = recnode->itemCandidates[itempos];
+			else
+				itemindex = itempos;
+			itemID = recnode->fullItemList[itemindex];
+
+			/* Once the best few are held, a run of items that
+			 * can't beat them is passed over all at once. */
+			if ((skipped = recBeatenItems(recnode, itempos)) > 0) {
+				InstrCountFiltered1(node, skipped);
+				recnode->fullItemNum += skipped - 1;
+				recNextItem(recnode);
+				continue;
+			}
+
+			/* An item the user has rated already isn't scored at
+			 * all, if we're leaving those out. */
+			if (recSkipsRated(recnode, itemindex) ||
+				!recItemPasses(recnode, itemindex)) {
+				InstrCountFiltered1(node, 1);
+				recNextItem(recnode);
+				continue;
+			}
 		} else {
 			recnode->userNum++;
 			recnode->newUser = true;
@@ -514,22 +770,11 @@ ExecFilterRecommend(RecScanState *recnode,
 		 * not calculate the RecScore in this node. In the current version
 		 * of RecDB, special joins don't exist, so that's no problem. */
 		if (attributes->noFilter)
-			applyRecScore(recnode, slot, itemID, itemindex);
+			recScoreAt(recnode, slot, itempos, itemID, itemindex);
 
 		/* Move onto the next item, for next time. If we're doing a RecJoin,
 		 * though, we'll move onto the next user instead. */
-		recnode->fullItemNum++;
-		if (recnode->fullItemNum >= recnode->fullTotalItems ||
-			attributes->opType == OP_JOIN ||
-			attributes->opType == OP_GENERATEJOIN) {
-			/* If we've reached the last item, move onto the next user.
-			 * If we've reached the last user, we're done. */
-			recnode->userNum++;
-			recnode->newUser = true;
-			recnode->fullItemNum = 0;
-			if (recnode->userNum >= recnode->totalUsers)
-				recnode->finished = true;
-		}
+		recNextItem(recnode);
 
 		/*
 		 * check that the current tuple satisfies the qual-clause
@@ -538,7 +783,8 @@ ExecFilterRecommend(RecScanState *recnode,
 		 * when the qual is nil ... saves only a few cycles, but they add up
 		 * ...
 		 */
-		if (!qual || ExecQual(qual, econtext, false))
+		if (recScorePasses(recnode, slot) &&
+			(!qual || ExecQual(qual, econtext, false)))
 		{
 			/*
 			 * If this is an invalid user, then we'll skip this tuple,
@@ -547,7 +793,6 @@ ExecFilterRecommend(RecScanState *recnode,
 			if (!recnode->validUser) {
 				InstrCountFiltered1(node, 1);
 				ResetExprContext(econtext);
-				ExecDropSingleTupleTableSlot(slot);
 				continue;
 			}
 
@@ -556,31 +801,11 @@ ExecFilterRecommend(RecScanState *recnode,
 			 * we will calculate and apply the RecScore.
 			 */
 			if (!attributes->noFilter)
-				applyRecScore(recnode, slot, itemID, itemindex);
-
-			if (projInfo)
-			{
-				/*
-				 * Form a projection tuple, store it in the result tuple slot
-				 * and return it --- unless we find we can project no tuples
-				 * from this scan tuple, in which case continue scan.
-				 */
-				resultSlot = ExecProject(projInfo, &isDone);
-				if (isDone != ExprEndResult)
-				{
-					node->ps.ps_TupFromTlist = (isDone == ExprMultipleResult);
-
-					return resultSlot;
-				}
-			}
-			else
-			{
-				/*
-				 * Here, we aren't projecting, so just return scan tuple.
-				 */
+				recScoreAt(recnode, slot, itempos, itemID, itemindex);
 
-				return slot;
-			}
+			resultSlot = recProjectTuple(recnode, slot);
+			if (resultSlot)
+				return resultSlot;
 		}
 		else
 			InstrCountFiltered1(node, 1);
@@ -589,254 +814,2567 @@ ExecFilterRecommend(RecScanState *recnode,
 		 * Tuple fails qual, so free per-tuple memory and try again.
 		 */
 		ResetExprContext(econtext);
-		ExecDropSingleTupleTableSlot(slot);
 	}
 
 }
 
 /*
- * ExecReScanRecScan
+ * recNextItem
  *
- * This decides what kind of ReScan method to use. We should only be
- * considering a SeqScan; we built in a failsafe, though anything else
- * should be impossible due to how we handled the planning.
+ * Moves ExecFilterRecommend on to the current user's next item, or,
+ * once they're all done or this is a RecJoin, on to the next user.
  */
-void
-ExecReScanRecScan(RecScanState *node)
+static void
+recNextItem(RecScanState *recnode)
 {
-	switch (nodeTag(node->subscan))
-	{
-		case T_SeqScanState:
-			ExecReScanSeqScan((SeqScanState *) node->subscan);
-			break;
-
-		default:
-			elog(ERROR, "invalid RecScan subscan type: %d", (int) nodeTag(node->subscan));
-			break;
+	AttributeInfo *attributes = (AttributeInfo *) recnode->attributes;
+
+	recnode->fullItemNum++;
+	if (recnode->fullItemNum >= (recnode->itemCandidates ?
+			recnode->numCandidates : recnode->fullTotalItems) ||
+		attributes->opType == OP_JOIN ||
+		attributes->opType == OP_GENERATEJOIN) {
+		/* If we've reached the last item, move onto the next user.
+		 * If we've reached the last user, we're done. */
+		recnode->userNum++;
+		recnode->newUser = true;
+		recnode->fullItemNum = 0;
+		if (recnode->userNum >= recnode->totalUsers)
+			recnode->finished = true;
 	}
 }
 
 /*
- * ExecRecMarkPos
+ * recTimed
  *
- * This decides what kind of MarkPos method to use. We should only be
- * considering a SeqScan; we built in a failsafe, though anything else
- * should be impossible due to how we handled the planning.
+ * Are the phases of this scan timed? They are when EXPLAIN asked for
+ * it, and when the recommender's latency histograms are kept.
  */
-void
-ExecRecMarkPos(RecScanState *node)
+static bool
+recTimed(RecScanState *recnode)
 {
-	switch (nodeTag(node->subscan))
+	Instrumentation *instr = recnode->ss.ps.instrument;
+
+	return (instr && instr->need_timer) || recnode->trackLatency;
+}
+
+/*
+ * recInstrStart
+ *
+ * Starts one of the phases EXPLAIN ANALYZE reports on: setting up,
+ * preparing a user, or scoring an item. Whatever the phase keeps
+ * goes in the recommender's own memory context, so we can tell how
+ * much it takes. Timing is only done if recTimed says so.
+ */
+static void
+recInstrStart(RecScanState *recnode, instr_time *starttime,
+			  MemoryContext *oldcontext)
+{
+	if (recTimed(recnode))
+		INSTR_TIME_SET_CURRENT(*starttime);
+	*oldcontext = MemoryContextSwitchTo(recnode->recContext);
+}
+
+/*
+ * recInstrStop
+ *
+ * Ends a phase begun with recInstrStart, adding its time to 'total'.
+ */
+static void
+recInstrStop(RecScanState *recnode, instr_time *starttime,
+			 instr_time *total, MemoryContext oldcontext)
+{
+	Instrumentation *instr = recnode->ss.ps.instrument;
+
+	MemoryContextSwitchTo(oldcontext);
+	if (recTimed(recnode))
 	{
-		case T_SeqScanState:
-			ExecSeqMarkPos((SeqScanState *) node->subscan);
-			break;
+		instr_time	endtime;
 
-		default:
-			/* don't make hard error unless caller asks to restore... */
-			elog(DEBUG2, "invalid RecScan subscan type: %d", (int) nodeTag(node->subscan));
-			break;
+		INSTR_TIME_SET_CURRENT(endtime);
+		INSTR_TIME_ACCUM_DIFF(*total, endtime, *starttime);
+	}
+	if (instr)
+	{
+		Size		space = MemoryContextTotalSpace(recnode->recContext);
+
+		if (space > recnode->peakSpace)
+			recnode->peakSpace = space;
 	}
 }
 
 /*
- * ExecRecRestrPos
+ * recScoreItem
  *
- * This decides what kind of RestrPos method to use. We should only be
- * considering a SeqScan; we built in a failsafe, though anything else
- * should be impossible due to how we handled the planning.
+ * Scores one item for the current user, timing it for EXPLAIN ANALYZE.
+ * Scores go straight into the slot, so there's nothing to keep in the
+ * recommender's context, and no point measuring it every item.
  */
-void
-ExecRecRestrPos(RecScanState *node)
+static void
+recScoreItem(RecScanState *recnode, TupleTableSlot *slot,
+			 int itemID, int itemindex)
 {
-	switch (nodeTag(node->subscan))
+	recnode->itemsScored++;
+	if (recTimed(recnode))
 	{
-		case T_SeqScanState:
-			ExecSeqRestrPos((SeqScanState *) node->subscan);
-			break;
+		instr_time	starttime;
+		instr_time	endtime;
 
-		default:
-			elog(ERROR, "invalid RecScan subscan type: %d", (int) nodeTag(node->subscan));
-			break;
+		INSTR_TIME_SET_CURRENT(starttime);
+		applyRecScore(recnode, slot, itemID, itemindex);
+		INSTR_TIME_SET_CURRENT(endtime);
+		INSTR_TIME_ACCUM_DIFF(recnode->scoreTime, endtime, starttime);
 	}
+	else
+		applyRecScore(recnode, slot, itemID, itemindex);
 }
 
 /*
- * InitializeRecommender
+ * recSkipsRated
  *
- * This function will initialize the recommender information we need.
+ * Is the item at this index in fullItemList one the current user has
+ * rated, which the query is leaving out?
+ */
+static bool
+recSkipsRated(RecScanState *recnode, int itemindex)
+{
+	return recnode->excludeRated && recnode->isRated &&
+		recnode->isRated[itemindex];
+}
+
+/*
+ * recScoreBatch
+ *
+ * Scores the current user's items from position 'pos' in their list,
+ * up to RECATHON_SCORE_BATCH of them, through the method's batch
+ * scorer. Timed for EXPLAIN ANALYZE like recScoreItem. Items the
+ * query leaves out because the user has rated them aren't passed to
+ * the scorer; they stay in the batch, with a score of zero, so that
+ * positions still line up.
  */
 static void
-InitializeRecommender(RecScanState *recstate) {
-	int i;
-	AttributeInfo *attributes;
-	// Query objects.
-	char *querystring;
-	QueryDesc *queryDesc;
-	PlanState *planstate;
-	TupleTableSlot *hslot;
-	MemoryContext recathoncontext;
+recScoreBatch(RecScanState *recnode, int pos)
+{
+	bool		timed = recTimed(recnode);
+	instr_time	starttime;
+	int			numItems, n, m, i;
+
+	numItems = recnode->itemCandidates ?
+		recnode->numCandidates : recnode->fullTotalItems;
+	n = Min(numItems - pos, RECATHON_SCORE_BATCH);
+	m = 0;
+	for (i = 0; i < n; i++)
+	{
+		int			itemindex = recnode->itemCandidates ?
+			recnode->itemCandidates[pos + i] : pos + i;
 
-	attributes = (AttributeInfo*) recstate->attributes;
+		if (!recSkipsRated(recnode, itemindex))
+			recnode->batchItems[m++] = itemindex;
+	}
 
-	/* Our next step is to get the list of all users who participated in the
-	 * events table. At the least, we need to consider each one up until the
-	 * point where WHERE filters are applied. Any user IDs that survive that
-	 * filter will have structures created for recommendation. */
-	/* Note: if we're generating recommendations on-the-fly, we may not need
-	 * to do this, as this list may be created as a side effect. */
+	if (timed)
+		INSTR_TIME_SET_CURRENT(starttime);
+	if (m > 0)
+		scoreItemBatch(recnode, recnode->batchItems, m, recnode->batchScores);
+	if (timed)
+	{
+		instr_time	endtime;
 
-	querystring = (char*) palloc(1024*sizeof(char));
-	if ((attributes->opType != OP_GENERATE && attributes->opType != OP_GENERATEJOIN) ||
-	    attributes->method == itemCosCF ||
-	    attributes->method == itemPearCF) {
-		sprintf(querystring,"select count(distinct %s) from %s;",
-			attributes->userkey,attributes->eventtable);
-		queryDesc = recathon_queryStart(querystring,&recathoncontext);
-		planstate = queryDesc->planstate;
-		hslot = ExecProcNode(planstate);
-		recstate->totalUsers = getTupleInt(hslot,"count");
-		recathon_queryEnd(queryDesc,recathoncontext);
+		INSTR_TIME_SET_CURRENT(endtime);
+		INSTR_TIME_ACCUM_DIFF(recnode->scoreTime, endtime, starttime);
+	}
 
-		/* In the event that there are no user IDs, we can't do anything. */
-		if (recstate->totalUsers <= 0)
-			elog(ERROR, "no users found, cannot predict ratings");
+	/* Spread the scores back out from the end, where there's no
+	 * chance of writing over one we haven't moved yet. */
+	if (m < n)
+	{
+		int			k = m - 1;
 
-		recstate->userList = (int*) palloc(recstate->totalUsers*sizeof(int));
-		recstate->userNum = 0;
+		for (i = n - 1; i >= 0; i--)
+		{
+			recnode->batchItems[i] = recnode->itemCandidates ?
+				recnode->itemCandidates[pos + i] : pos + i;
+			if (recSkipsRated(recnode, recnode->batchItems[i]))
+				recnode->batchScores[i] = 0.0;
+			else
+				recnode->batchScores[i] = recnode->batchScores[k--];
+		}
+	}
 
-		/* Now for the actual query. */
-		sprintf(querystring,"select distinct %s from %s;",
-			attributes->userkey,attributes->eventtable);
-		queryDesc = recathon_queryStart(querystring,&recathoncontext);
-		planstate = queryDesc->planstate;
+	recnode->itemsScored += m;
+	recnode->batchStart = pos;
+	recnode->batchCount = n;
+	recnode->batchNumSurvivors = -1;
+}
 
-		i = 0;
-		for (;;) {
-			int currentUser;
+/*
+ * recBeatenItems
+ *
+ * When only the best few tuples are wanted, every item is scored a
+ * batch at a time, and the heap is full, returns how many items from
+ * position 'pos' on can't make it into the heap, and can be passed
+ * over without building their tuples. The first time it's asked about
+ * a batch, the scores that beat the worst of the heap are picked out
+ * of it; the heap only gets better after that, so the ones that
+ * weren't can't ever make it. Those that were still have to beat it
+ * when they get there.
+ */
+static int
+recBeatenItems(RecScanState *recnode, int pos)
+{
+	AttributeInfo *attributes = (AttributeInfo *) recnode->attributes;
+	int			offset;
 
-			hslot = ExecProcNode(planstate);
-			if (TupIsNull(hslot)) break;
+	if (!recnode->batchScoring || recnode->topK <= 0 ||
+		recnode->topKCount < recnode->topK || attributes->opType != OP_FILTER)
+		return 0;
 
-			currentUser = getTupleInt(hslot,attributes->userkey);
+	if (pos < recnode->batchStart ||
+		pos >= recnode->batchStart + recnode->batchCount)
+		recScoreBatch(recnode, pos);
+	if (recnode->batchNumSurvivors < 0)
+	{
+		float		worst = recnode->topKDescending ?
+			recnode->topKKeys[0] : -recnode->topKKeys[0];
 
-			recstate->userList[i] = currentUser;
-			i++;
-			if (i >= recstate->totalUsers) break;
-		}
-		recathon_queryEnd(queryDesc,recathoncontext);
+		recnode->batchNumSurvivors = selectScores(recnode->batchScores,
+			recnode->batchCount, worst, recnode->topKDescending,
+			recnode->batchSurvivors);
+		recnode->batchSurvivorNext = 0;
+	}
 
-		/* Quick error protection. */
-		recstate->totalUsers = i;
+	offset = pos - recnode->batchStart;
+	while (recnode->batchSurvivorNext < recnode->batchNumSurvivors &&
+		   recnode->batchSurvivors[recnode->batchSurvivorNext] < offset)
+		recnode->batchSurvivorNext++;
+	if (recnode->batchSurvivorNext < recnode->batchNumSurvivors)
+		return recnode->batchSurvivors[recnode->batchSurvivorNext] - offset;
+	return recnode->batchCount - offset;
+}
+
+/*
+ * recScoreAt
+ *
+ * Scores the item at position 'pos' in the current user's list. When
+ * all of a user's items are going to be scored, they're scored a batch
+ * at a time, and this just reads the score off.
+ */
+static void
+recScoreAt(RecScanState *recnode, TupleTableSlot *slot,
+		   int pos, int itemID, int itemindex)
+{
+	if (!recnode->batchScoring)
+	{
+		recScoreItem(recnode, slot, itemID, itemindex);
+		return;
+	}
+
+	if (pos < recnode->batchStart ||
+		pos >= recnode->batchStart + recnode->batchCount)
+		recScoreBatch(recnode, pos);
+	slot->tts_values[recnode->eventatt] =
+		Float4GetDatum(recnode->batchScores[pos - recnode->batchStart]);
+	slot->tts_isnull[recnode->eventatt] = false;
+}
+
+/*
+ * recProjectTuple
+ *
+ * Finishes a scored tuple that has passed the quals. If only the best
+ * few tuples are wanted, there's no point projecting one that can't
+ * make the cut. Returns NULL if there's nothing to return for it.
+ */
+static TupleTableSlot *
+recProjectTuple(RecScanState *recnode, TupleTableSlot *slot)
+{
+	ScanState  *node = recnode->subscan;
+	ProjectionInfo *projInfo = node->ps.ps_ProjInfo;
+	ExprDoneCond isDone;
+	TupleTableSlot *resultSlot;
+
+	if (recnode->topK > 0 &&
+		!topKAccepts(recnode, DatumGetFloat4(slot->tts_values[recnode->eventatt])))
+		return NULL;
+
+	/*
+	 * Here, we aren't projecting, so just return scan tuple.
+	 */
+	if (!projInfo)
+		return slot;
+
+	/*
+	 * Form a projection tuple, store it in the result tuple slot and
+	 * return it --- unless we find we can project no tuples from this
+	 * scan tuple, in which case the scan continues.
+	 */
+	resultSlot = ExecProject(projInfo, &isDone);
+	if (isDone == ExprEndResult)
+		return NULL;
+
+	node->ps.ps_TupFromTlist = (isDone == ExprMultipleResult);
+	return resultSlot;
+}
+
+/*
+ * recParallelEligible
+ *
+ * Can this scan be shared out among worker processes? Only when it's
+ * for every user, and not a RecJoin, and recathon_parallel_workers
+ * asks for it. The workers can't run queries, so the model has to be
+ * in memory: an item-based model loaded whole or built on the fly, or
+ * a user-based or factor model built on the fly or in a model file.
+ */
+static bool
+recParallelEligible(RecScanState *recnode)
+{
+	AttributeInfo *attributes = (AttributeInfo *) recnode->attributes;
+	bool		generated;
+
+	if (recathon_parallel_workers <= 1 || attributes->userIDList != NIL)
+		return false;
+	/* The workers' tuples come back interleaved. */
+	if (recnode->ordered)
+		return false;
+	/* The other methods of an ensemble, or the one picking the
+	 * candidates, would have to be checked too. */
+	if (attributes->ensemble != NIL || attributes->candidates)
+		return false;
+	if (attributes->opType == OP_JOIN || attributes->opType == OP_JOINPARTNER ||
+		attributes->opType == OP_GENERATEJOIN)
+		return false;
+	if (!recnode->userList || recnode->totalUsers < 2)
+		return false;
+
+	generated = (attributes->opType == OP_GENERATE);
+	switch ((recMethod) attributes->method)
+	{
+		case itemCosCF:
+		case itemPearCF:
+		case itemJaccardCF:
+			return recnode->itemCFmodel != NULL;
+		case userCosCF:
+		case userPearCF:
+		case SVD:
+		case ALS:
+			return generated || recnode->modelFile != NULL;
+		default:
+			return false;
+	}
+}
+
+/*
+ * recStartWorkers
+ *
+ * Forks recathon_parallel_workers processes, which between them score
+ * every user who passes the user quals; we check those here, first.
+ * Each worker takes every numWorkers'th user, which spreads the heavy
+ * ones about evenly. The CF methods read everyone's events in at once
+ * beforehand, so the workers needn't query them.
+ */
+static void
+recStartWorkers(RecScanState *recnode, ExprContext *econtext,
+				TupleTableSlot *slot)
+{
+	AttributeInfo *attributes = (AttributeInfo *) recnode->attributes;
+	ScanState  *node = recnode->subscan;
+	int		   *users;
+	int			numUsers = 0;
+	int			numWorkers;
+	int			i;
+
+	users = (int *) palloc(recnode->totalUsers * sizeof(int));
+	for (i = 0; i < recnode->totalUsers; i++)
+	{
+		slot->tts_values[recnode->useratt] = Int32GetDatum(recnode->userList[i]);
+		slot->tts_values[recnode->itematt] = Int32GetDatum(-1);
+		slot->tts_values[recnode->eventatt] = Int32GetDatum(-1);
+		if (!recnode->userqual || ExecQual(recnode->userqual, econtext, false))
+			users[numUsers++] = i;
+		else
+			InstrCountFiltered1(node, recnode->fullTotalItems);
+		ResetExprContext(econtext);
+	}
+
+	numWorkers = Min(recathon_parallel_workers, numUsers);
+	if (numWorkers <= 1)
+	{
+		pfree(users);
+		return;
+	}
+
+	/* Workers can't look up what each user has rated, so they
+	 * need everyone's events to hand, for leaving those items out
+	 * as well as for scoring with the neighborhood methods. */
+	if (!recnode->userEvents &&
+		(recnode->excludeRated ||
+		 attributes->method == itemCosCF || attributes->method == itemPearCF ||
+		 attributes->method == itemJaccardCF ||
+		 attributes->method == userCosCF || attributes->method == userPearCF))
+	{
+		instr_time	starttime;
+		MemoryContext oldcontext;
+
+		recInstrStart(recnode, &starttime, &oldcontext);
+		loadUserEvents(recnode);
+		recInstrStop(recnode, &starttime, &recnode->initTime, oldcontext);
+	}
+
+	recForkWorkers(recnode, slot, users, numUsers, numWorkers, false);
+	pfree(users);
+}
+
+/*
+ * recItemParallelEligible
+ *
+ * Can the items of a query's one user be shared out among worker
+ * processes instead? Only when recathon_parallel_workers asks for it,
+ * and not for a RecJoin, an ensemble or a query with CANDIDATES FROM,
+ * whose items are picked for the user, nor when the plan counts on the
+ * items coming out in order. Whether the user has enough
+ * items, and whether they can be scored without queries, we can only
+ * tell once they're prepared.
+ */
+static bool
+recItemParallelEligible(RecScanState *recnode)
+{
+	AttributeInfo *attributes = (AttributeInfo *) recnode->attributes;
+
+	if (recathon_parallel_workers <= 1 || attributes->ensemble != NIL ||
+		attributes->candidates || recnode->ordered)
+		return false;
+	if (attributes->opType == OP_JOIN || attributes->opType == OP_JOINPARTNER ||
+		attributes->opType == OP_GENERATEJOIN)
+		return false;
+	return recnode->userList && recnode->totalUsers == 1;
+}
+
+/*
+ * recStartItemWorkers
+ *
+ * Prepares the query's one user, which can take queries, and then
+ * forks workers that each score an even share of the user's items
+ * against their copy of what we prepared. That's only done for a
+ * method with a batch scorer, since those work from memory alone, and
+ * for a user with at least REC_WORKER_MIN_ITEMS items for each worker.
+ * Otherwise the user is left prepared for the scan to score itself.
+ *
+ * When only the best few tuples are wanted, and the quals can't tell
+ * one item from another, each worker keeps the best of its share and
+ * sends back just those, for ExecTopKRecommend to merge.
+ */
+static void
+recStartItemWorkers(RecScanState *recnode, ExprContext *econtext,
+					TupleTableSlot *slot)
+{
+	AttributeInfo *attributes = (AttributeInfo *) recnode->attributes;
+	RecScan    *plan = (RecScan *) recnode->ss.ps.plan;
+	const rec_strategy *strategy;
+	instr_time	starttime;
+	MemoryContext oldcontext;
+	int			userID = recnode->userList[0];
+	int			numItems, numWorkers;
+
+	/* A user who fails the user quals is the scan's to skip. */
+	slot->tts_values[recnode->useratt] = Int32GetDatum(userID);
+	slot->tts_values[recnode->itematt] = Int32GetDatum(-1);
+	slot->tts_values[recnode->eventatt] = Int32GetDatum(-1);
+	if (recnode->userqual && !ExecQual(recnode->userqual, econtext, false))
+	{
+		ResetExprContext(econtext);
+		return;
+	}
+	ResetExprContext(econtext);
+
+	attributes->userID = userID;
+	recnode->userindex = 0;
+	recInstrStart(recnode, &starttime, &oldcontext);
+	recnode->validUser = prepUserForRating(recnode, userID);
+	recInstrStop(recnode, &starttime, &recnode->prepTime, oldcontext);
+	if (recnode->validUser)
+		recnode->usersScored++;
+	recnode->newUser = false;
+	recnode->batchCount = 0;
+	if (!recnode->validUser)
+		return;
+
+	strategy = recnode->strategy ? recnode->strategy :
+		recStrategy((recMethod) attributes->method,
+					attributes->opType == OP_GENERATE);
+	if (!strategy->score_batch)
+		return;
+
+	numItems = recnode->itemCandidates ?
+		recnode->numCandidates : recnode->fullTotalItems;
+	numWorkers = Min(recathon_parallel_workers, numItems / REC_WORKER_MIN_ITEMS);
+	if (numWorkers <= 1)
+		return;
+
+	recForkWorkers(recnode, slot, NULL, 0, numWorkers,
+				   recnode->topK > 0 && qualUsesOnly(recnode, plan, false));
+}
+
+/*
+ * recForkWorkers
+ *
+ * Forks numWorkers processes to score for this scan, and remembers
+ * them so that they're stopped however the scan ends. Given a list of
+ * users, each worker scores every numWorkers'th of them; without one,
+ * they share out the items of the user we've just prepared, and if
+ * 'keep' isn't zero, each sends back only its best 'keep' of them.
+ */
+static void
+recForkWorkers(RecScanState *recnode, TupleTableSlot *slot,
+			   int *users, int numUsers, int numWorkers, bool keepBest)
+{
+	AttributeInfo *attributes;
+	rec_workers_t *ws;
+	int			w;
+
+	attributes = (AttributeInfo *) recnode->attributes;
+	if (!recathon_worker_callback_registered)
+	{
+		RegisterXactCallback(recWorkersAtEOXact, NULL);
+		recathon_worker_callback_registered = true;
+	}
+
+	/*
+	 * The workers outlive any memory context we could give them, if we
+	 * error out, so they're kept where only we free them.
+	 */
+	ws = (rec_workers_t *) malloc(sizeof(rec_workers_t));
+	if (ws)
+		ws->workers = (rec_worker *) malloc(numWorkers * sizeof(rec_worker));
+	if (!ws || !ws->workers)
+	{
+		if (ws)
+			free(ws);
+		ereport(ERROR,
+				(errcode(ERRCODE_OUT_OF_MEMORY),
+				 errmsg("out of memory")));
+	}
+	ws->numWorkers = numWorkers;
+	ws->nextWorker = 0;
+	ws->deferItemNum = -1;
+	for (w = 0; w < numWorkers; w++)
+	{
+		ws->workers[w].pid = 0;
+		ws->workers[w].fd = -1;
+		/* Item workers all score the one user we've counted already. */
+		ws->workers[w].lastUser = users ? -1 : attributes->userID;
+		ws->workers[w].start = 0;
+		ws->workers[w].len = 0;
+	}
+	ws->next = recathon_worker_sets;
+	recathon_worker_sets = ws;
+	recnode->workers = ws;
+
+	/* Anything buffered now would otherwise be written twice. */
+	fflush(stdout);
+	fflush(stderr);
+
+	for (w = 0; w < numWorkers; w++)
+	{
+		int			fds[2];
+		pid_t		pid;
+
+		if (pipe(fds) < 0)
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("could not create pipe for recommendation worker: %m")));
+
+		pid = fork();
+		if (pid < 0)
+		{
+			close(fds[0]);
+			close(fds[1]);
+			ereport(ERROR,
+					(errcode(ERRCODE_INSUFFICIENT_RESOURCES),
+					 errmsg("could not fork recommendation worker: %m")));
+		}
+
+		if (pid == 0)
+		{
+			close(fds[0]);
+			if (users)
+				recWorkerRun(recnode, slot, users, numUsers, w, numWorkers, fds[1]);
+			else
+				recItemWorkerRun(recnode, w, numWorkers, keepBest, fds[1]);
+			_exit(0);
+		}
+
+		close(fds[1]);
+		ws->workers[w].pid = pid;
+		ws->workers[w].fd = fds[0];
+	}
+}
+
+/*
+ * recWorkerRun
+ *
+ * The body of a worker process. We score our share of the users into
+ * the pipe, and exit. Any error here has to end the process directly,
+ * since the backend's error handling isn't ours to use, and nothing
+ * we say can go to the client.
+ */
+static void
+recWorkerRun(RecScanState *recnode, TupleTableSlot *slot,
+			 int *users, int numUsers, int worker, int numWorkers, int fd)
+{
+	AttributeInfo *attributes = (AttributeInfo *) recnode->attributes;
+	FILE	   *out;
+	int			k, j;
+
+	whereToSendOutput = DestNone;
+	pqsignal(SIGINT, SIG_DFL);
+	pqsignal(SIGTERM, SIG_DFL);
+	pqsignal(SIGQUIT, SIG_DFL);
+	recnode->parallelWorker = true;
+
+	if ((out = fdopen(fd, "w")) == NULL)
+		_exit(1);
+
+	PG_TRY();
+	{
+		for (k = worker; k < numUsers; k += numWorkers)
+		{
+			int			userindex = users[k];
+			int			userID = recnode->userList[userindex];
+			int			numItems;
+			rec_record	rec;
+
+			attributes->userID = userID;
+			recnode->userindex = userindex;
+			recnode->deferUser = false;
+			if (!prepUserForRating(recnode, userID))
+			{
+				if (recnode->deferUser)
+				{
+					rec.kind = REC_RECORD_DEFER;
+					rec.userID = userID;
+					rec.itemID = userindex;
+					rec.score = 0;
+					if (fwrite(&rec, sizeof(rec_record), 1, out) != 1)
+						_exit(1);
+				}
+				continue;
+			}
+
+			numItems = recnode->itemCandidates ?
+				recnode->numCandidates : recnode->fullTotalItems;
+			for (j = 0; j < numItems; j += RECATHON_SCORE_BATCH)
+			{
+				int			b;
+
+				recScoreBatch(recnode, j);
+				for (b = 0; b < recnode->batchCount; b++)
+				{
+					if (recSkipsRated(recnode, recnode->batchItems[b]))
+						continue;
+					rec.kind = REC_RECORD_SCORE;
+					rec.userID = userID;
+					rec.itemID = recnode->fullItemList[recnode->batchItems[b]];
+					rec.score = recnode->batchScores[b];
+					if (fwrite(&rec, sizeof(rec_record), 1, out) != 1)
+						_exit(1);
+				}
+			}
+		}
+
+		if (fclose(out) != 0)
+			_exit(1);
+	}
+	PG_CATCH();
+	{
+		_exit(1);
+	}
+	PG_END_TRY();
+}
+
+/*
+ * recItemWorkerRun
+ *
+ * The body of a worker process sharing out one user's items. We score
+ * our share of them into the pipe, or, with keepBest, hold on to the
+ * best in our own copy of the top-k heap and send just those, and
+ * exit. Errors end the process, as in recWorkerRun.
+ */
+static void
+recItemWorkerRun(RecScanState *recnode, int worker, int numWorkers,
+				 bool keepBest, int fd)
+{
+	AttributeInfo *attributes = (AttributeInfo *) recnode->attributes;
+	FILE	   *out;
+	rec_record	rec;
+	int			numItems, start, end, j, b;
+
+	whereToSendOutput = DestNone;
+	pqsignal(SIGINT, SIG_DFL);
+	pqsignal(SIGTERM, SIG_DFL);
+	pqsignal(SIGQUIT, SIG_DFL);
+	recnode->parallelWorker = true;
+
+	if ((out = fdopen(fd, "w")) == NULL)
+		_exit(1);
+
+	numItems = recnode->itemCandidates ?
+		recnode->numCandidates : recnode->fullTotalItems;
+	start = (int) ((int64) numItems * worker / numWorkers);
+	end = (int) ((int64) numItems * (worker + 1) / numWorkers);
+	recnode->topKCount = 0;
+	rec.kind = REC_RECORD_SCORE;
+	rec.userID = attributes->userID;
+
+	PG_TRY();
+	{
+		for (j = start; j < end; j += RECATHON_SCORE_BATCH)
+		{
+			int			count = Min(end - j, RECATHON_SCORE_BATCH);
+			int			n = 0;
+
+			/* What the user has rated may not need scoring. */
+			for (b = 0; b < count; b++)
+			{
+				int			itemindex = recnode->itemCandidates ?
+					recnode->itemCandidates[j + b] : j + b;
+
+				if (!recSkipsRated(recnode, itemindex))
+					recnode->batchItems[n++] = itemindex;
+			}
+			if (n == 0)
+				continue;
+			scoreItemBatch(recnode, recnode->batchItems, n, recnode->batchScores);
+
+			if (keepBest)
+			{
+				topKOfferBatch(recnode, recnode->batchItems,
+							   recnode->batchScores, n);
+				continue;
+			}
+			for (b = 0; b < n; b++)
+			{
+				rec.itemID = recnode->fullItemList[recnode->batchItems[b]];
+				rec.score = recnode->batchScores[b];
+				if (fwrite(&rec, sizeof(rec_record), 1, out) != 1)
+					_exit(1);
+			}
+		}
+
+		/* The heap is in no particular order, which is fine to merge. */
+		for (b = 0; b < recnode->topKCount; b++)
+		{
+			rec.itemID = recnode->topKItems[b];
+			rec.score = recnode->topKDescending ?
+				recnode->topKKeys[b] : -recnode->topKKeys[b];
+			if (fwrite(&rec, sizeof(rec_record), 1, out) != 1)
+				_exit(1);
+		}
+
+		if (fclose(out) != 0)
+			_exit(1);
+	}
+	PG_CATCH();
+	{
+		_exit(1);
+	}
+	PG_END_TRY();
+}
+
+/*
+ * recWorkersNext
+ *
+ * Puts the next scored tuple from the workers into the slot. A user a
+ * worker deferred to us is prepared, and has all of their items
+ * scored, before we read on. Returns false once every worker is done.
+ */
+static bool
+recWorkersNext(RecScanState *recnode, TupleTableSlot *slot)
+{
+	AttributeInfo *attributes = (AttributeInfo *) recnode->attributes;
+	rec_workers_t *ws = recnode->workers;
+
+	for (;;)
+	{
+		struct pollfd pfds[64];
+		rec_worker *pw[64];
+		rec_record	rec;
+		int			numOpen, i, rc;
+		bool		found = false;
+
+		/* A user we're scoring ourselves comes first. */
+		if (ws->deferItemNum >= 0)
+		{
+			int			numItems = recnode->itemCandidates ?
+				recnode->numCandidates : recnode->fullTotalItems;
+
+			if (ws->deferItemNum < numItems)
+			{
+				int			itemindex = recnode->itemCandidates ?
+					recnode->itemCandidates[ws->deferItemNum] : ws->deferItemNum;
+				int			itemID = recnode->fullItemList[itemindex];
+
+				ws->deferItemNum++;
+				if (recSkipsRated(recnode, itemindex))
+					continue;
+				slot->tts_values[recnode->useratt] = Int32GetDatum(attributes->userID);
+				slot->tts_values[recnode->itematt] = Int32GetDatum(itemID);
+				recScoreItem(recnode, slot, itemID, itemindex);
+				return true;
+			}
+			ws->deferItemNum = -1;
+		}
+
+		/* Then anything we've read already, going round the workers. */
+		for (i = 0; i < ws->numWorkers && !found; i++)
+		{
+			int			w = (ws->nextWorker + i) % ws->numWorkers;
+			rec_worker *worker = &ws->workers[w];
+
+			if (worker->len - worker->start < (int) sizeof(rec_record))
+				continue;
+
+			memcpy(&rec, worker->buf + worker->start, sizeof(rec_record));
+			worker->start += sizeof(rec_record);
+			ws->nextWorker = w;
+			found = true;
+
+			if (rec.kind == REC_RECORD_SCORE && rec.userID != worker->lastUser)
+			{
+				worker->lastUser = rec.userID;
+				recnode->usersScored++;
+			}
+		}
+
+		if (found)
+		{
+			if (rec.kind == REC_RECORD_DEFER)
+			{
+				instr_time	starttime;
+				MemoryContext oldcontext;
+
+				attributes->userID = rec.userID;
+				recnode->userindex = rec.itemID;
+				recInstrStart(recnode, &starttime, &oldcontext);
+				if (prepUserForRating(recnode, rec.userID))
+				{
+					recnode->usersScored++;
+					ws->deferItemNum = 0;
+				}
+				recInstrStop(recnode, &starttime, &recnode->prepTime, oldcontext);
+				continue;
+			}
+
+			slot->tts_values[recnode->useratt] = Int32GetDatum(rec.userID);
+			slot->tts_values[recnode->itematt] = Int32GetDatum(rec.itemID);
+			slot->tts_values[recnode->eventatt] = Float4GetDatum(rec.score);
+			slot->tts_isnull[recnode->eventatt] = false;
+			recnode->itemsScored++;
+			return true;
+		}
+
+		/* We need more from the workers, then. */
+		numOpen = 0;
+		for (i = 0; i < ws->numWorkers; i++)
+		{
+			rec_worker *worker = &ws->workers[i];
+
+			if (worker->fd < 0)
+				continue;
+			pfds[numOpen].fd = worker->fd;
+			pfds[numOpen].events = POLLIN;
+			pfds[numOpen].revents = 0;
+			pw[numOpen] = worker;
+			numOpen++;
+		}
+		if (numOpen == 0)
+			return false;
+
+		rc = poll(pfds, numOpen, 1000);
+		if (rc < 0 && errno != EINTR)
+			ereport(ERROR,
+					(errcode_for_socket_access(),
+					 errmsg("could not wait for recommendation workers: %m")));
+		CHECK_FOR_INTERRUPTS();
+		if (rc <= 0)
+			continue;
+
+		for (i = 0; i < numOpen; i++)
+		{
+			rec_worker *worker = pw[i];
+			ssize_t		n;
+			int			status;
+
+			if (pfds[i].revents == 0)
+				continue;
+
+			/* Keep whatever part of a record we have. */
+			memmove(worker->buf, worker->buf + worker->start,
+					worker->len - worker->start);
+			worker->len -= worker->start;
+			worker->start = 0;
+
+			n = read(worker->fd, worker->buf + worker->len,
+					 sizeof(worker->buf) - worker->len);
+			if (n > 0)
+			{
+				worker->len += n;
+				continue;
+			}
+			if (n < 0 && errno == EINTR)
+				continue;
+
+			/* The worker is done, one way or another. */
+			close(worker->fd);
+			worker->fd = -1;
+			if (waitpid(worker->pid, &status, 0) < 0 ||
+				!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			{
+				worker->pid = 0;
+				ereport(ERROR,
+						(errcode(ERRCODE_INTERNAL_ERROR),
+						 errmsg("recommendation worker failed")));
+			}
+			worker->pid = 0;
+		}
+	}
+}
+
+/*
+ * recStopWorkers
+ *
+ * Stops any workers still scoring for this scan, as when a LIMIT means
+ * we don't need the rest of their tuples.
+ */
+static void
+recStopWorkers(RecScanState *recnode)
+{
+	if (recnode->workers)
+	{
+		recWorkersRelease(recnode->workers);
+		recnode->workers = NULL;
+	}
+}
+
+/*
+ * recWorkersRelease
+ *
+ * Kills and reaps a set of workers, and forgets them.
+ */
+static void
+recWorkersRelease(rec_workers_t *ws)
+{
+	rec_workers_t **link;
+	int			w;
+
+	for (w = 0; w < ws->numWorkers; w++)
+	{
+		if (ws->workers[w].fd >= 0)
+			close(ws->workers[w].fd);
+		if (ws->workers[w].pid > 0)
+		{
+			kill(ws->workers[w].pid, SIGKILL);
+			waitpid(ws->workers[w].pid, NULL, 0);
+		}
+	}
+
+	for (link = &recathon_worker_sets; *link; link = &(*link)->next)
+	{
+		if (*link == ws)
+		{
+			*link = ws->next;
+			break;
+		}
+	}
+	free(ws->workers);
+	free(ws);
+}
+
+/*
+ * recWorkersAtEOXact
+ *
+ * Scans that errored out never reach ExecEndRecScan, so anything
+ * left running at the end of the transaction is stopped here.
+ */
+static void
+recWorkersAtEOXact(XactEvent event, void *arg)
+{
+	while (recathon_worker_sets)
+		recWorkersRelease(recathon_worker_sets);
+}
+
+/*
+ * topKKey
+ *
+ * Turns a score into a heap key where bigger is always better,
+ * whichever direction the query sorts in.
+ */
+static inline float
+topKKey(RecScanState *recnode, float score)
+{
+	return recnode->topKDescending ? score : -score;
+}
+
+/*
+ * topKAccepts
+ *
+ * Would a tuple with this score make it into the top-k heap? If the
+ * heap isn't full yet, anything does.
+ */
+static bool
+topKAccepts(RecScanState *recnode, float score)
+{
+	if (recnode->topKCount < recnode->topK)
+		return true;
+	return topKKey(recnode, score) > recnode->topKKeys[0];
+}
+
+/*
+ * topKSiftDown
+ *
+ * Restores the heap property below position i. The heap keeps the
+ * worst of the tuples we're holding at the top, so that it's the one
+ * a better tuple replaces.
+ */
+static void
+topKSiftDown(RecScanState *recnode, int i, int count)
+{
+	for (;;) {
+		int smallest = i;
+		int left = 2*i + 1;
+		int right = 2*i + 2;
+		float tempkey;
+		HeapTuple temptuple;
+		int tempitem;
+
+		if (left < count && recnode->topKKeys[left] < recnode->topKKeys[smallest])
+			smallest = left;
+		if (right < count && recnode->topKKeys[right] < recnode->topKKeys[smallest])
+			smallest = right;
+		if (smallest == i)
+			break;
+
+		tempkey = recnode->topKKeys[i];
+		recnode->topKKeys[i] = recnode->topKKeys[smallest];
+		recnode->topKKeys[smallest] = tempkey;
+		temptuple = recnode->topKTuples[i];
+		recnode->topKTuples[i] = recnode->topKTuples[smallest];
+		recnode->topKTuples[smallest] = temptuple;
+		tempitem = recnode->topKItems[i];
+		recnode->topKItems[i] = recnode->topKItems[smallest];
+		recnode->topKItems[smallest] = tempitem;
+		i = smallest;
+	}
+}
+
+/*
+ * topKInsert
+ *
+ * Adds a copy of a result tuple to the heap, pushing out the worst
+ * one if the heap is full. A worker keeping the best of its share of
+ * the items has no tuple to give, just the item and its score.
+ */
+static void
+topKInsert(RecScanState *recnode, TupleTableSlot *slot, int item, float score)
+{
+	float key = topKKey(recnode, score);
+	int i;
+
+	if (recnode->topKCount < recnode->topK) {
+		/* Sift the new tuple up from the bottom. */
+		i = recnode->topKCount++;
+		while (i > 0 && recnode->topKKeys[(i-1)/2] > key) {
+			recnode->topKKeys[i] = recnode->topKKeys[(i-1)/2];
+			recnode->topKTuples[i] = recnode->topKTuples[(i-1)/2];
+			recnode->topKItems[i] = recnode->topKItems[(i-1)/2];
+			i = (i-1)/2;
+		}
+		recnode->topKKeys[i] = key;
+		recnode->topKTuples[i] = slot ? ExecCopySlotTuple(slot) : NULL;
+		recnode->topKItems[i] = item;
+		return;
+	}
+
+	if (recnode->topKTuples[0])
+		heap_freetuple(recnode->topKTuples[0]);
+	recnode->topKKeys[0] = key;
+	recnode->topKTuples[0] = slot ? ExecCopySlotTuple(slot) : NULL;
+	recnode->topKItems[0] = item;
+	topKSiftDown(recnode, 0, recnode->topKCount);
+}
+
+/*
+ * topKOfferBatch
+ *
+ * Offers a batch of scored items to the heap, with no tuples. Once the
+ * heap is full, the scores that beat the worst it holds are picked out
+ * a block at a time, and only they are offered.
+ */
+static void
+topKOfferBatch(RecScanState *recnode, const int *itemindexes,
+			   const float *scores, int n)
+{
+	int			positions[RECATHON_SELECT_BLOCK];
+	int			start = 0, found, i;
+
+	while (start < n && recnode->topKCount < recnode->topK) {
+		topKInsert(recnode, NULL, recnode->fullItemList[itemindexes[start]],
+				   scores[start]);
+		start++;
+	}
+	if (recnode->topK <= 0)
+		return;
+
+	for (; start < n; start += RECATHON_SELECT_BLOCK) {
+		int			count = Min(n - start, RECATHON_SELECT_BLOCK);
+		float		worst = recnode->topKDescending ?
+			recnode->topKKeys[0] : -recnode->topKKeys[0];
+
+		found = selectScores(scores + start, count, worst,
+							 recnode->topKDescending, positions);
+		for (i = 0; i < found; i++) {
+			int			b = start + positions[i];
+
+			if (topKAccepts(recnode, scores[b]))
+				topKInsert(recnode, NULL,
+						   recnode->fullItemList[itemindexes[b]], scores[b]);
+		}
+	}
+}
+
+/*
+ * ExecTopKRecommend
+ *
+ * When the planner has told us that only the best few tuples are
+ * wanted, we run the whole FilterRecommend the first time we're
+ * called, holding on to the best tuples in a bounded heap, and then
+ * hand them back best first. A single user's list is kept in the
+ * result cache, when ExecInitRecScan asked for it. With a time
+ * budget, ExecFilterRecommend may stop early, and we hand back the
+ * best of what it scored.
+ */
+static TupleTableSlot*
+ExecTopKRecommend(RecScanState *recnode,
+					 ExecScanAccessMtd accessMtd,
+					 ExecScanRecheckMtd recheckMtd)
+{
+	if (!recnode->topKDone) {
+		ExprContext *econtext = recnode->subscan->ps.ps_ExprContext;
+		int i;
+
+		if (!recnode->topKKeys) {
+			recnode->topKKeys = (float*) palloc(recnode->topK*sizeof(float));
+			recnode->topKTuples = (HeapTuple*) palloc(recnode->topK*sizeof(HeapTuple));
+			recnode->topKItems = (int*) palloc(recnode->topK*sizeof(int));
+		}
+		recnode->topKCount = 0;
+
+		for (;;) {
+			TupleTableSlot *slot, *scanslot;
+			float score;
+
+			slot = ExecFilterRecommend(recnode, accessMtd, recheckMtd);
+			if (TupIsNull(slot))
+				break;
+
+			/* Whatever the projection did, the score is in the
+			 * scan tuple we built. */
+			scanslot = econtext->ecxt_scantuple;
+			score = DatumGetFloat4(scanslot->tts_values[recnode->eventatt]);
+			if (!recnode->topKSlot)
+				recnode->topKSlot = MakeSingleTupleTableSlot(slot->tts_tupleDescriptor);
+			topKInsert(recnode, slot,
+				DatumGetInt32(scanslot->tts_values[recnode->itematt]), score);
+		}
+
+		/* Take the worst off the heap each time, putting it at the
+		 * end, so that the array ends up best first. */
+		for (i = recnode->topKCount - 1; i > 0; i--) {
+			float tempkey = recnode->topKKeys[0];
+			HeapTuple temptuple = recnode->topKTuples[0];
+			int tempitem = recnode->topKItems[0];
+
+			recnode->topKKeys[0] = recnode->topKKeys[i];
+			recnode->topKTuples[0] = recnode->topKTuples[i];
+			recnode->topKItems[0] = recnode->topKItems[i];
+			recnode->topKKeys[i] = tempkey;
+			recnode->topKTuples[i] = temptuple;
+			recnode->topKItems[i] = tempitem;
+			topKSiftDown(recnode, 0, i);
+		}
+
+		/* Fewer tuples than we asked for means we have all of them.
+		 * A list cut short by the time budget isn't kept, since it
+		 * may not be the real one. */
+		if (recnode->storeResults && !recnode->timedOut)
+			storeTopKResults(recnode);
+
+		recnode->topKNext = 0;
+		recnode->topKDone = true;
+	}
+
+	if (recnode->topKNext >= recnode->topKCount)
+		return recnode->topKSlot ? ExecClearTuple(recnode->topKSlot) : NULL;
+
+	return ExecStoreTuple(recnode->topKTuples[recnode->topKNext++],
+						  recnode->topKSlot, InvalidBuffer, false);
+}
+
+/*
+ * storeTopKResults
+ *
+ * Keeps a single user's best tuples in the result cache. Only the
+ * highest scores are ever stored, so the heap keys are the scores.
+ * Fewer tuples than we asked for means that's all the user has.
+ */
+static void
+storeTopKResults(RecScanState *recnode)
+{
+	AttributeInfo *attributes = (AttributeInfo *) recnode->attributes;
+
+	recathonResultStore(attributes->recIndexName, attributes->eventtable,
+		linitial_int(attributes->userIDList), recnode->resultVersion,
+		recnode->resultGeneration, recnode->topKCount,
+		recnode->topKCount < recnode->topK,
+		recnode->topKItems, recnode->topKKeys);
+	recnode->storeResults = false;
+}
+
+/*
+ * ExecReScanRecScan
+ *
+ * This decides what kind of ReScan method to use. We should only be
+ * considering a SeqScan; we built in a failsafe, though anything else
+ * should be impossible due to how we handled the planning.
+ */
+void
+ExecReScanRecScan(RecScanState *node)
+{
+	/* Workers scoring the last scan have to start over too. */
+	recStopWorkers(node);
+	node->parallelTried = false;
+
+	/* So does any batch of scores. */
+	node->batchCount = 0;
+
+	/* Any top-k tuples we collected have to be worked out again. */
+	if (node->topKDone) {
+		int i;
+
+		for (i = 0; i < node->topKCount; i++)
+			heap_freetuple(node->topKTuples[i]);
+		node->topKCount = 0;
+		node->topKDone = false;
+		if (node->topKSlot)
+			ExecClearTuple(node->topKSlot);
+	}
+
+	switch (nodeTag(node->subscan))
+	{
+		case T_SeqScanState:
+			ExecReScanSeqScan((SeqScanState *) node->subscan);
+			break;
+
+		default:
+			elog(ERROR, "invalid RecScan subscan type: %d", (int) nodeTag(node->subscan));
+			break;
+	}
+}
+
+/*
+ * ExecRecMarkPos
+ *
+ * This decides what kind of MarkPos method to use. We should only be
+ * considering a SeqScan; we built in a failsafe, though anything else
+ * should be impossible due to how we handled the planning.
+ */
+void
+ExecRecMarkPos(RecScanState *node)
+{
+	switch (nodeTag(node->subscan))
+	{
+		case T_SeqScanState:
+			ExecSeqMarkPos((SeqScanState *) node->subscan);
+			break;
+
+		default:
+			/* don't make hard error unless caller asks to restore... */
+			elog(DEBUG2, "invalid RecScan subscan type: %d", (int) nodeTag(node->subscan));
+			break;
+	}
+}
+
+/*
+ * ExecRecRestrPos
+ *
+ * This decides what kind of RestrPos method to use. We should only be
+ * considering a SeqScan; we built in a failsafe, though anything else
+ * should be impossible due to how we handled the planning.
+ */
+void
+ExecRecRestrPos(RecScanState *node)
+{
+	switch (nodeTag(node->subscan))
+	{
+		case T_SeqScanState:
+			ExecSeqRestrPos((SeqScanState *) node->subscan);
+			break;
+
+		default:
+			elog(ERROR, "invalid RecScan subscan type: %d", (int) nodeTag(node->subscan));
+			break;
+	}
+}
+
+/*
+ * InitializeRecommender
+ *
+ * This function will initialize the recommender information we need.
+ */
+static void
+InitializeRecommender(RecScanState *recstate) {
+	int i;
+	AttributeInfo *attributes;
+	// Query objects.
+	char *querystring;
+	QueryDesc *queryDesc;
+	PlanState *planstate;
+	TupleTableSlot *hslot;
+	MemoryContext recathoncontext;
+	tuple_column keycol;
+
+	attributes = (AttributeInfo*) recstate->attributes;
+	TRACE_POSTGRESQL_RECOMMEND_INIT_START(recTraceName(attributes));
+
+	/* A built recommender can share what it loads with other backends,
+	 * through the model cache or a model file, as long as we know which
+	 * build it is. */
+	recstate->cacheVersion = 0;
+	recstate->cachePins = NIL;
+	recstate->probes = NIL;
+	recstate->buildHandle = -1;
+	recstate->modelFile = NULL;
+	recstate->modelPrecision = RECATHON_FULL_PRECISION;
+	if (attributes->opType != OP_GENERATE && attributes->opType != OP_GENERATEJOIN &&
+	    attributes->recIndexName &&
+	    (recathonCacheEnabled() || modelFileExists(attributes->recIndexName))) {
+		uint32 version = modelVersion(attributes->recIndexName);
+
+		if (recathonCacheEnabled()) {
+			recstate->cacheVersion = version;
+			recstate->modelPrecision = loadModelPrecision(attributes->recIndexName);
+		}
+		recstate->modelFile = openModelFile(attributes->recIndexName, version);
+	}
+
+	/* A symmetric similarity model is read one direction at a time. */
+	recstate->modelSymmetric = (attributes->opType != OP_GENERATE &&
+		attributes->opType != OP_GENERATEJOIN && attributes->recIndexName &&
+		getRecSymmetric(attributes->recIndexName));
+
+	/* A user-based recommender with a neighborhood predicts from
+	 * only that many of each user's most similar users. */
+	recstate->neighborhood = 0;
+	if ((attributes->method == userCosCF || attributes->method == userPearCF) &&
+		attributes->opType != OP_GENERATE && attributes->opType != OP_GENERATEJOIN &&
+		attributes->recIndexName)
+		recstate->neighborhood = getRecNeighborhood(attributes->recIndexName);
+	recstate->numNeighbors = 0;
+	recstate->neighbors = NULL;
+
+	/* Our next step is to get the list of all users who participated in the
+	 * events table. At the least, we need to consider each one up until the
+	 * point where WHERE filters are applied. Any user IDs that survive that
+	 * filter will have structures created for recommendation. */
+	/* Note: if we're generating recommendations on-the-fly, we don't need
+	 * to do this, as the list is created as a side effect. */
+	recstate->userList = NULL;
+	recstate->totalUsers = -1;
+	recstate->userNum = 0;
+
+	/* If the WHERE clause limits the users to a subquery, or to a
+	 * table they're joined with, we find out who they are first and
+	 * go on as if it had named them. If it finds nobody, there's
+	 * nothing to return. */
+	if (attributes->userIDList == NIL && attributes->userWhereQuery) {
+		ListCell *lc;
+
+		attributes->userIDList = loadQueryUsers((Query *) attributes->userWhereQuery);
+		foreach(lc, attributes->ensemble)
+			((AttributeInfo *) lfirst(lc))->userIDList = list_copy(attributes->userIDList);
+		if (attributes->candidates)
+			attributes->candidates->userIDList = list_copy(attributes->userIDList);
+		if (attributes->userIDList == NIL) {
+			recstate->totalUsers = 0;
+			recstate->userList = (int*) palloc(sizeof(int));
+		}
+	}
+
+	/* If the WHERE clause names the users we want, we only
+	 * need to check that those users exist. */
+	querystring = (char*) palloc(1024*sizeof(char));
+	if (attributes->userIDList != NIL &&
+	    ((attributes->opType != OP_GENERATE && attributes->opType != OP_GENERATEJOIN) ||
+	     attributes->method == itemCosCF ||
+	     attributes->method == itemPearCF ||
+	     attributes->method == itemJaccardCF)) {
+		recstate->totalUsers = getListedUsers(attributes->userIDList,
+			attributes->userkey, attributes->eventtable, &recstate->userList);
+
+		/* If none of them have any events, there's nothing to return;
+		 * ExecFilterRecommend checks for this. */
+		if (recstate->totalUsers > 0)
+			attributes->userID = recstate->userList[0] - 1;
+	}
+	else if (recstate->totalUsers < 0 &&
+	    attributes->opType != OP_GENERATE && attributes->opType != OP_GENERATEJOIN) {
+		/* A built recommender keeps its user list alongside its model. */
+		if (attributes->recIndexName)
+			recstate->totalUsers = loadCachedIDDictionary(recstate,
+				"users", &recstate->userList);
+	}
+
+	/* Without that, we have to work it out from the events. */
+	if (recstate->totalUsers < 0 &&
+	    attributes->opType != OP_GENERATE && attributes->opType != OP_GENERATEJOIN) {
+		sprintf(querystring,"select count(distinct %s) from %s;",
+			attributes->userkey,attributes->eventtable);
+		queryDesc = recathon_queryStart(querystring,&recathoncontext);
+		planstate = queryDesc->planstate;
+		hslot = ExecProcNode(planstate);
+		recstate->totalUsers = getTupleInt(hslot,"count");
+		recathon_queryEnd(queryDesc,recathoncontext);
+
+		/* In the event that there are no user IDs, we can't do anything. */
+		if (recstate->totalUsers <= 0)
+			elog(ERROR, "no users found, cannot predict ratings");
+
+		recstate->userList = (int*) palloc(recstate->totalUsers*sizeof(int));
+
+		/* Now for the actual query. The users go in order, as they
+		 * do from the ID dictionary, which the planner counts on. */
+		sprintf(querystring,"select distinct %s from %s order by %s;",
+			attributes->userkey,attributes->eventtable,attributes->userkey);
+		queryDesc = recathon_queryStart(querystring,&recathoncontext);
+		planstate = queryDesc->planstate;
+		bindColumn(&keycol, attributes->userkey);
+
+		i = 0;
+		for (;;) {
+			int currentUser;
+
+			hslot = ExecProcNode(planstate);
+			if (TupIsNull(hslot)) break;
+
+			currentUser = columnInt(hslot,&keycol);
+
+			recstate->userList[i] = currentUser;
+			i++;
+			if (i >= recstate->totalUsers) break;
+		}
+		recathon_queryEnd(queryDesc,recathoncontext);
+
+		/* Quick error protection. */
+		recstate->totalUsers = i;
+	}
+
+	/* Lastly, initialize the attributes->userID. */
+	if (recstate->userList && attributes->userIDList == NIL &&
+	    !attributes->userWhereQuery) {
 		if (recstate->totalUsers <= 0)
 			elog(ERROR, "no users found, cannot predict ratings");
+		attributes->userID = recstate->userList[0] - 1;
+	}
+
+	/* Next, we need a full list of all the items in the rating table. This will tell
+	 * us what items to generate ratings for. On-the-fly models make this list
+	 * as they go. */
+	recstate->fullItemList = NULL;
+	recstate->fullTotalItems = -1;
+	recstate->fullItemNum = 0;
+	if (attributes->opType != OP_GENERATE && attributes->opType != OP_GENERATEJOIN &&
+	    attributes->recIndexName)
+		recstate->fullTotalItems = loadCachedIDDictionary(recstate,
+			"items", &recstate->fullItemList);
+
+	if (recstate->fullTotalItems < 0 &&
+	    attributes->opType != OP_GENERATE && attributes->opType != OP_GENERATEJOIN) {
+		sprintf(querystring,"select count(distinct %s) from %s;",
+			attributes->itemkey,attributes->eventtable);
+		queryDesc = recathon_queryStart(querystring,&recathoncontext);
+		planstate = queryDesc->planstate;
+		hslot = ExecProcNode(planstate);
+		recstate->fullTotalItems = getTupleInt(hslot,"count");
+		recathon_queryEnd(queryDesc,recathoncontext);
+
+		/* In the event that there are no item IDs, we can't do anything. */
+		if (recstate->fullTotalItems <= 0)
+			elog(ERROR, "no items found, cannot predict ratings");
+
+		recstate->fullItemList = (int*) palloc(recstate->fullTotalItems*sizeof(int));
+
+		/* Now for the actual query. */
+		sprintf(querystring,"select distinct %s from %s order by %s;",
+			attributes->itemkey,attributes->eventtable,attributes->itemkey);
+		queryDesc = recathon_queryStart(querystring,&recathoncontext);
+		planstate = queryDesc->planstate;
+		bindColumn(&keycol, attributes->itemkey);
+
+		i = 0;
+		for (;;) {
+			int currentItem;
+
+			hslot = ExecProcNode(planstate);
+			if (TupIsNull(hslot)) break;
+
+			currentItem = columnInt(hslot,&keycol);
+
+			recstate->fullItemList[i] = currentItem;
+			i++;
+			if (i >= recstate->fullTotalItems) break;
+		}
+		recathon_queryEnd(queryDesc,recathoncontext);
+
+		/* Quick error protection. */
+		recstate->fullTotalItems = i;
+	}
+	if (recstate->fullItemList && recstate->fullTotalItems <= 0)
+		elog(ERROR, "no items found, cannot predict ratings");
+
+	recstate->finished = false;
+	recstate->base_slot = NULL;
+	recstate->recSlot = NULL;
+	recstate->newUser = true;
+	recstate->useratt = -1;
+	recstate->itematt = -1;
+	recstate->eventatt = -1;
+
+	/* Initialize certain structures to NULL. */
+	recstate->ratedItems = NULL;
+	recstate->isRated = NULL;
+	recstate->ratedScore = NULL;
+	recstate->pendingScore = NULL;
+	recstate->pendingSim = NULL;
+	recstate->ratedOrder = NULL;
+	recstate->isSeen = NULL;
+	recstate->thresholdItems = NULL;
+	recstate->sortedEntries = NULL;
+	recstate->rowSorted = NULL;
+	recstate->userSim = NULL;
+	recstate->userFeatures = NULL;
+	recstate->itemMap = NULL;
+
+	/* Whatever is made for one user alone goes when the next comes
+	 * along. Each method of an ensemble has its own. */
+	recstate->userContext = AllocSetContextCreate(recstate->recContext,
+						"RecScanUser",
+						ALLOCSET_SMALL_MINSIZE,
+						ALLOCSET_SMALL_INITSIZE,
+						ALLOCSET_DEFAULT_MAXSIZE);
+	recstate->itemMapBase = 0;
+	recstate->itemMapSize = 0;
+
+	/* In case we don't have a pre-built recommender, we need to assemble
+	 * the appropriate structures now. */
+	recstate->itemCFmodel = NULL;
+	recstate->itemCFslice = false;
+	recstate->hotItemSim = NULL;
+	recstate->hotItemRow = NULL;
+	recstate->userCFmodel = NULL;
+	recstate->userCFrows = false;
+	recstate->itemEvents = NULL;
+	recstate->eventUsers = NULL;
+	recstate->numEventUsers = 0;
+	recstate->userEvents = NULL;
+	recstate->userEventIDs = NULL;
+	recstate->SVDusermodel = NULL;
+	recstate->SVDitemmodel = NULL;
+	recstate->SVDitemHalf = NULL;
+	recstate->numClusters = 0;
+	recstate->clusterStart = NULL;
+	recstate->clusterItems = NULL;
+	recstate->clusterCentroids = NULL;
+	recstate->numCandidates = 0;
+	recstate->itemCandidates = NULL;
+
+	/* Items are scored through the method's strategy. When every item
+	 * of a user is scored anyway, we do it a batch at a time. */
+	recstate->strategy = recStrategy((recMethod) attributes->method,
+		attributes->opType == OP_GENERATE || attributes->opType == OP_GENERATEJOIN);
+	recstate->batchScoring = (attributes->noFilter || !recstate->scanQual) &&
+		attributes->opType != OP_JOIN && attributes->opType != OP_GENERATEJOIN;
+	recstate->batchCount = 0;
+	recstate->batchItems = (int*) palloc(RECATHON_SCORE_BATCH*sizeof(int));
+	recstate->batchScores = (float*) palloc(RECATHON_SCORE_BATCH*sizeof(float));
+	recstate->batchSurvivors = (int*) palloc(RECATHON_SCORE_BATCH*sizeof(int));
+	recstate->batchNumSurvivors = -1;
+
+	if (attributes->opType == OP_GENERATE || attributes->opType == OP_GENERATEJOIN) {
+		Size		before = MemoryContextTotalSpace(recstate->recContext);
+
+		/* Other sessions' builds may have to finish first, either
+		 * for the memory or because they're building the same model. */
+		recstate->buildHandle = admitGeneratedModel(recstate);
+		TRACE_POSTGRESQL_RECOMMEND_MODEL_LOAD_START(recTraceName(attributes), "on the fly");
+		switch (attributes->method) {
+			case itemPearCF:
+				generateItemPearModel(recstate);
+				break;
+			case itemJaccardCF:
+				generateItemJaccardModel(recstate);
+				break;
+			case userCosCF:
+				generateUserCosModel(recstate);
+				break;
+			case userPearCF:
+				generateUserPearModel(recstate);
+				break;
+			case SVD:
+				generateSVDmodel(recstate);
+				break;
+			case ALS:
+				generateALSmodel(recstate);
+				break;
+			/* The default case is itemCosCF. There shouldn't actually
+			 * be a possibility of "default", but just in case. */
+			case itemCosCF:
+			default:
+				generateItemCosModel(recstate);
+				break;
+		}
+		TRACE_POSTGRESQL_RECOMMEND_MODEL_LOAD_DONE(recTraceName(attributes), "on the fly");
+		recathonBuildFinish(recstate->buildHandle,
+			MemoryContextTotalSpace(recstate->recContext) - before);
+	}
+
+	/* With the item list settled, we can set up quick lookups into it. */
+	buildItemMap(recstate);
+
+	/* If the WHERE clause limits the items to a subquery, we only
+	 * score what it returns. */
+	if (attributes->itemWhereQuery && recstate->fullItemList)
+		loadItemCandidates(recstate, (Query *) attributes->itemWhereQuery);
+
+	/* And if it limits the item IDs, or the recommender has an active
+	 * set, only those that fit. */
+	InitializeItemQuals(recstate);
+
+	if ((attributes->opType != OP_GENERATE && attributes->opType != OP_GENERATEJOIN) &&
+	    FACTOR_METHOD(attributes->method)) {
+		/* For a pre-built SVD or ALS recommender, we read the whole item
+		 * model in once, rather than querying it for every item. */
+		TRACE_POSTGRESQL_RECOMMEND_MODEL_LOAD_START(recTraceName(attributes), "item factors");
+		recstate->numFeatures = loadCachedItemFactors(recstate);
+		TRACE_POSTGRESQL_RECOMMEND_MODEL_LOAD_DONE(recTraceName(attributes), "item factors");
+		recstate->userModelArrays = factorModelHasArrays(attributes->recModelName);
+		/* The approximate top-k index picks its own candidates for
+		 * each user, so it's no use once we have ours, or once
+		 * another method picks them. */
+		if (attributes->recClusterName && !recstate->itemCandidates &&
+		    !attributes->candidates)
+			loadItemClusters(recstate, attributes->recClusterName);
+	}
+
+	/* With the model cache or a model file, a built item-based recommender
+	 * reads its similarities once for everyone, instead of once per user. */
+	if ((attributes->opType != OP_GENERATE && attributes->opType != OP_GENERATEJOIN) &&
+	    (attributes->method == itemCosCF || attributes->method == itemPearCF ||
+	     attributes->method == itemJaccardCF)) {
+		TRACE_POSTGRESQL_RECOMMEND_MODEL_LOAD_START(recTraceName(attributes), "item similarities");
+		loadCachedItemSim(recstate);
+		TRACE_POSTGRESQL_RECOMMEND_MODEL_LOAD_DONE(recTraceName(attributes), "item similarities");
+	}
+
+	/* User-based methods score each item from the events of the
+	 * users who rated it, so we gather those up in one pass. */
+	if (attributes->method == userCosCF || attributes->method == userPearCF)
+		loadItemEvents(recstate);
+
+	/* Now that we know how the model is kept, the strategy can be
+	 * made for it. */
+	recstate->strategy = recModelStrategy(recstate, recstate->strategy);
+
+	/* A hybrid recommender wants to know who asked. The query itself
+	 * is counted in the statistics when we're done. */
+	if (attributes->recIndexName)
+		logUserQueries(attributes->recIndexName, attributes->userIDList);
+
+	/* An ensemble needs its other methods ready as well. */
+	if (attributes->ensemble != NIL)
+		InitializeEnsemble(recstate);
+
+	/* So does the method that picks the items to score. */
+	if (attributes->candidates)
+		InitializeCandidates(recstate);
+
+	/* Lastly, mark this as initialized. */
+	recstate->initialized = true;
+	TRACE_POSTGRESQL_RECOMMEND_INIT_DONE(recTraceName(attributes));
+}
+
+/*
+ * InitializeEnsemble
+ *
+ * Sets up a RecScanState for each of the other methods of an ensemble,
+ * the way InitializeRecommender did for the first. They share its scan
+ * and its memory, and never return tuples of their own; they're only
+ * asked to prepare each user and score items for the first.
+ */
+static void
+InitializeEnsemble(RecScanState *recstate) {
+	ListCell *lc;
+	AttributeInfo *attributes;
+
+	attributes = (AttributeInfo*) recstate->attributes;
+	foreach(lc, attributes->ensemble) {
+		RecScanState *member = makeNode(RecScanState);
+
+		member->subscan = recstate->subscan;
+		member->attributes = (Node*) lfirst(lc);
+		member->recContext = recstate->recContext;
+		member->scanQual = recstate->scanQual;
+		InitializeRecommender(member);
+		recstate->ensemble = lappend(recstate->ensemble, member);
+	}
+}
+
+/*
+ * InitializeCandidates
+ *
+ * Sets up a RecScanState for the method of CANDIDATES FROM, the way
+ * InitializeEnsemble does for the methods of an ensemble. For each user
+ * it scores every item it knows, and the few it likes best are all the
+ * main method scores. Whatever the WHERE clause limited the items to
+ * is kept aside, to pick the candidates from.
+ */
+static void
+InitializeCandidates(RecScanState *recstate) {
+	RecScanState *source = makeNode(RecScanState);
+	AttributeInfo *attributes;
+
+	attributes = (AttributeInfo*) recstate->attributes;
+	source->subscan = recstate->subscan;
+	source->attributes = (Node*) attributes->candidates;
+	source->recContext = recstate->recContext;
+	source->scanQual = recstate->scanQual;
+	InitializeRecommender(source);
+	recstate->candidateSource = source;
+
+	recstate->baseCandidates = recstate->itemCandidates;
+	recstate->numBaseCandidates = recstate->numCandidates;
+	recstate->itemCandidates = (int*) MemoryContextAlloc(recstate->recContext,
+		Max(recstate->fullTotalItems, 1)*sizeof(int));
+	recstate->numCandidates = 0;
+}
+
+/*
+ * InitializeRecView
+ *
+ * Answering from the RecView needs none of the models, just the
+ * users the query names and room for one user's predictions. A user
+ * who arrived since the view was filled has nothing in it, though,
+ * so if any of the users are missing we give up on the view, and
+ * leave the recommender to InitializeRecommender.
+ */
+static void
+InitializeRecView(RecScanState *recstate) {
+	int i;
+	ListCell *lc;
+	AttributeInfo *attributes;
+
+	attributes = (AttributeInfo*) recstate->attributes;
+
+	/* We take the users as given, without duplicates. */
+	recstate->userList = (int*) palloc(list_length(attributes->userIDList)*sizeof(int));
+	recstate->totalUsers = 0;
+	recstate->userNum = 0;
+	foreach(lc, attributes->userIDList) {
+		int userID = lfirst_int(lc);
+
+		for (i = 0; i < recstate->totalUsers; i++) {
+			if (recstate->userList[i] == userID)
+				break;
+		}
+		if (i == recstate->totalUsers)
+			recstate->userList[recstate->totalUsers++] = userID;
+	}
+
+	recstate->viewItems = (int*) palloc(recstate->viewSize*sizeof(int));
+	recstate->viewScores = (float*) palloc(recstate->viewSize*sizeof(float));
+	for (i = 0; i < recstate->totalUsers; i++) {
+		if (loadRecViewUser(recstate, recstate->userList[i]) == 0) {
+			pfree(recstate->userList);
+			pfree(recstate->viewItems);
+			pfree(recstate->viewScores);
+			recstate->userList = NULL;
+			recstate->viewItems = NULL;
+			recstate->viewScores = NULL;
+			recstate->useRecView = false;
+			return;
+		}
+	}
+	recstate->numViewRows = 0;
+	recstate->viewRowNum = 0;
+	recstate->viewReturned = 0;
+
+	recstate->base_slot = NULL;
+	recstate->recSlot = NULL;
+	recstate->newUser = true;
+	recstate->useratt = -1;
+	recstate->itematt = -1;
+	recstate->eventatt = -1;
+
+	/* This still counts as a query on the recommender. */
+	logUserQueries(attributes->recIndexName, attributes->userIDList);
+
+	recstate->initialized = true;
+}
+
+/*
+ * InitializeShards
+ *
+ * The nodes in serve_nodes score the users for us, so we only need to
+ * know who they are: the ones the query names, without duplicates, or
+ * everyone in the recommender's list of users. If it has none, we
+ * leave the recommender to InitializeRecommender. Each node is asked
+ * for the best few of all of its users at once.
+ */
+static void
+InitializeShards(RecScanState *recstate) {
+	int i;
+	ListCell *lc;
+	AttributeInfo *attributes;
+
+	attributes = (AttributeInfo*) recstate->attributes;
+
+	if (attributes->userIDList != NIL) {
+		recstate->userList = (int*) palloc(list_length(attributes->userIDList)*sizeof(int));
+		recstate->totalUsers = 0;
+		foreach(lc, attributes->userIDList) {
+			int userID = lfirst_int(lc);
+
+			for (i = 0; i < recstate->totalUsers; i++) {
+				if (recstate->userList[i] == userID)
+					break;
+			}
+			if (i == recstate->totalUsers)
+				recstate->userList[recstate->totalUsers++] = userID;
+		}
+	} else {
+		/* Without a list of everyone, we score them ourselves. */
+		recstate->totalUsers = loadIDDictionary(attributes->recIndexName,
+			"users", &recstate->userList);
+		if (recstate->totalUsers < 0) {
+			recstate->userList = NULL;
+			recstate->useShards = false;
+			return;
+		}
+	}
+	recstate->userNum = 0;
+
+	(void) loadShardResults(recstate, recstate->serveNodes);
+	recstate->numViewRows = 0;
+	recstate->viewRowNum = 0;
+	recstate->viewReturned = 0;
+
+	recstate->base_slot = NULL;
+	recstate->recSlot = NULL;
+	recstate->newUser = true;
+	recstate->useratt = -1;
+	recstate->itematt = -1;
+	recstate->eventatt = -1;
+
+	/* This still counts as a query on the recommender. */
+	logUserQueries(attributes->recIndexName, attributes->userIDList);
+
+	recstate->initialized = true;
+}
+
+/*
+ * InitializeResultCache
+ *
+ * ExecInitRecScan already found the user's list in the result cache,
+ * so there's nothing to load; we just have to look like the RecView
+ * does to ExecIndexRecommend.
+ */
+static void
+InitializeResultCache(RecScanState *recstate) {
+	AttributeInfo *attributes;
+
+	attributes = (AttributeInfo*) recstate->attributes;
+
+	recstate->userList = (int*) palloc(sizeof(int));
+	recstate->userList[0] = linitial_int(attributes->userIDList);
+	recstate->totalUsers = 1;
+	recstate->userNum = 0;
+	recstate->numViewRows = 0;
+	recstate->viewRowNum = 0;
+	recstate->viewReturned = 0;
+
+	recstate->base_slot = NULL;
+	recstate->recSlot = NULL;
+	recstate->newUser = true;
+	recstate->useratt = -1;
+	recstate->itematt = -1;
+	recstate->eventatt = -1;
+
+	/* This still counts as a query on the recommender. */
+	logUserQueries(attributes->recIndexName, attributes->userIDList);
+
+	recstate->initialized = true;
+}
+
+/*
+ * qualUsesOnly
+ *
+ * Does the scan filter on nothing but the user, and, if allowScore,
+ * the score?
+ */
+static bool
+qualUsesOnly(RecScanState *recstate, RecScan *node, bool allowScore)
+{
+	AttributeInfo *attributes;
+	TupleDesc	tupdesc;
+	List	   *vars;
+	ListCell   *lc;
+	bool		covered = true;
 
-		/* Lastly, initialize the attributes->userID. */
-		attributes->userID = recstate->userList[0] - 1;
+	attributes = (AttributeInfo *) recstate->attributes;
+	tupdesc = RelationGetDescr(recstate->ss.ss_currentRelation);
+	vars = pull_var_clause((Node *) node->scan.plan.qual,
+						   PVC_RECURSE_AGGREGATES,
+						   PVC_RECURSE_PLACEHOLDERS);
+	foreach(lc, vars)
+	{
+		Var		   *var = (Var *) lfirst(lc);
+		char	   *attname;
+
+		if (var->varattno <= 0 || var->varattno > tupdesc->natts)
+		{
+			covered = false;
+			break;
+		}
+		attname = NameStr(tupdesc->attrs[var->varattno - 1]->attname);
+		if (strcmp(attname, attributes->userkey) != 0 &&
+			(!allowScore || strcmp(attname, attributes->eventval) != 0))
+		{
+			covered = false;
+			break;
+		}
 	}
+	list_free(vars);
+	return covered;
+}
 
-	/* Next, we need a full list of all the items in the rating table. This will tell
-	 * us what items to generate ratings for. */
-	if ((attributes->opType != OP_GENERATE && attributes->opType != OP_GENERATEJOIN) ||
-	    attributes->method == userCosCF ||
-	    attributes->method == userPearCF) {
-		sprintf(querystring,"select count(distinct %s) from %s;",
-			attributes->itemkey,attributes->eventtable);
-		queryDesc = recathon_queryStart(querystring,&recathoncontext);
-		planstate = queryDesc->planstate;
-		hslot = ExecProcNode(planstate);
-		recstate->fullTotalItems = getTupleInt(hslot,"count");
-		recathon_queryEnd(queryDesc,recathoncontext);
+/*
+ * recSplitQuals
+ *
+ * Takes the conditions on the item ID and the score out of the scan's
+ * quals, so we can check them ourselves against the item list and the
+ * scores, without building a tuple for ExecQual. That covers comparing
+ * either one with a constant, and an item ID = ANY of a constant array,
+ * which is what IN lists turn into. Items that fail are never scored,
+ * and a score that fails is dropped as soon as it's worked out; the
+ * rest of the quals still go through ExecQual. A RecJoin gets its
+ * items from the other side of the join, so all its quals are left to
+ * ExecQual. The RecView and the result cache run the full quals too.
+ */
+static void
+recSplitQuals(RecScanState *recstate, RecScan *node)
+{
+	AttributeInfo *attributes = (AttributeInfo *) recstate->attributes;
+	TupleDesc	tupdesc = RelationGetDescr(recstate->ss.ss_currentRelation);
+	List	   *qual = recstate->subscan->ps.qual;
+	AttrNumber	itemattno = InvalidAttrNumber;
+	AttrNumber	scoreattno = InvalidAttrNumber;
+	ListCell   *lc;
+	int			i;
+
+	recstate->scanQual = qual;
+	recstate->itemBounded = false;
+	recstate->itemMin = INT_MIN;
+	recstate->itemMax = INT_MAX;
+	recstate->numItemSet = 0;
+	recstate->itemSet = NULL;
+	recstate->itemQualPass = NULL;
+	recstate->scoreBounded = false;
+	recstate->scoreHasMin = false;
+	recstate->scoreHasMax = false;
+	if (attributes->opType != OP_FILTER && attributes->opType != OP_GENERATE)
+		return;
+
+	for (i = 0; i < tupdesc->natts; i++)
+	{
+		char	   *attname = NameStr(tupdesc->attrs[i]->attname);
 
-		/* In the event that there are no item IDs, we can't do anything. */
-		if (recstate->fullTotalItems <= 0)
-			elog(ERROR, "no items found, cannot predict ratings");
+		if (strcmp(attname, attributes->itemkey) == 0)
+			itemattno = i + 1;
+		else if (strcmp(attname, attributes->eventval) == 0)
+			scoreattno = i + 1;
+	}
 
-		recstate->fullItemList = (int*) palloc(recstate->fullTotalItems*sizeof(int));
-		recstate->fullItemNum = 0;
+	recstate->scanQual = NIL;
+	foreach(lc, qual)
+	{
+		ExprState  *clause = (ExprState *) lfirst(lc);
 
-		/* Now for the actual query. */
-		sprintf(querystring,"select distinct %s from %s order by %s;",
-			attributes->itemkey,attributes->eventtable,attributes->itemkey);
-		queryDesc = recathon_queryStart(querystring,&recathoncontext);
-		planstate = queryDesc->planstate;
+		if (!recTakeQual(recstate, clause->expr, node->scan.scanrelid,
+						 itemattno, scoreattno))
+			recstate->scanQual = lappend(recstate->scanQual, clause);
+	}
+}
 
-		i = 0;
-		for (;;) {
-			int currentItem;
+/*
+ * recQualConstInt
+ *
+ * Reads an integer constant, if it is one.
+ */
+static bool
+recQualConstInt(Const *con, int64 *value)
+{
+	switch (con->consttype)
+	{
+		case INT2OID:
+			*value = DatumGetInt16(con->constvalue);
+			return true;
+		case INT4OID:
+			*value = DatumGetInt32(con->constvalue);
+			return true;
+		case INT8OID:
+			*value = DatumGetInt64(con->constvalue);
+			return true;
+		default:
+			return false;
+	}
+}
 
-			hslot = ExecProcNode(planstate);
-			if (TupIsNull(hslot)) break;
+/*
+ * recScoreCompare
+ *
+ * Compares two scores the way the float comparison operators do, with
+ * NaN above everything else.
+ */
+static int
+recScoreCompare(double a, double b)
+{
+	if (isnan(a))
+		return isnan(b) ? 0 : 1;
+	if (isnan(b))
+		return -1;
+	return (a > b) ? 1 : ((a < b) ? -1 : 0);
+}
 
-			currentItem = getTupleInt(hslot,attributes->itemkey);
+/*
+ * recTakeQual
+ *
+ * If a qual is one recSplitQuals can check for itself, adds it to the
+ * bounds on the item ID or the score, and returns true.
+ */
+static bool
+recTakeQual(RecScanState *recstate, Expr *expr, Index varno,
+			AttrNumber itemattno, AttrNumber scoreattno)
+{
+	AttributeInfo *attributes = (AttributeInfo *) recstate->attributes;
+	Node	   *left, *right;
+	Var		   *var;
+	Const	   *con;
+	int			strategy;
 
-			recstate->fullItemList[i] = currentItem;
-			i++;
-			if (i >= recstate->fullTotalItems) break;
-		}
-		recathon_queryEnd(queryDesc,recathoncontext);
+	if (IsA(expr, ScalarArrayOpExpr))
+	{
+		ScalarArrayOpExpr *saop = (ScalarArrayOpExpr *) expr;
+		ArrayType  *array;
+		Datum	   *elems;
+		bool	   *nulls;
+		int16		elmlen;
+		bool		elmbyval;
+		char		elmalign;
+		int			numElems, numIDs, i, j;
+		int		   *IDs;
+
+		left = (Node *) linitial(saop->args);
+		right = (Node *) lsecond(saop->args);
+		if (!saop->useOr || !IsA(left, Var) || !IsA(right, Const))
+			return false;
+		var = (Var *) left;
+		con = (Const *) right;
+		if (var->varno != varno || var->varlevelsup != 0 ||
+			var->varattno != itemattno || var->vartype != INT4OID ||
+			con->constisnull)
+			return false;
+		if (get_op_opfamily_strategy(saop->opno, INTEGER_BTREE_FAM_OID) !=
+			BTEqualStrategyNumber)
+			return false;
+
+		array = DatumGetArrayTypeP(con->constvalue);
+		if (ARR_ELEMTYPE(array) != INT2OID && ARR_ELEMTYPE(array) != INT4OID &&
+			ARR_ELEMTYPE(array) != INT8OID)
+			return false;
+		get_typlenbyvalalign(ARR_ELEMTYPE(array), &elmlen, &elmbyval, &elmalign);
+		deconstruct_array(array, ARR_ELEMTYPE(array), elmlen, elmbyval, elmalign,
+						  &elems, &nulls, &numElems);
+
+		/* A null never equals anything, nor does an ID out of range. */
+		IDs = (int *) palloc(Max(numElems, 1) * sizeof(int));
+		numIDs = 0;
+		for (i = 0; i < numElems; i++)
+		{
+			int64		value;
 
-		/* Quick error protection. */
-		recstate->fullTotalItems = i;
-		if (recstate->fullTotalItems <= 0)
-			elog(ERROR, "no items found, cannot predict ratings");
+			if (nulls[i])
+				continue;
+			if (ARR_ELEMTYPE(array) == INT2OID)
+				value = DatumGetInt16(elems[i]);
+			else if (ARR_ELEMTYPE(array) == INT4OID)
+				value = DatumGetInt32(elems[i]);
+			else
+				value = DatumGetInt64(elems[i]);
+			if (value >= INT_MIN && value <= INT_MAX)
+				IDs[numIDs++] = (int) value;
+		}
+		qsort(IDs, numIDs, sizeof(int), intCompare);
+		for (i = 0, j = 0; i < numIDs; i++)
+			if (j == 0 || IDs[j - 1] != IDs[i])
+				IDs[j++] = IDs[i];
+		numIDs = j;
+
+		/* With more than one list, only what's in all of them counts. */
+		if (recstate->itemSet)
+		{
+			for (i = 0, j = 0; i < numIDs; i++)
+				if (binarySearch(recstate->itemSet, IDs[i], 0, recstate->numItemSet) >= 0)
+					IDs[j++] = IDs[i];
+			numIDs = j;
+			pfree(recstate->itemSet);
+		}
+		recstate->itemSet = IDs;
+		recstate->numItemSet = numIDs;
+		recstate->itemBounded = true;
+		return true;
 	}
 
-	recstate->finished = false;
-	recstate->base_slot = NULL;
-	recstate->newUser = true;
-	recstate->useratt = -1;
-	recstate->itematt = -1;
-	recstate->eventatt = -1;
-
-	/* Initialize certain structures to NULL. */
-	recstate->ratedTable = NULL;
-	recstate->pendingTable = NULL;
-	recstate->simTable = NULL;
-	recstate->userFeatures = NULL;
-
-	/* In case we don't have a pre-built recommender, we need to assemble
-	 * the appropriate structures now. */
-	recstate->itemCFmodel = NULL;
-	recstate->userCFmodel = NULL;
-	recstate->SVDusermodel = NULL;
-	recstate->SVDitemmodel = NULL;
+	if (!IsA(expr, OpExpr) || list_length(((OpExpr *) expr)->args) != 2)
+		return false;
+	left = (Node *) linitial(((OpExpr *) expr)->args);
+	right = (Node *) lsecond(((OpExpr *) expr)->args);
+	if (IsA(left, Var) && IsA(right, Const))
+	{
+		var = (Var *) left;
+		con = (Const *) right;
+	}
+	else if (IsA(right, Var) && IsA(left, Const))
+	{
+		var = (Var *) right;
+		con = (Const *) left;
+	}
+	else
+		return false;
+	if (var->varno != varno || var->varlevelsup != 0 || con->constisnull)
+		return false;
 
-	if (attributes->opType == OP_GENERATE || attributes->opType == OP_GENERATEJOIN) {
-		switch (attributes->method) {
-			case itemPearCF:
-				generateItemPearModel(recstate);
+	if (var->varattno == itemattno && var->vartype == INT4OID)
+	{
+		int64		value;
+
+		strategy = get_op_opfamily_strategy(((OpExpr *) expr)->opno,
+											INTEGER_BTREE_FAM_OID);
+		if (strategy == 0 || !recQualConstInt(con, &value))
+			return false;
+		if ((Node *) var == right)
+			strategy = BTCommuteStrategyNumber(strategy);
+
+		/* The range stays within int4, so stepping past an end
+		 * can't overflow. */
+		switch (strategy)
+		{
+			case BTLessStrategyNumber:
+				if (value <= recstate->itemMin)
+					recstate->itemMax = recstate->itemMin - 1;
+				else
+					recstate->itemMax = Min(recstate->itemMax, value - 1);
 				break;
-			case userCosCF:
-				generateUserCosModel(recstate);
+			case BTLessEqualStrategyNumber:
+				recstate->itemMax = Min(recstate->itemMax, value);
 				break;
-			case userPearCF:
-				generateUserPearModel(recstate);
+			case BTEqualStrategyNumber:
+				recstate->itemMin = Max(recstate->itemMin, value);
+				recstate->itemMax = Min(recstate->itemMax, value);
 				break;
-			case SVD:
-				generateSVDmodel(recstate);
+			case BTGreaterEqualStrategyNumber:
+				recstate->itemMin = Max(recstate->itemMin, value);
 				break;
-			/* The default case is itemCosCF. There shouldn't actually
-			 * be a possibility of "default", but just in case. */
-			case itemCosCF:
-			default:
-				generateItemCosModel(recstate);
+			case BTGreaterStrategyNumber:
+				if (value >= recstate->itemMax)
+					recstate->itemMin = recstate->itemMax + 1;
+				else
+					recstate->itemMin = Max(recstate->itemMin, value + 1);
 				break;
 		}
+		recstate->itemBounded = true;
+		return true;
+	}
+
+	/* The score is only there to check if it's worked out first. */
+	if (var->varattno == scoreattno && var->vartype == FLOAT4OID &&
+		attributes->noFilter)
+	{
+		double		value;
+		bool		tighter;
+
+		strategy = get_op_opfamily_strategy(((OpExpr *) expr)->opno,
+											FLOAT_BTREE_FAM_OID);
+		if (con->consttype == FLOAT4OID)
+			value = DatumGetFloat4(con->constvalue);
+		else if (con->consttype == FLOAT8OID)
+			value = DatumGetFloat8(con->constvalue);
+		else
+			return false;
+		if (strategy == 0)
+			return false;
+		if ((Node *) var == right)
+			strategy = BTCommuteStrategyNumber(strategy);
+
+		if (strategy == BTGreaterStrategyNumber ||
+			strategy == BTGreaterEqualStrategyNumber ||
+			strategy == BTEqualStrategyNumber)
+		{
+			bool		strict = (strategy == BTGreaterStrategyNumber);
+			int			cmp = recstate->scoreHasMin ?
+				recScoreCompare(value, recstate->scoreMin) : 1;
+
+			tighter = cmp > 0 || (cmp == 0 && strict);
+			if (tighter)
+			{
+				recstate->scoreMin = value;
+				recstate->scoreMinStrict = strict;
+				recstate->scoreHasMin = true;
+			}
+		}
+		if (strategy == BTLessStrategyNumber ||
+			strategy == BTLessEqualStrategyNumber ||
+			strategy == BTEqualStrategyNumber)
+		{
+			bool		strict = (strategy == BTLessStrategyNumber);
+			int			cmp = recstate->scoreHasMax ?
+				recScoreCompare(value, recstate->scoreMax) : -1;
+
+			tighter = cmp < 0 || (cmp == 0 && strict);
+			if (tighter)
+			{
+				recstate->scoreMax = value;
+				recstate->scoreMaxStrict = strict;
+				recstate->scoreHasMax = true;
+			}
+		}
+		recstate->scoreBounded = true;
+		return true;
+	}
+
+	return false;
+}
+
+/*
+ * InitializeItemQuals
+ *
+ * Works out which items meet the conditions recSplitQuals took on
+ * the item ID, once the item list is settled, and leaves the others
+ * out of the items we score, as loadItemCandidates does for a
+ * subquery. A recommender with active_items never recommends the
+ * items outside its active set, so they're left out the same way.
+ */
+static void
+InitializeItemQuals(RecScanState *recstate)
+{
+	AttributeInfo *attributes = (AttributeInfo *) recstate->attributes;
+	int			i, numCandidates, numActive;
+	int		   *activeIDs;
+
+	if (!recstate->fullItemList)
+		return;
+
+	numActive = -1;
+	activeIDs = NULL;
+	if (attributes->recIndexName &&
+		attributes->opType != OP_GENERATE && attributes->opType != OP_GENERATEJOIN)
+		numActive = loadActiveItems(attributes->recIndexName, &activeIDs);
+	if (!recstate->itemBounded && numActive < 0)
+		return;
+
+	recstate->itemQualPass = (bool *) palloc(Max(recstate->fullTotalItems, 1) * sizeof(bool));
+	for (i = 0; i < recstate->fullTotalItems; i++)
+	{
+		int			itemID = recstate->fullItemList[i];
+
+		recstate->itemQualPass[i] = (!recstate->itemBounded ||
+			(itemID >= recstate->itemMin &&
+			 itemID <= recstate->itemMax &&
+			 (!recstate->itemSet ||
+			  binarySearch(recstate->itemSet, itemID, 0, recstate->numItemSet) >= 0))) &&
+			(numActive < 0 ||
+			 binarySearch(activeIDs, itemID, 0, numActive) >= 0);
 	}
+	if (activeIDs)
+		pfree(activeIDs);
 
-	/* We also need to increase the query counter for this particular table,
-	 * if it exists already. If this was on-the-fly, forget it. Also don't do it if our
-	 * recommender was never initialized. */
-	if (attributes->recIndexName) {
-		char *querystring = (char*) palloc(1024*sizeof(char));
-		sprintf(querystring,"update %s set querycounter = querycounter+1;",attributes->recIndexName);
-		recathon_queryExecute(querystring);
-		pfree(querystring);
+	if (!recstate->itemCandidates)
+	{
+		recstate->itemCandidates = (int *) palloc(Max(recstate->fullTotalItems, 1) * sizeof(int));
+		for (i = 0; i < recstate->fullTotalItems; i++)
+			recstate->itemCandidates[i] = i;
+		recstate->numCandidates = recstate->fullTotalItems;
 	}
+	numCandidates = 0;
+	for (i = 0; i < recstate->numCandidates; i++)
+		if (recstate->itemQualPass[recstate->itemCandidates[i]])
+			recstate->itemCandidates[numCandidates++] = recstate->itemCandidates[i];
+	recstate->numCandidates = numCandidates;
+}
 
-	/* Lastly, mark this as initialized. */
-	recstate->initialized = true;
+/*
+ * recItemPasses
+ *
+ * Does the item at this index in fullItemList meet the conditions on
+ * the item ID? Most that don't are never candidates, but a user with
+ * no events of their own may be scored on every item.
+ */
+static bool
+recItemPasses(RecScanState *recnode, int itemindex)
+{
+	return !recnode->itemQualPass ||
+		(itemindex >= 0 && recnode->itemQualPass[itemindex]);
+}
+
+/*
+ * recScorePasses
+ *
+ * Does the score in the slot meet the bounds the quals put on it?
+ */
+static bool
+recScorePasses(RecScanState *recnode, TupleTableSlot *slot)
+{
+	double		score;
+	int			cmp;
+
+	if (!recnode->scoreBounded)
+		return true;
+
+	score = DatumGetFloat4(slot->tts_values[recnode->eventatt]);
+	if (recnode->scoreHasMin)
+	{
+		cmp = recScoreCompare(score, recnode->scoreMin);
+		if (cmp < 0 || (cmp == 0 && recnode->scoreMinStrict))
+			return false;
+	}
+	if (recnode->scoreHasMax)
+	{
+		cmp = recScoreCompare(score, recnode->scoreMax);
+		if (cmp > 0 || (cmp == 0 && recnode->scoreMaxStrict))
+			return false;
+	}
+	return true;
+}
+
+/*
+ * recViewCovers
+ *
+ * Decides whether a query can be answered from the recommender's
+ * RecView. The view only holds the best few predictions for each
+ * user, and none they've rated, so the query has to name its users,
+ * want no more than that many of the best for each, leave out the
+ * rated ones too, and filter on nothing but the user and the score.
+ * A filter on anything else could pass over everything the view
+ * holds for a user, and want items that aren't there.
+ */
+static bool
+recViewCovers(RecScanState *recstate, RecScan *node)
+{
+	AttributeInfo *attributes;
+
+	attributes = (AttributeInfo *) recstate->attributes;
+	if (attributes->opType != OP_FILTER || !attributes->recIndexName ||
+		!attributes->recViewName || attributes->userIDList == NIL)
+		return false;
+	/* The view's best items needn't be any of the ones asked for,
+	 * and they're only the best by its own method. */
+	if (attributes->itemWhereQuery || attributes->ensemble != NIL ||
+		attributes->candidates)
+		return false;
+	if (node->topK <= 0 || !node->topKDescending)
+		return false;
+	/* The view leaves out what each user has rated. */
+	if (!recstate->excludeRated)
+		return false;
+	if (!qualUsesOnly(recstate, node, true))
+		return false;
+
+	recstate->viewSize = getRecViewSize(attributes->recIndexName);
+	return node->topK <= recstate->viewSize;
+}
+
+/*
+ * shardsCover
+ *
+ * Decides whether other nodes should answer the query, which they do
+ * for a recommender built with serve_nodes. Each node answers with
+ * recathon_recommend_batch, which gives a user's best few, leaving out
+ * what they've rated, so the query has to want just that, and filter
+ * on nothing but the user; a filter on the score could want more of
+ * them than the node sends. The users can be named or not.
+ */
+static bool
+shardsCover(RecScanState *recstate, RecScan *node)
+{
+	AttributeInfo *attributes;
+
+	attributes = (AttributeInfo *) recstate->attributes;
+	if (attributes->opType != OP_FILTER || !attributes->recIndexName ||
+		attributes->itemWhereQuery || attributes->ensemble != NIL ||
+		attributes->candidates)
+		return false;
+	if (node->topK <= 0 || !node->topKDescending || !recstate->excludeRated)
+		return false;
+	if (!qualUsesOnly(recstate, node, false))
+		return false;
+
+	recstate->serveNodes = getRecServeNodes(attributes->recIndexName);
+	return recstate->serveNodes != NULL;
+}
+
+/*
+ * resultCacheLookup
+ *
+ * Looks for the answer to a query in the result cache. The cache holds
+ * a user's best predictions from one build of the models, so the query
+ * has to be for one user, want no more than the list holds, and filter
+ * on nothing but the user; even a filter on the score could want
+ * predictions that weren't good enough to keep. On a hit, the list is
+ * copied out for ExecIndexRecommend. On a miss, if the query could have
+ * been answered, ExecTopKRecommend stores its answer for next time.
+ */
+static void
+resultCacheLookup(RecScanState *recstate, RecScan *node)
+{
+	AttributeInfo *attributes;
+	int			count;
+
+	recstate->useResultCache = false;
+	recstate->storeResults = false;
+
+	attributes = (AttributeInfo *) recstate->attributes;
+	if (!recathonResultCacheEnabled() ||
+		attributes->opType != OP_FILTER || !attributes->recIndexName ||
+		list_length(attributes->userIDList) != 1 || attributes->itemWhereQuery ||
+		attributes->ensemble != NIL || attributes->candidates)
+		return;
+	if (node->topK <= 0 || node->topK > RECATHON_RESULT_LENGTH ||
+		!node->topKDescending || !recstate->excludeRated)
+		return;
+	if (!qualUsesOnly(recstate, node, false))
+		return;
+
+	/* Without a version, a rebuild couldn't be told apart. */
+	recstate->resultVersion = modelVersion(attributes->recIndexName);
+	if (recstate->resultVersion == 0)
+		return;
+
+	recstate->viewItems = (int *) palloc(RECATHON_RESULT_LENGTH * sizeof(int));
+	recstate->viewScores = (float *) palloc(RECATHON_RESULT_LENGTH * sizeof(float));
+	count = recathonResultLookup(attributes->recIndexName,
+		linitial_int(attributes->userIDList), recstate->resultVersion,
+		node->topK, recstate->viewItems, recstate->viewScores,
+		&recstate->resultGeneration);
+	if (count >= 0)
+	{
+		recstate->useResultCache = true;
+		recstate->numCachedResults = count;
+		return;
+	}
+
+	pfree(recstate->viewItems);
+	pfree(recstate->viewScores);
+	recstate->viewItems = NULL;
+	recstate->viewScores = NULL;
+	recstate->storeResults = true;
+}
+
+/*
+ * arrayUserIDs
+ *
+ * The user IDs in an integer array parameter, for bindUserParams.
+ */
+static List *
+arrayUserIDs(ArrayType *array)
+{
+	List	   *IDs = NIL;
+	Datum	   *elems;
+	bool	   *nulls;
+	int			nelems, i;
+
+	deconstruct_array(array, INT4OID, sizeof(int32), true, 'i',
+					  &elems, &nulls, &nelems);
+	for (i = 0; i < nelems; i++)
+	{
+		if (!nulls[i])
+			IDs = lappend_int(IDs, DatumGetInt32(elems[i]));
+	}
+	pfree(elems);
+	pfree(nulls);
+	return IDs;
+}
+
+/*
+ * bindUserParams
+ *
+ * A prepared statement whose WHERE clause pins the user key to
+ * parameters gets the users they stand for this time around. A
+ * parameter can also be an array of them, for userkey = ANY($n); its
+ * NULL elements can't match anyone, so they're skipped. We return NIL
+ * if any parameter is NULL or isn't an integer, which leaves the user
+ * WHERE clause to sort it out as usual.
+ */
+static List *
+bindUserParams(List *paramList, ParamListInfo params)
+{
+	List	   *IDs = NIL;
+	ListCell   *lc;
+
+	foreach(lc, paramList)
+	{
+		int			paramno = lfirst_int(lc);
+		ParamExternData *prm;
+
+		if (!params || paramno <= 0 || paramno > params->numParams)
+			break;
+		prm = &params->params[paramno - 1];
+		if (!OidIsValid(prm->ptype) && params->paramFetch != NULL)
+			(*params->paramFetch) (params, paramno);
+		if (prm->isnull)
+			break;
+
+		switch (prm->ptype)
+		{
+			case INT2OID:
+				IDs = lappend_int(IDs, (int) DatumGetInt16(prm->value));
+				continue;
+			case INT4OID:
+				IDs = lappend_int(IDs, (int) DatumGetInt32(prm->value));
+				continue;
+			case INT8OID:
+				IDs = lappend_int(IDs, (int) DatumGetInt64(prm->value));
+				continue;
+			case INT4ARRAYOID:
+				IDs = list_concat(IDs, arrayUserIDs(DatumGetArrayTypeP(prm->value)));
+				continue;
+			default:
+				break;
+		}
+		break;
+	}
+
+	if (lc != NULL)
+	{
+		list_free(IDs);
+		return NIL;
+	}
+	return IDs;
 }
 
 /*
@@ -888,56 +3426,152 @@ ExecInitRecScan(RecScan *node, EState *estate, int eflags)
 	recstate->attributes = (Node*) ((RecommendInfo*)node->recommender)->attributes;
 	attributes = (AttributeInfo *) recstate->attributes;
 
+	/* If the users come from parameters or a subquery, this execution
+	 * gets its own copy of the attributes naming them, since the plan
+	 * may be run again with others. From there on they're treated just
+	 * like users the query named outright. The subquery waits until
+	 * we initialize the recommender, so EXPLAIN doesn't run it. */
+	if (attributes->userParamList != NIL || attributes->userWhereQuery)
+	{
+		attributes = (AttributeInfo *) copyObject(attributes);
+		recstate->attributes = (Node *) attributes;
+	}
+	if (attributes->userParamList != NIL)
+	{
+		ListCell   *lc;
+
+		attributes->userIDList = bindUserParams(attributes->userParamList,
+												estate->es_param_list_info);
+		foreach(lc, attributes->ensemble)
+		{
+			AttributeInfo *member = (AttributeInfo *) lfirst(lc);
+
+			member->userIDList = list_copy(attributes->userIDList);
+		}
+		if (attributes->candidates)
+			attributes->candidates->userIDList = list_copy(attributes->userIDList);
+	}
+	TRACE_POSTGRESQL_RECOMMEND_START(recTraceName(attributes), attributes->method);
+
 	/* Mark this recommender as NOT initialized. We're moving a lot of time-consuming
 	 * stuff out of Init and into Execute, to make EXPLAIN go faster. */
 	recstate->initialized = false;
 
-	/* Next we need to prep our user WHERE clause. */
+	/* What the recommender builds and loads is kept apart, so
+	 * EXPLAIN ANALYZE can say how much of it there was. */
+	recstate->recContext = AllocSetContextCreate(CurrentMemoryContext,
+						"RecScan",
+						ALLOCSET_DEFAULT_MINSIZE,
+						ALLOCSET_DEFAULT_INITSIZE,
+						ALLOCSET_DEFAULT_MAXSIZE);
+	recstate->peakSpace = 0;
+	recstate->buildHandle = -1;
+	INSTR_TIME_SET_ZERO(recstate->initTime);
+	INSTR_TIME_SET_ZERO(recstate->prepTime);
+	INSTR_TIME_SET_ZERO(recstate->scoreTime);
+	recstate->usersScored = 0;
+	recstate->itemsScored = 0;
+	recstate->internalQueries = 0;
+	INSTR_TIME_SET_CURRENT(recstate->startTime);
+	recstate->trackLatency = recathon_track_latency &&
+		attributes->recIndexName != NULL;
+
+	/* Only a query for the best few can make do with what it has
+	 * found, so only those get a time budget. */
+	recstate->timeBudget = (node->topK > 0) ? recathon_time_budget * 1000L : 0;
+	recstate->budgetTicks = 0;
+	recstate->timedOut = false;
+
+	/* We decide on a parallel scan once we know the users. */
+	recstate->parallelTried = false;
+	recstate->parallelWorker = false;
+	recstate->deferUser = false;
+	recstate->workers = NULL;
+
+	/* The scoring strategy is picked with the model. */
+	recstate->strategy = NULL;
+	recstate->batchScoring = false;
+	recstate->batchStart = 0;
+	recstate->batchCount = 0;
+	recstate->batchItems = NULL;
+	recstate->batchScores = NULL;
+	recstate->batchSurvivors = NULL;
+	recstate->batchNumSurvivors = -1;
+
+	/* Users with no events are ranked by popularity, which is
+	 * only read if one comes up. */
+	recstate->coldStart = false;
+	recstate->popularChecked = false;
+	recstate->popularScores = NULL;
+	recstate->ensemble = NIL;
+	recstate->candidateSource = NULL;
+	recstate->numBaseCandidates = 0;
+	recstate->baseCandidates = NULL;
+
+	/* Next we need to prep our user WHERE clause, and see which
+	 * of the rest we can check for ourselves. */
 	recstate->userqual = (List *)
 		ExecInitExpr((Expr *) attributes->userWhereClause, NULL);
-
-	/* Code for a future version of RecDB. */
-/*	switch(attributes->cellType) {
+	recSplitQuals(recstate, node);
+
+	/* The planner may have told us only the best few tuples are
+	 * needed. */
+	recstate->topK = node->topK;
+	recstate->topKDescending = node->topKDescending;
+	recstate->topKDone = false;
+	recstate->ordered = node->ordered;
+
+	/* Items the user has rated already are left out if the query
+	 * says so, and by default when it only wants the best few, which
+	 * are hardly worth recommending again. */
+	recstate->excludeRated = attributes->excludeRated > 0 ||
+		(attributes->excludeRated < 0 && recstate->topK > 0);
+
+	/* A recommender that keeps enough of each user's best predictions
+	 * in its RecView can answer for a few users straight from there.
+	 * If only its heavy users are in it, anyone else turns up missing
+	 * when we load the view, and gets scored on demand. */
+	switch (attributes->cellType) {
 		case CELL_ALPHA:
-			{
-				char *heavystring;
-
-				heavystring = (char*) palloc(1024*sizeof(char));
-				sprintf(heavystring,"select userid from recathonheavyusers where userid = %d;",
-						attributes->userID);
-				queryDesc = recathon_queryStart(heavystring, &recathoncontext);
-				planstate = queryDesc->planstate;
-
-				hslot = ExecProcNode(planstate);
-				if (TupIsNull(hslot))
-					recstate->useRecView = false;
-				else
-					recstate->useRecView = true;
-
-				recathon_queryEnd(queryDesc, recathoncontext);
-				pfree(heavystring);
-			}
-
-			break;
 		case CELL_GAMMA:
-			recstate->useRecView = true;
+			recstate->useRecView = recViewCovers(recstate, node);
 			break;
 		case CELL_BETA:
 			recstate->useRecView = false;
 			break;
 		default:
 			elog(ERROR, "unrecognized cell type: %d",
-				(int) ((RecommendInfo*)node->recommender)->attributes->cellType);
+				(int) attributes->cellType);
 			break;
 	}
-*/
 
-	/* In the current version of Recathon, we will not be using
-	 * IndexRecommend at all.  */
-	if (attributes->opType == OP_INDEX)
-		recstate->useRecView = true;
-	else
-		recstate->useRecView = false;
+	/* Failing that, we may have answered for this user before. */
+	recstate->useResultCache = false;
+	recstate->storeResults = false;
+	if (!recstate->useRecView)
+		resultCacheLookup(recstate, node);
+
+	/* Otherwise, the recommender may be served by other nodes. */
+	recstate->useShards = false;
+	recstate->serveNodes = NULL;
+	recstate->shardStart = NULL;
+	if (!recstate->useRecView && !recstate->useResultCache)
+		recstate->useShards = shardsCover(recstate, node);
+
+	/* If it comes to scoring, an item-based query for the best few
+	 * that filters on nothing else but the user can stop looking at
+	 * each user's items once the rest can't beat what it has. That
+	 * only goes for its own scores, not those of an ensemble, and
+	 * not when another method picks the items. */
+	recstate->thresholdTopK = (!recstate->useRecView && !recstate->useResultCache &&
+		!recstate->useShards &&
+		attributes->opType == OP_FILTER && attributes->recIndexName &&
+		!attributes->itemWhereQuery && attributes->ensemble == NIL &&
+		!attributes->candidates &&
+		recstate->topK > 0 && recstate->topKDescending &&
+		(attributes->method == itemCosCF || attributes->method == itemPearCF ||
+		 attributes->method == itemJaccardCF) &&
+		qualUsesOnly(recstate, node, false));
 
 	return recstate;
 }
@@ -956,9 +3590,16 @@ ExecInitRecScan(RecScan *node, EState *estate, int eflags)
 TupleTableSlot *
 ExecRecScan(RecScanState *node)
 {
+	TupleTableSlot *slot;
+	long queries;
+
 	switch(nodeTag(node->subscan)) {
 		case T_SeqScanState:
-			return ExecSeqRecScan(node);
+			/* Count the queries we run to get this tuple. */
+			queries = recathon_query_count;
+			slot = ExecSeqRecScan(node);
+			node->internalQueries += recathon_query_count - queries;
+			return slot;
 		default:
 			elog(ERROR, "invalid RecScan subscan type: %d", (int) nodeTag(node->subscan));
 	}
@@ -973,6 +3614,42 @@ ExecRecScan(RecScanState *node)
 void
 ExecEndRecScan(RecScanState *node)
 {
+	ListCell *lc;
+	AttributeInfo *attributes = (AttributeInfo *) node->attributes;
+
+	/* If we stopped reading early, the workers are still going. */
+	recStopWorkers(node);
+	TRACE_POSTGRESQL_RECOMMEND_DONE(recTraceName(attributes),
+		node->usersScored, node->itemsScored);
+
+	/* A query that ran counts against its recommender, if it has one,
+	 * in the statistics collector. */
+	if (node->initialized && attributes->recIndexName) {
+		char statname[NAMEDATALEN];
+		instr_time elapsed;
+		Size space;
+
+		INSTR_TIME_SET_CURRENT(elapsed);
+		INSTR_TIME_SUBTRACT(elapsed, node->startTime);
+		space = Max(node->peakSpace, MemoryContextTotalSpace(node->recContext));
+		recathonStatName(attributes->recIndexName, statname);
+		pgstat_count_recommender_query(statname, node->itemsScored,
+			node->internalQueries, INSTR_TIME_GET_MICROSEC(elapsed), space);
+
+		/* And in its latency histograms, phase by phase. */
+		if (node->trackLatency)
+		{
+			recathonLatencyRecord(statname, RECATHON_LATENCY_QUERY,
+								  INSTR_TIME_GET_MICROSEC(elapsed));
+			recathonLatencyRecord(statname, RECATHON_LATENCY_INIT,
+								  INSTR_TIME_GET_MICROSEC(node->initTime));
+			recathonLatencyRecord(statname, RECATHON_LATENCY_PREP,
+								  INSTR_TIME_GET_MICROSEC(node->prepTime));
+			recathonLatencyRecord(statname, RECATHON_LATENCY_SCORE,
+								  INSTR_TIME_GET_MICROSEC(node->scoreTime));
+		}
+	}
+
 	/* End the normal scan. */
 	switch(nodeTag(node->subscan)) {
 		case T_SeqScanState:
@@ -984,11 +3661,119 @@ ExecEndRecScan(RecScanState *node)
 			break;
 	}
 
-	/* Now for extra stuff. */
-	if (node->fullItemList)
+	/* Now for extra stuff. Anything read from the model cache or a
+	 * model file is shared, so it stays where it is. */
+	if (node->fullItemList && !modelDataShared(node, node->fullItemList))
 		pfree(node->fullItemList);
 	if (node->userFeatures)
 		pfree(node->userFeatures);
+	if (node->SVDusermodel)
+		pfree(node->SVDusermodel);
+	if (node->SVDitemmodel && !modelDataShared(node, node->SVDitemmodel))
+		pfree(node->SVDitemmodel);
+	if (node->SVDitemHalf && !modelDataShared(node, node->SVDitemHalf))
+		pfree(node->SVDitemHalf);
+	if (node->clusterStart)
+		pfree(node->clusterStart);
+	if (node->clusterItems)
+		pfree(node->clusterItems);
+	if (node->clusterCentroids)
+		pfree(node->clusterCentroids);
+	if (node->itemCandidates)
+		pfree(node->itemCandidates);
+	if (node->baseCandidates)
+		pfree(node->baseCandidates);
+	if (node->batchItems)
+		pfree(node->batchItems);
+	if (node->batchScores)
+		pfree(node->batchScores);
+	if (node->batchSurvivors)
+		pfree(node->batchSurvivors);
+	if (node->popularScores)
+		pfree(node->popularScores);
+	if (node->viewItems)
+		pfree(node->viewItems);
+	if (node->viewScores)
+		pfree(node->viewScores);
+	if (node->topKSlot)
+		ExecDropSingleTupleTableSlot(node->topKSlot);
+	if (node->itemCFmodel) {
+		if (modelDataShared(node, node->itemCFmodel->rowStart)) {
+			if (node->itemCFmodel->rowBuf)
+				pfree(node->itemCFmodel->rowBuf);
+			pfree(node->itemCFmodel);
+		} else
+			sparseFree(node->itemCFmodel);
+	}
+	if (node->hotItemSim)
+		pfree(node->hotItemSim);
+	if (node->itemEvents)
+		sparseFree(node->itemEvents);
+	if (node->userEvents)
+		sparseFree(node->userEvents);
+	if (node->userEventIDs)
+		pfree(node->userEventIDs);
+	if (node->eventUsers)
+		pfree(node->eventUsers);
+	if (node->itemMap)
+		pfree(node->itemMap);
+	if (node->ratedItems)
+		pfree(node->ratedItems);
+	if (node->isRated)
+		pfree(node->isRated);
+	if (node->itemQualPass)
+		pfree(node->itemQualPass);
+	if (node->ratedScore)
+		pfree(node->ratedScore);
+	if (node->pendingScore)
+		pfree(node->pendingScore);
+	if (node->pendingSim)
+		pfree(node->pendingSim);
+	if (node->userSim)
+		pfree(node->userSim);
+	if (node->neighbors)
+		pfree(node->neighbors);
+	if (node->recSlot)
+		ExecDropSingleTupleTableSlot(node->recSlot);
 	if (node->base_slot)
 		FreeTupleDesc(node->base_slot);
+
+	/* We're done reading from the model cache and the model file, as
+	 * are the other methods of an ensemble and the one picking the
+	 * candidates, and any models we generated are about to go. Everything
+	 * else they have is in our context. */
+	foreach(lc, node->cachePins)
+		recathonCacheRelease(lfirst_int(lc));
+	list_free(node->cachePins);
+	node->cachePins = NIL;
+	closeModelFile(node->modelFile);
+	node->modelFile = NULL;
+	closeScanProbes(node);
+	recathonBuildRelease(node->buildHandle);
+	node->buildHandle = -1;
+	foreach(lc, node->ensemble)
+	{
+		RecScanState *member = (RecScanState *) lfirst(lc);
+		ListCell   *pc;
+
+		foreach(pc, member->cachePins)
+			recathonCacheRelease(lfirst_int(pc));
+		closeModelFile(member->modelFile);
+		closeScanProbes(member);
+		recathonBuildRelease(member->buildHandle);
+	}
+	node->ensemble = NIL;
+	if (node->candidateSource)
+	{
+		foreach(lc, node->candidateSource->cachePins)
+			recathonCacheRelease(lfirst_int(lc));
+		closeModelFile(node->candidateSource->modelFile);
+		closeScanProbes(node->candidateSource);
+		recathonBuildRelease(node->candidateSource->buildHandle);
+		node->candidateSource = NULL;
+	}
+
+	/* And anything else the recommender kept goes with its context. */
+	MemoryContextDelete(node->recContext);
+	node->recContext = NULL;
 }
@@ -91,6 +91,7 @@
 #include "parser/parse_coerce.h"
 #include "utils/acl.h"
 #include "utils/builtins.h"
+#include "utils/fmgroids.h"
 #include "utils/lsyscache.h"
 #include "utils/memutils.h"
 #include "utils/syscache.h"
@@ -202,6 +203,22 @@ typedef struct AggStatePerAggData
 	 */
 
 	Tuplesortstate *sortstate;	/* sort object, if DISTINCT or ORDER BY */
+
+	/*
+	 * A DISTINCT aggregate with a single input whose result doesn't depend
+	 * on the order of its input (just count(DISTINCT x) for now) is instead
+	 * fed into a hash table of the distinct values seen so far, and the
+	 * transition function is run once per entry at the end of the group.
+	 * If the table outgrows work_mem, its contents are moved into a sort
+	 * object and we carry on as above.  distincthash is NULL whenever the
+	 * sort object is in use.
+	 */
+	bool		hashDistinct;	/* try hashing before sorting? */
+	FmgrInfo   *hashEqualfns;	/* equality functions for distincthash */
+	FmgrInfo   *hashfns;		/* hash functions for distincthash */
+	MemoryContext distinctcontext;	/* holds distincthash and its entries */
+	TupleHashTable distincthash;	/* distinct values so far, or NULL */
+	long		distinctAdded;	/* entries added since last size check */
 }	AggStatePerAggData;
 
 /*
@@ -236,6 +253,13 @@ typedef struct AggStatePerGroupData
 	 */
 } AggStatePerGroupData;
 
+/*
+ * How many new entries to add to a DISTINCT aggregate's hash table between
+ * checks of its size against work_mem; walking the memory contexts on every
+ * insertion would cost more than the hashing saves.
+ */
+#define DISTINCT_HASH_CHECK_INTERVAL	1024
+
 /*
  * To implement hashed aggregation, we need a hashtable that stores a
  * representative tuple and an array of AggStatePerGroup structs for each
@@ -260,6 +284,11 @@ static void advance_transition_function(AggState *aggstate,
 							AggStatePerGroup pergroupstate,
 							FunctionCallInfoData *fcinfo);
 static void advance_aggregates(AggState *aggstate, AggStatePerGroup pergroup);
+static void begin_distinct_sort(AggStatePerAgg peraggstate);
+static void spill_distinct_hash(AggState *aggstate, AggStatePerAgg peraggstate);
+static void process_distinct_hash(AggState *aggstate,
+					  AggStatePerAgg peraggstate,
+					  AggStatePerGroup pergroupstate);
 static void process_ordered_aggregate_single(AggState *aggstate,
 								 AggStatePerAgg peraggstate,
 								 AggStatePerGroup pergroupstate);
@@ -309,26 +338,28 @@ initialize_aggregates(AggState *aggstate,
 			 */
 			if (peraggstate->sortstate)
 				tuplesort_end(peraggstate->sortstate);
+			peraggstate->sortstate = NULL;
 
-			/*
-			 * We use a plain Datum sorter when there's a single input column;
-			 * otherwise sort the full tuple.  (See comments for
-			 * process_ordered_aggregate_single.)
-			 */
-			peraggstate->sortstate =
-				(peraggstate->numInputs == 1) ?
-				tuplesort_begin_datum(peraggstate->evaldesc->attrs[0]->atttypid,
-									  peraggstate->sortOperators[0],
-									  peraggstate->sortCollations[0],
-									  peraggstate->sortNullsFirst[0],
-									  work_mem, false) :
-				tuplesort_begin_heap(peraggstate->evaldesc,
-									 peraggstate->numSortCols,
-									 peraggstate->sortColIdx,
-									 peraggstate->sortOperators,
-									 peraggstate->sortCollations,
-									 peraggstate->sortNullsFirst,
-									 work_mem, false);
+			if (peraggstate->hashDistinct)
+			{
+				/*
+				 * Likewise throw away whatever a previous group left in the
+				 * hash table, and start collecting values in a new one.
+				 */
+				MemoryContextResetAndDeleteChildren(peraggstate->distinctcontext);
+				peraggstate->distincthash =
+					BuildTupleHashTable(1,
+										peraggstate->sortColIdx,
+										peraggstate->hashEqualfns,
+										peraggstate->hashfns,
+										1024,
+										sizeof(TupleHashEntryData),
+										peraggstate->distinctcontext,
+										aggstate->tmpcontext->ecxt_per_tuple_memory);
+				peraggstate->distinctAdded = 0;
+			}
+			else
+				begin_distinct_sort(peraggstate);
 		}
 
 		/*
@@ -512,6 +543,26 @@ advance_aggregates(AggState *aggstate, AggStatePerGroup pergroup)
 					continue;
 			}
 
+			/*
+			 * If we are still hashing, add the value to the table, and move
+			 * over to sorting once the table no longer fits in work_mem.
+			 */
+			if (peraggstate->distincthash)
+			{
+				bool		isnew;
+
+				LookupTupleHashEntry(peraggstate->distincthash, slot, &isnew);
+				if (isnew &&
+					++peraggstate->distinctAdded >= DISTINCT_HASH_CHECK_INTERVAL)
+				{
+					peraggstate->distinctAdded = 0;
+					if (MemoryContextTotalSpace(peraggstate->distinctcontext) >
+						work_mem * 1024L)
+						spill_distinct_hash(aggstate, peraggstate);
+				}
+				continue;
+			}
+
 			/* OK, put the tuple into the tuplesort object */
 			if (peraggstate->numInputs == 1)
 				tuplesort_putdatum(peraggstate->sortstate,
@@ -540,6 +591,114 @@ advance_aggregates(AggState *aggstate, AggStatePerGroup pergroup)
 	}
 }
 
+/*
+ * Start the sort object for a DISTINCT/ORDER BY aggregate.
+ *
+ * When called, CurrentMemoryContext should be the per-query context.
+ */
+static void
+begin_distinct_sort(AggStatePerAgg peraggstate)
+{
+	/*
+	 * We use a plain Datum sorter when there's a single input column;
+	 * otherwise sort the full tuple.  (See comments for
+	 * process_ordered_aggregate_single.)
+	 */
+	peraggstate->sortstate =
+		(peraggstate->numInputs == 1) ?
+		tuplesort_begin_datum(peraggstate->evaldesc->attrs[0]->atttypid,
+							  peraggstate->sortOperators[0],
+							  peraggstate->sortCollations[0],
+							  peraggstate->sortNullsFirst[0],
+							  work_mem, false) :
+		tuplesort_begin_heap(peraggstate->evaldesc,
+							 peraggstate->numSortCols,
+							 peraggstate->sortColIdx,
+							 peraggstate->sortOperators,
+							 peraggstate->sortCollations,
+							 peraggstate->sortNullsFirst,
+							 work_mem, false);
+}
+
+/*
+ * The hash table of a hashed DISTINCT aggregate has outgrown work_mem:
+ * start its sort object, load the values collected so far into it, and
+ * drop the table.  The rest of the group's input goes straight to the
+ * sort, and process_ordered_aggregate_single removes any duplicates
+ * between the two.
+ *
+ * When called, CurrentMemoryContext should be the per-query context.
+ */
+static void
+spill_distinct_hash(AggState *aggstate, AggStatePerAgg peraggstate)
+{
+	TupleHashTable hashtable = peraggstate->distincthash;
+	TupleHashIterator hashiter;
+	TupleHashEntry entry;
+
+	Assert(peraggstate->numInputs == 1);
+
+	begin_distinct_sort(peraggstate);
+
+	InitTupleHashIterator(hashtable, &hashiter);
+	while ((entry = ScanTupleHashTable(&hashiter)) != NULL)
+	{
+		TupleTableSlot *slot = hashtable->tableslot;
+		Datum		value;
+		bool		isnull;
+
+		ExecStoreMinimalTuple(entry->firstTuple, slot, false);
+		value = slot_getattr(slot, 1, &isnull);
+		tuplesort_putdatum(peraggstate->sortstate, value, isnull);
+	}
+	TermTupleHashIterator(&hashiter);
+
+	MemoryContextResetAndDeleteChildren(peraggstate->distinctcontext);
+	peraggstate->distincthash = NULL;
+}
+
+/*
+ * Run the transition function once for each value in the hash table of a
+ * hashed DISTINCT aggregate, in whatever order the table returns them.
+ * As with the sort, strictness was already checked when the values were
+ * entered.
+ *
+ * When called, CurrentMemoryContext should be the per-query context.
+ */
+static void
+process_distinct_hash(AggState *aggstate,
+					  AggStatePerAgg peraggstate,
+					  AggStatePerGroup pergroupstate)
+{
+	TupleHashTable hashtable = peraggstate->distincthash;
+	MemoryContext workcontext = aggstate->tmpcontext->ecxt_per_tuple_memory;
+	MemoryContext oldContext;
+	TupleHashIterator hashiter;
+	TupleHashEntry entry;
+	FunctionCallInfoData fcinfo;
+
+	InitTupleHashIterator(hashtable, &hashiter);
+	while ((entry = ScanTupleHashTable(&hashiter)) != NULL)
+	{
+		TupleTableSlot *slot = hashtable->tableslot;
+
+		MemoryContextReset(workcontext);
+		oldContext = MemoryContextSwitchTo(workcontext);
+
+		/* Load the column into argument 1 (arg 0 will be transition value) */
+		ExecStoreMinimalTuple(entry->firstTuple, slot, false);
+		fcinfo.arg[1] = slot_getattr(slot, 1, &fcinfo.argnull[1]);
+
+		advance_transition_function(aggstate, peraggstate, pergroupstate,
+									&fcinfo);
+
+		MemoryContextSwitchTo(oldContext);
+	}
+	TermTupleHashIterator(&hashiter);
+
+	MemoryContextResetAndDeleteChildren(peraggstate->distinctcontext);
+	peraggstate->distincthash = NULL;
+}
 
 /*
  * Run the transition function for a DISTINCT or ORDER BY aggregate
@@ -1159,7 +1318,11 @@ agg_retrieve_direct(AggState *aggstate)
 
 			if (peraggstate->numSortCols > 0)
 			{
-				if (peraggstate->numInputs == 1)
+				if (peraggstate->distincthash)
+					process_distinct_hash(aggstate,
+										  peraggstate,
+										  pergroupstate);
+				else if (peraggstate->numInputs == 1)
 					process_ordered_aggregate_single(aggstate,
 													 peraggstate,
 													 pergroupstate);
@@ -1847,6 +2010,34 @@ ExecInitAgg(Agg *node, EState *estate, int eflags)
 				i++;
 			}
 			Assert(i == numDistinctCols);
+
+			/*
+			 * count(DISTINCT x) gives the same answer whatever order its
+			 * input arrives in, so if x's type can be hashed we can skip the
+			 * sort as long as the distinct values fit in work_mem.  Other
+			 * aggregates may care about the order (think array_agg), so
+			 * they keep the sort.
+			 */
+			if (numInputs == 1 && aggref->aggorder == NIL &&
+				peraggstate->transfn_oid == F_INT8INC_ANY)
+			{
+				SortGroupClause *sortcl =
+					(SortGroupClause *) linitial(aggref->aggdistinct);
+
+				if (sortcl->hashable)
+				{
+					execTuplesHashPrepare(1, &sortcl->eqop,
+										  &peraggstate->hashEqualfns,
+										  &peraggstate->hashfns);
+					peraggstate->distinctcontext =
+						AllocSetContextCreate(CurrentMemoryContext,
+											  "AggDistinctHash",
+											  ALLOCSET_DEFAULT_MINSIZE,
+											  ALLOCSET_DEFAULT_INITSIZE,
+											  ALLOCSET_DEFAULT_MAXSIZE);
+					peraggstate->hashDistinct = true;
+				}
+			}
 		}
 
 		ReleaseSysCache(aggTuple);
@@ -1946,6 +2137,9 @@ ExecReScanAgg(AggState *node)
 		if (peraggstate->sortstate)
 			tuplesort_end(peraggstate->sortstate);
 		peraggstate->sortstate = NULL;
+		if (peraggstate->hashDistinct)
+			MemoryContextResetAndDeleteChildren(peraggstate->distinctcontext);
+		peraggstate->distincthash = NULL;
 	}
 
 	/* Release first tuple of group, if we have made a copy */
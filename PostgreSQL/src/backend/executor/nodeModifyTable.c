@@ -250,6 +250,17 @@ ExecInsert(TupleTableSlot *slot,
 		if (resultRelInfo->ri_NumIndices > 0)
 			recheckIndexes = ExecInsertIndexTuples(slot, &(tuple->t_self),
 												   estate);
+
+		/*************************************************************
+		 * ADDED CONTENT FOR RECATHON
+		 *************************************************************/
+
+		/* Note whose recommendations the new event changes. */
+		recordEventUser(resultRelationDesc, tuple);
+
+		/*************************************************************
+		 * END CONTENT FOR RECATHON
+		 *************************************************************/
 	}
 
 	if (canSetTag)
@@ -264,16 +275,6 @@ ExecInsert(TupleTableSlot *slot,
 
 	list_free(recheckIndexes);
 
-	/*************************************************************
-	 * ADDED CONTENT FOR RECATHON
-	 *************************************************************/
-
-	updateCellCounter(resultRelationDesc->rd_rel->relname.data,slot);
-
-	/*************************************************************
-	 * END CONTENT FOR RECATHON
-	 *************************************************************/
-
 	/* Process RETURNING if present */
 	if (resultRelInfo->ri_projectReturning)
 		return ExecProcessReturning(resultRelInfo->ri_projectReturning,
@@ -1214,6 +1215,35 @@ ExecEndModifyTable(ModifyTableState *node)
 	 */
 	for (i = 0; i < node->mt_nplans; i++)
 		ExecEndNode(node->mt_plans[i]);
+
+	/*************************************************************
+	 * ADDED CONTENT FOR RECATHON
+	 *************************************************************/
+
+	/*
+	 * Let the recommenders know about new events once per statement,
+	 * rather than once per row.
+	 */
+	if (node->operation == CMD_INSERT && node->ps.state->es_processed > 0)
+	{
+		for (i = 0; i < node->mt_nplans; i++)
+			updateCellCounter(RelationGetRelationName(node->resultRelInfo[i].ri_RelationDesc));
+	}
+
+	/*
+	 * And the catalogue caches about changes to the recommenders
+	 * themselves.
+	 */
+	if (node->ps.state->es_processed > 0)
+	{
+		for (i = 0; i < node->mt_nplans; i++)
+			noteCatalogueChange(node->resultRelInfo[i].ri_RelationDesc,
+								node->operation);
+	}
+
+	/*************************************************************
+	 * END CONTENT FOR RECATHON
+	 *************************************************************/
 }
 
 void
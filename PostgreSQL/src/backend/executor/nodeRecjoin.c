@@ -26,11 +26,99 @@
 #include "postgres.h"
 
 #include "executor/execdebug.h"
+#include "executor/execRecommend.h"
 #include "executor/nodeRecjoin.h"
 #include "utils/memutils.h"
 #include "utils/recathon.h"
 
 
+static void loadRecJoinInner(RecJoinState *recjoin);
+
+/* ----------------------------------------------------------------
+ *		loadRecJoinInner
+ *
+ *		Reads the inner relation once, keeping those of its tuples
+ *		whose item the recommender can score, along with where that
+ *		item sits in its item list. Every user is then joined with
+ *		these in memory, rather than rescanning the inner relation
+ *		and looking up each of its items all over again.
+ * ----------------------------------------------------------------
+ */
+static void
+loadRecJoinInner(RecJoinState *recjoin)
+{
+	RecScanState *recnode = recjoin->recnode;
+	AttributeInfo *attributes = (AttributeInfo*) recnode->attributes;
+	PlanState  *innerPlan = innerPlanState(recjoin->subjoin);
+	MemoryContext oldcontext;
+	TupleDesc	innerDesc;
+	int			i, maxInner;
+
+	MemoryContextReset(recjoin->innerContext);
+	recjoin->innerItems = NULL;
+	recjoin->numInner = 0;
+
+	innerDesc = ExecGetResultType(innerPlan);
+	recjoin->innerTupleAtt = -1;
+	for (i = 0; i < innerDesc->natts; i++)
+	{
+		if (strcmp(NameStr(innerDesc->attrs[i]->attname), attributes->itemkey) == 0)
+		{
+			recjoin->innerTupleAtt = i;
+			break;
+		}
+	}
+	if (recjoin->innerTupleAtt < 0)
+		elog(ERROR, "RecJoin inner relation has no column \"%s\"",
+			 attributes->itemkey);
+
+	if (recjoin->innerSlot == NULL)
+		recjoin->innerSlot = MakeSingleTupleTableSlot(innerDesc);
+
+	oldcontext = MemoryContextSwitchTo(recjoin->innerContext);
+	maxInner = 64;
+	recjoin->innerItems = (RecJoinInner*) palloc(maxInner*sizeof(RecJoinInner));
+
+	ENL1_printf("reading inner plan");
+	ExecReScan(innerPlan);
+	for (;;)
+	{
+		TupleTableSlot *innerTupleSlot;
+		Datum		value;
+		bool		isnull;
+		int			itemID, itemindex;
+
+		innerTupleSlot = ExecProcNode(innerPlan);
+		if (TupIsNull(innerTupleSlot))
+			break;
+
+		value = slot_getattr(innerTupleSlot, recjoin->innerTupleAtt + 1, &isnull);
+		if (isnull)
+			continue;
+		itemID = DatumGetInt32(value);
+
+		/* Items the recommender doesn't have never join. */
+		itemindex = itemIndex(recnode, itemID);
+		if (itemindex < 0)
+			continue;
+
+		if (recjoin->numInner >= maxInner)
+		{
+			maxInner *= 2;
+			recjoin->innerItems = (RecJoinInner*) repalloc(recjoin->innerItems,
+				maxInner*sizeof(RecJoinInner));
+		}
+		recjoin->innerItems[recjoin->numInner].itemID = itemID;
+		recjoin->innerItems[recjoin->numInner].itemindex = itemindex;
+		recjoin->innerItems[recjoin->numInner].tuple =
+			ExecCopySlotMinimalTuple(innerTupleSlot);
+		recjoin->numInner++;
+	}
+	MemoryContextSwitchTo(oldcontext);
+
+	recjoin->innerLoaded = true;
+}
+
 /* ----------------------------------------------------------------
  *		ExecRecJoin(node)
  *
@@ -39,6 +127,8 @@
  *		satisfies the qualification clause.
  *
  *		It scans the inner relation to join with current outer tuple.
+ *		(For a RecJoin, the inner relation is read once and kept in
+ *		memory; see loadRecJoinInner.)
  *
  *		If none is found, next tuple from the outer relation is retrieved
  *		and the inner relation is scanned from the beginning again to join
@@ -69,7 +159,6 @@ ExecRecJoin(RecJoinState *recjoin)
 
 	NestLoopState *node;
 //	NestLoop   *nl;
-	PlanState  *innerPlan;
 	PlanState  *outerPlan;
 	TupleTableSlot *outerTupleSlot;
 	TupleTableSlot *innerTupleSlot;
@@ -90,7 +179,6 @@ ExecRecJoin(RecJoinState *recjoin)
 	joinqual = node->js.joinqual;
 	otherqual = node->js.ps.qual;
 	outerPlan = outerPlanState(node);
-	innerPlan = innerPlanState(node);
 	econtext = node->js.ps.ps_ExprContext;
 
 	/*
@@ -121,8 +209,8 @@ ExecRecJoin(RecJoinState *recjoin)
 	 * Ok, everything is setup for the join. We're going to get exactly one
 	 * tuple from the outer plan, because we just want to use its tupleDesc
 	 * in order to create new nodes. The inner loop is the key; we'll loop
-	 * over the items table, and for each item we see, we'll check it against
-	 * the items we need to rate. If we do need to rate that item, we'll
+	 * over the inner tuples whose items we can rate, which we read from the
+	 * items table the first time through. For each of them, we'll
 	 * generate a prediction, stuff it in the tuple, and return it all. This
 	 * repeats until the inner loop is out of tuples.
 	 */
@@ -130,9 +218,8 @@ ExecRecJoin(RecJoinState *recjoin)
 
 	for (;;)
 	{
-		int i, userID, innerItemID, natts;
-		GenRating *findRating;
-		bool minimalTuple = false;
+		int userID, innerItemID, itemindex;
+		RecJoinInner *inner;
 
 		/*
 		 * If we need an outer tuple, we fetch one. This creates a few
@@ -140,8 +227,6 @@ ExecRecJoin(RecJoinState *recjoin)
 		 * It works both for initializing and resuming the inner loop.
 		 */
 		if (recjoin->rj_NeedNewOuter) {
-			GenRating *tempItem;
-
 			outerTupleSlot = ExecProcNode(outerPlan);
 			/* If this happens, we're out of users. */
 			if (TupIsNull(outerTupleSlot)) {
@@ -149,69 +234,38 @@ ExecRecJoin(RecJoinState *recjoin)
 				return NULL;
 			}
 
-			/* Otherwise, we need to construct our hash table, since
-			 * we need info from the previous operator to do so. */
-			freeHash(recjoin->itemTable);
-			recjoin->itemTable = hashCreate(recjoin->recnode->fullTotalItems);
-			for (i = 0; i < recjoin->recnode->fullTotalItems; i++) {
-				int currentItem = recjoin->recnode->fullItemList[i];
-
-				tempItem = (GenRating*) palloc(sizeof(GenRating));
-				tempItem->ID = currentItem;
-				tempItem->index = -1;
-				tempItem->next = NULL;
-
-				hashAdd(recjoin->itemTable,tempItem);
-			}
-
 			/* Then we'll do some other stuff to ensure the loop
-			 * runs correctly. */
+			 * runs correctly. The recommender knows its items once
+			 * it has a user, so that's when we read the inner plan. */
 			recjoin->rj_NeedNewOuter = false;
-			ENL1_printf("rescanning inner plan");
-			ExecReScan(innerPlan);
+			if (!recjoin->innerLoaded)
+				loadRecJoinInner(recjoin);
+			ENL1_printf("restarting inner items");
+			recjoin->innerPos = 0;
 		}
 
-		/* We construct a new tuple on the fly. */
-		outerTupleSlot = MakeSingleTupleTableSlot(recnode->base_slot);
-		outerTupleSlot->tts_isempty = false;
-
-		/* Mark all slots as non-empty and zero. */
-		natts = outerTupleSlot->tts_tupleDescriptor->natts;
-		for (i = 0; i < natts; i++) {
-			/* Mark slot. */
-			outerTupleSlot->tts_values[i] = Int32GetDatum(0);
-			outerTupleSlot->tts_isnull[i] = false;
-			outerTupleSlot->tts_nvalid++;
+		/* We construct each new tuple in the same slot, in which
+		 * the columns the join reads start out zero. */
+		if (recjoin->outerSlot == NULL) {
+			Join	   *plan = (Join *) node->js.ps.plan;
+			List	   *exprs;
+
+			outerTupleSlot = MakeSingleTupleTableSlot(recnode->base_slot);
+			exprs = list_make3(plan->plan.targetlist, plan->plan.qual,
+							   plan->joinqual);
+			ExecRecBlankSlot(recnode, outerTupleSlot, (Node *) exprs, OUTER_VAR);
+			list_free(exprs);
+			recjoin->outerSlot = outerTupleSlot;
 		}
+		outerTupleSlot = recjoin->outerSlot;
 
-		/*
-		 * try to get the next inner tuple.
-		 */
-		ENL1_printf("getting new inner tuple");
-
-		innerTupleSlot = ExecProcNode(innerPlan);
-		econtext->ecxt_innertuple = innerTupleSlot;
-
-		/*
-		 * store the key tuple att number if we haven't already
-		 */
-		if (recjoin->innerTupleAtt < 0) {
-			for (i = 0; i < innerTupleSlot->tts_tupleDescriptor->natts; i++) {
-				char* col_name = innerTupleSlot->tts_tupleDescriptor->attrs[i]->attname.data;
-
-				if (strcmp(col_name,attributes->itemkey) == 0) {
-					recjoin->innerTupleAtt = i;
-					break;
-				}
-			}
-		}
-
-		if (!TupIsNull(innerTupleSlot) && innerTupleSlot->tts_mintuple)
-			minimalTuple = true;
+		/* Mark all slots as non-empty. */
+		outerTupleSlot->tts_isempty = false;
+		outerTupleSlot->tts_nvalid = outerTupleSlot->tts_tupleDescriptor->natts;
 
-		/* If there's no inner tuple, then we'll make a note to reset the
-		 * inner loop and get a new outer tuple. */
-		if (TupIsNull(innerTupleSlot))
+		/* If we've been through the inner items, then we'll get a new
+		 * outer tuple. */
+		if (recjoin->innerPos >= recjoin->numInner)
 		{
 			ENL1_printf("no inner tuple, need new outer tuple");
 			recjoin->rj_NeedNewOuter = true;
@@ -219,35 +273,22 @@ ExecRecJoin(RecJoinState *recjoin)
 		}
 
 		/*
-		 * We now have an inner tuple and a shell of an outer tuple. We need
-		 * to extract the item ID from the inner tuple and use that to build
-		 * a new outer tuple, then we send them for qual checking. If our
-		 * tuple is a minimal one, though, we need to materialize it first.
+		 * Otherwise we put the next one we kept in the inner slot. We
+		 * already know its item ID and where the recommender keeps it,
+		 * so we just use that to build a new outer tuple, then we send
+		 * them for qual checking.
 		 */
-		if (!minimalTuple)
-			innerItemID = getTupleInt(innerTupleSlot,attributes->itemkey);
-		else {
-			innerItemID = DatumGetInt32(innerTupleSlot->tts_values[recjoin->innerTupleAtt]);
-/*			TupleTableSlot *tempslot;
-			TupleDesc tempdesc;
-
-			tempdesc = CreateTupleDescCopy(innerTupleSlot->tts_tupleDescriptor);
-			tempslot = MakeSingleTupleTableSlot(tempdesc);
-			tempslot = ExecCopySlot(tempslot, innerTupleSlot);
+		ENL1_printf("getting new inner tuple");
 
-			innerItemID = getTupleInt(tempslot,attributes->itemkey);
+		inner = &recjoin->innerItems[recjoin->innerPos++];
+		innerTupleSlot = ExecStoreMinimalTuple(inner->tuple,
+							recjoin->innerSlot, false);
+		econtext->ecxt_innertuple = innerTupleSlot;
 
-			ExecDropSingleTupleTableSlot(tempslot);
-			FreeTupleDesc(tempdesc);*/
-		}
+		innerItemID = inner->itemID;
+		itemindex = inner->itemindex;
 		userID = attributes->userID;
 
-		/*
-		 * Is this item ID one of the ones we need to predict a rating for?
-		 */
-		findRating = hashFind(recjoin->itemTable,innerItemID);
-		if (!findRating) continue;
-
 		/*
 		 * We're ok to construct a tuple at this point.
 		 */
@@ -300,7 +341,6 @@ ExecRecJoin(RecJoinState *recjoin)
 				 * the RecScore before joining the tuples and sending
 				 * them on their happy way.
  				 */
-				int itemindex = binarySearch(recnode->fullItemList, innerItemID, 0, recnode->fullTotalItems);
 				applyRecScore(recnode, outerTupleSlot, innerItemID, itemindex);
 
 				ENL1_printf("qualification succeeded, projecting tuple");
@@ -354,8 +394,21 @@ ExecInitRecJoin(RecJoin *node, EState *estate, int eflags)
 	rjstate->rj_NeedNewOuter = true;
 	rjstate->rj_MatchedOuter = false;
 
-	/* A safeguard against minimal tuples appearing. */
+	/* The key att of the inner tuple is found once we read it. */
 	rjstate->innerTupleAtt = -1;
+	rjstate->outerSlot = NULL;
+
+	/* The inner relation is read when we have our first user. */
+	rjstate->innerLoaded = false;
+	rjstate->innerContext = AllocSetContextCreate(CurrentMemoryContext,
+						"RecJoin",
+						ALLOCSET_DEFAULT_MINSIZE,
+						ALLOCSET_DEFAULT_INITSIZE,
+						ALLOCSET_DEFAULT_MAXSIZE);
+	rjstate->innerItems = NULL;
+	rjstate->numInner = 0;
+	rjstate->innerPos = 0;
+	rjstate->innerSlot = NULL;
 
 	NL1_printf("ExecInitRecJoin: %s\n",
 			   "node initialized");
@@ -384,6 +437,11 @@ ExecEndRecJoin(RecJoinState *node)
 	 * clean out the tuple table
 	 */
 	ExecClearTuple(node->js.ps.ps_ResultTupleSlot);
+	if (node->outerSlot)
+		ExecDropSingleTupleTableSlot(node->outerSlot);
+	if (node->innerSlot)
+		ExecDropSingleTupleTableSlot(node->innerSlot);
+	MemoryContextDelete(node->innerContext);
 
 	/*
 	 * close down subplans
@@ -412,10 +470,12 @@ ExecReScanRecJoin(RecJoinState *node)
 		ExecReScan(outerPlan);
 
 	/*
-	 * innerPlan is re-scanned for each new outer tuple and MUST NOT be
-	 * re-scanned from here or you'll get troubles from inner index scans when
-	 * outer Vars are used as run-time keys...
+	 * The inner tuples we kept go with the recommender's items, which
+	 * may be different next time, so we read it again when asked.
 	 */
+	if (node->innerSlot)
+		ExecClearTuple(node->innerSlot);
+	node->innerLoaded = false;
 
 	node->js.ps.ps_TupFromTlist = false;
 	node->subjoin->nl_NeedNewOuter = true;
@@ -2523,6 +2523,9 @@ _copyRecommendInfo(const RecommendInfo *from)
 	COPY_NODE_FIELD(itemkey);
 	COPY_NODE_FIELD(eventval);
 	COPY_STRING_FIELD(strmethod);
+	COPY_NODE_FIELD(ensemble);
+	COPY_NODE_FIELD(candidates);
+	COPY_SCALAR_FIELD(excludeRated);
 	COPY_NODE_FIELD(recommender);
 	COPY_NODE_FIELD(attributes);
 	COPY_SCALAR_FIELD(opType);
@@ -2547,12 +2550,25 @@ _copyAttributeInfo(const AttributeInfo *from)
 	COPY_STRING_FIELD(recIndexName);
 	COPY_STRING_FIELD(recModelName);
 	COPY_STRING_FIELD(recModelName2);
+	COPY_STRING_FIELD(recClusterName);
 	COPY_STRING_FIELD(recViewName);
 	COPY_NODE_FIELD(userWhereClause);
+	COPY_NODE_FIELD(userIDList);
+	COPY_NODE_FIELD(userParamList);
+	COPY_NODE_FIELD(userWhereQuery);
+	COPY_NODE_FIELD(itemWhereQuery);
 	COPY_SCALAR_FIELD(IDfound);
 	COPY_SCALAR_FIELD(cellType);
 	COPY_SCALAR_FIELD(opType);
 	COPY_SCALAR_FIELD(noFilter);
+	COPY_NODE_FIELD(ensemble);
+	COPY_SCALAR_FIELD(weight);
+	COPY_NODE_FIELD(candidates);
+	COPY_SCALAR_FIELD(candidateLimit);
+	COPY_SCALAR_FIELD(excludeRated);
+	COPY_SCALAR_FIELD(canGenerate);
+	COPY_SCALAR_FIELD(modelCost);
+	COPY_SCALAR_FIELD(generateCost);
 
 	return newnode;
 }
@@ -1000,6 +1000,9 @@ _equalRecommendInfo(const RecommendInfo *a, const RecommendInfo *b)
 	COMPARE_NODE_FIELD(itemkey);
 	COMPARE_NODE_FIELD(eventval);
 	COMPARE_STRING_FIELD(strmethod);
+	COMPARE_NODE_FIELD(ensemble);
+	COMPARE_NODE_FIELD(candidates);
+	COMPARE_SCALAR_FIELD(excludeRated);
 	COMPARE_NODE_FIELD(recommender);
 	COMPARE_NODE_FIELD(attributes);
 	COMPARE_SCALAR_FIELD(opType);
@@ -1022,12 +1025,24 @@ _equalAttributeInfo(const AttributeInfo *a, const AttributeInfo *b)
 	COMPARE_STRING_FIELD(recIndexName);
 	COMPARE_STRING_FIELD(recModelName);
 	COMPARE_STRING_FIELD(recModelName2);
+	COMPARE_STRING_FIELD(recClusterName);
 	COMPARE_STRING_FIELD(recViewName);
 	COMPARE_NODE_FIELD(userWhereClause);
+	COMPARE_NODE_FIELD(userIDList);
+	COMPARE_NODE_FIELD(userParamList);
+	COMPARE_NODE_FIELD(userWhereQuery);
 	COMPARE_SCALAR_FIELD(IDfound);
 	COMPARE_SCALAR_FIELD(cellType);
 	COMPARE_SCALAR_FIELD(opType);
 	COMPARE_SCALAR_FIELD(noFilter);
+	COMPARE_NODE_FIELD(ensemble);
+	COMPARE_SCALAR_FIELD(weight);
+	COMPARE_NODE_FIELD(candidates);
+	COMPARE_SCALAR_FIELD(candidateLimit);
+	COMPARE_SCALAR_FIELD(excludeRated);
+	COMPARE_SCALAR_FIELD(canGenerate);
+	COMPARE_SCALAR_FIELD(modelCost);
+	COMPARE_SCALAR_FIELD(generateCost);
 
 	return true;
 }
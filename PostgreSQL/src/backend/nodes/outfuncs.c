@@ -2062,6 +2062,9 @@ _outRecommendInfo(StringInfo str, const RecommendInfo *node)
 	WRITE_NODE_FIELD(itemkey);
 	WRITE_NODE_FIELD(eventval);
 	WRITE_STRING_FIELD(strmethod);
+	WRITE_NODE_FIELD(ensemble);
+	WRITE_NODE_FIELD(candidates);
+	WRITE_INT_FIELD(excludeRated);
 	WRITE_NODE_FIELD(recommender);
 	WRITE_NODE_FIELD(attributes);
 	WRITE_INT_FIELD(opType);
@@ -2084,12 +2087,24 @@ _outAttributeInfo(StringInfo str, const AttributeInfo *node)
 	WRITE_STRING_FIELD(recIndexName);
 	WRITE_STRING_FIELD(recModelName);
 	WRITE_STRING_FIELD(recModelName2);
+	WRITE_STRING_FIELD(recClusterName);
 	WRITE_STRING_FIELD(recViewName);
 	WRITE_NODE_FIELD(userWhereClause);
+	WRITE_NODE_FIELD(userIDList);
+	WRITE_NODE_FIELD(userParamList);
+	WRITE_NODE_FIELD(userWhereQuery);
 	WRITE_BOOL_FIELD(IDfound);
 	WRITE_INT_FIELD(cellType);
 	WRITE_INT_FIELD(opType);
 	WRITE_BOOL_FIELD(noFilter);
+	WRITE_NODE_FIELD(ensemble);
+	WRITE_FLOAT_FIELD(weight, "%.6f");
+	WRITE_NODE_FIELD(candidates);
+	WRITE_INT_FIELD(candidateLimit);
+	WRITE_INT_FIELD(excludeRated);
+	WRITE_BOOL_FIELD(canGenerate);
+	WRITE_FLOAT_FIELD(modelCost, "%.2f");
+	WRITE_FLOAT_FIELD(generateCost, "%.2f");
 }
 
 static void
@@ -239,6 +239,9 @@ _readRecommendInfo(void)
 	READ_NODE_FIELD(itemkey);
 	READ_NODE_FIELD(eventval);
 	READ_STRING_FIELD(strmethod);
+	READ_NODE_FIELD(ensemble);
+	READ_NODE_FIELD(candidates);
+	READ_INT_FIELD(excludeRated);
 	READ_NODE_FIELD(recommender);
 	READ_NODE_FIELD(attributes);
 	READ_ENUM_FIELD(opType, recathon_optype);
@@ -266,12 +269,24 @@ _readAttributeInfo(void)
 	READ_STRING_FIELD(recIndexName);
 	READ_STRING_FIELD(recModelName);
 	READ_STRING_FIELD(recModelName2);
+	READ_STRING_FIELD(recClusterName);
 	READ_STRING_FIELD(recViewName);
 	READ_NODE_FIELD(userWhereClause);
+	READ_NODE_FIELD(userIDList);
+	READ_NODE_FIELD(userParamList);
+	READ_NODE_FIELD(userWhereQuery);
 	READ_BOOL_FIELD(IDfound);
 	READ_ENUM_FIELD(cellType, recathon_cell);
 	READ_ENUM_FIELD(opType, recathon_optype);
 	READ_BOOL_FIELD(noFilter);
+	READ_NODE_FIELD(ensemble);
+	READ_FLOAT_FIELD(weight);
+	READ_NODE_FIELD(candidates);
+	READ_INT_FIELD(candidateLimit);
+	READ_INT_FIELD(excludeRated);
+	READ_BOOL_FIELD(canGenerate);
+	READ_FLOAT_FIELD(modelCost);
+	READ_FLOAT_FIELD(generateCost);
 
 	READ_DONE();
 }
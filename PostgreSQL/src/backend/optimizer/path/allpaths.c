@@ -57,6 +57,10 @@ static void set_plain_rel_size(PlannerInfo *root, RelOptInfo *rel,
 				   RangeTblEntry *rte);
 static void set_plain_rel_pathlist(PlannerInfo *root, RelOptInfo *rel,
 					   RangeTblEntry *rte);
+static void choose_recscan_model(PlannerInfo *root, RelOptInfo *rel,
+					 Path *path);
+static void set_recscan_pathkeys(PlannerInfo *root, RelOptInfo *rel,
+					 RangeTblEntry *rte, Path *path);
 static void set_foreign_size(PlannerInfo *root, RelOptInfo *rel,
 				 RangeTblEntry *rte);
 static void set_foreign_pathlist(PlannerInfo *root, RelOptInfo *rel,
@@ -366,6 +370,103 @@ set_plain_rel_size(PlannerInfo *root, RelOptInfo *rel, RangeTblEntry *rte)
 		check_partial_indexes(root, rel);
 		set_baserel_size_estimates(root, rel);
 	}
+
+	/* A RECOMMEND returns predictions, not the table it scans. */
+	if (rel->recommender)
+	{
+		RecommendInfo *recInfo = (RecommendInfo *) rel->recommender;
+
+		if (recInfo->opType != OP_INDEX && recInfo->opType != OP_JOINPARTNER)
+			set_recscan_size_estimates(root, rel);
+	}
+}
+
+/*
+ * choose_recscan_model
+ *	  Decide whether a RECOMMEND over a built similarity model would do
+ *	  better to generate its model on the fly, as it would if there were
+ *	  no recommender.
+ *
+ * The parser only lets us choose when both give the same predictions.
+ * A query for a few users, filtered to a few items, may only need a
+ * small slice of the model, which can take less working out from the
+ * events than looking it up in a big model table that isn't cached;
+ * broad queries go the other way. Whichever it is, both costs are kept
+ * in the attributes for EXPLAIN. The RecommendInfo is copied before we
+ * change it, so that the query tree can be planned again.
+ */
+static void
+choose_recscan_model(PlannerInfo *root, RelOptInfo *rel, Path *path)
+{
+	RecommendInfo *recInfo = (RecommendInfo *) rel->recommender;
+	AttributeInfo *attributes = recInfo->attributes;
+	recathon_optype optype = attributes->opType;
+	Cost		modelCost;
+	Cost		generateCost;
+
+	if (!attributes->canGenerate ||
+		(optype != OP_FILTER && optype != OP_JOIN) ||
+		attributes->ensemble != NIL || attributes->candidates)
+		return;
+
+	recInfo = (RecommendInfo *) copyObject(recInfo);
+	rel->recommender = (Node *) recInfo;
+	attributes = recInfo->attributes;
+
+	modelCost = path->total_cost;
+	attributes->opType = (optype == OP_JOIN) ? OP_GENERATEJOIN : OP_GENERATE;
+	cost_recscan(path, root, rel);
+	generateCost = path->total_cost;
+	attributes->modelCost = modelCost;
+	attributes->generateCost = generateCost;
+
+	if (generateCost < modelCost)
+	{
+		/* As for a recommender whose model isn't kept up. */
+		recInfo->opType = attributes->opType;
+		attributes->recModelName = NULL;
+		attributes->recModelName2 = NULL;
+		attributes->recClusterName = NULL;
+		attributes->recViewName = NULL;
+	}
+	else
+	{
+		attributes->opType = optype;
+		cost_recscan(path, root, rel);
+	}
+}
+
+/*
+ * set_recscan_pathkeys
+ *	  Tell the planner the order a RecScan returns its predictions in.
+ *
+ * They come out by user and then item, so a join with an items table
+ * on the item key can be a merge join without sorting them first. A
+ * RecJoin does its own joining. Only pathkeys something in the query
+ * can use are kept, and a scan planned with any is marked as ordered
+ * (see create_scan_plan), so that it doesn't share out its scoring or
+ * keep only the best few, either of which returns them in another.
+ */
+static void
+set_recscan_pathkeys(PlannerInfo *root, RelOptInfo *rel, RangeTblEntry *rte,
+					 Path *path)
+{
+	RecommendInfo *recInfo = (RecommendInfo *) rel->recommender;
+	AttributeInfo *attributes = recInfo->attributes;
+	bool		single_user;
+	List	   *pathkeys;
+
+	if (recInfo->opType != OP_FILTER && recInfo->opType != OP_GENERATE)
+		return;
+
+	single_user = (list_length(attributes->userIDList) == 1 ||
+				   (attributes->userIDList == NIL &&
+					list_length(attributes->userParamList) == 1));
+	pathkeys = build_recscan_pathkeys(root, rel,
+									  get_attnum(rte->relid, attributes->userkey),
+									  get_attnum(rte->relid, attributes->itemkey),
+									  single_user);
+	path->pathkeys = truncate_useless_pathkeys(root, rel, pathkeys);
 }
 
 /*
@@ -384,6 +485,9 @@ set_plain_rel_pathlist(PlannerInfo *root, RelOptInfo *rel, RangeTblEntry *rte)
 	/* At this point, we check to see if we're dealing with a RECOMMEND
 	 * query using FilterRecommend or JoinRecommend. If we are, we don't
 	 * need to create any other paths at all, as SeqScan is required.
+	 * The RecScan only takes its tuple descriptor from it and never
+	 * reads the events table through it, and its quals are checked
+	 * against the predictions it builds, so no index could help.
 	 * Note that we also do this if this is the items table that is being
 	 * used in a RecJoin. */
 	if (rel->recommender) {
@@ -392,7 +496,12 @@ set_plain_rel_pathlist(PlannerInfo *root, RelOptInfo *rel, RangeTblEntry *rte)
 			/* A new type, to make our lives easier. Only do this
 			 * if it's not OP_JOINPARTNER though. */
 			if (recInfo->opType != OP_JOINPARTNER)
+			{
 				seqscan_path->pathtype = T_RecScan;
+				cost_recscan(seqscan_path, root, rel);
+				choose_recscan_model(root, rel, seqscan_path);
+				set_recscan_pathkeys(root, rel, rte, seqscan_path);
+			}
 
 			rel->cheapest_startup_path = seqscan_path;
 			rel->cheapest_total_path = seqscan_path;
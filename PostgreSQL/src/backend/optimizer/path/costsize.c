@@ -70,9 +70,12 @@
 
 #include <math.h>
 
+#include "catalog/namespace.h"
+#include "catalog/pg_class.h"
 #include "executor/executor.h"
 #include "executor/nodeHash.h"
 #include "miscadmin.h"
+#include "nodes/makefuncs.h"
 #include "nodes/nodeFuncs.h"
 #include "optimizer/clauses.h"
 #include "optimizer/cost.h"
@@ -82,15 +85,27 @@
 #include "optimizer/plancat.h"
 #include "optimizer/planmain.h"
 #include "optimizer/restrictinfo.h"
+#include "optimizer/var.h"
 #include "parser/parsetree.h"
 #include "utils/lsyscache.h"
+#include "utils/recathon.h"
+#include "utils/recathoncache.h"
 #include "utils/selfuncs.h"
 #include "utils/spccache.h"
+#include "utils/syscache.h"
 #include "utils/tuplesort.h"
 
 
 #define LOG2(x)  (log(x) / 0.693147180559945)
 
+/*
+ * What the planner assumes about a factor model it can't look at: the
+ * number of features, and the training epochs of one built on the fly.
+ * These are the CREATE RECOMMENDER defaults for SVD.
+ */
+#define RECSCAN_FACTOR_FEATURES		50
+#define RECSCAN_FACTOR_EPOCHS		100
+
 
 double		seq_page_cost = DEFAULT_SEQ_PAGE_COST;
 double		random_page_cost = DEFAULT_RANDOM_PAGE_COST;
@@ -140,6 +155,11 @@ static double calc_joinrel_size_estimate(PlannerInfo *root,
 static void set_rel_width(PlannerInfo *root, RelOptInfo *rel);
 static double relation_byte_size(double tuples, int width);
 static double page_size(double tuples, int width);
+static double recscan_method_cost(PlannerInfo *root,
+					AttributeInfo *attributes, RelOptInfo *baserel,
+					double tuples, double items, double allusers,
+					double users, double spc_seq_page_cost,
+					Cost *startup_cost, Cost *run_cost);
 
 
 /*
@@ -214,6 +234,339 @@ cost_seqscan(Path *path, PlannerInfo *root,
 	path->total_cost = startup_cost + run_cost;
 }
 
+/*
+ * recscan_ndistinct
+ *	  Estimate the number of distinct values in a column of the events
+ *	  table of a RECOMMEND, over the whole table.
+ */
+static double
+recscan_ndistinct(PlannerInfo *root, RelOptInfo *baserel, char *colname)
+{
+	RangeTblEntry *rte = planner_rt_fetch(baserel->relid, root);
+	AttrNumber	attno;
+	Oid			vartype;
+	int32		vartypmod;
+	Oid			varcollid;
+	VariableStatData vardata;
+	bool		isdefault;
+	double		ndistinct;
+
+	attno = get_attnum(rte->relid, colname);
+	if (attno == InvalidAttrNumber)
+		return clamp_row_est(baserel->tuples);
+
+	get_atttypetypmodcoll(rte->relid, attno, &vartype, &vartypmod, &varcollid);
+	examine_variable(root,
+					 (Node *) makeVar(baserel->relid, attno, vartype,
+									  vartypmod, varcollid, 0),
+					 0, &vardata);
+	ndistinct = get_variable_numdistinct(&vardata, &isdefault);
+	ReleaseVariableStats(vardata);
+
+	return clamp_row_est(Min(ndistinct, baserel->tuples));
+}
+
+/*
+ * recscan_estimate
+ *	  Estimate how many users and items a RECOMMEND scores, and the
+ *	  selectivity of the rest of its quals.
+ *
+ * A RecScan doesn't return the events table; it returns a prediction
+ * for every item, for each user its quals let through. Users listed in
+ * the WHERE clause are counted directly. Otherwise the quals on the user
+ * key alone tell us what fraction of users we keep, judging by the
+ * events table's statistics, as do the other quals for the predictions.
+ * With CANDIDATES FROM, each user gets no more items than its limit.
+ */
+static void
+recscan_estimate(PlannerInfo *root, RelOptInfo *baserel,
+				 double *users, double *items, Selectivity *othersel)
+{
+	RecommendInfo *recInfo = (RecommendInfo *) baserel->recommender;
+	AttributeInfo *attributes = recInfo->attributes;
+	RangeTblEntry *rte = planner_rt_fetch(baserel->relid, root);
+	AttrNumber	userattno;
+	List	   *userquals = NIL;
+	List	   *otherquals = NIL;
+	ListCell   *lc;
+
+	userattno = get_attnum(rte->relid, attributes->userkey);
+	foreach(lc, baserel->baserestrictinfo)
+	{
+		RestrictInfo *rinfo = (RestrictInfo *) lfirst(lc);
+		List	   *vars = pull_var_clause((Node *) rinfo->clause,
+										   PVC_RECURSE_AGGREGATES,
+										   PVC_RECURSE_PLACEHOLDERS);
+		bool		useronly = (vars != NIL);
+		ListCell   *vl;
+
+		foreach(vl, vars)
+		{
+			if (((Var *) lfirst(vl))->varattno != userattno)
+				useronly = false;
+		}
+		list_free(vars);
+
+		if (useronly)
+			userquals = lappend(userquals, rinfo);
+		else
+			otherquals = lappend(otherquals, rinfo);
+	}
+
+	if (attributes->userIDList != NIL)
+		*users = list_length(attributes->userIDList);
+	else if (attributes->userParamList != NIL)
+		*users = list_length(attributes->userParamList);
+	else
+		*users = clamp_row_est(recscan_ndistinct(root, baserel, attributes->userkey) *
+							   clauselist_selectivity(root, userquals, 0,
+													  JOIN_INNER, NULL));
+	*items = recscan_ndistinct(root, baserel, attributes->itemkey);
+	if (attributes->candidates)
+		*items = Min(*items, attributes->candidateLimit);
+	*othersel = clauselist_selectivity(root, otherquals, 0, JOIN_INNER, NULL);
+
+	list_free(userquals);
+	list_free(otherquals);
+}
+
+/*
+ * set_recscan_size_estimates
+ *		Set the size estimates for a relation a RECOMMEND scans, which
+ *		set_baserel_size_estimates has already looked at as a table.
+ *
+ * The rows are the predictions the RecScan returns, users times items.
+ * Joins with the RecScan, like the usual one with an items table, are
+ * then planned for what it really produces.
+ */
+void
+set_recscan_size_estimates(PlannerInfo *root, RelOptInfo *rel)
+{
+	double		users;
+	double		items;
+	Selectivity othersel;
+
+	recscan_estimate(root, rel, &users, &items, &othersel);
+	rel->rows = clamp_row_est(users * items * othersel);
+}
+
+/*
+ * cost_recscan
+ *	  Determines and returns the cost of a RECOMMEND over a relation.
+ *
+ * The startup cost is getting the model ready. A factor model that's been
+ * built is read from its tables, which are about the size of the events
+ * table, and a similarity model's rows are looked up as each user needs
+ * them; either is read once from the model cache or a model file if it
+ * has one. One built on the fly costs a pass over the events for each
+ * neighbor or training epoch, or less for a similarity model when the
+ * query names few enough users that only their part of it is worked out.
+ * Then each user's events are fetched, and each prediction takes a pass
+ * over the user's rated items (item-based), an item's raters
+ * (user-based), or the features (SVD and ALS). An ensemble does all of
+ * that for each of its methods. The method of CANDIDATES FROM has its
+ * model readied and its users' events fetched the same way, and scores
+ * every item for each user, so that the rest only score its picks.
+ *
+ * 'baserel' is the relation to be scanned, with set_recscan_size_estimates
+ * already applied
+ */
+void
+cost_recscan(Path *path, PlannerInfo *root, RelOptInfo *baserel)
+{
+	RecommendInfo *recInfo = (RecommendInfo *) baserel->recommender;
+	AttributeInfo *attributes = recInfo->attributes;
+	Cost		startup_cost = 0;
+	Cost		run_cost = 0;
+	double		spc_seq_page_cost;
+	double		users;
+	double		items;
+	double		allusers;
+	double		allitems;
+	double		tuples;
+	double		perprediction;
+	double		methods;
+	Selectivity othersel;
+	QualCost	qpqual_cost;
+	ListCell   *lc;
+
+	recscan_estimate(root, baserel, &users, &items, &othersel);
+	allusers = recscan_ndistinct(root, baserel, attributes->userkey);
+	allitems = recscan_ndistinct(root, baserel, attributes->itemkey);
+	tuples = Max(baserel->tuples, 1.0);
+	path->rows = baserel->rows;
+
+	get_tablespace_page_costs(baserel->reltablespace,
+							  NULL,
+							  &spc_seq_page_cost);
+
+	perprediction = recscan_method_cost(root, attributes, baserel, tuples,
+										allitems, allusers, users,
+										spc_seq_page_cost,
+										&startup_cost, &run_cost);
+	foreach(lc, attributes->ensemble)
+		perprediction += recscan_method_cost(root, (AttributeInfo *) lfirst(lc),
+											 baserel, tuples, allitems, allusers,
+											 users, spc_seq_page_cost,
+											 &startup_cost, &run_cost);
+	methods = 1 + list_length(attributes->ensemble);
+
+	/* Picking the candidates predicts every item, for every user. */
+	if (attributes->candidates)
+	{
+		run_cost += users * allitems * cpu_operator_cost *
+			recscan_method_cost(root, attributes->candidates, baserel, tuples,
+								allitems, allusers, users, spc_seq_page_cost,
+								&startup_cost, &run_cost);
+		methods += 1;
+	}
+
+	/* Each user's own events, through the index, for each method. */
+	run_cost += methods * users * (random_page_cost +
+								   cpu_index_tuple_cost * tuples / allusers);
+
+	/* And each prediction. */
+	get_restriction_qual_cost(root, baserel, NULL, &qpqual_cost);
+	startup_cost += qpqual_cost.startup;
+	run_cost += users * items *
+		(cpu_tuple_cost + qpqual_cost.per_tuple +
+		 cpu_operator_cost * perprediction);
+
+	path->startup_cost = startup_cost;
+	path->total_cost = startup_cost + run_cost;
+}
+
+/*
+ * recscan_model_size
+ *	  Look up the pages and rows of a model table, as last analyzed, or
+ *	  use the events table's if it isn't there.
+ */
+static void
+recscan_model_size(char *modelname, RelOptInfo *baserel,
+				   double *pages, double *tuples)
+{
+	Oid			relid = RelnameGetRelid(modelname);
+	HeapTuple	tuple;
+
+	*pages = baserel->pages;
+	*tuples = baserel->tuples;
+	if (!OidIsValid(relid))
+		return;
+	tuple = SearchSysCache1(RELOID, ObjectIdGetDatum(relid));
+	if (!HeapTupleIsValid(tuple))
+		return;
+	if (((Form_pg_class) GETSTRUCT(tuple))->relpages > 0)
+	{
+		*pages = ((Form_pg_class) GETSTRUCT(tuple))->relpages;
+		*tuples = ((Form_pg_class) GETSTRUCT(tuple))->reltuples;
+	}
+	ReleaseSysCache(tuple);
+}
+
+/*
+ * recscan_method_cost
+ *	  Adds the cost of getting one method's model ready to *startup_cost,
+ *	  and of looking up what the users need of it to *run_cost, and
+ *	  returns how much of a pass a prediction from it takes.
+ */
+static double
+recscan_method_cost(PlannerInfo *root, AttributeInfo *attributes,
+					RelOptInfo *baserel, double tuples, double items,
+					double allusers, double users, double spc_seq_page_cost,
+					Cost *startup_cost, Cost *run_cost)
+{
+	double		perprediction;
+	bool		generated;
+	bool		userbased;
+
+	userbased = (attributes->method == userCosCF ||
+				 attributes->method == userPearCF);
+	switch (attributes->method)
+	{
+		case userCosCF:
+		case userPearCF:
+			perprediction = tuples / items;
+			break;
+		case SVD:
+		case ALS:
+			perprediction = RECSCAN_FACTOR_FEATURES;
+			break;
+		default:
+			perprediction = tuples / allusers;
+			break;
+	}
+
+	generated = (attributes->opType == OP_GENERATE ||
+				 attributes->opType == OP_GENERATEJOIN ||
+				 !attributes->recIndexName);
+	if (generated)
+	{
+		/* Build the model from the events table, then score from it. */
+		*startup_cost += spc_seq_page_cost * baserel->pages;
+		if (FACTOR_METHOD(attributes->method))
+			*startup_cost += cpu_operator_cost * tuples *
+				RECSCAN_FACTOR_FEATURES * RECSCAN_FACTOR_EPOCHS;
+		else
+		{
+			double		fraction = 1.0;
+
+			/*
+			 * Named users only need the rows of the items they rated,
+			 * or their own, each worked out in full; that's done when
+			 * it's less than half of the model (see ratedItemSlice).
+			 */
+			if (attributes->userIDList != NIL ||
+				attributes->userParamList != NIL)
+			{
+				double		rows;
+				double		total;
+
+				rows = userbased ? users :
+					Min(items, users * tuples / allusers);
+				total = userbased ? allusers : items;
+				if (2.0 * rows < total)
+					fraction = 2.0 * rows / total;
+			}
+			*startup_cost += cpu_operator_cost * tuples * perprediction *
+				fraction;
+		}
+	}
+	else if (recathonCacheEnabled() || modelFileExists(attributes->recIndexName))
+	{
+		/* The model is already in memory, or one mapping away. */
+		*startup_cost += cpu_operator_cost * tuples;
+	}
+	else if (!FACTOR_METHOD(attributes->method) && attributes->recModelName)
+	{
+		double		modelpages;
+		double		modeltuples;
+		double		probes;
+		double		fetched;
+		double		pages;
+
+		/*
+		 * Each user looks up the model's rows for the items it rated, or
+		 * its own row, through the model's key. A model too big to stay
+		 * cached costs a random read for most of them.
+		 */
+		recscan_model_size(attributes->recModelName, baserel,
+						   &modelpages, &modeltuples);
+		probes = userbased ? users : users * tuples / allusers;
+		fetched = probes * Max(modeltuples / (userbased ? allusers : items), 1.0);
+		pages = index_pages_fetched(fetched, (BlockNumber) modelpages,
+									modelpages, root);
+		*run_cost += random_page_cost * pages +
+			(cpu_index_tuple_cost + cpu_tuple_cost) * fetched;
+	}
+	else
+	{
+		*startup_cost += spc_seq_page_cost * baserel->pages +
+			cpu_tuple_cost * tuples;
+	}
+
+	return perprediction;
+}
+
 /*
  * cost_index
  *	  Determines and returns the cost of scanning a relation using an index.
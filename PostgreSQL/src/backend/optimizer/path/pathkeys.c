@@ -25,7 +25,9 @@
 #include "optimizer/pathnode.h"
 #include "optimizer/paths.h"
 #include "optimizer/tlist.h"
+#include "parser/parsetree.h"
 #include "utils/lsyscache.h"
+#include "utils/typcache.h"
 
 
 static PathKey *makePathKey(EquivalenceClass *eclass, Oid opfamily,
@@ -575,6 +577,66 @@ build_index_pathkeys(PlannerInfo *root,
 	return retval;
 }
 
+/*
+ * build_recscan_pathkeys
+ *	  Build a pathkeys list that describes the order a RecScan returns its
+ *	  predictions in.
+ *
+ * A RecScan goes through its users in ascending order of user ID, and
+ * through each user's items in ascending order of item ID, so its output
+ * is sorted by user and then item.  For a query about a single user, the
+ * item alone orders it.  As with build_index_pathkeys, the result is
+ * canonical, and stops at the first key no EquivalenceClass is interested
+ * in; the caller should still call truncate_useless_pathkeys().
+ */
+List *
+build_recscan_pathkeys(PlannerInfo *root, RelOptInfo *rel,
+					   AttrNumber userattno, AttrNumber itemattno,
+					   bool single_user)
+{
+	List	   *retval = NIL;
+	RangeTblEntry *rte = planner_rt_fetch(rel->relid, root);
+	AttrNumber	attnos[2];
+	int			i;
+
+	attnos[0] = userattno;
+	attnos[1] = itemattno;
+	for (i = single_user ? 1 : 0; i < lengthof(attnos); i++)
+	{
+		Oid			vartype;
+		int32		vartypmod;
+		Oid			varcollid;
+		TypeCacheEntry *typentry;
+		Var		   *var;
+		PathKey    *cpathkey;
+
+		if (attnos[i] == InvalidAttrNumber)
+			break;
+		get_atttypetypmodcoll(rte->relid, attnos[i],
+							  &vartype, &vartypmod, &varcollid);
+		typentry = lookup_type_cache(vartype, TYPECACHE_LT_OPR);
+		if (!OidIsValid(typentry->lt_opr))
+			break;
+
+		var = makeVar(rel->relid, attnos[i], vartype, vartypmod, varcollid, 0);
+		cpathkey = make_pathkey_from_sortop(root,
+											(Expr *) var,
+											typentry->lt_opr,
+											false,
+											0,
+											false,
+											true);
+		if (!cpathkey)
+			break;
+
+		/* Add to list unless redundant */
+		if (!pathkey_is_redundant(cpathkey, retval))
+			retval = lappend(retval, cpathkey);
+	}
+
+	return retval;
+}
+
 /*
  * convert_subquery_pathkeys
  *	  Build a pathkeys list that describes the ordering of a subquery's
@@ -26,6 +26,7 @@
 #include "nodes/nodeFuncs.h"
 #include "optimizer/clauses.h"
 #include "optimizer/cost.h"
+#include "optimizer/pathnode.h"
 #include "optimizer/paths.h"
 #include "optimizer/placeholder.h"
 #include "optimizer/plancat.h"
@@ -281,9 +282,12 @@ create_scan_plan(PlannerInfo *root, Path *best_path)
 	 * tlist containing all Vars in order.	This will allow the executor to
 	 * optimize away projection of the table tuples, if possible.  (Note that
 	 * planner.c may replace the tlist we generate here, forcing projection to
-	 * occur.)
+	 * occur.)  A RecScan makes up its tuples rather than reading them, so
+	 * there's nothing to save, and it returns only the Vars needed; on a wide
+	 * events table, that's just the user, item and score.  A RecJoin puts
+	 * the physical tlist back.
 	 */
-	if (use_physical_tlist(root, rel))
+	if (best_path->pathtype != T_RecScan && use_physical_tlist(root, rel))
 	{
 		if (best_path->pathtype == T_IndexOnlyScan)
 		{
@@ -419,6 +423,9 @@ scan_clauses);
 				 * is present. */
 //				best_path->pathtype = T_RecScan;
 				recscan = make_rec_from_scan(subscan, rel->recommender);
+				/* The plan above may count on the order set_recscan_pathkeys
+				 * promised. */
+				recscan->ordered = (best_path->pathkeys != NIL);
 				plan = (Plan*) recscan;
 			}
 			break;
@@ -642,6 +649,14 @@ create_join_plan(PlannerInfo *root, JoinPath *best_path)
 	if (create_recjoin) {
 		RecJoin *recjoin;
 		Join *subjoin;
+		List *tlist;
+
+		/* The RecJoin builds its outer tuples in the shape of the
+		 * events table, so that's what the join has to read. */
+		tlist = build_physical_tlist(root,
+			find_base_rel(root, ((Scan*) outer_plan)->scanrelid));
+		if (tlist != NIL)
+			outer_plan->targetlist = tlist;
 
 		/* Restore curOuterRels */
 		bms_free(root->curOuterRels);
@@ -21,6 +21,7 @@
 #include "executor/nodeAgg.h"
 #include "miscadmin.h"
 #include "nodes/makefuncs.h"
+#include "nodes/nodeFuncs.h"
 #ifdef OPTIMIZER_DEBUG
 #include "nodes/print.h"
 #endif
@@ -37,6 +38,7 @@
 #include "parser/analyze.h"
 #include "parser/parsetree.h"
 #include "rewrite/rewriteManip.h"
+#include "utils/lsyscache.h"
 #include "utils/rel.h"
 
 
@@ -64,6 +66,8 @@ static void preprocess_rowmarks(PlannerInfo *root);
 static double preprocess_limit(PlannerInfo *root,
 				 double tuple_fraction,
 				 int64 *offset_est, int64 *count_est);
+static void push_topk_into_recscan(PlannerInfo *root, RecScan *recscan,
+					   double limit_tuples);
 static void preprocess_groupclause(PlannerInfo *root);
 static bool choose_hashed_grouping(PlannerInfo *root,
 					   double tuple_fraction, double limit_tuples,
@@ -1760,6 +1764,11 @@ grouping_planner(PlannerInfo *root, double tuple_fraction)
 	 */
 	if (parse->sortClause)
 	{
+		/* NEW FOR RECDB */
+		if (IsA(result_plan, RecScan))
+			push_topk_into_recscan(root, (RecScan *) result_plan,
+								   limit_tuples);
+
 		if (!pathkeys_contained_in(root->sort_pathkeys, current_pathkeys))
 		{
 			result_plan = (Plan *) make_sort_from_pathkeys(root,
@@ -2243,6 +2252,74 @@ preprocess_limit(PlannerInfo *root, double tuple_fraction,
 	return tuple_fraction;
 }
 
+/* NEW FOR RECDB */
+/*
+ * push_topk_into_recscan - let a RecScan keep only the best tuples
+ *
+ * For the usual query shape, "... RECOMMEND ... ORDER BY ratingval
+ * LIMIT k", the RecScan would produce a tuple for every item and the
+ * Sort above would throw nearly all of them away. If nothing between
+ * the scan and the sort can change which tuples survive, we tell the
+ * RecScan how many tuples are wanted and in which direction, so it can
+ * keep a bounded heap instead. The Sort and Limit stay in the plan;
+ * they just see far fewer tuples.
+ */
+static void
+push_topk_into_recscan(PlannerInfo *root, RecScan *recscan,
+					   double limit_tuples)
+{
+	Query	   *parse = root->parse;
+	RecommendInfo *recInfo = (RecommendInfo *) recscan->recommender;
+	SortGroupClause *sortcl;
+	Node	   *sortexpr;
+	Var		   *var;
+	char	   *attname;
+	Oid			opfamily;
+	Oid			opcintype;
+	int16		strategy;
+
+	if (!recInfo || !recInfo->attributes)
+		return;
+	/* The best few come out best first, not in the order promised. */
+	if (recscan->ordered)
+		return;
+	if (recInfo->attributes->opType == OP_JOIN ||
+		recInfo->attributes->opType == OP_GENERATEJOIN)
+		return;
+
+	/* Anything that combines or multiplies rows rules this out. */
+	if (parse->groupClause || parse->hasAggs || parse->hasWindowFuncs ||
+		parse->havingQual || parse->distinctClause || parse->rowMarks ||
+		expression_returns_set((Node *) parse->targetList))
+		return;
+
+	/* The bound has to be one we can afford to hold on to. */
+	if (limit_tuples <= 0 || limit_tuples > RECSCAN_MAX_TOPK)
+		return;
+
+	/* We only handle a single sort key, on the rating column. */
+	if (list_length(parse->sortClause) != 1)
+		return;
+	sortcl = (SortGroupClause *) linitial(parse->sortClause);
+	sortexpr = get_sortgroupclause_expr(sortcl, parse->targetList);
+	if (!IsA(sortexpr, Var))
+		return;
+	var = (Var *) sortexpr;
+	if (var->varno != recscan->scan.scanrelid || var->varlevelsup != 0)
+		return;
+	attname = get_rte_attribute_name(planner_rt_fetch(var->varno, root),
+									 var->varattno);
+	if (pg_strcasecmp(attname, recInfo->attributes->eventval) != 0)
+		return;
+
+	if (!get_ordering_op_properties(sortcl->sortop,
+									&opfamily, &opcintype, &strategy))
+		return;
+
+	recscan->topK = (int) limit_tuples;
+	recscan->topKDescending = (strategy == BTGreaterStrategyNumber);
+}
+
 
 /*
  * preprocess_groupclause - do preparatory work on GROUP BY clause
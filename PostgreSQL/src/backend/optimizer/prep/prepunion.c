@@ -1235,6 +1235,17 @@ expand_inherited_rtentry(PlannerInfo *root, RangeTblEntry *rte, Index rti)
 		Assert(rte->rtekind == RTE_SUBQUERY);
 		return;
 	}
+	/*
+	 * NEW FOR RECATHON: the events table of a RECOMMEND is only scanned for
+	 * its row type, while the recommender reads its events, children and
+	 * all, with queries of its own.  A RecScan for each child would return
+	 * every prediction once per child, so we keep to the parent.
+	 */
+	if (rte->recommender)
+	{
+		rte->inh = false;
+		return;
+	}
 	/* Fast path for common case of childless table */
 	parentOID = rte->relid;
 	if (!has_subclass(parentOID))
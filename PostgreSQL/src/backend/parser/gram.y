@@ -59,6 +59,7 @@
 #include "nodes/nodeFuncs.h"
 #include "parser/gramparse.h"
 #include "parser/parser.h"
+#include "parser/scansup.h"
 #include "storage/lmgr.h"
 #include "utils/date.h"
 #include "utils/datetime.h"
@@ -145,6 +146,7 @@ static void SplitColQualList(List *qualList,
 static void processCASbits(int cas_bits, int location, const char *constrType,
 			   bool *deferrable, bool *initdeferred, bool *not_valid,
 			   bool *no_inherit, core_yyscan_t yyscanner);
+static char *makeRecFilter(int start, core_yyscan_t yyscanner);
 
 %}
 
@@ -208,7 +210,7 @@ static void processCASbits(int cas_bits, int location, const char *constrType,
 		CreateOpFamilyStmt AlterOpFamilyStmt CreatePLangStmt
 		CreateSchemaStmt CreateSeqStmt CreateStmt CreateRStmt CreateTableSpaceStmt
 		CreateFdwStmt CreateForeignServerStmt CreateForeignTableStmt
-		CreateAssertStmt CreateTrigStmt DropRecStmt
+		CreateAssertStmt CreateTrigStmt DropRecStmt AlterRecStmt
 		CreateUserStmt CreateUserMappingStmt CreateRoleStmt
 		CreatedbStmt DeclareCursorStmt DefineStmt DeleteStmt DiscardStmt DoStmt
 		DropGroupStmt DropOpClassStmt DropOpFamilyStmt DropPLangStmt DropStmt
@@ -246,7 +248,7 @@ static void processCASbits(int cas_bits, int location, const char *constrType,
 				transaction_mode_item
 				create_extension_opt_item alter_extension_opt_item
 
-%type <ival>	opt_lock lock_type cast_context
+%type <ival>	opt_lock lock_type cast_context opt_rec_where opt_rec_rated
 %type <ival>	vacuum_option_list vacuum_option_elem
 %type <boolean>	opt_force opt_or_replace
 				opt_grant_grant_option opt_grant_admin_option
@@ -298,7 +300,8 @@ static void processCASbits(int cas_bits, int location, const char *constrType,
 				OptTableElementList TableElementList OptInherit definition
 				OptTypedTableElementList TypedTableElementList
 				OptForeignTableElementList ForeignTableElementList
-				reloptions opt_reloptions
+				reloptions opt_reloptions opt_rec_partition opt_rec_window
+				rec_ensemble_list
 				OptWith opt_distinct opt_definition func_args func_args_list
 				func_args_with_defaults func_args_with_defaults_list
 				func_as createfunc_opt_list alterfunc_opt_list
@@ -375,7 +378,8 @@ static void processCASbits(int cas_bits, int location, const char *constrType,
 %type <node>	TableElement TypedTableElement ConstraintElem TableFuncElement
 				ForeignTableElement
 %type <node>	columnDef columnOptions
-%type <defelt>	def_elem reloption_elem old_aggr_elem
+%type <defelt>	def_elem reloption_elem old_aggr_elem rec_ensemble_elem
+				opt_rec_candidates
 %type <node>	def_arg columnElem where_clause where_or_current_clause
 				a_expr b_expr c_expr func_expr AexprConst indirection_el
 				columnref in_expr having_clause func_table array_expr
@@ -494,7 +498,7 @@ static void processCASbits(int cas_bits, int location, const char *constrType,
 	BACKWARD BEFORE BEGIN_P BETWEEN BIGINT BINARY BIT
 	BOOLEAN_P BOTH BY
 
-	CACHE CALLED CASCADE CASCADED CASE CAST CATALOG_P CHAIN CHAR_P
+	CACHE CALLED CANDIDATES CASCADE CASCADED CASE CAST CATALOG_P CHAIN CHAR_P
 	CHARACTER CHARACTERISTICS CHECK CHECKPOINT CLASS CLOSE
 	CLUSTER COALESCE COLLATE COLLATION COLUMN COMMENT COMMENTS COMMIT
 	COMMITTED CONCURRENTLY CONFIGURATION CONNECTION CONSTRAINT CONSTRAINTS
@@ -503,7 +507,7 @@ static void processCASbits(int cas_bits, int location, const char *constrType,
 	CURRENT_CATALOG CURRENT_DATE CURRENT_ROLE CURRENT_SCHEMA
 	CURRENT_TIME CURRENT_TIMESTAMP CURRENT_USER CURSOR CYCLE
 
-	DATA_P DATABASE DAY_P DEALLOCATE DEC DECIMAL_P DECLARE DEFAULT DEFAULTS
+	DATA_P DATABASE DAY_P DEALLOCATE DEC DECAY DECIMAL_P DECLARE DEFAULT DEFAULTS
 	DEFERRABLE DEFERRED DEFINER DELETE_P DELIMITER DELIMITERS DESC
 	DICTIONARY DISABLE_P DISCARD DISTINCT DO DOCUMENT_P DOMAIN_P DOUBLE_P DROP
 
@@ -519,8 +523,8 @@ static void processCASbits(int cas_bits, int location, const char *constrType,
 	HANDLER HAVING HEADER_P HOLD HOUR_P
 
 	IDENTITY_P IF_P ILIKE IMMEDIATE IMMUTABLE IMPLICIT_P IN_P
-	INCLUDING INCREMENT INDEX INDEXES INHERIT INHERITS INITIALLY INLINE_P
-	INNER_P INOUT INPUT_P INSENSITIVE INSERT INSTEAD INT_P INTEGER
+	INCLUDE INCLUDING INCREMENT INDEX INDEXES INHERIT INHERITS INITIALLY
+	INLINE_P INNER_P INOUT INPUT_P INSENSITIVE INSERT INSTEAD INT_P INTEGER
 	INTERSECT INTERVAL INTO INVOKER IS ISNULL ISOLATION ITEMS
 
 	JOIN
@@ -546,8 +550,8 @@ static void processCASbits(int cas_bits, int location, const char *constrType,
 
 	QUOTE
 
-	RANGE READ REAL REASSIGN RECHECK RECOMMEND RECOMMENDER RECURSIVE REF
-	REFERENCES REINDEX RELATIVE_P RELEASE RENAME REPEATABLE REPLACE REPLICA
+	RANGE RATED READ REAL REASSIGN RECHECK RECOMMEND RECOMMENDER RECURSIVE REF
+	REFERENCES REFRESH REINDEX RELATIVE_P RELEASE RENAME REPEATABLE REPLACE REPLICA
 	RESET RESTART RESTRICT RETURNING RETURNS REVOKE RIGHT ROLE ROLLBACK
 	ROW ROWS RULE
 
@@ -690,6 +694,7 @@ stmt :
 			| AlterGroupStmt
 			| AlterObjectSchemaStmt
 			| AlterOwnerStmt
+			| AlterRecStmt
 			| AlterSeqStmt
 			| AlterTableStmt
 			| AlterCompositeTypeStmt
@@ -2437,41 +2442,117 @@ copy_generic_opt_arg_list_item:
 /*****************************************************************************
  *
  *		QUERY:
- *				CREATE RECOMMENDER
+ *				CREATE RECOMMENDER name ON table [ WHERE condition ] ...
+ *					[ TIME FROM column WINDOW 'interval' [ DECAY 'interval' ] ]
+ *					[ PARTITION BY column [ FROM table ] ]
+ *					[ WITH ( option = value [, ...] ) ]
  *
  *****************************************************************************/
 
-CreateRStmt:	CREATE RECOMMENDER qualified_name ON qualified_name
+CreateRStmt:	CREATE RECOMMENDER qualified_name ON qualified_name opt_rec_where
 			USERS FROM ColId
 			ITEMS FROM ColId
-			EVENTS FROM ColId
-			USING ColId
+			EVENTS FROM ColId opt_rec_window
+			USING ColId opt_rec_partition opt_reloptions
 				{
 					CreateRStmt *n = makeNode(CreateRStmt);
 					n->recname = $3;
 					n->eventtable = $5;
-					n->userkey = $8;
-					n->itemkey = $11;
-					n->eventval = $14;
-					n->method = $16;
+					n->eventfilter = NULL;
+					if ($6 >= 0)
+						n->eventfilter = makeRecFilter($6, yyscanner);
+					n->userkey = $9;
+					n->itemkey = $12;
+					n->eventval = $15;
+					n->method = $18;
+					n->timekey = NULL;
+					n->timewindow = NULL;
+					n->halflife = NULL;
+					if ($16 != NIL)
+					{
+						n->timekey = strVal(linitial($16));
+						n->timewindow = strVal(lsecond($16));
+						if (lthird($16) != NULL)
+							n->halflife = strVal(lthird($16));
+					}
+					n->partitionkey = NULL;
+					n->partitiontable = NULL;
+					if ($19 != NIL)
+					{
+						n->partitionkey = strVal(linitial($19));
+						n->partitiontable = (RangeVar *) lsecond($19);
+					}
+					n->options = $20;
 					$$ = (Node *)n;
 				}
-		|	CREATE RECOMMENDER qualified_name ON qualified_name
+		|	CREATE RECOMMENDER qualified_name ON qualified_name opt_rec_where
 			USERS FROM ColId
 			ITEMS FROM ColId
-			EVENTS FROM ColId
+			EVENTS FROM ColId opt_rec_window opt_rec_partition opt_reloptions
 				{
 					CreateRStmt *n = makeNode(CreateRStmt);
 					n->recname = $3;
 					n->eventtable = $5;
-					n->userkey = $8;
-					n->itemkey = $11;
-					n->eventval = $14;
+					n->eventfilter = NULL;
+					if ($6 >= 0)
+						n->eventfilter = makeRecFilter($6, yyscanner);
+					n->userkey = $9;
+					n->itemkey = $12;
+					n->eventval = $15;
 					n->method = NULL;
+					n->timekey = NULL;
+					n->timewindow = NULL;
+					n->halflife = NULL;
+					if ($16 != NIL)
+					{
+						n->timekey = strVal(linitial($16));
+						n->timewindow = strVal(lsecond($16));
+						if (lthird($16) != NULL)
+							n->halflife = strVal(lthird($16));
+					}
+					n->partitionkey = NULL;
+					n->partitiontable = NULL;
+					if ($17 != NIL)
+					{
+						n->partitionkey = strVal(linitial($17));
+						n->partitiontable = (RangeVar *) lsecond($17);
+					}
+					n->options = $18;
 					$$ = (Node *)n;
 				}
 		;
 
+/* Where the condition limiting the events a recommender learns from
+ * starts in the query string, or -1 if there isn't one. It's in
+ * parentheses, as for an exclusion constraint, so the text runs up to
+ * the one that closes it. */
+opt_rec_where:
+			WHERE '(' a_expr ')'				{ $$ = @3; }
+		|	/*EMPTY*/							{ $$ = -1; }
+		;
+
+/* The column that times the events, how far back the recommender looks,
+ * and the half-life of an event's weight, if it has one. */
+opt_rec_window:
+			TIME FROM ColId WINDOW Sconst
+				{ $$ = list_make3(makeString($3), makeString($5), NULL); }
+		|	TIME FROM ColId WINDOW Sconst DECAY Sconst
+				{ $$ = list_make3(makeString($3), makeString($5), makeString($7)); }
+		|	/*EMPTY*/
+				{ $$ = NIL; }
+		;
+
+/* The user attribute to split a recommender into cells by, and the table
+ * that has it, if that isn't the events table. */
+opt_rec_partition:
+			PARTITION BY ColId
+				{ $$ = list_make2(makeString($3), NULL); }
+		|	PARTITION BY ColId FROM qualified_name
+				{ $$ = list_make2(makeString($3), $5); }
+		|	/*EMPTY*/
+				{ $$ = NIL; }
+		;
+
 /*****************************************************************************
  *
  *		QUERY:
@@ -2487,6 +2568,47 @@ DropRecStmt:	DROP RECOMMENDER qualified_name
 				}
 		;
 		
+/*****************************************************************************
+ *
+ *		QUERY:
+ *				ALTER RECOMMENDER name REFRESH [ CONCURRENTLY ]
+ *				ALTER RECOMMENDER name SET ( option = value [, ...] )
+ *				ALTER RECOMMENDER name RESET ( option [, ...] )
+ *
+ *****************************************************************************/
+
+AlterRecStmt:	ALTER RECOMMENDER qualified_name REFRESH opt_concurrently
+				{
+					AlterRecStmt *n = makeNode(AlterRecStmt);
+					n->recname = $3;
+					n->refresh = true;
+					n->concurrent = $5;
+					n->options = NIL;
+					n->reset = false;
+					$$ = (Node *)n;
+				}
+		|	ALTER RECOMMENDER qualified_name SET reloptions
+				{
+					AlterRecStmt *n = makeNode(AlterRecStmt);
+					n->recname = $3;
+					n->refresh = false;
+					n->concurrent = false;
+					n->options = $5;
+					n->reset = false;
+					$$ = (Node *)n;
+				}
+		|	ALTER RECOMMENDER qualified_name RESET reloptions
+				{
+					AlterRecStmt *n = makeNode(AlterRecStmt);
+					n->recname = $3;
+					n->refresh = false;
+					n->concurrent = false;
+					n->options = $5;
+					n->reset = true;
+					$$ = (Node *)n;
+				}
+		;
+
 /*****************************************************************************
  *
  *		QUERY :
@@ -8929,15 +9051,48 @@ simple_select:
  * RecDB RECOMMEND clause looks like:
  *
  * RECOMMEND <item> TO <user> ON <events> USING <method>
+ *
+ * or, to blend the scores of several methods in one scan:
+ *
+ * RECOMMEND <item> TO <user> ON <events> USING ensemble(<method> <weight>, ...)
+ *
+ * Either may be followed by CANDIDATES FROM <method> LIMIT <n>, to score
+ * only the n items another method likes best for each user, and then by
+ * EXCLUDE RATED or INCLUDE RATED, to leave out or keep the items the user
+ * has already rated. Queries for the best few leave them out by default.
  */
 recommend_clause:
-		RECOMMEND columnref TO columnref ON columnref USING ColId
+		RECOMMEND columnref TO columnref ON columnref USING ColId opt_rec_candidates opt_rec_rated
 			{
 				RecommendInfo *n = makeNode(RecommendInfo);
 				n->userkey = $4;
 				n->itemkey = $2;
 				n->eventval = $6;
 				n->strmethod = $8;
+				n->ensemble = NIL;
+				n->candidates = $9;
+				n->excludeRated = $10;
+				n->recommender = NULL;
+				n->attributes = NULL;
+				n->opType = OP_GENERATE;
+				$$ = (Node *) n;
+			}
+		| RECOMMEND columnref TO columnref ON columnref USING ColId '(' rec_ensemble_list ')' opt_rec_candidates opt_rec_rated
+			{
+				RecommendInfo *n = makeNode(RecommendInfo);
+				if (strcmp($8, "ensemble") != 0)
+					ereport(ERROR,
+							(errcode(ERRCODE_SYNTAX_ERROR),
+							 errmsg("only an ensemble takes a list of methods"),
+							 parser_errposition(@8)));
+				n->userkey = $4;
+				n->itemkey = $2;
+				n->eventval = $6;
+				/* The first method drives the scan. */
+				n->strmethod = ((DefElem *) linitial($10))->defname;
+				n->ensemble = $10;
+				n->candidates = $12;
+				n->excludeRated = $13;
 				n->recommender = NULL;
 				n->attributes = NULL;
 				n->opType = OP_GENERATE;
@@ -8947,6 +9102,32 @@ recommend_clause:
 			{ $$ = NULL; }
 		;
 
+rec_ensemble_list:
+			rec_ensemble_elem						{ $$ = list_make1($1); }
+			| rec_ensemble_list ',' rec_ensemble_elem	{ $$ = lappend($1, $3); }
+		;
+
+rec_ensemble_elem:
+			ColId NumericOnly
+				{
+					$$ = makeDefElem($1, (Node *) $2);
+				}
+		;
+
+opt_rec_candidates:
+			CANDIDATES FROM ColId LIMIT Iconst
+				{
+					$$ = makeDefElem($3, (Node *) makeInteger($5));
+				}
+			| /* EMPTY */						{ $$ = NULL; }
+		;
+
+opt_rec_rated:
+			EXCLUDE RATED						{ $$ = 1; }
+			| INCLUDE RATED						{ $$ = 0; }
+			| /* EMPTY */						{ $$ = -1; }
+		;
+
 /*
  * SQL standard WITH clause looks like:
  *
@@ -12336,6 +12517,7 @@ unreserved_keyword:
 			| BY
 			| CACHE
 			| CALLED
+			| CANDIDATES
 			| CASCADE
 			| CASCADED
 			| CATALOG_P
@@ -12365,6 +12547,7 @@ unreserved_keyword:
 			| DATABASE
 			| DAY_P
 			| DEALLOCATE
+			| DECAY
 			| DECLARE
 			| DEFAULTS
 			| DEFERRED
@@ -12411,6 +12594,7 @@ unreserved_keyword:
 			| IMMEDIATE
 			| IMMUTABLE
 			| IMPLICIT_P
+			| INCLUDE
 			| INCLUDING
 			| INCREMENT
 			| INDEX
@@ -12480,12 +12664,14 @@ unreserved_keyword:
 			| PROCEDURE
 			| QUOTE
 			| RANGE
+			| RATED
 			| READ
 			| REASSIGN
 			| RECHECK
 			| RECOMMENDER
 			| RECURSIVE
 			| REF
+			| REFRESH
 			| REINDEX
 			| RELATIVE_P
 			| RELEASE
@@ -13357,6 +13543,40 @@ SplitColQualList(List *qualList,
 	*constraintList = qualList;
 }
 
+/*
+ * Copy the text of a CREATE RECOMMENDER's WHERE condition out of the query
+ * string, from where it starts to the parenthesis that closes it.  Recathon
+ * keeps it as text, for the view of the events the recommender is built
+ * from, and to match queries against.  The condition has already been
+ * parsed, so we only have to keep track of nesting and quoting.
+ */
+static char *
+makeRecFilter(int start, core_yyscan_t yyscanner)
+{
+	const char *scanbuf = pg_yyget_extra(yyscanner)->core_yy_extra.scanbuf;
+	const char *p = scanbuf + start;
+	int			depth = 0;
+	char		quote = '\0';
+
+	for (; *p; p++)
+	{
+		if (quote)
+		{
+			if (*p == quote)
+				quote = '\0';
+		}
+		else if (*p == '\'' || *p == '"')
+			quote = *p;
+		else if (*p == '(')
+			depth++;
+		else if (*p == ')' && depth-- == 0)
+			break;
+	}
+	while (p > scanbuf + start && scanner_isspace(p[-1]))
+		p--;
+	return pnstrdup(scanbuf + start, p - (scanbuf + start));
+}
+
 /*
  * Process result of ConstraintAttributeSpec, and set appropriate bool flags
  * in the output command node.  Pass NULL for any flags the particular
@@ -16,8 +16,12 @@
 #include "postgres.h"
 
 #include "catalog/pg_type.h"
+#include "commands/defrem.h"
 #include "executor/executor.h"
 #include "nodes/makefuncs.h"
+#include "nodes/nodeFuncs.h"
+#include "optimizer/var.h"
+#include "parser/analyze.h"
 #include "parser/parse_clause.h"
 #include "parser/parse_coerce.h"
 #include "parser/parse_expr.h"
@@ -36,6 +40,8 @@ static int checkWhereClause(ColumnRef* attribute, RangeVar* recommender, char* u
 //static void modifyTargetList(List *target_list, char *recname, char *viewname);
 //static void modifyColumnRef(ColumnRef *attribute, char *recname, char *viewname);
 static void modifyFrom(SelectStmt *stmt, RecommendInfo *recInfo);
+static void buildEnsemble(SelectStmt *stmt, RecommendInfo *recInfo);
+static void buildCandidates(SelectStmt *stmt, RecommendInfo *recInfo);
 static void filterfirst(Node *whereExpr, RecommendInfo *recInfo);
 static bool filterfirstrecurse(Node *whereExpr, RecommendInfo *recInfo);
 //static void applyRecJoin(Node *whereClause, List *fromClause, RecommendInfo *recInfo);
@@ -43,6 +49,14 @@ static bool filterfirstrecurse(Node *whereExpr, RecommendInfo *recInfo);
 static bool tableMatch(RangeVar* table, char* tablename);
 static Node *makeTrueConst();
 static Node *userWhereClause(Node* whereClause, char *userkey);
+static List *userWhereIDs(Node* whereClause, char *userkey, bool params);
+static Node *keyWhereQuery(Node* whereClause, char *key);
+static Node *keyJoinQuery(SelectStmt *stmt, char *key, bool needFilter);
+static Node *transformKeyQuery(ParseState *pstate, Node *rawQuery);
+static bool containsParams(Node *node, void *context);
+static char *filteredRecommender(SelectStmt *stmt, RecommendInfo *recInfo);
+static bool stripQualifiers(Node *node, void *context);
+static Node *dropWhereTerms(Node *whereClause, List *drop);
 
 /*
  * transformRecommendClause -
@@ -100,6 +114,44 @@ transformRecommendClause(ParseState *pstate, List **targetlist, SelectStmt *stmt
 //	userWhere = userWhereClause(stmt->whereClause, recInfo->attributes->userkey);
 	recInfo->attributes->userWhereClause = userWhere;
 
+	// If the WHERE clause pins the user key to a few constants, we can go
+	// straight to those users rather than testing every user we have.
+	recInfo->attributes->userIDList = userWhereIDs(stmt->whereClause, recInfo->attributes->userkey, false);
+
+	// A prepared statement may pin it to parameters instead, which
+	// the executor looks up each time it runs.
+	if (recInfo->attributes->userIDList == NIL)
+		recInfo->attributes->userParamList = userWhereIDs(stmt->whereClause,
+			recInfo->attributes->userkey, true);
+
+	// Likewise, if it puts the item key IN a subquery, we can run that
+	// first and only score the items it returns. That's how a query
+	// with a spatial predicate on the items gets to use its index.
+	recInfo->attributes->itemWhereQuery = keyWhereQuery(stmt->whereClause, recInfo->attributes->itemkey);
+
+	// If instead it joins the item key to another table and filters
+	// that table, the rows that pass the filter are our items.
+	if (!recInfo->attributes->itemWhereQuery)
+		recInfo->attributes->itemWhereQuery = keyJoinQuery(stmt, recInfo->attributes->itemkey, true);
+
+	// Users can be limited the same ways, when they aren't named. A
+	// table the user key is joined with, such as a list of active
+	// users, limits them even without a filter of its own.
+	if (recInfo->attributes->userIDList == NIL && recInfo->attributes->userParamList == NIL) {
+		recInfo->attributes->userWhereQuery = keyWhereQuery(stmt->whereClause, recInfo->attributes->userkey);
+		if (!recInfo->attributes->userWhereQuery)
+			recInfo->attributes->userWhereQuery = keyJoinQuery(stmt, recInfo->attributes->userkey, false);
+	}
+
+	// An ensemble also needs the recommenders for the methods it
+	// blends in with the first, found the same way.
+	if (recInfo->ensemble)
+		buildEnsemble(stmt, recInfo);
+
+	// So does a cheaper method picking the items for it to score.
+	if (recInfo->candidates)
+		buildCandidates(stmt, recInfo);
+
 	// There's an additional step, where we add the RECOMMEND clause elements into
 	// the target list if they aren't there, but we can't perform this step until
 	// the target list and FROM clauses have been processed, so we'll leave that
@@ -349,16 +401,159 @@ getAttributeInfo(char *eventtable, char *userkey, char *itemkey, char *eventval,
 	attributes->recIndexName = NULL;
 	attributes->recModelName = NULL;
 	attributes->recModelName2 = NULL;
+	attributes->recClusterName = NULL;
 	attributes->recViewName = NULL;
 	attributes->userWhereClause = NULL;
+	attributes->userIDList = NIL;
+	attributes->userParamList = NIL;
+	attributes->itemWhereQuery = NULL;
+	attributes->userWhereQuery = NULL;
 	attributes->IDfound = false;
-	attributes->cellType = CELL_ALPHA;
+	attributes->cellType = CELL_BETA;
 	attributes->opType = recInfo->opType;
 	attributes->noFilter = false;
+	attributes->ensemble = NIL;
+	attributes->weight = 1.0;
+	attributes->candidates = NULL;
+	attributes->candidateLimit = 0;
+	attributes->excludeRated = recInfo->excludeRated;
+	attributes->canGenerate = false;
+	attributes->modelCost = 0.0;
+	attributes->generateCost = 0.0;
 
 	return attributes;
 }
 
+/*
+ * buildEnsemble -
+ *	  For a RECOMMEND clause USING ensemble(...), checks the methods
+ *	  and their weights, and makes an AttributeInfo for each method
+ *	  after the first, which the main one already is. They hang off
+ *	  the main one, so the scan can prepare each user for all of them
+ *	  and blend their scores as it goes.
+ */
+static void
+buildEnsemble(SelectStmt *stmt, RecommendInfo *recInfo) {
+	ListCell *lc, *prev;
+	AttributeInfo *attributes = recInfo->attributes;
+
+	if (list_length(recInfo->ensemble) < 2)
+		ereport(ERROR,
+			(errcode(ERRCODE_SYNTAX_ERROR),
+			 errmsg("an ensemble needs at least two methods")));
+
+	foreach(lc, recInfo->ensemble) {
+		DefElem *def = (DefElem*) lfirst(lc);
+		RecommendInfo *member;
+		double weight;
+
+		if (getRecMethod(def->defname) < 0)
+			ereport(ERROR,
+				(errcode(ERRCODE_SYNTAX_ERROR),
+				 errmsg("recommendation method \"%s\" not recognized",
+					def->defname)));
+		weight = defGetNumeric(def);
+		if (weight <= 0.0)
+			ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("weight of method \"%s\" in ensemble must be positive",
+					def->defname)));
+		for (prev = list_head(recInfo->ensemble); prev != lc; prev = lnext(prev)) {
+			if (strcmp(((DefElem*) lfirst(prev))->defname, def->defname) == 0)
+				ereport(ERROR,
+					(errcode(ERRCODE_SYNTAX_ERROR),
+					 errmsg("method \"%s\" appears more than once in ensemble",
+						def->defname)));
+		}
+
+		// The first method is the one the scan is for.
+		if (lc == list_head(recInfo->ensemble)) {
+			attributes->weight = weight;
+			continue;
+		}
+
+		member = makeNode(RecommendInfo);
+		member->userkey = recInfo->userkey;
+		member->itemkey = recInfo->itemkey;
+		member->eventval = recInfo->eventval;
+		member->strmethod = def->defname;
+		member->ensemble = NIL;
+		member->candidates = NULL;
+		member->excludeRated = recInfo->excludeRated;
+		member->recommender = recInfo->recommender;
+		member->opType = OP_GENERATE;
+		member->attributes = getAttributeInfo(attributes->eventtable,
+			attributes->userkey, attributes->itemkey, attributes->eventval,
+			member);
+		modifyFrom(stmt, member);
+
+		// It's asked about the same users, but only scores the
+		// items the main method comes up with.
+		member->attributes->userIDList = list_copy(attributes->userIDList);
+		member->attributes->userParamList = list_copy(attributes->userParamList);
+		member->attributes->weight = weight;
+		attributes->ensemble = lappend(attributes->ensemble, member->attributes);
+	}
+
+	// Everything's in the attributes now.
+	recInfo->ensemble = NIL;
+}
+
+/*
+ * buildCandidates -
+ *	  For a RECOMMEND clause with CANDIDATES FROM <method> LIMIT <n>,
+ *	  checks the method and the limit, and makes an AttributeInfo for
+ *	  the method, found the same way as the main one. The scan asks it
+ *	  for each user's best n items, and the main method (or ensemble)
+ *	  only scores those.
+ */
+static void
+buildCandidates(SelectStmt *stmt, RecommendInfo *recInfo) {
+	DefElem *def = recInfo->candidates;
+	AttributeInfo *attributes = recInfo->attributes;
+	RecommendInfo *source;
+	int method;
+
+	method = getRecMethod(def->defname);
+	if (method < 0)
+		ereport(ERROR,
+			(errcode(ERRCODE_SYNTAX_ERROR),
+			 errmsg("recommendation method \"%s\" not recognized",
+				def->defname)));
+	if (method == attributes->method)
+		ereport(ERROR,
+			(errcode(ERRCODE_SYNTAX_ERROR),
+			 errmsg("method \"%s\" can't pick the candidates it scores itself",
+				def->defname)));
+	if (intVal(def->arg) <= 0)
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("LIMIT of CANDIDATES FROM must be positive")));
+
+	source = makeNode(RecommendInfo);
+	source->userkey = recInfo->userkey;
+	source->itemkey = recInfo->itemkey;
+	source->eventval = recInfo->eventval;
+	source->strmethod = def->defname;
+	source->ensemble = NIL;
+	source->candidates = NULL;
+	source->excludeRated = recInfo->excludeRated;
+	source->recommender = recInfo->recommender;
+	source->opType = OP_GENERATE;
+	source->attributes = getAttributeInfo(attributes->eventtable,
+		attributes->userkey, attributes->itemkey, attributes->eventval,
+		source);
+	modifyFrom(stmt, source);
+
+	// It's asked about the same users, and looks at every item.
+	source->attributes->userIDList = list_copy(attributes->userIDList);
+	source->attributes->userParamList = list_copy(attributes->userParamList);
+	attributes->candidates = source->attributes;
+	attributes->candidateLimit = intVal(def->arg);
+
+	recInfo->candidates = NULL;
+}
+
 /*
  * addRecTargets -
  *	  This function will verify that certain ColumnRefs are part of the
@@ -531,19 +726,40 @@ static void
 modifyFrom(SelectStmt *stmt, RecommendInfo *recInfo) {
 	int i;
 //	char *eventtable;
-	char *query_string, *recindexname;
-	char *recmodelname, *recmodelname2, *recviewname;
+	char *recindexname, *cellindexname;
+	char *recmodelname, *recmodelname2, *recclustername, *recviewname;
 	recMethod method;
-	// Query information.
-	QueryDesc *queryDesc;
-	PlanState *planstate;
 	TupleTableSlot *slot;
-	MemoryContext recathoncontext;
 
 	method = (recMethod) recInfo->attributes->method;
 	// We'll take a look to see if a recommender was already built
-	// on this table and method.
-	recindexname = retrieveRecommender(recInfo->attributes->eventtable,recInfo->strmethod);
+	// on this table and method. One built from just the events the
+	// query asks for comes first.
+	recindexname = filteredRecommender(stmt, recInfo);
+	if (!recindexname)
+		recindexname = retrieveRecommender(recInfo->attributes->eventtable,recInfo->strmethod);
+
+	// A partitioned recommender hands a query over to the cell its
+	// users are in, if they're all in the same one.
+	if (recindexname) {
+		cellindexname = getRecCell(recindexname,
+			userWhereIDs(stmt->whereClause, recInfo->attributes->userkey, false));
+		if (cellindexname) {
+			pfree(recindexname);
+			recindexname = cellindexname;
+		}
+	}
+
+	// If the maintenance process has decided this recommender isn't
+	// queried often enough to keep its model up, we generate the
+	// recommendation on the fly as if it weren't built. We still
+	// count the query against it, so it can come back.
+	if (recindexname && getRecLevel(recindexname) == RECATHON_LEVEL_GENERATE) {
+		for (i = 0; i < strlen(recindexname); i++)
+			recindexname[i] = tolower(recindexname[i]);
+		recInfo->attributes->recIndexName = recindexname;
+		recindexname = NULL;
+	}
 
 	// If no recommender turned up, we'll just return right away.
 	// We'll utilize the events table for our event generation. Though
@@ -564,44 +780,40 @@ modifyFrom(SelectStmt *stmt, RecommendInfo *recInfo) {
 		recInfo->attributes->opType = OP_FILTER;
 	}
 
-	// If a recommender did turn up, then we need to track down the
-	// RecView and replace our event table with it. We'll also store
-	// the model table(s) for later use.
-	query_string = (char*) palloc(1024*sizeof(char));
-	if (method == SVD)
-		sprintf(query_string,"select r.recusermodelname,r.recitemmodelname,r.recviewname from %s r;",
-			recindexname);
+	// Whose predictions the RecView has, if it has any.
+	if (getRecViewSize(recindexname) <= 0)
+		recInfo->attributes->cellType = CELL_BETA;
+	else if (getRecHybrid(recindexname))
+		recInfo->attributes->cellType = CELL_ALPHA;
 	else
-		sprintf(query_string,"select r.recmodelname,r.recviewname from %s r;",
-			recindexname);
-
-	// Now we prep the query.
-	queryDesc = recathon_queryStart(query_string, &recathoncontext);
-	planstate = queryDesc->planstate;
+		recInfo->attributes->cellType = CELL_GAMMA;
 
-	// Now that we have a correct planstate, we can actually get information
-	// from the table.
-	slot = ExecProcNode(planstate);
-	if (TupIsNull(slot)) {
+	// If a recommender did turn up, then we need to track down the
+	// RecView and replace our event table with it. We'll also store
+	// the model table(s) for later use. The index table's row comes
+	// from the catalogue cache, so this is normally just a lookup.
+	slot = getRecIndexSlot(recindexname);
+	if (!slot) {
 		ereport(WARNING,
 			(errcode(ERRCODE_SYNTAX_ERROR),
 			 errmsg("recommender is built, but model could not be accessed. Building recommendation on the fly")));
 		return;
 	}
 
-	// Now we grab the appropriate information from the query tuple.
-	if (method == SVD) {
+	// Now we grab the appropriate information from the tuple. Older
+	// factor recommenders have no column for the approximate top-k
+	// index, and get NULL.
+	if (FACTOR_METHOD(method)) {
 		recmodelname = getTupleString(slot,"recusermodelname");
 		recmodelname2 = getTupleString(slot,"recitemmodelname");
+		recclustername = getTupleString(slot,"recclustermodelname");
 	} else {
 		recmodelname = getTupleString(slot,"recmodelname");
 		recmodelname2 = NULL;
+		recclustername = NULL;
 	}
 	recviewname = getTupleString(slot,"recviewname");
-
-	// Now to tidy up.
-	recathon_queryEnd(queryDesc, recathoncontext);
-	pfree(query_string);
+	ExecDropSingleTupleTableSlot(slot);
 
 	// If we get to this point and there's no recmodelname, our query turned
 	// up no results, and something weird has gone wrong. I can't imagine a
@@ -625,12 +837,27 @@ modifyFrom(SelectStmt *stmt, RecommendInfo *recInfo) {
 		for (i = 0; i < strlen(recmodelname2); i++)
 			recmodelname2[i] = tolower(recmodelname2[i]);
 	}
+	if (recclustername) {
+		for (i = 0; i < strlen(recclustername); i++)
+			recclustername[i] = tolower(recclustername[i]);
+	}
 
 	// Store the info, so we can use it later for the query.
 	recInfo->attributes->recIndexName = recindexname;
 	recInfo->attributes->recModelName = recmodelname;
 	recInfo->attributes->recModelName2 = recmodelname2;
+	recInfo->attributes->recClusterName = recclustername;
 	recInfo->attributes->recViewName = recviewname;
+
+	// A similarity model with nothing in its RecView for us could just
+	// as well be generated on the fly, if that gives the same answers;
+	// the planner decides which is cheaper.
+	recInfo->attributes->canGenerate =
+		(method == itemCosCF || method == itemPearCF ||
+		 method == itemJaccardCF || method == userCosCF ||
+		 method == userPearCF) &&
+		recInfo->attributes->cellType == CELL_BETA &&
+		getRecGeneratable(recindexname, recInfo->attributes->eventtable);
 //	recInfo->attributes->recViewName = recInfo->attributes->eventtable;
 
 	// When we do find the match, we need to replace our event table from the FROM clause
@@ -1095,7 +1322,9 @@ userWhereClause(Node* whereClause, char *userkey) {
 	recAExpr = (A_Expr*) whereClause;
 
 	// If our expression is an OP or IN, then do the actual check.
-	if (recAExpr->kind == AEXPR_OP || recAExpr->kind == AEXPR_IN) {
+	// An = ANY or ALL is an OP with an array on the right.
+	if (recAExpr->kind == AEXPR_OP || recAExpr->kind == AEXPR_IN ||
+	    recAExpr->kind == AEXPR_OP_ANY || recAExpr->kind == AEXPR_OP_ALL) {
 		char *leftcol, *lefttable;
 		char *rightcol, *righttable;
 		bool leftiscol = false, rightiscol = false, userfound = false;
@@ -1181,9 +1410,533 @@ userWhereClause(Node* whereClause, char *userkey) {
 	return (Node *) recAExpr;
 }
 
+/*
+ * userWhereConst -
+ *	  A helper function for userWhereIDs. Returns true if the node
+ *	  is an integer constant, and stores it.
+ */
+static bool
+userWhereConst(Node *node, int *value) {
+	A_Const *con;
+
+	if (!node || nodeTag(node) != T_A_Const)
+		return false;
+
+	con = (A_Const*) node;
+	if (nodeTag(&con->val) != T_Integer)
+		return false;
+
+	(*value) = (int) intVal(&con->val);
+	return true;
+}
+
+/*
+ * userWhereParam -
+ *	  A helper function for userWhereIDs. Returns true if the node
+ *	  is a parameter reference, possibly cast, and stores its number.
+ */
+static bool
+userWhereParam(Node *node, int *value) {
+	if (node && nodeTag(node) == T_TypeCast)
+		node = ((TypeCast*) node)->arg;
+	if (!node || nodeTag(node) != T_ParamRef)
+		return false;
+
+	(*value) = ((ParamRef*) node)->number;
+	return true;
+}
+
+/*
+ * userWhereIDs -
+ *	  A function to find the user IDs our query is limited to, when
+ *	  one of the top-level AND terms of the WHERE clause is of the form
+ *	  userkey = constant, userkey IN (constants) or userkey = ANY
+ *	  (ARRAY[constants]). Returns an integer
+ *	  list of the IDs, or NIL if there is no such term. The list only
+ *	  narrows down which users we look at; the user WHERE clause is
+ *	  still checked for each of them. If params is true, we look for
+ *	  the same term with parameters in place of the constants, and
+ *	  return their numbers instead; userkey = ANY($n) has one
+ *	  parameter holding an array of IDs.
+ */
+static List*
+userWhereIDs(Node* whereClause, char *userkey, bool params) {
+	A_Expr *recAExpr;
+	char *opname, *colname, *tablename;
+	Node *colnode, *valnode;
+	List *IDs = NIL;
+	int value;
+
+	if (!whereClause || nodeTag(whereClause) != T_A_Expr)
+		return NIL;
+
+	recAExpr = (A_Expr*) whereClause;
+
+	// Any term of an AND will do.
+	if (recAExpr->kind == AEXPR_AND) {
+		IDs = userWhereIDs(recAExpr->lexpr, userkey, params);
+		if (IDs == NIL)
+			IDs = userWhereIDs(recAExpr->rexpr, userkey, params);
+		return IDs;
+	}
+
+	if (recAExpr->kind != AEXPR_OP && recAExpr->kind != AEXPR_IN &&
+	    recAExpr->kind != AEXPR_OP_ANY)
+		return NIL;
+	if (!recAExpr->name || list_length(recAExpr->name) != 1)
+		return NIL;
+	opname = strVal(linitial(recAExpr->name));
+	if (strcmp(opname,"=") != 0)
+		return NIL;
+
+	// Figure out which side is the column.
+	colnode = recAExpr->lexpr;
+	valnode = recAExpr->rexpr;
+	if (recAExpr->kind == AEXPR_OP && colnode &&
+			nodeTag(colnode) != T_ColumnRef) {
+		colnode = recAExpr->rexpr;
+		valnode = recAExpr->lexpr;
+	}
+	if (!colnode || nodeTag(colnode) != T_ColumnRef)
+		return NIL;
+	colname = getTableRef((ColumnRef*) colnode, &tablename);
+	if (!colname || strcmp(colname,userkey) != 0)
+		return NIL;
+
+	// An = ANY has an array on the right: ARRAY[...] of values, or
+	// a parameter holding all of them, which the executor unpacks.
+	if (recAExpr->kind == AEXPR_OP_ANY) {
+		ListCell *val_cell;
+
+		if (valnode && nodeTag(valnode) == T_TypeCast)
+			valnode = ((TypeCast*) valnode)->arg;
+		if (params)
+			return userWhereParam(valnode, &value) ? list_make1_int(value) : NIL;
+		if (!valnode || nodeTag(valnode) != T_A_ArrayExpr)
+			return NIL;
+		foreach(val_cell, ((A_ArrayExpr*) valnode)->elements) {
+			if (!userWhereConst((Node*) lfirst(val_cell), &value)) {
+				list_free(IDs);
+				return NIL;
+			}
+			IDs = lappend_int(IDs, value);
+		}
+		return IDs;
+	}
+
+	// An IN has a plain list of values on the right.
+	if (recAExpr->kind == AEXPR_IN) {
+		ListCell *val_cell;
+
+		if (!valnode || nodeTag(valnode) != T_List)
+			return NIL;
+		foreach(val_cell, (List*) valnode) {
+			if (!(params ? userWhereParam((Node*) lfirst(val_cell), &value) :
+					userWhereConst((Node*) lfirst(val_cell), &value))) {
+				list_free(IDs);
+				return NIL;
+			}
+			IDs = lappend_int(IDs, value);
+		}
+		return IDs;
+	}
+
+	if (!(params ? userWhereParam(valnode, &value) :
+			userWhereConst(valnode, &value)))
+		return NIL;
+	return list_make1_int(value);
+}
+
+/*
+ * keyWhereQuery -
+ *	  A function to find the subquery our items or users are limited
+ *	  to, when one of the top-level AND terms of the WHERE clause is of
+ *	  the form key IN (SELECT ...). Returns a copy of the raw subquery,
+ *	  or NULL if there is no such term. As with userWhereIDs, the term
+ *	  stays in the WHERE clause.
+ */
+static Node*
+keyWhereQuery(Node* whereClause, char *key) {
+	SubLink *sublink;
+	char *colname, *tablename;
+	Node *subquery;
+
+	if (!whereClause)
+		return NULL;
+
+	// Any term of an AND will do.
+	if (nodeTag(whereClause) == T_A_Expr) {
+		A_Expr *recAExpr = (A_Expr*) whereClause;
+
+		if (recAExpr->kind != AEXPR_AND)
+			return NULL;
+		subquery = keyWhereQuery(recAExpr->lexpr, key);
+		if (!subquery)
+			subquery = keyWhereQuery(recAExpr->rexpr, key);
+		return subquery;
+	}
+
+	if (nodeTag(whereClause) != T_SubLink)
+		return NULL;
+	sublink = (SubLink*) whereClause;
+	if (sublink->subLinkType != ANY_SUBLINK)
+		return NULL;
+	if (!sublink->operName || list_length(sublink->operName) != 1 ||
+			strcmp(strVal(linitial(sublink->operName)),"=") != 0)
+		return NULL;
+	if (!sublink->testexpr || nodeTag(sublink->testexpr) != T_ColumnRef)
+		return NULL;
+	colname = getTableRef((ColumnRef*) sublink->testexpr, &tablename);
+	if (!colname || strcmp(colname,key) != 0)
+		return NULL;
+
+	return (Node*) copyObject(sublink->subselect);
+}
+
+/*
+ * whereTerms -
+ *	  A helper function for keyJoinQuery, which lists the top-level
+ *	  AND terms of a WHERE clause.
+ */
+static List*
+whereTerms(Node *whereClause, List *terms) {
+	if (!whereClause)
+		return terms;
+
+	if (nodeTag(whereClause) == T_A_Expr &&
+			((A_Expr*) whereClause)->kind == AEXPR_AND) {
+		terms = whereTerms(((A_Expr*) whereClause)->lexpr, terms);
+		return whereTerms(((A_Expr*) whereClause)->rexpr, terms);
+	}
+
+	return lappend(terms, whereClause);
+}
+
+/*
+ * refersElsewhere -
+ *	  A helper function for keyJoinQuery. A walker that returns true
+ *	  if an expression uses anything other than the columns of the
+ *	  given table, or anything we wouldn't want to move into a query
+ *	  of its own.
+ */
+static bool
+refersElsewhere(Node *node, void *context) {
+	RangeVar *partner = (RangeVar*) context;
+
+	if (node == NULL)
+		return false;
+
+	if (IsA(node, ColumnRef)) {
+		char *colname, *tablename = NULL;
+
+		colname = getTableRef((ColumnRef*) node, &tablename);
+		return !colname || !tablename || !tableMatch(partner, tablename);
+	}
+	if (IsA(node, SubLink) || IsA(node, ParamRef))
+		return true;
+
+	return raw_expression_tree_walker(node, refersElsewhere, context);
+}
+
+/*
+ * keyJoinQuery -
+ *	  A function to find the items or users our query is limited to,
+ *	  when one of the top-level AND terms of the WHERE clause joins the
+ *	  key to a column of another table in the FROM clause, and others
+ *	  filter on that table alone. We return a raw query for the column
+ *	  under those filters, which keyWhereQuery would have found had
+ *	  the query been written with an IN, or NULL if there is no such
+ *	  join. If needFilter is true, a join without filters doesn't
+ *	  count. As before, the terms stay in the WHERE clause.
+ */
+static Node*
+keyJoinQuery(SelectStmt *stmt, char *key, bool needFilter) {
+	List *terms;
+	ListCell *term_cell, *from_cell;
+	RangeVar *partner = NULL;
+	ColumnRef *partnerCol = NULL;
+	Node *joinTerm = NULL, *filter = NULL;
+	SelectStmt *keyQuery;
+	ResTarget *target;
+
+	terms = whereTerms(stmt->whereClause, NIL);
+
+	// First we look for the join.
+	foreach(term_cell, terms) {
+		A_Expr *recAExpr = (A_Expr*) lfirst(term_cell);
+		int side;
+
+		if (nodeTag(recAExpr) != T_A_Expr || recAExpr->kind != AEXPR_OP)
+			continue;
+		if (!recAExpr->name || list_length(recAExpr->name) != 1 ||
+				strcmp(strVal(linitial(recAExpr->name)),"=") != 0)
+			continue;
+		if (!recAExpr->lexpr || nodeTag(recAExpr->lexpr) != T_ColumnRef ||
+				!recAExpr->rexpr || nodeTag(recAExpr->rexpr) != T_ColumnRef)
+			continue;
+
+		// Either side can be our key.
+		for (side = 0; side < 2 && !partner; side++) {
+			ColumnRef *itemCol, *otherCol;
+			char *colname, *tablename = NULL;
+			char *othername, *othertable = NULL;
+
+			itemCol = (ColumnRef*) (side == 0 ? recAExpr->lexpr : recAExpr->rexpr);
+			otherCol = (ColumnRef*) (side == 0 ? recAExpr->rexpr : recAExpr->lexpr);
+			colname = getTableRef(itemCol, &tablename);
+			othername = getTableRef(otherCol, &othertable);
+			if (!colname || strcmp(colname,key) != 0 ||
+					!othername || !othertable)
+				continue;
+
+			// The key has to be the events table's, and the
+			// other column a plain table's in the same FROM list,
+			// so the join is an inner one.
+			foreach(from_cell, stmt->fromClause) {
+				RangeVar *fromVar = (RangeVar*) lfirst(from_cell);
+
+				if (nodeTag(fromVar) != T_RangeVar)
+					continue;
+				if (fromVar->recommender) {
+					if (tablename && !tableMatch(fromVar, tablename))
+						break;
+					continue;
+				}
+				if (tableMatch(fromVar, othertable)) {
+					partner = fromVar;
+					partnerCol = otherCol;
+				}
+			}
+			if (from_cell != NULL)
+				partner = NULL;
+		}
+
+		if (partner) {
+			joinTerm = (Node*) recAExpr;
+			break;
+		}
+	}
+	if (!partner) {
+		list_free(terms);
+		return NULL;
+	}
+
+	// Then for the filters on the other table.
+	foreach(term_cell, terms) {
+		Node *term = (Node*) lfirst(term_cell);
+
+		if (term == joinTerm || refersElsewhere(term, partner))
+			continue;
+		if (filter)
+			filter = (Node*) makeA_Expr(AEXPR_AND, NIL, filter,
+				(Node*) copyObject(term), -1);
+		else
+			filter = (Node*) copyObject(term);
+	}
+	list_free(terms);
+
+	// Without any, we'd only be scoring the items that table has,
+	// which isn't worth another query. A table of users, though, is
+	// usually far smaller than the list of everyone.
+	if (!filter && needFilter)
+		return NULL;
+
+	target = makeNode(ResTarget);
+	target->name = NULL;
+	target->indirection = NIL;
+	target->val = (Node*) copyObject(partnerCol);
+	target->location = -1;
+
+	keyQuery = makeNode(SelectStmt);
+	keyQuery->targetList = list_make1(target);
+	keyQuery->fromClause = list_make1(copyObject(partner));
+	keyQuery->whereClause = filter;
+
+	return (Node*) keyQuery;
+}
+
+/*
+ * containsParams -
+ *	  A walker that looks for parameters, which a query run on its own
+ *	  would have no values for.
+ */
+static bool
+containsParams(Node *node, void *context) {
+	if (node == NULL)
+		return false;
+	if (IsA(node, Param))
+		return true;
+	if (IsA(node, Query))
+		return query_tree_walker((Query*) node, containsParams, context, 0);
+	return expression_tree_walker(node, containsParams, context);
+}
+
+/*
+ * filteredRecommender -
+ *	  A function to find a recommender built with a WHERE condition that
+ *	  our query can use. It can if every top-level AND term of the
+ *	  condition is also one of the query's, on the events table, in
+ *	  which case those terms have been taken care of by the recommender
+ *	  and come out of the WHERE clause; the columns they test aren't in
+ *	  the tuples we make anyway. If more than one will do, we take the
+ *	  one with the most terms. Returns its RecIndex name, or NULL.
+ */
+static char*
+filteredRecommender(SelectStmt *stmt, RecommendInfo *recInfo) {
+	List *recindexnames, *filters, *queryTerms;
+	List *bestTerms = NIL;
+	ListCell *name_cell, *filter_cell;
+	char *bestname = NULL;
+	int bestcount = 0;
+
+	recindexnames = filteredRecommenders(recInfo->attributes->eventtable,
+		recInfo->strmethod, &filters);
+	if (recindexnames == NIL || !stmt->whereClause)
+		return NULL;
+
+	queryTerms = whereTerms(stmt->whereClause, NIL);
+
+	forboth(name_cell, recindexnames, filter_cell, filters) {
+		char *filterquery;
+		List *parsetree, *filterTerms, *matched = NIL;
+		ListCell *filter_term, *query_term;
+		bool allFound = true;
+
+		// The condition is kept as text, so we parse it the same
+		// way as the query's.
+		filterquery = (char*) palloc((strlen((char*) lfirst(filter_cell))+64)*sizeof(char));
+		sprintf(filterquery,"SELECT 1 WHERE (%s)",(char*) lfirst(filter_cell));
+		parsetree = raw_parser(filterquery);
+		pfree(filterquery);
+		filterTerms = whereTerms(((SelectStmt*) linitial(parsetree))->whereClause, NIL);
+
+		foreach(filter_term, filterTerms) {
+			Node *filterNode = (Node*) copyObject(lfirst(filter_term));
+			bool found = false;
+
+			stripQualifiers(filterNode, NULL);
+			foreach(query_term, queryTerms) {
+				Node *queryNode = (Node*) copyObject(lfirst(query_term));
+
+				if (!stripQualifiers(queryNode, recInfo->recommender) &&
+				    equal(queryNode, filterNode)) {
+					matched = lappend(matched, lfirst(query_term));
+					found = true;
+					break;
+				}
+			}
+			if (!found) {
+				allFound = false;
+				break;
+			}
+		}
+
+		if (allFound && list_length(filterTerms) > bestcount) {
+			bestname = (char*) lfirst(name_cell);
+			bestcount = list_length(filterTerms);
+			list_free(bestTerms);
+			bestTerms = matched;
+		} else
+			list_free(matched);
+	}
+
+	if (bestname)
+		stmt->whereClause = dropWhereTerms(stmt->whereClause, bestTerms);
+
+	list_free(bestTerms);
+	list_free(queryTerms);
+	return bestname;
+}
+
+/*
+ * stripQualifiers -
+ *	  A helper function for filteredRecommender. A walker that leaves
+ *	  just the column name in each ColumnRef of an expression, so that
+ *	  a term can be compared whether or not the table is named. If
+ *	  given the events table, it returns true if a ColumnRef names any
+ *	  other, in which case the term can't be one of the condition's.
+ */
+static bool
+stripQualifiers(Node *node, void *context) {
+	RangeVar *events = (RangeVar*) context;
+
+	if (node == NULL)
+		return false;
+
+	if (IsA(node, ColumnRef)) {
+		ColumnRef *colref = (ColumnRef*) node;
+		char *colname, *tablename = NULL;
+
+		colname = getTableRef(colref, &tablename);
+		if (!colname)
+			return true;
+		if (tablename && events && !tableMatch(events, tablename))
+			return true;
+		colref->fields = list_make1(makeString(colname));
+		return false;
+	}
+
+	return raw_expression_tree_walker(node, stripQualifiers, context);
+}
+
+/*
+ * dropWhereTerms -
+ *	  A helper function for filteredRecommender, which replaces the
+ *	  given top-level AND terms of a WHERE clause with TRUE.
+ */
+static Node*
+dropWhereTerms(Node *whereClause, List *drop) {
+	if (!whereClause)
+		return NULL;
+
+	if (nodeTag(whereClause) == T_A_Expr &&
+			((A_Expr*) whereClause)->kind == AEXPR_AND) {
+		A_Expr *andExpr = (A_Expr*) whereClause;
+
+		andExpr->lexpr = dropWhereTerms(andExpr->lexpr, drop);
+		andExpr->rexpr = dropWhereTerms(andExpr->rexpr, drop);
+		return whereClause;
+	}
+
+	if (list_member_ptr(drop, whereClause))
+		return makeTrueConst();
+	return whereClause;
+}
+
+/*
+ * transformKeyQuery -
+ *	  A helper function for userWhereTransform, which transforms an
+ *	  item or user subquery. The executor runs it on its own, so we
+ *	  forget about it (returning NULL) if it refers to the outer query
+ *	  or parameters, or doesn't return a single integer column.
+ */
+static Node*
+transformKeyQuery(ParseState *pstate, Node *rawQuery) {
+	Query *keyQuery;
+	TargetEntry *tle;
+	Oid coltype;
+
+	if (!rawQuery)
+		return NULL;
+
+	keyQuery = parse_sub_analyze(rawQuery, pstate, NULL, false);
+	if (keyQuery->commandType != CMD_SELECT ||
+			list_length(keyQuery->targetList) != 1 ||
+			contain_vars_of_level((Node*) keyQuery, 1) ||
+			containsParams((Node*) keyQuery, NULL))
+		return NULL;
+	tle = (TargetEntry*) linitial(keyQuery->targetList);
+	coltype = exprType((Node*) tle->expr);
+	if (coltype != INT2OID && coltype != INT4OID && coltype != INT8OID)
+		return NULL;
+	return (Node*) keyQuery;
+}
+
 /*
  * userWhereClause -
- *	  A function to transform a modified WHERE clause.
+ *	  A function to transform a modified WHERE clause. We transform the
+ *	  item and user subqueries here as well; the WHERE clause still
+ *	  applies them if we have to forget about them.
  */
 void
 userWhereTransform(ParseState *pstate, Node* recommendClause) {
@@ -1200,4 +1953,9 @@ userWhereTransform(ParseState *pstate, Node* recommendClause) {
 		userWhere = coerce_to_boolean(pstate, userWhere, "USER_WHERE");
 	}
 	recInfo->attributes->userWhereClause = userWhere;
+
+	recInfo->attributes->itemWhereQuery = transformKeyQuery(pstate,
+		recInfo->attributes->itemWhereQuery);
+	recInfo->attributes->userWhereQuery = transformKeyQuery(pstate,
+		recInfo->attributes->userWhereQuery);
 }
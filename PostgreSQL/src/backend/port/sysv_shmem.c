@@ -30,6 +30,7 @@
 #include "miscadmin.h"
 #include "storage/ipc.h"
 #include "storage/pg_shmem.h"
+#include "utils/recathoncache.h"
 
 
 typedef key_t IpcMemoryKey;		/* shared memory key passed to shmget(2) */
@@ -69,10 +70,31 @@ static PGShmemHeader *PGSharedMemoryAttach(IpcMemoryKey key,
 static void *
 InternalIpcMemoryCreate(IpcMemoryKey memKey, Size size)
 {
-	IpcMemoryId shmid;
+	IpcMemoryId shmid = -1;
 	void	   *memAddress;
 
-	shmid = shmget(memKey, size, IPC_CREAT | IPC_EXCL | IPCProtection);
+#ifdef SHM_HUGETLB
+
+	/*
+	 * A big recommender model cache is read all over by every backend, so
+	 * we can ask for the segment in huge pages, to spare the TLB.  If the
+	 * kernel has none to give us, we use normal pages.
+	 */
+	if (recathon_cache_huge_pages && recathon_cache_size > 0)
+	{
+		Size		hugesize;
+
+		hugesize = ((size + RECATHON_HUGE_PAGE_SIZE - 1) / RECATHON_HUGE_PAGE_SIZE) *
+			RECATHON_HUGE_PAGE_SIZE;
+		shmid = shmget(memKey, hugesize,
+					   IPC_CREAT | IPC_EXCL | IPCProtection | SHM_HUGETLB);
+		if (shmid < 0 && errno != EEXIST && errno != EACCES)
+			elog(LOG, "could not get huge pages for shared memory, using normal pages: %m");
+	}
+#endif
+
+	if (shmid < 0)
+		shmid = shmget(memKey, size, IPC_CREAT | IPC_EXCL | IPCProtection);
 
 	if (shmid < 0)
 	{
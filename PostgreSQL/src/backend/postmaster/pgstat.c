@@ -99,6 +99,7 @@
 #define PGSTAT_DB_HASH_SIZE		16
 #define PGSTAT_TAB_HASH_SIZE	512
 #define PGSTAT_FUNCTION_HASH_SIZE	512
+#define PGSTAT_REC_HASH_SIZE	64
 
 
 /* ----------
@@ -172,6 +173,18 @@ static HTAB *pgStatFunctions = NULL;
  */
 static bool have_function_stats = false;
 
+/*
+ * Backends store per-recommender counts that are waiting to be sent to the
+ * collector in this hash table (indexed by recommender name).
+ */
+static HTAB *pgStatRecommenders = NULL;
+
+/*
+ * Indicates if backend has some recommender stats that it hasn't yet
+ * sent to the collector.
+ */
+static bool have_recommender_stats = false;
+
 /*
  * Tuple insertion/deletion counts for an open transaction can't be propagated
  * into PgStat_TableStatus counters until we know if it is going to commit
@@ -258,6 +271,7 @@ static void pgstat_read_current_status(void);
 
 static void pgstat_send_tabstat(PgStat_MsgTabstat *tsmsg);
 static void pgstat_send_funcstats(void);
+static void pgstat_send_recstats(void);
 static HTAB *pgstat_collect_oids(Oid catalogid);
 
 static PgStat_TableStatus *get_tabstat_entry(Oid rel_id, bool isshared);
@@ -283,6 +297,9 @@ static void pgstat_recv_funcpurge(PgStat_MsgFuncpurge *msg, int len);
 static void pgstat_recv_recoveryconflict(PgStat_MsgRecoveryConflict *msg, int len);
 static void pgstat_recv_deadlock(PgStat_MsgDeadlock *msg, int len);
 static void pgstat_recv_tempfile(PgStat_MsgTempFile *msg, int len);
+static void pgstat_recv_recstat(PgStat_MsgRecstat *msg, int len);
+static void pgstat_recv_recmaint(PgStat_MsgRecmaint *msg, int len);
+static void pgstat_recv_recpurge(PgStat_MsgRecpurge *msg, int len);
 
 
 /* ------------------------------------------------------------
@@ -686,7 +703,7 @@ pgstat_report_stat(bool force)
 
 	/* Don't expend a clock check if nothing to do */
 	if ((pgStatTabList == NULL || pgStatTabList->tsa_used == 0)
-		&& !have_function_stats)
+		&& !have_function_stats && !have_recommender_stats)
 		return;
 
 	/*
@@ -761,6 +778,9 @@ pgstat_report_stat(bool force)
 
 	/* Now, send function statistics */
 	pgstat_send_funcstats();
+
+	/* And recommender statistics */
+	pgstat_send_recstats();
 }
 
 /*
@@ -862,6 +882,52 @@ pgstat_send_funcstats(void)
 	have_function_stats = false;
 }
 
+/*
+ * Subroutine for pgstat_report_stat: populate and send a recommender stat
+ * message
+ */
+static void
+pgstat_send_recstats(void)
+{
+	PgStat_MsgRecstat msg;
+	PgStat_BackendRecEntry *entry;
+	HASH_SEQ_STATUS rstat;
+
+	if (pgStatRecommenders == NULL || !have_recommender_stats)
+		return;
+
+	pgstat_setheader(&msg.m_hdr, PGSTAT_MTYPE_RECSTAT);
+	msg.m_databaseid = MyDatabaseId;
+	msg.m_nentries = 0;
+
+	hash_seq_init(&rstat, pgStatRecommenders);
+	while ((entry = (PgStat_BackendRecEntry *) hash_seq_search(&rstat)) != NULL)
+	{
+		/* Skip it if no queries since last time */
+		if (entry->r_counts.r_queries == 0)
+			continue;
+
+		memcpy(&msg.m_entry[msg.m_nentries], entry,
+			   sizeof(PgStat_BackendRecEntry));
+
+		if (++msg.m_nentries >= PGSTAT_NUM_RECENTRIES)
+		{
+			pgstat_send(&msg, offsetof(PgStat_MsgRecstat, m_entry[0]) +
+						msg.m_nentries * sizeof(PgStat_BackendRecEntry));
+			msg.m_nentries = 0;
+		}
+
+		/* reset the entry's counts */
+		MemSet(&entry->r_counts, 0, sizeof(PgStat_RecommenderCounts));
+	}
+
+	if (msg.m_nentries > 0)
+		pgstat_send(&msg, offsetof(PgStat_MsgRecstat, m_entry[0]) +
+					msg.m_nentries * sizeof(PgStat_BackendRecEntry));
+
+	have_recommender_stats = false;
+}
+
 
 /* ----------
  * pgstat_vacuum_stat() -
@@ -1382,6 +1448,119 @@ pgstat_report_tempfile(size_t filesize)
 }
 
 
+/* ----------
+ * pgstat_count_recommender_query() -
+ *
+ *	Count a query one of our recommenders served: the predictions it
+ *	made, the queries it ran internally to make them, how long it took
+ *	in microseconds, and how much memory it held.  These go out with
+ *	the next pgstat_report_stat().
+ * ----------
+ */
+void
+pgstat_count_recommender_query(const char *recname,
+							   PgStat_Counter predictions,
+							   PgStat_Counter internal_queries,
+							   PgStat_Counter time, PgStat_Counter memory)
+{
+	PgStat_BackendRecEntry *entry;
+	char		key[NAMEDATALEN];
+	bool		found;
+
+	if (pgStatSock == PGINVALID_SOCKET || !pgstat_track_counts)
+		return;
+
+	if (!pgStatRecommenders)
+	{
+		HASHCTL		hash_ctl;
+
+		memset(&hash_ctl, 0, sizeof(hash_ctl));
+		hash_ctl.keysize = NAMEDATALEN;
+		hash_ctl.entrysize = sizeof(PgStat_BackendRecEntry);
+		pgStatRecommenders = hash_create("Recommender stat entries",
+										 PGSTAT_REC_HASH_SIZE,
+										 &hash_ctl,
+										 HASH_ELEM);
+	}
+
+	MemSet(key, 0, NAMEDATALEN);
+	strlcpy(key, recname, NAMEDATALEN);
+	entry = (PgStat_BackendRecEntry *) hash_search(pgStatRecommenders, key,
+												   HASH_ENTER, &found);
+	if (!found)
+		MemSet(&entry->r_counts, 0, sizeof(PgStat_RecommenderCounts));
+
+	entry->r_counts.r_queries++;
+	entry->r_counts.r_predictions += predictions;
+	entry->r_counts.r_internal_queries += internal_queries;
+	entry->r_counts.r_total_time += time;
+	entry->r_counts.r_max_time = Max(entry->r_counts.r_max_time, time);
+	entry->r_counts.r_memory = memory;
+
+	have_recommender_stats = true;
+}
+
+/* ----------
+ * pgstat_report_recommender_maint() -
+ *
+ *	Tell the collector what model maintenance found for a recommender,
+ *	and whether it rebuilt the model.  Maintenance is rare enough that
+ *	we send this right away.
+ * ----------
+ */
+void
+pgstat_report_recommender_maint(const char *recname, bool rebuilt,
+								PgStat_Counter rebuild_time,
+								PgStat_Counter events,
+								PgStat_Counter disk_size)
+{
+	PgStat_MsgRecmaint msg;
+
+	if (pgStatSock == PGINVALID_SOCKET || !pgstat_track_counts)
+		return;
+
+	pgstat_setheader(&msg.m_hdr, PGSTAT_MTYPE_RECMAINT);
+	msg.m_databaseid = MyDatabaseId;
+	MemSet(msg.m_name, 0, NAMEDATALEN);
+	strlcpy(msg.m_name, recname, NAMEDATALEN);
+	msg.m_rebuilt = rebuilt;
+	msg.m_rebuild_time = rebuild_time;
+	msg.m_events = events;
+	msg.m_disk_size = disk_size;
+	pgstat_send(&msg, sizeof(msg));
+}
+
+/* ----------
+ * pgstat_drop_recommender() -
+ *
+ *	Tell the collector that a recommender is gone.
+ * ----------
+ */
+void
+pgstat_drop_recommender(const char *recname)
+{
+	PgStat_MsgRecpurge msg;
+
+	if (pgStatRecommenders)
+	{
+		char		key[NAMEDATALEN];
+
+		MemSet(key, 0, NAMEDATALEN);
+		strlcpy(key, recname, NAMEDATALEN);
+		(void) hash_search(pgStatRecommenders, key, HASH_REMOVE, NULL);
+	}
+
+	if (pgStatSock == PGINVALID_SOCKET)
+		return;
+
+	pgstat_setheader(&msg.m_hdr, PGSTAT_MTYPE_RECPURGE);
+	msg.m_databaseid = MyDatabaseId;
+	MemSet(msg.m_name, 0, NAMEDATALEN);
+	strlcpy(msg.m_name, recname, NAMEDATALEN);
+	pgstat_send(&msg, sizeof(msg));
+}
+
+
 /* ----------
  * pgstat_ping() -
  *
@@ -2208,6 +2387,52 @@ pgstat_fetch_stat_funcentry(Oid func_id)
 }
 
 
+/* ----------
+ * pgstat_fetch_stat_recentry() -
+ *
+ *	Support function for the SQL-callable pgstat* functions. Returns
+ *	the collected statistics for one recommender or NULL.
+ * ----------
+ */
+PgStat_StatRecEntry *
+pgstat_fetch_stat_recentry(const char *recname)
+{
+	HTAB	   *rechash = pgstat_fetch_stat_recommenders();
+	char		key[NAMEDATALEN];
+
+	if (rechash == NULL)
+		return NULL;
+
+	MemSet(key, 0, NAMEDATALEN);
+	strlcpy(key, recname, NAMEDATALEN);
+	return (PgStat_StatRecEntry *) hash_search(rechash, key, HASH_FIND, NULL);
+}
+
+
+/* ----------
+ * pgstat_fetch_stat_recommenders() -
+ *
+ *	Support function for the SQL-callable pgstat* functions. Returns
+ *	the hash table of statistics for our database's recommenders, or
+ *	NULL if there are none.
+ * ----------
+ */
+HTAB *
+pgstat_fetch_stat_recommenders(void)
+{
+	PgStat_StatDBEntry *dbentry;
+
+	/* load the stats file if needed */
+	backend_read_statsfile();
+
+	dbentry = pgstat_fetch_stat_dbentry(MyDatabaseId);
+	if (dbentry == NULL)
+		return NULL;
+
+	return dbentry->recommenders;
+}
+
+
 /* ----------
  * pgstat_fetch_stat_beentry() -
  *
@@ -2463,6 +2688,7 @@ pgstat_bestart(void)
 	beentry->st_state = STATE_UNDEFINED;
 	beentry->st_appname[0] = '\0';
 	beentry->st_activity[0] = '\0';
+	beentry->st_progress_recname[0] = '\0';
 	/* Also make sure the last byte in each string area is always 0 */
 	beentry->st_clienthostname[NAMEDATALEN - 1] = '\0';
 	beentry->st_appname[NAMEDATALEN - 1] = '\0';
@@ -2670,6 +2896,106 @@ pgstat_report_waiting(bool waiting)
 	beentry->st_waiting = waiting;
 }
 
+/* ----------
+ * pgstat_progress_start_recommender() -
+ *
+ *	Called as CREATE RECOMMENDER, or a rebuild of a recommender, starts,
+ *	so that pg_stat_progress_recommender shows it until
+ *	pgstat_progress_end() is called, or the transaction aborts. The
+ *	builders report their phases, and how far along each one is, from
+ *	their outer loops; the rest of the time nothing is being built, and
+ *	those reports cost next to nothing.
+ * ----------
+ */
+void
+pgstat_progress_start_recommender(const char *recname)
+{
+	volatile PgBackendStatus *beentry = MyBEEntry;
+	TimestampTz now;
+
+	if (!pgstat_track_activities || !beentry)
+		return;
+
+	now = GetCurrentTimestamp();
+	beentry->st_changecount++;
+	strlcpy((char *) beentry->st_progress_recname, recname, NAMEDATALEN);
+	beentry->st_progress_phase = RECBUILD_PHASE_INITIALIZING;
+	beentry->st_progress_done = 0;
+	beentry->st_progress_total = 0;
+	beentry->st_progress_start_timestamp = now;
+	beentry->st_progress_phase_timestamp = now;
+	beentry->st_changecount++;
+	Assert((beentry->st_changecount & 1) == 0);
+}
+
+/* ----------
+ * pgstat_progress_phase() -
+ *
+ *	Called as a recommender build enters a new phase, with as many units
+ *	of work as it's expected to take, or 0 if we can't tell.
+ * ----------
+ */
+void
+pgstat_progress_phase(RecBuildPhase phase, int64 total)
+{
+	volatile PgBackendStatus *beentry = MyBEEntry;
+	TimestampTz now;
+
+	if (!pgstat_track_activities || !beentry ||
+		beentry->st_progress_recname[0] == '\0')
+		return;
+
+	now = GetCurrentTimestamp();
+	beentry->st_changecount++;
+	beentry->st_progress_phase = phase;
+	beentry->st_progress_done = 0;
+	beentry->st_progress_total = total;
+	beentry->st_progress_phase_timestamp = now;
+	beentry->st_changecount++;
+	Assert((beentry->st_changecount & 1) == 0);
+}
+
+/* ----------
+ * pgstat_progress_update() -
+ *
+ *	Reports how many units of work a recommender build's phase has done.
+ * ----------
+ */
+void
+pgstat_progress_update(int64 done)
+{
+	volatile PgBackendStatus *beentry = MyBEEntry;
+
+	if (!pgstat_track_activities || !beentry ||
+		beentry->st_progress_recname[0] == '\0')
+		return;
+
+	beentry->st_changecount++;
+	beentry->st_progress_done = done;
+	beentry->st_changecount++;
+	Assert((beentry->st_changecount & 1) == 0);
+}
+
+/* ----------
+ * pgstat_progress_end() -
+ *
+ *	Called once a recommender build is over, or has failed.
+ * ----------
+ */
+void
+pgstat_progress_end(void)
+{
+	volatile PgBackendStatus *beentry = MyBEEntry;
+
+	if (!beentry || beentry->st_progress_recname[0] == '\0')
+		return;
+
+	beentry->st_changecount++;
+	beentry->st_progress_recname[0] = '\0';
+	beentry->st_changecount++;
+	Assert((beentry->st_changecount & 1) == 0);
+}
+
 
 /* ----------
  * pgstat_read_current_status() -
@@ -3226,6 +3552,18 @@ PgstatCollectorMain(int argc, char *argv[])
 					pgstat_recv_tempfile((PgStat_MsgTempFile *) &msg, len);
 					break;
 
+				case PGSTAT_MTYPE_RECSTAT:
+					pgstat_recv_recstat((PgStat_MsgRecstat *) &msg, len);
+					break;
+
+				case PGSTAT_MTYPE_RECMAINT:
+					pgstat_recv_recmaint((PgStat_MsgRecmaint *) &msg, len);
+					break;
+
+				case PGSTAT_MTYPE_RECPURGE:
+					pgstat_recv_recpurge((PgStat_MsgRecpurge *) &msg, len);
+					break;
+
 				default:
 					break;
 			}
@@ -3324,6 +3662,7 @@ pgstat_get_db_entry(Oid databaseid, bool create)
 
 		result->tables = NULL;
 		result->functions = NULL;
+		result->recommenders = NULL;
 		result->n_xact_commit = 0;
 		result->n_xact_rollback = 0;
 		result->n_blocks_fetched = 0;
@@ -3363,6 +3702,13 @@ pgstat_get_db_entry(Oid databaseid, bool create)
 										PGSTAT_FUNCTION_HASH_SIZE,
 										&hash_ctl,
 										HASH_ELEM | HASH_FUNCTION);
+
+		hash_ctl.keysize = NAMEDATALEN;
+		hash_ctl.entrysize = sizeof(PgStat_StatRecEntry);
+		result->recommenders = hash_create("Per-database recommender",
+										   PGSTAT_REC_HASH_SIZE,
+										   &hash_ctl,
+										   HASH_ELEM);
 	}
 
 	return result;
@@ -3434,9 +3780,11 @@ pgstat_write_statsfile(bool permanent)
 	HASH_SEQ_STATUS hstat;
 	HASH_SEQ_STATUS tstat;
 	HASH_SEQ_STATUS fstat;
+	HASH_SEQ_STATUS rstat;
 	PgStat_StatDBEntry *dbentry;
 	PgStat_StatTabEntry *tabentry;
 	PgStat_StatFuncEntry *funcentry;
+	PgStat_StatRecEntry *recentry;
 	FILE	   *fpout;
 	int32		format_id;
 	const char *tmpfile = permanent ? PGSTAT_STAT_PERMANENT_TMPFILE : pgstat_stat_tmpname;
@@ -3511,6 +3859,17 @@ pgstat_write_statsfile(bool permanent)
 			(void) rc;			/* we'll check for error with ferror */
 		}
 
+		/*
+		 * Walk through the database's recommender stats table.
+		 */
+		hash_seq_init(&rstat, dbentry->recommenders);
+		while ((recentry = (PgStat_StatRecEntry *) hash_seq_search(&rstat)) != NULL)
+		{
+			fputc('R', fpout);
+			rc = fwrite(recentry, sizeof(PgStat_StatRecEntry), 1, fpout);
+			(void) rc;			/* we'll check for error with ferror */
+		}
+
 		/*
 		 * Mark the end of this DB
 		 */
@@ -3600,10 +3959,13 @@ pgstat_read_statsfile(Oid onlydb, bool permanent)
 	PgStat_StatTabEntry tabbuf;
 	PgStat_StatFuncEntry funcbuf;
 	PgStat_StatFuncEntry *funcentry;
+	PgStat_StatRecEntry recbuf;
+	PgStat_StatRecEntry *recentry;
 	HASHCTL		hash_ctl;
 	HTAB	   *dbhash;
 	HTAB	   *tabhash = NULL;
 	HTAB	   *funchash = NULL;
+	HTAB	   *rechash = NULL;
 	FILE	   *fpin;
 	int32		format_id;
 	bool		found;
@@ -3687,8 +4049,8 @@ pgstat_read_statsfile(Oid onlydb, bool permanent)
 		{
 				/*
 				 * 'D'	A PgStat_StatDBEntry struct describing a database
-				 * follows. Subsequently, zero to many 'T' and 'F' entries
-				 * will follow until a 'd' is encountered.
+				 * follows. Subsequently, zero to many 'T', 'F' and 'R'
+				 * entries will follow until a 'd' is encountered.
 				 */
 			case 'D':
 				if (fread(&dbbuf, 1, offsetof(PgStat_StatDBEntry, tables),
@@ -3718,6 +4080,7 @@ pgstat_read_statsfile(Oid onlydb, bool permanent)
 				memcpy(dbentry, &dbbuf, sizeof(PgStat_StatDBEntry));
 				dbentry->tables = NULL;
 				dbentry->functions = NULL;
+				dbentry->recommenders = NULL;
 
 				/*
 				 * Don't collect tables if not the requested DB (or the
@@ -3749,12 +4112,22 @@ pgstat_read_statsfile(Oid onlydb, bool permanent)
 												 &hash_ctl,
 								   HASH_ELEM | HASH_FUNCTION | HASH_CONTEXT);
 
+				memset(&hash_ctl, 0, sizeof(hash_ctl));
+				hash_ctl.keysize = NAMEDATALEN;
+				hash_ctl.entrysize = sizeof(PgStat_StatRecEntry);
+				hash_ctl.hcxt = pgStatLocalContext;
+				dbentry->recommenders = hash_create("Per-database recommender",
+													PGSTAT_REC_HASH_SIZE,
+													&hash_ctl,
+												HASH_ELEM | HASH_CONTEXT);
+
 				/*
 				 * Arrange that following records add entries to this
 				 * database's hash tables.
 				 */
 				tabhash = dbentry->tables;
 				funchash = dbentry->functions;
+				rechash = dbentry->recommenders;
 				break;
 
 				/*
@@ -3763,6 +4136,7 @@ pgstat_read_statsfile(Oid onlydb, bool permanent)
 			case 'd':
 				tabhash = NULL;
 				funchash = NULL;
+				rechash = NULL;
 				break;
 
 				/*
@@ -3833,6 +4207,40 @@ pgstat_read_statsfile(Oid onlydb, bool permanent)
 				memcpy(funcentry, &funcbuf, sizeof(funcbuf));
 				break;
 
+				/*
+				 * 'R'	A PgStat_StatRecEntry follows.
+				 */
+			case 'R':
+				if (fread(&recbuf, 1, sizeof(PgStat_StatRecEntry),
+						  fpin) != sizeof(PgStat_StatRecEntry))
+				{
+					ereport(pgStatRunningInCollector ? LOG : WARNING,
+							(errmsg("corrupted statistics file \"%s\"",
+									statfile)));
+					goto done;
+				}
+
+				/*
+				 * Skip if recommender belongs to a not requested database.
+				 */
+				if (rechash == NULL)
+					break;
+
+				recentry = (PgStat_StatRecEntry *) hash_search(rechash,
+													(void *) recbuf.recname,
+														 HASH_ENTER, &found);
+
+				if (found)
+				{
+					ereport(pgStatRunningInCollector ? LOG : WARNING,
+							(errmsg("corrupted statistics file \"%s\"",
+									statfile)));
+					goto done;
+				}
+
+				memcpy(recentry, &recbuf, sizeof(recbuf));
+				break;
+
 				/*
 				 * 'E'	The EOF marker of a complete stats file.
 				 */
@@ -4200,6 +4608,8 @@ pgstat_recv_dropdb(PgStat_MsgDropdb *msg, int len)
 			hash_destroy(dbentry->tables);
 		if (dbentry->functions != NULL)
 			hash_destroy(dbentry->functions);
+		if (dbentry->recommenders != NULL)
+			hash_destroy(dbentry->recommenders);
 
 		if (hash_search(pgStatDBHash,
 						(void *) &(dbentry->databaseid),
@@ -4239,9 +4649,12 @@ pgstat_recv_resetcounter(PgStat_MsgResetcounter *msg, int len)
 		hash_destroy(dbentry->tables);
 	if (dbentry->functions != NULL)
 		hash_destroy(dbentry->functions);
+	if (dbentry->recommenders != NULL)
+		hash_destroy(dbentry->recommenders);
 
 	dbentry->tables = NULL;
 	dbentry->functions = NULL;
+	dbentry->recommenders = NULL;
 
 	/*
 	 * Reset database-level stats too.	This should match the initialization
@@ -4281,6 +4694,13 @@ pgstat_recv_resetcounter(PgStat_MsgResetcounter *msg, int len)
 									 PGSTAT_FUNCTION_HASH_SIZE,
 									 &hash_ctl,
 									 HASH_ELEM | HASH_FUNCTION);
+
+	hash_ctl.keysize = NAMEDATALEN;
+	hash_ctl.entrysize = sizeof(PgStat_StatRecEntry);
+	dbentry->recommenders = hash_create("Per-database recommender",
+										PGSTAT_REC_HASH_SIZE,
+										&hash_ctl,
+										HASH_ELEM);
 }
 
 /* ----------
@@ -4601,3 +5021,109 @@ pgstat_recv_funcpurge(PgStat_MsgFuncpurge *msg, int len)
 						   HASH_REMOVE, NULL);
 	}
 }
+
+/* ----------
+ * pgstat_get_rec_entry() -
+ *
+ *	Find or create the collector's entry for a recommender.
+ * ----------
+ */
+static PgStat_StatRecEntry *
+pgstat_get_rec_entry(PgStat_StatDBEntry *dbentry, const char *recname)
+{
+	PgStat_StatRecEntry *recentry;
+	bool		found;
+
+	recentry = (PgStat_StatRecEntry *) hash_search(dbentry->recommenders,
+												   (void *) recname,
+												   HASH_ENTER, &found);
+	if (!found)
+	{
+		MemSet(((char *) recentry) + NAMEDATALEN, 0,
+			   sizeof(PgStat_StatRecEntry) - NAMEDATALEN);
+	}
+
+	return recentry;
+}
+
+/* ----------
+ * pgstat_recv_recstat() -
+ *
+ *	Count the queries a backend's recommenders served.
+ * ----------
+ */
+static void
+pgstat_recv_recstat(PgStat_MsgRecstat *msg, int len)
+{
+	PgStat_BackendRecEntry *recmsg = &(msg->m_entry[0]);
+	PgStat_StatDBEntry *dbentry;
+	PgStat_StatRecEntry *recentry;
+	int			i;
+
+	dbentry = pgstat_get_db_entry(msg->m_databaseid, true);
+
+	/*
+	 * Process all recommender entries in the message.
+	 */
+	for (i = 0; i < msg->m_nentries; i++, recmsg++)
+	{
+		recentry = pgstat_get_rec_entry(dbentry, recmsg->r_name);
+
+		recentry->queries += recmsg->r_counts.r_queries;
+		recentry->predictions += recmsg->r_counts.r_predictions;
+		recentry->internal_queries += recmsg->r_counts.r_internal_queries;
+		recentry->total_time += recmsg->r_counts.r_total_time;
+		recentry->max_time = Max(recentry->max_time,
+								 recmsg->r_counts.r_max_time);
+		recentry->memory_size = recmsg->r_counts.r_memory;
+	}
+}
+
+/* ----------
+ * pgstat_recv_recmaint() -
+ *
+ *	Record what model maintenance did with a recommender.
+ * ----------
+ */
+static void
+pgstat_recv_recmaint(PgStat_MsgRecmaint *msg, int len)
+{
+	PgStat_StatDBEntry *dbentry;
+	PgStat_StatRecEntry *recentry;
+
+	dbentry = pgstat_get_db_entry(msg->m_databaseid, true);
+	recentry = pgstat_get_rec_entry(dbentry, msg->m_name);
+
+	if (msg->m_rebuilt)
+	{
+		recentry->rebuilds++;
+		recentry->last_rebuild_time = msg->m_rebuild_time;
+		recentry->last_rebuild = GetCurrentTimestamp();
+	}
+	recentry->events_since_rebuild = msg->m_events;
+	recentry->disk_size = msg->m_disk_size;
+}
+
+/* ----------
+ * pgstat_recv_recpurge() -
+ *
+ *	Arrange for dead recommender removal.
+ * ----------
+ */
+static void
+pgstat_recv_recpurge(PgStat_MsgRecpurge *msg, int len)
+{
+	PgStat_StatDBEntry *dbentry;
+
+	dbentry = pgstat_get_db_entry(msg->m_databaseid, false);
+
+	/*
+	 * No need to purge if we don't even know the database.
+	 */
+	if (!dbentry || !dbentry->recommenders)
+		return;
+
+	/* Remove from hashtable if present; we don't care if it's not. */
+	(void) hash_search(dbentry->recommenders, (void *) msg->m_name,
+					   HASH_REMOVE, NULL);
+}
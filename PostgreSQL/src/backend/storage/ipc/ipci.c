@@ -37,6 +37,12 @@
 #include "storage/procsignal.h"
 #include "storage/sinvaladt.h"
 #include "storage/spin.h"
+#include "utils/recathonbuilds.h"
+#include "utils/recathoncache.h"
+#include "utils/recathonevents.h"
+#include "utils/recathonlatency.h"
+#include "utils/recathonqueries.h"
+#include "utils/recathonresults.h"
 
 
 shmem_startup_hook_type shmem_startup_hook = NULL;
@@ -126,6 +132,12 @@ CreateSharedMemoryAndSemaphores(bool makePrivate, int port)
 		size = add_size(size, BTreeShmemSize());
 		size = add_size(size, SyncScanShmemSize());
 		size = add_size(size, AsyncShmemSize());
+		size = add_size(size, RecathonCacheShmemSize());
+		size = add_size(size, RecathonResultCacheShmemSize());
+		size = add_size(size, RecathonEventsShmemSize());
+		size = add_size(size, RecathonBuildsShmemSize());
+		size = add_size(size, RecathonQueriesShmemSize());
+		size = add_size(size, RecathonLatencyShmemSize());
 #ifdef EXEC_BACKEND
 		size = add_size(size, ShmemBackendArraySize());
 #endif
@@ -235,6 +247,12 @@ CreateSharedMemoryAndSemaphores(bool makePrivate, int port)
 	BTreeShmemInit();
 	SyncScanShmemInit();
 	AsyncShmemInit();
+	RecathonCacheShmemInit();
+	RecathonResultCacheShmemInit();
+	RecathonEventsShmemInit();
+	RecathonBuildsShmemInit();
+	RecathonQueriesShmemInit();
+	RecathonLatencyShmemInit();
 
 #ifdef EXEC_BACKEND
 
@@ -51,6 +51,7 @@
 #include "commands/view.h"
 #include "miscadmin.h"
 #include "parser/parse_utilcmd.h"
+#include "pgstat.h"
 #include "postmaster/bgwriter.h"
 #include "rewrite/rewriteDefine.h"
 #include "rewrite/rewriteRemove.h"
@@ -74,11 +75,15 @@
 #include "parser/parse_relation.h"
 #include "utils/builtins.h"
 #include "utils/inet.h"
+#include "utils/lsyscache.h"
 #include "utils/rel.h"
 #include "utils/typcache.h"
 // Additional include for DropRecStmt
 #include "executor/executor.h"
 #include "utils/recathon.h"
+#include "utils/recathoncache.h"
+#include "utils/recathonlatency.h"
+#include "utils/recathonresults.h"
 
 /* Hook for plugins to get control in ProcessUtility() */
 ProcessUtility_hook_type ProcessUtility_hook = NULL;
@@ -86,43 +91,40 @@ ProcessUtility_hook_type ProcessUtility_hook = NULL;
 /* The functions for creating recommendation models. */
 static void itemSimilarity(CreateRStmt *recStmt, recMethod method);
 static void userSimilarity(CreateRStmt *recStmt, recMethod method);
-static void SVDSimilarity(CreateRStmt *recStmt);
+static void SVDSimilarity(CreateRStmt *recStmt, recMethod method);
+/* The functions for partitioned recommenders' cells. */
+static void createRecCells(CreateRStmt *recStmt);
+static void dropRecCells(char *recname);
+
+/*
+ * How a recommender's model tables are created. Models can always be
+ * rebuilt from the events, so they needn't be written to WAL if the
+ * recommender says so.
+ */
+static char *modelPersistence(CreateRStmt *recStmt) {
+	return getRecOptionBool(recStmt->options, "unlogged", false) ?
+		"UNLOGGED " : "";
+}
 
 /*
  * Create item similarity matrices for each cell in a recommender.
  */
 static void itemSimilarity(CreateRStmt *recStmt, recMethod method) {
 	int numEvents = 0;
-	char *recindexname, *recmodelname, *recviewname;
+	sim_params params;
+	char *recindexname, *recmodelname, *recviewname, *eventsource;
 	struct timeval timestamp;
-	// For cosine similarity, we will constantly re-use the vector
-	// length of each item, and that's a pain to calculate. We're
-	// going to pre-calculate that information, store it in an
-	// array, and refer to it when necessary.
-	int *itemIDs;
-	float *itemLengths;
-	// For Pearson correlation.
-	float *itemAvgs, *itemPearsons;
-	int numItems;
 	// Objects for querying.
 	char *querystring;
 
-	// For cosine, we obtain the list of items, the number of items, and their vector lengths.
-	if (method == itemCosCF)
-		itemLengths = vector_lengths(recStmt->itemkey,recStmt->eventtable->relname,
-						recStmt->eventval,&numItems,&itemIDs);
-
-	// For Pearson, we obtain the list of items, the number of items, their average events,
-	// and another useful constant (I'm calling them Pearsons).
-	else if (method == itemPearCF)
-		pearson_info(recStmt->itemkey,recStmt->eventtable->relname,
-			recStmt->eventval,&numItems,&itemIDs,&itemAvgs,&itemPearsons);
-
 	// Let's quickly fill in the name of the recIndex,
 	// since it'll be an argument for a later function.
 	recindexname = (char*) palloc((6+strlen(recStmt->eventtable->relname)+strlen(recStmt->method))*sizeof(char));
 	sprintf(recindexname,"%sIndex",recStmt->recname->relname);
 
+	// The models are built from the events in the window, if any.
+	eventsource = getRecEventSource(recindexname,recStmt->eventtable->relname);
+
 	// Inserting the one entry for the recindex.
 	querystring = (char*) palloc(1024*sizeof(char));
 	gettimeofday(&timestamp,NULL);
@@ -138,8 +140,8 @@ static void itemSimilarity(CreateRStmt *recStmt, recMethod method) {
 		timestamp.tv_sec,timestamp.tv_usec);
 
 	// We need to create a RecModel and calculate item similarities.
-	sprintf(querystring,"CREATE TABLE %s (item1 INTEGER NOT NULL, item2 INTEGER NOT NULL, similarity REAL NOT NULL);",
-		recmodelname);
+	sprintf(querystring,"CREATE %sTABLE %s (item1 INTEGER NOT NULL, item2 INTEGER NOT NULL, similarity REAL NOT NULL);",
+		modelPersistence(recStmt),recmodelname);
 	// Execute the INSERT.
 	recathon_utilityExecute(querystring);
 
@@ -157,15 +159,23 @@ static void itemSimilarity(CreateRStmt *recStmt, recMethod method) {
 	recathon_queryExecute(querystring);
 
 	// The task of populating the similarity matrix is left to an
-	// external function.
-	if (method == itemCosCF)
-		numEvents = updateItemCosModel(recStmt->eventtable->relname,recStmt->userkey,recStmt->itemkey,
-					recStmt->eventval,recmodelname,itemIDs,itemLengths,
-					numItems,false);
-	else if (method == itemPearCF)
-		numEvents = updateItemPearModel(recStmt->eventtable->relname,recStmt->userkey,recStmt->itemkey,
-					recStmt->eventval,recmodelname,itemIDs,itemAvgs,
-					itemPearsons,numItems,false);
+	// external function, which may split it across several workers,
+	// or build it in blocks if it won't fit in memory.
+	getSimParams(recStmt->options, &params);
+	if (getRecOptionBool(recStmt->options, "vector_store", false)) {
+		// Keep the rating vectors packed for rebuilds to read.
+		createVectorStore(recindexname,recStmt->eventtable->relname,
+			recStmt->userkey,recStmt->itemkey,recStmt->eventval);
+		params.vectorStore = recindexname;
+	}
+	numEvents = buildSimilarityModel(method,eventsource,
+				recStmt->userkey,recStmt->itemkey,recStmt->eventval,
+				recmodelname,&params);
+	noteBuildStrategy(recStmt->recname->relname,recindexname,&params,NOTICE);
+
+	// Store both directions of each pair, if asked.
+	if (getRecOptionBool(recStmt->options, "symmetric", false))
+		symmetrizeSimilarityModel(recmodelname, true);
 
 	// Now we can insert an entry into the index table for this cell.
 	sprintf(querystring,"INSERT INTO %s VALUES (default, '%s', '%s', 0, %d, 0, 0.0, 0.0, localtimestamp);",
@@ -174,6 +184,39 @@ static void itemSimilarity(CreateRStmt *recStmt, recMethod method) {
 	// Now execute the INSERT query.
 	recathon_queryExecute(querystring);
 	pfree(querystring);
+
+	// Keep what it takes to fold new events into the model, if asked.
+	if (getRecOptionBool(recStmt->options, "incremental", false))
+		buildItemCosStats(recindexname,eventsource,
+			recStmt->userkey,recStmt->itemkey,recStmt->eventval,
+			recmodelname);
+
+	// Keep track of which items get new events, if asked, so
+	// rebuilds need only recompute their rows.
+	if (getRecOptionBool(recStmt->options, "partial_refresh", false)) {
+		createEventDeltas(recindexname,recStmt->eventtable->relname,
+			recStmt->userkey,recStmt->itemkey,recStmt->eventval);
+		indexSimilarityModel(recmodelname, "item2");
+	}
+
+	// Queries shouldn't plan against the empty table's statistics.
+	analyzeModel(recmodelname);
+
+	// Keep the user and item lists, so queries needn't work them out.
+	refreshIDDictionary(recindexname,recStmt->eventtable->relname,
+		recStmt->userkey,recStmt->itemkey);
+
+	// Remember how precisely the models are to be shared, if asked.
+	if (getRecOptionInt(recStmt->options, "quantize", RECATHON_FULL_PRECISION) != RECATHON_FULL_PRECISION)
+		storeModelPrecision(recindexname,
+			getRecOptionInt(recStmt->options, "quantize", RECATHON_FULL_PRECISION));
+
+	// Write the models out to a file for queries to map, if asked.
+	if (getRecOptionBool(recStmt->options, "model_file", false))
+		writeModelFile(recindexname, method);
+
+	// Precompute the best predictions for each user, if asked.
+	materializeRecView(recStmt->recname->relname, recindexname);
 }
 
 /*
@@ -181,36 +224,20 @@ static void itemSimilarity(CreateRStmt *recStmt, recMethod method) {
  */
 static void userSimilarity(CreateRStmt *recStmt, recMethod method) {
 	int numEvents = 0;
-	char *recindexname, *recmodelname, *recviewname;
+	sim_params params;
+	char *recindexname, *recmodelname, *recviewname, *eventsource;
 	struct timeval timestamp;
-	// For cosine similarity, we will constantly re-use the vector
-	// length of each user, and that's a pain to calculate. We're
-	// going to pre-calculate that information, store it in an
-	// array, and refer to it when necessary.
-	int *userIDs;
-	float *userLengths;
-	// For Pearson correlation.
-	float *userAvgs, *userPearsons;
-	int numUsers;
 	// Objects for querying.
 	char *querystring;
 
-	// For cosine, we obtain the list of users, the number of users, and their vector lengths.
-	if (method == userCosCF)
-		userLengths = vector_lengths(recStmt->userkey,
-				recStmt->eventtable->relname,recStmt->eventval,&numUsers,&userIDs);
-
-	// For Pearson, we obtain the list of users, the number of users, their average ratings,
-	// and another useful constant (I'm calling them Pearsons).
-	else if (method == userPearCF)
-		pearson_info(recStmt->userkey,recStmt->eventtable->relname,
-			recStmt->eventval,&numUsers,&userIDs,&userAvgs,&userPearsons);
-
 	// Let's quickly fill in the name of the recIndex,
 	// since it'll be an argument for a later function.
 	recindexname = (char*) palloc((6+strlen(recStmt->eventtable->relname)+strlen(recStmt->method))*sizeof(char));
 	sprintf(recindexname,"%sIndex",recStmt->recname->relname);
 
+	// The models are built from the events in the window, if any.
+	eventsource = getRecEventSource(recindexname,recStmt->eventtable->relname);
+
 	// Inserting the one entry for the recindex.
 	querystring = (char*) palloc(1024*sizeof(char));
 	gettimeofday(&timestamp,NULL);
@@ -226,8 +253,8 @@ static void userSimilarity(CreateRStmt *recStmt, recMethod method) {
 		timestamp.tv_sec,timestamp.tv_usec);
 
 	// We need to create a recmodel and calculate item similarities.
-	sprintf(querystring,"CREATE TABLE %s (user1 INTEGER NOT NULL, user2 INTEGER NOT NULL, similarity REAL NOT NULL);",
-		recmodelname);
+	sprintf(querystring,"CREATE %sTABLE %s (user1 INTEGER NOT NULL, user2 INTEGER NOT NULL, similarity REAL NOT NULL);",
+		modelPersistence(recStmt),recmodelname);
 	// Execute the INSERT.
 	recathon_utilityExecute(querystring);
 
@@ -245,15 +272,23 @@ static void userSimilarity(CreateRStmt *recStmt, recMethod method) {
 	recathon_queryExecute(querystring);
 
 	// The task of populating the similarity matrix is left to an
-	// external function.
-	if (method == userCosCF)
-		numEvents = updateUserCosModel(recStmt->eventtable->relname,recStmt->userkey,recStmt->itemkey,
-					recStmt->eventval,recmodelname,userIDs,userLengths,
-					numUsers,false);
-	else if (method == userPearCF)
-		numEvents = updateUserPearModel(recStmt->eventtable->relname,recStmt->userkey,recStmt->itemkey,
-					recStmt->eventval,recmodelname,userIDs,userAvgs,
-					userPearsons,numUsers,false);
+	// external function, which may split it across several workers,
+	// or build it in blocks if it won't fit in memory.
+	getSimParams(recStmt->options, &params);
+	if (getRecOptionBool(recStmt->options, "vector_store", false)) {
+		// Keep the rating vectors packed for rebuilds to read.
+		createVectorStore(recindexname,recStmt->eventtable->relname,
+			recStmt->userkey,recStmt->itemkey,recStmt->eventval);
+		params.vectorStore = recindexname;
+	}
+	numEvents = buildSimilarityModel(method,eventsource,
+				recStmt->userkey,recStmt->itemkey,recStmt->eventval,
+				recmodelname,&params);
+	noteBuildStrategy(recStmt->recname->relname,recindexname,&params,NOTICE);
+
+	// Store both directions of each pair, if asked.
+	if (getRecOptionBool(recStmt->options, "symmetric", false))
+		symmetrizeSimilarityModel(recmodelname, false);
 
 	// Now we can insert an entry into the index table for this cell.
 	sprintf(querystring,"INSERT INTO %s VALUES (default, '%s', '%s', 0, %d, 0, 0.0, 0.0, localtimestamp);",
@@ -262,14 +297,48 @@ static void userSimilarity(CreateRStmt *recStmt, recMethod method) {
 	// Now execute the INSERT query.
 	recathon_queryExecute(querystring);
 	pfree(querystring);
+
+	// Queries look the model up by either user, unless it
+	// holds both directions.
+	if (!getRecOptionBool(recStmt->options, "symmetric", false))
+		indexSimilarityModel(recmodelname, "user2");
+
+	// Keep track of which users get new events, if asked, so
+	// rebuilds need only recompute their rows.
+	if (getRecOptionBool(recStmt->options, "partial_refresh", false))
+		createEventDeltas(recindexname,recStmt->eventtable->relname,
+			recStmt->userkey,recStmt->itemkey,recStmt->eventval);
+
+	// Queries shouldn't plan against the empty table's statistics.
+	analyzeModel(recmodelname);
+
+	// Keep the user and item lists, so queries needn't work them out.
+	refreshIDDictionary(recindexname,recStmt->eventtable->relname,
+		recStmt->userkey,recStmt->itemkey);
+
+	// Remember how precisely the models are to be shared, if asked.
+	if (getRecOptionInt(recStmt->options, "quantize", RECATHON_FULL_PRECISION) != RECATHON_FULL_PRECISION)
+		storeModelPrecision(recindexname,
+			getRecOptionInt(recStmt->options, "quantize", RECATHON_FULL_PRECISION));
+
+	// Write the models out to a file for queries to map, if asked.
+	if (getRecOptionBool(recStmt->options, "model_file", false))
+		writeModelFile(recindexname, method);
+
+	// Precompute the best predictions for each user, if asked.
+	materializeRecView(recStmt->recname->relname, recindexname);
 }
 
 /*
  * Create item similarity matrices for each cell in a recommender.
  */
-static void SVDSimilarity(CreateRStmt *recStmt) {
+static void SVDSimilarity(CreateRStmt *recStmt, recMethod method) {
 	int numEvents = 0;
+	int numWorkers, numClusters;
+	svd_params params;
 	char *recindexname, *recusermodelname, *recitemmodelname, *recviewname;
+	char *recclustername = NULL;
+	char *eventsource;
 	struct timeval timestamp;
 	// Objects for querying.
 	char *querystring;
@@ -279,6 +348,9 @@ static void SVDSimilarity(CreateRStmt *recStmt) {
 	recindexname = (char*) palloc((6+strlen(recStmt->eventtable->relname)+strlen(recStmt->method))*sizeof(char));
 	sprintf(recindexname,"%sIndex",recStmt->recname->relname);
 
+	// The models are built from the events in the window, if any.
+	eventsource = getRecEventSource(recindexname,recStmt->eventtable->relname);
+
 	// Inserting the one entry for the recindex.
 	querystring = (char*) palloc(1024*sizeof(char));
 	gettimeofday(&timestamp,NULL);
@@ -302,13 +374,13 @@ static void SVDSimilarity(CreateRStmt *recStmt) {
 
 	// We need to create two RecModels and do the SVD to populate them.
 	querystring = (char*) palloc(1024*sizeof(char));
-	sprintf(querystring,"CREATE TABLE %s (users INTEGER NOT NULL, feature INTEGER NOT NULL, value REAL NOT NULL);",
-		recusermodelname);
+	sprintf(querystring,"CREATE %sTABLE %s (users INTEGER NOT NULL, features REAL[] NOT NULL);",
+		modelPersistence(recStmt),recusermodelname);
 	// Execute the INSERT.
 	recathon_utilityExecute(querystring);
 
-	sprintf(querystring,"CREATE TABLE %s (items INTEGER NOT NULL, feature INTEGER NOT NULL, value REAL NOT NULL);",
-		recitemmodelname);
+	sprintf(querystring,"CREATE %sTABLE %s (items INTEGER NOT NULL, features REAL[] NOT NULL);",
+		modelPersistence(recStmt),recitemmodelname);
 	// Execute the INSERT.
 	recathon_utilityExecute(querystring);
 
@@ -327,16 +399,230 @@ static void SVDSimilarity(CreateRStmt *recStmt) {
 
 	// The task of populating the feature matrices is left to an
 	// external function.
-	numEvents = SVDtrain(recStmt->userkey,recStmt->itemkey,
-		recStmt->eventtable->relname,recStmt->eventval,
-		recusermodelname,recitemmodelname,false);
+	numWorkers = getRecOptionInt(recStmt->options, "parallel_workers", 1);
+	getSVDparams(recStmt->options, method, &params);
+	if (method == ALS)
+		numEvents = ALStrain(recStmt->userkey,recStmt->itemkey,
+			eventsource,recStmt->eventval,
+			recusermodelname,recitemmodelname,numWorkers,&params);
+	else
+		numEvents = SVDtrain(recStmt->userkey,recStmt->itemkey,
+			eventsource,recStmt->eventval,
+			recusermodelname,recitemmodelname,false,numWorkers,&params);
+
+	// If asked, cluster the items so that queries can find each
+	// user's top items without scoring all of them.
+	numClusters = getRecOptionInt(recStmt->options, "ann_clusters", 0);
+	if (numClusters > 0)
+		recclustername = createClusterModel(recStmt->recname->relname,
+			recitemmodelname, numClusters);
+
+	// Queries shouldn't plan against the empty tables' statistics.
+	analyzeModel(recusermodelname);
+	analyzeModel(recitemmodelname);
 
 	// Now we can insert an entry into the index table for this cell.
-	sprintf(querystring,"INSERT INTO %s VALUES (default, '%s', '%s', '%s', 0, %d, 0, 0.0, 0.0, localtimestamp);",
-		recindexname,recusermodelname,recitemmodelname,recviewname,numEvents);
+	if (recclustername)
+		sprintf(querystring,"INSERT INTO %s VALUES (default, '%s', '%s', '%s', 0, %d, 0, 0.0, 0.0, localtimestamp, '%s');",
+			recindexname,recusermodelname,recitemmodelname,recviewname,numEvents,recclustername);
+	else
+		sprintf(querystring,"INSERT INTO %s VALUES (default, '%s', '%s', '%s', 0, %d, 0, 0.0, 0.0, localtimestamp, NULL);",
+			recindexname,recusermodelname,recitemmodelname,recviewname,numEvents);
 	// Now execute the INSERT query.
 	recathon_queryExecute(querystring);
 	pfree(querystring);
+
+	// Queue up new events, for the factors to take in if asked, or
+	// else for the users and items they name to be folded in between
+	// rebuilds. A cell's events come through a view, which can't have
+	// the trigger, so it waits for its rebuilds.
+	if (getRecOptionBool(recStmt->options, "online", false) ||
+	    get_rel_relkind(RangeVarGetRelid(recStmt->eventtable, NoLock, false)) == RELKIND_RELATION)
+		createEventDeltas(recindexname,recStmt->eventtable->relname,
+			recStmt->userkey,recStmt->itemkey,recStmt->eventval);
+
+	// Keep the user and item lists, so queries needn't work them out.
+	refreshIDDictionary(recindexname,recStmt->eventtable->relname,
+		recStmt->userkey,recStmt->itemkey);
+
+	// Remember how precisely the models are to be shared, if asked.
+	if (getRecOptionInt(recStmt->options, "quantize", RECATHON_FULL_PRECISION) != RECATHON_FULL_PRECISION)
+		storeModelPrecision(recindexname,
+			getRecOptionInt(recStmt->options, "quantize", RECATHON_FULL_PRECISION));
+
+	// Write the models out to a file for queries to map, if asked.
+	if (getRecOptionBool(recStmt->options, "model_file", false))
+		writeModelFile(recindexname, method);
+
+	// Precompute the best predictions for each user, if asked.
+	materializeRecView(recStmt->recname->relname, recindexname);
+}
+
+/*
+ * Create a cell for each value of a partitioned recommender's attribute.
+ * A cell is a recommender of its own, built the same way on a view of
+ * the events of the users with that value, so it is much smaller than
+ * the whole. Values without any events don't get a cell.
+ */
+static void createRecCells(CreateRStmt *recStmt) {
+	int numCells = 0;
+	char *partitiontable;
+	char *window = NULL, *halflife = NULL;
+	List *values = NIL;
+	ListCell *lc;
+	// Objects for querying.
+	StringInfoData querystring, options;
+	QueryDesc *queryDesc;
+	TupleTableSlot *slot;
+	MemoryContext recathoncontext;
+
+	partitiontable = recStmt->partitiontable ?
+		recStmt->partitiontable->relname : recStmt->eventtable->relname;
+
+	// Each step below has to see the one before it.
+	CommandCounterIncrement();
+
+	initStringInfo(&querystring);
+	appendStringInfo(&querystring,"UPDATE RecModelsCatalogue SET partitionkey = '%s', partitiontable = '%s' WHERE recommendername = '%s';",
+		recStmt->partitionkey, partitiontable, recStmt->recname->relname);
+	recathon_queryExecute(querystring.data);
+
+	resetStringInfo(&querystring);
+	appendStringInfo(&querystring,"SELECT DISTINCT p.%s::text AS cellvalue FROM %s p WHERE p.%s IS NOT NULL AND EXISTS (SELECT 1 FROM %s e WHERE e.%s = p.%s) ORDER BY 1;",
+		recStmt->partitionkey, partitiontable, recStmt->partitionkey,
+		recStmt->eventtable->relname, recStmt->userkey, recStmt->userkey);
+	queryDesc = recathon_queryStart(querystring.data,&recathoncontext);
+	for (;;) {
+		slot = ExecProcNode(queryDesc->planstate);
+		if (TupIsNull(slot)) break;
+		values = lappend(values, getTupleString(slot,"cellvalue"));
+	}
+	recathon_queryEnd(queryDesc,recathoncontext);
+
+	if (list_length(values) > RECATHON_MAX_CELLS)
+		ereport(ERROR,
+			(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+			 errmsg("column \"%s\" has %d values, but a recommender can have at most %d cells",
+				recStmt->partitionkey, list_length(values), RECATHON_MAX_CELLS)));
+
+	// The cells are built with the same options as the whole.
+	initStringInfo(&options);
+	foreach(lc, recStmt->options) {
+		DefElem *def = (DefElem *) lfirst(lc);
+
+		appendStringInfo(&options,"%s%s",
+			options.len > 0 ? ", " : " WITH (", def->defname);
+		if (def->arg == NULL)
+			continue;
+		if (IsA(def->arg, Integer))
+			appendStringInfo(&options," = %ld",intVal(def->arg));
+		else if (IsA(def->arg, Float))
+			appendStringInfo(&options," = %s",strVal(def->arg));
+		else
+			appendStringInfo(&options," = %s",quote_literal_cstr(defGetString(def)));
+	}
+	if (options.len > 0)
+		appendStringInfoChar(&options,')');
+
+	// And with the same window.
+	if (recStmt->timekey)
+		window = quote_literal_cstr(recStmt->timewindow);
+	if (recStmt->halflife)
+		halflife = quote_literal_cstr(recStmt->halflife);
+
+	foreach(lc, values) {
+		char *value = quote_literal_cstr((char *) lfirst(lc));
+
+		numCells++;
+		resetStringInfo(&querystring);
+		appendStringInfo(&querystring,"CREATE VIEW %sCell%dEvents AS SELECT e.* FROM %s e WHERE e.%s IN (SELECT p.%s FROM %s p WHERE p.%s::text = %s);",
+			recStmt->recname->relname, numCells, recStmt->eventtable->relname,
+			recStmt->userkey, recStmt->userkey, partitiontable,
+			recStmt->partitionkey, value);
+		recathon_utilityExecute(querystring.data);
+		CommandCounterIncrement();
+
+		resetStringInfo(&querystring);
+		appendStringInfo(&querystring,"CREATE RECOMMENDER %sCell%d ON %sCell%dEvents",
+			recStmt->recname->relname, numCells,
+			recStmt->recname->relname, numCells);
+		if (recStmt->eventfilter)
+			appendStringInfo(&querystring," WHERE (%s)",recStmt->eventfilter);
+		appendStringInfo(&querystring," USERS FROM %s ITEMS FROM %s EVENTS FROM %s",
+			recStmt->userkey, recStmt->itemkey, recStmt->eventval);
+		if (recStmt->timekey)
+			appendStringInfo(&querystring," TIME FROM %s WINDOW %s",
+				recStmt->timekey, window);
+		if (recStmt->halflife)
+			appendStringInfo(&querystring," DECAY %s",halflife);
+		if (recStmt->method)
+			appendStringInfo(&querystring," USING %s",recStmt->method);
+		appendStringInfo(&querystring,"%s;",options.data);
+		recathon_utilityExecute(querystring.data);
+		CommandCounterIncrement();
+
+		resetStringInfo(&querystring);
+		appendStringInfo(&querystring,"UPDATE RecModelsCatalogue SET partitionof = '%s', partitionvalue = %s WHERE recommendername = '%scell%d';",
+			recStmt->recname->relname, value,
+			recStmt->recname->relname, numCells);
+		recathon_queryExecute(querystring.data);
+		pfree(value);
+	}
+
+	list_free_deep(values);
+	if (window)
+		pfree(window);
+	if (halflife)
+		pfree(halflife);
+	pfree(options.data);
+	pfree(querystring.data);
+}
+
+/*
+ * Drop the cells of a partitioned recommender, and their views.
+ */
+static void dropRecCells(char *recname) {
+	RangeVar *cataloguerv;
+	List *cells = NIL, *views = NIL;
+	ListCell *lc, *lv;
+	// Objects for querying.
+	StringInfoData querystring;
+	QueryDesc *queryDesc;
+	TupleTableSlot *slot;
+	MemoryContext recathoncontext;
+
+	// Catalogues from before partitioning have no cells.
+	cataloguerv = makeRangeVar(NULL,"recmodelscatalogue",0);
+	if (!columnExistsInRelation("partitionof",cataloguerv)) {
+		pfree(cataloguerv);
+		return;
+	}
+	pfree(cataloguerv);
+
+	initStringInfo(&querystring);
+	appendStringInfo(&querystring,"SELECT recommendername, eventtable FROM RecModelsCatalogue WHERE partitionof = '%s';",
+		recname);
+	queryDesc = recathon_queryStart(querystring.data,&recathoncontext);
+	for (;;) {
+		slot = ExecProcNode(queryDesc->planstate);
+		if (TupIsNull(slot)) break;
+		cells = lappend(cells, getTupleString(slot,"recommendername"));
+		views = lappend(views, getTupleString(slot,"eventtable"));
+	}
+	recathon_queryEnd(queryDesc,recathoncontext);
+
+	forboth(lc, cells, lv, views) {
+		resetStringInfo(&querystring);
+		appendStringInfo(&querystring,"DROP RECOMMENDER %s;",(char *) lfirst(lc));
+		recathon_utilityExecute(querystring.data);
+		resetStringInfo(&querystring);
+		appendStringInfo(&querystring,"DROP VIEW IF EXISTS %s;",(char *) lfirst(lv));
+		recathon_utilityExecute(querystring.data);
+	}
+
+	list_free_deep(cells);
+	list_free_deep(views);
+	pfree(querystring.data);
 }
 
 /*
@@ -472,6 +758,7 @@ check_xact_readonly(Node *parsetree)
 		case T_CreateStmt:
 		case T_CreateRStmt:
 		case T_DropRecStmt:
+		case T_AlterRecStmt:
 		case T_CreateTableAsStmt:
 		case T_CreateTableSpaceStmt:
 		case T_CreateTrigStmt:
@@ -821,6 +1108,14 @@ standard_ProcessUtility(Node *parsetree,
 											   true);
 
 						AlterTableCreateToastTable(relOid, toast_options);
+
+						/* NEW FOR RECATHON: a new partition of an events
+						 * table needs its recommenders' triggers. */
+						if (((CreateStmt *) stmt)->inhRelations != NIL)
+						{
+							CommandCounterIncrement();
+							noteTableInherits(relOid);
+						}
 					}
 					else if (IsA(stmt, CreateForeignTableStmt))
 					{
@@ -858,7 +1153,15 @@ standard_ProcessUtility(Node *parsetree,
 				CreateRStmt* recStmt;
 				recMethod method;
 				char *querystring;
-				RangeVar *proprv;
+				RangeVar *proprv, *cataloguerv;
+				sim_params simparams;
+				char *buildcolumns[] = {"neighborhood", "lshbands", "lshrows", "materialize", "adaptive", "level", "hybrid", "incremental", "partial_refresh", "modelfile", "unlogged", "symmetric", "notify_changes", "minsupport", "vectorstore", "userclusters", "clusterprobes", "online"};
+				char *partitioncolumns[] = {"partitionkey", "partitiontable", "partitionof", "partitionvalue"};
+				char *windowcolumns[] = {"timecolumn", "timewindow", "halflife", "windowstart", "windowexpired"};
+				char *windowtypes[] = {"VARCHAR", "INTERVAL", "INTERVAL", "TIMESTAMPTZ", "INTEGER NOT NULL DEFAULT 0"};
+				char *factorcolumns[] = {"features", "maxepochs", "learningrate", "regularization", "tolerance", "parallelworkers"};
+				char *factortypes[] = {"INTEGER", "INTEGER", "REAL", "REAL", "REAL", "INTEGER"};
+				int c;
 
 				recStmt = (CreateRStmt*) parsetree;
 
@@ -871,6 +1174,7 @@ standard_ProcessUtility(Node *parsetree,
 				 */
 
 				method = validateCreateRStmt(recStmt);
+				pgstat_progress_start_recommender(recStmt->recname->relname);
 
 				/*
 				 * CREATE TABLES
@@ -883,18 +1187,202 @@ standard_ProcessUtility(Node *parsetree,
 
 				// Create the RecModelsCatalogue table, if it doesn't exist.
 				querystring = (char*) palloc(1024*sizeof(char));
-				sprintf(querystring,"CREATE TABLE IF NOT EXISTS RecModelsCatalogue (recommenderId serial, PRIMARY KEY (recommenderId), recommenderName VARCHAR NOT NULL, recommenderIndexName VARCHAR NOT NULL, eventTable VARCHAR NOT NULL, userKey VARCHAR NOT NULL, itemKey VARCHAR NOT NULL, eventVal VARCHAR NOT NULL, method VARCHAR NOT NULL);");
+				sprintf(querystring,"CREATE TABLE IF NOT EXISTS RecModelsCatalogue (recommenderId serial, PRIMARY KEY (recommenderId), recommenderName VARCHAR NOT NULL, recommenderIndexName VARCHAR NOT NULL, eventTable VARCHAR NOT NULL, userKey VARCHAR NOT NULL, itemKey VARCHAR NOT NULL, eventVal VARCHAR NOT NULL, method VARCHAR NOT NULL, neighborhood INTEGER NOT NULL DEFAULT 0, lshBands INTEGER NOT NULL DEFAULT 0, lshRows INTEGER NOT NULL DEFAULT 0, materialize INTEGER NOT NULL DEFAULT 0, adaptive INTEGER NOT NULL DEFAULT 0, level INTEGER NOT NULL DEFAULT 0, hybrid INTEGER NOT NULL DEFAULT 0, incremental INTEGER NOT NULL DEFAULT 0, partial_refresh INTEGER NOT NULL DEFAULT 0, partitionKey VARCHAR, partitionTable VARCHAR, partitionOf VARCHAR, partitionValue VARCHAR);");
 				recathon_utilityExecute(querystring);
 
+				// A catalogue from before the build options needs
+				// their columns.
+				cataloguerv = makeRangeVar(NULL,"recmodelscatalogue",0);
+				for (c = 0; c < lengthof(buildcolumns); c++) {
+					if (columnExistsInRelation(buildcolumns[c],cataloguerv))
+						continue;
+					sprintf(querystring,"ALTER TABLE RecModelsCatalogue ADD COLUMN %s INTEGER NOT NULL DEFAULT 0;",
+						buildcolumns[c]);
+					recathon_utilityExecute(querystring);
+				}
+				for (c = 0; c < lengthof(partitioncolumns); c++) {
+					if (columnExistsInRelation(partitioncolumns[c],cataloguerv))
+						continue;
+					sprintf(querystring,"ALTER TABLE RecModelsCatalogue ADD COLUMN %s VARCHAR;",
+						partitioncolumns[c]);
+					recathon_utilityExecute(querystring);
+				}
+				for (c = 0; c < lengthof(windowcolumns); c++) {
+					if (columnExistsInRelation(windowcolumns[c],cataloguerv))
+						continue;
+					sprintf(querystring,"ALTER TABLE RecModelsCatalogue ADD COLUMN %s %s;",
+						windowcolumns[c],windowtypes[c]);
+					recathon_utilityExecute(querystring);
+				}
+				if (!columnExistsInRelation("buildnodes",cataloguerv))
+					recathon_utilityExecute("ALTER TABLE RecModelsCatalogue ADD COLUMN buildnodes VARCHAR;");
+				if (!columnExistsInRelation("samplefraction",cataloguerv))
+					recathon_utilityExecute("ALTER TABLE RecModelsCatalogue ADD COLUMN samplefraction REAL;");
+				if (!columnExistsInRelation("minsimilarity",cataloguerv))
+					recathon_utilityExecute("ALTER TABLE RecModelsCatalogue ADD COLUMN minsimilarity REAL;");
+				if (!columnExistsInRelation("eventfilter",cataloguerv))
+					recathon_utilityExecute("ALTER TABLE RecModelsCatalogue ADD COLUMN eventfilter VARCHAR;");
+				if (!columnExistsInRelation("buildstrategy",cataloguerv))
+					recathon_utilityExecute("ALTER TABLE RecModelsCatalogue ADD COLUMN buildstrategy VARCHAR;");
+				if (!columnExistsInRelation("servenodes",cataloguerv))
+					recathon_utilityExecute("ALTER TABLE RecModelsCatalogue ADD COLUMN servenodes VARCHAR;");
+				if (!columnExistsInRelation("itemattributes",cataloguerv))
+					recathon_utilityExecute("ALTER TABLE RecModelsCatalogue ADD COLUMN itemattributes VARCHAR;");
+				if (!columnExistsInRelation("activeitems",cataloguerv))
+					recathon_utilityExecute("ALTER TABLE RecModelsCatalogue ADD COLUMN activeitems VARCHAR;");
+				if (!columnExistsInRelation("viewfilled",cataloguerv))
+					recathon_utilityExecute("ALTER TABLE RecModelsCatalogue ADD COLUMN viewfilled TIMESTAMPTZ;");
+				if (!columnExistsInRelation("eventsinserted",cataloguerv))
+					recathon_utilityExecute("ALTER TABLE RecModelsCatalogue ADD COLUMN eventsinserted BIGINT;");
+				for (c = 0; c < lengthof(factorcolumns); c++) {
+					if (columnExistsInRelation(factorcolumns[c],cataloguerv))
+						continue;
+					sprintf(querystring,"ALTER TABLE RecModelsCatalogue ADD COLUMN %s %s;",
+						factorcolumns[c],factortypes[c]);
+					recathon_utilityExecute(querystring);
+				}
+				pfree(cataloguerv);
+
 				// Insert recommender information into the RecModelsCatalogue.
-				sprintf(querystring,"INSERT INTO RecModelsCatalogue VALUES (default,'%s','%sIndex','%s','%s','%s','%s','%s');",
+				getSimParams(recStmt->options, &simparams);
+				sprintf(querystring,"INSERT INTO RecModelsCatalogue (recommenderName, recommenderIndexName, eventTable, userKey, itemKey, eventVal, method, neighborhood, lshBands, lshRows, materialize, adaptive, hybrid, incremental, partial_refresh, modelfile, unlogged, symmetric, notify_changes, minsupport, minsimilarity, vectorstore, userclusters, clusterprobes, online) VALUES ('%s','%sIndex','%s','%s','%s','%s','%s',%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%f,%d,%d,%d,%d);",
 					recStmt->recname->relname, recStmt->recname->relname,
 					recStmt->eventtable->relname, recStmt->userkey,
-					recStmt->itemkey, recStmt->eventval, recStmt->method);
+					recStmt->itemkey, recStmt->eventval, recStmt->method,
+					simparams.neighborhood, simparams.lshBands,
+					simparams.lshRows,
+					getRecOptionInt(recStmt->options, "materialize", 0),
+					getRecOptionInt(recStmt->options, "adaptive", 0),
+					getRecOptionBool(recStmt->options, "hybrid", false) ? 1 : 0,
+					getRecOptionBool(recStmt->options, "incremental", false) ? 1 : 0,
+					getRecOptionBool(recStmt->options, "partial_refresh", false) ? 1 : 0,
+					getRecOptionBool(recStmt->options, "model_file", false) ? 1 : 0,
+					getRecOptionBool(recStmt->options, "unlogged", false) ? 1 : 0,
+					getRecOptionBool(recStmt->options, "symmetric", false) ? 1 : 0,
+					getRecOptionBool(recStmt->options, "notify_changes", false) ? 1 : 0,
+					simparams.minSupport, simparams.minSimilarity,
+					getRecOptionBool(recStmt->options, "vector_store", false) ? 1 : 0,
+					simparams.userClusters, simparams.clusterProbes,
+					getRecOptionBool(recStmt->options, "online", false) ? 1 : 0);
 
 				// Execute the query and add this recommender to the catalogue.
 				recathon_queryExecute(querystring);
 
+				// Rebuilds are shared with the same nodes.
+				if (simparams.buildNodes) {
+					StringInfoData nodestring;
+
+					initStringInfo(&nodestring);
+					appendStringInfo(&nodestring,"UPDATE RecModelsCatalogue SET buildnodes = %s WHERE recommenderName = '%s';",
+						quote_literal_cstr(simparams.buildNodes),
+						recStmt->recname->relname);
+					recathon_queryExecute(nodestring.data);
+					pfree(nodestring.data);
+				}
+
+				// Its queries go to the nodes that serve it, if it has any.
+				if (getRecOptionString(recStmt->options, "serve_nodes", NULL)) {
+					StringInfoData nodestring;
+
+					initStringInfo(&nodestring);
+					appendStringInfo(&nodestring,"UPDATE RecModelsCatalogue SET servenodes = %s WHERE recommenderName = '%s';",
+						quote_literal_cstr(getRecOptionString(recStmt->options, "serve_nodes", NULL)),
+						recStmt->recname->relname);
+					recathon_queryExecute(nodestring.data);
+					pfree(nodestring.data);
+				}
+
+				// As do the item columns its queries' filters can be
+				// answered from.
+				if (getRecOptionString(recStmt->options, "item_attributes", NULL)) {
+					StringInfoData attrstring;
+
+					initStringInfo(&attrstring);
+					appendStringInfo(&attrstring,"UPDATE RecModelsCatalogue SET itemattributes = %s WHERE recommenderName = '%s';",
+						quote_literal_cstr(getRecOptionString(recStmt->options, "item_attributes", NULL)),
+						recStmt->recname->relname);
+					recathon_queryExecute(attrstring.data);
+					pfree(attrstring.data);
+				}
+
+				// A factor model is rebuilt with the parameters it was
+				// first trained with.
+				if (FACTOR_METHOD(method)) {
+					svd_params svdparams;
+
+					getSVDparams(recStmt->options, method, &svdparams);
+					sprintf(querystring,"UPDATE RecModelsCatalogue SET features = %d, maxepochs = %d, learningrate = %g, regularization = %g, tolerance = %g, parallelworkers = %d WHERE recommenderName = '%s';",
+						svdparams.numFeatures, svdparams.maxEpochs,
+						svdparams.learnRate, svdparams.penalty,
+						svdparams.tolerance,
+						getRecOptionInt(recStmt->options, "parallel_workers", 1),
+						recStmt->recname->relname);
+					recathon_queryExecute(querystring);
+				}
+
+				// And the items it may recommend, if not all of them.
+				if (getRecOptionString(recStmt->options, "active_items", NULL)) {
+					StringInfoData activestring;
+
+					initStringInfo(&activestring);
+					appendStringInfo(&activestring,"UPDATE RecModelsCatalogue SET activeitems = %s WHERE recommenderName = '%s';",
+						quote_literal_cstr(getRecOptionString(recStmt->options, "active_items", NULL)),
+						recStmt->recname->relname);
+					recathon_queryExecute(activestring.data);
+					pfree(activestring.data);
+				}
+
+				// Any refresh policy it was given goes in with it.
+				CommandCounterIncrement();
+				setRefreshPolicy(recStmt->recname->relname, recStmt->options, false);
+
+				// Looking up a user's or an item's events shouldn't
+				// mean reading the whole table, unless asked.
+				if (getRecOptionBool(recStmt->options, "event_indexes", true))
+					ensureEventIndexes(recStmt->eventtable->relname,
+						recStmt->userkey,recStmt->itemkey,recStmt->eventval);
+
+				// A recommender with a WHERE condition learns from a view
+				// of the events that meet it.
+				if (recStmt->eventfilter) {
+					char *filterindexname;
+
+					CommandCounterIncrement();
+					filterindexname = (char*) palloc((6+strlen(recStmt->recname->relname))*sizeof(char));
+					sprintf(filterindexname,"%sIndex",recStmt->recname->relname);
+					createEventFilter(filterindexname,recStmt->eventtable->relname,
+						recStmt->eventfilter);
+					pfree(filterindexname);
+				}
+
+				// A recommender with a window learns from a view of the
+				// recent events, rather than the table itself.
+				if (recStmt->timekey) {
+					char *windowindexname;
+
+					CommandCounterIncrement();
+					windowindexname = (char*) palloc((6+strlen(recStmt->recname->relname))*sizeof(char));
+					sprintf(windowindexname,"%sIndex",recStmt->recname->relname);
+					createEventWindow(windowindexname,recStmt->eventtable->relname,
+						recStmt->userkey,recStmt->itemkey,recStmt->eventval,
+						recStmt->timekey,recStmt->timewindow,recStmt->halflife);
+					pfree(windowindexname);
+				}
+
+				// A sampled recommender learns from the events of some
+				// of its users only, which is quicker but approximate.
+				if (getRecOptionFloat(recStmt->options, "sample_fraction", 1.0) < 1.0) {
+					char *sampleindexname;
+
+					CommandCounterIncrement();
+					sampleindexname = (char*) palloc((6+strlen(recStmt->recname->relname))*sizeof(char));
+					sprintf(sampleindexname,"%sIndex",recStmt->recname->relname);
+					createEventSample(sampleindexname,recStmt->eventtable->relname,
+						recStmt->userkey,
+						getRecOptionFloat(recStmt->options, "sample_fraction", 1.0));
+					pfree(sampleindexname);
+				}
+
 				// Create the RecDBProperties table, if it doesn't exist.
 				// Here we do an actual check on the table, because we want
 				// to avoid both the table creation and the insert.
@@ -913,14 +1401,30 @@ standard_ProcessUtility(Node *parsetree,
 				querystring = (char*) palloc(1024*sizeof(char));
 				// SVD uses two different models, while the other methods use only one.
 				// Our index schema will differ as a result.
-				if (method == SVD) {
-					sprintf(querystring,"CREATE TABLE %sIndex (systemId serial, PRIMARY KEY (systemId), recUserModelName VARCHAR NOT NULL, recItemModelName VARCHAR NOT NULL, recViewName VARCHAR NOT NULL, updateCounter INTEGER NOT NULL, eventTotal INTEGER NOT NULL, queryCounter INTEGER NOT NULL, updateRate REAL NOT NULL, queryRate REAL NOT NULL, levelone_timestamp TIMESTAMP NOT NULL);",
+				if (FACTOR_METHOD(method)) {
+					sprintf(querystring,"CREATE TABLE %sIndex (systemId serial, PRIMARY KEY (systemId), recUserModelName VARCHAR NOT NULL, recItemModelName VARCHAR NOT NULL, recViewName VARCHAR NOT NULL, updateCounter INTEGER NOT NULL, eventTotal INTEGER NOT NULL, queryCounter INTEGER NOT NULL, updateRate REAL NOT NULL, queryRate REAL NOT NULL, levelone_timestamp TIMESTAMP NOT NULL, recClusterModelName VARCHAR);",
 						recStmt->recname->relname);
 				} else {
 					sprintf(querystring,"CREATE TABLE %sIndex (systemId serial, PRIMARY KEY (systemId), recModelName VARCHAR NOT NULL, recViewName VARCHAR NOT NULL, updateCounter INTEGER NOT NULL, eventTotal INTEGER NOT NULL, queryCounter INTEGER NOT NULL, updateRate REAL NOT NULL, queryRate REAL NOT NULL, levelone_timestamp TIMESTAMP NOT NULL);",
 						recStmt->recname->relname);
 				}
 				recathon_utilityExecute(querystring);
+
+				// A hybrid recommender notes down who asks for what, to
+				// work out which users its RecView is for.
+				if (getRecOptionBool(recStmt->options, "hybrid", false)) {
+					sprintf(querystring,"CREATE TABLE %sIndexUserQueries (userid INTEGER NOT NULL, queries REAL NOT NULL, inview BOOLEAN NOT NULL DEFAULT false);",
+						recStmt->recname->relname);
+					recathon_utilityExecute(querystring);
+				}
+
+				// One built with notify_changes logs whose lists each
+				// refill of its RecView changed.
+				if (getRecOptionBool(recStmt->options, "notify_changes", false)) {
+					sprintf(querystring,"CREATE TABLE %sIndexChanges (userid INTEGER NOT NULL, changedat TIMESTAMPTZ NOT NULL DEFAULT now());",
+						recStmt->recname->relname);
+					recathon_utilityExecute(querystring);
+				}
 				pfree(querystring);
 
 				/*
@@ -932,6 +1436,7 @@ standard_ProcessUtility(Node *parsetree,
 				switch (method) {
 					case itemCosCF:
 					case itemPearCF:
+					case itemJaccardCF:
 						itemSimilarity(recStmt,method);
 						break;
 					case userCosCF:
@@ -939,7 +1444,8 @@ standard_ProcessUtility(Node *parsetree,
 						userSimilarity(recStmt,method);
 						break;
 					case SVD:
-						SVDSimilarity(recStmt);
+					case ALS:
+						SVDSimilarity(recStmt,method);
 						break;
 					default:
 						ereport(ERROR,
@@ -949,6 +1455,55 @@ standard_ProcessUtility(Node *parsetree,
 						break;
 				}
 
+				// Users with no events of their own are given the
+				// most popular items instead.
+				{
+					char *popularindexname;
+
+					popularindexname = (char*) palloc((6+strlen(recStmt->recname->relname))*sizeof(char));
+					sprintf(popularindexname,"%sIndex",recStmt->recname->relname);
+					buildPopularityModel(popularindexname,recStmt->eventtable->relname,
+						recStmt->itemkey,recStmt->eventval);
+					pfree(popularindexname);
+				}
+
+				// The whole recommender answers for users who aren't all
+				// in one cell, so the cells come on top of it.
+				if (recStmt->partitionkey)
+					createRecCells(recStmt);
+
+				pgstat_progress_end();
+				break;
+			}
+
+		// Rebuilding a recommender now, or changing when it's rebuilt.
+		case T_AlterRecStmt:
+			{
+				AlterRecStmt *alterstmt = (AlterRecStmt *) parsetree;
+				ListCell *lc;
+
+				if (alterstmt->refresh) {
+					refreshRecommender(alterstmt->recname->relname,
+						alterstmt->concurrent);
+					break;
+				}
+
+				// How a recommender is built is fixed when it's created.
+				foreach(lc, alterstmt->options) {
+					DefElem *def = (DefElem *) lfirst(lc);
+
+					if (!isRefreshOption(def))
+						ereport(ERROR,
+							(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+							 errmsg("option \"%s\" can't be changed by ALTER RECOMMENDER",
+								def->defname)));
+					if (alterstmt->reset && def->arg)
+						ereport(ERROR,
+							(errcode(ERRCODE_SYNTAX_ERROR),
+							 errmsg("RESET must not include values for parameters")));
+				}
+				setRefreshPolicy(alterstmt->recname->relname,
+					alterstmt->options, alterstmt->reset);
 				break;
 			}
 
@@ -959,6 +1514,7 @@ standard_ProcessUtility(Node *parsetree,
 				char *query_string, *drop_string, *recname, *recindexname, *method;
 				char *recmodelname = NULL;
 				char *recmodelname2 = NULL;
+				char *recclustername = NULL;
 				char *recviewname = NULL;
 				RangeVar *cataloguerv;
 				// Query objects.
@@ -1027,12 +1583,14 @@ standard_ProcessUtility(Node *parsetree,
 
 				// Go through this tuple and get the appropriate information.
 				// This will change depending on the recommendation method.
-				if (strcmp(method,"svd") == 0) {
+				if (FACTOR_METHOD(getRecMethod(method))) {
 					recmodelname = getTupleString(slot,"recusermodelname");
 					recmodelname2 = getTupleString(slot,"recitemmodelname");
+					recclustername = getTupleString(slot,"recclustermodelname");
 				} else {
 					recmodelname = getTupleString(slot,"recmodelname");
 					recmodelname2 = NULL;
+					recclustername = NULL;
 				}
 				recviewname = getTupleString(slot,"recviewname");
 
@@ -1055,6 +1613,12 @@ standard_ProcessUtility(Node *parsetree,
 				recathon_utilityExecute(drop_string);
 				}
 
+				// Delete the top-k index, if there is one.
+				if (recclustername) {
+					sprintf(drop_string,"drop table %s;",recclustername);
+				recathon_utilityExecute(drop_string);
+				}
+
 				// Delete the recview.
 				if (recviewname) {
 					sprintf(drop_string,"drop table %s;",recviewname);
@@ -1065,7 +1629,35 @@ standard_ProcessUtility(Node *parsetree,
 
 				// We need to do two more removals: we need to remove the recommender
 				// index table, and then delete it from the recmodelscatalogue.
+				// Recommenders built before we kept ID lists have none to drop.
 				drop_string = (char*) palloc(512*sizeof(char));
+				sprintf(drop_string,"drop table if exists %sIDs;",recindexname);
+				recathon_utilityExecute(drop_string);
+				sprintf(drop_string,"drop table if exists %sUserQueries;",recindexname);
+				recathon_utilityExecute(drop_string);
+				sprintf(drop_string,"drop table if exists %sChanges;",recindexname);
+				recathon_utilityExecute(drop_string);
+				sprintf(drop_string,"drop table if exists %sPopular;",recindexname);
+				recathon_utilityExecute(drop_string);
+				if (getRecIncremental(recindexname) ||
+				    getRecPartialRefresh(recindexname) ||
+				    FACTOR_METHOD(getRecMethod(method)))
+					dropEventDeltas(recindexname);
+				if (getRecVectorStore(recindexname))
+					dropVectorStore(recindexname);
+				dropEventWindow(recindexname);
+				// Nothing should read its models from the cache or
+				// a model file now, or its results from the cache.
+				recathonCacheDrop(recindexname);
+				recathonResultDrop(recindexname);
+				removeModelFile(recindexname);
+				{
+					char statname[NAMEDATALEN];
+
+					recathonStatName(recindexname, statname);
+					pgstat_drop_recommender(statname);
+					recathonLatencyDrop(statname);
+				}
 				sprintf(drop_string,"drop table %s;",recindexname);
 				recathon_utilityExecute(drop_string);
 
@@ -1075,6 +1667,9 @@ standard_ProcessUtility(Node *parsetree,
 				recathon_queryExecute(drop_string);
 
 				pfree(drop_string);
+
+				// A partitioned recommender's cells go with it.
+				dropRecCells(recname);
 			}
 			break;
 
@@ -1236,8 +1831,22 @@ standard_ProcessUtility(Node *parsetree,
 
 						if (IsA(stmt, AlterTableStmt))
 						{
+							ListCell   *c;
+
 							/* Do the table alteration proper */
 							AlterTable(relid, lockmode, (AlterTableStmt *) stmt);
+
+							/* NEW FOR RECATHON: so does a table made
+							 * one with ALTER TABLE ... INHERIT. */
+							foreach(c, ((AlterTableStmt *) stmt)->cmds)
+							{
+								if (((AlterTableCmd *) lfirst(c))->subtype == AT_AddInherit)
+								{
+									CommandCounterIncrement();
+									noteTableInherits(relid);
+									break;
+								}
+							}
 						}
 						else
 						{
@@ -2132,6 +2741,10 @@ CreateCommandTag(Node *parsetree)
 			tag = "DROP RECOMMENDER";
 			break;
 
+		case T_AlterRecStmt:
+			tag = "ALTER RECOMMENDER";
+			break;
+
 		case T_CreateTableSpaceStmt:
 			tag = "CREATE TABLESPACE";
 			break;
@@ -2761,6 +3374,7 @@ GetCommandLogLevel(Node *parsetree)
 		case T_CreateStmt:
 		case T_CreateRStmt:
 		case T_DropRecStmt:
+		case T_AlterRecStmt:
 		case T_CreateForeignTableStmt:
 			lev = LOGSTMT_DDL;
 			break;
@@ -21,6 +21,7 @@
 #include "pgstat.h"
 #include "utils/builtins.h"
 #include "utils/inet.h"
+#include "utils/recathonlatency.h"
 #include "utils/timestamp.h"
 
 /* bogus ... these externs should be in a header file */
@@ -48,6 +49,10 @@ extern Datum pg_stat_get_function_calls(PG_FUNCTION_ARGS);
 extern Datum pg_stat_get_function_total_time(PG_FUNCTION_ARGS);
 extern Datum pg_stat_get_function_self_time(PG_FUNCTION_ARGS);
 
+extern Datum pg_stat_get_recommenders(PG_FUNCTION_ARGS);
+extern Datum pg_stat_get_recommender_progress(PG_FUNCTION_ARGS);
+extern Datum pg_stat_get_recommender_latency(PG_FUNCTION_ARGS);
+
 extern Datum pg_stat_get_backend_idset(PG_FUNCTION_ARGS);
 extern Datum pg_stat_get_activity(PG_FUNCTION_ARGS);
 extern Datum pg_backend_pid(PG_FUNCTION_ARGS);
@@ -462,6 +467,401 @@ pg_stat_get_function_self_time(PG_FUNCTION_ARGS)
 	PG_RETURN_FLOAT8(((double) funcentry->f_self_time) / 1000.0);
 }
 
+Datum
+pg_stat_get_recommenders(PG_FUNCTION_ARGS)
+{
+	FuncCallContext *funcctx;
+	PgStat_StatRecEntry *entries;
+
+	if (SRF_IS_FIRSTCALL())
+	{
+		MemoryContext oldcontext;
+		TupleDesc	tupdesc;
+		HTAB	   *rechash;
+		int			n = 0;
+
+		funcctx = SRF_FIRSTCALL_INIT();
+
+		oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+		tupdesc = CreateTemplateTupleDesc(12, false);
+		TupleDescInitEntry(tupdesc, (AttrNumber) 1, "recname",
+						   NAMEOID, -1, 0);
+		TupleDescInitEntry(tupdesc, (AttrNumber) 2, "queries",
+						   INT8OID, -1, 0);
+		TupleDescInitEntry(tupdesc, (AttrNumber) 3, "predictions",
+						   INT8OID, -1, 0);
+		TupleDescInitEntry(tupdesc, (AttrNumber) 4, "internal_queries",
+						   INT8OID, -1, 0);
+		TupleDescInitEntry(tupdesc, (AttrNumber) 5, "avg_latency",
+						   FLOAT8OID, -1, 0);
+		TupleDescInitEntry(tupdesc, (AttrNumber) 6, "max_latency",
+						   FLOAT8OID, -1, 0);
+		TupleDescInitEntry(tupdesc, (AttrNumber) 7, "rebuilds",
+						   INT8OID, -1, 0);
+		TupleDescInitEntry(tupdesc, (AttrNumber) 8, "last_rebuild",
+						   TIMESTAMPTZOID, -1, 0);
+		TupleDescInitEntry(tupdesc, (AttrNumber) 9, "last_rebuild_duration",
+						   FLOAT8OID, -1, 0);
+		TupleDescInitEntry(tupdesc, (AttrNumber) 10, "events_since_rebuild",
+						   INT8OID, -1, 0);
+		TupleDescInitEntry(tupdesc, (AttrNumber) 11, "disk_size",
+						   INT8OID, -1, 0);
+		TupleDescInitEntry(tupdesc, (AttrNumber) 12, "memory_size",
+						   INT8OID, -1, 0);
+
+		funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+		/*
+		 * Copy the entries out, so we don't hold a hash table scan open in
+		 * case we aren't read to the end.
+		 */
+		rechash = pgstat_fetch_stat_recommenders();
+		if (rechash != NULL)
+		{
+			HASH_SEQ_STATUS rstat;
+			PgStat_StatRecEntry *recentry;
+
+			entries = (PgStat_StatRecEntry *)
+				palloc(Max(hash_get_num_entries(rechash), 1) *
+					   sizeof(PgStat_StatRecEntry));
+			hash_seq_init(&rstat, rechash);
+			while ((recentry = (PgStat_StatRecEntry *) hash_seq_search(&rstat)) != NULL)
+				entries[n++] = *recentry;
+			funcctx->user_fctx = entries;
+		}
+		funcctx->max_calls = n;
+
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	/* stuff done on every call of the function */
+	funcctx = SRF_PERCALL_SETUP();
+	entries = (PgStat_StatRecEntry *) funcctx->user_fctx;
+
+	if (funcctx->call_cntr < funcctx->max_calls)
+	{
+		/* for each row */
+		Datum		values[12];
+		bool		nulls[12];
+		HeapTuple	tuple;
+		PgStat_StatRecEntry *recentry = &entries[funcctx->call_cntr];
+		NameData	recname;
+
+		MemSet(values, 0, sizeof(values));
+		MemSet(nulls, 0, sizeof(nulls));
+
+		namestrcpy(&recname, recentry->recname);
+		values[0] = NameGetDatum(&recname);
+		values[1] = Int64GetDatum(recentry->queries);
+		values[2] = Int64GetDatum(recentry->predictions);
+		values[3] = Int64GetDatum(recentry->internal_queries);
+		/* convert times from microsec to millisec for display */
+		if (recentry->queries > 0)
+		{
+			values[4] = Float8GetDatum(((double) recentry->total_time) /
+									   recentry->queries / 1000.0);
+			values[5] = Float8GetDatum(((double) recentry->max_time) / 1000.0);
+		}
+		else
+		{
+			nulls[4] = true;
+			nulls[5] = true;
+		}
+		values[6] = Int64GetDatum(recentry->rebuilds);
+		if (recentry->rebuilds > 0)
+		{
+			values[7] = TimestampTzGetDatum(recentry->last_rebuild);
+			values[8] = Float8GetDatum(((double) recentry->last_rebuild_time) / 1000.0);
+		}
+		else
+		{
+			nulls[7] = true;
+			nulls[8] = true;
+		}
+		values[9] = Int64GetDatum(recentry->events_since_rebuild);
+		values[10] = Int64GetDatum(recentry->disk_size);
+		values[11] = Int64GetDatum(recentry->memory_size);
+
+		tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+
+		SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+	}
+	else
+	{
+		/* nothing left */
+		SRF_RETURN_DONE(funcctx);
+	}
+}
+
+/*
+ * The names pg_stat_progress_recommender gives the phases of a build.
+ */
+static const char *
+recBuildPhaseName(RecBuildPhase phase)
+{
+	switch (phase)
+	{
+		case RECBUILD_PHASE_INITIALIZING:
+			return "initializing";
+		case RECBUILD_PHASE_LOADING:
+			return "loading events";
+		case RECBUILD_PHASE_SIMILARITY:
+			return "computing similarities";
+		case RECBUILD_PHASE_TRAINING:
+			return "training";
+		case RECBUILD_PHASE_WRITING:
+			return "writing model";
+		case RECBUILD_PHASE_INDEXING:
+			return "building index";
+		case RECBUILD_PHASE_STATISTICS:
+			return "gathering statistics";
+		case RECBUILD_PHASE_RECVIEW:
+			return "filling RecView";
+	}
+	return "unknown";
+}
+
+Datum
+pg_stat_get_recommender_progress(PG_FUNCTION_ARGS)
+{
+	FuncCallContext *funcctx;
+	PgBackendStatus *entries;
+
+	if (SRF_IS_FIRSTCALL())
+	{
+		MemoryContext oldcontext;
+		TupleDesc	tupdesc;
+		int			numBackends;
+		int			i;
+		int			n = 0;
+
+		funcctx = SRF_FIRSTCALL_INIT();
+
+		oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+		tupdesc = CreateTemplateTupleDesc(8, false);
+		TupleDescInitEntry(tupdesc, (AttrNumber) 1, "pid",
+						   INT4OID, -1, 0);
+		TupleDescInitEntry(tupdesc, (AttrNumber) 2, "recname",
+						   NAMEOID, -1, 0);
+		TupleDescInitEntry(tupdesc, (AttrNumber) 3, "phase",
+						   TEXTOID, -1, 0);
+		TupleDescInitEntry(tupdesc, (AttrNumber) 4, "done",
+						   INT8OID, -1, 0);
+		TupleDescInitEntry(tupdesc, (AttrNumber) 5, "total",
+						   INT8OID, -1, 0);
+		TupleDescInitEntry(tupdesc, (AttrNumber) 6, "build_start",
+						   TIMESTAMPTZOID, -1, 0);
+		TupleDescInitEntry(tupdesc, (AttrNumber) 7, "phase_start",
+						   TIMESTAMPTZOID, -1, 0);
+		TupleDescInitEntry(tupdesc, (AttrNumber) 8, "phase_eta",
+						   TIMESTAMPTZOID, -1, 0);
+
+		funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+		/* Only the backends building something are of interest. */
+		numBackends = pgstat_fetch_stat_numbackends();
+		entries = (PgBackendStatus *)
+			palloc(Max(numBackends, 1) * sizeof(PgBackendStatus));
+		for (i = 1; i <= numBackends; i++)
+		{
+			PgBackendStatus *beentry = pgstat_fetch_stat_beentry(i);
+
+			if (beentry && beentry->st_progress_recname[0] != '\0')
+				entries[n++] = *beentry;
+		}
+		funcctx->user_fctx = entries;
+		funcctx->max_calls = n;
+
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	/* stuff done on every call of the function */
+	funcctx = SRF_PERCALL_SETUP();
+	entries = (PgBackendStatus *) funcctx->user_fctx;
+
+	if (funcctx->call_cntr < funcctx->max_calls)
+	{
+		/* for each row */
+		Datum		values[8];
+		bool		nulls[8];
+		HeapTuple	tuple;
+		PgBackendStatus *beentry = &entries[funcctx->call_cntr];
+		NameData	recname;
+
+		MemSet(values, 0, sizeof(values));
+		MemSet(nulls, 0, sizeof(nulls));
+
+		namestrcpy(&recname, beentry->st_progress_recname);
+		values[0] = Int32GetDatum(beentry->st_procpid);
+		values[1] = NameGetDatum(&recname);
+		values[2] = CStringGetTextDatum(recBuildPhaseName(beentry->st_progress_phase));
+		values[3] = Int64GetDatum(beentry->st_progress_done);
+		values[4] = Int64GetDatum(beentry->st_progress_total);
+		values[5] = TimestampTzGetDatum(beentry->st_progress_start_timestamp);
+		values[6] = TimestampTzGetDatum(beentry->st_progress_phase_timestamp);
+
+		/*
+		 * The phase should end when the rest of its work has gone at the
+		 * rate the work done so far has.
+		 */
+		if (beentry->st_progress_total > 0 && beentry->st_progress_done > 0)
+		{
+			TimestampTz start = beentry->st_progress_phase_timestamp;
+			TimestampTz elapsed = GetCurrentTimestamp() - start;
+			double		ratio = (double) beentry->st_progress_total /
+				beentry->st_progress_done;
+
+			values[7] = TimestampTzGetDatum(start + (TimestampTz) (elapsed * ratio));
+		}
+		else
+			nulls[7] = true;
+
+		tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+
+		SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+	}
+	else
+	{
+		/* nothing left */
+		SRF_RETURN_DONE(funcctx);
+	}
+}
+
+/*
+ * The names pg_stat_recommender_latency gives what its histograms time.
+ */
+static const char *
+recLatencyPhaseName(RecathonLatencyPhase phase)
+{
+	switch (phase)
+	{
+		case RECATHON_LATENCY_QUERY:
+			return "query";
+		case RECATHON_LATENCY_INIT:
+			return "initializing";
+		case RECATHON_LATENCY_PREP:
+			return "preparing users";
+		case RECATHON_LATENCY_SCORE:
+			return "scoring";
+		case RECATHON_LATENCY_REBUILD:
+			return "rebuild";
+	}
+	return "unknown";
+}
+
+/* A row of pg_stat_get_recommender_latency: a histogram of a recommender. */
+typedef struct RecLatencyRow
+{
+	RecathonLatencyStats *stats;
+	RecathonLatencyPhase phase;
+} RecLatencyRow;
+
+Datum
+pg_stat_get_recommender_latency(PG_FUNCTION_ARGS)
+{
+	FuncCallContext *funcctx;
+	RecLatencyRow *rows;
+
+	if (SRF_IS_FIRSTCALL())
+	{
+		MemoryContext oldcontext;
+		TupleDesc	tupdesc;
+		RecathonLatencyStats *stats;
+		int			numStats;
+		int			i;
+		int			n = 0;
+
+		funcctx = SRF_FIRSTCALL_INIT();
+
+		oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+		tupdesc = CreateTemplateTupleDesc(8, false);
+		TupleDescInitEntry(tupdesc, (AttrNumber) 1, "recname",
+						   NAMEOID, -1, 0);
+		TupleDescInitEntry(tupdesc, (AttrNumber) 2, "phase",
+						   TEXTOID, -1, 0);
+		TupleDescInitEntry(tupdesc, (AttrNumber) 3, "count",
+						   INT8OID, -1, 0);
+		TupleDescInitEntry(tupdesc, (AttrNumber) 4, "mean",
+						   FLOAT8OID, -1, 0);
+		TupleDescInitEntry(tupdesc, (AttrNumber) 5, "p50",
+						   FLOAT8OID, -1, 0);
+		TupleDescInitEntry(tupdesc, (AttrNumber) 6, "p90",
+						   FLOAT8OID, -1, 0);
+		TupleDescInitEntry(tupdesc, (AttrNumber) 7, "p99",
+						   FLOAT8OID, -1, 0);
+		TupleDescInitEntry(tupdesc, (AttrNumber) 8, "p999",
+						   FLOAT8OID, -1, 0);
+
+		funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+		/* One row for each histogram that has counted anything. */
+		numStats = recathonLatencySnapshot(&stats);
+		rows = (RecLatencyRow *)
+			palloc(Max(numStats, 1) * RECATHON_LATENCY_PHASES * sizeof(RecLatencyRow));
+		for (i = 0; i < numStats; i++)
+		{
+			int			phase;
+
+			for (phase = 0; phase < RECATHON_LATENCY_PHASES; phase++)
+			{
+				if (stats[i].count[phase] == 0)
+					continue;
+				rows[n].stats = &stats[i];
+				rows[n].phase = (RecathonLatencyPhase) phase;
+				n++;
+			}
+		}
+		funcctx->user_fctx = rows;
+		funcctx->max_calls = n;
+
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	/* stuff done on every call of the function */
+	funcctx = SRF_PERCALL_SETUP();
+	rows = (RecLatencyRow *) funcctx->user_fctx;
+
+	if (funcctx->call_cntr < funcctx->max_calls)
+	{
+		/* for each row */
+		Datum		values[8];
+		bool		nulls[8];
+		HeapTuple	tuple;
+		RecLatencyRow *row = &rows[funcctx->call_cntr];
+		RecathonLatencyStats *stats = row->stats;
+		uint64		count = stats->count[row->phase];
+		const uint64 *buckets = stats->buckets[row->phase];
+		NameData	recname;
+
+		MemSet(values, 0, sizeof(values));
+		MemSet(nulls, 0, sizeof(nulls));
+
+		namestrcpy(&recname, stats->recname);
+		values[0] = NameGetDatum(&recname);
+		values[1] = CStringGetTextDatum(recLatencyPhaseName(row->phase));
+		values[2] = Int64GetDatum((int64) count);
+		/* convert times from microsec to millisec for display */
+		values[3] = Float8GetDatum((double) stats->total[row->phase] /
+								   count / 1000.0);
+		values[4] = Float8GetDatum(recathonLatencyPercentile(buckets, count, 0.5) / 1000.0);
+		values[5] = Float8GetDatum(recathonLatencyPercentile(buckets, count, 0.9) / 1000.0);
+		values[6] = Float8GetDatum(recathonLatencyPercentile(buckets, count, 0.99) / 1000.0);
+		values[7] = Float8GetDatum(recathonLatencyPercentile(buckets, count, 0.999) / 1000.0);
+
+		tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+
+		SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+	}
+	else
+	{
+		/* nothing left */
+		SRF_RETURN_DONE(funcctx);
+	}
+}
+
 Datum
 pg_stat_get_backend_idset(PG_FUNCTION_ARGS)
 {
@@ -1665,6 +2065,7 @@ Datum
 pg_stat_reset(PG_FUNCTION_ARGS)
 {
 	pgstat_reset_counters();
+	recathonLatencyReset();
 
 	PG_RETURN_VOID();
 }
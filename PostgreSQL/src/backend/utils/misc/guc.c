@@ -73,6 +73,11 @@
 #include "utils/plancache.h"
 #include "utils/portal.h"
 #include "utils/ps_status.h"
+#include "utils/recathon.h"
+#include "utils/recathonbuilds.h"
+#include "utils/recathoncache.h"
+#include "utils/recathonlatency.h"
+#include "utils/recathonresults.h"
 #include "utils/snapmgr.h"
 #include "utils/tzparser.h"
 #include "utils/xml.h"
@@ -369,6 +374,15 @@ static const struct config_enum_entry constraint_exclusion_options[] = {
 	{NULL, 0, false}
 };
 
+static const struct config_enum_entry recathon_duplicate_events_options[] = {
+	{"keep", RECATHON_DUPLICATES_KEEP, false},
+	{"sum", RECATHON_DUPLICATES_SUM, false},
+	{"max", RECATHON_DUPLICATES_MAX, false},
+	{"last", RECATHON_DUPLICATES_LAST, false},
+	{"count", RECATHON_DUPLICATES_COUNT, false},
+	{NULL, 0, false}
+};
+
 /*
  * Although only "on", "off", "remote_write", and "local" are documented, we
  * accept all the likely variants of "on" and "off".
@@ -1018,6 +1032,15 @@ static struct config_bool ConfigureNamesBool[] =
 		true,
 		NULL, NULL, NULL
 	},
+	{
+		{"recathon_track_latency", PGC_SUSET, STATS_COLLECTOR,
+			gettext_noop("Collects latency histograms of recommenders."),
+			gettext_noop("RECOMMEND queries time their phases for it, as EXPLAIN ANALYZE would.")
+		},
+		&recathon_track_latency,
+		true,
+		NULL, NULL, NULL
+	},
 	{
 		{"track_io_timing", PGC_SUSET, STATS_COLLECTOR,
 			gettext_noop("Collects timing statistics for database I/O activity."),
@@ -1448,6 +1471,37 @@ static struct config_bool ConfigureNamesBool[] =
 		NULL, NULL, NULL
 	},
 
+	{
+		{"recathon_build_checkpoints", PGC_USERSET, RESOURCES_DISK,
+			gettext_noop("Checkpoints similarity model builds done in blocks."),
+			gettext_noop("A build that doesn't fit in maintenance_work_mem saves each block it finishes, "
+						 "so that trying it again after it's cancelled or the server crashes resumes from there.")
+		},
+		&recathon_build_checkpoints,
+		true,
+		NULL, NULL, NULL
+	},
+
+	{
+		{"recathon_cache_huge_pages", PGC_POSTMASTER, RESOURCES_MEM,
+			gettext_noop("Asks for shared memory in huge pages when the recommender model cache is on."),
+			gettext_noop("If the kernel has none to give, normal pages are used.")
+		},
+		&recathon_cache_huge_pages,
+		false,
+		NULL, NULL, NULL
+	},
+
+	{
+		{"recathon_cache_interleave", PGC_POSTMASTER, RESOURCES_MEM,
+			gettext_noop("Spreads the recommender model cache evenly over the server's NUMA nodes."),
+			NULL
+		},
+		&recathon_cache_interleave,
+		false,
+		NULL, NULL, NULL
+	},
+
 	/* End-of-list marker */
 	{
 		{NULL, 0, 0, NULL, NULL}, NULL, false, NULL, NULL, NULL
@@ -1703,6 +1757,49 @@ static struct config_int ConfigureNamesInt[] =
 		NULL, NULL, NULL
 	},
 
+	{
+		{"recathon_cache_size", PGC_POSTMASTER, RESOURCES_MEM,
+			gettext_noop("Sets the shared memory used to cache recommender models for all sessions."),
+			gettext_noop("Zero disables the cache."),
+			GUC_UNIT_KB
+		},
+		&recathon_cache_size,
+		0, 0, MAX_KILOBYTES,
+		NULL, NULL, NULL
+	},
+
+	{
+		{"recathon_cache_hot_memory", PGC_SIGHUP, RESOURCES_MEM,
+			gettext_noop("Sets the model cache memory for the most popular items of a similarity model too big to cache whole."),
+			gettext_noop("The other items are read from the model table. Zero disables this."),
+			GUC_UNIT_KB
+		},
+		&recathon_cache_hot_memory,
+		0, 0, MAX_KILOBYTES,
+		NULL, NULL, NULL
+	},
+
+	{
+		{"recathon_build_memory", PGC_SIGHUP, RESOURCES_MEM,
+			gettext_noop("Sets the memory all sessions may use together for recommender models generated on the fly."),
+			gettext_noop("A build that would go over waits for others to finish. Zero means no limit."),
+			GUC_UNIT_KB
+		},
+		&recathon_build_memory,
+		0, 0, MAX_KILOBYTES,
+		NULL, NULL, NULL
+	},
+
+	{
+		{"recathon_result_cache_size", PGC_POSTMASTER, RESOURCES_MEM,
+			gettext_noop("Sets the number of users' recommendation lists kept in shared memory for all sessions."),
+			gettext_noop("Zero disables the cache.")
+		},
+		&recathon_result_cache_size,
+		0, 0, INT_MAX / 1024,
+		NULL, NULL, NULL
+	},
+
 	/*
 	 * We use the hopefully-safely-small value of 100kB as the compiled-in
 	 * default for max_stack_depth.  InitializeGUCOptions will increase it if
@@ -1859,6 +1956,18 @@ static struct config_int ConfigureNamesInt[] =
 		NULL, NULL, NULL
 	},
 
+	{
+		{"recathon_time_budget", PGC_USERSET, CLIENT_CONN_STATEMENT,
+			gettext_noop("Sets how long a query for the best few recommendations may spend scoring."),
+			gettext_noop("Once it's up, the query returns the best it has found so far. "
+						 "A value of 0 turns off the budget."),
+			GUC_UNIT_MS
+		},
+		&recathon_time_budget,
+		0, 0, INT_MAX,
+		NULL, NULL, NULL
+	},
+
 	{
 		{"vacuum_freeze_min_age", PGC_USERSET, CLIENT_CONN_STATEMENT,
 			gettext_noop("Minimum age at which VACUUM should freeze a table row."),
@@ -2127,6 +2236,28 @@ static struct config_int ConfigureNamesInt[] =
 		check_effective_io_concurrency, assign_effective_io_concurrency, NULL
 	},
 
+	{
+		{"recathon_parallel_workers", PGC_USERSET, RESOURCES_ASYNCHRONOUS,
+			gettext_noop("Sets the number of processes that score recommendations in parallel."),
+			gettext_noop("Queries for all users are split up by user, and queries for a single user by item. "
+						 "Big similarity model builds with no parallel_workers option use this many processes too.")
+		},
+		&recathon_parallel_workers,
+		1, 1, 64,
+		NULL, NULL, NULL
+	},
+
+	{
+		{"recathon_max_rebuilds", PGC_USERSET, RESOURCES_ASYNCHRONOUS,
+			gettext_noop("Sets the most recommenders a maintenance pass rebuilds for new events."),
+			gettext_noop("The most urgent go first; the rest are left for the next pass. "
+						 "Zero means no limit.")
+		},
+		&recathon_max_rebuilds,
+		0, 0, INT_MAX,
+		NULL, NULL, NULL
+	},
+
 	{
 		{"log_rotation_age", PGC_SIGHUP, LOGGING_WHERE,
 			gettext_noop("Automatic log file rotation will occur after N minutes."),
@@ -2736,6 +2867,17 @@ static struct config_string ConfigureNamesString[] =
 		NULL, NULL, NULL
 	},
 
+	{
+		{"recathon_preload_recommenders", PGC_SIGHUP, RESOURCES_MEM,
+			gettext_noop("Lists the recommenders recathon_preload() reads into memory."),
+			gettext_noop("Use * for every recommender."),
+			GUC_LIST_INPUT | GUC_LIST_QUOTE
+		},
+		&recathon_preload_recommenders,
+		"",
+		NULL, NULL, NULL
+	},
+
 	{
 		{"search_path", PGC_USERSET, CLIENT_CONN_STATEMENT,
 			gettext_noop("Sets the schema search order for names that are not schema-qualified."),
@@ -3284,6 +3426,17 @@ static struct config_enum ConfigureNamesEnum[] =
 		NULL, NULL, NULL
 	},
 
+	{
+		{"recathon_duplicate_events", PGC_SIGHUP, CLIENT_CONN_OTHER,
+			gettext_noop("Sets how a user's repeated events for the same item are combined."),
+			gettext_noop("Valid values are KEEP, SUM, MAX, LAST and COUNT. With anything but KEEP, "
+						 "recommender models and the users being scored see one event per user and item.")
+		},
+		&recathon_duplicate_events,
+		RECATHON_DUPLICATES_KEEP, recathon_duplicate_events_options,
+		NULL, NULL, NULL
+	},
+
 
 	/* End-of-list marker */
 	{
@@ -16,6 +16,8 @@
 /* INTERFACE ROUTINES
  *		recathon_queryStart - prepare a query for returning tuples
  *		recathon_queryEnd - clean up after recathon_queryStart
+ *		recathon_queryStartCached - recathon_queryStart with a cached plan
+ *		recathon_queryEndCached - clean up after recathon_queryStartCached
  *		recathon_queryExecute - fully execute a query
  *		recathon_utilityExecute - fully execute a utility statement
  *		make_rec_from_scan - creates a RecScan from a Scan object
@@ -29,175 +31,997 @@
  *		that only generate a single plan tree.
  */
 
+#include <ctype.h>
+#include <float.h>
 #include <math.h>
+#include <signal.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "postgres.h"
+#include "access/genam.h"
+#include "access/hash.h"
+#include "access/heapam.h"
+#include "access/nbtree.h"
+#include "access/relscan.h"
 #include "access/sdir.h"
+#include "access/sysattr.h"
+#include "access/xact.h"
+#include "access/transam.h"
+#include "access/visibilitymap.h"
+#include "access/xlog.h"
+#include "catalog/indexing.h"
 #include "catalog/namespace.h"
+#include "catalog/pg_am.h"
+#include "catalog/pg_inherits.h"
+#include "catalog/pg_inherits_fn.h"
+#include "catalog/pg_trigger.h"
 #include "catalog/pg_type.h"
+#include "commands/async.h"
+#include "commands/defrem.h"
+#include "commands/trigger.h"
 #include "executor/executor.h"
+#include "funcapi.h"
+#include "lib/stringinfo.h"
+#include "miscadmin.h"
 #include "nodes/makefuncs.h"
 #include "nodes/plannodes.h"
+#include "optimizer/clauses.h"
+#include "optimizer/planner.h"
+#include "optimizer/var.h"
 #include "parser/parse_relation.h"
 #include "parser/parser.h"
+#include "pg_trace.h"
+#include "pgstat.h"
+#include "portability/instr_time.h"
+#include "rewrite/rewriteHandler.h"
+#include "storage/buffile.h"
+#include "storage/bufmgr.h"
+#include "storage/fd.h"
+#include "storage/lmgr.h"
+#include "storage/spin.h"
 #include "tcop/utility.h"
+#include "utils/acl.h"
+#include "utils/array.h"
 #include "utils/builtins.h"
+#include "utils/datum.h"
+#include "utils/fmgroids.h"
+#include "utils/hsearch.h"
+#include "utils/inval.h"
+#include "utils/lsyscache.h"
 #include "utils/memutils.h"
+#include "utils/plancache.h"
 #include "utils/recathon.h"
-
-#define NBRHOOD 0
+#include "utils/recathonbuilds.h"
+#include "utils/recathoncache.h"
+#include "utils/recathonevents.h"
+#include "utils/recathonlatency.h"
+#include "utils/recathonqueries.h"
+#include "utils/recathonresults.h"
+#include "utils/recathonxlog.h"
+#include "utils/rel.h"
+#include "utils/snapmgr.h"
+#include "utils/tqual.h"
+
+/* When set, similarity models are built by accumulating dot products
+ * over co-rated pairs only, rather than comparing every pair. */
+#define COOCCUR_BUILD 1
+
+/* The co-occurrence build accumulates a row's dot products over
+ * tiles of this many other rows at a time, so the accumulators it
+ * scatters into stay in cache however many rows there are. */
+#define RECATHON_SIM_TILE_ROWS 8192
+
+/* An exact build multiplies dense rows instead, when that costs no
+ * more than this many times the multiply-adds the co-occurrence
+ * build would do, and the dense matrix has no more than this many
+ * cells. Dense rows are computed this many at a time, so each row
+ * they're compared with is read once for all of them. */
+#define RECATHON_DENSE_ADVANTAGE 32
+#define RECATHON_DENSE_MAX_CELLS (32*1024*1024)
+#define RECATHON_DENSE_BLOCK_ROWS 32
+
+/* A parallel model build cuts its rows into about this many tasks
+ * of equal estimated cost per process, so that a process that runs
+ * out can take over some of another's. */
+#define RECATHON_TASKS_PER_WORKER 64
+
+/* An ALS solve adds its row's events into the normal equations this
+ * many at a time, one row of the equations for all of them at once,
+ * so a large system is read through once a block, not once an event. */
+#define RECATHON_ALS_BLOCK 32
+
+/* Jaccard bitsets are intersected a word at a time, with the
+ * hardware popcount where the compiler has one. */
+#if defined(__GNUC__)
+#define RECATHON_POPCOUNT64(x) __builtin_popcountll(x)
+#else
+#define RECATHON_POPCOUNT64(x) recathon_popcount64(x)
+#endif
+
+/* Internal queries are cached by their template text, which is
+ * bounded by the size of the buffers we build them in. */
+#define RECATHON_PLAN_KEYLEN 1024
+
+/* Templates name the model tables they read, so every rebuild brings
+ * new ones, and the old ones are never used again. We keep this many,
+ * throwing out the least recently used to make room. */
+#define RECATHON_PLAN_CACHE_SIZE 256
+
+/* Penalty per rating when folding users into a factor model,
+ * the same as the ALS default. */
+#define RECATHON_FOLDIN_PENALTY 0.05
+
+/* An online factor model takes each pass's new events in with this
+ * many rounds of gradient steps over them, at this learning rate and
+ * this penalty on the factors' size. */
+#define RECATHON_ONLINE_EPOCHS 10
+#define RECATHON_ONLINE_RATE 0.01
+#define RECATHON_ONLINE_PENALTY 0.02
+
+/* A clustered user similarity build sketches each user's events in
+ * this many dimensions, and clusters the sketches. */
+#define RECATHON_CLUSTER_DIMS 32
+
+/* The approximate top-k index clusters the items with this many
+ * rounds of k-means, over a sample of this many items per cluster.
+ * A query probes at least this share of the clusters, and keeps
+ * probing until it has this many candidate items. */
+#define RECATHON_ANN_ITERATIONS 10
+#define RECATHON_ANN_SAMPLE 64
+#define RECATHON_ANN_PROBE_FRACTION 0.1
+#define RECATHON_ANN_MIN_CANDIDATES 1000
+
+/* An item-based scan of at least this many users, with its model in
+ * memory, works out this many users' pending scores at a time, as
+ * long as they fit in work_mem. */
+#define RECATHON_USER_BLOCK 16
+
+/* A factor-model scan of at least this many users scores this many of
+ * them against every item at a time, as long as their scores fit in
+ * work_mem, going through the items this many at a time so that each
+ * stretch of the item factors is read from cache by the whole block. */
+#define RECATHON_SVD_USER_BLOCK 64
+#define RECATHON_SVD_ITEM_TILE 256
+
+/* SVD and ALS training number the items most events first while they
+ * train, once their factors take more than this many bytes, so that
+ * the factors of the items read most often sit together in cache. */
+#define RECATHON_ITEM_ORDER_BYTES (1024*1024)
+
+/* The INSERT hook remembers this many users per events table, to
+ * throw out their cached recommendations; past that it throws out
+ * every list for the table. It also keeps track of this many
+ * different user keys among the table's recommenders. */
+#define RECATHON_EVENT_USERS 64
+#define RECATHON_EVENT_USERKEYS 8
+
+/* The most users whose prepared ratings, neighbors or factors a
+ * backend keeps between queries. Past that we start over. */
+#define RECATHON_PROFILE_USERS 1024
+
+/* The most filters on one item attribute whose items a backend keeps
+ * between queries. Past that the oldest is forgotten. */
+#define RECATHON_ITEM_FILTERS 32
+
+/* A query looks item IDs up in a plain array when the IDs span no
+ * more than this many times as many values as there are items. */
+#define RECATHON_ITEM_MAP_SPREAD 4
+
+/* An LSH bucket with more rows than this can't tell them apart, so
+ * an approximate build doesn't compare them on its account. */
+#define RECATHON_LSH_MAX_BUCKET 1000
+
+/* Similarity entries written to a model file at a time. */
+#define RECATHON_MODEL_CHUNK 65536
+
+/* The model files this backend has mapped. */
+static model_file recathon_model_files = NULL;
+static bool recathon_model_callback_registered = false;
+
+/* The events one model build read, kept for the next build over the
+ * same events while a maintenance pass is rebuilding recommenders. */
+typedef struct event_capture_t {
+	char *eventtable;
+	char *userkey;
+	char *itemkey;
+	char *eventval;
+	int numEvents;
+	int *users;
+	int *items;
+	float *values;
+	struct event_capture_t *next;
+} event_capture;
+
+static event_capture *recathon_event_captures = NULL;
+static MemoryContext recathon_capture_context = NULL;
+static int recathon_capture_depth = 0;
+static Size recathon_capture_bytes = 0;
+static bool recathon_capture_callback_registered = false;
+
+/* The most on-the-fly models a backend keeps for later queries. */
+#define RECATHON_GENERATED_MODELS 4
+
+/* Room for the events table, method and columns of one of them. */
+#define RECATHON_GENERATED_KEYLEN (5 * NAMEDATALEN)
+
+/* How many rows go by between reports to pg_stat_progress_recommender. */
+#define RECATHON_PROGRESS_ROWS 8192
+
+/* The state of an events table when a model was generated from it. */
+typedef struct generated_stamp {
+	bool valid;		/* could we tell? */
+	Oid relfilenode;
+	uint64 generation;	/* see recathonEventsWatch */
+	int64 changes;		/* rows inserted, updated and deleted */
+} generated_stamp;
+
+/* A model generated on the fly, kept for the next query over the
+ * same events (see restoreGeneratedModel). */
+typedef struct generated_model_t {
+	MemoryContext context;	/* holds all of it */
+	int method;
+	char eventtable[NAMEDATALEN];
+	char userkey[NAMEDATALEN];
+	char itemkey[NAMEDATALEN];
+	char eventval[NAMEDATALEN];
+	generated_stamp stamp;
+	bool factors;		/* SVD or ALS, rather than item-based */
+	Size size;
+	uint64 lastUsed;
+	int numItems;
+	int *itemIDs;
+	int numUsers;		/* every user, or none for an item-based */
+	int *userIDs;		/* model that didn't need them */
+	GenSparseModel *itemmodel;
+	int numFeatures;
+	float *userFeatures;
+	float *itemFeatures;
+	struct generated_model_t *next;
+} generated_model;
+
+static generated_model *recathon_generated_models = NULL;
+static uint64 recathon_generated_clock = 0;
+
+/* A model generated on the fly as it's kept in the shared model
+ * cache, for other sessions' queries over the same events. Its ID
+ * lists follow, then its factors or its rows. */
+typedef struct shared_generated_model {
+	int method;
+	char eventtable[NAMEDATALEN];
+	char userkey[NAMEDATALEN];
+	char itemkey[NAMEDATALEN];
+	char eventval[NAMEDATALEN];
+	generated_stamp stamp;
+	bool factors;
+	bool hasUsers;		/* is the list of every user there? */
+	int numItems;
+	int numUsers;
+	int numFeatures;
+	int numRows;
+	int numEntries;
+} shared_generated_model;
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+/* Factor dot products and updates use whichever vector instructions
+ * the compiler has been told it can target. */
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define RECATHON_USE_AVX2 1
+#elif defined(__SSE__)
+#include <xmmintrin.h>
+#define RECATHON_USE_SSE 1
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define RECATHON_USE_NEON 1
+#endif
+
+/* Half-precision factors are converted in hardware where we can. */
+#if defined(__F16C__) && !defined(RECATHON_USE_AVX2)
+#include <immintrin.h>
+#endif
+
+/* Tables the INSERT hook has already looked at in this transaction. */
+typedef struct RecathonEventEntry {
+	char tablename[NAMEDATALEN];
+	char eventtable[NAMEDATALEN];	/* the events table it's a partition of, or itself */
+	Oid eventrelid;		/* and its OID */
+	bool isEventTable;
+	bool notified;		/* has the maintenance process been told? */
+	bool claimed;		/* did we claim the notification (see recathonevents.c)? */
+	bool inserted;		/* have we added events to it? */
+	bool watched;		/* do models generated from it need to know? */
+	int numUserAtts;	/* the user key columns, or -1 if not looked up */
+	AttrNumber userAtts[RECATHON_EVENT_USERKEYS];
+	int numUsers;		/* users with new events in this transaction */
+	int users[RECATHON_EVENT_USERS];
+	bool allUsers;		/* too many to list, or keys we couldn't read */
+} RecathonEventEntry;
+
+/* What the catalogue cache knows of a recommender: its entry in
+ * RecModelsCatalogue, and the row of its index table. */
+typedef struct RecathonCatalogueEntry {
+	char key[NAMEDATALEN];	/* the index table's name, in lower case */
+	HeapTuple catalogue;	/* NULL if it isn't in the catalogue */
+	TupleDesc catalogueDesc;
+	bool indexRead;		/* has the index table been read yet? */
+	Oid indexRelid;
+	HeapTuple index;
+	TupleDesc indexDesc;
+} RecathonCatalogueEntry;
+
+/* The recommender, if any, on an events table using a method. */
+#define RECATHON_BUILT_KEYLEN (2*NAMEDATALEN)
+typedef struct RecathonBuiltEntry {
+	char key[RECATHON_BUILT_KEYLEN];	/* the table, a space, and the method */
+	char recindexname[NAMEDATALEN];	/* empty if there isn't one */
+} RecathonBuiltEntry;
+
+static HTAB *recathon_event_tables = NULL;
+static bool recathon_callbacks_registered = false;
+
+/* The catalogue cache lasts for the session, until RecModelsCatalogue
+ * or one of the cached index tables changes. */
+static MemoryContext recathon_catalogue_context = NULL;
+static HTAB *recathon_catalogue_entries = NULL;
+static HTAB *recathon_catalogue_built = NULL;
+static Oid recathon_catalogue_relid = InvalidOid;
+static bool recathon_catalogue_stale = false;
+
+typedef struct RecathonPlanEntry {
+	char query[RECATHON_PLAN_KEYLEN];
+	CachedPlanSource *plansource;
+	uint64 lastUsed;			/* recathon_plan_clock when last looked up */
+} RecathonPlanEntry;
+
+static HTAB *recathon_plan_cache = NULL;
+static uint64 recathon_plan_clock = 0;
+
+/* What prepUserForRating worked out for a user, kept for the rest of
+ * the session. It holds for as long as the recommender's models and
+ * the number of the user's events stay the same. */
+typedef struct RecathonProfileKey {
+	char recname[NAMEDATALEN];
+	int userID;
+} RecathonProfileKey;
+
+typedef struct RecathonProfileEntry {
+	RecathonProfileKey key;
+	uint32 version;		/* the build of the models */
+	int numEvents;		/* the user's events at the time */
+	int numValues;		/* ratings, neighbors or factors */
+	int *IDs;		/* the rated items or neighbors, or NULL for factors */
+	float *values;		/* the ratings, similarities or factors */
+	float average;		/* the user's average rating, for user-based CF */
+} RecathonProfileEntry;
+
+static HTAB *recathon_profile_cache = NULL;
+static MemoryContext recathon_profile_context = NULL;
+
+/* A column of an items table listed in a recommender's item_attributes,
+ * with its items grouped by value, kept for the rest of the session.
+ * It holds for as long as the recommender's models stay the same. */
+typedef struct RecathonItemAttribute {
+	char recname[NAMEDATALEN];
+	Oid relid;		/* the items table */
+	AttrNumber attno;	/* the attribute */
+	AttrNumber keyattno;	/* the column with the item IDs */
+	Oid atttypid;		/* the attribute's type when it was read */
+	uint32 version;		/* the build of the models */
+	int numItems;		/* the items the models know */
+	int numValues;		/* distinct values, a null among them */
+	Datum *values;		/* the values */
+	bool *isnull;		/* which of them is the null */
+	int *offsets;		/* where each value's items start, and the end */
+	int *items;		/* item indexes, grouped by value */
+	List *filters;		/* RecathonItemFilters, oldest first */
+	MemoryContext context;	/* holds all of the above */
+} RecathonItemAttribute;
+
+/* The items a condition on an attribute let through. */
+typedef struct RecathonItemFilter {
+	char *clause;		/* the condition, deparsed */
+	Bitmapset *items;	/* the item indexes it matched */
+} RecathonItemFilter;
+
+/* The same value, read twice, is told apart by its bytes. */
+typedef struct RecathonValueKey {
+	const char *data;
+	Size len;
+} RecathonValueKey;
+
+typedef struct RecathonValueEntry {
+	RecathonValueKey key;
+	int value;		/* its place in the attribute's values */
+} RecathonValueEntry;
+
+static List *recathon_item_attributes = NIL;
+static MemoryContext recathon_attribute_context = NULL;
+
+/* The internal queries this backend has run, for EXPLAIN ANALYZE. */
+long recathon_query_count = 0;
+
+/* GUC variable: the processes that score all users' recommendations. */
+int recathon_parallel_workers = 1;
+
+/* GUC variable: the recommenders recathon_preload() loads, or "*". */
+char *recathon_preload_recommenders = NULL;
+
+/* GUC variable: do similarity builds done in blocks keep checkpoints? */
+bool recathon_build_checkpoints = true;
+
+/* GUC variable: how a user's repeated events for an item are combined. */
+int recathon_duplicate_events = RECATHON_DUPLICATES_KEEP;
+
+/* GUC variable: milliseconds a top-k query may spend, or zero. */
+int recathon_time_budget = 0;
+
+/* GUC variable: rebuilds for new events a maintenance pass does, or zero. */
+int recathon_max_rebuilds = 0;
 
 static float getUpdateThreshold();
+static CachedPlanSource *recathon_getPlanSource(char *query_string, int nparams,
+			Oid *paramtypes);
+static void maintainHeavyUsers(char *recname, char *recindexname);
+static int64 recModelDiskSize(char *recindexname, char *modelname,
+			char *modelname2, char *clustername);
+static int maintainCells(char *eventtable);
+static void queryNumbers(char *querystring, double *numbers, int n);
+static int recViewAffectedUsers(char *recindexname, recMethod method,
+			char *oldmodelname, char *oldmodelname2, char *newmodelname,
+			char *newmodelname2, int **ret_IDs);
+static void refreshRecView(char *recname, char *recindexname, int *userIDs,
+			int numUsers);
+static int refreshStandbyModelFiles(char *eventtable);
+static bool relationIsEmpty(char *relname);
+static bool loadPopularScores(RecScanState *recstate);
+static const rec_strategy popularStrategy;
+static void probeItemClusters(RecScanState *recstate);
+static float* itemFactors(RecScanState *recstate, int itemindex, float *buf);
+static char *simMethodName(recMethod method);
+static void prepEnsembleUser(RecScanState *recstate, int userID);
+static bool prepOtherMethod(RecScanState *member, int userID);
+static void limitUserNeighbors(RecScanState *recstate);
+static bool *ratedItemSlice(RecScanState *recnode, sim_vector *itemEvents,
+		int numItems);
+static int slicedRow(sim_builder builder, bool *slice, int i);
+static float **buildUserCFModel(RecScanState *recnode, sim_builder builder,
+		sim_vector *userEvents, int numUsers, int *userIDs);
+static void pickMethodCandidates(RecScanState *recstate, int userID);
+static void loadHotItemSim(RecScanState *recstate);
+static void itemAttributeList(char *spec, bool validate, List **ret_relids,
+		List **ret_attnos);
+static bool attributeCandidates(RecScanState *recstate, Query *itemQuery);
+static bool profileCacheable(RecScanState *recstate);
+static void resetCandidates(RecScanState *recstate);
+static void blendEnsembleBatch(RecScanState *recnode, const int *itemindexes,
+		int n, float *scores);
+static char *modelFilePath(char *recindexname, bool temporary);
+static void addModelKey(char *modelname, char *columns, bool presorted);
+static uint32 activeItemsExecute(char *query_string);
+static bool generatedSVDparams(RecScanState *recnode, recMethod method,
+		svd_params *params);
+static void markModelAllVisible(Relation rel);
+static int *sparseRowColumns(GenSparseModel *model, int i, int *buf);
+static int sparseColumn(GenSparseModel *model, int i, int j);
+static void copyGeneratedModel(RecScanState *recnode, struct generated_model_t *gm);
+static void shareGeneratedModel(struct generated_model_t *gm);
+static bool restoreSharedModel(RecScanState *recnode, struct generated_stamp *stamp);
+static char *modelFileSection(RecScanState *recstate, int section, Size *ret_length);
+static bool modelFileFactorsOf(RecScanState *recstate, int userID, float *row);
+static int distinctIDs(int *IDs, int n, int **ret_IDs);
+static float *allocFeatures(int numFeatures, int n, bool shared);
+static void warmStartFeatures(svd_params *params, int *userIDs, int numUsers,
+		int *itemIDs, int numItems, float *userFeatures, float *itemFeatures);
+static int copyKnownFeatures(float *old, float *features, int n, int numFeatures);
+static void freeFeatures(float *features, int numFeatures, int n, bool shared);
+static int *orderItemsByEvents(svd_events events, int numItems, int numFeatures);
+static void permuteItemFactors(float *features, int *order, int numItems,
+		int numFeatures, bool toRanks);
+static int64 writeTopPredictions(char *recquery, char *tablename, char *userkey,
+			char *itemkey, char *eventval, int topN);
+static int simBuilderRowFrom(sim_builder builder, int i, bool full);
+static int simBuilderAccumulate(sim_builder builder, sim_vector vec, float norm,
+		float avg, int from, int to, int skip);
+static bool simBuilderMakeDense(sim_builder builder, int *colLengths);
+static void simBuilderStrategy(sim_builder builder, sim_params *params);
+static sim_vector *groupSimVectors(int numEvents, int *eventKey, int *eventOther,
+		float *eventValue, int *totalNum, int **IDlist);
+static void sortEvents(int *ids, float *events, int length);
+static int collapseEvents(int *ids, float *events, int length);
+static void simVectorCollapse(sim_vector vec);
+static bool simBuilderPruned(sim_builder builder, float similarity,
+		sim_vector a, sim_vector b, int support);
+static int simBuilderDenseRow(sim_builder builder, int i, bool full);
+static int simBuilderDenseAgainst(sim_builder builder, sim_vector vec, float norm,
+		float avg, int upto);
+static float factorDot(const float *a, const float *b, int n);
+static void factorAxpy(float alpha, const float *x, float *y, int n);
+static sim_builder simBuilderSetUp(sim_vector *vectors, int numVectors,
+		float *norms, float *avgs, bool jaccard, int lshBands, int lshRows,
+		int numClusters, int numProbes);
+static void lockEventDeltas(char *deltaname);
+static bool hasEventDeltas(char *recindexname);
+static bytea *packSimVector(sim_vector vec);
+static char *simMethodName(recMethod method);
+static int buildDistributedSimModel(recMethod method, char *eventtable,
+		char *userkey, char *itemkey, char *eventval, char *modelname,
+		sim_params *params);
+static void requireDblink(char *option);
+static List *splitNodeList(char *nodelist);
+static void applyItemCosChanges(char *recindexname, char *modelname,
+		char *querystring);
+static char *catalogueString(char *recindexname, char *column);
+static void getRefreshPolicy(char *recindexname, float update_threshold,
+		float *ret_threshold, bool *ret_due, bool *ret_requested);
+static void noteRefresh(char *recindexname, bool rebuilt);
+static void beginEventCapture(void);
+static int countEvents(char *eventtable);
+static int64 eventsInserted(char *eventtable);
+static int64 getRecEventsInserted(char *recindexname);
+static void storeRecEventsInserted(char *recindexname, int64 inserted);
+static void endEventCapture(void);
+
+/* ----------------------------------------------------------------
+ *		createSimVector
+ *
+ *		Creates an empty sim_vector, used for recommenders.
+ * ----------------------------------------------------------------
+ */
+sim_vector
+createSimVector(void) {
+	sim_vector newvec;
+
+	newvec = (sim_vector) palloc(sizeof(struct sim_vector_t));
+	newvec->length = 0;
+	newvec->maxlength = 16;
+	newvec->id = (int*) palloc(newvec->maxlength*sizeof(int));
+	newvec->event = (float*) palloc(newvec->maxlength*sizeof(float));
+	newvec->packed = false;
+
+	return newvec;
+}
+
+/* ----------------------------------------------------------------
+ *		createPackedSimVectors
+ *
+ *		Creates a set of empty sim_vectors that can hold the
+ *		given number of events each. Rather than allocating
+ *		three chunks per vector and doubling them as they
+ *		fill up, we make one block each for the vectors, the
+ *		IDs and the events, sized exactly, so a build with
+ *		millions of vectors makes three allocations instead
+ *		of millions, and wastes no space. The vectors can't
+ *		grow past those sizes, and are freed all at once by
+ *		freeSimVectors.
+ * ----------------------------------------------------------------
+ */
+sim_vector*
+createPackedSimVectors(int numVectors, int *lengths) {
+	int i;
+	Size total;
+	struct sim_vector_t *block;
+	sim_vector *vectors;
+	int *ids;
+	float *events;
+
+	total = 0;
+	for (i = 0; i < numVectors; i++)
+		total += lengths[i];
+
+	vectors = (sim_vector*) palloc(Max(numVectors,1)*sizeof(sim_vector));
+	block = (struct sim_vector_t*) palloc(Max(numVectors,1)*sizeof(struct sim_vector_t));
+	ids = (int*) palloc(Max(total,1)*sizeof(int));
+	events = (float*) palloc(Max(total,1)*sizeof(float));
+
+	for (i = 0; i < numVectors; i++) {
+		block[i].length = 0;
+		block[i].maxlength = lengths[i];
+		block[i].id = ids;
+		block[i].event = events;
+		block[i].packed = true;
+		ids += lengths[i];
+		events += lengths[i];
+		vectors[i] = &block[i];
+	}
+
+	return vectors;
+}
 
 /* ----------------------------------------------------------------
- *		createSimNode
+ *		simVectorAppend
  *
- *		Creates a sim_node, used for recommenders.
+ *		Add one event to the end of a sim_vector. The
+ *		vector is not kept sorted; call simVectorSort once
+ *		all of the events are in.
  * ----------------------------------------------------------------
  */
-sim_node
-createSimNode(int userid, float event) {
-	sim_node newnode;
+void
+simVectorAppend(sim_vector vec, int id, float event) {
+	if (vec->length >= vec->maxlength) {
+		if (vec->packed)
+			elog(ERROR, "packed rating vector is full");
+		vec->maxlength *= 2;
+		vec->id = (int*) repalloc(vec->id, vec->maxlength*sizeof(int));
+		vec->event = (float*) repalloc(vec->event, vec->maxlength*sizeof(float));
+	}
+
+	vec->id[vec->length] = id;
+	vec->event[vec->length] = event;
+	vec->length++;
+}
+
+/* Comparison function for sorting integers. */
+int
+intCompare(const void *a, const void *b) {
+	int id1 = *((const int*) a);
+	int id2 = *((const int*) b);
+
+	if (id1 < id2) return -1;
+	if (id1 > id2) return 1;
+	return 0;
+}
+
+/* Comparison function for sorting rating vector slots by ID. */
+static int
+simKeySlotCompare(const void *a, const void *b) {
+	int id1 = ((const sim_key_slot*) a)->id;
+	int id2 = ((const sim_key_slot*) b)->id;
+
+	if (id1 < id2) return -1;
+	if (id1 > id2) return 1;
+	return 0;
+}
 
-	newnode = (sim_node) palloc(sizeof(struct sim_node_t));
-	newnode->id = userid;
-	newnode->event = event;
-	newnode->next = NULL;
+/* Comparison function for sorting events by ID, keeping the order
+ * they were read in, which is in index, among those with the same. */
+static int
+simKeySlotStableCompare(const void *a, const void *b) {
+	const sim_key_slot *slot1 = (const sim_key_slot*) a;
+	const sim_key_slot *slot2 = (const sim_key_slot*) b;
+
+	if (slot1->id < slot2->id) return -1;
+	if (slot1->id > slot2->id) return 1;
+	if (slot1->index < slot2->index) return -1;
+	if (slot1->index > slot2->index) return 1;
+	return 0;
+}
+
+/* Comparison function for sorting sim_vector entries by descending event. */
+static int
+simEntryEventCompare(const void *a, const void *b) {
+	float event1 = ((const sim_entry*) a)->event;
+	float event2 = ((const sim_entry*) b)->event;
+
+	if (event1 > event2) return -1;
+	if (event1 < event2) return 1;
+	return 0;
+}
 
-	return newnode;
+/* ----------------------------------------------------------------
+ *		simVectorSort
+ *
+ *		Sort a sim_vector by ID, so that the similarity
+ *		functions can compare vectors in linear time.
+ * ----------------------------------------------------------------
+ */
+void
+simVectorSort(sim_vector vec) {
+	if (vec)
+		sortEvents(vec->id, vec->event, vec->length);
 }
 
 /* ----------------------------------------------------------------
- *		simInsert
+ *		sortEvents
  *
- *		Add one sim_node into a sorted list, via insertion
- *		sort. Sorted by id.
+ *		Sorts parallel arrays of IDs and events by ID. The
+ *		sort is stable, so repeated IDs stay in the order
+ *		they were read in, for collapseEvents.
  * ----------------------------------------------------------------
  */
-sim_node
-simInsert(sim_node target, sim_node newnode) {
-	sim_node tempnode;
+static void
+sortEvents(int *ids, float *events, int length) {
+	int i;
+	sim_key_slot *slots;
+	float *sorted;
+
+	if (length < 2)
+		return;
 
-	// Base case 1: target is empty.
-	if (!target) return newnode;
+	// Our input is often already in order, in which case
+	// there's nothing to do.
+	for (i = 1; i < length; i++)
+		if (ids[i-1] > ids[i]) break;
+	if (i == length)
+		return;
 
-	// Base case 2: target belongs at the head of the list.
-	tempnode = target;
-	if (newnode->id <= tempnode->id) {
-		newnode->next = tempnode;
-		return newnode;
+	slots = (sim_key_slot*) palloc(length*sizeof(sim_key_slot));
+	for (i = 0; i < length; i++) {
+		slots[i].id = ids[i];
+		slots[i].index = i;
 	}
 
-	// Normal case.
-	while (tempnode->next) {
-		if (newnode->id <= tempnode->next->id) break;
-		tempnode = tempnode->next;
+	qsort(slots, length, sizeof(sim_key_slot), simKeySlotStableCompare);
+
+	sorted = (float*) palloc(length*sizeof(float));
+	for (i = 0; i < length; i++) {
+		ids[i] = slots[i].id;
+		sorted[i] = events[slots[i].index];
 	}
+	memcpy(events, sorted, length*sizeof(float));
+	pfree(sorted);
+	pfree(slots);
+}
 
-	newnode->next = tempnode->next;
-	tempnode->next = newnode;
+/*
+ * The first of a user's events for an item, and the next one folded
+ * into what we have so far, under recathon_duplicate_events.
+ */
+static float
+firstDuplicateEvent(float event) {
+	return recathon_duplicate_events == RECATHON_DUPLICATES_COUNT ? 1.0 : event;
+}
 
-	return target;
+static float
+mergeDuplicateEvent(float sofar, float event) {
+	switch (recathon_duplicate_events) {
+		case RECATHON_DUPLICATES_SUM:
+			return sofar + event;
+		case RECATHON_DUPLICATES_MAX:
+			return Max(sofar, event);
+		case RECATHON_DUPLICATES_LAST:
+			return event;
+		case RECATHON_DUPLICATES_COUNT:
+			return sofar + 1.0;
+		default:
+			return sofar;
+	}
 }
 
 /* ----------------------------------------------------------------
- *		freeSimList
+ *		collapseEvents
  *
- *		Free a list of sim_nodes.
+ *		Combines the events of each ID in arrays sorted by
+ *		sortEvents into one, as recathon_duplicate_events
+ *		says. Returns how many are left, which are at the
+ *		front of the arrays, still sorted.
  * ----------------------------------------------------------------
  */
-void
-freeSimList(sim_node head) {
-	sim_node temp;
-	while (head) {
-		temp = head->next;
-		pfree(head);
-		head = temp;
+static int
+collapseEvents(int *ids, float *events, int length) {
+	int i, kept;
+
+	if (recathon_duplicate_events == RECATHON_DUPLICATES_KEEP || length < 1)
+		return length;
+
+	kept = 0;
+	for (i = 0; i < length; i++) {
+		if (kept > 0 && ids[kept-1] == ids[i]) {
+			events[kept-1] = mergeDuplicateEvent(events[kept-1], events[i]);
+			continue;
+		}
+		ids[kept] = ids[i];
+		events[kept] = firstDuplicateEvent(events[i]);
+		kept++;
 	}
+	return kept;
+}
+
+/* ----------------------------------------------------------------
+ *		simVectorCollapse
+ *
+ *		Sorts a sim_vector, and leaves it with one event for
+ *		each ID, unless duplicates are kept.
+ * ----------------------------------------------------------------
+ */
+static void
+simVectorCollapse(sim_vector vec) {
+	simVectorSort(vec);
+	if (vec)
+		vec->length = collapseEvents(vec->id, vec->event, vec->length);
 }
 
 /* ----------------------------------------------------------------
- *		createNbrNode
+ *		freeSimVector
  *
- *		Creates a nbr_node, used for limited-neighborhood
- *		recommenders.
+ *		Free a sim_vector.
  * ----------------------------------------------------------------
  */
-nbr_node
-createNbrNode(int item1, int item2, float similarity) {
-	nbr_node newnode;
+void
+freeSimVector(sim_vector vec) {
+	// A packed vector goes when the rest of its set does.
+	if (!vec || vec->packed)
+		return;
+
+	pfree(vec->id);
+	pfree(vec->event);
+	pfree(vec);
+}
+
+/* ----------------------------------------------------------------
+ *		nbrHeapCreate
+ *
+ *		Creates an empty neighborhood, used for limited-
+ *		neighborhood recommenders. It keeps the maxsize most
+ *		similar neighbors it's offered.
+ * ----------------------------------------------------------------
+ */
+nbr_heap
+nbrHeapCreate(int maxsize) {
+	nbr_heap heap;
 
-	newnode = (nbr_node) palloc(sizeof(struct nbr_node_t));
-	newnode->item1 = item1;
-	newnode->item2 = item2;
-	newnode->similarity = similarity;
-	newnode->next = NULL;
+	heap = (nbr_heap) palloc(sizeof(struct nbr_heap_t));
+	heap->size = 0;
+	heap->maxsize = maxsize;
+	heap->index = (int*) palloc(maxsize*sizeof(int));
+	heap->similarity = (float*) palloc(maxsize*sizeof(float));
 
-	return newnode;
+	return heap;
 }
 
 /* ----------------------------------------------------------------
- *		nbrInsert
+ *		nbrHeapReset
  *
- *		Add one nbr_node into a sorted list, via insertion
- *		sort. Sorted by similarity.
+ *		Empties a neighborhood, for the next row.
  * ----------------------------------------------------------------
  */
-nbr_node
-nbrInsert(nbr_node target, nbr_node newnode, int maxsize) {
-	int i;
-	nbr_node tempnode;
-	bool inserted = false;
+void
+nbrHeapReset(nbr_heap heap) {
+	heap->size = 0;
+}
+
+/* ----------------------------------------------------------------
+ *		nbrHeapInsert
+ *
+ *		Offers a neighbor to a neighborhood. Until it's full,
+ *		everyone gets in; after that, a neighbor only gets in
+ *		by being more similar than the least similar one held,
+ *		which it replaces.
+ * ----------------------------------------------------------------
+ */
+void
+nbrHeapInsert(nbr_heap heap, int index, float similarity) {
+	int i, child;
+
+	if (heap->size < heap->maxsize) {
+		// Sift the new neighbor up from the bottom.
+		i = heap->size++;
+		while (i > 0) {
+			int parent = (i - 1) / 2;
+
+			if (heap->similarity[parent] <= similarity)
+				break;
+			heap->index[i] = heap->index[parent];
+			heap->similarity[i] = heap->similarity[parent];
+			i = parent;
+		}
+		heap->index[i] = index;
+		heap->similarity[i] = similarity;
+		return;
+	}
+
+	if (similarity <= heap->similarity[0])
+		return;
+
+	// Replace the top, and sift it down.
+	i = 0;
+	for (;;) {
+		child = 2*i + 1;
+		if (child >= heap->size)
+			break;
+		if (child + 1 < heap->size &&
+		    heap->similarity[child+1] < heap->similarity[child])
+			child++;
+		if (similarity <= heap->similarity[child])
+			break;
+		heap->index[i] = heap->index[child];
+		heap->similarity[i] = heap->similarity[child];
+		i = child;
+	}
+	heap->index[i] = index;
+	heap->similarity[i] = similarity;
+}
 
-	// Base case 1: target is empty.
-	if (!target) return newnode;
+/* ----------------------------------------------------------------
+ *		nbrHeapInsertBatch
+ *
+ *		Offers n neighbors to a neighborhood at once, with
+ *		their indexes in index, or their positions if index
+ *		is NULL. Once it's full, only the ones more similar
+ *		than the least similar held are picked out, a block
+ *		at a time, and offered one by one.
+ * ----------------------------------------------------------------
+ */
+void
+nbrHeapInsertBatch(nbr_heap heap, const int *index, const float *similarity, int n) {
+	int positions[RECATHON_SELECT_BLOCK];
+	int start = 0, i, found;
 
-	// Base case 2: target belongs at the head of the list.
-	if (newnode->similarity >= target->similarity) {
-		newnode->next = target;
-		target = newnode;
-		inserted = true;
+	while (start < n && heap->size < heap->maxsize) {
+		nbrHeapInsert(heap, index ? index[start] : start, similarity[start]);
+		start++;
 	}
+	if (heap->maxsize <= 0)
+		return;
 
-	tempnode = target;
-	i = 1;
+	for (; start < n; start += RECATHON_SELECT_BLOCK) {
+		int count = Min(n - start, RECATHON_SELECT_BLOCK);
 
-	// Normal case.
-	while (tempnode->next && i < maxsize) {
-		if (newnode->similarity >= tempnode->next->similarity) {
-			if (!inserted) {
-				newnode->next = tempnode->next;
-				tempnode->next = newnode;
-				inserted = true;
-			}
+		found = selectScores(similarity + start, count, heap->similarity[0], true, positions);
+		for (i = 0; i < found; i++) {
+			int pos = start + positions[i];
+
+			nbrHeapInsert(heap, index ? index[pos] : pos, similarity[pos]);
 		}
-		tempnode = tempnode->next;
-		i++;
 	}
+}
+
+/* ----------------------------------------------------------------
+ *		selectScores
+ *
+ *		Puts the positions of the scores that beat threshold,
+ *		above it if highest or below it if not, in positions,
+ *		in order, and returns how many there are. Four scores
+ *		are compared at once, and a run with none of them
+ *		beating it costs one test; each position is written
+ *		whether or not it's kept, and only counted if it is,
+ *		so positions needs room for n.
+ * ----------------------------------------------------------------
+ */
+int
+selectScores(const float *scores, int n, float threshold, bool highest, int *positions) {
+	int i = 0, found = 0;
+
+#ifdef __SSE2__
+	__m128 limit = _mm_set1_ps(threshold);
+
+	for (; i + 8 <= n; i += 8) {
+		__m128 a = _mm_loadu_ps(scores + i);
+		__m128 b = _mm_loadu_ps(scores + i + 4);
+		int mask, lane;
 
-	// If we've run out of room on our list.
-	if (tempnode->next && i >= maxsize) {
-		pfree(tempnode->next);
-		tempnode->next = NULL;
+		if (highest)
+			mask = _mm_movemask_ps(_mm_cmpgt_ps(a, limit)) |
+				(_mm_movemask_ps(_mm_cmpgt_ps(b, limit)) << 4);
+		else
+			mask = _mm_movemask_ps(_mm_cmplt_ps(a, limit)) |
+				(_mm_movemask_ps(_mm_cmplt_ps(b, limit)) << 4);
+		if (mask == 0)
+			continue;
+
+		for (lane = 0; lane < 8; lane++) {
+			positions[found] = i + lane;
+			found += (mask >> lane) & 1;
+		}
 	}
+#endif
 
-	return target;
+	for (; i < n; i++) {
+		positions[found] = i;
+		found += highest ? (scores[i] > threshold) : (scores[i] < threshold);
+	}
+	return found;
 }
 
 /* ----------------------------------------------------------------
- *		freeNbrList
+ *		nbrHeapFree
  *
- *		Free a list of nbr_nodes.
+ *		Free a neighborhood.
  * ----------------------------------------------------------------
  */
 void
-freeNbrList(nbr_node head) {
-	nbr_node temp;
-	while (head) {
-		temp = head->next;
-		pfree(head);
-		head = temp;
-	}
+nbrHeapFree(nbr_heap heap) {
+	pfree(heap->index);
+	pfree(heap->similarity);
+	pfree(heap);
 }
 
 /* ----------------------------------------------------------------
@@ -224,6 +1048,8 @@ recathon_queryStart(char *query_string, MemoryContext *recathoncontext) {
 						ALLOCSET_DEFAULT_INITSIZE,
 						ALLOCSET_DEFAULT_MAXSIZE);
 	oldcontext = MemoryContextSwitchTo(newcontext);
+	recathon_query_count++;
+	TRACE_POSTGRESQL_RECOMMEND_INTERNAL_QUERY_START(query_string);
 
 	// Now we parse the query and get a parse tree.
 	parsetree_list = pg_parse_query(query_string);
@@ -255,6 +1081,52 @@ recathon_queryStart(char *query_string, MemoryContext *recathoncontext) {
 	return queryDesc;
 }
 
+/* ----------------------------------------------------------------
+ *		recathon_queryStartParsed
+ *
+ *		Like recathon_queryStart, but for a query that has
+ *		already been parsed and analyzed, such as a subquery
+ *		of a RECOMMEND query. We plan a copy, so the query
+ *		can be run again. Clean up with recathon_queryEnd.
+ * ----------------------------------------------------------------
+ */
+QueryDesc*
+recathon_queryStartParsed(Query *query, MemoryContext *recathoncontext) {
+	List *querytree_list, *plantree_list;
+	QueryDesc *queryDesc;
+	MemoryContext newcontext, oldcontext;
+
+	newcontext = AllocSetContextCreate(CurrentMemoryContext,
+						"RecathonQuery",
+						ALLOCSET_DEFAULT_MINSIZE,
+						ALLOCSET_DEFAULT_INITSIZE,
+						ALLOCSET_DEFAULT_MAXSIZE);
+	oldcontext = MemoryContextSwitchTo(newcontext);
+	recathon_query_count++;
+	TRACE_POSTGRESQL_RECOMMEND_INTERNAL_QUERY_START("RECOMMEND subquery");
+
+	// The rewriter and planner both scribble on their input.
+	querytree_list = QueryRewrite((Query*) copyObject(query));
+	if (list_length(querytree_list) != 1)
+		elog(ERROR, "unexpected rewrite result for RECOMMEND subquery");
+	plantree_list = pg_plan_queries(querytree_list, 0, NULL);
+
+	PushCopiedSnapshot(GetActiveSnapshot());
+	UpdateActiveSnapshotCommandId();
+
+	queryDesc = CreateQueryDesc((PlannedStmt*) linitial(plantree_list),
+					"RECOMMEND subquery",
+					GetActiveSnapshot(),
+					InvalidSnapshot,
+					None_Receiver, NULL, 0);
+	ExecutorStart(queryDesc, 0);
+
+	MemoryContextSwitchTo(oldcontext);
+	(*recathoncontext) = newcontext;
+
+	return queryDesc;
+}
+
 /* ----------------------------------------------------------------
  *		recathon_queryEnd
  *
@@ -270,6 +1142,7 @@ recathon_queryEnd(QueryDesc *queryDesc, MemoryContext recathoncontext) {
 	// End the query.
 	ExecutorFinish(queryDesc);
 	ExecutorEnd(queryDesc);
+	TRACE_POSTGRESQL_RECOMMEND_INTERNAL_QUERY_DONE(queryDesc->sourceText);
 	FreeQueryDesc(queryDesc);
 
 	// Pop our snapshot.
@@ -280,6 +1153,168 @@ recathon_queryEnd(QueryDesc *queryDesc, MemoryContext recathoncontext) {
 	MemoryContextDelete(recathoncontext);
 }
 
+/* ----------------------------------------------------------------
+ *		recathon_getPlanSource
+ *
+ *		Looks up the saved plan source for a query template
+ *		in our per-backend plan cache, parsing and saving a
+ *		new one if this is the first time we've seen it. Once
+ *		the cache is full, the template that has gone longest
+ *		without a lookup makes room for it. A query still
+ *		running on an evicted plan holds its own reference to
+ *		the plan, and its own copy of the text.
+ * ----------------------------------------------------------------
+ */
+static CachedPlanSource *
+recathon_getPlanSource(char *query_string, int nparams, Oid *paramtypes) {
+	RecathonPlanEntry *entry;
+	bool found;
+	List *parsetree_list, *querytree_list;
+	Node *parsetree;
+	CachedPlanSource *plansource;
+
+	// Create the cache the first time through.
+	if (!recathon_plan_cache) {
+		HASHCTL ctl;
+
+		MemSet(&ctl, 0, sizeof(ctl));
+		ctl.keysize = RECATHON_PLAN_KEYLEN;
+		ctl.entrysize = sizeof(RecathonPlanEntry);
+		recathon_plan_cache = hash_create("Recathon plan cache", RECATHON_PLAN_CACHE_SIZE,
+						&ctl, HASH_ELEM);
+	}
+
+	entry = (RecathonPlanEntry*) hash_search(recathon_plan_cache,
+						query_string, HASH_FIND, NULL);
+	if (entry) {
+		entry->lastUsed = ++recathon_plan_clock;
+		return entry->plansource;
+	}
+
+	if (hash_get_num_entries(recathon_plan_cache) >= RECATHON_PLAN_CACHE_SIZE) {
+		HASH_SEQ_STATUS status;
+		RecathonPlanEntry *victim = NULL;
+
+		hash_seq_init(&status, recathon_plan_cache);
+		while ((entry = (RecathonPlanEntry*) hash_seq_search(&status)) != NULL) {
+			if (!victim || entry->lastUsed < victim->lastUsed)
+				victim = entry;
+		}
+		DropCachedPlan(victim->plansource);
+		hash_search(recathon_plan_cache, victim->query, HASH_REMOVE, NULL);
+	}
+
+	// Parse and analyze the template, with its parameter types.
+	parsetree_list = pg_parse_query(query_string);
+	parsetree = lfirst(parsetree_list->head);
+
+	plansource = CreateCachedPlan(parsetree, query_string,
+					CreateCommandTag(parsetree));
+	querytree_list = pg_analyze_and_rewrite(parsetree, query_string,
+					paramtypes, nparams);
+	CompleteCachedPlan(plansource, querytree_list, NULL,
+			paramtypes, nparams, NULL, NULL, 0, false);
+
+	// Move it somewhere it will survive past this query.
+	SaveCachedPlan(plansource);
+
+	entry = (RecathonPlanEntry*) hash_search(recathon_plan_cache,
+						query_string, HASH_ENTER, &found);
+	entry->plansource = plansource;
+	entry->lastUsed = ++recathon_plan_clock;
+
+	return plansource;
+}
+
+/* ----------------------------------------------------------------
+ *		recathon_queryStartCached
+ *
+ *		A version of recathon_queryStart for query templates
+ *		that take parameters ($1, $2, ...). The plan is
+ *		cached per backend by template, so repeated calls
+ *		with different IDs skip parsing and planning.
+ *
+ *		Returns a query descriptor that tuples can be obtained
+ *		from. The caller must pass the returned CachedPlan to
+ *		recathon_queryEndCached.
+ * ----------------------------------------------------------------
+ */
+QueryDesc *
+recathon_queryStartCached(char *query_string, int nparams, Oid *paramtypes,
+			Datum *paramvalues, CachedPlan **cplan,
+			MemoryContext *recathoncontext) {
+	int i;
+	CachedPlanSource *plansource;
+	ParamListInfo params = NULL;
+	QueryDesc *queryDesc;
+	MemoryContext newcontext, oldcontext;
+
+	// Templates have to fit in a cache key.
+	if (strlen(query_string) >= RECATHON_PLAN_KEYLEN)
+		elog(ERROR, "query too long for Recathon plan cache");
+
+	newcontext = AllocSetContextCreate(CurrentMemoryContext,
+						"RecathonQuery",
+						ALLOCSET_DEFAULT_MINSIZE,
+						ALLOCSET_DEFAULT_INITSIZE,
+						ALLOCSET_DEFAULT_MAXSIZE);
+	oldcontext = MemoryContextSwitchTo(newcontext);
+	recathon_query_count++;
+	TRACE_POSTGRESQL_RECOMMEND_INTERNAL_QUERY_START(query_string);
+
+	plansource = recathon_getPlanSource(query_string, nparams, paramtypes);
+
+	// Bind the parameter values.
+	if (nparams > 0) {
+		params = (ParamListInfo) palloc(offsetof(ParamListInfoData, params) +
+						nparams * sizeof(ParamExternData));
+		params->paramFetch = NULL;
+		params->paramFetchArg = NULL;
+		params->parserSetup = NULL;
+		params->parserSetupArg = NULL;
+		params->numParams = nparams;
+		for (i = 0; i < nparams; i++) {
+			params->params[i].value = paramvalues[i];
+			params->params[i].isnull = false;
+			params->params[i].pflags = PARAM_FLAG_CONST;
+			params->params[i].ptype = paramtypes[i];
+		}
+	}
+
+	// Now we need to update the current snapshot.
+	PushCopiedSnapshot(GetActiveSnapshot());
+	UpdateActiveSnapshotCommandId();
+
+	// Revalidate and fetch the plan. We hold a reference on it until
+	// recathon_queryEndCached; the resource owner cleans up on error.
+	(*cplan) = GetCachedPlan(plansource, params, true);
+
+	queryDesc = CreateQueryDesc((PlannedStmt*) linitial((*cplan)->stmt_list),
+					pstrdup(query_string),
+					GetActiveSnapshot(),
+					InvalidSnapshot,
+					None_Receiver, params, 0);
+	ExecutorStart(queryDesc, 0);
+
+	MemoryContextSwitchTo(oldcontext);
+	(*recathoncontext) = newcontext;
+
+	return queryDesc;
+}
+
+/* ----------------------------------------------------------------
+ *		recathon_queryEndCached
+ *
+ *		Cleans up after recathon_queryStartCached.
+ * ----------------------------------------------------------------
+ */
+void
+recathon_queryEndCached(QueryDesc *queryDesc, CachedPlan *cplan,
+			MemoryContext recathoncontext) {
+	recathon_queryEnd(queryDesc, recathoncontext);
+	ReleaseCachedPlan(cplan, true);
+}
+
 /* ----------------------------------------------------------------
  *		recathon_queryExecute
  *
@@ -323,6 +1358,7 @@ recathon_utilityExecute(char *query_string) {
 						ALLOCSET_DEFAULT_INITSIZE,
 						ALLOCSET_DEFAULT_MAXSIZE);
 	oldcontext = MemoryContextSwitchTo(recathoncontext);
+	recathon_query_count++;
 
 	// Now we parse the query and get a parse tree.
 	parsetree_list = pg_parse_query(query_string);
@@ -363,6 +1399,9 @@ make_rec_from_scan(Scan *subscan, Node *recommender) {
 	recscan->scan.plan.type = T_RecScan;
 	recscan->subscan = subscan;
 	recscan->recommender = recommender;
+	recscan->topK = 0;
+	recscan->topKDescending = false;
+	recscan->ordered = false;
 
 	return recscan;
 }
@@ -389,6 +1428,33 @@ make_rec_from_join(Join *subjoin) {
 	return recjoin;
 }
 
+/* ----------------------------------------------------------------
+ *		relationIsEmpty
+ *
+ *		Does the given table have no rows at all? Cheaper than
+ *		counting them, when that's all we need to know.
+ * ----------------------------------------------------------------
+ */
+static bool
+relationIsEmpty(char *relname) {
+	bool empty;
+	// Objects for querying.
+	char *querystring;
+	QueryDesc *queryDesc;
+	TupleTableSlot *slot;
+	MemoryContext recathoncontext;
+
+	querystring = (char*) palloc(1024*sizeof(char));
+	sprintf(querystring,"SELECT 1 FROM %s LIMIT 1;",relname);
+	queryDesc = recathon_queryStart(querystring,&recathoncontext);
+	slot = ExecProcNode(queryDesc->planstate);
+	empty = TupIsNull(slot);
+	recathon_queryEnd(queryDesc,recathoncontext);
+	pfree(querystring);
+
+	return empty;
+}
+
 /* ----------------------------------------------------------------
  *		count_rows
  *
@@ -404,17 +1470,18 @@ count_rows(char *tablename) {
 	QueryDesc *queryDesc;
 	PlanState *planstate;
 	TupleTableSlot *slot;
+	CachedPlan *cplan;
 	MemoryContext recathoncontext;
 
 	// We start with a simple query to get the number of items.
 	querystring = (char*) palloc(256*sizeof(char));
 	sprintf(querystring,"SELECT COUNT(*) FROM %s;",tablename);
-	queryDesc = recathon_queryStart(querystring,&recathoncontext);
+	queryDesc = recathon_queryStartCached(querystring,0,NULL,NULL,&cplan,&recathoncontext);
 	planstate = queryDesc->planstate;
 
 	slot = ExecProcNode(planstate);
 	if (TupIsNull(slot)) {
-		recathon_queryEnd(queryDesc,recathoncontext);
+		recathon_queryEndCached(queryDesc,cplan,recathoncontext);
 		pfree(querystring);
 		return -1;
 	}
@@ -450,61 +1517,542 @@ count_rows(char *tablename) {
 		}
 	}
 
-	recathon_queryEnd(queryDesc,recathoncontext);
+	recathon_queryEndCached(queryDesc,cplan,recathoncontext);
 	pfree(querystring);
 
 	return numItems;
 }
 
 /* ----------------------------------------------------------------
- *		getTupleInt
+ *		countEvents
  *
- *		Obtain a certain int from a TupleTableSlot. This
- *		will also convert floats into ints.
+ *		Counts the rows of an events table for a maintenance
+ *		pass, unless nothing has been committed to it, deleted
+ *		from it or rewritten since the last time, in which case
+ *		we know already (see recathonevents.c). Deletes are
+ *		seen through the statistics collector, so a count can
+ *		lag one behind for a pass. A table with partitions is
+ *		always counted, since we don't follow their deletes,
+ *		as is a foreign table, whose rows change without any
+ *		transaction of ours committing.
  * ----------------------------------------------------------------
  */
-int
-getTupleInt(TupleTableSlot *slot, char *attname) {
-	int i, natts;
-
-	slot_getallattrs(slot);
-	natts = slot->tts_tupleDescriptor->natts;
+static int
+countEvents(char *eventtable) {
+	Oid relid, relfilenode;
+	Relation rel;
+	PgStat_StatTabEntry *tabstats;
+	int64 deleted;
+	int count;
+
+	relid = RelnameGetRelid(eventtable);
+	if (!OidIsValid(relid) || has_subclass(relid) ||
+	    get_rel_relkind(relid) == RELKIND_FOREIGN_TABLE)
+		return count_rows(eventtable);
+
+	rel = heap_open(relid, AccessShareLock);
+	relfilenode = rel->rd_node.relNode;
+	heap_close(rel, AccessShareLock);
+	tabstats = pgstat_fetch_stat_tabentry(relid);
+	deleted = tabstats ? (int64) tabstats->tuples_deleted : 0;
+
+	if (recathonEventsLookupCount(relid, relfilenode, deleted, &count))
+		return count;
+
+	count = count_rows(eventtable);
+	if (count >= 0)
+		recathonEventsStoreCount(relid, relfilenode, deleted, count);
+	return count;
+}
 
-	for (i = 0; i < natts; i++) {
-		if (!slot->tts_isnull[i]) {
-			char *col_name;
-			Datum slot_result;
+/* ----------------------------------------------------------------
+ *		eventsInserted
+ *
+ *		Counts the rows ever inserted into an events table and
+ *		its partitions, as the statistics collector and our own
+ *		transaction have counted them. Unlike the size of the
+ *		table, this only goes up, so deleted events can't hide
+ *		new ones. Returns -1 if we can't tell, as for a view or
+ *		a foreign table, or one the collector hasn't seen yet.
+ * ----------------------------------------------------------------
+ */
+static int64
+eventsInserted(char *eventtable) {
+	Oid relid;
+	List *tables;
+	ListCell *lc;
+	int64 inserted = 0;
+	bool seen = false;
+
+	relid = RelnameGetRelid(eventtable);
+	if (!OidIsValid(relid) || get_rel_relkind(relid) != RELKIND_RELATION)
+		return -1;
 
-			col_name = slot->tts_tupleDescriptor->attrs[i]->attname.data;
-			slot_result = slot->tts_values[i];
+	tables = find_all_inheritors(relid, NoLock, NULL);
+	foreach(lc, tables) {
+		PgStat_StatTabEntry *tabstats;
+		PgStat_TableStatus *pending;
+		PgStat_TableXactStatus *trans;
 
-			if (strcmp(col_name, attname) == 0) {
-				unsigned int data_type = slot->tts_tupleDescriptor->attrs[i]->atttypid;
-				// The data type will tell us what to do with it.
-				switch (data_type) {
-					case INT8OID:
-						return (int) DatumGetInt64(slot_result);
-					case INT2OID:
-						return (int) DatumGetInt16(slot_result);
-					case INT4OID:
-						return (int) DatumGetInt32(slot_result);
-					case FLOAT4OID:
-						return (int) DatumGetFloat4(slot_result);
-					case FLOAT8OID:
-						return (int) DatumGetFloat8(slot_result);
-					default:
-						ereport(ERROR,
-							(errcode(ERRCODE_SYNTAX_ERROR),
-							 errmsg("type mismatch in getTupleInt()")));
-						break;
-				}
-			}
+		tabstats = pgstat_fetch_stat_tabentry(lfirst_oid(lc));
+		if (tabstats) {
+			inserted += tabstats->tuples_inserted;
+			seen = true;
+		}
+		pending = find_tabstat_entry(lfirst_oid(lc));
+		if (pending) {
+			inserted += pending->t_counts.t_tuples_inserted;
+			for (trans = pending->trans; trans; trans = trans->upper)
+				inserted += trans->tuples_inserted;
 		}
 	}
+	list_free(tables);
+
+	return seen ? inserted : -1;
+}
 
+
+/* ----------------------------------------------------------------
+ *		bindColumn
+ *
+ *		Sets up a column to be read from the tuples of a
+ *		query by name, without looking the name up in every
+ *		tuple. The name isn't copied.
+ * ----------------------------------------------------------------
+ */
+void
+bindColumn(tuple_column *col, char *attname) {
+	col->attname = attname;
+	col->tupdesc = NULL;
+	col->attnum = 0;
+	col->typid = InvalidOid;
+	col->readInt = NULL;
+	col->readFloat = NULL;
+}
+
+/* The readers of a column's value as an int or a float, one for each
+ * type it may have, so that columnInt and columnFloat needn't look at
+ * the type for every tuple. They're picked when the column is found. */
+#define COLUMN_READER(name, result, getter) \
+static result \
+name(Datum value) { \
+	return (result) getter(value); \
+}
+
+COLUMN_READER(columnIntFromInt2, int, DatumGetInt16)
+COLUMN_READER(columnIntFromInt4, int, DatumGetInt32)
+COLUMN_READER(columnIntFromInt8, int, DatumGetInt64)
+COLUMN_READER(columnIntFromFloat4, int, DatumGetFloat4)
+COLUMN_READER(columnIntFromFloat8, int, DatumGetFloat8)
+COLUMN_READER(columnFloatFromInt2, float, DatumGetInt16)
+COLUMN_READER(columnFloatFromInt4, float, DatumGetInt32)
+COLUMN_READER(columnFloatFromInt8, float, DatumGetInt64)
+COLUMN_READER(columnFloatFromFloat4, float, DatumGetFloat4)
+COLUMN_READER(columnFloatFromFloat8, float, DatumGetFloat8)
+#undef COLUMN_READER
+
+static int
+columnIntMismatch(Datum value) {
+	ereport(ERROR,
+		(errcode(ERRCODE_SYNTAX_ERROR),
+		 errmsg("type mismatch in getTupleInt()")));
 	return -1;
 }
 
+static float
+columnFloatMismatch(Datum value) {
+	ereport(ERROR,
+		(errcode(ERRCODE_SYNTAX_ERROR),
+		 errmsg("type mismatch in getTupleFloat()")));
+	return -1.0;
+}
+
+/* Picks a found column's readers, from its type. */
+static void
+columnReaders(tuple_column *col) {
+	switch (col->typid) {
+		case INT2OID:
+			col->readInt = columnIntFromInt2;
+			col->readFloat = columnFloatFromInt2;
+			break;
+		case INT4OID:
+			col->readInt = columnIntFromInt4;
+			col->readFloat = columnFloatFromInt4;
+			break;
+		case INT8OID:
+			col->readInt = columnIntFromInt8;
+			col->readFloat = columnFloatFromInt8;
+			break;
+		case FLOAT4OID:
+			col->readInt = columnIntFromFloat4;
+			col->readFloat = columnFloatFromFloat4;
+			break;
+		case FLOAT8OID:
+			col->readInt = columnIntFromFloat8;
+			col->readFloat = columnFloatFromFloat8;
+			break;
+		default:
+			col->readInt = columnIntMismatch;
+			col->readFloat = columnFloatMismatch;
+			break;
+	}
+}
+
+/* ----------------------------------------------------------------
+ *		columnDatum
+ *
+ *		Fetches a bound column from a tuple, finding it in the
+ *		tuple's descriptor first if it's one we haven't seen.
+ *		Only as much of the tuple as it takes is deformed.
+ *		Returns false if there's no such column, or it's null.
+ * ----------------------------------------------------------------
+ */
+static bool
+columnDatum(TupleTableSlot *slot, tuple_column *col, Datum *value) {
+	bool isnull;
+
+	if (slot->tts_tupleDescriptor != col->tupdesc) {
+		TupleDesc tupdesc = slot->tts_tupleDescriptor;
+		int i;
+
+		col->tupdesc = tupdesc;
+		col->attnum = 0;
+		for (i = 0; i < tupdesc->natts; i++) {
+			if (strcmp(NameStr(tupdesc->attrs[i]->attname), col->attname) == 0) {
+				col->attnum = i + 1;
+				col->typid = tupdesc->attrs[i]->atttypid;
+				columnReaders(col);
+				break;
+			}
+		}
+	}
+	if (col->attnum == 0)
+		return false;
+
+	(*value) = slot_getattr(slot, col->attnum, &isnull);
+	return !isnull;
+}
+
+/* ----------------------------------------------------------------
+ *		slotHasColumn
+ *
+ *		Does a slot's tuple have a column of this name, null
+ *		or not?
+ * ----------------------------------------------------------------
+ */
+static bool
+slotHasColumn(TupleTableSlot *slot, char *attname) {
+	tuple_column col;
+	Datum value;
+
+	bindColumn(&col, attname);
+	(void) columnDatum(slot, &col, &value);
+	return col.attnum != 0;
+}
+
+/* ----------------------------------------------------------------
+ *		columnInt
+ *
+ *		Obtain a bound column's int from a TupleTableSlot.
+ *		This will also convert floats into ints. Returns -1
+ *		if the column is missing or null.
+ * ----------------------------------------------------------------
+ */
+int
+columnInt(TupleTableSlot *slot, tuple_column *col) {
+	Datum value;
+
+	if (!columnDatum(slot, col, &value))
+		return -1;
+
+	// The reader for the column's type was picked when it was found.
+	return col->readInt(value);
+}
+
+/* ----------------------------------------------------------------
+ *		columnFloat
+ *
+ *		Obtain a bound column's float from a TupleTableSlot.
+ *		This will also convert ints to floats. Returns -1.0
+ *		if the column is missing or null.
+ * ----------------------------------------------------------------
+ */
+float
+columnFloat(TupleTableSlot *slot, tuple_column *col) {
+	Datum value;
+
+	if (!columnDatum(slot, col, &value))
+		return -1.0;
+
+	// The reader for the column's type was picked when it was found.
+	return col->readFloat(value);
+}
+
+/* ----------------------------------------------------------------
+ *		columnFloatArray
+ *
+ *		Copy a bound one-dimensional real[] column from a
+ *		TupleTableSlot into dest, which has room for maxlen
+ *		values. Returns the array's length, or -1 if the
+ *		column is missing or null.
+ * ----------------------------------------------------------------
+ */
+int
+columnFloatArray(TupleTableSlot *slot, tuple_column *col, float *dest, int maxlen) {
+	Datum value;
+	ArrayType *array;
+	int length;
+
+	if (!columnDatum(slot, col, &value))
+		return -1;
+
+	if (col->typid != FLOAT4ARRAYOID)
+		ereport(ERROR,
+			(errcode(ERRCODE_SYNTAX_ERROR),
+			 errmsg("type mismatch in getTupleFloatArray()")));
+
+	array = DatumGetArrayTypeP(value);
+	if (ARR_NDIM(array) != 1 || ARR_HASNULL(array))
+		ereport(ERROR,
+			(errcode(ERRCODE_DATA_EXCEPTION),
+			 errmsg("factor vectors must be one-dimensional arrays without nulls")));
+	length = ARR_DIMS(array)[0];
+	memcpy(dest, ARR_DATA_PTR(array), Min(length, maxlen)*sizeof(float));
+
+	if ((Pointer) array != DatumGetPointer(value))
+		pfree(array);
+	return length;
+}
+
+/* ----------------------------------------------------------------
+ *		columnIntArray
+ *
+ *		Copy a bound one-dimensional integer[] column from a
+ *		TupleTableSlot into dest, which has room for maxlen
+ *		values. Returns the array's length, or -1 if the
+ *		column is missing or null.
+ * ----------------------------------------------------------------
+ */
+int
+columnIntArray(TupleTableSlot *slot, tuple_column *col, int *dest, int maxlen) {
+	Datum value;
+	ArrayType *array;
+	int length;
+
+	if (!columnDatum(slot, col, &value))
+		return -1;
+
+	if (col->typid != INT4ARRAYOID)
+		ereport(ERROR,
+			(errcode(ERRCODE_SYNTAX_ERROR),
+			 errmsg("type mismatch in getTupleIntArray()")));
+
+	array = DatumGetArrayTypeP(value);
+	if (ARR_NDIM(array) == 0) {
+		length = 0;
+	} else {
+		if (ARR_NDIM(array) != 1 || ARR_HASNULL(array))
+			ereport(ERROR,
+				(errcode(ERRCODE_DATA_EXCEPTION),
+				 errmsg("ID lists must be one-dimensional arrays without nulls")));
+		length = ARR_DIMS(array)[0];
+		memcpy(dest, ARR_DATA_PTR(array), Min(length, maxlen)*sizeof(int));
+	}
+
+	if ((Pointer) array != DatumGetPointer(value))
+		pfree(array);
+	return length;
+}
+
+/* ----------------------------------------------------------------
+ *		probeOpen
+ *
+ *		Opens a table for looking its rows up by one integer
+ *		column, through a valid btree index that starts with
+ *		it, for as long as the caller has lookups to make.
+ *		Each lookup then begins the index scan again with a
+ *		new key, instead of starting and ending a query, with
+ *		its own snapshot and memory context. A table that
+ *		can't be read that way, such as a view, one with
+ *		inheritance children, one we may not read, or one
+ *		without such an index, gives a probe with no table,
+ *		and the caller should query it as usual.
+ * ----------------------------------------------------------------
+ */
+recathon_probe *
+probeOpen(char *relname, char *keycol) {
+	int i;
+	char *attname;
+	recathon_probe *probe;
+	Relation heap;
+	List *indexes;
+	ListCell *lc;
+	AttrNumber attnum;
+
+	probe = (recathon_probe*) palloc0(sizeof(recathon_probe));
+	probe->relname = pstrdup(relname);
+	probe->keycol = pstrdup(keycol);
+
+	heap = heap_openrv_extended(makeRangeVarFromNameList(stringToQualifiedNameList(relname)),
+		AccessShareLock, true);
+	if (!heap)
+		return probe;
+	attname = pstrdup(keycol);
+	for (i = 0; i < strlen(attname); i++)
+		attname[i] = tolower(attname[i]);
+	attnum = get_attnum(RelationGetRelid(heap), attname);
+	pfree(attname);
+	if (heap->rd_rel->relkind != RELKIND_RELATION || heap->rd_rel->relhassubclass ||
+	    attnum == InvalidAttrNumber ||
+	    pg_class_aclcheck(RelationGetRelid(heap), GetUserId(), ACL_SELECT) != ACLCHECK_OK) {
+		heap_close(heap, AccessShareLock);
+		return probe;
+	}
+
+	indexes = RelationGetIndexList(heap);
+	foreach(lc, indexes) {
+		Relation candidate = index_open(lfirst_oid(lc), AccessShareLock);
+
+		if (candidate->rd_rel->relam == BTREE_AM_OID &&
+		    candidate->rd_index->indisvalid &&
+		    candidate->rd_index->indkey.values[0] == attnum &&
+		    candidate->rd_opcintype[0] == INT4OID &&
+		    RelationGetIndexPredicate(candidate) == NIL) {
+			probe->index = candidate;
+			break;
+		}
+		index_close(candidate, AccessShareLock);
+	}
+	list_free(indexes);
+	if (!probe->index) {
+		heap_close(heap, AccessShareLock);
+		return probe;
+	}
+
+	probe->heap = heap;
+	probe->snapshot = RegisterSnapshot(GetActiveSnapshot());
+	probe->scan = index_beginscan(heap, probe->index, probe->snapshot, 1, 0);
+	ScanKeyInit(&probe->key, 1, BTEqualStrategyNumber, F_INT4EQ, Int32GetDatum(0));
+	probe->slot = MakeSingleTupleTableSlot(RelationGetDescr(heap));
+	return probe;
+}
+
+/* ----------------------------------------------------------------
+ *		probeStart
+ *
+ *		Starts looking up the rows with the given key.
+ * ----------------------------------------------------------------
+ */
+void
+probeStart(recathon_probe *probe, int key) {
+	probe->key.sk_argument = Int32GetDatum(key);
+	index_rescan(probe->scan, &probe->key, 1, NULL, 0);
+}
+
+/* ----------------------------------------------------------------
+ *		probeNext
+ *
+ *		Returns the next row with the key in a slot, which
+ *		bound columns can be read from, or NULL when there
+ *		are no more. The row is only good until the next.
+ * ----------------------------------------------------------------
+ */
+TupleTableSlot *
+probeNext(recathon_probe *probe) {
+	HeapTuple tuple;
+
+	tuple = index_getnext(probe->scan, ForwardScanDirection);
+	if (!tuple) {
+		ExecClearTuple(probe->slot);
+		return NULL;
+	}
+	return ExecStoreTuple(tuple, probe->slot, probe->scan->xs_cbuf, false);
+}
+
+/* ----------------------------------------------------------------
+ *		probeClose
+ * ----------------------------------------------------------------
+ */
+void
+probeClose(recathon_probe *probe) {
+	if (probe->heap) {
+		ExecDropSingleTupleTableSlot(probe->slot);
+		index_endscan(probe->scan);
+		index_close(probe->index, AccessShareLock);
+		heap_close(probe->heap, AccessShareLock);
+		UnregisterSnapshot(probe->snapshot);
+	}
+	pfree(probe->relname);
+	pfree(probe->keycol);
+	pfree(probe);
+}
+
+/* ----------------------------------------------------------------
+ *		scanProbe
+ *
+ *		Returns a probe on a table that lasts as long as the
+ *		scan does, opening it the first time it's asked for,
+ *		or NULL if the table has to be queried instead. A
+ *		table that couldn't be probed isn't tried again. The
+ *		parallel workers don't probe.
+ * ----------------------------------------------------------------
+ */
+static recathon_probe *
+scanProbe(RecScanState *recstate, char *relname, char *keycol) {
+	recathon_probe *probe;
+	ListCell *lc;
+	MemoryContext oldcontext;
+
+	if (recstate->parallelWorker || !recstate->recContext)
+		return NULL;
+
+	foreach(lc, recstate->probes) {
+		probe = (recathon_probe*) lfirst(lc);
+		if (strcmp(probe->relname, relname) == 0 &&
+		    strcmp(probe->keycol, keycol) == 0)
+			return probe->heap ? probe : NULL;
+	}
+
+	oldcontext = MemoryContextSwitchTo(recstate->recContext);
+	probe = probeOpen(relname, keycol);
+	recstate->probes = lappend(recstate->probes, probe);
+	MemoryContextSwitchTo(oldcontext);
+	return probe->heap ? probe : NULL;
+}
+
+/* ----------------------------------------------------------------
+ *		closeScanProbes
+ *
+ *		Closes the tables a scan has been probing, once it's
+ *		done.
+ * ----------------------------------------------------------------
+ */
+void
+closeScanProbes(RecScanState *recstate) {
+	ListCell *lc;
+
+	foreach(lc, recstate->probes)
+		probeClose((recathon_probe*) lfirst(lc));
+	list_free(recstate->probes);
+	recstate->probes = NIL;
+}
+
+/* ----------------------------------------------------------------
+ *		getTupleInt
+ *
+ *		Obtain a certain int from a TupleTableSlot. This
+ *		will also convert floats into ints. For more than
+ *		a tuple or two, bind the column and use columnInt.
+ * ----------------------------------------------------------------
+ */
+int
+getTupleInt(TupleTableSlot *slot, char *attname) {
+	tuple_column col;
+
+	bindColumn(&col, attname);
+	return columnInt(slot, &col);
+}
+
 /* ----------------------------------------------------------------
  *		getTupleFloat
  *
@@ -514,44 +2062,42 @@ getTupleInt(TupleTableSlot *slot, char *attname) {
  */
 float
 getTupleFloat(TupleTableSlot *slot, char *attname) {
-	int i, natts;
+	tuple_column col;
 
-	slot_getallattrs(slot);
-	natts = slot->tts_tupleDescriptor->natts;
+	bindColumn(&col, attname);
+	return columnFloat(slot, &col);
+}
 
-	for (i = 0; i < natts; i++) {
-		if (!slot->tts_isnull[i]) {
-			char *col_name;
-			Datum slot_result;
+/* ----------------------------------------------------------------
+ *		getTupleFloatArray
+ *
+ *		Copy a one-dimensional real[] from a TupleTableSlot
+ *		into dest, which has room for maxlen values. Returns
+ *		the array's length, or -1 if there's no such column.
+ * ----------------------------------------------------------------
+ */
+int
+getTupleFloatArray(TupleTableSlot *slot, char *attname, float *dest, int maxlen) {
+	tuple_column col;
 
-			col_name = slot->tts_tupleDescriptor->attrs[i]->attname.data;
-			slot_result = slot->tts_values[i];
+	bindColumn(&col, attname);
+	return columnFloatArray(slot, &col, dest, maxlen);
+}
 
-			if (strcmp(col_name, attname) == 0) {
-				unsigned int data_type = slot->tts_tupleDescriptor->attrs[i]->atttypid;
-				// The data type will tell us what to do with it.
-				switch (data_type) {
-					case FLOAT8OID:
-						return (float) DatumGetFloat8(slot_result);
-					case FLOAT4OID:
-						return (float) DatumGetFloat4(slot_result);
-					case INT8OID:
-						return (float) DatumGetInt64(slot_result);
-					case INT2OID:
-						return (float) DatumGetInt16(slot_result);
-					case INT4OID:
-						return (float) DatumGetInt32(slot_result);
-					default:
-						ereport(ERROR,
-							(errcode(ERRCODE_SYNTAX_ERROR),
-							 errmsg("type mismatch in getTupleFloat()")));
-						break;
-				}
-			}
-		}
-	}
+/* ----------------------------------------------------------------
+ *		getTupleIntArray
+ *
+ *		Copy a one-dimensional integer[] from a TupleTableSlot
+ *		into dest, which has room for maxlen values. Returns
+ *		the array's length, or -1 if there's no such column.
+ * ----------------------------------------------------------------
+ */
+int
+getTupleIntArray(TupleTableSlot *slot, char *attname, int *dest, int maxlen) {
+	tuple_column col;
 
-	return -1.0;
+	bindColumn(&col, attname);
+	return columnIntArray(slot, &col, dest, maxlen);
 }
 
 /* ----------------------------------------------------------------
@@ -696,3740 +2242,22221 @@ columnExistsInRelation(char *colname, RangeVar *relation) {
 }
 
 /* ----------------------------------------------------------------
- *		retrieveRecommender
+ *		recathonCatalogueFlush
  *
- *		Given an event table and a recommendation method,
- *		we look to see if any recommenders are already
- *		built. If so, we return the RecIndex name.
+ *		Forgets everything the catalogue cache holds.
  * ----------------------------------------------------------------
  */
-char*
-retrieveRecommender(char *eventtable, char *method) {
-	RangeVar *cataloguerv;
-	char *querystring, *recindexname;
-	QueryDesc *queryDesc;
-	PlanState *planstate;
-	TupleTableSlot *slot;
-	MemoryContext recathoncontext;
-
-	// If this fails, there's no RecModelsCatalogue, so
-	// there are no recommenders.
-	cataloguerv = makeRangeVar(NULL,"recmodelscatalogue",0);
-	if (!relationExists(cataloguerv)) {
-		pfree(cataloguerv);
-		return NULL;
-	}
-	pfree(cataloguerv);
+static void
+recathonCatalogueFlush(void) {
+	if (recathon_catalogue_context)
+		MemoryContextReset(recathon_catalogue_context);
+	recathon_catalogue_entries = NULL;
+	recathon_catalogue_built = NULL;
+	recathon_catalogue_relid = InvalidOid;
+	recathon_catalogue_stale = false;
+}
 
-	// If the catalogue does exist, we'll query it looking
-	// for recommenders based on the given information.
-	querystring = (char*) palloc(1024*sizeof(char));
-	sprintf(querystring,"SELECT recommenderindexname FROM RecModelsCatalogue WHERE eventtable = '%s' AND method = '%s';",
-		eventtable, method);
-	queryDesc = recathon_queryStart(querystring,&recathoncontext);
-	planstate = queryDesc->planstate;
+/* ----------------------------------------------------------------
+ *		recathonCatalogueInval
+ *
+ *		Relcache callback for the catalogue cache. Changes to
+ *		RecModelsCatalogue or to a cached index table, from
+ *		any backend, arrive as relcache invalidations of that
+ *		table; we only note them here, and empty the cache at
+ *		the next lookup, as a lookup may be under way.
+ * ----------------------------------------------------------------
+ */
+static void
+recathonCatalogueInval(Datum arg, Oid relid) {
+	HASH_SEQ_STATUS status;
+	RecathonCatalogueEntry *entry;
 
-	slot = ExecProcNode(planstate);
-	// If there are no results, the recommender does not exist.
-	if (TupIsNull(slot)) {
-		recathon_queryEnd(queryDesc,recathoncontext);
-		pfree(querystring);
-		return NULL;
+	if (!recathon_catalogue_entries || recathon_catalogue_stale)
+		return;
+	if (!OidIsValid(relid) || relid == recathon_catalogue_relid) {
+		recathon_catalogue_stale = true;
+		return;
 	}
 
-	recindexname = getTupleString(slot,"recommenderindexname");
-
-	// Query cleanup.
-	recathon_queryEnd(queryDesc,recathoncontext);
-	pfree(querystring);
-
-	return recindexname;
+	hash_seq_init(&status, recathon_catalogue_entries);
+	while ((entry = (RecathonCatalogueEntry*) hash_seq_search(&status)) != NULL) {
+		if (entry->indexRelid == relid) {
+			recathon_catalogue_stale = true;
+			hash_seq_term(&status);
+			break;
+		}
+	}
 }
 
 /* ----------------------------------------------------------------
- *		getRecInfo
+ *		catalogueRelid
  *
- *		This function looks in the RecModelsCatalogue and
- *		gets some key information. It returns all its
- *		values by reference. If any of the provided return
- *		variables are NULL, we don't return that. This lets
- *		us customize what information we want.
+ *		Gets the catalogue cache ready for a lookup, and
+ *		returns the OID of RecModelsCatalogue, or InvalidOid
+ *		if there isn't one, in which case nothing is cached.
  * ----------------------------------------------------------------
  */
-void
-getRecInfo(char *recindexname, char **ret_eventtable,
-		char **ret_userkey, char **ret_itemkey,
-		char **ret_eventval, char **ret_method, int *ret_numatts) {
-	char *eventtable, *userkey, *itemkey, *eventval, *method;
+static Oid
+catalogueRelid(void) {
+	Oid relid;
+	HASHCTL ctl;
+
+	if (recathon_catalogue_stale)
+		recathonCatalogueFlush();
+
+	relid = RangeVarGetRelid(makeRangeVar(NULL,"recmodelscatalogue",0),
+		NoLock, true);
+	if (!OidIsValid(relid))
+		return InvalidOid;
+	if (relid != recathon_catalogue_relid)
+		recathonCatalogueFlush();
+
+	if (!recathon_catalogue_context) {
+		recathon_catalogue_context = AllocSetContextCreate(CacheMemoryContext,
+			"Recathon catalogue cache",
+			ALLOCSET_SMALL_MINSIZE,
+			ALLOCSET_SMALL_INITSIZE,
+			ALLOCSET_DEFAULT_MAXSIZE);
+		CacheRegisterRelcacheCallback(recathonCatalogueInval, (Datum) 0);
+	}
+
+	if (!recathon_catalogue_entries) {
+		MemSet(&ctl, 0, sizeof(ctl));
+		ctl.keysize = NAMEDATALEN;
+		ctl.entrysize = sizeof(RecathonCatalogueEntry);
+		ctl.hcxt = recathon_catalogue_context;
+		recathon_catalogue_entries = hash_create("Recathon catalogue entries", 16,
+			&ctl, HASH_ELEM | HASH_CONTEXT);
+
+		MemSet(&ctl, 0, sizeof(ctl));
+		ctl.keysize = RECATHON_BUILT_KEYLEN;
+		ctl.entrysize = sizeof(RecathonBuiltEntry);
+		ctl.hcxt = recathon_catalogue_context;
+		recathon_catalogue_built = hash_create("Recathon built recommenders", 16,
+			&ctl, HASH_ELEM | HASH_CONTEXT);
+	}
+	recathon_catalogue_relid = relid;
+
+	return relid;
+}
+
+/* ----------------------------------------------------------------
+ *		readCatalogueRow
+ *
+ *		Runs a query for one row of RecModelsCatalogue or an
+ *		index table, and returns a copy of it, or NULL if it
+ *		found nothing, along with its descriptor.
+ * ----------------------------------------------------------------
+ */
+static HeapTuple
+readCatalogueRow(char *querystring, TupleDesc *ret_desc) {
+	HeapTuple tuple;
 	// Information for query.
-	char *querystring;
 	QueryDesc *queryDesc;
-	PlanState *planstate;
 	TupleTableSlot *slot;
 	MemoryContext recathoncontext;
 
-	querystring = (char*) palloc(1024*sizeof(char));
-	sprintf(querystring,"SELECT * FROM RecModelsCatalogue WHERE recommenderindexname = '%s';",
-		recindexname);
 	queryDesc = recathon_queryStart(querystring,&recathoncontext);
-	planstate = queryDesc->planstate;
+	slot = ExecProcNode(queryDesc->planstate);
+	tuple = TupIsNull(slot) ? NULL : ExecCopySlotTuple(slot);
+	(*ret_desc) = CreateTupleDescCopy(slot->tts_tupleDescriptor);
+	recathon_queryEnd(queryDesc,recathoncontext);
 
-	slot = ExecProcNode(planstate);
-	// This should never happen.
-	if (TupIsNull(slot))
-		ereport(ERROR,
-			(errcode(ERRCODE_SYNTAX_ERROR),
-			 errmsg("fatal error in getRecInfo()")));
+	return tuple;
+}
 
-	// Obtain each of the values needed.
-	if (ret_eventtable) {
-		eventtable = getTupleString(slot,"eventtable");
-		(*ret_eventtable) = eventtable;
-	}
-	if (ret_userkey) {
-		userkey = getTupleString(slot,"userkey");
-		(*ret_userkey) = userkey;
-	}
-	if (ret_itemkey) {
-		itemkey = getTupleString(slot,"itemkey");
-		(*ret_itemkey) = itemkey;
-	}
-	if (ret_eventval) {
-		eventval = getTupleString(slot,"eventval");
-		(*ret_eventval) = eventval;
-	}
-	if (ret_method) {
-		method = getTupleString(slot,"method");
-		(*ret_method) = method;
-	}
-	if (ret_numatts)
-		(*ret_numatts) = getTupleInt(slot,"contextattributes");
+/* ----------------------------------------------------------------
+ *		cacheRow
+ *
+ *		Moves a row and its descriptor into the catalogue
+ *		cache.
+ * ----------------------------------------------------------------
+ */
+static void
+cacheRow(HeapTuple tuple, TupleDesc desc, HeapTuple *ret_tuple, TupleDesc *ret_desc) {
+	MemoryContext oldcontext;
 
-	// Cleanup.
-	recathon_queryEnd(queryDesc,recathoncontext);
-	pfree(querystring);
+	oldcontext = MemoryContextSwitchTo(recathon_catalogue_context);
+	(*ret_tuple) = tuple ? heap_copytuple(tuple) : NULL;
+	(*ret_desc) = CreateTupleDescCopy(desc);
+	MemoryContextSwitchTo(oldcontext);
+
+	if (tuple)
+		heap_freetuple(tuple);
+	FreeTupleDesc(desc);
 }
 
 /* ----------------------------------------------------------------
- *		validateCreateRStmt
+ *		cachedSlot
  *
- *		We need to implement a series of sanity checks, to
- *		make sure CREATE RECOMMENDER statement data is
- *		actually usable.
+ *		Hands out a copy of a cached row in a slot of its
+ *		own, so the cache can be emptied while it's in use.
+ *		The caller drops the slot with
+ *		ExecDropSingleTupleTableSlot.
  * ----------------------------------------------------------------
  */
-recMethod
-validateCreateRStmt(CreateRStmt *recStmt) {
-	recMethod method;
+static TupleTableSlot *
+cachedSlot(HeapTuple tuple, TupleDesc desc) {
+	TupleTableSlot *slot;
 
-	// Our first test is to make sure the ratings table exists.
-	if (!relationExists(recStmt->eventtable))
-		ereport(ERROR,
-			(errcode(ERRCODE_UNDEFINED_TABLE),
-			 errmsg("relation \"%s\" does not exist",
-				recStmt->eventtable->relname)));
+	slot = MakeSingleTupleTableSlot(CreateTupleDescCopy(desc));
+	ExecStoreTuple(heap_copytuple(tuple), slot, InvalidBuffer, true);
+	return slot;
+}
 
-	// Our second test is to see whether or not a recommender has already
-	// been created with the given events table and method, or name.
-	if (relationExists(recStmt->recname))
-		ereport(ERROR,
-			(errcode(ERRCODE_UNDEFINED_TABLE),
-			 errmsg("a recommender with name \"%s\" already exists",
-				recStmt->recname->relname)));
+/* ----------------------------------------------------------------
+ *		catalogueEntry
+ *
+ *		Finds a recommender in the catalogue cache, reading
+ *		its RecModelsCatalogue entry the first time. Table
+ *		names are folded to lower case, so we match the
+ *		name however it's written. Returns NULL if there's
+ *		no catalogue. What we read is only kept if no
+ *		change to the catalogue came in while we read it;
+ *		otherwise we read it again.
+ * ----------------------------------------------------------------
+ */
+static RecathonCatalogueEntry *
+catalogueEntry(char *recindexname) {
+	int i;
+	char key[NAMEDATALEN];
+	bool found;
+	RecathonCatalogueEntry *entry;
+	HeapTuple tuple;
+	TupleDesc desc;
+	char *querystring;
 
-	if (retrieveRecommender(recStmt->eventtable->relname,recStmt->method) != NULL)
-		ereport(ERROR,
-			(errcode(ERRCODE_UNDEFINED_TABLE),
-			 errmsg("recommender on table \"%s\" using method \"%s\" already exists",
-				recStmt->eventtable->relname,recStmt->method)));
+	MemSet(key, 0, NAMEDATALEN);
+	for (i = 0; i < NAMEDATALEN - 1 && recindexname[i]; i++)
+		key[i] = tolower(recindexname[i]);
 
-	// We next need to test that the provided columns
-	// exist in the events table.
-	// Test: user key is in event table.
-	if (!columnExistsInRelation(recStmt->userkey,recStmt->eventtable))
-		ereport(ERROR,
-			(errcode(ERRCODE_UNDEFINED_COLUMN),
-			 errmsg("column \"%s\" does not exist in relation \"%s\"",
-				recStmt->userkey,recStmt->eventtable->relname)));
-	// Test: item key is in event table.
-	if (!columnExistsInRelation(recStmt->itemkey,recStmt->eventtable))
-		ereport(ERROR,
-			(errcode(ERRCODE_UNDEFINED_COLUMN),
-			 errmsg("column \"%s\" does not exist in relation \"%s\"",
-				recStmt->itemkey,recStmt->eventtable->relname)));
-	// Test: event value is in event table.
-	if (!columnExistsInRelation(recStmt->eventval,recStmt->eventtable))
-		ereport(ERROR,
-			(errcode(ERRCODE_UNDEFINED_COLUMN),
-			 errmsg("column \"%s\" does not exist in relation \"%s\"",
-				recStmt->eventval,recStmt->eventtable->relname)));
+	querystring = (char*) palloc(1024*sizeof(char));
+	sprintf(querystring,"SELECT * FROM RecModelsCatalogue WHERE lower(recommenderindexname) = '%s';",
+		key);
 
-	// Now we convert our method name.
-	method = itemCosCF;
-	// To handle the case where no USING clause was provided.
-	if (recStmt->method) {
-		method = getRecMethod(recStmt->method);
-		if (method < 0)
-			ereport(ERROR,
-				(errcode(ERRCODE_CASE_NOT_FOUND),
-				 errmsg("recommendation method %s not recognized",
-					recStmt->method)));
+	for (;;) {
+		if (!OidIsValid(catalogueRelid())) {
+			entry = NULL;
+			break;
+		}
+
+		entry = (RecathonCatalogueEntry*) hash_search(recathon_catalogue_entries,
+			key, HASH_FIND, NULL);
+		if (entry)
+			break;
+
+		tuple = readCatalogueRow(querystring, &desc);
+		if (recathon_catalogue_stale) {
+			if (tuple)
+				heap_freetuple(tuple);
+			FreeTupleDesc(desc);
+			continue;
+		}
+
+		entry = (RecathonCatalogueEntry*) hash_search(recathon_catalogue_entries,
+			key, HASH_ENTER, &found);
+		cacheRow(tuple, desc, &entry->catalogue, &entry->catalogueDesc);
+		entry->indexRead = false;
+		entry->indexRelid = InvalidOid;
+		entry->index = NULL;
+		entry->indexDesc = NULL;
+		break;
 	}
 
-	// And return.
-	return method;
+	pfree(querystring);
+	return entry;
 }
 
 /* ----------------------------------------------------------------
- *		getRecMethod
+ *		getRecCatalogueSlot
  *
- *		Get the method in recMethod form.
+ *		Returns a recommender's RecModelsCatalogue entry in a
+ *		slot, from the catalogue cache, or NULL if it has
+ *		none. The caller drops the slot.
  * ----------------------------------------------------------------
  */
-recMethod
-getRecMethod(char *method) {
-	if (!method) return -1;
+TupleTableSlot *
+getRecCatalogueSlot(char *recindexname) {
+	RecathonCatalogueEntry *entry = catalogueEntry(recindexname);
 
-	if (strcmp("itemcoscf",method) == 0)
-		return itemCosCF;
-	else if (strcmp("itempearcf",method) == 0)
-		return itemPearCF;
-	else if (strcmp("usercoscf",method) == 0)
-		return userCosCF;
-	else if (strcmp("userpearcf",method) == 0)
-		return userPearCF;
-	else if (strcmp("svd",method) == 0)
-		return SVD;
-	else
-		return -1;
+	if (!entry || !entry->catalogue)
+		return NULL;
+	return cachedSlot(entry->catalogue, entry->catalogueDesc);
 }
 
 /* ----------------------------------------------------------------
- *		getUpdateThreshold
+ *		getRecIndexSlot
  *
- *		Get the update threshold.
+ *		Returns the row of a recommender's index table, with
+ *		the names of its models and RecView, in a slot, from
+ *		the catalogue cache, or NULL if it has none. The
+ *		caller drops the slot.
  * ----------------------------------------------------------------
  */
-static float
-getUpdateThreshold() {
-	float threshold = -1;
-	RangeVar *testrv;
-	// Query information.
+TupleTableSlot *
+getRecIndexSlot(char *recindexname) {
+	RecathonCatalogueEntry *entry;
+	HeapTuple tuple;
+	TupleDesc desc;
+	Oid relid;
 	char *querystring;
-	QueryDesc *queryDesc;
-	PlanState *planstate;
-	TupleTableSlot *slot;
-	MemoryContext recathoncontext;
 
-	testrv = makeRangeVar(NULL,"recdbproperties",0);
-	if (!relationExists(testrv)) {
-		pfree(testrv);
-		return -1;
-	}
-	pfree(testrv);
+	for (;;) {
+		entry = catalogueEntry(recindexname);
+		if (!entry || !entry->catalogue)
+			return NULL;
+		if (entry->indexRead)
+			break;
 
-	querystring = (char*) palloc(128*sizeof(char));
-	sprintf(querystring,"SELECT update_threshold FROM recdbproperties;");
-	queryDesc = recathon_queryStart(querystring,&recathoncontext);
-	planstate = queryDesc->planstate;
+		relid = RangeVarGetRelid(makeRangeVarFromNameList(
+			stringToQualifiedNameList(entry->key)), NoLock, true);
+		if (!OidIsValid(relid))
+			return NULL;
 
-	slot = ExecProcNode(planstate);
-	if (TupIsNull(slot)) {
-		recathon_queryEnd(queryDesc,recathoncontext);
+		querystring = (char*) palloc(1024*sizeof(char));
+		sprintf(querystring,"select * from %s r;",entry->key);
+		tuple = readCatalogueRow(querystring, &desc);
 		pfree(querystring);
-		return -1;
-	}
-
-	threshold = getTupleFloat(slot,"update_threshold");
+		if (recathon_catalogue_stale) {
+			if (tuple)
+				heap_freetuple(tuple);
+			FreeTupleDesc(desc);
+			continue;
+		}
 
-	recathon_queryEnd(queryDesc,recathoncontext);
-	pfree(querystring);
+		cacheRow(tuple, desc, &entry->index, &entry->indexDesc);
+		entry->indexRelid = relid;
+		entry->indexRead = true;
+		break;
+	}
 
-	return threshold;
+	if (!entry->index)
+		return NULL;
+	return cachedSlot(entry->index, entry->indexDesc);
 }
 
 /* ----------------------------------------------------------------
- *		updateCellCounter
+ *		builtRecommender
  *
- *		Happens whenever an INSERT occurs. If the insert
- *		is for an events table that we've built a
- *		recommender on, we need to update the counters of
- *		the appropriate cells.
+ *		Looks in the catalogue cache for a recommender on an
+ *		events table using a method, or using any method if
+ *		method is NULL, and returns its index table's name,
+ *		or NULL if there's none. A recommender built from some
+ *		of the events only answers queries that ask for them,
+ *		so with a method, we only look for one built from all
+ *		of them, unless filtered is true, when we only look
+ *		for one that isn't.
  * ----------------------------------------------------------------
  */
-void
-updateCellCounter(char *eventtable, TupleTableSlot *insertslot) {
-	float update_threshold;
-	RangeVar *cataloguerv;
-	// Query information.
+static char *
+builtRecommender(char *eventtable, char *method, bool filtered) {
+	char key[RECATHON_BUILT_KEYLEN];
+	bool found;
+	RecathonBuiltEntry *entry;
+	char *recindexname;
+	// Information for query.
 	char *querystring;
 	QueryDesc *queryDesc;
-	PlanState *planstate;
 	TupleTableSlot *slot;
 	MemoryContext recathoncontext;
 
-	// If this fails, there's no RecModelsCatalogue, so
-	// there are no recommenders.
-	cataloguerv = makeRangeVar(NULL,"recmodelscatalogue",0);
-	if (!relationExists(cataloguerv)) {
-		pfree(cataloguerv);
-		return;
-	}
-	pfree(cataloguerv);
-
-	// Obtain the update threshold.
-	update_threshold = getUpdateThreshold();
+	MemSet(key, 0, RECATHON_BUILT_KEYLEN);
+	snprintf(key, RECATHON_BUILT_KEYLEN, "%s %s%s", eventtable,
+		method ? method : "", filtered ? " filtered" : "");
 
-	// Now that we've confirmed the RecModelsCatalogue
-	// exists, let's query it to find the necessary
-	// information.
 	querystring = (char*) palloc(1024*sizeof(char));
-	sprintf(querystring,"SELECT * FROM RecModelsCatalogue WHERE eventtable = '%s';",
-		eventtable);
-	queryDesc = recathon_queryStart(querystring,&recathoncontext);
-	planstate = queryDesc->planstate;
 
 	for (;;) {
-		// In case of SVD, recmodelname is the user model, and the other is the
-		// item model. Otherwise, recmodelname2 is nothing.
-		char *recindexname, *recmodelname, *recmodelname2;
-		char *userkey, *itemkey, *eventval, *strmethod;
-		int updatecounter = -1;
-		int eventtotal = -1;
-		recMethod method;
-		// Query information for our internal query.
-		char *countquerystring;
-		QueryDesc *countqueryDesc;
-		PlanState *countplanstate;
-		TupleTableSlot *countslot;
-		MemoryContext countcontext;
-
-		slot = ExecProcNode(planstate);
-		if (TupIsNull(slot)) break;
-
-		// Acquire the data for this recommender.
-		recindexname = getTupleString(slot,"recommenderindexname");
-		userkey = getTupleString(slot,"userkey");
-		itemkey = getTupleString(slot,"itemkey");
-		eventval = getTupleString(slot,"eventval");
-		strmethod = getTupleString(slot,"method");
+		RangeVar *cataloguerv;
+		bool hasfilters;
 
-		// Get the recMethod.
-		method = getRecMethod(strmethod);
-		pfree(strmethod);
+		recindexname = NULL;
+		if (!OidIsValid(catalogueRelid()))
+			break;
 
-		// Failure case, continue to next tuple.
-		if (method < 0) {
-			pfree(recindexname);
-			pfree(userkey);
-			pfree(itemkey);
-			pfree(eventval);
-			continue;
+		entry = (RecathonBuiltEntry*) hash_search(recathon_catalogue_built,
+			key, HASH_FIND, NULL);
+		if (entry) {
+			if (entry->recindexname[0])
+				recindexname = pstrdup(entry->recindexname);
+			break;
 		}
 
-		// We now have all the information necessary to update this
-		// recommender's cell counter. First we need to acquire it,
-		// and we might as well get the model name while we're at it.
-		countquerystring = (char*) palloc(1024*sizeof(char));
-		if (method == SVD)
-			sprintf(countquerystring,"SELECT recusermodelname, recitemmodelname, updatecounter, eventtotal FROM %s;",
-				recindexname);
+		// Catalogues from before filtered recommenders have none.
+		cataloguerv = makeRangeVar(NULL,"recmodelscatalogue",0);
+		hasfilters = columnExistsInRelation("eventfilter",cataloguerv);
+		pfree(cataloguerv);
+		if (method)
+			sprintf(querystring,"SELECT recommenderindexname FROM RecModelsCatalogue WHERE eventtable = '%s' AND method = '%s'%s;",
+				eventtable, method, !hasfilters ? "" :
+				filtered ? " AND eventfilter IS NOT NULL LIMIT 1" :
+				" AND eventfilter IS NULL");
 		else
-			sprintf(countquerystring,"SELECT recmodelname, updatecounter, eventtotal FROM %s;",
-				recindexname);
-
-		countqueryDesc = recathon_queryStart(countquerystring,&countcontext);
-		countplanstate = countqueryDesc->planstate;
-
-		// Go through what should be the only tuple and obtain the data.
-		countslot = ExecProcNode(countplanstate);
-		if (TupIsNull(countslot)) {
-			// More failure conditions. We can't just error out
-			// because the INSERT still needs to happen.
-			recathon_queryEnd(countqueryDesc,countcontext);
-			pfree(countquerystring);
-			pfree(recindexname);
-			pfree(userkey);
-			pfree(itemkey);
-			pfree(eventval);
-			continue;
-		}
+			sprintf(querystring,"SELECT recommenderindexname FROM RecModelsCatalogue WHERE eventtable = '%s' LIMIT 1;",
+				eventtable);
 
-		// Get the relevant data.
-		if (method == SVD) {
-			recmodelname = getTupleString(countslot,"recusermodelname");
-			recmodelname2 = getTupleString(countslot,"recitemmodelname");
-		} else {
-			recmodelname = getTupleString(countslot,"recmodelname");
-			recmodelname2 = NULL;
+		if (filtered && !hasfilters)
+			recindexname = NULL;
+		else {
+			queryDesc = recathon_queryStart(querystring,&recathoncontext);
+			slot = ExecProcNode(queryDesc->planstate);
+			if (!TupIsNull(slot))
+				recindexname = getTupleString(slot,"recommenderindexname");
+			recathon_queryEnd(queryDesc,recathoncontext);
 		}
-		updatecounter = getTupleInt(countslot,"updatecounter");
-		eventtotal = getTupleInt(countslot,"eventtotal");
-
-		recathon_queryEnd(countqueryDesc,countcontext);
-		pfree(countquerystring);
-
-		// Even more failure conditions.
-		if (updatecounter < 0) {
-			pfree(recmodelname);
-			if (recmodelname2)
-				pfree(recmodelname2);
-			pfree(recindexname);
-			pfree(userkey);
-			pfree(itemkey);
+		if (recathon_catalogue_stale) {
+			if (recindexname)
+				pfree(recindexname);
 			continue;
 		}
 
-		// With that done, we check the original counter. If the
-		// number of new events is greater than threshold * the
-		// number of events currently used in the model, we need
-		// to trigger an update. Otherwise, just increment.
-		updatecounter++;
-
-		if (updatecounter >= (int) (update_threshold * eventtotal)) {
-			int numEvents = 0;
-
-			// What we do depends on the recommendation method.
-			switch (method) {
-				case itemCosCF:
-					{
-					// Before we update the similarity model, we need to obtain
-					// a few item-related things.
-					int numItems;
-					int *IDs;
-					float *lengths;
-
-					lengths = vector_lengths(itemkey, eventtable, eventval,
-						&numItems, &IDs);
-
-					// Now update the similarity model.
-					numEvents = updateItemCosModel(eventtable, userkey,
-						itemkey, eventval, recmodelname,
-						IDs, lengths, numItems, true);
-					}
-					break;
-				case itemPearCF:
-					{
-					// Before we update the similarity model, we need to obtain
-					// a few item-related things.
-					int numItems;
-					int *IDs;
-					float *avgs, *pearsons;
-
-					pearson_info(itemkey, eventtable, eventval, &numItems,
-							&IDs, &avgs, &pearsons);
-
-					// Now update the similarity model.
-					numEvents = updateItemPearModel(eventtable, userkey,
-						itemkey, eventval, recmodelname,
-						IDs, avgs, pearsons, numItems, true);
-					}
-					break;
-				case userCosCF:
-					{
-					// Before we update the similarity model, we need to obtain
-					// a few user-related things.
-					int numUsers;
-					int *IDs;
-					float *lengths;
-
-					lengths = vector_lengths(userkey, eventtable, eventval,
-						&numUsers, &IDs);
-
-					// Now update the similarity model.
-					numEvents = updateUserCosModel(eventtable, userkey,
-						itemkey, eventval, recmodelname,
-						IDs, lengths, numUsers, true);
-					}
-					break;
-				case userPearCF:
-					{
-					// Before we update the similarity model, we need to obtain
-					// a few user-related things.
-					int numUsers;
-					int *IDs;
-					float *avgs, *pearsons;
-
-					pearson_info(userkey, eventtable, eventval, &numUsers,
-							&IDs, &avgs, &pearsons);
-
-					// Now update the similarity model.
-					numEvents = updateUserPearModel(eventtable, userkey,
-						itemkey, eventval, recmodelname,
-						IDs, avgs, pearsons, numUsers, true);
-					}
-					break;
-				case SVD:
-					// No additional functions, just update the model.
-					numEvents = SVDtrain(userkey, itemkey,
-						eventtable, eventval,
-						recmodelname, recmodelname2, true);
-					break;
-				default:
-					break;
-			}
+		entry = (RecathonBuiltEntry*) hash_search(recathon_catalogue_built,
+			key, HASH_ENTER, &found);
+		strlcpy(entry->recindexname, recindexname ? recindexname : "", NAMEDATALEN);
+		break;
+	}
 
-			// Finally, we update the cell to indicate how many events were used
-			// to build it. We'll also reset the updatecounter.
-			countquerystring = (char*) palloc(1024*sizeof(char));
-			sprintf(countquerystring,"UPDATE %s SET updatecounter = 0, eventtotal = %d;",
-							recindexname,numEvents);
+	pfree(querystring);
+	return recindexname;
+}
 
-			// Execute normally, we don't need to see results.
-			recathon_queryExecute(countquerystring);
-			pfree(countquerystring);
-		} else {
-			// Just increment.
-			countquerystring = (char*) palloc(1024*sizeof(char));
-			sprintf(countquerystring,"UPDATE %s SET updatecounter = updatecounter+1;",
-							recindexname);
-			// Execute normally, we don't need to see results.
-			recathon_queryExecute(countquerystring);
-			pfree(countquerystring);
-		}
+/* ----------------------------------------------------------------
+ *		noteCatalogueChange
+ *
+ *		Happens at the end of every INSERT, UPDATE or DELETE
+ *		statement that changed rows. If it changed
+ *		RecModelsCatalogue, or what may be a recommender's
+ *		index table, every backend's catalogue cache is told
+ *		to forget what it holds once the change commits, and
+ *		ours forgets it now. Index tables are only ever
+ *		inserted into along with the catalogue.
+ * ----------------------------------------------------------------
+ */
+void
+noteCatalogueChange(Relation rel, CmdType operation) {
+	char *relname = RelationGetRelationName(rel);
+	int len = strlen(relname);
 
-		// Final cleanup.
-		pfree(recmodelname);
-		if (recmodelname2)
-			pfree(recmodelname2);
-		pfree(recindexname);
-		pfree(userkey);
-		pfree(itemkey);
-		pfree(eventval);
-	}
+	if (strcmp(relname, "recmodelscatalogue") != 0 &&
+	    (operation == CMD_INSERT || len < 5 ||
+	     pg_strcasecmp(relname + len - 5, "index") != 0))
+		return;
 
-	recathon_queryEnd(queryDesc,recathoncontext);
-	pfree(querystring);
+	CacheInvalidateRelcache(rel);
+	recathon_catalogue_stale = true;
 }
 
 /* ----------------------------------------------------------------
- *		binarySearch
+ *		retrieveRecommender
  *
- *		A quick binary search algorithm, for use with the
- *		CREATE RECOMMENDER query.
+ *		Given an event table and a recommendation method,
+ *		we look to see if any recommenders are already
+ *		built. If so, we return the RecIndex name.
  * ----------------------------------------------------------------
  */
-int
-binarySearch(int *array, int value, int lo, int hi) {
-	int mid;
-
-	mid = (hi + lo) / 2;
-	if (array[mid] == value) return mid;
-	// Edge case.
-	if (mid == lo) return -1;
-	// Normal recursive case.
-	if (array[mid] < value)
-		return binarySearch(array, value, mid, hi);
-	else
-		return binarySearch(array, value, lo, mid);
+char*
+retrieveRecommender(char *eventtable, char *method) {
+	return builtRecommender(eventtable, method, false);
 }
 
 /* ----------------------------------------------------------------
- *		vector_lengths
+ *		filteredRecommenders
  *
- *		Looks at all the items in a certain table and
- *		calculates their vector lengths. Used to determine
- *		cosine similarity. Also returns the number of items
- *		or users as a side effect, and a list of them.
+ *		Lists the recommenders built with a WHERE condition on
+ *		an events table using a method, by their RecIndex
+ *		names, and returns their conditions along with them.
+ *		The parser decides which of them a query can use.
  * ----------------------------------------------------------------
  */
-float*
-vector_lengths(char *key, char *eventtable, char *eventval, int *totalNum, int **IDlist) {
-	int *IDs;
-	float *lengths;
-	int i, j, numItems, priorID;
-	// Objects for querying.
-	char *querystring;
+List *
+filteredRecommenders(char *eventtable, char *method, List **ret_filters) {
+	List *recindexnames = NIL;
+	char *recindexname;
+	StringInfoData querystring;
+	// Query information.
 	QueryDesc *queryDesc;
-	PlanState *planstate;
 	TupleTableSlot *slot;
 	MemoryContext recathoncontext;
 
-	// We start by getting the number of distinct items in the event table.
-	querystring = (char*) palloc(1024*sizeof(char));
-	sprintf(querystring,"SELECT COUNT(DISTINCT %s) FROM %s;",
-		key,eventtable);
-	queryDesc = recathon_queryStart(querystring,&recathoncontext);
-	planstate = queryDesc->planstate;
-	slot = ExecProcNode(planstate);
-	numItems = getTupleInt(slot,"count");
-	recathon_queryEnd(queryDesc,recathoncontext);
+	*ret_filters = NIL;
 
-	// Now that we have the number of items, we can create an array or two.
-	IDs = (int*) palloc(numItems*sizeof(int));
-	lengths = (float*) palloc(numItems*sizeof(float));
-	for (j = 0; j < numItems; j++)
-		lengths[j] = 0.0;
+	// Usually there are none, and the cache knows it.
+	recindexname = builtRecommender(eventtable, method, true);
+	if (!recindexname)
+		return NIL;
+	pfree(recindexname);
 
-	// Now we need to populate the two arrays. We'll get all the events from
-	// the events table.
-	priorID = -1;
-	sprintf(querystring,"SELECT * FROM %s ORDER BY %s;",eventtable,key);
-	queryDesc = recathon_queryStart(querystring,&recathoncontext);
-	planstate = queryDesc->planstate;
-	i = -1;
+	initStringInfo(&querystring);
+	appendStringInfo(&querystring,"SELECT recommenderindexname, eventfilter FROM RecModelsCatalogue WHERE eventtable = '%s' AND eventfilter IS NOT NULL",
+		eventtable);
+	if (method)
+		appendStringInfo(&querystring," AND method = '%s'",method);
+	appendStringInfoString(&querystring," ORDER BY recommenderid;");
 
-	// This query grabs all item IDs, so we can store them. Later we'll calculate
-	// vector lengths.
+	queryDesc = recathon_queryStart(querystring.data,&recathoncontext);
 	for (;;) {
-		int currentID = 0;
-		float currentEvent = 0.0;
-
-		slot = ExecProcNode(planstate);
+		slot = ExecProcNode(queryDesc->planstate);
 		if (TupIsNull(slot)) break;
-
-		currentID = getTupleInt(slot,key);
-
-		// Are we dealing with a new item ID? If so, switch to the next slot.
-		if (currentID != priorID) {
-			i++;
-			priorID = currentID;
-			IDs[i] = currentID;
-		}
-
-		currentEvent = getTupleFloat(slot,eventval);
-		lengths[i] += currentEvent*currentEvent;
+		recindexnames = lappend(recindexnames,
+			getTupleString(slot,"recommenderindexname"));
+		*ret_filters = lappend(*ret_filters,
+			getTupleString(slot,"eventfilter"));
 	}
-
-	// Query cleanup.
 	recathon_queryEnd(queryDesc,recathoncontext);
-	pfree(querystring);
-
-	// Now that we've totally queried the events table, we need to
-	// take the square root of each length and we're done.
-	for (i = 0; i < numItems; i++)
-		lengths[i] = sqrtf(lengths[i]);
+	pfree(querystring.data);
 
-	// Return data.
-	(*totalNum) = numItems;
-	(*IDlist) = IDs;
-
-	return lengths;
+	return recindexnames;
 }
 
 /* ----------------------------------------------------------------
- *		dotProduct
+ *		getRecInfo
  *
- *		Function to compare two items and compute their dot
- *		product. Used for determining cosine similarity.
- *		The lists are necessarily sorted, so we can compare
- *		in linear time.
+ *		This function looks in the RecModelsCatalogue and
+ *		gets some key information. It returns all its
+ *		values by reference. If any of the provided return
+ *		variables are NULL, we don't return that. This lets
+ *		us customize what information we want.
  * ----------------------------------------------------------------
  */
-float
-dotProduct(sim_node item1, sim_node item2) {
-	sim_node temp1, temp2;
-	float similarity;
-
-	if (item1 == NULL || item2 == NULL) return 0;
-
-	similarity = 0.0;
-
-	// Check every event for the first item, and see how
-	// many of those users also rated the second item.
-	temp1 = item1; temp2 = item2;
-	while (temp1 && temp2) {
-		if (temp1->id == temp2->id) {
-			similarity += temp1->event * temp2->event;
-			temp1 = temp1->next;
-			temp2 = temp2->next;
-		} else if (temp1->id > temp2->id) {
-			temp2 = temp2->next;
-		} else {
-			temp1 = temp1->next;
-		}
+void
+getRecInfo(char *recindexname, char **ret_eventtable,
+		char **ret_userkey, char **ret_itemkey,
+		char **ret_eventval, char **ret_method, int *ret_numatts) {
+	char *eventtable, *userkey, *itemkey, *eventval, *method;
+	TupleTableSlot *slot;
+
+	slot = getRecCatalogueSlot(recindexname);
+	// This should never happen.
+	if (!slot)
+		ereport(ERROR,
+			(errcode(ERRCODE_SYNTAX_ERROR),
+			 errmsg("fatal error in getRecInfo()")));
+
+	// Obtain each of the values needed.
+	if (ret_eventtable) {
+		eventtable = getTupleString(slot,"eventtable");
+		(*ret_eventtable) = eventtable;
+	}
+	if (ret_userkey) {
+		userkey = getTupleString(slot,"userkey");
+		(*ret_userkey) = userkey;
+	}
+	if (ret_itemkey) {
+		itemkey = getTupleString(slot,"itemkey");
+		(*ret_itemkey) = itemkey;
+	}
+	if (ret_eventval) {
+		eventval = getTupleString(slot,"eventval");
+		(*ret_eventval) = eventval;
+	}
+	if (ret_method) {
+		method = getTupleString(slot,"method");
+		(*ret_method) = method;
 	}
+	if (ret_numatts)
+		(*ret_numatts) = getTupleInt(slot,"contextattributes");
 
-	return similarity;
+	ExecDropSingleTupleTableSlot(slot);
 }
 
 /* ----------------------------------------------------------------
- *		cosineSimilarity
+ *		catalogueInt
  *
- *		Function to compare two items and compute their
- *		cosine similarity.
+ *		Reads an integer column of a recommender's entry in
+ *		RecModelsCatalogue. Catalogues from before the column
+ *		was added don't have it, in which case we return 0.
  * ----------------------------------------------------------------
  */
-float
-cosineSimilarity(sim_node item1, sim_node item2, float length1, float length2) {
-	float numerator;
-	float denominator;
+static int
+catalogueInt(char *recindexname, char *column) {
+	int value;
+	TupleTableSlot *slot;
 
-	// Short-circuit check. If one of the items has no events,
-	// no point checking similarity. This also avoids a possible
-	// divide-by-zero error.
-	denominator = length1 * length2;
-	if (denominator <= 0) return 0;
+	slot = getRecCatalogueSlot(recindexname);
+	if (!slot)
+		return 0;
 
-	numerator = dotProduct(item1,item2);
-	if (numerator <= 0) return 0;
-	else return numerator / denominator;
+	value = 0;
+	if (slotHasColumn(slot,column))
+		value = getTupleInt(slot,column);
+
+	ExecDropSingleTupleTableSlot(slot);
+	return value;
 }
 
 /* ----------------------------------------------------------------
- *		updateItemCosModel
+ *		catalogueString
  *
- *		Given a single cell of a recommender, this
- *		function rebuilds the recModel for that cell, using
- *		item-based collaborative filtering with cosine
- *		similarity. Returns the number of events used.
+ *		Reads a text column of a recommender's entry in
+ *		RecModelsCatalogue. Returns NULL if it's null, or if
+ *		the catalogue is older than the column.
  * ----------------------------------------------------------------
  */
-int
-updateItemCosModel(char *eventtable, char *userkey, char *itemkey,
-		char *eventval, char *modelname, int *itemIDs, float *itemLengths,
-		int numItems, bool update) {
-	int i, j, priorID;
-	int numEvents = 0;
-	char *querystring, *insertstring, *temprecfile;
-	sim_node *itemEvents;
-	// Information for other queries.
-	QueryDesc *simqueryDesc;
-	PlanState *simplanstate;
-	TupleTableSlot *simslot;
-	MemoryContext simcontext;
-	// Information for writing to file.
-	FILE *fp;
-	temprecfile = (char*) palloc(256*sizeof(char));
-	sprintf(temprecfile,"recathon_temp_%s.dat",modelname);
-
-	// If this is us updating a cell as opposed to building
-	// a recommender, we need to drop the existing entries.
-	if (update) {
-		char *dropstring;
+static char *
+catalogueString(char *recindexname, char *column) {
+	char *value;
+	TupleTableSlot *slot;
 
-		dropstring = (char*) palloc(256*sizeof(char));
-		sprintf(dropstring,"DELETE FROM %s;",modelname);
-		recathon_queryExecute(dropstring);
-		pfree(dropstring);
-	}
+	slot = getRecCatalogueSlot(recindexname);
+	if (!slot)
+		return NULL;
 
-	// With the precomputation done, we need to derive the actual item
-	// similarities. We can do this in a way that's linear in the number
-	// of I/Os and also the amount of storage. The complexity is relegated
-	// to in-memory calculations, which is the most affordable. We need to
-	// use this data structure here.
-	itemEvents = (sim_node*) palloc(numItems*sizeof(sim_node));
-	for (i = 0; i < numItems; i++)
-		itemEvents[i] = NULL;
+	value = getTupleString(slot,column);
 
-	// With the model created, we need to populate it, which means calculating
-	// similarity between all item pairs. We need to query the events table
-	// in order to get the key information. We'll also keep track of the number
-	// of events used, since we need to store that information.
-	querystring = (char*) palloc(1024*sizeof(char));
-	sprintf(querystring,"SELECT r.%s,r.%s,r.%s FROM %s r ORDER BY r.%s;",
-		userkey,itemkey,eventval,eventtable,itemkey);
+	ExecDropSingleTupleTableSlot(slot);
+	return value;
+}
 
-	// Begin extracting data.
-	priorID = -1;
-	simqueryDesc = recathon_queryStart(querystring, &simcontext);
-	simplanstate = simqueryDesc->planstate;
-	i = -1;
+/* ----------------------------------------------------------------
+ *		getRecSimParams
+ *
+ *		Looks up the build parameters a similarity-based
+ *		recommender was created with, for rebuilding its
+ *		model. Rebuilds use a single process on each node.
+ * ----------------------------------------------------------------
+ */
+void
+getRecSimParams(char *recindexname, sim_params *params) {
+	char *minsimilarity;
+
+	params->numWorkers = 0;
+	params->neighborhood = catalogueInt(recindexname, "neighborhood");
+	params->minSupport = catalogueInt(recindexname, "minsupport");
+	minsimilarity = catalogueString(recindexname, "minsimilarity");
+	params->minSimilarity = minsimilarity ? atof(minsimilarity) : 0.0;
+	if (minsimilarity)
+		pfree(minsimilarity);
+	params->lshBands = catalogueInt(recindexname, "lshbands");
+	params->lshRows = catalogueInt(recindexname, "lshrows");
+	if (params->lshRows <= 0)
+		params->lshBands = 0;
+	params->userClusters = catalogueInt(recindexname, "userclusters");
+	params->clusterProbes = catalogueInt(recindexname, "clusterprobes");
+	if (params->clusterProbes <= 0)
+		params->userClusters = 0;
+	params->buildNodes = catalogueString(recindexname, "buildnodes");
+	params->vectorStore = getRecVectorStore(recindexname) ?
+		pstrdup(recindexname) : NULL;
+	params->shard = 0;
+	params->numShards = 1;
+	params->strategy[0] = '\0';
+}
 
-	for (;;) {
-		int simuser, simitem;
-		float simevent;
-		sim_node newnode;
+/* ----------------------------------------------------------------
+ *		getRecSVDparams
+ *
+ *		Looks up the training parameters an SVD or ALS
+ *		recommender was created with, for rebuilding its
+ *		models, and returns the number of processes to train
+ *		with. Recommenders from before they were kept get the
+ *		defaults, as does anything they were never given.
+ * ----------------------------------------------------------------
+ */
+int
+getRecSVDparams(char *recindexname, recMethod method, svd_params *params) {
+	int value, numWorkers;
+	char *real;
+
+	getSVDparams(NIL, method, params);
+
+	value = catalogueInt(recindexname, "features");
+	if (value > 0)
+		params->numFeatures = value;
+	value = catalogueInt(recindexname, "maxepochs");
+	if (value > 0)
+		params->maxEpochs = value;
+	real = catalogueString(recindexname, "learningrate");
+	if (real) {
+		params->learnRate = atof(real);
+		pfree(real);
+	}
+	real = catalogueString(recindexname, "regularization");
+	if (real) {
+		params->penalty = atof(real);
+		pfree(real);
+	}
+	real = catalogueString(recindexname, "tolerance");
+	if (real) {
+		params->tolerance = atof(real);
+		pfree(real);
+	}
 
-		// Shut the compiler up.
-		simuser = 0; simitem = 0; simevent = 0.0;
+	numWorkers = catalogueInt(recindexname, "parallelworkers");
+	return numWorkers > 0 ? numWorkers : 1;
+}
 
-		simslot = ExecProcNode(simplanstate);
-		if (TupIsNull(simslot)) break;
+/* ----------------------------------------------------------------
+ *		getRecViewSize
+ *
+ *		Looks up how many predictions per user a recommender
+ *		keeps in its RecView, or 0 if it doesn't keep any.
+ * ----------------------------------------------------------------
+ */
+int
+getRecViewSize(char *recindexname) {
+	return catalogueInt(recindexname, "materialize");
+}
 
-		simuser = getTupleInt(simslot,userkey);
-		simitem = getTupleInt(simslot,itemkey);
-		simevent = getTupleFloat(simslot,eventval);
+/* ----------------------------------------------------------------
+ *		getRecLevel
+ *
+ *		Looks up how much of a recommender is materialized.
+ *		Unless it was built with the adaptive option, that's
+ *		always RECATHON_LEVEL_MODEL.
+ * ----------------------------------------------------------------
+ */
+int
+getRecLevel(char *recindexname) {
+	return catalogueInt(recindexname, "level");
+}
 
-		// Are we dealing with a new item ID? If so, switch to the next slot.
-		if (simitem != priorID) {
-			priorID = simitem;
-			i++;
-		}
+/* ----------------------------------------------------------------
+ *		getRecHybrid
+ *
+ *		Looks up whether a recommender only keeps its heavy
+ *		users' predictions in its RecView.
+ * ----------------------------------------------------------------
+ */
+bool
+getRecHybrid(char *recindexname) {
+	return catalogueInt(recindexname, "hybrid") != 0;
+}
 
-		// We now have the user, item, and event for this tuple.
-		// We insert the results as a sim_node into the
-		// itemEvents table; we'll do calculations later.
-		newnode = createSimNode(simuser, simevent);
-		itemEvents[i] = simInsert(itemEvents[i], newnode);
-		numEvents++;
+/* ----------------------------------------------------------------
+ *		getRecIncremental
+ *
+ *		Looks up whether a recommender folds new events into
+ *		its model as they arrive, rather than rebuilding it.
+ * ----------------------------------------------------------------
+ */
+bool
+getRecIncremental(char *recindexname) {
+	return catalogueInt(recindexname, "incremental") != 0;
+}
+
+/* ----------------------------------------------------------------
+ *		getRecUnlogged
+ *
+ *		Looks up whether a recommender keeps its models in
+ *		unlogged tables.
+ * ----------------------------------------------------------------
+ */
+bool
+getRecUnlogged(char *recindexname) {
+	return catalogueInt(recindexname, "unlogged") != 0;
+}
+
+/* ----------------------------------------------------------------
+ *		getRecPartialRefresh
+ *
+ *		Looks up whether a recommender's rebuilds only
+ *		recompute the rows of items or users with new events.
+ * ----------------------------------------------------------------
+ */
+bool
+getRecPartialRefresh(char *recindexname) {
+	return catalogueInt(recindexname, "partial_refresh") != 0;
+}
+
+/* ----------------------------------------------------------------
+ *		getRecOnline
+ *
+ *		Looks up whether an SVD or ALS recommender takes new
+ *		events into its factors at every maintenance pass.
+ * ----------------------------------------------------------------
+ */
+bool
+getRecOnline(char *recindexname) {
+	return catalogueInt(recindexname, "online") != 0;
+}
+
+/* ----------------------------------------------------------------
+ *		getRecVectorStore
+ *
+ *		Looks up whether a recommender keeps its rating
+ *		vectors in a vector store, for rebuilds to read.
+ * ----------------------------------------------------------------
+ */
+bool
+getRecVectorStore(char *recindexname) {
+	return catalogueInt(recindexname, "vectorstore") != 0;
+}
+
+/* ----------------------------------------------------------------
+ *		getRecSymmetric
+ *
+ *		Looks up whether a recommender's similarity models
+ *		hold both directions of every pair.
+ * ----------------------------------------------------------------
+ */
+bool
+getRecSymmetric(char *recindexname) {
+	return catalogueInt(recindexname, "symmetric") != 0;
+}
+
+/* ----------------------------------------------------------------
+ *		getRecNeighborhood
+ *
+ *		Looks up how many neighbors a similarity-based
+ *		recommender keeps, or 0 if it keeps them all.
+ * ----------------------------------------------------------------
+ */
+int
+getRecNeighborhood(char *recindexname) {
+	return catalogueInt(recindexname, "neighborhood");
+}
+
+/* ----------------------------------------------------------------
+ *		getRecGeneratable
+ *
+ *		Looks up whether generating a similarity-based
+ *		recommender's model on the fly would give the same
+ *		predictions as its built one: that it keeps every
+ *		neighbor of every pair, exactly, and is built from
+ *		the whole events table rather than a cell, sample,
+ *		window or WHERE condition of it.
+ * ----------------------------------------------------------------
+ */
+bool
+getRecGeneratable(char *recindexname, char *eventtable) {
+	char *minsimilarity, *partitionof, *source;
+	bool result;
+
+	if (getRecNeighborhood(recindexname) > 0 ||
+	    catalogueInt(recindexname, "lshbands") > 0 ||
+	    catalogueInt(recindexname, "userclusters") > 0 ||
+	    catalogueInt(recindexname, "minsupport") > 1)
+		return false;
+
+	minsimilarity = catalogueString(recindexname, "minsimilarity");
+	partitionof = catalogueString(recindexname, "partitionof");
+	result = (!minsimilarity || atof(minsimilarity) == 0.0) && !partitionof;
+	if (minsimilarity)
+		pfree(minsimilarity);
+	if (partitionof)
+		pfree(partitionof);
+	if (!result)
+		return false;
+
+	source = getRecEventSource(recindexname, eventtable);
+	result = (strcmp(source, eventtable) == 0);
+	pfree(source);
+	return result;
+}
+
+/* ----------------------------------------------------------------
+ *		getRecNotifyChanges
+ *
+ *		Looks up whether a recommender logs the users whose
+ *		RecView lists change when it's refilled.
+ * ----------------------------------------------------------------
+ */
+bool
+getRecNotifyChanges(char *recindexname) {
+	return catalogueInt(recindexname, "notify_changes") != 0;
+}
+
+/* ----------------------------------------------------------------
+ *		getRecServeNodes
+ *
+ *		Looks up the nodes that answer a recommender's queries
+ *		for it, or NULL if it answers for itself.
+ * ----------------------------------------------------------------
+ */
+char *
+getRecServeNodes(char *recindexname) {
+	return catalogueString(recindexname, "servenodes");
+}
+
+/* ----------------------------------------------------------------
+ *		getRecActiveItems
+ *
+ *		Looks up the relation or query naming the items a
+ *		recommender may recommend, or NULL if it may
+ *		recommend any of them.
+ * ----------------------------------------------------------------
+ */
+char *
+getRecActiveItems(char *recindexname) {
+	return catalogueString(recindexname, "activeitems");
+}
+
+/* ----------------------------------------------------------------
+ *		getRecCell
+ *
+ *		For a partitioned recommender, looks up the cell that
+ *		every one of the given users belongs to, and returns
+ *		the name of its index table. If the users are spread
+ *		over more than one cell, or some are in none, or the
+ *		recommender isn't partitioned, returns NULL, and the
+ *		recommender answers for itself.
+ * ----------------------------------------------------------------
+ */
+char *
+getRecCell(char *recindexname, List *userIDList) {
+	char *recname, *partitionkey, *partitiontable, *userkey;
+	char *cellindexname = NULL;
+	bool first = true;
+	ListCell *lc;
+	// Query objects.
+	StringInfoData querystring;
+	QueryDesc *queryDesc;
+	TupleTableSlot *slot;
+	MemoryContext recathoncontext;
+
+	if (userIDList == NIL)
+		return NULL;
+
+	// Only partitioned recommenders have cells, and catalogues
+	// from before partitioning have none.
+	partitionkey = catalogueString(recindexname,"partitionkey");
+	if (!partitionkey)
+		return NULL;
+	slot = getRecCatalogueSlot(recindexname);
+	recname = getTupleString(slot,"recommendername");
+	userkey = getTupleString(slot,"userkey");
+	partitiontable = getTupleString(slot,"partitiontable");
+	ExecDropSingleTupleTableSlot(slot);
+
+	// Match each user with the cell for their attribute. A user
+	// with no row, a NULL attribute, or a value that didn't get a
+	// cell matches nothing.
+	initStringInfo(&querystring);
+	appendStringInfoString(&querystring,"SELECT min(c.recommenderindexname) AS cellindexname, count(DISTINCT c.recommenderindexname) AS numcells, sum(CASE WHEN c.recommenderindexname IS NULL THEN 1 ELSE 0 END) AS uncovered FROM (VALUES ");
+	foreach(lc, userIDList) {
+		appendStringInfo(&querystring,"%s(%d)",first ? "" : ", ",lfirst_int(lc));
+		first = false;
+	}
+	appendStringInfo(&querystring,") q(id) LEFT JOIN %s p ON p.%s = q.id LEFT JOIN RecModelsCatalogue c ON c.partitionof = '%s' AND c.partitionvalue = p.%s::text;",
+		partitiontable,userkey,recname,partitionkey);
+	queryDesc = recathon_queryStart(querystring.data,&recathoncontext);
+	slot = ExecProcNode(queryDesc->planstate);
+	if (!TupIsNull(slot) &&
+			getTupleInt(slot,"numcells") == 1 &&
+			getTupleInt(slot,"uncovered") == 0)
+		cellindexname = getTupleString(slot,"cellindexname");
+	recathon_queryEnd(queryDesc,recathoncontext);
+
+	pfree(querystring.data);
+	pfree(recname);
+	pfree(userkey);
+	pfree(partitionkey);
+	pfree(partitiontable);
+
+	return cellindexname;
+}
+
+/* ----------------------------------------------------------------
+ *		validateCreateRStmt
+ *
+ *		We need to implement a series of sanity checks, to
+ *		make sure CREATE RECOMMENDER statement data is
+ *		actually usable.
+ * ----------------------------------------------------------------
+ */
+recMethod
+validateCreateRStmt(CreateRStmt *recStmt) {
+	recMethod method;
+	char relkind;
+	ListCell *lc;
+
+	// Our first test is to make sure the ratings table exists.
+	if (!relationExists(recStmt->eventtable))
+		ereport(ERROR,
+			(errcode(ERRCODE_UNDEFINED_TABLE),
+			 errmsg("relation \"%s\" does not exist",
+				recStmt->eventtable->relname)));
+
+	// The events can come straight from a foreign table, such as a
+	// file_fdw file, but then nothing sees them arrive, so options
+	// that need a trigger on the table are out.
+	relkind = get_rel_relkind(RangeVarGetRelid(recStmt->eventtable,NoLock,false));
+	if (relkind == RELKIND_FOREIGN_TABLE &&
+	    (getRecOptionBool(recStmt->options, "incremental", false) ||
+	     getRecOptionBool(recStmt->options, "partial_refresh", false) ||
+	     getRecOptionBool(recStmt->options, "online", false) ||
+	     getRecOptionBool(recStmt->options, "vector_store", false)))
+		ereport(ERROR,
+			(errcode(ERRCODE_WRONG_OBJECT_TYPE),
+			 errmsg("options \"incremental\", \"partial_refresh\", \"online\" and \"vector_store\" can't be used with foreign table \"%s\"",
+				recStmt->eventtable->relname)));
+
+	// Our second test is to see whether or not a recommender has already
+	// been created with the given events table and method, or name.
+	if (relationExists(recStmt->recname))
+		ereport(ERROR,
+			(errcode(ERRCODE_UNDEFINED_TABLE),
+			 errmsg("a recommender with name \"%s\" already exists",
+				recStmt->recname->relname)));
+
+	// Recommenders on some of the events can sit alongside one on
+	// all of them, so that a query can pick.
+	if (!recStmt->eventfilter &&
+	    retrieveRecommender(recStmt->eventtable->relname,recStmt->method) != NULL)
+		ereport(ERROR,
+			(errcode(ERRCODE_UNDEFINED_TABLE),
+			 errmsg("recommender on table \"%s\" using method \"%s\" already exists",
+				recStmt->eventtable->relname,recStmt->method)));
+
+	// We next need to test that the provided columns
+	// exist in the events table.
+	// Test: user key is in event table.
+	if (!columnExistsInRelation(recStmt->userkey,recStmt->eventtable))
+		ereport(ERROR,
+			(errcode(ERRCODE_UNDEFINED_COLUMN),
+			 errmsg("column \"%s\" does not exist in relation \"%s\"",
+				recStmt->userkey,recStmt->eventtable->relname)));
+	// Test: item key is in event table.
+	if (!columnExistsInRelation(recStmt->itemkey,recStmt->eventtable))
+		ereport(ERROR,
+			(errcode(ERRCODE_UNDEFINED_COLUMN),
+			 errmsg("column \"%s\" does not exist in relation \"%s\"",
+				recStmt->itemkey,recStmt->eventtable->relname)));
+	// Test: event value is in event table.
+	if (!columnExistsInRelation(recStmt->eventval,recStmt->eventtable))
+		ereport(ERROR,
+			(errcode(ERRCODE_UNDEFINED_COLUMN),
+			 errmsg("column \"%s\" does not exist in relation \"%s\"",
+				recStmt->eventval,recStmt->eventtable->relname)));
+
+	// A partitioned recommender needs the partition attribute,
+	// and the users it belongs to, in the same table.
+	if (recStmt->partitionkey) {
+		RangeVar *partitionrv = recStmt->partitiontable ?
+			recStmt->partitiontable : recStmt->eventtable;
+
+		if (!relationExists(partitionrv))
+			ereport(ERROR,
+				(errcode(ERRCODE_UNDEFINED_TABLE),
+				 errmsg("relation \"%s\" does not exist",
+					partitionrv->relname)));
+		if (!columnExistsInRelation(recStmt->userkey,partitionrv))
+			ereport(ERROR,
+				(errcode(ERRCODE_UNDEFINED_COLUMN),
+				 errmsg("column \"%s\" does not exist in relation \"%s\"",
+					recStmt->userkey,partitionrv->relname)));
+		if (!columnExistsInRelation(recStmt->partitionkey,partitionrv))
+			ereport(ERROR,
+				(errcode(ERRCODE_UNDEFINED_COLUMN),
+				 errmsg("column \"%s\" does not exist in relation \"%s\"",
+					recStmt->partitionkey,partitionrv->relname)));
+	}
+
+	// A recommender with a window needs the time of each event.
+	if (recStmt->timekey &&
+	    !columnExistsInRelation(recStmt->timekey,recStmt->eventtable))
+		ereport(ERROR,
+			(errcode(ERRCODE_UNDEFINED_COLUMN),
+			 errmsg("column \"%s\" does not exist in relation \"%s\"",
+				recStmt->timekey,recStmt->eventtable->relname)));
+
+	// Now we convert our method name.
+	method = itemCosCF;
+	// To handle the case where no USING clause was provided.
+	if (recStmt->method) {
+		method = getRecMethod(recStmt->method);
+		if (method < 0)
+			ereport(ERROR,
+				(errcode(ERRCODE_CASE_NOT_FOUND),
+				 errmsg("recommendation method %s not recognized",
+					recStmt->method)));
+	}
+
+	// Make sure we recognize all of the options.
+	foreach(lc, recStmt->options) {
+		DefElem *def = (DefElem*) lfirst(lc);
+
+		if (isRefreshOption(def))
+			continue;
+		if (strcmp(def->defname, "parallel_workers") == 0) {
+			int64 workers = defGetInt64(def);
+
+			if (workers < 1 || workers > RECATHON_MAX_WORKERS)
+				ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("parallel_workers must be between 1 and %d",
+						RECATHON_MAX_WORKERS)));
+			continue;
+		}
+		if (strcmp(def->defname, "model_file") == 0 ||
+		    strcmp(def->defname, "unlogged") == 0 ||
+		    strcmp(def->defname, "event_indexes") == 0) {
+			(void) defGetBoolean(def);
+			continue;
+		}
+		if (strcmp(def->defname, "build_nodes") == 0) {
+			(void) defGetString(def);
+			if (FACTOR_METHOD(method))
+				ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("option \"%s\" is only valid for similarity-based recommenders",
+						def->defname)));
+			continue;
+		}
+		if (strcmp(def->defname, "serve_nodes") == 0 ||
+		    strcmp(def->defname, "active_items") == 0) {
+			(void) defGetString(def);
+			continue;
+		}
+		if (strcmp(def->defname, "item_attributes") == 0) {
+			List *relids, *attnos;
+
+			itemAttributeList(defGetString(def), true, &relids, &attnos);
+			list_free(relids);
+			list_free(attnos);
+			continue;
+		}
+		if (strcmp(def->defname, "incremental") == 0) {
+			if (!defGetBoolean(def))
+				continue;
+			// The statistics only add up for plain cosine similarity,
+			// with every co-rated pair in the model.
+			if (method != itemCosCF)
+				ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("option \"incremental\" is only valid for ItemCosCF recommenders")));
+			if (getRecOptionInt(recStmt->options, "neighborhood", 0) > 0 ||
+			    getRecOptionInt(recStmt->options, "lsh_bands", 0) > 0)
+				ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("option \"incremental\" can't be combined with \"neighborhood\" or \"lsh_bands\"")));
+			if (getRecOptionInt(recStmt->options, "min_support", 0) > 1 ||
+			    getRecOptionFloat(recStmt->options, "min_similarity", 0.0) > 0.0)
+				ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("option \"incremental\" can't be combined with \"min_support\" or \"min_similarity\"")));
+			if (recStmt->partitionkey)
+				ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("option \"incremental\" can't be combined with PARTITION BY")));
+			// Decayed events change weight as they age, so what's in
+			// the statistics goes stale.
+			if (recStmt->halflife)
+				ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("option \"incremental\" can't be combined with DECAY")));
+			// Its deltas come from every event, whether or not it
+			// meets the condition.
+			if (recStmt->eventfilter)
+				ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("option \"incremental\" can't be combined with WHERE")));
+			continue;
+		}
+		if (strcmp(def->defname, "partial_refresh") == 0) {
+			if (!defGetBoolean(def))
+				continue;
+			// Only an exact, whole similarity model can have some of
+			// its rows recomputed without touching the others.
+			if (FACTOR_METHOD(method))
+				ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("option \"%s\" is only valid for similarity-based recommenders",
+						def->defname)));
+			if (getRecOptionInt(recStmt->options, "neighborhood", 0) > 0 ||
+			    getRecOptionInt(recStmt->options, "lsh_bands", 0) > 0 ||
+			    getRecOptionInt(recStmt->options, "user_clusters", 0) > 0)
+				ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("option \"partial_refresh\" can't be combined with \"neighborhood\", \"lsh_bands\" or \"user_clusters\"")));
+			if (recStmt->partitionkey)
+				ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("option \"partial_refresh\" can't be combined with PARTITION BY")));
+			if (getRecOptionBool(recStmt->options, "incremental", false))
+				ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("option \"partial_refresh\" can't be combined with \"incremental\"")));
+			// Its deltas come from every event, whether or not it
+			// meets the condition.
+			if (recStmt->eventfilter)
+				ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("option \"partial_refresh\" can't be combined with WHERE")));
+			continue;
+		}
+		if (strcmp(def->defname, "online") == 0) {
+			if (!defGetBoolean(def))
+				continue;
+			// Only factor models can take single events in by
+			// gradient steps.
+			if (!FACTOR_METHOD(method))
+				ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("option \"online\" is only valid for SVD and ALS recommenders")));
+			if (recStmt->partitionkey)
+				ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("option \"online\" can't be combined with PARTITION BY")));
+			// Its deltas come from every event, whether or not it
+			// meets the condition or is in the sample.
+			if (recStmt->eventfilter)
+				ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("option \"online\" can't be combined with WHERE")));
+			if (getRecOptionFloat(recStmt->options, "sample_fraction", 0.0) > 0.0)
+				ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("option \"online\" can't be combined with \"sample_fraction\"")));
+			continue;
+		}
+		if (strcmp(def->defname, "vector_store") == 0) {
+			if (!defGetBoolean(def))
+				continue;
+			if (FACTOR_METHOD(method))
+				ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("option \"%s\" is only valid for similarity-based recommenders",
+						def->defname)));
+			// The store holds the events table's own events, which
+			// is all its trigger sees.
+			if (recStmt->partitionkey)
+				ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("option \"vector_store\" can't be combined with PARTITION BY")));
+			if (recStmt->timekey || recStmt->eventfilter)
+				ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("option \"vector_store\" can't be combined with WINDOW or WHERE")));
+			if (getRecOptionFloat(recStmt->options, "sample_fraction", 1.0) < 1.0)
+				ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("option \"vector_store\" can't be combined with \"sample_fraction\"")));
+			continue;
+		}
+		if (strcmp(def->defname, "symmetric") == 0) {
+			if (!defGetBoolean(def))
+				continue;
+			// Models that are rewritten in place only keep one
+			// direction of each pair up to date.
+			if (FACTOR_METHOD(method))
+				ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("option \"%s\" is only valid for similarity-based recommenders",
+						def->defname)));
+			if (recStmt->partitionkey)
+				ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("option \"symmetric\" can't be combined with PARTITION BY")));
+			if (getRecOptionBool(recStmt->options, "incremental", false) ||
+			    getRecOptionBool(recStmt->options, "partial_refresh", false))
+				ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("option \"symmetric\" can't be combined with \"incremental\" or \"partial_refresh\"")));
+			continue;
+		}
+		if (strcmp(def->defname, "sample_fraction") == 0) {
+			float fraction = (float) defGetNumeric(def);
+
+			if (fraction <= 0.0 || fraction > 1.0)
+				ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("option \"sample_fraction\" must be greater than 0 and at most 1")));
+			// A user left out of the sample would have no neighbors
+			// at all. The item-based and factor models still serve
+			// them, from their own events.
+			if (method == userCosCF || method == userPearCF)
+				ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("option \"%s\" isn't valid for user-based recommenders",
+						def->defname)));
+			if (recStmt->partitionkey)
+				ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("option \"sample_fraction\" can't be combined with PARTITION BY")));
+			// Their deltas come from every user's events, not the
+			// sample's.
+			if (getRecOptionBool(recStmt->options, "incremental", false) ||
+			    getRecOptionBool(recStmt->options, "partial_refresh", false))
+				ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("option \"sample_fraction\" can't be combined with \"incremental\" or \"partial_refresh\"")));
+			continue;
+		}
+		if (strcmp(def->defname, "notify_changes") == 0) {
+			if (defGetBoolean(def) &&
+			    getRecOptionInt(recStmt->options, "materialize", 0) == 0 &&
+			    getRecOptionInt(recStmt->options, "adaptive", 0) == 0)
+				ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("option \"notify_changes\" needs \"materialize\" or \"adaptive\"")));
+			continue;
+		}
+		if (strcmp(def->defname, "hybrid") == 0) {
+			if (defGetBoolean(def) &&
+			    getRecOptionInt(recStmt->options, "materialize", 0) == 0 &&
+			    getRecOptionInt(recStmt->options, "adaptive", 0) == 0)
+				ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("option \"hybrid\" needs \"materialize\" or \"adaptive\"")));
+			continue;
+		}
+		if (strcmp(def->defname, "neighborhood") == 0) {
+			if (FACTOR_METHOD(method))
+				ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("option \"%s\" is only valid for similarity-based recommenders",
+						def->defname)));
+			if (defGetInt64(def) < 0 || defGetInt64(def) > RECATHON_MAX_NEIGHBORHOOD)
+				ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("neighborhood must be between 0 and %d",
+						RECATHON_MAX_NEIGHBORHOOD)));
+			continue;
+		}
+		if (strcmp(def->defname, "min_support") == 0) {
+			if (FACTOR_METHOD(method))
+				ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("option \"%s\" is only valid for similarity-based recommenders",
+						def->defname)));
+			if (defGetInt64(def) < 0)
+				ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("min_support must not be negative")));
+			continue;
+		}
+		if (strcmp(def->defname, "min_similarity") == 0) {
+			double value = defGetNumeric(def);
+
+			if (FACTOR_METHOD(method))
+				ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("option \"%s\" is only valid for similarity-based recommenders",
+						def->defname)));
+			if (value < 0.0 || value > 1.0)
+				ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("min_similarity must be between 0 and 1")));
+			continue;
+		}
+		if (strcmp(def->defname, "lsh_bands") == 0 ||
+		    strcmp(def->defname, "lsh_rows") == 0) {
+			int64 value = defGetInt64(def);
+			int64 minimum = (strcmp(def->defname, "lsh_bands") == 0) ? 0 : 1;
+			int64 maximum = (strcmp(def->defname, "lsh_bands") == 0) ?
+				RECATHON_MAX_LSH_BANDS : RECATHON_MAX_LSH_ROWS;
+
+			if (FACTOR_METHOD(method))
+				ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("option \"%s\" is only valid for similarity-based recommenders",
+						def->defname)));
+			if (value < minimum || value > maximum)
+				ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("%s must be between %d and %d",
+						def->defname, (int) minimum, (int) maximum)));
+			continue;
+		}
+		if (strcmp(def->defname, "user_clusters") == 0 ||
+		    strcmp(def->defname, "cluster_probes") == 0) {
+			int64 value = defGetInt64(def);
+			int64 minimum = (strcmp(def->defname, "user_clusters") == 0) ? 0 : 1;
+			int64 maximum = (strcmp(def->defname, "user_clusters") == 0) ?
+				RECATHON_MAX_USER_CLUSTERS : RECATHON_MAX_CLUSTER_PROBES;
+
+			if (method != userCosCF && method != userPearCF)
+				ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("option \"%s\" is only valid for UserCosCF and UserPearCF recommenders",
+						def->defname)));
+			if (value < minimum || value > maximum)
+				ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("%s must be between %d and %d",
+						def->defname, (int) minimum, (int) maximum)));
+			// The clusters take the place of LSH, and every node
+			// sharing a build would have to find the same ones.
+			if (value > 0 && strcmp(def->defname, "user_clusters") == 0 &&
+			    (getRecOptionInt(recStmt->options, "lsh_bands", 0) > 0 ||
+			     getRecOptionString(recStmt->options, "build_nodes", NULL)))
+				ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("option \"user_clusters\" can't be combined with \"lsh_bands\" or \"build_nodes\"")));
+			continue;
+		}
+		if (strcmp(def->defname, "materialize") == 0 ||
+		    strcmp(def->defname, "adaptive") == 0) {
+			if (defGetInt64(def) < 0 || defGetInt64(def) > RECATHON_MAX_MATERIALIZE)
+				ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("%s must be between 0 and %d",
+						def->defname, RECATHON_MAX_MATERIALIZE)));
+			// Recommendations generated on the fly come from all of
+			// the events, so a recommender on some of them always
+			// keeps its model.
+			if (strcmp(def->defname, "adaptive") == 0 &&
+			    defGetInt64(def) > 0 && recStmt->eventfilter)
+				ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("option \"adaptive\" can't be combined with WHERE")));
+			continue;
+		}
+		if (strcmp(def->defname, "quantize") == 0) {
+			int64 bits = defGetInt64(def);
+
+			// Factors only come in halves.
+			if (FACTOR_METHOD(method) && bits != 16 && bits != RECATHON_FULL_PRECISION)
+				ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("quantize must be 16 or 32 for SVD and ALS recommenders")));
+			if (bits != 8 && bits != 16 && bits != RECATHON_FULL_PRECISION)
+				ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("quantize must be 8, 16 or 32")));
+			continue;
+		}
+
+		// Everything else is a training parameter for SVD or ALS,
+		// or sets up their approximate top-k index.
+		if (strcmp(def->defname, "features") != 0 &&
+				strcmp(def->defname, "ann_clusters") != 0 &&
+				strcmp(def->defname, "max_epochs") != 0 &&
+				strcmp(def->defname, "learning_rate") != 0 &&
+				strcmp(def->defname, "regularization") != 0 &&
+				strcmp(def->defname, "tolerance") != 0)
+			ereport(ERROR,
+				(errcode(ERRCODE_SYNTAX_ERROR),
+				 errmsg("unrecognized recommender option \"%s\"",
+					def->defname)));
+		if (strcmp(def->defname, "learning_rate") == 0 && method != SVD)
+			ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("option \"%s\" is only valid for SVD recommenders",
+					def->defname)));
+		if (!FACTOR_METHOD(method))
+			ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("option \"%s\" is only valid for SVD and ALS recommenders",
+					def->defname)));
+
+		if (strcmp(def->defname, "features") == 0) {
+			int64 features = defGetInt64(def);
+
+			if (features < 1 || features > RECATHON_MAX_FEATURES)
+				ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("features must be between 1 and %d",
+						RECATHON_MAX_FEATURES)));
+		} else if (strcmp(def->defname, "ann_clusters") == 0) {
+			if (defGetInt64(def) < 0)
+				ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("ann_clusters must not be negative")));
+		} else if (strcmp(def->defname, "max_epochs") == 0) {
+			if (defGetInt64(def) < 1)
+				ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("max_epochs must be at least 1")));
+		} else if (strcmp(def->defname, "learning_rate") == 0) {
+			if (defGetNumeric(def) <= 0)
+				ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("learning_rate must be greater than zero")));
+		} else if (defGetNumeric(def) < 0)
+			ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("%s must not be negative",
+					def->defname)));
+	}
+
+	// And return.
+	return method;
+}
+
+/* ----------------------------------------------------------------
+ *		getRecOptionInt
+ *
+ *		Looks up an integer option from the WITH clause of
+ *		a CREATE RECOMMENDER statement, returning the
+ *		default if it wasn't given.
+ * ----------------------------------------------------------------
+ */
+int
+getRecOptionInt(List *options, char *optname, int defaultval) {
+	ListCell *lc;
+
+	foreach(lc, options) {
+		DefElem *def = (DefElem*) lfirst(lc);
+
+		if (strcmp(def->defname, optname) == 0)
+			return (int) defGetInt64(def);
+	}
+
+	return defaultval;
+}
+
+/* ----------------------------------------------------------------
+ *		getRecOptionBool
+ *
+ *		The same as getRecOptionInt, for boolean options.
+ * ----------------------------------------------------------------
+ */
+bool
+getRecOptionBool(List *options, char *optname, bool defaultval) {
+	ListCell *lc;
+
+	foreach(lc, options) {
+		DefElem *def = (DefElem*) lfirst(lc);
+
+		if (strcmp(def->defname, optname) == 0)
+			return defGetBoolean(def);
+	}
+
+	return defaultval;
+}
+
+/* ----------------------------------------------------------------
+ *		getRecOptionFloat
+ *
+ *		The same as getRecOptionInt, for numeric options.
+ * ----------------------------------------------------------------
+ */
+float
+getRecOptionFloat(List *options, char *optname, float defaultval) {
+	ListCell *lc;
+
+	foreach(lc, options) {
+		DefElem *def = (DefElem*) lfirst(lc);
+
+		if (strcmp(def->defname, optname) == 0)
+			return (float) defGetNumeric(def);
+	}
+
+	return defaultval;
+}
+
+/* ----------------------------------------------------------------
+ *		getRecOptionString
+ *
+ *		The same as getRecOptionInt, for string options.
+ * ----------------------------------------------------------------
+ */
+char *
+getRecOptionString(List *options, char *optname, char *defaultval) {
+	ListCell *lc;
+
+	foreach(lc, options) {
+		DefElem *def = (DefElem*) lfirst(lc);
+
+		if (strcmp(def->defname, optname) == 0)
+			return defGetString(def);
+	}
+
+	return defaultval;
+}
+
+/* ----------------------------------------------------------------
+ *		getSimParams
+ *
+ *		Fills in the build parameters for a similarity model
+ *		from the WITH clause of a CREATE RECOMMENDER statement.
+ *		By default, everything is built exactly, with as many
+ *		processes as the build picks for its size.
+ * ----------------------------------------------------------------
+ */
+void
+getSimParams(List *options, sim_params *params) {
+	params->numWorkers = getRecOptionInt(options, "parallel_workers", 0);
+	params->neighborhood = getRecOptionInt(options, "neighborhood", 0);
+	params->minSupport = getRecOptionInt(options, "min_support", 0);
+	params->minSimilarity = getRecOptionFloat(options, "min_similarity", 0.0);
+	params->lshBands = getRecOptionInt(options, "lsh_bands", 0);
+	params->lshRows = getRecOptionInt(options, "lsh_rows", 4);
+	params->userClusters = getRecOptionInt(options, "user_clusters", 0);
+	params->clusterProbes = getRecOptionInt(options, "cluster_probes", 3);
+	params->buildNodes = getRecOptionString(options, "build_nodes", NULL);
+	params->vectorStore = NULL;
+	params->shard = 0;
+	params->numShards = 1;
+	params->strategy[0] = '\0';
+}
+
+/* ----------------------------------------------------------------
+ *		getSVDparams
+ *
+ *		Fills in SVD or ALS training parameters from the
+ *		WITH clause of a CREATE RECOMMENDER statement.
+ *		Anything not given keeps the values SVD has always
+ *		used. ALS converges in far fewer iterations, and
+ *		scales its penalty by each row's number of events,
+ *		so it has defaults of its own for those.
+ * ----------------------------------------------------------------
+ */
+void
+getSVDparams(List *options, recMethod method, svd_params *params) {
+	params->numFeatures = getRecOptionInt(options, "features", 50);
+	params->learnRate = getRecOptionFloat(options, "learning_rate", 0.001);
+	params->tolerance = getRecOptionFloat(options, "tolerance", 0.0);
+	if (method == ALS) {
+		params->maxEpochs = getRecOptionInt(options, "max_epochs", 10);
+		params->penalty = getRecOptionFloat(options, "regularization", 0.05);
+	} else {
+		params->maxEpochs = getRecOptionInt(options, "max_epochs", 100);
+		params->penalty = getRecOptionFloat(options, "regularization", 0.002);
+	}
+	params->warmUserModel = NULL;
+	params->warmItemModel = NULL;
+	params->warmStart = false;
+}
+
+/* ----------------------------------------------------------------
+ *		getRecMethod
+ *
+ *		Get the method in recMethod form.
+ * ----------------------------------------------------------------
+ */
+recMethod
+getRecMethod(char *method) {
+	if (!method) return -1;
+
+	if (strcmp("itemcoscf",method) == 0)
+		return itemCosCF;
+	else if (strcmp("itempearcf",method) == 0)
+		return itemPearCF;
+	else if (strcmp("usercoscf",method) == 0)
+		return userCosCF;
+	else if (strcmp("userpearcf",method) == 0)
+		return userPearCF;
+	else if (strcmp("svd",method) == 0)
+		return SVD;
+	else if (strcmp("als",method) == 0)
+		return ALS;
+	else if (strcmp("itemjaccardcf",method) == 0)
+		return itemJaccardCF;
+	else
+		return -1;
+}
+
+/* ----------------------------------------------------------------
+ *		recMethodName
+ *
+ *		The name getRecMethod knows any method by.
+ * ----------------------------------------------------------------
+ */
+char *
+recMethodName(recMethod method) {
+	switch (method) {
+		case SVD:
+			return "svd";
+		case ALS:
+			return "als";
+		case itemCosCF:
+		case itemPearCF:
+		case itemJaccardCF:
+		case userCosCF:
+		case userPearCF:
+			return simMethodName(method);
+		default:
+			return "unknown";
+	}
+}
+
+/* ----------------------------------------------------------------
+ *		simMethodName
+ *
+ *		The name getRecMethod knows a similarity method by.
+ * ----------------------------------------------------------------
+ */
+static char *
+simMethodName(recMethod method) {
+	switch (method) {
+		case itemCosCF:
+			return "itemcoscf";
+		case itemPearCF:
+			return "itempearcf";
+		case itemJaccardCF:
+			return "itemjaccardcf";
+		case userCosCF:
+			return "usercoscf";
+		case userPearCF:
+			return "userpearcf";
+		default:
+			elog(ERROR, "recommendation method %d has no similarity model", (int) method);
+	}
+
+	return NULL;
+}
+
+/* ----------------------------------------------------------------
+ *		getUpdateThreshold
+ *
+ *		Get the update threshold.
+ * ----------------------------------------------------------------
+ */
+static float
+getUpdateThreshold() {
+	float threshold = -1;
+	RangeVar *testrv;
+	// Query information.
+	char *querystring;
+	QueryDesc *queryDesc;
+	PlanState *planstate;
+	TupleTableSlot *slot;
+	CachedPlan *cplan;
+	MemoryContext recathoncontext;
+
+	testrv = makeRangeVar(NULL,"recdbproperties",0);
+	if (!relationExists(testrv)) {
+		pfree(testrv);
+		return -1;
+	}
+	pfree(testrv);
+
+	querystring = (char*) palloc(128*sizeof(char));
+	sprintf(querystring,"SELECT update_threshold FROM recdbproperties;");
+	queryDesc = recathon_queryStartCached(querystring,0,NULL,NULL,&cplan,&recathoncontext);
+	planstate = queryDesc->planstate;
+
+	slot = ExecProcNode(planstate);
+	if (TupIsNull(slot)) {
+		recathon_queryEndCached(queryDesc,cplan,recathoncontext);
+		pfree(querystring);
+		return -1;
+	}
+
+	threshold = getTupleFloat(slot,"update_threshold");
+
+	recathon_queryEndCached(queryDesc,cplan,recathoncontext);
+	pfree(querystring);
+
+	return threshold;
+}
+
+/* ----------------------------------------------------------------
+ *		refreshPolicyColumns
+ *
+ *		Whether the RecModelsCatalogue has the columns for
+ *		refresh policies. Catalogues from before them don't,
+ *		until a recommender is given a policy.
+ * ----------------------------------------------------------------
+ */
+static bool
+refreshPolicyColumns() {
+	bool exists;
+	RangeVar *cataloguerv;
+
+	cataloguerv = makeRangeVar(NULL,"recmodelscatalogue",0);
+	exists = columnExistsInRelation("refreshrequested",cataloguerv);
+	pfree(cataloguerv);
+
+	return exists;
+}
+
+/* ----------------------------------------------------------------
+ *		addRefreshPolicyColumns
+ *
+ *		Adds the refresh policy columns to a catalogue that
+ *		doesn't have them. A recommender with nothing in them
+ *		follows the global update threshold, whenever it
+ *		likes, which is how they all used to behave.
+ * ----------------------------------------------------------------
+ */
+static void
+addRefreshPolicyColumns() {
+	char *policycolumns[] = {"refreshthreshold", "refreshinterval", "refreshwindowstart", "refreshwindowend", "lastrefresh", "refreshrequested"};
+	char *policytypes[] = {"REAL", "INTERVAL", "TIME", "TIME", "TIMESTAMPTZ", "INTEGER NOT NULL DEFAULT 0"};
+	char querystring[256];
+	RangeVar *cataloguerv;
+	int c;
+
+	cataloguerv = makeRangeVar(NULL,"recmodelscatalogue",0);
+	for (c = 0; c < lengthof(policycolumns); c++) {
+		if (columnExistsInRelation(policycolumns[c],cataloguerv))
+			continue;
+		sprintf(querystring,"ALTER TABLE RecModelsCatalogue ADD COLUMN %s %s;",
+			policycolumns[c],policytypes[c]);
+		recathon_utilityExecute(querystring);
+	}
+	pfree(cataloguerv);
+
+	CommandCounterIncrement();
+}
+
+/* ----------------------------------------------------------------
+ *		getRefreshPolicy
+ *
+ *		Works out when a recommender may be rebuilt. It goes
+ *		by its own update threshold if it has one, and the
+ *		global one if not. A rebuild for new events is only
+ *		due once the minimum interval has passed since the
+ *		last one, and only in the maintenance window, which
+ *		can run past midnight. We also say whether someone
+ *		has asked for a rebuild on the next pass.
+ * ----------------------------------------------------------------
+ */
+static void
+getRefreshPolicy(char *recindexname, float update_threshold,
+		float *ret_threshold, bool *ret_due, bool *ret_requested) {
+	char *querystring;
+	QueryDesc *queryDesc;
+	TupleTableSlot *slot;
+	MemoryContext recathoncontext;
+
+	*ret_threshold = update_threshold;
+	*ret_due = true;
+	*ret_requested = false;
+	if (!refreshPolicyColumns())
+		return;
+
+	querystring = (char*) palloc(1024*sizeof(char));
+	sprintf(querystring,"SELECT coalesce(refreshthreshold, -1) AS threshold, refreshrequested, CASE WHEN (refreshinterval IS NULL OR lastrefresh IS NULL OR now() - lastrefresh >= refreshinterval) AND (refreshwindowstart IS NULL OR CASE WHEN refreshwindowstart <= refreshwindowend THEN localtime BETWEEN refreshwindowstart AND refreshwindowend ELSE localtime >= refreshwindowstart OR localtime <= refreshwindowend END) THEN 1 ELSE 0 END AS due FROM RecModelsCatalogue WHERE recommenderindexname = '%s';",
+		recindexname);
+	queryDesc = recathon_queryStart(querystring,&recathoncontext);
+
+	slot = ExecProcNode(queryDesc->planstate);
+	if (!TupIsNull(slot)) {
+		float threshold = getTupleFloat(slot,"threshold");
+
+		if (threshold >= 0.0)
+			*ret_threshold = threshold;
+		*ret_due = (getTupleInt(slot,"due") != 0);
+		*ret_requested = (getTupleInt(slot,"refreshrequested") != 0);
+	}
+
+	recathon_queryEnd(queryDesc,recathoncontext);
+	pfree(querystring);
+}
+
+/* ----------------------------------------------------------------
+ *		noteRefresh
+ *
+ *		Records that a recommender has been seen to, so any
+ *		request for a rebuild is cleared, and if it was
+ *		rebuilt, its minimum interval starts again.
+ * ----------------------------------------------------------------
+ */
+static void
+noteRefresh(char *recindexname, bool rebuilt) {
+	char querystring[1024];
+
+	if (!refreshPolicyColumns())
+		return;
+
+	if (rebuilt)
+		sprintf(querystring,"UPDATE RecModelsCatalogue SET refreshrequested = 0, lastrefresh = now() WHERE recommenderindexname = '%s';",
+			recindexname);
+	else
+		sprintf(querystring,"UPDATE RecModelsCatalogue SET refreshrequested = 0 WHERE recommenderindexname = '%s';",
+			recindexname);
+	recathon_queryExecute(querystring);
+}
+
+/* ----------------------------------------------------------------
+ *		createModelTable
+ *
+ *		Creates a new, empty model table for a recommender,
+ *		and returns its name. Names are made unique with a
+ *		timestamp, the same way CREATE RECOMMENDER does it.
+ *		The table is unlogged if the recommender's are.
+ *		For SVD and ALS, itemside picks the item model rather than
+ *		the user model.
+ * ----------------------------------------------------------------
+ */
+char*
+createModelTable(char *recname, recMethod method, bool itemside) {
+	char *modelname, *querystring, *persistence;
+	struct timeval timestamp;
+
+	gettimeofday(&timestamp,NULL);
+	modelname = (char*) palloc(256*sizeof(char));
+	querystring = (char*) palloc(1024*sizeof(char));
+
+	// A model can always be rebuilt from the events, so it needn't
+	// be written to WAL if the recommender says so.
+	sprintf(modelname,"%sIndex",recname);
+	persistence = getRecUnlogged(modelname) ? "UNLOGGED " : "";
+
+	switch (method) {
+		case itemCosCF:
+		case itemPearCF:
+		case itemJaccardCF:
+			sprintf(modelname,"%sModel%ld%ld",recname,
+				timestamp.tv_sec,timestamp.tv_usec);
+			sprintf(querystring,"CREATE %sTABLE %s (item1 INTEGER NOT NULL, item2 INTEGER NOT NULL, similarity REAL NOT NULL);",
+				persistence,modelname);
+			break;
+		case userCosCF:
+		case userPearCF:
+			sprintf(modelname,"%sModel%ld%ld",recname,
+				timestamp.tv_sec,timestamp.tv_usec);
+			sprintf(querystring,"CREATE %sTABLE %s (user1 INTEGER NOT NULL, user2 INTEGER NOT NULL, similarity REAL NOT NULL);",
+				persistence,modelname);
+			break;
+		case SVD:
+		case ALS:
+			if (itemside) {
+				sprintf(modelname,"%sItemModel%ld%ld",recname,
+					timestamp.tv_sec,timestamp.tv_usec);
+				sprintf(querystring,"CREATE %sTABLE %s (items INTEGER NOT NULL, features REAL[] NOT NULL);",
+					persistence,modelname);
+			} else {
+				sprintf(modelname,"%sUserModel%ld%ld",recname,
+					timestamp.tv_sec,timestamp.tv_usec);
+				sprintf(querystring,"CREATE %sTABLE %s (users INTEGER NOT NULL, features REAL[] NOT NULL);",
+					persistence,modelname);
+			}
+			break;
+		default:
+			elog(ERROR, "invalid recommendation method in createModelTable()");
+	}
+
+	recathon_utilityExecute(querystring);
+	pfree(querystring);
+
+	return modelname;
+}
+
+/* ----------------------------------------------------------------
+ *		recathon_resetEventTables
+ *
+ *		Transaction callbacks that forget which tables the
+ *		INSERT hook has already looked at. The table itself
+ *		lives in TopTransactionContext, so it's freed for us.
+ *		Once the transaction commits, the cached recommendations
+ *		of the users who have new events are thrown out first,
+ *		the users are queued for recathon_prewarm, and the
+ *		tables are marked to be counted again. If it aborts,
+ *		the notifications we claimed were never sent, so we
+ *		give them back.
+ *		On subtransaction abort our notifications are thrown
+ *		away, so they have to be sent again; the users we kept
+ *		are only thrown out for nothing.
+ * ----------------------------------------------------------------
+ */
+static void
+recathon_resetEventTables(XactEvent event, void *arg) {
+	HASH_SEQ_STATUS status;
+	RecathonEventEntry *entry;
+	int i;
+
+	if (event == XACT_EVENT_ABORT && recathon_event_tables) {
+		hash_seq_init(&status, recathon_event_tables);
+		while ((entry = (RecathonEventEntry *) hash_seq_search(&status)) != NULL) {
+			if (entry->claimed)
+				recathonEventsReleaseNotify(entry->eventrelid);
+		}
+	}
+
+	if (event == XACT_EVENT_COMMIT && recathon_event_tables) {
+		hash_seq_init(&status, recathon_event_tables);
+		while ((entry = (RecathonEventEntry *) hash_seq_search(&status)) != NULL) {
+			if (entry->inserted)
+				recathonEventsCommitted(entry->eventrelid);
+			if (entry->allUsers)
+				recathonResultInvalidateTable(entry->eventtable);
+			else {
+				for (i = 0; i < entry->numUsers; i++) {
+					recathonResultInvalidate(entry->eventtable, entry->users[i]);
+					recathonPrewarmQueue(entry->eventtable, entry->users[i]);
+				}
+			}
+		}
+	}
+	recathon_event_tables = NULL;
+}
+
+static void
+recathon_resetEventTablesSub(SubXactEvent event, SubTransactionId mySubid,
+							SubTransactionId parentSubid, void *arg) {
+	HASH_SEQ_STATUS status;
+	RecathonEventEntry *entry;
+
+	if (event == SUBXACT_EVENT_ABORT_SUB && recathon_event_tables) {
+		hash_seq_init(&status, recathon_event_tables);
+		while ((entry = (RecathonEventEntry *) hash_seq_search(&status)) != NULL) {
+			if (entry->claimed)
+				recathonEventsReleaseNotify(entry->eventrelid);
+			entry->notified = false;
+			entry->claimed = false;
+		}
+	}
+}
+
+/* ----------------------------------------------------------------
+ *		isEventTable
+ *
+ *		Returns true if some recommender has been built on
+ *		the given table.
+ * ----------------------------------------------------------------
+ */
+static bool
+isEventTable(char *tablename) {
+	char *recindexname;
+
+	recindexname = builtRecommender(tablename, NULL, false);
+	if (!recindexname)
+		return false;
+	pfree(recindexname);
+	return true;
+}
+
+/* ----------------------------------------------------------------
+ *		inheritanceParents
+ *
+ *		Returns the OIDs of the tables the given one inherits
+ *		from directly, as read from pg_inherits.
+ * ----------------------------------------------------------------
+ */
+static List *
+inheritanceParents(Oid relid) {
+	List *parents = NIL;
+	Relation inhrel;
+	SysScanDesc scan;
+	ScanKeyData key;
+	HeapTuple tuple;
+
+	inhrel = heap_open(InheritsRelationId, AccessShareLock);
+	ScanKeyInit(&key, Anum_pg_inherits_inhrelid,
+		BTEqualStrategyNumber, F_OIDEQ, ObjectIdGetDatum(relid));
+	scan = systable_beginscan(inhrel, InheritsRelidSeqnoIndexId, true,
+		SnapshotNow, 1, &key);
+	while ((tuple = systable_getnext(scan)) != NULL)
+		parents = lappend_oid(parents,
+			((Form_pg_inherits) GETSTRUCT(tuple))->inhparent);
+	systable_endscan(scan);
+	heap_close(inhrel, AccessShareLock);
+
+	return parents;
+}
+
+/* ----------------------------------------------------------------
+ *		inheritanceAncestors
+ *
+ *		Returns the names of every table the given one
+ *		inherits from, nearest first.
+ * ----------------------------------------------------------------
+ */
+static List *
+inheritanceAncestors(Oid relid) {
+	List *pending, *seen = NIL, *names = NIL;
+
+	pending = inheritanceParents(relid);
+	while (pending != NIL) {
+		Oid parent = linitial_oid(pending);
+		char *parentname;
+
+		pending = list_delete_first(pending);
+		if (list_member_oid(seen, parent))
+			continue;
+		seen = lappend_oid(seen, parent);
+
+		parentname = get_rel_name(parent);
+		if (parentname)
+			names = lappend(names, parentname);
+		pending = list_concat(pending, inheritanceParents(parent));
+	}
+	list_free(seen);
+
+	return names;
+}
+
+/* ----------------------------------------------------------------
+ *		partitionEventTable
+ *
+ *		If a table is a partition of an events table, made
+ *		with inheritance, returns the name of the events
+ *		table, and NULL otherwise. Rows inserted straight
+ *		into the partition are new events of that table.
+ * ----------------------------------------------------------------
+ */
+static char *
+partitionEventTable(char *tablename) {
+	Oid relid;
+	List *ancestors;
+	ListCell *lc;
+	char *eventtable = NULL;
+
+	relid = RelnameGetRelid(tablename);
+	if (!OidIsValid(relid))
+		return NULL;
+
+	ancestors = inheritanceAncestors(relid);
+	foreach(lc, ancestors) {
+		if (isEventTable((char*) lfirst(lc))) {
+			eventtable = pstrdup((char*) lfirst(lc));
+			break;
+		}
+	}
+	list_free_deep(ancestors);
+
+	return eventtable;
+}
+
+/* ----------------------------------------------------------------
+ *		lookupEventTable
+ *
+ *		Finds what the INSERT hook knows of a table in this
+ *		transaction, looking it up the first time.
+ * ----------------------------------------------------------------
+ */
+static RecathonEventEntry *
+lookupEventTable(char *tablename) {
+	char key[NAMEDATALEN];
+	RecathonEventEntry *entry;
+	bool found;
+
+	if (!recathon_callbacks_registered) {
+		RegisterXactCallback(recathon_resetEventTables, NULL);
+		RegisterSubXactCallback(recathon_resetEventTablesSub, NULL);
+		recathon_callbacks_registered = true;
+	}
+
+	if (recathon_event_tables == NULL) {
+		HASHCTL ctl;
+
+		MemSet(&ctl, 0, sizeof(ctl));
+		ctl.keysize = NAMEDATALEN;
+		ctl.entrysize = sizeof(RecathonEventEntry);
+		ctl.hcxt = TopTransactionContext;
+		recathon_event_tables = hash_create("Recathon event tables", 16,
+			&ctl, HASH_ELEM | HASH_CONTEXT);
+	}
+
+	MemSet(key, 0, NAMEDATALEN);
+	strlcpy(key, tablename, NAMEDATALEN);
+	entry = (RecathonEventEntry *) hash_search(recathon_event_tables,
+		key, HASH_ENTER, &found);
+	if (!found) {
+		entry->isEventTable = isEventTable(tablename);
+		strlcpy(entry->eventtable, tablename, NAMEDATALEN);
+		if (!entry->isEventTable && catalogueRelid() != InvalidOid) {
+			char *eventtable = partitionEventTable(tablename);
+
+			if (eventtable) {
+				entry->isEventTable = true;
+				strlcpy(entry->eventtable, eventtable, NAMEDATALEN);
+				pfree(eventtable);
+			}
+		}
+		entry->eventrelid = RelnameGetRelid(entry->eventtable);
+		entry->notified = false;
+		entry->claimed = false;
+		entry->inserted = false;
+		entry->watched = !entry->isEventTable &&
+			recathonEventsWatched(entry->eventrelid);
+		entry->numUserAtts = -1;
+		entry->numUsers = 0;
+		entry->allUsers = false;
+	}
+	return entry;
+}
+
+/* ----------------------------------------------------------------
+ *		updateCellCounter
+ *
+ *		Happens at the end of every INSERT or COPY FROM
+ *		statement that added rows. If the table is an
+ *		events table that we've built a recommender on, we
+ *		queue a notification for the maintenance process,
+ *		which will update the counters and rebuild models
+ *		once the transaction commits. Each table is only
+ *		looked at once per transaction, and once some
+ *		transaction has notified, the others leave it until
+ *		the next maintenance pass over the table, so they
+ *		don't all queue up to commit their notifications.
+ * ----------------------------------------------------------------
+ */
+void
+updateCellCounter(char *eventtable) {
+	RecathonEventEntry *entry;
+
+	entry = lookupEventTable(eventtable);
+	if (!entry->isEventTable) {
+		if (entry->watched)
+			entry->inserted = true;
+		return;
+	}
+
+	entry->inserted = true;
+	if (!entry->notified) {
+		if (recathonEventsClaimNotify(entry->eventrelid)) {
+			Async_Notify(RECATHON_MAINTENANCE_CHANNEL, entry->eventtable);
+			entry->claimed = true;
+		}
+		entry->notified = true;
+	}
+}
+
+/* ----------------------------------------------------------------
+ *		findEventUserKeys
+ *
+ *		Works out which columns of an events table hold the
+ *		users, for all of the recommenders built on it. If
+ *		there are more than we can keep track of, every
+ *		insert throws out all of the table's cached lists.
+ * ----------------------------------------------------------------
+ */
+static void
+findEventUserKeys(RecathonEventEntry *entry, Relation rel) {
+	Oid paramtypes[1];
+	Datum values[1];
+	QueryDesc *queryDesc;
+	TupleTableSlot *slot;
+	CachedPlan *cplan;
+	MemoryContext recathoncontext;
+
+	entry->numUserAtts = 0;
+	paramtypes[0] = TEXTOID;
+	values[0] = CStringGetTextDatum(entry->eventtable);
+	queryDesc = recathon_queryStartCached("SELECT DISTINCT userkey FROM RecModelsCatalogue WHERE eventtable = $1;",
+		1,paramtypes,values,&cplan,&recathoncontext);
+	for (;;) {
+		char *userkey;
+		int i;
+
+		slot = ExecProcNode(queryDesc->planstate);
+		if (TupIsNull(slot)) break;
+
+		userkey = getTupleString(slot,"userkey");
+		for (i = 0; i < RelationGetNumberOfAttributes(rel); i++) {
+			Form_pg_attribute att = RelationGetDescr(rel)->attrs[i];
+
+			if (!att->attisdropped && att->atttypid == INT4OID &&
+			    strcmp(NameStr(att->attname), userkey) == 0)
+				break;
+		}
+		if (i >= RelationGetNumberOfAttributes(rel) ||
+		    entry->numUserAtts >= RECATHON_EVENT_USERKEYS)
+			entry->allUsers = true;
+		else
+			entry->userAtts[entry->numUserAtts++] = i + 1;
+		pfree(userkey);
+	}
+	recathon_queryEndCached(queryDesc,cplan,recathoncontext);
+	pfree(DatumGetPointer(values[0]));
+}
+
+/* ----------------------------------------------------------------
+ *		recordEventUser
+ *
+ *		Happens for every row an INSERT or COPY FROM adds,
+ *		when the result cache is on. If the table is an events
+ *		table, we remember whose events these are, so that
+ *		their cached recommendations are thrown out when the
+ *		transaction commits.
+ * ----------------------------------------------------------------
+ */
+void
+recordEventUser(Relation rel, HeapTuple tuple) {
+	RecathonEventEntry *entry;
+	int i, j;
+
+	if (!recathonResultCacheEnabled())
+		return;
+
+	entry = lookupEventTable(RelationGetRelationName(rel));
+	if (!entry->isEventTable || entry->allUsers)
+		return;
+	if (entry->numUserAtts < 0)
+		findEventUserKeys(entry, rel);
+
+	for (i = 0; i < entry->numUserAtts && !entry->allUsers; i++) {
+		Datum value;
+		bool isnull;
+		int userID;
+
+		value = heap_getattr(tuple, entry->userAtts[i],
+			RelationGetDescr(rel), &isnull);
+		if (isnull)
+			continue;
+		userID = DatumGetInt32(value);
+
+		for (j = 0; j < entry->numUsers; j++) {
+			if (entry->users[j] == userID)
+				break;
+		}
+		if (j < entry->numUsers)
+			continue;
+		if (entry->numUsers >= RECATHON_EVENT_USERS)
+			entry->allUsers = true;
+		else
+			entry->users[entry->numUsers++] = userID;
+	}
+}
+
+/* ----------------------------------------------------------------
+ *		chooseRecLevel
+ *
+ *		The adaptive materialization policy. What decides it
+ *		is how many queries we expect between two rebuilds of
+ *		the model. Generating a recommendation on the fly
+ *		costs about as much as building the model, so the
+ *		model is worth keeping once it will be queried more
+ *		than once before it is rebuilt. Filling the RecView
+ *		costs about a query for every user, so that's worth
+ *		it once there are more queries than users between
+ *		rebuilds. We only move once the workload is well past
+ *		either point. Without any queries or updates, there's
+ *		nothing to go on, and we stay where we are.
+ * ----------------------------------------------------------------
+ */
+static int
+chooseRecLevel(int level, float queryRate, float updateRate,
+		float update_threshold, int eventtotal, int numUsers) {
+	float perRebuild, modelPoint, viewPoint;
+
+	if (queryRate <= 0.0 && updateRate <= 0.0)
+		return level;
+
+	// Without updates, the model is never rebuilt.
+	if (updateRate <= 0.0)
+		perRebuild = FLT_MAX;
+	else
+		perRebuild = queryRate * update_threshold * Max(eventtotal, 1) / updateRate;
+
+	if (level == RECATHON_LEVEL_GENERATE)
+		modelPoint = RECATHON_LEVEL_HYSTERESIS;
+	else
+		modelPoint = 1.0 / RECATHON_LEVEL_HYSTERESIS;
+	if (level == RECATHON_LEVEL_VIEW)
+		viewPoint = numUsers / RECATHON_LEVEL_HYSTERESIS;
+	else
+		viewPoint = numUsers * RECATHON_LEVEL_HYSTERESIS;
+
+	if (perRebuild >= viewPoint)
+		return RECATHON_LEVEL_VIEW;
+	if (perRebuild >= modelPoint)
+		return RECATHON_LEVEL_MODEL;
+	return RECATHON_LEVEL_GENERATE;
+}
+
+/* ----------------------------------------------------------------
+ *		recathonStatName
+ *
+ *		Works out the name the statistics collector knows a
+ *		recommender by from its index table's name, which is
+ *		the recommender's name with "Index" on the end. We
+ *		fold case, since both come to us either way.
+ * ----------------------------------------------------------------
+ */
+void
+recathonStatName(char *recindexname, char *statname) {
+	int i, len;
+
+	len = strlen(recindexname);
+	if (len > 5 && pg_strcasecmp(recindexname + len - 5, "index") == 0)
+		len -= 5;
+	if (len >= NAMEDATALEN)
+		len = NAMEDATALEN - 1;
+
+	MemSet(statname, 0, NAMEDATALEN);
+	for (i = 0; i < len; i++)
+		statname[i] = pg_tolower((unsigned char) recindexname[i]);
+}
+
+/* ----------------------------------------------------------------
+ *		recModelDiskSize
+ *
+ *		How much disk a recommender's model takes up: its
+ *		model tables, with their indexes, and its model file
+ *		if it has one.
+ * ----------------------------------------------------------------
+ */
+static int64
+recModelDiskSize(char *recindexname, char *modelname,
+			char *modelname2, char *clustername) {
+	int64 size = 0;
+	struct stat st;
+	char *path;
+	bool isnull;
+	Datum value;
+	StringInfoData querystring;
+	QueryDesc *queryDesc;
+	TupleTableSlot *slot;
+	MemoryContext recathoncontext;
+
+	initStringInfo(&querystring);
+	appendStringInfo(&querystring,"SELECT pg_total_relation_size('%s')",modelname);
+	if (modelname2)
+		appendStringInfo(&querystring," + pg_total_relation_size('%s')",modelname2);
+	if (clustername)
+		appendStringInfo(&querystring," + pg_total_relation_size('%s')",clustername);
+	appendStringInfoString(&querystring," AS size;");
+
+	queryDesc = recathon_queryStart(querystring.data,&recathoncontext);
+	slot = ExecProcNode(queryDesc->planstate);
+	if (!TupIsNull(slot)) {
+		value = slot_getattr(slot, 1, &isnull);
+		if (!isnull)
+			size = DatumGetInt64(value);
+	}
+	recathon_queryEnd(queryDesc,recathoncontext);
+	pfree(querystring.data);
+
+	path = modelFilePath(recindexname, false);
+	if (stat(path, &st) == 0)
+		size += st.st_size;
+	pfree(path);
+
+	return size;
+}
+
+/* A recommender, and how urgently its model wants rebuilding. */
+typedef struct rebuild_rank {
+	char *recindexname;
+	double priority;
+} rebuild_rank;
+
+static int
+rebuildRankCompare(const void *a, const void *b) {
+	const rebuild_rank *ra = (const rebuild_rank *) a;
+	const rebuild_rank *rb = (const rebuild_rank *) b;
+
+	if (ra->priority > rb->priority)
+		return -1;
+	if (ra->priority < rb->priority)
+		return 1;
+	return strcmp(ra->recindexname, rb->recindexname);
+}
+
+/* ----------------------------------------------------------------
+ *		rebuildOrder
+ *
+ *		Ranks the recommenders on the given events table by
+ *		how urgently they want rebuilding, and returns an
+ *		ORDER BY clause that puts the catalogue's rows for
+ *		them in that order. Urgency is the share of the
+ *		model's events that have come in since it was built
+ *		times how often it's queried, so a stale model that
+ *		nobody asks for waits behind a busy one that's only
+ *		a little behind. The counts and rates are those of
+ *		the last pass, with numRows the table's size now.
+ * ----------------------------------------------------------------
+ */
+static char *
+rebuildOrder(char *eventtable, int numRows) {
+	int i, numRecs;
+	char querystring[1024];
+	List *indexnames = NIL;
+	ListCell *lc;
+	rebuild_rank *ranks;
+	StringInfoData order;
+	// Query information.
+	QueryDesc *queryDesc;
+	TupleTableSlot *slot;
+	MemoryContext recathoncontext;
+
+	sprintf(querystring,"SELECT recommenderindexname FROM RecModelsCatalogue WHERE eventtable = '%s';",
+		eventtable);
+	queryDesc = recathon_queryStart(querystring,&recathoncontext);
+	for (;;) {
+		slot = ExecProcNode(queryDesc->planstate);
+		if (TupIsNull(slot)) break;
+		indexnames = lappend(indexnames, getTupleString(slot,"recommenderindexname"));
+	}
+	recathon_queryEnd(queryDesc,recathoncontext);
+
+	// With one recommender, there's nothing to put in order.
+	initStringInfo(&order);
+	numRecs = list_length(indexnames);
+	if (numRecs < 2) {
+		list_free_deep(indexnames);
+		return order.data;
+	}
+
+	ranks = (rebuild_rank*) palloc(numRecs*sizeof(rebuild_rank));
+	i = 0;
+	foreach(lc, indexnames) {
+		double numbers[3];
+		double newEvents, eventtotal;
+		char *eventsource;
+
+		ranks[i].recindexname = (char *) lfirst(lc);
+		sprintf(querystring,"SELECT updatecounter, eventtotal, queryrate FROM %s;",
+			ranks[i].recindexname);
+		queryNumbers(querystring, numbers, 3);
+		newEvents = isnan(numbers[0]) ? 0.0 : numbers[0];
+		eventtotal = isnan(numbers[1]) ? 0.0 : numbers[1];
+
+		// A recommender on the whole table has at least the rows
+		// it's short of; one on a window of it only has last
+		// pass's count to go on.
+		eventsource = getRecEventSource(ranks[i].recindexname, eventtable);
+		if (strcmp(eventsource, eventtable) == 0)
+			newEvents = Max(newEvents, (double) numRows - eventtotal);
+		pfree(eventsource);
+
+		ranks[i].priority = newEvents / Max(eventtotal, 1.0) *
+			((isnan(numbers[2]) ? 0.0 : Max(numbers[2], 0.0)) +
+			 RECATHON_IDLE_QUERY_RATE);
+		i++;
+	}
+	qsort(ranks, numRecs, sizeof(rebuild_rank), rebuildRankCompare);
+
+	appendStringInfoString(&order," ORDER BY CASE recommenderindexname");
+	for (i = 0; i < numRecs; i++)
+		appendStringInfo(&order," WHEN '%s' THEN %d",ranks[i].recindexname,i);
+	appendStringInfo(&order," ELSE %d END",numRecs);
+
+	pfree(ranks);
+	list_free_deep(indexnames);
+	return order.data;
+}
+
+/* ----------------------------------------------------------------
+ *		maintainRecommenders
+ *
+ *		Brings every recommender built on the given events
+ *		table up to date. The number of new events is however
+ *		many rows the table has beyond what the model was
+ *		built from; once that passes the update threshold,
+ *		we rebuild. Returns the number of models rebuilt.
+ *
+ *		A recommender can have a threshold of its own, and
+ *		can hold its rebuilds to a minimum interval and a
+ *		time of day (see getRefreshPolicy). Given an index
+ *		name, only that recommender is looked at, and with
+ *		force, it's rebuilt however few events have come
+ *		in, as it is if ALTER RECOMMENDER ... REFRESH
+ *		CONCURRENTLY asked for it. Recommenders rebuilt on the
+ *		same pass from the same events and columns share one
+ *		read of them (see readEvents).
+ *
+ *		So that a burst of events on a table with many
+ *		recommenders doesn't set off a rebuild of every one
+ *		of them at once, the pass looks at the most urgent
+ *		first (see rebuildOrder), and rebuilds at most
+ *		recathon_max_rebuilds of them for new events. The
+ *		rest stay due, and the pass asks for another one to
+ *		get to them. Rebuilds that were asked for, or that
+ *		replace a lost model, don't count against the limit.
+ *
+ *		Each pass also measures how quickly each recommender
+ *		is being queried and updated, and keeps a smoothed
+ *		rate of both in its index table. For recommenders
+ *		built with the adaptive option, chooseRecLevel uses
+ *		these to decide how much of it to materialize. The
+ *		queries come from the statistics collector; the index
+ *		table's querycounter holds how many it had counted as
+ *		of the last pass. What we did is reported back to the
+ *		collector for pg_stat_recommenders.
+ * ----------------------------------------------------------------
+ */
+static int
+maintainRecommenders(char *eventtable, char *onlyindexname, bool force) {
+	int numRows, numRebuilt, numDue;
+	bool deferred;
+	char *order;
+	float update_threshold;
+	RangeVar *cataloguerv;
+	// Query information.
+	char *querystring;
+	QueryDesc *queryDesc;
+	PlanState *planstate;
+	TupleTableSlot *slot;
+	MemoryContext recathoncontext;
+
+	// If this fails, there's no RecModelsCatalogue, so
+	// there are no recommenders.
+	cataloguerv = makeRangeVar(NULL,"recmodelscatalogue",0);
+	if (!relationExists(cataloguerv)) {
+		pfree(cataloguerv);
+		return 0;
+	}
+	pfree(cataloguerv);
+
+	// A hot standby gets its models from the primary, so all it
+	// can do is keep their model files in step with them.
+	if (RecoveryInProgress())
+		return refreshStandbyModelFiles(eventtable) + maintainCells(eventtable);
+
+	// Obtain the update threshold, and the current size of
+	// the events table.
+	update_threshold = getUpdateThreshold();
+	recathonEventsPassStart(RelnameGetRelid(eventtable));
+	numRows = countEvents(eventtable);
+	numRebuilt = 0;
+	numDue = 0;
+	deferred = false;
+
+	// Recommenders over the same events that come due together are
+	// rebuilt from one read of them.
+	beginEventCapture();
+
+	// Now that we've confirmed the RecModelsCatalogue
+	// exists, let's query it to find the necessary
+	// information.
+	if (onlyindexname) {
+		querystring = (char*) palloc(1024*sizeof(char));
+		sprintf(querystring,"SELECT * FROM RecModelsCatalogue WHERE eventtable = '%s' AND recommenderindexname = '%s';",
+			eventtable,onlyindexname);
+	} else {
+		order = rebuildOrder(eventtable, numRows);
+		querystring = (char*) palloc((1024 + strlen(order))*sizeof(char));
+		sprintf(querystring,"SELECT * FROM RecModelsCatalogue WHERE eventtable = '%s'%s;",
+			eventtable,order);
+		pfree(order);
+	}
+	queryDesc = recathon_queryStart(querystring,&recathoncontext);
+	planstate = queryDesc->planstate;
+
+	for (;;) {
+		// In case of SVD, recmodelname is the user model, and the other is the
+		// item model. Otherwise, recmodelname2 is nothing.
+		char *recname, *recindexname, *recmodelname, *recmodelname2;
+		char *userkey, *itemkey, *eventval, *strmethod;
+		int updatecounter = -1;
+		int storedcounter;
+		char *clustername;
+		int eventtotal = -1;
+		int querycounter, adaptive, level, newlevel;
+		float queryRate, updateRate, elapsed;
+		bool generated, rebuilt, incremental, applied, partialrefresh, online;
+		bool windowed, modellost, symmetric;
+		float threshold;
+		bool refreshdue, requested, due;
+		char *eventsource;
+		char statname[NAMEDATALEN];
+		PgStat_StatRecEntry *recstats;
+		int64 queriesServed, diskSize, inserted;
+		instr_time rebuildStart, rebuildTime;
+		recMethod method;
+		// Query information for our internal query.
+		char *countquerystring;
+		QueryDesc *countqueryDesc;
+		PlanState *countplanstate;
+		TupleTableSlot *countslot;
+		MemoryContext countcontext;
+
+		slot = ExecProcNode(planstate);
+		if (TupIsNull(slot)) break;
+
+		// Acquire the data for this recommender.
+		recname = getTupleString(slot,"recommendername");
+		recindexname = getTupleString(slot,"recommenderindexname");
+		userkey = getTupleString(slot,"userkey");
+		itemkey = getTupleString(slot,"itemkey");
+		eventval = getTupleString(slot,"eventval");
+		strmethod = getTupleString(slot,"method");
+
+		// Get the recMethod.
+		method = getRecMethod(strmethod);
+		pfree(strmethod);
+
+		// Failure case, continue to next tuple.
+		if (method < 0) {
+			pfree(recname);
+			pfree(recindexname);
+			pfree(userkey);
+			pfree(itemkey);
+			pfree(eventval);
+			continue;
+		}
+
+		// We now have all the information necessary to update this
+		// recommender's cell counter. First we need to acquire it,
+		// and we might as well get the model name while we're at it.
+		countquerystring = (char*) palloc(1024*sizeof(char));
+		// Recommenders from before the approximate top-k index don't
+		// have a column for it, so we don't name it.
+		if (FACTOR_METHOD(method))
+			sprintf(countquerystring,"SELECT *, extract(epoch FROM localtimestamp - levelone_timestamp) AS elapsed FROM %s;",
+				recindexname);
+		else
+			sprintf(countquerystring,"SELECT recmodelname, updatecounter, eventtotal, querycounter, queryrate, updaterate, extract(epoch FROM localtimestamp - levelone_timestamp) AS elapsed FROM %s;",
+				recindexname);
+
+		countqueryDesc = recathon_queryStart(countquerystring,&countcontext);
+		countplanstate = countqueryDesc->planstate;
+
+		// Go through what should be the only tuple and obtain the data.
+		countslot = ExecProcNode(countplanstate);
+		if (TupIsNull(countslot)) {
+			// More failure conditions. We can't just error out
+			// because the INSERT still needs to happen.
+			recathon_queryEnd(countqueryDesc,countcontext);
+			pfree(countquerystring);
+			pfree(recname);
+			pfree(recindexname);
+			pfree(userkey);
+			pfree(itemkey);
+			pfree(eventval);
+			continue;
+		}
+
+		// Get the relevant data.
+		if (FACTOR_METHOD(method)) {
+			recmodelname = getTupleString(countslot,"recusermodelname");
+			recmodelname2 = getTupleString(countslot,"recitemmodelname");
+			clustername = getTupleString(countslot,"recclustermodelname");
+		} else {
+			recmodelname = getTupleString(countslot,"recmodelname");
+			recmodelname2 = NULL;
+			clustername = NULL;
+		}
+		updatecounter = getTupleInt(countslot,"updatecounter");
+		storedcounter = updatecounter;
+		eventtotal = getTupleInt(countslot,"eventtotal");
+		querycounter = getTupleInt(countslot,"querycounter");
+		queryRate = getTupleFloat(countslot,"queryrate");
+		updateRate = getTupleFloat(countslot,"updaterate");
+		elapsed = getTupleFloat(countslot,"elapsed");
+
+		recathon_queryEnd(countqueryDesc,countcontext);
+		pfree(countquerystring);
+
+		// Even more failure conditions.
+		if (updatecounter < 0) {
+			pfree(recmodelname);
+			if (recmodelname2)
+				pfree(recmodelname2);
+			if (clustername)
+				pfree(clustername);
+			pfree(recname);
+			pfree(recindexname);
+			pfree(userkey);
+			pfree(itemkey);
+			continue;
+		}
+
+		// An incremental recommender folds the events that have come
+		// in since the last pass straight into its model, and counts
+		// them as part of it, so it never comes due for a rebuild.
+		incremental = (method == itemCosCF && getRecIncremental(recindexname));
+		online = (FACTOR_METHOD(method) && getRecOnline(recindexname));
+		partialrefresh = (!FACTOR_METHOD(method) && getRecPartialRefresh(recindexname));
+		symmetric = (!FACTOR_METHOD(method) && getRecSymmetric(recindexname));
+
+		// A recommender with a window or a WHERE condition learns
+		// from the events in it, rather than the whole events table.
+		eventsource = getRecEventSource(recindexname, eventtable);
+		windowed = (strcmp(eventsource, eventtable) != 0);
+
+		// Items come and go from the active set whether or not
+		// there are new events, so it's checked every pass. The
+		// lists already worked out may hold items that have gone.
+		if (refreshActiveItems(recindexname)) {
+			recathonResultDrop(recindexname);
+			if (getRecViewSize(recindexname) > 0)
+				materializeRecView(recname, recindexname);
+		}
+
+		// An online factor model does the same with gradient steps.
+		applied = false;
+		if (incremental || online) {
+			int numApplied;
+
+			if (incremental)
+				numApplied = applyItemCosDeltas(recindexname, eventsource,
+					userkey, itemkey, eventval, recmodelname);
+			else
+				numApplied = applyOnlineDeltas(recindexname, userkey,
+					itemkey, eventval, recmodelname, recmodelname2);
+
+			if (numApplied > 0) {
+				eventtotal += numApplied;
+				countquerystring = (char*) palloc(1024*sizeof(char));
+				sprintf(countquerystring,"UPDATE %s SET eventtotal = %d;",
+					recindexname,eventtotal);
+				recathon_queryExecute(countquerystring);
+				pfree(countquerystring);
+				applied = true;
+			}
+		}
+
+		// Events that have aged out of the window since the last
+		// pass come straight out of an incremental model, once the
+		// new ones are in.
+		if (windowed) {
+			int numExpired = expireWindowEvents(recindexname, eventtable,
+				userkey, itemkey, eventval, recmodelname, incremental,
+				partialrefresh);
+
+			if (incremental && numExpired > 0) {
+				eventtotal -= numExpired;
+				countquerystring = (char*) palloc(1024*sizeof(char));
+				sprintf(countquerystring,"UPDATE %s SET eventtotal = %d;",
+					recindexname,eventtotal);
+				recathon_queryExecute(countquerystring);
+				pfree(countquerystring);
+				applied = true;
+			}
+		}
+
+		// With that done, we work out how many events have come in
+		// since the model was built. If that's greater than
+		// threshold * the number of events currently used in the
+		// model, we need to trigger an update. Otherwise, just
+		// record the new count. An event that has left the window
+		// is a change too, but it also takes one off the count of
+		// events in it, so it counts twice.
+		// Otherwise the count comes from the inserts the statistics
+		// collector has seen since the build, which deletes can't
+		// cancel out, as they would in the table's size. Where we
+		// don't have that, as for a recommender from before we kept
+		// it, or after the statistics are reset, it's the growth of
+		// the table, and the inserts are counted from then on. An
+		// incremental or online model takes its new events in as
+		// they come, so only its growth is still waiting.
+		inserted = -1;
+		if (windowed)
+			updatecounter = count_rows(eventsource) - eventtotal +
+				2 * catalogueInt(recindexname, "windowexpired");
+		else if (incremental || online ||
+				 (inserted = eventsInserted(eventtable)) < 0)
+			updatecounter = numRows - eventtotal;
+		else {
+			int64 insertedatbuild = getRecEventsInserted(recindexname);
+
+			if (insertedatbuild >= 0 && inserted >= insertedatbuild)
+				updatecounter = (int) Min(inserted - insertedatbuild, INT_MAX);
+			else {
+				updatecounter = Max(numRows - eventtotal, 0);
+				storeRecEventsInserted(recindexname, inserted - updatecounter);
+			}
+		}
+		if (updatecounter < 0)
+			updatecounter = 0;
+
+		// Fold this pass's queries and new events into the rates,
+		// and start counting queries again. If the statistics have
+		// been reset since the last pass, they're all new.
+		recathonStatName(recindexname, statname);
+		recstats = pgstat_fetch_stat_recentry(statname);
+		queriesServed = recstats ? recstats->queries : 0;
+		if (queriesServed < querycounter)
+			querycounter = 0;
+		if (elapsed > 0.0) {
+			float newQueries = Max(queriesServed - querycounter, 0);
+			float newEvents = Max(updatecounter - storedcounter, 0);
+
+			queryRate = RECATHON_RATE_SMOOTHING * (newQueries / elapsed) +
+				(1.0 - RECATHON_RATE_SMOOTHING) * Max(queryRate, 0.0);
+			updateRate = RECATHON_RATE_SMOOTHING * (newEvents / elapsed) +
+				(1.0 - RECATHON_RATE_SMOOTHING) * Max(updateRate, 0.0);
+
+			countquerystring = (char*) palloc(1024*sizeof(char));
+			sprintf(countquerystring,"UPDATE %s SET querycounter = %d, queryrate = %f, updaterate = %f, levelone_timestamp = localtimestamp;",
+				recindexname,(int) queriesServed,queryRate,updateRate);
+			recathon_queryExecute(countquerystring);
+			pfree(countquerystring);
+		}
+
+		// Its own refresh policy decides whether it may be rebuilt
+		// for new events on this pass.
+		getRefreshPolicy(recindexname, update_threshold, &threshold,
+			&refreshdue, &requested);
+
+		// An adaptive recommender may change level with its workload.
+		// Going up to the RecView, we have to fill it; coming down,
+		// queries stop using it. A recommender left to generate on
+		// the fly doesn't bother rebuilding its model, so it needs
+		// one if it comes back.
+		level = RECATHON_LEVEL_MODEL;
+		newlevel = level;
+		adaptive = catalogueInt(recindexname, "adaptive");
+		if (adaptive > 0) {
+			int numUsers;
+			int *userIDs;
+
+			numUsers = loadIDDictionary(recindexname, "users", &userIDs);
+			if (numUsers >= 0)
+				pfree(userIDs);
+			else
+				numUsers = count_rows(eventtable);
+
+			level = getRecLevel(recindexname);
+			newlevel = chooseRecLevel(level, queryRate, updateRate,
+				threshold, eventtotal, numUsers);
+			if (newlevel != level) {
+				countquerystring = (char*) palloc(1024*sizeof(char));
+				sprintf(countquerystring,"UPDATE RecModelsCatalogue SET level = %d, materialize = %d WHERE recommenderindexname = '%s';",
+					newlevel,(newlevel == RECATHON_LEVEL_VIEW) ? adaptive : 0,
+					recindexname);
+				recathon_queryExecute(countquerystring);
+				pfree(countquerystring);
+			}
+		}
+		generated = (level == RECATHON_LEVEL_GENERATE);
+		rebuilt = false;
+		diskSize = 0;
+
+		// An unlogged model comes back empty after a crash, and has
+		// to be rebuilt however few events have come in.
+		modellost = (newlevel != RECATHON_LEVEL_GENERATE &&
+			eventtotal > 0 && getRecUnlogged(recindexname) &&
+			relationIsEmpty(recmodelname));
+
+		// A rebuild for new events waits for a later pass once this
+		// one has done its share of them.
+		due = (!generated && updatecounter > 0 && refreshdue &&
+			updatecounter >= (int) (threshold * eventtotal));
+		if (due && !modellost && !force && !requested &&
+		    recathon_max_rebuilds > 0) {
+			if (numDue >= recathon_max_rebuilds) {
+				elog(DEBUG1, "recommender \"%s\" is due for a rebuild, leaving it for the next pass",
+					recname);
+				due = false;
+				deferred = true;
+			} else
+				numDue++;
+		}
+
+		// A refresh that was asked for happens whatever the policy
+		// says, as long as there's a model to rebuild.
+		if (due ||
+			(generated && newlevel != RECATHON_LEVEL_GENERATE &&
+			updatecounter > 0) || modellost ||
+			((force || requested) && newlevel != RECATHON_LEVEL_GENERATE)) {
+			int numEvents = 0, numAffected;
+			int *affectedIDs;
+			char *newmodelname, *newmodelname2, *newclustername;
+			sim_params simparams;
+			bool refreshed;
+
+			INSTR_TIME_SET_CURRENT(rebuildStart);
+			TRACE_POSTGRESQL_RECOMMEND_REBUILD_START(recname);
+			pgstat_progress_start_recommender(recname);
+
+			// A recommender that keeps track of which rows got new
+			// events only needs those rows recomputed, which it does
+			// in place, unless too many of them have changed.
+			refreshed = false;
+			if (partialrefresh && !modellost) {
+				numEvents = refreshSimilarityRows(recindexname, method,
+					eventsource, userkey, itemkey, eventval, recmodelname);
+				refreshed = (numEvents >= 0);
+			}
+
+			// Rather than emptying and reloading the live model, we
+			// build a fresh one alongside it and then point the
+			// recommender at it. Queries keep using the old model,
+			// with its index, until we commit.
+			newmodelname2 = NULL;
+			if (refreshed)
+				newmodelname = pstrdup(recmodelname);
+			else
+				newmodelname = createModelTable(recname, method, false);
+			if (FACTOR_METHOD(method))
+				newmodelname2 = createModelTable(recname, method, true);
+
+			// Similarity models are rebuilt the way they were created.
+			if (!FACTOR_METHOD(method))
+				getRecSimParams(recindexname, &simparams);
+
+			// Otherwise, what we do depends on the recommendation method.
+			if (!refreshed) {
+				switch (method) {
+					case itemCosCF:
+					case itemPearCF:
+					case itemJaccardCF:
+					case userCosCF:
+					case userPearCF:
+						// Similarity models are built in memory if they fit,
+						// and in blocks if not.
+						numEvents = buildSimilarityModel(method, eventsource,
+							userkey, itemkey, eventval, newmodelname, &simparams);
+						noteBuildStrategy(recname, recindexname, &simparams, DEBUG1);
+						if (symmetric)
+							symmetrizeSimilarityModel(newmodelname,
+								method != userCosCF && method != userPearCF);
+						break;
+					case SVD:
+						{
+						svd_params params;
+						int numWorkers;
+						StringInfoData strategystring;
+
+						// No additional functions, just update the model
+						// with the parameters it was created with,
+						// starting from the one it replaces, unless
+						// that's been lost.
+						numWorkers = getRecSVDparams(recindexname, method, &params);
+						if (!modellost) {
+							params.warmUserModel = recmodelname;
+							params.warmItemModel = recmodelname2;
+						}
+						numEvents = SVDtrain(userkey, itemkey,
+							eventsource, eventval,
+							newmodelname, newmodelname2, false, numWorkers,
+							&params);
+
+						// Whether it could start from the old factors
+						// is worth knowing when tuning it.
+						initStringInfo(&strategystring);
+						appendStringInfo(&strategystring,"UPDATE RecModelsCatalogue SET buildstrategy = '%s' WHERE recommenderIndexName = '%s';",
+							params.warmStart ? "warm started" : "from scratch",
+							recindexname);
+						recathon_queryExecute(strategystring.data);
+						pfree(strategystring.data);
+						}
+						break;
+					case ALS:
+						{
+						svd_params params;
+						int numWorkers;
+
+						numWorkers = getRecSVDparams(recindexname, method, &params);
+						numEvents = ALStrain(userkey, itemkey,
+							eventsource, eventval,
+							newmodelname, newmodelname2, numWorkers,
+							&params);
+						}
+						break;
+					default:
+						break;
+				}
+			}
+
+			// A new model that gets rewritten row by row needs an index
+			// on its second column, as does any user-based model, which
+			// queries look up by either user unless it holds both
+			// directions. It has all the tracked events in.
+			if (!refreshed && (incremental || partialrefresh ||
+			    ((method == userCosCF || method == userPearCF) && !symmetric)))
+				indexSimilarityModel(newmodelname,
+					(method == itemCosCF || method == itemPearCF ||
+					 method == itemJaccardCF) ? "item2" : "user2");
+			if (!refreshed && (partialrefresh || online))
+				clearEventDeltas(recindexname);
+
+			// Any other factor model has taken in the events waiting
+			// to be folded in, too. One from before fold-in kept them
+			// gets its Deltas table now, unless its events come
+			// through a view.
+			if (FACTOR_METHOD(method) && !online) {
+				if (hasEventDeltas(recindexname))
+					clearEventDeltas(recindexname);
+				else if (get_rel_relkind(RelnameGetRelid(eventtable)) == RELKIND_RELATION)
+					createEventDeltas(recindexname, eventtable, userkey,
+						itemkey, eventval);
+			}
+
+			// If the old item model had a top-k index, the new one
+			// gets one with the same number of clusters.
+			newclustername = NULL;
+			if (clustername)
+				newclustername = createClusterModel(recname, newmodelname2,
+					countClusters(clustername));
+
+			// The new model's statistics have to describe it before
+			// queries start planning against it.
+			analyzeModel(newmodelname);
+			if (newmodelname2)
+				analyzeModel(newmodelname2);
+
+			// Finally, we point the cell at the new model, and record how
+			// many events were used to build it. We'll also reset the
+			// updatecounter.
+			countquerystring = (char*) palloc(1024*sizeof(char));
+			if (newclustername)
+				sprintf(countquerystring,"UPDATE %s SET recusermodelname = '%s', recitemmodelname = '%s', recclustermodelname = '%s', updatecounter = 0, eventtotal = %d;",
+							recindexname,newmodelname,newmodelname2,newclustername,numEvents);
+			else if (FACTOR_METHOD(method))
+				sprintf(countquerystring,"UPDATE %s SET recusermodelname = '%s', recitemmodelname = '%s', updatecounter = 0, eventtotal = %d;",
+							recindexname,newmodelname,newmodelname2,numEvents);
+			else
+				sprintf(countquerystring,"UPDATE %s SET recmodelname = '%s', updatecounter = 0, eventtotal = %d;",
+							recindexname,newmodelname,numEvents);
+
+			// Execute normally, we don't need to see results.
+			recathon_queryExecute(countquerystring);
+
+			// New events are counted from the ones it was built from.
+			if (inserted >= 0)
+				storeRecEventsInserted(recindexname, inserted);
+
+			// The new model has none of the expired events in it.
+			if (windowed) {
+				sprintf(countquerystring,"UPDATE RecModelsCatalogue SET windowexpired = 0 WHERE recommenderindexname = '%s';",
+					recindexname);
+				recathon_queryExecute(countquerystring);
+			}
+
+			// The RecView only has to be filled in again for the users
+			// the new models change, which we can only tell while the
+			// old ones are still here. A model refreshed in place has
+			// nothing to compare with.
+			numAffected = -1;
+			affectedIDs = NULL;
+			if (!refreshed && getRecViewSize(recindexname) > 0)
+				numAffected = recViewAffectedUsers(recindexname, method,
+					recmodelname, recmodelname2, newmodelname,
+					newmodelname2, &affectedIDs);
+
+			// The old model can go now. Anyone still reading it holds
+			// a lock, so this waits for them rather than pulling the
+			// table out from underneath them.
+			if (!refreshed) {
+				sprintf(countquerystring,"DROP TABLE %s;",recmodelname);
+				recathon_utilityExecute(countquerystring);
+			}
+			if (recmodelname2) {
+				sprintf(countquerystring,"DROP TABLE %s;",recmodelname2);
+				recathon_utilityExecute(countquerystring);
+			}
+			if (clustername) {
+				sprintf(countquerystring,"DROP TABLE %s;",clustername);
+				recathon_utilityExecute(countquerystring);
+			}
+			pfree(countquerystring);
+
+			// The user and item lists go along with the new model,
+			// as does the popularity ranking, and the model file and
+			// the RecView, if it has them.
+			refreshIDDictionary(recindexname, eventtable, userkey, itemkey);
+			buildPopularityModel(recindexname, eventtable, itemkey, eventval);
+			if (modelFileExists(recindexname))
+				writeModelFile(recindexname, method);
+			if (numAffected >= 0)
+				refreshRecView(recname, recindexname, affectedIDs, numAffected);
+			else
+				materializeRecView(recname, recindexname);
+			if (affectedIDs)
+				pfree(affectedIDs);
+
+			INSTR_TIME_SET_CURRENT(rebuildTime);
+			INSTR_TIME_SUBTRACT(rebuildTime, rebuildStart);
+			TRACE_POSTGRESQL_RECOMMEND_REBUILD_DONE(recname, numEvents);
+			pgstat_progress_end();
+			rebuilt = true;
+			updatecounter = 0;
+			diskSize = recModelDiskSize(recindexname, newmodelname,
+				newmodelname2, newclustername);
+			pfree(newmodelname);
+			if (newmodelname2)
+				pfree(newmodelname2);
+			if (newclustername)
+				pfree(newclustername);
+			numRebuilt++;
+		} else {
+			char *foldclustername = NULL;
+			bool arrived;
+
+			arrived = (updatecounter > 0 && updatecounter != storedcounter &&
+				newlevel != RECATHON_LEVEL_GENERATE);
+
+			// Between full rebuilds, factor models can still pick up
+			// new items and users by folding them in, in place: the
+			// new items against the current user model, then the users
+			// with new events against the item model with those items
+			// in. Both come from the Deltas table, which is emptied
+			// once they're done. We only bother when something has
+			// arrived since the last pass, and the model is in use.
+			// Once the new events reach the threshold, they wait for
+			// the rebuild they've made due instead. The clusters have
+			// to take in the new items too. An online model has taken
+			// its events in already.
+			if (FACTOR_METHOD(method) && arrived && !online &&
+			    updatecounter < (int) (threshold * eventtotal) &&
+			    hasEventDeltas(recindexname)) {
+				char deltaname[NAMEDATALEN + 8];
+				int numNewItems, numNewUsers;
+
+				snprintf(deltaname, sizeof(deltaname), "%sDeltas", recindexname);
+				lockEventDeltas(deltaname);
+				numNewItems = foldInItemModel(recindexname, eventsource,
+					userkey, itemkey, eventval, recmodelname, recmodelname2);
+				numNewUsers = foldInUserModel(recindexname, eventsource,
+					userkey, itemkey, eventval, recmodelname, recmodelname2);
+				if (numNewItems > 0 || numNewUsers > 0)
+					applied = true;
+				clearEventDeltas(recindexname);
+				PopActiveSnapshot();
+				if (numNewItems > 0 && clustername)
+					foldclustername = createClusterModel(recname, recmodelname2,
+						countClusters(clustername));
+			}
+
+			// An item-based model that's rewritten whole gets rows for
+			// its new items in place. The others are kept up to date
+			// row by row already.
+			if ((method == itemCosCF || method == itemPearCF ||
+			     method == itemJaccardCF) && arrived &&
+			    !incremental && !partialrefresh && !symmetric &&
+			    getRecNeighborhood(recindexname) == 0 &&
+			    catalogueInt(recindexname, "lshbands") == 0 &&
+			    foldInSimilarityItems(recindexname, method, eventsource,
+					userkey, itemkey, eventval, recmodelname) > 0) {
+				analyzeModel(recmodelname);
+				applied = true;
+			}
+
+			// Record the count, and the new clusters if there are any.
+			// Folding in doesn't count for the rebuild; the events
+			// it took in are still waiting for one.
+			countquerystring = (char*) palloc(1024*sizeof(char));
+			if (foldclustername)
+				sprintf(countquerystring,"UPDATE %s SET recclustermodelname = '%s', updatecounter = %d;",
+							recindexname,foldclustername,updatecounter);
+			else
+				sprintf(countquerystring,"UPDATE %s SET updatecounter = %d;",
+							recindexname,updatecounter);
+			// Execute normally, we don't need to see results.
+			recathon_queryExecute(countquerystring);
+
+			if (foldclustername) {
+				sprintf(countquerystring,"DROP TABLE %s;",clustername);
+				recathon_utilityExecute(countquerystring);
+			}
+			pfree(countquerystring);
+
+			// A recommender generating on the fly has no model to speak of.
+			if (newlevel != RECATHON_LEVEL_GENERATE)
+				diskSize = recModelDiskSize(recindexname, recmodelname,
+					recmodelname2, foldclustername ? foldclustername : clustername);
+			if (foldclustername)
+				pfree(foldclustername);
+
+			// New events can bring new users and items, which queries
+			// should see even before the model is rebuilt. Events
+			// folded into the model change it, too.
+			if ((updatecounter != storedcounter || applied) &&
+					newlevel != RECATHON_LEVEL_GENERATE) {
+				refreshIDDictionary(recindexname, eventtable, userkey, itemkey);
+				if (modelFileExists(recindexname))
+					writeModelFile(recindexname, method);
+				if (applied) {
+					buildPopularityModel(recindexname, eventtable, itemkey, eventval);
+					materializeRecView(recname, recindexname);
+				}
+			}
+
+			// A recommender that has just gone up to the RecView
+			// needs it filled now, rather than at the next rebuild.
+			if (newlevel == RECATHON_LEVEL_VIEW && level != RECATHON_LEVEL_VIEW)
+				materializeRecView(recname, recindexname);
+		}
+
+		// The interval runs from this rebuild, and any request for
+		// one has been seen to.
+		if (rebuilt || requested)
+			noteRefresh(recindexname, rebuilt);
+
+		// A hybrid recommender's heavy users change with its queries.
+		if (getRecHybrid(recindexname))
+			maintainHeavyUsers(recname, recindexname);
+
+		pgstat_report_recommender_maint(statname, rebuilt,
+			rebuilt ? INSTR_TIME_GET_MICROSEC(rebuildTime) : 0,
+			updatecounter, diskSize);
+		if (rebuilt)
+			recathonLatencyRecord(statname, RECATHON_LATENCY_REBUILD,
+				INSTR_TIME_GET_MICROSEC(rebuildTime));
+
+		// Final cleanup.
+		pfree(recmodelname);
+		if (recmodelname2)
+			pfree(recmodelname2);
+		if (clustername)
+			pfree(clustername);
+		pfree(eventsource);
+		pfree(recname);
+		pfree(recindexname);
+		pfree(userkey);
+		pfree(itemkey);
+		pfree(eventval);
+	}
+
+	recathon_queryEnd(queryDesc,recathoncontext);
+	pfree(querystring);
+	endEventCapture();
+
+	// The maintenance process hears of this once we commit, and
+	// comes back for the rebuilds we put off.
+	if (deferred)
+		Async_Notify(RECATHON_MAINTENANCE_CHANNEL, eventtable);
+
+	// The cells of a partitioned recommender are built on views
+	// of this table, so its new events are theirs too.
+	if (!onlyindexname)
+		numRebuilt += maintainCells(eventtable);
+
+	return numRebuilt;
+}
+
+/* ----------------------------------------------------------------
+ *		maintainCells
+ *
+ *		Brings the cells of every partitioned recommender on
+ *		the given events table up to date. Each cell is a
+ *		recommender of its own, on a view of the table, so
+ *		it's maintained like any other. Returns the number of
+ *		models rebuilt.
+ * ----------------------------------------------------------------
+ */
+static int
+maintainCells(char *eventtable) {
+	int numRebuilt = 0;
+	char *querystring;
+	RangeVar *cataloguerv;
+	List *celltables = NIL;
+	ListCell *lc;
+	// Query information.
+	QueryDesc *queryDesc;
+	TupleTableSlot *slot;
+	MemoryContext recathoncontext;
+
+	// Catalogues from before partitioning have no cells.
+	cataloguerv = makeRangeVar(NULL,"recmodelscatalogue",0);
+	if (!columnExistsInRelation("partitionof",cataloguerv)) {
+		pfree(cataloguerv);
+		return 0;
+	}
+	pfree(cataloguerv);
+
+	// Collect the views first, since rebuilding a model
+	// changes the catalogue underneath us.
+	querystring = (char*) palloc(1024*sizeof(char));
+	sprintf(querystring,"SELECT DISTINCT c.eventtable FROM RecModelsCatalogue c, RecModelsCatalogue p WHERE c.partitionof = p.recommendername AND p.eventtable = '%s';",
+		eventtable);
+	queryDesc = recathon_queryStart(querystring,&recathoncontext);
+	for (;;) {
+		slot = ExecProcNode(queryDesc->planstate);
+		if (TupIsNull(slot)) break;
+		celltables = lappend(celltables, getTupleString(slot,"eventtable"));
+	}
+	recathon_queryEnd(queryDesc,recathoncontext);
+	pfree(querystring);
+
+	foreach(lc, celltables) {
+		CHECK_FOR_INTERRUPTS();
+		numRebuilt += maintainRecommenders((char *) lfirst(lc), NULL, false);
+	}
+	list_free_deep(celltables);
+
+	return numRebuilt;
+}
+
+/* ----------------------------------------------------------------
+ *		refreshStandbyModelFiles
+ *
+ *		On a hot standby, writes a new model file for each
+ *		recommender on the given events table that should
+ *		have one, and doesn't have one for its current
+ *		models. The primary ships its files through WAL,
+ *		but a standby whose base backup came without one,
+ *		or that lost a shipped file, can make its own from
+ *		the replicated model tables, unless they're
+ *		unlogged. Returns the number of files written.
+ * ----------------------------------------------------------------
+ */
+static int
+refreshStandbyModelFiles(char *eventtable) {
+	int numWritten = 0;
+	// Query information.
+	char *querystring;
+	QueryDesc *queryDesc;
+	TupleTableSlot *slot;
+	MemoryContext recathoncontext;
+
+	querystring = (char*) palloc(1024*sizeof(char));
+	sprintf(querystring,"SELECT recommenderindexname, method FROM RecModelsCatalogue WHERE eventtable = '%s';",
+		eventtable);
+	queryDesc = recathon_queryStart(querystring,&recathoncontext);
+
+	for (;;) {
+		char *recindexname, *strmethod;
+		recMethod method;
+		uint32 version;
+		model_file mf;
+
+		slot = ExecProcNode(queryDesc->planstate);
+		if (TupIsNull(slot)) break;
+
+		recindexname = getTupleString(slot,"recommenderindexname");
+		strmethod = getTupleString(slot,"method");
+		method = getRecMethod(strmethod);
+		pfree(strmethod);
+
+		// The primary may have been given its file after our base
+		// backup was taken, so we go by the catalogue too.
+		if (method >= 0 && (catalogueInt(recindexname, "modelfile") > 0 ||
+				modelFileExists(recindexname))) {
+			version = modelVersion(recindexname);
+			mf = openModelFile(recindexname, version);
+			if (mf)
+				closeModelFile(mf);
+			else if (version != 0 && !getRecUnlogged(recindexname)) {
+				writeModelFile(recindexname, method);
+				numWritten++;
+			}
+		}
+
+		CHECK_FOR_INTERRUPTS();
+		pfree(recindexname);
+	}
+
+	recathon_queryEnd(queryDesc,recathoncontext);
+	pfree(querystring);
+
+	return numWritten;
+}
+
+/* ----------------------------------------------------------------
+ *		recathon_maintain
+ *
+ *		SQL-callable entry point for model maintenance,
+ *		meant to be run by a separate session (see
+ *		scripts/recdbmaintain.pl) rather than by the
+ *		sessions doing the INSERTs. With an argument, only
+ *		recommenders on that events table are looked at,
+ *		which suits a client that LISTENs on the
+ *		recathon_maintenance channel and passes along the
+ *		payload. Returns the number of models rebuilt. On a
+ *		hot standby, nothing is rebuilt, but model files are
+ *		brought up to date with the replicated models, and
+ *		we return the number written.
+ * ----------------------------------------------------------------
+ */
+Datum
+recathon_maintain(PG_FUNCTION_ARGS) {
+	int numRebuilt = 0;
+	RangeVar *cataloguerv;
+	List *eventtables = NIL;
+	ListCell *lc;
+	// Query information.
+	QueryDesc *queryDesc;
+	TupleTableSlot *slot;
+	MemoryContext recathoncontext;
+
+	if (PG_NARGS() > 0 && !PG_ARGISNULL(0)) {
+		char *eventtable = text_to_cstring(PG_GETARG_TEXT_PP(0));
+
+		numRebuilt = maintainRecommenders(eventtable, NULL, false);
+		pfree(eventtable);
+		PG_RETURN_INT32(numRebuilt);
+	}
+
+	// No table given, so go through all of them.
+	cataloguerv = makeRangeVar(NULL,"recmodelscatalogue",0);
+	if (!relationExists(cataloguerv)) {
+		pfree(cataloguerv);
+		PG_RETURN_INT32(0);
+	}
+
+	// Collect the table names first, since rebuilding a model
+	// changes the catalogue underneath us. Cells are looked after
+	// along with the table their view is on.
+	if (columnExistsInRelation("partitionof",cataloguerv))
+		queryDesc = recathon_queryStart("SELECT DISTINCT eventtable FROM RecModelsCatalogue WHERE partitionof IS NULL;",
+			&recathoncontext);
+	else
+		queryDesc = recathon_queryStart("SELECT DISTINCT eventtable FROM RecModelsCatalogue;",
+			&recathoncontext);
+	pfree(cataloguerv);
+	for (;;) {
+		slot = ExecProcNode(queryDesc->planstate);
+		if (TupIsNull(slot)) break;
+		eventtables = lappend(eventtables, getTupleString(slot,"eventtable"));
+	}
+	recathon_queryEnd(queryDesc,recathoncontext);
+
+	foreach(lc, eventtables) {
+		CHECK_FOR_INTERRUPTS();
+		numRebuilt += maintainRecommenders((char *) lfirst(lc), NULL, false);
+	}
+	list_free_deep(eventtables);
+
+	PG_RETURN_INT32(numRebuilt);
+}
+
+/* ----------------------------------------------------------------
+ *		isRefreshOption
+ *
+ *		Whether an option is part of a recommender's refresh
+ *		policy, rather than how it's built. Those are the
+ *		only ones ALTER RECOMMENDER can change. If it has a
+ *		value, we check it.
+ * ----------------------------------------------------------------
+ */
+bool
+isRefreshOption(DefElem *def) {
+	if (strcmp(def->defname, "refresh_threshold") == 0) {
+		if (def->arg && defGetNumeric(def) < 0.0)
+			ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("refresh_threshold can't be negative")));
+		return true;
+	}
+	if (strcmp(def->defname, "refresh_window") == 0) {
+		if (def->arg) {
+			char *window = defGetString(def);
+			char *dash = strchr(window, '-');
+
+			if (!dash || dash == window || *(dash+1) == '\0' ||
+			    strchr(dash+1, '-'))
+				ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("refresh_window must be of the form 'start-end', as in '02:00-05:00'")));
+		}
+		return true;
+	}
+	if (strcmp(def->defname, "refresh_interval") == 0) {
+		if (def->arg)
+			(void) defGetString(def);
+		return true;
+	}
+	return false;
+}
+
+/* ----------------------------------------------------------------
+ *		recommenderEntries
+ *
+ *		Finds the index names and events tables of a
+ *		recommender and its cells, if it has any. It's an
+ *		error if there's no such recommender.
+ * ----------------------------------------------------------------
+ */
+static void
+recommenderEntries(char *recname, List **ret_indexnames, List **ret_eventtables) {
+	char *querystring;
+	RangeVar *cataloguerv;
+	bool partitioned;
+	// Query information.
+	QueryDesc *queryDesc;
+	TupleTableSlot *slot;
+	MemoryContext recathoncontext;
+
+	cataloguerv = makeRangeVar(NULL,"recmodelscatalogue",0);
+	if (!relationExists(cataloguerv)) {
+		pfree(cataloguerv);
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_SCHEMA_NAME),
+			 errmsg("no recommenders have been built")));
+	}
+	partitioned = columnExistsInRelation("partitionof",cataloguerv);
+	pfree(cataloguerv);
+
+	// The whole comes first, so its cells are refreshed after it.
+	querystring = (char*) palloc(1024*sizeof(char));
+	if (partitioned)
+		sprintf(querystring,"SELECT recommenderindexname, eventtable FROM RecModelsCatalogue WHERE recommendername = '%s' OR partitionof = '%s' ORDER BY partitionof NULLS FIRST, recommenderid;",
+			recname,recname);
+	else
+		sprintf(querystring,"SELECT recommenderindexname, eventtable FROM RecModelsCatalogue WHERE recommendername = '%s';",
+			recname);
+	queryDesc = recathon_queryStart(querystring,&recathoncontext);
+
+	*ret_indexnames = NIL;
+	*ret_eventtables = NIL;
+	for (;;) {
+		slot = ExecProcNode(queryDesc->planstate);
+		if (TupIsNull(slot)) break;
+		*ret_indexnames = lappend(*ret_indexnames,
+			getTupleString(slot,"recommenderindexname"));
+		*ret_eventtables = lappend(*ret_eventtables,
+			getTupleString(slot,"eventtable"));
+	}
+	recathon_queryEnd(queryDesc,recathoncontext);
+	pfree(querystring);
+
+	if (*ret_indexnames == NIL)
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_SCHEMA_NAME),
+			 errmsg("recommender %s not found",recname)));
+}
+
+/* ----------------------------------------------------------------
+ *		refreshRecommender
+ *
+ *		Handles ALTER RECOMMENDER ... REFRESH. The models are
+ *		rebuilt right away, in this transaction, however few
+ *		events have come in and whatever the refresh policy.
+ *		With CONCURRENTLY, we leave the rebuild to the
+ *		maintenance process instead, and return at once; it
+ *		happens on its next pass over the events table,
+ *		once we commit. Either way, queries keep using the
+ *		current models until the new ones are in.
+ * ----------------------------------------------------------------
+ */
+void
+refreshRecommender(char *recname, bool concurrent) {
+	List *indexnames, *eventtables;
+	ListCell *lc, *lc2;
+
+	recommenderEntries(recname, &indexnames, &eventtables);
+
+	if (concurrent) {
+		char querystring[1024];
+
+		addRefreshPolicyColumns();
+		forboth(lc, indexnames, lc2, eventtables) {
+			sprintf(querystring,"UPDATE RecModelsCatalogue SET refreshrequested = 1 WHERE recommenderindexname = '%s';",
+				(char *) lfirst(lc));
+			recathon_queryExecute(querystring);
+		}
+		// The cells are looked after along with the whole.
+		Async_Notify(RECATHON_MAINTENANCE_CHANNEL,
+			(char *) linitial(eventtables));
+	} else {
+		forboth(lc, indexnames, lc2, eventtables) {
+			CHECK_FOR_INTERRUPTS();
+			maintainRecommenders((char *) lfirst(lc2),
+				(char *) lfirst(lc), true);
+			CommandCounterIncrement();
+		}
+	}
+
+	list_free_deep(indexnames);
+	list_free_deep(eventtables);
+}
+
+/* ----------------------------------------------------------------
+ *		setRefreshPolicy
+ *
+ *		Stores the refresh policy options among the given
+ *		ones for a recommender and its cells, or with reset,
+ *		clears them. Others are ignored, which suits CREATE
+ *		RECOMMENDER; ALTER RECOMMENDER checks for them first.
+ * ----------------------------------------------------------------
+ */
+void
+setRefreshPolicy(char *recname, List *options, bool reset) {
+	StringInfoData setlist, querystring;
+	List *indexnames, *eventtables;
+	ListCell *lc;
+
+	initStringInfo(&setlist);
+	foreach(lc, options) {
+		DefElem *def = (DefElem *) lfirst(lc);
+
+		if (!isRefreshOption(def))
+			continue;
+		if (setlist.len > 0)
+			appendStringInfoString(&setlist,", ");
+
+		if (strcmp(def->defname, "refresh_threshold") == 0) {
+			if (reset)
+				appendStringInfoString(&setlist,"refreshthreshold = NULL");
+			else
+				appendStringInfo(&setlist,"refreshthreshold = %f",
+					defGetNumeric(def));
+		} else if (strcmp(def->defname, "refresh_interval") == 0) {
+			if (reset)
+				appendStringInfoString(&setlist,"refreshinterval = NULL");
+			else
+				appendStringInfo(&setlist,"refreshinterval = %s::interval",
+					quote_literal_cstr(defGetString(def)));
+		} else {
+			if (reset)
+				appendStringInfoString(&setlist,"refreshwindowstart = NULL, refreshwindowend = NULL");
+			else {
+				char *start = pstrdup(defGetString(def));
+				char *end = strchr(start, '-');
+
+				*end++ = '\0';
+				appendStringInfo(&setlist,"refreshwindowstart = %s::time, refreshwindowend = %s::time",
+					quote_literal_cstr(start), quote_literal_cstr(end));
+				pfree(start);
+			}
+		}
+	}
+	if (setlist.len == 0) {
+		pfree(setlist.data);
+		return;
+	}
+
+	recommenderEntries(recname, &indexnames, &eventtables);
+	addRefreshPolicyColumns();
+
+	initStringInfo(&querystring);
+	foreach(lc, indexnames) {
+		resetStringInfo(&querystring);
+		appendStringInfo(&querystring,"UPDATE RecModelsCatalogue SET %s WHERE recommenderindexname = '%s';",
+			setlist.data, (char *) lfirst(lc));
+		recathon_queryExecute(querystring.data);
+	}
+
+	pfree(querystring.data);
+	pfree(setlist.data);
+	list_free_deep(indexnames);
+	list_free_deep(eventtables);
+}
+
+/* ----------------------------------------------------------------
+ *		prewarmUser
+ *
+ *		Scores a user's best predictions from each of the
+ *		recommenders on an events table, which leaves them in
+ *		the result cache. Returns the number of recommenders.
+ * ----------------------------------------------------------------
+ */
+static int
+prewarmUser(char *eventtable, int userID, bool partitioned) {
+	int numWarmed = 0;
+	List *recindexnames = NIL;
+	ListCell *lc;
+	StringInfoData querystring;
+	// Query objects.
+	Oid paramtypes[1];
+	Datum values[1];
+	QueryDesc *queryDesc;
+	TupleTableSlot *slot;
+	CachedPlan *cplan;
+	MemoryContext recathoncontext;
+
+	paramtypes[0] = TEXTOID;
+	values[0] = CStringGetTextDatum(eventtable);
+	if (partitioned)
+		queryDesc = recathon_queryStartCached("SELECT recommenderindexname FROM RecModelsCatalogue WHERE eventtable = $1 AND partitionof IS NULL;",
+			1,paramtypes,values,&cplan,&recathoncontext);
+	else
+		queryDesc = recathon_queryStartCached("SELECT recommenderindexname FROM RecModelsCatalogue WHERE eventtable = $1;",
+			1,paramtypes,values,&cplan,&recathoncontext);
+	for (;;) {
+		slot = ExecProcNode(queryDesc->planstate);
+		if (TupIsNull(slot)) break;
+		recindexnames = lappend(recindexnames, getTupleString(slot,"recommenderindexname"));
+	}
+	recathon_queryEndCached(queryDesc,cplan,recathoncontext);
+	pfree(DatumGetPointer(values[0]));
+
+	initStringInfo(&querystring);
+	foreach(lc, recindexnames) {
+		char *recindexname = (char *) lfirst(lc);
+		char *recevents, *userkey, *itemkey, *eventval, *method;
+
+		getRecInfo(recindexname, &recevents, &userkey, &itemkey,
+			&eventval, &method, NULL);
+
+		// A single user's top-k is just what the result cache
+		// keeps, so running the query is all it takes.
+		resetStringInfo(&querystring);
+		appendStringInfo(&querystring,"SELECT r.%s, r.%s FROM %s r RECOMMEND r.%s TO r.%s ON r.%s USING %s WHERE r.%s = %d ORDER BY r.%s DESC LIMIT %d;",
+			itemkey,eventval,recevents,
+			itemkey,userkey,eventval,method,
+			userkey,userID,eventval,RECATHON_RESULT_LENGTH);
+		queryDesc = recathon_queryStart(querystring.data,&recathoncontext);
+		for (;;) {
+			slot = ExecProcNode(queryDesc->planstate);
+			if (TupIsNull(slot)) break;
+		}
+		recathon_queryEnd(queryDesc,recathoncontext);
+		numWarmed++;
+
+		pfree(recevents);
+		pfree(userkey);
+		pfree(itemkey);
+		pfree(eventval);
+		pfree(method);
+	}
+
+	pfree(querystring.data);
+	list_free_deep(recindexnames);
+	return numWarmed;
+}
+
+/* ----------------------------------------------------------------
+ *		recathon_prewarm
+ *
+ *		SQL-callable entry point that puts the recommendations
+ *		of users with new events back into the result cache,
+ *		so their next query doesn't have to wait for scoring.
+ *		Committing new events throws out the user's cached
+ *		lists and queues them; like recathon_maintain, this is
+ *		meant to be run from the maintenance session, and
+ *		goes through every user waiting. Returns the number
+ *		of lists scored.
+ * ----------------------------------------------------------------
+ */
+Datum
+recathon_prewarm(PG_FUNCTION_ARGS) {
+	int numWarmed = 0;
+	int userID;
+	bool partitioned;
+	char eventtable[NAMEDATALEN];
+	RangeVar *cataloguerv;
+
+	if (!recathonResultCacheEnabled())
+		PG_RETURN_INT32(0);
+
+	cataloguerv = makeRangeVar(NULL,"recmodelscatalogue",0);
+	if (!relationExists(cataloguerv)) {
+		pfree(cataloguerv);
+		PG_RETURN_INT32(0);
+	}
+	// Cells are scored through the recommender they belong to.
+	partitioned = columnExistsInRelation("partitionof",cataloguerv);
+	pfree(cataloguerv);
+
+	while (recathonPrewarmNext(eventtable, &userID)) {
+		CHECK_FOR_INTERRUPTS();
+		numWarmed += prewarmUser(eventtable, userID, partitioned);
+	}
+
+	PG_RETURN_INT32(numWarmed);
+}
+
+/* ----------------------------------------------------------------
+ *		preloadBlocks
+ *
+ *		Reads up to budget blocks of a relation into shared
+ *		buffers, from the start. Returns how many it read.
+ * ----------------------------------------------------------------
+ */
+static BlockNumber
+preloadBlocks(Relation rel, BlockNumber budget) {
+	BlockNumber blkno, nblocks;
+
+	nblocks = RelationGetNumberOfBlocks(rel);
+	for (blkno = 0; blkno < nblocks && blkno < budget; blkno++) {
+		CHECK_FOR_INTERRUPTS();
+		ReleaseBuffer(ReadBufferExtended(rel, MAIN_FORKNUM, blkno,
+			RBM_NORMAL, NULL));
+	}
+	return blkno;
+}
+
+/* ----------------------------------------------------------------
+ *		preloadTable
+ *
+ *		Reads a table and its indexes into shared buffers, as
+ *		far as the budget of blocks goes. A table that isn't
+ *		there, or is really a view, is skipped. Returns the
+ *		number of blocks read.
+ * ----------------------------------------------------------------
+ */
+static BlockNumber
+preloadTable(char *tablename, BlockNumber budget) {
+	int i;
+	char *relname;
+	Relation rel;
+	List *indexes;
+	ListCell *lc;
+	BlockNumber numRead;
+
+	relname = pstrdup(tablename);
+	for (i = 0; i < strlen(relname); i++)
+		relname[i] = tolower(relname[i]);
+	rel = heap_openrv_extended(makeRangeVar(NULL,relname,-1),
+		AccessShareLock, true);
+	pfree(relname);
+	if (!rel)
+		return 0;
+	if (rel->rd_rel->relkind != RELKIND_RELATION) {
+		heap_close(rel, AccessShareLock);
+		return 0;
+	}
+
+	numRead = preloadBlocks(rel, budget);
+	indexes = RelationGetIndexList(rel);
+	foreach(lc, indexes) {
+		Relation index = index_open(lfirst_oid(lc), AccessShareLock);
+
+		numRead += preloadBlocks(index, budget - numRead);
+		index_close(index, AccessShareLock);
+	}
+	list_free(indexes);
+	heap_close(rel, AccessShareLock);
+
+	return numRead;
+}
+
+/* ----------------------------------------------------------------
+ *		preloadRecommender
+ *
+ *		Gets a recommender ready for its first query after a
+ *		restart. Its model and RecView tables go into shared
+ *		buffers, or its events table if it's scored on the
+ *		fly, and with the model cache on, one user is scored
+ *		so that its models are decoded into the cache. Takes
+ *		blocks out of the budget as it reads them.
+ * ----------------------------------------------------------------
+ */
+static void
+preloadRecommender(char *recindexname, BlockNumber *budget) {
+	int i, userID;
+	bool haveUser;
+	char *eventtable, *userkey, *itemkey, *eventval, *method;
+	TupleTableSlot *slot;
+	StringInfoData querystring;
+	// Query objects.
+	QueryDesc *queryDesc;
+	TupleTableSlot *qslot;
+	MemoryContext recathoncontext;
+
+	getRecInfo(recindexname, &eventtable, &userkey, &itemkey,
+		&eventval, &method, NULL);
+
+	if (getRecLevel(recindexname) == 1) {
+		// Nothing is kept but the events.
+		(*budget) -= preloadTable(eventtable, *budget);
+	} else {
+		slot = getRecIndexSlot(recindexname);
+		if (slot) {
+			TupleDesc desc = slot->tts_tupleDescriptor;
+
+			for (i = 0; i < desc->natts; i++) {
+				char *attname = NameStr(desc->attrs[i]->attname);
+				int len = strlen(attname);
+				char *tablename;
+
+				if (!((len > 9 && strcmp(attname + len - 9, "modelname") == 0) ||
+				      (len > 8 && strcmp(attname + len - 8, "viewname") == 0)))
+					continue;
+				tablename = getTupleString(slot, attname);
+				if (tablename) {
+					(*budget) -= preloadTable(tablename, *budget);
+					pfree(tablename);
+				}
+			}
+			ExecDropSingleTupleTableSlot(slot);
+		}
+	}
+
+	// Scoring any one user loads every model the recommender has.
+	// Without ORDER BY and LIMIT, the query can't be answered
+	// from the RecView or the result cache instead.
+	if (recathonCacheEnabled() && getRecLevel(recindexname) != 1) {
+		initStringInfo(&querystring);
+		appendStringInfo(&querystring,"SELECT r.%s FROM %s r LIMIT 1;",
+			userkey,eventtable);
+		queryDesc = recathon_queryStart(querystring.data,&recathoncontext);
+		qslot = ExecProcNode(queryDesc->planstate);
+		haveUser = !TupIsNull(qslot);
+		userID = haveUser ? getTupleInt(qslot,userkey) : 0;
+		recathon_queryEnd(queryDesc,recathoncontext);
+
+		if (haveUser) {
+			resetStringInfo(&querystring);
+			appendStringInfo(&querystring,"SELECT r.%s FROM %s r RECOMMEND r.%s TO r.%s ON r.%s USING %s WHERE r.%s = %d;",
+				itemkey,eventtable,
+				itemkey,userkey,eventval,method,
+				userkey,userID);
+			queryDesc = recathon_queryStart(querystring.data,&recathoncontext);
+			for (;;) {
+				qslot = ExecProcNode(queryDesc->planstate);
+				if (TupIsNull(qslot)) break;
+			}
+			recathon_queryEnd(queryDesc,recathoncontext);
+		}
+		pfree(querystring.data);
+	}
+
+	pfree(eventtable);
+	pfree(userkey);
+	pfree(itemkey);
+	pfree(eventval);
+	pfree(method);
+}
+
+/* ----------------------------------------------------------------
+ *		recathon_preload
+ *
+ *		SQL-callable entry point that warms up the recommenders
+ *		named in recathon_preload_recommenders, or all of them
+ *		for "*", after the server starts, so that their first
+ *		queries don't pay for reading everything from disk.
+ *		There's no way to run it from the server itself, so
+ *		the maintenance script calls it whenever it sees the
+ *		server has restarted. Reading more than shared_buffers
+ *		would only push out what was read first, so that's as
+ *		much as it reads in all. Returns the number of
+ *		recommenders preloaded.
+ * ----------------------------------------------------------------
+ */
+Datum
+recathon_preload(PG_FUNCTION_ARGS) {
+	int i, numLoaded = 0;
+	char *rawnames;
+	bool *matched;
+	List *names = NIL, *recindexnames = NIL;
+	ListCell *lc;
+	BlockNumber budget = NBuffers;
+	RangeVar *cataloguerv;
+	// Query objects.
+	QueryDesc *queryDesc;
+	TupleTableSlot *slot;
+	MemoryContext recathoncontext;
+
+	if (!recathon_preload_recommenders || recathon_preload_recommenders[0] == '\0')
+		PG_RETURN_INT32(0);
+
+	cataloguerv = makeRangeVar(NULL,"recmodelscatalogue",0);
+	if (!relationExists(cataloguerv)) {
+		pfree(cataloguerv);
+		PG_RETURN_INT32(0);
+	}
+	pfree(cataloguerv);
+
+	rawnames = pstrdup(recathon_preload_recommenders);
+	if (!SplitIdentifierString(rawnames, ',', &names))
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("invalid list syntax in recathon_preload_recommenders")));
+
+	// Names are matched the way RECOMMEND matches them, without
+	// regard to case.
+	matched = (bool*) palloc0(Max(list_length(names), 1)*sizeof(bool));
+	queryDesc = recathon_queryStart("SELECT recommendername, recommenderindexname FROM RecModelsCatalogue ORDER BY recommenderid;",
+		&recathoncontext);
+	for (;;) {
+		char *recname;
+		bool wanted = false;
+
+		slot = ExecProcNode(queryDesc->planstate);
+		if (TupIsNull(slot)) break;
+
+		recname = getTupleString(slot,"recommendername");
+		i = 0;
+		foreach(lc, names) {
+			char *name = (char *) lfirst(lc);
+
+			if (strcmp(name, "*") == 0 || pg_strcasecmp(name, recname) == 0)
+				wanted = matched[i] = true;
+			i++;
+		}
+		if (wanted)
+			recindexnames = lappend(recindexnames,
+				getTupleString(slot,"recommenderindexname"));
+		pfree(recname);
+	}
+	recathon_queryEnd(queryDesc,recathoncontext);
+
+	i = 0;
+	foreach(lc, names) {
+		if (!matched[i++] && strcmp((char *) lfirst(lc), "*") != 0)
+			ereport(WARNING,
+				(errcode(ERRCODE_UNDEFINED_OBJECT),
+				 errmsg("recommender %s in recathon_preload_recommenders not found",
+					(char *) lfirst(lc))));
+	}
+
+	foreach(lc, recindexnames) {
+		char *recindexname = (char *) lfirst(lc);
+
+		CHECK_FOR_INTERRUPTS();
+		for (i = 0; i < strlen(recindexname); i++)
+			recindexname[i] = tolower(recindexname[i]);
+		preloadRecommender(recindexname, &budget);
+		numLoaded++;
+	}
+
+	list_free_deep(recindexnames);
+	list_free(names);
+	pfree(matched);
+	pfree(rawnames);
+	PG_RETURN_INT32(numLoaded);
+}
+
+/* ----------------------------------------------------------------
+ *		lookupRecIndexName
+ *
+ *		Finds the index table of the recommender a user named
+ *		in a call to one of our SQL functions, complaining if
+ *		there isn't one.
+ * ----------------------------------------------------------------
+ */
+static char*
+lookupRecIndexName(char *recname) {
+	char *recindexname;
+	RangeVar *cataloguerv;
+	// Query objects.
+	QueryDesc *queryDesc;
+	TupleTableSlot *slot;
+	CachedPlan *cplan;
+	MemoryContext recathoncontext;
+	Oid paramtypes[1] = {TEXTOID};
+	Datum paramvalues[1];
+
+	cataloguerv = makeRangeVar(NULL,"recmodelscatalogue",0);
+	if (!relationExists(cataloguerv)) {
+		pfree(cataloguerv);
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_SCHEMA_NAME),
+			 errmsg("no recommenders have been built")));
+	}
+	pfree(cataloguerv);
+
+	// recathon_recommend looks this up on every call, so the plan
+	// is kept.
+	paramvalues[0] = CStringGetTextDatum(recname);
+	queryDesc = recathon_queryStartCached("SELECT recommenderindexname FROM RecModelsCatalogue WHERE recommenderName = $1;",
+		1,paramtypes,paramvalues,&cplan,&recathoncontext);
+	slot = ExecProcNode(queryDesc->planstate);
+	recindexname = NULL;
+	if (!TupIsNull(slot))
+		recindexname = getTupleString(slot,"recommenderindexname");
+	recathon_queryEndCached(queryDesc,cplan,recathoncontext);
+	pfree(DatumGetPointer(paramvalues[0]));
+	if (!recindexname)
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_SCHEMA_NAME),
+			 errmsg("recommender %s not found",recname)));
+
+	return recindexname;
+}
+
+/* ----------------------------------------------------------------
+ *		recathon_export
+ *
+ *		SQL-callable bulk export of a recommender's best
+ *		predictions: creates a new table holding the best
+ *		n for every user, or for the users matching an
+ *		optional condition on the events table (aliased
+ *		as r), such as one segment of a nightly batch.
+ *		This is what materialize = N does for the RecView,
+ *		so it never holds more than one user's predictions
+ *		and skips the Sort and per-tuple insertion a
+ *		CREATE TABLE AS over a RECOMMEND query would need.
+ *		Returns the number of rows written.
+ * ----------------------------------------------------------------
+ */
+Datum
+recathon_export(PG_FUNCTION_ARGS) {
+	char *recname, *tablename, *userfilter = NULL;
+	char *recindexname;
+	char *eventtable, *userkey, *itemkey, *eventval, *method;
+	int topN;
+	int64 numWritten;
+	StringInfoData querystring;
+
+	recname = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	tablename = text_to_cstring(PG_GETARG_TEXT_PP(1));
+	topN = PG_GETARG_INT32(2);
+	if (PG_NARGS() > 3)
+		userfilter = text_to_cstring(PG_GETARG_TEXT_PP(3));
+
+	if (topN < 1 || topN > RECATHON_MAX_MATERIALIZE)
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("the number of predictions per user must be between 1 and %d",
+				RECATHON_MAX_MATERIALIZE)));
+
+	recindexname = lookupRecIndexName(recname);
+	getRecInfo(recindexname, &eventtable, &userkey, &itemkey,
+		&eventval, &method, NULL);
+
+	// The new table fails to be created if it already exists,
+	// which is what we want.
+	initStringInfo(&querystring);
+	appendStringInfo(&querystring,"CREATE TABLE %s (%s INTEGER NOT NULL, %s INTEGER NOT NULL, %s REAL NOT NULL);",
+		tablename,userkey,itemkey,eventval);
+	recathon_utilityExecute(querystring.data);
+	CommandCounterIncrement();
+
+	// Each user's best few are worth as much as a top-k query's.
+	resetStringInfo(&querystring);
+	appendStringInfo(&querystring,"SELECT r.%s, r.%s, r.%s FROM %s r RECOMMEND r.%s TO r.%s ON r.%s USING %s EXCLUDE RATED",
+		userkey,itemkey,eventval,eventtable,
+		itemkey,userkey,eventval,method);
+	if (userfilter)
+		appendStringInfo(&querystring," WHERE %s",userfilter);
+	appendStringInfoChar(&querystring,';');
+
+	numWritten = writeTopPredictions(querystring.data, tablename,
+		userkey, itemkey, eventval, topN);
+
+	pfree(querystring.data);
+	pfree(recname);
+	pfree(tablename);
+	if (userfilter)
+		pfree(userfilter);
+	pfree(recindexname);
+	pfree(eventtable);
+	pfree(userkey);
+	pfree(itemkey);
+	pfree(eventval);
+	pfree(method);
+
+	PG_RETURN_INT64(numWritten);
+}
+
+/* ----------------------------------------------------------------
+ *		loadSimilarModelNames
+ *
+ *		Fills in the names of the model tables of a built
+ *		recommender, from its index table, as transforming a
+ *		RECOMMEND clause does.
+ * ----------------------------------------------------------------
+ */
+static void
+loadSimilarModelNames(AttributeInfo *attributes) {
+	int i;
+	char *names[3];
+	TupleTableSlot *slot;
+
+	// Older factor recommenders have no column for the
+	// approximate top-k index.
+	slot = getRecIndexSlot(attributes->recIndexName);
+	if (!slot)
+		ereport(ERROR,
+			(errcode(ERRCODE_SYNTAX_ERROR),
+			 errmsg("recommender is built, but model could not be accessed")));
+	if (FACTOR_METHOD(attributes->method)) {
+		attributes->recModelName = getTupleString(slot,"recusermodelname");
+		attributes->recModelName2 = getTupleString(slot,"recitemmodelname");
+		attributes->recClusterName = getTupleString(slot,"recclustermodelname");
+	} else
+		attributes->recModelName = getTupleString(slot,"recmodelname");
+	ExecDropSingleTupleTableSlot(slot);
+
+	names[0] = attributes->recModelName;
+	names[1] = attributes->recModelName2;
+	names[2] = attributes->recClusterName;
+	for (i = 0; i < 3; i++) {
+		int j;
+
+		if (!names[i])
+			continue;
+		for (j = 0; j < strlen(names[i]); j++)
+			names[i][j] = tolower(names[i][j]);
+	}
+}
+
+/* ----------------------------------------------------------------
+ *		similarFromSimModel
+ *
+ *		Offers the neighbors of an item in a similarity model
+ *		to heap. Out of the model file or the model cache,
+ *		that's the item's row; otherwise we probe the model
+ *		table's index for the best k, under both columns
+ *		unless the model is symmetric.
+ * ----------------------------------------------------------------
+ */
+static void
+similarFromSimModel(RecScanState *recstate, int itemID, nbr_heap heap) {
+	int j, itemindex;
+	AttributeInfo *attributes = (AttributeInfo*) recstate->attributes;
+	GenSparseModel *model;
+	// Query objects.
+	char *querystring;
+	QueryDesc *queryDesc;
+	PlanState *planstate;
+	TupleTableSlot *slot;
+	CachedPlan *cplan;
+	MemoryContext recathoncontext;
+	tuple_column itemcol, simcol;
+	Oid paramtypes[1] = {INT4OID};
+	Datum paramvalues[1];
+
+	if (recstate->fullTotalItems > 0)
+		loadCachedItemSim(recstate);
+	model = recstate->itemCFmodel;
+	if (model) {
+		int *ranked = (int*) modelFileSection(recstate, MODEL_FILE_RANKED, NULL);
+
+		int *cols, start;
+
+		itemindex = itemIndex(recstate, itemID);
+		if (itemindex < 0)
+			return;
+		// A ranked row is read only as far as the heap needs.
+		cols = sparseRowColumns(model, itemindex, NULL);
+		start = model->rowStart[itemindex];
+		for (j = start; j < model->rowStart[itemindex+1]; j++) {
+			int entry = ranked ? ranked[j] : j;
+
+			if (cols[entry - start] == itemindex)
+				continue;
+			if (ranked && heap->size == heap->maxsize)
+				break;
+			nbrHeapInsert(heap, recstate->fullItemList[cols[entry - start]],
+				sparseValue(model, itemindex, entry));
+		}
+		return;
+	}
+
+	querystring = (char*) palloc(1024*sizeof(char));
+	if (recstate->modelSymmetric)
+		sprintf(querystring,"select item2 as item, similarity from %s where item1 = $1 order by similarity desc limit %d;",
+			attributes->recModelName,heap->maxsize);
+	else
+		sprintf(querystring,"select item2 as item, similarity from %s where item1 = $1 union all select item1, similarity from %s where item2 = $1 order by similarity desc limit %d;",
+			attributes->recModelName,attributes->recModelName,heap->maxsize);
+	paramvalues[0] = Int32GetDatum(itemID);
+	queryDesc = recathon_queryStartCached(querystring,1,paramtypes,paramvalues,
+		&cplan,&recathoncontext);
+	planstate = queryDesc->planstate;
+	bindColumn(&itemcol, "item");
+	bindColumn(&simcol, "similarity");
+
+	for (;;) {
+		int item;
+
+		slot = ExecProcNode(planstate);
+		if (TupIsNull(slot)) break;
+
+		item = columnInt(slot,&itemcol);
+		if (item != itemID)
+			nbrHeapInsert(heap, item, columnFloat(slot,&simcol));
+	}
+
+	recathon_queryEndCached(queryDesc,cplan,recathoncontext);
+	pfree(querystring);
+}
+
+/* ----------------------------------------------------------------
+ *		similarFromFactors
+ *
+ *		Offers the items of an SVD or ALS model to heap, by
+ *		the inner product of their factors with the item's.
+ *		With the approximate top-k index, only the items in
+ *		the clusters that look best for the item are scored,
+ *		as for a user.
+ * ----------------------------------------------------------------
+ */
+static void
+similarFromFactors(RecScanState *recstate, int itemID, nbr_heap heap) {
+	int i, start, itemindex, numFeatures, numItems;
+	int *items, *ids;
+	float *query, *buf, *scores;
+	AttributeInfo *attributes = (AttributeInfo*) recstate->attributes;
+
+	numFeatures = recstate->numFeatures = loadCachedItemFactors(recstate);
+	itemindex = itemIndex(recstate, itemID);
+	if (numFeatures <= 0 || itemindex < 0)
+		return;
+
+	buf = (float*) palloc(numFeatures*sizeof(float));
+	query = (float*) palloc(numFeatures*sizeof(float));
+	memcpy(query, itemFactors(recstate, itemindex, buf), numFeatures*sizeof(float));
+
+	items = NULL;
+	numItems = recstate->fullTotalItems;
+	if (attributes->recClusterName) {
+		loadItemClusters(recstate, attributes->recClusterName);
+		if (recstate->numClusters > 0) {
+			recstate->userFeatures = query;
+			probeItemClusters(recstate);
+			items = recstate->itemCandidates;
+			numItems = recstate->numCandidates;
+		}
+	}
+
+	// The products are worked out a batch at a time, and only the
+	// ones that could make the heap are offered to it.
+	ids = (int*) palloc(RECATHON_SCORE_BATCH*sizeof(int));
+	scores = (float*) palloc(RECATHON_SCORE_BATCH*sizeof(float));
+	for (start = 0; start < numItems; start += RECATHON_SCORE_BATCH) {
+		int count = Min(numItems - start, RECATHON_SCORE_BATCH);
+		int n = 0;
+
+		for (i = start; i < start + count; i++) {
+			int index = items ? items[i] : i;
+
+			if (index == itemindex)
+				continue;
+			ids[n] = recstate->fullItemList[index];
+			scores[n++] = factorDot(query, itemFactors(recstate, index, buf), numFeatures);
+		}
+		nbrHeapInsertBatch(heap, ids, scores, n);
+	}
+
+	pfree(ids);
+	pfree(scores);
+	pfree(buf);
+}
+
+/* ----------------------------------------------------------------
+ *		findSimilarItems
+ *
+ *		Finds the k items most like the given one according
+ *		to a built recommender, most similar first, reading
+ *		its model the way a scan would: out of the model file
+ *		or the shared model cache if it's there, and from the
+ *		model tables if not. Returns how many were found.
+ * ----------------------------------------------------------------
+ */
+static int
+findSimilarItems(char *recname, int itemID, int k, sim_entry **ret_entries) {
+	int i, numFound;
+	char *recindexname, *methodname;
+	recMethod method;
+	RecScanState *recstate;
+	AttributeInfo *attributes;
+	nbr_heap heap;
+	sim_entry *entries;
+	ListCell *lc;
+	MemoryContext lookupcontext, oldcontext;
+
+	// Everything but the answer goes when we're done.
+	lookupcontext = AllocSetContextCreate(CurrentMemoryContext,
+		"Recathon similar items",
+		ALLOCSET_DEFAULT_MINSIZE,
+		ALLOCSET_DEFAULT_INITSIZE,
+		ALLOCSET_DEFAULT_MAXSIZE);
+	oldcontext = MemoryContextSwitchTo(lookupcontext);
+
+	recindexname = lookupRecIndexName(recname);
+	for (i = 0; i < strlen(recindexname); i++)
+		recindexname[i] = tolower(recindexname[i]);
+	getRecInfo(recindexname, NULL, NULL, NULL, NULL, &methodname, NULL);
+	method = (recMethod) getRecMethod(methodname);
+	if (method != itemCosCF && method != itemPearCF && method != itemJaccardCF &&
+	    !FACTOR_METHOD(method))
+		ereport(ERROR,
+			(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+			 errmsg("recommender %s has no model of its items", recname),
+			 errhint("Similar items can be found with item-based, SVD and ALS recommenders.")));
+
+	attributes = makeNode(AttributeInfo);
+	attributes->recName = recname;
+	attributes->method = method;
+	attributes->opType = OP_FILTER;
+	attributes->recIndexName = recindexname;
+	loadSimilarModelNames(attributes);
+
+	// A scan of our own, with nothing in it but the model.
+	recstate = makeNode(RecScanState);
+	recstate->attributes = (Node*) attributes;
+	recstate->modelPrecision = RECATHON_FULL_PRECISION;
+	if (recathonCacheEnabled() || modelFileExists(recindexname)) {
+		uint32 version = modelVersion(recindexname);
+
+		if (recathonCacheEnabled()) {
+			recstate->cacheVersion = version;
+			recstate->modelPrecision = loadModelPrecision(recindexname);
+		}
+		recstate->modelFile = openModelFile(recindexname, version);
+	}
+	recstate->modelSymmetric = getRecSymmetric(recindexname);
+	recstate->fullTotalItems = loadCachedIDDictionary(recstate,
+		"items", &recstate->fullItemList);
+	if (recstate->fullTotalItems > 0)
+		buildItemMap(recstate);
+
+	if (recstate->fullTotalItems > 0)
+		k = Min(k, recstate->fullTotalItems);
+	heap = nbrHeapCreate(k);
+	if (FACTOR_METHOD(method)) {
+		// Recommenders from before the dictionary have nothing to
+		// order their item factors by.
+		if (recstate->fullTotalItems <= 0)
+			ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("recommender %s has no list of its items", recname),
+				 errhint("It gets one the next time its model is rebuilt.")));
+		similarFromFactors(recstate, itemID, heap);
+	} else
+		similarFromSimModel(recstate, itemID, heap);
+
+	// The answer, best first.
+	MemoryContextSwitchTo(oldcontext);
+	numFound = heap->size;
+	entries = (sim_entry*) palloc(Max(numFound, 1)*sizeof(sim_entry));
+	for (i = 0; i < numFound; i++) {
+		entries[i].id = heap->index[i];
+		entries[i].event = heap->similarity[i];
+	}
+	qsort(entries, numFound, sizeof(sim_entry), simEntryEventCompare);
+
+	foreach(lc, recstate->cachePins)
+		recathonCacheRelease(lfirst_int(lc));
+	closeModelFile(recstate->modelFile);
+	MemoryContextDelete(lookupcontext);
+
+	(*ret_entries) = entries;
+	return numFound;
+}
+
+/* ----------------------------------------------------------------
+ *		recathon_similar_items
+ *
+ *		SQL-callable lookup of the k items most like a given
+ *		one, according to a built item-based, SVD or ALS
+ *		recommender, for "related items" without a user. It
+ *		returns each item with its similarity, or the inner
+ *		product of its factors with the item's, most similar
+ *		first. An item the recommender doesn't know has no
+ *		similar items.
+ * ----------------------------------------------------------------
+ */
+Datum
+recathon_similar_items(PG_FUNCTION_ARGS) {
+	FuncCallContext *funcctx;
+	sim_entry *entries;
+
+	if (SRF_IS_FIRSTCALL()) {
+		char *recname;
+		int itemID, k;
+		TupleDesc tupdesc;
+		MemoryContext oldcontext;
+
+		funcctx = SRF_FIRSTCALL_INIT();
+		oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+		recname = text_to_cstring(PG_GETARG_TEXT_PP(0));
+		itemID = PG_GETARG_INT32(1);
+		k = PG_GETARG_INT32(2);
+		if (k < 1)
+			ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("the number of similar items must be at least 1")));
+
+		if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+			elog(ERROR, "return type must be a row type");
+		funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+		funcctx->max_calls = findSimilarItems(recname, itemID, k, &entries);
+		funcctx->user_fctx = entries;
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	funcctx = SRF_PERCALL_SETUP();
+	entries = (sim_entry*) funcctx->user_fctx;
+
+	if (funcctx->call_cntr < funcctx->max_calls) {
+		Datum values[2];
+		bool nulls[2] = {false, false};
+		HeapTuple tuple;
+
+		values[0] = Int32GetDatum(entries[funcctx->call_cntr].id);
+		values[1] = Float4GetDatum(entries[funcctx->call_cntr].event);
+		tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+		SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+	}
+
+	SRF_RETURN_DONE(funcctx);
+}
+
+/* ----------------------------------------------------------------
+ *		recommendFromCache
+ *
+ *		Looks for a user's best k predictions in the result
+ *		cache, keeping only the candidates if there's a list
+ *		of them, sorted. A filtered list has to come from
+ *		everything the cache holds, and it's only an answer
+ *		if it still has k items or the cache has all of the
+ *		user's. Returns how many there are, or -1 for a miss,
+ *		along with the generation recathonResultStore needs.
+ * ----------------------------------------------------------------
+ */
+static int
+recommendFromCache(char *recindexname, uint32 version, int userID, int k,
+		int *candidates, int numCandidates, sim_entry *entries,
+		uint32 *ret_generation) {
+	int i, count, numFound;
+	int *items;
+	float *scores;
+
+	if (version == 0)
+		return -1;
+
+	items = (int*) palloc(RECATHON_RESULT_LENGTH*sizeof(int));
+	scores = (float*) palloc(RECATHON_RESULT_LENGTH*sizeof(float));
+	count = recathonResultLookup(recindexname, userID, version,
+		candidates ? RECATHON_RESULT_LENGTH : k, items, scores, ret_generation);
+
+	numFound = 0;
+	for (i = 0; i < count && numFound < k; i++) {
+		if (candidates && binarySearch(candidates, items[i], 0, numCandidates) < 0)
+			continue;
+		entries[numFound].id = items[i];
+		entries[numFound].event = scores[i];
+		numFound++;
+	}
+	if (count < 0 || (candidates && numFound < k && count >= RECATHON_RESULT_LENGTH))
+		numFound = -1;
+
+	pfree(items);
+	pfree(scores);
+	return numFound;
+}
+
+/* ----------------------------------------------------------------
+ *		recommendForUser
+ *
+ *		Finds a user's best k predictions from a recommender,
+ *		best first, among the candidate items if it's given
+ *		any. The result cache is tried first, which takes no
+ *		RECOMMEND query at all. Otherwise we run the query a
+ *		client would have, as a kept plan, which leaves the
+ *		user's list in the cache for next time; without
+ *		candidates, we ask for all that the cache keeps, so
+ *		any k up to that will find it there. Returns how many
+ *		were found.
+ * ----------------------------------------------------------------
+ */
+static int
+recommendForUser(char *recname, int userID, int k, ArrayType *candidatearray,
+		sim_entry **ret_entries) {
+	int i, numFound, numCandidates = 0;
+	int *candidates = NULL;
+	char *recindexname;
+	char *eventtable, *userkey, *itemkey, *eventval, *method;
+	sim_entry *entries;
+	StringInfoData querystring;
+	// Query objects.
+	QueryDesc *queryDesc;
+	TupleTableSlot *slot;
+	CachedPlan *cplan;
+	MemoryContext recathoncontext, lookupcontext, oldcontext;
+	tuple_column itemcol, eventcol;
+	Oid paramtypes[2] = {INT4OID, INT4ARRAYOID};
+	Datum paramvalues[2];
+
+	if (candidatearray) {
+		if (ARR_NDIM(candidatearray) > 1 || ARR_HASNULL(candidatearray))
+			ereport(ERROR,
+				(errcode(ERRCODE_DATA_EXCEPTION),
+				 errmsg("ID lists must be one-dimensional arrays without nulls")));
+		numCandidates = ARR_NDIM(candidatearray) == 0 ? 0 : ARR_DIMS(candidatearray)[0];
+	}
+
+	entries = (sim_entry*) palloc(k*sizeof(sim_entry));
+	if (candidatearray && numCandidates == 0) {
+		(*ret_entries) = entries;
+		return 0;
+	}
+
+	// Everything but the answer goes when we're done.
+	lookupcontext = AllocSetContextCreate(CurrentMemoryContext,
+		"Recathon recommend",
+		ALLOCSET_DEFAULT_MINSIZE,
+		ALLOCSET_DEFAULT_INITSIZE,
+		ALLOCSET_DEFAULT_MAXSIZE);
+	oldcontext = MemoryContextSwitchTo(lookupcontext);
+
+	if (candidatearray) {
+		candidates = (int*) palloc(numCandidates*sizeof(int));
+		memcpy(candidates, ARR_DATA_PTR(candidatearray), numCandidates*sizeof(int));
+		qsort(candidates, numCandidates, sizeof(int), intCompare);
+	}
+
+	recindexname = lookupRecIndexName(recname);
+	for (i = 0; i < strlen(recindexname); i++)
+		recindexname[i] = tolower(recindexname[i]);
+
+	numFound = -1;
+	if (recathonResultCacheEnabled() && k <= RECATHON_RESULT_LENGTH) {
+		uint32 generation;
+
+		numFound = recommendFromCache(recindexname, modelVersion(recindexname),
+			userID, k, candidates, numCandidates, entries, &generation);
+	}
+
+	if (numFound < 0) {
+		getRecInfo(recindexname, &eventtable, &userkey, &itemkey,
+			&eventval, &method, NULL);
+
+		// The query takes the user and candidates as parameters, so
+		// its plan is kept for every call with the same recommender,
+		// and the RECOMMEND clause is only rewritten the first time.
+		initStringInfo(&querystring);
+		appendStringInfo(&querystring,"SELECT r.%s, r.%s FROM %s r RECOMMEND r.%s TO r.%s ON r.%s USING %s WHERE r.%s = $1",
+			itemkey,eventval,eventtable,
+			itemkey,userkey,eventval,method,
+			userkey);
+		if (candidates)
+			appendStringInfo(&querystring," AND r.%s = ANY($2)",itemkey);
+		appendStringInfo(&querystring," ORDER BY r.%s DESC LIMIT %d;",
+			eventval,candidates ? k : Max(k, RECATHON_RESULT_LENGTH));
+
+		paramvalues[0] = Int32GetDatum(userID);
+		paramvalues[1] = PointerGetDatum(candidatearray);
+		queryDesc = recathon_queryStartCached(querystring.data,candidates ? 2 : 1,
+			paramtypes,paramvalues,&cplan,&recathoncontext);
+		bindColumn(&itemcol, itemkey);
+		bindColumn(&eventcol, eventval);
+		numFound = 0;
+		while (numFound < k) {
+			slot = ExecProcNode(queryDesc->planstate);
+			if (TupIsNull(slot)) break;
+
+			entries[numFound].id = columnInt(slot,&itemcol);
+			entries[numFound].event = columnFloat(slot,&eventcol);
+			numFound++;
+		}
+		recathon_queryEndCached(queryDesc,cplan,recathoncontext);
+	}
+
+	MemoryContextSwitchTo(oldcontext);
+	MemoryContextDelete(lookupcontext);
+
+	(*ret_entries) = entries;
+	return numFound;
+}
+
+/* ----------------------------------------------------------------
+ *		recathon_recommend
+ *
+ *		SQL-callable lookup of a user's k best predictions
+ *		from a built recommender, best first, optionally
+ *		among a list of candidate items. It's meant for the
+ *		hot path of an application: a user whose list is in
+ *		the result cache gets it without a RECOMMEND query to
+ *		parse, rewrite, plan or start up, and anyone else is
+ *		scored by the query the application would have run.
+ * ----------------------------------------------------------------
+ */
+Datum
+recathon_recommend(PG_FUNCTION_ARGS) {
+	FuncCallContext *funcctx;
+	sim_entry *entries;
+
+	if (SRF_IS_FIRSTCALL()) {
+		char *recname;
+		int userID, k;
+		ArrayType *candidates = NULL;
+		TupleDesc tupdesc;
+		MemoryContext oldcontext;
+
+		funcctx = SRF_FIRSTCALL_INIT();
+		oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+		recname = text_to_cstring(PG_GETARG_TEXT_PP(0));
+		userID = PG_GETARG_INT32(1);
+		k = PG_GETARG_INT32(2);
+		if (PG_NARGS() > 3)
+			candidates = PG_GETARG_ARRAYTYPE_P(3);
+		if (k < 1)
+			ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("the number of recommendations must be at least 1")));
+
+		if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+			elog(ERROR, "return type must be a row type");
+		funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+		funcctx->max_calls = recommendForUser(recname, userID, k, candidates, &entries);
+		funcctx->user_fctx = entries;
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	funcctx = SRF_PERCALL_SETUP();
+	entries = (sim_entry*) funcctx->user_fctx;
+
+	if (funcctx->call_cntr < funcctx->max_calls) {
+		Datum values[2];
+		bool nulls[2] = {false, false};
+		HeapTuple tuple;
+
+		values[0] = Int32GetDatum(entries[funcctx->call_cntr].id);
+		values[1] = Float4GetDatum(entries[funcctx->call_cntr].event);
+		tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+		SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+	}
+
+	SRF_RETURN_DONE(funcctx);
+}
+
+/* One row of recathon_recommend_batch's answer. */
+typedef struct batch_entry {
+	int		userID;
+	int		itemID;
+	float		event;
+} batch_entry;
+
+/* ----------------------------------------------------------------
+ *		recommendForUsers
+ *
+ *		recommendForUser, for a list of users at once. Each
+ *		user whose list is in the result cache gets it from
+ *		there, and the rest are scored by one RECOMMEND query
+ *		for all of them, so the recommender is only set up
+ *		and its models loaded once. We keep each user's best
+ *		k as their predictions go by, and put them in the
+ *		cache for next time. The answer has each user's best
+ *		first, in the order the users were given, once each.
+ *		Returns how many rows there are.
+ * ----------------------------------------------------------------
+ */
+static int
+recommendForUsers(char *recname, ArrayType *userarray, int k,
+		batch_entry **ret_entries) {
+	int i, j, numUsers, numMissed, numRows;
+	int *userIDs, *missed, *sortedIDs;
+	int *counts;
+	sim_entry *found;
+	nbr_heap *heaps;
+	uint32 version = 0;
+	uint32 *generations;
+	bool useCache;
+	char *recindexname;
+	char *eventtable, *userkey, *itemkey, *eventval, *method;
+	batch_entry *entries;
+	StringInfoData querystring;
+	// Query objects.
+	QueryDesc *queryDesc;
+	TupleTableSlot *slot;
+	CachedPlan *cplan;
+	MemoryContext recathoncontext, lookupcontext, oldcontext;
+	tuple_column usercol, itemcol, eventcol;
+	Oid paramtypes[1] = {INT4ARRAYOID};
+	Datum paramvalues[1];
+
+	if (ARR_NDIM(userarray) > 1 || ARR_HASNULL(userarray))
+		ereport(ERROR,
+			(errcode(ERRCODE_DATA_EXCEPTION),
+			 errmsg("ID lists must be one-dimensional arrays without nulls")));
+	numUsers = ARR_NDIM(userarray) == 0 ? 0 : ARR_DIMS(userarray)[0];
+	if (numUsers == 0) {
+		(*ret_entries) = (batch_entry*) palloc(sizeof(batch_entry));
+		return 0;
+	}
+
+	// Everything but the answer goes when we're done.
+	lookupcontext = AllocSetContextCreate(CurrentMemoryContext,
+		"Recathon recommend batch",
+		ALLOCSET_DEFAULT_MINSIZE,
+		ALLOCSET_DEFAULT_INITSIZE,
+		ALLOCSET_DEFAULT_MAXSIZE);
+	oldcontext = MemoryContextSwitchTo(lookupcontext);
+
+	// Each user is answered once, at their place in the sorted list.
+	userIDs = (int*) ARR_DATA_PTR(userarray);
+	sortedIDs = (int*) palloc(numUsers*sizeof(int));
+	memcpy(sortedIDs, userIDs, numUsers*sizeof(int));
+	qsort(sortedIDs, numUsers, sizeof(int), intCompare);
+	for (i = 0, j = 0; i < numUsers; i++)
+		if (j == 0 || sortedIDs[j-1] != sortedIDs[i])
+			sortedIDs[j++] = sortedIDs[i];
+	numUsers = j;
+	counts = (int*) palloc(numUsers*sizeof(int));
+	found = (sim_entry*) palloc((Size) numUsers*k*sizeof(sim_entry));
+	generations = (uint32*) palloc(numUsers*sizeof(uint32));
+
+	recindexname = lookupRecIndexName(recname);
+	for (i = 0; i < strlen(recindexname); i++)
+		recindexname[i] = tolower(recindexname[i]);
+
+	useCache = recathonResultCacheEnabled() && k <= RECATHON_RESULT_LENGTH;
+	if (useCache)
+		version = modelVersion(recindexname);
+
+	missed = (int*) palloc(numUsers*sizeof(int));
+	numMissed = 0;
+	for (i = 0; i < numUsers; i++) {
+		counts[i] = -1;
+		if (useCache)
+			counts[i] = recommendFromCache(recindexname, version, sortedIDs[i], k,
+				NULL, 0, found + (Size) i*k, &generations[i]);
+		if (counts[i] < 0)
+			missed[numMissed++] = sortedIDs[i];
+	}
+
+	if (numMissed > 0) {
+		Datum *missedIDs;
+
+		getRecInfo(recindexname, &eventtable, &userkey, &itemkey,
+			&eventval, &method, NULL);
+
+		missedIDs = (Datum*) palloc(numMissed*sizeof(Datum));
+		for (i = 0; i < numMissed; i++)
+			missedIDs[i] = Int32GetDatum(missed[i]);
+		paramvalues[0] = PointerGetDatum(construct_array(missedIDs, numMissed,
+			INT4OID, sizeof(int32), true, 'i'));
+
+		heaps = (nbr_heap*) palloc(numUsers*sizeof(nbr_heap));
+		for (i = 0; i < numUsers; i++)
+			heaps[i] = counts[i] < 0 ? nbrHeapCreate(k) : NULL;
+
+		// There's no LIMIT to leave out what each user has rated, as
+		// the lists in the cache do, so we ask for that.
+		initStringInfo(&querystring);
+		appendStringInfo(&querystring,"SELECT r.%s, r.%s, r.%s FROM %s r RECOMMEND r.%s TO r.%s ON r.%s USING %s EXCLUDE RATED WHERE r.%s = ANY($1);",
+			userkey,itemkey,eventval,eventtable,
+			itemkey,userkey,eventval,method,
+			userkey);
+		queryDesc = recathon_queryStartCached(querystring.data,1,
+			paramtypes,paramvalues,&cplan,&recathoncontext);
+		bindColumn(&usercol, userkey);
+		bindColumn(&itemcol, itemkey);
+		bindColumn(&eventcol, eventval);
+		for (;;) {
+			int pos;
+
+			CHECK_FOR_INTERRUPTS();
+
+			slot = ExecProcNode(queryDesc->planstate);
+			if (TupIsNull(slot)) break;
+
+			pos = binarySearch(sortedIDs, columnInt(slot,&usercol), 0, numUsers);
+			if (pos < 0 || !heaps[pos])
+				continue;
+			nbrHeapInsert(heaps[pos], columnInt(slot,&itemcol),
+				columnFloat(slot,&eventcol));
+		}
+		recathon_queryEndCached(queryDesc,cplan,recathoncontext);
+
+		// Each user's best, best first, and kept for next time.
+		for (i = 0; i < numUsers; i++) {
+			sim_entry *best = found + (Size) i*k;
+			int *items;
+			float *scores;
+
+			if (!heaps[i])
+				continue;
+			counts[i] = heaps[i]->size;
+			for (j = 0; j < counts[i]; j++) {
+				best[j].id = heaps[i]->index[j];
+				best[j].event = heaps[i]->similarity[j];
+			}
+			qsort(best, counts[i], sizeof(sim_entry), simEntryEventCompare);
+			if (!useCache || version == 0)
+				continue;
+
+			items = (int*) palloc(Max(counts[i], 1)*sizeof(int));
+			scores = (float*) palloc(Max(counts[i], 1)*sizeof(float));
+			for (j = 0; j < counts[i]; j++) {
+				items[j] = best[j].id;
+				scores[j] = best[j].event;
+			}
+			recathonResultStore(recindexname, eventtable, sortedIDs[i],
+				version, generations[i], counts[i], counts[i] < k,
+				items, scores);
+			pfree(items);
+			pfree(scores);
+		}
+	}
+
+	// The answer, in the order the users were given.
+	MemoryContextSwitchTo(oldcontext);
+	numRows = 0;
+	for (i = 0; i < numUsers; i++)
+		numRows += Max(counts[i], 0);
+	entries = (batch_entry*) palloc(Max(numRows, 1)*sizeof(batch_entry));
+	numRows = 0;
+	for (i = 0; i < ARR_DIMS(userarray)[0]; i++) {
+		int pos = binarySearch(sortedIDs, userIDs[i], 0, numUsers);
+
+		if (counts[pos] < 0)
+			continue;
+		for (j = 0; j < counts[pos]; j++) {
+			entries[numRows].userID = userIDs[i];
+			entries[numRows].itemID = found[(Size) pos*k + j].id;
+			entries[numRows].event = found[(Size) pos*k + j].event;
+			numRows++;
+		}
+		// A user named twice is only answered the first time.
+		counts[pos] = -1;
+	}
+	MemoryContextDelete(lookupcontext);
+
+	(*ret_entries) = entries;
+	return numRows;
+}
+
+/* ----------------------------------------------------------------
+ *		recathon_recommend_batch
+ *
+ *		SQL-callable lookup of the k best predictions for
+ *		each of a list of users, as recathon_recommend would
+ *		give them one at a time, in a single result.
+ * ----------------------------------------------------------------
+ */
+Datum
+recathon_recommend_batch(PG_FUNCTION_ARGS) {
+	FuncCallContext *funcctx;
+	batch_entry *entries;
+
+	if (SRF_IS_FIRSTCALL()) {
+		char *recname;
+		int k;
+		TupleDesc tupdesc;
+		MemoryContext oldcontext;
+
+		funcctx = SRF_FIRSTCALL_INIT();
+		oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+		recname = text_to_cstring(PG_GETARG_TEXT_PP(0));
+		k = PG_GETARG_INT32(2);
+		if (k < 1)
+			ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("the number of recommendations must be at least 1")));
+
+		if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+			elog(ERROR, "return type must be a row type");
+		funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+		funcctx->max_calls = recommendForUsers(recname, PG_GETARG_ARRAYTYPE_P(1),
+			k, &entries);
+		funcctx->user_fctx = entries;
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	funcctx = SRF_PERCALL_SETUP();
+	entries = (batch_entry*) funcctx->user_fctx;
+
+	if (funcctx->call_cntr < funcctx->max_calls) {
+		Datum values[3];
+		bool nulls[3] = {false, false, false};
+		HeapTuple tuple;
+
+		values[0] = Int32GetDatum(entries[funcctx->call_cntr].userID);
+		values[1] = Int32GetDatum(entries[funcctx->call_cntr].itemID);
+		values[2] = Float4GetDatum(entries[funcctx->call_cntr].event);
+		tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+		SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+	}
+
+	SRF_RETURN_DONE(funcctx);
+}
+
+/* How a group's predictions for an item are combined. */
+typedef enum {
+	GROUP_AVERAGE,		/* the average of the members' */
+	GROUP_LEAST_MISERY,	/* the least happy member's */
+	GROUP_MOST_PLEASURE	/* the happiest member's */
+} group_aggregate;
+
+/* What the members of a group predict for one item, so far. */
+typedef struct group_entry {
+	int		itemID;		/* the hash key */
+	int		members;	/* how many have predicted it */
+	double		sum;
+	float		min;
+	float		max;
+} group_entry;
+
+/* ----------------------------------------------------------------
+ *		recommendForGroup
+ *
+ *		Finds the k items a group of users would like best
+ *		together, such as a household picking a film, best
+ *		first. All of the members are scored by one RECOMMEND
+ *		query, which leaves out what each of them has rated,
+ *		and their predictions are combined item by item as
+ *		they go by, so only an item's running total is kept.
+ *		An item one of the members has rated is left out
+ *		altogether. Returns how many were found.
+ * ----------------------------------------------------------------
+ */
+static int
+recommendForGroup(char *recname, ArrayType *userarray, int k, char *aggregate,
+		sim_entry **ret_entries) {
+	int i, j, numUsers, numFound;
+	int *userIDs;
+	group_aggregate how = GROUP_AVERAGE;
+	char *recindexname;
+	char *eventtable, *userkey, *itemkey, *eventval, *method;
+	sim_entry *entries;
+	nbr_heap heap;
+	group_entry *entry;
+	HTAB *items;
+	HASHCTL ctl;
+	HASH_SEQ_STATUS status;
+	Datum *IDs;
+	StringInfoData querystring;
+	// Query objects.
+	QueryDesc *queryDesc;
+	TupleTableSlot *slot;
+	CachedPlan *cplan;
+	MemoryContext recathoncontext, lookupcontext, oldcontext;
+	tuple_column itemcol, eventcol;
+	Oid paramtypes[1] = {INT4ARRAYOID};
+	Datum paramvalues[1];
+
+	if (pg_strcasecmp(aggregate, "avg") == 0)
+		;
+	else if (pg_strcasecmp(aggregate, "min") == 0 ||
+		 pg_strcasecmp(aggregate, "least_misery") == 0)
+		how = GROUP_LEAST_MISERY;
+	else if (pg_strcasecmp(aggregate, "max") == 0 ||
+		 pg_strcasecmp(aggregate, "most_pleasure") == 0)
+		how = GROUP_MOST_PLEASURE;
+	else
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("unrecognized group aggregate \"%s\"", aggregate),
+			 errhint("Valid aggregates are \"avg\", \"min\" or \"least_misery\", and \"max\" or \"most_pleasure\".")));
+
+	if (ARR_NDIM(userarray) > 1 || ARR_HASNULL(userarray))
+		ereport(ERROR,
+			(errcode(ERRCODE_DATA_EXCEPTION),
+			 errmsg("ID lists must be one-dimensional arrays without nulls")));
+	numUsers = ARR_NDIM(userarray) == 0 ? 0 : ARR_DIMS(userarray)[0];
+	entries = (sim_entry*) palloc(k*sizeof(sim_entry));
+	if (numUsers == 0) {
+		(*ret_entries) = entries;
+		return 0;
+	}
+
+	// Everything but the answer goes when we're done.
+	lookupcontext = AllocSetContextCreate(CurrentMemoryContext,
+		"Recathon recommend group",
+		ALLOCSET_DEFAULT_MINSIZE,
+		ALLOCSET_DEFAULT_INITSIZE,
+		ALLOCSET_DEFAULT_MAXSIZE);
+	oldcontext = MemoryContextSwitchTo(lookupcontext);
+
+	// A member named twice still counts once.
+	userIDs = (int*) palloc(numUsers*sizeof(int));
+	memcpy(userIDs, ARR_DATA_PTR(userarray), numUsers*sizeof(int));
+	qsort(userIDs, numUsers, sizeof(int), intCompare);
+	for (i = 0, j = 0; i < numUsers; i++)
+		if (j == 0 || userIDs[j-1] != userIDs[i])
+			userIDs[j++] = userIDs[i];
+	numUsers = j;
+	IDs = (Datum*) palloc(numUsers*sizeof(Datum));
+	for (i = 0; i < numUsers; i++)
+		IDs[i] = Int32GetDatum(userIDs[i]);
+	paramvalues[0] = PointerGetDatum(construct_array(IDs, numUsers,
+		INT4OID, sizeof(int32), true, 'i'));
+
+	recindexname = lookupRecIndexName(recname);
+	for (i = 0; i < strlen(recindexname); i++)
+		recindexname[i] = tolower(recindexname[i]);
+	getRecInfo(recindexname, &eventtable, &userkey, &itemkey,
+		&eventval, &method, NULL);
+
+	MemSet(&ctl, 0, sizeof(ctl));
+	ctl.keysize = sizeof(int);
+	ctl.entrysize = sizeof(group_entry);
+	ctl.hash = tag_hash;
+	ctl.hcxt = lookupcontext;
+	items = hash_create("Recathon group items", 1024, &ctl,
+		HASH_ELEM | HASH_FUNCTION | HASH_CONTEXT);
+
+	initStringInfo(&querystring);
+	appendStringInfo(&querystring,"SELECT r.%s, r.%s FROM %s r RECOMMEND r.%s TO r.%s ON r.%s USING %s EXCLUDE RATED WHERE r.%s = ANY($1);",
+		itemkey,eventval,eventtable,
+		itemkey,userkey,eventval,method,
+		userkey);
+	queryDesc = recathon_queryStartCached(querystring.data,1,
+		paramtypes,paramvalues,&cplan,&recathoncontext);
+	bindColumn(&itemcol, itemkey);
+	bindColumn(&eventcol, eventval);
+	for (;;) {
+		int itemID;
+		float event;
+		bool found;
+
+		CHECK_FOR_INTERRUPTS();
+
+		slot = ExecProcNode(queryDesc->planstate);
+		if (TupIsNull(slot)) break;
+
+		itemID = columnInt(slot,&itemcol);
+		event = columnFloat(slot,&eventcol);
+		entry = (group_entry*) hash_search(items, &itemID, HASH_ENTER, &found);
+		if (!found) {
+			entry->members = 0;
+			entry->sum = 0.0;
+			entry->min = event;
+			entry->max = event;
+		}
+		entry->members++;
+		entry->sum += event;
+		if (event < entry->min)
+			entry->min = event;
+		if (event > entry->max)
+			entry->max = event;
+	}
+	recathon_queryEndCached(queryDesc,cplan,recathoncontext);
+
+	// An item missing a member's prediction is one they've rated.
+	heap = nbrHeapCreate(k);
+	hash_seq_init(&status, items);
+	while ((entry = (group_entry*) hash_seq_search(&status)) != NULL) {
+		float score;
+
+		if (entry->members < numUsers)
+			continue;
+		switch (how) {
+			case GROUP_LEAST_MISERY:
+				score = entry->min;
+				break;
+			case GROUP_MOST_PLEASURE:
+				score = entry->max;
+				break;
+			default:
+				score = (float) (entry->sum / entry->members);
+				break;
+		}
+		nbrHeapInsert(heap, entry->itemID, score);
+	}
+
+	numFound = heap->size;
+	for (i = 0; i < numFound; i++) {
+		entries[i].id = heap->index[i];
+		entries[i].event = heap->similarity[i];
+	}
+	qsort(entries, numFound, sizeof(sim_entry), simEntryEventCompare);
+
+	MemoryContextSwitchTo(oldcontext);
+	MemoryContextDelete(lookupcontext);
+
+	(*ret_entries) = entries;
+	return numFound;
+}
+
+/* ----------------------------------------------------------------
+ *		recathon_recommend_group
+ *
+ *		SQL-callable lookup of the k best items for a group
+ *		of users together, with their predictions combined
+ *		by the given aggregate, or averaged without one.
+ * ----------------------------------------------------------------
+ */
+Datum
+recathon_recommend_group(PG_FUNCTION_ARGS) {
+	FuncCallContext *funcctx;
+	sim_entry *entries;
+
+	if (SRF_IS_FIRSTCALL()) {
+		char *recname, *aggregate = "avg";
+		int k;
+		TupleDesc tupdesc;
+		MemoryContext oldcontext;
+
+		funcctx = SRF_FIRSTCALL_INIT();
+		oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+		recname = text_to_cstring(PG_GETARG_TEXT_PP(0));
+		k = PG_GETARG_INT32(2);
+		if (PG_NARGS() > 3)
+			aggregate = text_to_cstring(PG_GETARG_TEXT_PP(3));
+		if (k < 1)
+			ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("the number of recommendations must be at least 1")));
+
+		if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+			elog(ERROR, "return type must be a row type");
+		funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+		funcctx->max_calls = recommendForGroup(recname, PG_GETARG_ARRAYTYPE_P(1),
+			k, aggregate, &entries);
+		funcctx->user_fctx = entries;
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	funcctx = SRF_PERCALL_SETUP();
+	entries = (sim_entry*) funcctx->user_fctx;
+
+	if (funcctx->call_cntr < funcctx->max_calls) {
+		Datum values[2];
+		bool nulls[2] = {false, false};
+		HeapTuple tuple;
+
+		values[0] = Int32GetDatum(entries[funcctx->call_cntr].id);
+		values[1] = Float4GetDatum(entries[funcctx->call_cntr].event);
+		tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+		SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+	}
+
+	SRF_RETURN_DONE(funcctx);
+}
+
+/* ----------------------------------------------------------------
+ *		evaluationOptions
+ *
+ *		The WITH clause that builds a recommender's model
+ *		again, as its catalogue entry has it: the same
+ *		options a rebuild goes by, along with its sample,
+ *		its model file and its approximate top-k index,
+ *		which change how fast it's queried. Nothing that
+ *		only matters to a live recommender comes along.
+ * ----------------------------------------------------------------
+ */
+static char *
+evaluationOptions(char *recindexname, recMethod method) {
+	sim_params params;
+	char *fraction, *clustername = NULL;
+	StringInfoData options;
+	TupleTableSlot *slot;
+
+	initStringInfo(&options);
+	if (!FACTOR_METHOD(method)) {
+		getRecSimParams(recindexname, &params);
+		if (params.neighborhood > 0)
+			appendStringInfo(&options,", neighborhood = %d",params.neighborhood);
+		if (params.minSupport > 0)
+			appendStringInfo(&options,", min_support = %d",params.minSupport);
+		if (params.minSimilarity > 0.0)
+			appendStringInfo(&options,", min_similarity = %g",params.minSimilarity);
+		if (params.lshBands > 0)
+			appendStringInfo(&options,", lsh_bands = %d, lsh_rows = %d",
+				params.lshBands,params.lshRows);
+		if (params.userClusters > 0)
+			appendStringInfo(&options,", user_clusters = %d, cluster_probes = %d",
+				params.userClusters,params.clusterProbes);
+		if (getRecSymmetric(recindexname))
+			appendStringInfoString(&options,", symmetric = true");
+	} else {
+		slot = getRecIndexSlot(recindexname);
+		if (slot) {
+			clustername = getTupleString(slot,"recclustermodelname");
+			ExecDropSingleTupleTableSlot(slot);
+		}
+		if (clustername) {
+			appendStringInfo(&options,", ann_clusters = %d",countClusters(clustername));
+			pfree(clustername);
+		}
+	}
+	if (catalogueInt(recindexname,"modelfile"))
+		appendStringInfoString(&options,", model_file = true");
+	fraction = catalogueString(recindexname,"samplefraction");
+	if (fraction) {
+		appendStringInfo(&options,", sample_fraction = %s",fraction);
+		pfree(fraction);
+	}
+	return options.data;
+}
+
+/* ----------------------------------------------------------------
+ *		recathon_evaluate
+ *
+ *		SQL-callable evaluation of a recommender, for tuning
+ *		its options. A share of its events, picked by a hash
+ *		of the user and item so that every run holds out the
+ *		same ones, is put aside, and a recommender is built
+ *		on the rest by CREATE RECOMMENDER, with the options
+ *		the recommender has, or with the ones given instead.
+ *		The users with held out events are then scored the
+ *		way recathon_recommend_batch scores them, for their
+ *		best k, and their held out items the way
+ *		recathon_recommend scores candidates. We report the
+ *		RMSE of those, precision and recall at k, the build
+ *		time, the size of the model, and the scoring time
+ *		per user. The recommender and both halves of the
+ *		events are dropped before we return.
+ * ----------------------------------------------------------------
+ */
+Datum
+recathon_evaluate(PG_FUNCTION_ARGS) {
+	char *recname, *recindexname, *evalname, *evalindexname, *options;
+	char *eventtable, *userkey, *itemkey, *eventval, *method, *source;
+	char *modelname, *modelname2 = NULL, *clustername = NULL;
+	float holdout;
+	int i, j, k, numUsers, numHeld, numPredicted, numRows;
+	int *userIDs, *userStart, *heldItems;
+	float *heldEvents;
+	double sqError, precision, recall;
+	int64 modelSize;
+	Datum *userDatums;
+	batch_entry *entries;
+	instr_time buildStart, buildTime, scoreStart, scoreTime;
+	StringInfoData querystring;
+	TupleTableSlot *slot;
+	TupleDesc tupdesc;
+	Datum values[7];
+	bool nulls[7] = {false, false, false, false, false, false, false};
+	bool isnull;
+	// Query objects.
+	QueryDesc *queryDesc;
+	MemoryContext recathoncontext;
+	tuple_column usercol, itemcol, eventcol;
+
+	recname = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	holdout = PG_GETARG_FLOAT4(1);
+	k = PG_GETARG_INT32(2);
+	if (holdout <= 0.0 || holdout >= 1.0)
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("the holdout fraction must be between 0 and 1")));
+	if (k < 1)
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("the number of recommendations must be at least 1")));
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	recindexname = lookupRecIndexName(recname);
+	for (i = 0; i < strlen(recindexname); i++)
+		recindexname[i] = tolower(recindexname[i]);
+	getRecInfo(recindexname, &eventtable, &userkey, &itemkey,
+		&eventval, &method, NULL);
+	if (PG_NARGS() > 3) {
+		options = text_to_cstring(PG_GETARG_TEXT_PP(3));
+		if (options[0] != '\0') {
+			char *given = options;
+
+			options = (char*) palloc((strlen(given)+3)*sizeof(char));
+			sprintf(options,", %s",given);
+			pfree(given);
+		}
+	} else
+		options = evaluationOptions(recindexname, getRecMethod(method));
+
+	// The events are split the same way every time, so runs with
+	// different options are measured against the same holdout.
+	// Held out events of users with none left to train on can't
+	// be predicted, so they're left out.
+	evalname = (char*) palloc((strlen(recname)+5)*sizeof(char));
+	sprintf(evalname,"%sEval",recname);
+	source = getRecWindowSource(recindexname, eventtable);
+	initStringInfo(&querystring);
+	appendStringInfo(&querystring,"CREATE TEMP TABLE %sTrain AS SELECT e.%s, e.%s, e.%s FROM %s e WHERE abs(hashint8(e.%s::int8 * 2147483648 + e.%s)::int8) %% 1000000 >= %d;",
+		evalname,userkey,itemkey,eventval,source,
+		userkey,itemkey,(int) (holdout * 1000000));
+	recathon_utilityExecute(querystring.data);
+	CommandCounterIncrement();
+	resetStringInfo(&querystring);
+	appendStringInfo(&querystring,"CREATE TEMP TABLE %sHoldout AS SELECT e.%s, e.%s, e.%s FROM %s e WHERE abs(hashint8(e.%s::int8 * 2147483648 + e.%s)::int8) %% 1000000 < %d AND e.%s IN (SELECT t.%s FROM %sTrain t);",
+		evalname,userkey,itemkey,eventval,source,
+		userkey,itemkey,(int) (holdout * 1000000),
+		userkey,userkey,evalname);
+	recathon_utilityExecute(querystring.data);
+	CommandCounterIncrement();
+
+	INSTR_TIME_SET_CURRENT(buildStart);
+	resetStringInfo(&querystring);
+	appendStringInfo(&querystring,"CREATE RECOMMENDER %s ON %sTrain USERS FROM %s ITEMS FROM %s EVENTS FROM %s USING %s",
+		evalname,evalname,userkey,itemkey,eventval,method);
+	if (options[0] != '\0')
+		appendStringInfo(&querystring," WITH (%s)",options + 2);
+	appendStringInfoChar(&querystring,';');
+	recathon_utilityExecute(querystring.data);
+	CommandCounterIncrement();
+	INSTR_TIME_SET_CURRENT(buildTime);
+	INSTR_TIME_SUBTRACT(buildTime, buildStart);
+
+	evalindexname = lookupRecIndexName(evalname);
+	for (i = 0; i < strlen(evalindexname); i++)
+		evalindexname[i] = tolower(evalindexname[i]);
+	slot = getRecIndexSlot(evalindexname);
+	if (!slot)
+		ereport(ERROR,
+			(errcode(ERRCODE_SYNTAX_ERROR),
+			 errmsg("recommender is built, but model could not be accessed")));
+	if (FACTOR_METHOD(getRecMethod(method))) {
+		modelname = getTupleString(slot,"recusermodelname");
+		modelname2 = getTupleString(slot,"recitemmodelname");
+		clustername = getTupleString(slot,"recclustermodelname");
+	} else
+		modelname = getTupleString(slot,"recmodelname");
+	ExecDropSingleTupleTableSlot(slot);
+	modelSize = recModelDiskSize(evalindexname, modelname, modelname2, clustername);
+
+	// The held out events, by user, with each user's items in order.
+	resetStringInfo(&querystring);
+	appendStringInfo(&querystring,"SELECT COUNT(*) AS held FROM %sHoldout;",evalname);
+	queryDesc = recathon_queryStart(querystring.data,&recathoncontext);
+	slot = ExecProcNode(queryDesc->planstate);
+	numRows = TupIsNull(slot) ? 0 : (int) DatumGetInt64(slot_getattr(slot, 1, &isnull));
+	recathon_queryEnd(queryDesc,recathoncontext);
+
+	userIDs = (int*) palloc((numRows+1)*sizeof(int));
+	userStart = (int*) palloc((numRows+1)*sizeof(int));
+	heldItems = (int*) palloc((numRows+1)*sizeof(int));
+	heldEvents = (float*) palloc((numRows+1)*sizeof(float));
+	numUsers = 0;
+	numHeld = 0;
+	resetStringInfo(&querystring);
+	appendStringInfo(&querystring,"SELECT %s, %s, %s FROM %sHoldout ORDER BY %s, %s;",
+		userkey,itemkey,eventval,evalname,userkey,itemkey);
+	queryDesc = recathon_queryStart(querystring.data,&recathoncontext);
+	bindColumn(&usercol, userkey);
+	bindColumn(&itemcol, itemkey);
+	bindColumn(&eventcol, eventval);
+	while (numHeld < numRows) {
+		int userID;
+
+		slot = ExecProcNode(queryDesc->planstate);
+		if (TupIsNull(slot)) break;
+
+		userID = columnInt(slot,&usercol);
+		if (numUsers == 0 || userIDs[numUsers-1] != userID) {
+			userIDs[numUsers] = userID;
+			userStart[numUsers] = numHeld;
+			numUsers++;
+		}
+		heldItems[numHeld] = columnInt(slot,&itemcol);
+		heldEvents[numHeld] = columnFloat(slot,&eventcol);
+		numHeld++;
+	}
+	recathon_queryEnd(queryDesc,recathoncontext);
+	userStart[numUsers] = numHeld;
+
+	// Every user's best k, all at once, which is what we time.
+	precision = recall = 0.0;
+	INSTR_TIME_SET_ZERO(scoreTime);
+	if (numUsers > 0) {
+		userDatums = (Datum*) palloc(numUsers*sizeof(Datum));
+		for (i = 0; i < numUsers; i++)
+			userDatums[i] = Int32GetDatum(userIDs[i]);
+
+		INSTR_TIME_SET_CURRENT(scoreStart);
+		numRows = recommendForUsers(evalname, construct_array(userDatums, numUsers,
+			INT4OID, sizeof(int32), true, 'i'), k, &entries);
+		INSTR_TIME_SET_CURRENT(scoreTime);
+		INSTR_TIME_SUBTRACT(scoreTime, scoreStart);
+
+		// The answer has the users in the order we gave them.
+		for (i = 0, j = 0; i < numUsers; i++) {
+			int hits = 0;
+
+			for (; j < numRows && entries[j].userID == userIDs[i]; j++)
+				if (binarySearch(heldItems, entries[j].itemID,
+						userStart[i], userStart[i+1]) >= 0)
+					hits++;
+			precision += (double) hits / k;
+			recall += (double) hits / (userStart[i+1] - userStart[i]);
+		}
+		precision /= numUsers;
+		recall /= numUsers;
+		pfree(entries);
+		pfree(userDatums);
+	}
+
+	// Each user's held out items, as candidates, for their errors.
+	sqError = 0.0;
+	numPredicted = 0;
+	for (i = 0; i < numUsers; i++) {
+		int numCandidates = userStart[i+1] - userStart[i];
+		Datum *candidates;
+		sim_entry *predictions;
+		int numFound;
+
+		CHECK_FOR_INTERRUPTS();
+
+		candidates = (Datum*) palloc(numCandidates*sizeof(Datum));
+		for (j = 0; j < numCandidates; j++)
+			candidates[j] = Int32GetDatum(heldItems[userStart[i] + j]);
+		numFound = recommendForUser(evalname, userIDs[i], numCandidates,
+			construct_array(candidates, numCandidates, INT4OID,
+				sizeof(int32), true, 'i'), &predictions);
+		for (j = 0; j < numFound; j++) {
+			int pos = binarySearch(heldItems, predictions[j].id,
+				userStart[i], userStart[i+1]);
+
+			if (pos < 0)
+				continue;
+			sqError += (predictions[j].event - heldEvents[pos]) *
+				(predictions[j].event - heldEvents[pos]);
+			numPredicted++;
+		}
+		pfree(predictions);
+		pfree(candidates);
+	}
+
+	resetStringInfo(&querystring);
+	appendStringInfo(&querystring,"DROP RECOMMENDER %s;",evalname);
+	recathon_utilityExecute(querystring.data);
+	CommandCounterIncrement();
+	resetStringInfo(&querystring);
+	appendStringInfo(&querystring,"DROP TABLE %sTrain, %sHoldout;",evalname,evalname);
+	recathon_utilityExecute(querystring.data);
+	CommandCounterIncrement();
+
+	values[0] = Int32GetDatum(numUsers);
+	if (numPredicted > 0)
+		values[1] = Float8GetDatum(sqrt(sqError / numPredicted));
+	else
+		nulls[1] = true;
+	values[2] = Float8GetDatum(precision);
+	values[3] = Float8GetDatum(recall);
+	values[4] = Float8GetDatum(INSTR_TIME_GET_MILLISEC(buildTime));
+	values[5] = Int64GetDatum(modelSize);
+	values[6] = Float8GetDatum(numUsers > 0 ?
+		INSTR_TIME_GET_MILLISEC(scoreTime) / numUsers : 0.0);
+
+	pfree(querystring.data);
+	pfree(userIDs);
+	pfree(userStart);
+	pfree(heldItems);
+	pfree(heldEvents);
+	pfree(modelname);
+	if (modelname2)
+		pfree(modelname2);
+	if (clustername)
+		pfree(clustername);
+	pfree(options);
+	pfree(source);
+	pfree(evalname);
+	pfree(evalindexname);
+	pfree(recindexname);
+	pfree(recname);
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(BlessTupleDesc(tupdesc),
+		values, nulls)));
+}
+
+/* The most buckets of recathon_model_stats's neighbor histogram. */
+#define RECATHON_STATS_BUCKETS 32
+
+/* ----------------------------------------------------------------
+ *		queryNumbers
+ *
+ *		Runs a query for one row of numbers, and puts its
+ *		first n columns into numbers as doubles. A null, or
+ *		a query with no rows, gives NaN.
+ * ----------------------------------------------------------------
+ */
+static void
+queryNumbers(char *querystring, double *numbers, int n) {
+	int i;
+	QueryDesc *queryDesc;
+	TupleTableSlot *slot;
+	MemoryContext recathoncontext;
+
+	queryDesc = recathon_queryStart(querystring,&recathoncontext);
+	slot = ExecProcNode(queryDesc->planstate);
+	for (i = 0; i < n; i++) {
+		bool isnull = true;
+		Datum value = 0;
+
+		if (!TupIsNull(slot))
+			value = slot_getattr(slot, i+1, &isnull);
+		if (isnull) {
+			numbers[i] = get_float8_nan();
+			continue;
+		}
+
+		switch (slot->tts_tupleDescriptor->attrs[i]->atttypid) {
+			case INT8OID:
+				numbers[i] = (double) DatumGetInt64(value);
+				break;
+			case INT4OID:
+				numbers[i] = (double) DatumGetInt32(value);
+				break;
+			case FLOAT4OID:
+				numbers[i] = (double) DatumGetFloat4(value);
+				break;
+			case FLOAT8OID:
+				numbers[i] = DatumGetFloat8(value);
+				break;
+			default:
+				elog(ERROR, "type mismatch in queryNumbers()");
+		}
+	}
+	recathon_queryEnd(queryDesc,recathoncontext);
+}
+
+/* ----------------------------------------------------------------
+ *		recathon_model_stats
+ *
+ *		SQL-callable description of a recommender's model,
+ *		for tuning it. We report its users, items and events,
+ *		and how dense they are; how many rows the model has;
+ *		for a similarity model, how long its neighbor lists
+ *		are, in a histogram of powers of two, and the spread
+ *		of its similarities; for a factor model, how many
+ *		features it has; its size on disk and in memory; how
+ *		it was last built, and how long that took; and how
+ *		many model entries scoring all of a typical user's
+ *		items reads. The counts come from the ID dictionary
+ *		and the index table where we have them, so it's
+ *		only the model that is read through.
+ * ----------------------------------------------------------------
+ */
+Datum
+recathon_model_stats(PG_FUNCTION_ARGS) {
+	char *recname, *recindexname, *eventtable, *userkey, *itemkey, *eventval, *method;
+	char *modelname = NULL, *modelname2 = NULL, *clustername = NULL, *strategy;
+	char statname[NAMEDATALEN];
+	recMethod recmethod;
+	int i, numBuckets;
+	double numbers[4], users, items, events, meanNeighbors;
+	int64 histogram[RECATHON_STATS_BUCKETS];
+	StringInfoData querystring;
+	RangeVar *dictrv;
+	TupleTableSlot *slot;
+	TupleDesc tupdesc;
+	PgStat_StatRecEntry *recstats;
+	Datum values[18];
+	bool nulls[18];
+
+	recname = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	recindexname = lookupRecIndexName(recname);
+	for (i = 0; i < strlen(recindexname); i++)
+		recindexname[i] = tolower(recindexname[i]);
+	getRecInfo(recindexname, &eventtable, &userkey, &itemkey,
+		&eventval, &method, NULL);
+	recmethod = (recMethod) getRecMethod(method);
+	MemSet(nulls, false, sizeof(nulls));
+	initStringInfo(&querystring);
+
+	// The users and items are counted in the dictionary, if it's
+	// there, and the events in the index table.
+	events = get_float8_nan();
+	slot = getRecIndexSlot(recindexname);
+	if (slot) {
+		if (FACTOR_METHOD(recmethod)) {
+			modelname = getTupleString(slot,"recusermodelname");
+			modelname2 = getTupleString(slot,"recitemmodelname");
+			clustername = getTupleString(slot,"recclustermodelname");
+		} else
+			modelname = getTupleString(slot,"recmodelname");
+		if (slotHasColumn(slot,"eventtotal"))
+			events = getTupleInt(slot,"eventtotal");
+		ExecDropSingleTupleTableSlot(slot);
+	}
+	appendStringInfo(&querystring,"%sIDs",recindexname);
+	dictrv = makeRangeVarFromNameList(stringToQualifiedNameList(querystring.data));
+	resetStringInfo(&querystring);
+	if (relationExists(dictrv))
+		appendStringInfo(&querystring,"SELECT (SELECT coalesce(array_length(ids,1),0) FROM %sIDs WHERE kind = 'users') AS users, (SELECT coalesce(array_length(ids,1),0) FROM %sIDs WHERE kind = 'items') AS items;",
+			recindexname,recindexname);
+	else {
+		char *source = getRecWindowSource(recindexname, eventtable);
+
+		appendStringInfo(&querystring,"SELECT count(DISTINCT %s) AS users, count(DISTINCT %s) AS items FROM %s;",
+			userkey,itemkey,source);
+		pfree(source);
+	}
+	pfree(dictrv);
+	queryNumbers(querystring.data, numbers, 2);
+	users = numbers[0];
+	items = numbers[1];
+	if (isnan(events) || events < 0) {
+		resetStringInfo(&querystring);
+		appendStringInfo(&querystring,"SELECT count(*) AS events FROM %s;",eventtable);
+		queryNumbers(querystring.data, &events, 1);
+	}
+
+	values[0] = CStringGetTextDatum(method);
+	values[1] = Int64GetDatum((int64) users);
+	values[2] = Int64GetDatum((int64) items);
+	values[3] = Int64GetDatum((int64) events);
+	if (users > 0 && items > 0)
+		values[4] = Float8GetDatum(events / users / items);
+	else
+		nulls[4] = true;
+	for (i = 5; i <= 12; i++)
+		nulls[i] = true;
+	nulls[17] = true;
+
+	if (modelname && FACTOR_METHOD(recmethod) && modelname2) {
+		// Both factor tables, and the width of a row of features.
+		resetStringInfo(&querystring);
+		if (factorModelHasArrays(modelname2))
+			appendStringInfo(&querystring,"SELECT (SELECT count(*) FROM %s) + (SELECT count(*) FROM %s) AS rows, (SELECT max(array_length(features,1)) FROM %s) AS features;",
+				modelname,modelname2,modelname2);
+		else
+			appendStringInfo(&querystring,"SELECT (SELECT count(*) FROM %s) + (SELECT count(*) FROM %s) AS rows, (SELECT count(DISTINCT feature) FROM %s)::integer AS features;",
+				modelname,modelname2,modelname2);
+		queryNumbers(querystring.data, numbers, 2);
+		values[5] = Int64GetDatum((int64) numbers[0]);
+		nulls[5] = false;
+		if (!isnan(numbers[1])) {
+			values[6] = Int32GetDatum((int32) numbers[1]);
+			nulls[6] = false;
+
+			// Every item is a dot product of that many features.
+			values[17] = Float8GetDatum(items * numbers[1]);
+			nulls[17] = false;
+		}
+	} else if (modelname && !FACTOR_METHOD(recmethod)) {
+		char *id1, *id2;
+		bool symmetric = getRecSymmetric(recindexname);
+		int64 lists, entries, longest;
+		QueryDesc *queryDesc;
+		MemoryContext recathoncontext;
+
+		if (recmethod == userCosCF || recmethod == userPearCF) {
+			id1 = "user1";
+			id2 = "user2";
+		} else {
+			id1 = "item1";
+			id2 = "item2";
+		}
+
+		resetStringInfo(&querystring);
+		appendStringInfo(&querystring,"SELECT count(*) AS rows, min(similarity) AS smin, avg(similarity) AS savg, max(similarity) AS smax FROM %s;",
+			modelname);
+		queryNumbers(querystring.data, numbers, 4);
+		values[5] = Int64GetDatum((int64) numbers[0]);
+		nulls[5] = false;
+		for (i = 1; i < 4; i++) {
+			if (isnan(numbers[i]))
+				continue;
+			values[9+i] = Float8GetDatum(numbers[i]);
+			nulls[9+i] = false;
+		}
+
+		// Each ID's neighbor list. A model that isn't symmetric
+		// keeps each pair once, so its lists are in both columns.
+		resetStringInfo(&querystring);
+		if (symmetric)
+			appendStringInfo(&querystring,"SELECT count(*) AS neighbors FROM %s GROUP BY %s;",
+				modelname,id1);
+		else
+			appendStringInfo(&querystring,"SELECT count(*) AS neighbors FROM (SELECT %s AS id FROM %s UNION ALL SELECT %s FROM %s) m GROUP BY id;",
+				id1,modelname,id2,modelname);
+		MemSet(histogram, 0, sizeof(histogram));
+		lists = entries = longest = 0;
+		numBuckets = 0;
+		queryDesc = recathon_queryStart(querystring.data,&recathoncontext);
+		for (;;) {
+			int64 length;
+			bool isnull;
+
+			slot = ExecProcNode(queryDesc->planstate);
+			if (TupIsNull(slot))
+				break;
+			length = DatumGetInt64(slot_getattr(slot, 1, &isnull));
+
+			// Bucket b counts lists of 2^b to 2^(b+1) - 1 neighbors.
+			for (i = 0; i < RECATHON_STATS_BUCKETS - 1 && (length >> (i+1)) > 0; i++)
+				;
+			histogram[i]++;
+			numBuckets = Max(numBuckets, i+1);
+			lists++;
+			entries += length;
+			longest = Max(longest, length);
+		}
+		recathon_queryEnd(queryDesc,recathoncontext);
+
+		if (lists > 0) {
+			Datum *buckets = (Datum*) palloc(numBuckets*sizeof(Datum));
+
+			meanNeighbors = (double) entries / lists;
+			values[7] = Float8GetDatum(meanNeighbors);
+			nulls[7] = false;
+			for (i = 0; i < numBuckets; i++)
+				buckets[i] = Int64GetDatum(histogram[i]);
+			values[9] = PointerGetDatum(construct_array(buckets, numBuckets,
+				INT8OID, sizeof(int64), FLOAT8PASSBYVAL, 'd'));
+			nulls[9] = false;
+			values[8] = Int64GetDatum(longest);
+			nulls[8] = false;
+
+			// An item-based scan reads the list of every item the
+			// user rated. A user-based one reads the user's list,
+			// and then the raters of every item.
+			if (recmethod == userCosCF || recmethod == userPearCF) {
+				values[17] = Float8GetDatum(meanNeighbors + events);
+				nulls[17] = false;
+			} else if (users > 0) {
+				values[17] = Float8GetDatum(events / users * meanNeighbors);
+				nulls[17] = false;
+			}
+		}
+	}
+
+	values[13] = Int64GetDatum(modelname ?
+		recModelDiskSize(recindexname, modelname, modelname2, clustername) : 0);
+
+	// What the statistics collector knows of its queries and builds.
+	recathonStatName(recindexname, statname);
+	recstats = pgstat_fetch_stat_recentry(statname);
+	if (recstats && recstats->memory_size > 0)
+		values[14] = Int64GetDatum(recstats->memory_size);
+	else
+		nulls[14] = true;
+	strategy = catalogueString(recindexname, "buildstrategy");
+	if (strategy)
+		values[15] = CStringGetTextDatum(strategy);
+	else
+		nulls[15] = true;
+	if (recstats && recstats->rebuilds > 0)
+		values[16] = Float8GetDatum(((double) recstats->last_rebuild_time) / 1000.0);
+	else
+		nulls[16] = true;
+
+	pfree(querystring.data);
+	if (modelname)
+		pfree(modelname);
+	if (modelname2)
+		pfree(modelname2);
+	if (clustername)
+		pfree(clustername);
+	pfree(recindexname);
+	pfree(recname);
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(BlessTupleDesc(tupdesc),
+		values, nulls)));
+}
+
+/* ----------------------------------------------------------------
+ *		eventTriggerColumns
+ *
+ *		Finds the user, item and event columns a
+ *		recathon_record_event trigger copies, putting their
+ *		attribute numbers in attnums.
+ * ----------------------------------------------------------------
+ */
+static void
+eventTriggerColumns(Trigger *trigger, Relation rel, int *attnums) {
+	TupleDesc tupdesc = RelationGetDescr(rel);
+	int i, j;
+
+	if (trigger->tgnargs != 4)
+		elog(ERROR, "recathon_record_event: expected 4 arguments, got %d",
+			trigger->tgnargs);
+
+	for (i = 0; i < 3; i++) {
+		char *colname = trigger->tgargs[i+1];
+
+		for (j = 0; j < tupdesc->natts; j++) {
+			if (tupdesc->attrs[j]->attisdropped) continue;
+			if (strcmp(NameStr(tupdesc->attrs[j]->attname), colname) == 0)
+				break;
+		}
+		if (j >= tupdesc->natts)
+			ereport(ERROR,
+				(errcode(ERRCODE_UNDEFINED_COLUMN),
+				 errmsg("column \"%s\" does not exist in relation \"%s\"",
+					colname, RelationGetRelationName(rel))));
+		attnums[i] = j+1;
+	}
+}
+
+/* ----------------------------------------------------------------
+ *		recathon_record_event
+ *
+ *		The AFTER INSERT trigger an incremental recommender
+ *		puts on its events table. Its arguments are the
+ *		Deltas table, then the user, item and event columns,
+ *		and it copies those columns of each new row into
+ *		the Deltas table for the maintenance process.
+ * ----------------------------------------------------------------
+ */
+Datum
+recathon_record_event(PG_FUNCTION_ARGS) {
+	TriggerData *trigdata = (TriggerData *) fcinfo->context;
+	Trigger *trigger;
+	TupleDesc tupdesc;
+	Relation deltarel;
+	HeapTuple deltatuple;
+	Datum values[3];
+	bool nulls[3];
+	int i, attnums[3];
+
+	if (!CALLED_AS_TRIGGER(fcinfo))
+		elog(ERROR, "recathon_record_event: not called by trigger manager");
+	if (!TRIGGER_FIRED_FOR_ROW(trigdata->tg_event) ||
+		!TRIGGER_FIRED_BY_INSERT(trigdata->tg_event))
+		elog(ERROR, "recathon_record_event: must be fired for each inserted row");
+
+	// Find the columns we want in the new row.
+	trigger = trigdata->tg_trigger;
+	tupdesc = RelationGetDescr(trigdata->tg_relation);
+	eventTriggerColumns(trigger, trigdata->tg_relation, attnums);
+	for (i = 0; i < 3; i++)
+		values[i] = heap_getattr(trigdata->tg_trigtuple, attnums[i], tupdesc, &nulls[i]);
+
+	// The Deltas table has no indexes, so the heap is all there
+	// is to insert into.
+	deltarel = heap_openrv(makeRangeVarFromNameList(stringToQualifiedNameList(trigger->tgargs[0])),
+		RowExclusiveLock);
+	deltatuple = heap_form_tuple(RelationGetDescr(deltarel), values, nulls);
+	simple_heap_insert(deltarel, deltatuple);
+	heap_freetuple(deltatuple);
+	heap_close(deltarel, NoLock);
+
+	return PointerGetDatum(NULL);
+}
+
+/* What recathon_ingest needs for each Deltas table it fills. */
+typedef struct ingest_deltas {
+	Relation		rel;
+	BulkInsertState		bistate;
+	int			attnums[3];	/* the user, item and event columns */
+} ingest_deltas;
+
+/* ----------------------------------------------------------------
+ *		eventValueDatum
+ *
+ *		Converts a rating to the type of the events table's
+ *		rating column. The usual types are converted
+ *		directly, and anything else through its input
+ *		function.
+ * ----------------------------------------------------------------
+ */
+static Datum
+eventValueDatum(float4 value, Form_pg_attribute att, FmgrInfo *infunc,
+			Oid typioparam) {
+	char buf[32];
+
+	switch (att->atttypid) {
+		case FLOAT4OID:
+			return Float4GetDatum(value);
+		case FLOAT8OID:
+			return Float8GetDatum((float8) value);
+		case INT4OID:
+			return Int32GetDatum((int32) rint(value));
+		default:
+			snprintf(buf, sizeof(buf), "%.*g", FLT_DIG + 3, value);
+			return InputFunctionCall(infunc, buf, typioparam, att->atttypmod);
+	}
+}
+
+/* ----------------------------------------------------------------
+ *		recathon_ingest
+ *
+ *		SQL-callable bulk insert of a batch of events, for
+ *		loaders that collect thousands of ratings at a time.
+ *		The i'th event is users[i] rating items[i] with
+ *		vals[i]; the events table's other columns get their
+ *		defaults. The heap is written with a bulk insert
+ *		state, and each incremental recommender's Deltas
+ *		table with one of its own, in the same pass, rather
+ *		than through a trigger call for every row. The users
+ *		are noted for the result cache as they go, and the
+ *		maintenance process is notified once for the batch,
+ *		as at the end of an INSERT. Tables with insert
+ *		triggers of their own have to use INSERT, so that
+ *		those fire. Returns the number of events inserted.
+ * ----------------------------------------------------------------
+ */
+Datum
+recathon_ingest(PG_FUNCTION_ARGS) {
+	Oid relid = PG_GETARG_OID(0);
+	ArrayType *userarray = PG_GETARG_ARRAYTYPE_P(1);
+	ArrayType *itemarray = PG_GETARG_ARRAYTYPE_P(2);
+	ArrayType *valarray = PG_GETARG_ARRAYTYPE_P(3);
+	int i, j, numEvents, numDeltas, numDefaults;
+	int *userIDs, *itemIDs;
+	float4 *vals;
+	int attnums[3];
+	int *defmap;
+	ExprState **defexprs;
+	Relation rel;
+	TupleDesc tupdesc;
+	RecathonEventEntry *entry;
+	AclResult aclresult;
+	ResultRelInfo *resultRelInfo;
+	EState *estate;
+	ExprContext *econtext;
+	TupleTableSlot *slot;
+	BulkInsertState bistate;
+	CommandId mycid;
+	ingest_deltas *deltas;
+	FmgrInfo infunc;
+	Oid infuncoid, typioparam = InvalidOid;
+	Datum *values;
+	bool *nulls;
+	Oid paramtypes[1];
+	Datum paramvalues[1];
+	QueryDesc *queryDesc;
+	TupleTableSlot *catslot;
+	CachedPlan *cplan;
+	MemoryContext recathoncontext;
+	char *keys[3] = {NULL, NULL, NULL};
+
+	if (ARR_NDIM(userarray) > 1 || ARR_HASNULL(userarray) ||
+	    ARR_NDIM(itemarray) > 1 || ARR_HASNULL(itemarray) ||
+	    ARR_NDIM(valarray) > 1 || ARR_HASNULL(valarray))
+		ereport(ERROR,
+			(errcode(ERRCODE_DATA_EXCEPTION),
+			 errmsg("event lists must be one-dimensional arrays without nulls")));
+	numEvents = ARR_NDIM(userarray) == 0 ? 0 : ARR_DIMS(userarray)[0];
+	if ((ARR_NDIM(itemarray) == 0 ? 0 : ARR_DIMS(itemarray)[0]) != numEvents ||
+	    (ARR_NDIM(valarray) == 0 ? 0 : ARR_DIMS(valarray)[0]) != numEvents)
+		ereport(ERROR,
+			(errcode(ERRCODE_ARRAY_SUBSCRIPT_ERROR),
+			 errmsg("the user, item and rating lists must be the same length")));
+	userIDs = (int*) ARR_DATA_PTR(userarray);
+	itemIDs = (int*) ARR_DATA_PTR(itemarray);
+	vals = (float4*) ARR_DATA_PTR(valarray);
+
+	rel = heap_open(relid, RowExclusiveLock);
+	if (rel->rd_rel->relkind != RELKIND_RELATION)
+		ereport(ERROR,
+			(errcode(ERRCODE_WRONG_OBJECT_TYPE),
+			 errmsg("\"%s\" is not a table",
+				RelationGetRelationName(rel))));
+	aclresult = pg_class_aclcheck(relid, GetUserId(), ACL_INSERT);
+	if (aclresult != ACLCHECK_OK)
+		aclcheck_error(aclresult, ACL_KIND_CLASS, RelationGetRelationName(rel));
+
+	entry = lookupEventTable(RelationGetRelationName(rel));
+	if (!entry->isEventTable)
+		ereport(ERROR,
+			(errcode(ERRCODE_WRONG_OBJECT_TYPE),
+			 errmsg("\"%s\" is not the events table of any recommender",
+				RelationGetRelationName(rel))));
+
+	// Every recommender on the table has to agree on which columns
+	// hold the events.
+	paramtypes[0] = TEXTOID;
+	paramvalues[0] = CStringGetTextDatum(entry->eventtable);
+	queryDesc = recathon_queryStartCached("SELECT DISTINCT userkey, itemkey, eventval FROM RecModelsCatalogue WHERE eventtable = $1;",
+		1,paramtypes,paramvalues,&cplan,&recathoncontext);
+	for (i = 0; ; i++) {
+		catslot = ExecProcNode(queryDesc->planstate);
+		if (TupIsNull(catslot)) break;
+		if (i > 0)
+			ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("the recommenders on \"%s\" use different columns",
+					entry->eventtable),
+				 errhint("Use INSERT to add its events.")));
+		keys[0] = getTupleString(catslot,"userkey");
+		keys[1] = getTupleString(catslot,"itemkey");
+		keys[2] = getTupleString(catslot,"eventval");
+	}
+	recathon_queryEndCached(queryDesc,cplan,recathoncontext);
+	pfree(DatumGetPointer(paramvalues[0]));
+	if (!keys[0])
+		ereport(ERROR,
+			(errcode(ERRCODE_WRONG_OBJECT_TYPE),
+			 errmsg("\"%s\" is not the events table of any recommender",
+				RelationGetRelationName(rel))));
+
+	tupdesc = RelationGetDescr(rel);
+	for (i = 0; i < 3; i++) {
+		for (j = 0; j < tupdesc->natts; j++) {
+			if (tupdesc->attrs[j]->attisdropped) continue;
+			if (strcmp(NameStr(tupdesc->attrs[j]->attname), keys[i]) == 0)
+				break;
+		}
+		if (j >= tupdesc->natts)
+			ereport(ERROR,
+				(errcode(ERRCODE_UNDEFINED_COLUMN),
+				 errmsg("column \"%s\" does not exist in relation \"%s\"",
+					keys[i], RelationGetRelationName(rel))));
+		if (i < 2 && tupdesc->attrs[j]->atttypid != INT4OID)
+			ereport(ERROR,
+				(errcode(ERRCODE_DATATYPE_MISMATCH),
+				 errmsg("column \"%s\" of relation \"%s\" is not an integer",
+					keys[i], RelationGetRelationName(rel))));
+		attnums[i] = j+1;
+		pfree(keys[i]);
+	}
+	getTypeInputInfo(tupdesc->attrs[attnums[2]-1]->atttypid, &infuncoid, &typioparam);
+	fmgr_info(infuncoid, &infunc);
+
+	// Our own Deltas triggers we do ourselves; anyone else's have
+	// to fire as usual.
+	deltas = (ingest_deltas*) palloc0(((rel->trigdesc ? rel->trigdesc->numtriggers : 0) + 1) *
+		sizeof(ingest_deltas));
+	numDeltas = 0;
+	for (i = 0; rel->trigdesc && i < rel->trigdesc->numtriggers; i++) {
+		Trigger *trigger = &rel->trigdesc->triggers[i];
+
+		if (trigger->tgenabled == TRIGGER_DISABLED ||
+		    !TRIGGER_FOR_INSERT(trigger->tgtype))
+			continue;
+		if (trigger->tgfoid != F_RECATHON_RECORD_EVENT)
+			ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("relation \"%s\" has insert triggers of its own",
+					RelationGetRelationName(rel)),
+				 errhint("Use INSERT to add its events.")));
+
+		eventTriggerColumns(trigger, rel, deltas[numDeltas].attnums);
+		deltas[numDeltas].rel = heap_openrv(makeRangeVarFromNameList(stringToQualifiedNameList(trigger->tgargs[0])),
+			RowExclusiveLock);
+		deltas[numDeltas].bistate = GetBulkInsertState();
+		numDeltas++;
+	}
+
+	// The executor state is only there for constraints, indexes
+	// and the defaults of the other columns.
+	estate = CreateExecutorState();
+	resultRelInfo = makeNode(ResultRelInfo);
+	resultRelInfo->ri_RangeTableIndex = 1;
+	resultRelInfo->ri_RelationDesc = rel;
+	ExecOpenIndices(resultRelInfo);
+	estate->es_result_relations = resultRelInfo;
+	estate->es_num_result_relations = 1;
+	estate->es_result_relation_info = resultRelInfo;
+	slot = ExecInitExtraTupleSlot(estate);
+	ExecSetSlotDescriptor(slot, tupdesc);
+	econtext = GetPerTupleExprContext(estate);
+
+	defmap = (int*) palloc(tupdesc->natts*sizeof(int));
+	defexprs = (ExprState**) palloc(tupdesc->natts*sizeof(ExprState*));
+	numDefaults = 0;
+	for (j = 0; j < tupdesc->natts; j++) {
+		Node *defexpr;
+
+		if (tupdesc->attrs[j]->attisdropped ||
+		    j+1 == attnums[0] || j+1 == attnums[1] || j+1 == attnums[2])
+			continue;
+		defexpr = build_column_default(rel, j+1);
+		if (defexpr) {
+			defexprs[numDefaults] = ExecInitExpr(expression_planner((Expr*) defexpr), NULL);
+			defmap[numDefaults] = j;
+			numDefaults++;
+		}
+	}
+
+	values = (Datum*) palloc(tupdesc->natts*sizeof(Datum));
+	nulls = (bool*) palloc(tupdesc->natts*sizeof(bool));
+	mycid = GetCurrentCommandId(true);
+	bistate = GetBulkInsertState();
+
+	for (i = 0; i < numEvents; i++) {
+		HeapTuple tuple;
+		List *recheckIndexes = NIL;
+		MemoryContext oldcontext;
+
+		CHECK_FOR_INTERRUPTS();
+		ResetPerTupleExprContext(estate);
+		oldcontext = MemoryContextSwitchTo(GetPerTupleMemoryContext(estate));
+
+		for (j = 0; j < tupdesc->natts; j++) {
+			values[j] = (Datum) 0;
+			nulls[j] = true;
+		}
+		for (j = 0; j < numDefaults; j++)
+			values[defmap[j]] = ExecEvalExpr(defexprs[j], econtext,
+				&nulls[defmap[j]], NULL);
+		values[attnums[0]-1] = Int32GetDatum(userIDs[i]);
+		values[attnums[1]-1] = Int32GetDatum(itemIDs[i]);
+		values[attnums[2]-1] = eventValueDatum(vals[i],
+			tupdesc->attrs[attnums[2]-1], &infunc, typioparam);
+		nulls[attnums[0]-1] = nulls[attnums[1]-1] = nulls[attnums[2]-1] = false;
+
+		tuple = heap_form_tuple(tupdesc, values, nulls);
+		ExecStoreTuple(tuple, slot, InvalidBuffer, false);
+		if (rel->rd_att->constr)
+			ExecConstraints(resultRelInfo, slot, estate);
+
+		recordEventUser(rel, tuple);
+		heap_insert(rel, tuple, mycid, 0, bistate);
+		if (resultRelInfo->ri_NumIndices > 0)
+			recheckIndexes = ExecInsertIndexTuples(slot, &(tuple->t_self), estate);
+		list_free(recheckIndexes);
+
+		// The Deltas tables have no indexes, so the heap is all
+		// there is to insert into.
+		for (j = 0; j < numDeltas; j++) {
+			Datum deltavalues[3];
+			bool deltanulls[3];
+			HeapTuple deltatuple;
+			int k;
+
+			for (k = 0; k < 3; k++)
+				deltavalues[k] = heap_getattr(tuple, deltas[j].attnums[k],
+					tupdesc, &deltanulls[k]);
+			deltatuple = heap_form_tuple(RelationGetDescr(deltas[j].rel),
+				deltavalues, deltanulls);
+			heap_insert(deltas[j].rel, deltatuple, mycid, 0, deltas[j].bistate);
+		}
+
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	FreeBulkInsertState(bistate);
+	for (j = 0; j < numDeltas; j++) {
+		FreeBulkInsertState(deltas[j].bistate);
+		heap_close(deltas[j].rel, NoLock);
+	}
+	ExecResetTupleTable(estate->es_tupleTable, false);
+	ExecCloseIndices(resultRelInfo);
+	FreeExecutorState(estate);
+
+	if (numEvents > 0)
+		updateCellCounter(RelationGetRelationName(rel));
+	heap_close(rel, NoLock);
+
+	pfree(values);
+	pfree(nulls);
+	pfree(defmap);
+	pfree(defexprs);
+	pfree(deltas);
+
+	PG_RETURN_INT64(numEvents);
+}
+
+/* ----------------------------------------------------------------
+ *		recathon_build_shard
+ *
+ *		SQL-callable build of one shard of a similarity
+ *		model, for a node sharing its build with this one.
+ *		Takes the method, the events table and its user,
+ *		item and event columns, the name of a new table for
+ *		the shard, which shard it is out of how many, and
+ *		the neighborhood, LSH, worker and pruning options. Returns
+ *		the number of events used, so the node that asked
+ *		can check we have the same ones.
+ * ----------------------------------------------------------------
+ */
+Datum
+recathon_build_shard(PG_FUNCTION_ARGS) {
+	char *strmethod, *eventtable, *userkey, *itemkey, *eventval, *modelname;
+	int numEvents;
+	recMethod method;
+	sim_params params;
+	StringInfoData querystring;
+
+	strmethod = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	eventtable = text_to_cstring(PG_GETARG_TEXT_PP(1));
+	userkey = text_to_cstring(PG_GETARG_TEXT_PP(2));
+	itemkey = text_to_cstring(PG_GETARG_TEXT_PP(3));
+	eventval = text_to_cstring(PG_GETARG_TEXT_PP(4));
+	modelname = text_to_cstring(PG_GETARG_TEXT_PP(5));
+	params.shard = PG_GETARG_INT32(6);
+	params.numShards = PG_GETARG_INT32(7);
+	params.neighborhood = PG_GETARG_INT32(8);
+	params.lshBands = PG_GETARG_INT32(9);
+	params.lshRows = PG_GETARG_INT32(10);
+	params.userClusters = 0;
+	params.clusterProbes = 0;
+	params.numWorkers = PG_GETARG_INT32(11);
+	params.minSupport = PG_GETARG_INT32(12);
+	params.minSimilarity = PG_GETARG_FLOAT4(13);
+	params.buildNodes = NULL;
+	params.vectorStore = NULL;
+	params.strategy[0] = '\0';
+
+	method = getRecMethod(strmethod);
+	if (method < 0 || FACTOR_METHOD(method))
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("%s is not a similarity-based recommendation method",
+				strmethod)));
+	if (params.numShards < 1 || params.shard < 0 ||
+			params.shard >= params.numShards)
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("shard %d is not one of %d",
+				params.shard, params.numShards)));
+	if (params.numWorkers < 1 || params.numWorkers > RECATHON_MAX_WORKERS)
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("parallel_workers must be between 1 and %d",
+				RECATHON_MAX_WORKERS)));
+
+	initStringInfo(&querystring);
+	appendStringInfo(&querystring,"CREATE TABLE %s (id1 INTEGER NOT NULL, id2 INTEGER NOT NULL, similarity REAL NOT NULL);",
+		modelname);
+	recathon_utilityExecute(querystring.data);
+	CommandCounterIncrement();
+
+	numEvents = buildSimilarityModel(method, eventtable, userkey, itemkey,
+		eventval, modelname, &params);
+
+	pfree(querystring.data);
+	pfree(strmethod);
+	pfree(eventtable);
+	pfree(userkey);
+	pfree(itemkey);
+	pfree(eventval);
+	pfree(modelname);
+
+	PG_RETURN_INT64((int64) numEvents);
+}
+
+/* ----------------------------------------------------------------
+ *		binarySearch
+ *
+ *		A quick binary search algorithm, for use with the
+ *		CREATE RECOMMENDER query. Looks for value among
+ *		array[lo] through array[hi-1], returning its index
+ *		or -1.
+ * ----------------------------------------------------------------
+ */
+int
+binarySearch(int *array, int value, int lo, int hi) {
+	while (lo < hi) {
+		int mid = lo + (hi - lo) / 2;
+
+		if (array[mid] == value) return mid;
+		if (array[mid] < value)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return -1;
+}
+
+/* ----------------------------------------------------------------
+ *		buildItemMap
+ *
+ *		The items in fullItemList are numbered by their place
+ *		in it. Item IDs are usually close to being numbered
+ *		that way already, so when they don't spread out too
+ *		far we make an array taking each ID straight to its
+ *		index, and spare ourselves a search on every lookup.
+ * ----------------------------------------------------------------
+ */
+void
+buildItemMap(RecScanState *recnode) {
+	int i, minID, maxID;
+	double spread;
+
+	recnode->itemMap = NULL;
+	recnode->itemMapBase = 0;
+	recnode->itemMapSize = 0;
+	if (!recnode->fullItemList || recnode->fullTotalItems <= 0)
+		return;
+
+	minID = recnode->fullItemList[0];
+	maxID = recnode->fullItemList[recnode->fullTotalItems-1];
+	spread = (double) maxID - (double) minID + 1.0;
+	if (spread > (double) RECATHON_ITEM_MAP_SPREAD * recnode->fullTotalItems)
+		return;
+
+	recnode->itemMapBase = minID;
+	recnode->itemMapSize = (int) spread;
+	recnode->itemMap = (int*) palloc(recnode->itemMapSize*sizeof(int));
+	for (i = 0; i < recnode->itemMapSize; i++)
+		recnode->itemMap[i] = -1;
+	for (i = 0; i < recnode->fullTotalItems; i++)
+		recnode->itemMap[recnode->fullItemList[i] - minID] = i;
+}
+
+/* ----------------------------------------------------------------
+ *		itemIndex
+ *
+ *		Finds the index of an item ID in fullItemList, or
+ *		returns -1 if it isn't there.
+ * ----------------------------------------------------------------
+ */
+int
+itemIndex(RecScanState *recnode, int itemID) {
+	if (recnode->itemMap) {
+		// Unsigned, so IDs below the base are out of range too.
+		unsigned int offset = (unsigned int) itemID - (unsigned int) recnode->itemMapBase;
+
+		if (offset >= (unsigned int) recnode->itemMapSize)
+			return -1;
+		return recnode->itemMap[offset];
+	}
+
+	return binarySearch(recnode->fullItemList, itemID, 0, recnode->fullTotalItems);
+}
+
+/* ----------------------------------------------------------------
+ *		getListedUsers
+ *
+ *		Takes the user IDs a query is limited to, and returns
+ *		them sorted and without duplicates, leaving out any
+ *		that have no events. This saves us from making a list
+ *		of every user when we only want a few of them. Each
+ *		is looked up in the events table's index on users,
+ *		if it has one, and queried for if not.
+ * ----------------------------------------------------------------
+ */
+int
+getListedUsers(List *userIDList, char *userkey, char *eventtable, int **ret_userIDs) {
+	int i, numIDs, numUsers;
+	int *IDs;
+	ListCell *id_cell;
+	recathon_probe *probe;
+	// Objects for querying.
+	char *querystring;
+	QueryDesc *queryDesc;
+	PlanState *planstate;
+	TupleTableSlot *slot;
+	CachedPlan *cplan;
+	MemoryContext recathoncontext;
+	Oid paramtypes[1] = {INT4OID};
+	Datum paramvalues[1];
+
+	numIDs = list_length(userIDList);
+	IDs = (int*) palloc((numIDs > 0 ? numIDs : 1)*sizeof(int));
+	i = 0;
+	foreach(id_cell, userIDList)
+		IDs[i++] = lfirst_int(id_cell);
+	qsort(IDs, numIDs, sizeof(int), intCompare);
+
+	querystring = (char*) palloc(1024*sizeof(char));
+	sprintf(querystring,"select 1 as found from %s where %s = $1 limit 1;",
+		eventtable,userkey);
+
+	probe = probeOpen(eventtable, userkey);
+	numUsers = 0;
+	for (i = 0; i < numIDs; i++) {
+		if (numUsers > 0 && IDs[numUsers-1] == IDs[i])
+			continue;
+
+		if (probe->heap) {
+			probeStart(probe, IDs[i]);
+			if (probeNext(probe) != NULL)
+				IDs[numUsers++] = IDs[i];
+			continue;
+		}
+
+		paramvalues[0] = Int32GetDatum(IDs[i]);
+		queryDesc = recathon_queryStartCached(querystring,1,paramtypes,paramvalues,
+			&cplan,&recathoncontext);
+		planstate = queryDesc->planstate;
+		slot = ExecProcNode(planstate);
+		if (!TupIsNull(slot))
+			IDs[numUsers++] = IDs[i];
+		recathon_queryEndCached(queryDesc,cplan,recathoncontext);
+	}
+	probeClose(probe);
+
+	pfree(querystring);
+
+	(*ret_userIDs) = IDs;
+	return numUsers;
+}
+
+/* ----------------------------------------------------------------
+ *		refreshIDDictionary
+ *
+ *		Stores the sorted lists of user and item IDs in a
+ *		recommender's events table, so that queries on it can
+ *		read them rather than scanning the events themselves.
+ *		The dictionary table is named after the recommender's
+ *		index table, and is made if it doesn't exist yet.
+ *		The items are the ones its models are built from; the
+ *		users include those a sample left out, since they
+ *		can still be recommended for.
+ * ----------------------------------------------------------------
+ */
+void
+refreshIDDictionary(char *recindexname, char *eventtable, char *userkey, char *itemkey) {
+	char *querystring, *usersource, *itemsource;
+
+	usersource = getRecWindowSource(recindexname,eventtable);
+	itemsource = getRecEventSource(recindexname,eventtable);
+	pgstat_progress_phase(RECBUILD_PHASE_STATISTICS, 0);
+
+	querystring = (char*) palloc(1024*sizeof(char));
+	sprintf(querystring,"CREATE TABLE IF NOT EXISTS %sIDs (kind VARCHAR NOT NULL PRIMARY KEY, ids INTEGER[] NOT NULL);",
+		recindexname);
+	recathon_utilityExecute(querystring);
+
+	sprintf(querystring,"DELETE FROM %sIDs WHERE kind IN ('users', 'items');",recindexname);
+	recathon_queryExecute(querystring);
+
+	sprintf(querystring,"INSERT INTO %sIDs VALUES ('users', ARRAY(SELECT DISTINCT %s FROM %s ORDER BY %s));",
+		recindexname,userkey,usersource,userkey);
+	recathon_queryExecute(querystring);
+
+	sprintf(querystring,"INSERT INTO %sIDs VALUES ('items', ARRAY(SELECT DISTINCT %s FROM %s ORDER BY %s));",
+		recindexname,itemkey,itemsource,itemkey);
+	recathon_queryExecute(querystring);
+
+	pfree(querystring);
+	pfree(usersource);
+	pfree(itemsource);
+
+	refreshActiveItems(recindexname);
+}
+
+/* ----------------------------------------------------------------
+ *		buildPopularityModel
+ *
+ *		Ranks every item a recommender covers by its events,
+ *		for users who have none of their own. Each item gets
+ *		its count and average, and a score that is its
+ *		average pulled towards the overall one, by as many
+ *		events as RECATHON_POPULAR_DAMPING, so an item with
+ *		one high rating doesn't come top. The table is named
+ *		after the recommender's index table, and replaces
+ *		any that was there.
+ * ----------------------------------------------------------------
+ */
+void
+buildPopularityModel(char *recindexname, char *eventtable, char *itemkey, char *eventval) {
+	char *querystring, *source;
+
+	// Unsampled users are worth counting here.
+	source = getRecWindowSource(recindexname,eventtable);
+	querystring = (char*) palloc(2048*sizeof(char));
+
+	sprintf(querystring,"DROP TABLE IF EXISTS %sPopular;",recindexname);
+	recathon_utilityExecute(querystring);
+
+	sprintf(querystring,"CREATE TABLE %sPopular AS SELECT e.%s AS item, count(*)::integer AS events, avg(e.%s)::real AS average, ((sum(e.%s) + %d * g.mean) / (count(*) + %d))::real AS recscore FROM %s e, (SELECT coalesce(avg(%s), 0) AS mean FROM %s) g GROUP BY e.%s, g.mean;",
+		recindexname,itemkey,eventval,eventval,
+		RECATHON_POPULAR_DAMPING,RECATHON_POPULAR_DAMPING,
+		source,eventval,source,itemkey);
+	recathon_utilityExecute(querystring);
+	CommandCounterIncrement();
+
+	pfree(querystring);
+	pfree(source);
+}
+
+/* ----------------------------------------------------------------
+ *		loadIDDictionary
+ *
+ *		Reads one of the ID lists kept by refreshIDDictionary,
+ *		where kind is "users" or "items". Returns the number
+ *		of IDs, or -1 if the recommender has no dictionary,
+ *		as with recommenders built before we kept one.
+ * ----------------------------------------------------------------
+ */
+int
+loadIDDictionary(char *recindexname, char *kind, int **ret_IDs) {
+	int numIDs;
+	int *IDs;
+	char *dictname;
+	RangeVar *dictrv;
+	// Objects for querying.
+	char *querystring;
+	QueryDesc *queryDesc;
+	PlanState *planstate;
+	TupleTableSlot *slot;
+	MemoryContext recathoncontext;
+
+	dictname = (char*) palloc(256*sizeof(char));
+	sprintf(dictname,"%sIDs",recindexname);
+	dictrv = makeRangeVarFromNameList(stringToQualifiedNameList(dictname));
+	if (!relationExists(dictrv)) {
+		pfree(dictrv);
+		pfree(dictname);
+		return -1;
+	}
+	pfree(dictrv);
+
+	querystring = (char*) palloc(1024*sizeof(char));
+	sprintf(querystring,"select coalesce(array_length(ids,1),0) as count, ids from %s where kind = '%s';",
+		dictname,kind);
+	queryDesc = recathon_queryStart(querystring,&recathoncontext);
+	planstate = queryDesc->planstate;
+
+	numIDs = -1;
+	IDs = NULL;
+	slot = ExecProcNode(planstate);
+	if (!TupIsNull(slot)) {
+		int count = getTupleInt(slot,"count");
+
+		IDs = (int*) palloc((count+1)*sizeof(int));
+		numIDs = getTupleIntArray(slot,"ids",IDs,count);
+		if (numIDs > count)
+			numIDs = count;
+	}
+	recathon_queryEnd(queryDesc,recathoncontext);
+
+	pfree(querystring);
+	pfree(dictname);
+
+	(*ret_IDs) = IDs;
+	return numIDs;
+}
+
+/* ----------------------------------------------------------------
+ *		modelVersion
+ *
+ *		Identifies the current build of a recommender's models,
+ *		for the shared model cache and model files. Every build
+ *		rewrites the ID dictionary in the same transaction, so
+ *		its xmin changes whenever the models do. Returns 0 if
+ *		the recommender has no dictionary, in which case nothing
+ *		it loads is shared.
+ * ----------------------------------------------------------------
+ */
+uint32
+modelVersion(char *recindexname) {
+	uint32 version;
+	char *dictname;
+	RangeVar *dictrv;
+	// Objects for querying.
+	char *querystring;
+	QueryDesc *queryDesc;
+	TupleTableSlot *slot;
+	CachedPlan *cplan;
+	MemoryContext recathoncontext;
+
+	dictname = (char*) palloc(256*sizeof(char));
+	sprintf(dictname,"%sIDs",recindexname);
+	dictrv = makeRangeVarFromNameList(stringToQualifiedNameList(dictname));
+	if (!relationExists(dictrv)) {
+		pfree(dictrv);
+		pfree(dictname);
+		return 0;
+	}
+	pfree(dictrv);
+
+	querystring = (char*) palloc(1024*sizeof(char));
+	sprintf(querystring,"select xmin::text as version from %s where kind = 'items';",dictname);
+	// Every RECOMMEND query asks, so the plan is kept.
+	queryDesc = recathon_queryStartCached(querystring,0,NULL,NULL,
+		&cplan,&recathoncontext);
+	slot = ExecProcNode(queryDesc->planstate);
+
+	version = 0;
+	if (!TupIsNull(slot)) {
+		char *versionstr = getTupleString(slot,"version");
+
+		version = (uint32) strtoul(versionstr, NULL, 10);
+		pfree(versionstr);
+	}
+	recathon_queryEndCached(queryDesc,cplan,recathoncontext);
+
+	pfree(querystring);
+	pfree(dictname);
+	return version;
+}
+
+/* ----------------------------------------------------------------
+ *		storeModelPrecision
+ *
+ *		Records how many bits a recommender keeps for each
+ *		similarity or factor in the model cache and its model
+ *		file. It's kept with the ID lists, so it has to be
+ *		called after refreshIDDictionary has made the table,
+ *		and refreshing them leaves it alone. The model tables
+ *		themselves always hold full precision.
+ * ----------------------------------------------------------------
+ */
+void
+storeModelPrecision(char *recindexname, int bits) {
+	char *querystring;
+
+	querystring = (char*) palloc(1024*sizeof(char));
+	sprintf(querystring,"DELETE FROM %sIDs WHERE kind = 'precision';",recindexname);
+	recathon_queryExecute(querystring);
+
+	sprintf(querystring,"INSERT INTO %sIDs VALUES ('precision', ARRAY[%d]);",
+		recindexname,bits);
+	recathon_queryExecute(querystring);
+
+	pfree(querystring);
+}
+
+/* ----------------------------------------------------------------
+ *		loadModelPrecision
+ *
+ *		Returns the precision set by storeModelPrecision, or
+ *		full precision if none was.
+ * ----------------------------------------------------------------
+ */
+int
+loadModelPrecision(char *recindexname) {
+	int bits = RECATHON_FULL_PRECISION;
+	int *stored;
+
+	if (loadIDDictionary(recindexname, "precision", &stored) > 0 &&
+	    (stored[0] == 8 || stored[0] == 16))
+		bits = stored[0];
+	if (stored)
+		pfree(stored);
+	return bits;
+}
+
+/* ----------------------------------------------------------------
+ *		refreshActiveItems
+ *
+ *		For a recommender created with active_items, stores
+ *		the sorted IDs of the items it may recommend with its
+ *		other ID lists, as kind "active". The option names a
+ *		relation or gives a query, and the items are in its
+ *		first column. The list is only rewritten when it's
+ *		changed, and we return whether it was. It has nothing
+ *		to do with the models, which still learn from every
+ *		item's events.
+ * ----------------------------------------------------------------
+ */
+bool
+refreshActiveItems(char *recindexname) {
+	char *spec, *source;
+	StringInfoData querystring;
+	uint32 changed;
+
+	spec = getRecActiveItems(recindexname);
+	if (!spec)
+		return false;
+
+	// Anything that isn't a query is taken to be a relation.
+	source = spec;
+	while (isspace((unsigned char) *source))
+		source++;
+	initStringInfo(&querystring);
+	if (pg_strncasecmp(source, "select", 6) == 0 ||
+	    pg_strncasecmp(source, "with", 4) == 0 ||
+	    pg_strncasecmp(source, "values", 6) == 0)
+		source = pstrdup(source);
+	else {
+		appendStringInfo(&querystring,"SELECT * FROM %s",source);
+		source = pstrdup(querystring.data);
+		resetStringInfo(&querystring);
+	}
+
+	appendStringInfo(&querystring,"UPDATE %sIDs d SET ids = a.ids FROM (SELECT ARRAY(SELECT DISTINCT item::integer FROM (%s) s(item) WHERE item IS NOT NULL ORDER BY 1) AS ids) a WHERE d.kind = 'active' AND d.ids IS DISTINCT FROM a.ids;",
+		recindexname,source);
+	changed = activeItemsExecute(querystring.data);
+
+	resetStringInfo(&querystring);
+	appendStringInfo(&querystring,"INSERT INTO %sIDs SELECT 'active', ARRAY(SELECT DISTINCT item::integer FROM (%s) s(item) WHERE item IS NOT NULL ORDER BY 1) WHERE NOT EXISTS (SELECT 1 FROM %sIDs WHERE kind = 'active');",
+		recindexname,source,recindexname);
+	changed += activeItemsExecute(querystring.data);
+
+	pfree(querystring.data);
+	pfree(source);
+	pfree(spec);
+	return changed > 0;
+}
+
+/* ----------------------------------------------------------------
+ *		activeItemsExecute
+ *
+ *		Runs one of refreshActiveItems' statements, as
+ *		recathon_queryExecute would, and counts the rows it
+ *		changed.
+ * ----------------------------------------------------------------
+ */
+static uint32
+activeItemsExecute(char *query_string) {
+	QueryDesc *queryDesc;
+	MemoryContext recathoncontext, oldcontext;
+	uint32 processed;
+
+	queryDesc = recathon_queryStart(query_string, &recathoncontext);
+
+	oldcontext = MemoryContextSwitchTo(recathoncontext);
+	ExecutorRun(queryDesc, ForwardScanDirection, 0);
+	MemoryContextSwitchTo(oldcontext);
+	processed = queryDesc->estate->es_processed;
+
+	recathon_queryEnd(queryDesc, recathoncontext);
+	return processed;
+}
+
+/* ----------------------------------------------------------------
+ *		loadActiveItems
+ *
+ *		Reads the items a recommender may recommend, as kept
+ *		by refreshActiveItems. Returns the number of IDs, or
+ *		-1 if every item may be recommended.
+ * ----------------------------------------------------------------
+ */
+int
+loadActiveItems(char *recindexname, int **ret_IDs) {
+	char *spec;
+
+	(*ret_IDs) = NULL;
+	spec = getRecActiveItems(recindexname);
+	if (!spec)
+		return -1;
+	pfree(spec);
+
+	return loadIDDictionary(recindexname, "active", ret_IDs);
+}
+
+/* ----------------------------------------------------------------
+ *		floatToHalf
+ *
+ *		Converts a float to an IEEE half-precision value,
+ *		rounding to nearest even. Factors too large for a half
+ *		become infinite, but training never gets near that.
+ * ----------------------------------------------------------------
+ */
+static uint16
+floatToHalf(float value) {
+#if defined(__F16C__)
+	return (uint16) _cvtss_sh(value, _MM_FROUND_TO_NEAREST_INT);
+#else
+	union { float f; uint32 u; } v;
+	uint32 sign, mant, rounded, rest, half;
+	int exp, shift;
+
+	v.f = value;
+	sign = (v.u >> 16) & 0x8000;
+	exp = (int) ((v.u >> 23) & 0xff);
+	mant = v.u & 0x7fffff;
+
+	// Infinities and NaNs stay what they are.
+	if (exp == 0xff)
+		return sign | 0x7c00 | (mant ? 0x200 : 0);
+	exp += 15 - 127;
+	if (exp >= 31)
+		return sign | 0x7c00;
+
+	// Small values become subnormal halves, or zero.
+	if (exp <= 0) {
+		if (exp < -10)
+			return sign;
+		mant |= 0x800000;
+		shift = 14 - exp;
+	} else
+		shift = 13;
+
+	rounded = mant >> shift;
+	rest = mant & ((1u << shift) - 1);
+	half = 1u << (shift - 1);
+	if (rest > half || (rest == half && (rounded & 1)))
+		rounded++;
+
+	// Rounding up can carry into the exponent, which is just right.
+	if (exp <= 0)
+		return sign | rounded;
+	return sign | (((uint32) exp << 10) + rounded);
+#endif
+}
+
+/* ----------------------------------------------------------------
+ *		halfToFloat
+ *
+ *		Converts an IEEE half-precision value back to a float.
+ * ----------------------------------------------------------------
+ */
+static float
+halfToFloat(uint16 h) {
+#if defined(__F16C__)
+	return _cvtsh_ss(h);
+#else
+	union { float f; uint32 u; } v;
+	uint32 sign, exp, mant;
+
+	sign = ((uint32) h & 0x8000) << 16;
+	exp = (h >> 10) & 0x1f;
+	mant = h & 0x3ff;
+
+	if (exp == 0) {
+		// Zero or subnormal, which is mant * 2^-24.
+		float f = mant * (1.0f / 16777216.0f);
+
+		return sign ? -f : f;
+	}
+	if (exp == 31)
+		v.u = sign | 0x7f800000 | (mant << 13);
+	else
+		v.u = sign | ((exp + 127 - 15) << 23) | (mant << 13);
+	return v.f;
+#endif
+}
+
+/* ----------------------------------------------------------------
+ *		floatsToHalves
+ *
+ *		Converts an array of n floats to half precision.
+ * ----------------------------------------------------------------
+ */
+static void
+floatsToHalves(const float *src, uint16 *dest, Size n) {
+	Size i;
+
+	for (i = 0; i < n; i++)
+		dest[i] = floatToHalf(src[i]);
+}
+
+/* ----------------------------------------------------------------
+ *		similarityScale
+ *
+ *		The scale for a row of similarities quantized to the
+ *		given number of bits, whose largest magnitude is maxabs.
+ * ----------------------------------------------------------------
+ */
+static float
+similarityScale(float maxabs, int bits) {
+	if (bits == RECATHON_FULL_PRECISION)
+		return 1.0;
+	return maxabs / RECATHON_QUANT_MAX(bits);
+}
+
+/* ----------------------------------------------------------------
+ *		storeSimilarity
+ *
+ *		Stores entry j of an array of similarities kept with
+ *		the given number of bits, quantizing it with the row's
+ *		scale if need be.
+ * ----------------------------------------------------------------
+ */
+static void
+storeSimilarity(void *values, int j, float similarity, float scale, int bits) {
+	long q;
+
+	if (bits == RECATHON_FULL_PRECISION) {
+		((float*) values)[j] = similarity;
+		return;
+	}
+
+	q = (scale > 0) ? lrintf(similarity / scale) : 0;
+	if (q > RECATHON_QUANT_MAX(bits))
+		q = RECATHON_QUANT_MAX(bits);
+	if (q < -RECATHON_QUANT_MAX(bits))
+		q = -RECATHON_QUANT_MAX(bits);
+
+	if (bits == 8)
+		((int8*) values)[j] = (int8) q;
+	else
+		((int16*) values)[j] = (int16) q;
+}
+
+/* ----------------------------------------------------------------
+ *		modelFilePath
+ *
+ *		Where a recommender's model file lives, relative to the
+ *		data directory. The directory is shared by every
+ *		database, so the file is named after ours too.
+ * ----------------------------------------------------------------
+ */
+static char*
+modelFilePath(char *recindexname, bool temporary) {
+	char *path = (char*) palloc(MAXPGPATH*sizeof(char));
+
+	snprintf(path, MAXPGPATH, "%s/%u_%s.model%s", RECATHON_MODEL_DIR,
+		MyDatabaseId, recindexname, temporary ? ".tmp" : "");
+	return path;
+}
+
+/* ----------------------------------------------------------------
+ *		modelFileExists
+ *
+ *		Has this recommender been given a model file?
+ * ----------------------------------------------------------------
+ */
+bool
+modelFileExists(char *recindexname) {
+	struct stat st;
+	char *path;
+	bool result;
+
+	path = modelFilePath(recindexname, false);
+	result = (stat(path, &st) == 0);
+	pfree(path);
+	return result;
+}
+
+/* ----------------------------------------------------------------
+ *		removeModelFile
+ *
+ *		Deletes a recommender's model file, if it has one.
+ * ----------------------------------------------------------------
+ */
+void
+removeModelFile(char *recindexname) {
+	char *path;
+
+	path = modelFilePath(recindexname, false);
+	if (unlink(path) != 0 && errno != ENOENT)
+		ereport(WARNING,
+			(errcode_for_file_access(),
+			 errmsg("could not remove model file \"%s\": %m", path)));
+	else
+		logModelFileRemoval(recindexname);
+	pfree(path);
+}
+
+/* ----------------------------------------------------------------
+ *		writeModelFileAt
+ *
+ *		Writes part of a model file at the given offset.
+ * ----------------------------------------------------------------
+ */
+static void
+writeModelFileAt(FILE *file, char *path, uint64 offset, void *data, Size length) {
+	if (length == 0)
+		return;
+	if (fseeko(file, (off_t) offset, SEEK_SET) != 0 ||
+	    fwrite(data, 1, length, file) != length)
+		ereport(ERROR,
+			(errcode_for_file_access(),
+			 errmsg("could not write model file \"%s\": %m", path)));
+}
+
+/* ----------------------------------------------------------------
+ *		addModelFileSection
+ *
+ *		Lays out the next section of a model file.
+ * ----------------------------------------------------------------
+ */
+static void
+addModelFileSection(model_file_header *header, int section, Size length, uint64 *end) {
+	header->offset[section] = TYPEALIGN(RECATHON_MODEL_ALIGN, *end);
+	header->length[section] = length;
+	(*end) = header->offset[section] + length;
+}
+
+/* ----------------------------------------------------------------
+ *		packRowColumns
+ *
+ *		Packs the n column indexes of a row, which must be in
+ *		order, into out, in blocks as RECATHON_PACK_BLOCK
+ *		describes. out needs room for RECATHON_PACKED_SIZE(n)
+ *		bytes. Returns how many it took.
+ * ----------------------------------------------------------------
+ */
+static Size
+packRowColumns(const int *cols, int n, uint8 *out) {
+	int b, k;
+	uint8 *p = out;
+
+	for (b = 0; b < n; b += RECATHON_PACK_BLOCK) {
+		int count = Min(n - b, RECATHON_PACK_BLOCK);
+		uint32 maxgap = 0;
+		uint8 width;
+
+		for (k = 1; k < count; k++)
+			maxgap = Max(maxgap, (uint32) cols[b+k] - (uint32) cols[b+k-1] - 1);
+		width = (maxgap <= 0xFF) ? 1 : (maxgap <= 0xFFFF) ? 2 : 4;
+
+		*p++ = width;
+		memcpy(p, &cols[b], sizeof(int));
+		p += sizeof(int);
+		for (k = 1; k < count; k++) {
+			uint32 gap = (uint32) cols[b+k] - (uint32) cols[b+k-1] - 1;
+
+			if (width == 1)
+				*p = (uint8) gap;
+			else if (width == 2) {
+				uint16 gap16 = (uint16) gap;
+
+				memcpy(p, &gap16, sizeof(uint16));
+			} else
+				memcpy(p, &gap, sizeof(uint32));
+			p += width;
+		}
+	}
+	return p - out;
+}
+
+/* ----------------------------------------------------------------
+ *		unpackGaps
+ *
+ *		Turns count gaps of the given width, packed after the
+ *		column prev, back into columns. With SSE2, four are
+ *		widened at a time and turned into columns with a
+ *		prefix sum. Returns where the gaps end.
+ * ----------------------------------------------------------------
+ */
+static const uint8*
+unpackGaps(const uint8 *p, int width, int count, uint32 prev, int *cols) {
+	int k = 0;
+
+#ifdef __SSE2__
+	__m128i zero = _mm_setzero_si128();
+	__m128i ones = _mm_set1_epi32(1);
+	__m128i last = _mm_set1_epi32((int) prev);
+
+	for (; k + 4 <= count; k += 4) {
+		__m128i v;
+
+		if (width == 1) {
+			int32 four;
+
+			memcpy(&four, p, sizeof(int32));
+			v = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(four), zero), zero);
+		} else if (width == 2)
+			v = _mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i*) p), zero);
+		else
+			v = _mm_loadu_si128((const __m128i*) p);
+		p += 4*width;
+
+		// Each column is the one before, plus its gap and one.
+		v = _mm_add_epi32(v, ones);
+		v = _mm_add_epi32(v, _mm_slli_si128(v, 4));
+		v = _mm_add_epi32(v, _mm_slli_si128(v, 8));
+		v = _mm_add_epi32(v, last);
+		_mm_storeu_si128((__m128i*) (cols + k), v);
+		last = _mm_shuffle_epi32(v, _MM_SHUFFLE(3, 3, 3, 3));
+	}
+	prev = (uint32) _mm_cvtsi128_si32(last);
+#endif
+
+	for (; k < count; k++) {
+		uint32 gap;
+
+		if (width == 1)
+			gap = *p;
+		else if (width == 2) {
+			uint16 gap16;
+
+			memcpy(&gap16, p, sizeof(uint16));
+			gap = gap16;
+		} else
+			memcpy(&gap, p, sizeof(uint32));
+		p += width;
+
+		prev += gap + 1;
+		cols[k] = (int) prev;
+	}
+	return p;
+}
+
+/* ----------------------------------------------------------------
+ *		unpackRowColumns
+ *
+ *		Unpacks the n column indexes of a row packed by
+ *		packRowColumns into cols.
+ * ----------------------------------------------------------------
+ */
+static void
+unpackRowColumns(const uint8 *in, int n, int *cols) {
+	int b;
+	const uint8 *p = in;
+
+	for (b = 0; b < n; b += RECATHON_PACK_BLOCK) {
+		int count = Min(n - b, RECATHON_PACK_BLOCK);
+		int width = *p++;
+
+		memcpy(&cols[b], p, sizeof(int));
+		p += sizeof(int);
+		p = unpackGaps(p, width, count - 1, (uint32) cols[b], cols + b + 1);
+	}
+}
+
+/* ----------------------------------------------------------------
+ *		sparseRowColumns
+ *
+ *		Returns the column indexes of row i of a sparse model,
+ *		so that entry j's is at [j - rowStart[i]]. A packed row
+ *		is unpacked into buf, which needs room for the row, or
+ *		else into the model's own rowBuf.
+ * ----------------------------------------------------------------
+ */
+static int*
+sparseRowColumns(GenSparseModel *model, int i, int *buf) {
+	if (model->colIndex)
+		return model->colIndex + model->rowStart[i];
+	if (!buf)
+		buf = model->rowBuf;
+	unpackRowColumns(model->packed + model->packStart[i],
+		model->rowStart[i+1] - model->rowStart[i], buf);
+	return buf;
+}
+
+/* ----------------------------------------------------------------
+ *		sparseColumn
+ *
+ *		Returns the column index of entry j, in row i, of a
+ *		sparse model. A packed row is skipped through a block
+ *		at a time, and only the entry's block is unpacked.
+ * ----------------------------------------------------------------
+ */
+static int
+sparseColumn(GenSparseModel *model, int i, int j) {
+	const uint8 *p;
+	int k, width;
+	int cols[RECATHON_PACK_BLOCK];
+
+	if (model->colIndex)
+		return model->colIndex[j];
+
+	p = model->packed + model->packStart[i];
+	k = j - model->rowStart[i];
+	while (k >= RECATHON_PACK_BLOCK) {
+		p += 1 + sizeof(int) + (RECATHON_PACK_BLOCK - 1) * (*p);
+		k -= RECATHON_PACK_BLOCK;
+	}
+
+	width = *p++;
+	memcpy(&cols[0], p, sizeof(int));
+	p += sizeof(int);
+	if (k > 0)
+		unpackGaps(p, width, k, (uint32) cols[0], cols + 1);
+	return cols[k];
+}
+
+/* One entry of a row, for putting the row most similar first. */
+typedef struct rank_entry {
+	int		key;
+	float		value;
+} rank_entry;
+
+/* Comparison function for sorting a row most similar first, and
+ * otherwise in the order it was stored. */
+static int
+rankEntryCompare(const void *a, const void *b) {
+	const rank_entry *entry1 = (const rank_entry*) a;
+	const rank_entry *entry2 = (const rank_entry*) b;
+
+	if (entry1->value > entry2->value) return -1;
+	if (entry1->value < entry2->value) return 1;
+	return entry1->key - entry2->key;
+}
+
+/* Comparison function for sorting a row by key. */
+static int
+rankEntryKeyCompare(const void *a, const void *b) {
+	const rank_entry *entry1 = (const rank_entry*) a;
+	const rank_entry *entry2 = (const rank_entry*) b;
+
+	return (entry1->key > entry2->key) - (entry1->key < entry2->key);
+}
+
+/* One entry of a row, and where it was, for sorting a row by column. */
+typedef struct column_entry {
+	int		column;
+	int		entry;
+} column_entry;
+
+/* Comparison function for sorting a row by column. */
+static int
+columnEntryCompare(const void *a, const void *b) {
+	const column_entry *entry1 = (const column_entry*) a;
+	const column_entry *entry2 = (const column_entry*) b;
+
+	return (entry1->column > entry2->column) - (entry1->column < entry2->column);
+}
+
+/* ----------------------------------------------------------------
+ *		writeModelFileRows
+ *
+ *		Writes a similarity model into the CSR sections of a
+ *		model file, with every pair in the rows of both its
+ *		keys. The model table only holds half of each pair,
+ *		unless it's symmetric, so we read it twice over,
+ *		sorted by row, and stream the
+ *		entries out a chunk at a time. Each row is gathered up
+ *		first, so that it can be quantized against its largest
+ *		similarity, and ranked: for every row, the ranked
+ *		section lists its entries most similar first, so a
+ *		row's best few neighbors are the start of one short
+ *		run of the file. The rows come sorted by column too,
+ *		so that their column indexes can be packed; since we
+ *		only know how small they've packed at the end, that
+ *		section is last, and we fill in its length and the
+ *		longest row in the header. Returns the number of
+ *		entries written.
+ * ----------------------------------------------------------------
+ */
+static int
+writeModelFileRows(FILE *file, char *path, model_file_header *header,
+		char *modelname, char *key1, char *key2, int *IDs, int numRows, int capacity,
+		bool symmetric) {
+	int row, nextRow, numEntries, numRowEntries, buffered, bits, valueSize, k;
+	int maxRowLength;
+	int *rowStart, *rowCols, *ranks;
+	int64 *packStart;
+	float *rowVals, *rowScale;
+	rank_entry *rowRanks;
+	char *vals;
+	uint8 *rowPacked, *packs;
+	Size packBuffered, packChunk;
+	uint64 packPos, valPos, rankPos;
+	// Query objects.
+	char *querystring;
+	QueryDesc *queryDesc;
+	PlanState *planstate;
+	TupleTableSlot *slot;
+	MemoryContext recathoncontext;
+	tuple_column acol, bcol, simcol;
+
+	bits = header->valueBits;
+	valueSize = bits / 8;
+	rowStart = (int*) palloc0((numRows+1)*sizeof(int));
+	packStart = (int64*) palloc0((numRows+1)*sizeof(int64));
+	rowScale = (float*) palloc0(Max(numRows, 1)*sizeof(float));
+	rowCols = (int*) palloc(Max(numRows, 1)*sizeof(int));
+	rowVals = (float*) palloc(Max(numRows, 1)*sizeof(float));
+	rowRanks = (rank_entry*) palloc(Max(numRows, 1)*sizeof(rank_entry));
+	rowPacked = (uint8*) palloc(RECATHON_PACKED_SIZE(Max(numRows, 1)));
+	packChunk = RECATHON_MODEL_CHUNK*sizeof(int);
+	packs = (uint8*) palloc(packChunk);
+	vals = (char*) palloc(RECATHON_MODEL_CHUNK*valueSize);
+	ranks = (int*) palloc(RECATHON_MODEL_CHUNK*sizeof(int));
+	packPos = header->offset[MODEL_FILE_COLINDEX];
+	valPos = header->offset[MODEL_FILE_VALUES];
+	rankPos = header->offset[MODEL_FILE_RANKED];
+
+	querystring = (char*) palloc(1024*sizeof(char));
+	if (symmetric)
+		sprintf(querystring,"select %s as a, %s as b, similarity from %s order by a, b;",
+			key1,key2,modelname);
+	else
+		sprintf(querystring,"select a, b, similarity from (select %s as a, %s as b, similarity from %s union all select %s, %s, similarity from %s) s order by a, b;",
+			key1,key2,modelname,key2,key1,modelname);
+	queryDesc = recathon_queryStart(querystring,&recathoncontext);
+	planstate = queryDesc->planstate;
+	bindColumn(&acol, "a");
+	bindColumn(&bcol, "b");
+	bindColumn(&simcol, "similarity");
+
+	row = -1;
+	nextRow = 0;
+	numEntries = 0;
+	numRowEntries = 0;
+	maxRowLength = 0;
+	buffered = 0;
+	packBuffered = 0;
+	for (;;) {
+		int index1 = numRows, index2 = -1;
+
+		CHECK_FOR_INTERRUPTS();
+
+		slot = ExecProcNode(planstate);
+		if (!TupIsNull(slot)) {
+			index1 = binarySearch(IDs, columnInt(slot,&acol), 0, numRows);
+			if (index1 < 0) continue;
+			index2 = binarySearch(IDs, columnInt(slot,&bcol), 0, numRows);
+			if (index2 < 0) continue;
+		}
+
+		// Once a row is complete, scale it and send it on.
+		if (index1 != row) {
+			if (row >= 0) {
+				float maxabs = 0.0;
+				Size packedSize;
+
+				// IDs are sorted, so the columns are already in order.
+				packedSize = packRowColumns(rowCols, numRowEntries, rowPacked);
+				if (packBuffered + packedSize > packChunk) {
+					writeModelFileAt(file, path, packPos, packs, packBuffered);
+					packPos += packBuffered;
+					packBuffered = 0;
+				}
+				if (packedSize > packChunk) {
+					writeModelFileAt(file, path, packPos, rowPacked, packedSize);
+					packPos += packedSize;
+				} else {
+					memcpy(packs + packBuffered, rowPacked, packedSize);
+					packBuffered += packedSize;
+				}
+				maxRowLength = Max(maxRowLength, numRowEntries);
+
+				for (k = 0; k < numRowEntries; k++) {
+					maxabs = Max(maxabs, fabsf(rowVals[k]));
+					rowRanks[k].key = k;
+					rowRanks[k].value = rowVals[k];
+				}
+				rowScale[row] = similarityScale(maxabs, bits);
+				qsort(rowRanks, numRowEntries, sizeof(rank_entry), rankEntryCompare);
+
+				for (k = 0; k < numRowEntries; k++) {
+					storeSimilarity(vals, buffered, rowVals[k], rowScale[row], bits);
+					ranks[buffered] = numEntries + rowRanks[k].key;
+					buffered++;
+					if (buffered == RECATHON_MODEL_CHUNK) {
+						writeModelFileAt(file, path, valPos, vals, buffered*valueSize);
+						writeModelFileAt(file, path, rankPos, ranks, buffered*sizeof(int));
+						valPos += buffered*valueSize;
+						rankPos += buffered*sizeof(int);
+						buffered = 0;
+					}
+				}
+				numEntries += numRowEntries;
+			}
+
+			// Rows come in order, so any we skipped past are empty.
+			while (nextRow <= index1) {
+				packStart[nextRow] = packPos + packBuffered -
+					header->offset[MODEL_FILE_COLINDEX];
+				rowStart[nextRow++] = numEntries;
+			}
+			row = index1;
+			numRowEntries = 0;
+		}
+		if (TupIsNull(slot)) break;
+
+		// We counted the model just before this, in the same
+		// transaction that built it.
+		if (numEntries + numRowEntries >= capacity || numRowEntries >= numRows)
+			elog(ERROR, "model %s changed while its model file was written", modelname);
+
+		rowCols[numRowEntries] = index2;
+		rowVals[numRowEntries] = columnFloat(slot,&simcol);
+		numRowEntries++;
+	}
+	recathon_queryEnd(queryDesc,recathoncontext);
+
+	writeModelFileAt(file, path, packPos, packs, packBuffered);
+	writeModelFileAt(file, path, valPos, vals, buffered*valueSize);
+	writeModelFileAt(file, path, rankPos, ranks, buffered*sizeof(int));
+	writeModelFileAt(file, path, header->offset[MODEL_FILE_ROWSTART],
+		rowStart, (numRows+1)*sizeof(int));
+	writeModelFileAt(file, path, header->offset[MODEL_FILE_PACKSTART],
+		packStart, (numRows+1)*sizeof(int64));
+	header->length[MODEL_FILE_COLINDEX] = packPos + packBuffered -
+		header->offset[MODEL_FILE_COLINDEX];
+	header->maxRowLength = maxRowLength;
+	if (bits != RECATHON_FULL_PRECISION)
+		writeModelFileAt(file, path, header->offset[MODEL_FILE_ROWSCALE],
+			rowScale, numRows*sizeof(float));
+
+	pfree(querystring);
+	pfree(ranks);
+	pfree(vals);
+	pfree(packs);
+	pfree(rowPacked);
+	pfree(rowRanks);
+	pfree(rowVals);
+	pfree(rowCols);
+	pfree(rowScale);
+	pfree(packStart);
+	pfree(rowStart);
+	return numEntries;
+}
+
+/* ----------------------------------------------------------------
+ *		writeModelFile
+ *
+ *		Writes a recommender's models out to a read-only binary
+ *		file in the data directory, for backends to map into
+ *		memory instead of reading the model tables. The file
+ *		holds a header, the user and item ID lists, and then
+ *		either CSR similarity rows, each with its ranking, or
+ *		the user and item factor matrices, every section aligned
+ *		for direct use, and at the recommender's precision. It is
+ *		stamped with the model version, so a file left over
+ *		from an older build, or from a build that was rolled
+ *		back, is simply ignored.
+ * ----------------------------------------------------------------
+ */
+void
+writeModelFile(char *recindexname, recMethod method) {
+	model_file_header header;
+	int numUsers, numItems, bits;
+	int *userIDs, *itemIDs;
+	float *userFactors, *itemFactors;
+	uint16 *userHalves, *itemHalves;
+	char *modelname, *modelname2, *path, *tmppath;
+	uint64 end;
+	bool symmetric = false;
+	FILE *file;
+	// Query objects.
+	char *querystring;
+	QueryDesc *queryDesc;
+	TupleTableSlot *slot;
+	MemoryContext recathoncontext;
+
+	// We're usually called right after the models and dictionary
+	// were written, so make sure we can see them.
+	CommandCounterIncrement();
+
+	// Find the current model tables.
+	querystring = (char*) palloc(1024*sizeof(char));
+	if (FACTOR_METHOD(method))
+		sprintf(querystring,"select recusermodelname, recitemmodelname from %s;",recindexname);
+	else
+		sprintf(querystring,"select recmodelname from %s;",recindexname);
+	queryDesc = recathon_queryStart(querystring,&recathoncontext);
+	slot = ExecProcNode(queryDesc->planstate);
+	if (TupIsNull(slot)) {
+		recathon_queryEnd(queryDesc,recathoncontext);
+		pfree(querystring);
+		return;
+	}
+	if (FACTOR_METHOD(method)) {
+		modelname = getTupleString(slot,"recusermodelname");
+		modelname2 = getTupleString(slot,"recitemmodelname");
+	} else {
+		modelname = getTupleString(slot,"recmodelname");
+		modelname2 = NULL;
+	}
+	recathon_queryEnd(queryDesc,recathoncontext);
+	pfree(querystring);
+
+	numUsers = loadIDDictionary(recindexname, "users", &userIDs);
+	numItems = loadIDDictionary(recindexname, "items", &itemIDs);
+	if (numUsers < 0 || numItems < 0)
+		elog(ERROR, "recommender %s has no ID dictionary", recindexname);
+
+	memset(&header, 0, sizeof(model_file_header));
+	header.magic = RECATHON_MODEL_MAGIC;
+	header.format = RECATHON_MODEL_FORMAT;
+	header.version = modelVersion(recindexname);
+	header.method = (int32) method;
+	header.numUsers = numUsers;
+	header.numItems = numItems;
+	bits = loadModelPrecision(recindexname);
+	header.valueBits = FACTOR_METHOD(method) ? RECATHON_FULL_PRECISION : bits;
+	header.factorBits = (FACTOR_METHOD(method) && bits == 16) ? 16 : RECATHON_FULL_PRECISION;
+
+	end = sizeof(model_file_header);
+	addModelFileSection(&header, MODEL_FILE_USERS, numUsers*sizeof(int), &end);
+	addModelFileSection(&header, MODEL_FILE_ITEMS, numItems*sizeof(int), &end);
+
+	userFactors = NULL;
+	itemFactors = NULL;
+	userHalves = NULL;
+	itemHalves = NULL;
+	if (FACTOR_METHOD(method)) {
+		header.numFeatures = loadFactorModel(modelname2, "items", itemIDs, numItems, &itemFactors);
+		if (header.numFeatures > 0 &&
+		    loadFactorModel(modelname, "users", userIDs, numUsers, &userFactors) != header.numFeatures) {
+			// The user model doesn't match; queries still have the table.
+			if (userFactors)
+				pfree(userFactors);
+			userFactors = NULL;
+		}
+		if (userFactors)
+			addModelFileSection(&header, MODEL_FILE_USERFACTORS,
+				(Size) numUsers * header.numFeatures * (header.factorBits / 8), &end);
+		if (itemFactors)
+			addModelFileSection(&header, MODEL_FILE_ITEMFACTORS,
+				(Size) numItems * header.numFeatures * (header.factorBits / 8), &end);
+
+		// Halves are written from a converted copy.
+		if (header.factorBits == 16 && userFactors) {
+			userHalves = (uint16*) palloc(header.length[MODEL_FILE_USERFACTORS]);
+			floatsToHalves(userFactors, userHalves, (Size) numUsers * header.numFeatures);
+		}
+		if (header.factorBits == 16 && itemFactors) {
+			itemHalves = (uint16*) palloc(header.length[MODEL_FILE_ITEMFACTORS]);
+			floatsToHalves(itemFactors, itemHalves, (Size) numItems * header.numFeatures);
+		}
+	} else {
+		int numRows, numPairs, capacity;
+
+		// A symmetric model already holds each row in full.
+		symmetric = getRecSymmetric(recindexname);
+		numRows = (method == userCosCF || method == userPearCF) ? numUsers : numItems;
+		numPairs = count_rows(modelname);
+		if (numPairs < 0 || numPairs > (INT_MAX - 1) / 2)
+			elog(ERROR, "model %s is too large for a model file", modelname);
+		capacity = symmetric ? numPairs : 2*numPairs;
+		addModelFileSection(&header, MODEL_FILE_ROWSTART, (numRows+1)*sizeof(int), &end);
+		addModelFileSection(&header, MODEL_FILE_PACKSTART, (numRows+1)*sizeof(int64), &end);
+		addModelFileSection(&header, MODEL_FILE_VALUES,
+			(Size) capacity * (header.valueBits / 8), &end);
+		if (header.valueBits != RECATHON_FULL_PRECISION)
+			addModelFileSection(&header, MODEL_FILE_ROWSCALE, numRows*sizeof(float), &end);
+		addModelFileSection(&header, MODEL_FILE_RANKED, capacity*sizeof(int), &end);
+		// Room for the columns at their worst, cut down once written.
+		addModelFileSection(&header, MODEL_FILE_COLINDEX,
+			RECATHON_PACKED_SIZE(capacity) + numRows, &end);
+	}
+
+	// Write to a temporary file and rename it into place, so
+	// that nobody maps a file that's half written.
+	if (mkdir(RECATHON_MODEL_DIR, S_IRWXU) != 0 && errno != EEXIST)
+		ereport(ERROR,
+			(errcode_for_file_access(),
+			 errmsg("could not create directory \"%s\": %m", RECATHON_MODEL_DIR)));
+	path = modelFilePath(recindexname, false);
+	tmppath = modelFilePath(recindexname, true);
+	file = AllocateFile(tmppath, PG_BINARY_W);
+	if (!file)
+		ereport(ERROR,
+			(errcode_for_file_access(),
+			 errmsg("could not create model file \"%s\": %m", tmppath)));
+
+	writeModelFileAt(file, tmppath, header.offset[MODEL_FILE_USERS], userIDs, numUsers*sizeof(int));
+	writeModelFileAt(file, tmppath, header.offset[MODEL_FILE_ITEMS], itemIDs, numItems*sizeof(int));
+	if (FACTOR_METHOD(method)) {
+		if (userFactors)
+			writeModelFileAt(file, tmppath, header.offset[MODEL_FILE_USERFACTORS],
+				userHalves ? (void*) userHalves : (void*) userFactors,
+				header.length[MODEL_FILE_USERFACTORS]);
+		if (itemFactors)
+			writeModelFileAt(file, tmppath, header.offset[MODEL_FILE_ITEMFACTORS],
+				itemHalves ? (void*) itemHalves : (void*) itemFactors,
+				header.length[MODEL_FILE_ITEMFACTORS]);
+	} else {
+		int capacity = header.length[MODEL_FILE_RANKED]/sizeof(int);
+
+		if (method == userCosCF || method == userPearCF)
+			header.numEntries = writeModelFileRows(file, tmppath, &header, modelname,
+				"user1", "user2", userIDs, numUsers, capacity, symmetric);
+		else
+			header.numEntries = writeModelFileRows(file, tmppath, &header, modelname,
+				"item1", "item2", itemIDs, numItems, capacity, symmetric);
+		end = header.offset[MODEL_FILE_COLINDEX] + header.length[MODEL_FILE_COLINDEX];
+	}
+
+	// The header goes last, once we know everything in it.
+	header.fileSize = end;
+	writeModelFileAt(file, tmppath, 0, &header, sizeof(model_file_header));
+	if (fflush(file) != 0 || ftruncate(fileno(file), (off_t) end) != 0 ||
+	    pg_fsync(fileno(file)) != 0)
+		ereport(ERROR,
+			(errcode_for_file_access(),
+			 errmsg("could not write model file \"%s\": %m", tmppath)));
+	if (FreeFile(file) != 0)
+		ereport(ERROR,
+			(errcode_for_file_access(),
+			 errmsg("could not close model file \"%s\": %m", tmppath)));
+	// Standbys get the file itself, and put it in place when
+	// all of it has arrived.
+	logModelFile(recindexname, tmppath, header.version, header.fileSize);
+	if (rename(tmppath, path) != 0)
+		ereport(ERROR,
+			(errcode_for_file_access(),
+			 errmsg("could not rename model file \"%s\" to \"%s\": %m", tmppath, path)));
+
+	pfree(path);
+	pfree(tmppath);
+	if (userFactors)
+		pfree(userFactors);
+	if (itemFactors)
+		pfree(itemFactors);
+	if (userHalves)
+		pfree(userHalves);
+	if (itemHalves)
+		pfree(itemHalves);
+	pfree(userIDs);
+	pfree(itemIDs);
+	pfree(modelname);
+	if (modelname2)
+		pfree(modelname2);
+}
+
+/* ----------------------------------------------------------------
+ *		releaseModelFiles
+ *
+ *		At the end of a transaction no scan can still be
+ *		reading a model file, so we forget their references,
+ *		which scans that errored out never gave back, and
+ *		unmap the files that have been replaced.
+ * ----------------------------------------------------------------
+ */
+static void
+releaseModelFiles(XactEvent event, void *arg) {
+	model_file *link;
+
+	if (event != XACT_EVENT_COMMIT && event != XACT_EVENT_ABORT &&
+	    event != XACT_EVENT_PREPARE)
+		return;
+
+	link = &recathon_model_files;
+	while (*link) {
+		model_file mf = *link;
+
+		mf->refcount = 0;
+		if (mf->stale) {
+			(*link) = mf->next;
+			munmap(mf->base, mf->size);
+			free(mf);
+			continue;
+		}
+		link = &mf->next;
+	}
+}
+
+/* ----------------------------------------------------------------
+ *		openModelFile
+ *
+ *		Maps a recommender's model file into memory, if it has
+ *		one for this version of its models. Each backend keeps
+ *		its mappings from one query to the next, and the pages
+ *		are shared with every other backend through the OS
+ *		page cache. Call closeModelFile when done.
+ * ----------------------------------------------------------------
+ */
+model_file
+openModelFile(char *recindexname, uint32 version) {
+	model_file mf;
+	model_file_header *header;
+	struct stat st;
+	char *path, *base;
+	int fd, section;
+	bool ok;
+
+	if (version == 0)
+		return NULL;
+
+	if (!recathon_model_callback_registered) {
+		RegisterXactCallback(releaseModelFiles, NULL);
+		recathon_model_callback_registered = true;
+	}
+
+	// Maybe we have it mapped already.
+	for (mf = recathon_model_files; mf; mf = mf->next) {
+		if (mf->stale || strcmp(mf->recname, recindexname) != 0)
+			continue;
+		if (mf->version == version) {
+			mf->refcount++;
+			return mf;
+		}
+		// It's been rebuilt since; this goes when nobody's using it.
+		// A mapping of models newer than ours stays for those who
+		// can see them.
+		if (!recathonVersionIsNewer(mf->version))
+			mf->stale = true;
+	}
+
+	path = modelFilePath(recindexname, false);
+	fd = BasicOpenFile(path, O_RDONLY | PG_BINARY, 0);
+	pfree(path);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) != 0 || st.st_size < sizeof(model_file_header)) {
+		close(fd);
+		return NULL;
+	}
+	base = (char*) mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (base == (char*) MAP_FAILED)
+		return NULL;
+
+	// Only a complete file for these very models will do.
+	header = (model_file_header*) base;
+	ok = header->magic == RECATHON_MODEL_MAGIC &&
+		header->format == RECATHON_MODEL_FORMAT &&
+		header->version == version &&
+		header->fileSize == (uint64) st.st_size &&
+		(header->valueBits == 8 || header->valueBits == 16 ||
+		 header->valueBits == RECATHON_FULL_PRECISION) &&
+		(header->factorBits == 16 || header->factorBits == RECATHON_FULL_PRECISION) &&
+		header->length[MODEL_FILE_USERS] == (uint64) header->numUsers*sizeof(int) &&
+		header->length[MODEL_FILE_ITEMS] == (uint64) header->numItems*sizeof(int);
+	for (section = 0; ok && section < MODEL_FILE_SECTIONS; section++) {
+		if (header->length[section] > 0 &&
+		    (header->offset[section] % RECATHON_MODEL_ALIGN != 0 ||
+		     header->offset[section] + header->length[section] > header->fileSize))
+			ok = false;
+	}
+	if (!ok) {
+		munmap(base, (size_t) st.st_size);
+		return NULL;
+	}
+
+	mf = (model_file) malloc(sizeof(struct model_file_t));
+	if (!mf) {
+		munmap(base, (size_t) st.st_size);
+		return NULL;
+	}
+	strlcpy(mf->recname, recindexname, NAMEDATALEN);
+	mf->version = version;
+	mf->base = base;
+	mf->size = (Size) st.st_size;
+	mf->refcount = 1;
+	mf->stale = false;
+	mf->next = recathon_model_files;
+	recathon_model_files = mf;
+	return mf;
+}
+
+/* ----------------------------------------------------------------
+ *		closeModelFile
+ *
+ *		Gives back a reference from openModelFile.
+ * ----------------------------------------------------------------
+ */
+void
+closeModelFile(model_file mf) {
+	if (mf && mf->refcount > 0)
+		mf->refcount--;
+}
+
+/* ----------------------------------------------------------------
+ *		modelFileSection
+ *
+ *		Finds a section of the scan's model file, returning
+ *		NULL if there's no file or the section is empty.
+ * ----------------------------------------------------------------
+ */
+static char*
+modelFileSection(RecScanState *recstate, int section, Size *ret_length) {
+	model_file_header *header;
+
+	if (!recstate->modelFile)
+		return NULL;
+
+	header = (model_file_header*) recstate->modelFile->base;
+	if (header->length[section] == 0)
+		return NULL;
+	if (ret_length)
+		(*ret_length) = (Size) header->length[section];
+	return recstate->modelFile->base + header->offset[section];
+}
+
+/* ----------------------------------------------------------------
+ *		modelFileRows
+ *
+ *		Wraps the CSR sections of the scan's model file in a
+ *		GenSparseModel, or returns NULL if there are none.
+ * ----------------------------------------------------------------
+ */
+static GenSparseModel*
+modelFileRows(RecScanState *recstate) {
+	model_file_header *header;
+	GenSparseModel *model;
+	Size length;
+	char *rowStart;
+
+	rowStart = modelFileSection(recstate, MODEL_FILE_ROWSTART, &length);
+	if (!rowStart)
+		return NULL;
+
+	header = (model_file_header*) recstate->modelFile->base;
+	model = (GenSparseModel*) palloc(sizeof(GenSparseModel));
+	model->numRows = length/sizeof(int) - 1;
+	model->numEntries = header->numEntries;
+	model->maxEntries = header->length[MODEL_FILE_RANKED]/sizeof(int);
+	model->rowStart = (int*) rowStart;
+	model->colIndex = NULL;
+	model->packed = (uint8*) modelFileSection(recstate, MODEL_FILE_COLINDEX, NULL);
+	model->packStart = (int64*) modelFileSection(recstate, MODEL_FILE_PACKSTART, NULL);
+	model->maxRowLength = header->maxRowLength;
+	model->rowBuf = (int*) palloc(Max(model->maxRowLength, 1)*sizeof(int));
+	model->valueBits = header->valueBits;
+	model->values = NULL;
+	model->qvalues = modelFileSection(recstate, MODEL_FILE_VALUES, NULL);
+	model->rowScale = (float*) modelFileSection(recstate, MODEL_FILE_ROWSCALE, NULL);
+	if (!model->packed || !model->qvalues) {
+		// An empty model has no entries to point at.
+		model->packed = (uint8*) rowStart;
+		model->qvalues = rowStart;
+	}
+	if (model->valueBits == RECATHON_FULL_PRECISION)
+		model->values = (float*) model->qvalues;
+	return model;
+}
+
+/* ----------------------------------------------------------------
+ *		modelFileUserFactors
+ *
+ *		Copies a user's factors out of the scan's model file
+ *		into recstate->userFeatures. Returns false if the file
+ *		doesn't have them, in which case the caller queries
+ *		the user model. Users with no row in the model table
+ *		were written as zero vectors, so we treat those as
+ *		missing too, and let them be folded in.
+ * ----------------------------------------------------------------
+ */
+bool
+modelFileUserFactors(RecScanState *recstate, int userID) {
+	return modelFileFactorsOf(recstate, userID, recstate->userFeatures);
+}
+
+/* ----------------------------------------------------------------
+ *		modelFileFactorsOf
+ *
+ *		modelFileUserFactors, copying into row instead.
+ * ----------------------------------------------------------------
+ */
+static bool
+modelFileFactorsOf(RecScanState *recstate, int userID, float *row) {
+	model_file_header *header;
+	char *factors;
+	int *userIDs;
+	int userindex, i;
+
+	factors = modelFileSection(recstate, MODEL_FILE_USERFACTORS, NULL);
+	userIDs = (int*) modelFileSection(recstate, MODEL_FILE_USERS, NULL);
+	if (!factors || !userIDs)
+		return false;
+
+	header = (model_file_header*) recstate->modelFile->base;
+	userindex = binarySearch(userIDs, userID, 0, header->numUsers);
+	if (userindex < 0)
+		return false;
+
+	if (header->factorBits == 16) {
+		uint16 *halves = (uint16*) factors + (Size) userindex * header->numFeatures;
+
+		for (i = 0; i < header->numFeatures; i++)
+			row[i] = halfToFloat(halves[i]);
+	} else
+		memcpy(row, (float*) factors + (Size) userindex * header->numFeatures,
+			header->numFeatures*sizeof(float));
+
+	for (i = 0; i < header->numFeatures; i++) {
+		if (row[i] != 0)
+			return true;
+	}
+	return false;
+}
+
+/* ----------------------------------------------------------------
+ *		modelFileUserSim
+ *
+ *		Fills in recstate->userSim for a user-based scan from
+ *		the similarity rows in its model file. Returns false if
+ *		the file doesn't have the user, in which case the
+ *		caller queries the model table.
+ * ----------------------------------------------------------------
+ */
+bool
+modelFileUserSim(RecScanState *recstate, int userID) {
+	model_file_header *header;
+	GenSparseModel *model;
+	int *userIDs, *ranked, *cols;
+	int userindex, i, found;
+
+	userIDs = (int*) modelFileSection(recstate, MODEL_FILE_USERS, NULL);
+	if (!userIDs)
+		return false;
+	model = modelFileRows(recstate);
+	if (!model)
+		return false;
+
+	header = (model_file_header*) recstate->modelFile->base;
+	userindex = binarySearch(userIDs, userID, 0, header->numUsers);
+	if (userindex < 0) {
+		pfree(model->rowBuf);
+		pfree(model);
+		return false;
+	}
+
+	// With a neighborhood, a ranked row has the ones that count
+	// at its start.
+	ranked = (int*) modelFileSection(recstate, MODEL_FILE_RANKED, NULL);
+	if (recstate->neighborhood <= 0)
+		ranked = NULL;
+	found = 0;
+	cols = sparseRowColumns(model, userindex, NULL);
+	for (i = model->rowStart[userindex]; i < model->rowStart[userindex+1]; i++) {
+		int entry = ranked ? ranked[i] : i;
+		int simindex;
+		float similarity;
+
+		if (ranked && found == recstate->neighborhood)
+			break;
+		simindex = binarySearch(recstate->eventUsers,
+					userIDs[cols[entry - model->rowStart[userindex]]],
+					0, recstate->numEventUsers);
+		if (simindex < 0)
+			continue;
+		similarity = sparseValue(model, userindex, entry);
+		recstate->userSim[simindex] = similarity;
+		if (similarity != 0.0)
+			found++;
+	}
+	pfree(model->rowBuf);
+	pfree(model);
+	return true;
+}
+
+/* ----------------------------------------------------------------
+ *		modelDataShared
+ *
+ *		Is this array one the scan is reading from the model
+ *		cache or its model file, and so mustn't free?
+ * ----------------------------------------------------------------
+ */
+bool
+modelDataShared(RecScanState *recstate, void *ptr) {
+	char *p = (char*) ptr;
+
+	if (recathonCacheOwns(ptr))
+		return true;
+	return recstate->modelFile && p >= recstate->modelFile->base &&
+		p < recstate->modelFile->base + recstate->modelFile->size;
+}
+
+/* ----------------------------------------------------------------
+ *		cachedModelData
+ *
+ *		Looks for a piece of this scan's recommender in the
+ *		shared model cache. If it's there, it stays pinned
+ *		until the scan ends.
+ * ----------------------------------------------------------------
+ */
+static char*
+cachedModelData(RecScanState *recstate, char *kind, Size *ret_size) {
+	AttributeInfo *attributes = (AttributeInfo*) recstate->attributes;
+	char *data;
+	int handle;
+
+	if (recstate->cacheVersion == 0)
+		return NULL;
+
+	data = recathonCacheLookup(attributes->recIndexName, kind,
+			recstate->cacheVersion, ret_size, &handle);
+	if (data)
+		recstate->cachePins = lappend_int(recstate->cachePins, handle);
+	return data;
+}
+
+/* ----------------------------------------------------------------
+ *		reserveModelData
+ *
+ *		Sets aside room for a piece of this scan's recommender
+ *		in the shared model cache. The caller fills it in and
+ *		calls recathonCacheFinish with the handle. Returns NULL
+ *		if it can't be cached.
+ * ----------------------------------------------------------------
+ */
+static char*
+reserveModelData(RecScanState *recstate, char *kind, Size size, int *ret_handle) {
+	AttributeInfo *attributes = (AttributeInfo*) recstate->attributes;
+	char *data;
+
+	if (recstate->cacheVersion == 0)
+		return NULL;
+
+	data = recathonCacheReserve(attributes->recIndexName, kind,
+			recstate->cacheVersion, size, ret_handle);
+	if (data)
+		recstate->cachePins = lappend_int(recstate->cachePins, *ret_handle);
+	return data;
+}
+
+/* ----------------------------------------------------------------
+ *		loadCachedIDDictionary
+ *
+ *		loadIDDictionary for a scan, reading the list from the
+ *		recommender's model file or the shared model cache
+ *		when it's there, and putting it in the cache when it
+ *		isn't. A shared list must not be freed.
+ * ----------------------------------------------------------------
+ */
+int
+loadCachedIDDictionary(RecScanState *recstate, char *kind, int **ret_IDs) {
+	AttributeInfo *attributes = (AttributeInfo*) recstate->attributes;
+	int numIDs, handle;
+	int *IDs;
+	char *data;
+	Size size;
+
+	data = modelFileSection(recstate, strcmp(kind, "users") == 0 ?
+			MODEL_FILE_USERS : MODEL_FILE_ITEMS, &size);
+	if (!data)
+		data = cachedModelData(recstate, kind, &size);
+	if (data) {
+		(*ret_IDs) = (int*) data;
+		return size / sizeof(int);
+	}
+
+	numIDs = loadIDDictionary(attributes->recIndexName, kind, &IDs);
+	if (numIDs > 0) {
+		data = reserveModelData(recstate, kind, numIDs*sizeof(int), &handle);
+		if (data) {
+			memcpy(data, IDs, numIDs*sizeof(int));
+			recathonCacheFinish(handle);
+			pfree(IDs);
+			IDs = (int*) data;
+		}
+	}
+
+	(*ret_IDs) = IDs;
+	return numIDs;
+}
+
+/* ----------------------------------------------------------------
+ *		releaseEventCaptures
+ *
+ *		At the end of a transaction the events we kept may be
+ *		out of date, and a pass that errored out never let go
+ *		of them, so we drop them all.
+ * ----------------------------------------------------------------
+ */
+static void
+releaseEventCaptures(XactEvent event, void *arg) {
+	if (event != XACT_EVENT_COMMIT && event != XACT_EVENT_ABORT &&
+	    event != XACT_EVENT_PREPARE)
+		return;
+
+	recathon_capture_depth = 0;
+	endEventCapture();
+}
+
+/* ----------------------------------------------------------------
+ *		beginEventCapture
+ *
+ *		Starts keeping the events each model build reads, so
+ *		that other recommenders rebuilt over the same events
+ *		table and columns, until the matching endEventCapture,
+ *		don't have to scan it again. Calls can be nested.
+ * ----------------------------------------------------------------
+ */
+static void
+beginEventCapture(void) {
+	if (!recathon_capture_callback_registered) {
+		RegisterXactCallback(releaseEventCaptures, NULL);
+		recathon_capture_callback_registered = true;
+	}
+
+	if (recathon_capture_depth++ > 0)
+		return;
+
+	recathon_capture_context = AllocSetContextCreate(TopMemoryContext,
+						"RecathonEventCapture",
+						ALLOCSET_DEFAULT_MINSIZE,
+						ALLOCSET_DEFAULT_INITSIZE,
+						ALLOCSET_DEFAULT_MAXSIZE);
+	recathon_event_captures = NULL;
+	recathon_capture_bytes = 0;
+}
+
+/* ----------------------------------------------------------------
+ *		endEventCapture
+ *
+ *		Stops keeping events, and frees the ones we have, once
+ *		the outermost beginEventCapture is done with.
+ * ----------------------------------------------------------------
+ */
+static void
+endEventCapture(void) {
+	if (recathon_capture_depth > 0 && --recathon_capture_depth > 0)
+		return;
+
+	if (recathon_capture_context)
+		MemoryContextDelete(recathon_capture_context);
+	recathon_capture_context = NULL;
+	recathon_event_captures = NULL;
+	recathon_capture_bytes = 0;
+}
+
+/* ----------------------------------------------------------------
+ *		readEvents
+ *
+ *		Reads every event in an events table, in one unordered
+ *		scan, into arrays of the key, the other key and the
+ *		event value, which the caller owns. If an earlier build
+ *		in this maintenance pass read the same events, with the
+ *		keys either way round, we copy those instead of scanning
+ *		the table again. Otherwise, during a pass, we keep what
+ *		we read for the next build, as long as all of the kept
+ *		events fit in maintenance_work_mem. Returns the number
+ *		of events.
+ * ----------------------------------------------------------------
+ */
+static int
+readEvents(char *key, char *otherkey, char *eventtable, char *eventval,
+		int **ret_keys, int **ret_others, float **ret_values) {
+	int numEvents, maxEvents;
+	int *keys, *others;
+	float *values;
+	event_capture *capture;
+	Size bytes;
+	// Objects for querying.
+	char *querystring;
+	QueryDesc *queryDesc;
+	PlanState *planstate;
+	TupleTableSlot *slot;
+	MemoryContext recathoncontext, oldcontext;
+	tuple_column keycol, othercol, eventcol;
+
+	for (capture = recathon_event_captures; capture; capture = capture->next) {
+		bool forward, backward;
+
+		if (strcmp(capture->eventtable, eventtable) != 0 ||
+		    strcmp(capture->eventval, eventval) != 0)
+			continue;
+		forward = (strcmp(capture->userkey, key) == 0 &&
+			strcmp(capture->itemkey, otherkey) == 0);
+		backward = (strcmp(capture->userkey, otherkey) == 0 &&
+			strcmp(capture->itemkey, key) == 0);
+		if (!forward && !backward)
+			continue;
+
+		numEvents = capture->numEvents;
+		keys = (int*) palloc(Max(numEvents,1)*sizeof(int));
+		others = (int*) palloc(Max(numEvents,1)*sizeof(int));
+		values = (float*) palloc(Max(numEvents,1)*sizeof(float));
+		memcpy(keys, forward ? capture->users : capture->items,
+			numEvents*sizeof(int));
+		memcpy(others, forward ? capture->items : capture->users,
+			numEvents*sizeof(int));
+		memcpy(values, capture->values, numEvents*sizeof(float));
+
+		elog(DEBUG1, "reusing the %d events read from %s for this build",
+			numEvents, eventtable);
+		(*ret_keys) = keys;
+		(*ret_others) = others;
+		(*ret_values) = values;
+		return numEvents;
+	}
+
+	maxEvents = 1024;
+	keys = (int*) palloc(maxEvents*sizeof(int));
+	others = (int*) palloc(maxEvents*sizeof(int));
+	values = (float*) palloc(maxEvents*sizeof(float));
+
+	querystring = (char*) palloc(1024*sizeof(char));
+	sprintf(querystring,"SELECT %s,%s,%s FROM %s;",
+		key,otherkey,eventval,eventtable);
+	queryDesc = recathon_queryStart(querystring,&recathoncontext);
+	planstate = queryDesc->planstate;
+	bindColumn(&keycol, key);
+	bindColumn(&othercol, otherkey);
+	bindColumn(&eventcol, eventval);
+	pgstat_progress_phase(RECBUILD_PHASE_LOADING,
+		(int64) queryDesc->plannedstmt->planTree->plan_rows);
+
+	numEvents = 0;
+	for (;;) {
+		slot = ExecProcNode(planstate);
+		if (TupIsNull(slot)) break;
+
+		if (numEvents % RECATHON_PROGRESS_ROWS == 0)
+			pgstat_progress_update(numEvents);
+		if (numEvents >= maxEvents) {
+			maxEvents *= 2;
+			keys = (int*) repalloc(keys, maxEvents*sizeof(int));
+			others = (int*) repalloc(others, maxEvents*sizeof(int));
+			values = (float*) repalloc(values, maxEvents*sizeof(float));
+		}
+		keys[numEvents] = columnInt(slot,&keycol);
+		others[numEvents] = columnInt(slot,&othercol);
+		values[numEvents] = columnFloat(slot,&eventcol);
+		numEvents++;
+	}
+	pgstat_progress_update(numEvents);
+
+	recathon_queryEnd(queryDesc,recathoncontext);
+	pfree(querystring);
+
+	// Keep a copy for the next build in this pass, if there's room.
+	bytes = (Size) Max(numEvents,1) * (2*sizeof(int) + sizeof(float));
+	if (recathon_capture_context &&
+	    recathon_capture_bytes + bytes <= (Size) maintenance_work_mem * 1024L) {
+		oldcontext = MemoryContextSwitchTo(recathon_capture_context);
+		capture = (event_capture*) palloc(sizeof(event_capture));
+		capture->eventtable = pstrdup(eventtable);
+		capture->userkey = pstrdup(key);
+		capture->itemkey = pstrdup(otherkey);
+		capture->eventval = pstrdup(eventval);
+		capture->numEvents = numEvents;
+		capture->users = (int*) palloc(Max(numEvents,1)*sizeof(int));
+		capture->items = (int*) palloc(Max(numEvents,1)*sizeof(int));
+		capture->values = (float*) palloc(Max(numEvents,1)*sizeof(float));
+		memcpy(capture->users, keys, numEvents*sizeof(int));
+		memcpy(capture->items, others, numEvents*sizeof(int));
+		memcpy(capture->values, values, numEvents*sizeof(float));
+		capture->next = recathon_event_captures;
+		recathon_event_captures = capture;
+		recathon_capture_bytes += bytes;
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	(*ret_keys) = keys;
+	(*ret_others) = others;
+	(*ret_values) = values;
+	return numEvents;
+}
+
+/* ----------------------------------------------------------------
+ *		collectSimVectors
+ *
+ *		Reads every event with readEvents, and gathers them
+ *		into a rating vector for each distinct key, over
+ *		otherkey, with groupSimVectors. Returns the vectors,
+ *		each sorted, along with the number of them, their IDs
+ *		in increasing order, and the number of events.
+ * ----------------------------------------------------------------
+ */
+sim_vector*
+collectSimVectors(char *key, char *otherkey, char *eventtable, char *eventval,
+		int *totalNum, int **IDlist, int *totalEvents) {
+	int numEvents;
+	int *eventKey, *eventOther;
+	float *eventValue;
+	sim_vector *vectors;
+
+	numEvents = readEvents(key, otherkey, eventtable, eventval,
+		&eventKey, &eventOther, &eventValue);
+	vectors = groupSimVectors(numEvents, eventKey, eventOther, eventValue,
+		totalNum, IDlist);
+
+	pfree(eventKey);
+	pfree(eventOther);
+	pfree(eventValue);
+
+	if (totalEvents)
+		(*totalEvents) = numEvents;
+
+	return vectors;
+}
+
+/*
+ * Gathers events, given as parallel arrays of the key, the other key
+ * and the event, into a rating vector for each distinct key. Keys
+ * are grouped by hash as they come, and put in order in memory
+ * afterwards, so the executor never has to sort the table. Once we
+ * know how many events each key has, the vectors are packed, and
+ * filled in. The arrays still belong to the caller.
+ */
+static sim_vector*
+groupSimVectors(int numEvents, int *eventKey, int *eventOther,
+		float *eventValue, int *totalNum, int **IDlist) {
+	int i, numVectors, maxVectors;
+	int *IDs, *rank, *lengths, *eventSlot;
+	sim_vector *vectors;
+	sim_key_slot *keyed;
+	HTAB *slots;
+	HASHCTL ctl;
+
+	// Every key we come across gets the next slot.
+	MemSet(&ctl, 0, sizeof(ctl));
+	ctl.keysize = sizeof(int);
+	ctl.entrysize = sizeof(sim_key_slot);
+	ctl.hash = tag_hash;
+	ctl.hcxt = CurrentMemoryContext;
+	slots = hash_create("Recathon rating vectors", 1024, &ctl,
+		HASH_ELEM | HASH_FUNCTION | HASH_CONTEXT);
+
+	maxVectors = 1024;
+	numVectors = 0;
+	keyed = (sim_key_slot*) palloc(maxVectors*sizeof(sim_key_slot));
+	eventSlot = (int*) palloc(Max(numEvents,1)*sizeof(int));
+
+	for (i = 0; i < numEvents; i++) {
+		bool found;
+		sim_key_slot *entry;
+
+		entry = (sim_key_slot*) hash_search(slots, &eventKey[i],
+			HASH_ENTER, &found);
+		if (!found) {
+			if (numVectors >= maxVectors) {
+				maxVectors *= 2;
+				keyed = (sim_key_slot*) repalloc(keyed,
+					maxVectors*sizeof(sim_key_slot));
+			}
+			entry->index = numVectors;
+			keyed[numVectors].id = eventKey[i];
+			keyed[numVectors].index = numVectors;
+			numVectors++;
+		}
+		eventSlot[i] = entry->index;
+	}
+
+	hash_destroy(slots);
+
+	// Now put the keys in order of ID, and work out where each
+	// slot ended up.
+	qsort(keyed, numVectors, sizeof(sim_key_slot), simKeySlotCompare);
+	IDs = (int*) palloc(Max(numVectors,1)*sizeof(int));
+	rank = (int*) palloc(Max(numVectors,1)*sizeof(int));
+	lengths = (int*) palloc0(Max(numVectors,1)*sizeof(int));
+	for (i = 0; i < numVectors; i++) {
+		IDs[i] = keyed[i].id;
+		rank[keyed[i].index] = i;
+	}
+	pfree(keyed);
+
+	// Fill in the vectors, then put each in order of the other ID,
+	// combining repeated events if we're asked to.
+	for (i = 0; i < numEvents; i++)
+		lengths[rank[eventSlot[i]]]++;
+	vectors = createPackedSimVectors(numVectors, lengths);
+	for (i = 0; i < numEvents; i++)
+		simVectorAppend(vectors[rank[eventSlot[i]]], eventOther[i], eventValue[i]);
+	for (i = 0; i < numVectors; i++)
+		simVectorCollapse(vectors[i]);
+
+	pfree(eventSlot);
+	pfree(lengths);
+	pfree(rank);
+
+	// Return data.
+	(*totalNum) = numVectors;
+	(*IDlist) = IDs;
+
+	return vectors;
+}
+
+/* ----------------------------------------------------------------
+ *		freeSimVectors
+ *
+ *		Frees an array of rating vectors, and the array. If
+ *		they were packed, their blocks start with the first
+ *		one.
+ * ----------------------------------------------------------------
+ */
+void
+freeSimVectors(sim_vector *vectors, int numVectors) {
+	int i;
+
+	if (numVectors > 0 && vectors[0] && vectors[0]->packed) {
+		pfree(vectors[0]->id);
+		pfree(vectors[0]->event);
+		pfree(vectors[0]);
+	} else {
+		for (i = 0; i < numVectors; i++)
+			freeSimVector(vectors[i]);
+	}
+	pfree(vectors);
+}
+
+/* ----------------------------------------------------------------
+ *		vector_lengths
+ *
+ *		Calculates the vector length of each of a set of
+ *		rating vectors. Used to determine cosine similarity.
+ * ----------------------------------------------------------------
+ */
+float*
+vector_lengths(sim_vector *vectors, int numVectors) {
+	int i, k;
+	float *lengths;
+
+	lengths = (float*) palloc(Max(numVectors,1)*sizeof(float));
+	for (i = 0; i < numVectors; i++) {
+		float sum = 0.0;
+
+		if (vectors[i])
+			for (k = 0; k < vectors[i]->length; k++)
+				sum += vectors[i]->event[k]*vectors[i]->event[k];
+		lengths[i] = sqrtf(sum);
+	}
+
+	return lengths;
+}
+
+/* ----------------------------------------------------------------
+ *		gallopSearch
+ *
+ *		Finds the first position from lo on in a sorted list
+ *		of IDs whose ID is at least value, doubling the step
+ *		until it overshoots and then bisecting, so that each
+ *		of a short vector's IDs costs a logarithmic number
+ *		of steps through a long one. Returns length if there
+ *		isn't one.
+ * ----------------------------------------------------------------
+ */
+static int
+gallopSearch(const int *ids, int lo, int length, int value) {
+	int hi, step = 1;
+
+	if (lo >= length || ids[lo] >= value)
+		return lo;
+
+	hi = lo + 1;
+	while (hi < length && ids[hi] < value) {
+		lo = hi;
+		step <<= 1;
+		hi = lo + step;
+	}
+	if (hi > length)
+		hi = length;
+
+	// ids[lo] is short of value, and ids[hi] isn't, if it exists.
+	while (lo + 1 < hi) {
+		int mid = lo + (hi - lo) / 2;
+
+		if (ids[mid] < value)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return hi;
+}
+
+/* ----------------------------------------------------------------
+ *		gallopPastSearch
+ *
+ *		Like gallopSearch, but finds the first position whose
+ *		ID is greater than value.
+ * ----------------------------------------------------------------
+ */
+static int
+gallopPastSearch(const int *ids, int lo, int length, int value) {
+	lo = gallopSearch(ids, lo, length, value);
+	while (lo < length && ids[lo] == value)
+		lo++;
+	return lo;
+}
+
+/* ----------------------------------------------------------------
+ *		gallopIsCheaper
+ *
+ *		Would looking up each of n1 IDs in a vector of n2 take
+ *		less time than merging the two? A lookup takes a
+ *		step for each doubling of the gap between the short
+ *		vector's IDs, and each step, which jumps around
+ *		memory, costs about as much as merging five IDs in
+ *		order; against a vector of 50,000 IDs, the two break
+ *		even when the other is about 25 times shorter.
+ * ----------------------------------------------------------------
+ */
+static bool
+gallopIsCheaper(int n1, int n2) {
+	int steps = 1;
+
+	while (steps < 31 && ((int64) n1 << steps) < n2)
+		steps++;
+	return (int64) 5 * n1 * steps < (int64) n1 + n2;
+}
+
+/* ----------------------------------------------------------------
+ *		sparseDot
+ *
+ *		The sum of (event1 - avg1) * (event2 - avg2) over the
+ *		IDs two sorted vectors share, which is their dot
+ *		product when the averages are zero. Each vector is
+ *		first cut down to the range of IDs the other covers.
+ *		If one is then much shorter, which is what pairing a
+ *		popular item with a niche one gives, its IDs are
+ *		looked up in the longer one by galloping search, for
+ *		a cost that grows with the short one's length and only
+ *		the log of the long one's. Otherwise the two are merged four IDs at a time with
+ *		SSE2, comparing each block of one against every
+ *		rotation of a block of the other, and adding up the
+ *		products of the matching lanes without branching;
+ *		the rest is merged one ID at a time.
+ * ----------------------------------------------------------------
+ */
+static float
+sparseDot(sim_vector item1, sim_vector item2, float avg1, float avg2) {
+	const int *id1, *id2;
+	const float *ev1, *ev2;
+	int n1, n2, i1, i2;
+	float similarity = 0.0;
+
+	if (item1 == NULL || item2 == NULL) return 0.0;
+
+	id1 = item1->id; ev1 = item1->event; n1 = item1->length;
+	id2 = item2->id; ev2 = item2->event; n2 = item2->length;
+	if (n1 == 0 || n2 == 0) return 0.0;
+
+	// Nothing outside the other vector's range of IDs can match.
+	i2 = gallopSearch(id2, 0, n2, id1[0]);
+	n2 = gallopPastSearch(id2, i2, n2, id1[n1 - 1]);
+	if (i2 >= n2) return 0.0;
+	i1 = gallopSearch(id1, 0, n1, id2[i2]);
+	n1 = gallopPastSearch(id1, i1, n1, id2[n2 - 1]);
+	if (i1 >= n1) return 0.0;
+
+	if (gallopIsCheaper(n1 - i1, n2 - i2) ||
+	    gallopIsCheaper(n2 - i2, n1 - i1)) {
+		// Look the shorter side's IDs up in the longer one's;
+		// the sum is the same either way round.
+		if (n1 - i1 > n2 - i2) {
+			const int *tmpid = id1;
+			const float *tmpev = ev1;
+			int tmp = i1;
+			float tmpavg = avg1;
+
+			id1 = id2; ev1 = ev2; avg1 = avg2;
+			id2 = tmpid; ev2 = tmpev; avg2 = tmpavg;
+			i1 = i2; i2 = tmp;
+			tmp = n1; n1 = n2; n2 = tmp;
+		}
+		for (; i1 < n1 && i2 < n2; i1++) {
+			i2 = gallopSearch(id2, i2, n2, id1[i1]);
+			if (i2 < n2 && id2[i2] == id1[i1])
+				similarity += (ev1[i1] - avg1) * (ev2[i2] - avg2);
+		}
+		return similarity;
+	}
+
+#ifdef __SSE2__
+	{
+		__m128 acc = _mm_setzero_ps();
+		__m128 mean1 = _mm_set1_ps(avg1);
+		__m128 mean2 = _mm_set1_ps(avg2);
+		float lanes[4];
+
+		while (i1 + 4 <= n1 && i2 + 4 <= n2) {
+			__m128i a = _mm_loadu_si128((const __m128i *) (id1 + i1));
+			__m128i b = _mm_loadu_si128((const __m128i *) (id2 + i2));
+			__m128 ea = _mm_sub_ps(_mm_loadu_ps(ev1 + i1), mean1);
+			__m128 eb = _mm_sub_ps(_mm_loadu_ps(ev2 + i2), mean2);
+			int max1 = id1[i1 + 3], max2 = id2[i2 + 3];
+
+			// In rotation r, lane j pairs a[j] with b[(j + r) % 4],
+			// and adds their product if the IDs match.
+#define SPARSE_DOT_ROTATION(ctl) \
+			do { \
+				__m128 match = _mm_castsi128_ps(_mm_cmpeq_epi32(a, \
+					_mm_shuffle_epi32(b, ctl))); \
+				acc = _mm_add_ps(acc, _mm_and_ps(match, \
+					_mm_mul_ps(ea, _mm_shuffle_ps(eb, eb, ctl)))); \
+			} while (0)
+			SPARSE_DOT_ROTATION(_MM_SHUFFLE(3,2,1,0));
+			SPARSE_DOT_ROTATION(_MM_SHUFFLE(0,3,2,1));
+			SPARSE_DOT_ROTATION(_MM_SHUFFLE(1,0,3,2));
+			SPARSE_DOT_ROTATION(_MM_SHUFFLE(2,1,0,3));
+#undef SPARSE_DOT_ROTATION
+
+			// Move past whichever block ends first, or both.
+			i1 += (max1 <= max2) << 2;
+			i2 += (max2 <= max1) << 2;
+		}
+		_mm_storeu_ps(lanes, acc);
+		similarity = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+	}
+#endif
+
+	while (i1 < n1 && i2 < n2) {
+		int a = id1[i1], b = id2[i2];
+
+		if (a == b)
+			similarity += (ev1[i1] - avg1) * (ev2[i2] - avg2);
+		i1 += (a <= b);
+		i2 += (b <= a);
+	}
+
+	return similarity;
+}
+
+/* ----------------------------------------------------------------
+ *		dotProduct
+ *
+ *		Function to compare two items and compute their dot
+ *		product. Used for determining cosine similarity.
+ *		The lists are necessarily sorted, so we can compare
+ *		in linear time.
+ * ----------------------------------------------------------------
+ */
+float
+dotProduct(sim_vector item1, sim_vector item2) {
+	return sparseDot(item1, item2, 0.0, 0.0);
+}
+
+/* ----------------------------------------------------------------
+ *		cosineSimilarity
+ *
+ *		Function to compare two items and compute their
+ *		cosine similarity.
+ * ----------------------------------------------------------------
+ */
+float
+cosineSimilarity(sim_vector item1, sim_vector item2, float length1, float length2) {
+	float numerator;
+	float denominator;
+
+	// Short-circuit check. If one of the items has no events,
+	// no point checking similarity. This also avoids a possible
+	// divide-by-zero error.
+	denominator = length1 * length2;
+	if (denominator <= 0) return 0;
+
+	numerator = dotProduct(item1,item2);
+	if (numerator <= 0) return 0;
+	else return numerator / denominator;
+}
+
+/* ----------------------------------------------------------------
+ *		jaccard_info
+ *
+ *		Turns rating vectors into sets, for Jaccard
+ *		similarity, by setting every event to 1. Returns
+ *		the size of each set.
+ * ----------------------------------------------------------------
+ */
+float*
+jaccard_info(sim_vector *vectors, int numVectors) {
+	int i, k;
+	float *sizes;
+
+	sizes = (float*) palloc(Max(numVectors,1)*sizeof(float));
+	for (i = 0; i < numVectors; i++) {
+		sizes[i] = 0.0;
+		if (!vectors[i]) continue;
+		for (k = 0; k < vectors[i]->length; k++)
+			vectors[i]->event[k] = 1.0;
+		sizes[i] = vectors[i]->length;
+	}
+
+	return sizes;
+}
+
+/* ----------------------------------------------------------------
+ *		jaccardSimilarity
+ *
+ *		Function to compare two items and compute their
+ *		Jaccard similarity, the number of users they have
+ *		in common over the number who have either. The
+ *		vectors come from jaccard_info, so their dot product
+ *		is the number in common.
+ * ----------------------------------------------------------------
+ */
+float
+jaccardSimilarity(sim_vector item1, sim_vector item2, float size1, float size2) {
+	float common;
+
+	if (size1 <= 0 || size2 <= 0) return 0;
+
+	common = dotProduct(item1,item2);
+	if (common <= 0) return 0;
+	else return common / (size1 + size2 - common);
+}
+
+/* ----------------------------------------------------------------
+ *		updateItemCosModel
+ *
+ *		Given a single cell of a recommender, this
+ *		function rebuilds the recModel for that cell, using
+ *		item-based collaborative filtering with cosine
+ *		similarity, from the item rating vectors that
+ *		collectSimVectors gathered, which it frees. Returns
+ *		the number of events used.
+ * ----------------------------------------------------------------
+ */
+int
+updateItemCosModel(char *modelname, sim_vector *itemEvents, int *itemIDs,
+		float *itemLengths, int numItems, bool update, sim_params *params) {
+	int i;
+	bool sorted;
+	sim_builder builder;
+	int numEvents = 0;
+	char *querystring;
+
+	// If this is us updating a cell as opposed to building
+	// a recommender, we need to drop the existing entries.
+	querystring = (char*) palloc(1024*sizeof(char));
+	if (update) {
+		sprintf(querystring,"DELETE FROM %s;",modelname);
+		recathon_queryExecute(querystring);
+	}
+
+	// The rating vectors already hold every event, so all that's
+	// left is to count them.
+	for (i = 0; i < numItems; i++)
+		if (itemEvents[i])
+			numEvents += itemEvents[i]->length;
+
+	// If we are updating an existing similarity model,
+	// we will want to drop the existing primary key
+	// constraint before loading it, to save time.
+	if (update) {
+		sprintf(querystring,"ALTER TABLE %s DROP CONSTRAINT %s_pkey;",
+					modelname,modelname);
+		recathon_utilityExecute(querystring);
+	}
+
+	// Compute the similarities and insert them straight into the
+	// model. The rows can be split across several worker processes.
+	builder = simBuilderCreate(itemEvents, numItems, itemLengths, NULL,
+		params->lshBands, params->lshRows);
+	sorted = writeSimilarityModel(builder, itemIDs, modelname, params);
+	simBuilderFree(builder);
+
+	// Now we add the primary key constraint. It's
+	// faster to add it after adding the data than
+	// having it incrementally updated.
+	addModelKey(modelname,"item1, item2",sorted);
+	pfree(querystring);
+
+	// Free up the rating vectors.
+	freeSimVectors(itemEvents, numItems);
+
+	// Return the number of events we used.
+	return numEvents;
+}
+
+/* ----------------------------------------------------------------
+ *		updateItemJaccardModel
+ *
+ *		Given a single cell of a recommender, this
+ *		function rebuilds the recModel for that cell, using
+ *		item-based collaborative filtering with Jaccard
+ *		similarity, from the item vectors that jaccard_info
+ *		made into sets, which it frees. Returns the number
+ *		of events used.
+ * ----------------------------------------------------------------
+ */
+int
+updateItemJaccardModel(char *modelname, sim_vector *itemEvents, int *itemIDs,
+		float *itemSizes, int numItems, bool update, sim_params *params) {
+	int i;
+	bool sorted;
+	sim_builder builder;
+	int numEvents = 0;
+	char *querystring;
+
+	// If this is us updating a cell as opposed to building
+	// a recommender, we need to drop the existing entries,
+	// and the primary key until they're reloaded.
+	querystring = (char*) palloc(1024*sizeof(char));
+	if (update) {
+		sprintf(querystring,"DELETE FROM %s;",modelname);
+		recathon_queryExecute(querystring);
+		sprintf(querystring,"ALTER TABLE %s DROP CONSTRAINT %s_pkey;",
+					modelname,modelname);
+		recathon_utilityExecute(querystring);
+	}
+
+	for (i = 0; i < numItems; i++)
+		if (itemEvents[i])
+			numEvents += itemEvents[i]->length;
+
+	// Compute the similarities and insert them straight into the
+	// model. The rows can be split across several worker processes.
+	builder = simBuilderCreateJaccard(itemEvents, numItems, itemSizes,
+		params->lshBands, params->lshRows);
+	sorted = writeSimilarityModel(builder, itemIDs, modelname, params);
+	simBuilderFree(builder);
+
+	addModelKey(modelname,"item1, item2",sorted);
+	pfree(querystring);
+
+	freeSimVectors(itemEvents, numItems);
+
+	return numEvents;
+}
+
+/* ----------------------------------------------------------------
+ *		indexSimilarityModel
+ *
+ *		A similarity model whose rows get rewritten by item
+ *		or user has them looked up by the second column as
+ *		well as the first, so it gets an index on that too.
+ * ----------------------------------------------------------------
+ */
+void
+indexSimilarityModel(char *modelname, char *column) {
+	char *querystring;
+
+	querystring = (char*) palloc(1024*sizeof(char));
+	sprintf(querystring,"CREATE INDEX %s_%s ON %s (%s);",
+		modelname,column,modelname,column);
+	recathon_utilityExecute(querystring);
+	pfree(querystring);
+}
+
+/* ----------------------------------------------------------------
+ *		analyzeModel
+ *
+ *		Collects statistics on a model that has just been
+ *		built or rewritten, so that the planner knows what's
+ *		in it before any query looks it up. Otherwise it goes
+ *		by the empty table it started as until autovacuum
+ *		gets around to it.
+ * ----------------------------------------------------------------
+ */
+void
+analyzeModel(char *modelname) {
+	char *querystring;
+
+	querystring = (char*) palloc(1024*sizeof(char));
+	sprintf(querystring,"ANALYZE %s;",modelname);
+	pgstat_progress_phase(RECBUILD_PHASE_STATISTICS, 0);
+	recathon_utilityExecute(querystring);
+	pfree(querystring);
+}
+
+/* ----------------------------------------------------------------
+ *		noteBuildStrategy
+ *
+ *		Records how a similarity model was just built, and
+ *		why, in the recommender's RecModelsCatalogue entry,
+ *		and reports it at the given level.
+ * ----------------------------------------------------------------
+ */
+void
+noteBuildStrategy(char *recname, char *recindexname, sim_params *params,
+			int elevel) {
+	StringInfoData querystring;
+
+	if (params->strategy[0] == '\0')
+		return;
+
+	initStringInfo(&querystring);
+	appendStringInfo(&querystring,"UPDATE RecModelsCatalogue SET buildstrategy = %s WHERE recommenderIndexName = '%s';",
+		quote_literal_cstr(params->strategy),recindexname);
+	recathon_queryExecute(querystring.data);
+	pfree(querystring.data);
+
+	ereport(elevel,
+		(errmsg("similarity model of recommender \"%s\" built %s",
+			recname, params->strategy)));
+}
+
+/* ----------------------------------------------------------------
+ *		symmetrizeSimilarityModel
+ *
+ *		Gives a finished similarity model the other direction
+ *		of every pair it holds, then clusters it on its
+ *		primary key, so that all of an item's or user's
+ *		neighbors sit together under the first column and
+ *		can be read with one range scan of the index.
+ * ----------------------------------------------------------------
+ */
+void
+symmetrizeSimilarityModel(char *modelname, bool itemside) {
+	char *querystring, *col1, *col2;
+
+	col1 = itemside ? "item1" : "user1";
+	col2 = itemside ? "item2" : "user2";
+	querystring = (char*) palloc(1024*sizeof(char));
+
+	sprintf(querystring,"INSERT INTO %s SELECT s.%s, s.%s, s.similarity FROM %s s WHERE NOT EXISTS (SELECT 1 FROM %s t WHERE t.%s = s.%s AND t.%s = s.%s);",
+		modelname,col2,col1,modelname,modelname,col1,col2,col2,col1);
+	recathon_queryExecute(querystring);
+	CommandCounterIncrement();
+
+	sprintf(querystring,"CLUSTER %s USING %s_pkey;",modelname,modelname);
+	recathon_utilityExecute(querystring);
+	pfree(querystring);
+}
+
+/* ----------------------------------------------------------------
+ *		ensureEventIndex
+ *
+ *		Gives an events table a B-tree index on two of its key
+ *		columns, followed by the event value, so that a lookup
+ *		by the first key can be answered by an index-only scan.
+ *		An index that already leads with the two keys will do.
+ *		We leave alone views, and tables we don't own.
+ * ----------------------------------------------------------------
+ */
+static void
+ensureEventIndex(char *eventtable, char *firstkey, char *secondkey, char *eventval) {
+	bool needed;
+	char *querystring;
+	QueryDesc *queryDesc;
+	TupleTableSlot *slot;
+	MemoryContext recathoncontext;
+
+	querystring = (char*) palloc(2048*sizeof(char));
+	sprintf(querystring,"SELECT CASE WHEN c.relkind = 'r' AND pg_has_role(c.relowner, 'USAGE') AND NOT EXISTS (SELECT 1 FROM pg_index i WHERE i.indrelid = c.oid AND i.indnatts >= 2 AND i.indexprs IS NULL AND i.indpred IS NULL AND i.indkey[0] = (SELECT attnum FROM pg_attribute WHERE attrelid = c.oid AND attname = '%s') AND i.indkey[1] = (SELECT attnum FROM pg_attribute WHERE attrelid = c.oid AND attname = '%s')) THEN 1 ELSE 0 END AS needed FROM pg_class c WHERE c.oid = '%s'::regclass;",
+		firstkey,secondkey,eventtable);
+	queryDesc = recathon_queryStart(querystring,&recathoncontext);
+	slot = ExecProcNode(queryDesc->planstate);
+	needed = !TupIsNull(slot) && getTupleInt(slot,"needed") != 0;
+	recathon_queryEnd(queryDesc,recathoncontext);
+
+	if (needed) {
+		sprintf(querystring,"CREATE INDEX ON %s (%s, %s, %s);",
+			eventtable,firstkey,secondkey,eventval);
+		recathon_utilityExecute(querystring);
+	}
+	pfree(querystring);
+}
+
+/* ----------------------------------------------------------------
+ *		ensureEventIndexes
+ *
+ *		Makes sure the ways we look up an events table, by user
+ *		when preparing a user and by item when scoring with
+ *		user-based CF, don't have to scan all of it.
+ * ----------------------------------------------------------------
+ */
+void
+ensureEventIndexes(char *eventtable, char *userkey, char *itemkey, char *eventval) {
+	ensureEventIndex(eventtable, userkey, itemkey, eventval);
+	ensureEventIndex(eventtable, itemkey, userkey, eventval);
+	CommandCounterIncrement();
+}
+
+/* ----------------------------------------------------------------
+ *		eventPartitions
+ *
+ *		Returns the names of the tables that inherit from an
+ *		events table, at any depth. A table partitioned with
+ *		inheritance gets its rows through these.
+ * ----------------------------------------------------------------
+ */
+static List *
+eventPartitions(Oid relid) {
+	List *children, *names = NIL;
+	ListCell *lc;
+
+	children = find_all_inheritors(relid, NoLock, NULL);
+	foreach(lc, children) {
+		char *childname;
+
+		if (lfirst_oid(lc) == relid)
+			continue;
+		childname = get_rel_name(lfirst_oid(lc));
+		if (childname)
+			names = lappend(names, childname);
+	}
+	list_free(children);
+
+	return names;
+}
+
+/* ----------------------------------------------------------------
+ *		createDeltaTrigger
+ *
+ *		Puts the trigger that copies new events into a
+ *		recommender's Deltas table on a table, replacing
+ *		any it had. The querystring is scratch space of
+ *		1024 bytes.
+ * ----------------------------------------------------------------
+ */
+static void
+createDeltaTrigger(char *recindexname, char *tablename, char *userkey,
+		char *itemkey, char *eventval, char *querystring) {
+	sprintf(querystring,"DROP TRIGGER IF EXISTS %sDeltas ON %s;",
+		recindexname,tablename);
+	recathon_utilityExecute(querystring);
+	sprintf(querystring,"CREATE TRIGGER %sDeltas AFTER INSERT ON %s FOR EACH ROW EXECUTE PROCEDURE recathon_record_event('%sDeltas', '%s', '%s', '%s');",
+		recindexname,tablename,recindexname,userkey,itemkey,eventval);
+	recathon_utilityExecute(querystring);
+}
+
+/* ----------------------------------------------------------------
+ *		createEventDeltas
+ *
+ *		Creates a recommender's Deltas table, and the AFTER
+ *		INSERT trigger on its events table that copies each
+ *		new event into it. The table keeps the events
+ *		table's own column types, so the trigger can copy
+ *		the values across as they are. Rows inserted into a
+ *		partition don't fire the trigger of the table it
+ *		inherits from, so every partition gets one too.
+ * ----------------------------------------------------------------
+ */
+void
+createEventDeltas(char *recindexname, char *eventtable, char *userkey,
+		char *itemkey, char *eventval) {
+	char *querystring;
+	List *partitions;
+	ListCell *lc;
+
+	querystring = (char*) palloc(1024*sizeof(char));
+	sprintf(querystring,"CREATE TABLE %sDeltas AS SELECT %s, %s, %s FROM %s WITH NO DATA;",
+		recindexname,userkey,itemkey,eventval,eventtable);
+	recathon_utilityExecute(querystring);
+	sprintf(querystring,"CREATE TRIGGER %sDeltas AFTER INSERT ON %s FOR EACH ROW EXECUTE PROCEDURE recathon_record_event('%sDeltas', '%s', '%s', '%s');",
+		recindexname,eventtable,recindexname,userkey,itemkey,eventval);
+	recathon_utilityExecute(querystring);
+
+	partitions = eventPartitions(RelnameGetRelid(eventtable));
+	foreach(lc, partitions)
+		createDeltaTrigger(recindexname, (char*) lfirst(lc),
+			userkey, itemkey, eventval, querystring);
+	list_free_deep(partitions);
+	pfree(querystring);
+}
+
+/* ----------------------------------------------------------------
+ *		noteTableInherits
+ *
+ *		Called when a table starts inheriting from others, by
+ *		CREATE TABLE ... INHERITS or ALTER TABLE ... INHERIT.
+ *		If one of them is an events table whose recommenders
+ *		keep a Deltas table, the new partition and any tables
+ *		under it get their triggers, so the events inserted
+ *		into it are counted like any others.
+ * ----------------------------------------------------------------
+ */
+void
+noteTableInherits(Oid relid) {
+	List *ancestors, *tables, *recommenders = NIL;
+	ListCell *lc, *rc;
+	char *querystring;
+	QueryDesc *queryDesc;
+	TupleTableSlot *slot;
+	MemoryContext recathoncontext;
+
+	if (catalogueRelid() == InvalidOid)
+		return;
+	ancestors = inheritanceAncestors(relid);
+	if (ancestors == NIL)
+		return;
+
+	// We find the recommenders first, and only change the
+	// tables once we're done reading the catalogue.
+	querystring = (char*) palloc(1024*sizeof(char));
+	foreach(lc, ancestors) {
+		if (!isEventTable((char*) lfirst(lc)))
+			continue;
+
+		sprintf(querystring,"SELECT recommenderindexname, userkey, itemkey, eventval FROM RecModelsCatalogue WHERE eventtable = '%s' AND (incremental <> 0 OR partial_refresh <> 0 OR online <> 0 OR method IN ('svd', 'als')) UNION ALL SELECT recommenderindexname || 'Vector', userkey, itemkey, eventval FROM RecModelsCatalogue WHERE eventtable = '%s' AND vectorstore <> 0;",
+			(char*) lfirst(lc),(char*) lfirst(lc));
+		queryDesc = recathon_queryStart(querystring,&recathoncontext);
+		for (;;) {
+			slot = ExecProcNode(queryDesc->planstate);
+			if (TupIsNull(slot)) break;
+
+			recommenders = lappend(recommenders, list_make4(
+				getTupleString(slot,"recommenderindexname"),
+				getTupleString(slot,"userkey"),
+				getTupleString(slot,"itemkey"),
+				getTupleString(slot,"eventval")));
+		}
+		recathon_queryEnd(queryDesc,recathoncontext);
+	}
+	list_free_deep(ancestors);
+
+	if (recommenders != NIL) {
+		tables = eventPartitions(relid);
+		tables = lcons(get_rel_name(relid), tables);
+		foreach(rc, recommenders) {
+			List *rec = (List*) lfirst(rc);
+
+			foreach(lc, tables)
+				createDeltaTrigger((char*) linitial(rec), (char*) lfirst(lc),
+					(char*) lsecond(rec), (char*) lthird(rec),
+					(char*) lfourth(rec), querystring);
+			list_free_deep(rec);
+		}
+		list_free_deep(tables);
+		list_free(recommenders);
+	}
+	pfree(querystring);
+}
+
+/* ----------------------------------------------------------------
+ *		lockEventDeltas
+ *
+ *		Before the maintenance process reads a recommender's
+ *		Deltas table, it makes sure no other session is
+ *		doing the same. The trigger's inserts don't conflict
+ *		with this lock, but whoever had it before us may
+ *		have used and deleted deltas our snapshot still
+ *		sees, so we push a new one, taken after we have the
+ *		lock, for the caller to pop when it's done. That
+ *		also keeps the events table and the deltas in step.
+ * ----------------------------------------------------------------
+ */
+static void
+lockEventDeltas(char *deltaname) {
+	RangeVar *deltarv;
+
+	deltarv = makeRangeVarFromNameList(stringToQualifiedNameList(deltaname));
+	LockRelationOid(RangeVarGetRelid(deltarv, NoLock, false),
+		ShareUpdateExclusiveLock);
+	pfree(deltarv);
+	PushActiveSnapshot(GetTransactionSnapshot());
+}
+
+/* ----------------------------------------------------------------
+ *		hasEventDeltas
+ *
+ *		Does a recommender have a Deltas table? SVD and ALS
+ *		recommenders from before fold-in used one don't, nor
+ *		do the cells of a partitioned one.
+ * ----------------------------------------------------------------
+ */
+static bool
+hasEventDeltas(char *recindexname) {
+	char deltaname[NAMEDATALEN + 8];
+	RangeVar *deltarv;
+	bool exists;
+
+	snprintf(deltaname, sizeof(deltaname), "%sDeltas", recindexname);
+	deltarv = makeRangeVarFromNameList(stringToQualifiedNameList(deltaname));
+	exists = relationExists(deltarv);
+	pfree(deltarv);
+
+	return exists;
+}
+
+/* ----------------------------------------------------------------
+ *		clearEventDeltas
+ *
+ *		Empties a recommender's Deltas table once a full
+ *		rebuild, or a fold-in, has taken in every event it
+ *		can see.
+ * ----------------------------------------------------------------
+ */
+void
+clearEventDeltas(char *recindexname) {
+	char *querystring;
+
+	querystring = (char*) palloc(1024*sizeof(char));
+	sprintf(querystring,"DELETE FROM %sDeltas;",recindexname);
+	recathon_queryExecute(querystring);
+	CommandCounterIncrement();
+	pfree(querystring);
+}
+
+/* ----------------------------------------------------------------
+ *		buildItemCosStats
+ *
+ *		Sets up an incremental ItemCosCF recommender. The
+ *		cosine similarity of two items only depends on their
+ *		dot product and their squared norms, so we keep
+ *		those, along with how many users rated both items,
+ *		in a Dots and a Norms table. An AFTER INSERT trigger
+ *		on the events table copies each new event into a
+ *		Deltas table, and applyItemCosDeltas later adds the
+ *		new events' share to the statistics and rewrites the
+ *		model rows they change.
+ * ----------------------------------------------------------------
+ */
+void
+buildItemCosStats(char *recindexname, char *eventtable, char *userkey,
+		char *itemkey, char *eventval, char *modelname) {
+	char *querystring;
+
+	querystring = (char*) palloc(2048*sizeof(char));
+
+	sprintf(querystring,"CREATE TABLE %sNorms (item INTEGER NOT NULL, sqnorm DOUBLE PRECISION NOT NULL);",
+		recindexname);
+	recathon_utilityExecute(querystring);
+	sprintf(querystring,"CREATE TABLE %sDots (item1 INTEGER NOT NULL, item2 INTEGER NOT NULL, dot DOUBLE PRECISION NOT NULL, corated INTEGER NOT NULL);",
+		recindexname);
+	recathon_utilityExecute(querystring);
+
+	// Both tables are filled before they get their keys, which
+	// is faster than updating the indexes as we go.
+	sprintf(querystring,"INSERT INTO %sNorms SELECT %s, sum(%s::float8 * %s) FROM %s GROUP BY %s;",
+		recindexname,itemkey,eventval,eventval,eventtable,itemkey);
+	recathon_queryExecute(querystring);
+	sprintf(querystring,"INSERT INTO %sDots SELECT a.%s, b.%s, sum(a.%s::float8 * b.%s), count(*) FROM %s a, %s b WHERE a.%s = b.%s AND a.%s < b.%s GROUP BY a.%s, b.%s;",
+		recindexname,itemkey,itemkey,eventval,eventval,eventtable,eventtable,
+		userkey,userkey,itemkey,itemkey,itemkey,itemkey);
+	recathon_queryExecute(querystring);
+	CommandCounterIncrement();
+
+	sprintf(querystring,"ALTER TABLE %sNorms ADD PRIMARY KEY (item);",
+		recindexname);
+	recathon_utilityExecute(querystring);
+	sprintf(querystring,"ALTER TABLE %sDots ADD PRIMARY KEY (item1, item2);",
+		recindexname);
+	recathon_utilityExecute(querystring);
+	sprintf(querystring,"CREATE INDEX %sDots_item2 ON %sDots (item2);",
+		recindexname,recindexname);
+	recathon_utilityExecute(querystring);
+	indexSimilarityModel(modelname, "item2");
+
+	createEventDeltas(recindexname, eventtable, userkey, itemkey, eventval);
+	pfree(querystring);
+}
+
+/* ----------------------------------------------------------------
+ *		applyItemCosChanges
+ *
+ *		Adds the changes in recathon_pairs and recathon_items
+ *		to an incremental recommender's statistics, and
+ *		rewrites the model rows of the items in
+ *		recathon_items from them. The querystring is scratch
+ *		space of 4096 bytes.
+ * ----------------------------------------------------------------
+ */
+static void
+applyItemCosChanges(char *recindexname, char *modelname, char *querystring) {
+	// Add them to the statistics, with new rows for new pairs
+	// and items.
+	sprintf(querystring,"UPDATE %sDots t SET dot = t.dot + p.dot, corated = t.corated + p.corated FROM recathon_pairs p WHERE t.item1 = p.item1 AND t.item2 = p.item2;",
+		recindexname);
+	recathon_queryExecute(querystring);
+	CommandCounterIncrement();
+	sprintf(querystring,"INSERT INTO %sDots SELECT p.item1, p.item2, p.dot, p.corated FROM recathon_pairs p WHERE NOT EXISTS (SELECT 1 FROM %sDots t WHERE t.item1 = p.item1 AND t.item2 = p.item2);",
+		recindexname,recindexname);
+	recathon_queryExecute(querystring);
+	sprintf(querystring,"UPDATE %sNorms t SET sqnorm = t.sqnorm + p.sqnorm FROM recathon_items p WHERE t.item = p.item;",
+		recindexname);
+	recathon_queryExecute(querystring);
+	CommandCounterIncrement();
+	sprintf(querystring,"INSERT INTO %sNorms SELECT p.item, p.sqnorm FROM recathon_items p WHERE NOT EXISTS (SELECT 1 FROM %sNorms t WHERE t.item = p.item);",
+		recindexname,recindexname);
+	recathon_queryExecute(querystring);
+	CommandCounterIncrement();
+
+	// Rewrite the model rows of the items whose norms changed,
+	// from either side. Like the full build, we only keep the
+	// pairs with a positive similarity.
+	sprintf(querystring,"DELETE FROM %s WHERE item1 IN (SELECT item FROM recathon_items);",
+		modelname);
+	recathon_queryExecute(querystring);
+	sprintf(querystring,"DELETE FROM %s WHERE item2 IN (SELECT item FROM recathon_items);",
+		modelname);
+	recathon_queryExecute(querystring);
+	CommandCounterIncrement();
+	sprintf(querystring,"INSERT INTO %s SELECT t.item1, t.item2, (t.dot / (sqrt(n1.sqnorm) * sqrt(n2.sqnorm)))::real FROM %sDots t, %sNorms n1, %sNorms n2 WHERE t.item1 IN (SELECT item FROM recathon_items) AND n1.item = t.item1 AND n2.item = t.item2 AND t.dot > 0 AND n1.sqnorm > 0 AND n2.sqnorm > 0;",
+		modelname,recindexname,recindexname,recindexname);
+	recathon_queryExecute(querystring);
+	sprintf(querystring,"INSERT INTO %s SELECT t.item1, t.item2, (t.dot / (sqrt(n1.sqnorm) * sqrt(n2.sqnorm)))::real FROM %sDots t, %sNorms n1, %sNorms n2 WHERE t.item2 IN (SELECT item FROM recathon_items) AND t.item1 NOT IN (SELECT item FROM recathon_items) AND n1.item = t.item1 AND n2.item = t.item2 AND t.dot > 0 AND n1.sqnorm > 0 AND n2.sqnorm > 0;",
+		modelname,recindexname,recindexname,recindexname);
+	recathon_queryExecute(querystring);
+}
+
+/* ----------------------------------------------------------------
+ *		applyItemCosDeltas
+ *
+ *		Folds the events waiting in an incremental
+ *		recommender's Deltas table into its statistics and
+ *		model. A new rating (u, i, r) adds r * r' to the dot
+ *		product of i and each other item u has rated r', and
+ *		r * r to the squared norm of i, so we only look at
+ *		the events of users with new ones. Every pair of a
+ *		new event with any of the user's events counts once
+ *		in each direction, which counts the pairs of two new
+ *		events twice, so those are taken back out by half.
+ *		The model rows of every item whose norm changed are
+ *		rewritten from the statistics; no other rows change.
+ *		Returns the number of events folded in.
+ * ----------------------------------------------------------------
+ */
+int
+applyItemCosDeltas(char *recindexname, char *eventtable, char *userkey,
+		char *itemkey, char *eventval, char *modelname) {
+	int numDeltas;
+	char *querystring, *deltaname;
+
+	querystring = (char*) palloc(4096*sizeof(char));
+	deltaname = (char*) palloc(256*sizeof(char));
+	sprintf(deltaname,"%sDeltas",recindexname);
+
+	// Only one session folds in a recommender's events at once.
+	lockEventDeltas(deltaname);
+
+	numDeltas = count_rows(deltaname);
+	if (numDeltas <= 0) {
+		PopActiveSnapshot();
+		pfree(deltaname);
+		pfree(querystring);
+		return 0;
+	}
+
+	// The changes to the statistics, by pair and by item.
+	recathon_utilityExecute("CREATE TEMP TABLE recathon_pairs (item1 INTEGER NOT NULL, item2 INTEGER NOT NULL, dot DOUBLE PRECISION NOT NULL, corated INTEGER NOT NULL);");
+	recathon_utilityExecute("CREATE TEMP TABLE recathon_items (item INTEGER NOT NULL, sqnorm DOUBLE PRECISION NOT NULL);");
+
+	sprintf(querystring,"INSERT INTO recathon_pairs SELECT item1, item2, sum(dot), round(sum(corated))::integer FROM (SELECT least(d.%s, e.%s) AS item1, greatest(d.%s, e.%s) AS item2, d.%s::float8 * e.%s AS dot, 1.0::float8 AS corated FROM %s d, %s e WHERE e.%s = d.%s AND e.%s <> d.%s UNION ALL SELECT least(d1.%s, d2.%s), greatest(d1.%s, d2.%s), -0.5 * d1.%s::float8 * d2.%s, -0.5::float8 FROM %s d1, %s d2 WHERE d1.%s = d2.%s AND d1.%s <> d2.%s) p GROUP BY item1, item2;",
+		itemkey,itemkey,itemkey,itemkey,eventval,eventval,
+		deltaname,eventtable,userkey,userkey,itemkey,itemkey,
+		itemkey,itemkey,itemkey,itemkey,eventval,eventval,
+		deltaname,deltaname,userkey,userkey,itemkey,itemkey);
+	recathon_queryExecute(querystring);
+	sprintf(querystring,"INSERT INTO recathon_items SELECT %s, sum(%s::float8 * %s) FROM %s GROUP BY %s;",
+		itemkey,eventval,eventval,deltaname,itemkey);
+	recathon_queryExecute(querystring);
+	CommandCounterIncrement();
+
+	applyItemCosChanges(recindexname,modelname,querystring);
+
+	// The deltas we saw are done with. Any that arrived since
+	// our snapshot stay for the next pass.
+	sprintf(querystring,"DELETE FROM %s;",deltaname);
+	recathon_queryExecute(querystring);
+	CommandCounterIncrement();
+
+	recathon_utilityExecute("DROP TABLE recathon_pairs;");
+	recathon_utilityExecute("DROP TABLE recathon_items;");
+
+	PopActiveSnapshot();
+	pfree(deltaname);
+	pfree(querystring);
+
+	return numDeltas;
+}
+
+/* ----------------------------------------------------------------
+ *		loadDeltaFactors
+ *
+ *		Reads the rows of a user or item model table for the
+ *		IDs in keycol of the Deltas table into features, in
+ *		the order of IDs. Returns the number of them found,
+ *		and marks which those were; the rest are untouched.
+ * ----------------------------------------------------------------
+ */
+static int
+loadDeltaFactors(char *modelname, char *keycol, char *deltaname,
+		char *deltakey, int *IDs, int n, int numFeatures,
+		float *features, bool *found) {
+	int numFound;
+	char *querystring;
+	QueryDesc *queryDesc;
+	PlanState *planstate;
+	TupleTableSlot *slot;
+	MemoryContext recathoncontext;
+	tuple_column keycolumn, featurescol;
+
+	querystring = (char*) palloc(1024*sizeof(char));
+	sprintf(querystring,"SELECT %s, features FROM %s WHERE %s IN (SELECT %s FROM %s);",
+		keycol,modelname,keycol,deltakey,deltaname);
+	queryDesc = recathon_queryStart(querystring,&recathoncontext);
+	planstate = queryDesc->planstate;
+	bindColumn(&keycolumn, keycol);
+	bindColumn(&featurescol, "features");
+
+	numFound = 0;
+	for (;;) {
+		int index;
+
+		slot = ExecProcNode(planstate);
+		if (TupIsNull(slot)) break;
+
+		index = binarySearch(IDs,columnInt(slot,&keycolumn),0,n);
+		if (index < 0 || found[index])
+			continue;
+		columnFloatArray(slot, &featurescol,
+			features + (Size) index * numFeatures, numFeatures);
+		found[index] = true;
+		numFound++;
+	}
+	recathon_queryEnd(queryDesc,recathoncontext);
+	pfree(querystring);
+
+	return numFound;
+}
+
+/* ----------------------------------------------------------------
+ *		applyOnlineDeltas
+ *
+ *		Takes the events waiting in an online SVD or ALS
+ *		recommender's Deltas table into its factors, with a
+ *		few rounds of stochastic gradient descent over just
+ *		those events. Only the rows of the users and items
+ *		they name change: those are read from the model
+ *		tables, stepped towards the new events, and written
+ *		back in place. Users and items new to the model start
+ *		out the way training starts them. Returns the number
+ *		of events taken in.
+ * ----------------------------------------------------------------
+ */
+int
+applyOnlineDeltas(char *recindexname, char *userkey, char *itemkey,
+		char *eventval, char *usermodelname, char *itemmodelname) {
+	int i, p, epoch, numDeltas, maxDeltas, numUsers, numItems, numFeatures;
+	int *deltaUsers, *deltaItems, *userIDs, *itemIDs, *userIndex, *itemIndex;
+	float *deltaValues, *userFeatures, *itemFeatures;
+	bool *userFound, *itemFound;
+	char *querystring, *deltaname;
+	model_writer writer;
+	// Query objects.
+	QueryDesc *queryDesc;
+	PlanState *planstate;
+	TupleTableSlot *slot;
+	MemoryContext recathoncontext;
+
+	// Rows are rewritten whole, so the models have to keep
+	// their factors in arrays, as new ones do.
+	if (!factorModelHasArrays(usermodelname) || !factorModelHasArrays(itemmodelname))
+		return 0;
+
+	querystring = (char*) palloc(1024*sizeof(char));
+	deltaname = (char*) palloc(256*sizeof(char));
+	sprintf(deltaname,"%sDeltas",recindexname);
+
+	// Only one session takes in a recommender's events at once.
+	lockEventDeltas(deltaname);
+
+	sprintf(querystring,"SELECT %s, %s, %s FROM %s;",
+		userkey,itemkey,eventval,deltaname);
+	numDeltas = 0;
+	maxDeltas = 1024;
+	deltaUsers = (int*) palloc(maxDeltas*sizeof(int));
+	deltaItems = (int*) palloc(maxDeltas*sizeof(int));
+	deltaValues = (float*) palloc(maxDeltas*sizeof(float));
+	queryDesc = recathon_queryStart(querystring,&recathoncontext);
+	planstate = queryDesc->planstate;
+	for (;;) {
+		slot = ExecProcNode(planstate);
+		if (TupIsNull(slot)) break;
+		if (numDeltas >= maxDeltas) {
+			maxDeltas *= 2;
+			deltaUsers = (int*) repalloc(deltaUsers, maxDeltas*sizeof(int));
+			deltaItems = (int*) repalloc(deltaItems, maxDeltas*sizeof(int));
+			deltaValues = (float*) repalloc(deltaValues, maxDeltas*sizeof(float));
+		}
+		deltaUsers[numDeltas] = getTupleInt(slot,userkey);
+		deltaItems[numDeltas] = getTupleInt(slot,itemkey);
+		deltaValues[numDeltas] = getTupleFloat(slot,eventval);
+		numDeltas++;
+	}
+	recathon_queryEnd(queryDesc,recathoncontext);
+
+	// The width of the factors, from any one row.
+	numFeatures = 0;
+	if (numDeltas > 0) {
+		sprintf(querystring,"SELECT array_length(features, 1) AS numfeatures FROM %s LIMIT 1;",
+			itemmodelname);
+		queryDesc = recathon_queryStart(querystring,&recathoncontext);
+		slot = ExecProcNode(queryDesc->planstate);
+		if (!TupIsNull(slot)) {
+			slot_getallattrs(slot);
+			if (!slot->tts_isnull[0])
+				numFeatures = getTupleInt(slot,"numfeatures");
+		}
+		recathon_queryEnd(queryDesc,recathoncontext);
+	}
+
+	if (numFeatures <= 0 || numFeatures > RECATHON_MAX_FEATURES) {
+		PopActiveSnapshot();
+		pfree(deltaUsers);
+		pfree(deltaItems);
+		pfree(deltaValues);
+		pfree(deltaname);
+		pfree(querystring);
+		return 0;
+	}
+
+	numUsers = distinctIDs(deltaUsers, numDeltas, &userIDs);
+	numItems = distinctIDs(deltaItems, numDeltas, &itemIDs);
+	userFeatures = allocFeatures(numFeatures, numUsers, false);
+	itemFeatures = allocFeatures(numFeatures, numItems, false);
+	userFound = (bool*) palloc0(numUsers*sizeof(bool));
+	itemFound = (bool*) palloc0(numItems*sizeof(bool));
+	loadDeltaFactors(usermodelname, "users", deltaname, userkey, userIDs,
+		numUsers, numFeatures, userFeatures, userFound);
+	loadDeltaFactors(itemmodelname, "items", deltaname, itemkey, itemIDs,
+		numItems, numFeatures, itemFeatures, itemFound);
+
+	userIndex = (int*) palloc(numDeltas*sizeof(int));
+	itemIndex = (int*) palloc(numDeltas*sizeof(int));
+	for (i = 0; i < numDeltas; i++) {
+		userIndex[i] = binarySearch(userIDs, deltaUsers[i], 0, numUsers);
+		itemIndex[i] = binarySearch(itemIDs, deltaItems[i], 0, numItems);
+	}
+
+	for (epoch = 0; epoch < RECATHON_ONLINE_EPOCHS; epoch++) {
+		for (i = 0; i < numDeltas; i++) {
+			float *userVec = userFeatures + (Size) userIndex[i] * numFeatures;
+			float *itemVec = itemFeatures + (Size) itemIndex[i] * numFeatures;
+			float err = deltaValues[i] - factorDot(userVec, itemVec, numFeatures);
+
+			for (p = 0; p < numFeatures; p++) {
+				float userValue = userVec[p];
+
+				userVec[p] += RECATHON_ONLINE_RATE *
+					(err * itemVec[p] - RECATHON_ONLINE_PENALTY * userValue);
+				itemVec[p] += RECATHON_ONLINE_RATE *
+					(err * userValue - RECATHON_ONLINE_PENALTY * itemVec[p]);
+			}
+		}
+		CHECK_FOR_INTERRUPTS();
+	}
+
+	// Out with the old rows, and in with the new.
+	sprintf(querystring,"DELETE FROM %s WHERE users IN (SELECT %s FROM %s);",
+		usermodelname,userkey,deltaname);
+	recathon_queryExecute(querystring);
+	sprintf(querystring,"DELETE FROM %s WHERE items IN (SELECT %s FROM %s);",
+		itemmodelname,itemkey,deltaname);
+	recathon_queryExecute(querystring);
+	CommandCounterIncrement();
+
+	writer = modelWriterOpen(usermodelname);
+	for (i = 0; i < numUsers; i++)
+		modelWriterInsertArray(writer, userIDs[i],
+			userFeatures + (Size) i * numFeatures, numFeatures);
+	modelWriterClose(writer);
+	writer = modelWriterOpen(itemmodelname);
+	for (i = 0; i < numItems; i++)
+		modelWriterInsertArray(writer, itemIDs[i],
+			itemFeatures + (Size) i * numFeatures, numFeatures);
+	modelWriterClose(writer);
+
+	// The deltas we saw are done with. Any that arrived since
+	// our snapshot stay for the next pass.
+	sprintf(querystring,"DELETE FROM %s;",deltaname);
+	recathon_queryExecute(querystring);
+	CommandCounterIncrement();
+	PopActiveSnapshot();
+
+	pfree(deltaUsers);
+	pfree(deltaItems);
+	pfree(deltaValues);
+	pfree(userIDs);
+	pfree(itemIDs);
+	pfree(userIndex);
+	pfree(itemIndex);
+	pfree(userFound);
+	pfree(itemFound);
+	freeFeatures(userFeatures, numFeatures, numUsers, false);
+	freeFeatures(itemFeatures, numFeatures, numItems, false);
+	pfree(deltaname);
+	pfree(querystring);
+
+	return numDeltas;
+}
+
+/* ----------------------------------------------------------------
+ *		createEventFilter
+ *
+ *		Sets a recommender up to learn only from the events
+ *		that meet its WHERE condition. Its models are built
+ *		from a view of them, and the condition goes in the
+ *		catalogue, where queries are matched against it.
+ *		A window or a sample is taken from the view in turn.
+ * ----------------------------------------------------------------
+ */
+void
+createEventFilter(char *recindexname, char *eventtable, char *filter) {
+	StringInfoData querystring;
+
+	// Columns in the condition can be named with or without the
+	// table, as in a query on it.
+	initStringInfo(&querystring);
+	appendStringInfo(&querystring,"CREATE VIEW %sFilter AS SELECT * FROM %s WHERE (%s);",
+		recindexname,eventtable,filter);
+	recathon_utilityExecute(querystring.data);
+
+	resetStringInfo(&querystring);
+	appendStringInfo(&querystring,"UPDATE RecModelsCatalogue SET eventfilter = %s WHERE recommenderindexname = '%s';",
+		quote_literal_cstr(filter),recindexname);
+	recathon_queryExecute(querystring.data);
+	CommandCounterIncrement();
+
+	pfree(querystring.data);
+}
+
+/* ----------------------------------------------------------------
+ *		createEventWindow
+ *
+ *		Sets a recommender up to learn only from the events
+ *		of the last timewindow, by their timekey. Its models
+ *		are built from a view of those events, in which each
+ *		is weighted by half for every halflife of its age if
+ *		a half-life is given. We also note where the window
+ *		starts, so that maintenance can tell which events
+ *		have left it since. The window is taken from the
+ *		recommender's WHERE condition, if it has one.
+ * ----------------------------------------------------------------
+ */
+void
+createEventWindow(char *recindexname, char *eventtable, char *userkey,
+		char *itemkey, char *eventval, char *timekey, char *timewindow,
+		char *halflife) {
+	char *windowlit, *halflifelit = NULL, *source;
+	StringInfoData querystring;
+	QueryDesc *queryDesc;
+	TupleTableSlot *slot;
+	MemoryContext recathoncontext;
+	float windowsecs, halflifesecs = 1.0;
+
+	windowlit = quote_literal_cstr(timewindow);
+	if (halflife)
+		halflifelit = quote_literal_cstr(halflife);
+
+	// Both have to be intervals, and positive ones.
+	initStringInfo(&querystring);
+	appendStringInfo(&querystring,"SELECT extract(epoch FROM %s::interval)::real AS windowsecs, extract(epoch FROM %s::interval)::real AS halflifesecs;",
+		windowlit,halflifelit ? halflifelit : "'1 second'");
+	queryDesc = recathon_queryStart(querystring.data,&recathoncontext);
+	slot = ExecProcNode(queryDesc->planstate);
+	windowsecs = getTupleFloat(slot,"windowsecs");
+	halflifesecs = getTupleFloat(slot,"halflifesecs");
+	recathon_queryEnd(queryDesc,recathoncontext);
+	if (windowsecs <= 0)
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("WINDOW must be a positive interval")));
+	if (halflifesecs <= 0)
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("DECAY must be a positive interval")));
+
+	source = getRecFilterSource(recindexname,eventtable);
+	resetStringInfo(&querystring);
+	if (halflife)
+		appendStringInfo(&querystring,"CREATE VIEW %sWindow AS SELECT e.%s, e.%s, (e.%s * power(0.5, extract(epoch FROM now() - e.%s) / extract(epoch FROM %s::interval)))::real AS %s, e.%s FROM %s e WHERE e.%s >= now() - %s::interval;",
+			recindexname,userkey,itemkey,eventval,timekey,halflifelit,
+			eventval,timekey,source,timekey,windowlit);
+	else
+		appendStringInfo(&querystring,"CREATE VIEW %sWindow AS SELECT e.%s, e.%s, e.%s, e.%s FROM %s e WHERE e.%s >= now() - %s::interval;",
+			recindexname,userkey,itemkey,eventval,timekey,
+			source,timekey,windowlit);
+	recathon_utilityExecute(querystring.data);
+	pfree(source);
+
+	resetStringInfo(&querystring);
+	appendStringInfo(&querystring,"UPDATE RecModelsCatalogue SET timecolumn = '%s', timewindow = %s::interval, halflife = %s%s, windowstart = now() - %s::interval, windowexpired = 0 WHERE recommenderindexname = '%s';",
+		timekey,windowlit,halflifelit ? halflifelit : "NULL",
+		halflifelit ? "::interval" : "",windowlit,recindexname);
+	recathon_queryExecute(querystring.data);
+	CommandCounterIncrement();
+
+	pfree(querystring.data);
+	pfree(windowlit);
+	if (halflifelit)
+		pfree(halflifelit);
+}
+
+/* ----------------------------------------------------------------
+ *		createEventSample
+ *
+ *		Creates the view a sampled recommender builds its
+ *		models from: every event of a fixed fraction of the
+ *		users, taken from its window if it has one. Users
+ *		are picked by a hash of their ID, so the same ones
+ *		stay in the sample from one rebuild to the next, and
+ *		each of them keeps all of their events.
+ * ----------------------------------------------------------------
+ */
+void
+createEventSample(char *recindexname, char *eventtable, char *userkey,
+		float fraction) {
+	char *source;
+	StringInfoData querystring;
+
+	// The window has to exist already, so the sample is
+	// taken from it.
+	source = getRecWindowSource(recindexname,eventtable);
+
+	initStringInfo(&querystring);
+	appendStringInfo(&querystring,"CREATE VIEW %sSample AS SELECT e.* FROM %s e WHERE (hashint4(e.%s::integer) & 2147483647) %% 1000000 < %d;",
+		recindexname,source,userkey,(int) (fraction * 1000000.0 + 0.5));
+	recathon_utilityExecute(querystring.data);
+
+	resetStringInfo(&querystring);
+	appendStringInfo(&querystring,"UPDATE RecModelsCatalogue SET samplefraction = %f WHERE recommenderindexname = '%s';",
+		fraction,recindexname);
+	recathon_queryExecute(querystring.data);
+	CommandCounterIncrement();
+
+	pfree(querystring.data);
+	pfree(source);
+}
+
+/* ----------------------------------------------------------------
+ *		getRecEventSource
+ *
+ *		Returns the relation a recommender's models are built
+ *		from: the view of its sample, its window or its WHERE
+ *		condition if it has one, or else the events table
+ *		itself.
+ * ----------------------------------------------------------------
+ */
+char *
+getRecEventSource(char *recindexname, char *eventtable) {
+	char *fraction, *source;
+
+	fraction = catalogueString(recindexname,"samplefraction");
+	if (!fraction)
+		return getRecWindowSource(recindexname,eventtable);
+	pfree(fraction);
+
+	source = (char*) palloc((strlen(recindexname)+7)*sizeof(char));
+	sprintf(source,"%sSample",recindexname);
+	return source;
+}
+
+/* ----------------------------------------------------------------
+ *		getRecWindowSource
+ *
+ *		Returns the events a recommender covers, whether or
+ *		not it's sampled: the view of its window if it has
+ *		one, or else those that meet its WHERE condition.
+ * ----------------------------------------------------------------
+ */
+char *
+getRecWindowSource(char *recindexname, char *eventtable) {
+	char *timekey, *source;
+
+	timekey = catalogueString(recindexname,"timecolumn");
+	if (!timekey)
+		return getRecFilterSource(recindexname,eventtable);
+	pfree(timekey);
+
+	source = (char*) palloc((strlen(recindexname)+7)*sizeof(char));
+	sprintf(source,"%sWindow",recindexname);
+	return source;
+}
+
+/* ----------------------------------------------------------------
+ *		getRecFilterSource
+ *
+ *		Returns the events that meet a recommender's WHERE
+ *		condition: the view of them if it has one, or else
+ *		the events table itself.
+ * ----------------------------------------------------------------
+ */
+char *
+getRecFilterSource(char *recindexname, char *eventtable) {
+	char *filter, *source;
+
+	filter = catalogueString(recindexname,"eventfilter");
+	if (!filter)
+		return pstrdup(eventtable);
+	pfree(filter);
+
+	source = (char*) palloc((strlen(recindexname)+7)*sizeof(char));
+	sprintf(source,"%sFilter",recindexname);
+	return source;
+}
+
+/* ----------------------------------------------------------------
+ *		expireWindowEvents
+ *
+ *		Moves a recommender's window up to the present, and
+ *		deals with the events that have left it since the
+ *		last pass. An incremental recommender takes them
+ *		back out of its statistics and model, the way
+ *		applyItemCosDeltas puts new ones in, but negated; a
+ *		recommender that refreshes rows gets them added to
+ *		its deltas, so their rows are recomputed. Any other
+ *		just counts them towards its next rebuild. Returns
+ *		the number of events that expired.
+ * ----------------------------------------------------------------
+ */
+int
+expireWindowEvents(char *recindexname, char *eventtable, char *userkey,
+		char *itemkey, char *eventval, char *modelname, bool incremental,
+		bool partialrefresh) {
+	int numExpired;
+	char *timekey, *source, *filtersource, *querystring;
+
+	timekey = catalogueString(recindexname,"timecolumn");
+	if (!timekey)
+		return 0;
+	source = getRecEventSource(recindexname,eventtable);
+	querystring = (char*) palloc(4096*sizeof(char));
+
+	// The window only ever moves forward, so the expired events
+	// are the ones between its old start and its new one.
+	filtersource = getRecFilterSource(recindexname,eventtable);
+	sprintf(querystring,"CREATE TEMP TABLE recathon_expired AS SELECT e.%s, e.%s, e.%s FROM %s e, RecModelsCatalogue c WHERE c.recommenderindexname = '%s' AND e.%s >= c.windowstart AND e.%s < now() - c.timewindow;",
+		userkey,itemkey,eventval,filtersource,recindexname,timekey,timekey);
+	pfree(filtersource);
+	recathon_utilityExecute(querystring);
+	CommandCounterIncrement();
+	numExpired = count_rows("recathon_expired");
+
+	if (numExpired > 0 && incremental) {
+		// Every pair of an expired event with one still in the
+		// window comes out once, and every pair of two expired
+		// events comes out by half from each side, as in
+		// applyItemCosDeltas.
+		recathon_utilityExecute("CREATE TEMP TABLE recathon_pairs (item1 INTEGER NOT NULL, item2 INTEGER NOT NULL, dot DOUBLE PRECISION NOT NULL, corated INTEGER NOT NULL);");
+		recathon_utilityExecute("CREATE TEMP TABLE recathon_items (item INTEGER NOT NULL, sqnorm DOUBLE PRECISION NOT NULL);");
+
+		sprintf(querystring,"INSERT INTO recathon_pairs SELECT item1, item2, sum(dot), round(sum(corated))::integer FROM (SELECT least(d.%s, e.%s) AS item1, greatest(d.%s, e.%s) AS item2, -(d.%s::float8 * e.%s) AS dot, -1.0::float8 AS corated FROM recathon_expired d, %s e WHERE e.%s = d.%s AND e.%s <> d.%s UNION ALL SELECT least(d1.%s, d2.%s), greatest(d1.%s, d2.%s), -0.5 * d1.%s::float8 * d2.%s, -0.5::float8 FROM recathon_expired d1, recathon_expired d2 WHERE d1.%s = d2.%s AND d1.%s <> d2.%s) p GROUP BY item1, item2;",
+			itemkey,itemkey,itemkey,itemkey,eventval,eventval,
+			source,userkey,userkey,itemkey,itemkey,
+			itemkey,itemkey,itemkey,itemkey,eventval,eventval,
+			userkey,userkey,itemkey,itemkey);
+		recathon_queryExecute(querystring);
+		sprintf(querystring,"INSERT INTO recathon_items SELECT %s, -sum(%s::float8 * %s) FROM recathon_expired GROUP BY %s;",
+			itemkey,eventval,eventval,itemkey);
+		recathon_queryExecute(querystring);
+		CommandCounterIncrement();
+
+		applyItemCosChanges(recindexname,modelname,querystring);
+
+		recathon_utilityExecute("DROP TABLE recathon_pairs;");
+		recathon_utilityExecute("DROP TABLE recathon_items;");
+	} else if (numExpired > 0 && partialrefresh) {
+		sprintf(querystring,"INSERT INTO %sDeltas SELECT %s, %s, %s FROM recathon_expired;",
+			recindexname,userkey,itemkey,eventval);
+		recathon_queryExecute(querystring);
+	}
+
+	// An incremental model is already up to date; the others
+	// remember what's changed until they're rebuilt.
+	sprintf(querystring,"UPDATE RecModelsCatalogue SET windowstart = now() - timewindow, windowexpired = windowexpired + %d WHERE recommenderindexname = '%s';",
+		incremental ? 0 : numExpired,recindexname);
+	recathon_queryExecute(querystring);
+	CommandCounterIncrement();
+
+	recathon_utilityExecute("DROP TABLE recathon_expired;");
+
+	pfree(querystring);
+	pfree(source);
+	pfree(timekey);
+	return numExpired;
+}
+
+/* ----------------------------------------------------------------
+ *		dropEventWindow
+ *
+ *		Drops the views of a recommender's sample, its window
+ *		and its WHERE condition, if it has them. Each can be
+ *		a view of the next, so they go in that order.
+ * ----------------------------------------------------------------
+ */
+void
+dropEventWindow(char *recindexname) {
+	char *querystring;
+
+	querystring = (char*) palloc(1024*sizeof(char));
+	sprintf(querystring,"DROP VIEW IF EXISTS %sSample;",recindexname);
+	recathon_utilityExecute(querystring);
+	sprintf(querystring,"DROP VIEW IF EXISTS %sWindow;",recindexname);
+	recathon_utilityExecute(querystring);
+	sprintf(querystring,"DROP VIEW IF EXISTS %sFilter;",recindexname);
+	recathon_utilityExecute(querystring);
+	pfree(querystring);
+}
+
+/* ----------------------------------------------------------------
+ *		refreshSimilarityRows
+ *
+ *		Rebuilds just the rows of a similarity model that
+ *		involve an item (or a user, for the user-based
+ *		methods) with events in the Deltas table. Only its
+ *		own vector, average and norm have changed, so every
+ *		other pair keeps its similarity; we recompute the
+ *		changed ones against all the others and replace
+ *		them in the model, in place. Returns the number of
+ *		events used, or -1 if there are no deltas, or so
+ *		many rows have changed that a full rebuild is
+ *		better, in which case the model is left alone.
+ * ----------------------------------------------------------------
+ */
+int
+refreshSimilarityRows(char *recindexname, recMethod method, char *eventtable,
+		char *userkey, char *itemkey, char *eventval, char *modelname) {
+	int i, j, k, numVectors, numDirty, numEvents;
+	int *IDs, *dirtyIDs;
+	float *norms, *avgs = NULL;
+	bool *dirty;
+	bool itemside;
+	char *key, *otherkey, *col1, *col2;
+	char *querystring, *deltaname;
+	sim_vector *vectors;
+	sim_params params;
+	sim_builder builder;
+	model_writer writer;
+	// Query objects.
+	QueryDesc *queryDesc;
+	PlanState *planstate;
+	TupleTableSlot *slot;
+	MemoryContext recathoncontext;
+
+	itemside = (method == itemCosCF || method == itemPearCF ||
+		    method == itemJaccardCF);
+	key = itemside ? itemkey : userkey;
+	otherkey = itemside ? userkey : itemkey;
+	col1 = itemside ? "item1" : "user1";
+	col2 = itemside ? "item2" : "user2";
+
+	querystring = (char*) palloc(1024*sizeof(char));
+	deltaname = (char*) palloc(256*sizeof(char));
+	sprintf(deltaname,"%sDeltas",recindexname);
+	lockEventDeltas(deltaname);
+
+	// Work out which rows are dirty.
+	sprintf(querystring,"SELECT DISTINCT %s FROM %s ORDER BY %s;",
+		key,deltaname,key);
+	numDirty = 0;
+	dirtyIDs = NULL;
+	queryDesc = recathon_queryStart(querystring,&recathoncontext);
+	planstate = queryDesc->planstate;
+	for (;;) {
+		slot = ExecProcNode(planstate);
+		if (TupIsNull(slot)) break;
+		if (numDirty == 0)
+			dirtyIDs = (int*) palloc(64*sizeof(int));
+		else if (numDirty % 64 == 0)
+			dirtyIDs = (int*) repalloc(dirtyIDs, (numDirty+64)*sizeof(int));
+		dirtyIDs[numDirty++] = getTupleInt(slot,key);
+	}
+	recathon_queryEnd(queryDesc,recathoncontext);
+
+	if (numDirty == 0) {
+		PopActiveSnapshot();
+		pfree(deltaname);
+		pfree(querystring);
+		return -1;
+	}
+
+	// We need every row's vector to compare the dirty ones with.
+	getRecSimParams(recindexname, &params);
+	if (params.vectorStore)
+		vectors = loadStoredVectors(params.vectorStore, key, otherkey,
+			eventtable, eventval, &numVectors, &IDs, &numEvents);
+	else
+		vectors = collectSimVectors(key, otherkey, eventtable, eventval,
+			&numVectors, &IDs, &numEvents);
+
+	// Recomputing more than half of the rows is about as much
+	// work as the whole model, and leaves the table bloated.
+	if (numDirty > numVectors / 2) {
+		PopActiveSnapshot();
+		freeSimVectors(vectors, numVectors);
+		pfree(dirtyIDs);
+		pfree(IDs);
+		pfree(deltaname);
+		pfree(querystring);
+		return -1;
+	}
+
+	if (method == itemCosCF || method == userCosCF)
+		norms = vector_lengths(vectors, numVectors);
+	else if (method == itemJaccardCF)
+		norms = jaccard_info(vectors, numVectors);
+	else
+		pearson_info(vectors, numVectors, &avgs, &norms);
+
+	dirty = (bool*) palloc0(numVectors*sizeof(bool));
+	for (k = 0; k < numDirty; k++) {
+		i = binarySearch(IDs, dirtyIDs[k], 0, numVectors);
+		if (i >= 0)
+			dirty[i] = true;
+	}
+
+	// Out with the old rows...
+	sprintf(querystring,"DELETE FROM %s WHERE %s IN (SELECT %s FROM %s);",
+		modelname,col1,key,deltaname);
+	recathon_queryExecute(querystring);
+	sprintf(querystring,"DELETE FROM %s WHERE %s IN (SELECT %s FROM %s);",
+		modelname,col2,key,deltaname);
+	recathon_queryExecute(querystring);
+	CommandCounterIncrement();
+
+	// ... and in with the new. The model keeps each pair once,
+	// lower ID first, and a pair of dirty rows is written by the
+	// later of the two.
+	if (method == itemJaccardCF)
+		builder = simBuilderCreateJaccard(vectors, numVectors, norms, 0, 0);
+	else
+		builder = simBuilderCreate(vectors, numVectors, norms, avgs, 0, 0);
+	simBuilderSetPruning(builder, &params);
+	writer = modelWriterOpen(modelname);
+	for (i = 0; i < numVectors; i++) {
+		int numNeighbors;
+
+		if (!dirty[i]) continue;
+
+		numNeighbors = simBuilderFullRow(builder, i);
+		for (k = 0; k < numNeighbors; k++) {
+			j = builder->rowIndex[k];
+			if (dirty[j] && j < i) continue;
+			modelWriterInsert(writer, IDs[Min(i,j)], IDs[Max(i,j)],
+				builder->rowSim[k]);
+		}
+
+		CHECK_FOR_INTERRUPTS();
+	}
+	modelWriterClose(writer);
+	simBuilderFree(builder);
+
+	// The deltas we saw are done with. Any that arrived since
+	// our snapshot stay for the next rebuild.
+	sprintf(querystring,"DELETE FROM %s;",deltaname);
+	recathon_queryExecute(querystring);
+	CommandCounterIncrement();
+	PopActiveSnapshot();
+
+	freeSimVectors(vectors, numVectors);
+	pfree(dirty);
+	pfree(dirtyIDs);
+	pfree(IDs);
+	pfree(norms);
+	if (avgs)
+		pfree(avgs);
+	pfree(deltaname);
+	pfree(querystring);
+
+	return numEvents;
+}
+
+/* ----------------------------------------------------------------
+ *		foldInSimilarityItems
+ *
+ *		Adds rows to an item-based similarity model for the
+ *		items that have events but aren't in it yet, between
+ *		full rebuilds. A new item's vector is compared with
+ *		every other item's, as refreshSimilarityRows does
+ *		for a dirty row, and its pairs are inserted into the
+ *		model in place; the rows already there are left as
+ *		they are, new events and all, until the next rebuild.
+ *		An item with no neighbors gets no rows, so it's looked
+ *		at again on the next pass. Returns the number of
+ *		items folded in, or 0 if there were none, or so many
+ *		that a full rebuild is better.
+ * ----------------------------------------------------------------
+ */
+int
+foldInSimilarityItems(char *recindexname, recMethod method, char *eventtable,
+		char *userkey, char *itemkey, char *eventval, char *modelname) {
+	int i, j, k, numVectors, numEvents, numKnown, maxKnown, numNew;
+	int *IDs, *knownIDs;
+	float *norms, *avgs = NULL;
+	bool *isNew;
+	char *querystring;
+	sim_vector *vectors;
+	sim_params params;
+	sim_builder builder;
+	model_writer writer;
+	// Query objects.
+	QueryDesc *queryDesc;
+	PlanState *planstate;
+	TupleTableSlot *slot;
+	MemoryContext recathoncontext;
+
+	// The items the model already has rows for.
+	querystring = (char*) palloc(1024*sizeof(char));
+	sprintf(querystring,"SELECT item1 AS id FROM %s UNION SELECT item2 FROM %s;",
+		modelname,modelname);
+	numKnown = 0;
+	maxKnown = 1024;
+	knownIDs = (int*) palloc(maxKnown*sizeof(int));
+	queryDesc = recathon_queryStart(querystring,&recathoncontext);
+	planstate = queryDesc->planstate;
+	for (;;) {
+		slot = ExecProcNode(planstate);
+		if (TupIsNull(slot)) break;
+		if (numKnown >= maxKnown) {
+			maxKnown *= 2;
+			knownIDs = (int*) repalloc(knownIDs, maxKnown*sizeof(int));
+		}
+		knownIDs[numKnown++] = getTupleInt(slot,"id");
+	}
+	recathon_queryEnd(queryDesc,recathoncontext);
+	pfree(querystring);
+	qsort(knownIDs, numKnown, sizeof(int), intCompare);
+
+	getRecSimParams(recindexname, &params);
+	if (params.vectorStore)
+		vectors = loadStoredVectors(params.vectorStore, itemkey, userkey,
+			eventtable, eventval, &numVectors, &IDs, &numEvents);
+	else
+		vectors = collectSimVectors(itemkey, userkey, eventtable, eventval,
+			&numVectors, &IDs, &numEvents);
+
+	isNew = (bool*) palloc0(Max(numVectors,1)*sizeof(bool));
+	numNew = 0;
+	for (i = 0; i < numVectors; i++) {
+		if (binarySearch(knownIDs, IDs[i], 0, numKnown) < 0) {
+			isNew[i] = true;
+			numNew++;
+		}
+	}
+	pfree(knownIDs);
+
+	// An empty model, or one missing half its items, might as
+	// well wait for the rebuild it's due.
+	if (numNew == 0 || numNew > numVectors / 2) {
+		freeSimVectors(vectors, numVectors);
+		pfree(isNew);
+		pfree(IDs);
+		return 0;
+	}
+
+	if (method == itemCosCF)
+		norms = vector_lengths(vectors, numVectors);
+	else if (method == itemJaccardCF)
+		norms = jaccard_info(vectors, numVectors);
+	else
+		pearson_info(vectors, numVectors, &avgs, &norms);
+
+	// Each pair is kept once, lower ID first, and a pair of new
+	// items is written by the later of the two.
+	if (method == itemJaccardCF)
+		builder = simBuilderCreateJaccard(vectors, numVectors, norms, 0, 0);
+	else
+		builder = simBuilderCreate(vectors, numVectors, norms, avgs, 0, 0);
+	simBuilderSetPruning(builder, &params);
+	writer = modelWriterOpen(modelname);
+	for (i = 0; i < numVectors; i++) {
+		int numNeighbors;
+
+		if (!isNew[i]) continue;
+
+		numNeighbors = simBuilderFullRow(builder, i);
+		for (k = 0; k < numNeighbors; k++) {
+			j = builder->rowIndex[k];
+			if (isNew[j] && j < i) continue;
+			modelWriterInsert(writer, IDs[Min(i,j)], IDs[Max(i,j)],
+				builder->rowSim[k]);
+		}
+
+		CHECK_FOR_INTERRUPTS();
+	}
+	modelWriterClose(writer);
+	simBuilderFree(builder);
+	CommandCounterIncrement();
+
+	freeSimVectors(vectors, numVectors);
+	pfree(isNew);
+	pfree(IDs);
+	pfree(norms);
+	if (avgs)
+		pfree(avgs);
+
+	return numNew;
+}
+
+/* ----------------------------------------------------------------
+ *		dropEventDeltas
+ *
+ *		Removes a recommender's trigger and Deltas table,
+ *		and an incremental recommender's statistics, if it
+ *		has them.
+ * ----------------------------------------------------------------
+ */
+void
+dropEventDeltas(char *recindexname) {
+	char *eventtable, *querystring;
+	List *partitions;
+	ListCell *lc;
+
+	getRecInfo(recindexname, &eventtable, NULL, NULL, NULL, NULL, NULL);
+
+	querystring = (char*) palloc(1024*sizeof(char));
+	sprintf(querystring,"DROP TRIGGER IF EXISTS %sDeltas ON %s;",
+		recindexname,eventtable);
+	recathon_utilityExecute(querystring);
+	partitions = eventPartitions(RelnameGetRelid(eventtable));
+	foreach(lc, partitions) {
+		sprintf(querystring,"DROP TRIGGER IF EXISTS %sDeltas ON %s;",
+			recindexname,(char*) lfirst(lc));
+		recathon_utilityExecute(querystring);
+	}
+	list_free_deep(partitions);
+	sprintf(querystring,"DROP TABLE IF EXISTS %sDeltas;",recindexname);
+	recathon_utilityExecute(querystring);
+	sprintf(querystring,"DROP TABLE IF EXISTS %sDots;",recindexname);
+	recathon_utilityExecute(querystring);
+	sprintf(querystring,"DROP TABLE IF EXISTS %sNorms;",recindexname);
+	recathon_utilityExecute(querystring);
+
+	pfree(querystring);
+	pfree(eventtable);
+}
+
+/* ----------------------------------------------------------------
+ *		createVectorStore
+ *
+ *		Sets up a recommender's vector store: a Vectors table
+ *		holding the rating vectors its model is built from,
+ *		packed, and a VectorDeltas table that an AFTER INSERT
+ *		trigger on the events table, and on each partition,
+ *		copies every new event into. The store starts out
+ *		empty, and the first build fills it.
+ * ----------------------------------------------------------------
+ */
+void
+createVectorStore(char *recindexname, char *eventtable, char *userkey,
+		char *itemkey, char *eventval) {
+	char *querystring, *storename;
+	List *partitions;
+	ListCell *lc;
+
+	querystring = (char*) palloc(1024*sizeof(char));
+	sprintf(querystring,"CREATE TABLE %sVectors (id INTEGER NOT NULL, vector BYTEA NOT NULL);",
+		recindexname);
+	recathon_utilityExecute(querystring);
+	sprintf(querystring,"CREATE TABLE %sVectorDeltas AS SELECT %s, %s, %s FROM %s WITH NO DATA;",
+		recindexname,userkey,itemkey,eventval,eventtable);
+	recathon_utilityExecute(querystring);
+
+	// The trigger and its table are named after the store the
+	// same way a Deltas table is after its recommender.
+	storename = (char*) palloc((strlen(recindexname)+7)*sizeof(char));
+	sprintf(storename,"%sVector",recindexname);
+	createDeltaTrigger(storename, eventtable, userkey, itemkey, eventval,
+		querystring);
+	partitions = eventPartitions(RelnameGetRelid(eventtable));
+	foreach(lc, partitions)
+		createDeltaTrigger(storename, (char*) lfirst(lc),
+			userkey, itemkey, eventval, querystring);
+	list_free_deep(partitions);
+
+	pfree(storename);
+	pfree(querystring);
+}
+
+/*
+ * Packs a sorted rating vector for the vector store: its length,
+ * then its events, then its IDs as varints, the first zigzagged and
+ * each of the others as the gap from the one before.
+ */
+static bytea*
+packSimVector(sim_vector vec) {
+	int k;
+	char *p;
+	bytea *packed;
+
+	packed = (bytea*) palloc(VARHDRSZ + sizeof(int32) +
+		vec->length * (sizeof(float) + 5));
+	p = VARDATA(packed);
+	memcpy(p, &vec->length, sizeof(int32));
+	p += sizeof(int32);
+	memcpy(p, vec->event, vec->length*sizeof(float));
+	p += vec->length*sizeof(float);
+
+	for (k = 0; k < vec->length; k++) {
+		uint32 value;
+
+		if (k == 0)
+			value = ((uint32) vec->id[0] << 1) ^ (uint32) (vec->id[0] >> 31);
+		else
+			value = (uint32) vec->id[k] - (uint32) vec->id[k-1];
+		while (value >= 0x80) {
+			*p++ = (char) ((value & 0x7F) | 0x80);
+			value >>= 7;
+		}
+		*p++ = (char) value;
+	}
+
+	SET_VARSIZE(packed, p - (char*) packed);
+	return packed;
+}
+
+/*
+ * The number of events in a packed rating vector.
+ */
+static int
+packedVectorLength(bytea *packed) {
+	int32 length;
+
+	memcpy(&length, VARDATA(packed), sizeof(int32));
+	return length;
+}
+
+/*
+ * Unpacks a rating vector from the vector store into arrays with
+ * room for its events.
+ */
+static void
+unpackSimVector(bytea *packed, int *ids, float *events) {
+	int k, length;
+	char *p;
+
+	length = packedVectorLength(packed);
+	p = VARDATA(packed) + sizeof(int32);
+	memcpy(events, p, length*sizeof(float));
+	p += length*sizeof(float);
+
+	for (k = 0; k < length; k++) {
+		uint32 value = 0;
+		int shift = 0;
+
+		for (;;) {
+			unsigned char c = (unsigned char) *p++;
+
+			value |= (uint32) (c & 0x7F) << shift;
+			if (!(c & 0x80)) break;
+			shift += 7;
+		}
+		if (k == 0)
+			ids[0] = (int) ((value >> 1) ^ (~(value & 1) + 1));
+		else
+			ids[k] = (int) ((uint32) ids[k-1] + value);
+	}
+}
+
+/* ----------------------------------------------------------------
+ *		loadStoredVectors
+ *
+ *		Like collectSimVectors, but for a recommender with a
+ *		vector store, reads the packed vectors and the events
+ *		added since they were stored, instead of the events
+ *		table. The new events are then kept as one more
+ *		segment of each vector they belong to, so the store
+ *		is only ever appended to, and once there are twice
+ *		as many segments as vectors, it's rewritten with one
+ *		each. The trigger only sees inserts, so if the store
+ *		doesn't hold as many events as the table, because
+ *		some were deleted or it's just been created, we read
+ *		the table and store every vector again. We do the same
+ *		whenever repeated events are combined, since then we
+ *		can't tell.
+ * ----------------------------------------------------------------
+ */
+sim_vector*
+loadStoredVectors(char *recindexname, char *key, char *otherkey,
+		char *eventtable, char *eventval, int *totalNum, int **IDlist,
+		int *totalEvents) {
+	int i, numEvents, maxEvents, numStored, numSegments;
+	int *keys, *others;
+	float *values;
+	bool rewrite;
+	char *querystring, *deltaname, *storename;
+	sim_vector *vectors;
+	model_writer writer;
+	// Objects for querying.
+	QueryDesc *queryDesc;
+	PlanState *planstate;
+	TupleTableSlot *slot;
+	MemoryContext recathoncontext;
+	tuple_column idcol, vectorcol, keycol, othercol, eventcol;
+
+	querystring = (char*) palloc(1024*sizeof(char));
+	deltaname = (char*) palloc((strlen(recindexname)+13)*sizeof(char));
+	sprintf(deltaname,"%sVectorDeltas",recindexname);
+	storename = (char*) palloc((strlen(recindexname)+8)*sizeof(char));
+	sprintf(storename,"%sVectors",recindexname);
+	lockEventDeltas(deltaname);
+
+	maxEvents = 1024;
+	keys = (int*) palloc(maxEvents*sizeof(int));
+	others = (int*) palloc(maxEvents*sizeof(int));
+	values = (float*) palloc(maxEvents*sizeof(float));
+
+	// First the stored segments.
+	numEvents = 0;
+	numSegments = 0;
+	sprintf(querystring,"SELECT id, vector FROM %s;",storename);
+	queryDesc = recathon_queryStart(querystring,&recathoncontext);
+	planstate = queryDesc->planstate;
+	bindColumn(&idcol, "id");
+	bindColumn(&vectorcol, "vector");
+	for (;;) {
+		int id, length;
+		Datum value;
+		bytea *packed;
+
+		slot = ExecProcNode(planstate);
+		if (TupIsNull(slot)) break;
+		if (!columnDatum(slot, &vectorcol, &value)) continue;
+
+		id = columnInt(slot, &idcol);
+		packed = DatumGetByteaP(value);
+		length = packedVectorLength(packed);
+		if (numEvents + length > maxEvents) {
+			while (numEvents + length > maxEvents)
+				maxEvents *= 2;
+			keys = (int*) repalloc(keys, maxEvents*sizeof(int));
+			others = (int*) repalloc(others, maxEvents*sizeof(int));
+			values = (float*) repalloc(values, maxEvents*sizeof(float));
+		}
+		unpackSimVector(packed, others + numEvents, values + numEvents);
+		for (i = 0; i < length; i++)
+			keys[numEvents + i] = id;
+		numEvents += length;
+		numSegments++;
+
+		if ((Pointer) packed != DatumGetPointer(value))
+			pfree(packed);
+	}
+	recathon_queryEnd(queryDesc,recathoncontext);
+	numStored = numEvents;
+
+	// Then the events added since.
+	sprintf(querystring,"SELECT %s,%s,%s FROM %s;",
+		key,otherkey,eventval,deltaname);
+	queryDesc = recathon_queryStart(querystring,&recathoncontext);
+	planstate = queryDesc->planstate;
+	bindColumn(&keycol, key);
+	bindColumn(&othercol, otherkey);
+	bindColumn(&eventcol, eventval);
+	for (;;) {
+		slot = ExecProcNode(planstate);
+		if (TupIsNull(slot)) break;
+
+		if (numEvents >= maxEvents) {
+			maxEvents *= 2;
+			keys = (int*) repalloc(keys, maxEvents*sizeof(int));
+			others = (int*) repalloc(others, maxEvents*sizeof(int));
+			values = (float*) repalloc(values, maxEvents*sizeof(float));
+		}
+		keys[numEvents] = columnInt(slot,&keycol);
+		others[numEvents] = columnInt(slot,&othercol);
+		values[numEvents] = columnFloat(slot,&eventcol);
+		numEvents++;
+	}
+	recathon_queryEnd(queryDesc,recathoncontext);
+
+	if (recathon_duplicate_events != RECATHON_DUPLICATES_KEEP ||
+	    numEvents != countEvents(eventtable)) {
+		elog(DEBUG1, "vector store %s is out of step with %s, reading the table",
+			storename, eventtable);
+		vectors = collectSimVectors(key, otherkey, eventtable, eventval,
+			totalNum, IDlist, &numEvents);
+		rewrite = true;
+	} else {
+		vectors = groupSimVectors(numEvents, keys, others, values,
+			totalNum, IDlist);
+		rewrite = (numSegments > 2 * (*totalNum));
+
+		// The new events go in as segments of their own.
+		if (!rewrite && numEvents > numStored) {
+			int numNew;
+			int *newIDs;
+			sim_vector *newVectors;
+
+			newVectors = groupSimVectors(numEvents - numStored,
+				keys + numStored, others + numStored, values + numStored,
+				&numNew, &newIDs);
+			writer = modelWriterOpen(storename);
+			for (i = 0; i < numNew; i++)
+				modelWriterInsertVector(writer, newIDs[i], newVectors[i]);
+			modelWriterClose(writer);
+			freeSimVectors(newVectors, numNew);
+			pfree(newIDs);
+		}
+	}
+	pfree(keys);
+	pfree(others);
+	pfree(values);
+
+	if (rewrite) {
+		sprintf(querystring,"DELETE FROM %s;",storename);
+		recathon_queryExecute(querystring);
+		CommandCounterIncrement();
+		writer = modelWriterOpen(storename);
+		for (i = 0; i < (*totalNum); i++)
+			if (vectors[i] && vectors[i]->length > 0)
+				modelWriterInsertVector(writer, (*IDlist)[i], vectors[i]);
+		modelWriterClose(writer);
+	}
+
+	// Every delta our snapshot sees is in the store now.
+	sprintf(querystring,"DELETE FROM %s;",deltaname);
+	recathon_queryExecute(querystring);
+	CommandCounterIncrement();
+	PopActiveSnapshot();
+
+	pfree(querystring);
+	pfree(deltaname);
+	pfree(storename);
+
+	if (totalEvents)
+		(*totalEvents) = numEvents;
+
+	return vectors;
+}
+
+/* ----------------------------------------------------------------
+ *		dropVectorStore
+ *
+ *		Removes a recommender's vector store, its trigger
+ *		and its VectorDeltas table.
+ * ----------------------------------------------------------------
+ */
+void
+dropVectorStore(char *recindexname) {
+	char *eventtable, *querystring;
+	List *partitions;
+	ListCell *lc;
+
+	getRecInfo(recindexname, &eventtable, NULL, NULL, NULL, NULL, NULL);
+
+	querystring = (char*) palloc(1024*sizeof(char));
+	sprintf(querystring,"DROP TRIGGER IF EXISTS %sVectorDeltas ON %s;",
+		recindexname,eventtable);
+	recathon_utilityExecute(querystring);
+	partitions = eventPartitions(RelnameGetRelid(eventtable));
+	foreach(lc, partitions) {
+		sprintf(querystring,"DROP TRIGGER IF EXISTS %sVectorDeltas ON %s;",
+			recindexname,(char*) lfirst(lc));
+		recathon_utilityExecute(querystring);
+	}
+	list_free_deep(partitions);
+	sprintf(querystring,"DROP TABLE IF EXISTS %sVectorDeltas;",recindexname);
+	recathon_utilityExecute(querystring);
+	sprintf(querystring,"DROP TABLE IF EXISTS %sVectors;",recindexname);
+	recathon_utilityExecute(querystring);
+
+	pfree(querystring);
+	pfree(eventtable);
+}
+
+/* ----------------------------------------------------------------
+ *		pearson_info
+ *
+ *		Calculates the average event of each of a set of
+ *		rating vectors, as well as another data item useful
+ *		for Pearson correlation, which I'm just calling a
+ *		Pearson because I'm not sure it has a name. It can
+ *		be pre-calculated, so we will.
+ * ----------------------------------------------------------------
+ */
+void
+pearson_info(sim_vector *vectors, int numVectors, float **avgList,
+		float **pearsonList) {
+	int i, k;
+	float *avgs, *pearsons;
+
+	avgs = (float*) palloc0(Max(numVectors,1)*sizeof(float));
+	pearsons = (float*) palloc0(Max(numVectors,1)*sizeof(float));
+
+	for (i = 0; i < numVectors; i++) {
+		sim_vector vec = vectors[i];
+
+		if (!vec || vec->length == 0) continue;
+
+		for (k = 0; k < vec->length; k++)
+			avgs[i] += vec->event[k];
+		avgs[i] /= ((float)vec->length);
+
+		for (k = 0; k < vec->length; k++) {
+			float difference = vec->event[k] - avgs[i];
+
+			pearsons[i] += difference*difference;
+		}
+		pearsons[i] = sqrtf(pearsons[i]);
+	}
+
+	// Return data.
+	(*avgList) = avgs;
+	(*pearsonList) = pearsons;
+}
+
+/* ----------------------------------------------------------------
+ *		pearsonDotProduct
+ *
+ *		Function to compare two items and compute a version
+ *		of their dot product, for Pearson similarity.
+ *		The lists are necessarily sorted, so we can compare
+ *		in linear time.
+ * ----------------------------------------------------------------
+ */
+float
+pearsonDotProduct(sim_vector item1, sim_vector item2, float avg1, float avg2) {
+	return sparseDot(item1, item2, avg1, avg2);
+}
+
+/* ----------------------------------------------------------------
+ *		pearsonSimilarity
+ *
+ *		Function to compare two items and compute their
+ *		Pearson similarity.
+ * ----------------------------------------------------------------
+ */
+float
+pearsonSimilarity(sim_vector item1, sim_vector item2, float avg1, float avg2,
+			float pearson1, float pearson2) {
+	float numerator;
+	float denominator;
+
+	// Short-circuit check. If one of the items has no events,
+	// no point checking similarity. This also avoids a possible
+	// divide-by-zero error.
+	denominator = pearson1 * pearson2;
+	if (denominator == 0.0) return 0.0;
+
+	numerator = pearsonDotProduct(item1,item2,avg1,avg2);
+	if (numerator == 0.0) return 0.0;
+	else return numerator / denominator;
+}
+
+/* ----------------------------------------------------------------
+ *		distinctVectorIDs
+ *
+ *		Gathers the IDs held in a set of rating vectors into
+ *		one sorted list, without duplicates. Returns the
+ *		number of distinct IDs.
+ * ----------------------------------------------------------------
+ */
+int
+distinctVectorIDs(sim_vector *vectors, int numVectors, int **ret_IDs) {
+	int i, k, numIDs, totalEntries;
+	int *allIDs;
+
+	totalEntries = 0;
+	for (i = 0; i < numVectors; i++)
+		if (vectors[i])
+			totalEntries += vectors[i]->length;
+
+	allIDs = (int*) palloc((totalEntries+1)*sizeof(int));
+	totalEntries = 0;
+	for (i = 0; i < numVectors; i++) {
+		if (!vectors[i]) continue;
+		for (k = 0; k < vectors[i]->length; k++)
+			allIDs[totalEntries++] = vectors[i]->id[k];
+	}
+	qsort(allIDs, totalEntries, sizeof(int), intCompare);
+
+	numIDs = 0;
+	for (k = 0; k < totalEntries; k++) {
+		if (numIDs > 0 && allIDs[numIDs-1] == allIDs[k])
+			continue;
+		allIDs[numIDs++] = allIDs[k];
+	}
+
+	(*ret_IDs) = allIDs;
+	return numIDs;
+}
+
+/* A row's key in one LSH band, for sorting the rows into buckets. */
+typedef struct lsh_entry {
+	uint32		key;
+	int		row;
+} lsh_entry;
+
+/* Comparison function for sorting LSH entries by key, then row. */
+static int
+lshEntryCompare(const void *a, const void *b) {
+	const lsh_entry *entry1 = (const lsh_entry*) a;
+	const lsh_entry *entry2 = (const lsh_entry*) b;
+
+	if (entry1->key != entry2->key)
+		return (entry1->key < entry2->key) ? -1 : 1;
+	return entry1->row - entry2->row;
+}
+
+/* ----------------------------------------------------------------
+ *		lshBandKey
+ *
+ *		Hashes row i into one band of an LSH signature, using
+ *		one hash function per seed. For binary events we use
+ *		MinHash, where each hash is the smallest hash of any ID
+ *		in the row, and rows collide with probability equal to
+ *		their Jaccard similarity. Otherwise each hash is the
+ *		side of a random hyperplane the row's events fall on,
+ *		less the average for Pearson, so rows collide more the
+ *		smaller the angle between them.
+ * ----------------------------------------------------------------
+ */
+static uint32
+lshBandKey(sim_builder builder, int i, uint32 *seeds, int bandRows, bool binary) {
+	int r, k;
+	uint32 key = 2166136261U;
+	float avg;
+	sim_vector vec;
+
+	vec = builder->vectors[i];
+	avg = builder->avgs ? builder->avgs[i] : 0.0;
+	for (r = 0; r < bandRows; r++) {
+		uint32 value;
+
+		if (binary) {
+			value = 0xFFFFFFFF;
+			for (k = 0; k < vec->length; k++) {
+				uint32 h = DatumGetUInt32(hash_uint32((uint32) vec->id[k] ^ seeds[r]));
+
+				if (h < value)
+					value = h;
+			}
+		} else {
+			float dot = 0.0;
+
+			for (k = 0; k < vec->length; k++) {
+				uint32 h = DatumGetUInt32(hash_uint32((uint32) vec->id[k] ^ seeds[r]));
+
+				if (h & 1)
+					dot += vec->event[k] - avg;
+				else
+					dot -= vec->event[k] - avg;
+			}
+			value = (dot >= 0);
+		}
+
+		// Fold the hashes together, FNV style.
+		key = (key ^ value) * 16777619U;
+	}
+
+	return key;
+}
+
+/* ----------------------------------------------------------------
+ *		simBuilderHash
+ *
+ *		Sets a builder up for an approximate build, by hashing
+ *		every row into each of numBands bands and grouping the
+ *		rows with the same key in a band into a bucket. Only
+ *		rows that share a bucket in some band get compared.
+ *		More bands find more of the true neighbors; more rows
+ *		per band make the buckets more selective.
+ * ----------------------------------------------------------------
+ */
+static void
+simBuilderHash(sim_builder builder, int numBands, int bandRows) {
+	int i, b, k, r, n, numEntries;
+	bool binary, haveEvent;
+	float firstEvent;
+	uint32 *seeds;
+	lsh_entry *entries;
+
+	n = builder->numVectors;
+
+	// Rows of events that are all the same, like clicks or
+	// purchases, are only told apart by which IDs they have.
+	binary = true;
+	haveEvent = false;
+	firstEvent = 0.0;
+	for (i = 0; i < n && binary; i++) {
+		if (!builder->vectors[i]) continue;
+		for (k = 0; k < builder->vectors[i]->length; k++) {
+			if (!haveEvent) {
+				firstEvent = builder->vectors[i]->event[k];
+				haveEvent = true;
+			} else if (builder->vectors[i]->event[k] != firstEvent) {
+				binary = false;
+				break;
+			}
+		}
+	}
+
+	builder->lshBands = numBands;
+	builder->lshBucketOf = (int**) palloc(numBands*sizeof(int*));
+	builder->lshBucketStart = (int**) palloc(numBands*sizeof(int*));
+	builder->lshMembers = (int**) palloc(numBands*sizeof(int*));
+	seeds = (uint32*) palloc(bandRows*sizeof(uint32));
+	entries = (lsh_entry*) palloc((n+1)*sizeof(lsh_entry));
+
+	for (b = 0; b < numBands; b++) {
+		int start, end, numBuckets, numMembers;
+		int *bucketOf, *bucketStart, *members;
+
+		for (r = 0; r < bandRows; r++)
+			seeds[r] = DatumGetUInt32(hash_uint32((uint32) (b*bandRows + r + 1)));
+
+		bucketOf = (int*) palloc((n+1)*sizeof(int));
+		numEntries = 0;
+		for (i = 0; i < n; i++) {
+			bucketOf[i] = -1;
+			if (!builder->vectors[i] || builder->vectors[i]->length == 0)
+				continue;
+			entries[numEntries].key = lshBandKey(builder, i, seeds, bandRows, binary);
+			entries[numEntries].row = i;
+			numEntries++;
+		}
+		qsort(entries, numEntries, sizeof(lsh_entry), lshEntryCompare);
+
+		// Rows with the same key make up a bucket. A bucket of one
+		// doesn't give us anything to compare, and one that's too
+		// big isn't selective, so we don't keep either.
+		bucketStart = (int*) palloc((numEntries/2 + 2)*sizeof(int));
+		members = (int*) palloc((numEntries+1)*sizeof(int));
+		numBuckets = 0;
+		numMembers = 0;
+		for (start = 0; start < numEntries; start = end) {
+			end = start + 1;
+			while (end < numEntries && entries[end].key == entries[start].key)
+				end++;
+			if (end - start < 2 || end - start > RECATHON_LSH_MAX_BUCKET)
+				continue;
+
+			bucketStart[numBuckets] = numMembers;
+			for (k = start; k < end; k++) {
+				members[numMembers++] = entries[k].row;
+				bucketOf[entries[k].row] = numBuckets;
+			}
+			numBuckets++;
+		}
+		bucketStart[numBuckets] = numMembers;
+
+		builder->lshBucketOf[b] = bucketOf;
+		builder->lshBucketStart[b] = bucketStart;
+		builder->lshMembers[b] = members;
+
+		CHECK_FOR_INTERRUPTS();
+	}
+
+	pfree(entries);
+	pfree(seeds);
+}
+
+/* ----------------------------------------------------------------
+ *		simBuilderCluster
+ *
+ *		Sets a builder up for a clustered build. Each row's
+ *		events, less the average for Pearson, are sketched
+ *		into RECATHON_CLUSTER_DIMS dimensions by hashing
+ *		their IDs to a dimension and a sign, and normalized,
+ *		so that rows pointing the same way have sketches
+ *		close together. The sketches are clustered with
+ *		k-means as createClusterModel does, on an evenly
+ *		spaced sample, and every row then keeps its
+ *		numProbes nearest clusters. Only rows that fall in
+ *		one of a row's clusters get compared with it.
+ * ----------------------------------------------------------------
+ */
+static void
+simBuilderCluster(sim_builder builder, int numClusters, int numProbes) {
+	int i, c, k, p, iter, n, numRows, numSample;
+	int *rows, *sample, *assign, *counts, *fill;
+	float *sketches, *centroids, *norms, *dists;
+
+	n = builder->numVectors;
+
+	// Only rows with events have a direction to cluster by.
+	rows = (int*) palloc((n+1)*sizeof(int));
+	numRows = 0;
+	for (i = 0; i < n; i++)
+		if (builder->vectors[i] && builder->vectors[i]->length > 0)
+			rows[numRows++] = i;
+	if (numClusters > numRows)
+		numClusters = numRows;
+	if (numProbes > numClusters)
+		numProbes = numClusters;
+
+	builder->numClusters = numClusters;
+	builder->clusterProbes = numProbes;
+	builder->clusterOf = (int*) palloc(((Size) n * Max(numProbes, 1) + 1)*sizeof(int));
+	for (i = 0; i < n * numProbes; i++)
+		builder->clusterOf[i] = -1;
+	builder->clusterStart = (int*) palloc0((numClusters+1)*sizeof(int));
+	builder->clusterMembers = (int*) palloc((numRows+1)*sizeof(int));
+	if (numClusters < 1) {
+		pfree(rows);
+		return;
+	}
+
+	sketches = (float*) palloc0((Size) numRows * RECATHON_CLUSTER_DIMS * sizeof(float));
+	for (i = 0; i < numRows; i++) {
+		sim_vector vec = builder->vectors[rows[i]];
+		float *sketch = sketches + (Size) i * RECATHON_CLUSTER_DIMS;
+		float avg = builder->avgs ? builder->avgs[rows[i]] : 0.0;
+		float length;
+
+		for (k = 0; k < vec->length; k++) {
+			uint32 h = DatumGetUInt32(hash_uint32((uint32) vec->id[k]));
+
+			if (h & 0x80000000)
+				sketch[h % RECATHON_CLUSTER_DIMS] += vec->event[k] - avg;
+			else
+				sketch[h % RECATHON_CLUSTER_DIMS] -= vec->event[k] - avg;
+		}
+		length = sqrtf(factorDot(sketch, sketch, RECATHON_CLUSTER_DIMS));
+		if (length > 0)
+			for (k = 0; k < RECATHON_CLUSTER_DIMS; k++)
+				sketch[k] /= length;
+	}
+
+	// The sample, and the starting centroids, are evenly spaced
+	// through the rows.
+	numSample = Min(numRows, numClusters * RECATHON_ANN_SAMPLE);
+	sample = (int*) palloc(numSample*sizeof(int));
+	for (i = 0; i < numSample; i++)
+		sample[i] = (int) ((int64) i * numRows / numSample);
+
+	centroids = (float*) palloc((Size) numClusters * RECATHON_CLUSTER_DIMS * sizeof(float));
+	norms = (float*) palloc(numClusters*sizeof(float));
+	counts = (int*) palloc(numClusters*sizeof(int));
+	assign = (int*) palloc(numRows*sizeof(int));
+	dists = (float*) palloc(numProbes*sizeof(float));
+	for (c = 0; c < numClusters; c++)
+		memcpy(centroids + (Size) c * RECATHON_CLUSTER_DIMS,
+			sketches + (Size) sample[(int) ((int64) c * numSample / numClusters)] * RECATHON_CLUSTER_DIMS,
+			RECATHON_CLUSTER_DIMS*sizeof(float));
+
+	for (iter = 0; iter <= RECATHON_ANN_ITERATIONS; iter++) {
+		bool last = (iter == RECATHON_ANN_ITERATIONS);
+		int m = last ? numRows : numSample;
+
+		for (c = 0; c < numClusters; c++) {
+			float *cvec = centroids + (Size) c * RECATHON_CLUSTER_DIMS;
+
+			norms[c] = factorDot(cvec, cvec, RECATHON_CLUSTER_DIMS);
+		}
+
+		// Assign each point to its nearest centroid, by
+		// |c|^2 - 2 x.c. On the last pass, every row keeps
+		// its nearest few, in order.
+		for (i = 0; i < m; i++) {
+			int row = last ? i : sample[i];
+			float *vec = sketches + (Size) row * RECATHON_CLUSTER_DIMS;
+			int *probes = builder->clusterOf + (Size) rows[row] * numProbes;
+			float best = 0.0;
+
+			assign[row] = 0;
+			for (c = 0; c < numClusters; c++) {
+				float dist = norms[c] - 2 * factorDot(vec,
+					centroids + (Size) c * RECATHON_CLUSTER_DIMS, RECATHON_CLUSTER_DIMS);
+
+				if (c == 0 || dist < best) {
+					best = dist;
+					assign[row] = c;
+				}
+				if (!last)
+					continue;
+
+				// Insert it among the nearest, if it's near enough.
+				for (p = Min(c, numProbes); p > 0 && dists[p-1] > dist; p--) {
+					if (p < numProbes) {
+						dists[p] = dists[p-1];
+						probes[p] = probes[p-1];
+					}
+				}
+				if (p < numProbes) {
+					dists[p] = dist;
+					probes[p] = c;
+				}
+			}
+
+			if ((i & 1023) == 0)
+				CHECK_FOR_INTERRUPTS();
+		}
+		if (last)
+			break;
+
+		// Move each centroid to the mean of its points. An
+		// empty cluster keeps the centroid it had.
+		memset(counts, 0, numClusters*sizeof(int));
+		for (i = 0; i < numSample; i++)
+			counts[assign[sample[i]]]++;
+		for (c = 0; c < numClusters; c++) {
+			if (counts[c] > 0)
+				memset(centroids + (Size) c * RECATHON_CLUSTER_DIMS, 0,
+					RECATHON_CLUSTER_DIMS*sizeof(float));
+		}
+		for (i = 0; i < numSample; i++) {
+			c = assign[sample[i]];
+			factorAxpy(1.0 / counts[c],
+				sketches + (Size) sample[i] * RECATHON_CLUSTER_DIMS,
+				centroids + (Size) c * RECATHON_CLUSTER_DIMS, RECATHON_CLUSTER_DIMS);
+		}
+	}
+
+	// Group the rows by the cluster they're nearest, in row order.
+	for (i = 0; i < numRows; i++)
+		builder->clusterStart[assign[i]+1]++;
+	for (c = 0; c < numClusters; c++)
+		builder->clusterStart[c+1] += builder->clusterStart[c];
+	fill = (int*) palloc(numClusters*sizeof(int));
+	memcpy(fill, builder->clusterStart, numClusters*sizeof(int));
+	for (i = 0; i < numRows; i++)
+		builder->clusterMembers[fill[assign[i]]++] = rows[i];
+
+	pfree(fill);
+	pfree(dists);
+	pfree(assign);
+	pfree(counts);
+	pfree(norms);
+	pfree(centroids);
+	pfree(sample);
+	pfree(sketches);
+	pfree(rows);
+}
+
+/* ----------------------------------------------------------------
+ *		simBuilderCreate
+ *
+ *		Sets up to compute a similarity model one row at a
+ *		time. The vectors must already be sorted. The norms
+ *		are the vector lengths for cosine similarity, or the
+ *		Pearson values if avgs is non-NULL.
+ *
+ *		For the co-occurrence build, we also transpose the
+ *		vectors, so we can find every row that shares a
+ *		column with a given row without comparing all pairs.
+ *		If the vectors are dense enough that multiplying
+ *		whole rows is cheaper, we lay them out as a dense
+ *		matrix instead. With lshBands, we hash the rows into
+ *		LSH buckets instead, and only compare rows that
+ *		share one.
+ * ----------------------------------------------------------------
+ */
+sim_builder
+simBuilderCreate(sim_vector *vectors, int numVectors, float *norms, float *avgs,
+		int lshBands, int lshRows) {
+	return simBuilderSetUp(vectors, numVectors, norms, avgs, false,
+		lshBands, lshRows, 0, 0);
+}
+
+/* ----------------------------------------------------------------
+ *		simBuilderCreateJaccard
+ *
+ *		Like simBuilderCreate, for Jaccard similarity between
+ *		the sets that jaccard_info made, given their sizes.
+ *		Dense enough sets are laid out as bitsets.
+ * ----------------------------------------------------------------
+ */
+sim_builder
+simBuilderCreateJaccard(sim_vector *vectors, int numVectors, float *sizes,
+		int lshBands, int lshRows) {
+	return simBuilderSetUp(vectors, numVectors, sizes, NULL, true,
+		lshBands, lshRows, 0, 0);
+}
+
+/* ----------------------------------------------------------------
+ *		simBuilderCreateClustered
+ *
+ *		Like simBuilderCreate, for an approximate user
+ *		similarity build that clusters the users into
+ *		numClusters clusters, and only compares each one
+ *		with the users in its numProbes nearest clusters.
+ * ----------------------------------------------------------------
+ */
+sim_builder
+simBuilderCreateClustered(sim_vector *vectors, int numVectors, float *norms,
+		float *avgs, int numClusters, int numProbes) {
+	return simBuilderSetUp(vectors, numVectors, norms, avgs, false,
+		0, 0, numClusters, numProbes);
+}
+
+/*
+ * The body of simBuilderCreate, simBuilderCreateJaccard and
+ * simBuilderCreateClustered.
+ */
+static sim_builder
+simBuilderSetUp(sim_vector *vectors, int numVectors, float *norms, float *avgs,
+		bool jaccard, int lshBands, int lshRows, int numClusters, int numProbes) {
+	int i, k;
+	int *colLengths;
+	sim_builder builder;
+
+	builder = (sim_builder) palloc0(sizeof(struct sim_builder_t));
+	builder->numVectors = numVectors;
+	builder->vectors = vectors;
+	builder->norms = norms;
+	builder->avgs = avgs;
+	builder->jaccard = jaccard;
+	builder->rowLength = 0;
+	builder->rowIndex = (int*) palloc((numVectors+1)*sizeof(int));
+	builder->rowSim = (float*) palloc((numVectors+1)*sizeof(float));
+
+	if (lshBands > 0) {
+		builder->inRow = (bool*) palloc0((numVectors+1)*sizeof(bool));
+		simBuilderHash(builder, lshBands, lshRows);
+		return builder;
+	}
+	if (numClusters > 0) {
+		builder->inRow = (bool*) palloc0((numVectors+1)*sizeof(bool));
+		simBuilderCluster(builder, numClusters, numProbes);
+		return builder;
+	}
+
+	if (!COOCCUR_BUILD)
+		return builder;
+
+	// Gather every column ID, and reduce it to a sorted list
+	// of distinct IDs.
+	builder->numCols = distinctVectorIDs(vectors, numVectors, &builder->colIDs);
+
+	// Now build the transpose. We count each column first, so the
+	// transposed vectors can be packed. Since we go through the
+	// rows in order, each transposed vector comes out sorted.
+	colLengths = (int*) palloc0((builder->numCols+1)*sizeof(int));
+	for (i = 0; i < numVectors; i++) {
+		if (!vectors[i]) continue;
+		for (k = 0; k < vectors[i]->length; k++) {
+			int col = binarySearch(builder->colIDs, vectors[i]->id[k],
+						0, builder->numCols);
+			if (col >= 0)
+				colLengths[col]++;
+		}
+	}
+	if (simBuilderMakeDense(builder, colLengths)) {
+		pfree(colLengths);
+		return builder;
+	}
+	builder->transpose = createPackedSimVectors(builder->numCols, colLengths);
+	pfree(colLengths);
+	for (i = 0; i < numVectors; i++) {
+		if (!vectors[i]) continue;
+		for (k = 0; k < vectors[i]->length; k++) {
+			int col = binarySearch(builder->colIDs, vectors[i]->id[k],
+						0, builder->numCols);
+			if (col < 0) continue;
+			simVectorAppend(builder->transpose[col], i, vectors[i]->event[k]);
+		}
+	}
+
+	builder->accum = (float*) palloc0((numVectors+1)*sizeof(float));
+	builder->inRow = (bool*) palloc0((numVectors+1)*sizeof(bool));
+
+	return builder;
+}
+
+/* ----------------------------------------------------------------
+ *		simBuilderRow
+ *
+ *		Computes the nonzero similarities between row i and
+ *		every row j > i, storing them in rowIndex/rowSim in
+ *		increasing order of j. Returns how many there are.
+ *		Cosine similarities that aren't positive are left
+ *		out, as are Pearson similarities of zero. An
+ *		approximate build only looks at the rows that share
+ *		an LSH bucket with row i, or that fall in one of its
+ *		nearest clusters.
+ * ----------------------------------------------------------------
+ */
+int
+simBuilderRow(sim_builder builder, int i) {
+	return simBuilderRowFrom(builder, i, false);
+}
+
+/* ----------------------------------------------------------------
+ *		simBuilderFullRow
+ *
+ *		Like simBuilderRow, but finds the neighbors of row i
+ *		among all of the other rows, not just the later ones,
+ *		for when only some rows of a model are recomputed.
+ * ----------------------------------------------------------------
+ */
+int
+simBuilderFullRow(sim_builder builder, int i) {
+	return simBuilderRowFrom(builder, i, true);
+}
+
+/*
+ * The body of simBuilderRow and simBuilderFullRow. With full, the
+ * neighbors come from every row but i itself.
+ */
+static int
+simBuilderRowFrom(sim_builder builder, int i, bool full) {
+	int b, j, k, m;
+	sim_vector row_i;
+
+	builder->rowLength = 0;
+	row_i = builder->vectors[i];
+	if (!row_i) return 0;
+
+	// The original all-pairs build, and the approximate builds,
+	// compare whole rows.
+	if (!COOCCUR_BUILD || builder->lshBands > 0 || builder->numClusters > 0) {
+		if (builder->numClusters > 0) {
+			// Gather the candidates. Each cluster is in row order.
+			for (b = 0; b < builder->clusterProbes; b++) {
+				int cluster = builder->clusterOf[(Size) i * builder->clusterProbes + b];
+
+				if (cluster < 0) continue;
+				for (k = builder->clusterStart[cluster];
+				     k < builder->clusterStart[cluster+1]; k++) {
+					j = builder->clusterMembers[k];
+					if ((full ? j == i : j <= i) || builder->inRow[j]) continue;
+					builder->inRow[j] = true;
+					builder->rowIndex[builder->rowLength++] = j;
+				}
+			}
+			qsort(builder->rowIndex, builder->rowLength, sizeof(int), intCompare);
+		} else if (builder->lshBands > 0) {
+			// Gather the candidates. Each bucket is in row order.
+			for (b = 0; b < builder->lshBands; b++) {
+				int bucket = builder->lshBucketOf[b][i];
+
+				if (bucket < 0) continue;
+				for (k = builder->lshBucketStart[b][bucket];
+				     k < builder->lshBucketStart[b][bucket+1]; k++) {
+					j = builder->lshMembers[b][k];
+					if ((full ? j == i : j <= i) || builder->inRow[j]) continue;
+					builder->inRow[j] = true;
+					builder->rowIndex[builder->rowLength++] = j;
+				}
+			}
+			qsort(builder->rowIndex, builder->rowLength, sizeof(int), intCompare);
+		} else {
+			for (j = full ? 0 : i+1; j < builder->numVectors; j++) {
+				if (j == i) continue;
+				builder->rowIndex[builder->rowLength++] = j;
+			}
+		}
+
+		m = 0;
+		for (k = 0; k < builder->rowLength; k++) {
+			float similarity;
+
+			j = builder->rowIndex[k];
+			if (builder->inRow)
+				builder->inRow[j] = false;
+			if (!builder->vectors[j]) continue;
+
+			if (builder->avgs) {
+				similarity = pearsonSimilarity(row_i, builder->vectors[j],
+						builder->avgs[i], builder->avgs[j],
+						builder->norms[i], builder->norms[j]);
+				if (similarity == 0.0) continue;
+			} else if (builder->jaccard) {
+				similarity = jaccardSimilarity(row_i, builder->vectors[j],
+						builder->norms[i], builder->norms[j]);
+				if (similarity <= 0) continue;
+			} else {
+				similarity = cosineSimilarity(row_i, builder->vectors[j],
+						builder->norms[i], builder->norms[j]);
+				if (similarity <= 0) continue;
+			}
+			if (simBuilderPruned(builder, similarity, row_i,
+					builder->vectors[j], -1))
+				continue;
+
+			builder->rowIndex[m] = j;
+			builder->rowSim[m] = similarity;
+			m++;
+		}
+		builder->rowLength = m;
+		return builder->rowLength;
+	}
+
+	if (builder->dense || builder->bits)
+		return simBuilderDenseRow(builder, i, full);
+	if (builder->numCols <= 0) return 0;
+
+	return simBuilderAccumulate(builder, row_i, builder->norms[i],
+		builder->avgs ? builder->avgs[i] : 0.0,
+		full ? 0 : i+1, builder->numVectors, i);
+}
+
+/*
+ * The co-occurrence build of one row against rows from up to to,
+ * leaving out row skip. We find where each of the vector's columns
+ * reaches row from, then go through the other rows a tile at a
+ * time, advancing along every column to the end of the tile. Each
+ * tile's neighbors are put in order and normalized before the next
+ * one is started.
+ */
+static int
+simBuilderAccumulate(sim_builder builder, sim_vector vec, float norm,
+		float avg, int from, int to, int skip) {
+	int j, k, m, n, numCols, tileStart;
+
+	if (vec->length > builder->maxCols) {
+		if (builder->colOf) {
+			pfree(builder->colOf);
+			pfree(builder->colPos);
+			pfree(builder->colEvent);
+		}
+		builder->maxCols = vec->length;
+		builder->colOf = (sim_vector*) palloc(vec->length*sizeof(sim_vector));
+		builder->colPos = (int*) palloc(vec->length*sizeof(int));
+		builder->colEvent = (float*) palloc(vec->length*sizeof(float));
+	}
+
+	// Look up the vector's columns once, and where each of them
+	// gets to row from. Columns are sorted by row.
+	numCols = 0;
+	for (k = 0; k < vec->length; k++) {
+		int col, lo, hi;
+		sim_vector column;
+
+		col = binarySearch(builder->colIDs, vec->id[k], 0, builder->numCols);
+		if (col < 0) continue;
+		column = builder->transpose[col];
+
+		lo = 0;
+		hi = column->length;
+		while (lo < hi) {
+			int mid = lo + (hi - lo) / 2;
+			if (column->id[mid] < from)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		if (lo >= column->length) continue;
+
+		builder->colOf[numCols] = column;
+		builder->colPos[numCols] = lo;
+		builder->colEvent[numCols] = vec->event[k] - avg;
+		numCols++;
+	}
+
+	m = 0;
+	builder->rowLength = 0;
+	for (tileStart = from; tileStart < to && numCols > 0;
+	     tileStart += RECATHON_SIM_TILE_ROWS) {
+		int tileEnd, first;
+
+		tileEnd = Min(to, tileStart + RECATHON_SIM_TILE_ROWS);
+		first = builder->rowLength;
+
+		// Add every column's contribution to the dot product with
+		// each row of the tile that shares it. Columns that are
+		// used up drop out.
+		for (n = 0; n < numCols; n++) {
+			sim_vector column = builder->colOf[n];
+			float event_i = builder->colEvent[n];
+			int pos = builder->colPos[n];
+
+			for (; pos < column->length; pos++) {
+				float event_j;
+
+				j = column->id[pos];
+				if (j >= tileEnd) break;
+				if (j == skip) continue;
+
+				event_j = column->event[pos];
+				if (builder->avgs)
+					event_j -= builder->avgs[j];
+				builder->accum[j] += event_i * event_j;
+				if (builder->support)
+					builder->support[j]++;
+
+				if (!builder->inRow[j]) {
+					builder->inRow[j] = true;
+					builder->rowIndex[builder->rowLength++] = j;
+				}
+			}
+
+			if (pos >= column->length) {
+				numCols--;
+				builder->colOf[n] = builder->colOf[numCols];
+				builder->colPos[n] = builder->colPos[numCols];
+				builder->colEvent[n] = builder->colEvent[numCols];
+				n--;
+			} else
+				builder->colPos[n] = pos;
+		}
+
+		// Put the tile's neighbors in order, then normalize them,
+		// and reset our accumulators for the next tile.
+		qsort(builder->rowIndex + first, builder->rowLength - first,
+			sizeof(int), intCompare);
+
+		for (k = first; k < builder->rowLength; k++) {
+			float numerator, denominator;
+			int support = 0;
+
+			j = builder->rowIndex[k];
+			numerator = builder->accum[j];
+			denominator = builder->jaccard ? norm + builder->norms[j] - numerator :
+				norm * builder->norms[j];
+			builder->accum[j] = 0.0;
+			builder->inRow[j] = false;
+			if (builder->support) {
+				support = builder->support[j];
+				builder->support[j] = 0;
+			}
+
+			if (builder->avgs) {
+				if (denominator == 0.0 || numerator == 0.0) continue;
+			} else {
+				if (denominator <= 0 || numerator <= 0) continue;
+			}
+			if (simBuilderPruned(builder, numerator / denominator,
+					NULL, NULL, support))
+				continue;
+
+			builder->rowIndex[m] = j;
+			builder->rowSim[m] = numerator / denominator;
+			m++;
+		}
+		builder->rowLength = m;
+	}
+	builder->rowLength = m;
+
+	return builder->rowLength;
+}
+
+/*
+ * Decides whether a builder should multiply dense rows, given how
+ * many rows have each column, and if so lays the rows out. The
+ * co-occurrence build does a multiply-add for every pair of entries
+ * in a column, the dense build one for every cell of every pair
+ * of rows, but many at a time and in order. For Pearson, the rows
+ * are stored less their averages, so the missing events are zeros
+ * either way. For Jaccard, the rows are bitsets, and a word of
+ * each pair is intersected at a time.
+ */
+static bool
+simBuilderMakeDense(sim_builder builder, int *colLengths) {
+	int i, k, n;
+	double pairCells, denseCells, denseBytes;
+
+	n = builder->numVectors;
+	if (n <= 1 || builder->numCols <= 0)
+		return false;
+
+	if (builder->jaccard) {
+		builder->bitWords = (builder->numCols + 63) / 64;
+		denseCells = (double) n * n * builder->bitWords;
+		denseBytes = (double) n * builder->bitWords * sizeof(uint64);
+	} else {
+		denseCells = (double) n * n * builder->numCols;
+		denseBytes = (double) n * builder->numCols * sizeof(float);
+	}
+	if (denseBytes > (double) RECATHON_DENSE_MAX_CELLS * sizeof(float)) {
+		builder->denseWork = -1.0;
+		return false;
+	}
+
+	pairCells = 0.0;
+	for (k = 0; k < builder->numCols; k++)
+		pairCells += (double) colLengths[k] * colLengths[k];
+	if (pairCells > 0.0)
+		builder->denseWork = denseCells / pairCells;
+	if (denseCells > pairCells * RECATHON_DENSE_ADVANTAGE)
+		return false;
+
+	builder->blockSums = (float*) palloc(RECATHON_DENSE_BLOCK_ROWS * (Size) n * sizeof(float));
+	builder->blockFirst = -1;
+	builder->blockRows = 0;
+	builder->rowStride = 1;
+	builder->rowEnd = n;
+
+	if (builder->jaccard) {
+		builder->bits = (uint64*) palloc0((Size) n * builder->bitWords * sizeof(uint64));
+		for (i = 0; i < n; i++) {
+			uint64 *row = builder->bits + (Size) i * builder->bitWords;
+
+			if (!builder->vectors[i]) continue;
+			for (k = 0; k < builder->vectors[i]->length; k++) {
+				int col = binarySearch(builder->colIDs, builder->vectors[i]->id[k],
+							0, builder->numCols);
+				if (col >= 0)
+					row[col / 64] |= ((uint64) 1) << (col % 64);
+			}
+		}
+		return true;
+	}
+
+	builder->dense = (float*) palloc0((Size) n * builder->numCols * sizeof(float));
+	for (i = 0; i < n; i++) {
+		float *row = builder->dense + (Size) i * builder->numCols;
+		float avg_i = builder->avgs ? builder->avgs[i] : 0.0;
+
+		if (!builder->vectors[i]) continue;
+		for (k = 0; k < builder->vectors[i]->length; k++) {
+			int col = binarySearch(builder->colIDs, builder->vectors[i]->id[k],
+						0, builder->numCols);
+			if (col >= 0)
+				row[col] = builder->vectors[i]->event[k] - avg_i;
+		}
+	}
+
+	return true;
+}
+
+#if !defined(__GNUC__)
+/*
+ * Counts the bits set in a word, where the compiler has no builtin.
+ */
+static int
+recathon_popcount64(uint64 x) {
+	x = x - ((x >> 1) & UINT64CONST(0x5555555555555555));
+	x = (x & UINT64CONST(0x3333333333333333)) + ((x >> 2) & UINT64CONST(0x3333333333333333));
+	x = (x + (x >> 4)) & UINT64CONST(0x0f0f0f0f0f0f0f0f);
+	return (int) ((x * UINT64CONST(0x0101010101010101)) >> 56);
+}
+#endif
+
+/*
+ * The number of bits two bitsets of the given length have in common.
+ */
+static int
+bitsetIntersect(const uint64 *a, const uint64 *b, int words) {
+	int k, count = 0;
+
+	for (k = 0; k < words; k++)
+		count += RECATHON_POPCOUNT64(a[k] & b[k]);
+
+	return count;
+}
+
+/*
+ * Keeps the neighbors with a nonzero similarity among the dot
+ * products of a row, with vector vec, with rows from up to to,
+ * leaving out row skip.
+ */
+static int
+simBuilderDenseKeep(sim_builder builder, float *sums, sim_vector vec,
+		float norm, int from, int to, int skip) {
+	int j;
+
+	builder->rowLength = 0;
+	for (j = from; j < to; j++) {
+		float numerator, denominator;
+
+		if (j == skip || !builder->vectors[j]) continue;
+		numerator = sums[j];
+		denominator = builder->jaccard ? norm + builder->norms[j] - numerator :
+			norm * builder->norms[j];
+		if (builder->avgs) {
+			if (denominator == 0.0 || numerator == 0.0) continue;
+		} else {
+			if (denominator <= 0 || numerator <= 0) continue;
+		}
+		// A Jaccard dot product is already the number shared.
+		if (simBuilderPruned(builder, numerator / denominator, vec,
+				builder->vectors[j], builder->jaccard ? (int) numerator : -1))
+			continue;
+
+		builder->rowIndex[builder->rowLength] = j;
+		builder->rowSim[builder->rowLength] = numerator / denominator;
+		builder->rowLength++;
+	}
+
+	return builder->rowLength;
+}
+
+/*
+ * The dense build of a row. Rows are multiplied a block at a time,
+ * the block being row i and the next ones this process will ask for,
+ * rowStride apart and before rowEnd, against tiles of the other
+ * rows. We keep the block's dot products until a row outside it is
+ * wanted. Full rows are only wanted here and there, so they're done
+ * one at a time.
+ */
+static int
+simBuilderDenseRow(sim_builder builder, int i, bool full) {
+	int t, j, n, c, from, end, tileStart;
+	float *row_i;
+
+	n = builder->numVectors;
+	c = builder->numCols;
+	end = Min(n, Max(builder->rowEnd, i+1));
+
+	if (builder->blockFirst < 0 || i < builder->blockFirst ||
+	    (i - builder->blockFirst) % builder->rowStride != 0 ||
+	    (i - builder->blockFirst) / builder->rowStride >= builder->blockRows ||
+	    builder->blockFull != full) {
+		builder->blockFirst = i;
+		builder->blockFull = full;
+		builder->blockRows = 0;
+		while (builder->blockRows < (full ? 1 : RECATHON_DENSE_BLOCK_ROWS) &&
+		       i + builder->blockRows * builder->rowStride < end)
+			builder->blockRows++;
+
+		// Each tile of other rows is read once for the whole
+		// block, while it's still in cache.
+		from = full ? 0 : i+1;
+		for (tileStart = from; tileStart < n; tileStart += RECATHON_DENSE_BLOCK_ROWS) {
+			int tileEnd = Min(n, tileStart + RECATHON_DENSE_BLOCK_ROWS);
+
+			for (t = 0; t < builder->blockRows; t++) {
+				float *sums = builder->blockSums + (Size) t * n;
+				int r = i + t * builder->rowStride;
+
+				if (builder->bits) {
+					int w = builder->bitWords;
+					uint64 *bits_i = builder->bits + (Size) r * w;
+
+					for (j = tileStart; j < tileEnd; j++)
+						sums[j] = bitsetIntersect(bits_i, builder->bits + (Size) j * w, w);
+					continue;
+				}
+
+				row_i = builder->dense + (Size) r * c;
+				for (j = tileStart; j < tileEnd; j++)
+					sums[j] = factorDot(row_i, builder->dense + (Size) j * c, c);
+			}
+		}
+	}
+
+	t = (i - builder->blockFirst) / builder->rowStride;
+	return simBuilderDenseKeep(builder, builder->blockSums + (Size) t * n,
+		builder->vectors[i], builder->norms[i], full ? 0 : i+1, n, i);
+}
+
+/*
+ * The dense build of a vector from outside the builder, against
+ * its rows before upto.
+ */
+static int
+simBuilderDenseAgainst(sim_builder builder, sim_vector vec, float norm,
+		float avg, int upto) {
+	int j, k, c;
+	float *row, *sums;
+
+	c = builder->numCols;
+
+	// The block is about to be overwritten, so it's no longer any use.
+	builder->blockFirst = -1;
+	sums = builder->blockSums;
+
+	if (builder->bits) {
+		int w = builder->bitWords;
+		uint64 *bits = (uint64*) palloc0(w*sizeof(uint64));
+
+		for (k = 0; k < vec->length; k++) {
+			int col = binarySearch(builder->colIDs, vec->id[k], 0, c);
+			if (col >= 0)
+				bits[col / 64] |= ((uint64) 1) << (col % 64);
+		}
+		for (j = 0; j < upto; j++)
+			sums[j] = bitsetIntersect(bits, builder->bits + (Size) j * w, w);
+		pfree(bits);
+
+		return simBuilderDenseKeep(builder, sums, vec, norm, 0, upto, -1);
+	}
+
+	row = (float*) palloc0(c*sizeof(float));
+	for (k = 0; k < vec->length; k++) {
+		int col = binarySearch(builder->colIDs, vec->id[k], 0, c);
+		if (col >= 0)
+			row[col] = vec->event[k] - (builder->avgs ? avg : 0.0);
+	}
+
+	for (j = 0; j < upto; j++)
+		sums[j] = factorDot(row, builder->dense + (Size) j * c, c);
+	pfree(row);
+
+	return simBuilderDenseKeep(builder, sums, vec, norm, 0, upto, -1);
+}
+
+/* ----------------------------------------------------------------
+ *		simBuilderAgainst
+ *
+ *		Computes the nonzero similarities between a vector
+ *		from outside the builder and each of its rows before
+ *		upto, storing them in rowIndex/rowSim in increasing
+ *		order of row, like simBuilderRow. The vector's norm
+ *		and average are given, the average only mattering
+ *		for Pearson. Used to build a model that doesn't fit
+ *		in memory a block of rows at a time.
+ * ----------------------------------------------------------------
+ */
+int
+simBuilderAgainst(sim_builder builder, sim_vector vec, float norm, float avg,
+		int upto) {
+	int i;
+
+	builder->rowLength = 0;
+	if (!vec || vec->length == 0) return 0;
+	if (upto > builder->numVectors)
+		upto = builder->numVectors;
+
+	// The original all-pairs build compares whole rows.
+	if (!COOCCUR_BUILD) {
+		for (i = 0; i < upto; i++) {
+			float similarity;
+
+			if (!builder->vectors[i]) continue;
+			if (builder->avgs) {
+				similarity = pearsonSimilarity(builder->vectors[i], vec,
+						builder->avgs[i], avg, builder->norms[i], norm);
+				if (similarity == 0.0) continue;
+			} else if (builder->jaccard) {
+				similarity = jaccardSimilarity(builder->vectors[i], vec,
+						builder->norms[i], norm);
+				if (similarity <= 0) continue;
+			} else {
+				similarity = cosineSimilarity(builder->vectors[i], vec,
+						builder->norms[i], norm);
+				if (similarity <= 0) continue;
+			}
+			if (simBuilderPruned(builder, similarity, builder->vectors[i],
+					vec, -1))
+				continue;
+			builder->rowIndex[builder->rowLength] = i;
+			builder->rowSim[builder->rowLength] = similarity;
+			builder->rowLength++;
+		}
+		return builder->rowLength;
+	}
+
+	if (builder->dense || builder->bits)
+		return simBuilderDenseAgainst(builder, vec, norm, avg, upto);
+	if (builder->numCols <= 0) return 0;
+
+	return simBuilderAccumulate(builder, vec, norm,
+		builder->avgs ? avg : 0.0, 0, upto, -1);
+}
+
+/* ----------------------------------------------------------------
+ *		simBuilderSetPruning
+ *
+ *		Has a builder leave out the pairs of rows that share
+ *		fewer than the minimum support of columns, or whose
+ *		similarity is smaller in magnitude than the minimum,
+ *		from the build parameters. The co-occurrence build
+ *		counts the shared columns as it goes; the others
+ *		count them for the pairs that would be kept.
+ * ----------------------------------------------------------------
+ */
+void
+simBuilderSetPruning(sim_builder builder, sim_params *params) {
+	builder->minSupport = params->minSupport;
+	builder->minSimilarity = params->minSimilarity;
+	if (builder->minSupport > 1 && builder->accum && !builder->support)
+		builder->support = (int*) palloc0((builder->numVectors+1)*sizeof(int));
+}
+
+/*
+ * Whether a pair of rows falls short of the builder's minimum
+ * similarity or support. The support is the number of columns the
+ * two vectors share, or if it's negative, the vectors are merged
+ * to count it.
+ */
+static bool
+simBuilderPruned(sim_builder builder, float similarity, sim_vector a,
+		sim_vector b, int support) {
+	int p, q;
+
+	if (builder->minSimilarity > 0 &&
+	    (similarity < 0 ? -similarity : similarity) < builder->minSimilarity)
+		return true;
+	if (builder->minSupport <= 1)
+		return false;
+
+	if (support < 0) {
+		support = 0;
+		p = q = 0;
+		while (p < a->length && q < b->length) {
+			if (a->id[p] < b->id[q])
+				p++;
+			else if (a->id[p] > b->id[q])
+				q++;
+			else {
+				support++;
+				p++;
+				q++;
+			}
+		}
+	}
+
+	return support < builder->minSupport;
+}
+
+/* ----------------------------------------------------------------
+ *		simBuilderFree
+ *
+ *		Free a sim_builder. The vectors themselves belong
+ *		to the caller.
+ * ----------------------------------------------------------------
+ */
+void
+simBuilderFree(sim_builder builder) {
+	int k;
+
+	if (!builder)
+		return;
+
+	if (builder->transpose)
+		freeSimVectors(builder->transpose, builder->numCols);
+	if (builder->colIDs)
+		pfree(builder->colIDs);
+	if (builder->accum)
+		pfree(builder->accum);
+	if (builder->inRow)
+		pfree(builder->inRow);
+	if (builder->support)
+		pfree(builder->support);
+	if (builder->colOf) {
+		pfree(builder->colOf);
+		pfree(builder->colPos);
+		pfree(builder->colEvent);
+	}
+	if (builder->dense || builder->bits) {
+		if (builder->dense)
+			pfree(builder->dense);
+		if (builder->bits)
+			pfree(builder->bits);
+		pfree(builder->blockSums);
+	}
+	for (k = 0; k < builder->lshBands; k++) {
+		pfree(builder->lshBucketOf[k]);
+		pfree(builder->lshBucketStart[k]);
+		pfree(builder->lshMembers[k]);
+	}
+	if (builder->lshBands > 0) {
+		pfree(builder->lshBucketOf);
+		pfree(builder->lshBucketStart);
+		pfree(builder->lshMembers);
+	}
+	if (builder->clusterOf) {
+		pfree(builder->clusterOf);
+		pfree(builder->clusterStart);
+		pfree(builder->clusterMembers);
+	}
+	pfree(builder->rowIndex);
+	pfree(builder->rowSim);
+	pfree(builder);
+}
+
+/* ----------------------------------------------------------------
+ *		modelWriterOpen
+ *
+ *		Opens a model table so we can insert tuples into it
+ *		directly. Every model table has the same shape, two
+ *		integers and a real, whether it holds similarities
+ *		or SVD features. The table shouldn't have any
+ *		indexes yet; we add the primary key afterwards. A
+ *		table created in this transaction is filled the way
+ *		COPY fills one: without WAL under wal_level minimal,
+ *		syncing it to disk instead when we're done. One
+ *		created in this very subtransaction gets its tuples
+ *		frozen as they go in, and its pages marked all
+ *		visible when we're done, so that index-only scans
+ *		work on it at once and VACUUM has nothing to do. We also
+ *		keep track of whether an empty table is being filled
+ *		in key order, so the key can be built without a sort.
+ *		A live model that gets rows added in place has its
+ *		indexes already, and they're kept up as we go.
+ * ----------------------------------------------------------------
+ */
+model_writer
+modelWriterOpen(char *modelname) {
+	model_writer writer;
+	RangeVar *modelrv;
+
+	writer = (model_writer) palloc(sizeof(struct model_writer_t));
+
+	// Our model names were never quoted, so they need to be
+	// downcased the same way the parser did it.
+	modelrv = makeRangeVarFromNameList(stringToQualifiedNameList(modelname));
+	writer->rel = heap_openrv(modelrv, RowExclusiveLock);
+	writer->bistate = GetBulkInsertState();
+	writer->cid = GetCurrentCommandId(true);
+	writer->options = 0;
+	writer->count = 0;
+	writer->sorted = (RelationGetNumberOfBlocks(writer->rel) == 0);
+	writer->lastKey1 = 0;
+	writer->lastKey2 = 0;
+	writer->indstate = NULL;
+	if (RelationGetForm(writer->rel)->relhasindex)
+		writer->indstate = CatalogOpenIndexes(writer->rel);
+
+	// If the transaction aborts, nobody will ever see the table,
+	// so a crash before it commits doesn't matter either.
+	if (writer->rel->rd_createSubid != InvalidSubTransactionId ||
+	    writer->rel->rd_newRelfilenodeSubid != InvalidSubTransactionId) {
+		writer->options |= HEAP_INSERT_SKIP_FSM;
+		if (!XLogIsNeeded())
+			writer->options |= HEAP_INSERT_SKIP_WAL;
+	}
+	// Frozen tuples are visible to every snapshot, so only a
+	// table nobody else can see yet, and that goes away if
+	// we abort, may have them.
+	if (writer->rel->rd_createSubid == GetCurrentSubTransactionId())
+		writer->options |= HEAP_INSERT_FROZEN;
+
+	return writer;
+}
+
+/* ----------------------------------------------------------------
+ *		modelWriterInsert
+ *
+ *		Inserts one tuple into a model table.
+ * ----------------------------------------------------------------
+ */
+void
+modelWriterInsert(model_writer writer, int key1, int key2, float value) {
+	Datum values[3];
+	bool nulls[3] = {false, false, false};
+	HeapTuple tuple;
+
+	values[0] = Int32GetDatum(key1);
+	values[1] = Int32GetDatum(key2);
+	values[2] = Float4GetDatum(value);
+
+	tuple = heap_form_tuple(RelationGetDescr(writer->rel), values, nulls);
+	heap_insert(writer->rel, tuple, writer->cid, writer->options, writer->bistate);
+	if (writer->indstate)
+		CatalogIndexInsert(writer->indstate, tuple);
+	heap_freetuple(tuple);
+
+	if (writer->count > 0 && (key1 < writer->lastKey1 ||
+			(key1 == writer->lastKey1 && key2 < writer->lastKey2)))
+		writer->sorted = false;
+	writer->lastKey1 = key1;
+	writer->lastKey2 = key2;
+	writer->count++;
+}
+
+/* ----------------------------------------------------------------
+ *		modelWriterInsertArray
+ *
+ *		Inserts one tuple into an SVD or ALS model table,
+ *		which holds a key and a real[] of its factors.
+ * ----------------------------------------------------------------
+ */
+void
+modelWriterInsertArray(model_writer writer, int key, float *features, int numFeatures) {
+	int i;
+	Datum values[2];
+	bool nulls[2] = {false, false};
+	Datum *elems;
+	HeapTuple tuple;
+
+	elems = (Datum*) palloc(numFeatures*sizeof(Datum));
+	for (i = 0; i < numFeatures; i++)
+		elems[i] = Float4GetDatum(features[i]);
+
+	values[0] = Int32GetDatum(key);
+	values[1] = PointerGetDatum(construct_array(elems, numFeatures, FLOAT4OID,
+		sizeof(float4), FLOAT4PASSBYVAL, 'i'));
+
+	tuple = heap_form_tuple(RelationGetDescr(writer->rel), values, nulls);
+	heap_insert(writer->rel, tuple, writer->cid, writer->options, writer->bistate);
+	if (writer->indstate)
+		CatalogIndexInsert(writer->indstate, tuple);
+	heap_freetuple(tuple);
+	pfree(DatumGetPointer(values[1]));
+	pfree(elems);
+
+	if (writer->count > 0 && key < writer->lastKey1)
+		writer->sorted = false;
+	writer->lastKey1 = key;
+	writer->count++;
+}
+
+/* ----------------------------------------------------------------
+ *		modelWriterInsertVector
+ *
+ *		Inserts one tuple into a vector store, which holds
+ *		a key and its packed rating vector.
+ * ----------------------------------------------------------------
+ */
+void
+modelWriterInsertVector(model_writer writer, int key, sim_vector vec) {
+	Datum values[2];
+	bool nulls[2] = {false, false};
+	HeapTuple tuple;
+
+	values[0] = Int32GetDatum(key);
+	values[1] = PointerGetDatum(packSimVector(vec));
+
+	tuple = heap_form_tuple(RelationGetDescr(writer->rel), values, nulls);
+	heap_insert(writer->rel, tuple, writer->cid, writer->options, writer->bistate);
+	if (writer->indstate)
+		CatalogIndexInsert(writer->indstate, tuple);
+	heap_freetuple(tuple);
+	pfree(DatumGetPointer(values[1]));
+
+	writer->count++;
+}
+
+/* ----------------------------------------------------------------
+ *		markModelAllVisible
+ *
+ *		Marks every page of a model table filled with frozen
+ *		tuples as all visible, in the page and in the
+ *		visibility map, the way VACUUM would. The primary
+ *		key built afterwards records the count in pg_class,
+ *		so the planner costs index-only scans right.
+ * ----------------------------------------------------------------
+ */
+static void
+markModelAllVisible(Relation rel) {
+	BlockNumber blkno, nblocks;
+	Buffer buf, vmbuffer = InvalidBuffer;
+	BufferAccessStrategy strategy;
+	Page page;
+
+	strategy = GetAccessStrategy(BAS_BULKREAD);
+	nblocks = RelationGetNumberOfBlocks(rel);
+	for (blkno = 0; blkno < nblocks; blkno++) {
+		visibilitymap_pin(rel, blkno, &vmbuffer);
+		buf = ReadBufferExtended(rel, MAIN_FORKNUM, blkno, RBM_NORMAL, strategy);
+		LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+		page = BufferGetPage(buf);
+		if (!PageIsAllVisible(page)) {
+			PageSetAllVisible(page);
+			MarkBufferDirty(buf);
+			visibilitymap_set(rel, blkno, InvalidXLogRecPtr, vmbuffer,
+				InvalidTransactionId);
+		}
+		UnlockReleaseBuffer(buf);
+	}
+	if (vmbuffer != InvalidBuffer)
+		ReleaseBuffer(vmbuffer);
+	FreeAccessStrategy(strategy);
+}
+
+/* ----------------------------------------------------------------
+ *		modelWriterClose
+ *
+ *		Finishes up with a model table. We keep our lock
+ *		until the end of the transaction, and make the new
+ *		tuples visible to whatever we run next. Returns
+ *		true if the table holds its tuples in key order.
+ * ----------------------------------------------------------------
+ */
+bool
+modelWriterClose(model_writer writer) {
+	bool sorted = writer->sorted;
+
+	if (writer->indstate)
+		CatalogCloseIndexes(writer->indstate);
+	FreeBulkInsertState(writer->bistate);
+	// What skipped WAL has to be on disk before we commit. It
+	// has to be there before the visibility map is logged, too,
+	// or replaying that could find pages that were never written.
+	if (writer->options & HEAP_INSERT_SKIP_WAL)
+		heap_sync(writer->rel);
+	if (writer->options & HEAP_INSERT_FROZEN)
+		markModelAllVisible(writer->rel);
+	heap_close(writer->rel, NoLock);
+	pfree(writer);
+
+	CommandCounterIncrement();
+	return sorted;
+}
+
+/* ----------------------------------------------------------------
+ *		addModelKey
+ *
+ *		Adds the primary key on the given columns to a
+ *		model table once it's filled. If the writer found
+ *		the table was filled in key order, the B-tree build
+ *		is told so, and loads it without sorting; it checks
+ *		the order as it goes, and sorts after all if it has
+ *		to.
+ * ----------------------------------------------------------------
+ */
+static void
+addModelKey(char *modelname, char *columns, bool presorted) {
+	char querystring[1024];
+
+	snprintf(querystring,sizeof(querystring),
+		"ALTER TABLE %s ADD PRIMARY KEY (%s);",modelname,columns);
+	pgstat_progress_phase(RECBUILD_PHASE_INDEXING, 0);
+
+	bt_build_presorted = presorted;
+	PG_TRY();
+	{
+		recathon_utilityExecute(querystring);
+	}
+	PG_CATCH();
+	{
+		bt_build_presorted = false;
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+	bt_build_presorted = false;
+}
+
+/* Where writeSimilarityRows sends its output. The backend inserts
+ * into the model directly; a worker process can't, so it writes
+ * binary records to a file for the backend to pick up. */
+typedef struct sim_output {
+	model_writer	writer;
+	FILE		*fp;
+	int64		count;		/* records sent so far */
+} sim_output;
+
+typedef struct sim_record {
+	int		id1;
+	int		id2;
+	float		similarity;
+} sim_record;
+
+static void
+emitSimilarity(sim_output *out, int id1, int id2, float similarity) {
+	if (out->writer)
+		modelWriterInsert(out->writer, id1, id2, similarity);
+	else {
+		sim_record record;
+
+		record.id1 = id1;
+		record.id2 = id2;
+		record.similarity = similarity;
+		fwrite(&record,sizeof(sim_record),1,out->fp);
+	}
+	out->count++;
+}
+
+/* A parallel build shares out its rows as tasks, each a run of the
+ * rows the build has to do. Every process holds a deque of tasks,
+ * which it works through from the front; one that runs out steals
+ * the back half of the fullest deque. The deques live in an
+ * anonymous shared mapping so the forked workers see each other's;
+ * the tasks' bounds are worked out before we fork. So that the
+ * backend can put the rows back in order, each task also records
+ * which process did it and where its rows are in that one's output. */
+typedef struct sim_task_deque {
+	slock_t		mutex;
+	int		head;		/* the next task the owner will do */
+	int		tail;		/* one past the last task it holds */
+	int		rowsDone;	/* rows the owner has finished, for progress */
+} sim_task_deque;
+
+typedef struct sim_task_output {
+	int		worker;		/* the process that did the task */
+	int64		first;		/* its first record in that one's output */
+	int64		count;		/* how many records it wrote */
+} sim_task_output;
+
+typedef struct sim_tasks {
+	int		numTasks;
+	int		*taskStart;	/* each task's first row, counted in the shard */
+	int		numDeques;
+	sim_task_deque	*deques;	/* one for each process */
+	sim_task_output	*outputs;	/* one for each task */
+} sim_tasks;
+
+/* ----------------------------------------------------------------
+ *		simTasksCreate
+ *
+ *		Cuts the numRows rows of this shard into tasks of
+ *		about equal cost, and deals them out evenly among
+ *		numWorkers deques. A row is compared with every
+ *		row after it, so its cost goes with how many of
+ *		those there are, times its own length unless the
+ *		build is dense. A row that costs more than a task
+ *		should gets a task to itself.
+ * ----------------------------------------------------------------
+ */
+static sim_tasks*
+simTasksCreate(sim_builder builder, sim_params *params, int numRows,
+			int numWorkers) {
+	int k, t, w, n;
+	double total, sofar, *cost;
+	sim_tasks *tasks;
+
+	n = builder->numVectors;
+	tasks = (sim_tasks*) palloc(sizeof(sim_tasks));
+	tasks->numTasks = Min(numRows, numWorkers * RECATHON_TASKS_PER_WORKER);
+	tasks->numTasks = Max(tasks->numTasks, 1);
+	tasks->taskStart = (int*) palloc((tasks->numTasks+1)*sizeof(int));
+
+	cost = (double*) palloc((numRows+1)*sizeof(double));
+	total = 0.0;
+	for (k = 0; k < numRows; k++) {
+		int i = params->shard + k * params->numShards;
+		double length = 1.0;
+
+		if (!builder->dense && !builder->bits && builder->vectors[i])
+			length += builder->vectors[i]->length;
+		cost[k] = length * (n - i);
+		total += cost[k];
+	}
+
+	// Cut a task wherever the running cost passes the next share.
+	tasks->taskStart[0] = 0;
+	t = 1;
+	sofar = 0.0;
+	for (k = 0; k < numRows && t < tasks->numTasks; k++) {
+		sofar += cost[k];
+		if (sofar >= total * t / tasks->numTasks)
+			tasks->taskStart[t++] = k+1;
+	}
+	tasks->numTasks = t;
+	tasks->taskStart[t] = numRows;
+	pfree(cost);
+
+	// A build in the backend alone has no one to share with.
+	tasks->numDeques = numWorkers;
+	if (numWorkers > 1) {
+		tasks->deques = (sim_task_deque*) mmap(NULL,
+				numWorkers*sizeof(sim_task_deque) +
+				tasks->numTasks*sizeof(sim_task_output),
+				PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+		if (tasks->deques == (sim_task_deque*) MAP_FAILED)
+			ereport(ERROR,
+				(errcode(ERRCODE_OUT_OF_MEMORY),
+				 errmsg("could not map memory for model build tasks: %m")));
+		tasks->outputs = (sim_task_output*) (tasks->deques + numWorkers);
+	} else {
+		tasks->deques = (sim_task_deque*) palloc(sizeof(sim_task_deque));
+		tasks->outputs = (sim_task_output*)
+			palloc(tasks->numTasks*sizeof(sim_task_output));
+	}
+	memset(tasks->outputs, 0, tasks->numTasks*sizeof(sim_task_output));
+
+	for (w = 0; w < numWorkers; w++) {
+		SpinLockInit(&tasks->deques[w].mutex);
+		tasks->deques[w].head = (int) ((int64) tasks->numTasks * w / numWorkers);
+		tasks->deques[w].tail = (int) ((int64) tasks->numTasks * (w+1) / numWorkers);
+		tasks->deques[w].rowsDone = 0;
+	}
+
+	return tasks;
+}
+
+/* ----------------------------------------------------------------
+ *		simTasksFree
+ *
+ *		Frees tasks made by simTasksCreate.
+ * ----------------------------------------------------------------
+ */
+static void
+simTasksFree(sim_tasks *tasks) {
+	if (tasks->numDeques > 1)
+		munmap(tasks->deques, tasks->numDeques*sizeof(sim_task_deque) +
+			tasks->numTasks*sizeof(sim_task_output));
+	else {
+		pfree(tasks->deques);
+		pfree(tasks->outputs);
+	}
+	pfree(tasks->taskStart);
+	pfree(tasks);
+}
+
+/* ----------------------------------------------------------------
+ *		simTasksNext
+ *
+ *		Finds the next task for the given process, from its
+ *		own deque while there's anything left in it, and
+ *		otherwise from the back of whichever deque holds the
+ *		most tasks. We take half of those, one to do now and
+ *		the rest to keep in our own deque. Returns false once
+ *		every deque is empty.
+ * ----------------------------------------------------------------
+ */
+static bool
+simTasksNext(sim_tasks *tasks, int self, int *ret_task) {
+	volatile sim_task_deque *mine = &tasks->deques[self];
+	int w, first, last;
+
+	SpinLockAcquire(&mine->mutex);
+	first = mine->head;
+	if (first < mine->tail)
+		mine->head++;
+	last = mine->tail;
+	SpinLockRelease(&mine->mutex);
+
+	if (first < last) {
+		*ret_task = first;
+		return true;
+	}
+
+	for (;;) {
+		volatile sim_task_deque *victim = NULL;
+		int most = 0;
+
+		// A stale count only makes us pick a worse victim.
+		for (w = 0; w < tasks->numDeques; w++) {
+			volatile sim_task_deque *deque = &tasks->deques[w];
+			int left = deque->tail - deque->head;
+
+			if (w != self && left > most) {
+				most = left;
+				victim = deque;
+			}
+		}
+		if (!victim)
+			return false;
+
+		SpinLockAcquire(&victim->mutex);
+		last = victim->tail;
+		first = last - (last - victim->head + 1) / 2;
+		if (first < last)
+			victim->tail = first;
+		SpinLockRelease(&victim->mutex);
+
+		// Someone else may have emptied it first.
+		if (first >= last)
+			continue;
+
+		SpinLockAcquire(&mine->mutex);
+		mine->head = first+1;
+		mine->tail = last;
+		SpinLockRelease(&mine->mutex);
+
+		*ret_task = first;
+		return true;
+	}
+}
+
+/* ----------------------------------------------------------------
+ *		writeSimilarityRows
+ *
+ *		Computes the rows of a similarity model in each task
+ *		the given process can get, and sends them to the
+ *		given output. A build of one shard of the model only
+ *		has every numShards'th row to share out. With a
+ *		neighborhood size, only that many of the most
+ *		similar neighbors in each row are kept. Each row's
+ *		neighbors are written in order, so a task's rows
+ *		come out in the order of the model's key.
+ * ----------------------------------------------------------------
+ */
+static void
+writeSimilarityRows(sim_builder builder, int *IDs, sim_output *out,
+			int worker, sim_tasks *tasks, sim_params *params) {
+	int i, k, t, numNeighbors, neighborhood, stride;
+	nbr_heap heap = NULL;
+	rank_entry *entries;
+
+	neighborhood = params->neighborhood;
+	if (neighborhood > 0)
+		heap = nbrHeapCreate(neighborhood);
+	entries = (rank_entry*) palloc(Max(builder->numVectors,1)*sizeof(rank_entry));
+
+	// A dense build works out the rows we'll want next along with
+	// each one, so it has to know which those are.
+	stride = params->numShards;
+	builder->rowStride = stride;
+
+	while (simTasksNext(tasks, worker, &t)) {
+		int end = params->shard + tasks->taskStart[t+1] * stride;
+
+		tasks->outputs[t].worker = worker;
+		tasks->outputs[t].first = out->count;
+
+		builder->rowEnd = Min(end, builder->numVectors);
+		for (i = params->shard + tasks->taskStart[t] * stride;
+				i < builder->rowEnd; i += stride) {
+			int numEntries = 0;
+			bool inorder = true;
+
+			numNeighbors = simBuilderRow(builder, i);
+
+			// A row that fits in the neighborhood is written as it is,
+			// and one that's already in order needs no sort.
+			if (!heap || numNeighbors <= neighborhood) {
+				for (k = 1; k < numNeighbors && inorder; k++)
+					inorder = (builder->rowIndex[k-1] < builder->rowIndex[k]);
+				if (inorder) {
+					for (k = 0; k < numNeighbors; k++)
+						emitSimilarity(out,IDs[i],IDs[builder->rowIndex[k]],
+							builder->rowSim[k]);
+				} else {
+					for (k = 0; k < numNeighbors; k++) {
+						entries[k].key = builder->rowIndex[k];
+						entries[k].value = builder->rowSim[k];
+					}
+					numEntries = numNeighbors;
+				}
+			} else {
+				nbrHeapReset(heap);
+				for (k = 0; k < numNeighbors; k++)
+					nbrHeapInsert(heap,builder->rowIndex[k],builder->rowSim[k]);
+				for (k = 0; k < heap->size; k++) {
+					entries[k].key = heap->index[k];
+					entries[k].value = heap->similarity[k];
+				}
+				numEntries = heap->size;
+			}
+
+			if (numEntries > 0) {
+				qsort(entries, numEntries, sizeof(rank_entry),
+					rankEntryKeyCompare);
+				for (k = 0; k < numEntries; k++)
+					emitSimilarity(out,IDs[i],IDs[entries[k].key],
+						entries[k].value);
+			}
+
+			// Only the backend itself can safely service interrupts.
+			if (worker == 0)
+				CHECK_FOR_INTERRUPTS();
+		}
+
+		tasks->outputs[t].count = out->count - tasks->outputs[t].first;
+
+		// Everyone counts their own rows, and the backend, which
+		// alone may write its status, reports them all.
+		((volatile sim_task_deque*) &tasks->deques[worker])->rowsDone +=
+			tasks->taskStart[t+1] - tasks->taskStart[t];
+		if (worker == 0) {
+			int64 done = 0;
+
+			for (k = 0; k < tasks->numDeques; k++)
+				done += ((volatile sim_task_deque*) &tasks->deques[k])->rowsDone;
+			pgstat_progress_update(done);
+		}
+	}
+
+	builder->rowStride = 1;
+	builder->rowEnd = builder->numVectors;
+
+	if (heap)
+		nbrHeapFree(heap);
+	pfree(entries);
+}
+
+/*
+ * Says how a builder is going to compute its rows, and why, in the
+ * build's parameters. A dense build is picked when multiplying whole
+ * rows costs little enough compared with pairing up co-rated events
+ * (see simBuilderMakeDense).
+ */
+static void
+simBuilderStrategy(sim_builder builder, sim_params *params) {
+	if (builder->lshBands > 0)
+		snprintf(params->strategy, RECATHON_STRATEGY_LEN,
+			"in memory, approximately: LSH with %d bands of %d rows, as lsh_bands asks",
+			builder->lshBands, params->lshRows);
+	else if (builder->numClusters > 0)
+		snprintf(params->strategy, RECATHON_STRATEGY_LEN,
+			"in memory, approximately: %d clusters of users, each compared with its %d nearest, as user_clusters asks",
+			builder->numClusters, builder->clusterProbes);
+	else if (builder->dense || builder->bits)
+		snprintf(params->strategy, RECATHON_STRATEGY_LEN,
+			"in memory, as a dense matrix: %d rows of %d columns, multiplying %.1f cells for every co-rated pair",
+			builder->numVectors, builder->numCols, builder->denseWork);
+	else if (builder->denseWork < 0)
+		snprintf(params->strategy, RECATHON_STRATEGY_LEN,
+			"in memory, from co-rated pairs: a dense matrix of %d rows of %d columns would be too big",
+			builder->numVectors, builder->numCols);
+	else if (builder->denseWork > 0)
+		snprintf(params->strategy, RECATHON_STRATEGY_LEN,
+			"in memory, from co-rated pairs: a dense matrix would multiply %.1f cells for every one, more than %d",
+			builder->denseWork, RECATHON_DENSE_ADVANTAGE);
+	else
+		snprintf(params->strategy, RECATHON_STRATEGY_LEN,
+			"in memory, from co-rated pairs");
+}
+
+/* ----------------------------------------------------------------
+ *		writeSimilarityModel
+ *
+ *		Computes a whole similarity model and inserts it
+ *		into the given model table. If numWorkers is more
+ *		than one, we fork that many processes less one,
+ *		each of which does the tasks it gets into a
+ *		temporary file of its own. The workers get
+ *		copy-on-write images of the rating vectors, and
+ *		never touch shared memory, the catalogs or the
+ *		client connection. We put our own share in a file
+ *		too, and once everyone's done, insert the tasks'
+ *		rows in task order, which is the model's key order.
+ *		Returns true if the model table was filled in that
+ *		order, so that its key needn't sort it.
+ * ----------------------------------------------------------------
+ */
+bool
+writeSimilarityModel(sim_builder builder, int *IDs, char *modelname,
+			sim_params *params) {
+	int t, w, numWorkers, numRows;
+	bool failed = false, sorted;
+	pid_t *pids;
+	FILE **parts;
+	sim_output out;
+	sim_tasks *tasks;
+
+	simBuilderSetPruning(builder, params);
+	simBuilderStrategy(builder, params);
+
+	numWorkers = params->numWorkers;
+	if (numWorkers < 1)
+		numWorkers = 1;
+	// No point in having workers with no rows.
+	numRows = (builder->numVectors > params->shard) ?
+		(builder->numVectors - params->shard + params->numShards - 1) /
+		params->numShards : 0;
+	if (numWorkers > numRows)
+		numWorkers = (numRows > 0) ? numRows : 1;
+
+	tasks = simTasksCreate(builder, params, numRows, numWorkers);
+	pids = (pid_t*) palloc0(numWorkers*sizeof(pid_t));
+	pgstat_progress_phase(RECBUILD_PHASE_SIMILARITY, numRows);
+
+	// With workers, our own share goes to a file like theirs.
+	out.writer = NULL;
+	out.fp = NULL;
+	out.count = 0;
+	if (numWorkers > 1) {
+		char partfile[MAXPGPATH];
+
+		snprintf(partfile,MAXPGPATH,"recathon_temp_%s.0.dat",modelname);
+		if ((out.fp = fopen(partfile,"w")) == NULL)
+			ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not create file \"%s\": %m",partfile)));
+	}
+
+	// Anything buffered now would otherwise be written twice.
+	fflush(stdout);
+	fflush(stderr);
+
+	PG_TRY();
+	{
+		for (w = 1; w < numWorkers; w++) {
+			char partfile[MAXPGPATH];
+			pid_t pid;
+
+			snprintf(partfile,MAXPGPATH,"recathon_temp_%s.%d.dat",modelname,w);
+
+			pid = fork();
+			if (pid < 0)
+				ereport(ERROR,
+					(errcode(ERRCODE_INSUFFICIENT_RESOURCES),
+					 errmsg("could not fork model build worker: %m")));
+
+			if (pid == 0) {
+				sim_output wout;
+
+				// We're the worker. Any error here has to end the
+				// process directly, since the backend's error
+				// handling isn't ours to use.
+				PG_TRY();
+				{
+					wout.writer = NULL;
+					wout.count = 0;
+					if ((wout.fp = fopen(partfile,"w")) == NULL)
+						_exit(1);
+					writeSimilarityRows(builder, IDs, &wout, w, tasks, params);
+					if (fclose(wout.fp) != 0)
+						_exit(1);
+				}
+				PG_CATCH();
+				{
+					_exit(1);
+				}
+				PG_END_TRY();
+				_exit(0);
+			}
+
+			pids[w] = pid;
+		}
+
+		// Meanwhile, we do our own share.
+		if (numWorkers == 1)
+			out.writer = modelWriterOpen(modelname);
+		writeSimilarityRows(builder, IDs, &out, 0, tasks, params);
+	}
+	PG_CATCH();
+	{
+		// Don't leave any workers behind.
+		for (w = 1; w < numWorkers; w++) {
+			if (pids[w] > 0) {
+				kill(pids[w], SIGKILL);
+				waitpid(pids[w], NULL, 0);
+			}
+		}
+		if (out.fp) {
+			char partfile[MAXPGPATH];
+
+			fclose(out.fp);
+			snprintf(partfile,MAXPGPATH,"recathon_temp_%s.0.dat",modelname);
+			unlink(partfile);
+		}
+		simTasksFree(tasks);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	if (numWorkers == 1) {
+		sorted = modelWriterClose(out.writer);
+		simTasksFree(tasks);
+		pfree(pids);
+		return sorted;
+	}
+
+	// Wait for the workers, and open everyone's results.
+	if (fclose(out.fp) != 0)
+		failed = true;
+	parts = (FILE**) palloc0(numWorkers*sizeof(FILE*));
+	for (w = 0; w < numWorkers; w++) {
+		char partfile[MAXPGPATH];
+		int status;
+
+		snprintf(partfile,MAXPGPATH,"recathon_temp_%s.%d.dat",modelname,w);
+
+		if (w > 0 && (waitpid(pids[w], &status, 0) < 0 ||
+				!WIFEXITED(status) || WEXITSTATUS(status) != 0))
+			failed = true;
+
+		if (!failed && (parts[w] = fopen(partfile,"r")) == NULL)
+			failed = true;
+
+		// It's open if we need it, and gone once we're done.
+		unlink(partfile);
+	}
+
+	// Insert the rows a task at a time, in task order.
+	out.writer = modelWriterOpen(modelname);
+	pgstat_progress_phase(RECBUILD_PHASE_WRITING, tasks->numTasks);
+	for (t = 0; t < tasks->numTasks && !failed; t++) {
+		sim_task_output *task = &tasks->outputs[t];
+		sim_record record;
+		int64 k;
+
+		pgstat_progress_update(t);
+		if (task->count == 0)
+			continue;
+		if (fseeko(parts[task->worker],
+				(off_t) task->first*sizeof(sim_record), SEEK_SET) != 0) {
+			failed = true;
+			break;
+		}
+		for (k = 0; k < task->count; k++) {
+			if (fread(&record,sizeof(sim_record),1,parts[task->worker]) != 1) {
+				failed = true;
+				break;
+			}
+			modelWriterInsert(out.writer, record.id1,
+				record.id2, record.similarity);
+		}
+	}
+
+	for (w = 0; w < numWorkers; w++)
+		if (parts[w])
+			fclose(parts[w]);
+	sorted = modelWriterClose(out.writer);
+	simTasksFree(tasks);
+	pfree(parts);
+	pfree(pids);
+
+	if (failed)
+		ereport(ERROR,
+			(errcode(ERRCODE_INTERNAL_ERROR),
+			 errmsg("a model build worker failed")));
+	return sorted;
+}
+
+/* ----------------------------------------------------------------
+ *		updateItemPearModel
+ *
+ *		Given a single cell of a recommender, this
+ *		function rebuilds the recModel for that cell, using
+ *		item-based collaborative filtering with Pearson
+ *		similarity, from the item rating vectors that
+ *		collectSimVectors gathered, which it frees. Returns
+ *		the number of events used.
+ * ----------------------------------------------------------------
+ */
+int
+updateItemPearModel(char *modelname, sim_vector *itemEvents, int *itemIDs,
+		float *itemAvgs,
+		float *itemPearsons, int numItems, bool update, sim_params *params) {
+	int i;
+	bool sorted;
+	sim_builder builder;
+	int numEvents = 0;
+	char *querystring;
+
+	// If this is us updating a cell as opposed to building
+	// a recommender, we need to drop the existing entries.
+	querystring = (char*) palloc(1024*sizeof(char));
+	if (update) {
+		sprintf(querystring,"DELETE FROM %s;",modelname);
+		recathon_queryExecute(querystring);
+	}
+
+	// The rating vectors already hold every event, so all that's
+	// left is to count them.
+	for (i = 0; i < numItems; i++)
+		if (itemEvents[i])
+			numEvents += itemEvents[i]->length;
+
+	// If we are updating an existing similarity model,
+	// we will want to drop the existing primary key
+	// constraint before loading it, to save time.
+	if (update) {
+		sprintf(querystring,"ALTER TABLE %s DROP CONSTRAINT %s_pkey;",
+					modelname,modelname);
+		recathon_utilityExecute(querystring);
+	}
+
+	// Compute the similarities and insert them straight into the
+	// model. The rows can be split across several worker processes.
+	builder = simBuilderCreate(itemEvents, numItems, itemPearsons, itemAvgs,
+		params->lshBands, params->lshRows);
+	sorted = writeSimilarityModel(builder, itemIDs, modelname, params);
+	simBuilderFree(builder);
+
+	// Now we add the primary key constraint. It's
+	// faster to add it after adding the data than
+	// having it incrementally updated.
+	addModelKey(modelname,"item1, item2",sorted);
+	pfree(querystring);
+
+	// Free up the rating vectors.
+	freeSimVectors(itemEvents, numItems);
+
+	// Return the number of events we used.
+	return numEvents;
+}
+
+/* ----------------------------------------------------------------
+ *		updateUserCosModel
+ *
+ *		Given a single cell of a recommender, this
+ *		function rebuilds the recModel for that cell, using
+ *		user-based collaborative filtering with cosine
+ *		similarity, from the user rating vectors that
+ *		collectSimVectors gathered, which it frees. Returns
+ *		the number of events used.
+ * ----------------------------------------------------------------
+ */
+int
+updateUserCosModel(char *modelname, sim_vector *userEvents, int *userIDs,
+		float *userLengths, int numUsers, bool update, sim_params *params) {
+	int i;
+	bool sorted;
+	sim_builder builder;
+	int numEvents = 0;
+	char *querystring;
+
+	// If this is us updating a cell as opposed to building
+	// a recommender, we need to drop the existing entries.
+	querystring = (char*) palloc(1024*sizeof(char));
+	if (update) {
+		sprintf(querystring,"DELETE FROM %s;",modelname);
+		recathon_queryExecute(querystring);
+	}
+
+	// The rating vectors already hold every event, so all that's
+	// left is to count them.
+	for (i = 0; i < numUsers; i++)
+		if (userEvents[i])
+			numEvents += userEvents[i]->length;
+
+	// If we are updating an existing similarity model,
+	// we will want to drop the existing primary key
+	// constraint before loading it, to save time.
+	if (update) {
+		sprintf(querystring,"ALTER TABLE %s DROP CONSTRAINT %s_pkey;",
+					modelname,modelname);
+		recathon_utilityExecute(querystring);
+	}
+
+	// Compute the similarities and insert them straight into the
+	// model. The rows can be split across several worker processes.
+	if (params->userClusters > 0)
+		builder = simBuilderCreateClustered(userEvents, numUsers, userLengths, NULL,
+			params->userClusters, params->clusterProbes);
+	else
+		builder = simBuilderCreate(userEvents, numUsers, userLengths, NULL,
+			params->lshBands, params->lshRows);
+	sorted = writeSimilarityModel(builder, userIDs, modelname, params);
+	simBuilderFree(builder);
+
+	// Now we add the primary key constraint. It's
+	// faster to add it after adding the data than
+	// having it incrementally updated.
+	addModelKey(modelname,"user1, user2",sorted);
+	pfree(querystring);
+
+	// Free up the rating vectors.
+	freeSimVectors(userEvents, numUsers);
+
+	// Return the number of events we used.
+	return numEvents;
+}
+
+/* ----------------------------------------------------------------
+ *		updateUserPearModel
+ *
+ *		Given a single cell of a recommender, this
+ *		function rebuilds the recModel for that cell, using
+ *		user-based collaborative filtering with Pearson
+ *		similarity, from the user rating vectors that
+ *		collectSimVectors gathered, which it frees. Returns
+ *		the number of events used.
+ * ----------------------------------------------------------------
+ */
+int
+updateUserPearModel(char *modelname, sim_vector *userEvents, int *userIDs,
+		float *userAvgs,
+		float *userPearsons, int numUsers, bool update, sim_params *params) {
+	int i;
+	bool sorted;
+	sim_builder builder;
+	int numEvents = 0;
+	char *querystring;
+
+	// If this is us updating a cell as opposed to building
+	// a recommender, we need to drop the existing entries.
+	querystring = (char*) palloc(1024*sizeof(char));
+	if (update) {
+		sprintf(querystring,"DELETE FROM %s;",modelname);
+		recathon_queryExecute(querystring);
+	}
+
+	// The rating vectors already hold every event, so all that's
+	// left is to count them.
+	for (i = 0; i < numUsers; i++)
+		if (userEvents[i])
+			numEvents += userEvents[i]->length;
+
+	// If we are updating an existing similarity model,
+	// we will want to drop the existing primary key
+	// constraint before loading it, to save time.
+	if (update) {
+		sprintf(querystring,"ALTER TABLE %s DROP CONSTRAINT %s_pkey;",
+					modelname,modelname);
+		recathon_utilityExecute(querystring);
+	}
+
+	// Compute the similarities and insert them straight into the
+	// model. The rows can be split across several worker processes.
+	if (params->userClusters > 0)
+		builder = simBuilderCreateClustered(userEvents, numUsers, userPearsons, userAvgs,
+			params->userClusters, params->clusterProbes);
+	else
+		builder = simBuilderCreate(userEvents, numUsers, userPearsons, userAvgs,
+			params->lshBands, params->lshRows);
+	sorted = writeSimilarityModel(builder, userIDs, modelname, params);
+	simBuilderFree(builder);
+
+	// Now we add the primary key constraint. It's
+	// faster to add it after adding the data than
+	// having it incrementally updated.
+	addModelKey(modelname,"user1, user2",sorted);
+	pfree(querystring);
+
+	// Free up the rating vectors.
+	freeSimVectors(userEvents, numUsers);
+
+	// Return the number of events we used.
+	return numEvents;
+}
+
+/* ----------------------------------------------------------------
+ *		estimateSimEvents
+ *
+ *		Estimates how many events a similarity build over an
+ *		events table will read, which decides how it's done.
+ *		We go by the planner's estimate of the table's size,
+ *		since counting it would mean another scan.
+ * ----------------------------------------------------------------
+ */
+static double
+estimateSimEvents(char *eventtable) {
+	double numEvents;
+	char *querystring;
+	QueryDesc *queryDesc;
+	MemoryContext recathoncontext;
+
+	querystring = (char*) palloc(1024*sizeof(char));
+	sprintf(querystring,"SELECT 1 FROM %s;",eventtable);
+	queryDesc = recathon_queryStart(querystring,&recathoncontext);
+	numEvents = queryDesc->plannedstmt->planTree->plan_rows;
+	recathon_queryEnd(queryDesc,recathoncontext);
+	pfree(querystring);
+
+	return numEvents;
+}
+
+/* ----------------------------------------------------------------
+ *		spillSimVector
+ *
+ *		Writes one finished rating vector to a build's
+ *		temporary file, along with its ID and its norm, and
+ *		its average for Pearson. For Jaccard, it's written
+ *		as a set. Its repeated events are combined first.
+ * ----------------------------------------------------------------
+ */
+static void
+spillSimVector(BufFile *file, int id, sim_vector vec, recMethod method) {
+	sim_spill_row row;
+	float *norms, *avgs = NULL;
+
+	simVectorCollapse(vec);
+	if (method == itemPearCF || method == userPearCF)
+		pearson_info(&vec, 1, &avgs, &norms);
+	else if (method == itemJaccardCF)
+		norms = jaccard_info(&vec, 1);
+	else
+		norms = vector_lengths(&vec, 1);
+
+	row.id = id;
+	row.length = vec->length;
+	row.norm = norms[0];
+	row.avg = avgs ? avgs[0] : 0.0;
+	pfree(norms);
+	if (avgs)
+		pfree(avgs);
+
+	if (BufFileWrite(file, &row, sizeof(row)) != sizeof(row) ||
+	    BufFileWrite(file, vec->id, vec->length*sizeof(int)) != vec->length*sizeof(int) ||
+	    BufFileWrite(file, vec->event, vec->length*sizeof(float)) != vec->length*sizeof(float))
+		ereport(ERROR,
+			(errcode_for_file_access(),
+			 errmsg("could not write to similarity build temporary file: %m")));
+}
+
+/* ----------------------------------------------------------------
+ *		readSpilledSimVector
+ *
+ *		Reads the next rating vector back from a build's
+ *		temporary file, sized exactly.
+ * ----------------------------------------------------------------
+ */
+static sim_vector
+readSpilledSimVector(BufFile *file, sim_spill_row *row) {
+	sim_vector vec;
+
+	if (BufFileRead(file, row, sizeof(*row)) != sizeof(*row))
+		ereport(ERROR,
+			(errcode_for_file_access(),
+			 errmsg("could not read from similarity build temporary file: %m")));
+
+	vec = (sim_vector) palloc(sizeof(struct sim_vector_t));
+	vec->length = row->length;
+	vec->maxlength = Max(row->length,1);
+	vec->packed = false;
+	vec->id = (int*) palloc(vec->maxlength*sizeof(int));
+	vec->event = (float*) palloc(vec->maxlength*sizeof(float));
+	if (BufFileRead(file, vec->id, row->length*sizeof(int)) != row->length*sizeof(int) ||
+	    BufFileRead(file, vec->event, row->length*sizeof(float)) != row->length*sizeof(float))
+		ereport(ERROR,
+			(errcode_for_file_access(),
+			 errmsg("could not read from similarity build temporary file: %m")));
+
+	return vec;
+}
+
+/* A blocked build's checkpoint, kept in the model directory so that it
+ * outlives the transaction doing the build, under a name that comes
+ * from its database and what it builds. The header says what's
+ * being built, from which events, cut into how many blocks, and how
+ * many of those are done; the model rows of the finished blocks follow,
+ * in the order they were written. The rows of a block go to disk before
+ * the header counts it, so whatever the header counts can be trusted,
+ * and anything after that is thrown away. */
+#define RECATHON_CHECKPOINT_MAGIC 0x52434b31
+#define RECATHON_CHECKPOINT_KEYLEN (5*NAMEDATALEN + 64)
+
+typedef struct build_checkpoint_header {
+	uint32		magic;
+	char		key[RECATHON_CHECKPOINT_KEYLEN];	/* method, columns and parameters */
+	uint64		fingerprint;	/* of every event read */
+	int		numEvents;
+	int		numRows;
+	int		numBlocks;
+	Size		budget;		/* maintenance_work_mem, which cut the blocks */
+	int		blocksDone;
+	int64		recordsDone;	/* rows written by those blocks */
+} build_checkpoint_header;
+
+typedef struct build_checkpoint_t {
+	FILE		*file;
+	char		*path;
+	build_checkpoint_header header;
+} *build_checkpoint;
+
+/* Checkpoints whose models are in, to remove once they're committed. */
+static List *recathon_finished_checkpoints = NIL;
+static bool recathon_checkpoint_callback_registered = false;
+
+/*
+ * What an event adds to the fingerprint of a build's events. They're
+ * summed, so it doesn't matter what order they're read in.
+ */
+static uint64
+eventFingerprint(int key, int other, float value) {
+	struct {
+		int key;
+		int other;
+		float value;
+	} event;
+
+	event.key = key;
+	event.other = other;
+	event.value = value;
+	return (uint64) DatumGetUInt32(hash_any((const unsigned char *) &event,
+		sizeof(event)));
+}
+
+/* ----------------------------------------------------------------
+ *		removeFinishedCheckpoints
+ *
+ *		Once the transaction that filled in a model commits,
+ *		its checkpoint isn't needed. If it aborts, it's kept,
+ *		so that the next try can pick up where this one
+ *		left off.
+ * ----------------------------------------------------------------
+ */
+static void
+removeFinishedCheckpoints(XactEvent event, void *arg) {
+	ListCell *lc;
+
+	if (event != XACT_EVENT_COMMIT && event != XACT_EVENT_ABORT &&
+	    event != XACT_EVENT_PREPARE)
+		return;
+
+	foreach(lc, recathon_finished_checkpoints) {
+		char *path = (char*) lfirst(lc);
+
+		if (event == XACT_EVENT_COMMIT && unlink(path) != 0 && errno != ENOENT)
+			ereport(WARNING,
+				(errcode_for_file_access(),
+				 errmsg("could not remove build checkpoint \"%s\": %m", path)));
+	}
+	list_free_deep(recathon_finished_checkpoints);
+	recathon_finished_checkpoints = NIL;
+}
+
+/* ----------------------------------------------------------------
+ *		openBuildCheckpoint
+ *
+ *		Finds the checkpoint of an earlier try at the same
+ *		build, from the same events cut into the same blocks,
+ *		and sends the rows of the blocks it finished to the
+ *		writer. Otherwise, or if there was none, it starts a
+ *		new one. Returns NULL if checkpoints are off.
+ * ----------------------------------------------------------------
+ */
+static build_checkpoint
+openBuildCheckpoint(char *key, uint64 fingerprint, int numEvents, int numRows,
+			int numBlocks, Size budget, model_writer writer) {
+	build_checkpoint ckpt;
+	build_checkpoint_header old;
+	char *path;
+	FILE *file;
+	uint32 hash;
+	int64 k;
+	LOCKTAG tag;
+	bool resume = false;
+
+	if (!recathon_build_checkpoints)
+		return NULL;
+
+	// Two sessions doing the same build at once can't share its
+	// checkpoint, so the second goes without. The lock goes with
+	// the transaction.
+	hash = DatumGetUInt32(hash_any((const unsigned char *) key, strlen(key)));
+	SET_LOCKTAG_ADVISORY(tag, MyDatabaseId, hash, RECATHON_CHECKPOINT_MAGIC, 3);
+	if (LockAcquire(&tag, ExclusiveLock, false, true) == LOCKACQUIRE_NOT_AVAIL) {
+		elog(DEBUG1, "another session is doing the same similarity build, so this one keeps no checkpoint");
+		return NULL;
+	}
+
+	if (mkdir(RECATHON_MODEL_DIR, S_IRWXU) != 0 && errno != EEXIST)
+		ereport(ERROR,
+			(errcode_for_file_access(),
+			 errmsg("could not create directory \"%s\": %m", RECATHON_MODEL_DIR)));
+	path = (char*) palloc(MAXPGPATH*sizeof(char));
+	snprintf(path, MAXPGPATH, "%s/build_%u_%08x.checkpoint", RECATHON_MODEL_DIR,
+		MyDatabaseId, hash);
+
+	ckpt = (build_checkpoint) palloc0(sizeof(struct build_checkpoint_t));
+	ckpt->path = path;
+	ckpt->header.magic = RECATHON_CHECKPOINT_MAGIC;
+	strlcpy(ckpt->header.key, key, RECATHON_CHECKPOINT_KEYLEN);
+	ckpt->header.fingerprint = fingerprint;
+	ckpt->header.numEvents = numEvents;
+	ckpt->header.numRows = numRows;
+	ckpt->header.numBlocks = numBlocks;
+	ckpt->header.budget = budget;
+
+	file = AllocateFile(path, "r+b");
+	if (file && fread(&old, sizeof(old), 1, file) == 1 &&
+	    old.magic == RECATHON_CHECKPOINT_MAGIC &&
+	    strncmp(old.key, key, RECATHON_CHECKPOINT_KEYLEN) == 0 &&
+	    old.fingerprint == fingerprint && old.numEvents == numEvents &&
+	    old.numRows == numRows && old.numBlocks == numBlocks &&
+	    old.budget == budget && old.blocksDone > 0 &&
+	    old.blocksDone <= numBlocks)
+		resume = true;
+
+	if (resume) {
+		sim_record record;
+
+		for (k = 0; k < old.recordsDone; k++) {
+			if (fread(&record,sizeof(sim_record),1,file) != 1) {
+				resume = false;
+				break;
+			}
+			modelWriterInsert(writer, record.id1, record.id2,
+				record.similarity);
+		}
+		// The writer has nothing it can take back, so a file
+		// that lets us down half way has to end the build.
+		if (!resume)
+			ereport(ERROR,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 errmsg("build checkpoint \"%s\" is truncated", path),
+				 errhint("Remove the file to build the model from the start.")));
+		ckpt->header.blocksDone = old.blocksDone;
+		ckpt->header.recordsDone = old.recordsDone;
+		elog(LOG, "resuming the similarity build from its checkpoint, after %d of %d blocks",
+			old.blocksDone, numBlocks);
+	} else {
+		if (file)
+			FreeFile(file);
+		file = AllocateFile(path, "w+b");
+		if (!file)
+			ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not create build checkpoint \"%s\": %m", path)));
+	}
+	ckpt->file = file;
+
+	// Drop whatever a block that didn't finish left, and write
+	// the header for this try.
+	if (fflush(file) != 0 ||
+	    ftruncate(fileno(file), (off_t) (sizeof(build_checkpoint_header) +
+			ckpt->header.recordsDone*sizeof(sim_record))) != 0 ||
+	    fseeko(file, 0, SEEK_SET) != 0 ||
+	    fwrite(&ckpt->header, sizeof(build_checkpoint_header), 1, file) != 1 ||
+	    fseeko(file, 0, SEEK_END) != 0)
+		ereport(ERROR,
+			(errcode_for_file_access(),
+			 errmsg("could not write build checkpoint \"%s\": %m", path)));
+	return ckpt;
+}
+
+/*
+ * Sends a row of the model to the writer, and to the checkpoint.
+ */
+static void
+checkpointInsert(model_writer writer, build_checkpoint ckpt, int id1, int id2,
+			float similarity) {
+	modelWriterInsert(writer, id1, id2, similarity);
+	if (ckpt) {
+		sim_record record;
+
+		record.id1 = id1;
+		record.id2 = id2;
+		record.similarity = similarity;
+		if (fwrite(&record,sizeof(sim_record),1,ckpt->file) != 1)
+			ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not write build checkpoint \"%s\": %m",
+					ckpt->path)));
+		ckpt->header.recordsDone++;
+	}
+}
+
+/* ----------------------------------------------------------------
+ *		checkpointBlockDone
+ *
+ *		Makes a finished block's rows durable, and only then
+ *		counts it in the header.
+ * ----------------------------------------------------------------
+ */
+static void
+checkpointBlockDone(build_checkpoint ckpt, int blocksDone) {
+	if (!ckpt)
+		return;
+
+	ckpt->header.blocksDone = blocksDone;
+	if (fflush(ckpt->file) != 0 || pg_fsync(fileno(ckpt->file)) != 0 ||
+	    fseeko(ckpt->file, 0, SEEK_SET) != 0 ||
+	    fwrite(&ckpt->header, sizeof(build_checkpoint_header), 1, ckpt->file) != 1 ||
+	    fflush(ckpt->file) != 0 || pg_fsync(fileno(ckpt->file)) != 0 ||
+	    fseeko(ckpt->file, 0, SEEK_END) != 0)
+		ereport(ERROR,
+			(errcode_for_file_access(),
+			 errmsg("could not write build checkpoint \"%s\": %m", ckpt->path)));
+}
+
+/* ----------------------------------------------------------------
+ *		closeBuildCheckpoint
+ *
+ *		Closes a checkpoint once the whole model is written,
+ *		and sees that it's removed when the transaction
+ *		commits.
+ * ----------------------------------------------------------------
+ */
+static void
+closeBuildCheckpoint(build_checkpoint ckpt) {
+	MemoryContext oldcontext;
+
+	if (!ckpt)
+		return;
+
+	if (FreeFile(ckpt->file) != 0)
+		ereport(ERROR,
+			(errcode_for_file_access(),
+			 errmsg("could not close build checkpoint \"%s\": %m", ckpt->path)));
+
+	if (!recathon_checkpoint_callback_registered) {
+		RegisterXactCallback(removeFinishedCheckpoints, NULL);
+		recathon_checkpoint_callback_registered = true;
+	}
+	oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+	recathon_finished_checkpoints = lappend(recathon_finished_checkpoints,
+		pstrdup(ckpt->path));
+	MemoryContextSwitchTo(oldcontext);
+
+	pfree(ckpt->path);
+	pfree(ckpt);
+}
+
+/* ----------------------------------------------------------------
+ *		updateBlockedSimModel
+ *
+ *		Builds a similarity model whose rating vectors don't
+ *		fit in maintenance_work_mem. The executor sorts the
+ *		events by key, spilling to disk as it needs to, and
+ *		we write each finished rating vector out to a
+ *		temporary file, dividing them into blocks that do
+ *		fit. Then we load one block at a time, and stream
+ *		it and every later row past it, so each pair is
+ *		compared once. A build of n blocks reads the file
+ *		about n/2 times, which is slow, but it finishes.
+ *		It's done in this process alone, and only for exact
+ *		builds. Each finished block is checkpointed, so a
+ *		build that's cancelled or crashes picks up again
+ *		from the last one it finished, if it's tried again
+ *		with the same events. Returns the number of events
+ *		used.
+ * ----------------------------------------------------------------
+ */
+static int
+updateBlockedSimModel(recMethod method, char *eventtable, char *userkey,
+		char *itemkey, char *eventval, char *modelname, sim_params *params) {
+	int i, j, k, a, numRows, numEvents, numBlocks, maxRows, maxBlocks;
+	int currentID;
+	int *IDs, *blockStart, *blockFile;
+	off_t *blockOffset;
+	bool itemside, pearson, jaccard, sorted;
+	char *key, *otherkey, *querystring;
+	char ckptkey[RECATHON_CHECKPOINT_KEYLEN];
+	uint64 fingerprint = 0;
+	Size budget, blockBytes;
+	BufFile *spill;
+	sim_vector current;
+	model_writer writer;
+	build_checkpoint ckpt;
+	// Query objects.
+	QueryDesc *queryDesc;
+	PlanState *planstate;
+	TupleTableSlot *slot;
+	MemoryContext recathoncontext;
+	tuple_column keycol, othercol, eventcol;
+
+	itemside = (method == itemCosCF || method == itemPearCF ||
+		    method == itemJaccardCF);
+	pearson = (method == itemPearCF || method == userPearCF);
+	jaccard = (method == itemJaccardCF);
+	key = itemside ? itemkey : userkey;
+	otherkey = itemside ? userkey : itemkey;
+	budget = (Size) maintenance_work_mem * 1024L;
+
+	maxRows = 1024;
+	maxBlocks = 16;
+	IDs = (int*) palloc(maxRows*sizeof(int));
+	blockStart = (int*) palloc((maxBlocks+1)*sizeof(int));
+	blockFile = (int*) palloc(maxBlocks*sizeof(int));
+	blockOffset = (off_t*) palloc(maxBlocks*sizeof(off_t));
+	numRows = 0;
+	numEvents = 0;
+	numBlocks = 0;
+	blockBytes = 0;
+	currentID = 0;
+
+	// First, write out every rating vector, in order of ID.
+	spill = BufFileCreateTemp(false);
+	current = createSimVector();
+
+	querystring = (char*) palloc(1024*sizeof(char));
+	sprintf(querystring,"SELECT %s,%s,%s FROM %s ORDER BY %s;",
+		key,otherkey,eventval,eventtable,key);
+	queryDesc = recathon_queryStart(querystring,&recathoncontext);
+	planstate = queryDesc->planstate;
+	bindColumn(&keycol, key);
+	bindColumn(&othercol, otherkey);
+	bindColumn(&eventcol, eventval);
+	pgstat_progress_phase(RECBUILD_PHASE_LOADING,
+		(int64) queryDesc->plannedstmt->planTree->plan_rows);
+
+	for (;;) {
+		int rowID = 0;
+		bool done;
+
+		slot = ExecProcNode(planstate);
+		done = TupIsNull(slot);
+		if (!done)
+			rowID = columnInt(slot,&keycol);
+
+		// Once we're past a vector, it's finished, so out it goes,
+		// starting a new block if this one is full.
+		if (current->length > 0 && (done || rowID != currentID)) {
+			Size rowBytes;
+
+			rowBytes = current->length * RECATHON_EVENT_BYTES +
+				RECATHON_ROW_BYTES + params->neighborhood * 2 * sizeof(float);
+			if (numBlocks == 0 || (blockBytes > 0 && blockBytes + rowBytes > budget)) {
+				if (numBlocks >= maxBlocks) {
+					maxBlocks *= 2;
+					blockStart = (int*) repalloc(blockStart, (maxBlocks+1)*sizeof(int));
+					blockFile = (int*) repalloc(blockFile, maxBlocks*sizeof(int));
+					blockOffset = (off_t*) repalloc(blockOffset, maxBlocks*sizeof(off_t));
+				}
+				blockStart[numBlocks] = numRows;
+				BufFileTell(spill, &blockFile[numBlocks], &blockOffset[numBlocks]);
+				numBlocks++;
+				blockBytes = 0;
+			}
+			blockBytes += rowBytes;
+
+			spillSimVector(spill, currentID, current, method);
+			if (numRows >= maxRows) {
+				maxRows *= 2;
+				IDs = (int*) repalloc(IDs, maxRows*sizeof(int));
+			}
+			IDs[numRows++] = currentID;
+			current->length = 0;
+		}
+		if (done) break;
+
+		currentID = rowID;
+		simVectorAppend(current, columnInt(slot,&othercol),
+			columnFloat(slot,&eventcol));
+		fingerprint += eventFingerprint(rowID,
+			current->id[current->length-1], current->event[current->length-1]);
+		if (++numEvents % RECATHON_PROGRESS_ROWS == 0)
+			pgstat_progress_update(numEvents);
+	}
+
+	recathon_queryEnd(queryDesc,recathoncontext);
+	freeSimVector(current);
+	blockStart[numBlocks] = numRows;
+
+	// Now we go a block at a time. Each row of the block is
+	// compared with the rows before it in the block, and every
+	// row after the block with all of it.
+	// An earlier try at this build may have done some blocks.
+	writer = modelWriterOpen(modelname);
+	snprintf(ckptkey, sizeof(ckptkey), "%d %s %s %s %s %d %d %g %d",
+		(int) method, eventtable, key, otherkey, eventval,
+		params->neighborhood, params->minSupport, params->minSimilarity,
+		recathon_duplicate_events);
+	ckpt = openBuildCheckpoint(ckptkey, fingerprint, numEvents, numRows,
+		numBlocks, budget, writer);
+	if (ckpt && ckpt->header.blocksDone > 0) {
+		int len = strlen(params->strategy);
+
+		snprintf(params->strategy + len, RECATHON_STRATEGY_LEN - len,
+			", resumed from a checkpoint after %d of %d blocks",
+			ckpt->header.blocksDone, numBlocks);
+	}
+	pgstat_progress_phase(RECBUILD_PHASE_SIMILARITY, numBlocks);
+	for (a = ckpt ? ckpt->header.blocksDone : 0; a < numBlocks; a++) {
+		int first, n;
+		float *norms, *avgs;
+		sim_vector *vectors;
+		nbr_heap *heaps = NULL;
+		sim_builder builder;
+
+		pgstat_progress_update(a);
+		first = blockStart[a];
+		n = blockStart[a+1] - first;
+
+		if (BufFileSeek(spill, blockFile[a], blockOffset[a], SEEK_SET) != 0)
+			ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not seek in similarity build temporary file: %m")));
+
+		vectors = (sim_vector*) palloc(Max(n,1)*sizeof(sim_vector));
+		norms = (float*) palloc(Max(n,1)*sizeof(float));
+		avgs = (float*) palloc(Max(n,1)*sizeof(float));
+		for (i = 0; i < n; i++) {
+			sim_spill_row row;
+
+			vectors[i] = readSpilledSimVector(spill, &row);
+			norms[i] = row.norm;
+			avgs[i] = row.avg;
+		}
+
+		if (jaccard)
+			builder = simBuilderCreateJaccard(vectors, n, norms, 0, 0);
+		else
+			builder = simBuilderCreate(vectors, n, norms, pearson ? avgs : NULL, 0, 0);
+		simBuilderSetPruning(builder, params);
+		if (params->neighborhood > 0) {
+			heaps = (nbr_heap*) palloc(n*sizeof(nbr_heap));
+			for (i = 0; i < n; i++)
+				heaps[i] = nbrHeapCreate(params->neighborhood);
+		}
+
+		// The file is now at the start of the next block, so the
+		// later rows follow on from the block's own.
+		for (j = first; j < numRows; j++) {
+			int numNeighbors, upto;
+			float norm, avg;
+			sim_vector vec;
+
+			if (j < first + n) {
+				vec = vectors[j - first];
+				norm = norms[j - first];
+				avg = avgs[j - first];
+				upto = j - first;
+			} else {
+				sim_spill_row row;
+
+				vec = readSpilledSimVector(spill, &row);
+				norm = row.norm;
+				avg = row.avg;
+				upto = n;
+			}
+
+			numNeighbors = simBuilderAgainst(builder, vec, norm, avg, upto);
+			for (k = 0; k < numNeighbors; k++) {
+				i = builder->rowIndex[k];
+				if (heaps)
+					nbrHeapInsert(heaps[i], j, builder->rowSim[k]);
+				else
+					checkpointInsert(writer, ckpt, IDs[first + i], IDs[j],
+						builder->rowSim[k]);
+			}
+
+			if (j >= first + n)
+				freeSimVector(vec);
+			CHECK_FOR_INTERRUPTS();
+		}
+
+		// A limited neighborhood is only known once every later
+		// row has been by.
+		if (heaps) {
+			for (i = 0; i < n; i++) {
+				for (k = 0; k < heaps[i]->size; k++)
+					checkpointInsert(writer, ckpt, IDs[first + i],
+						IDs[heaps[i]->index[k]], heaps[i]->similarity[k]);
+				nbrHeapFree(heaps[i]);
+			}
+			pfree(heaps);
+		}
+
+		simBuilderFree(builder);
+		for (i = 0; i < n; i++)
+			freeSimVector(vectors[i]);
+		pfree(vectors);
+		pfree(norms);
+		pfree(avgs);
+		checkpointBlockDone(ckpt, a+1);
+	}
+	sorted = modelWriterClose(writer);
+	closeBuildCheckpoint(ckpt);
+	BufFileClose(spill);
+
+	// Now we add the primary key constraint.
+	addModelKey(modelname, itemside ? "item1, item2" : "user1, user2", sorted);
+
+	pfree(querystring);
+	pfree(IDs);
+	pfree(blockStart);
+	pfree(blockFile);
+	pfree(blockOffset);
+
+	return numEvents;
+}
+
+/* ----------------------------------------------------------------
+ *		buildSimilarityModel
+ *
+ *		Fills in a new, empty similarity model for any of
+ *		the similarity methods. If the events fit in
+ *		maintenance_work_mem, or the build is approximate,
+ *		we gather them all and build the model in memory,
+ *		possibly in several workers. Each event is held while
+ *		it's collected, then in its rating vector, and again
+ *		in the co-occurrence transpose. Otherwise we build it
+ *		a block at a time. A build shared with other nodes,
+ *		or a shard of one, is always done in memory. Unless
+ *		we're told how many workers to use, a big enough
+ *		build uses recathon_parallel_workers of them. How it
+ *		was done, and why, is left in params->strategy.
+ *		Returns the number of events used.
+ * ----------------------------------------------------------------
+ */
+int
+buildSimilarityModel(recMethod method, char *eventtable, char *userkey,
+		char *itemkey, char *eventval, char *modelname, sim_params *params) {
+	int numVectors, numEvents;
+	int *IDs;
+	float *norms, *avgs;
+	double estimate;
+	bool itemside, autoWorkers = false;
+	sim_vector *vectors;
+
+	estimate = estimateSimEvents(eventtable);
+	if (params->numWorkers < 1) {
+		params->numWorkers = 1;
+		if (estimate >= RECATHON_PARALLEL_MIN_EVENTS)
+			params->numWorkers = Min(recathon_parallel_workers, RECATHON_MAX_WORKERS);
+		autoWorkers = true;
+	}
+
+	if (params->buildNodes && params->numShards == 1)
+		return buildDistributedSimModel(method, eventtable, userkey,
+			itemkey, eventval, modelname, params);
+
+	if (params->lshBands == 0 && params->userClusters == 0 && params->numShards == 1 &&
+			estimate * RECATHON_EVENT_BYTES > (double) maintenance_work_mem * 1024.0) {
+		snprintf(params->strategy, RECATHON_STRATEGY_LEN,
+			"in blocks: about %.0f events need about %.0f kB, more than maintenance_work_mem (%d kB)",
+			estimate, estimate * RECATHON_EVENT_BYTES / 1024.0, maintenance_work_mem);
+		elog(DEBUG1, "similarity model %s doesn't fit in maintenance_work_mem, building it in blocks",
+			modelname);
+		return updateBlockedSimModel(method, eventtable, userkey, itemkey,
+			eventval, modelname, params);
+	}
+
+	itemside = (method == itemCosCF || method == itemPearCF ||
+		    method == itemJaccardCF);
+	if (params->vectorStore)
+		vectors = loadStoredVectors(params->vectorStore,
+			itemside ? itemkey : userkey, itemside ? userkey : itemkey,
+			eventtable, eventval, &numVectors, &IDs, NULL);
+	else
+		vectors = collectSimVectors(itemside ? itemkey : userkey,
+			itemside ? userkey : itemkey, eventtable, eventval,
+			&numVectors, &IDs, NULL);
+
+	switch (method) {
+		case itemCosCF:
+			norms = vector_lengths(vectors, numVectors);
+			numEvents = updateItemCosModel(modelname, vectors, IDs, norms,
+				numVectors, false, params);
+			break;
+		case itemPearCF:
+			pearson_info(vectors, numVectors, &avgs, &norms);
+			numEvents = updateItemPearModel(modelname, vectors, IDs, avgs, norms,
+				numVectors, false, params);
+			break;
+		case itemJaccardCF:
+			norms = jaccard_info(vectors, numVectors);
+			numEvents = updateItemJaccardModel(modelname, vectors, IDs, norms,
+				numVectors, false, params);
+			break;
+		case userCosCF:
+			norms = vector_lengths(vectors, numVectors);
+			numEvents = updateUserCosModel(modelname, vectors, IDs, norms,
+				numVectors, false, params);
+			break;
+		case userPearCF:
+			pearson_info(vectors, numVectors, &avgs, &norms);
+			numEvents = updateUserPearModel(modelname, vectors, IDs, avgs, norms,
+				numVectors, false, params);
+			break;
+		default:
+			elog(ERROR, "recommendation method %d has no similarity model", (int) method);
+			return 0;
+	}
+
+	if (params->numWorkers > 1 && numVectors > 1) {
+		int len = strlen(params->strategy);
+
+		if (autoWorkers)
+			snprintf(params->strategy + len, RECATHON_STRATEGY_LEN - len,
+				", in up to %d processes, since it has about %.0f events",
+				params->numWorkers, estimate);
+		else
+			snprintf(params->strategy + len, RECATHON_STRATEGY_LEN - len,
+				", in up to %d processes, as parallel_workers asks",
+				params->numWorkers);
+	}
+
+	return numEvents;
+}
+
+/* ----------------------------------------------------------------
+ *		buildDistributedSimModel
+ *
+ *		Shares the build of a similarity model between this
+ *		node and the others in build_nodes, a list of libpq
+ *		connection strings separated by semicolons, through
+ *		dblink. Each node holds its own copy of the events
+ *		table, reads all of the rating vectors from it, and
+ *		computes every numShards'th row of the model as its
+ *		shard, with recathon_build_shard. We do shard 0
+ *		while the others run, then copy each of their
+ *		shards into the model here. Every node has to have
+ *		the same events, which we check by their number.
+ *		Returns the number of events used.
+ * ----------------------------------------------------------------
+ */
+static int
+buildDistributedSimModel(recMethod method, char *eventtable, char *userkey,
+		char *itemkey, char *eventval, char *modelname, sim_params *params) {
+	int k, numNodes, numEvents;
+	char **connnames;
+	List *nodes;
+	ListCell *lc;
+	sim_params localparams;
+	StringInfoData querystring, shardquery;
+	// Query objects.
+	QueryDesc *queryDesc;
+	TupleTableSlot *slot;
+	MemoryContext recathoncontext;
+
+	requireDblink("build_nodes");
+	nodes = splitNodeList(params->buildNodes);
+	numNodes = list_length(nodes);
+	snprintf(params->strategy, RECATHON_STRATEGY_LEN,
+		"shared with %d other nodes, as build_nodes asks", numNodes);
+
+	localparams = *params;
+	localparams.buildNodes = NULL;
+	localparams.shard = 0;
+	localparams.numShards = numNodes + 1;
+
+	// Start every other node on its shard. The shards are named
+	// after the model, which is new, so they can't clash.
+	connnames = (char**) palloc((numNodes+1)*sizeof(char*));
+	initStringInfo(&querystring);
+	initStringInfo(&shardquery);
+	k = 0;
+	foreach(lc, nodes) {
+		connnames[k] = (char*) palloc(NAMEDATALEN*sizeof(char));
+		snprintf(connnames[k],NAMEDATALEN,"recathon_node%d",k+1);
+
+		resetStringInfo(&querystring);
+		appendStringInfo(&querystring,"SELECT dblink_connect(%s, %s);",
+			quote_literal_cstr(connnames[k]),
+			quote_literal_cstr((char *) lfirst(lc)));
+		queryDesc = recathon_queryStart(querystring.data,&recathoncontext);
+		(void) ExecProcNode(queryDesc->planstate);
+		recathon_queryEnd(queryDesc,recathoncontext);
+
+		resetStringInfo(&shardquery);
+		appendStringInfo(&shardquery,"SELECT recathon_build_shard(%s, %s, %s, %s, %s, %s, %d, %d, %d, %d, %d, %d, %d, %f);",
+			quote_literal_cstr(simMethodName(method)),
+			quote_literal_cstr(eventtable),quote_literal_cstr(userkey),
+			quote_literal_cstr(itemkey),quote_literal_cstr(eventval),
+			quote_literal_cstr(modelname),k+1,numNodes+1,
+			params->neighborhood,params->lshBands,params->lshRows,
+			params->numWorkers,params->minSupport,params->minSimilarity);
+		resetStringInfo(&querystring);
+		appendStringInfo(&querystring,"SELECT dblink_send_query(%s, %s) AS sent;",
+			quote_literal_cstr(connnames[k]),
+			quote_literal_cstr(shardquery.data));
+		queryDesc = recathon_queryStart(querystring.data,&recathoncontext);
+		slot = ExecProcNode(queryDesc->planstate);
+		if (TupIsNull(slot) || getTupleInt(slot,"sent") != 1)
+			ereport(ERROR,
+				(errcode(ERRCODE_CONNECTION_FAILURE),
+				 errmsg("could not start the model build on node %d",k+1)));
+		recathon_queryEnd(queryDesc,recathoncontext);
+		k++;
+	}
+
+	// Our own shard.
+	numEvents = buildSimilarityModel(method, eventtable, userkey, itemkey,
+		eventval, modelname, &localparams);
+
+	// Wait for each of the others, and take its shard.
+	for (k = 0; k < numNodes; k++) {
+		int64 nodeEvents = -1;
+
+		resetStringInfo(&querystring);
+		appendStringInfo(&querystring,"SELECT numevents FROM dblink_get_result(%s) AS t(numevents bigint);",
+			quote_literal_cstr(connnames[k]));
+		queryDesc = recathon_queryStart(querystring.data,&recathoncontext);
+		slot = ExecProcNode(queryDesc->planstate);
+		if (!TupIsNull(slot))
+			nodeEvents = (int64) getTupleInt(slot,"numevents");
+		recathon_queryEnd(queryDesc,recathoncontext);
+		// The connection isn't free again until it has given us
+		// its empty result.
+		queryDesc = recathon_queryStart(querystring.data,&recathoncontext);
+		(void) ExecProcNode(queryDesc->planstate);
+		recathon_queryEnd(queryDesc,recathoncontext);
+
+		if (nodeEvents != numEvents)
+			ereport(ERROR,
+				(errcode(ERRCODE_DATA_EXCEPTION),
+				 errmsg("node %d built its shard of the model from %ld events, but this node has %d",
+					k+1, (long) nodeEvents, numEvents),
+				 errhint("Every node in build_nodes needs the same copy of table \"%s\".",
+					eventtable)));
+
+		resetStringInfo(&shardquery);
+		appendStringInfo(&shardquery,"SELECT * FROM %s",modelname);
+		resetStringInfo(&querystring);
+		appendStringInfo(&querystring,"INSERT INTO %s SELECT * FROM dblink(%s, %s) AS t(id1 integer, id2 integer, similarity real);",
+			modelname,quote_literal_cstr(connnames[k]),
+			quote_literal_cstr(shardquery.data));
+		recathon_queryExecute(querystring.data);
+
+		resetStringInfo(&shardquery);
+		appendStringInfo(&shardquery,"DROP TABLE %s",modelname);
+		resetStringInfo(&querystring);
+		appendStringInfo(&querystring,"SELECT dblink_exec(%s, %s);",
+			quote_literal_cstr(connnames[k]),
+			quote_literal_cstr(shardquery.data));
+		queryDesc = recathon_queryStart(querystring.data,&recathoncontext);
+		(void) ExecProcNode(queryDesc->planstate);
+		recathon_queryEnd(queryDesc,recathoncontext);
+
+		resetStringInfo(&querystring);
+		appendStringInfo(&querystring,"SELECT dblink_disconnect(%s);",
+			quote_literal_cstr(connnames[k]));
+		queryDesc = recathon_queryStart(querystring.data,&recathoncontext);
+		(void) ExecProcNode(queryDesc->planstate);
+		recathon_queryEnd(queryDesc,recathoncontext);
+
+		pfree(connnames[k]);
+	}
+	CommandCounterIncrement();
+
+	pfree(connnames);
+	list_free_deep(nodes);
+	pfree(querystring.data);
+	pfree(shardquery.data);
+
+	return numEvents;
+}
+
+/* ----------------------------------------------------------------
+ *		requireDblink
+ *
+ *		Makes sure dblink, which the connections to other
+ *		nodes go through, is installed in this database,
+ *		complaining about option if it isn't.
+ * ----------------------------------------------------------------
+ */
+static void
+requireDblink(char *option) {
+	bool haveDblink;
+	QueryDesc *queryDesc;
+	TupleTableSlot *slot;
+	MemoryContext recathoncontext;
+
+	queryDesc = recathon_queryStart("SELECT 1 FROM pg_proc WHERE proname = 'dblink_send_query';",
+		&recathoncontext);
+	slot = ExecProcNode(queryDesc->planstate);
+	haveDblink = !TupIsNull(slot);
+	recathon_queryEnd(queryDesc,recathoncontext);
+	if (!haveDblink)
+		ereport(ERROR,
+			(errcode(ERRCODE_UNDEFINED_FUNCTION),
+			 errmsg("option \"%s\" needs the dblink extension", option),
+			 errhint("Run CREATE EXTENSION dblink in this database.")));
+}
+
+/* ----------------------------------------------------------------
+ *		splitNodeList
+ *
+ *		Splits a list of libpq connection strings, separated
+ *		by semicolons, into a List of copies of them, leaving
+ *		out empty ones.
+ * ----------------------------------------------------------------
+ */
+static List *
+splitNodeList(char *nodelist) {
+	char *copy, *node, *saveptr;
+	List *nodes = NIL;
+
+	copy = pstrdup(nodelist);
+	for (node = strtok_r(copy, ";", &saveptr); node;
+			node = strtok_r(NULL, ";", &saveptr)) {
+		while (isspace((unsigned char) *node))
+			node++;
+		if (*node != '\0')
+			nodes = lappend(nodes, pstrdup(node));
+	}
+	pfree(copy);
+	return nodes;
+}
+
+/* ----------------------------------------------------------------
+ *		distinctIDs
+ *
+ *		Gathers a list of IDs into one sorted list, without
+ *		duplicates. Returns the number of distinct IDs.
+ * ----------------------------------------------------------------
+ */
+static int
+distinctIDs(int *IDs, int n, int **ret_IDs) {
+	int k, numIDs;
+	int *sorted;
+
+	sorted = (int*) palloc((n+1)*sizeof(int));
+	memcpy(sorted, IDs, n*sizeof(int));
+	qsort(sorted, n, sizeof(int), intCompare);
+
+	numIDs = 0;
+	for (k = 0; k < n; k++) {
+		if (numIDs > 0 && sorted[numIDs-1] == sorted[k])
+			continue;
+		sorted[numIDs++] = sorted[k];
+	}
+
+	(*ret_IDs) = sorted;
+	return numIDs;
+}
+
+/* ----------------------------------------------------------------
+ *		SVDevents
+ *
+ *		Reads all of the events for SVD training into one
+ *		svd_events structure, with readEvents. The user and item lists come from the
+ *		events themselves, and the IDs are turned into
+ *		indexes in those lists. The events are put in order
+ *		of user in memory, and residuals start at zero.
+ * ----------------------------------------------------------------
+ */
+svd_events
+SVDevents(char *userkey, char *itemkey, char *eventtable, char *eventval,
+		int **ret_userIDs, int **ret_itemIDs, int *ret_numUsers,
+		int *ret_numItems) {
+	int i, numEvents, numUsers, numItems;
+	int *userIDs, *itemIDs, *userStart;
+	int *users, *items;
+	float *values;
+	svd_events events;
+
+	// Let's acquire all of our events and store them, in whatever
+	// order the table gives them to us.
+	numEvents = readEvents(userkey, itemkey, eventtable, eventval,
+		&users, &items, &values);
+
+	// Now we can get our lists of users and items, and convert
+	// IDs to indexes in them, which makes our lives easier.
+	numUsers = distinctIDs(users, numEvents, &userIDs);
+	numItems = distinctIDs(items, numEvents, &itemIDs);
+	for (i = 0; i < numEvents; i++) {
+		users[i] = binarySearch(userIDs,users[i],0,numUsers);
+		items[i] = binarySearch(itemIDs,items[i],0,numItems);
+	}
+
+	// Training shards the events into ranges, so we keep each
+	// user's events together. A counting sort does it in one pass.
+	userStart = (int*) palloc0((numUsers+1)*sizeof(int));
+	for (i = 0; i < numEvents; i++)
+		userStart[users[i]+1]++;
+	for (i = 0; i < numUsers; i++)
+		userStart[i+1] += userStart[i];
+
+	events = (svd_events) palloc(sizeof(struct svd_events_t));
+	events->numEvents = numEvents;
+	events->userid = (int*) palloc(Max(numEvents,1)*sizeof(int));
+	events->itemid = (int*) palloc(Max(numEvents,1)*sizeof(int));
+	events->event = (float*) palloc(Max(numEvents,1)*sizeof(float));
+	events->residual = (float*) palloc0(Max(numEvents,1)*sizeof(float));
+	events->trailing = (float*) palloc0(Max(numEvents,1)*sizeof(float));
+	for (i = 0; i < numEvents; i++) {
+		int k = userStart[users[i]]++;
+
+		events->userid[k] = users[i];
+		events->itemid[k] = items[i];
+		events->event[k] = values[i];
+	}
+
+	// The counting sort kept each user's events in the order we read
+	// them, so their repeated items can be combined now. Each user's
+	// events end where the next one's used to start.
+	if (recathon_duplicate_events != RECATHON_DUPLICATES_KEEP) {
+		int start = 0, kept = 0;
+
+		for (i = 0; i < numUsers; i++) {
+			int k, length;
+
+			sortEvents(events->itemid + start, events->event + start,
+				userStart[i] - start);
+			length = collapseEvents(events->itemid + start, events->event + start,
+				userStart[i] - start);
+			memmove(events->itemid + kept, events->itemid + start, length*sizeof(int));
+			memmove(events->event + kept, events->event + start, length*sizeof(float));
+			for (k = kept; k < kept + length; k++)
+				events->userid[k] = i;
+			kept += length;
+			start = userStart[i];
+		}
+		events->numEvents = kept;
+	}
+
+	pfree(userStart);
+	pfree(users);
+	pfree(items);
+	pfree(values);
+
+	(*ret_userIDs) = userIDs;
+	(*ret_itemIDs) = itemIDs;
+	(*ret_numUsers) = numUsers;
+	(*ret_numItems) = numItems;
+	return events;
+}
+
+/* ----------------------------------------------------------------
+ *		freeSVDevents
+ *
+ *		Frees an svd_events structure.
+ * ----------------------------------------------------------------
+ */
+void
+freeSVDevents(svd_events events) {
+	pfree(events->userid);
+	pfree(events->itemid);
+	pfree(events->event);
+	pfree(events->residual);
+	pfree(events->trailing);
+	pfree(events);
+}
+
+/* ----------------------------------------------------------------
+ *		SVDaverages
+ *
+ *		This function generates some event averages which
+ *		are used as starting points for our SVD, from the
+ *		events SVDevents read. This needs to be done once
+ *		per cell. Borrowed from Simon Funk.
+ * ----------------------------------------------------------------
+ */
+void
+SVDaverages(svd_events events, int numUsers, int numItems,
+		float **ret_itemAvgs, float **ret_userOffsets) {
+	int i;
+	int *userCounts, *itemCounts;
+	float *userAvgs, *itemAvgs;
+	float *itemSums;
+	float *itemSqs; // Squares of sums. Used to calculate variances.
+	float *itemVars; // Variances.
+	float globalAvg;
+	float globalSum = 0.0;
+	float globalAvgSum = 0.0;
+	float globalSq = 0.0;
+	float globalVar;
+
+	// Initialize arrays.
+	itemCounts = (int*) palloc0((numItems+1)*sizeof(int));
+	itemAvgs = (float*) palloc((numItems+1)*sizeof(float));
+	itemSums = (float*) palloc0((numItems+1)*sizeof(float));
+	itemSqs = (float*) palloc0((numItems+1)*sizeof(float));
+	itemVars = (float*) palloc((numItems+1)*sizeof(float));
+
+	for (i = 0; i < events->numEvents; i++) {
+		int itemindex = events->itemid[i];
+		float event = events->event[i];
+
+		itemCounts[itemindex] += 1;
+		itemSums[itemindex] += event;
+		itemSqs[itemindex] += (event*event);
+	}
+
+	// We have enough data to calculate individual item variances.
+	for (i = 0; i < numItems; i++) {
+		float sum, sumsqr;
+		int n;
+
+		n = itemCounts[i];
+		sum = itemSums[i];
+		sumsqr = itemSqs[i];
+
+		if (n <= 0)
+			itemVars[i] = 0;
+		else
+			itemVars[i] = (sumsqr - ((sum*sum)/n))/n;
+
+		// We can also start calculating the global variance in this loop.
+		// Some notation abuse.
+		globalSum += sum;
+		if (n > 0) {
+			sum = sum/n;
+			globalAvgSum += sum;
+			globalSq += (sum*sum);
+		}
+	}
+
+	// Now we derive the global variance.
+	globalVar = (numItems > 0) ?
+		(globalSq - ((globalAvgSum*globalAvgSum)/numItems))/numItems : 0;
+	globalAvg = (events->numEvents > 0) ? globalSum/events->numEvents : 0;
+
+	// Finally, we can obtain the baseline averages for each item.
+	for (i = 0; i < numItems; i++) {
+		float k;
+
+		if (globalVar == 0)
+			k = 0;
+		else
+			k = itemVars[i] / globalVar;
+
+		if ((k + itemCounts[i]) > 0)
+			itemAvgs[i] = ((globalAvg*k) + itemSums[i]) / (k + itemCounts[i]);
+		else
+			itemAvgs[i] = 0;
+	}
+
+	// With the averages calculated, we can now calculate the average offset
+	// for each user, from the same events.
+	userCounts = (int*) palloc0((numUsers+1)*sizeof(int));
+	userAvgs = (float*) palloc0((numUsers+1)*sizeof(float));
+
+	for (i = 0; i < events->numEvents; i++) {
+		int userindex = events->userid[i];
+
+		// We need to find the average offset of a user's event from
+		// the average event.
+		userCounts[userindex] += 1;
+		userAvgs[userindex] += events->event[i] - itemAvgs[events->itemid[i]];
+	}
+
+	// Now we just divide by the counts.
+	for (i = 0; i < numUsers; i++) {
+		if (userCounts[i] > 0)
+			userAvgs[i] /= userCounts[i];
+		else
+			userAvgs[i] = 0;
+	}
+
+	// Free up memory.
+	pfree(itemCounts);
+	pfree(itemSums);
+	pfree(itemSqs);
+	pfree(itemVars);
+	pfree(userCounts);
+
+	// With that information calculated, we can finally return.
+	(*ret_itemAvgs) = itemAvgs;
+	(*ret_userOffsets) = userAvgs;
+}
+
+/* ----------------------------------------------------------------
+ *		factorDot
+ *
+ *		Returns the dot product of two factor vectors of
+ *		length n. This is the inner loop of all SVD and ALS
+ *		scoring, so it's vectorized where the compiler
+ *		targets AVX2, SSE or NEON.
+ * ----------------------------------------------------------------
+ */
+static float
+factorDot(const float *a, const float *b, int n) {
+	int i = 0;
+	float sum = 0.0;
+#if defined(RECATHON_USE_AVX2)
+	float lanes[8];
+	__m256 acc = _mm256_setzero_ps();
+
+	for (; i + 8 <= n; i += 8) {
+#ifdef __FMA__
+		acc = _mm256_fmadd_ps(_mm256_loadu_ps(a+i), _mm256_loadu_ps(b+i), acc);
+#else
+		acc = _mm256_add_ps(acc,
+			_mm256_mul_ps(_mm256_loadu_ps(a+i), _mm256_loadu_ps(b+i)));
+#endif
+	}
+	_mm256_storeu_ps(lanes, acc);
+	sum = ((lanes[0] + lanes[1]) + (lanes[2] + lanes[3])) +
+		((lanes[4] + lanes[5]) + (lanes[6] + lanes[7]));
+#elif defined(RECATHON_USE_SSE)
+	float lanes[4];
+	__m128 acc = _mm_setzero_ps();
+
+	for (; i + 4 <= n; i += 4)
+		acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(a+i), _mm_loadu_ps(b+i)));
+	_mm_storeu_ps(lanes, acc);
+	sum = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+#elif defined(RECATHON_USE_NEON)
+	float lanes[4];
+	float32x4_t acc = vdupq_n_f32(0.0f);
+
+	for (; i + 4 <= n; i += 4)
+		acc = vmlaq_f32(acc, vld1q_f32(a+i), vld1q_f32(b+i));
+	vst1q_f32(lanes, acc);
+	sum = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+#endif
+
+	for (; i < n; i++)
+		sum += a[i] * b[i];
+
+	return sum;
+}
+
+/* ----------------------------------------------------------------
+ *		factorDotHalf
+ *
+ *		factorDot, where the second vector is in half
+ *		precision. With F16C the halves are widened eight at a
+ *		time on their way into the sum.
+ * ----------------------------------------------------------------
+ */
+static float
+factorDotHalf(const float *a, const uint16 *b, int n) {
+	int i = 0;
+	float sum = 0.0;
+#if defined(RECATHON_USE_AVX2) && defined(__F16C__)
+	float lanes[8];
+	__m256 acc = _mm256_setzero_ps();
+
+	for (; i + 8 <= n; i += 8) {
+		__m256 vb = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*) (b+i)));
+
+#ifdef __FMA__
+		acc = _mm256_fmadd_ps(_mm256_loadu_ps(a+i), vb, acc);
+#else
+		acc = _mm256_add_ps(acc, _mm256_mul_ps(_mm256_loadu_ps(a+i), vb));
+#endif
+	}
+	_mm256_storeu_ps(lanes, acc);
+	sum = ((lanes[0] + lanes[1]) + (lanes[2] + lanes[3])) +
+		((lanes[4] + lanes[5]) + (lanes[6] + lanes[7]));
+#endif
+
+	for (; i < n; i++)
+		sum += a[i] * halfToFloat(b[i]);
+
+	return sum;
+}
+
+/* ----------------------------------------------------------------
+ *		factorAxpy
+ *
+ *		Adds alpha times x into y, for vectors of length n.
+ *		Vectorized the same way as factorDot.
+ * ----------------------------------------------------------------
+ */
+static void
+factorAxpy(float alpha, const float *x, float *y, int n) {
+	int i = 0;
+#if defined(RECATHON_USE_AVX2)
+	__m256 va = _mm256_set1_ps(alpha);
+
+	for (; i + 8 <= n; i += 8) {
+#ifdef __FMA__
+		_mm256_storeu_ps(y+i,
+			_mm256_fmadd_ps(va, _mm256_loadu_ps(x+i), _mm256_loadu_ps(y+i)));
+#else
+		_mm256_storeu_ps(y+i, _mm256_add_ps(_mm256_loadu_ps(y+i),
+			_mm256_mul_ps(va, _mm256_loadu_ps(x+i))));
+#endif
+	}
+#elif defined(RECATHON_USE_SSE)
+	__m128 va = _mm_set1_ps(alpha);
+
+	for (; i + 4 <= n; i += 4)
+		_mm_storeu_ps(y+i, _mm_add_ps(_mm_loadu_ps(y+i),
+			_mm_mul_ps(va, _mm_loadu_ps(x+i))));
+#elif defined(RECATHON_USE_NEON)
+	float32x4_t va = vdupq_n_f32(alpha);
+
+	for (; i + 4 <= n; i += 4)
+		vst1q_f32(y+i, vmlaq_f32(vld1q_f32(y+i), va, vld1q_f32(x+i)));
+#endif
+
+	for (; i < n; i++)
+		y[i] += alpha * x[i];
+}
+
+/* ----------------------------------------------------------------
+ *		predictRating
+ *
+ *		This function gives a rating prediction based on
+ *		our SVD models. Used for training only. The vectors
+ *		are a user's and an item's rows of the factor
+ *		matrices.
+ * ----------------------------------------------------------------
+ */
+float
+predictRating(int featurenum, int numFeatures, float *userVec,
+		float *itemVec, float residual) {
+	return residual + factorDot(userVec + featurenum, itemVec + featurenum,
+		numFeatures - featurenum);
+}
+
+/* ----------------------------------------------------------------
+ *		allocFeatures
+ *
+ *		Allocates a row-major factor matrix of n rows with
+ *		numFeatures features each, all set to the starting
+ *		value of 0.1. If shared is true, the matrix is an
+ *		anonymous shared mapping, so that forked training
+ *		workers update the same features we do.
+ * ----------------------------------------------------------------
+ */
+static float*
+allocFeatures(int numFeatures, int n, bool shared) {
+	Size i;
+	float *features;
+	Size numValues = (Size) numFeatures * n;
+
+	if (shared) {
+		// mmap doesn't like zero-length mappings.
+		features = (float*) mmap(NULL, Max(numValues,1)*sizeof(float),
+				PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+		if (features == (float*) MAP_FAILED)
+			ereport(ERROR,
+				(errcode(ERRCODE_OUT_OF_MEMORY),
+				 errmsg("could not map memory for SVD features: %m")));
+	} else
+		features = (float*) palloc(Max(numValues,1)*sizeof(float));
+
+	for (i = 0; i < numValues; i++)
+		features[i] = 0.1;
+
+	return features;
+}
+
+/* ----------------------------------------------------------------
+ *		freeFeatures
+ *
+ *		Frees features made by allocFeatures.
+ * ----------------------------------------------------------------
+ */
+static void
+freeFeatures(float *features, int numFeatures, int n, bool shared) {
+	Size numValues = (Size) numFeatures * n;
+
+	if (shared)
+		munmap(features, Max(numValues,1)*sizeof(float));
+	else
+		pfree(features);
+}
+
+/* An item's place among the others, by its number of events. */
+typedef struct item_rank {
+	int		events;
+	int		index;
+} item_rank;
+
+/* Comparison function for sorting items most events first. */
+static int
+itemRankCompare(const void *a, const void *b) {
+	const item_rank *rank1 = (const item_rank*) a;
+	const item_rank *rank2 = (const item_rank*) b;
+
+	if (rank1->events != rank2->events)
+		return rank2->events - rank1->events;
+	return rank1->index - rank2->index;
+}
+
+/* ----------------------------------------------------------------
+ *		orderItemsByEvents
+ *
+ *		Training reads an item's factors for every event it
+ *		has, in the order of the users, so the items with the
+ *		most events are read all the time, from all over the
+ *		item factors. If those don't fit in cache anyway, we
+ *		renumber the items in events most events first, so
+ *		the ones read most often share the same stretch of
+ *		memory. Returns the order, where order[r] is the item
+ *		index now numbered r, or NULL if we left them alone.
+ *		Features trained in that order have to be put back in
+ *		item order before they're written; see
+ *		permuteItemFactors.
+ * ----------------------------------------------------------------
+ */
+static int*
+orderItemsByEvents(svd_events events, int numItems, int numFeatures) {
+	int i;
+	int *order, *rank;
+	item_rank *ranks;
+
+	if ((Size) numItems * numFeatures * sizeof(float) <= RECATHON_ITEM_ORDER_BYTES)
+		return NULL;
+
+	ranks = (item_rank*) palloc(numItems*sizeof(item_rank));
+	for (i = 0; i < numItems; i++) {
+		ranks[i].events = 0;
+		ranks[i].index = i;
+	}
+	for (i = 0; i < events->numEvents; i++)
+		if (events->itemid[i] >= 0)
+			ranks[events->itemid[i]].events++;
+	qsort(ranks, numItems, sizeof(item_rank), itemRankCompare);
+
+	order = (int*) palloc(numItems*sizeof(int));
+	rank = (int*) palloc(numItems*sizeof(int));
+	for (i = 0; i < numItems; i++) {
+		order[i] = ranks[i].index;
+		rank[ranks[i].index] = i;
+	}
+	for (i = 0; i < events->numEvents; i++)
+		if (events->itemid[i] >= 0)
+			events->itemid[i] = rank[events->itemid[i]];
+
+	pfree(rank);
+	pfree(ranks);
+	return order;
+}
+
+/* ----------------------------------------------------------------
+ *		permuteItemFactors
+ *
+ *		Moves the rows of an item factor matrix into the
+ *		order orderItemsByEvents gave, if toRanks is set, or
+ *		back into item order if not.
+ * ----------------------------------------------------------------
+ */
+static void
+permuteItemFactors(float *features, int *order, int numItems,
+		int numFeatures, bool toRanks) {
+	int r;
+	Size rowBytes = numFeatures*sizeof(float);
+	float *moved;
+
+	moved = (float*) palloc(Max((Size) numItems * rowBytes, 1));
+	for (r = 0; r < numItems; r++) {
+		if (toRanks)
+			memcpy(moved + (Size) r * numFeatures,
+				features + (Size) order[r] * numFeatures, rowBytes);
+		else
+			memcpy(moved + (Size) order[r] * numFeatures,
+				features + (Size) r * numFeatures, rowBytes);
+	}
+	memcpy(features, moved, (Size) numItems * rowBytes);
+	pfree(moved);
+}
+
+/* ----------------------------------------------------------------
+ *		SVDtrainEvents
+ *
+ *		Runs gradient descent over events first through
+ *		last-1. The residuals for those events are ours
+ *		alone, but the features may be shared with other
+ *		workers running over other events at the same time.
+ *		We don't lock them; with ratings as sparse as ours,
+ *		two workers rarely touch the same user and item at
+ *		once, and a lost update now and then doesn't hurt
+ *		convergence. This runs in forked workers too, so
+ *		it mustn't allocate memory or report errors, and
+ *		only checks for interrupts if asked to.
+ *
+ *		With a tolerance, a feature stops training once an
+ *		epoch improves its RMSE by less than that. Its
+ *		values still count towards the residuals of later
+ *		features, and we stop altogether once every feature
+ *		has converged.
+ *
+ *		A prediction needs every feature, but only one changes
+ *		at a time, so rather than taking the whole dot product
+ *		for each feature (see predictRating), we keep the sum
+ *		of the features after it for each event. It's taken
+ *		once an epoch, and each feature's term comes off it
+ *		just before we get to that feature, which makes an
+ *		epoch linear in the number of features.
+ *
+ *		Training that was warm started goes from the features
+ *		it was given from its first epoch, and can tell from
+ *		then on whether it's converged.
+ * ----------------------------------------------------------------
+ */
+static void
+SVDtrainEvents(svd_events events, int first, int last, svd_params *params,
+		float *userFeatures, float *itemFeatures,
+		float *itemAvgs, float *userOffsets, bool interruptible) {
+	int i, j, k;
+	int numFeatures = params->numFeatures;
+	int numConverged = 0;
+	int settling = params->warmStart ? 0 : 1;
+	bool converged[RECATHON_MAX_FEATURES];
+	double lastRMSE[RECATHON_MAX_FEATURES];
+
+	for (i = 0; i < numFeatures; i++)
+		converged[i] = false;
+
+	for (j = 0; j < params->maxEpochs; j++) {
+		for (i = 0; i < numFeatures; i++) {
+			float learn = params->learnRate;
+			float penalty = params->penalty;
+			double sqerr = 0.0;
+			double rmse;
+
+			if (converged[i]) {
+				// Just keep the residuals up to date.
+				for (k = first; k < last; k++) {
+					float *userVec, *itemVec;
+
+					userVec = userFeatures + (Size) events->userid[k] * numFeatures;
+					itemVec = itemFeatures + (Size) events->itemid[k] * numFeatures;
+					if (i == 0) {
+						events->residual[k] = userVec[i] * itemVec[i];
+						events->trailing[k] = factorDot(userVec + 1, itemVec + 1,
+							numFeatures - 1);
+					} else
+						events->residual[k] += userVec[i] * itemVec[i];
+					if (i + 1 < numFeatures)
+						events->trailing[k] -= userVec[i+1] * itemVec[i+1];
+				}
+				continue;
+			}
+
+			for (k = first; k < last; k++) {
+				int userid;
+				int itemid;
+				float event, err, residual, temp;
+				float *userVec, *itemVec;
+
+				userid = events->userid[k];
+				itemid = events->itemid[k];
+				event = events->event[k];
+				userVec = userFeatures + (Size) userid * numFeatures;
+				itemVec = itemFeatures + (Size) itemid * numFeatures;
+				// Need to reset residuals for each new
+				// iteration of the trainer, and take the
+				// features after the first all over again.
+				if (i == 0) {
+					events->residual[k] = 0;
+					events->trailing[k] = factorDot(userVec + 1, itemVec + 1,
+						numFeatures - 1);
+				}
+				residual = events->residual[k];
+
+				if (i == 0 && j == 0 && !params->warmStart) {
+					err = event - (itemAvgs[itemid] + userOffsets[userid]);
+				} else {
+					err = event - (residual + userVec[i] * itemVec[i] +
+						events->trailing[k]);
+				}
+				sqerr += err * err;
+				temp = userVec[i];
+				userVec[i] += learn * ((err * itemVec[i]) - (penalty * userVec[i]));
+				itemVec[i] += learn * ((err * temp) - (penalty * itemVec[i]));
+
+				// Store residuals. The next feature hasn't been
+				// touched this epoch, so its term is still the one
+				// we counted in the trailing sum.
+				if (i == 0)
+					events->residual[k] = userVec[i] * itemVec[i];
+				else
+					events->residual[k] += userVec[i] * itemVec[i];
+				if (i + 1 < numFeatures)
+					events->trailing[k] -= userVec[i+1] * itemVec[i+1];
+			}
+
+			// The first epoch starts from the baseline averages
+			// rather than the features, so it can't tell us
+			// anything about convergence.
+			rmse = sqrt(sqerr / Max(last - first, 1));
+			if (params->tolerance > 0 && j > settling &&
+					lastRMSE[i] - rmse < params->tolerance) {
+				converged[i] = true;
+				numConverged++;
+			}
+			lastRMSE[i] = rmse;
+
+			// Only the backend can service interrupts, or report
+			// how far it's got; the workers keep pace with it.
+			if (interruptible) {
+				CHECK_FOR_INTERRUPTS();
+				pgstat_progress_update((int64) j * numFeatures + i + 1);
+			}
+		}
+
+		if (numConverged == numFeatures)
+			break;
+	}
+}
+
+/* ----------------------------------------------------------------
+ *		factorModelHasArrays
+ *
+ *		Tells us how an SVD or ALS model table is laid out.
+ *		Models are written with one real[] of features per
+ *		user or item, but recommenders built before that
+ *		have one (id, feature, value) row per feature.
+ * ----------------------------------------------------------------
+ */
+bool
+factorModelHasArrays(char *modelname) {
+	Oid relid;
+	RangeVar *modelrv;
+
+	modelrv = makeRangeVarFromNameList(stringToQualifiedNameList(modelname));
+	relid = RangeVarGetRelid(modelrv, NoLock, true);
+	pfree(modelrv);
+	if (!OidIsValid(relid))
+		return false;
+
+	return get_attnum(relid, "features") != InvalidAttrNumber;
+}
+
+/* ----------------------------------------------------------------
+ *		writeFactorModel
+ *
+ *		Writes a row-major factor matrix into a user or
+ *		item model table, one row per user or item, then
+ *		adds its primary key. keycol is the table's ID
+ *		column, "users" or "items".
+ * ----------------------------------------------------------------
+ */
+static void
+writeFactorModel(char *modelname, char *keycol, int *IDs, int n,
+		float *features, int numFeatures) {
+	int j;
+	bool sorted;
+	model_writer writer;
+
+	writer = modelWriterOpen(modelname);
+	pgstat_progress_phase(RECBUILD_PHASE_WRITING, n);
+	for (j = 0; j < n; j++) {
+		modelWriterInsertArray(writer,IDs[j],features + (Size) j * numFeatures,numFeatures);
+		if ((j+1) % RECATHON_PROGRESS_ROWS == 0)
+			pgstat_progress_update(j+1);
+	}
+	sorted = modelWriterClose(writer);
+
+	// Adding a primary key after loading is about 25% faster
+	// than adding it before, and the IDs are in order, so
+	// there's nothing to sort.
+	addModelKey(modelname,keycol,sorted);
+}
+
+/* ----------------------------------------------------------------
+ *		warmStartFeatures
+ *
+ *		Starts SVD training from the features of the model
+ *		named in params, if there is one and it has the same
+ *		number of features. The users and items it has keep
+ *		their features; new ones keep the starting value
+ *		they were given. A model refreshed after a few more
+ *		events is nearly the one it replaces, so it's trained
+ *		with a tolerance, until it stops improving, even if
+ *		none was asked for. Sets params->warmStart if it's
+ *		warm started.
+ * ----------------------------------------------------------------
+ */
+static void
+warmStartFeatures(svd_params *params, int *userIDs, int numUsers,
+		int *itemIDs, int numItems, float *userFeatures, float *itemFeatures) {
+	int numFeatures = params->numFeatures;
+	int numKnownUsers, numKnownItems;
+	float *oldUsers, *oldItems;
+
+	params->warmStart = false;
+	if (!params->warmUserModel || !params->warmItemModel)
+		return;
+
+	if (loadFactorModel(params->warmUserModel, "users", userIDs, numUsers,
+			&oldUsers) != numFeatures) {
+		if (oldUsers)
+			pfree(oldUsers);
+		return;
+	}
+	if (loadFactorModel(params->warmItemModel, "items", itemIDs, numItems,
+			&oldItems) != numFeatures) {
+		if (oldItems)
+			pfree(oldItems);
+		pfree(oldUsers);
+		return;
+	}
+
+	// A row the old model didn't have comes back all zeros,
+	// which no trained row is.
+	numKnownUsers = copyKnownFeatures(oldUsers, userFeatures, numUsers, numFeatures);
+	numKnownItems = copyKnownFeatures(oldItems, itemFeatures, numItems, numFeatures);
+	pfree(oldUsers);
+	pfree(oldItems);
+
+	if (numKnownUsers == 0 || numKnownItems == 0)
+		return;
+	params->warmStart = true;
+	if (params->tolerance <= 0)
+		params->tolerance = RECATHON_SVD_WARM_TOLERANCE;
+	elog(DEBUG1, "starting SVD training from the features of %d of %d users and %d of %d items",
+		numKnownUsers, numUsers, numKnownItems, numItems);
+}
+
+/*
+ * Copies the rows of old that aren't all zeros into features, and
+ * returns how many there were.
+ */
+static int
+copyKnownFeatures(float *old, float *features, int n, int numFeatures) {
+	int i, f, numKnown = 0;
+
+	for (i = 0; i < n; i++) {
+		float *row = old + (Size) i * numFeatures;
+
+		for (f = 0; f < numFeatures; f++) {
+			if (row[f] != 0.0)
+				break;
+		}
+		if (f == numFeatures)
+			continue;
+		memcpy(features + (Size) i * numFeatures, row, numFeatures*sizeof(float));
+		numKnown++;
+	}
+	return numKnown;
+}
+
+/* ----------------------------------------------------------------
+ *		SVDtrain
+ *
+ *		This function trains features for SVD models.
+ *		If numWorkers is more than one, the events are split
+ *		into that many contiguous shards, and we fork a
+ *		process for each shard but the first, which we do
+ *		ourselves. Everyone updates the same features,
+ *		kept in an anonymous shared mapping. Since events
+ *		are sorted by user, shards mostly don't share users.
+ *		An update starts from the features it replaces, and
+ *		so does a rebuild given the old model in params;
+ *		see warmStartFeatures. Returns the number of events
+ *		used.
+ * ----------------------------------------------------------------
+ */
+int
+SVDtrain(char *userkey, char *itemkey, char *eventtable, char *eventval,
+		char *usermodelname, char *itemmodelname, bool update, int numWorkers,
+		svd_params *params) {
+	float *userFeatures, *itemFeatures;
+	int *userIDs, *itemIDs;
+	float *itemAvgs, *userOffsets;
+	int numUsers, numItems;
+	int w, numEvents;
+	int numFeatures = params->numFeatures;
+	bool shared, failed = false;
+	pid_t *pids;
+	svd_events events;
+	int *itemOrder;
+
+	// First, we get all of the events we'll be considering, and
+	// our lists of users and items along with them.
+	events = SVDevents(userkey,itemkey,eventtable,eventval,
+		&userIDs, &itemIDs, &numUsers, &numItems);
+	numEvents = events->numEvents;
+	itemOrder = orderItemsByEvents(events, numItems, numFeatures);
+
+	// Then we get information for baseline averages.
+	SVDaverages(events,numUsers,numItems,&itemAvgs,&userOffsets);
+
+	// No point in having workers with no events.
+	if (numWorkers < 1)
+		numWorkers = 1;
+	if (numWorkers > numEvents)
+		numWorkers = (numEvents > 0) ? numEvents : 1;
+	shared = (numWorkers > 1);
+
+	// Initialize our feature arrays. If this is us updating a
+	// cell as opposed to building a recommender, the features
+	// it has are where we start from.
+	userFeatures = allocFeatures(numFeatures, numUsers, shared);
+	itemFeatures = allocFeatures(numFeatures, numItems, shared);
+	if (update) {
+		params->warmUserModel = usermodelname;
+		params->warmItemModel = itemmodelname;
+	}
+	warmStartFeatures(params, userIDs, numUsers, itemIDs, numItems,
+		userFeatures, itemFeatures);
+	if (itemOrder && params->warmStart)
+		permuteItemFactors(itemFeatures, itemOrder, numItems, numFeatures, true);
+
+	// Then we drop the existing entries, if there are any.
+	if (update) {
+		char *dropstring;
+
+		dropstring = (char*) palloc(256*sizeof(char));
+		sprintf(dropstring,"DELETE FROM %s;",usermodelname);
+		recathon_queryExecute(dropstring);
+		sprintf(dropstring,"DELETE FROM %s;",itemmodelname);
+		recathon_queryExecute(dropstring);
+		pfree(dropstring);
+	}
+
+	// We now have all of the events, so we can start training our features.
+	pids = (pid_t*) palloc0(numWorkers*sizeof(pid_t));
+	pgstat_progress_phase(RECBUILD_PHASE_TRAINING,
+		(int64) params->maxEpochs * numFeatures);
+
+	// Anything buffered now would otherwise be written twice.
+	fflush(stdout);
+	fflush(stderr);
+
+	PG_TRY();
+	{
+		for (w = 1; w < numWorkers; w++) {
+			pid_t pid;
+
+			pid = fork();
+			if (pid < 0)
+				ereport(ERROR,
+					(errcode(ERRCODE_INSUFFICIENT_RESOURCES),
+					 errmsg("could not fork SVD training worker: %m")));
+
+			if (pid == 0) {
+				// We're the worker. Train our shard and leave
+				// without running any of the backend's exit code.
+				SVDtrainEvents(events,
+					(int) ((int64) numEvents * w / numWorkers),
+					(int) ((int64) numEvents * (w+1) / numWorkers),
+					params, userFeatures, itemFeatures,
+					itemAvgs, userOffsets, false);
+				_exit(0);
+			}
+
+			pids[w] = pid;
+		}
+
+		// Meanwhile, we do our own share.
+		SVDtrainEvents(events, 0, numEvents / numWorkers,
+			params, userFeatures, itemFeatures,
+			itemAvgs, userOffsets, true);
+	}
+	PG_CATCH();
+	{
+		// Don't leave any workers behind.
+		for (w = 1; w < numWorkers; w++) {
+			if (pids[w] > 0) {
+				kill(pids[w], SIGKILL);
+				waitpid(pids[w], NULL, 0);
+			}
+		}
+		if (shared) {
+			freeFeatures(userFeatures, numFeatures, numUsers, shared);
+			freeFeatures(itemFeatures, numFeatures, numItems, shared);
+		}
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	for (w = 1; w < numWorkers; w++) {
+		int status;
+
+		if (waitpid(pids[w], &status, 0) < 0 ||
+				!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			failed = true;
+	}
+	pfree(pids);
+
+	if (failed) {
+		freeFeatures(userFeatures, numFeatures, numUsers, shared);
+		freeFeatures(itemFeatures, numFeatures, numItems, shared);
+		ereport(ERROR,
+			(errcode(ERRCODE_INTERNAL_ERROR),
+			 errmsg("an SVD training worker failed")));
+	}
+
+	// With the training finished, we put the features into the
+	// model tables. If we're updating an existing SVD model, we
+	// drop the primary key constraints before loading, to save time.
+	if (update) {
+		char *querystring;
+
+		querystring = (char*) palloc(1024*sizeof(char));
+		sprintf(querystring,"ALTER TABLE %s DROP CONSTRAINT %s_pkey;",
+					usermodelname,usermodelname);
+		recathon_utilityExecute(querystring);
+		sprintf(querystring,"ALTER TABLE %s DROP CONSTRAINT %s_pkey;",
+					itemmodelname,itemmodelname);
+		recathon_utilityExecute(querystring);
+		pfree(querystring);
+	}
+
+	if (itemOrder) {
+		permuteItemFactors(itemFeatures, itemOrder, numItems, numFeatures, false);
+		pfree(itemOrder);
+	}
+	writeFactorModel(usermodelname, "users", userIDs, numUsers,
+		userFeatures, numFeatures);
+	writeFactorModel(itemmodelname, "items", itemIDs, numItems,
+		itemFeatures, numFeatures);
+
+	// Free up memory.
+	pfree(userIDs);
+	pfree(itemIDs);
+	pfree(itemAvgs);
+	pfree(userOffsets);
+	freeSVDevents(events);
+
+	freeFeatures(userFeatures, numFeatures, numUsers, shared);
+	freeFeatures(itemFeatures, numFeatures, numItems, shared);
+
+	// Return the number of events we used.
+	return numEvents;
+}
+
+/* ----------------------------------------------------------------
+ *		ALSrows
+ *
+ *		Groups events by user, or by item if byItem is set,
+ *		in CSR form. The events for row r are entries
+ *		rowStart[r] through rowStart[r+1]-1 of cols and vals,
+ *		where cols holds the index on the other side.
+ * ----------------------------------------------------------------
+ */
+static void
+ALSrows(svd_events events, bool byItem, int numRows,
+		int **ret_rowStart, int **ret_cols, float **ret_vals) {
+	int i;
+	int *rowStart, *cols, *fill;
+	float *vals;
+	int *rows = byItem ? events->itemid : events->userid;
+	int *others = byItem ? events->userid : events->itemid;
+
+	rowStart = (int*) palloc0((numRows+1)*sizeof(int));
+	cols = (int*) palloc(Max(events->numEvents,1)*sizeof(int));
+	vals = (float*) palloc(Max(events->numEvents,1)*sizeof(float));
+
+	// Count the events in each row, then turn the counts
+	// into starting offsets.
+	for (i = 0; i < events->numEvents; i++)
+		if (rows[i] >= 0 && others[i] >= 0)
+			rowStart[rows[i]+1]++;
+	for (i = 0; i < numRows; i++)
+		rowStart[i+1] += rowStart[i];
+
+	fill = (int*) palloc(Max(numRows,1)*sizeof(int));
+	for (i = 0; i < numRows; i++)
+		fill[i] = rowStart[i];
+	for (i = 0; i < events->numEvents; i++) {
+		if (rows[i] < 0 || others[i] < 0)
+			continue;
+		cols[fill[rows[i]]] = others[i];
+		vals[fill[rows[i]]] = events->event[i];
+		fill[rows[i]]++;
+	}
+	pfree(fill);
+
+	(*ret_rowStart) = rowStart;
+	(*ret_cols) = cols;
+	(*ret_vals) = vals;
+}
+
+/* ----------------------------------------------------------------
+ *		choleskySolve
+ *
+ *		Solves A x = b for a symmetric positive definite
+ *		k x k matrix, of which only the lower triangle is
+ *		read. x holds b on the way in and the solution on
+ *		the way out, and A is overwritten. Returns false if
+ *		A turns out not to be positive definite.
+ * ----------------------------------------------------------------
+ */
+static bool
+choleskySolve(double *A, double *x, int k) {
+	int i, p, q;
+
+	// Cholesky factorization, in place.
+	for (p = 0; p < k; p++) {
+		for (q = 0; q <= p; q++) {
+			double sum = A[p*k+q];
+
+			for (i = 0; i < q; i++)
+				sum -= A[p*k+i] * A[q*k+i];
+			if (p == q) {
+				if (sum <= 0.0)
+					return false;
+				A[p*k+p] = sqrt(sum);
+			} else
+				A[p*k+q] = sum / A[q*k+q];
+		}
+	}
+
+	// Forward and back substitution.
+	for (p = 0; p < k; p++) {
+		double sum = x[p];
+
+		for (q = 0; q < p; q++)
+			sum -= A[p*k+q] * x[q];
+		x[p] = sum / A[p*k+p];
+	}
+	for (p = k-1; p >= 0; p--) {
+		double sum = x[p];
+
+		for (q = p+1; q < k; q++)
+			sum -= A[q*k+p] * x[q];
+		x[p] = sum / A[p*k+p];
+	}
+
+	return true;
+}
+
+/* ----------------------------------------------------------------
+ *		ALSsolveRows
+ *
+ *		Solves rows first through last-1 of one ALS half
+ *		step. Each row's factors are the ridge regression of
+ *		its events against the fixed factors of the other
+ *		side, with the penalty scaled by the row's number of
+ *		events. Af is numFeatures*(numFeatures+1) floats of
+ *		workspace, and A and x are numFeatures^2 and
+ *		numFeatures doubles. Rows with no events, or whose system
+ *		isn't positive definite, keep the factors they have.
+ *		Like SVDtrainEvents, this runs in forked workers, so
+ *		it mustn't allocate memory or report errors.
+ * ----------------------------------------------------------------
+ */
+static void
+ALSsolveRows(int first, int last, int *rowStart, int *cols, float *vals,
+		float *fixed, float *solved, int numFeatures, float penalty,
+		float *Af, double *A, double *x, bool interruptible) {
+	int r, e, p, q, b, n;
+	int k = numFeatures;
+	float *xf = Af + (Size) k * k;
+	float *block[RECATHON_ALS_BLOCK];
+
+	for (r = first; r < last; r++) {
+		int count = rowStart[r+1] - rowStart[r];
+
+		if (count == 0)
+			continue;
+
+		// Build the normal equations. Only the lower
+		// triangle of A is used. They're accumulated in
+		// single precision, a block of events at a time,
+		// and solved in double precision.
+		memset(Af, 0, (Size) k * (k+1) * sizeof(float));
+		for (e = rowStart[r]; e < rowStart[r+1]; e += n) {
+			n = Min(RECATHON_ALS_BLOCK, rowStart[r+1] - e);
+			for (b = 0; b < n; b++) {
+				block[b] = fixed + (Size) cols[e+b] * k;
+				factorAxpy(vals[e+b], block[b], xf, k);
+			}
+			for (p = 0; p < k; p++) {
+				float *Arow = Af + (Size) p * k;
+
+				for (b = 0; b < n; b++)
+					factorAxpy(block[b][p], block[b], Arow, p+1);
+			}
+		}
+		for (p = 0; p < k; p++) {
+			x[p] = xf[p];
+			for (q = 0; q <= p; q++)
+				A[p*k+q] = Af[p*k+q];
+			A[p*k+p] += penalty * count;
+		}
+
+		if (!choleskySolve(A, x, k))
+			continue;
+
+		for (p = 0; p < k; p++)
+			solved[(Size) r * k + p] = (float) x[p];
+
+		if (interruptible && (r & 255) == 0)
+			CHECK_FOR_INTERRUPTS();
+	}
+}
+
+/* ----------------------------------------------------------------
+ *		ALShalfStep
+ *
+ *		Solves every row on one side of an ALS model. The
+ *		rows are independent, so with more than one worker
+ *		we fork processes that each solve a contiguous range
+ *		of rows, writing into the shared factor matrix, and
+ *		do the first range ourselves.
+ * ----------------------------------------------------------------
+ */
+static void
+ALShalfStep(int numRows, int *rowStart, int *cols, float *vals,
+		float *fixed, float *solved, int numFeatures, float penalty,
+		int numWorkers) {
+	int w;
+	bool failed = false;
+	pid_t *pids;
+	float *Af;
+	double *A, *x;
+	Size k = numFeatures;
+
+	if (numWorkers > numRows)
+		numWorkers = (numRows > 0) ? numRows : 1;
+
+	pids = (pid_t*) palloc0(numWorkers*sizeof(pid_t));
+	Af = (float*) palloc(k*(k+1)*sizeof(float));
+	A = (double*) palloc(k*k*sizeof(double));
+	x = (double*) palloc(k*sizeof(double));
+
+	// Anything buffered now would otherwise be written twice.
+	fflush(stdout);
+	fflush(stderr);
+
+	PG_TRY();
+	{
+		for (w = 1; w < numWorkers; w++) {
+			pid_t pid;
+
+			pid = fork();
+			if (pid < 0)
+				ereport(ERROR,
+					(errcode(ERRCODE_INSUFFICIENT_RESOURCES),
+					 errmsg("could not fork ALS worker: %m")));
+
+			if (pid == 0) {
+				float *wAf;
+				double *wA, *wx;
+
+				// We're the worker. The backend's allocator
+				// isn't ours to use, so our workspace comes
+				// from malloc.
+				wAf = (float*) malloc(k*(k+1)*sizeof(float));
+				wA = (double*) malloc(k*k*sizeof(double));
+				wx = (double*) malloc(k*sizeof(double));
+				if (!wAf || !wA || !wx)
+					_exit(1);
+				ALSsolveRows((int) ((int64) numRows * w / numWorkers),
+					(int) ((int64) numRows * (w+1) / numWorkers),
+					rowStart, cols, vals, fixed, solved,
+					numFeatures, penalty, wAf, wA, wx, false);
+				_exit(0);
+			}
+
+			pids[w] = pid;
+		}
+
+		// Meanwhile, we do our own share.
+		ALSsolveRows(0, numRows / numWorkers, rowStart, cols, vals,
+			fixed, solved, numFeatures, penalty, Af, A, x, true);
+	}
+	PG_CATCH();
+	{
+		// Don't leave any workers behind.
+		for (w = 1; w < numWorkers; w++) {
+			if (pids[w] > 0) {
+				kill(pids[w], SIGKILL);
+				waitpid(pids[w], NULL, 0);
+			}
+		}
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	for (w = 1; w < numWorkers; w++) {
+		int status;
+
+		if (waitpid(pids[w], &status, 0) < 0 ||
+				!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			failed = true;
+	}
+
+	pfree(pids);
+	pfree(Af);
+	pfree(A);
+	pfree(x);
+
+	if (failed)
+		ereport(ERROR,
+			(errcode(ERRCODE_INTERNAL_ERROR),
+			 errmsg("an ALS worker failed")));
+}
+
+/* ----------------------------------------------------------------
+ *		ALSfactorize
+ *
+ *		Fits user and item factors to the events by
+ *		alternating least squares: solve every user against
+ *		the item factors, then every item against the user
+ *		factors, and repeat. With a tolerance, we stop once
+ *		an iteration improves the training RMSE by less than
+ *		that.
+ * ----------------------------------------------------------------
+ */
+static void
+ALSfactorize(svd_events events, int numUsers, int numItems,
+		svd_params *params, int numWorkers,
+		float *userFeatures, float *itemFeatures) {
+	int iter, k;
+	int *userStart, *userCols, *itemStart, *itemCols;
+	float *userVals, *itemVals;
+	double lastRMSE = 0.0;
+	uint32 seed = 1;
+	Size i;
+
+	k = params->numFeatures;
+	ALSrows(events, false, numUsers, &userStart, &userCols, &userVals);
+	ALSrows(events, true, numItems, &itemStart, &itemCols, &itemVals);
+
+	// If every item started out the same, every user solve would
+	// give the same direction and we'd never get past rank one, so
+	// we spread the starting values out. A fixed seed keeps builds
+	// repeatable.
+	for (i = 0; i < (Size) numItems * k; i++) {
+		seed = seed * 1103515245 + 12345;
+		itemFeatures[i] = 0.2 * ((seed >> 16) & 0x7fff) / 32768.0;
+	}
+
+	// The workers ALShalfStep forks never report; we do, between steps.
+	pgstat_progress_phase(RECBUILD_PHASE_TRAINING, params->maxEpochs);
+	for (iter = 0; iter < params->maxEpochs; iter++) {
+		pgstat_progress_update(iter);
+		ALShalfStep(numUsers, userStart, userCols, userVals,
+			itemFeatures, userFeatures, k, params->penalty, numWorkers);
+		ALShalfStep(numItems, itemStart, itemCols, itemVals,
+			userFeatures, itemFeatures, k, params->penalty, numWorkers);
+
+		if (params->tolerance > 0) {
+			int e;
+			double sqerr = 0.0, rmse;
+
+			for (e = 0; e < events->numEvents; e++) {
+				float *userVec, *itemVec;
+				float err;
+
+				if (events->userid[e] < 0 || events->itemid[e] < 0)
+					continue;
+				userVec = userFeatures + (Size) events->userid[e] * k;
+				itemVec = itemFeatures + (Size) events->itemid[e] * k;
+				err = events->event[e] - factorDot(userVec, itemVec, k);
+				sqerr += err * err;
+			}
+			rmse = sqrt(sqerr / Max(events->numEvents, 1));
+
+			if (iter > 0 && lastRMSE - rmse < params->tolerance)
+				break;
+			lastRMSE = rmse;
+		}
+	}
+
+	pfree(userStart);
+	pfree(userCols);
+	pfree(userVals);
+	pfree(itemStart);
+	pfree(itemCols);
+	pfree(itemVals);
+}
+
+/* ----------------------------------------------------------------
+ *		ALStrain
+ *
+ *		This function builds the user and item models for an
+ *		ALS recommender. They have the same layout as SVD
+ *		models, and are queried the same way. Each half step
+ *		is split across numWorkers processes. Returns the
+ *		number of events used.
+ * ----------------------------------------------------------------
+ */
+int
+ALStrain(char *userkey, char *itemkey, char *eventtable, char *eventval,
+		char *usermodelname, char *itemmodelname, int numWorkers,
+		svd_params *params) {
+	float *userFeatures, *itemFeatures;
+	int *userIDs, *itemIDs;
+	int numUsers, numItems, numEvents;
+	int numFeatures = params->numFeatures;
+	bool shared;
+	svd_events events;
+	int *itemOrder;
+
+	// First, we get the events, and our lists of users and items.
+	events = SVDevents(userkey,itemkey,eventtable,eventval,
+		&userIDs, &itemIDs, &numUsers, &numItems);
+	numEvents = events->numEvents;
+	itemOrder = orderItemsByEvents(events, numItems, numFeatures);
+
+	if (numWorkers < 1)
+		numWorkers = 1;
+	shared = (numWorkers > 1);
+
+	// Initialize our feature arrays.
+	userFeatures = allocFeatures(numFeatures, numUsers, shared);
+	itemFeatures = allocFeatures(numFeatures, numItems, shared);
+
+	PG_TRY();
+	{
+		ALSfactorize(events, numUsers, numItems, params, numWorkers,
+			userFeatures, itemFeatures);
+	}
+	PG_CATCH();
+	{
+		if (shared) {
+			freeFeatures(userFeatures, numFeatures, numUsers, shared);
+			freeFeatures(itemFeatures, numFeatures, numItems, shared);
+		}
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	if (itemOrder) {
+		permuteItemFactors(itemFeatures, itemOrder, numItems, numFeatures, false);
+		pfree(itemOrder);
+	}
+	writeFactorModel(usermodelname, "users", userIDs, numUsers,
+		userFeatures, numFeatures);
+	writeFactorModel(itemmodelname, "items", itemIDs, numItems,
+		itemFeatures, numFeatures);
+
+	// Free up memory.
+	pfree(userIDs);
+	pfree(itemIDs);
+	freeSVDevents(events);
+	freeFeatures(userFeatures, numFeatures, numUsers, shared);
+	freeFeatures(itemFeatures, numFeatures, numItems, shared);
+
+	// Return the number of events we used.
+	return numEvents;
+}
+
+/* ----------------------------------------------------------------
+ *		loadFactorModel
+ *
+ *		Reads a user or item model table back into a
+ *		row-major factor matrix, with rows in the order of
+ *		the given ID list. IDs with no rows in the table get
+ *		zero vectors. Returns the number of features, or
+ *		zero if the table is empty.
+ * ----------------------------------------------------------------
+ */
+int
+loadFactorModel(char *modelname, char *keycol, int *IDs, int n,
+		float **ret_features) {
+	int numFeatures;
+	float *features;
+	bool arrays;
+	// Information for other queries.
+	char *querystring;
+	QueryDesc *queryDesc;
+	PlanState *planstate;
+	TupleTableSlot *slot;
+	MemoryContext recathoncontext;
+	tuple_column keycolumn, featurescol, featurecol, valuecol;
+
+	arrays = factorModelHasArrays(modelname);
+	querystring = (char*) palloc(1024*sizeof(char));
+	if (arrays)
+		sprintf(querystring,"SELECT max(array_length(features, 1)) - 1 AS maxfeature FROM %s;",modelname);
+	else
+		sprintf(querystring,"SELECT max(feature) AS maxfeature FROM %s;",modelname);
+	queryDesc = recathon_queryStart(querystring,&recathoncontext);
+	slot = ExecProcNode(queryDesc->planstate);
+	numFeatures = 0;
+	if (!TupIsNull(slot)) {
+		slot_getallattrs(slot);
+		if (!slot->tts_isnull[0])
+			numFeatures = getTupleInt(slot,"maxfeature") + 1;
+	}
+	recathon_queryEnd(queryDesc,recathoncontext);
+
+	if (numFeatures <= 0 || numFeatures > RECATHON_MAX_FEATURES) {
+		pfree(querystring);
+		(*ret_features) = NULL;
+		return 0;
+	}
+
+	features = (float*) palloc0(Max((Size) numFeatures * n, 1)*sizeof(float));
+
+	if (arrays)
+		sprintf(querystring,"SELECT %s, features FROM %s;",keycol,modelname);
+	else
+		sprintf(querystring,"SELECT %s, feature, value FROM %s;",keycol,modelname);
+	queryDesc = recathon_queryStart(querystring,&recathoncontext);
+	planstate = queryDesc->planstate;
+	bindColumn(&keycolumn, keycol);
+	bindColumn(&featurescol, "features");
+	bindColumn(&featurecol, "feature");
+	bindColumn(&valuecol, "value");
+
+	for (;;) {
+		int index, feature;
+
+		slot = ExecProcNode(planstate);
+		if (TupIsNull(slot)) break;
+
+		index = binarySearch(IDs,columnInt(slot,&keycolumn),0,n);
+		if (arrays) {
+			// A whole row at once.
+			if (index >= 0)
+				columnFloatArray(slot, &featurescol,
+					features + (Size) index * numFeatures, numFeatures);
+			continue;
+		}
+		feature = columnInt(slot,&featurecol);
+		if (index < 0 || feature < 0 || feature >= numFeatures)
+			continue;
+		features[(Size) index * numFeatures + feature] = columnFloat(slot,&valuecol);
+	}
+
+	recathon_queryEnd(queryDesc,recathoncontext);
+	pfree(querystring);
+
+	(*ret_features) = features;
+	return numFeatures;
+}
+
+/* ----------------------------------------------------------------
+ *		loadCachedItemFactors
+ *
+ *		Reads the item model of a built SVD or ALS recommender,
+ *		in the order of the scan's item list, going through the
+ *		model file or the shared model cache like
+ *		loadCachedIDDictionary does. The model lands in
+ *		recstate->SVDitemmodel, or in recstate->SVDitemHalf if
+ *		it's shared in half precision.
+ *		The cached copy starts with the number of features and
+ *		the bits per factor.
+ * ----------------------------------------------------------------
+ */
+int
+loadCachedItemFactors(RecScanState *recstate) {
+	AttributeInfo *attributes = (AttributeInfo*) recstate->attributes;
+	int numFeatures, handle, bits;
+	float *features;
+	char *data;
+	int *header;
+	Size size, count, headersize;
+
+	data = modelFileSection(recstate, MODEL_FILE_ITEMFACTORS, NULL);
+	if (data) {
+		model_file_header *fileheader = (model_file_header*) recstate->modelFile->base;
+
+		if (fileheader->factorBits == 16)
+			recstate->SVDitemHalf = (uint16*) data;
+		else
+			recstate->SVDitemmodel = (float*) data;
+		return fileheader->numFeatures;
+	}
+
+	headersize = MAXALIGN(2*sizeof(int));
+	data = cachedModelData(recstate, "itemfactors", &size);
+	if (data) {
+		header = (int*) data;
+		if (header[1] == 16)
+			recstate->SVDitemHalf = (uint16*) (data + headersize);
+		else
+			recstate->SVDitemmodel = (float*) (data + headersize);
+		return header[0];
+	}
+
+	numFeatures = loadFactorModel(attributes->recModelName2, "items",
+		recstate->fullItemList, recstate->fullTotalItems, &features);
+	recstate->SVDitemmodel = features;
+	if (numFeatures > 0) {
+		bits = (recstate->modelPrecision == 16) ? 16 : RECATHON_FULL_PRECISION;
+		count = (Size) numFeatures * recstate->fullTotalItems;
+		data = reserveModelData(recstate, "itemfactors",
+			headersize + count * (bits / 8), &handle);
+		if (data) {
+			header = (int*) data;
+			header[0] = numFeatures;
+			header[1] = bits;
+			if (bits == 16) {
+				floatsToHalves(features, (uint16*) (data + headersize), count);
+				recstate->SVDitemHalf = (uint16*) (data + headersize);
+				recstate->SVDitemmodel = NULL;
+			} else {
+				memcpy(data + headersize, features, count*sizeof(float));
+				recstate->SVDitemmodel = (float*) (data + headersize);
+			}
+			recathonCacheFinish(handle);
+			pfree(features);
+		}
+	}
+
+	return numFeatures;
+}
+
+/* ----------------------------------------------------------------
+ *		foldInUserModel
+ *
+ *		Brings the users with events in an SVD or ALS
+ *		recommender's Deltas table up to date without
+ *		retraining the items. Each of them is solved from all
+ *		of their events against the frozen item model, as in
+ *		one ALS half step, and their rows are replaced in the
+ *		live user model, the way applyOnlineDeltas does it.
+ *		Every other user keeps the factors training gave
+ *		them. Items that are newer than the item model don't
+ *		contribute. The caller holds the Deltas lock. Returns
+ *		the number of users folded in, or 0 if there are
+ *		none, the user model doesn't keep its factors in
+ *		arrays, or the item model is empty.
+ * ----------------------------------------------------------------
+ */
+int
+foldInUserModel(char *recindexname, char *eventtable, char *userkey,
+		char *itemkey, char *eventval, char *usermodelname,
+		char *itemmodelname) {
+	int i, numUsers, numItems, numFeatures;
+	int *userIDs, *itemIDs;
+	int *rowStart, *cols;
+	float *vals, *userFeatures, *itemFeatures;
+	char *querystring;
+	svd_events events;
+	model_writer writer;
+
+	// Rows are rewritten whole, so the model has to keep its
+	// factors in arrays, as new ones do.
+	if (!factorModelHasArrays(usermodelname))
+		return 0;
+
+	// Just the events of the users with new ones.
+	querystring = (char*) palloc(1024*sizeof(char));
+	sprintf(querystring,"(SELECT * FROM %s WHERE %s IN (SELECT %s FROM %sDeltas)) AS foldin",
+		eventtable,userkey,userkey,recindexname);
+	events = SVDevents(userkey,itemkey,querystring,eventval,
+		&userIDs, &itemIDs, &numUsers, &numItems);
+
+	numFeatures = 0;
+	itemFeatures = NULL;
+	if (numUsers > 0)
+		numFeatures = loadFactorModel(itemmodelname, "items", itemIDs, numItems,
+			&itemFeatures);
+	if (numFeatures == 0) {
+		freeSVDevents(events);
+		pfree(userIDs);
+		pfree(itemIDs);
+		if (itemFeatures)
+			pfree(itemFeatures);
+		pfree(querystring);
+		return 0;
+	}
+
+	ALSrows(events, false, numUsers, &rowStart, &cols, &vals);
+	freeSVDevents(events);
+
+	userFeatures = allocFeatures(numFeatures, numUsers, false);
+	ALShalfStep(numUsers, rowStart, cols, vals, itemFeatures, userFeatures,
+		numFeatures, RECATHON_FOLDIN_PENALTY, 1);
+
+	// Out with their old rows, and in with the new.
+	sprintf(querystring,"DELETE FROM %s WHERE users IN (SELECT %s FROM %sDeltas);",
+		usermodelname,userkey,recindexname);
+	recathon_queryExecute(querystring);
+	CommandCounterIncrement();
+
+	writer = modelWriterOpen(usermodelname);
+	for (i = 0; i < numUsers; i++)
+		modelWriterInsertArray(writer, userIDs[i],
+			userFeatures + (Size) i * numFeatures, numFeatures);
+	modelWriterClose(writer);
+	CommandCounterIncrement();
+
+	// Free up memory.
+	pfree(userIDs);
+	pfree(itemIDs);
+	pfree(rowStart);
+	pfree(cols);
+	pfree(vals);
+	pfree(itemFeatures);
+	freeFeatures(userFeatures, numFeatures, numUsers, false);
+	pfree(querystring);
+
+	return numUsers;
+}
+
+/* ----------------------------------------------------------------
+ *		foldInItemModel
+ *
+ *		The other half of foldInUserModel: adds rows to the
+ *		live item model of an SVD or ALS recommender for the
+ *		items in its Deltas table that the model doesn't have
+ *		yet, by solving just those items' factors against the
+ *		frozen user model, from the ratings they have so far.
+ *		The items it already has keep their factors. Users
+ *		newer than the user model don't contribute. The
+ *		caller holds the Deltas lock. Returns the number of
+ *		items folded in, or 0 if no item is new, the item
+ *		model doesn't keep its factors in arrays, or the
+ *		user model is empty.
+ * ----------------------------------------------------------------
+ */
+int
+foldInItemModel(char *recindexname, char *eventtable, char *userkey,
+		char *itemkey, char *eventval, char *usermodelname,
+		char *itemmodelname) {
+	int i, numUsers, numItems, numFeatures;
+	int *userIDs, *itemIDs;
+	int *rowStart, *cols;
+	float *vals, *userFeatures, *itemFeatures;
+	char *querystring;
+	svd_events events;
+	model_writer writer;
+
+	// Rows are added whole, so the model has to keep its
+	// factors in arrays, as new ones do.
+	if (!factorModelHasArrays(itemmodelname))
+		return 0;
+
+	// Just the events of the items that are new to the model.
+	querystring = (char*) palloc(1024*sizeof(char));
+	sprintf(querystring,"(SELECT * FROM %s WHERE %s IN (SELECT d.%s FROM %sDeltas d WHERE NOT EXISTS (SELECT 1 FROM %s m WHERE m.items = d.%s))) AS foldin",
+		eventtable,itemkey,itemkey,recindexname,itemmodelname,itemkey);
+	events = SVDevents(userkey,itemkey,querystring,eventval,
+		&userIDs, &itemIDs, &numUsers, &numItems);
+	pfree(querystring);
+
+	numFeatures = 0;
+	userFeatures = NULL;
+	if (numItems > 0)
+		numFeatures = loadFactorModel(usermodelname, "users", userIDs, numUsers,
+			&userFeatures);
+	if (numFeatures == 0) {
+		freeSVDevents(events);
+		pfree(userIDs);
+		pfree(itemIDs);
+		if (userFeatures)
+			pfree(userFeatures);
+		return 0;
+	}
+
+	ALSrows(events, true, numItems, &rowStart, &cols, &vals);
+	freeSVDevents(events);
+
+	itemFeatures = allocFeatures(numFeatures, numItems, false);
+	ALShalfStep(numItems, rowStart, cols, vals, userFeatures, itemFeatures,
+		numFeatures, RECATHON_FOLDIN_PENALTY, 1);
+
+	writer = modelWriterOpen(itemmodelname);
+	for (i = 0; i < numItems; i++)
+		modelWriterInsertArray(writer, itemIDs[i],
+			itemFeatures + (Size) i * numFeatures, numFeatures);
+	modelWriterClose(writer);
+	CommandCounterIncrement();
+
+	// Free up memory.
+	pfree(userIDs);
+	pfree(itemIDs);
+	pfree(rowStart);
+	pfree(cols);
+	pfree(vals);
+	pfree(userFeatures);
+	freeFeatures(itemFeatures, numFeatures, numItems, false);
+
+	return numItems;
+}
+
+/* ----------------------------------------------------------------
+ *		createClusterModel
+ *
+ *		Builds the approximate top-k index for an SVD or ALS
+ *		recommender. The item factor vectors are clustered
+ *		with k-means, and each item's cluster is written to
+ *		a new table of (items, cluster, distance). k-means
+ *		runs on an evenly spaced sample of the items, and
+ *		every item is assigned once at the end, so this
+ *		stays affordable for large catalogues. Returns the
+ *		name of the new table.
+ * ----------------------------------------------------------------
+ */
+char*
+createClusterModel(char *recname, char *itemmodelname, int numClusters) {
+	int i, j, c, iter, numItems, maxItems, numFeatures, numSample;
+	int *itemIDs, *sample, *assign, *counts;
+	float *itemFeatures, *centroids, *norms;
+	char *clustername;
+	struct timeval timestamp;
+	model_writer writer;
+	// Query objects.
+	char *querystring;
+	QueryDesc *queryDesc;
+	PlanState *planstate;
+	TupleTableSlot *slot;
+	MemoryContext recathoncontext;
+	tuple_column itemscol;
+
+	// Get the items in the model, in order.
+	querystring = (char*) palloc(1024*sizeof(char));
+	sprintf(querystring,"SELECT DISTINCT items FROM %s ORDER BY items;",itemmodelname);
+	queryDesc = recathon_queryStart(querystring,&recathoncontext);
+	planstate = queryDesc->planstate;
+	bindColumn(&itemscol, "items");
+
+	numItems = 0;
+	maxItems = 1024;
+	itemIDs = (int*) palloc(maxItems*sizeof(int));
+	for (;;) {
+		slot = ExecProcNode(planstate);
+		if (TupIsNull(slot)) break;
+
+		if (numItems >= maxItems) {
+			maxItems *= 2;
+			itemIDs = (int*) repalloc(itemIDs, maxItems*sizeof(int));
+		}
+		itemIDs[numItems++] = columnInt(slot,&itemscol);
+	}
+	recathon_queryEnd(queryDesc,recathoncontext);
+
+	numFeatures = loadFactorModel(itemmodelname, "items", itemIDs, numItems,
+		&itemFeatures);
+	if (numClusters > numItems)
+		numClusters = numItems;
+
+	gettimeofday(&timestamp,NULL);
+	clustername = (char*) palloc(256*sizeof(char));
+	sprintf(clustername,"%sClusters%ld%ld",recname,
+		timestamp.tv_sec,timestamp.tv_usec);
+	sprintf(querystring,"CREATE TABLE %s (items INTEGER NOT NULL, cluster INTEGER NOT NULL, distance REAL NOT NULL);",
+		clustername);
+	recathon_utilityExecute(querystring);
+	pfree(querystring);
+
+	if (numFeatures == 0 || numClusters < 1) {
+		pfree(itemIDs);
+		return clustername;
+	}
+
+	// The sample, and the starting centroids, are evenly spaced
+	// through the item list.
+	numSample = Min(numItems, numClusters * RECATHON_ANN_SAMPLE);
+	sample = (int*) palloc(numSample*sizeof(int));
+	for (i = 0; i < numSample; i++)
+		sample[i] = (int) ((int64) i * numItems / numSample);
+
+	centroids = (float*) palloc((Size) numClusters * numFeatures * sizeof(float));
+	norms = (float*) palloc(numClusters*sizeof(float));
+	counts = (int*) palloc(numClusters*sizeof(int));
+	assign = (int*) palloc(numItems*sizeof(int));
+	for (c = 0; c < numClusters; c++)
+		memcpy(centroids + (Size) c * numFeatures,
+			itemFeatures + (Size) sample[(int) ((int64) c * numSample / numClusters)] * numFeatures,
+			numFeatures*sizeof(float));
+
+	for (iter = 0; iter <= RECATHON_ANN_ITERATIONS; iter++) {
+		bool last = (iter == RECATHON_ANN_ITERATIONS);
+		int n = last ? numItems : numSample;
+
+		for (c = 0; c < numClusters; c++) {
+			float *cvec = centroids + (Size) c * numFeatures;
+
+			norms[c] = factorDot(cvec, cvec, numFeatures);
+		}
+
+		// Assign points to their nearest centroid. Since the
+		// point's own length doesn't change the answer, we
+		// only need |c|^2 - 2 x.c. On the last pass, we assign
+		// every item rather than the sample.
+		for (i = 0; i < n; i++) {
+			int item = last ? i : sample[i];
+			float *vec = itemFeatures + (Size) item * numFeatures;
+			float best = 0.0;
+
+			assign[item] = 0;
+			for (c = 0; c < numClusters; c++) {
+				float dist = norms[c] - 2 * factorDot(vec,
+					centroids + (Size) c * numFeatures, numFeatures);
+
+				if (c == 0 || dist < best) {
+					best = dist;
+					assign[item] = c;
+				}
+			}
+
+			if ((i & 1023) == 0)
+				CHECK_FOR_INTERRUPTS();
+		}
+		if (last)
+			break;
+
+		// Move each centroid to the mean of its points. An
+		// empty cluster keeps the centroid it had.
+		memset(counts, 0, numClusters*sizeof(int));
+		for (i = 0; i < numSample; i++)
+			counts[assign[sample[i]]]++;
+		for (c = 0; c < numClusters; c++) {
+			if (counts[c] > 0)
+				memset(centroids + (Size) c * numFeatures, 0,
+					numFeatures*sizeof(float));
+		}
+		for (i = 0; i < numSample; i++) {
+			c = assign[sample[i]];
+			factorAxpy(1.0 / counts[c],
+				itemFeatures + (Size) sample[i] * numFeatures,
+				centroids + (Size) c * numFeatures, numFeatures);
+		}
+	}
+
+	// Write out each item's cluster, with its squared distance
+	// from the centroid.
+	writer = modelWriterOpen(clustername);
+	for (i = 0; i < numItems; i++) {
+		float *vec = itemFeatures + (Size) i * numFeatures;
+		float *cvec = centroids + (Size) assign[i] * numFeatures;
+		float dist = 0.0;
+
+		for (j = 0; j < numFeatures; j++)
+			dist += (vec[j] - cvec[j]) * (vec[j] - cvec[j]);
+		modelWriterInsert(writer, itemIDs[i], assign[i], dist);
+	}
+	modelWriterClose(writer);
+
+	// Free up memory.
+	pfree(itemIDs);
+	pfree(itemFeatures);
+	pfree(sample);
+	pfree(centroids);
+	pfree(norms);
+	pfree(counts);
+	pfree(assign);
+
+	return clustername;
+}
+
+/* ----------------------------------------------------------------
+ *		countClusters
+ *
+ *		Returns the number of clusters in an item cluster
+ *		table, so that a rebuild can make the same number.
+ * ----------------------------------------------------------------
+ */
+int
+countClusters(char *clustername) {
+	int numClusters = 0;
+	// Query objects.
+	char *querystring;
+	QueryDesc *queryDesc;
+	TupleTableSlot *slot;
+	MemoryContext recathoncontext;
+
+	querystring = (char*) palloc(1024*sizeof(char));
+	sprintf(querystring,"SELECT max(cluster) AS maxcluster FROM %s;",clustername);
+	queryDesc = recathon_queryStart(querystring,&recathoncontext);
+	slot = ExecProcNode(queryDesc->planstate);
+	if (!TupIsNull(slot)) {
+		slot_getallattrs(slot);
+		if (!slot->tts_isnull[0])
+			numClusters = getTupleInt(slot,"maxcluster") + 1;
+	}
+	recathon_queryEnd(queryDesc,recathoncontext);
+	pfree(querystring);
+
+	return numClusters;
+}
+
+/* ----------------------------------------------------------------
+ *		logUserQueries
+ *
+ *		Notes down which users a query asked about, for a
+ *		hybrid recommender to work out its heavy users from.
+ *		Only those have a table for the maintenance process
+ *		to add it all up in. The query itself only adds to
+ *		a tally in shared memory, which the maintenance
+ *		process drains, so RECOMMEND never has to write.
+ * ----------------------------------------------------------------
+ */
+void
+logUserQueries(char *recindexname, List *userIDList) {
+	char *tablename;
+	int i, numUsers;
+	int *userIDs;
+	RangeVar *tablerv;
+	ListCell *lc;
+
+	if (!recindexname || userIDList == NIL)
+		return;
+
+	// A hot standby has no maintenance pass to drain the tally.
+	// Its queries still count in the statistics.
+	if (RecoveryInProgress())
+		return;
+
+	tablename = (char*) palloc((strlen(recindexname)+12)*sizeof(char));
+	sprintf(tablename,"%suserqueries",recindexname);
+	tablerv = makeRangeVar(NULL,tablename,0);
+	if (!relationExists(tablerv)) {
+		pfree(tablerv);
+		pfree(tablename);
+		return;
+	}
+	pfree(tablerv);
+
+	numUsers = list_length(userIDList);
+	userIDs = (int*) palloc(numUsers*sizeof(int));
+	i = 0;
+	foreach(lc, userIDList)
+		userIDs[i++] = lfirst_int(lc);
+	recathonQueriesNote(recindexname, userIDs, numUsers);
+
+	pfree(userIDs);
+	pfree(tablename);
+}
+
+/* ----------------------------------------------------------------
+ *		heavyUsersQuery
+ *
+ *		Appends a query for a hybrid recommender's heavy
+ *		users: the most frequent ones, who between them make
+ *		up RECATHON_HEAVY_SHARE of its recent queries. A user
+ *		may turn up twice, if they've been noted down since the
+ *		last maintenance pass.
+ * ----------------------------------------------------------------
+ */
+static void
+heavyUsersQuery(StringInfo querystring, char *recindexname) {
+	appendStringInfo(querystring,"SELECT userid FROM (SELECT userid, queries, sum(queries) OVER (ORDER BY queries DESC, userid ROWS UNBOUNDED PRECEDING) AS running, sum(queries) OVER () AS total FROM %sUserQueries) q WHERE running - queries < total * %f",
+		recindexname,RECATHON_HEAVY_SHARE);
+}
+
+/* ----------------------------------------------------------------
+ *		getHeavyUsers
+ *
+ *		Returns the number of heavy users a hybrid recommender
+ *		has, and the sorted list of them.
+ * ----------------------------------------------------------------
+ */
+static int
+getHeavyUsers(char *recindexname, int **ret_IDs) {
+	int i, numIDs, maxIDs;
+	int *IDs;
+	// Query objects.
+	StringInfoData querystring;
+	QueryDesc *queryDesc;
+	PlanState *planstate;
+	TupleTableSlot *slot;
+	MemoryContext recathoncontext;
+	tuple_column usercol;
+
+	initStringInfo(&querystring);
+	heavyUsersQuery(&querystring, recindexname);
+	appendStringInfoChar(&querystring,';');
+	queryDesc = recathon_queryStart(querystring.data,&recathoncontext);
+	planstate = queryDesc->planstate;
+	bindColumn(&usercol, "userid");
+
+	numIDs = 0;
+	maxIDs = 64;
+	IDs = (int*) palloc(maxIDs*sizeof(int));
+	for (;;) {
+		slot = ExecProcNode(planstate);
+		if (TupIsNull(slot)) break;
+
+		if (numIDs >= maxIDs) {
+			maxIDs *= 2;
+			IDs = (int*) repalloc(IDs, maxIDs*sizeof(int));
+		}
+		IDs[numIDs++] = columnInt(slot,&usercol);
+	}
+	recathon_queryEnd(queryDesc,recathoncontext);
+	pfree(querystring.data);
+
+	// Sort, and take out the repeats.
+	qsort(IDs, numIDs, sizeof(int), intCompare);
+	for (i = 1; i < numIDs; i++) {
+		if (IDs[i] == IDs[i-1]) {
+			memmove(IDs+i, IDs+i+1, (numIDs-i-1)*sizeof(int));
+			numIDs--;
+			i--;
+		}
+	}
+
+	(*ret_IDs) = IDs;
+	return numIDs;
+}
+
+/* ----------------------------------------------------------------
+ *		maintainHeavyUsers
+ *
+ *		Adds up the queries a hybrid recommender has noted
+ *		down since the last pass, one row per user, fading out
+ *		the older ones so the heavy users follow the workload.
+ *		The new ones come from the tally in shared memory.
+ *		If that turns up a heavy user who wasn't one when the
+ *		RecView was last filled in, we fill it in again.
+ * ----------------------------------------------------------------
+ */
+static void
+maintainHeavyUsers(char *recname, char *recindexname) {
+	int i, numUsers, missing = 0;
+	int *userIDs;
+	float *queries;
+	// Query objects.
+	StringInfoData querystring;
+	QueryDesc *queryDesc;
+	TupleTableSlot *slot;
+	MemoryContext recathoncontext;
+
+	initStringInfo(&querystring);
+	userIDs = (int*) palloc(RECATHON_QUERY_USERS*sizeof(int));
+	queries = (float*) palloc(RECATHON_QUERY_USERS*sizeof(float));
+	numUsers = recathonQueriesDrain(recindexname, userIDs, queries);
+	if (numUsers > 0) {
+		appendStringInfo(&querystring,"INSERT INTO %sUserQueries (userid, queries) VALUES ",
+			recindexname);
+		for (i = 0; i < numUsers; i++)
+			appendStringInfo(&querystring,"%s(%d, %f)",i > 0 ? ", " : "",
+				userIDs[i],queries[i]);
+		appendStringInfoChar(&querystring,';');
+		recathon_queryExecute(querystring.data);
+		CommandCounterIncrement();
+		resetStringInfo(&querystring);
+	}
+	pfree(userIDs);
+	pfree(queries);
+
+	appendStringInfo(&querystring,"WITH moved AS (DELETE FROM %sUserQueries RETURNING userid, queries, inview) INSERT INTO %sUserQueries SELECT userid, sum(queries) * %f, bool_or(inview) FROM moved GROUP BY userid HAVING sum(queries) * %f >= %f;",
+		recindexname,recindexname,RECATHON_QUERY_DECAY,
+		RECATHON_QUERY_DECAY,RECATHON_QUERY_FLOOR);
+	recathon_queryExecute(querystring.data);
+
+	if (getRecViewSize(recindexname) <= 0) {
+		pfree(querystring.data);
+		return;
+	}
+
+	// The next query has to see the counts we just wrote.
+	CommandCounterIncrement();
+
+	resetStringInfo(&querystring);
+	appendStringInfo(&querystring,"SELECT count(*) AS missing FROM %sUserQueries WHERE NOT inview AND userid IN (",
+		recindexname);
+	heavyUsersQuery(&querystring, recindexname);
+	appendStringInfoString(&querystring,");");
+	queryDesc = recathon_queryStart(querystring.data,&recathoncontext);
+	slot = ExecProcNode(queryDesc->planstate);
+	if (!TupIsNull(slot))
+		missing = getTupleInt(slot,"missing");
+	recathon_queryEnd(queryDesc,recathoncontext);
+
+	if (missing > 0)
+		materializeRecView(recname, recindexname);
+
+	pfree(querystring.data);
+}
+
+/* ----------------------------------------------------------------
+ *		writeRecViewUser
+ *
+ *		Writes out the predictions kept for one user, best
+ *		first, and empties the heap for the next user.
+ *		Returns how many rows were written.
+ * ----------------------------------------------------------------
+ */
+static int
+writeRecViewUser(model_writer writer, nbr_heap heap, sim_entry *entries, int userID) {
+	int i, numWritten;
+
+	for (i = 0; i < heap->size; i++) {
+		entries[i].id = heap->index[i];
+		entries[i].event = heap->similarity[i];
+	}
+	qsort(entries, heap->size, sizeof(sim_entry), simEntryEventCompare);
+	for (i = 0; i < heap->size; i++)
+		modelWriterInsert(writer, userID, entries[i].id, entries[i].event);
+
+	numWritten = heap->size;
+	nbrHeapReset(heap);
+	return numWritten;
+}
+
+/* ----------------------------------------------------------------
+ *		writeTopPredictions
+ *
+ *		Runs a RECOMMEND query and writes the best topN of
+ *		each user's predictions into a table with the user,
+ *		item and event columns, in that order. The query
+ *		hands us its predictions one user at a time, so
+ *		we only hold on to the best of one user's at once,
+ *		and the rows go in through a bulk insert, each
+ *		user's together and best first. Returns how many
+ *		rows were written.
+ * ----------------------------------------------------------------
+ */
+static int64
+writeTopPredictions(char *recquery, char *tablename, char *userkey,
+		char *itemkey, char *eventval, int topN) {
+	int currentUser, numUsers;
+	int64 numWritten = 0;
+	nbr_heap heap;
+	sim_entry *entries;
+	model_writer writer;
+	// Query objects.
+	QueryDesc *queryDesc;
+	PlanState *planstate;
+	TupleTableSlot *slot;
+	MemoryContext recathoncontext;
+	tuple_column usercol, itemcol, eventcol;
+
+	writer = modelWriterOpen(tablename);
+	heap = nbrHeapCreate(topN);
+	entries = (sim_entry*) palloc(topN*sizeof(sim_entry));
+
+	queryDesc = recathon_queryStart(recquery,&recathoncontext);
+	planstate = queryDesc->planstate;
+	bindColumn(&usercol, userkey);
+	bindColumn(&itemcol, itemkey);
+	bindColumn(&eventcol, eventval);
+
+	currentUser = 0;
+	numUsers = 0;
+	for (;;) {
+		int userID;
+
+		CHECK_FOR_INTERRUPTS();
+
+		slot = ExecProcNode(planstate);
+		if (TupIsNull(slot)) break;
+
+		userID = columnInt(slot,&usercol);
+		if (heap->size > 0 && userID != currentUser) {
+			numWritten += writeRecViewUser(writer, heap, entries, currentUser);
+			pgstat_progress_update(++numUsers);
+		}
+		currentUser = userID;
+
+		nbrHeapInsert(heap, columnInt(slot,&itemcol),
+			columnFloat(slot,&eventcol));
+	}
+	if (heap->size > 0) {
+		numWritten += writeRecViewUser(writer, heap, entries, currentUser);
+		pgstat_progress_update(++numUsers);
+	}
+
+	recathon_queryEnd(queryDesc,recathoncontext);
+	modelWriterClose(writer);
+	nbrHeapFree(heap);
+	pfree(entries);
+
+	return numWritten;
+}
+
+/* ----------------------------------------------------------------
+ *		logRecViewChanges
+ *
+ *		Notes down in a recommender's Changes table every
+ *		user whose list in its new RecView isn't the one in
+ *		the old: an item has come or gone, or the same items
+ *		are in a different order. A new score for an item
+ *		that keeps its place doesn't count. Without an old
+ *		view, everyone in the new one has changed. Given a
+ *		list of users, only they are compared, the old view
+ *		holding just theirs. If anyone has changed, we notify
+ *		the changes channel with the recommender's name,
+ *		which goes out when we commit.
+ * ----------------------------------------------------------------
+ */
+static void
+logRecViewChanges(char *recname, char *recindexname, char *oldviewname,
+		char *viewname, char *userkey, char *itemkey, char *eventval,
+		char *userlist) {
+	int changed = 0;
+	StringInfoData querystring;
+	RangeVar *oldviewrv = NULL;
+	// Query objects.
+	QueryDesc *queryDesc;
+	TupleTableSlot *slot;
+	MemoryContext recathoncontext;
+
+	if (oldviewname)
+		oldviewrv = makeRangeVar(NULL,oldviewname,0);
+
+	// Each list is compared by rank, ties going to the lower item
+	// the way they're read back. A new recommender's first view
+	// only has a placeholder row in it.
+	initStringInfo(&querystring);
+	if (oldviewrv && relationExists(oldviewrv))
+		appendStringInfo(&querystring,"WITH n AS (SELECT %s AS u, %s AS i, row_number() OVER (PARTITION BY %s ORDER BY %s DESC, %s) AS r FROM %s%s%s%s), o AS (SELECT %s AS u, %s AS i, row_number() OVER (PARTITION BY %s ORDER BY %s DESC, %s) AS r FROM %s WHERE %s <> -1 OR %s <> -1) INSERT INTO %sChanges (userid) SELECT DISTINCT u FROM ((SELECT * FROM n EXCEPT SELECT * FROM o) UNION ALL (SELECT * FROM o EXCEPT SELECT * FROM n)) d;",
+			userkey,itemkey,userkey,eventval,itemkey,viewname,
+			userlist ? " WHERE " : "",userlist ? userkey : "",
+			userlist ? userlist : "",
+			userkey,itemkey,userkey,eventval,itemkey,oldviewname,
+			userkey,itemkey,recindexname);
+	else
+		appendStringInfo(&querystring,"INSERT INTO %sChanges (userid) SELECT DISTINCT %s FROM %s;",
+			recindexname,userkey,viewname);
+	recathon_queryExecute(querystring.data);
+	CommandCounterIncrement();
+
+	// now() is when this transaction started, so it picks out
+	// just what we added.
+	resetStringInfo(&querystring);
+	appendStringInfo(&querystring,"SELECT count(*) AS changed FROM %sChanges WHERE changedat = now();",
+		recindexname);
+	queryDesc = recathon_queryStart(querystring.data,&recathoncontext);
+	slot = ExecProcNode(queryDesc->planstate);
+	if (!TupIsNull(slot))
+		changed = getTupleInt(slot,"changed");
+	recathon_queryEnd(queryDesc,recathoncontext);
+
+	if (changed > 0)
+		Async_Notify(RECATHON_CHANGES_CHANNEL, recname);
+
+	if (oldviewrv)
+		pfree(oldviewrv);
+	pfree(querystring.data);
+}
+
+/* ----------------------------------------------------------------
+ *		noteRecViewFilled
+ *
+ *		Records when a recommender's RecView was last brought
+ *		up to date, wholly or for the users who needed it,
+ *		in RecModelsCatalogue's viewfilled. Catalogues from
+ *		before it get the column with the next CREATE
+ *		RECOMMENDER.
+ * ----------------------------------------------------------------
+ */
+static void
+noteRecViewFilled(char *recindexname) {
+	char querystring[1024];
+	RangeVar *cataloguerv;
+	bool exists;
+
+	cataloguerv = makeRangeVar(NULL,"recmodelscatalogue",0);
+	exists = columnExistsInRelation("viewfilled",cataloguerv);
+	pfree(cataloguerv);
+	if (!exists)
+		return;
+
+	sprintf(querystring,"UPDATE RecModelsCatalogue SET viewfilled = now() WHERE recommenderindexname = '%s';",
+		recindexname);
+	recathon_queryExecute(querystring);
+}
+
+/* ----------------------------------------------------------------
+ *		getRecEventsInserted
+ *
+ *		Looks up how many rows had been inserted into a
+ *		recommender's events table, by eventsInserted, when
+ *		its model was built. Returns -1 if it isn't known,
+ *		as for a catalogue from before we kept it.
+ * ----------------------------------------------------------------
+ */
+static int64
+getRecEventsInserted(char *recindexname) {
+	int64 inserted = -1;
+	tuple_column col;
+	Datum value;
+	TupleTableSlot *slot;
+
+	slot = getRecCatalogueSlot(recindexname);
+	if (!slot)
+		return -1;
+
+	bindColumn(&col, "eventsinserted");
+	if (columnDatum(slot, &col, &value))
+		inserted = DatumGetInt64(value);
+
+	ExecDropSingleTupleTableSlot(slot);
+	return inserted;
+}
+
+/* ----------------------------------------------------------------
+ *		storeRecEventsInserted
+ *
+ *		Records the count getRecEventsInserted looks up, if
+ *		the catalogue has a column for it.
+ * ----------------------------------------------------------------
+ */
+static void
+storeRecEventsInserted(char *recindexname, int64 inserted) {
+	char querystring[1024];
+	RangeVar *cataloguerv;
+	bool exists;
+
+	cataloguerv = makeRangeVar(NULL,"recmodelscatalogue",0);
+	exists = columnExistsInRelation("eventsinserted",cataloguerv);
+	pfree(cataloguerv);
+	if (!exists)
+		return;
+
+	sprintf(querystring,"UPDATE RecModelsCatalogue SET eventsinserted = " INT64_FORMAT " WHERE recommenderindexname = '%s';",
+		inserted,recindexname);
+	recathon_queryExecute(querystring);
+}
+
+/* ----------------------------------------------------------------
+ *		materializeRecView
+ *
+ *		Fills a new RecView with the best predictions for
+ *		every user, as many as the materialize option asks
+ *		for, and points the recommender at it. Each user's
+ *		rows go in together, so the view comes out clustered
+ *		by user, and its primary key makes each user's list
+ *		a short index range scan. Like a model
+ *		rebuild, the old view stays in place until we're done.
+ *		A hybrid recommender only fills it in for its heavy
+ *		users; everyone else gets scored on demand. One built
+ *		with notify_changes logs whose lists the new view
+ *		changed, before the old one goes.
+ * ----------------------------------------------------------------
+ */
+void
+materializeRecView(char *recname, char *recindexname) {
+	int i, topN, numHeavy;
+	int *heavyIDs = NULL;
+	bool hybrid;
+	StringInfoData recquery;
+	char *eventtable, *userkey, *itemkey, *eventval, *method;
+	char *viewname, *oldviewname;
+	struct timeval timestamp;
+	// Query objects.
+	char *querystring;
+	QueryDesc *queryDesc;
+	TupleTableSlot *slot;
+	MemoryContext recathoncontext;
+
+	topN = getRecViewSize(recindexname);
+	if (topN <= 0)
+		return;
+
+	// The query below has to see the models we've just built.
+	CommandCounterIncrement();
+
+	getRecInfo(recindexname, &eventtable, &userkey, &itemkey,
+		&eventval, &method, NULL);
+
+	// The new view doesn't get its primary key until it's full.
+	gettimeofday(&timestamp,NULL);
+	viewname = (char*) palloc(256*sizeof(char));
+	sprintf(viewname,"%sView%ld%ld",recname,
+		timestamp.tv_sec,timestamp.tv_usec);
+	querystring = (char*) palloc(1024*sizeof(char));
+	sprintf(querystring,"CREATE TABLE %s (%s INTEGER NOT NULL, %s INTEGER NOT NULL, %s REAL NOT NULL);",
+		viewname,userkey,itemkey,eventval);
+	recathon_utilityExecute(querystring);
+
+	hybrid = getRecHybrid(recindexname);
+	numHeavy = 0;
+	if (hybrid)
+		numHeavy = getHeavyUsers(recindexname, &heavyIDs);
+
+	initStringInfo(&recquery);
+	// Nobody needs recommending what they've rated already.
+	appendStringInfo(&recquery,"SELECT r.%s, r.%s, r.%s FROM %s r RECOMMEND r.%s TO r.%s ON r.%s USING %s EXCLUDE RATED",
+		userkey,itemkey,eventval,eventtable,
+		itemkey,userkey,eventval,method);
+	if (hybrid) {
+		appendStringInfo(&recquery," WHERE r.%s IN (",userkey);
+		for (i = 0; i < numHeavy; i++)
+			appendStringInfo(&recquery,"%s%d",i > 0 ? ", " : "",heavyIDs[i]);
+		appendStringInfoChar(&recquery,')');
+	}
+	appendStringInfoChar(&recquery,';');
+
+	// With no heavy users yet, the view stays empty. Otherwise we
+	// only know how many users it's for when they're the heavy ones.
+	pgstat_progress_phase(RECBUILD_PHASE_RECVIEW, hybrid ? numHeavy : 0);
+	if (!hybrid || numHeavy > 0)
+		writeTopPredictions(recquery.data, viewname, userkey, itemkey,
+			eventval, topN);
+
+	// Remember who the view was filled in for.
+	if (hybrid) {
+		resetStringInfo(&recquery);
+		appendStringInfo(&recquery,"UPDATE %sUserQueries SET inview = ",
+			recindexname);
+		if (numHeavy > 0) {
+			appendStringInfoString(&recquery,"userid IN (");
+			for (i = 0; i < numHeavy; i++)
+				appendStringInfo(&recquery,"%s%d",i > 0 ? ", " : "",heavyIDs[i]);
+			appendStringInfoString(&recquery,");");
+		} else
+			appendStringInfoString(&recquery,"false;");
+		recathon_queryExecute(recquery.data);
+	}
+	pfree(recquery.data);
+	if (heavyIDs)
+		pfree(heavyIDs);
+
+	sprintf(querystring,"ALTER TABLE %s ADD PRIMARY KEY (%s, %s);",
+		viewname,userkey,itemkey);
+	recathon_utilityExecute(querystring);
+
+	// Swap the new view in, and drop the old one.
+	sprintf(querystring,"SELECT recviewname FROM %s;",recindexname);
+	queryDesc = recathon_queryStart(querystring,&recathoncontext);
+	slot = ExecProcNode(queryDesc->planstate);
+	oldviewname = NULL;
+	if (!TupIsNull(slot))
+		oldviewname = getTupleString(slot,"recviewname");
+	recathon_queryEnd(queryDesc,recathoncontext);
+
+	if (getRecNotifyChanges(recindexname))
+		logRecViewChanges(recname, recindexname, oldviewname, viewname,
+			userkey, itemkey, eventval, NULL);
+
+	sprintf(querystring,"UPDATE %s SET recviewname = '%s';",
+		recindexname,viewname);
+	recathon_queryExecute(querystring);
+	if (oldviewname) {
+		sprintf(querystring,"DROP TABLE IF EXISTS %s;",oldviewname);
+		recathon_utilityExecute(querystring);
+		pfree(oldviewname);
+	}
+	noteRecViewFilled(recindexname);
+
+	pfree(querystring);
+	pfree(viewname);
+	pfree(eventtable);
+	pfree(userkey);
+	pfree(itemkey);
+	pfree(eventval);
+	pfree(method);
+}
+
+/* ----------------------------------------------------------------
+ *		recViewAffectedUsers
+ *
+ *		Works out whose lists in a recommender's RecView a
+ *		rebuild may have changed, by comparing the models it
+ *		replaces with the new ones. For an item-based model,
+ *		that's everyone who rated an item whose neighbors
+ *		changed; for a user-based one, everyone whose own
+ *		neighbors did; for a factor model, everyone whose
+ *		factors moved, as long as no item's did. Anyone who
+ *		has since rated an item on their list is in too, and
+ *		so is anyone with events but no list, unless only
+ *		a hybrid recommender's heavy users have lists.
+ *		Returns how many users there are, and the sorted
+ *		list of them, or -1 if the whole view has to be
+ *		filled in again: it's empty, the models can't be
+ *		compared, or so many users have changed that
+ *		picking them out isn't worth it.
+ * ----------------------------------------------------------------
+ */
+static int
+recViewAffectedUsers(char *recindexname, recMethod method,
+		char *oldmodelname, char *oldmodelname2, char *newmodelname,
+		char *newmodelname2, int **ret_IDs) {
+	int numIDs, maxIDs;
+	int *IDs;
+	double viewUsers;
+	bool hybrid;
+	char *eventtable, *userkey, *itemkey, *eventval, *strmethod;
+	char *viewname = NULL;
+	RangeVar *viewrv;
+	// Query objects.
+	StringInfoData querystring;
+	QueryDesc *queryDesc;
+	PlanState *planstate;
+	TupleTableSlot *slot;
+	MemoryContext recathoncontext;
+	tuple_column usercol;
+
+	initStringInfo(&querystring);
+	appendStringInfo(&querystring,"SELECT recviewname FROM %s;",recindexname);
+	queryDesc = recathon_queryStart(querystring.data,&recathoncontext);
+	slot = ExecProcNode(queryDesc->planstate);
+	if (!TupIsNull(slot))
+		viewname = getTupleString(slot,"recviewname");
+	recathon_queryEnd(queryDesc,recathoncontext);
+	if (!viewname) {
+		pfree(querystring.data);
+		return -1;
+	}
+	viewrv = makeRangeVar(NULL,viewname,0);
+	if (!relationExists(viewrv)) {
+		pfree(viewrv);
+		pfree(viewname);
+		pfree(querystring.data);
+		return -1;
+	}
+	pfree(viewrv);
+
+	// A factor model from before the arrays keeps one row per
+	// factor, and one whose item factors have moved changes
+	// everyone's scores for those items.
+	if (FACTOR_METHOD(method)) {
+		double numMoved;
+
+		if (!factorModelHasArrays(oldmodelname) ||
+		    !factorModelHasArrays(oldmodelname2)) {
+			pfree(viewname);
+			pfree(querystring.data);
+			return -1;
+		}
+
+		resetStringInfo(&querystring);
+		appendStringInfo(&querystring,"SELECT count(*) FROM %s o FULL JOIN %s n ON o.items = n.items WHERE o.items IS NULL OR n.items IS NULL OR array_length(o.features, 1) IS DISTINCT FROM array_length(n.features, 1) OR (SELECT max(abs(o.features[f] - n.features[f])) FROM generate_subscripts(n.features, 1) f) > %f;",
+			oldmodelname2,newmodelname2,RECATHON_VIEW_TOLERANCE);
+		queryNumbers(querystring.data, &numMoved, 1);
+		if (isnan(numMoved) || numMoved > 0) {
+			pfree(viewname);
+			pfree(querystring.data);
+			return -1;
+		}
+	}
+
+	getRecInfo(recindexname, &eventtable, &userkey, &itemkey,
+		&eventval, &strmethod, NULL);
+
+	// A new recommender's first view only has a placeholder row.
+	resetStringInfo(&querystring);
+	appendStringInfo(&querystring,"SELECT count(DISTINCT %s) FROM %s WHERE %s <> -1;",
+		userkey,viewname,userkey);
+	queryNumbers(querystring.data, &viewUsers, 1);
+	if (isnan(viewUsers) || viewUsers <= 0) {
+		pfree(viewname);
+		pfree(querystring.data);
+		pfree(eventtable);
+		pfree(userkey);
+		pfree(itemkey);
+		pfree(eventval);
+		pfree(strmethod);
+		return -1;
+	}
+
+	// What changed between the models, as a pair of IDs for the
+	// similarity models and one user for the factor models.
+	resetStringInfo(&querystring);
+	if (FACTOR_METHOD(method))
+		appendStringInfo(&querystring,"WITH d AS (SELECT coalesce(o.users, n.users) AS a FROM %s o FULL JOIN %s n ON o.users = n.users WHERE o.users IS NULL OR n.users IS NULL OR array_length(o.features, 1) IS DISTINCT FROM array_length(n.features, 1) OR (SELECT max(abs(o.features[f] - n.features[f])) FROM generate_subscripts(n.features, 1) f) > %f) SELECT userid FROM (SELECT a FROM d",
+			oldmodelname,newmodelname,RECATHON_VIEW_TOLERANCE);
+	else if (method == userCosCF || method == userPearCF)
+		appendStringInfo(&querystring,"WITH d AS (SELECT coalesce(o.user1, n.user1) AS a, coalesce(o.user2, n.user2) AS b FROM %s o FULL JOIN %s n ON o.user1 = n.user1 AND o.user2 = n.user2 WHERE o.user1 IS NULL OR n.user1 IS NULL OR abs(o.similarity - n.similarity) > %f) SELECT userid FROM (SELECT a FROM d UNION SELECT b FROM d",
+			oldmodelname,newmodelname,RECATHON_VIEW_TOLERANCE);
+	else
+		appendStringInfo(&querystring,"WITH d AS (SELECT coalesce(o.item1, n.item1) AS a, coalesce(o.item2, n.item2) AS b FROM %s o FULL JOIN %s n ON o.item1 = n.item1 AND o.item2 = n.item2 WHERE o.item1 IS NULL OR n.item1 IS NULL OR abs(o.similarity - n.similarity) > %f) SELECT userid FROM (SELECT %s FROM %s WHERE %s IN (SELECT a FROM d UNION SELECT b FROM d)",
+			oldmodelname,newmodelname,RECATHON_VIEW_TOLERANCE,
+			userkey,eventtable,itemkey);
+
+	// EXCLUDE RATED takes what they've rated off their lists.
+	appendStringInfo(&querystring," UNION SELECT v.%s FROM %s v JOIN %s e ON e.%s = v.%s AND e.%s = v.%s",
+		userkey,viewname,eventtable,userkey,userkey,itemkey,itemkey);
+
+	hybrid = getRecHybrid(recindexname);
+	if (hybrid)
+		appendStringInfo(&querystring,") a (userid) WHERE userid IN (SELECT userid FROM %sUserQueries WHERE inview) ORDER BY userid;",
+			recindexname);
+	else
+		appendStringInfo(&querystring," UNION (SELECT %s FROM %s EXCEPT SELECT %s FROM %s)) a (userid) ORDER BY userid;",
+			userkey,eventtable,userkey,viewname);
+
+	queryDesc = recathon_queryStart(querystring.data,&recathoncontext);
+	planstate = queryDesc->planstate;
+	bindColumn(&usercol, "userid");
+
+	numIDs = 0;
+	maxIDs = 64;
+	IDs = (int*) palloc(maxIDs*sizeof(int));
+	for (;;) {
+		CHECK_FOR_INTERRUPTS();
+
+		slot = ExecProcNode(planstate);
+		if (TupIsNull(slot)) break;
+
+		if (numIDs >= maxIDs) {
+			maxIDs *= 2;
+			IDs = (int*) repalloc(IDs, maxIDs*sizeof(int));
+		}
+		IDs[numIDs++] = columnInt(slot,&usercol);
+	}
+	recathon_queryEnd(queryDesc,recathoncontext);
+
+	pfree(viewname);
+	pfree(querystring.data);
+	pfree(eventtable);
+	pfree(userkey);
+	pfree(itemkey);
+	pfree(eventval);
+	pfree(strmethod);
+
+	if (numIDs > RECATHON_VIEW_REFILL_SHARE * viewUsers) {
+		pfree(IDs);
+		return -1;
+	}
+
+	(*ret_IDs) = IDs;
+	return numIDs;
+}
+
+/* ----------------------------------------------------------------
+ *		refreshRecView
+ *
+ *		Fills in the given users' lists in a recommender's
+ *		RecView again, in place, after a rebuild has changed
+ *		them (see recViewAffectedUsers). Everyone else keeps
+ *		the list they had; queries see the new ones once we
+ *		commit. One built with notify_changes logs which of
+ *		these users' lists came out different.
+ * ----------------------------------------------------------------
+ */
+static void
+refreshRecView(char *recname, char *recindexname, int *userIDs,
+		int numUsers) {
+	int i, topN;
+	bool notify;
+	char *eventtable, *userkey, *itemkey, *eventval, *method;
+	char *viewname = NULL;
+	char oldviewname[NAMEDATALEN+16];
+	StringInfoData userlist, querystring;
+	// Query objects.
+	QueryDesc *queryDesc;
+	TupleTableSlot *slot;
+	MemoryContext recathoncontext;
+
+	topN = getRecViewSize(recindexname);
+	if (topN <= 0)
+		return;
+	if (numUsers == 0) {
+		noteRecViewFilled(recindexname);
+		return;
+	}
+
+	// The queries below have to see the models we've just built.
+	CommandCounterIncrement();
+
+	getRecInfo(recindexname, &eventtable, &userkey, &itemkey,
+		&eventval, &method, NULL);
+
+	initStringInfo(&querystring);
+	appendStringInfo(&querystring,"SELECT recviewname FROM %s;",recindexname);
+	queryDesc = recathon_queryStart(querystring.data,&recathoncontext);
+	slot = ExecProcNode(queryDesc->planstate);
+	if (!TupIsNull(slot))
+		viewname = getTupleString(slot,"recviewname");
+	recathon_queryEnd(queryDesc,recathoncontext);
+
+	initStringInfo(&userlist);
+	appendStringInfoString(&userlist," IN (");
+	for (i = 0; i < numUsers; i++)
+		appendStringInfo(&userlist,"%s%d",i > 0 ? ", " : "",userIDs[i]);
+	appendStringInfoChar(&userlist,')');
+
+	// The lists we're replacing are kept until we've seen which
+	// of them changed.
+	notify = getRecNotifyChanges(recindexname);
+	if (notify) {
+		snprintf(oldviewname,sizeof(oldviewname),"%sViewOld",recname);
+		resetStringInfo(&querystring);
+		appendStringInfo(&querystring,"CREATE TEMP TABLE %s ON COMMIT DROP AS SELECT * FROM %s WHERE %s%s;",
+			oldviewname,viewname,userkey,userlist.data);
+		recathon_utilityExecute(querystring.data);
+	}
+
+	resetStringInfo(&querystring);
+	appendStringInfo(&querystring,"DELETE FROM %s WHERE %s%s;",
+		viewname,userkey,userlist.data);
+	recathon_queryExecute(querystring.data);
+	CommandCounterIncrement();
+
+	resetStringInfo(&querystring);
+	appendStringInfo(&querystring,"SELECT r.%s, r.%s, r.%s FROM %s r RECOMMEND r.%s TO r.%s ON r.%s USING %s EXCLUDE RATED WHERE r.%s%s;",
+		userkey,itemkey,eventval,eventtable,
+		itemkey,userkey,eventval,method,
+		userkey,userlist.data);
+	pgstat_progress_phase(RECBUILD_PHASE_RECVIEW, numUsers);
+	writeTopPredictions(querystring.data, viewname, userkey, itemkey,
+		eventval, topN);
+	CommandCounterIncrement();
+
+	if (notify) {
+		logRecViewChanges(recname, recindexname, oldviewname, viewname,
+			userkey, itemkey, eventval, userlist.data);
+		resetStringInfo(&querystring);
+		appendStringInfo(&querystring,"DROP TABLE %s;",oldviewname);
+		recathon_utilityExecute(querystring.data);
+	}
+	noteRecViewFilled(recindexname);
+
+	pfree(querystring.data);
+	pfree(userlist.data);
+	pfree(viewname);
+	pfree(eventtable);
+	pfree(userkey);
+	pfree(itemkey);
+	pfree(eventval);
+	pfree(method);
+}
+
+/* ----------------------------------------------------------------
+ *		sparseCreate
+ *
+ *		Creates an empty sparse model with the given
+ *		number of rows.
+ * ----------------------------------------------------------------
+ */
+GenSparseModel*
+sparseCreate(int numRows) {
+	GenSparseModel *model;
+
+	model = (GenSparseModel*) palloc(sizeof(GenSparseModel));
+	model->numRows = numRows;
+	model->numEntries = 0;
+	model->maxEntries = (numRows > 0) ? numRows : 1;
+	model->rowStart = (int*) palloc0((numRows+1)*sizeof(int));
+	model->colIndex = (int*) palloc(model->maxEntries*sizeof(int));
+	model->values = (float*) palloc(model->maxEntries*sizeof(float));
+	model->valueBits = RECATHON_FULL_PRECISION;
+	model->qvalues = NULL;
+	model->rowScale = NULL;
+	model->packed = NULL;
+	model->packStart = NULL;
+	model->maxRowLength = 0;
+	model->rowBuf = NULL;
+
+	return model;
+}
+
+/* ----------------------------------------------------------------
+ *		sparseStartRow
+ *
+ *		Marks the start of a row. Rows must be started in
+ *		increasing order, and row numRows must be started
+ *		once the last row is complete.
+ * ----------------------------------------------------------------
+ */
+void
+sparseStartRow(GenSparseModel *model, int row) {
+	model->rowStart[row] = model->numEntries;
+}
+
+/* ----------------------------------------------------------------
+ *		sparseAppend
+ *
+ *		Adds an entry to the row currently being built.
+ * ----------------------------------------------------------------
+ */
+void
+sparseAppend(GenSparseModel *model, int col, float value) {
+	if (model->numEntries >= model->maxEntries) {
+		model->maxEntries *= 2;
+		model->colIndex = (int*) repalloc(model->colIndex,
+					model->maxEntries*sizeof(int));
+		model->values = (float*) repalloc(model->values,
+					model->maxEntries*sizeof(float));
+	}
+
+	model->colIndex[model->numEntries] = col;
+	model->values[model->numEntries] = value;
+	model->numEntries++;
+}
+
+/*
+ * Adds an event to row, which is being built, in order of column,
+ * combining it with the one before if that's for the same column and
+ * repeated events are combined.
+ */
+static void
+sparseAppendEvent(GenSparseModel *model, int row, int col, float event) {
+	int last = model->numEntries - 1;
+
+	if (recathon_duplicate_events != RECATHON_DUPLICATES_KEEP &&
+	    last >= model->rowStart[row] && model->colIndex[last] == col) {
+		model->values[last] = mergeDuplicateEvent(model->values[last], event);
+		return;
+	}
+	sparseAppend(model, col, firstDuplicateEvent(event));
+}
+
+/* ----------------------------------------------------------------
+ *		sparseFree
+ *
+ *		Free a sparse model.
+ * ----------------------------------------------------------------
+ */
+void
+sparseFree(GenSparseModel *model) {
+	if (!model)
+		return;
+
+	pfree(model->rowStart);
+	pfree(model->colIndex);
+	pfree(model->values);
+	pfree(model);
+}
+
+/* ----------------------------------------------------------------
+ *		loadItemEvents
+ *
+ *		Reads the whole events table once, into a sparse
+ *		model with one row per item in fullItemList, holding
+ *		each user who rated it and their event. Users are
+ *		stored as indexes into eventUsers, the sorted list of
+ *		every user in the table, in order.
+ *		User-based CF scores an item by going through this
+ *		row, rather than querying the events for each item.
+ * ----------------------------------------------------------------
+ */
+void
+loadItemEvents(RecScanState *recnode) {
+	int row, priorID, itemindex;
+	AttributeInfo *attributes;
+	GenSparseModel *model;
+	// Query objects.
+	char *querystring;
+	QueryDesc *queryDesc;
+	PlanState *planstate;
+	TupleTableSlot *slot;
+	MemoryContext recathoncontext;
+	tuple_column usercol, itemcol, eventcol;
+
+	attributes = (AttributeInfo*) recnode->attributes;
+	model = sparseCreate(recnode->fullTotalItems);
+
+	querystring = (char*) palloc(1024*sizeof(char));
+	sprintf(querystring,"select %s, %s, %s from %s order by %s, %s;",
+		attributes->userkey,attributes->itemkey,attributes->eventval,
+		attributes->eventtable,attributes->itemkey,attributes->userkey);
+	queryDesc = recathon_queryStart(querystring,&recathoncontext);
+	planstate = queryDesc->planstate;
+	bindColumn(&usercol, attributes->userkey);
+	bindColumn(&itemcol, attributes->itemkey);
+	bindColumn(&eventcol, attributes->eventval);
+
+	// Rows have to be started in order, including empty ones.
+	row = -1;
+	priorID = -1;
+	itemindex = -1;
+	for (;;) {
+		int userID, itemID;
+		float event;
+
+		slot = ExecProcNode(planstate);
+		if (TupIsNull(slot)) break;
+
+		userID = columnInt(slot,&usercol);
+		itemID = columnInt(slot,&itemcol);
+		event = columnFloat(slot,&eventcol);
+
+		if (row < 0 || itemID != priorID) {
+			priorID = itemID;
+			itemindex = itemIndex(recnode, itemID);
+			while (row < itemindex)
+				sparseStartRow(model, ++row);
+		}
+		// Items we aren't predicting for don't matter.
+		if (itemindex < 0) continue;
+
+		sparseAppendEvent(model, row, userID, event);
+	}
+	recathon_queryEnd(queryDesc,recathoncontext);
+	pfree(querystring);
+
+	while (row < recnode->fullTotalItems)
+		sparseStartRow(model, ++row);
+
+	// Number the users, so that their similarities can go in
+	// a plain array, and store those numbers instead of IDs.
+	{
+		int i, numUsers;
+		int *userIDs;
+
+		userIDs = (int*) palloc((model->numEntries+1)*sizeof(int));
+		memcpy(userIDs, model->colIndex, model->numEntries*sizeof(int));
+		qsort(userIDs, model->numEntries, sizeof(int), intCompare);
+		numUsers = 0;
+		for (i = 0; i < model->numEntries; i++) {
+			if (numUsers > 0 && userIDs[numUsers-1] == userIDs[i])
+				continue;
+			userIDs[numUsers++] = userIDs[i];
+		}
+		for (i = 0; i < model->numEntries; i++)
+			model->colIndex[i] = binarySearch(userIDs, model->colIndex[i], 0, numUsers);
+
+		recnode->eventUsers = userIDs;
+		recnode->numEventUsers = numUsers;
+	}
+
+	recnode->itemEvents = model;
+}
+
+/* ----------------------------------------------------------------
+ *		loadUserEvents
+ *
+ *		Reads the whole events table once, into a sparse
+ *		model with one row per user in userList, holding the
+ *		index in fullItemList of each item they rated, or -1,
+ *		and their event. The rows are in order of user ID,
+ *		as kept in userEventIDs. With this, preparing a user
+ *		for scoring needs no queries, so it can be done by
+ *		the worker processes of a parallel scan.
+ * ----------------------------------------------------------------
+ */
+void
+loadUserEvents(RecScanState *recnode) {
+	int i, row, numUsers;
+	int *userIDs;
+	AttributeInfo *attributes;
+	GenSparseModel *model;
+	// Query objects.
+	char *querystring;
+	QueryDesc *queryDesc;
+	PlanState *planstate;
+	TupleTableSlot *slot;
+	MemoryContext recathoncontext;
+	tuple_column usercol, itemcol, eventcol;
+
+	attributes = (AttributeInfo*) recnode->attributes;
+
+	// The rows go in order of user ID, without duplicates.
+	userIDs = (int*) palloc((recnode->totalUsers+1)*sizeof(int));
+	memcpy(userIDs, recnode->userList, recnode->totalUsers*sizeof(int));
+	qsort(userIDs, recnode->totalUsers, sizeof(int), intCompare);
+	numUsers = 0;
+	for (i = 0; i < recnode->totalUsers; i++) {
+		if (numUsers > 0 && userIDs[numUsers-1] == userIDs[i])
+			continue;
+		userIDs[numUsers++] = userIDs[i];
+	}
+	model = sparseCreate(numUsers);
+
+	querystring = (char*) palloc(1024*sizeof(char));
+	sprintf(querystring,"select %s, %s, %s from %s order by %s, %s;",
+		attributes->userkey,attributes->itemkey,attributes->eventval,
+		attributes->eventtable,attributes->userkey,attributes->itemkey);
+	queryDesc = recathon_queryStart(querystring,&recathoncontext);
+	planstate = queryDesc->planstate;
+	bindColumn(&usercol, attributes->userkey);
+	bindColumn(&itemcol, attributes->itemkey);
+	bindColumn(&eventcol, attributes->eventval);
+
+	// The events come in the same order as the rows, so we can
+	// walk through both at once.
+	row = -1;
+	for (;;) {
+		int userID, itemID;
+		float event;
+
+		slot = ExecProcNode(planstate);
+		if (TupIsNull(slot)) break;
+
+		userID = columnInt(slot,&usercol);
+		itemID = columnInt(slot,&itemcol);
+		event = columnFloat(slot,&eventcol);
+
+		while (row < numUsers-1 && (row < 0 || userIDs[row] < userID))
+			sparseStartRow(model, ++row);
+		// Users we aren't scoring don't matter.
+		if (row < 0 || userIDs[row] != userID) continue;
+
+		sparseAppendEvent(model, row, itemIndex(recnode, itemID), event);
+	}
+	recathon_queryEnd(queryDesc,recathoncontext);
+	pfree(querystring);
+
+	while (row < numUsers)
+		sparseStartRow(model, ++row);
+
+	recnode->userEvents = model;
+	recnode->userEventIDs = userIDs;
+}
+
+/* ----------------------------------------------------------------
+ *		generatedModelStamp
+ *
+ *		Describes the state of an events table, for telling
+ *		whether a model generated from it is still good: its
+ *		storage, the transactions that have committed events
+ *		to it (see recathonevents.c), and the rows inserted,
+ *		updated or deleted, as the statistics collector and
+ *		our own transaction have counted them. Returns false
+ *		if we can't tell, as for a view or a foreign table,
+ *		in which case nothing is kept.
+ * ----------------------------------------------------------------
+ */
+static bool
+generatedModelStamp(char *eventtable, generated_stamp *stamp) {
+	Oid relid;
+	Relation rel;
+	PgStat_StatTabEntry *tabstats;
+	PgStat_TableStatus *pending;
+	PgStat_TableXactStatus *trans;
+
+	relid = RelnameGetRelid(eventtable);
+	if (!OidIsValid(relid) || has_subclass(relid) ||
+	    get_rel_relkind(relid) != RELKIND_RELATION)
+		return false;
+	tabstats = pgstat_fetch_stat_tabentry(relid);
+	if (!tabstats)
+		return false;
+	if (!recathonEventsWatch(relid, &stamp->generation))
+		return false;
+
+	rel = heap_open(relid, AccessShareLock);
+	stamp->relfilenode = rel->rd_node.relNode;
+	heap_close(rel, AccessShareLock);
+
+	stamp->changes = tabstats->tuples_inserted + tabstats->tuples_updated +
+		tabstats->tuples_deleted;
+	pending = find_tabstat_entry(relid);
+	if (pending) {
+		stamp->changes += pending->t_counts.t_tuples_inserted +
+			pending->t_counts.t_tuples_updated +
+			pending->t_counts.t_tuples_deleted;
+		for (trans = pending->trans; trans; trans = trans->upper)
+			stamp->changes += trans->tuples_inserted +
+				trans->tuples_updated + trans->tuples_deleted;
+	}
+	return true;
+}
+
+/*
+ * Were two models generated from the same state of their events?
+ */
+static bool
+sameGeneratedStamp(generated_stamp *a, generated_stamp *b) {
+	return a->relfilenode == b->relfilenode &&
+		a->generation == b->generation && a->changes == b->changes;
+}
+
+/* ----------------------------------------------------------------
+ *		dropGeneratedModel
+ *
+ *		Forgets a kept on-the-fly model.
+ * ----------------------------------------------------------------
+ */
+static void
+dropGeneratedModel(generated_model *gm) {
+	generated_model **link;
+
+	for (link = &recathon_generated_models; *link; link = &(*link)->next) {
+		if (*link == gm) {
+			(*link) = gm->next;
+			break;
+		}
+	}
+	MemoryContextDelete(gm->context);
+}
+
+/* ----------------------------------------------------------------
+ *		findGeneratedModel
+ *
+ *		Looks for a kept model for a query's events, method
+ *		and columns. One whose events table has changed since
+ *		it was generated is thrown out.
+ * ----------------------------------------------------------------
+ */
+static generated_model*
+findGeneratedModel(AttributeInfo *attributes, generated_stamp *stamp) {
+	generated_model *gm;
+
+	for (gm = recathon_generated_models; gm; gm = gm->next) {
+		if (gm->method != attributes->method ||
+		    strcmp(gm->eventtable, attributes->eventtable) != 0 ||
+		    strcmp(gm->userkey, attributes->userkey) != 0 ||
+		    strcmp(gm->itemkey, attributes->itemkey) != 0 ||
+		    strcmp(gm->eventval, attributes->eventval) != 0)
+			continue;
+
+		if (!sameGeneratedStamp(&gm->stamp, stamp)) {
+			dropGeneratedModel(gm);
+			return NULL;
+		}
+		return gm;
+	}
+	return NULL;
+}
+
+/* ----------------------------------------------------------------
+ *		restoreGeneratedModel
+ *
+ *		A query with no recommender generates its model on the
+ *		fly, which for SVD means training it from scratch. So
+ *		the models generated by one query are kept, at most
+ *		RECATHON_GENERATED_MODELS of them and no more than
+ *		maintenance_work_mem in all, and the next query over
+ *		the same events, method and columns copies one into
+ *		its scan instead, if its events table hasn't changed
+ *		in the meantime. With the model cache on, so can
+ *		other sessions' queries. Returns true if it did; otherwise the
+ *		caller generates the model and hands it and the stamp
+ *		we fill in to keepGeneratedModel.
+ * ----------------------------------------------------------------
+ */
+static bool
+restoreGeneratedModel(RecScanState *recnode, generated_stamp *stamp) {
+	AttributeInfo *attributes = (AttributeInfo*) recnode->attributes;
+	generated_model *gm;
+
+	stamp->valid = generatedModelStamp(attributes->eventtable, stamp);
+	if (!stamp->valid)
+		return false;
+
+	gm = findGeneratedModel(attributes, stamp);
+	if (!gm)
+		return restoreSharedModel(recnode, stamp);
+
+	// An item-based model only lists every user if it had to.
+	if (!gm->factors && !recnode->userList && !gm->userIDs)
+		return false;
+
+	copyGeneratedModel(recnode, gm);
+	gm->lastUsed = ++recathon_generated_clock;
+	elog(DEBUG1, "reusing the model generated from %s", attributes->eventtable);
+	return true;
+}
+
+/* ----------------------------------------------------------------
+ *		copyGeneratedModel
+ *
+ *		Copies a kept model into a scan.
+ * ----------------------------------------------------------------
+ */
+static void
+copyGeneratedModel(RecScanState *recnode, generated_model *gm) {
+	AttributeInfo *attributes = (AttributeInfo*) recnode->attributes;
+
+	if (gm->factors || !recnode->userList) {
+		recnode->totalUsers = gm->numUsers;
+		recnode->userList = (int*) palloc(gm->numUsers*sizeof(int));
+		memcpy(recnode->userList, gm->userIDs, gm->numUsers*sizeof(int));
+		if (!gm->factors)
+			attributes->userID = recnode->userList[0] - 1;
+	}
+	recnode->fullTotalItems = gm->numItems;
+	recnode->fullItemList = (int*) palloc(Max(gm->numItems,1)*sizeof(int));
+	memcpy(recnode->fullItemList, gm->itemIDs, gm->numItems*sizeof(int));
+
+	if (gm->factors) {
+		Size userValues = (Size) gm->numFeatures * gm->numUsers;
+		Size itemValues = (Size) gm->numFeatures * gm->numItems;
+
+		recnode->numFeatures = gm->numFeatures;
+		recnode->SVDusermodel = (float*) palloc(Max(userValues,1)*sizeof(float));
+		memcpy(recnode->SVDusermodel, gm->userFeatures, userValues*sizeof(float));
+		recnode->SVDitemmodel = (float*) palloc(Max(itemValues,1)*sizeof(float));
+		memcpy(recnode->SVDitemmodel, gm->itemFeatures, itemValues*sizeof(float));
+	} else {
+		GenSparseModel *model = gm->itemmodel;
+		GenSparseModel *copy;
+
+		copy = sparseCreate(model->numRows);
+		copy->numEntries = model->numEntries;
+		copy->maxEntries = Max(model->numEntries, 1);
+		copy->colIndex = (int*) repalloc(copy->colIndex, copy->maxEntries*sizeof(int));
+		copy->values = (float*) repalloc(copy->values, copy->maxEntries*sizeof(float));
+		memcpy(copy->rowStart, model->rowStart, (model->numRows+1)*sizeof(int));
+		memcpy(copy->colIndex, model->colIndex, model->numEntries*sizeof(int));
+		memcpy(copy->values, model->values, model->numEntries*sizeof(float));
+		recnode->itemCFmodel = copy;
 	}
+}
 
-	// Query cleanup.
-	recathon_queryEnd(simqueryDesc, simcontext);
+/* ----------------------------------------------------------------
+ *		keepGeneratedModel
+ *
+ *		Keeps a copy of the model just generated for a scan,
+ *		to be found by restoreGeneratedModel. An item-based
+ *		model keeps the list of every user if it was made.
+ *		The least recently used models make room for it.
+ * ----------------------------------------------------------------
+ */
+static void
+keepGeneratedModel(RecScanState *recnode, generated_stamp *stamp,
+		bool factors, bool allUsers) {
+	AttributeInfo *attributes = (AttributeInfo*) recnode->attributes;
+	generated_model *gm, *old;
+	MemoryContext context, oldcontext;
+	Size size, total, limit;
+
+	if (!stamp->valid)
+		return;
 
-	// We're going to write out the results to file.
-	if ((fp = fopen(temprecfile,"w")) == NULL)
-		ereport(ERROR,
-			(errcode(ERRCODE_SYNTAX_ERROR),
-			 errmsg("failed to open temporary file")));
-	insertstring = (char*) palloc(128*sizeof(char));
+	// Work out how much room it needs, and if it's worth it.
+	size = (Size) recnode->fullTotalItems * sizeof(int);
+	if (factors || allUsers)
+		size += (Size) recnode->totalUsers * sizeof(int);
+	if (factors)
+		size += (Size) recnode->numFeatures *
+			(recnode->totalUsers + recnode->fullTotalItems) * sizeof(float);
+	else
+		size += (Size) recnode->itemCFmodel->numEntries * (sizeof(int) + sizeof(float)) +
+			(Size) (recnode->itemCFmodel->numRows + 1) * sizeof(int);
+	limit = (Size) maintenance_work_mem * 1024L;
+	if (size > limit)
+		return;
 
-	// Now we do the similarity calculations. Note that we
-	// don't include duplicate entries, to save time and space.
-	// The first item ALWAYS has a lower value than the second.
-	for (i = 0; i < numItems; i++) {
-		float length_i;
-		sim_node item_i;
-		nbr_node temp_nbr;
-		nbr_node nbr_list = NULL;
+	// An older model of the same events goes, as do the least
+	// recently used, until there's room.
+	old = findGeneratedModel(attributes, stamp);
+	if (old)
+		dropGeneratedModel(old);
+	for (;;) {
+		generated_model *lru = NULL;
+		int count = 0;
+
+		total = 0;
+		for (gm = recathon_generated_models; gm; gm = gm->next) {
+			count++;
+			total += gm->size;
+			if (!lru || gm->lastUsed < lru->lastUsed)
+				lru = gm;
+		}
+		if (!lru || (count < RECATHON_GENERATED_MODELS && total + size <= limit))
+			break;
+		dropGeneratedModel(lru);
+	}
 
-		item_i = itemEvents[i];
-		if (!item_i) continue;
-		length_i = itemLengths[i];
+	// It's built under the query's context, so an error leaves
+	// nothing behind, and only kept once it's complete.
+	context = AllocSetContextCreate(CurrentMemoryContext,
+						"RecathonGeneratedModel",
+						ALLOCSET_DEFAULT_MINSIZE,
+						ALLOCSET_DEFAULT_INITSIZE,
+						ALLOCSET_DEFAULT_MAXSIZE);
+	oldcontext = MemoryContextSwitchTo(context);
+
+	gm = (generated_model*) palloc0(sizeof(generated_model));
+	gm->context = context;
+	gm->method = attributes->method;
+	strlcpy(gm->eventtable, attributes->eventtable, NAMEDATALEN);
+	strlcpy(gm->userkey, attributes->userkey, NAMEDATALEN);
+	strlcpy(gm->itemkey, attributes->itemkey, NAMEDATALEN);
+	strlcpy(gm->eventval, attributes->eventval, NAMEDATALEN);
+	gm->stamp = *stamp;
+	gm->factors = factors;
+	gm->size = size;
+	gm->lastUsed = ++recathon_generated_clock;
+
+	gm->numItems = recnode->fullTotalItems;
+	gm->itemIDs = (int*) palloc(Max(gm->numItems,1)*sizeof(int));
+	memcpy(gm->itemIDs, recnode->fullItemList, gm->numItems*sizeof(int));
+	if (factors || allUsers) {
+		gm->numUsers = recnode->totalUsers;
+		gm->userIDs = (int*) palloc(Max(gm->numUsers,1)*sizeof(int));
+		memcpy(gm->userIDs, recnode->userList, gm->numUsers*sizeof(int));
+	}
 
-		for (j = i+1; j < numItems; j++) {
-			float length_j;
-			sim_node item_j;
-			int item1, item2;
-			float similarity;
+	if (factors) {
+		Size userValues = (Size) recnode->numFeatures * gm->numUsers;
+		Size itemValues = (Size) recnode->numFeatures * gm->numItems;
+
+		gm->numFeatures = recnode->numFeatures;
+		gm->userFeatures = (float*) palloc(Max(userValues,1)*sizeof(float));
+		memcpy(gm->userFeatures, recnode->SVDusermodel, userValues*sizeof(float));
+		gm->itemFeatures = (float*) palloc(Max(itemValues,1)*sizeof(float));
+		memcpy(gm->itemFeatures, recnode->SVDitemmodel, itemValues*sizeof(float));
+	} else {
+		GenSparseModel *model = recnode->itemCFmodel;
+		GenSparseModel *copy;
+
+		copy = (GenSparseModel*) palloc0(sizeof(GenSparseModel));
+		copy->numRows = model->numRows;
+		copy->numEntries = model->numEntries;
+		copy->maxEntries = Max(model->numEntries, 1);
+		copy->rowStart = (int*) palloc((model->numRows+1)*sizeof(int));
+		copy->colIndex = (int*) palloc(copy->maxEntries*sizeof(int));
+		copy->values = (float*) palloc(copy->maxEntries*sizeof(float));
+		copy->valueBits = RECATHON_FULL_PRECISION;
+		memcpy(copy->rowStart, model->rowStart, (model->numRows+1)*sizeof(int));
+		memcpy(copy->colIndex, model->colIndex, model->numEntries*sizeof(int));
+		memcpy(copy->values, model->values, model->numEntries*sizeof(float));
+		gm->itemmodel = copy;
+	}
 
-			item_j = itemEvents[j];
-			if (!item_j) continue;
-			length_j = itemLengths[j];
+	MemoryContextSwitchTo(oldcontext);
+	MemoryContextSetParent(context, TopMemoryContext);
+	gm->next = recathon_generated_models;
+	recathon_generated_models = gm;
 
-			similarity = cosineSimilarity(item_i, item_j, length_i, length_j);
-			if (similarity <= 0) continue;
-			item1 = itemIDs[i];
-			item2 = itemIDs[j];
+	shareGeneratedModel(gm);
+}
 
-			// Now we write.
-			if (NBRHOOD <= 0) {
-				sprintf(insertstring,"%d;%d;%f\n",
-					item1,item2,similarity);
-				fwrite(insertstring,1,strlen(insertstring),fp);
-			} else {
-				nbr_node newnbr = createNbrNode(item1,item2,similarity);
-				nbr_list = nbrInsert(nbr_list,newnbr,NBRHOOD);
-			}
-		}
+/* ----------------------------------------------------------------
+ *		generatedModelKey
+ *
+ *		Names what an on-the-fly build makes, for telling
+ *		whether two sessions are making the same thing. Only
+ *		sessions in the same database can be.
+ * ----------------------------------------------------------------
+ */
+static void
+generatedModelKey(int method, char *eventtable, char *userkey,
+		char *itemkey, char *eventval, char *key) {
+	snprintf(key, RECATHON_GENERATED_KEYLEN, "%u %d %s %s %s %s %d",
+		MyDatabaseId, method, eventtable, userkey, itemkey, eventval,
+		recathon_duplicate_events);
+}
 
-		// If we have a limited neighborhood, we write the results here.
-		if (NBRHOOD > 0) {
-			for (temp_nbr = nbr_list; temp_nbr; temp_nbr = temp_nbr->next) {
-				sprintf(insertstring,"%d;%d;%f\n",temp_nbr->item1,
-					temp_nbr->item2,temp_nbr->similarity);
-				fwrite(insertstring,1,strlen(insertstring),fp);
-			}
-			freeNbrList(nbr_list);
-		}
+/*
+ * The name a generated model is kept under in the model cache. The
+ * key is too long for one, so it's hashed, and the model itself says
+ * which one it is.
+ */
+static void
+generatedCacheName(char *key, char *name) {
+	snprintf(name, NAMEDATALEN, "generated %08x",
+		DatumGetUInt32(hash_any((const unsigned char *) key, strlen(key))));
+}
 
-		CHECK_FOR_INTERRUPTS();
+/* ----------------------------------------------------------------
+ *		shareGeneratedModel
+ *
+ *		Copies a model just kept into shared model cache, if
+ *		it's on, replacing any older one of the same events,
+ *		method and columns.
+ * ----------------------------------------------------------------
+ */
+static void
+shareGeneratedModel(generated_model *gm) {
+	char key[RECATHON_GENERATED_KEYLEN];
+	char name[NAMEDATALEN];
+	shared_generated_model *shared;
+	char *data;
+	int *ids;
+	Size size;
+	int handle;
+
+	if (!recathonCacheEnabled())
+		return;
+
+	size = MAXALIGN(sizeof(shared_generated_model)) +
+		((Size) gm->numItems + gm->numUsers) * sizeof(int);
+	if (gm->factors)
+		size += (Size) gm->numFeatures * (gm->numUsers + gm->numItems) * sizeof(float);
+	else
+		size += (Size) (gm->itemmodel->numRows + 1) * sizeof(int) +
+			(Size) gm->itemmodel->numEntries * (sizeof(int) + sizeof(float));
+
+	generatedModelKey(gm->method, gm->eventtable, gm->userkey, gm->itemkey,
+		gm->eventval, key);
+	generatedCacheName(key, name);
+	recathonCacheDrop(name);
+	data = recathonCacheReserve(name, "generated", 0, size, &handle);
+	if (!data)
+		return;
+
+	shared = (shared_generated_model*) data;
+	memset(shared, 0, sizeof(shared_generated_model));
+	shared->method = gm->method;
+	strlcpy(shared->eventtable, gm->eventtable, NAMEDATALEN);
+	strlcpy(shared->userkey, gm->userkey, NAMEDATALEN);
+	strlcpy(shared->itemkey, gm->itemkey, NAMEDATALEN);
+	strlcpy(shared->eventval, gm->eventval, NAMEDATALEN);
+	shared->stamp = gm->stamp;
+	shared->factors = gm->factors;
+	shared->hasUsers = (gm->userIDs != NULL);
+	shared->numItems = gm->numItems;
+	shared->numUsers = gm->numUsers;
+	shared->numFeatures = gm->numFeatures;
+
+	ids = (int*) (data + MAXALIGN(sizeof(shared_generated_model)));
+	memcpy(ids, gm->itemIDs, gm->numItems*sizeof(int));
+	ids += gm->numItems;
+	if (shared->hasUsers)
+		memcpy(ids, gm->userIDs, gm->numUsers*sizeof(int));
+	ids += gm->numUsers;
+
+	if (gm->factors) {
+		float *values = (float*) ids;
+		Size userValues = (Size) gm->numFeatures * gm->numUsers;
+
+		memcpy(values, gm->userFeatures, userValues*sizeof(float));
+		memcpy(values + userValues, gm->itemFeatures,
+			(Size) gm->numFeatures * gm->numItems * sizeof(float));
+	} else {
+		GenSparseModel *model = gm->itemmodel;
+
+		shared->numRows = model->numRows;
+		shared->numEntries = model->numEntries;
+		memcpy(ids, model->rowStart, (model->numRows+1)*sizeof(int));
+		ids += model->numRows + 1;
+		memcpy(ids, model->colIndex, model->numEntries*sizeof(int));
+		ids += model->numEntries;
+		memcpy(ids, model->values, model->numEntries*sizeof(float));
 	}
 
-	pfree(insertstring);
-	fclose(fp);
+	recathonCacheFinish(handle);
+	recathonCacheRelease(handle);
+}
 
-	// If we are updating an existing similarity model,
-	// we will want to drop the existing primary key
-	// constraint before doing the copy, to save time.
-	if (update) {
-		sprintf(querystring,"ALTER TABLE %s DROP CONSTRAINT %s_pkey;",
-					modelname,modelname);
-		recathon_utilityExecute(querystring);
+/* ----------------------------------------------------------------
+ *		restoreSharedModel
+ *
+ *		Like restoreGeneratedModel, for a model some session
+ *		has left in the shared model cache.
+ * ----------------------------------------------------------------
+ */
+static bool
+restoreSharedModel(RecScanState *recnode, generated_stamp *stamp) {
+	AttributeInfo *attributes = (AttributeInfo*) recnode->attributes;
+	char key[RECATHON_GENERATED_KEYLEN];
+	char name[NAMEDATALEN];
+	shared_generated_model *shared;
+	generated_model gm;
+	GenSparseModel model;
+	char *data;
+	int *ids;
+	Size size;
+	int handle;
+
+	if (!recathonCacheEnabled())
+		return false;
+
+	generatedModelKey(attributes->method, attributes->eventtable,
+		attributes->userkey, attributes->itemkey, attributes->eventval, key);
+	generatedCacheName(key, name);
+	data = recathonCacheLookup(name, "generated", 0, &size, &handle);
+	if (!data)
+		return false;
+
+	// The name is only a hash, so it has to be the right model, and
+	// one generated from the events as we see them.
+	shared = (shared_generated_model*) data;
+	if (shared->method != attributes->method ||
+	    strcmp(shared->eventtable, attributes->eventtable) != 0 ||
+	    strcmp(shared->userkey, attributes->userkey) != 0 ||
+	    strcmp(shared->itemkey, attributes->itemkey) != 0 ||
+	    strcmp(shared->eventval, attributes->eventval) != 0 ||
+	    !sameGeneratedStamp(&shared->stamp, stamp) ||
+	    (!shared->factors && !recnode->userList && !shared->hasUsers)) {
+		recathonCacheRelease(handle);
+		return false;
 	}
 
-	// With all the data written out, we're going to
-	// issue a COPY FROM command to bulk load the data
-	// into the database.
-	sprintf(querystring,"COPY %s FROM '%s' DELIMITERS ';';",
-		modelname,temprecfile);
-	recathon_utilityExecute(querystring);
+	memset(&gm, 0, sizeof(generated_model));
+	gm.factors = shared->factors;
+	gm.numItems = shared->numItems;
+	gm.numUsers = shared->numUsers;
+	gm.numFeatures = shared->numFeatures;
+	ids = (int*) (data + MAXALIGN(sizeof(shared_generated_model)));
+	gm.itemIDs = ids;
+	ids += gm.numItems;
+	if (shared->hasUsers)
+		gm.userIDs = ids;
+	ids += gm.numUsers;
+
+	if (gm.factors) {
+		gm.userFeatures = (float*) ids;
+		gm.itemFeatures = gm.userFeatures + (Size) gm.numFeatures * gm.numUsers;
+	} else {
+		memset(&model, 0, sizeof(GenSparseModel));
+		model.numRows = shared->numRows;
+		model.numEntries = shared->numEntries;
+		model.rowStart = ids;
+		model.colIndex = ids + model.numRows + 1;
+		model.values = (float*) (model.colIndex + model.numEntries);
+		gm.itemmodel = &model;
+	}
 
-	// Now we add the primary key constraint. It's
-	// faster to add it after adding the data than
-	// having it incrementally updated.
-	sprintf(querystring,"ALTER TABLE %s ADD PRIMARY KEY (item1, item2)",modelname);
-	recathon_utilityExecute(querystring);
-	pfree(querystring);
+	copyGeneratedModel(recnode, &gm);
+	recathonCacheRelease(handle);
+	elog(DEBUG1, "reusing the model another session generated from %s",
+		attributes->eventtable);
+	return true;
+}
 
-	// We'll delete the temporary file here, to not hold onto
-	// memory longer than necessary.
-	if (unlink(temprecfile) < 0)
-		ereport(WARNING,
-			(errcode(ERRCODE_WARNING),
-			 errmsg("failed to delete temporary file")));
+/* ----------------------------------------------------------------
+ *		admitGeneratedModel
+ *
+ *		Called before a scan generates its model, to wait for
+ *		room for it under recathon_build_memory, and for any
+ *		other session generating the same model, which it
+ *		may then reuse. Like a build from a table, we expect
+ *		RECATHON_EVENT_BYTES for each event the planner thinks
+ *		the table has, though we only need to know with a limit
+ *		set. Returns the build's handle.
+ * ----------------------------------------------------------------
+ */
+int
+admitGeneratedModel(RecScanState *recnode) {
+	AttributeInfo *attributes = (AttributeInfo*) recnode->attributes;
+	char key[RECATHON_GENERATED_KEYLEN];
+	double estimate;
+	bool reusable;
+
+	// User-based models aren't kept, so there's no sense waiting
+	// for someone else's.
+	reusable = (attributes->method != userCosCF &&
+		    attributes->method != userPearCF);
+	generatedModelKey(attributes->method, attributes->eventtable,
+		attributes->userkey, attributes->itemkey, attributes->eventval, key);
+	estimate = 0;
+	if (recathon_build_memory > 0)
+		estimate = estimateSimEvents(attributes->eventtable) * RECATHON_EVENT_BYTES;
+	return recathonBuildAdmit(key, reusable,
+		(Size) Min(estimate, (double) (~((Size) 0) >> 1)));
+}
+
+/* ----------------------------------------------------------------
+ *		ratedItemSlice
+ *
+ *		An on-the-fly item-based prediction for a user only
+ *		reads the model's similarities to the items the user
+ *		rated. So when the query names its users, and they've
+ *		rated fewer than half of the items, we only work out
+ *		the rows of the items they rated, each against all of
+ *		the other items, and leave the rest of the rows empty.
+ *		Returns which rows to work out, or NULL for the usual
+ *		half of the model.
+ * ----------------------------------------------------------------
+ */
+static bool *
+ratedItemSlice(RecScanState *recnode, sim_vector *itemEvents, int numItems) {
+	int i, k, numRated;
+	bool *slice;
 
-	// Free up the lists of sim_nodes and start again.
+	if (!recnode->userList || recnode->totalUsers <= 0)
+		return NULL;
+
+	slice = (bool*) palloc0(Max(numItems, 1)*sizeof(bool));
+	numRated = 0;
 	for (i = 0; i < numItems; i++) {
-		freeSimList(itemEvents[i]);
-		itemEvents[i] = NULL;
+		sim_vector item_i = itemEvents[i];
+
+		if (!item_i) continue;
+		for (k = 0; k < item_i->length; k++) {
+			if (binarySearch(recnode->userList, item_i->id[k], 0,
+					recnode->totalUsers) >= 0) {
+				slice[i] = true;
+				numRated++;
+				break;
+			}
+		}
 	}
 
-	// Return the number of events we used.
-	return numEvents;
+	if (numRated * 2 >= numItems) {
+		pfree(slice);
+		return NULL;
+	}
+	return slice;
 }
 
 /* ----------------------------------------------------------------
- *		pearson_info
+ *		slicedRow
  *
- *		Looks at all the items in our users/items table and
- *		calculates their average events, as well as
- *		another data item useful for Pearson correlation,
- *		which I'm just calling a Pearson because I'm not
- *		sure it has a name. It can be pre-calculated, so we
- *		will. Also returns a list of user/item IDs.
+ *		Works out row i of an on-the-fly item model: the later
+ *		items, as simBuilderRow does, or with a slice, all of
+ *		the other items if the row is in it and none if not.
  * ----------------------------------------------------------------
  */
-void
-pearson_info(char *key, char *eventtable, char *eventval, int *totalNum,
-		int **IDlist, float **avgList, float **pearsonList) {
-	int *IDs, *counts;
-	float *avgs, *pearsons;
-	int i, j, numItems, priorID;
-	// Objects for querying.
-	char *querystring;
-	QueryDesc *queryDesc;
-	PlanState *planstate;
-	TupleTableSlot *slot;
-	MemoryContext recathoncontext;
+static int
+slicedRow(sim_builder builder, bool *slice, int i) {
+	int numNeighbors;
+
+	if (!slice)
+		return simBuilderRow(builder, i);
+	if (!slice[i]) {
+		builder->rowLength = 0;
+		return 0;
+	}
 
-	// We start by getting the number of items in the event table.
-	querystring = (char*) palloc(1024*sizeof(char));
-	sprintf(querystring,"SELECT COUNT(DISTINCT %s) FROM %s;",
-		key,eventtable);
-	queryDesc = recathon_queryStart(querystring,&recathoncontext);
-	planstate = queryDesc->planstate;
-	slot = ExecProcNode(planstate);
-	numItems = getTupleInt(slot,"count");
-	recathon_queryEnd(queryDesc,recathoncontext);
+	// A dense build shouldn't work out rows we won't use.
+	builder->rowEnd = i + 1;
+	numNeighbors = simBuilderFullRow(builder, i);
+	builder->rowEnd = builder->numVectors;
+	return numNeighbors;
+}
 
-	// Now that we have the number of items, we can create an array or two.
-	IDs = (int*) palloc(numItems*sizeof(int));
-	counts = (int*) palloc(numItems*sizeof(int));
-	for (j = 0; j < numItems; j++)
-		counts[j] = 0;
-	avgs = (float*) palloc(numItems*sizeof(float));
-	for (j = 0; j < numItems; j++)
-		avgs[j] = 0.0;
-	pearsons = (float*) palloc(numItems*sizeof(float));
-	for (j = 0; j < numItems; j++)
-		pearsons[j] = 0.0;
-
-	// Now we need to populate the four arrays. We'll get all the events from
-	// the events table.
-	priorID = -1;
-	sprintf(querystring,"SELECT * FROM %s ORDER BY %s;",eventtable,key);
-	queryDesc = recathon_queryStart(querystring,&recathoncontext);
-	planstate = queryDesc->planstate;
-	i = -1;
+/* ----------------------------------------------------------------
+ *		generateItemCosModel
+ *
+ *		Create an item-based cosine model on the fly.
+ * ----------------------------------------------------------------
+ */
+void
+generateItemCosModel(RecScanState *recnode) {
+	int i, j, k, numNeighbors;
+	sim_builder builder;
+	AttributeInfo *attributes;
+	GenSparseModel *itemmodel;
+	char *eventtable, *userkey, *itemkey, *eventval;
+	int numItems;
+	int *itemIDs;
+	float *itemLengths;
+	sim_vector *itemEvents;
+	generated_stamp stamp;
+	bool allUsers;
+	bool *slice;
 
-	// This query grabs all item IDs, so we can store them. It also fills in
-	// some other information we'll need.
-	for (;;) {
-		int currentID = 0;
-		float currentEvent = 0.0;
+	attributes = (AttributeInfo*) recnode->attributes;
+	eventtable = attributes->eventtable;
+	userkey = attributes->userkey;
+	itemkey = attributes->itemkey;
+	eventval = attributes->eventval;
 
-		slot = ExecProcNode(planstate);
-		if (TupIsNull(slot)) break;
+	/* A model generated for an earlier query may still be good. */
+	if (restoreGeneratedModel(recnode, &stamp))
+		return;
+	allUsers = (recnode->userList == NULL);
 
-		currentID = getTupleInt(slot,key);
+	/* We start by gathering each item's ratings, in one scan of the
+	 * events table, and getting their vector lengths. */
+	itemEvents = collectSimVectors(itemkey, userkey, eventtable, eventval,
+		&numItems, &itemIDs, NULL);
+	itemLengths = vector_lengths(itemEvents, numItems);
 
-		// Are we dealing with a new item ID? If so, switch to the next slot.
-		if (currentID != priorID) {
-			i++;
-			priorID = currentID;
-			IDs[i] = currentID;
-		}
+	/* We have the number of items, so we can initialize our model. */
+	itemmodel = sparseCreate(numItems);
 
-		currentEvent = getTupleFloat(slot,eventval);
-		counts[i] += 1;
-		avgs[i] += currentEvent;
-	}
+	/* Set up to compute one row of similarities at a time. */
+	builder = simBuilderCreate(itemEvents, numItems, itemLengths, NULL, 0, 0);
 
-	// Query cleanup.
-	recathon_queryEnd(queryDesc,recathoncontext);
+	/* A query for a few users only needs the rows of the items
+	 * they rated, if that's fewer than half of them. */
+	slice = ratedItemSlice(recnode, itemEvents, numItems);
 
-	// Now that we've totally queried the events table, we need to
-	// obtain the actual averages for each item.
+	/* Now we do the similarity calculations. Note that we
+	 * don't include duplicate entries, to save time and space.
+	 * The first item ALWAYS has a lower value than the second. */
 	for (i = 0; i < numItems; i++) {
-		if (counts[i] > 0)
-			avgs[i] /= ((float)counts[i]);
-	}
-	pfree(counts);
+		sim_vector item_i;
 
-	// We can reuse the same query to obtain the events again, and
-	// calculate Pearsons.
-	priorID = -1;
-	queryDesc = recathon_queryStart(querystring,&recathoncontext);
-	planstate = queryDesc->planstate;
-	i = -1;
+		sparseStartRow(itemmodel, i);
+		item_i = itemEvents[i];
+		if (!item_i) continue;
 
-	// We scan through the entire event table once, sorting the events
-	// based on which item they apply to.
-	for (;;) {
-		int currentID = 0;
-		float currentEvent = 0.0;
-		float difference = 0.0;
+		numNeighbors = slicedRow(builder, slice, i);
+		for (k = 0; k < numNeighbors; k++) {
+			float similarity;
 
-		slot = ExecProcNode(planstate);
-		if (TupIsNull(slot)) break;
+			j = builder->rowIndex[k];
+			similarity = builder->rowSim[k];
 
-		currentID = getTupleInt(slot,key);
-		// Are we dealing with a new item ID? If so, switch to the next slot.
-		if (currentID != priorID) {
-			priorID = currentID;
-			i++;
+			/* Now we output. Like with the pre-computed model, we'll
+			 * only worry about half the model. This allows us to fill
+			 * in the matrix left-to-right, top-to-bottom. */
+			sparseAppend(itemmodel, j, similarity);
 		}
-		currentEvent = getTupleFloat(slot,eventval);
 
-		// We have the item number and event value from this tuple.
-		// Now we need to update Pearsons.
-		difference = currentEvent - avgs[i];
-		pearsons[i] += difference*difference;
+		CHECK_FOR_INTERRUPTS();
+	}
+	simBuilderFree(builder);
+	sparseStartRow(itemmodel, numItems);
+
+	/* The rating vectors hold every user, so we take the user list
+	 * from them, unless the query already named its users. */
+	if (!recnode->userList) {
+		recnode->totalUsers = distinctVectorIDs(itemEvents, numItems, &recnode->userList);
+		if (recnode->totalUsers <= 0)
+			elog(ERROR, "no users found, cannot predict ratings");
+		attributes->userID = recnode->userList[0] - 1;
 	}
 
-	// Query cleanup.
-	recathon_queryEnd(queryDesc,recathoncontext);
-	pfree(querystring);
+	/* Free up the rating vectors now, since we're done. */
+	freeSimVectors(itemEvents, numItems);
 
-	// Now that we've totally queried the events table, we need to
-	// take the square root of each Pearson and we're done.
-	for (i = 0; i < numItems; i++)
-		pearsons[i] = sqrtf(pearsons[i]);
+	/* Fill in the appropriate information. */
+	recnode->fullTotalItems = numItems;
+	recnode->fullItemList = itemIDs;
+	recnode->itemCFmodel = itemmodel;
 
-	// Return data.
-	(*totalNum) = numItems;
-	(*IDlist) = IDs;
-	(*avgList) = avgs;
-	(*pearsonList) = pearsons;
+	/* And keep it for the next query, unless it's only a slice. */
+	recnode->itemCFslice = (slice != NULL);
+	if (slice)
+		pfree(slice);
+	else
+		keepGeneratedModel(recnode, &stamp, false, allUsers);
 }
 
 /* ----------------------------------------------------------------
- *		pearsonDotProduct
+ *		generateItemPearModel
  *
- *		Function to compare two items and compute a version
- *		of their dot product, for Pearson similarity.
- *		The lists are necessarily sorted, so we can compare
- *		in linear time.
+ *		Create an item-based Pearson model on the fly.
  * ----------------------------------------------------------------
  */
-float
-pearsonDotProduct(sim_node item1, sim_node item2, float avg1, float avg2) {
-	sim_node temp1, temp2;
-	float similarity;
+void
+generateItemPearModel(RecScanState *recnode) {
+	int i, j, k, numNeighbors;
+	sim_builder builder;
+	char *eventtable, *userkey, *itemkey, *eventval;
+	sim_vector *itemEvents;
+	int numItems;
+	int *itemIDs;
+	float *itemAvgs;
+	float *itemPearsons;
+	AttributeInfo *attributes;
+	GenSparseModel *itemmodel;
+	generated_stamp stamp;
+	bool allUsers;
+	bool *slice;
 
-	if (item1 == NULL || item2 == NULL) return 0.0;
+	attributes = (AttributeInfo*) recnode->attributes;
+	eventtable = attributes->eventtable;
+	userkey = attributes->userkey;
+	itemkey = attributes->itemkey;
+	eventval = attributes->eventval;
 
-	similarity = 0.0;
-
-	// Check every event for the first item, and see how
-	// many of those users also rated the second item.
-	temp1 = item1; temp2 = item2;
-	while (temp1 && temp2) {
-		if (temp1->id == temp2->id) {
-			similarity += (temp1->event - avg1) * (temp2->event - avg2);
-			temp1 = temp1->next;
-			temp2 = temp2->next;
-		} else if (temp1->id > temp2->id) {
-			temp2 = temp2->next;
-		} else {
-			temp1 = temp1->next;
+	// A model generated for an earlier query may still be good.
+	if (restoreGeneratedModel(recnode, &stamp))
+		return;
+	allUsers = (recnode->userList == NULL);
+
+	// First we gather each item's ratings, in one scan of the events
+	// table, and get the relevant Pearson information.
+	itemEvents = collectSimVectors(itemkey, userkey, eventtable, eventval,
+		&numItems, &itemIDs, NULL);
+	pearson_info(itemEvents, numItems, &itemAvgs, &itemPearsons);
+
+	/* We have the number of items, so we can initialize our model. */
+	itemmodel = sparseCreate(numItems);
+
+	// Set up to compute one row of similarities at a time.
+	builder = simBuilderCreate(itemEvents, numItems, itemPearsons, itemAvgs, 0, 0);
+
+	// A query for a few users only needs the rows of the items
+	// they rated, if that's fewer than half of them.
+	slice = ratedItemSlice(recnode, itemEvents, numItems);
+
+	// Now we do the similarity calculations. Note that we
+	// don't include duplicate entries, to save time and space.
+	// The first item ALWAYS has a lower value than the second.
+	for (i = 0; i < numItems; i++) {
+		sim_vector item_i;
+
+		sparseStartRow(itemmodel, i);
+		item_i = itemEvents[i];
+		if (!item_i) continue;
+
+		numNeighbors = slicedRow(builder, slice, i);
+		for (k = 0; k < numNeighbors; k++) {
+			float similarity;
+
+			j = builder->rowIndex[k];
+			similarity = builder->rowSim[k];
+
+			/* Now we output. Like with the pre-computed model, we'll
+			 * only worry about half the model. This allows us to fill
+			 * in the matrix left-to-right, top-to-bottom. */
+			sparseAppend(itemmodel, j, similarity);
 		}
+
+		CHECK_FOR_INTERRUPTS();
+	}
+	simBuilderFree(builder);
+	sparseStartRow(itemmodel, numItems);
+
+	// The rating vectors hold every user, so we take the user list
+	// from them, unless the query already named its users.
+	if (!recnode->userList) {
+		recnode->totalUsers = distinctVectorIDs(itemEvents, numItems, &recnode->userList);
+		if (recnode->totalUsers <= 0)
+			elog(ERROR, "no users found, cannot predict ratings");
+		attributes->userID = recnode->userList[0] - 1;
 	}
 
-	return similarity;
+	// Free up the rating vectors and we're done.
+	freeSimVectors(itemEvents, numItems);
+
+	// Return the relevant information.
+	recnode->fullTotalItems = numItems;
+	recnode->fullItemList = itemIDs;
+	recnode->itemCFmodel = itemmodel;
+
+	// And keep it for the next query, unless it's only a slice.
+	recnode->itemCFslice = (slice != NULL);
+	if (slice)
+		pfree(slice);
+	else
+		keepGeneratedModel(recnode, &stamp, false, allUsers);
 }
 
 /* ----------------------------------------------------------------
- *		pearsonSimilarity
+ *		generateItemJaccardModel
  *
- *		Function to compare two items and compute their
- *		Pearson similarity.
+ *		Create an item-based Jaccard model on the fly.
  * ----------------------------------------------------------------
  */
-float
-pearsonSimilarity(sim_node item1, sim_node item2, float avg1, float avg2,
-			float pearson1, float pearson2) {
-	float numerator;
-	float denominator;
+void
+generateItemJaccardModel(RecScanState *recnode) {
+	int i, k, numNeighbors;
+	sim_builder builder;
+	AttributeInfo *attributes;
+	GenSparseModel *itemmodel;
+	char *eventtable, *userkey, *itemkey, *eventval;
+	int numItems;
+	int *itemIDs;
+	float *itemSizes;
+	sim_vector *itemEvents;
+	generated_stamp stamp;
+	bool allUsers;
+	bool *slice;
+
+	attributes = (AttributeInfo*) recnode->attributes;
+	eventtable = attributes->eventtable;
+	userkey = attributes->userkey;
+	itemkey = attributes->itemkey;
+	eventval = attributes->eventval;
+
+	/* A model generated for an earlier query may still be good. */
+	if (restoreGeneratedModel(recnode, &stamp))
+		return;
+	allUsers = (recnode->userList == NULL);
+
+	/* We gather each item's users, in one scan of the events
+	 * table, as sets. */
+	itemEvents = collectSimVectors(itemkey, userkey, eventtable, eventval,
+		&numItems, &itemIDs, NULL);
+	itemSizes = jaccard_info(itemEvents, numItems);
+
+	itemmodel = sparseCreate(numItems);
+	builder = simBuilderCreateJaccard(itemEvents, numItems, itemSizes, 0, 0);
+
+	/* A query for a few users only needs the rows of the items
+	 * they rated, if that's fewer than half of them. */
+	slice = ratedItemSlice(recnode, itemEvents, numItems);
 
-	// Short-circuit check. If one of the items has no events,
-	// no point checking similarity. This also avoids a possible
-	// divide-by-zero error.
-	denominator = pearson1 * pearson2;
-	if (denominator == 0.0) return 0.0;
+	/* Like the other item models, we only keep half of it, the
+	 * first item always having a lower value than the second. */
+	for (i = 0; i < numItems; i++) {
+		sparseStartRow(itemmodel, i);
+		if (!itemEvents[i]) continue;
 
-	numerator = pearsonDotProduct(item1,item2,avg1,avg2);
-	if (numerator == 0.0) return 0.0;
-	else return numerator / denominator;
+		numNeighbors = slicedRow(builder, slice, i);
+		for (k = 0; k < numNeighbors; k++)
+			sparseAppend(itemmodel, builder->rowIndex[k], builder->rowSim[k]);
+
+		CHECK_FOR_INTERRUPTS();
+	}
+	simBuilderFree(builder);
+	sparseStartRow(itemmodel, numItems);
+
+	/* The sets hold every user, so we take the user list from
+	 * them, unless the query already named its users. */
+	if (!recnode->userList) {
+		recnode->totalUsers = distinctVectorIDs(itemEvents, numItems, &recnode->userList);
+		if (recnode->totalUsers <= 0)
+			elog(ERROR, "no users found, cannot predict ratings");
+		attributes->userID = recnode->userList[0] - 1;
+	}
+
+	freeSimVectors(itemEvents, numItems);
+	pfree(itemSizes);
+
+	recnode->fullTotalItems = numItems;
+	recnode->fullItemList = itemIDs;
+	recnode->itemCFmodel = itemmodel;
+
+	/* And keep it for the next query, unless it's only a slice. */
+	recnode->itemCFslice = (slice != NULL);
+	if (slice)
+		pfree(slice);
+	else
+		keepGeneratedModel(recnode, &stamp, false, allUsers);
 }
 
 /* ----------------------------------------------------------------
- *		updateItemPearModel
+ *		buildUserCFModel
  *
- *		Given a single cell of a recommender, this
- *		function rebuilds the recModel for that cell, using
- *		item-based collaborative filtering with Pearson
- *		similarity. Returns the number of events used.
+ *		Works out an on-the-fly user-based model with the
+ *		given builder. Usually that's half of the matrix, the
+ *		first user always having a lower index than the
+ *		second, which fills it in left-to-right, top-to-
+ *		bottom. A query naming fewer than half of the users
+ *		only ever reads their rows, though, so then we work
+ *		them out whole, against every other user, and leave
+ *		out the rest of the matrix.
  * ----------------------------------------------------------------
  */
-int
-updateItemPearModel(char *eventtable, char *userkey, char *itemkey,
-		char *eventval, char *modelname, int *itemIDs, float *itemAvgs,
-		float *itemPearsons, int numItems, bool update) {
-	int i, j, priorID;
-	int numEvents = 0;
-	char *querystring, *insertstring, *temprecfile;
-	sim_node *itemEvents;
-	// Information for other queries.
-	QueryDesc *simqueryDesc;
-	PlanState *simplanstate;
-	TupleTableSlot *simslot;
-	MemoryContext simcontext;
-	// Information for writing to file.
-	FILE *fp;
-	temprecfile = (char*) palloc(256*sizeof(char));
-	sprintf(temprecfile,"recathon_temp_%s.dat",modelname);
-
-	// If this is us updating a cell as opposed to building
-	// a recommender, we need to drop the existing entries.
-	if (update) {
-		char *dropstring;
-
-		dropstring = (char*) palloc(256*sizeof(char));
-		sprintf(dropstring,"DELETE FROM %s;",modelname);
-		recathon_queryExecute(dropstring);
-		pfree(dropstring);
-	}
+static float **
+buildUserCFModel(RecScanState *recnode, sim_builder builder,
+		sim_vector *userEvents, int numUsers, int *userIDs) {
+	int i, k, numNeighbors, numNamed;
+	float **usermodel;
+	ListCell *lc;
+	AttributeInfo *attributes = (AttributeInfo*) recnode->attributes;
 
-	// With the precomputation done, we need to derive the actual item
-	// similarities. We can do this in a way that's linear in the number
-	// of I/Os and also the amount of storage. The complexity is relegated
-	// to in-memory calculations, which is the most affordable. We need to
-	// use this data structure here.
-	itemEvents = (sim_node*) palloc(numItems*sizeof(sim_node));
-	for (i = 0; i < numItems; i++)
-		itemEvents[i] = NULL;
+	usermodel = (float**) palloc0(numUsers*sizeof(float*));
+	numNamed = list_length(attributes->userIDList);
+	recnode->userCFrows = (numNamed > 0 && numNamed < numUsers / 2);
 
-	// With the model created, we need to populate it, which means calculating
-	// similarity between all item pairs. We need to query the events table
-	// in order to get the key information.
-	querystring = (char*) palloc(1024*sizeof(char));
-	sprintf(querystring,"SELECT r.%s,r.%s,r.%s FROM %s r ORDER BY r.%s;",
-		userkey,itemkey,eventval,eventtable,itemkey);
+	if (recnode->userCFrows) {
+		foreach(lc, attributes->userIDList) {
+			i = binarySearch(userIDs, lfirst_int(lc), 0, numUsers);
+			if (i < 0 || usermodel[i]) continue;
 
-	// Begin extracting data.
-	priorID = -1;
-	simqueryDesc = recathon_queryStart(querystring, &simcontext);
-	simplanstate = simqueryDesc->planstate;
-	i = -1;
+			usermodel[i] = (float*) palloc0(numUsers*sizeof(float));
+			if (!userEvents[i]) continue;
 
-	for (;;) {
-		int simuser, simitem;
-		float simevent;
-		sim_node newnode;
+			// A dense build shouldn't work out rows we won't use.
+			builder->rowEnd = i + 1;
+			numNeighbors = simBuilderFullRow(builder, i);
+			for (k = 0; k < numNeighbors; k++)
+				usermodel[i][builder->rowIndex[k]] = builder->rowSim[k];
 
-		// Shut the compiler up.
-		simuser = 0; simitem = 0; simevent = 0.0;
+			CHECK_FOR_INTERRUPTS();
+		}
+		builder->rowEnd = numUsers;
+		return usermodel;
+	}
 
-		simslot = ExecProcNode(simplanstate);
-		if (TupIsNull(simslot)) break;
+	for (i = 0; i < numUsers; i++)
+		usermodel[i] = (float*) palloc0(numUsers*sizeof(float));
 
-		simuser = getTupleInt(simslot,userkey);
-		simitem = getTupleInt(simslot,itemkey);
-		simevent = getTupleFloat(simslot,eventval);
+	// Note that we don't include duplicate entries, to save
+	// time and space.
+	for (i = 0; i < numUsers; i++) {
+		if (!userEvents[i]) continue;
 
-		// Are we dealing with a new item ID? If so, switch to the next slot.
-		if (simitem != priorID) {
-			priorID = simitem;
-			i++;
-		}
+		numNeighbors = simBuilderRow(builder, i);
+		for (k = 0; k < numNeighbors; k++)
+			usermodel[i][builder->rowIndex[k]] = builder->rowSim[k];
 
-		// We now have the user, item, and event for this tuple.
-		// We insert the results as a sim_node into the
-		// itemEvents table; we'll do calculations later.
-		newnode = createSimNode(simuser, simevent);
-		itemEvents[i] = simInsert(itemEvents[i], newnode);
-		numEvents++;
+		CHECK_FOR_INTERRUPTS();
 	}
+	return usermodel;
+}
 
-	// Query cleanup.
-	recathon_queryEnd(simqueryDesc, simcontext);
-	pfree(querystring);
+/* ----------------------------------------------------------------
+ *		generateUserCosModel
+ *
+ *		Create a user-based cosine model on the fly.
+ * ----------------------------------------------------------------
+ */
+void
+generateUserCosModel(RecScanState *recnode) {
+	sim_builder builder;
+	sim_vector *userEvents;
+	char *eventtable, *userkey, *itemkey, *eventval;
+	AttributeInfo *attributes;
+	float **usermodel;
+	int numUsers;
+	int *userIDs;
+	float *userLengths;
 
-	// We're going to write out the results to file.
-	if ((fp = fopen(temprecfile,"w")) == NULL)
-		ereport(ERROR,
-			(errcode(ERRCODE_SYNTAX_ERROR),
-			 errmsg("failed to open temporary file")));
-	insertstring = (char*) palloc(128*sizeof(char));
+	attributes = (AttributeInfo*) recnode->attributes;
+	eventtable = attributes->eventtable;
+	userkey = attributes->userkey;
+	itemkey = attributes->itemkey;
+	eventval = attributes->eventval;
 
-	// Now we do the similarity calculations. Note that we
-	// don't include duplicate entries, to save time and space.
-	// The first item ALWAYS has a lower value than the second.
-	for (i = 0; i < numItems; i++) {
-		float avg_i, pearson_i;
-		sim_node item_i;
-		nbr_node temp_nbr;
-		nbr_node nbr_list = NULL;
+	// First we gather each user's ratings, in one scan of the events
+	// table, and get their vector lengths.
+	userEvents = collectSimVectors(userkey, itemkey, eventtable, eventval,
+		&numUsers, &userIDs, NULL);
+	userLengths = vector_lengths(userEvents, numUsers);
 
-		item_i = itemEvents[i];
-		if (!item_i) continue;
-		avg_i = itemAvgs[i];
-		pearson_i = itemPearsons[i];
+	// Set up to compute one row of similarities at a time.
+	builder = simBuilderCreate(userEvents, numUsers, userLengths, NULL, 0, 0);
+	usermodel = buildUserCFModel(recnode, builder, userEvents, numUsers, userIDs);
+	simBuilderFree(builder);
 
-		for (j = i+1; j < numItems; j++) {
-			float avg_j, pearson_j;
-			sim_node item_j;
-			int item1, item2;
-			float similarity;
+	// The rating vectors also hold every item, which saves us
+	// from scanning the events again for the item list.
+	recnode->fullTotalItems = distinctVectorIDs(userEvents, numUsers, &recnode->fullItemList);
+	if (recnode->fullTotalItems <= 0)
+		elog(ERROR, "no items found, cannot predict ratings");
 
-			item_j = itemEvents[j];
-			if (!item_j) continue;
-			avg_j = itemAvgs[j];
-			pearson_j = itemPearsons[j];
+	// Free up the rating vectors and we're done.
+	freeSimVectors(userEvents, numUsers);
 
-			similarity = pearsonSimilarity(item_i, item_j, avg_i, avg_j, pearson_i, pearson_j);
-			if (similarity == 0.0) continue;
-			item1 = itemIDs[i];
-			item2 = itemIDs[j];
+	// Return the relevant information.
+	recnode->totalUsers = numUsers;
+	recnode->userList = userIDs;
+	recnode->userCFmodel = usermodel;
+}
 
-			// Now we write.
-			if (NBRHOOD <= 0) {
-				sprintf(insertstring,"%d;%d;%f\n",item1,item2,similarity);
-				fwrite(insertstring,1,strlen(insertstring),fp);
-			} else {
-				nbr_node newnbr = createNbrNode(item1,item2,similarity);
-				nbr_list = nbrInsert(nbr_list,newnbr,NBRHOOD);
-			}
-		}
+/* ----------------------------------------------------------------
+ *		generateUserPearModel
+ *
+ *		Create a user-based Pearson model on the fly.
+ * ----------------------------------------------------------------
+ */
+void
+generateUserPearModel(RecScanState *recnode) {
+	sim_builder builder;
+	sim_vector *userEvents;
+	char *eventtable, *userkey, *itemkey, *eventval;
+	AttributeInfo *attributes;
+	float **usermodel;
+	int numUsers;
+	int *userIDs;
+	float *userAvgs;
+	float *userPearsons;
 
-		// If we have a limited neighborhood, we write the results here.
-		if (NBRHOOD > 0) {
-			for (temp_nbr = nbr_list; temp_nbr; temp_nbr = temp_nbr->next) {
-				sprintf(insertstring,"%d;%d;%f\n",temp_nbr->item1,
-					temp_nbr->item2,temp_nbr->similarity);
-				fwrite(insertstring,1,strlen(insertstring),fp);
-			}
-			freeNbrList(nbr_list);
-		}
+	attributes = (AttributeInfo*) recnode->attributes;
+	eventtable = attributes->eventtable;
+	userkey = attributes->userkey;
+	itemkey = attributes->itemkey;
+	eventval = attributes->eventval;
 
-		CHECK_FOR_INTERRUPTS();
-	}
+	// First we gather each user's ratings, in one scan of the events
+	// table, and get their Pearson info.
+	userEvents = collectSimVectors(userkey, itemkey, eventtable, eventval,
+		&numUsers, &userIDs, NULL);
+	pearson_info(userEvents, numUsers, &userAvgs, &userPearsons);
 
-	pfree(insertstring);
-	fclose(fp);
+	// Set up to compute one row of similarities at a time.
+	builder = simBuilderCreate(userEvents, numUsers, userPearsons, userAvgs, 0, 0);
+	usermodel = buildUserCFModel(recnode, builder, userEvents, numUsers, userIDs);
+	simBuilderFree(builder);
 
-	// If we are updating an existing similarity model,
-	// we will want to drop the existing primary key
-	// constraint before doing the copy, to save time.
-	if (update) {
-		insertstring = (char*) palloc(1024*sizeof(char));
-		sprintf(insertstring,"ALTER TABLE %s DROP CONSTRAINT %s_pkey;",
-					modelname,modelname);
-		recathon_utilityExecute(insertstring);
-		pfree(insertstring);
-	}
+	// The rating vectors also hold every item, which saves us
+	// from scanning the events again for the item list.
+	recnode->fullTotalItems = distinctVectorIDs(userEvents, numUsers, &recnode->fullItemList);
+	if (recnode->fullTotalItems <= 0)
+		elog(ERROR, "no items found, cannot predict ratings");
 
-	// With all the data written out, we're going to
-	// issue a COPY FROM command to bulk load the data
-	// into the database.
-	insertstring = (char*) palloc(1024*sizeof(char));
-	sprintf(insertstring,"COPY %s FROM '%s' DELIMITERS ';';",
-		modelname,temprecfile);
-	recathon_utilityExecute(insertstring);
-	pfree(insertstring);
+	// Free up the rating vectors and we're done.
+	freeSimVectors(userEvents, numUsers);
 
-	// Now we add the primary key constraint. It's
-	// faster to add it after adding the data than
-	// having it incrementally updated.
-	insertstring = (char*) palloc(1024*sizeof(char));
-	sprintf(insertstring,"ALTER TABLE %s ADD PRIMARY KEY (item1, item2)",modelname);
-	recathon_utilityExecute(insertstring);
-	pfree(insertstring);
-
-	// We'll delete the temporary file here, to not hold onto
-	// memory longer than necessary.
-	if (unlink(temprecfile) < 0)
-		ereport(WARNING,
-			(errcode(ERRCODE_WARNING),
-			 errmsg("failed to delete temporary file")));
+	// Return the relevant information.
+	recnode->totalUsers = numUsers;
+	recnode->userList = userIDs;
+	recnode->userCFmodel = usermodel;
+}
 
-	// Free up the lists of sim_nodes and start again.
-	for (i = 0; i < numItems; i++) {
-		freeSimList(itemEvents[i]);
-		itemEvents[i] = NULL;
+/* ----------------------------------------------------------------
+ *		generatedSVDparams
+ *
+ *		Works out the parameters to train an SVD or ALS model
+ *		on the fly with: those of the recommender the query
+ *		goes to, if it has one, and the defaults otherwise.
+ *		Returns true if they're the defaults.
+ * ----------------------------------------------------------------
+ */
+static bool
+generatedSVDparams(RecScanState *recnode, recMethod method, svd_params *params) {
+	AttributeInfo *attributes = (AttributeInfo*) recnode->attributes;
+	svd_params defaults;
+
+	getSVDparams(NIL, method, &defaults);
+	if (!attributes->recIndexName) {
+		(*params) = defaults;
+		return true;
 	}
 
-	// Return the number of events we used.
-	return numEvents;
+	(void) getRecSVDparams(attributes->recIndexName, method, params);
+	return params->numFeatures == defaults.numFeatures &&
+		params->maxEpochs == defaults.maxEpochs &&
+		params->learnRate == defaults.learnRate &&
+		params->penalty == defaults.penalty &&
+		params->tolerance == defaults.tolerance;
 }
 
 /* ----------------------------------------------------------------
- *		updateUserCosModel
+ *		generateSVDmodel
  *
- *		Given a single cell of a recommender, this
- *		function rebuilds the recModel for that cell, using
- *		user-based collaborative filtering with cosine
- *		similarity. Returns the number of events used.
+ *		Create a SVD model on the fly.
  * ----------------------------------------------------------------
  */
-int
-updateUserCosModel(char *eventtable, char *userkey, char *itemkey,
-		char *eventval, char *modelname, int *userIDs, float *userLengths,
-		int numUsers, bool update) {
-	int i, j, priorID;
-	int numEvents = 0;
-	char *querystring, *insertstring, *temprecfile;
-	sim_node *userEvents;
-	// Information for other queries.
-	QueryDesc *simqueryDesc;
-	PlanState *simplanstate;
-	TupleTableSlot *simslot;
-	MemoryContext simcontext;
-	// Information for writing to file.
-	FILE *fp;
-	temprecfile = (char*) palloc(256*sizeof(char));
-	sprintf(temprecfile,"recathon_temp_%s.dat",modelname);
+void
+generateSVDmodel(RecScanState *recnode) {
+	float *userFeatures, *itemFeatures;
+	int *userIDs, *itemIDs;
+	float *itemAvgs, *userOffsets;
+	int numUsers, numItems;
+	int numFeatures;
+	svd_params params;
+	svd_events events;
+	AttributeInfo *attributes;
+	char *eventtable, *userkey, *itemkey, *eventval;
+	generated_stamp stamp;
+	bool shared;
 
-	// If this is us updating a cell as opposed to building
-	// a recommender, we need to drop the existing entries.
-	if (update) {
-		char *dropstring;
+	attributes = (AttributeInfo*) recnode->attributes;
+	eventtable = attributes->eventtable;
+	userkey = attributes->userkey;
+	itemkey = attributes->itemkey;
+	eventval = attributes->eventval;
 
-		dropstring = (char*) palloc(256*sizeof(char));
-		sprintf(dropstring,"DELETE FROM %s;",modelname);
-		recathon_queryExecute(dropstring);
-		pfree(dropstring);
-	}
+	// A recommender left to generate its model on the fly trains
+	// it the way it was created. Only models with the default
+	// parameters are kept for other queries, since those are
+	// what a query with no recommender would train.
+	shared = generatedSVDparams(recnode, SVD, &params);
 
-	// With the precomputation done, we need to derive the actual user
-	// similarities. We can do this in a way that's linear in the number
-	// of I/Os and also the amount of storage. The complexity is relegated
-	// to in-memory calculations, which is the most affordable. We need to
-	// use this data structure here.
-	userEvents = (sim_node*) palloc(numUsers*sizeof(sim_node));
-	for (i = 0; i < numUsers; i++)
-		userEvents[i] = NULL;
+	// A model generated for an earlier query may still be good.
+	if (shared && restoreGeneratedModel(recnode, &stamp))
+		return;
+	numFeatures = params.numFeatures;
 
-	// With the model created, we need to populate it, which means calculating
-	// similarity between all user pairs. We need to query the events table
-	// in order to get the key information.
-	querystring = (char*) palloc(1024*sizeof(char));
-	sprintf(querystring,"SELECT r.%s,r.%s,r.%s FROM %s r ORDER BY r.%s;",
-		userkey,itemkey,eventval,eventtable,userkey);
+	// First, we get all of the events we'll be considering, and
+	// our lists of users and items along with them.
+	events = SVDevents(userkey,itemkey,eventtable,eventval,
+		&userIDs, &itemIDs, &numUsers, &numItems);
 
-	// Begin extracting data.
-	priorID = -1;
-	simqueryDesc = recathon_queryStart(querystring, &simcontext);
-	simplanstate = simqueryDesc->planstate;
-	i = -1;
+	// Then we get information for baseline averages.
+	SVDaverages(events,numUsers,numItems,&itemAvgs,&userOffsets);
 
-	for (;;) {
-		int simuser, simitem;
-		float simevent;
-		sim_node newnode;
+	// Initialize our feature arrays.
+	userFeatures = allocFeatures(numFeatures, numUsers, false);
+	itemFeatures = allocFeatures(numFeatures, numItems, false);
 
-		// Shut the compiler up.
-		simuser = 0; simitem = 0; simevent = 0.0;
+	// We now have all of the events, so we can start training our features.
+	SVDtrainEvents(events, 0, events->numEvents, &params,
+		userFeatures, itemFeatures, itemAvgs, userOffsets, true);
 
-		simslot = ExecProcNode(simplanstate);
-		if (TupIsNull(simslot)) break;
+	// Free up memory.
+	pfree(itemAvgs);
+	pfree(userOffsets);
+	freeSVDevents(events);
 
-		simuser = getTupleInt(simslot,userkey);
-		simitem = getTupleInt(simslot,itemkey);
-		simevent = getTupleFloat(simslot,eventval);
+	// Return the relevant information.
+	recnode->numFeatures = numFeatures;
+	recnode->totalUsers = numUsers;
+	recnode->fullTotalItems = numItems;
+	recnode->userList = userIDs;
+	recnode->fullItemList = itemIDs;
+	recnode->SVDusermodel = userFeatures;
+	recnode->SVDitemmodel = itemFeatures;
 
-		// Are we dealing with a new user ID? If so, switch to the next slot.
-		if (simuser != priorID) {
-			priorID = simuser;
-			i++;
-		}
+	// And keep it for the next query.
+	if (shared)
+		keepGeneratedModel(recnode, &stamp, true, true);
+}
 
-		// We now have the user, item, and event for this tuple.
-		// We insert the results as a sim_node into the
-		// userEvents table; we'll do calculations later.
-		newnode = createSimNode(simitem, simevent);
-		userEvents[i] = simInsert(userEvents[i], newnode);
-		numEvents++;
-	}
+/* ----------------------------------------------------------------
+ *		generateALSmodel
+ *
+ *		Create an ALS model on the fly. The result has the
+ *		same layout as an on-the-fly SVD model, so it's
+ *		scored by SVDgenerate.
+ * ----------------------------------------------------------------
+ */
+void
+generateALSmodel(RecScanState *recnode) {
+	float *userFeatures, *itemFeatures;
+	int *userIDs, *itemIDs;
+	int numUsers, numItems;
+	svd_params params;
+	svd_events events;
+	AttributeInfo *attributes;
+	generated_stamp stamp;
+	bool shared;
 
-	// Query cleanup.
-	recathon_queryEnd(simqueryDesc, simcontext);
-	pfree(querystring);
+	attributes = (AttributeInfo*) recnode->attributes;
 
-	// We're going to write out the results to file.
-	if ((fp = fopen(temprecfile,"w")) == NULL)
-		ereport(ERROR,
-			(errcode(ERRCODE_SYNTAX_ERROR),
-			 errmsg("failed to open temporary file")));
-	insertstring = (char*) palloc(128*sizeof(char));
+	// As for SVD, only models with the default parameters
+	// are kept.
+	shared = generatedSVDparams(recnode, ALS, &params);
 
-	// Now we do the similarity calculations. Note that we
-	// don't include duplicate entries, to save time and space.
-	// The first user ALWAYS has a lower value than the second.
-	for (i = 0; i < numUsers; i++) {
-		float length_i;
-		sim_node user_i;
-		nbr_node temp_nbr;
-		nbr_node nbr_list = NULL;
-
-		user_i = userEvents[i];
-		if (!user_i) continue;
-		length_i = userLengths[i];
-
-		for (j = i+1; j < numUsers; j++) {
-			float length_j;
-			sim_node user_j;
-			int user1, user2;
-			float similarity;
+	// A model generated for an earlier query may still be good.
+	if (shared && restoreGeneratedModel(recnode, &stamp))
+		return;
 
-			user_j = userEvents[j];
-			if (!user_j) continue;
-			length_j = userLengths[j];
+	events = SVDevents(attributes->userkey,attributes->itemkey,
+		attributes->eventtable,attributes->eventval,
+		&userIDs, &itemIDs, &numUsers, &numItems);
 
-			similarity = cosineSimilarity(user_i, user_j, length_i, length_j);
-			if (similarity <= 0) continue;
-			user1 = userIDs[i];
-			user2 = userIDs[j];
+	userFeatures = allocFeatures(params.numFeatures, numUsers, false);
+	itemFeatures = allocFeatures(params.numFeatures, numItems, false);
+	ALSfactorize(events, numUsers, numItems, &params, 1,
+		userFeatures, itemFeatures);
+	freeSVDevents(events);
 
-			// Now we write.
-			if (NBRHOOD <= 0) {
-				sprintf(insertstring,"%d;%d;%f\n",user1,user2,similarity);
-				fwrite(insertstring,1,strlen(insertstring),fp);
-			} else {
-				nbr_node newnbr = createNbrNode(user1,user2,similarity);
-				nbr_list = nbrInsert(nbr_list,newnbr,NBRHOOD);
-			}
-		}
+	// Return the relevant information.
+	recnode->numFeatures = params.numFeatures;
+	recnode->totalUsers = numUsers;
+	recnode->fullTotalItems = numItems;
+	recnode->userList = userIDs;
+	recnode->fullItemList = itemIDs;
+	recnode->SVDusermodel = userFeatures;
+	recnode->SVDitemmodel = itemFeatures;
 
-		// If we have a limited neighborhood, we write the results here.
-		if (NBRHOOD > 0) {
-			for (temp_nbr = nbr_list; temp_nbr; temp_nbr = temp_nbr->next) {
-				sprintf(insertstring,"%d;%d;%f\n",temp_nbr->item1,
-					temp_nbr->item2,temp_nbr->similarity);
-				fwrite(insertstring,1,strlen(insertstring),fp);
-			}
-			freeNbrList(nbr_list);
-		}
+	// And keep it for the next query.
+	if (shared)
+		keepGeneratedModel(recnode, &stamp, true, true);
+}
 
-		CHECK_FOR_INTERRUPTS();
-	}
+/* ----------------------------------------------------------------
+ *		itemCFgenerate
+ *
+ *		Generates a predicted RecScore for a given user and
+ *		item, for a recommender that uses item-based
+ *		collaborative filtering built on-the-fly.
+ * ----------------------------------------------------------------
+ */
+float
+itemCFgenerate(RecScanState *recnode, int itemid, int itemindex)
+{
+	int i, *cols;
+	float score, totalSim;
+	GenSparseModel *itemmodel;
 
-	pfree(insertstring);
-	fclose(fp);
+	// In case there's some error.
+	if (itemindex < 0)
+		return -1;
 
-	// If we are updating an existing similarity model,
-	// we will want to drop the existing primary key
-	// constraint before doing the copy, to save time.
-	if (update) {
-		insertstring = (char*) palloc(1024*sizeof(char));
-		sprintf(insertstring,"ALTER TABLE %s DROP CONSTRAINT %s_pkey;",
-					modelname,modelname);
-		recathon_utilityExecute(insertstring);
-		pfree(insertstring);
+	// applyItemSimGenerate has already added in the rated items in
+	// earlier rows. We're going to look through the similarity
+	// matrix for the numbers that correspond to this item, and find
+	// which of those also correspond to items this user rated. We
+	// will use that information to obtain the estimated rating.
+	// A slice of the model has whole rows for the rated items, so
+	// they've all been added in already.
+	itemmodel = recnode->itemCFmodel;
+	score = recnode->pendingScore[itemindex];
+	totalSim = recnode->pendingSim[itemindex];
+	if (recnode->itemCFslice)
+		return totalSim == 0 ? 0 : score / totalSim;
+
+	cols = sparseRowColumns(itemmodel, itemindex, NULL);
+	for (i = itemmodel->rowStart[itemindex]; i < itemmodel->rowStart[itemindex+1]; i++) {
+		int ratedindex;
+		float similarity;
+
+		// If this isn't an item we've rated, we don't care.
+		ratedindex = cols[i - itemmodel->rowStart[itemindex]];
+		if (!recnode->isRated[ratedindex])
+			continue;
+
+		similarity = itemmodel->values[i];
+		score += similarity*recnode->ratedScore[ratedindex];
+		if (similarity < 0)
+			similarity *= -1;
+		totalSim += similarity;
 	}
 
-	// With all the data written out, we're going to
-	// issue a COPY FROM command to bulk load the data
-	// into the database.
-	insertstring = (char*) palloc(1024*sizeof(char));
-	sprintf(insertstring,"COPY %s FROM '%s' DELIMITERS ';';",
-		modelname,temprecfile);
-	recathon_utilityExecute(insertstring);
-	pfree(insertstring);
+	if (totalSim == 0) return 0;
+
+	return score / totalSim;
+}
+
+/* ----------------------------------------------------------------
+ *		itemJaccardScore
+ *
+ *		Generates a RecScore for a given user and item, for
+ *		a recommender that uses item-based collaborative
+ *		filtering with Jaccard similarity, built or on the
+ *		fly. Its events are implicit, so rather than
+ *		averaging them, we score each item by how similar
+ *		it is to all of the user's items together.
+ * ----------------------------------------------------------------
+ */
+float
+itemJaccardScore(RecScanState *recnode, int itemid, int itemindex)
+{
+	int i, *cols;
+	float totalSim;
+	AttributeInfo *attributes;
+	GenSparseModel *itemmodel;
+
+	// In case there's some error.
+	if (itemindex < 0)
+		return -1;
 
-	// Now we add the primary key constraint. It's
-	// faster to add it after adding the data than
-	// having it incrementally updated.
-	insertstring = (char*) palloc(1024*sizeof(char));
-	sprintf(insertstring,"ALTER TABLE %s ADD PRIMARY KEY (user1, user2)",modelname);
-	recathon_utilityExecute(insertstring);
-	pfree(insertstring);
-
-	// We'll delete the temporary file here, to not hold onto
-	// memory longer than necessary.
-	if (unlink(temprecfile) < 0)
-		ereport(WARNING,
-			(errcode(ERRCODE_WARNING),
-			 errmsg("failed to delete temporary file")));
+	// The earlier rows of an on-the-fly model have already been
+	// added in, and so has all of a built one, or of a slice.
+	totalSim = recnode->pendingSim[itemindex];
+	attributes = (AttributeInfo*) recnode->attributes;
+	if ((attributes->opType != OP_GENERATE && attributes->opType != OP_GENERATEJOIN) ||
+	    recnode->itemCFslice)
+		return totalSim;
 
-	// Free up the lists of sim_nodes and start again.
-	for (i = 0; i < numUsers; i++) {
-		freeSimList(userEvents[i]);
-		userEvents[i] = NULL;
-	}
+	itemmodel = recnode->itemCFmodel;
+	cols = sparseRowColumns(itemmodel, itemindex, NULL);
+	for (i = itemmodel->rowStart[itemindex]; i < itemmodel->rowStart[itemindex+1]; i++)
+		if (recnode->isRated[cols[i - itemmodel->rowStart[itemindex]]])
+			totalSim += itemmodel->values[i];
 
-	// Return the number of events we used.
-	return numEvents;
+	return totalSim;
 }
 
 /* ----------------------------------------------------------------
- *		updateUserPearModel
+ *		userCFgenerate
  *
- *		Given a single cell of a recommender, this
- *		function rebuilds the recModel for that cell, using
- *		user-based collaborative filtering with Pearson
- *		similarity. Returns the number of events used.
+ *		Generates a predicted RecScore for a given user and
+ *		item, for a recommender that uses user-based
+ *		collaborative filtering built on-the-fly.
  * ----------------------------------------------------------------
  */
-int
-updateUserPearModel(char *eventtable, char *userkey, char *itemkey,
-		char *eventval, char *modelname, int *userIDs, float *userAvgs,
-		float *userPearsons, int numUsers, bool update) {
-	int i, j, priorID;
-	int numEvents = 0;
-	char *querystring, *insertstring, *temprecfile;
-	sim_node *userEvents;
-	// Information for other queries.
-	QueryDesc *simqueryDesc;
-	PlanState *simplanstate;
-	TupleTableSlot *simslot;
-	MemoryContext simcontext;
-	// Information for writing to file.
-	FILE *fp;
-	temprecfile = (char*) palloc(256*sizeof(char));
-	sprintf(temprecfile,"recathon_temp_%s.dat",modelname);
+float
+userCFgenerate(RecScanState *recnode, int itemid, int itemindex)
+{
+	/* The model only differs in where the similarities come from,
+	 * which prepUserForRating has already dealt with. */
+	return userCFpredict(recnode, itemid, itemindex);
+}
 
-	// If this is us updating a cell as opposed to building
-	// a recommender, we need to drop the existing entries.
-	if (update) {
-		char *dropstring;
+/* ----------------------------------------------------------------
+ *		SVDgenerate
+ *
+ *		Generates a predicted RecScore for a given user and
+ *		item, for a recommender that uses SVD built
+ *		on-the-fly.
+ * ----------------------------------------------------------------
+ */
+float
+SVDgenerate(RecScanState *recnode, int itemid, int itemindex)
+{
+	float *userVec, *itemVec;
 
-		dropstring = (char*) palloc(256*sizeof(char));
-		sprintf(dropstring,"DELETE FROM %s;",modelname);
-		recathon_queryExecute(dropstring);
-		pfree(dropstring);
+	userVec = recnode->SVDusermodel + (Size) recnode->userindex * recnode->numFeatures;
+	itemVec = recnode->SVDitemmodel + (Size) itemindex * recnode->numFeatures;
+
+	// At this point, our work is easy.
+	return factorDot(userVec, itemVec, recnode->numFeatures);
+}
+
+/* A model entry and its similarity, or a rated item's place and its
+ * similarity, for thresholdItemCandidates, or a rated item and its
+ * rating, for applyItemSimGenerate. */
+typedef struct threshold_entry {
+	int		key;
+	float		value;
+} threshold_entry;
+
+/* Comparison function for sorting entries by descending similarity. */
+static int
+thresholdValueCompare(const void *a, const void *b) {
+	const threshold_entry *entry1 = (const threshold_entry*) a;
+	const threshold_entry *entry2 = (const threshold_entry*) b;
+
+	if (entry1->value > entry2->value) return -1;
+	if (entry1->value < entry2->value) return 1;
+	return entry1->key - entry2->key;
+}
+
+/* ----------------------------------------------------------------
+ *		itemBlockScoring
+ *
+ *		Decides, the first time it's asked, whether an item-
+ *		based scan works out its users' pending scores a
+ *		block at a time, and sets it up if so. That takes
+ *		the model in memory, and a scan of many users that
+ *		goes through them all in order, in this process;
+ *		one stopping early for a top-k or a time budget
+ *		wants each user's scores its own way. Everyone's
+ *		events are read in at once, if they haven't been.
+ * ----------------------------------------------------------------
+ */
+static bool
+itemBlockScoring(RecScanState *recstate) {
+	AttributeInfo *attributes = (AttributeInfo*) recstate->attributes;
+	Size rowBytes;
+	int size;
+
+	if (recstate->userBlockSize != 0)
+		return recstate->userBlockSize > 0;
+	recstate->userBlockSize = -1;
+
+	rowBytes = 2 * (Size) Max(recstate->fullTotalItems, 1) * sizeof(float);
+	size = (int) Min((Size) RECATHON_USER_BLOCK, (Size) work_mem * 1024L / rowBytes);
+	if (size < 2 || !recstate->itemCFmodel || recstate->userqual ||
+	    recstate->totalUsers < RECATHON_USER_BLOCK ||
+	    recstate->thresholdTopK || recstate->timeBudget > 0 ||
+	    recstate->parallelWorker ||
+	    (attributes->opType != OP_FILTER && attributes->opType != OP_GENERATE))
+		return false;
+
+	if (!recstate->userEvents) {
+		MemoryContext oldcontext = MemoryContextSwitchTo(recstate->recContext);
+
+		loadUserEvents(recstate);
+		MemoryContextSwitchTo(oldcontext);
 	}
+	recstate->userBlockScore = (float*) MemoryContextAlloc(recstate->recContext,
+		size * rowBytes / 2);
+	recstate->userBlockSim = (float*) MemoryContextAlloc(recstate->recContext,
+		size * rowBytes / 2);
+	recstate->userBlockRows = 0;
+	recstate->userBlockSize = size;
+	return true;
+}
 
-	// With the precomputation done, we need to derive the actual item
-	// similarities. We can do this in a way that's linear in the number
-	// of I/Os and also the amount of storage. The complexity is relegated
-	// to in-memory calculations, which is the most affordable. We need to
-	// use this data structure here.
-	userEvents = (sim_node*) palloc(numUsers*sizeof(sim_node));
-	for (i = 0; i < numUsers; i++)
-		userEvents[i] = NULL;
+/* A user's rating of an item, among a block's. */
+typedef struct block_entry {
+	int		item;		/* the item's index */
+	int		row;		/* the user's place in the block */
+	float		rating;
+} block_entry;
+
+/* Comparison function for sorting block entries by item, then user. */
+static int
+blockEntryCompare(const void *a, const void *b) {
+	const block_entry *entry1 = (const block_entry*) a;
+	const block_entry *entry2 = (const block_entry*) b;
+
+	if (entry1->item != entry2->item)
+		return entry1->item - entry2->item;
+	return entry1->row - entry2->row;
+}
 
-	// With the model created, we need to populate it, which means calculating
-	// similarity between all item pairs. We need to query the events table
-	// in order to get the key information.
-	querystring = (char*) palloc(1024*sizeof(char));
-	sprintf(querystring,"SELECT r.%s,r.%s,r.%s FROM %s r ORDER BY r.%s;",
-		userkey,itemkey,eventval,eventtable,userkey);
+/* ----------------------------------------------------------------
+ *		userBlockPending
+ *
+ *		Fills in the pending scores and similarity sums for
+ *		the user in the given row of userEvents, as
+ *		applyItemSimGenerate would. If they aren't in the
+ *		current block, the block from their row on is worked
+ *		out first, as the product of the block's ratings and
+ *		the model: every item the block's users rated is
+ *		taken in turn, and each of its neighbors is added
+ *		in for all of those users at once, so the model's
+ *		rows are read once a block rather than once a user.
+ * ----------------------------------------------------------------
+ */
+static void
+userBlockPending(RecScanState *recstate, int row) {
+	GenSparseModel *events = recstate->userEvents;
+	GenSparseModel *model = recstate->itemCFmodel;
+	Size n = recstate->fullTotalItems;
+	float *score = recstate->userBlockScore;
+	float *simsum = recstate->userBlockSim;
+
+	if (recstate->userBlockRows == 0 || row < recstate->userBlockFirst ||
+	    row >= recstate->userBlockFirst + recstate->userBlockRows) {
+		int r, e, k, j, end, numRows, numEntries;
+		int *seen;
+		block_entry *entries;
+
+		numRows = Min(recstate->userBlockSize, events->numRows - row);
+		memset(score, 0, numRows * n * sizeof(float));
+		memset(simsum, 0, numRows * n * sizeof(float));
+
+		// Each user's first rating of an item is the one that
+		// counts, as for a single user.
+		numEntries = events->rowStart[row+numRows] - events->rowStart[row];
+		entries = (block_entry*) palloc(Max(numEntries, 1)*sizeof(block_entry));
+		seen = (int*) palloc(Max(n, 1)*sizeof(int));
+		memset(seen, -1, n*sizeof(int));
+		numEntries = 0;
+		for (r = 0; r < numRows; r++) {
+			for (j = events->rowStart[row+r]; j < events->rowStart[row+r+1]; j++) {
+				int itemindex = events->colIndex[j];
+
+				if (itemindex < 0 || seen[itemindex] == r)
+					continue;
+				seen[itemindex] = r;
+				entries[numEntries].item = itemindex;
+				entries[numEntries].row = r;
+				entries[numEntries].rating = events->values[j];
+				numEntries++;
+			}
+		}
+		qsort(entries, numEntries, sizeof(block_entry), blockEntryCompare);
 
-	// Begin extracting data.
-	priorID = -1;
-	simqueryDesc = recathon_queryStart(querystring, &simcontext);
-	simplanstate = simqueryDesc->planstate;
-	i = -1;
+		for (e = 0; e < numEntries; e = end) {
+			int itemindex = entries[e].item;
+			int *cols = sparseRowColumns(model, itemindex, NULL);
 
-	for (;;) {
-		int simuser, simitem;
-		float simevent;
-		sim_node newnode;
+			end = e + 1;
+			while (end < numEntries && entries[end].item == itemindex)
+				end++;
 
-		// Shut the compiler up.
-		simuser = 0; simitem = 0; simevent = 0.0;
+			for (j = model->rowStart[itemindex]; j < model->rowStart[itemindex+1]; j++) {
+				int pendingindex = cols[j - model->rowStart[itemindex]];
+				float similarity = sparseValue(model, itemindex, j);
+				float abssim = fabsf(similarity);
 
-		simslot = ExecProcNode(simplanstate);
-		if (TupIsNull(simslot)) break;
+				for (k = e; k < end; k++) {
+					Size at = (Size) entries[k].row * n + pendingindex;
 
-		simuser = getTupleInt(simslot,userkey);
-		simitem = getTupleInt(simslot,itemkey);
-		simevent = getTupleFloat(simslot,eventval);
+					score[at] += similarity*entries[k].rating;
+					simsum[at] += abssim;
+				}
+			}
 
-		// Are we dealing with a new user ID? If so, switch to the next slot.
-		if (simuser != priorID) {
-			priorID = simuser;
-			i++;
+			CHECK_FOR_INTERRUPTS();
 		}
 
-		// We now have the user, item, and event for this tuple.
-		// We insert the results as a sim_node into the
-		// userEvents table; we'll do calculations later.
-		newnode = createSimNode(simitem, simevent);
-		userEvents[i] = simInsert(userEvents[i], newnode);
-		numEvents++;
+		pfree(seen);
+		pfree(entries);
+		recstate->userBlockFirst = row;
+		recstate->userBlockRows = numRows;
 	}
 
-	// Query cleanup.
-	recathon_queryEnd(simqueryDesc, simcontext);
-	pfree(querystring);
-
-	// We're going to write out the results to file.
-	if ((fp = fopen(temprecfile,"w")) == NULL)
-		ereport(ERROR,
-			(errcode(ERRCODE_SYNTAX_ERROR),
-			 errmsg("failed to open temporary file")));
-	insertstring = (char*) palloc(128*sizeof(char));
+	memcpy(recstate->pendingScore, score + (Size) (row - recstate->userBlockFirst) * n,
+		n*sizeof(float));
+	memcpy(recstate->pendingSim, simsum + (Size) (row - recstate->userBlockFirst) * n,
+		n*sizeof(float));
+}
 
-	// Now we do the similarity calculations. Note that we
-	// don't include duplicate entries, to save time and space.
-	// The first item ALWAYS has a lower value than the second.
-	for (i = 0; i < numUsers; i++) {
-		float avg_i, pearson_i;
-		sim_node user_i;
-		nbr_node temp_nbr;
-		nbr_node nbr_list = NULL;
-
-		user_i = userEvents[i];
-		if (!user_i) continue;
-		avg_i = userAvgs[i];
-		pearson_i = userPearsons[i];
-
-		for (j = i+1; j < numUsers; j++) {
-			float avg_j, pearson_j;
-			sim_node user_j;
-			int user1, user2;
-			float similarity;
+/* ----------------------------------------------------------------
+ *		svdBlockScoring
+ *
+ *		Decides, the first time it's asked, whether a factor-
+ *		model scan scores its users a block at a time, and
+ *		sets it up if so. Like itemBlockScoring, that takes
+ *		a scan of many users going through them in order
+ *		in this process, and it takes every user's factors
+ *		to hand, in the generated model or the model file,
+ *		and the item factors at full precision. A scan
+ *		probing clusters of items scores too few of them
+ *		for it to pay.
+ * ----------------------------------------------------------------
+ */
+static bool
+svdBlockScoring(RecScanState *recstate) {
+	AttributeInfo *attributes = (AttributeInfo*) recstate->attributes;
+	Size rowBytes;
+	int size;
+
+	if (recstate->userBlockSize != 0)
+		return recstate->userBlockSize > 0;
+	recstate->userBlockSize = -1;
+
+	rowBytes = (Size) Max(recstate->fullTotalItems, 1) * sizeof(float);
+	size = (int) Min((Size) RECATHON_SVD_USER_BLOCK, (Size) work_mem * 1024L / rowBytes);
+	if (size < 2 || !recstate->SVDitemmodel || recstate->SVDitemHalf ||
+	    recstate->userqual || recstate->clusterItems ||
+	    recstate->totalUsers < RECATHON_SVD_USER_BLOCK ||
+	    recstate->timeBudget > 0 || recstate->parallelWorker ||
+	    recstate->numFeatures <= 0 || recstate->numFeatures > RECATHON_MAX_FEATURES)
+		return false;
+	if (attributes->opType == OP_GENERATE) {
+		if (!recstate->SVDusermodel)
+			return false;
+	} else if (attributes->opType != OP_FILTER ||
+		   !modelFileSection(recstate, MODEL_FILE_USERFACTORS, NULL))
+		return false;
+
+	recstate->userBlockScore = (float*) MemoryContextAlloc(recstate->recContext,
+		size * rowBytes);
+	recstate->userBlockValid = (bool*) MemoryContextAlloc(recstate->recContext,
+		size * sizeof(bool));
+	recstate->userBlockRows = 0;
+	recstate->userBlockSize = size;
+	return true;
+}
 
-			user_j = userEvents[j];
-			if (!user_j) continue;
-			avg_j = userAvgs[j];
-			pearson_j = userPearsons[j];
+/* ----------------------------------------------------------------
+ *		svdUserBlock
+ *
+ *		Finds the current user's row among the block's
+ *		scores, and returns it, or -1 if we have to score
+ *		them on their own. If they aren't in the current
+ *		block, the block from their place in userList on is
+ *		scored first: the product of its users' factors and
+ *		the item factors, a stretch of items at a time, so
+ *		each item's factors are read in once and used by
+ *		every user in the block while they're in cache.
+ *		Users the model file has no factors for are left
+ *		out, to be folded in as usual.
+ * ----------------------------------------------------------------
+ */
+static int
+svdUserBlock(RecScanState *recstate) {
+	AttributeInfo *attributes = (AttributeInfo*) recstate->attributes;
+	int pos = recstate->userindex;
+	int numFeatures = recstate->numFeatures;
+	Size n = recstate->fullTotalItems;
 
-			similarity = pearsonSimilarity(user_i, user_j, avg_i, avg_j, pearson_i, pearson_j);
-			if (similarity == 0.0) continue;
-			user1 = userIDs[i];
-			user2 = userIDs[j];
+	if (pos < 0 || pos >= recstate->totalUsers)
+		return -1;
 
-			// Now we write.
-			if (NBRHOOD <= 0) {
-				sprintf(insertstring,"%d;%d;%f\n",user1,user2,similarity);
-				fwrite(insertstring,1,strlen(insertstring),fp);
-			} else {
-				nbr_node newnbr = createNbrNode(user1,user2,similarity);
-				nbr_list = nbrInsert(nbr_list,newnbr,NBRHOOD);
-			}
+	if (recstate->userBlockRows == 0 || pos < recstate->userBlockFirst ||
+	    pos >= recstate->userBlockFirst + recstate->userBlockRows) {
+		int r, numRows, tile, tileEnd, i;
+		float *vectors;
+
+		numRows = Min(recstate->userBlockSize, recstate->totalUsers - pos);
+		vectors = (float*) palloc((Size) numRows * numFeatures * sizeof(float));
+		for (r = 0; r < numRows; r++) {
+			float *vec = vectors + (Size) r * numFeatures;
+
+			if (attributes->opType == OP_GENERATE) {
+				memcpy(vec, recstate->SVDusermodel + (Size) (pos + r) * numFeatures,
+					numFeatures*sizeof(float));
+				recstate->userBlockValid[r] = true;
+			} else
+				recstate->userBlockValid[r] = modelFileFactorsOf(recstate,
+					recstate->userList[pos + r], vec);
 		}
 
-		// If we have a limited neighborhood, we write the results here.
-		if (NBRHOOD > 0) {
-			for (temp_nbr = nbr_list; temp_nbr; temp_nbr = temp_nbr->next) {
-				sprintf(insertstring,"%d;%d;%f\n",temp_nbr->item1,
-					temp_nbr->item2,temp_nbr->similarity);
-				fwrite(insertstring,1,strlen(insertstring),fp);
+		for (tile = 0; tile < (int) n; tile = tileEnd) {
+			tileEnd = Min(tile + RECATHON_SVD_ITEM_TILE, (int) n);
+			for (r = 0; r < numRows; r++) {
+				const float *vec = vectors + (Size) r * numFeatures;
+				float *score = recstate->userBlockScore + (Size) r * n;
+
+				if (!recstate->userBlockValid[r])
+					continue;
+				for (i = tile; i < tileEnd; i++)
+					score[i] = factorDot(vec, recstate->SVDitemmodel +
+						(Size) i * numFeatures, numFeatures);
 			}
-			freeNbrList(nbr_list);
+			CHECK_FOR_INTERRUPTS();
 		}
 
-		CHECK_FOR_INTERRUPTS();
-	}
-
-	pfree(insertstring);
-	fclose(fp);
-
-	// If we are updating an existing similarity model,
-	// we will want to drop the existing primary key
-	// constraint before doing the copy, to save time.
-	if (update) {
-		insertstring = (char*) palloc(1024*sizeof(char));
-		sprintf(insertstring,"ALTER TABLE %s DROP CONSTRAINT %s_pkey;",
-					modelname,modelname);
-		recathon_utilityExecute(insertstring);
-		pfree(insertstring);
+		pfree(vectors);
+		recstate->userBlockFirst = pos;
+		recstate->userBlockRows = numRows;
 	}
 
-	// With all the data written out, we're going to
-	// issue a COPY FROM command to bulk load the data
-	// into the database.
-	insertstring = (char*) palloc(1024*sizeof(char));
-	sprintf(insertstring,"COPY %s FROM '%s' DELIMITERS ';';",
-		modelname,temprecfile);
-	recathon_utilityExecute(insertstring);
-	pfree(insertstring);
-
-	// Now we add the primary key constraint. It's
-	// faster to add it after adding the data than
-	// having it incrementally updated.
-	insertstring = (char*) palloc(1024*sizeof(char));
-	sprintf(insertstring,"ALTER TABLE %s ADD PRIMARY KEY (user1, user2)",modelname);
-	recathon_utilityExecute(insertstring);
-	pfree(insertstring);
-
-	// We'll delete the temporary file here, to not hold onto
-	// memory longer than necessary.
-	if (unlink(temprecfile) < 0)
-		ereport(WARNING,
-			(errcode(ERRCODE_WARNING),
-			 errmsg("failed to delete temporary file")));
-
-	// Free up the lists of sim_nodes and start again.
-	for (i = 0; i < numUsers; i++) {
-		freeSimList(userEvents[i]);
-		userEvents[i] = NULL;
-	}
+	if (!recstate->userBlockValid[pos - recstate->userBlockFirst])
+		return -1;
+	return pos - recstate->userBlockFirst;
+}
 
-	// Return the number of events we used.
-	return numEvents;
+/* ----------------------------------------------------------------
+ *		recPastBudget
+ *
+ *		Says whether a query with a time budget has used it
+ *		up, looking at the clock only once every so many
+ *		calls. Once it has, it stays that way, and the query
+ *		is marked as having stopped short.
+ * ----------------------------------------------------------------
+ */
+bool
+recPastBudget(RecScanState *recnode, int every) {
+	instr_time elapsed;
+
+	if (recnode->timeBudget <= 0)
+		return false;
+	if (recnode->timedOut)
+		return true;
+	if (++recnode->budgetTicks < every)
+		return false;
+	recnode->budgetTicks = 0;
+
+	INSTR_TIME_SET_CURRENT(elapsed);
+	INSTR_TIME_SUBTRACT(elapsed, recnode->startTime);
+	if (INSTR_TIME_GET_MICROSEC(elapsed) < recnode->timeBudget)
+		return false;
+
+	elog(DEBUG1, "recommendation time budget of %ld ms used up",
+		recnode->timeBudget / 1000);
+	recnode->timedOut = true;
+	return true;
 }
 
 /* ----------------------------------------------------------------
- *		createSVDnode
+ *		applyItemSimGenerate
  *
- *		This function creates a new SVD node out of a
- *		TupleTableSlot.
+ *		The equivalent of applyItemSim for on-the-fly
+ *		recommendation. With a time budget, the rated items
+ *		go largest rating first, since those count the most,
+ *		and we stop where we are once it's used up.
  * ----------------------------------------------------------------
  */
-svd_node createSVDnode(TupleTableSlot *slot, char *userkey, char *itemkey, char *eventval,
-				int *userIDs, int *itemIDs, int numUsers, int numItems) {
-	int userid, itemid;
-	svd_node new_svd;
+void
+applyItemSimGenerate(RecScanState *recnode)
+{
+	int i, j;
+	int *order;
+	GenSparseModel *itemmodel;
+
+	itemmodel = recnode->itemCFmodel;
+
+	order = recnode->ratedItems;
+	if (recnode->timeBudget > 0) {
+		threshold_entry *byRating;
+
+		byRating = (threshold_entry*) palloc(Max(recnode->totalRatings, 1)*sizeof(threshold_entry));
+		for (i = 0; i < recnode->totalRatings; i++) {
+			byRating[i].key = recnode->ratedItems[i];
+			byRating[i].value = fabsf(recnode->ratedScore[recnode->ratedItems[i]]);
+		}
+		qsort(byRating, recnode->totalRatings, sizeof(threshold_entry), thresholdValueCompare);
+		order = (int*) palloc(Max(recnode->totalRatings, 1)*sizeof(int));
+		for (i = 0; i < recnode->totalRatings; i++)
+			order[i] = byRating[i].key;
+		pfree(byRating);
+	}
+
+	// For every item we've rated, we need to obtain its similarity
+	// scores and apply them to the appropriate items. This is
+	// necessary because we're only storing half of the similarity
+	// matrix.
+	for (i = 0; i < recnode->totalRatings; i++) {
+		int itemindex = order[i];
+		float rating = recnode->ratedScore[itemindex];
+		int *cols;
 
-	// Quiet the compiler.
-	userid = -1;
-	itemid = -1;
+		if (recPastBudget(recnode, 1))
+			break;
+		cols = sparseRowColumns(itemmodel, itemindex, NULL);
 
-	new_svd = (svd_node) palloc(sizeof(struct svd_node_t));
-	// Default values.
-	new_svd->userid = -1;
-	new_svd->itemid = -1;
-	new_svd->event = -1;
-	new_svd->residual = 0.0;
+		// Only nonzero similarities are stored, so every
+		// entry in this row is worth applying.
+		for (j = itemmodel->rowStart[itemindex]; j < itemmodel->rowStart[itemindex+1]; j++) {
+			int pendingindex;
+			float similarity;
 
-	userid = getTupleInt(slot,userkey);
-	itemid = getTupleInt(slot,itemkey);
-	new_svd->event = getTupleFloat(slot,eventval);
+			pendingindex = cols[j - itemmodel->rowStart[itemindex]];
+			similarity = sparseValue(itemmodel, itemindex, j);
 
-	// If we convert IDs to indexes in our arrays, it will make
-	// our lives easier.
-	new_svd->userid = binarySearch(userIDs,userid,0,numUsers);
-	new_svd->itemid = binarySearch(itemIDs,itemid,0,numItems);
+			recnode->pendingScore[pendingindex] += similarity*rating;
+			if (similarity < 0)
+				similarity *= -1;
+			recnode->pendingSim[pendingindex] += similarity;
+		}
+	}
 
-	return new_svd;
+	if (order != recnode->ratedItems)
+		pfree(order);
 }
 
 /* ----------------------------------------------------------------
- *		SVDlists
+ *		fillItemSim
  *
- *		This function generates user and item lists for use
- *		in SVD.
+ *		Fills in the rows of a similarity model being cached by
+ *		loadCachedItemSim, counting each row's entries in one
+ *		pass over the model table and placing them in a second.
+ *		To quantize the values, the first pass also finds each
+ *		row's scale, for rowScale. Returns false if the table
+ *		changed in between.
  * ----------------------------------------------------------------
  */
-void
-SVDlists(char *userkey, char *itemkey, char *eventtable,
-		int **ret_userIDs, int **ret_itemIDs,
-		int *ret_numUsers, int *ret_numItems) {
-	int i, numUsers, numItems;
-	int *userIDs, *itemIDs;
+static bool
+fillItemSim(RecScanState *recstate, char *itemmodel, int numRows, int capacity,
+		int bits, int *rowStart, int *colIndex, float *rowScale, void *values,
+		int *ret_numEntries) {
+	int i, numEntries;
+	int *fill;
+	bool ok;
+	// Query objects.
 	char *querystring;
-	// Information for other queries.
 	QueryDesc *queryDesc;
 	PlanState *planstate;
 	TupleTableSlot *slot;
 	MemoryContext recathoncontext;
+	tuple_column item1col, item2col, simcol;
 
 	querystring = (char*) palloc(1024*sizeof(char));
 
-	// First, let's get the list of users. We need to count how many
-	// we're dealing with.
-	sprintf(querystring,"SELECT COUNT(DISTINCT %s) FROM %s;",
-		userkey,eventtable);
-
-	queryDesc = recathon_queryStart(querystring, &recathoncontext);
+	// Every pair goes in the rows of both of its items, so a
+	// model that holds both directions is read one way. Until
+	// the second pass, rowScale holds each row's largest magnitude.
+	memset(rowStart, 0, (numRows+1)*sizeof(int));
+	if (rowScale)
+		memset(rowScale, 0, numRows*sizeof(float));
+	sprintf(querystring,"select item1, item2, similarity from %s%s;",itemmodel,
+		recstate->modelSymmetric ? " where item1 < item2" : "");
+	queryDesc = recathon_queryStart(querystring,&recathoncontext);
 	planstate = queryDesc->planstate;
+	bindColumn(&item1col, "item1");
+	bindColumn(&item2col, "item2");
+	bindColumn(&simcol, "similarity");
 
-	slot = ExecProcNode(planstate);
-	if (TupIsNull(slot))
-		numUsers = 0;
-	else
-		numUsers = getTupleInt(slot,"count");
-	recathon_queryEnd(queryDesc, recathoncontext);
-	userIDs = (int*) palloc(numUsers*sizeof(int));
-
-	sprintf(querystring,"SELECT DISTINCT %s FROM %s ORDER BY %s;",
-		userkey,eventtable,userkey);
+	numEntries = 0;
+	for (;;) {
+		int index1, index2;
 
-	queryDesc = recathon_queryStart(querystring, &recathoncontext);
-	planstate = queryDesc->planstate;
+		CHECK_FOR_INTERRUPTS();
 
-	i = 0;
-	for (;;) {
 		slot = ExecProcNode(planstate);
 		if (TupIsNull(slot)) break;
 
-		userIDs[i] = getTupleInt(slot, userkey);
+		index1 = itemIndex(recstate, columnInt(slot,&item1col));
+		if (index1 < 0) continue;
+		index2 = itemIndex(recstate, columnInt(slot,&item2col));
+		if (index2 < 0) continue;
 
-		i++;
-		if (i >= numUsers) break;
-	}
+		rowStart[index1+1]++;
+		rowStart[index2+1]++;
+		numEntries += 2;
+		if (numEntries > capacity) break;
 
-	recathon_queryEnd(queryDesc, recathoncontext);
+		if (rowScale) {
+			float magnitude = fabsf(columnFloat(slot,&simcol));
 
-	// Next, the list of items.
-	sprintf(querystring,"SELECT COUNT(DISTINCT %s) FROM %s;",
-		itemkey,eventtable);
+			rowScale[index1] = Max(rowScale[index1], magnitude);
+			rowScale[index2] = Max(rowScale[index2], magnitude);
+		}
+	}
+	recathon_queryEnd(queryDesc,recathoncontext);
 
-	queryDesc = recathon_queryStart(querystring, &recathoncontext);
-	planstate = queryDesc->planstate;
+	if (numEntries > capacity) {
+		pfree(querystring);
+		return false;
+	}
+	for (i = 0; i < numRows; i++)
+		rowStart[i+1] += rowStart[i];
+	for (i = 0; rowScale && i < numRows; i++)
+		rowScale[i] = similarityScale(rowScale[i], bits);
 
-	slot = ExecProcNode(planstate);
-	if (TupIsNull(slot))
-		numItems = 0;
-	else
-		numItems = getTupleInt(slot,"count");
-	recathon_queryEnd(queryDesc, recathoncontext);
-	itemIDs = (int*) palloc(numItems*sizeof(int));
+	fill = (int*) palloc(numRows*sizeof(int));
+	memcpy(fill, rowStart, numRows*sizeof(int));
 
-	querystring = (char*) palloc(1024*sizeof(char));
-	sprintf(querystring,"SELECT DISTINCT %s FROM %s ORDER BY %s;",
-		itemkey, eventtable, itemkey);
-	queryDesc = recathon_queryStart(querystring, &recathoncontext);
+	sprintf(querystring,"select item1, item2, similarity from %s%s;",itemmodel,
+		recstate->modelSymmetric ? " where item1 < item2" : "");
+	queryDesc = recathon_queryStart(querystring,&recathoncontext);
 	planstate = queryDesc->planstate;
+	bindColumn(&item1col, "item1");
+	bindColumn(&item2col, "item2");
+	bindColumn(&simcol, "similarity");
 
-	i = 0;
+	ok = true;
 	for (;;) {
+		int index1, index2;
+		float similarity;
+
+		CHECK_FOR_INTERRUPTS();
+
 		slot = ExecProcNode(planstate);
 		if (TupIsNull(slot)) break;
 
-		itemIDs[i] = getTupleInt(slot, itemkey);
+		index1 = itemIndex(recstate, columnInt(slot,&item1col));
+		if (index1 < 0) continue;
+		index2 = itemIndex(recstate, columnInt(slot,&item2col));
+		if (index2 < 0) continue;
+		similarity = columnFloat(slot,&simcol);
 
-		i++;
-		if (i >= numItems) break;
+		if (fill[index1] >= rowStart[index1+1] || fill[index2] >= rowStart[index2+1]) {
+			ok = false;
+			break;
+		}
+		// Each item's row holds the other item.
+		colIndex[fill[index1]] = index2;
+		storeSimilarity(values, fill[index1], similarity,
+			rowScale ? rowScale[index1] : 1.0, bits);
+		fill[index1]++;
+		colIndex[fill[index2]] = index1;
+		storeSimilarity(values, fill[index2], similarity,
+			rowScale ? rowScale[index2] : 1.0, bits);
+		fill[index2]++;
 	}
+	recathon_queryEnd(queryDesc,recathoncontext);
 
-	recathon_queryEnd(queryDesc, recathoncontext);
+	// Every row has to have come out full, too.
+	for (i = 0; ok && i < numRows; i++) {
+		if (fill[i] != rowStart[i+1])
+			ok = false;
+	}
+
+	pfree(fill);
 	pfree(querystring);
 
-	// Now we return the data.
-	(*ret_userIDs) = userIDs;
-	(*ret_itemIDs) = itemIDs;
-	(*ret_numUsers) = numUsers;
-	(*ret_numItems) = numItems;
+	(*ret_numEntries) = numEntries;
+	return ok;
 }
 
 /* ----------------------------------------------------------------
- *		SVDaverages
+ *		itemSimLayout
  *
- *		This function generates some event averages which
- *		are used as starting points for our SVD. This needs
- *		to be done once per cell. Borrowed from Simon Funk.
+ *		Points a GenSparseModel at the pieces of a cached item
+ *		model, as loadCachedItemSim lays it out, unless data is
+ *		NULL. Returns the offset of the packed columns.
  * ----------------------------------------------------------------
  */
-void
-SVDaverages(char *userkey, char *itemkey, char *eventtable, char *eventval,
-		int *userIDs, int *itemIDs, int numUsers, int numItems,
-		float **ret_itemAvgs, float **ret_userOffsets) {
-	int i, priorID;
-	int *userCounts, *itemCounts;
-	float *userAvgs, *itemAvgs;
-	float *itemSums;
-	float *itemSqs; // Squares of sums. Used to calculate variances.
-	float *itemVars; // Variances.
-	float globalAvg;
-	float globalSum = 0.0;
-	float globalAvgSum = 0.0;
-	float globalSq = 0.0;
-	float globalVar;
-	// Information for other queries.
-	char *querystring;
-	QueryDesc *queryDesc;
-	PlanState *planstate;
-	TupleTableSlot *slot;
-	MemoryContext recathoncontext;
-
-	// Initialize arrays.
-	itemCounts = (int*) palloc(numItems*sizeof(int));
-	itemAvgs = (float*) palloc(numItems*sizeof(float));
-	itemSums = (float*) palloc(numItems*sizeof(float));
-	itemSqs = (float*) palloc(numItems*sizeof(float));
-	itemVars = (float*) palloc(numItems*sizeof(float));
-	for (i = 0; i < numItems; i++) {
-		itemCounts[i] = 0;
-		itemSums[i] = 0.0;
-		itemSqs[i] = 0.0;
+static Size
+itemSimLayout(char *data, int numRows, int capacity, int bits,
+		GenSparseModel *model) {
+	Size scaleOffset, valueOffset, packStartOffset, packOffset;
+
+	scaleOffset = MAXALIGN(5*sizeof(int)) + (Size) (numRows+1)*sizeof(int);
+	valueOffset = scaleOffset;
+	if (bits != RECATHON_FULL_PRECISION)
+		valueOffset += (Size) numRows*sizeof(float);
+	packStartOffset = MAXALIGN(valueOffset + (Size) capacity*(bits/8));
+	packOffset = packStartOffset + (Size) (numRows+1)*sizeof(int64);
+
+	if (data) {
+		model->rowStart = (int*) (data + MAXALIGN(5*sizeof(int)));
+		model->rowScale = (bits != RECATHON_FULL_PRECISION) ?
+			(float*) (data + scaleOffset) : NULL;
+		model->qvalues = data + valueOffset;
+		model->values = (bits == RECATHON_FULL_PRECISION) ? (float*) model->qvalues : NULL;
+		model->packStart = (int64*) (data + packStartOffset);
+		model->packed = (uint8*) (data + packOffset);
+		model->colIndex = NULL;
 	}
+	return packOffset;
+}
 
-	// We need to issue a query to get event information.
-	querystring = (char*) palloc(256*sizeof(char));
-	sprintf(querystring,"SELECT %s,%s FROM %s ORDER BY %s;",
-			itemkey,eventval,eventtable,itemkey);
-
-	priorID = -1;
-	queryDesc = recathon_queryStart(querystring,&recathoncontext);
-	planstate = queryDesc->planstate;
-	i = -1;
+/* ----------------------------------------------------------------
+ *		packItemSim
+ *
+ *		Sorts each row of an item model just filled in by
+ *		fillItemSim by column, with its values, and packs its
+ *		columns. The plain columns were put after the packed
+ *		ones' space, far enough along that packing a row can
+ *		never reach the rows after it. Returns the size of the
+ *		packed columns, and the longest row in ret_maxRowLength.
+ * ----------------------------------------------------------------
+ */
+static Size
+packItemSim(GenSparseModel *model, int *colIndex, int *ret_maxRowLength) {
+	int i, k, maxRowLength, valueSize;
+	int *cols;
+	char *vals, *qvalues;
+	column_entry *order;
+	Size packedSize;
+
+	maxRowLength = 0;
+	for (i = 0; i < model->numRows; i++)
+		maxRowLength = Max(maxRowLength, model->rowStart[i+1] - model->rowStart[i]);
+
+	valueSize = model->valueBits / 8;
+	qvalues = (char*) model->qvalues;
+	cols = (int*) palloc(Max(maxRowLength, 1)*sizeof(int));
+	vals = (char*) palloc(Max(maxRowLength, 1)*valueSize);
+	order = (column_entry*) palloc(Max(maxRowLength, 1)*sizeof(column_entry));
+
+	packedSize = 0;
+	for (i = 0; i < model->numRows; i++) {
+		int start = model->rowStart[i];
+		int n = model->rowStart[i+1] - start;
+		bool sorted = true;
+
+		for (k = 1; k < n && sorted; k++)
+			sorted = (colIndex[start+k-1] < colIndex[start+k]);
+		if (sorted)
+			memcpy(cols, colIndex + start, n*sizeof(int));
+		else {
+			for (k = 0; k < n; k++) {
+				order[k].column = colIndex[start+k];
+				order[k].entry = k;
+			}
+			qsort(order, n, sizeof(column_entry), columnEntryCompare);
+			memcpy(vals, qvalues + (Size) start*valueSize, (Size) n*valueSize);
+			for (k = 0; k < n; k++) {
+				int from = order[k].entry;
+
+				cols[k] = order[k].column;
+				memcpy(qvalues + (Size) (start+k)*valueSize, vals + (Size) from*valueSize,
+					valueSize);
+			}
+		}
 
-	for (;;) {
-		int itemnum = 0;
-		float event = 0.0;
+		model->packStart[i] = packedSize;
+		packedSize += packRowColumns(cols, n, model->packed + packedSize);
+	}
+	model->packStart[model->numRows] = packedSize;
 
-		slot = ExecProcNode(planstate);
-		if (TupIsNull(slot)) break;
+	pfree(order);
+	pfree(vals);
+	pfree(cols);
 
-		itemnum = getTupleInt(slot,itemkey);
-		event = getTupleFloat(slot,eventval);
+	(*ret_maxRowLength) = maxRowLength;
+	return packedSize;
+}
 
-		// Are we dealing with a new item ID? If so, switch to the next slot.
-		if (itemnum != priorID) {
-			priorID = itemnum;
-			i++;
-		}
+/* ----------------------------------------------------------------
+ *		loadHotItemSim
+ *
+ *		For a similarity model too big for the shared model
+ *		cache, keeps the rows of the items with the most events
+ *		there instead, in up to recathon_cache_hot_memory
+ *		kilobytes. Those are the items nearly every user has
+ *		rated, so applyItemSim takes them from memory and only
+ *		queries the model table for the rest. Which items are
+ *		kept is worked out again whenever the model is rebuilt.
+ *
+ *		The cached copy holds the number of rows and entries,
+ *		then each item's row, or -1, then rowStart, and the
+ *		entries' items and similarities. A row has every pair
+ *		its item is in, with the other item's index.
+ * ----------------------------------------------------------------
+ */
+static void
+loadHotItemSim(RecScanState *recstate) {
+	AttributeInfo *attributes = (AttributeInfo*) recstate->attributes;
+	GenSparseModel *model;
+	int i, numItems, numRanked, numHot, numEntries, handle;
+	int *header, *rowOf, *ranked, *rowLength, *fill;
+	Datum *hotIDs;
+	char *data, *popularname;
+	RangeVar *popularrv;
+	Size budget, size;
+	bool complete;
+	// Query objects.
+	char *querystring;
+	QueryDesc *queryDesc;
+	TupleTableSlot *slot;
+	CachedPlan *cplan;
+	MemoryContext recathoncontext;
+	tuple_column itemcol, item1col, item2col, simcol;
+	Oid paramtypes[1] = {INT4ARRAYOID};
+	Datum paramvalues[1];
 
-		itemCounts[i] += 1;
-		itemSums[i] += event;
-		itemSqs[i] += (event*event);
-	}
+	budget = (Size) recathon_cache_hot_memory * 1024L;
+	numItems = recstate->fullTotalItems;
+	if (budget == 0 || recstate->cacheVersion == 0 || numItems <= 0)
+		return;
 
-	recathon_queryEnd(queryDesc,recathoncontext);
+	data = cachedModelData(recstate, "hotsimilarity", &size);
+	if (!data) {
+		// The items by their events, as the popularity model
+		// counts them.
+		popularname = (char*) palloc(256*sizeof(char));
+		sprintf(popularname,"%sPopular",attributes->recIndexName);
+		popularrv = makeRangeVarFromNameList(stringToQualifiedNameList(popularname));
+		if (!relationExists(popularrv)) {
+			pfree(popularrv);
+			pfree(popularname);
+			return;
+		}
+		pfree(popularrv);
+
+		querystring = (char*) palloc(1024*sizeof(char));
+		sprintf(querystring,"select item from %s order by events desc;",popularname);
+		ranked = (int*) palloc(numItems*sizeof(int));
+		numRanked = 0;
+		queryDesc = recathon_queryStart(querystring,&recathoncontext);
+		bindColumn(&itemcol, "item");
+		for (;;) {
+			int itemindex;
+
+			slot = ExecProcNode(queryDesc->planstate);
+			if (TupIsNull(slot)) break;
+
+			itemindex = itemIndex(recstate, columnInt(slot,&itemcol));
+			if (itemindex >= 0 && numRanked < numItems)
+				ranked[numRanked++] = itemindex;
+		}
+		recathon_queryEnd(queryDesc,recathoncontext);
+		pfree(popularname);
 
-	// We have enough data to calculate individual item variances.
-	for (i = 0; i < numItems; i++) {
-		float sum, sumsqr;
-		int n;
+		// How long each item's row is.
+		rowLength = (int*) palloc0(numItems*sizeof(int));
+		sprintf(querystring,"select item1, item2 from %s;",attributes->recModelName);
+		queryDesc = recathon_queryStart(querystring,&recathoncontext);
+		bindColumn(&item1col, "item1");
+		bindColumn(&item2col, "item2");
+		for (;;) {
+			int index1, index2;
 
-		n = itemCounts[i];
-		sum = itemSums[i];
-		sumsqr = itemSqs[i];
+			CHECK_FOR_INTERRUPTS();
 
-		if (n <= 0)
-			itemVars[i] = 0;
-		else
-			itemVars[i] = (sumsqr - ((sum*sum)/n))/n;
+			slot = ExecProcNode(queryDesc->planstate);
+			if (TupIsNull(slot)) break;
 
-		// We can also start calculating the global variance in this loop.
-		// Some notation abuse.
-		globalSum += sum;
-		if (n > 0) {
-			sum = sum/n;
-			globalAvgSum += sum;
-			globalSq += (sum*sum);
+			index1 = itemIndex(recstate, columnInt(slot,&item1col));
+			if (index1 < 0) continue;
+			index2 = itemIndex(recstate, columnInt(slot,&item2col));
+			if (index2 < 0) continue;
+			rowLength[index1]++;
+			if (!recstate->modelSymmetric)
+				rowLength[index2]++;
 		}
-	}
-
-	// Now we derive the global variance.
-	globalVar = (globalSq - ((globalAvgSum*globalAvgSum)/numItems))/numItems;
-	globalAvg = globalSum/count_rows(eventtable);
+		recathon_queryEnd(queryDesc,recathoncontext);
 
-	// Finally, we can obtain the baseline averages for each item.
-	for (i = 0; i < numItems; i++) {
-		float k;
+		// Then as many of the most popular as fit.
+		size = (Size) (numItems + 3)*sizeof(int);
+		numHot = 0;
+		numEntries = 0;
+		while (numHot < numRanked) {
+			Size rowSize = sizeof(int) +
+				(Size) rowLength[ranked[numHot]]*(sizeof(int) + sizeof(float));
+
+			if (size + rowSize > budget)
+				break;
+			size += rowSize;
+			numEntries += rowLength[ranked[numHot]];
+			numHot++;
+		}
+		if (numHot == 0) {
+			pfree(ranked);
+			pfree(rowLength);
+			pfree(querystring);
+			return;
+		}
 
-		if (globalVar == 0)
-			k = 0;
-		else
-			k = itemVars[i] / globalVar;
+		data = reserveModelData(recstate, "hotsimilarity", size, &handle);
+		if (!data) {
+			pfree(ranked);
+			pfree(rowLength);
+			pfree(querystring);
+			return;
+		}
+		header = (int*) data;
+		header[0] = numHot;
+		header[1] = numEntries;
+		rowOf = header + 2;
+		model = (GenSparseModel*) palloc0(sizeof(GenSparseModel));
+		model->rowStart = rowOf + numItems;
+		model->colIndex = model->rowStart + numHot + 1;
+		model->values = (float*) (model->colIndex + numEntries);
+		for (i = 0; i < numItems; i++)
+			rowOf[i] = -1;
+		model->rowStart[0] = 0;
+		hotIDs = (Datum*) palloc(numHot*sizeof(Datum));
+		for (i = 0; i < numHot; i++) {
+			rowOf[ranked[i]] = i;
+			model->rowStart[i+1] = model->rowStart[i] + rowLength[ranked[i]];
+			hotIDs[i] = Int32GetDatum(recstate->fullItemList[ranked[i]]);
+		}
 
-		if ((k + itemCounts[i]) > 0)
-			itemAvgs[i] = ((globalAvg*k) + itemSums[i]) / (k + itemCounts[i]);
+		// And their rows.
+		fill = (int*) palloc(numHot*sizeof(int));
+		memcpy(fill, model->rowStart, numHot*sizeof(int));
+		paramvalues[0] = PointerGetDatum(construct_array(hotIDs, numHot,
+					INT4OID, sizeof(int32), true, 'i'));
+		if (recstate->modelSymmetric)
+			sprintf(querystring,"select item1, item2, similarity from %s where item1 = ANY($1);",
+				attributes->recModelName);
 		else
-			itemAvgs[i] = 0;
-	}
+			sprintf(querystring,"select item1, item2, similarity from %s where item1 = ANY($1) or item2 = ANY($1);",
+				attributes->recModelName);
+		queryDesc = recathon_queryStartCached(querystring,1,paramtypes,paramvalues,
+					&cplan,&recathoncontext);
+		bindColumn(&item1col, "item1");
+		bindColumn(&item2col, "item2");
+		bindColumn(&simcol, "similarity");
+		complete = true;
+		for (;;) {
+			int index1, index2, row;
+			float similarity;
 
-	// With the averages calculated, we can now calculate the average offset
-	// for each user. This involves querying the user table again.
-	userCounts = (int*) palloc(numUsers*sizeof(int));
-	for (i = 0; i < numUsers; i++)
-		userCounts[i] = 0;
-	userAvgs = (float*) palloc(numUsers*sizeof(float));
-	for (i = 0; i < numUsers; i++)
-		userAvgs[i] = 0.0;
+			CHECK_FOR_INTERRUPTS();
 
-	sprintf(querystring,"SELECT r.%s,r.%s,r.%s FROM %s r;",
-		userkey,itemkey,eventval,eventtable);
+			slot = ExecProcNode(queryDesc->planstate);
+			if (TupIsNull(slot)) break;
+
+			index1 = itemIndex(recstate, columnInt(slot,&item1col));
+			if (index1 < 0) continue;
+			index2 = itemIndex(recstate, columnInt(slot,&item2col));
+			if (index2 < 0) continue;
+			similarity = columnFloat(slot,&simcol);
+
+			row = rowOf[index1];
+			if (row >= 0) {
+				if (fill[row] < model->rowStart[row+1]) {
+					model->colIndex[fill[row]] = index2;
+					model->values[fill[row]++] = similarity;
+				} else
+					complete = false;
+			}
+			row = recstate->modelSymmetric ? -1 : rowOf[index2];
+			if (row >= 0) {
+				if (fill[row] < model->rowStart[row+1]) {
+					model->colIndex[fill[row]] = index1;
+					model->values[fill[row]++] = similarity;
+				} else
+					complete = false;
+			}
+		}
+		recathon_queryEndCached(queryDesc,cplan,recathoncontext);
+		for (i = 0; i < numHot; i++) {
+			if (fill[i] != model->rowStart[i+1])
+				complete = false;
+		}
 
-	queryDesc = recathon_queryStart(querystring,&recathoncontext);
-	planstate = queryDesc->planstate;
+		pfree(DatumGetPointer(paramvalues[0]));
+		pfree(hotIDs);
+		pfree(fill);
+		pfree(ranked);
+		pfree(rowLength);
+		pfree(querystring);
+		pfree(model);
+
+		// Rows that came out differently from their counts, as
+		// under a concurrent rebuild, aren't kept.
+		if (!complete) {
+			recstate->cachePins = list_delete_int(recstate->cachePins, handle);
+			recathonCacheRelease(handle);
+			return;
+		}
+		recathonCacheFinish(handle);
+		elog(DEBUG1, "kept the similarities of %d of %d items in the model cache",
+			numHot, numItems);
+	}
 
-	for (;;) {
-		int userindex, itemindex;
-		int usernum, itemnum;
-		float event;
+	header = (int*) data;
+	model = (GenSparseModel*) palloc0(sizeof(GenSparseModel));
+	model->numRows = header[0];
+	model->numEntries = header[1];
+	model->maxEntries = header[1];
+	model->valueBits = RECATHON_FULL_PRECISION;
+	recstate->hotItemRow = header + 2;
+	model->rowStart = recstate->hotItemRow + numItems;
+	model->colIndex = model->rowStart + model->numRows + 1;
+	model->values = (float*) (model->colIndex + model->numEntries);
+	recstate->hotItemSim = model;
+}
 
-		slot = ExecProcNode(planstate);
-		if (TupIsNull(slot)) break;
+/* ----------------------------------------------------------------
+ *		loadCachedItemSim
+ *
+ *		With a model file or the shared model cache, a built
+ *		item-based recommender reads its whole similarity model
+ *		once into recstate->itemCFmodel, with every pair in both
+ *		items' rows, so that each user is scored by
+ *		applyItemSimGenerate rather than a query per user. The
+ *		rows only ever live in the file or the cache; without
+ *		them, itemCFmodel stays NULL and applyItemSim is used,
+ *		with the popular items' rows from loadHotItemSim if the
+ *		model is too big for the cache.
+ *
+ *		The cached copy holds the number of rows, entries, slots
+ *		for entries, bits per value and longest row, then
+ *		rowStart, the row scales if the values are quantized,
+ *		the values, and the rows' columns, packed, with where
+ *		each row's start. Until they're packed, the plain
+ *		columns go on the end, and what's left over of them
+ *		afterwards is given back to the cache.
+ * ----------------------------------------------------------------
+ */
+void
+loadCachedItemSim(RecScanState *recstate) {
+	AttributeInfo *attributes = (AttributeInfo*) recstate->attributes;
+	GenSparseModel *model;
+	int numRows, numEntries, capacity, numPairs, handle, bits, maxRowLength;
+	int *header, *colIndex;
+	char *data;
+	Size size, packOffset, slack;
 
-		usernum = getTupleInt(slot,userkey);
-		itemnum = getTupleInt(slot,itemkey);
-		event = getTupleFloat(slot,eventval);
-		userindex = binarySearch(userIDs, usernum, 0, numUsers);
-		itemindex = binarySearch(itemIDs, itemnum, 0, numItems);
+	if (recstate->fullTotalItems <= 0)
+		return;
 
-		// We need to find the average offset of a user's event from
-		// the average event.
-		if (userindex >= 0 && userindex < numUsers) {
-			userCounts[userindex] += 1;
-			userAvgs[userindex] += event - itemAvgs[itemindex];
-		}
+	// A model file has the rows ready to use, already ranked.
+	recstate->itemCFmodel = modelFileRows(recstate);
+	if (recstate->itemCFmodel) {
+		recstate->sortedEntries = (int*) modelFileSection(recstate, MODEL_FILE_RANKED, NULL);
+		recstate->rowSorted = NULL;
+		return;
 	}
+	if (recstate->cacheVersion == 0)
+		return;
 
-	recathon_queryEnd(queryDesc,recathoncontext);
+	model = (GenSparseModel*) palloc(sizeof(GenSparseModel));
+	data = cachedModelData(recstate, "similarity", &size);
+	if (!data) {
+		numRows = recstate->fullTotalItems;
+		numPairs = count_rows(attributes->recModelName);
+		if (numPairs < 0 || numPairs > (INT_MAX - 1) / 2) {
+			pfree(model);
+			return;
+		}
+		capacity = Max(recstate->modelSymmetric ? numPairs : 2*numPairs, 1);
+		bits = recstate->modelPrecision;
+
+		packOffset = itemSimLayout(NULL, numRows, capacity, bits, model);
+		slack = MAXALIGN(capacity / RECATHON_PACK_BLOCK + numRows + 1);
+		size = packOffset + slack + (Size) capacity*sizeof(int);
+		data = reserveModelData(recstate, "similarity", size, &handle);
+		if (!data) {
+			pfree(model);
+			if (size > (Size) recathon_cache_size * 1024L)
+				loadHotItemSim(recstate);
+			return;
+		}
 
-	// Now we just divide by the counts.
-	for (i = 0; i < numUsers; i++) {
-		if (userCounts[i] > 0)
-			userAvgs[i] /= userCounts[i];
-		else
-			userAvgs[i] = 0;
+		header = (int*) data;
+		header[0] = numRows;
+		header[2] = capacity;
+		header[3] = bits;
+		itemSimLayout(data, numRows, capacity, bits, model);
+		model->numRows = numRows;
+		model->valueBits = bits;
+		colIndex = (int*) (data + packOffset + slack);
+		if (!fillItemSim(recstate, attributes->recModelName, numRows, capacity, bits,
+				model->rowStart, colIndex, model->rowScale, model->qvalues,
+				&numEntries)) {
+			recstate->cachePins = list_delete_int(recstate->cachePins, handle);
+			recathonCacheRelease(handle);
+			pfree(model);
+			return;
+		}
+		header[1] = numEntries;
+		recathonCacheShrink(handle, packOffset + packItemSim(model, colIndex, &maxRowLength));
+		header[4] = maxRowLength;
+		recathonCacheFinish(handle);
 	}
 
-	// Free up memory.
-	pfree(itemCounts);
-	pfree(itemSums);
-	pfree(itemSqs);
-	pfree(itemVars);
-	pfree(userCounts);
-	pfree(querystring);
-
-	// With that information calculated, we can finally return.
-	(*ret_itemAvgs) = itemAvgs;
-	(*ret_userOffsets) = userAvgs;
+	header = (int*) data;
+	model->numRows = header[0];
+	model->numEntries = header[1];
+	model->maxEntries = header[2];
+	model->valueBits = header[3];
+	model->maxRowLength = header[4];
+	itemSimLayout(data, model->numRows, model->maxEntries, model->valueBits, model);
+	model->rowBuf = (int*) palloc(Max(model->maxRowLength, 1)*sizeof(int));
+	recstate->itemCFmodel = model;
 }
 
 /* ----------------------------------------------------------------
- *		predictRating
+ *		itemFactors
  *
- *		This function gives a rating prediction based on
- *		our SVD models. Used for training only.
+ *		Returns an item's row of the scan's item model. If the
+ *		model is in half precision, the row is widened into buf,
+ *		which has room for numFeatures floats.
  * ----------------------------------------------------------------
  */
-float
-predictRating(int featurenum, int numFeatures, int userid, int itemid,
-		float **userFeatures, float **itemFeatures, float residual) {
+static float*
+itemFactors(RecScanState *recstate, int itemindex, float *buf) {
+	uint16 *halves;
 	int i;
-	float rating;
 
-	rating = residual;
-	for (i = featurenum; i < numFeatures; i++)
-		rating += userFeatures[i][userid] * itemFeatures[i][itemid];
+	if (recstate->SVDitemmodel)
+		return recstate->SVDitemmodel + (Size) itemindex * recstate->numFeatures;
 
-	return rating;
+	halves = recstate->SVDitemHalf + (Size) itemindex * recstate->numFeatures;
+	for (i = 0; i < recstate->numFeatures; i++)
+		buf[i] = halfToFloat(halves[i]);
+	return buf;
 }
 
 /* ----------------------------------------------------------------
- *		SVDtrain
+ *		foldInUser
  *
- *		This function trains features for SVD models.
- *		Returns the number of events used.
+ *		Computes factors on the spot for a user who isn't in
+ *		an SVD or ALS user model yet, by solving their
+ *		ratings against the item model the scan has loaded.
+ *		The result goes in recstate->userFeatures, and isn't
+ *		written anywhere; the maintenance process does that.
+ *		Returns false if none of the user's items are in the
+ *		model.
  * ----------------------------------------------------------------
  */
-int
-SVDtrain(char *userkey, char *itemkey, char *eventtable, char *eventval,
-		char *usermodelname, char *itemmodelname, bool update) {
-	float **userFeatures, **itemFeatures;
-	int *userIDs, *itemIDs;
-	float *itemAvgs, *userOffsets;
-	int numUsers, numItems;
-	int i, j, k, numEvents;
-	int numFeatures = 50;
-	svd_node *allEvents;
-	FILE *fp;
-	char *tempfilename, *insertstring;
-	// Information for other queries.
+static bool
+foldInUser(RecScanState *recstate, int userID) {
+	int p, q, numRated, numFeatures;
+	double *A, *x;
+	float *buf;
+	bool solved;
+	AttributeInfo *attributes = (AttributeInfo*) recstate->attributes;
+	// Query objects.
 	char *querystring;
 	QueryDesc *queryDesc;
 	PlanState *planstate;
 	TupleTableSlot *slot;
+	CachedPlan *cplan;
 	MemoryContext recathoncontext;
+	tuple_column itemcol, eventcol;
+	recathon_probe *probe;
+	Oid paramtypes[1] = {INT4OID};
+	Datum paramvalues[1];
+
+	numFeatures = recstate->numFeatures;
+	if ((!recstate->SVDitemmodel && !recstate->SVDitemHalf) || numFeatures <= 0)
+		return false;
+
+	A = (double*) palloc0((Size) numFeatures * numFeatures * sizeof(double));
+	x = (double*) palloc0(numFeatures*sizeof(double));
+	buf = (float*) palloc(numFeatures*sizeof(float));
+
+	// Build the same normal equations as an ALS half step, from
+	// the user's ratings.
+	querystring = NULL;
+	planstate = NULL;
+	probe = scanProbe(recstate, attributes->eventtable, attributes->userkey);
+	if (probe)
+		probeStart(probe, userID);
+	else {
+		querystring = (char*) palloc(1024*sizeof(char));
+		sprintf(querystring,"select %s, %s from %s where %s = $1;",
+			attributes->itemkey,attributes->eventval,
+			attributes->eventtable,attributes->userkey);
+		paramvalues[0] = Int32GetDatum(userID);
+		queryDesc = recathon_queryStartCached(querystring,1,paramtypes,paramvalues,
+			&cplan,&recathoncontext);
+		planstate = queryDesc->planstate;
+	}
+	bindColumn(&itemcol, attributes->itemkey);
+	bindColumn(&eventcol, attributes->eventval);
 
-	// If this is us updating a cell as opposed to building
-	// a recommender, we need to drop the existing entries.
-	if (update) {
-		char *dropstring;
+	numRated = 0;
+	for (;;) {
+		int itemindex;
+		float rating, *vec;
 
-		dropstring = (char*) palloc(256*sizeof(char));
-		sprintf(dropstring,"DELETE FROM %s;",usermodelname);
-		recathon_queryExecute(dropstring);
-		sprintf(dropstring,"DELETE FROM %s;",itemmodelname);
-		recathon_queryExecute(dropstring);
-		pfree(dropstring);
-	}
+		slot = probe ? probeNext(probe) : ExecProcNode(planstate);
+		if (TupIsNull(slot)) break;
 
-	// First, we get our lists of users and items.
-	SVDlists(userkey,itemkey,eventtable,
-		&userIDs, &itemIDs, &numUsers, &numItems);
+		itemindex = itemIndex(recstate, columnInt(slot,&itemcol));
+		if (itemindex < 0)
+			continue;
+		rating = columnFloat(slot,&eventcol);
+		vec = itemFactors(recstate, itemindex, buf);
 
-	// Then we get information for baseline averages.
-	SVDaverages(userkey,itemkey,eventtable,eventval,
-		userIDs,itemIDs,numUsers,numItems,
-		&itemAvgs,&userOffsets);
+		for (p = 0; p < numFeatures; p++) {
+			x[p] += rating * vec[p];
+			for (q = 0; q <= p; q++)
+				A[p*numFeatures+q] += vec[p] * vec[q];
+		}
+		numRated++;
+	}
 
-	// Initialize our feature arrays.
-	userFeatures = (float**) palloc(numFeatures*sizeof(float*));
-	for (i = 0; i < numFeatures; i++) {
-		userFeatures[i] = (float*) palloc(numUsers*sizeof(float));
-		for (j = 0; j < numUsers; j++)
-			userFeatures[i][j] = 0.1;
+	if (!probe) {
+		recathon_queryEndCached(queryDesc,cplan,recathoncontext);
+		pfree(querystring);
 	}
-	itemFeatures = (float**) palloc(numFeatures*sizeof(float*));
-	for (i = 0; i < numFeatures; i++) {
-		itemFeatures[i] = (float*) palloc(numItems*sizeof(float));
-		for (j = 0; j < numItems; j++)
-			itemFeatures[i][j] = 0.1;
+
+	solved = false;
+	if (numRated > 0) {
+		for (p = 0; p < numFeatures; p++)
+			A[p*numFeatures+p] += RECATHON_FOLDIN_PENALTY * numRated;
+
+		solved = choleskySolve(A, x, numFeatures);
+		if (solved) {
+			for (p = 0; p < numFeatures; p++)
+				recstate->userFeatures[p] = (float) x[p];
+		}
 	}
 
-	// First we need to count the number of events we'll be
-	// considering.
-	querystring = (char*) palloc(1024*sizeof(char));
-	numEvents = count_rows(eventtable);
+	pfree(A);
+	pfree(x);
+	pfree(buf);
+
+	return solved;
+}
+
+/* ----------------------------------------------------------------
+ *		loadItemClusters
+ *
+ *		Reads the approximate top-k index of an SVD or ALS
+ *		recommender, once the item model has been loaded.
+ *		We keep the items of each cluster, as indexes into
+ *		fullItemList, and each cluster's centroid, which is
+ *		the mean of its items' factors. Items that aren't in
+ *		the index are newer than the item model, and would
+ *		score zero anyway, so they're left out.
+ * ----------------------------------------------------------------
+ */
+void
+loadItemClusters(RecScanState *recstate, char *clustername) {
+	int i, c, numClusters, numFeatures;
+	int *assign, *fill;
+	float *buf;
+	// Query objects.
+	char *querystring;
+	QueryDesc *queryDesc;
+	PlanState *planstate;
+	TupleTableSlot *slot;
+	MemoryContext recathoncontext;
+	tuple_column itemscol, clustercol;
 
-	// Initialize the events array.
-	allEvents = (svd_node*) palloc(numEvents*sizeof(svd_node));
+	numFeatures = recstate->numFeatures;
+	if ((!recstate->SVDitemmodel && !recstate->SVDitemHalf) || numFeatures <= 0)
+		return;
 
-	sprintf(querystring,"SELECT r.%s,r.%s,r.%s FROM %s r ORDER BY r.%s;",
-		userkey,itemkey,eventval,eventtable,userkey);
+	assign = (int*) palloc(recstate->fullTotalItems*sizeof(int));
+	for (i = 0; i < recstate->fullTotalItems; i++)
+		assign[i] = -1;
 
-	// Let's acquire all of our events and store them. Sorting initially by
-	// user ID avoids unnecessary binary searches.
+	querystring = (char*) palloc(1024*sizeof(char));
+	sprintf(querystring,"select items, cluster from %s;",clustername);
 	queryDesc = recathon_queryStart(querystring,&recathoncontext);
 	planstate = queryDesc->planstate;
+	bindColumn(&itemscol, "items");
+	bindColumn(&clustercol, "cluster");
 
-	i = 0;
+	numClusters = 0;
 	for (;;) {
-		svd_node new_svd;
+		int index, cluster;
 
 		slot = ExecProcNode(planstate);
 		if (TupIsNull(slot)) break;
 
-		new_svd = createSVDnode(slot, userkey, itemkey, eventval, userIDs, itemIDs, numUsers, numItems);
-
-		allEvents[i] = new_svd;
-
-		i++;
-		if (i >= numEvents) break;
+		index = itemIndex(recstate, columnInt(slot,&itemscol));
+		cluster = columnInt(slot,&clustercol);
+		if (index < 0 || cluster < 0)
+			continue;
+		assign[index] = cluster;
+		if (cluster >= numClusters)
+			numClusters = cluster + 1;
 	}
 
 	recathon_queryEnd(queryDesc,recathoncontext);
+	pfree(querystring);
 
-	// We now have all of the events, so we can start training our features.
-	for (j = 0; j < 100; j++) {
-		for (i = 0; i < numFeatures; i++) {
-			float learn = 0.001;
-			float penalty = 0.002;
-			float *userVal = userFeatures[i];
-			float *itemVal = itemFeatures[i];
+	if (numClusters == 0) {
+		pfree(assign);
+		return;
+	}
 
-			for (k = 0; k < numEvents; k++) {
-				int userid;
-				int itemid;
-				float event, err, residual, temp;
-				svd_node current_svd;
+	// Group the items by cluster, in compressed sparse row form,
+	// and sum their factors into the centroids.
+	recstate->numClusters = numClusters;
+	recstate->clusterStart = (int*) palloc0((numClusters+1)*sizeof(int));
+	recstate->clusterItems = (int*) palloc(Max(recstate->fullTotalItems, 1)*sizeof(int));
+	recstate->clusterCentroids = (float*) palloc0((Size) numClusters * numFeatures * sizeof(float));
+	for (i = 0; i < recstate->fullTotalItems; i++) {
+		if (assign[i] >= 0)
+			recstate->clusterStart[assign[i]+1]++;
+	}
+	for (c = 0; c < numClusters; c++)
+		recstate->clusterStart[c+1] += recstate->clusterStart[c];
+
+	fill = (int*) palloc(numClusters*sizeof(int));
+	buf = (float*) palloc(numFeatures*sizeof(float));
+	for (c = 0; c < numClusters; c++)
+		fill[c] = recstate->clusterStart[c];
+	for (i = 0; i < recstate->fullTotalItems; i++) {
+		c = assign[i];
+		if (c < 0)
+			continue;
+		recstate->clusterItems[fill[c]++] = i;
+		factorAxpy(1.0, itemFactors(recstate, i, buf),
+			recstate->clusterCentroids + (Size) c * numFeatures, numFeatures);
+	}
+	for (c = 0; c < numClusters; c++) {
+		int count = recstate->clusterStart[c+1] - recstate->clusterStart[c];
+		float *cvec = recstate->clusterCentroids + (Size) c * numFeatures;
 
-				current_svd = allEvents[k];
-				userid = current_svd->userid;
-				itemid = current_svd->itemid;
-				event = current_svd->event;
-				// Need to reset residuals for each new
-				// iteration of the trainer.
-				if (i == 0)
-					current_svd->residual = 0;
-				residual = current_svd->residual;
+		if (count > 0) {
+			for (i = 0; i < numFeatures; i++)
+				cvec[i] /= count;
+		}
+	}
 
-				if (i == 0 && j == 0) {
-					err = event - (itemAvgs[itemid] + userOffsets[userid]);
-				} else {
-					err = event - predictRating(i, numFeatures, userid, itemid,
-							userFeatures, itemFeatures, residual);
-				}
-				temp = userVal[userid];
-				userVal[userid] += learn * ((err * itemVal[itemid]) - (penalty * userVal[userid]));
-				itemVal[itemid] += learn * ((err * temp) - (penalty * itemVal[itemid]));
+	recstate->itemCandidates = (int*) palloc(Max(recstate->fullTotalItems, 1)*sizeof(int));
+	recstate->numCandidates = 0;
 
-				// Store residuals.
-				if (i == 0)
-					current_svd->residual = userVal[userid] * itemVal[itemid];
-				else
-					current_svd->residual += userVal[userid] * itemVal[itemid];
-			}
+	pfree(buf);
+	pfree(fill);
+	pfree(assign);
+}
 
-			CHECK_FOR_INTERRUPTS();
-		}
+/* A cluster and how well its centroid scores for the current user. */
+typedef struct cluster_score {
+	int		cluster;
+	float		score;
+} cluster_score;
+
+/* Comparison function for sorting clusters by descending score. */
+static int
+clusterScoreCompare(const void *a, const void *b) {
+	float score1 = ((const cluster_score*) a)->score;
+	float score2 = ((const cluster_score*) b)->score;
+
+	if (score1 > score2) return -1;
+	if (score1 < score2) return 1;
+	return 0;
+}
+
+/* ----------------------------------------------------------------
+ *		probeItemClusters
+ *
+ *		Picks the items to score for the current user, from
+ *		the clusters whose centroids score highest against
+ *		the user's factors. We take at least a fixed share
+ *		of the clusters, and keep going until we have a
+ *		minimum number of candidates. The candidates are put
+ *		back in fullItemList order.
+ * ----------------------------------------------------------------
+ */
+static void
+probeItemClusters(RecScanState *recstate) {
+	int c, e, numProbes, numClusters;
+	cluster_score *scores;
+
+	numClusters = recstate->numClusters;
+	scores = (cluster_score*) palloc(numClusters*sizeof(cluster_score));
+	for (c = 0; c < numClusters; c++) {
+		scores[c].cluster = c;
+		scores[c].score = factorDot(recstate->userFeatures,
+			recstate->clusterCentroids + (Size) c * recstate->numFeatures,
+			recstate->numFeatures);
 	}
+	qsort(scores, numClusters, sizeof(cluster_score), clusterScoreCompare);
 
-	// With the training finished, we need to write out the data to file,
-	// so we can put it back. First, the user model.
-	tempfilename = (char*) palloc(256*sizeof(char));
-	sprintf(tempfilename,"recathon_temp_%s.dat",usermodelname);
-	if ((fp = fopen(tempfilename,"w")) == NULL)
-		ereport(ERROR,
-			(errcode(ERRCODE_SYNTAX_ERROR),
-			 errmsg("failed to open temporary file")));
-	insertstring = (char*) palloc(128*sizeof(char));
+	numProbes = (int) ceil(numClusters * RECATHON_ANN_PROBE_FRACTION);
+	recstate->numCandidates = 0;
+	for (c = 0; c < numClusters; c++) {
+		int cluster = scores[c].cluster;
 
-	for (i = 0; i < numFeatures; i++) {
-		for (j = 0; j < numUsers; j++) {
-			sprintf(insertstring,"%d;%d;%f\n",userIDs[j],i,userFeatures[i][j]);
-			fwrite(insertstring,1,strlen(insertstring),fp);
-		}
+		if (c >= numProbes && recstate->numCandidates >= RECATHON_ANN_MIN_CANDIDATES)
+			break;
+		for (e = recstate->clusterStart[cluster]; e < recstate->clusterStart[cluster+1]; e++)
+			recstate->itemCandidates[recstate->numCandidates++] = recstate->clusterItems[e];
 	}
-	fclose(fp);
+	qsort(recstate->itemCandidates, recstate->numCandidates, sizeof(int), intCompare);
 
-	// If we are updating an existing SVD model,
-	// we will want to drop the existing primary key
-	// constraint before doing the copy, to save time.
-	if (update) {
-		insertstring = (char*) palloc(1024*sizeof(char));
-		sprintf(insertstring,"ALTER TABLE %s DROP CONSTRAINT %s_pkey;",
-					usermodelname,usermodelname);
-		recathon_utilityExecute(insertstring);
-		pfree(insertstring);
+	pfree(scores);
+}
+
+/* Comparison function for sorting entries by key. */
+static int
+thresholdKeyCompare(const void *a, const void *b) {
+	return ((const threshold_entry*) a)->key - ((const threshold_entry*) b)->key;
+}
+
+/* The prediction an item's pending score and similarity sum make,
+ * as itemCFpredict or itemJaccardScore would give it. */
+static float
+thresholdPrediction(RecScanState *recstate, int itemindex) {
+	AttributeInfo *attributes = (AttributeInfo*) recstate->attributes;
+
+	if (attributes->method == itemJaccardCF)
+		return recstate->pendingSim[itemindex];
+	if (recstate->pendingSim[itemindex] == 0)
+		return 0;
+	return recstate->pendingScore[itemindex] / recstate->pendingSim[itemindex];
+}
+
+/* ----------------------------------------------------------------
+ *		thresholdItemScore
+ *
+ *		Works out an item's prediction for the current user
+ *		from its own row of the item model, leaving its score
+ *		and similarity sum in pendingScore and pendingSim. The
+ *		rated items' contributions are added up in ratedItems
+ *		order, the same as applyItemSimGenerate does, so the
+ *		prediction comes out exactly the same. buf must have
+ *		room for totalRatings entries. Returns the prediction.
+ * ----------------------------------------------------------------
+ */
+static float
+thresholdItemScore(RecScanState *recstate, int itemindex, threshold_entry *buf) {
+	GenSparseModel *model = recstate->itemCFmodel;
+	int j, numFound, *cols;
+	float score, totalSim;
+
+	numFound = 0;
+	cols = sparseRowColumns(model, itemindex, NULL);
+	for (j = model->rowStart[itemindex]; j < model->rowStart[itemindex+1]; j++) {
+		int ratedindex = cols[j - model->rowStart[itemindex]];
+
+		if (!recstate->isRated[ratedindex])
+			continue;
+		buf[numFound].key = recstate->ratedOrder[ratedindex];
+		buf[numFound++].value = model->values[j];
 	}
+	if (numFound > 1)
+		qsort(buf, numFound, sizeof(threshold_entry), thresholdKeyCompare);
 
-	// We can bulk load the data with COPY FROM. It's faster
-	// than individual inserts by a good margin.
-	sprintf(querystring,"COPY %s FROM '%s' DELIMITERS ';';",
-		usermodelname,tempfilename);
-	recathon_utilityExecute(querystring);
+	score = 0.0;
+	totalSim = 0.0;
+	for (j = 0; j < numFound; j++) {
+		float similarity = buf[j].value;
 
-	// Adding a primary key after the COPY FROM is about 25% faster
-	// than adding it before.
-	sprintf(querystring,"ALTER TABLE %s ADD PRIMARY KEY (users, feature);",usermodelname);
-	recathon_utilityExecute(querystring);
+		score += similarity*recstate->ratedScore[recstate->ratedItems[buf[j].key]];
+		if (similarity < 0)
+			similarity *= -1;
+		totalSim += similarity;
+	}
+	recstate->pendingScore[itemindex] = score;
+	recstate->pendingSim[itemindex] = totalSim;
 
-	// Delete the temporary file.
-	if (unlink(tempfilename) < 0)
-		ereport(WARNING,
-			(errcode(ERRCODE_WARNING),
-			 errmsg("failed to delete temporary file")));
+	return thresholdPrediction(recstate, itemindex);
+}
 
-	// Now do it again for the item model.
-	tempfilename = (char*) palloc(256*sizeof(char));
-	sprintf(tempfilename,"recathon_temp_%s.dat",itemmodelname);
-	if ((fp = fopen(tempfilename,"w")) == NULL)
-		ereport(ERROR,
-			(errcode(ERRCODE_SYNTAX_ERROR),
-			 errmsg("failed to open temporary file")));
+/* ----------------------------------------------------------------
+ *		thresholdItemCandidates
+ *
+ *		For a query that only wants the best few items from
+ *		a built item-based recommender, looks for them by
+ *		working through the rated items' neighbors, in the
+ *		manner of Fagin's threshold algorithm, rather than
+ *		adding every neighbor into every item's score. Each
+ *		item we come across gets its prediction worked out in
+ *		full, from its own row, and we stop as soon as the
+ *		k-th best of those beats anything the items we haven't
+ *		come across could get.
+ *
+ *		A Jaccard score is a sum of similarities, so we go
+ *		down all of the rated items' neighbors at once, most
+ *		similar first, and the best an unseen item could get
+ *		is the sum of the similarities we're up to. The other
+ *		methods average the ratings, so an unseen item can do
+ *		no better than the largest rating, in magnitude, of
+ *		the rated items whose neighbors we haven't been
+ *		through yet. We go through those a whole rated item at
+ *		a time, largest rating first.
+ *
+ *		If we find the best items, they and anything tied with
+ *		them become the candidates to score, and we return
+ *		true. If we run out of neighbors first, or it's costing
+ *		more than adding everything in would, we return false,
+ *		having left the scores as we found them.
+ * ----------------------------------------------------------------
+ */
+static bool
+thresholdItemCandidates(RecScanState *recstate) {
+	GenSparseModel *model = recstate->itemCFmodel;
+	AttributeInfo *attributes = (AttributeInfo*) recstate->attributes;
+	int i, j, k, numItems, numRatings, numSeen, done;
+	int *next, *cols, *outer;
+	double work, budget;
+	float bound;
+	bool jaccard, found, skipRated;
+	threshold_entry *lists, *buf;
+	nbr_heap best;
+
+	// Items the query leaves out can't be among the best.
+	numItems = recstate->fullTotalItems;
+	numRatings = recstate->totalRatings;
+	skipRated = recstate->excludeRated;
+	k = recstate->topK;
+	if (!model || model->valueBits != RECATHON_FULL_PRECISION ||
+	    model->numRows != numItems ||
+	    k >= (skipRated ? numItems - numRatings : numItems))
+		return false;
+	jaccard = (attributes->method == itemJaccardCF);
+
+	// The per-item arrays last for the whole scan, so they don't
+	// go in the user's context.
+	if (!recstate->thresholdItems) {
+		recstate->ratedOrder = (int*) MemoryContextAlloc(recstate->recContext,
+			numItems*sizeof(int));
+		recstate->isSeen = (bool*) MemoryContextAllocZero(recstate->recContext,
+			numItems*sizeof(bool));
+		recstate->thresholdItems = (int*) MemoryContextAlloc(recstate->recContext,
+			numItems*sizeof(int));
+	}
+	if (jaccard && !recstate->sortedEntries) {
+		recstate->sortedEntries = (int*) MemoryContextAlloc(recstate->recContext,
+			Max(model->numEntries, 1)*sizeof(int));
+		recstate->rowSorted = (bool*) MemoryContextAllocZero(recstate->recContext,
+			numItems*sizeof(bool));
+	}
 
-	for (i = 0; i < numFeatures; i++) {
-		for (j = 0; j < numItems; j++) {
-			char insertstring[128];
-			sprintf(insertstring,"%d;%d;%f\n",itemIDs[j],i,itemFeatures[i][j]);
-			fwrite(insertstring,1,strlen(insertstring),fp);
-		}
+	// Adding everything in costs one step per neighbor, and then
+	// there's every item to score.
+	budget = numItems;
+	for (i = 0; i < numRatings; i++) {
+		int itemindex = recstate->ratedItems[i];
+
+		recstate->ratedOrder[itemindex] = i;
+		budget += model->rowStart[itemindex+1] - model->rowStart[itemindex];
 	}
-	fclose(fp);
 
-	// If we are updating an existing SVD model,
-	// we will want to drop the existing primary key
-	// constraint before doing the copy, to save time.
-	if (update) {
-		insertstring = (char*) palloc(1024*sizeof(char));
-		sprintf(insertstring,"ALTER TABLE %s DROP CONSTRAINT %s_pkey;",
-					itemmodelname,itemmodelname);
-		recathon_utilityExecute(insertstring);
-		pfree(insertstring);
+	// Each rated item's neighbors are a list, which a Jaccard
+	// model reads most similar first.
+	lists = (threshold_entry*) palloc(numRatings*sizeof(threshold_entry));
+	buf = (threshold_entry*) palloc(numRatings*sizeof(threshold_entry));
+	next = (int*) palloc(numRatings*sizeof(int));
+	for (i = 0; i < numRatings; i++) {
+		int itemindex = recstate->ratedItems[i];
+
+		lists[i].key = itemindex;
+		lists[i].value = fabsf(recstate->ratedScore[itemindex]);
+		next[i] = model->rowStart[itemindex];
+		if (jaccard && recstate->rowSorted && !recstate->rowSorted[itemindex]) {
+			int start = model->rowStart[itemindex];
+			int length = model->rowStart[itemindex+1] - start;
+			threshold_entry *row;
+
+			row = (threshold_entry*) palloc(Max(length, 1)*sizeof(threshold_entry));
+			for (j = 0; j < length; j++) {
+				row[j].key = start + j;
+				row[j].value = model->values[start + j];
+			}
+			qsort(row, length, sizeof(threshold_entry), thresholdValueCompare);
+			for (j = 0; j < length; j++)
+				recstate->sortedEntries[start + j] = row[j].key;
+			pfree(row);
+			recstate->rowSorted[itemindex] = true;
+		}
 	}
+	// The others go through the largest ratings first. A Jaccard
+	// model's lists stay in ratedItems order, so next lines up.
+	if (!jaccard)
+		qsort(lists, numRatings, sizeof(threshold_entry), thresholdValueCompare);
+
+	// A packed row being gone through needs room of its own, since
+	// scoring its neighbors unpacks theirs.
+	outer = model->colIndex ? NULL :
+		(int*) palloc(Max(model->maxRowLength, 1)*sizeof(int));
+
+	best = nbrHeapCreate(k);
+	numSeen = 0;
+	work = 0;
+	found = false;
+	done = 0;
+	while (!found && work <= budget) {
+		CHECK_FOR_INTERRUPTS();
 
-	// We can bulk load the data with COPY FROM. It's faster
-	// than individual inserts by a good margin.
-	sprintf(querystring,"COPY %s FROM '%s' DELIMITERS ';';",
-		itemmodelname,tempfilename);
-	recathon_utilityExecute(querystring);
+		if (jaccard) {
+			// One more neighbor from every list, then the bound is
+			// what the next ones down add up to.
+			bool any = false;
 
-	// Adding a primary key after the COPY FROM is about 25% faster
-	// than adding it before.
-	sprintf(querystring,"ALTER TABLE %s ADD PRIMARY KEY (items, feature);",itemmodelname);
-	recathon_utilityExecute(querystring);
+			bound = 0.0;
+			for (i = 0; i < numRatings; i++) {
+				int itemindex = lists[i].key;
+				int end = model->rowStart[itemindex+1];
+				int seen;
 
-	// Delete the temporary file.
-	if (unlink(tempfilename) < 0)
-		ereport(WARNING,
-			(errcode(ERRCODE_WARNING),
-			 errmsg("failed to delete temporary file")));
+				if (next[i] >= end)
+					continue;
+				j = recstate->sortedEntries[next[i]++];
+				any = true;
+				work++;
+				seen = sparseColumn(model, itemindex, j);
+				if (!recstate->isSeen[seen]) {
+					recstate->isSeen[seen] = true;
+					recstate->thresholdItems[numSeen++] = seen;
+					if (!skipRated || !recstate->isRated[seen])
+						nbrHeapInsert(best, seen, thresholdItemScore(recstate, seen, buf));
+					work += model->rowStart[seen+1] - model->rowStart[seen];
+				}
+				if (next[i] < end)
+					bound += model->values[recstate->sortedEntries[next[i]]];
+			}
+			if (!any)
+				break;
+		} else {
+			// The whole of the next list, after which no unseen item
+			// can beat the largest rating left.
+			int itemindex;
+
+			if (done >= numRatings)
+				break;
+			itemindex = lists[done++].key;
+			cols = sparseRowColumns(model, itemindex, outer);
+			for (j = model->rowStart[itemindex]; j < model->rowStart[itemindex+1]; j++) {
+				int seen = cols[j - model->rowStart[itemindex]];
+
+				work++;
+				if (recstate->isSeen[seen])
+					continue;
+				recstate->isSeen[seen] = true;
+				recstate->thresholdItems[numSeen++] = seen;
+				if (!skipRated || !recstate->isRated[seen])
+					nbrHeapInsert(best, seen, thresholdItemScore(recstate, seen, buf));
+				work += model->rowStart[seen+1] - model->rowStart[seen];
+			}
+			bound = (done < numRatings) ? lists[done].value : 0.0;
+		}
 
-	// Free up memory.
-	pfree(querystring);
-	pfree(userIDs);
-	pfree(itemIDs);
-	pfree(itemAvgs);
-	pfree(userOffsets);
-	pfree(allEvents);
+		// An item nobody rated anything like scores zero, so the
+		// bound is never below that.
+		if (best->size == k && best->similarity[0] > Max(bound, 0.0))
+			found = true;
+	}
 
-	for (i = 0; i < numFeatures; i++)
-		pfree(userFeatures[i]);
-	pfree(userFeatures);
-	for (i = 0; i < numFeatures; i++)
-		pfree(itemFeatures[i]);
-	pfree(itemFeatures);
+	// Whatever we found, the seen marks come off for the next user.
+	// If we found the best, they and their ties are the ones to
+	// score; if not, adding everything in starts from zero.
+	recstate->numCandidates = 0;
+	for (i = 0; i < numSeen; i++) {
+		int itemindex = recstate->thresholdItems[i];
+
+		recstate->isSeen[itemindex] = false;
+		if (!found) {
+			recstate->pendingScore[itemindex] = 0.0;
+			recstate->pendingSim[itemindex] = 0.0;
+		} else if ((!skipRated || !recstate->isRated[itemindex]) &&
+			   thresholdPrediction(recstate, itemindex) >= best->similarity[0])
+			recstate->thresholdItems[recstate->numCandidates++] = itemindex;
+	}
+	if (found) {
+		qsort(recstate->thresholdItems, recstate->numCandidates, sizeof(int), intCompare);
+		recstate->itemCandidates = recstate->thresholdItems;
+	}
 
-	// Return the number of events we used.
-	return numEvents;
+	nbrHeapFree(best);
+	if (outer)
+		pfree(outer);
+	pfree(lists);
+	pfree(buf);
+	pfree(next);
+	return found;
 }
 
 /* ----------------------------------------------------------------
- *		generateItemCosModel
+ *		itemAttributeList
  *
- *		Create an item-based cosine model on the fly.
+ *		Reads a recommender's item_attributes, a list of
+ *		table.column names separated by commas, into the
+ *		OIDs of the tables and the numbers of the columns.
+ *		When validating, anything that isn't a column of a
+ *		plain table is an error; otherwise, as for a table
+ *		dropped since, it's left out.
  * ----------------------------------------------------------------
  */
-void
-generateItemCosModel(RecScanState *recnode) {
-	int i, j, priorID;
-	AttributeInfo *attributes;
-	float **itemmodel;
-	char *eventtable, *userkey, *itemkey, *eventval;
-	int numItems;
-	int *itemIDs;
-	float *itemLengths;
-	sim_node *itemEvents;
-	// Information for other queries.
-	char *querystring;
-	QueryDesc *simqueryDesc;
-	PlanState *simplanstate;
-	TupleTableSlot *simslot;
-	MemoryContext simcontext;
-
-	attributes = (AttributeInfo*) recnode->attributes;
-	eventtable = attributes->eventtable;
-	userkey = attributes->userkey;
-	itemkey = attributes->itemkey;
-	eventval = attributes->eventval;
-
-	/* We start by getting vector lengths. */
-	itemLengths = vector_lengths(itemkey,eventtable,eventval,&numItems,&itemIDs);
-
-	/* We have the number of items, so we can initialize our model. */
-	itemmodel = (float**) palloc(numItems*sizeof(float*));
-	for (i = 0; i < numItems; i++)
-		itemmodel[i] = (float*) palloc0(numItems*sizeof(float));
-
-	/* Then we can calculate similarity values for our model. We start by
-	 * storing all the ratings. */
-	itemEvents = (sim_node*) palloc(numItems*sizeof(sim_node));
-	for (i = 0; i < numItems; i++)
-		itemEvents[i] = NULL;
+static void
+itemAttributeList(char *spec, bool validate, List **ret_relids, List **ret_attnos) {
+	char *copy, *item, *next;
+	List *relids = NIL, *attnos = NIL;
+
+	copy = pstrdup(spec);
+	for (item = copy; item; item = next) {
+		List *names;
+		char *colname;
+		Oid relid;
+		AttrNumber attno;
+
+		next = strchr(item, ',');
+		if (next)
+			*next++ = '\0';
+
+		names = stringToQualifiedNameList(item);
+		if (list_length(names) < 2) {
+			if (validate)
+				ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("item attribute \"%s\" is not of the form table.column",
+						item)));
+			continue;
+		}
+		colname = strVal(llast(names));
+		names = list_truncate(list_copy(names), list_length(names) - 1);
 
-	/* With the model created, we need to populate it, which means calculating
-	 * similarity between all item pairs. We need to query the events table
-	 * in order to get the key information. We'll also keep track of the number
-	 * of events used, since we need to store that information. */
-	querystring = (char*) palloc(1024*sizeof(char));
-	sprintf(querystring,"SELECT r.%s,r.%s,r.%s FROM %s r ORDER BY r.%s;",
-		userkey,itemkey,eventval,eventtable,itemkey);
+		relid = RangeVarGetRelid(makeRangeVarFromNameList(names), NoLock, !validate);
+		if (!OidIsValid(relid))
+			continue;
+		if (get_rel_relkind(relid) != RELKIND_RELATION) {
+			if (validate)
+				ereport(ERROR,
+					(errcode(ERRCODE_WRONG_OBJECT_TYPE),
+					 errmsg("item attribute \"%s\" is not a column of a table",
+						item)));
+			continue;
+		}
+		attno = get_attnum(relid, colname);
+		if (attno <= 0) {
+			if (validate)
+				ereport(ERROR,
+					(errcode(ERRCODE_UNDEFINED_COLUMN),
+					 errmsg("column \"%s\" of relation \"%s\" does not exist",
+						colname, get_rel_name(relid))));
+			continue;
+		}
 
-	/* Begin extracting data. */
-	priorID = -1;
-	simqueryDesc = recathon_queryStart(querystring, &simcontext);
-	simplanstate = simqueryDesc->planstate;
-	i = -1;
+		relids = lappend_oid(relids, relid);
+		attnos = lappend_int(attnos, attno);
+	}
+	pfree(copy);
 
-	for (;;) {
-		int simuser, simitem;
-		float simevent;
-		sim_node newnode;
+	(*ret_relids) = relids;
+	(*ret_attnos) = attnos;
+}
 
-		/* Shut the compiler up. */
-		simuser = 0; simitem = 0; simevent = 0.0;
+/* ----------------------------------------------------------------
+ *		attributeValueHash
+ *
+ *		Hashes the bytes of an attribute value, for grouping
+ *		the items of an attribute by value.
+ * ----------------------------------------------------------------
+ */
+static uint32
+attributeValueHash(const void *key, Size keysize) {
+	const RecathonValueKey *vkey = (const RecathonValueKey*) key;
 
-		simslot = ExecProcNode(simplanstate);
-		if (TupIsNull(simslot)) break;
+	return DatumGetUInt32(hash_any((const unsigned char *) vkey->data, vkey->len));
+}
 
-		simuser = getTupleInt(simslot,userkey);
-		simitem = getTupleInt(simslot,itemkey);
-		simevent = getTupleFloat(simslot,eventval);
+static int
+attributeValueMatch(const void *key1, const void *key2, Size keysize) {
+	const RecathonValueKey *vkey1 = (const RecathonValueKey*) key1;
+	const RecathonValueKey *vkey2 = (const RecathonValueKey*) key2;
 
-		/* Are we dealing with a new item ID? If so, switch to the next slot. */
-		if (simitem != priorID) {
-			priorID = simitem;
-			i++;
-		}
+	if (vkey1->len != vkey2->len)
+		return 1;
+	return memcmp(vkey1->data, vkey2->data, vkey1->len);
+}
 
-		/* We now have the user, item, and event for this tuple.
-		 * We insert the results as a sim_node into the
-		 * itemEvents table; we'll do calculations later. */
-		newnode = createSimNode(simuser, simevent);
-		itemEvents[i] = simInsert(itemEvents[i], newnode);
+/* ----------------------------------------------------------------
+ *		attributeValueBytes
+ *
+ *		Points a key at the bytes of a value, which has to
+ *		stay where it is for as long as the key is used.
+ * ----------------------------------------------------------------
+ */
+static void
+attributeValueBytes(Datum *value, int16 typlen, bool typbyval, RecathonValueKey *key) {
+	if (typbyval) {
+		key->data = (const char *) value;
+		key->len = sizeof(Datum);
+	} else if (typlen > 0) {
+		key->data = DatumGetPointer(*value);
+		key->len = typlen;
+	} else if (typlen == -1) {
+		key->data = VARDATA_ANY(DatumGetPointer(*value));
+		key->len = VARSIZE_ANY_EXHDR(DatumGetPointer(*value));
+	} else {
+		key->data = DatumGetCString(*value);
+		key->len = strlen(key->data);
 	}
+}
 
-	/* Query cleanup. */
-	recathon_queryEnd(simqueryDesc, simcontext);
+/* ----------------------------------------------------------------
+ *		loadItemAttribute
+ *
+ *		Reads a column of an items table, and groups the items
+ *		the recommender knows by their value of it. An item
+ *		that's in the table more than once goes with each of
+ *		its values. Returns what we read, kept for the session.
+ * ----------------------------------------------------------------
+ */
+static RecathonItemAttribute *
+loadItemAttribute(RecScanState *recstate, Oid relid, AttrNumber attno,
+		AttrNumber keyattno, Oid atttypid) {
+	int i, numRows, maxRows, maxValues;
+	int *rowValues, *rowItems, *fill;
+	int16 typlen;
+	bool typbyval;
+	RecathonItemAttribute *attr;
+	MemoryContext attrcontext, oldcontext;
+	HTAB *valueHash;
+	HASHCTL ctl;
+	int nullValue = -1;
+	// Query objects.
+	StringInfoData querystring;
+	QueryDesc *queryDesc;
+	TupleTableSlot *slot;
+	MemoryContext recathoncontext;
 
-	/* Now we do the similarity calculations. Note that we
-	 * don't include duplicate entries, to save time and space.
-	 * The first item ALWAYS has a lower value than the second. */
-	for (i = 0; i < numItems; i++) {
-		float length_i;
-		sim_node item_i;
+	AttributeInfo *attributes = (AttributeInfo*) recstate->attributes;
 
-		item_i = itemEvents[i];
-		if (!item_i) continue;
-		length_i = itemLengths[i];
+	if (!recathon_attribute_context)
+		recathon_attribute_context = AllocSetContextCreate(TopMemoryContext,
+			"Recathon item attributes",
+			ALLOCSET_SMALL_MINSIZE,
+			ALLOCSET_SMALL_INITSIZE,
+			ALLOCSET_DEFAULT_MAXSIZE);
+	attrcontext = AllocSetContextCreate(recathon_attribute_context,
+		"Recathon item attribute",
+		ALLOCSET_DEFAULT_MINSIZE,
+		ALLOCSET_DEFAULT_INITSIZE,
+		ALLOCSET_DEFAULT_MAXSIZE);
+
+	attr = (RecathonItemAttribute*) MemoryContextAllocZero(attrcontext,
+		sizeof(RecathonItemAttribute));
+	strlcpy(attr->recname, attributes->recIndexName, NAMEDATALEN);
+	attr->relid = relid;
+	attr->attno = attno;
+	attr->keyattno = keyattno;
+	attr->atttypid = atttypid;
+	attr->version = recstate->profileVersion;
+	attr->numItems = recstate->fullTotalItems;
+	attr->context = attrcontext;
+	get_typlenbyval(atttypid, &typlen, &typbyval);
+
+	MemSet(&ctl, 0, sizeof(ctl));
+	ctl.keysize = sizeof(RecathonValueKey);
+	ctl.entrysize = sizeof(RecathonValueEntry);
+	ctl.hash = attributeValueHash;
+	ctl.match = attributeValueMatch;
+	ctl.hcxt = CurrentMemoryContext;
+	valueHash = hash_create("Recathon attribute values", 1024, &ctl,
+		HASH_ELEM | HASH_FUNCTION | HASH_COMPARE | HASH_CONTEXT);
+
+	maxRows = 1024;
+	rowValues = (int*) palloc(maxRows*sizeof(int));
+	rowItems = (int*) palloc(maxRows*sizeof(int));
+	maxValues = 64;
+	attr->values = (Datum*) MemoryContextAlloc(attrcontext, maxValues*sizeof(Datum));
+	attr->isnull = (bool*) MemoryContextAlloc(attrcontext, maxValues*sizeof(bool));
+	numRows = 0;
+
+	initStringInfo(&querystring);
+	appendStringInfo(&querystring,"select %s, %s from %s;",
+		quote_identifier(get_attname(relid, attno)),
+		quote_identifier(get_attname(relid, keyattno)),
+		quote_qualified_identifier(get_namespace_name(get_rel_namespace(relid)),
+			get_rel_name(relid)));
+	queryDesc = recathon_queryStart(querystring.data,&recathoncontext);
+	for (;;) {
+		Datum value, keyvalue;
+		bool isnull, keynull;
+		int itemindex, v;
 
-		for (j = i+1; j < numItems; j++) {
-			float length_j;
-			sim_node item_j;
-			float similarity;
+		CHECK_FOR_INTERRUPTS();
 
-			item_j = itemEvents[j];
-			if (!item_j) continue;
-			length_j = itemLengths[j];
+		slot = ExecProcNode(queryDesc->planstate);
+		if (TupIsNull(slot)) break;
 
-			similarity = cosineSimilarity(item_i, item_j, length_i, length_j);
-			if (similarity <= 0) continue;
+		keyvalue = slot_getattr(slot, 2, &keynull);
+		if (keynull)
+			continue;
+		switch (slot->tts_tupleDescriptor->attrs[1]->atttypid) {
+			case INT2OID:
+				itemindex = itemIndex(recstate, (int) DatumGetInt16(keyvalue));
+				break;
+			case INT8OID:
+				itemindex = itemIndex(recstate, (int) DatumGetInt64(keyvalue));
+				break;
+			default:
+				itemindex = itemIndex(recstate, DatumGetInt32(keyvalue));
+				break;
+		}
+		if (itemindex < 0)
+			continue;
 
-			/* Now we output. Like with the pre-computed model, we'll
-			 * only worry about half the model. This allows us to fill
-			 * in the matrix left-to-right, top-to-bottom. */
-			itemmodel[i][j] = similarity;
+		value = slot_getattr(slot, 1, &isnull);
+		if (isnull && nullValue >= 0)
+			v = nullValue;
+		else {
+			RecathonValueKey key;
+			RecathonValueEntry *entry = NULL;
+			bool found = false;
+
+			if (!isnull) {
+				if (typlen == -1)
+					value = PointerGetDatum(PG_DETOAST_DATUM_PACKED(value));
+				attributeValueBytes(&value, typlen, typbyval, &key);
+				entry = (RecathonValueEntry*) hash_search(valueHash, &key,
+					HASH_ENTER, &found);
+			}
+			if (found)
+				v = entry->value;
+			else {
+				if (attr->numValues >= maxValues) {
+					maxValues *= 2;
+					attr->values = (Datum*) repalloc(attr->values, maxValues*sizeof(Datum));
+					attr->isnull = (bool*) repalloc(attr->isnull, maxValues*sizeof(bool));
+				}
+				v = attr->numValues++;
+				attr->isnull[v] = isnull;
+				attr->values[v] = (Datum) 0;
+				if (isnull)
+					nullValue = v;
+				else {
+					// The key goes on pointing at the copy we keep.
+					oldcontext = MemoryContextSwitchTo(attrcontext);
+					attr->values[v] = datumCopy(value, typbyval, typlen);
+					MemoryContextSwitchTo(oldcontext);
+					attributeValueBytes(&attr->values[v], typlen, typbyval, &entry->key);
+					entry->value = v;
+				}
+			}
 		}
 
-		CHECK_FOR_INTERRUPTS();
+		if (numRows >= maxRows) {
+			maxRows *= 2;
+			rowValues = (int*) repalloc(rowValues, maxRows*sizeof(int));
+			rowItems = (int*) repalloc(rowItems, maxRows*sizeof(int));
+		}
+		rowValues[numRows] = v;
+		rowItems[numRows] = itemindex;
+		numRows++;
 	}
+	recathon_queryEnd(queryDesc,recathoncontext);
+	pfree(querystring.data);
+	hash_destroy(valueHash);
+
+	// Then the items are put together by value.
+	attr->offsets = (int*) MemoryContextAllocZero(attrcontext,
+		(attr->numValues + 1)*sizeof(int));
+	attr->items = (int*) MemoryContextAlloc(attrcontext, Max(numRows, 1)*sizeof(int));
+	for (i = 0; i < numRows; i++)
+		attr->offsets[rowValues[i] + 1]++;
+	for (i = 0; i < attr->numValues; i++)
+		attr->offsets[i + 1] += attr->offsets[i];
+	fill = (int*) palloc(Max(attr->numValues, 1)*sizeof(int));
+	memcpy(fill, attr->offsets, attr->numValues*sizeof(int));
+	for (i = 0; i < numRows; i++)
+		attr->items[fill[rowValues[i]]++] = rowItems[i];
+
+	pfree(fill);
+	pfree(rowValues);
+	pfree(rowItems);
+
+	elog(DEBUG1, "read %d values of item attribute \"%s\" of \"%s\"",
+		attr->numValues, get_attname(relid, attno), get_rel_name(relid));
+	return attr;
+}
 
-	/* Free up the lists of sim_nodes now, since we're done. */
-	for (i = 0; i < numItems; i++) {
-		freeSimList(itemEvents[i]);
-		itemEvents[i] = NULL;
+/* ----------------------------------------------------------------
+ *		findItemAttribute
+ *
+ *		Finds the items of a recommender grouped by a column
+ *		of an items table, reading them if we haven't since
+ *		its models last changed.
+ * ----------------------------------------------------------------
+ */
+static RecathonItemAttribute *
+findItemAttribute(RecScanState *recstate, Oid relid, AttrNumber attno,
+		AttrNumber keyattno, Oid atttypid) {
+	ListCell *lc;
+	RecathonItemAttribute *attr;
+	MemoryContext oldcontext;
+
+	AttributeInfo *attributes = (AttributeInfo*) recstate->attributes;
+
+	foreach(lc, recathon_item_attributes) {
+		attr = (RecathonItemAttribute*) lfirst(lc);
+		if (strcmp(attr->recname, attributes->recIndexName) != 0 ||
+		    attr->relid != relid || attr->attno != attno ||
+		    attr->keyattno != keyattno)
+			continue;
+		if (attr->version == recstate->profileVersion &&
+		    attr->numItems == recstate->fullTotalItems &&
+		    attr->atttypid == atttypid)
+			return attr;
+
+		// An older read is thrown out.
+		recathon_item_attributes = list_delete_ptr(recathon_item_attributes, attr);
+		MemoryContextDelete(attr->context);
+		break;
 	}
 
-	/* Fill in the appropriate information. */
-	recnode->fullTotalItems = numItems;
-	recnode->fullItemList = itemIDs;
-	recnode->itemCFmodel = itemmodel;
+	attr = loadItemAttribute(recstate, relid, attno, keyattno, atttypid);
+	oldcontext = MemoryContextSwitchTo(recathon_attribute_context);
+	recathon_item_attributes = lappend(recathon_item_attributes, attr);
+	MemoryContextSwitchTo(oldcontext);
+	return attr;
 }
 
 /* ----------------------------------------------------------------
- *		generateItemPearModel
+ *		attributeFilter
  *
- *		Create an item-based Pearson model on the fly.
+ *		Works out which items meet a condition on one item
+ *		attribute, by testing it once for each value of the
+ *		attribute rather than once for each item. Unless the
+ *		condition could come out differently another time, the
+ *		answer is kept for the next query that asks.
  * ----------------------------------------------------------------
  */
-void
-generateItemPearModel(RecScanState *recnode) {
-	int i, j, priorID;
-	char *querystring;
-	char *eventtable, *userkey, *itemkey, *eventval;
-	sim_node *itemEvents;
-	int numItems;
-	int *itemIDs;
-	float *itemAvgs;
-	float *itemPearsons;
-	AttributeInfo *attributes;
-	float **itemmodel;
-	// Information for other queries.
-	QueryDesc *simqueryDesc;
-	PlanState *simplanstate;
-	TupleTableSlot *simslot;
-	MemoryContext simcontext;
+static Bitmapset *
+attributeFilter(RecathonItemAttribute *attr, Relation rel, Expr *clause) {
+	int v, i;
+	char *deparsed = NULL;
+	bool keep;
+	ListCell *lc;
+	Bitmapset *items = NULL;
+	RecathonItemFilter *filter;
+	ExprState *exprstate;
+	ExprContext *econtext;
+	TupleTableSlot *slot;
+	TupleDesc tupdesc;
+	MemoryContext oldcontext;
 
-	attributes = (AttributeInfo*) recnode->attributes;
-	eventtable = attributes->eventtable;
-	userkey = attributes->userkey;
-	itemkey = attributes->itemkey;
-	eventval = attributes->eventval;
+	keep = !contain_mutable_functions((Node*) clause);
+	if (keep) {
+		deparsed = deparse_expression((Node*) clause,
+			deparse_context_for(RelationGetRelationName(rel), RelationGetRelid(rel)),
+			false, false);
+		foreach(lc, attr->filters) {
+			filter = (RecathonItemFilter*) lfirst(lc);
+			if (strcmp(filter->clause, deparsed) == 0) {
+				pfree(deparsed);
+				return bms_copy(filter->items);
+			}
+		}
+	}
 
-	// First we need to get relevant Pearson information.
-	pearson_info(itemkey, eventtable, eventval, &numItems, &itemIDs, &itemAvgs, &itemPearsons);
+	tupdesc = RelationGetDescr(rel);
+	slot = MakeSingleTupleTableSlot(tupdesc);
+	econtext = CreateStandaloneExprContext();
+	exprstate = ExecInitExpr(expression_planner((Expr*) copyObject(clause)), NULL);
 
-	/* We have the number of items, so we can initialize our model. */
-	itemmodel = (float**) palloc(numItems*sizeof(float*));
-	for (i = 0; i < numItems; i++)
-		itemmodel[i] = (float*) palloc0(numItems*sizeof(float));
-
-	// With the precomputation done, we need to derive the actual item
-	// similarities. We can do this in a way that's linear in the number
-	// of I/Os and also the amount of storage. The complexity is relegated
-	// to in-memory calculations, which is the most affordable. We need to
-	// use this data structure here.
-	itemEvents = (sim_node*) palloc(numItems*sizeof(sim_node));
-	for (i = 0; i < numItems; i++)
-		itemEvents[i] = NULL;
+	for (v = 0; v < attr->numValues; v++) {
+		Datum result;
+		bool isnull;
 
-	// With the model created, we need to populate it, which means calculating
-	// similarity between all item pairs. We need to query the events table
-	// in order to get the key information.
-	querystring = (char*) palloc(1024*sizeof(char));
-	sprintf(querystring,"SELECT r.%s,r.%s,r.%s FROM %s r ORDER BY r.%s;",
-		userkey,itemkey,eventval,eventtable,itemkey);
+		CHECK_FOR_INTERRUPTS();
 
-	// Begin extracting data.
-	priorID = -1;
-	simqueryDesc = recathon_queryStart(querystring, &simcontext);
-	simplanstate = simqueryDesc->planstate;
-	i = -1;
+		ExecClearTuple(slot);
+		for (i = 0; i < tupdesc->natts; i++)
+			slot->tts_isnull[i] = true;
+		slot->tts_values[attr->attno - 1] = attr->values[v];
+		slot->tts_isnull[attr->attno - 1] = attr->isnull[v];
+		ExecStoreVirtualTuple(slot);
+		econtext->ecxt_scantuple = slot;
+
+		result = ExecEvalExprSwitchContext(exprstate, econtext, &isnull, NULL);
+		ResetExprContext(econtext);
+		if (isnull || !DatumGetBool(result))
+			continue;
+		for (i = attr->offsets[v]; i < attr->offsets[v + 1]; i++)
+			items = bms_add_member(items, attr->items[i]);
+	}
 
-	for (;;) {
-		int simuser, simitem;
-		float simevent;
-		sim_node newnode;
+	FreeExprContext(econtext, true);
+	ExecDropSingleTupleTableSlot(slot);
 
-		// Shut the compiler up.
-		simuser = 0; simitem = 0; simevent = 0.0;
+	if (keep) {
+		if (list_length(attr->filters) >= RECATHON_ITEM_FILTERS) {
+			filter = (RecathonItemFilter*) linitial(attr->filters);
+			attr->filters = list_delete_first(attr->filters);
+			pfree(filter->clause);
+			bms_free(filter->items);
+			pfree(filter);
+		}
+		oldcontext = MemoryContextSwitchTo(attr->context);
+		filter = (RecathonItemFilter*) palloc(sizeof(RecathonItemFilter));
+		filter->clause = pstrdup(deparsed);
+		filter->items = bms_copy(items);
+		attr->filters = lappend(attr->filters, filter);
+		MemoryContextSwitchTo(oldcontext);
+		pfree(deparsed);
+	}
+	return items;
+}
 
-		simslot = ExecProcNode(simplanstate);
-		if (TupIsNull(simslot)) break;
+/* ----------------------------------------------------------------
+ *		attributeCandidates
+ *
+ *		Answers the query an item filter was made into from
+ *		the item attributes we keep, if the recommender lists
+ *		every column its conditions test in item_attributes.
+ *		They have to be conditions on a single plain table,
+ *		each testing one column. Each is turned into the set
+ *		of items it lets through, and the candidates are the
+ *		items every one of them does. Returns false if the
+ *		query has to be run instead.
+ * ----------------------------------------------------------------
+ */
+static bool
+attributeCandidates(RecScanState *recstate, Query *itemQuery) {
+	int itemindex;
+	char *spec;
+	List *relids, *attnos, *clauses;
+	ListCell *lc;
+	RangeTblEntry *rte;
+	TargetEntry *tle;
+	Var *keyvar;
+	Relation rel;
+	Bitmapset *candidates = NULL;
+	bool first = true;
 
-		simuser = getTupleInt(simslot,userkey);
-		simitem = getTupleInt(simslot,itemkey);
-		simevent = getTupleFloat(simslot,eventval);
+	AttributeInfo *attributes = (AttributeInfo*) recstate->attributes;
 
-		// Are we dealing with a new item ID? If so, switch to the next slot.
-		if (simitem != priorID) {
-			priorID = simitem;
-			i++;
+	if (!profileCacheable(recstate))
+		return false;
+
+	// A plain SELECT of the item key from one table, and the
+	// conditions on it.
+	if (itemQuery->commandType != CMD_SELECT || itemQuery->hasAggs ||
+	    itemQuery->hasWindowFuncs || itemQuery->hasSubLinks ||
+	    itemQuery->cteList || itemQuery->groupClause || itemQuery->havingQual ||
+	    itemQuery->distinctClause || itemQuery->limitOffset ||
+	    itemQuery->limitCount || itemQuery->setOperations ||
+	    itemQuery->rowMarks || list_length(itemQuery->rtable) != 1 ||
+	    !itemQuery->jointree || !itemQuery->jointree->quals ||
+	    list_length(itemQuery->jointree->fromlist) != 1 ||
+	    !IsA(linitial(itemQuery->jointree->fromlist), RangeTblRef))
+		return false;
+	rte = (RangeTblEntry*) linitial(itemQuery->rtable);
+	if (rte->rtekind != RTE_RELATION || rte->relkind != RELKIND_RELATION || !rte->inh)
+		return false;
+	tle = (TargetEntry*) linitial(itemQuery->targetList);
+	if (!IsA(tle->expr, Var))
+		return false;
+	keyvar = (Var*) tle->expr;
+
+	spec = catalogueString(attributes->recIndexName, "itemattributes");
+	if (!spec)
+		return false;
+	itemAttributeList(spec, false, &relids, &attnos);
+
+	// Every condition has to test one listed column.
+	clauses = make_ands_implicit((Expr*) itemQuery->jointree->quals);
+	foreach(lc, clauses) {
+		Node *clause = (Node*) lfirst(lc);
+		Bitmapset *varattnos = NULL;
+		ListCell *rc, *ac;
+		bool listed = false;
+		int attno;
+
+		if (contain_volatile_functions(clause))
+			return false;
+		pull_varattnos(clause, 1, &varattnos);
+		if (bms_num_members(varattnos) != 1)
+			return false;
+		attno = bms_singleton_member(varattnos) + FirstLowInvalidHeapAttributeNumber;
+		forboth(rc, relids, ac, attnos) {
+			if (lfirst_oid(rc) == rte->relid && lfirst_int(ac) == attno)
+				listed = true;
 		}
-
-		// We now have the user, item, and event for this tuple.
-		// We insert the results as a sim_node into the
-		// itemEvents table; we'll do calculations later.
-		newnode = createSimNode(simuser, simevent);
-		itemEvents[i] = simInsert(itemEvents[i], newnode);
+		if (!listed)
+			return false;
 	}
 
-	// Query cleanup.
-	recathon_queryEnd(simqueryDesc, simcontext);
-	pfree(querystring);
+	// The query would have checked we may read the table.
+	ExecCheckRTPerms(itemQuery->rtable, true);
+
+	rel = heap_open(rte->relid, AccessShareLock);
+	foreach(lc, clauses) {
+		Node *clause = (Node*) lfirst(lc);
+		Bitmapset *varattnos = NULL;
+		Bitmapset *items;
+		RecathonItemAttribute *attr;
+		AttrNumber attno;
+
+		pull_varattnos(clause, 1, &varattnos);
+		attno = bms_singleton_member(varattnos) + FirstLowInvalidHeapAttributeNumber;
+		attr = findItemAttribute(recstate, rte->relid, attno, keyvar->varattno,
+			RelationGetDescr(rel)->attrs[attno - 1]->atttypid);
+
+		items = attributeFilter(attr, rel, (Expr*) clause);
+		if (first)
+			candidates = items;
+		else {
+			candidates = bms_int_members(candidates, items);
+			bms_free(items);
+		}
+		first = false;
+	}
+	heap_close(rel, AccessShareLock);
 
-	// Now we do the similarity calculations. Note that we
-	// don't include duplicate entries, to save time and space.
-	// The first item ALWAYS has a lower value than the second.
-	for (i = 0; i < numItems; i++) {
-		float avg_i, pearson_i;
-		sim_node item_i;
+	recstate->itemCandidates = (int*) palloc(Max(recstate->fullTotalItems, 1)*sizeof(int));
+	recstate->numCandidates = 0;
+	while ((itemindex = bms_first_member(candidates)) >= 0)
+		recstate->itemCandidates[recstate->numCandidates++] = itemindex;
+	bms_free(candidates);
 
-		item_i = itemEvents[i];
-		if (!item_i) continue;
-		avg_i = itemAvgs[i];
-		pearson_i = itemPearsons[i];
+	return true;
+}
 
-		for (j = i+1; j < numItems; j++) {
-			float avg_j, pearson_j;
-			sim_node item_j;
-			float similarity;
+/* ----------------------------------------------------------------
+ *		loadItemCandidates
+ *
+ *		Runs the subquery a RECOMMEND query's WHERE clause
+ *		limits the items to, and makes the items it returns
+ *		the only ones we score, for every user. The subquery
+ *		is planned on its own, so something like a distance
+ *		predicate on an indexed items table fetches a few
+ *		candidates through the index, rather than us scoring
+ *		every item and leaving the WHERE clause to throw most
+ *		of them away. Items we don't know are skipped. The
+ *		candidates are put in fullItemList order. If the
+ *		recommender keeps the item attributes the conditions
+ *		test, we answer from those instead.
+ * ----------------------------------------------------------------
+ */
+void
+loadItemCandidates(RecScanState *recstate, Query *itemQuery) {
+	int i, numItems;
+	bool *isCandidate;
+	// Query objects.
+	QueryDesc *queryDesc;
+	TupleTableSlot *slot;
+	MemoryContext recathoncontext;
 
-			item_j = itemEvents[j];
-			if (!item_j) continue;
-			avg_j = itemAvgs[j];
-			pearson_j = itemPearsons[j];
+	if (attributeCandidates(recstate, itemQuery))
+		return;
 
-			similarity = pearsonSimilarity(item_i, item_j, avg_i, avg_j, pearson_i, pearson_j);
-			if (similarity == 0.0) continue;
+	numItems = recstate->fullTotalItems;
+	isCandidate = (bool*) palloc0(Max(numItems, 1)*sizeof(bool));
 
-			/* Now we output. Like with the pre-computed model, we'll
-			 * only worry about half the model. This allows us to fill
-			 * in the matrix left-to-right, top-to-bottom. */
-			itemmodel[i][j] = similarity;
-		}
+	queryDesc = recathon_queryStartParsed(itemQuery,&recathoncontext);
+	for (;;) {
+		Datum value;
+		bool isnull;
+		int itemindex;
 
 		CHECK_FOR_INTERRUPTS();
+
+		slot = ExecProcNode(queryDesc->planstate);
+		if (TupIsNull(slot)) break;
+
+		value = slot_getattr(slot, 1, &isnull);
+		if (isnull)
+			continue;
+		switch (slot->tts_tupleDescriptor->attrs[0]->atttypid) {
+			case INT2OID:
+				itemindex = itemIndex(recstate, (int) DatumGetInt16(value));
+				break;
+			case INT8OID:
+				itemindex = itemIndex(recstate, (int) DatumGetInt64(value));
+				break;
+			default:
+				itemindex = itemIndex(recstate, DatumGetInt32(value));
+				break;
+		}
+		if (itemindex >= 0)
+			isCandidate[itemindex] = true;
 	}
+	recathon_queryEnd(queryDesc,recathoncontext);
 
-	// Free up the lists of sim_nodes and we're done.
+	recstate->itemCandidates = (int*) palloc(Max(numItems, 1)*sizeof(int));
+	recstate->numCandidates = 0;
 	for (i = 0; i < numItems; i++) {
-		freeSimList(itemEvents[i]);
-		itemEvents[i] = NULL;
+		if (isCandidate[i])
+			recstate->itemCandidates[recstate->numCandidates++] = i;
 	}
 
-	// Return the relevant information.
-	recnode->fullTotalItems = numItems;
-	recnode->fullItemList = itemIDs;
-	recnode->itemCFmodel = itemmodel;
+	pfree(isCandidate);
 }
 
 /* ----------------------------------------------------------------
- *		generateUserCosModel
+ *		loadQueryUsers
  *
- *		Create a user-based cosine model on the fly.
+ *		Runs the subquery a RECOMMEND query's WHERE clause
+ *		limits the users to, or the one we made from a table
+ *		they're joined with, and returns the user IDs it finds
+ *		as an integer list. We then go on as if the query had
+ *		named them, loading the recommender once for all of
+ *		them rather than once per user.
  * ----------------------------------------------------------------
  */
-void
-generateUserCosModel(RecScanState *recnode) {
-	int i, j, priorID;
-	int numEvents = 0;
-	char *querystring;
-	sim_node *userEvents;
-	char *eventtable, *userkey, *itemkey, *eventval;
-	AttributeInfo *attributes;
-	float **usermodel;
-	int numUsers;
-	int *userIDs;
-	float *userLengths;
-	// Information for other queries.
-	QueryDesc *simqueryDesc;
-	PlanState *simplanstate;
-	TupleTableSlot *simslot;
-	MemoryContext simcontext;
-
-	attributes = (AttributeInfo*) recnode->attributes;
-	eventtable = attributes->eventtable;
-	userkey = attributes->userkey;
-	itemkey = attributes->itemkey;
-	eventval = attributes->eventval;
-
-	// First we need vector lengths.
-	userLengths = vector_lengths(userkey, eventtable, eventval, &numUsers, &userIDs);
-
-	/* We have the number of users, so we can initialize our model. */
-	usermodel = (float**) palloc(numUsers*sizeof(float*));
-	for (i = 0; i < numUsers; i++)
-		usermodel[i] = (float*) palloc0(numUsers*sizeof(float));
-
-	// With the precomputation done, we need to derive the actual user
-	// similarities. We can do this in a way that's linear in the number
-	// of I/Os and also the amount of storage. The complexity is relegated
-	// to in-memory calculations, which is the most affordable. We need to
-	// use this data structure here.
-	userEvents = (sim_node*) palloc(numUsers*sizeof(sim_node));
-	for (i = 0; i < numUsers; i++)
-		userEvents[i] = NULL;
-
-	// With the model created, we need to populate it, which means calculating
-	// similarity between all user pairs. We need to query the events table
-	// in order to get the key information.
-	querystring = (char*) palloc(1024*sizeof(char));
-	sprintf(querystring,"SELECT r.%s,r.%s,r.%s FROM %s r ORDER BY r.%s;",
-		userkey,itemkey,eventval,eventtable,userkey);
-
-	// Begin extracting data.
-	priorID = -1;
-	simqueryDesc = recathon_queryStart(querystring, &simcontext);
-	simplanstate = simqueryDesc->planstate;
-	i = -1;
+List *
+loadQueryUsers(Query *userQuery) {
+	List *IDs = NIL;
+	// Query objects.
+	QueryDesc *queryDesc;
+	TupleTableSlot *slot;
+	MemoryContext recathoncontext;
 
+	queryDesc = recathon_queryStartParsed(userQuery,&recathoncontext);
 	for (;;) {
-		int simuser, simitem;
-		float simevent;
-		sim_node newnode;
-
-		// Shut the compiler up.
-		simuser = 0; simitem = 0; simevent = 0.0;
+		Datum value;
+		bool isnull;
+		int userID;
 
-		simslot = ExecProcNode(simplanstate);
-		if (TupIsNull(simslot)) break;
+		CHECK_FOR_INTERRUPTS();
 
-		simuser = getTupleInt(simslot,userkey);
-		simitem = getTupleInt(simslot,itemkey);
-		simevent = getTupleFloat(simslot,eventval);
+		slot = ExecProcNode(queryDesc->planstate);
+		if (TupIsNull(slot)) break;
 
-		// Are we dealing with a new user ID? If so, switch to the next slot.
-		if (simuser != priorID) {
-			priorID = simuser;
-			i++;
+		value = slot_getattr(slot, 1, &isnull);
+		if (isnull)
+			continue;
+		switch (slot->tts_tupleDescriptor->attrs[0]->atttypid) {
+			case INT2OID:
+				userID = (int) DatumGetInt16(value);
+				break;
+			case INT8OID:
+				userID = (int) DatumGetInt64(value);
+				break;
+			default:
+				userID = DatumGetInt32(value);
+				break;
 		}
-
-		// We now have the user, item, and event for this tuple.
-		// We insert the results as a sim_node into the
-		// userEvents table; we'll do calculations later.
-		newnode = createSimNode(simitem, simevent);
-		userEvents[i] = simInsert(userEvents[i], newnode);
-		numEvents++;
+		IDs = lappend_int(IDs, userID);
 	}
+	recathon_queryEnd(queryDesc,recathoncontext);
 
-	// Query cleanup.
-	recathon_queryEnd(simqueryDesc, simcontext);
-	pfree(querystring);
-
-	// Now we do the similarity calculations. Note that we
-	// don't include duplicate entries, to save time and space.
-	// The first user ALWAYS has a lower value than the second.
-	for (i = 0; i < numUsers; i++) {
-		float length_i;
-		sim_node user_i;
+	return IDs;
+}
 
-		user_i = userEvents[i];
-		if (!user_i) continue;
-		length_i = userLengths[i];
+/* ----------------------------------------------------------------
+ *		profileCacheable
+ *
+ *		Can what we prepare for users be kept for the rest of
+ *		the session? Only for a built recommender with a model
+ *		version, and not in parallel workers, which can't run
+ *		the query that checks a kept user.
+ * ----------------------------------------------------------------
+ */
+static bool
+profileCacheable(RecScanState *recstate) {
+	AttributeInfo *attributes = (AttributeInfo*) recstate->attributes;
 
-		for (j = i+1; j < numUsers; j++) {
-			float length_j;
-			sim_node user_j;
-			float similarity;
+	if (attributes->opType == OP_GENERATE || attributes->opType == OP_GENERATEJOIN ||
+	    !attributes->recIndexName || recstate->parallelWorker)
+		return false;
 
-			user_j = userEvents[j];
-			if (!user_j) continue;
-			length_j = userLengths[j];
+	// The version is looked up once per scan.
+	if (!recstate->profileChecked) {
+		recstate->profileVersion = recstate->cacheVersion ? recstate->cacheVersion :
+			modelVersion(attributes->recIndexName);
+		recstate->profileChecked = true;
+	}
+	return recstate->profileVersion != 0;
+}
 
-			similarity = cosineSimilarity(user_i, user_j, length_i, length_j);
-			if (similarity <= 0) continue;
+/* ----------------------------------------------------------------
+ *		countUserEvents
+ *
+ *		Counts a user's events, which is how we tell that a
+ *		kept user is still current.
+ * ----------------------------------------------------------------
+ */
+static int
+countUserEvents(RecScanState *recstate, int userID) {
+	int numEvents;
+	char *querystring;
+	QueryDesc *queryDesc;
+	TupleTableSlot *hslot;
+	CachedPlan *cplan;
+	MemoryContext recathoncontext;
+	recathon_probe *probe;
+	Oid paramtypes[1] = {INT4OID};
+	Datum paramvalues[1];
 
-			/* Now we output. Like with the pre-computed model, we'll
-			 * only worry about half the model. This allows us to fill
-			 * in the matrix left-to-right, top-to-bottom. */
-			usermodel[i][j] = similarity;
-		}
+	AttributeInfo *attributes = (AttributeInfo*) recstate->attributes;
 
-		CHECK_FOR_INTERRUPTS();
+	// Counting them off the index is quicker than a query.
+	probe = scanProbe(recstate, attributes->eventtable, attributes->userkey);
+	if (probe) {
+		numEvents = 0;
+		probeStart(probe, userID);
+		while (probeNext(probe) != NULL)
+			numEvents++;
+		return numEvents;
 	}
 
-	// Free up the lists of sim_nodes and we're done.
-	for (i = 0; i < numUsers; i++) {
-		freeSimList(userEvents[i]);
-		userEvents[i] = NULL;
-	}
+	querystring = (char*) palloc(1024*sizeof(char));
+	sprintf(querystring,"select count(*) as count from %s where %s = $1;",
+		attributes->eventtable,attributes->userkey);
+	paramvalues[0] = Int32GetDatum(userID);
+	queryDesc = recathon_queryStartCached(querystring,1,paramtypes,paramvalues,
+		&cplan,&recathoncontext);
+	hslot = ExecProcNode(queryDesc->planstate);
+	numEvents = getTupleInt(hslot,"count");
+	recathon_queryEndCached(queryDesc,cplan,recathoncontext);
+	pfree(querystring);
 
-	// Return the relevant information.
-	recnode->totalUsers = numUsers;
-	recnode->userList = userIDs;
-	recnode->userCFmodel = usermodel;
+	return numEvents;
 }
 
 /* ----------------------------------------------------------------
- *		generateUserPearModel
+ *		lookupUserProfile
  *
- *		Create a user-based Pearson model on the fly.
+ *		Finds what an earlier query in this session prepared
+ *		for a user, if it still holds. We only count the
+ *		user's events if there's something to check.
  * ----------------------------------------------------------------
  */
-void
-generateUserPearModel(RecScanState *recnode) {
-	int i, j, priorID;
-	int numEvents = 0;
-	char *querystring;
-	sim_node *userEvents;
-	char *eventtable, *userkey, *itemkey, *eventval;
-	AttributeInfo *attributes;
-	float **usermodel;
-	int numUsers;
-	int *userIDs;
-	float *userAvgs;
-	float *userPearsons;
-	// Information for other queries.
-	QueryDesc *simqueryDesc;
-	PlanState *simplanstate;
-	TupleTableSlot *simslot;
-	MemoryContext simcontext;
+static RecathonProfileEntry *
+lookupUserProfile(RecScanState *recstate, int userID) {
+	RecathonProfileKey key;
+	RecathonProfileEntry *entry;
 
-	attributes = (AttributeInfo*) recnode->attributes;
-	eventtable = attributes->eventtable;
-	userkey = attributes->userkey;
-	itemkey = attributes->itemkey;
-	eventval = attributes->eventval;
+	AttributeInfo *attributes = (AttributeInfo*) recstate->attributes;
 
-	// First, we need Pearson info.
-	pearson_info(userkey, eventtable, eventval, &numUsers, &userIDs, &userAvgs, &userPearsons);
+	if (!recathon_profile_cache || !profileCacheable(recstate))
+		return NULL;
 
-	/* We have the number of users, so we can initialize our model. */
-	usermodel = (float**) palloc(numUsers*sizeof(float*));
-	for (i = 0; i < numUsers; i++)
-		usermodel[i] = (float*) palloc0(numUsers*sizeof(float));
+	MemSet(&key, 0, sizeof(key));
+	strlcpy(key.recname, attributes->recIndexName, NAMEDATALEN);
+	key.userID = userID;
+	entry = (RecathonProfileEntry*) hash_search(recathon_profile_cache,
+		&key, HASH_FIND, NULL);
+	if (!entry || entry->version != recstate->profileVersion ||
+	    entry->numEvents != countUserEvents(recstate, userID))
+		return NULL;
+	return entry;
+}
 
-	// With the precomputation done, we need to derive the actual item
-	// similarities. We can do this in a way that's linear in the number
-	// of I/Os and also the amount of storage. The complexity is relegated
-	// to in-memory calculations, which is the most affordable. We need to
-	// use this data structure here.
-	userEvents = (sim_node*) palloc(numUsers*sizeof(sim_node));
-	for (i = 0; i < numUsers; i++)
-		userEvents[i] = NULL;
+/* ----------------------------------------------------------------
+ *		fetchUserEvents
+ *
+ *		Reads all of a user's events in one pass, in item
+ *		order, into arrays that grow as needed. Returns how
+ *		many there are, which also serves as their count
+ *		unless repeated events are combined; ret_numRead,
+ *		if given, gets how many rows were read either way.
+ * ----------------------------------------------------------------
+ */
+static int
+fetchUserEvents(RecScanState *recstate, int userID, int **ret_items,
+		float **ret_events, int *ret_numRead) {
+	int numFound, size;
+	int *items;
+	float *events;
+	char *querystring;
+	QueryDesc *queryDesc;
+	TupleTableSlot *hslot;
+	CachedPlan *cplan;
+	MemoryContext recathoncontext;
+	tuple_column itemcol, eventcol;
+	recathon_probe *probe;
+	Oid paramtypes[1] = {INT4OID};
+	Datum paramvalues[1];
 
-	// With the model created, we need to populate it, which means calculating
-	// similarity between all item pairs. We need to query the events table
-	// in order to get the key information.
-	querystring = (char*) palloc(1024*sizeof(char));
-	sprintf(querystring,"SELECT r.%s,r.%s,r.%s FROM %s r ORDER BY r.%s;",
-		userkey,itemkey,eventval,eventtable,userkey);
+	AttributeInfo *attributes = (AttributeInfo*) recstate->attributes;
 
-	// Begin extracting data.
-	priorID = -1;
-	simqueryDesc = recathon_queryStart(querystring, &simcontext);
-	simplanstate = simqueryDesc->planstate;
-	i = -1;
+	size = 64;
+	items = (int*) palloc(size*sizeof(int));
+	events = (float*) palloc(size*sizeof(float));
+
+	// The events table's index on the user saves a query.
+	querystring = NULL;
+	probe = scanProbe(recstate, attributes->eventtable, attributes->userkey);
+	if (probe)
+		probeStart(probe, userID);
+	else {
+		querystring = (char*) palloc(1024*sizeof(char));
+		if (recathon_duplicate_events == RECATHON_DUPLICATES_KEEP)
+			sprintf(querystring,"select %s, %s from %s where %s = $1 order by %s;",
+				attributes->itemkey,attributes->eventval,
+				attributes->eventtable,attributes->userkey,
+				attributes->itemkey);
+		else
+			sprintf(querystring,"select %s, %s from %s where %s = $1;",
+				attributes->itemkey,attributes->eventval,
+				attributes->eventtable,attributes->userkey);
+		paramvalues[0] = Int32GetDatum(userID);
+		queryDesc = recathon_queryStartCached(querystring,1,paramtypes,paramvalues,
+			&cplan,&recathoncontext);
+	}
+	bindColumn(&itemcol, attributes->itemkey);
+	bindColumn(&eventcol, attributes->eventval);
 
+	numFound = 0;
 	for (;;) {
-		int simuser, simitem;
-		float simevent;
-		sim_node newnode;
-
-		// Shut the compiler up.
-		simuser = 0; simitem = 0; simevent = 0.0;
-
-		simslot = ExecProcNode(simplanstate);
-		if (TupIsNull(simslot)) break;
+		hslot = probe ? probeNext(probe) : ExecProcNode(queryDesc->planstate);
+		if (TupIsNull(hslot)) break;
 
-		simuser = getTupleInt(simslot,userkey);
-		simitem = getTupleInt(simslot,itemkey);
-		simevent = getTupleFloat(simslot,eventval);
-
-		// Are we dealing with a new user ID? If so, switch to the next slot.
-		if (simuser != priorID) {
-			priorID = simuser;
-			i++;
+		if (numFound >= size) {
+			size *= 2;
+			items = (int*) repalloc(items, size*sizeof(int));
+			events = (float*) repalloc(events, size*sizeof(float));
 		}
-
-		// We now have the user, item, and event for this tuple.
-		// We insert the results as a sim_node into the
-		// userEvents table; we'll do calculations later.
-		newnode = createSimNode(simitem, simevent);
-		userEvents[i] = simInsert(userEvents[i], newnode);
-		numEvents++;
+		items[numFound] = columnInt(hslot,&itemcol);
+		events[numFound] = columnFloat(hslot,&eventcol);
+		numFound++;
+	}
+	if (!probe) {
+		recathon_queryEndCached(queryDesc,cplan,recathoncontext);
+		pfree(querystring);
 	}
 
-	// Query cleanup.
-	recathon_queryEnd(simqueryDesc, simcontext);
-	pfree(querystring);
-
-	// Now we do the similarity calculations. Note that we
-	// don't include duplicate entries, to save time and space.
-	// The first item ALWAYS has a lower value than the second.
-	for (i = 0; i < numUsers; i++) {
-		float avg_i, pearson_i;
-		sim_node user_i;
-
-		user_i = userEvents[i];
-		if (!user_i) continue;
-		avg_i = userAvgs[i];
-		pearson_i = userPearsons[i];
-
-		for (j = i+1; j < numUsers; j++) {
-			float avg_j, pearson_j;
-			sim_node user_j;
-			float similarity;
-
-			user_j = userEvents[j];
-			if (!user_j) continue;
-			avg_j = userAvgs[j];
-			pearson_j = userPearsons[j];
+	// Repeated events are put in order here rather than by the
+	// query, so that the order they were read in decides which of
+	// them is last. The index leaves them in no order either.
+	if (ret_numRead)
+		(*ret_numRead) = numFound;
+	if (recathon_duplicate_events != RECATHON_DUPLICATES_KEEP) {
+		sortEvents(items, events, numFound);
+		numFound = collapseEvents(items, events, numFound);
+	} else if (probe)
+		sortEvents(items, events, numFound);
+
+	(*ret_items) = items;
+	(*ret_events) = events;
+	return numFound;
+}
 
-			similarity = pearsonSimilarity(user_i, user_j, avg_i, avg_j, pearson_i, pearson_j);
-			if (similarity == 0.0) continue;
+/* ----------------------------------------------------------------
+ *		storeUserProfile
+ *
+ *		Keeps what we prepared for a user for later queries in
+ *		this session, replacing anything older. IDs may be NULL.
+ *		numEvents is the user's event count, if we have it to
+ *		hand, or -1 to count them now.
+ * ----------------------------------------------------------------
+ */
+static void
+storeUserProfile(RecScanState *recstate, int userID, int numEvents,
+		int numValues, int *IDs, float *values, float average) {
+	RecathonProfileKey key;
+	RecathonProfileEntry *entry;
+	MemoryContext oldcontext;
+	bool found;
 
-			/* Now we output. Like with the pre-computed model, we'll
-			 * only worry about half the model. This allows us to fill
-			 * in the matrix left-to-right, top-to-bottom. */
-			usermodel[i][j] = similarity;
-		}
+	AttributeInfo *attributes = (AttributeInfo*) recstate->attributes;
 
-		CHECK_FOR_INTERRUPTS();
+	if (!profileCacheable(recstate))
+		return;
+	if (numEvents < 0)
+		numEvents = countUserEvents(recstate, userID);
+
+	// Start over once we're holding too many users.
+	if (recathon_profile_cache &&
+	    hash_get_num_entries(recathon_profile_cache) >= RECATHON_PROFILE_USERS) {
+		MemoryContextReset(recathon_profile_context);
+		recathon_profile_cache = NULL;
+	}
+	if (!recathon_profile_cache) {
+		HASHCTL ctl;
+
+		if (!recathon_profile_context)
+			recathon_profile_context = AllocSetContextCreate(TopMemoryContext,
+				"Recathon user profiles",
+				ALLOCSET_DEFAULT_MINSIZE,
+				ALLOCSET_DEFAULT_INITSIZE,
+				ALLOCSET_DEFAULT_MAXSIZE);
+		MemSet(&ctl, 0, sizeof(ctl));
+		ctl.keysize = sizeof(RecathonProfileKey);
+		ctl.entrysize = sizeof(RecathonProfileEntry);
+		ctl.hash = tag_hash;
+		ctl.hcxt = recathon_profile_context;
+		recathon_profile_cache = hash_create("Recathon user profiles", 256,
+			&ctl, HASH_ELEM | HASH_FUNCTION | HASH_CONTEXT);
 	}
 
-	// Free up the lists of sim_nodes and we're done.
-	for (i = 0; i < numUsers; i++) {
-		freeSimList(userEvents[i]);
-		userEvents[i] = NULL;
+	MemSet(&key, 0, sizeof(key));
+	strlcpy(key.recname, attributes->recIndexName, NAMEDATALEN);
+	key.userID = userID;
+	entry = (RecathonProfileEntry*) hash_search(recathon_profile_cache,
+		&key, HASH_ENTER, &found);
+	if (found) {
+		if (entry->IDs)
+			pfree(entry->IDs);
+		if (entry->values)
+			pfree(entry->values);
 	}
 
-	// Return the relevant information.
-	recnode->totalUsers = numUsers;
-	recnode->userList = userIDs;
-	recnode->userCFmodel = usermodel;
+	oldcontext = MemoryContextSwitchTo(recathon_profile_context);
+	entry->version = recstate->profileVersion;
+	entry->numEvents = numEvents;
+	entry->numValues = numValues;
+	entry->IDs = NULL;
+	if (IDs) {
+		entry->IDs = (int*) palloc(Max(numValues, 1)*sizeof(int));
+		memcpy(entry->IDs, IDs, numValues*sizeof(int));
+	}
+	entry->values = (float*) palloc(Max(numValues, 1)*sizeof(float));
+	memcpy(entry->values, values, numValues*sizeof(float));
+	entry->average = average;
+	MemoryContextSwitchTo(oldcontext);
 }
 
 /* ----------------------------------------------------------------
- *		generateSVDmodel
+ *		prepareUser
  *
- *		Create a SVD model on the fly.
+ *		Given a user ID, we need to create some data
+ *		structures that will allow us to efficiently
+ *		predict ratings for this user.
  * ----------------------------------------------------------------
  */
-void
-generateSVDmodel(RecScanState *recnode) {
-	float **userFeatures, **itemFeatures;
-	int *userIDs, *itemIDs;
-	float *itemAvgs, *userOffsets;
-	int numUsers, numItems;
-	int i, j, k, numEvents;
-	int numFeatures = 50;
-	svd_node *allEvents;
-	AttributeInfo *attributes;
-	char *eventtable, *userkey, *itemkey, *eventval;
-	// Information for other queries.
+static bool
+prepareUser(RecScanState *recstate, int userID) {
+	int i, userindex, numFound, numEvents, blockRow;
+	int *eventItems;
+	float *eventValues;
+	RecathonProfileEntry *profile;
+	bool keepProfile;
+	// Query objects.
 	char *querystring;
 	QueryDesc *queryDesc;
 	PlanState *planstate;
-	TupleTableSlot *slot;
+	TupleTableSlot *hslot;
+	CachedPlan *cplan;
 	MemoryContext recathoncontext;
+	tuple_column usercol, simcol, featurescol, featurecol, valuecol;
+	recathon_probe *probe;
+	Oid paramtypes[1] = {INT4OID};
+	Datum paramvalues[1];
 
-	attributes = (AttributeInfo*) recnode->attributes;
-	eventtable = attributes->eventtable;
-	userkey = attributes->userkey;
-	itemkey = attributes->itemkey;
-	eventval = attributes->eventval;
+	AttributeInfo *attributes = (AttributeInfo*) recstate->attributes;
+	attributes->userID = userID;
 
-	// First, we get our lists of users and items.
-	SVDlists(userkey,itemkey,eventtable,
-		&userIDs, &itemIDs, &numUsers, &numItems);
+	/* INSERT FORMER LIST CODE HERE */
+	querystring = (char*) palloc(1024*sizeof(char));
+	paramvalues[0] = Int32GetDatum(userID);
 
-	// Then we get information for baseline averages.
-	SVDaverages(userkey,itemkey,eventtable,eventval,
-		userIDs,itemIDs,numUsers,numItems,
-		&itemAvgs,&userOffsets);
+	switch ((recMethod) attributes->method) {
+		/* If this is an item-based CF recommender, we can pre-obtain
+		 * the ratings of this user, and add in their contributions to
+		 * the scores of all the other items. */
+		case itemCosCF:
+		case itemPearCF:
+		case itemJaccardCF:
+			/* The score arrays are indexed the same way as
+			 * fullItemList. We make them for the first user, for
+			 * the whole scan, and just clear them out for each one
+			 * after that. */
+			if (!recstate->pendingScore) {
+				Size n = recstate->fullTotalItems;
+
+				recstate->pendingScore = (float*) MemoryContextAlloc(recstate->recContext, n*sizeof(float));
+				recstate->pendingSim = (float*) MemoryContextAlloc(recstate->recContext, n*sizeof(float));
+				recstate->ratedScore = (float*) MemoryContextAlloc(recstate->recContext, n*sizeof(float));
+				recstate->isRated = (bool*) MemoryContextAlloc(recstate->recContext, n*sizeof(bool));
+				recstate->ratedItems = (int*) MemoryContextAlloc(recstate->recContext, n*sizeof(int));
+			}
+			memset(recstate->isRated, 0, recstate->fullTotalItems*sizeof(bool));
 
-	// Initialize our feature arrays.
-	userFeatures = (float**) palloc(numFeatures*sizeof(float*));
-	for (i = 0; i < numFeatures; i++) {
-		userFeatures[i] = (float*) palloc(numUsers*sizeof(float));
-		for (j = 0; j < numUsers; j++)
-			userFeatures[i][j] = 0.1;
-	}
-	itemFeatures = (float**) palloc(numFeatures*sizeof(float*));
-	for (i = 0; i < numFeatures; i++) {
-		itemFeatures[i] = (float*) palloc(numItems*sizeof(float));
-		for (j = 0; j < numItems; j++)
-			itemFeatures[i][j] = 0.1;
-	}
+			/* With many users to score, their pending scores may
+			 * be worked out a block at a time, from everyone's
+			 * events. */
+			blockRow = -1;
+			(void) itemBlockScoring(recstate);
 
-	// First we need to count the number of events we'll be
-	// considering.
-	querystring = (char*) palloc(1024*sizeof(char));
-	numEvents = count_rows(eventtable);
+			/* The rated list is all of the items this user has
+			 * rated already. We store the ratings now and we'll
+			 * use them during calculation. */
+			numFound = 0;
+			if (recstate->userEvents) {
+				/* Everyone's events were read in at once. */
+				GenSparseModel *events = recstate->userEvents;
+				int row, j;
+
+				row = binarySearch(recstate->userEventIDs, userID, 0, events->numRows);
+				if (row >= 0) {
+					for (j = events->rowStart[row]; j < events->rowStart[row+1]; j++) {
+						int itemindex = events->colIndex[j];
+
+						if (itemindex < 0 || recstate->isRated[itemindex])
+							continue;
+
+						recstate->isRated[itemindex] = true;
+						recstate->ratedScore[itemindex] = events->values[j];
+						recstate->ratedItems[numFound++] = itemindex;
+					}
+					if (recstate->userBlockSize > 0)
+						blockRow = row;
+				}
+			} else {
+				int numRead;
+
+				/* An earlier query in this session may have read
+				 * them already. If not, one pass over the user's
+				 * events gets us the ratings and their count. */
+				profile = lookupUserProfile(recstate, userID);
+				if (profile) {
+					numEvents = profile->numValues;
+					eventItems = profile->IDs;
+					eventValues = profile->values;
+				} else
+					numEvents = fetchUserEvents(recstate, userID,
+						&eventItems, &eventValues, &numRead);
+
+				for (i = 0; i < numEvents; i++) {
+					/* Items we aren't predicting for can't be used, and
+					 * we only count the first rating for an item. */
+					int itemindex = itemIndex(recstate, eventItems[i]);
+
+					if (itemindex < 0 || recstate->isRated[itemindex])
+						continue;
+
+					recstate->isRated[itemindex] = true;
+					recstate->ratedScore[itemindex] = eventValues[i];
+					recstate->ratedItems[numFound++] = itemindex;
+				}
 
-	// Initialize the events array.
-	allEvents = (svd_node*) palloc(numEvents*sizeof(svd_node));
+				if (!profile) {
+					storeUserProfile(recstate, userID, numRead, numEvents,
+						eventItems, eventValues, 0.0);
+					pfree(eventItems);
+					pfree(eventValues);
+				}
+			}
 
-	sprintf(querystring,"SELECT r.%s,r.%s,r.%s FROM %s r ORDER BY r.%s;",
-		userkey,itemkey,eventval,eventtable,userkey);
+			/* It's possible that someone has rated no items. */
+			recstate->totalRatings = numFound;
+			if (recstate->totalRatings <= 0) {
+				recstate->coldStart = true;
+				pfree(querystring);
+				return false;
+			}
 
-	// Let's acquire all of our events and store them. Sorting initially by
-	// user ID avoids unnecessary binary searches.
-	queryDesc = recathon_queryStart(querystring,&recathoncontext);
-	planstate = queryDesc->planstate;
+			/* The user's block has their scores worked out already. */
+			if (blockRow >= 0) {
+				userBlockPending(recstate, blockRow);
+				break;
+			}
 
-	i = 0;
-	for (;;) {
-		svd_node new_svd;
+			/* The pending scores are for all of the items we have yet
+			 * to calculate ratings for. We need to maintain partial
+			 * scores and similarity sums for each one. The rated items
+			 * get them too, though a query leaving those out never
+			 * reads theirs. */
+			memset(recstate->pendingScore, 0, recstate->fullTotalItems*sizeof(float));
+			memset(recstate->pendingSim, 0, recstate->fullTotalItems*sizeof(float));
 
-		slot = ExecProcNode(planstate);
-		if (TupIsNull(slot)) break;
+			/* With another function, we apply the ratings and similarities
+			 * from the rated items to the unrated ones. It's good to get
+			 * this done early, as this will allow the operator to be
+			 * non-blocking, which is important. */
+			/* A query for the best few items may get away with
+			 * scoring only those that could be among them. */
+			if (recstate->thresholdTopK) {
+				recstate->itemCandidates = NULL;
+				if (thresholdItemCandidates(recstate))
+					break;
+			}
+			if (attributes->opType == OP_GENERATE || attributes->opType == OP_GENERATEJOIN ||
+			    recstate->itemCFmodel)
+				applyItemSimGenerate(recstate);
+			else
+				applyItemSim(recstate, attributes->recModelName);
+			break;
+		case userCosCF:
+		case userPearCF:
+			userindex = binarySearch(recstate->userList, userID, 0, recstate->totalUsers);
+
+			/* Without a model file, the neighbors take queries, so
+			 * we keep them and the average for the rest of the
+			 * session. */
+			profile = NULL;
+			numEvents = -1;
+			if (!recstate->modelFile)
+				profile = lookupUserProfile(recstate, userID);
+
+			/* The first thing we'll do is obtain the average rating. */
+			if (profile)
+				recstate->average = profile->average;
+			else if (recstate->userEvents) {
+				GenSparseModel *events = recstate->userEvents;
+				int row, j;
+				float sum = 0.0;
+
+				recstate->average = 0.0;
+				row = binarySearch(recstate->userEventIDs, userID, 0, events->numRows);
+				if (row >= 0 && events->rowStart[row+1] > events->rowStart[row]) {
+					for (j = events->rowStart[row]; j < events->rowStart[row+1]; j++)
+						sum += events->values[j];
+					recstate->average = sum / (events->rowStart[row+1] - events->rowStart[row]);
+				}
+			} else {
+				/* The events we read for this also count them. */
+				float sum = 0.0;
+
+				numEvents = fetchUserEvents(recstate, userID,
+					&eventItems, &eventValues, NULL);
+				for (i = 0; i < numEvents; i++)
+					sum += eventValues[i];
+				recstate->average = numEvents > 0 ? sum / numEvents : 0.0;
+				pfree(eventItems);
+				pfree(eventValues);
+			}
 
-		new_svd = createSVDnode(slot, userkey, itemkey, eventval, userIDs, itemIDs, numUsers, numItems);
+			/* Next, we need to store this user's similarity model
+			 * for easier access. It's indexed the same way as the
+			 * users in itemEvents, and users who aren't neighbors
+			 * stay at zero, which adds nothing to a prediction. */
+			if (!recstate->userSim)
+				recstate->userSim = (float*) MemoryContextAlloc(recstate->recContext,
+					(recstate->numEventUsers+1)*sizeof(float));
+			memset(recstate->userSim, 0, recstate->numEventUsers*sizeof(float));
 
-		allEvents[i] = new_svd;
+			/* We need to find the entire similarity table for this
+			 * user, which will be in two parts. */
+			if (attributes->opType == OP_GENERATE || attributes->opType == OP_GENERATEJOIN) {
+				/* With only the named users' rows, the WHERE clause
+				 * has no use for anyone else. */
+				if (recstate->userCFrows && !recstate->userCFmodel[userindex]) {
+					pfree(querystring);
+					return false;
+				}
+				for (i = 0; i < recstate->totalUsers; i++) {
+					int simindex;
+					float currentSim;
 
-		i++;
-		if (i >= numEvents) break;
-	}
+					if (i == userindex) continue;
+					if (i < userindex && !recstate->userCFrows)
+						currentSim = recstate->userCFmodel[i][userindex];
+					else
+						currentSim = recstate->userCFmodel[userindex][i];
 
-	recathon_queryEnd(queryDesc,recathoncontext);
+					simindex = binarySearch(recstate->eventUsers, recstate->userList[i],
+								0, recstate->numEventUsers);
+					if (simindex >= 0)
+						recstate->userSim[simindex] = currentSim;
+				}
+			} else if (profile) {
+				for (i = 0; i < profile->numValues; i++) {
+					int simindex = binarySearch(recstate->eventUsers, profile->IDs[i],
+								0, recstate->numEventUsers);
 
-	// We now have all of the events, so we can start training our features.
-	for (j = 0; j < 100; j++) {
-		for (i = 0; i < numFeatures; i++) {
-			float learn = 0.001;
-			float penalty = 0.002;
-			float *userVal = userFeatures[i];
-			float *itemVal = itemFeatures[i];
+					if (simindex >= 0)
+						recstate->userSim[simindex] = profile->values[i];
+				}
+			} else if (!modelFileUserSim(recstate, userID)) {
+				/* Without a model file, we query the model table,
+				 * which a parallel worker can't; the leader will. */
+				if (recstate->parallelWorker) {
+					recstate->deferUser = true;
+					pfree(querystring);
+					return false;
+				}
+				/* A symmetric model has all of the user's neighbors
+				 * under their own rows, so the second query is enough.
+				 * Both are index lookups, if the model table has the
+				 * indexes for them. */
+				if (!recstate->modelSymmetric) {
+					probe = scanProbe(recstate, attributes->recModelName, "user2");
+					if (probe)
+						probeStart(probe, userID);
+					else {
+						sprintf(querystring,"select * from %s where user1 < $1 and user2 = $1;",
+							attributes->recModelName);
+						queryDesc = recathon_queryStartCached(querystring,1,paramtypes,paramvalues,
+						&cplan,&recathoncontext);
+						planstate = queryDesc->planstate;
+					}
+					bindColumn(&usercol, "user1");
+					bindColumn(&simcol, "similarity");
 
-			for (k = 0; k < numEvents; k++) {
-				int userid;
-				int itemid;
-				float event, err, residual, temp;
-				svd_node current_svd;
+					for (;;) {
+						int currentUser, simindex;
+						float currentSim;
 
-				current_svd = allEvents[k];
-				userid = current_svd->userid;
-				itemid = current_svd->itemid;
-				event = current_svd->event;
-				// Need to reset residuals for each new
-				// iteration of the trainer.
-				if (i == 0)
-					current_svd->residual = 0;
-				residual = current_svd->residual;
+						hslot = probe ? probeNext(probe) : ExecProcNode(planstate);
+						if (TupIsNull(hslot)) break;
 
-				if (i == 0 && j == 0) {
-					err = event - (itemAvgs[itemid] + userOffsets[userid]);
-				} else {
-					err = event - predictRating(i, numFeatures, userid, itemid,
-							userFeatures, itemFeatures, residual);
+						currentUser = columnInt(hslot,&usercol);
+						if (probe && currentUser >= userID)
+							continue;
+						currentSim = columnFloat(hslot,&simcol);
+
+						simindex = binarySearch(recstate->eventUsers, currentUser,
+									0, recstate->numEventUsers);
+						if (simindex >= 0)
+							recstate->userSim[simindex] = currentSim;
+					}
+					if (!probe)
+						recathon_queryEndCached(queryDesc,cplan,recathoncontext);
 				}
-				temp = userVal[userid];
-				userVal[userid] += learn * ((err * itemVal[itemid]) - (penalty * userVal[userid]));
-				itemVal[itemid] += learn * ((err * temp) - (penalty * itemVal[itemid]));
 
-				// Store residuals.
-				if (i == 0)
-					current_svd->residual = userVal[userid] * itemVal[itemid];
-				else
-					current_svd->residual += userVal[userid] * itemVal[itemid];
+				/* Here's the second. */
+				probe = scanProbe(recstate, attributes->recModelName, "user1");
+				if (probe)
+					probeStart(probe, userID);
+				else {
+					sprintf(querystring,"select * from %s where user1 = $1;",
+						attributes->recModelName);
+					queryDesc = recathon_queryStartCached(querystring,1,paramtypes,paramvalues,
+					&cplan,&recathoncontext);
+					planstate = queryDesc->planstate;
+				}
+				bindColumn(&usercol, "user2");
+				bindColumn(&simcol, "similarity");
+
+				for (;;) {
+					int currentUser, simindex;
+					float currentSim;
+
+					hslot = probe ? probeNext(probe) : ExecProcNode(planstate);
+					if (TupIsNull(hslot)) break;
+
+					currentUser = columnInt(hslot,&usercol);
+					currentSim = columnFloat(hslot,&simcol);
+
+					simindex = binarySearch(recstate->eventUsers, currentUser,
+								0, recstate->numEventUsers);
+					if (simindex >= 0)
+						recstate->userSim[simindex] = currentSim;
+				}
+				if (!probe)
+					recathon_queryEndCached(queryDesc,cplan,recathoncontext);
+
+				if (profileCacheable(recstate)) {
+					int *neighbors = (int*) palloc((recstate->numEventUsers+1)*sizeof(int));
+					float *sims = (float*) palloc((recstate->numEventUsers+1)*sizeof(float));
+
+					numFound = 0;
+					for (i = 0; i < recstate->numEventUsers; i++) {
+						if (recstate->userSim[i] == 0.0)
+							continue;
+						neighbors[numFound] = recstate->eventUsers[i];
+						sims[numFound++] = recstate->userSim[i];
+					}
+					storeUserProfile(recstate, userID, numEvents, numFound,
+						neighbors, sims, recstate->average);
+					pfree(neighbors);
+					pfree(sims);
+				}
 			}
 
-			CHECK_FOR_INTERRUPTS();
-		}
+			/* With a neighborhood, only the most similar count. */
+			if (recstate->neighborhood > 0)
+				limitUserNeighbors(recstate);
+			break;
+		/* If this is a SVD recommender, we can pre-obtain the user features,
+		 * which stay fixed, and cut the I/O time in half. Of course, if this
+		 * is generated on-the-fly, this is done already. ALS models are
+		 * laid out the same way. */
+		case SVD:
+		case ALS:
+			recstate->userBlockRow = -1;
+			if (svdBlockScoring(recstate))
+				recstate->userBlockRow = svdUserBlock(recstate);
+			if (attributes->opType != OP_GENERATE && attributes->opType != OP_GENERATEJOIN) {
+				// Models can have any number of features up to the
+				// limit CREATE RECOMMENDER allows.
+				recstate->userFeatures = (float*) palloc(RECATHON_MAX_FEATURES*sizeof(float));
+				for (i = 0; i < RECATHON_MAX_FEATURES; i++)
+					recstate->userFeatures[i] = 0;
+				/* A model file has the user's factors to hand, and
+				 * so might an earlier query in this session. */
+				numFound = 0;
+				profile = NULL;
+				keepProfile = false;
+				if (modelFileUserFactors(recstate, userID))
+					numFound = 1;
+				else if (recstate->parallelWorker) {
+					/* The leader will query for this user. */
+					recstate->deferUser = true;
+					pfree(querystring);
+					return false;
+				} else if ((profile = lookupUserProfile(recstate, userID)) != NULL) {
+					memcpy(recstate->userFeatures, profile->values,
+						profile->numValues*sizeof(float));
+					numFound = 1;
+				} else {
+					/* What we read here is worth keeping. */
+					keepProfile = true;
+					probe = scanProbe(recstate, attributes->recModelName, "users");
+					if (probe)
+						probeStart(probe, userID);
+					else {
+						sprintf(querystring,"select * from %s where users = $1;",
+							attributes->recModelName);
+						queryDesc = recathon_queryStartCached(querystring,1,paramtypes,paramvalues,
+						&cplan,&recathoncontext);
+						planstate = queryDesc->planstate;
+					}
+					bindColumn(&featurescol, "features");
+					bindColumn(&featurecol, "feature");
+					bindColumn(&valuecol, "value");
+
+					for (;;) {
+						int feature;
+						float featValue;
+
+						hslot = probe ? probeNext(probe) : ExecProcNode(planstate);
+						if (TupIsNull(hslot)) break;
+
+						// The whole vector comes in one row, if the
+						// model was stored that way.
+						if (recstate->userModelArrays) {
+							columnFloatArray(hslot, &featurescol,
+								recstate->userFeatures, RECATHON_MAX_FEATURES);
+							numFound++;
+							continue;
+						}
+
+						feature = columnInt(hslot,&featurecol);
+						featValue = columnFloat(hslot,&valuecol);
+
+						if (feature >= 0 && feature < RECATHON_MAX_FEATURES)
+							recstate->userFeatures[feature] = featValue;
+						numFound++;
+					}
+
+					if (!probe)
+						recathon_queryEndCached(queryDesc,cplan,recathoncontext);
+				}
+
+				/* Users who arrived after the model was built can
+				 * still be served, by folding them in now. */
+				if (numFound == 0 && !foldInUser(recstate, userID)) {
+					recstate->coldStart = true;
+					break;
+				}
+				if (keepProfile)
+					storeUserProfile(recstate, userID, -1,
+						Min(recstate->numFeatures, RECATHON_MAX_FEATURES),
+						NULL, recstate->userFeatures, 0.0);
+
+				// With an approximate top-k index, we only score
+				// the items this user is likely to rate highly.
+				if (recstate->clusterItems)
+					probeItemClusters(recstate);
+			}
+			break;
+		default:
+			elog(ERROR, "invalid recommendation method in prepUserForRating()");
 	}
 
-	// Free up memory.
+	/* If we've gotten to this point, this is a valid user, so return true. */
 	pfree(querystring);
-	pfree(itemAvgs);
-	pfree(userOffsets);
-	pfree(allEvents);
-
-	// Return the relevant information.
-	recnode->numFeatures = numFeatures;
-	recnode->totalUsers = numUsers;
-	recnode->fullTotalItems = numItems;
-	recnode->userList = userIDs;
-	recnode->fullItemList = itemIDs;
-	recnode->SVDusermodel = userFeatures;
-	recnode->SVDitemmodel = itemFeatures;
+	return true;
 }
 
 /* ----------------------------------------------------------------
- *		itemCFgenerate
+ *		limitUserNeighbors
  *
- *		Generates a predicted RecScore for a given user and
- *		item, for a recommender that uses item-based
- *		collaborative filtering built on-the-fly.
+ *		Keeps only the neighborhood's worth of the current
+ *		user's most similar users in userSim, and lists them
+ *		in neighbors. The model keeps that many in each of
+ *		its rows, but half of a user's similarities are in
+ *		other users' rows, so a user can have more than that.
  * ----------------------------------------------------------------
  */
-float
-itemCFgenerate(RecScanState *recnode, int itemid, int itemindex)
-{
-	int i;
-	float recScore;
-	GenRating *currentItem;
-
-	// First, we grab the GenRating for this item ID.
-	currentItem = hashFind(recnode->pendingTable, itemid);
-	// In case there's some error.
-	if (!currentItem)
-		return -1;
-
-	// We're going to look through the similarity matrix for the
-	// numbers that correspond to this item, and find which of those
-	// also correspond to items this user rated. We will use that
-	// information to obtain the estimated rating.
-
-	for (i = itemindex+1; i < recnode->fullTotalItems; i++) {
-		int itemID;
-		float similarity;
-		GenRating *ratedItem;
-
-		itemID = recnode->fullItemList[i];
-		similarity = recnode->itemCFmodel[itemindex][i];
-
-		// Find the array slot this item ID corresponds to.
-		// If -1 is returned, then the item ID corresponds to
-		// another item we haven't rated, so we don't care.
-		ratedItem = hashFind(recnode->ratedTable,itemID);
-		if (ratedItem) {
-			currentItem->score += similarity*ratedItem->score;
-			if (similarity < 0)
-				similarity *= -1;
-			currentItem->totalSim += similarity;
-		}
-	}
+static void
+limitUserNeighbors(RecScanState *recstate) {
+	int i;
+	nbr_heap best;
+
+	if (!recstate->neighbors)
+		recstate->neighbors = (int*) MemoryContextAlloc(recstate->recContext,
+			recstate->neighborhood*sizeof(int));
 
-	if (currentItem->totalSim == 0) return 0;
+	best = nbrHeapCreate(recstate->neighborhood);
+	for (i = 0; i < recstate->numEventUsers; i++) {
+		if (recstate->userSim[i] != 0.0)
+			nbrHeapInsert(best, i, recstate->userSim[i]);
+	}
 
-	recScore = currentItem->score / currentItem->totalSim;
-	return recScore;
+	memset(recstate->userSim, 0, recstate->numEventUsers*sizeof(float));
+	for (i = 0; i < best->size; i++)
+		recstate->userSim[best->index[i]] = best->similarity[i];
+	memcpy(recstate->neighbors, best->index, best->size*sizeof(int));
+	recstate->numNeighbors = best->size;
+	qsort(recstate->neighbors, recstate->numNeighbors, sizeof(int), intCompare);
+	nbrHeapFree(best);
 }
 
 /* ----------------------------------------------------------------
- *		userCFgenerate
+ *		markRatedItems
  *
- *		Generates a predicted RecScore for a given user and
- *		item, for a recommender that uses user-based
- *		collaborative filtering built on-the-fly.
+ *		Marks the items a user has rated in isRated, for a
+ *		query that leaves them out. The item-based methods
+ *		have done this already, in preparing the user; for
+ *		the rest, we read their events. A parallel worker
+ *		has everyone's events to hand, or else the leader
+ *		takes the user. Returns false if it has to.
  * ----------------------------------------------------------------
  */
-float
-userCFgenerate(RecScanState *recnode, int itemid, int itemindex)
-{
-	float event, totalSim, average;
-	AttributeInfo *attributes;
-	// Query objects;
-	char *querystring;
-	QueryDesc *queryDesc;
-	PlanState *planstate;
-	TupleTableSlot *qslot;
-	MemoryContext recathoncontext;
-
-	attributes = (AttributeInfo*) recnode->attributes;
+static bool
+markRatedItems(RecScanState *recstate, int userID) {
+	int i, numEvents;
+	int *eventItems;
+	float *eventValues;
 
-	event = 0.0;
-	totalSim = 0.0;
-	average = recnode->average;
+	AttributeInfo *attributes = (AttributeInfo*) recstate->attributes;
 
-	/* We need to query the events table, so that we can
-	 * find all events for this item and match them up
-	 * with what we have in the similarity matrix. We note
-	 * that it's necessarily true that the user has not
-	 * rated these items. */
-	querystring = (char*) palloc(1024*sizeof(char));
-	sprintf(querystring,"select * from %s where %s = %d;",
-		attributes->eventtable,attributes->itemkey,itemid);
-	queryDesc = recathon_queryStart(querystring,&recathoncontext);
-	planstate = queryDesc->planstate;
+	switch ((recMethod) attributes->method) {
+		case itemCosCF:
+		case itemPearCF:
+		case itemJaccardCF:
+			if (recstate->isRated)
+				return true;
+			break;
+		default:
+			break;
+	}
 
-	for (;;) {
-		int currentUserID;
-		float currentRating, similarity;
-		GenRating *currentUser;
+	if (!recstate->isRated)
+		recstate->isRated = (bool*) MemoryContextAlloc(recstate->recContext,
+			recstate->fullTotalItems*sizeof(bool));
+	memset(recstate->isRated, 0, recstate->fullTotalItems*sizeof(bool));
 
-		qslot = ExecProcNode(planstate);
-		if (TupIsNull(qslot)) break;
+	if (recstate->userEvents) {
+		GenSparseModel *events = recstate->userEvents;
+		int row, j;
 
-		currentUserID = getTupleInt(qslot,attributes->userkey);
-		currentRating = getTupleFloat(qslot,attributes->eventval);
+		row = binarySearch(recstate->userEventIDs, userID, 0, events->numRows);
+		if (row >= 0) {
+			for (j = events->rowStart[row]; j < events->rowStart[row+1]; j++) {
+				if (events->colIndex[j] >= 0)
+					recstate->isRated[events->colIndex[j]] = true;
+			}
+		}
+		return true;
+	}
+	if (recstate->parallelWorker) {
+		recstate->deferUser = true;
+		return false;
+	}
 
-		currentUser = hashFind(recnode->simTable,currentUserID);
-		if (!currentUser) continue;
-		similarity = currentUser->totalSim;
+	numEvents = fetchUserEvents(recstate, userID, &eventItems, &eventValues, NULL);
+	for (i = 0; i < numEvents; i++) {
+		int itemindex = itemIndex(recstate, eventItems[i]);
 
-		event += (currentRating - average) * similarity;
-		// Poor man's absolute value of the similarity.
-		if (similarity < 0)
-			similarity *= -1;
-		totalSim += similarity;
+		if (itemindex >= 0)
+			recstate->isRated[itemindex] = true;
 	}
-	recathon_queryEnd(queryDesc,recathoncontext);
+	pfree(eventItems);
+	pfree(eventValues);
+	return true;
+}
 
-	if (totalSim == 0.0) return 0.0;
+/* ----------------------------------------------------------------
+ *		prepUserForRating
+ *
+ *		Prepares a user for scoring with prepareUser, between
+ *		the probes that trace it. Returns false if the user
+ *		can't be scored. Everything made for the last user
+ *		alone is in the scan's user context, which we empty
+ *		all at once, and the new user's goes there too; what
+ *		lasts for the whole scan is made in its recContext.
+ * ----------------------------------------------------------------
+ */
+bool
+prepUserForRating(RecScanState *recstate, int userID) {
+	bool valid;
+	MemoryContext oldcontext;
 
-	event /= totalSim;
-	event += average;
+	TRACE_POSTGRESQL_RECOMMEND_USER_START(userID);
+	recstate->coldStart = false;
+	MemoryContextReset(recstate->userContext);
+	recstate->userFeatures = NULL;
+	oldcontext = MemoryContextSwitchTo(recstate->userContext);
+	valid = prepareUser(recstate, userID);
+	MemoryContextSwitchTo(oldcontext);
 
-	return event;
+	// Someone with no events of their own gets the items
+	// everyone else likes, if the recommender ranks them.
+	if (recstate->coldStart) {
+		if (!recstate->popularChecked && recstate->parallelWorker) {
+			// Reading the ranking takes a query, which the
+			// leader can do.
+			recstate->deferUser = true;
+			valid = false;
+		} else if (loadPopularScores(recstate)) {
+			recstate->strategy = &popularStrategy;
+			if (recstate->clusterItems || recstate->candidateSource)
+				resetCandidates(recstate);
+			else
+				recstate->itemCandidates = NULL;
+			valid = true;
+		} else if (!valid)
+			elog(WARNING, "user %d has rated no items, no predictions can be made",
+				userID);
+	} else if (recstate->strategy == &popularStrategy)
+		recstate->strategy = NULL;
+
+	// What they've rated may be left out, which the candidates
+	// should know about.
+	if (valid && recstate->excludeRated && !markRatedItems(recstate, userID))
+		valid = false;
+
+	// The items to score may be up to another method.
+	if (valid && recstate->candidateSource && !recstate->coldStart)
+		pickMethodCandidates(recstate, userID);
+	if (valid && recstate->ensemble)
+		prepEnsembleUser(recstate, userID);
+	TRACE_POSTGRESQL_RECOMMEND_USER_DONE(userID, valid);
+
+	return valid;
 }
 
 /* ----------------------------------------------------------------
- *		SVDgenerate
+ *		prepEnsembleUser
  *
- *		Generates a predicted RecScore for a given user and
- *		item, for a recommender that uses SVD built
- *		on-the-fly.
+ *		Prepares a user for each of the other methods of an
+ *		ensemble. A method that can't score the user leaves
+ *		them to the rest.
  * ----------------------------------------------------------------
  */
-float
-SVDgenerate(RecScanState *recnode, int itemid, int itemindex)
-{
-	int i;
-	float **userFeatures, **itemFeatures;
-	float recscore = 0.0;
+static void
+prepEnsembleUser(RecScanState *recstate, int userID) {
+	ListCell *lc;
 
-	userFeatures = recnode->SVDusermodel;
-	itemFeatures = recnode->SVDitemmodel;
-
-	// At this point, our work is easy.
-	for (i = 0; i < recnode->numFeatures; i++)
-		recscore += userFeatures[i][recnode->userindex] * itemFeatures[i][itemindex];
+	foreach(lc, recstate->ensemble) {
+		RecScanState *member = (RecScanState*) lfirst(lc);
 
-	return recscore;
+		member->validUser = prepOtherMethod(member, userID);
+	}
 }
 
 /* ----------------------------------------------------------------
- *		applyItemSimGenerate
+ *		prepOtherMethod
  *
- *		The equivalent of applyItemSim for on-the-fly
- *		recommendation.
+ *		Prepares a user for a method other than the one the
+ *		scan is for, which an ensemble blends in or which
+ *		picks the candidates. Returns false if it can't
+ *		score the user.
  * ----------------------------------------------------------------
  */
-void
-applyItemSimGenerate(RecScanState *recnode)
-{
-	int i, j;
-	GenHash *ratedTable;
+static bool
+prepOtherMethod(RecScanState *member, int userID) {
+	AttributeInfo *memberattrs = (AttributeInfo*) member->attributes;
+
+	member->userindex = -1;
+	if (member->userList)
+		member->userindex = binarySearch(member->userList, userID,
+			0, member->totalUsers);
+
+	// An SVD model made on the fly only has the users it
+	// was made from.
+	if (member->userindex < 0 && FACTOR_METHOD(memberattrs->method) &&
+	    (memberattrs->opType == OP_GENERATE || memberattrs->opType == OP_GENERATEJOIN))
+		return false;
+	return prepUserForRating(member, userID);
+}
 
-	ratedTable = recnode->ratedTable;
+/* ----------------------------------------------------------------
+ *		pickMethodCandidates
+ *
+ *		For CANDIDATES FROM, has the method picking the
+ *		candidates score every item it knows for the user, a
+ *		batch at a time, and keeps the best of them that the
+ *		scan knows too, up to the limit. If the WHERE clause
+ *		limited the items, only those can be picked. They're
+ *		put in fullItemList order, as the only items the scan
+ *		goes on to score. A user the method can't score has
+ *		all of the items scored instead.
+ * ----------------------------------------------------------------
+ */
+static void
+pickMethodCandidates(RecScanState *recstate, int userID) {
+	int start, i, j, numItems, limit, numFound;
+	int *positions;
+	bool selected;
+	nbr_heap best;
+	RecScanState *source = recstate->candidateSource;
+
+	if (!prepOtherMethod(source, userID)) {
+		resetCandidates(recstate);
+		return;
+	}
 
-	// For every item we've rated, we need to obtain its similarity
-	// scores and apply them to the appropriate items. This is
-	// necessary because we're only storing half of the similarity
-	// matrix.
-	for (i = 0; i < ratedTable->hash; i++) {
-		GenRating *currentItem;
+	limit = ((AttributeInfo*) recstate->attributes)->candidateLimit;
+	best = nbrHeapCreate(Max(limit, 1));
+	positions = (int*) palloc(RECATHON_SCORE_BATCH*sizeof(int));
+	numItems = source->itemCandidates ? source->numCandidates : source->fullTotalItems;
+	for (start = 0; start < numItems; start += RECATHON_SCORE_BATCH) {
+		int count = Min(numItems - start, RECATHON_SCORE_BATCH);
 
-		for (currentItem = ratedTable->table[i]; currentItem;
-				currentItem = currentItem->next) {
-			int itemindex = currentItem->index;
+		CHECK_FOR_INTERRUPTS();
 
-			for (j = itemindex+1; j < recnode->fullTotalItems; j++) {
-				int itemID;
-				float similarity;
-				GenRating *pendingItem;
+		for (i = 0; i < count; i++)
+			source->batchItems[i] = source->itemCandidates ?
+				source->itemCandidates[start + i] : start + i;
+		scoreItemBatch(source, source->batchItems, count, source->batchScores);
+
+		// Once the heap is full, only the scores that beat the
+		// worst it holds are worth looking up.
+		selected = (best->size >= best->maxsize);
+		numFound = selected ? selectScores(source->batchScores, count,
+			best->similarity[0], true, positions) : count;
+		for (j = 0; j < numFound; j++) {
+			int itemindex;
+
+			i = selected ? positions[j] : j;
+			itemindex = itemIndex(recstate,
+				source->fullItemList[source->batchItems[i]]);
+			if (itemindex < 0)
+				continue;
+			if (recstate->excludeRated && recstate->isRated[itemindex])
+				continue;
+			if (recstate->baseCandidates &&
+			    binarySearch(recstate->baseCandidates, itemindex, 0,
+					recstate->numBaseCandidates) < 0)
+				continue;
+			nbrHeapInsert(best, itemindex, source->batchScores[i]);
+		}
+	}
+	pfree(positions);
 
-				itemID = recnode->fullItemList[j];
-				similarity = recnode->itemCFmodel[itemindex][j];
+	memcpy(recstate->itemCandidates, best->index, best->size*sizeof(int));
+	recstate->numCandidates = best->size;
+	qsort(recstate->itemCandidates, recstate->numCandidates, sizeof(int), intCompare);
+	nbrHeapFree(best);
+}
 
-				// If the similarity is 0, there's no point.
-				if (similarity == 0.0)
-					continue;
+/* ----------------------------------------------------------------
+ *		resetCandidates
+ *
+ *		Makes every item the scan may score a candidate: the
+ *		ones the WHERE clause limited the items to, if it did,
+ *		or else all of them.
+ * ----------------------------------------------------------------
+ */
+static void
+resetCandidates(RecScanState *recstate) {
+	int i;
 
-				// Find the array slot this item ID corresponds to.
-				// If -1 is returned, then the item ID corresponds to
-				// another item we've rated, so we don't care.
-				pendingItem = hashFind(recnode->pendingTable,itemID);
-				if (pendingItem) {
-					pendingItem->score += similarity*currentItem->score;
-					if (similarity < 0)
-						similarity *= -1;
-					pendingItem->totalSim += similarity;
-				}
-			}
-		}
+	if (recstate->baseCandidates) {
+		memcpy(recstate->itemCandidates, recstate->baseCandidates,
+			recstate->numBaseCandidates*sizeof(int));
+		recstate->numCandidates = recstate->numBaseCandidates;
+		return;
 	}
+	for (i = 0; i < recstate->fullTotalItems; i++)
+		recstate->itemCandidates[i] = i;
+	recstate->numCandidates = recstate->fullTotalItems;
 }
 
 /* ----------------------------------------------------------------
- *		prepUserForRating
+ *		loadRecViewUser
  *
- *		Given a user ID, we need to create some data
- *		structures that will allow us to efficiently
- *		predict ratings for this user.
+ *		Reads the predictions kept in the RecView for a
+ *		given user, best first. Returns how many there are,
+ *		which is zero for a user the view knows nothing of.
  * ----------------------------------------------------------------
  */
-bool
-prepUserForRating(RecScanState *recstate, int userID) {
-	int i, userindex;
+int
+loadRecViewUser(RecScanState *recstate, int userID) {
+	int numFound;
 	// Query objects.
 	char *querystring;
 	QueryDesc *queryDesc;
 	PlanState *planstate;
 	TupleTableSlot *hslot;
+	CachedPlan *cplan;
 	MemoryContext recathoncontext;
+	tuple_column itemcol, eventcol;
+	Oid paramtypes[1] = {INT4OID};
+	Datum paramvalues[1];
 
 	AttributeInfo *attributes = (AttributeInfo*) recstate->attributes;
-	attributes->userID = userID;
-
-	/* First off, we need to delete any existing structures. */
-	if (recstate->ratedTable) {
-		freeHash(recstate->ratedTable);
-		recstate->ratedTable = NULL;
-	}
-	if (recstate->pendingTable) {
-		freeHash(recstate->pendingTable);
-		recstate->pendingTable = NULL;
-	}
-	if (recstate->simTable) {
-		freeHash(recstate->simTable);
-		recstate->simTable = NULL;
-	}
-	if (recstate->userFeatures) {
-		pfree(recstate->userFeatures);
-		recstate->userFeatures = NULL;
-	}
 
-	/* INSERT FORMER LIST CODE HERE */
 	querystring = (char*) palloc(1024*sizeof(char));
+	sprintf(querystring,"select %s, %s from %s where %s = $1 order by %s desc;",
+		attributes->itemkey,attributes->eventval,
+		attributes->recViewName,attributes->userkey,
+		attributes->eventval);
+	paramvalues[0] = Int32GetDatum(userID);
+	queryDesc = recathon_queryStartCached(querystring,1,paramtypes,paramvalues,
+		&cplan,&recathoncontext);
+	planstate = queryDesc->planstate;
+	bindColumn(&itemcol, attributes->itemkey);
+	bindColumn(&eventcol, attributes->eventval);
 
-	switch ((recMethod) attributes->method) {
-		/* If this is an item-based CF recommender, we can pre-obtain
-		 * the ratings of this user, and add in their contributions to
-		 * the scores of all the other items. */
-		case itemCosCF:
-		case itemPearCF:
-			/* The rated list is all of the items this user has
-			 * rated already. We store the ratings now and we'll
-			 * use them during calculation. */
-			sprintf(querystring,"select count(*) from %s where %s = %d;",
-				attributes->eventtable,attributes->userkey,userID);
-			queryDesc = recathon_queryStart(querystring,&recathoncontext);
-			planstate = queryDesc->planstate;
-			hslot = ExecProcNode(planstate);
-			recstate->totalRatings = getTupleInt(hslot,"count");
-			recathon_queryEnd(queryDesc,recathoncontext);
+	numFound = 0;
+	while (numFound < recstate->viewSize) {
+		hslot = ExecProcNode(planstate);
+		if (TupIsNull(hslot)) break;
 
-			/* It's possible that someone has rated no items. */
-			if (recstate->totalRatings <= 0) {
-				elog(WARNING, "user %d has rated no items, no predictions can be made",
-					userID);
-				return false;
-			}
+		recstate->viewItems[numFound] = columnInt(hslot,&itemcol);
+		recstate->viewScores[numFound] = columnFloat(hslot,&eventcol);
+		numFound++;
+	}
+	recathon_queryEndCached(queryDesc,cplan,recathoncontext);
+	pfree(querystring);
 
-			recstate->ratedTable = hashCreate(recstate->totalRatings);
+	return numFound;
+}
 
-			/* Now to acquire the actual ratings. */
-			sprintf(querystring,"select * from %s where %s = %d order by %s;",
-				attributes->eventtable,attributes->userkey,
-				userID,attributes->itemkey);
-			queryDesc = recathon_queryStart(querystring,&recathoncontext);
-			planstate = queryDesc->planstate;
+/* ----------------------------------------------------------------
+ *		loadShardResults
+ *
+ *		Fetches the best topK predictions for each of a scan's
+ *		users from the nodes in serve_nodes, a list of libpq
+ *		connection strings separated by semicolons. A hash of
+ *		the user's ID picks the node that serves them, so that
+ *		it's always the same one, which keeps their profile
+ *		and their cached list. Each node is sent all of its
+ *		users at once, through dblink, and the nodes all work
+ *		at the same time; recathon_recommend_batch answers
+ *		there, from the recommender of the same name. User
+ *		i's predictions end up in viewItems and viewScores,
+ *		best first, from shardStart[i] up to shardStart[i+1].
+ *		Returns the number of nodes asked.
+ * ----------------------------------------------------------------
+ */
+int
+loadShardResults(RecScanState *recstate, char *nodelist) {
+	int i, k, numNodes, numAsked, topK;
+	int *shardOf, *counts;
+	bool *asked;
+	char *recname;
+	List *nodes;
+	ListCell *lc;
+	StringInfoData querystring, batchquery, userarray;
+	// Query objects.
+	QueryDesc *queryDesc;
+	TupleTableSlot *slot;
+	MemoryContext recathoncontext;
+	tuple_column usercol, itemcol, scorecol;
 
-			i = 0;
-			for (;;) {
-				int currentItem;
-				float currentRating;
-				GenRating *newItem;
+	AttributeInfo *attributes = (AttributeInfo*) recstate->attributes;
 
-				hslot = ExecProcNode(planstate);
-				if (TupIsNull(hslot)) break;
+	requireDblink("serve_nodes");
+	nodes = splitNodeList(nodelist);
+	numNodes = list_length(nodes);
+	if (numNodes == 0)
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("option \"serve_nodes\" of recommender \"%s\" lists no nodes",
+				attributes->recIndexName)));
+	recname = catalogueString(attributes->recIndexName, "recommendername");
+	topK = recstate->topK;
+
+	shardOf = (int*) palloc(Max(recstate->totalUsers,1)*sizeof(int));
+	for (i = 0; i < recstate->totalUsers; i++)
+		shardOf[i] = DatumGetUInt32(hash_uint32((uint32) recstate->userList[i])) % numNodes;
+
+	recstate->viewItems = (int*) palloc(Max(recstate->totalUsers*topK,1)*sizeof(int));
+	recstate->viewScores = (float*) palloc(Max(recstate->totalUsers*topK,1)*sizeof(float));
+	recstate->shardStart = (int*) palloc((recstate->totalUsers+1)*sizeof(int));
+	counts = (int*) palloc0(Max(recstate->totalUsers,1)*sizeof(int));
+	asked = (bool*) palloc0(numNodes*sizeof(bool));
+
+	// Start every node that has any of our users on them.
+	initStringInfo(&querystring);
+	initStringInfo(&batchquery);
+	initStringInfo(&userarray);
+	numAsked = 0;
+	k = 0;
+	foreach(lc, nodes) {
+		char connname[NAMEDATALEN];
+
+		resetStringInfo(&userarray);
+		appendStringInfoChar(&userarray, '{');
+		for (i = 0; i < recstate->totalUsers; i++) {
+			if (shardOf[i] != k)
+				continue;
+			if (userarray.len > 1)
+				appendStringInfoChar(&userarray, ',');
+			appendStringInfo(&userarray, "%d", recstate->userList[i]);
+		}
+		appendStringInfoChar(&userarray, '}');
+		if (userarray.len <= 2) {
+			k++;
+			continue;
+		}
 
-				currentItem = getTupleInt(hslot,attributes->itemkey);
-				currentRating = getTupleFloat(hslot,attributes->eventval);
+		snprintf(connname, NAMEDATALEN, "recathon_shard%d", k+1);
+		resetStringInfo(&querystring);
+		appendStringInfo(&querystring,"SELECT dblink_connect(%s, %s);",
+			quote_literal_cstr(connname),
+			quote_literal_cstr((char *) lfirst(lc)));
+		queryDesc = recathon_queryStart(querystring.data,&recathoncontext);
+		(void) ExecProcNode(queryDesc->planstate);
+		recathon_queryEnd(queryDesc,recathoncontext);
 
-				newItem = (GenRating*) palloc(sizeof(GenRating));
-				newItem->ID = currentItem;
-				newItem->index = binarySearch(recstate->fullItemList,currentItem,0,recstate->fullTotalItems);
-				newItem->score = currentRating;
-				newItem->next = NULL;
-				hashAdd(recstate->ratedTable, newItem);
+		resetStringInfo(&batchquery);
+		appendStringInfo(&batchquery,"SELECT userid, item, recscore FROM recathon_recommend_batch(%s, %s::integer[], %d)",
+			quote_literal_cstr(recname),quote_literal_cstr(userarray.data),topK);
+		resetStringInfo(&querystring);
+		appendStringInfo(&querystring,"SELECT dblink_send_query(%s, %s) AS sent;",
+			quote_literal_cstr(connname),
+			quote_literal_cstr(batchquery.data));
+		queryDesc = recathon_queryStart(querystring.data,&recathoncontext);
+		slot = ExecProcNode(queryDesc->planstate);
+		if (TupIsNull(slot) || getTupleInt(slot,"sent") != 1)
+			ereport(ERROR,
+				(errcode(ERRCODE_CONNECTION_FAILURE),
+				 errmsg("could not send the recommendation query to serving node %d",k+1)));
+		recathon_queryEnd(queryDesc,recathoncontext);
 
-				i++;
-				if (i >= recstate->totalRatings) break;
-			}
-			recathon_queryEnd(queryDesc,recathoncontext);
+		asked[k] = true;
+		numAsked++;
+		k++;
+	}
 
-			/* Quick error protection. Again, I don't know how this could
-			 * possibly happen, but better safe than sorry. */
-			recstate->totalRatings = i;
-			if (recstate->totalRatings <= 0) {
-				elog(WARNING, "user %d has rated no items, no predictions can be made",
-					userID);
-				return false;
-			}
+	// Collect each node's answer. It has each user's best first, in
+	// the order we sent them, leaving out any it had nothing for, so
+	// we follow along in userList.
+	for (k = 0; k < numNodes; k++) {
+		char connname[NAMEDATALEN];
+		int next = 0;
 
-			/* The pending list is all of the items we have yet to
-			 * calculate ratings for. We need to maintain partial
-			 * scores and similarity sums for each one. In this version
-			 * of the code, note that we rate all items. */
-			recstate->pendingTable = hashCreate(recstate->fullTotalItems);
-			for (i = 0; i < recstate->fullTotalItems; i++) {
-				GenRating *newItem;
-
-				newItem = (GenRating*) palloc(sizeof(GenRating));
-				newItem->ID = recstate->fullItemList[i];
-				/* The pending list doesn't need indexes. */
-				newItem->index = -1;
-				newItem->score = 0.0;
-				newItem->totalSim = 0.0;
-				newItem->next = NULL;
-				hashAdd(recstate->pendingTable, newItem);
-			}
+		if (!asked[k])
+			continue;
 
-			/* With another function, we apply the ratings and similarities
-			 * from the rated items to the unrated ones. It's good to get
-			 * this done early, as this will allow the operator to be
-			 * non-blocking, which is important. */
-			if (attributes->opType == OP_GENERATE || attributes->opType == OP_GENERATEJOIN)
-				applyItemSimGenerate(recstate);
-			else
-				applyItemSim(recstate, attributes->recModelName);
-			break;
-		case userCosCF:
-		case userPearCF:
-			userindex = binarySearch(recstate->userList, userID, 0, recstate->totalUsers);
+		snprintf(connname, NAMEDATALEN, "recathon_shard%d", k+1);
+		resetStringInfo(&querystring);
+		appendStringInfo(&querystring,"SELECT userid, item, recscore FROM dblink_get_result(%s) AS t(userid integer, item integer, recscore real);",
+			quote_literal_cstr(connname));
+		queryDesc = recathon_queryStart(querystring.data,&recathoncontext);
+		bindColumn(&usercol, "userid");
+		bindColumn(&itemcol, "item");
+		bindColumn(&scorecol, "recscore");
+		for (;;) {
+			int userID, pos;
+
+			slot = ExecProcNode(queryDesc->planstate);
+			if (TupIsNull(slot)) break;
+
+			userID = columnInt(slot,&usercol);
+			while (next < recstate->totalUsers &&
+			       (shardOf[next] != k || recstate->userList[next] != userID))
+				next++;
+			if (next >= recstate->totalUsers)
+				ereport(ERROR,
+					(errcode(ERRCODE_DATA_EXCEPTION),
+					 errmsg("serving node %d answered for user %d out of turn",
+						k+1, userID)));
+			if (counts[next] >= topK)
+				continue;
+
+			pos = next*topK + counts[next]++;
+			recstate->viewItems[pos] = columnInt(slot,&itemcol);
+			recstate->viewScores[pos] = columnFloat(slot,&scorecol);
+		}
+		recathon_queryEnd(queryDesc,recathoncontext);
+		// The connection isn't free again until it has given us
+		// its empty result.
+		queryDesc = recathon_queryStart(querystring.data,&recathoncontext);
+		(void) ExecProcNode(queryDesc->planstate);
+		recathon_queryEnd(queryDesc,recathoncontext);
 
-			/* The first thing we'll do is obtain the average rating. */
-			sprintf(querystring,"select avg(%s) as average from %s where %s = %d;",
-				attributes->eventval,attributes->eventtable,
-				attributes->userkey,userID);
-			queryDesc = recathon_queryStart(querystring,&recathoncontext);
-			planstate = queryDesc->planstate;
+		resetStringInfo(&querystring);
+		appendStringInfo(&querystring,"SELECT dblink_disconnect(%s);",
+			quote_literal_cstr(connname));
+		queryDesc = recathon_queryStart(querystring.data,&recathoncontext);
+		(void) ExecProcNode(queryDesc->planstate);
+		recathon_queryEnd(queryDesc,recathoncontext);
+	}
 
-			hslot = ExecProcNode(planstate);
-			recstate->average = getTupleFloat(hslot,"average");
-			recathon_queryEnd(queryDesc,recathoncontext);
+	// Close up the gaps, so each user's predictions follow the last's.
+	recstate->shardStart[0] = 0;
+	for (i = 0; i < recstate->totalUsers; i++) {
+		int start = recstate->shardStart[i];
 
-			/* Next, we need to store this user's similarity model
-			 * in a hash table for easier access. We base the table on
-			 * the number of items we have to rate - a close enough
-			 * approximation that we won't have much trouble. */
-			recstate->simTable = hashCreate(recstate->fullTotalItems);
+		memmove(recstate->viewItems + start, recstate->viewItems + i*topK,
+			counts[i]*sizeof(int));
+		memmove(recstate->viewScores + start, recstate->viewScores + i*topK,
+			counts[i]*sizeof(float));
+		recstate->shardStart[i+1] = start + counts[i];
+	}
 
-			/* We need to find the entire similarity table for this
-			 * user, which will be in two parts. */
-			if (attributes->opType == OP_GENERATE || attributes->opType == OP_GENERATEJOIN) {
-				for (i = 0; i < userindex; i++) {
-					int currentUser;
-					float currentSim;
-					GenRating *newUser;
+	pfree(shardOf);
+	pfree(counts);
+	pfree(asked);
+	pfree(querystring.data);
+	pfree(batchquery.data);
+	pfree(userarray.data);
+	list_free_deep(nodes);
 
-					currentUser = recstate->userList[i];
-					currentSim = recstate->userCFmodel[i][userindex];
+	return numAsked;
+}
 
-					newUser = (GenRating*) palloc(sizeof(GenRating));
-					newUser->ID = currentUser;
-					newUser->index = i;
-					newUser->totalSim = currentSim;
-					newUser->next = NULL;
-					hashAdd(recstate->simTable, newUser);
-				}
+/* ----------------------------------------------------------------
+ *		itemCFpredict
+ *
+ *		Generates a predicted RecScore for a given user and
+ *		item, for a recommender that uses item-based
+ *		collaborative filtering. All of the similarity
+ *		contributions were already gathered by applyItemSim,
+ *		so this is just a lookup.
+ * ----------------------------------------------------------------
+ */
+float
+itemCFpredict(RecScanState *recnode, int itemid, int itemindex)
+{
+	// In case there's some error.
+	if (itemindex < 0)
+		return -1;
 
-				for (i = userindex+1; i < recstate->totalUsers; i++) {
-					int currentUser;
-					float currentSim;
-					GenRating *newUser;
+	if (recnode->pendingSim[itemindex] == 0) return 0;
 
-					currentUser = recstate->userList[i];
-					currentSim = recstate->userCFmodel[userindex][i];
+	return recnode->pendingScore[itemindex] / recnode->pendingSim[itemindex];
+}
 
-					newUser = (GenRating*) palloc(sizeof(GenRating));
-					newUser->ID = currentUser;
-					newUser->index = i;
-					newUser->totalSim = currentSim;
-					newUser->next = NULL;
-					hashAdd(recstate->simTable, newUser);
-				}
-			} else {
-				sprintf(querystring,"select * from %s where user1 < %d and user2 = %d;",
-					attributes->recModelName,attributes->userID,
-					attributes->userID);
-				queryDesc = recathon_queryStart(querystring,&recathoncontext);
-				planstate = queryDesc->planstate;
+/* ----------------------------------------------------------------
+ *		userCFpredict
+ *
+ *		Generates a predicted RecScore for a given user and
+ *		item, for a recommender that uses user-based
+ *		collaborative filtering.
+ * ----------------------------------------------------------------
+ */
+float
+userCFpredict(RecScanState *recnode, int itemid, int itemindex)
+{
+	int i, n, rowstart, rowend;
+	float event, totalSim, average;
+	GenSparseModel *itemEvents;
 
-				for (;;) {
-					int currentUser;
-					float currentSim;
-					GenRating *newUser;
+	event = 0.0;
+	totalSim = 0.0;
+	average = recnode->average;
+	itemEvents = recnode->itemEvents;
+
+	if (!itemEvents || itemindex < 0 || itemindex >= itemEvents->numRows)
+		return 0.0;
+
+	/* With a neighborhood smaller than the item's raters, we
+	 * look each neighbor up among them instead, which the row
+	 * lets us do by being in user order. */
+	rowstart = itemEvents->rowStart[itemindex];
+	rowend = itemEvents->rowStart[itemindex+1];
+	if (recnode->neighborhood > 0 && recnode->numNeighbors < rowend - rowstart) {
+		for (n = 0; n < recnode->numNeighbors; n++) {
+			float similarity;
 
-					hslot = ExecProcNode(planstate);
-					if (TupIsNull(hslot)) break;
+			i = binarySearch(itemEvents->colIndex, recnode->neighbors[n],
+				rowstart, rowend);
+			if (i < 0) continue;
+			similarity = recnode->userSim[recnode->neighbors[n]];
 
-					currentUser = getTupleInt(hslot,"user1");
-					currentSim = getTupleFloat(hslot,"similarity");
-
-					newUser = (GenRating*) palloc(sizeof(GenRating));
-					newUser->ID = currentUser;
-					/* Pre-generated recommendation doesn't need
-					 * indexes. */
-					newUser->index = -1;
-					newUser->totalSim = currentSim;
-					newUser->next = NULL;
-					hashAdd(recstate->simTable, newUser);
-				}
-				recathon_queryEnd(queryDesc,recathoncontext);
+			event += (itemEvents->values[i] - average) * similarity;
+			totalSim += similarity < 0 ? -similarity : similarity;
+		}
+	} else {
+		/* We go through the users who rated this item and match
+		 * them up with what we have in the similarity table. We
+		 * note that it's necessarily true that the user has not
+		 * rated these items. */
+		for (i = rowstart; i < rowend; i++) {
+			float currentRating, similarity;
+
+			// Users who aren't neighbors have no similarity.
+			similarity = recnode->userSim[itemEvents->colIndex[i]];
+			if (similarity == 0.0) continue;
+			currentRating = itemEvents->values[i];
 
-				/* Here's the second. */
-				sprintf(querystring,"select * from %s where user1 = %d;",
-					attributes->recModelName,attributes->userID);
-				queryDesc = recathon_queryStart(querystring,&recathoncontext);
-				planstate = queryDesc->planstate;
+			event += (currentRating - average) * similarity;
+			// Poor man's absolute value of the similarity.
+			if (similarity < 0)
+				similarity *= -1;
+			totalSim += similarity;
+		}
+	}
 
-				for (;;) {
-					int currentUser;
-					float currentSim;
-					GenRating *newUser;
+	if (totalSim == 0.0) return 0.0;
 
-					hslot = ExecProcNode(planstate);
-					if (TupIsNull(hslot)) break;
+	event /= totalSim;
+	event += average;
 
-					currentUser = getTupleInt(hslot,"user2");
-					currentSim = getTupleFloat(hslot,"similarity");
-
-					newUser = (GenRating*) palloc(sizeof(GenRating));
-					newUser->ID = currentUser;
-					/* Pre-generated recommendation doesn't need
-					 * indexes. */
-					newUser->index = -1;
-					newUser->totalSim = currentSim;
-					newUser->next = NULL;
-					hashAdd(recstate->simTable, newUser);
-				}
-				recathon_queryEnd(queryDesc,recathoncontext);
-			}
+	return event;
+}
 
-			break;
-		/* If this is a SVD recommender, we can pre-obtain the user features,
-		 * which stay fixed, and cut the I/O time in half. Of course, if this
-		 * is generated on-the-fly, this is done already. */
-		case SVD:
-			if (attributes->opType != OP_GENERATE && attributes->opType != OP_GENERATEJOIN) {
-				recstate->userFeatures = (float*) palloc(50*sizeof(float));
-				for (i = 0; i < 50; i++)
-					recstate->userFeatures[i] = 0;
-				sprintf(querystring,"select * from %s where users = %d;",
-					attributes->recModelName,userID);
-				queryDesc = recathon_queryStart(querystring,&recathoncontext);
-				planstate = queryDesc->planstate;
+/* ----------------------------------------------------------------
+ *		SVDpredict
+ *
+ *		Generates a predicted RecScore for a given user and
+ *		item, for a recommender that uses SVD. The item model
+ *		was loaded into recnode->SVDitemmodel when the scan
+ *		started, with one row per item in fullItemList, or
+ *		into recnode->SVDitemHalf if it's kept in half
+ *		precision.
+ * ----------------------------------------------------------------
+ */
+float
+SVDpredict(RecScanState *recnode, int itemid, int itemindex)
+{
+	float *itemVec;
 
-				for (;;) {
-					int feature;
-					float featValue;
+	if (itemindex < 0)
+		return 0.0;
+
+	if (recnode->SVDitemHalf)
+		return factorDotHalf(recnode->userFeatures,
+			recnode->SVDitemHalf + (Size) itemindex * recnode->numFeatures,
+			recnode->numFeatures);
+	if (!recnode->SVDitemmodel)
+		return 0.0;
 
-					hslot = ExecProcNode(planstate);
-					if (TupIsNull(hslot)) break;
+	itemVec = recnode->SVDitemmodel + (Size) itemindex * recnode->numFeatures;
+	return factorDot(itemVec, recnode->userFeatures, recnode->numFeatures);
+}
 
-					feature = getTupleInt(hslot,"feature");
-					featValue = getTupleFloat(hslot,"value");
+/* ----------------------------------------------------------------
+ *		itemCFpredictBatch
+ *
+ *		itemCFpredict, for a batch of items.
+ * ----------------------------------------------------------------
+ */
+static void
+itemCFpredictBatch(RecScanState *recnode, const int *itemindexes, int n,
+		float *scores) {
+	int i;
+	const float *pendingScore = recnode->pendingScore;
+	const float *pendingSim = recnode->pendingSim;
 
-					recstate->userFeatures[feature] = featValue;
-				}
+	for (i = 0; i < n; i++) {
+		int itemindex = itemindexes[i];
 
-				recathon_queryEnd(queryDesc,recathoncontext);
-			}
-			break;
-		default:
-			elog(ERROR, "invalid recommendation method in prepUserForRating()");
+		if (itemindex < 0)
+			scores[i] = -1;
+		else if (pendingSim[itemindex] == 0)
+			scores[i] = 0;
+		else
+			scores[i] = pendingScore[itemindex] / pendingSim[itemindex];
 	}
-
-	/* If we've gotten to this point, this is a valid user, so return true. */
-	pfree(querystring);
-	return true;
 }
 
 /* ----------------------------------------------------------------
- *		hashCreate
+ *		itemJaccardPredictBatch
  *
- *		Creates a new hash table.
+ *		itemJaccardScore for a built model, for a batch of
+ *		items. Everything was added in by applyItemSim.
  * ----------------------------------------------------------------
  */
-GenHash*
-hashCreate(int totalItems)
-{
-	int hash;
-	GenHash *newHashTable;
+static void
+itemJaccardPredictBatch(RecScanState *recnode, const int *itemindexes, int n,
+		float *scores) {
+	int i;
+	const float *pendingSim = recnode->pendingSim;
 
-	if (totalItems <= 10) hash = totalItems;
-	else hash = totalItems / 3;
+	for (i = 0; i < n; i++)
+		scores[i] = itemindexes[i] < 0 ? -1 : pendingSim[itemindexes[i]];
+}
 
-	newHashTable = (GenHash*) palloc(sizeof(GenHash));
-	newHashTable->hash = hash;
-	newHashTable->table = (GenRating**) palloc0(hash*sizeof(GenRating));
+/* Copies the block's scores for a batch of items, for the batch scorers. */
+static void
+svdBlockBatch(RecScanState *recnode, const int *itemindexes, int n,
+		float *scores) {
+	const float *row = recnode->userBlockScore +
+		(Size) recnode->userBlockRow * recnode->fullTotalItems;
+	int i;
 
-	return newHashTable;
+	for (i = 0; i < n; i++)
+		scores[i] = itemindexes[i] < 0 ? 0.0 : row[itemindexes[i]];
 }
 
 /* ----------------------------------------------------------------
- *		hashAdd
+ *		SVDpredictBatch
  *
- *		Adds an item to the hash table. We're creating the
- *		hash table so that all of the items are in
- *		increasing order, but we're inserting all the items
- *		that way anyway, so we don't need to enfoce it.
+ *		SVDpredict, for a batch of items. The user's vector
+ *		stays where it is while the item rows go past it.
  * ----------------------------------------------------------------
  */
-void
-hashAdd(GenHash *table, GenRating *item)
-{
-	int hashval;
-	GenRating *tempRating;
+static void
+SVDpredictBatch(RecScanState *recnode, const int *itemindexes, int n,
+		float *scores) {
+	int i, numFeatures;
+	const float *userVec;
+
+	if (recnode->userBlockSize > 0 && recnode->userBlockRow >= 0) {
+		svdBlockBatch(recnode, itemindexes, n, scores);
+		return;
+	}
 
-	hashval = item->ID % table->hash;
-	tempRating = table->table[hashval];
+	numFeatures = recnode->numFeatures;
+	userVec = recnode->userFeatures;
 
-	if (!tempRating) {
-		table->table[hashval] = item;
+	if (recnode->SVDitemHalf) {
+		for (i = 0; i < n; i++)
+			scores[i] = itemindexes[i] < 0 ? 0.0 :
+				factorDotHalf(userVec, recnode->SVDitemHalf +
+					(Size) itemindexes[i] * numFeatures, numFeatures);
 		return;
 	}
 
-	while (tempRating->next)
-		tempRating = tempRating->next;
-
-	tempRating->next = item;
+	for (i = 0; i < n; i++) {
+		if (itemindexes[i] < 0 || !recnode->SVDitemmodel)
+			scores[i] = 0.0;
+		else
+			scores[i] = factorDot(recnode->SVDitemmodel +
+				(Size) itemindexes[i] * numFeatures, userVec, numFeatures);
+	}
 }
 
 /* ----------------------------------------------------------------
- *		hashFind
+ *		SVDgenerateBatch
  *
- *		Locate an item in the hash table. Returns NULL if
- *		not found.
+ *		SVDgenerate, for a batch of items.
  * ----------------------------------------------------------------
  */
-GenRating*
-hashFind(GenHash *table, int itemID)
-{
-	int hashval;
-	GenRating *tempRating;
-
-	hashval = itemID % table->hash;
-	tempRating = table->table[hashval];
-
-	while (tempRating) {
-		if (tempRating->ID == itemID)
-			return tempRating;
-		if (tempRating->ID > itemID)
-			return NULL;
-		tempRating = tempRating->next;
+static void
+SVDgenerateBatch(RecScanState *recnode, const int *itemindexes, int n,
+		float *scores) {
+	int i, numFeatures;
+	const float *userVec;
+
+	if (recnode->userBlockSize > 0 && recnode->userBlockRow >= 0) {
+		svdBlockBatch(recnode, itemindexes, n, scores);
+		return;
 	}
 
-	return NULL;
+	numFeatures = recnode->numFeatures;
+	userVec = recnode->SVDusermodel + (Size) recnode->userindex * numFeatures;
+
+	for (i = 0; i < n; i++)
+		scores[i] = factorDot(userVec, recnode->SVDitemmodel +
+			(Size) itemindexes[i] * numFeatures, numFeatures);
 }
 
 /* ----------------------------------------------------------------
- *		freeHash
+ *		FACTOR_SCORERS
  *
- *		Free a hash table.
+ *		Makes SVDpredict and SVDpredictBatch for one way of
+ *		keeping the item model, given the rows and the dot
+ *		product that reads them, so that scoring an item
+ *		doesn't ask how the model is kept.
  * ----------------------------------------------------------------
  */
-void
-freeHash(GenHash *table) {
-	int i;
+#define FACTOR_SCORERS(single, batch, itemrows, dot) \
+static float \
+single(RecScanState *recnode, int itemid, int itemindex) \
+{ \
+	if (itemindex < 0) \
+		return 0.0; \
+	return dot(recnode->userFeatures, recnode->itemrows + \
+		(Size) itemindex * recnode->numFeatures, recnode->numFeatures); \
+} \
+\
+static void \
+batch(RecScanState *recnode, const int *itemindexes, int n, \
+		float *scores) { \
+	int i, numFeatures; \
+	const float *userVec; \
+\
+	if (recnode->userBlockSize > 0 && recnode->userBlockRow >= 0) { \
+		svdBlockBatch(recnode, itemindexes, n, scores); \
+		return; \
+	} \
+\
+	numFeatures = recnode->numFeatures; \
+	userVec = recnode->userFeatures; \
+	for (i = 0; i < n; i++) \
+		scores[i] = itemindexes[i] < 0 ? 0.0 : dot(userVec, \
+			recnode->itemrows + (Size) itemindexes[i] * numFeatures, \
+			numFeatures); \
+}
 
-	if (!table)
-		return;
+FACTOR_SCORERS(SVDpredictFloat, SVDpredictFloatBatch, SVDitemmodel, factorDot)
+FACTOR_SCORERS(SVDpredictHalf, SVDpredictHalfBatch, SVDitemHalf, factorDotHalf)
+#undef FACTOR_SCORERS
 
-	for (i = 0; i < table->hash; i++) {
-		GenRating *tempRating;
+/* ----------------------------------------------------------------
+ *		ITEM_SIM_GENERATE_BATCH
+ *
+ *		Makes a batch scorer for an item-based model built on
+ *		the fly, as itemCFgenerate or itemJaccardScore do it,
+ *		for a model whose columns are packed or aren't. Since
+ *		both are constants, the row loop is made for the one
+ *		case, without asking for each entry.
+ * ----------------------------------------------------------------
+ */
+#define ITEM_SIM_GENERATE_BATCH(name, PACKED, JACCARD) \
+static void \
+name(RecScanState *recnode, const int *itemindexes, int n, \
+		float *scores) { \
+	int i, j; \
+	GenSparseModel *itemmodel = recnode->itemCFmodel; \
+	const bool *isRated = recnode->isRated; \
+	const float *ratedScore = recnode->ratedScore; \
+\
+	for (i = 0; i < n; i++) { \
+		int itemindex = itemindexes[i], start, len; \
+		const int *cols; \
+		const float *values; \
+		float score, totalSim; \
+\
+		if (itemindex < 0) { \
+			scores[i] = -1; \
+			continue; \
+		} \
+		start = itemmodel->rowStart[itemindex]; \
+		len = itemmodel->rowStart[itemindex+1] - start; \
+		cols = (PACKED) ? sparseRowColumns(itemmodel, itemindex, NULL) : \
+			itemmodel->colIndex + start; \
+		values = itemmodel->values + start; \
+		score = (JACCARD) ? 0.0 : recnode->pendingScore[itemindex]; \
+		totalSim = recnode->pendingSim[itemindex]; \
+\
+		for (j = 0; j < len; j++) { \
+			float similarity; \
+\
+			if (!isRated[cols[j]]) \
+				continue; \
+			similarity = values[j]; \
+			if (JACCARD) \
+				totalSim += similarity; \
+			else { \
+				score += similarity * ratedScore[cols[j]]; \
+				totalSim += similarity < 0 ? -similarity : similarity; \
+			} \
+		} \
+\
+		if (JACCARD) \
+			scores[i] = totalSim; \
+		else \
+			scores[i] = totalSim == 0 ? 0 : score / totalSim; \
+	} \
+}
 
-		tempRating = table->table[i];
-		while (tempRating) {
-			GenRating *tempRating2 = tempRating->next;
-			pfree(tempRating);
-			tempRating = tempRating2;
-		}
-	}
+ITEM_SIM_GENERATE_BATCH(itemCFgenerateBatch, false, false)
+ITEM_SIM_GENERATE_BATCH(itemCFgeneratePackedBatch, true, false)
+ITEM_SIM_GENERATE_BATCH(itemJaccardGenerateBatch, false, true)
+ITEM_SIM_GENERATE_BATCH(itemJaccardGeneratePackedBatch, true, true)
+#undef ITEM_SIM_GENERATE_BATCH
 
-	pfree(table->table);
-	pfree(table);
+/* itemJaccardScore, once everything has been added in. */
+static float
+itemJaccardPredict(RecScanState *recnode, int itemid, int itemindex)
+{
+	return itemindex < 0 ? -1 : recnode->pendingSim[itemindex];
 }
 
 /* ----------------------------------------------------------------
- *		itemCFpredict
+ *		USER_CF_SCORERS
  *
- *		Generates a predicted RecScore for a given user and
- *		item, for a recommender that uses item-based
- *		collaborative filtering.
+ *		Makes userCFpredict and a batch scorer for it, for a
+ *		recommender with a neighborhood or without one. One
+ *		without never needs to look its neighbors up.
  * ----------------------------------------------------------------
  */
-float
-itemCFpredict(RecScanState *recnode, char *itemmodel, int itemid)
+#define USER_CF_SCORERS(single, batch, NEIGHBORS) \
+static float \
+single(RecScanState *recnode, int itemid, int itemindex) \
+{ \
+	int i, n, rowstart, rowend; \
+	float event, totalSim, average; \
+	const float *userSim; \
+	GenSparseModel *itemEvents = recnode->itemEvents; \
+\
+	if (!itemEvents || itemindex < 0 || itemindex >= itemEvents->numRows) \
+		return 0.0; \
+\
+	event = 0.0; \
+	totalSim = 0.0; \
+	average = recnode->average; \
+	userSim = recnode->userSim; \
+	rowstart = itemEvents->rowStart[itemindex]; \
+	rowend = itemEvents->rowStart[itemindex+1]; \
+	if ((NEIGHBORS) && recnode->numNeighbors < rowend - rowstart) { \
+		for (n = 0; n < recnode->numNeighbors; n++) { \
+			float similarity; \
+\
+			i = binarySearch(itemEvents->colIndex, recnode->neighbors[n], \
+				rowstart, rowend); \
+			if (i < 0) continue; \
+			similarity = userSim[recnode->neighbors[n]]; \
+\
+			event += (itemEvents->values[i] - average) * similarity; \
+			totalSim += similarity < 0 ? -similarity : similarity; \
+		} \
+	} else { \
+		for (i = rowstart; i < rowend; i++) { \
+			float similarity = userSim[itemEvents->colIndex[i]]; \
+\
+			if (similarity == 0.0) continue; \
+			event += (itemEvents->values[i] - average) * similarity; \
+			totalSim += similarity < 0 ? -similarity : similarity; \
+		} \
+	} \
+\
+	if (totalSim == 0.0) return 0.0; \
+	return event / totalSim + average; \
+} \
+\
+static void \
+batch(RecScanState *recnode, const int *itemindexes, int n, \
+		float *scores) { \
+	int i; \
+\
+	for (i = 0; i < n; i++) \
+		scores[i] = single(recnode, -1, itemindexes[i]); \
+}
+
+USER_CF_SCORERS(userCFneighborsPredict, userCFneighborsBatch, true)
+USER_CF_SCORERS(userCFallPredict, userCFallBatch, false)
+#undef USER_CF_SCORERS
+
+/* A method we don't know how to score. */
+static float
+unknownScore(RecScanState *recnode, int itemid, int itemindex)
 {
-	float recScore;
-	GenRating *currentItem;
-	// Query objects.
+	return -1;
+}
+
+/* ----------------------------------------------------------------
+ *		loadPopularScores
+ *
+ *		Reads the ranking buildPopularityModel made for the
+ *		recommender, the first time a user with no events
+ *		comes up, into an array indexed like fullItemList.
+ *		Items it doesn't have score zero. Returns false if
+ *		there's no ranking to read.
+ * ----------------------------------------------------------------
+ */
+static bool
+loadPopularScores(RecScanState *recstate) {
+	char *popularname;
+	RangeVar *popularrv;
+	// Objects for querying.
 	char *querystring;
 	QueryDesc *queryDesc;
 	PlanState *planstate;
 	TupleTableSlot *slot;
 	MemoryContext recathoncontext;
+	tuple_column itemcol, scorecol;
 
-	// First, we grab the GenRating for this item ID.
-	currentItem = hashFind(recnode->pendingTable, itemid);
-	// In case there's some error.
-	if (!currentItem)
-		return -1;
+	AttributeInfo *attributes = (AttributeInfo*) recstate->attributes;
 
-	querystring = (char*) palloc(1024*sizeof(char));
+	if (recstate->popularChecked)
+		return recstate->popularScores != NULL;
+	recstate->popularChecked = true;
+
+	// A recommender made on the fly doesn't have one, and
+	// neither does one made before we kept them.
+	if (!attributes->recIndexName || recstate->fullTotalItems <= 0)
+		return false;
+	popularname = (char*) palloc(256*sizeof(char));
+	sprintf(popularname,"%sPopular",attributes->recIndexName);
+	popularrv = makeRangeVarFromNameList(stringToQualifiedNameList(popularname));
+	if (!relationExists(popularrv)) {
+		pfree(popularrv);
+		pfree(popularname);
+		return false;
+	}
+	pfree(popularrv);
+
+	recstate->popularScores = (float*) palloc0(recstate->fullTotalItems*sizeof(float));
 
-	// We're going to look through the similarity matrix for the
-	// numbers that correspond to this item, and find which of those
-	// also correspond to items this user rated. We will use that
-	// information to obtain the estimated rating.
-	sprintf(querystring,"select * from %s where item1 = %d;",
-		itemmodel,currentItem->ID);
+	querystring = (char*) palloc(1024*sizeof(char));
+	sprintf(querystring,"select item, recscore from %s;",popularname);
 	queryDesc = recathon_queryStart(querystring,&recathoncontext);
 	planstate = queryDesc->planstate;
+	bindColumn(&itemcol, "item");
+	bindColumn(&scorecol, "recscore");
 
 	for (;;) {
-		int itemID;
-		float similarity;
-		GenRating *ratedItem;
+		int itemindex;
 
 		slot = ExecProcNode(planstate);
 		if (TupIsNull(slot)) break;
 
-		itemID = getTupleInt(slot,"item2");
-		similarity = getTupleFloat(slot,"similarity");
-
-		// Find the array slot this item ID corresponds to.
-		// If -1 is returned, then the item ID corresponds to
-		// another item we haven't rated, so we don't care.
-		ratedItem = hashFind(recnode->ratedTable,itemID);
-		if (ratedItem) {
-			currentItem->score += similarity*ratedItem->score;
-			if (similarity < 0)
-				similarity *= -1;
-			currentItem->totalSim += similarity;
-		}
+		itemindex = itemIndex(recstate, columnInt(slot,&itemcol));
+		if (itemindex >= 0)
+			recstate->popularScores[itemindex] = columnFloat(slot,&scorecol);
 	}
-
-	// Cleanup.
 	recathon_queryEnd(queryDesc,recathoncontext);
+
 	pfree(querystring);
+	pfree(popularname);
+	return true;
+}
+
+/* For a user with no events, an item scores what everyone
+ * else makes of it. */
+static float
+popularScore(RecScanState *recnode, int itemid, int itemindex)
+{
+	return itemindex < 0 ? 0.0 : recnode->popularScores[itemindex];
+}
 
-	if (currentItem->totalSim == 0) return 0;
+static void
+popularScoreBatch(RecScanState *recnode, const int *itemindexes, int n,
+		float *scores) {
+	int i;
+	const float *popularScores = recnode->popularScores;
 
-	recScore = currentItem->score / currentItem->totalSim;
-	return recScore;
+	for (i = 0; i < n; i++)
+		scores[i] = itemindexes[i] < 0 ? 0.0 : popularScores[itemindexes[i]];
 }
 
+/* The scoring strategies, for built models and on-the-fly ones. A
+ * strategy without a batch scorer is batched one item at a time. */
+static const rec_strategy itemCFpredictStrategy =
+	{"item-based CF", itemCFpredict, itemCFpredictBatch};
+static const rec_strategy itemCFgenerateStrategy =
+	{"item-based CF, on the fly", itemCFgenerate, NULL};
+static const rec_strategy itemJaccardPredictStrategy =
+	{"item-based Jaccard CF", itemJaccardScore, itemJaccardPredictBatch};
+static const rec_strategy itemJaccardGenerateStrategy =
+	{"item-based Jaccard CF, on the fly", itemJaccardScore, NULL};
+static const rec_strategy userCFpredictStrategy =
+	{"user-based CF", userCFpredict, NULL};
+static const rec_strategy userCFgenerateStrategy =
+	{"user-based CF, on the fly", userCFgenerate, NULL};
+static const rec_strategy SVDpredictStrategy =
+	{"matrix factorization", SVDpredict, SVDpredictBatch};
+static const rec_strategy SVDgenerateStrategy =
+	{"matrix factorization, on the fly", SVDgenerate, SVDgenerateBatch};
+static const rec_strategy unknownStrategy =
+	{"unknown", unknownScore, NULL};
+static const rec_strategy popularStrategy =
+	{"popularity", popularScore, popularScoreBatch};
+
+/* And the ones made for how a model is kept, once it's loaded. */
+static const rec_strategy itemCFsliceStrategy =
+	{"item-based CF, on the fly", itemCFpredict, itemCFpredictBatch};
+static const rec_strategy itemCFgenerateFullStrategy =
+	{"item-based CF, on the fly", itemCFgenerate, itemCFgenerateBatch};
+static const rec_strategy itemCFgeneratePackedStrategy =
+	{"item-based CF, on the fly", itemCFgenerate, itemCFgeneratePackedBatch};
+static const rec_strategy itemJaccardBuiltStrategy =
+	{"item-based Jaccard CF", itemJaccardPredict, itemJaccardPredictBatch};
+static const rec_strategy itemJaccardSliceStrategy =
+	{"item-based Jaccard CF, on the fly", itemJaccardPredict, itemJaccardPredictBatch};
+static const rec_strategy itemJaccardFullStrategy =
+	{"item-based Jaccard CF, on the fly", itemJaccardScore, itemJaccardGenerateBatch};
+static const rec_strategy itemJaccardPackedStrategy =
+	{"item-based Jaccard CF, on the fly", itemJaccardScore, itemJaccardGeneratePackedBatch};
+static const rec_strategy userCFneighborsStrategy =
+	{"user-based CF", userCFneighborsPredict, userCFneighborsBatch};
+static const rec_strategy userCFallStrategy =
+	{"user-based CF", userCFallPredict, userCFallBatch};
+static const rec_strategy userCFgenerateNeighborsStrategy =
+	{"user-based CF, on the fly", userCFneighborsPredict, userCFneighborsBatch};
+static const rec_strategy userCFgenerateAllStrategy =
+	{"user-based CF, on the fly", userCFallPredict, userCFallBatch};
+static const rec_strategy SVDpredictFloatStrategy =
+	{"matrix factorization", SVDpredictFloat, SVDpredictFloatBatch};
+static const rec_strategy SVDpredictHalfStrategy =
+	{"matrix factorization", SVDpredictHalf, SVDpredictHalfBatch};
+
 /* ----------------------------------------------------------------
- *		userCFpredict
+ *		recStrategy
  *
- *		Generates a predicted RecScore for a given user and
- *		item, for a recommender that uses user-based
- *		collaborative filtering.
+ *		Picks how a recommender method scores items, from a
+ *		built model or one generated on the fly.
  * ----------------------------------------------------------------
  */
-float
-userCFpredict(RecScanState *recnode, char *eventval, int itemid)
-{
-	float event, totalSim, average;
-	AttributeInfo *attributes;
-	// Query objects;
-	char *querystring;
-	QueryDesc *queryDesc;
-	PlanState *planstate;
-	TupleTableSlot *qslot;
-	MemoryContext recathoncontext;
-
-	attributes = (AttributeInfo*) recnode->attributes;
-
-	event = 0.0;
-	totalSim = 0.0;
-	average = recnode->average;
-
-	/* We need to query the events table, so that we can
-	 * find all events for this item and match them up
-	 * with what we have in the similarity matrix. We note
-	 * that it's necessarily true that the user has not
-	 * rated these items. */
-	querystring = (char*) palloc(1024*sizeof(char));
-	sprintf(querystring,"select * from %s where %s = %d;",
-		attributes->eventtable,attributes->itemkey,itemid);
-	queryDesc = recathon_queryStart(querystring,&recathoncontext);
-	planstate = queryDesc->planstate;
+const rec_strategy *
+recStrategy(recMethod method, bool generate) {
+	switch (method) {
+		case itemCosCF:
+		case itemPearCF:
+			return generate ? &itemCFgenerateStrategy : &itemCFpredictStrategy;
+		case itemJaccardCF:
+			return generate ? &itemJaccardGenerateStrategy : &itemJaccardPredictStrategy;
+		case userCosCF:
+		case userPearCF:
+			return generate ? &userCFgenerateStrategy : &userCFpredictStrategy;
+		case SVD:
+		case ALS:
+			return generate ? &SVDgenerateStrategy : &SVDpredictStrategy;
+		default:
+			return &unknownStrategy;
+	}
+}
 
-	for (;;) {
-		int currentUserID;
-		float currentRating, similarity;
-		GenRating *currentUser;
+/* ----------------------------------------------------------------
+ *		recModelStrategy
+ *
+ *		Once the scan's model is loaded, trades the method's
+ *		strategy for one made for how the model is kept: in
+ *		half precision or not, packed or not, in a slice or
+ *		whole, with a neighborhood or without. The scorers
+ *		then needn't ask, for every item. A model that isn't
+ *		loaded keeps the general strategy, which does.
+ * ----------------------------------------------------------------
+ */
+const rec_strategy *
+recModelStrategy(RecScanState *recnode, const rec_strategy *strategy) {
+	GenSparseModel *itemmodel = recnode->itemCFmodel;
+
+	if (strategy == &SVDpredictStrategy) {
+		if (recnode->SVDitemHalf)
+			return &SVDpredictHalfStrategy;
+		if (recnode->SVDitemmodel)
+			return &SVDpredictFloatStrategy;
+	} else if (strategy == &itemCFgenerateStrategy) {
+		if (recnode->itemCFslice)
+			return &itemCFsliceStrategy;
+		if (itemmodel)
+			return itemmodel->colIndex ? &itemCFgenerateFullStrategy :
+				&itemCFgeneratePackedStrategy;
+	} else if (strategy == &itemJaccardGenerateStrategy) {
+		if (recnode->itemCFslice)
+			return &itemJaccardSliceStrategy;
+		if (itemmodel)
+			return itemmodel->colIndex ? &itemJaccardFullStrategy :
+				&itemJaccardPackedStrategy;
+	} else if (strategy == &itemJaccardPredictStrategy) {
+		return &itemJaccardBuiltStrategy;
+	} else if (strategy == &userCFpredictStrategy) {
+		return recnode->neighborhood > 0 ? &userCFneighborsStrategy :
+			&userCFallStrategy;
+	} else if (strategy == &userCFgenerateStrategy) {
+		return recnode->neighborhood > 0 ? &userCFgenerateNeighborsStrategy :
+			&userCFgenerateAllStrategy;
+	}
+	return strategy;
+}
 
-		qslot = ExecProcNode(planstate);
-		if (TupIsNull(qslot)) break;
+/* The scan's strategy, picked now if InitializeRecommender hasn't. */
+static const rec_strategy *
+scanStrategy(RecScanState *recnode) {
+	AttributeInfo *attributes;
 
-		currentUserID = getTupleInt(qslot,attributes->userkey);
-		currentRating = getTupleFloat(qslot,eventval);
+	if (recnode->strategy)
+		return recnode->strategy;
 
-		currentUser = hashFind(recnode->simTable,currentUserID);
-		if (!currentUser) continue;
-		similarity = currentUser->totalSim;
+	attributes = (AttributeInfo*) recnode->attributes;
+	recnode->strategy = recModelStrategy(recnode, recStrategy((recMethod) attributes->method,
+		attributes->opType == OP_GENERATE || attributes->opType == OP_GENERATEJOIN));
+	return recnode->strategy;
+}
 
-		event += (currentRating - average) * similarity;
-		// Poor man's absolute value of the similarity.
-		if (similarity < 0)
-			similarity *= -1;
-		totalSim += similarity;
+/* ----------------------------------------------------------------
+ *		scoreItemBatch
+ *
+ *		Scores n items for the user that was last prepared,
+ *		given their item indexes, into scores.
+ * ----------------------------------------------------------------
+ */
+void
+scoreItemBatch(RecScanState *recnode, const int *itemindexes, int n, float *scores) {
+	int i;
+	const rec_strategy *strategy = scanStrategy(recnode);
+
+	if (strategy->score_batch)
+		strategy->score_batch(recnode, itemindexes, n, scores);
+	else {
+		for (i = 0; i < n; i++)
+			scores[i] = strategy->score(recnode,
+				itemindexes[i] < 0 ? -1 : recnode->fullItemList[itemindexes[i]],
+				itemindexes[i]);
 	}
-	recathon_queryEnd(queryDesc,recathoncontext);
-
-	if (totalSim == 0.0) return 0.0;
-
-	event /= totalSim;
-	event += average;
 
-	return event;
+	if (recnode->ensemble)
+		blendEnsembleBatch(recnode, itemindexes, n, scores);
 }
 
 /* ----------------------------------------------------------------
- *		SVDpredict
+ *		blendEnsembleBatch
  *
- *		Generates a predicted RecScore for a given user and
- *		item, for a recommender that uses SVD.
+ *		Blends the scores the first method of an ensemble
+ *		gave to n items with what each of its other methods
+ *		makes of them, weighting each by its share. A method
+ *		that couldn't prepare the user, or doesn't know an
+ *		item, has no say in its score.
  * ----------------------------------------------------------------
  */
-float
-SVDpredict(RecScanState *recnode, char *itemmodel, int itemid)
-{
-	float *userFeatures;
-	float recscore = 0.0;
-	// Query objects;
-	char *querystring;
-	QueryDesc *queryDesc;
-	PlanState *planstate;
-	TupleTableSlot *qslot;
-	MemoryContext recathoncontext;
+static void
+blendEnsembleBatch(RecScanState *recnode, const int *itemindexes, int n,
+		float *scores) {
+	int start, i;
+	ListCell *lc;
+	float weightSum[RECATHON_SCORE_BATCH];
+	AttributeInfo *attributes = (AttributeInfo*) recnode->attributes;
+
+	for (start = 0; start < n; start += RECATHON_SCORE_BATCH) {
+		int count = Min(n - start, RECATHON_SCORE_BATCH);
+		float *batch = scores + start;
+
+		for (i = 0; i < count; i++) {
+			batch[i] *= attributes->weight;
+			weightSum[i] = attributes->weight;
+		}
 
-	userFeatures = recnode->userFeatures;
+		foreach(lc, recnode->ensemble) {
+			RecScanState *member = (RecScanState*) lfirst(lc);
+			double weight = ((AttributeInfo*) member->attributes)->weight;
 
-	querystring = (char*) palloc(1024*sizeof(char));
-	sprintf(querystring,"select * from %s where items = %d;",
-		itemmodel,itemid);
+			if (!member->validUser)
+				continue;
 
-	queryDesc = recathon_queryStart(querystring,&recathoncontext);
-	planstate = queryDesc->planstate;
+			// The member has its own list of items.
+			for (i = 0; i < count; i++) {
+				int itemindex = itemindexes[start + i];
 
-	// Here we don't use the simpler methods, because they're slightly
-	// less efficient. Since we'll be doing this several thousand times,
-	// we'll take what we can get.
-	for (;;) {
-		int i, natts;
-		int feature = -1;
-		float featValue = 0;
-
-		qslot = ExecProcNode(planstate);
-		if (TupIsNull(qslot)) break;
-		slot_getallattrs(qslot);
-		natts = qslot->tts_tupleDescriptor->natts;
-
-		for (i = 0; i < natts; i++) {
-			if (!qslot->tts_isnull[i]) {
-				char *col_name;
-				Datum slot_result;
-				// What we do depends on the column name.
-				col_name = qslot->tts_tupleDescriptor->attrs[i]->attname.data;
-				slot_result = qslot->tts_values[i];
-
-				if (strcmp(col_name,"feature") == 0)
-					feature = DatumGetInt32(slot_result);
-				else if (strcmp(col_name,"value") == 0)
-					featValue = DatumGetFloat4(slot_result);
+				member->batchItems[i] = itemindex < 0 ? -1 :
+					itemIndex(member, recnode->fullItemList[itemindex]);
 			}
-		}
+			scoreItemBatch(member, member->batchItems, count, member->batchScores);
 
-		// If there's an error and we didn't find the column.
-		if (feature < 0) continue;
+			for (i = 0; i < count; i++) {
+				if (member->batchItems[i] < 0)
+					continue;
+				batch[i] += weight * member->batchScores[i];
+				weightSum[i] += weight;
+			}
+		}
 
-		// Add it into the event and continue.
-		recscore += featValue * userFeatures[feature];
+		for (i = 0; i < count; i++)
+			batch[i] /= weightSum[i];
 	}
-
-	// Cleanup.
-	recathon_queryEnd(queryDesc,recathoncontext);
-	pfree(querystring);
-
-	return recscore;
 }
 
 /* ----------------------------------------------------------------
@@ -4443,38 +24470,167 @@ void
 applyRecScore(RecScanState *recnode, TupleTableSlot *slot, int itemid, int itemindex)
 {
 	float recscore;
-	AttributeInfo *attributes;
 
-	attributes = (AttributeInfo*) recnode->attributes;
+	// An ensemble's score comes from all of its methods.
+	if (recnode->ensemble)
+		scoreItemBatch(recnode, &itemindex, 1, &recscore);
+	else
+		recscore = scanStrategy(recnode)->score(recnode,itemid,itemindex);
 
-	switch ((recMethod)attributes->method) {
-		case itemCosCF:
-		case itemPearCF:
-			if (attributes->opType == OP_GENERATE || attributes->opType == OP_GENERATEJOIN)
-				recscore = itemCFgenerate(recnode,itemid,itemindex);
-			else
-				recscore = itemCFpredict(recnode,attributes->recModelName,itemid);
-			break;
-		case userCosCF:
-		case userPearCF:
-			if (attributes->opType == OP_GENERATE || attributes->opType == OP_GENERATEJOIN)
-				recscore = userCFgenerate(recnode,itemid,itemindex);
-			else
-				recscore = userCFpredict(recnode,attributes->eventval,itemid);
-			break;
-		case SVD:
-			if (attributes->opType == OP_GENERATE || attributes->opType == OP_GENERATEJOIN)
-				recscore = SVDgenerate(recnode,itemid,itemindex);
-			else
-				recscore = SVDpredict(recnode,attributes->recModelName2,itemid);
-			break;
-		default:
-			recscore = -1;
+	slot->tts_values[recnode->eventatt] = Float4GetDatum(recscore);
+	slot->tts_isnull[recnode->eventatt] = false;
+}
+
+/* Reading ahead the pages of a similarity model that hold the
+ * neighbors of each of a user's rated items, in item order. */
+typedef struct sim_prefetch {
+	Relation	heap;
+	Relation	index;
+	IndexScanDesc	scan;
+	ScanKeyData	key;
+	int		*IDs;		/* the rated items, in order */
+	int		*numPages;	/* the pages asked for, for each */
+	int		numIDs;
+	int		next;		/* the next item to look up */
+	int		current;	/* the first item the scan hasn't passed */
+	int		ahead;		/* pages asked for that it hasn't reached */
+	BlockNumber	lastBlock;
+} sim_prefetch;
+
+/* ----------------------------------------------------------------
+ *		simPrefetchAdvance
+ *
+ *		Looks up where the rows of the next few items are in
+ *		the model's index, and asks for their pages, until
+ *		effective_io_concurrency pages are on their way.
+ * ----------------------------------------------------------------
+ */
+static void
+simPrefetchAdvance(sim_prefetch *pf) {
+#ifdef USE_PREFETCH
+	while (pf->next < pf->numIDs && pf->ahead < target_prefetch_pages) {
+		ItemPointer tid;
+		int pages = 0;
+
+		pf->key.sk_argument = Int32GetDatum(pf->IDs[pf->next]);
+		index_rescan(pf->scan, &pf->key, 1, NULL, 0);
+		while ((tid = index_getnext_tid(pf->scan, ForwardScanDirection)) != NULL) {
+			BlockNumber blkno = ItemPointerGetBlockNumber(tid);
+
+			// A list is usually on a page or two in a row.
+			if (blkno == pf->lastBlock)
+				continue;
+			PrefetchBuffer(pf->heap, MAIN_FORKNUM, blkno);
+			pf->lastBlock = blkno;
+			pages++;
+		}
+		pf->numPages[pf->next++] = pages;
+		pf->ahead += pages;
+	}
+#endif
+}
+
+/* ----------------------------------------------------------------
+ *		simPrefetchStart
+ *
+ *		Gets ready to read ahead the neighbors of the given
+ *		items, which must be in order, from a model that's
+ *		being read with a plain index scan on item1, which
+ *		doesn't read ahead by itself. A model that fits in
+ *		shared buffers isn't worth it, and neither is one
+ *		without a btree index on item1. Returns NULL if
+ *		we aren't reading ahead.
+ * ----------------------------------------------------------------
+ */
+static sim_prefetch *
+simPrefetchStart(char *itemmodel, PlanState *planstate, int *IDs, int numIDs) {
+#ifdef USE_PREFETCH
+	sim_prefetch *pf;
+	Relation heap, index = NULL;
+	List *indexes;
+	ListCell *lc;
+	AttrNumber attnum;
+
+	if (target_prefetch_pages <= 0 || numIDs < 2 ||
+	    !IsA(planstate, IndexScanState))
+		return NULL;
+
+	heap = heap_openrv(makeRangeVarFromNameList(stringToQualifiedNameList(itemmodel)),
+		AccessShareLock);
+	attnum = get_attnum(RelationGetRelid(heap), "item1");
+	if (RelationGetNumberOfBlocks(heap) <= (BlockNumber) NBuffers ||
+	    attnum == InvalidAttrNumber) {
+		heap_close(heap, AccessShareLock);
+		return NULL;
+	}
+
+	indexes = RelationGetIndexList(heap);
+	foreach(lc, indexes) {
+		Relation candidate = index_open(lfirst_oid(lc), AccessShareLock);
+
+		if (candidate->rd_rel->relam == BTREE_AM_OID &&
+		    candidate->rd_index->indkey.values[0] == attnum) {
+			index = candidate;
 			break;
+		}
+		index_close(candidate, AccessShareLock);
+	}
+	list_free(indexes);
+	if (!index) {
+		heap_close(heap, AccessShareLock);
+		return NULL;
 	}
 
-	slot->tts_values[recnode->eventatt] = Float4GetDatum(recscore);
-	slot->tts_isnull[recnode->eventatt] = false;
+	pf = (sim_prefetch*) palloc0(sizeof(sim_prefetch));
+	pf->heap = heap;
+	pf->index = index;
+	pf->scan = index_beginscan(heap, index, GetActiveSnapshot(), 1, 0);
+	ScanKeyInit(&pf->key, 1, BTEqualStrategyNumber, F_INT4EQ, Int32GetDatum(0));
+	pf->IDs = IDs;
+	pf->numIDs = numIDs;
+	pf->numPages = (int*) palloc(numIDs*sizeof(int));
+	pf->lastBlock = InvalidBlockNumber;
+
+	simPrefetchAdvance(pf);
+	return pf;
+#else
+	return NULL;
+#endif
+}
+
+/* ----------------------------------------------------------------
+ *		simPrefetchReached
+ *
+ *		Notes that the scan has got as far as an item's rows,
+ *		so the pages before them are done with, and asks for
+ *		as many more.
+ * ----------------------------------------------------------------
+ */
+static void
+simPrefetchReached(sim_prefetch *pf, int itemID) {
+	while (pf->current < pf->next && pf->IDs[pf->current] < itemID)
+		pf->ahead -= pf->numPages[pf->current++];
+	// We may have got here before looking it up.
+	if (pf->current == pf->next) {
+		while (pf->next < pf->numIDs && pf->IDs[pf->next] < itemID)
+			pf->numPages[pf->next++] = 0;
+		pf->current = pf->next;
+		pf->ahead = 0;
+	}
+	simPrefetchAdvance(pf);
+}
+
+/* ----------------------------------------------------------------
+ *		simPrefetchEnd
+ * ----------------------------------------------------------------
+ */
+static void
+simPrefetchEnd(sim_prefetch *pf) {
+	index_endscan(pf->scan);
+	index_close(pf->index, AccessShareLock);
+	heap_close(pf->heap, AccessShareLock);
+	pfree(pf->numPages);
+	pfree(pf);
 }
 
 /* ----------------------------------------------------------------
@@ -4484,64 +24640,139 @@ applyRecScore(RecScanState *recnode, TupleTableSlot *slot, int itemid, int itemi
  *		item-based CF prediction generation. We take the
  *		ratings this user has generated and we apply those
  *		similarity values to our tentative ratings.
+ *
+ *		Since we only store half of the similarity matrix,
+ *		a rated item can appear in either column. We fetch
+ *		every model row touching a rated item in a single
+ *		query, and apply it in whichever direction applies.
+ *		A symmetric model has each rated item's neighbors
+ *		under its own rows, so we only look at the first
+ *		column, and only apply the first item to the second.
+ *		Those rows come item by item from an index scan, and
+ *		if the model is bigger than shared buffers, we ask
+ *		for the pages of the next few items' rows ahead of
+ *		time, so that reading them overlaps with adding in
+ *		these. Both columns make for a bitmap scan, which
+ *		reads ahead on its own. With a time budget, we stop
+ *		reading rows once it's used up.
  * ----------------------------------------------------------------
  */
 void
 applyItemSim(RecScanState *recnode, char *itemmodel)
 {
-	int i;
-	GenHash *ratedTable;
+	int i, e, lastItem, numCold;
+	int *sortedIDs = NULL;
+	int *hotRow = recnode->hotItemRow;
+	Datum *ratedIDs;
+	sim_prefetch *prefetch = NULL;
 	// Query objects.
 	char *querystring;
 	QueryDesc *queryDesc;
 	PlanState *planstate;
 	TupleTableSlot *slot;
+	CachedPlan *cplan;
 	MemoryContext recathoncontext;
-
-	ratedTable = recnode->ratedTable;
+	tuple_column item1col, item2col, simcol;
+	Oid paramtypes[1] = {INT4ARRAYOID};
+	Datum paramvalues[1];
+
+	// Build an array of every item this user has rated. The rows of
+	// those the model cache keeps are applied from there instead.
+	ratedIDs = (Datum*) palloc(recnode->totalRatings*sizeof(Datum));
+	numCold = 0;
+	for (i = 0; i < recnode->totalRatings; i++) {
+		int rated = recnode->ratedItems[i];
+		GenSparseModel *hot = recnode->hotItemSim;
+
+		if (hotRow && hotRow[rated] >= 0) {
+			for (e = hot->rowStart[hotRow[rated]]; e < hot->rowStart[hotRow[rated]+1]; e++) {
+				float similarity = hot->values[e];
+
+				recnode->pendingScore[hot->colIndex[e]] += similarity*recnode->ratedScore[rated];
+				recnode->pendingSim[hot->colIndex[e]] += (similarity < 0) ? -similarity : similarity;
+			}
+			continue;
+		}
+		ratedIDs[numCold++] = Int32GetDatum(recnode->fullItemList[rated]);
+	}
+	if (numCold == 0) {
+		pfree(ratedIDs);
+		return;
+	}
+	paramvalues[0] = PointerGetDatum(construct_array(ratedIDs, numCold,
+				INT4OID, sizeof(int32), true, 'i'));
 
 	querystring = (char*) palloc(1024*sizeof(char));
+	if (recnode->modelSymmetric)
+		sprintf(querystring,"select item1, item2, similarity from %s where item1 = ANY($1);",
+			itemmodel);
+	else
+		sprintf(querystring,"select item1, item2, similarity from %s where item1 = ANY($1) or item2 = ANY($1);",
+			itemmodel);
+	queryDesc = recathon_queryStartCached(querystring,1,paramtypes,paramvalues,
+				&cplan,&recathoncontext);
+	planstate = queryDesc->planstate;
+	bindColumn(&item1col, "item1");
+	bindColumn(&item2col, "item2");
+	bindColumn(&simcol, "similarity");
+
+	if (recnode->modelSymmetric) {
+		sortedIDs = (int*) palloc(numCold*sizeof(int));
+		for (i = 0; i < numCold; i++)
+			sortedIDs[i] = DatumGetInt32(ratedIDs[i]);
+		qsort(sortedIDs, numCold, sizeof(int), intCompare);
+		prefetch = simPrefetchStart(itemmodel, planstate, sortedIDs, numCold);
+	}
+	lastItem = -1;
 
-	// For every item we've rated, we need to obtain its similarity
-	// scores and apply them to the appropriate items. This is
-	// necessary because we're only storing half of the similarity
-	// matrix.
-	for (i = 0; i < ratedTable->hash; i++) {
-		GenRating *currentItem;
+	for (;;) {
+		int item1, item2, index1, index2;
+		float similarity, abssim;
 
-		for (currentItem = ratedTable->table[i]; currentItem;
-				currentItem = currentItem->next) {
-			sprintf(querystring,"select * from %s where item1 = %d;",
-				itemmodel,currentItem->ID);
-			queryDesc = recathon_queryStart(querystring,&recathoncontext);
-			planstate = queryDesc->planstate;
+		CHECK_FOR_INTERRUPTS();
+		if (recPastBudget(recnode, RECATHON_BUDGET_ROWS))
+			break;
 
-			for (;;) {
-				int itemID;
-				float similarity;
-				GenRating *pendingItem;
-
-				slot = ExecProcNode(planstate);
-				if (TupIsNull(slot)) break;
-
-				itemID = getTupleInt(slot,"item2");
-				similarity = getTupleFloat(slot,"similarity");
-
-				// Find the array slot this item ID corresponds to.
-				// If -1 is returned, then the item ID corresponds to
-				// another item we've rated, so we don't care.
-				pendingItem = hashFind(recnode->pendingTable,itemID);
-				if (pendingItem) {
-					pendingItem->score += similarity*currentItem->score;
-					if (similarity < 0)
-						similarity *= -1;
-					pendingItem->totalSim += similarity;
-				}
-			}
+		slot = ExecProcNode(planstate);
+		if (TupIsNull(slot)) break;
 
-			recathon_queryEnd(queryDesc,recathoncontext);
+		item1 = columnInt(slot,&item1col);
+		item2 = columnInt(slot,&item2col);
+		similarity = columnFloat(slot,&simcol);
+		abssim = (similarity < 0) ? -similarity : similarity;
+
+		if (prefetch && item1 != lastItem) {
+			simPrefetchReached(prefetch, item1);
+			lastItem = item1;
+		}
+
+		// Both items have to be ones we know about.
+		index1 = itemIndex(recnode, item1);
+		if (index1 < 0) continue;
+		index2 = itemIndex(recnode, item2);
+		if (index2 < 0) continue;
+
+		// If the first item was rated, it contributes to the second,
+		// unless its row came from the cache.
+		if (recnode->isRated[index1] && (!hotRow || hotRow[index1] < 0)) {
+			recnode->pendingScore[index2] += similarity*recnode->ratedScore[index1];
+			recnode->pendingSim[index2] += abssim;
+		}
+
+		// And the other way around.
+		if (!recnode->modelSymmetric && recnode->isRated[index2] &&
+		    (!hotRow || hotRow[index2] < 0)) {
+			recnode->pendingScore[index1] += similarity*recnode->ratedScore[index2];
+			recnode->pendingSim[index1] += abssim;
 		}
 	}
 
+	if (prefetch)
+		simPrefetchEnd(prefetch);
+	if (sortedIDs)
+		pfree(sortedIDs);
+	recathon_queryEndCached(queryDesc,cplan,recathoncontext);
 	pfree(querystring);
+	pfree(DatumGetPointer(paramvalues[0]));
+	pfree(ratedIDs);
 }
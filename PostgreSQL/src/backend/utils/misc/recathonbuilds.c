@@ -0,0 +1,269 @@
+/*-------------------------------------------------------------------------
+ *
+ * recathonbuilds.c
+ *	  Shared-memory admission control for models generated on the fly.
+ *
+ * A RECOMMEND query on a table with no recommender for its method builds
+ * its model in its own memory, and holds it until the scan ends. Twenty
+ * sessions doing that at once hold twenty models, and for a big events
+ * table that's more than the server has. Worse, they're often all the
+ * same model, built from the same events at the same moment.
+ *
+ * So every on-the-fly build takes an entry here before it starts, saying
+ * what it builds and how much memory it expects to need, and keeps it
+ * until its scan is done with the model. Once the build is over, the
+ * estimate is replaced with what the model really took. While the
+ * entries together hold recathon_build_memory kilobytes, a new build
+ * waits for some to go; a build is always let in when nothing else is
+ * running, however big it is, and so is one from a backend that already
+ * holds an entry, so that nobody waits while holding memory others are
+ * waiting for. A build that finds another backend building the same
+ * model waits for it to finish, and then picks the model up from the
+ * shared model cache, if it's there (see restoreGeneratedModel), rather
+ * than building its own. Waiting can be cancelled, and counts towards
+ * statement_timeout.
+ *
+ * Entries still held at the end of a transaction, as after an error,
+ * are let go then. When more builds are running than there are entries,
+ * the rest go ahead untracked if there's no budget, or if their backend
+ * holds one already, and wait otherwise.
+ *
+ * Portions Copyright (c) 2012-2013, University of Minnesota
+ * Portions Copyright (c) 1996-2012, PostgreSQL Global Development Group
+ * Portions Copyright (c) 1994, Regents of the University of California
+ *
+ * IDENTIFICATION
+ *	  src/backend/utils/misc/recathonbuilds.c
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "access/hash.h"
+#include "access/xact.h"
+#include "miscadmin.h"
+#include "storage/shmem.h"
+#include "storage/spin.h"
+#include "utils/recathonbuilds.h"
+
+/* Room for what a build makes: its database, events table, method and
+ * columns. */
+#define RECATHON_BUILD_KEYLEN (5 * NAMEDATALEN)
+
+/* How long a waiting build sleeps between looks, in microseconds. */
+#define RECATHON_BUILD_POLL 10000L
+
+/* One build, running or holding its model. */
+typedef struct RecathonBuildEntry
+{
+	bool		inUse;			/* does this slot hold a build? */
+	bool		building;		/* is the model still being made? */
+	uint32		hash;			/* of the key, to compare quickly */
+	char		key[RECATHON_BUILD_KEYLEN];	/* what it builds */
+	Size		size;			/* the memory it holds, or expects to */
+} RecathonBuildEntry;
+
+typedef struct RecathonBuildsControl
+{
+	slock_t		mutex;			/* protects everything below */
+	RecathonBuildEntry entries[RECATHON_BUILDS];
+} RecathonBuildsControl;
+
+/* GUC variable */
+int			recathon_build_memory = 0;
+
+static RecathonBuildsControl *RecathonBuilds = NULL;
+
+/* The entries this backend holds. */
+static bool localBuilds[RECATHON_BUILDS];
+static bool recathon_builds_callback_registered = false;
+
+static void recathonBuildsXactCallback(XactEvent event, void *arg);
+
+/* ----------------------------------------------------------------
+ *		RecathonBuildsShmemSize
+ *
+ *		Reports the shared memory we need.
+ * ----------------------------------------------------------------
+ */
+Size
+RecathonBuildsShmemSize(void) {
+	return MAXALIGN(sizeof(RecathonBuildsControl));
+}
+
+/* ----------------------------------------------------------------
+ *		RecathonBuildsShmemInit
+ *
+ *		Sets up the table in shared memory, or attaches to it.
+ * ----------------------------------------------------------------
+ */
+void
+RecathonBuildsShmemInit(void) {
+	int i;
+	bool found;
+
+	RecathonBuilds = (RecathonBuildsControl*) ShmemInitStruct("Recathon Model Builds",
+		RecathonBuildsShmemSize(), &found);
+
+	if (!found) {
+		SpinLockInit(&RecathonBuilds->mutex);
+		for (i = 0; i < RECATHON_BUILDS; i++)
+			RecathonBuilds->entries[i].inUse = false;
+	}
+}
+
+static void
+registerCallback(void) {
+	if (!recathon_builds_callback_registered) {
+		RegisterXactCallback(recathonBuildsXactCallback, NULL);
+		recathon_builds_callback_registered = true;
+	}
+}
+
+/* ----------------------------------------------------------------
+ *		recathonBuildAdmit
+ *
+ *		Waits until a build of the model named by key, which
+ *		is expected to take estimate bytes, may start, and
+ *		returns a handle to its entry, or -1 if it goes ahead
+ *		untracked. If shared, another backend building the
+ *		same model is waited for, since what it builds can
+ *		be reused; the caller should look for it again.
+ * ----------------------------------------------------------------
+ */
+int
+recathonBuildAdmit(const char *key, bool shared, Size estimate) {
+	int i, slot, running;
+	uint32 hash;
+	bool holding, busy, waited;
+	Size budget, total;
+	RecathonBuildEntry *entry;
+
+	if (!RecathonBuilds)
+		return -1;
+	registerCallback();
+
+	hash = DatumGetUInt32(hash_any((const unsigned char *) key, strlen(key)));
+	holding = false;
+	for (i = 0; i < RECATHON_BUILDS; i++) {
+		if (localBuilds[i])
+			holding = true;
+	}
+	budget = (Size) recathon_build_memory * 1024L;
+
+	waited = false;
+	for (;;) {
+		slot = -1;
+		running = 0;
+		total = 0;
+		busy = false;
+
+		SpinLockAcquire(&RecathonBuilds->mutex);
+		for (i = 0; i < RECATHON_BUILDS; i++) {
+			entry = &RecathonBuilds->entries[i];
+			if (!entry->inUse) {
+				if (slot < 0)
+					slot = i;
+				continue;
+			}
+			if (shared && entry->building && entry->hash == hash &&
+			    strncmp(entry->key, key, RECATHON_BUILD_KEYLEN - 1) == 0)
+				busy = true;
+			running++;
+			total += entry->size;
+		}
+
+		if (!busy && slot >= 0 &&
+		    (holding || budget == 0 || running == 0 || total + estimate <= budget)) {
+			entry = &RecathonBuilds->entries[slot];
+			entry->inUse = true;
+			entry->building = true;
+			entry->hash = hash;
+			strlcpy(entry->key, key, RECATHON_BUILD_KEYLEN);
+			entry->size = estimate;
+			SpinLockRelease(&RecathonBuilds->mutex);
+
+			localBuilds[slot] = true;
+			return slot;
+		}
+		SpinLockRelease(&RecathonBuilds->mutex);
+
+		// With no entry to spare, only the builds that wouldn't
+		// have waited for memory go ahead.
+		if (!busy && slot < 0 && (holding || budget == 0))
+			return -1;
+
+		if (!waited) {
+			if (busy)
+				elog(DEBUG1, "waiting for another session to build the same model");
+			else
+				elog(DEBUG1, "waiting for %lu kB of memory to build a model",
+					(unsigned long) (estimate / 1024));
+			waited = true;
+		}
+		CHECK_FOR_INTERRUPTS();
+		pg_usleep(RECATHON_BUILD_POLL);
+	}
+}
+
+/* ----------------------------------------------------------------
+ *		recathonBuildFinish
+ *
+ *		Notes that a build is over, and that its model holds
+ *		size bytes until it's released. Builds of the same
+ *		model that were waiting for it can go on.
+ * ----------------------------------------------------------------
+ */
+void
+recathonBuildFinish(int handle, Size size) {
+	RecathonBuildEntry *entry;
+
+	if (handle < 0)
+		return;
+	Assert(handle < RECATHON_BUILDS && localBuilds[handle]);
+
+	SpinLockAcquire(&RecathonBuilds->mutex);
+	entry = &RecathonBuilds->entries[handle];
+	entry->building = false;
+	entry->size = size;
+	SpinLockRelease(&RecathonBuilds->mutex);
+}
+
+/* ----------------------------------------------------------------
+ *		recathonBuildRelease
+ *
+ *		Gives back a build's entry, once its model is gone.
+ * ----------------------------------------------------------------
+ */
+void
+recathonBuildRelease(int handle) {
+	if (handle < 0 || !localBuilds[handle])
+		return;
+	Assert(handle < RECATHON_BUILDS);
+
+	SpinLockAcquire(&RecathonBuilds->mutex);
+	RecathonBuilds->entries[handle].inUse = false;
+	SpinLockRelease(&RecathonBuilds->mutex);
+	localBuilds[handle] = false;
+}
+
+/* ----------------------------------------------------------------
+ *		recathonBuildsXactCallback
+ *
+ *		Scans release their entries when they end, but one
+ *		that errors out never gets the chance, so whatever
+ *		this backend still holds at the end of the transaction
+ *		is released here.
+ * ----------------------------------------------------------------
+ */
+static void
+recathonBuildsXactCallback(XactEvent event, void *arg) {
+	int i;
+
+	if (event != XACT_EVENT_COMMIT && event != XACT_EVENT_ABORT &&
+	    event != XACT_EVENT_PREPARE)
+		return;
+
+	for (i = 0; i < RECATHON_BUILDS; i++)
+		recathonBuildRelease(i);
+}
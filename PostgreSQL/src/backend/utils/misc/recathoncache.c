@@ -0,0 +1,644 @@
+/*-------------------------------------------------------------------------
+ *
+ * recathoncache.c
+ *	  Shared-memory cache of decoded recommender models.
+ *
+ * Every backend answering a RECOMMEND query against a built recommender
+ * needs the same ID lists and model arrays. Rather than have each one
+ * decode them from the model tables, the first backend to load a piece
+ * copies it in here, and later queries read it in place.
+ *
+ * The cache is an arena of recathon_cache_size kilobytes, along with a
+ * fixed table of entries describing the pieces in it. An entry is keyed
+ * by recommender, the kind of data, and a version that changes whenever
+ * the recommender's models are rebuilt, so an old piece is never handed
+ * out. Entries are pinned while a scan reads them. When room is needed,
+ * the least recently used recommender loses all of its unpinned pieces.
+ *
+ * A rebuild doesn't wait for the scans reading the old models. Versions
+ * are the transaction IDs of the builds, so a scan can tell which of two
+ * is the newer one, as far as its snapshot goes. The first scan to ask
+ * for the new version retires the old pieces, which go once their last
+ * reader unpins them, and a scan that started before the rebuild
+ * committed keeps reading what it pinned without disturbing the new
+ * pieces, or putting old ones back.
+ * Pins still held at the end of a transaction, as after an error, are
+ * dropped then.
+ *
+ * On a server with several NUMA nodes, the arena can be interleaved over
+ * all of them, so that scans of a big model draw on every node's memory
+ * evenly instead of all on the node the first reader ran on. Together
+ * with huge pages (see InternalIpcMemoryCreate), that keeps a cache of
+ * many gigabytes from going to waste on TLB misses and remote accesses.
+ *
+ * Portions Copyright (c) 2012-2013, University of Minnesota
+ * Portions Copyright (c) 1996-2012, PostgreSQL Global Development Group
+ * Portions Copyright (c) 1994, Regents of the University of California
+ *
+ * IDENTIFICATION
+ *	  src/backend/utils/misc/recathoncache.c
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#include "access/transam.h"
+#include "access/xact.h"
+#include "miscadmin.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "utils/recathoncache.h"
+#include "utils/snapmgr.h"
+
+/* The most pieces the cache can hold at once. */
+#define RECATHON_CACHE_ENTRIES 256
+
+/* Room for the kind of a piece, such as "items". */
+#define RECATHON_CACHE_KINDLEN 16
+
+/* One piece of model data in the arena. */
+typedef struct RecathonCacheEntry
+{
+	bool		inUse;			/* does this slot describe a piece? */
+	bool		valid;			/* has its data been copied in? */
+	bool		stale;			/* should it go once it's unpinned? */
+	Oid			databaseid;		/* the recommender's database */
+	char		recname[NAMEDATALEN];	/* the recommender it belongs to */
+	char		kind[RECATHON_CACHE_KINDLEN];	/* what the data is */
+	uint32		version;		/* the build of the models it came from */
+	int			pinCount;		/* scans currently reading it */
+	uint64		lastUsed;		/* clock value at its last use */
+	Size		offset;			/* where its data starts in the arena */
+	Size		size;			/* the length of its data */
+} RecathonCacheEntry;
+
+typedef struct RecathonCacheControl
+{
+	uint64		clock;			/* ticks once per use */
+	Size		arenaSize;		/* the bytes of data space */
+	RecathonCacheEntry entries[RECATHON_CACHE_ENTRIES];
+} RecathonCacheControl;
+
+/* The kernel's MPOL_INTERLEAVE, spelled out so as not to need libnuma. */
+#define RECATHON_MPOL_INTERLEAVE 3
+
+/* The most NUMA nodes we interleave over. */
+#define RECATHON_MAX_NUMA_NODES 1024
+
+/* GUC variables */
+int			recathon_cache_size = 0;
+int			recathon_cache_hot_memory = 0;
+bool		recathon_cache_huge_pages = false;
+bool		recathon_cache_interleave = false;
+
+static RecathonCacheControl *RecathonCache = NULL;
+static char *RecathonCacheArena = NULL;
+
+/* The pins this backend holds on each entry. */
+static int	localPins[RECATHON_CACHE_ENTRIES];
+static bool recathon_cache_callback_registered = false;
+
+static void recathonCacheXactCallback(XactEvent event, void *arg);
+
+/* ----------------------------------------------------------------
+ *		RecathonCacheShmemSize
+ *
+ *		Reports the shared memory the cache needs, which is
+ *		none at all when it's turned off.
+ * ----------------------------------------------------------------
+ */
+Size
+RecathonCacheShmemSize(void) {
+	Size size;
+
+	if (recathon_cache_size <= 0)
+		return 0;
+
+	size = MAXALIGN(sizeof(RecathonCacheControl));
+	size = add_size(size, mul_size((Size) recathon_cache_size, 1024));
+	return size;
+}
+
+/* ----------------------------------------------------------------
+ *		interleaveArena
+ *
+ *		Asks the kernel to place the arena's pages round robin
+ *		over every NUMA node, as they're first touched. Only
+ *		whole huge pages of it are covered, so that the policy
+ *		applies however the segment was mapped. A server with
+ *		one node, or a kernel that won't, is left as it is.
+ * ----------------------------------------------------------------
+ */
+static void
+interleaveArena(void) {
+#if defined(__linux__) && defined(SYS_mbind)
+	unsigned long mask[RECATHON_MAX_NUMA_NODES / (8 * sizeof(unsigned long))];
+	uintptr_t start, end;
+	int i, first, last, numNodes;
+	FILE *file;
+
+	// The nodes the kernel knows of, as "0" or "0-3".
+	file = fopen("/sys/devices/system/node/possible", "r");
+	if (!file)
+		return;
+	numNodes = fscanf(file, "%d-%d", &first, &last);
+	fclose(file);
+	if (numNodes < 2 || last < 1 || last >= RECATHON_MAX_NUMA_NODES)
+		return;
+
+	memset(mask, 0, sizeof(mask));
+	for (i = 0; i <= last; i++)
+		mask[i / (8 * sizeof(unsigned long))] |= 1UL << (i % (8 * sizeof(unsigned long)));
+
+	start = TYPEALIGN(RECATHON_HUGE_PAGE_SIZE, (uintptr_t) RecathonCacheArena);
+	end = TYPEALIGN_DOWN(RECATHON_HUGE_PAGE_SIZE,
+		(uintptr_t) RecathonCacheArena + RecathonCache->arenaSize);
+	if (end <= start)
+		return;
+
+	if (syscall(SYS_mbind, (void*) start, (unsigned long) (end - start),
+			RECATHON_MPOL_INTERLEAVE, mask, (unsigned long) (last + 2), 0) != 0)
+		elog(LOG, "could not interleave the recommender model cache: %m");
+#endif
+}
+
+/* ----------------------------------------------------------------
+ *		RecathonCacheShmemInit
+ *
+ *		Sets up the cache in shared memory, or attaches to it.
+ * ----------------------------------------------------------------
+ */
+void
+RecathonCacheShmemInit(void) {
+	int i;
+	bool found;
+
+	if (recathon_cache_size <= 0)
+		return;
+
+	RecathonCache = (RecathonCacheControl*)
+		ShmemInitStruct("Recathon Model Cache", RecathonCacheShmemSize(), &found);
+	RecathonCacheArena = ((char*) RecathonCache) + MAXALIGN(sizeof(RecathonCacheControl));
+
+	if (!found) {
+		RecathonCache->clock = 0;
+		RecathonCache->arenaSize = mul_size((Size) recathon_cache_size, 1024);
+		for (i = 0; i < RECATHON_CACHE_ENTRIES; i++) {
+			RecathonCache->entries[i].inUse = false;
+			RecathonCache->entries[i].valid = false;
+			RecathonCache->entries[i].stale = false;
+			RecathonCache->entries[i].pinCount = 0;
+		}
+		if (recathon_cache_interleave)
+			interleaveArena();
+	}
+}
+
+/* ----------------------------------------------------------------
+ *		recathonCacheEnabled
+ *
+ *		Is there a model cache to use?
+ * ----------------------------------------------------------------
+ */
+bool
+recathonCacheEnabled(void) {
+	return RecathonCache != NULL;
+}
+
+/*
+ * The functions below all expect RecathonCacheLock to be held
+ * exclusively.
+ */
+
+static bool
+sameRecommender(RecathonCacheEntry *entry, Oid databaseid, const char *recname) {
+	return entry->databaseid == databaseid &&
+		strncmp(entry->recname, recname, NAMEDATALEN - 1) == 0;
+}
+
+static bool
+sameKey(RecathonCacheEntry *entry, const char *recname, const char *kind) {
+	return sameRecommender(entry, MyDatabaseId, recname) &&
+		strncmp(entry->kind, kind, RECATHON_CACHE_KINDLEN - 1) == 0;
+}
+
+static void
+freeEntry(int i) {
+	RecathonCacheEntry *entry = &RecathonCache->entries[i];
+
+	entry->inUse = false;
+	entry->valid = false;
+	entry->stale = false;
+}
+
+static void
+pinEntry(int i) {
+	RecathonCache->entries[i].pinCount++;
+	RecathonCache->entries[i].lastUsed = ++RecathonCache->clock;
+	localPins[i]++;
+}
+
+static void
+unpinEntry(int i) {
+	RecathonCacheEntry *entry = &RecathonCache->entries[i];
+
+	entry->pinCount--;
+	localPins[i]--;
+
+	// A piece that was replaced, or never finished, goes
+	// as soon as nobody's reading it.
+	if (entry->pinCount <= 0 && (entry->stale || !entry->valid))
+		freeEntry(i);
+}
+
+static void
+markStale(int i) {
+	if (RecathonCache->entries[i].pinCount <= 0)
+		freeEntry(i);
+	else
+		RecathonCache->entries[i].stale = true;
+}
+
+/* ----------------------------------------------------------------
+ *		findSpace
+ *
+ *		Looks for a gap in the arena that will hold size
+ *		bytes, taking the first one that fits.
+ * ----------------------------------------------------------------
+ */
+static bool
+findSpace(Size size, Size *ret_offset) {
+	int order[RECATHON_CACHE_ENTRIES];
+	int i, j, count;
+	Size start;
+	RecathonCacheEntry *entries = RecathonCache->entries;
+
+	// Put the pieces in the order they sit in the arena.
+	count = 0;
+	for (i = 0; i < RECATHON_CACHE_ENTRIES; i++) {
+		if (!entries[i].inUse) continue;
+		for (j = count; j > 0 && entries[order[j-1]].offset > entries[i].offset; j--)
+			order[j] = order[j-1];
+		order[j] = i;
+		count++;
+	}
+
+	size = MAXALIGN(size);
+	start = 0;
+	for (j = 0; j < count; j++) {
+		RecathonCacheEntry *entry = &entries[order[j]];
+
+		if (entry->offset - start >= size) {
+			(*ret_offset) = start;
+			return true;
+		}
+		start = entry->offset + MAXALIGN(entry->size);
+	}
+
+	if (RecathonCache->arenaSize - start >= size) {
+		(*ret_offset) = start;
+		return true;
+	}
+	return false;
+}
+
+/* ----------------------------------------------------------------
+ *		evictRecommender
+ *
+ *		Makes room by throwing out the unpinned pieces of the
+ *		least recently used recommender. A piece whose load
+ *		was abandoned goes before anything else. Returns false
+ *		if everything is pinned.
+ * ----------------------------------------------------------------
+ */
+static bool
+evictRecommender(void) {
+	int i, victim;
+	Oid databaseid;
+	char recname[NAMEDATALEN];
+	RecathonCacheEntry *entries = RecathonCache->entries;
+
+	victim = -1;
+	for (i = 0; i < RECATHON_CACHE_ENTRIES; i++) {
+		if (!entries[i].inUse || entries[i].pinCount > 0)
+			continue;
+		if (entries[i].stale || !entries[i].valid) {
+			freeEntry(i);
+			return true;
+		}
+		if (victim < 0 || entries[i].lastUsed < entries[victim].lastUsed)
+			victim = i;
+	}
+	if (victim < 0)
+		return false;
+
+	// A recommender's pieces are used together, so they go together.
+	databaseid = entries[victim].databaseid;
+	strlcpy(recname, entries[victim].recname, NAMEDATALEN);
+	for (i = 0; i < RECATHON_CACHE_ENTRIES; i++) {
+		if (entries[i].inUse && entries[i].pinCount <= 0 &&
+		    sameRecommender(&entries[i], databaseid, recname))
+			freeEntry(i);
+	}
+	return true;
+}
+
+/* ----------------------------------------------------------------
+ *		recathonVersionIsNewer
+ *
+ *		Is a version of some recommender's models newer than
+ *		the ones our snapshot can see? That's a build that
+ *		hadn't committed when our scan started. Any other
+ *		version, including one from a build that aborted, is
+ *		older than ours.
+ * ----------------------------------------------------------------
+ */
+bool
+recathonVersionIsNewer(uint32 version) {
+	TransactionId xid = (TransactionId) version;
+	Snapshot snapshot;
+	int i;
+
+	if (!TransactionIdIsNormal(xid) || TransactionIdIsCurrentTransactionId(xid))
+		return false;
+	if (!ActiveSnapshotSet())
+		return false;
+
+	snapshot = GetActiveSnapshot();
+	if (TransactionIdFollowsOrEquals(xid, snapshot->xmax))
+		return true;
+	if (TransactionIdPrecedes(xid, snapshot->xmin))
+		return false;
+	for (i = 0; i < snapshot->xcnt; i++) {
+		if (TransactionIdEquals(xid, snapshot->xip[i]))
+			return true;
+	}
+	return false;
+}
+
+static void
+registerCallback(void) {
+	if (!recathon_cache_callback_registered) {
+		RegisterXactCallback(recathonCacheXactCallback, NULL);
+		recathon_cache_callback_registered = true;
+	}
+}
+
+/* ----------------------------------------------------------------
+ *		recathonCacheLookup
+ *
+ *		Finds a piece of a recommender's models in the cache.
+ *		If it's there, it is pinned and returned, along with
+ *		its size and a handle to release it with. Returns NULL
+ *		otherwise. A piece from an older version of the models
+ *		is retired; one from a newer version is left for the
+ *		scans that can see it.
+ * ----------------------------------------------------------------
+ */
+char *
+recathonCacheLookup(const char *recname, const char *kind, uint32 version,
+		Size *ret_size, int *ret_handle) {
+	int i;
+	char *data;
+
+	if (!RecathonCache)
+		return NULL;
+	registerCallback();
+
+	data = NULL;
+	LWLockAcquire(RecathonCacheLock, LW_EXCLUSIVE);
+	for (i = 0; i < RECATHON_CACHE_ENTRIES; i++) {
+		RecathonCacheEntry *entry = &RecathonCache->entries[i];
+
+		if (!entry->inUse || entry->stale || !sameKey(entry, recname, kind))
+			continue;
+		if (entry->version != version) {
+			if (!recathonVersionIsNewer(entry->version))
+				markStale(i);
+			continue;
+		}
+		// Someone else is still copying it in.
+		if (!entry->valid)
+			continue;
+
+		pinEntry(i);
+		data = RecathonCacheArena + entry->offset;
+		(*ret_size) = entry->size;
+		(*ret_handle) = i;
+		break;
+	}
+	LWLockRelease(RecathonCacheLock);
+
+	return data;
+}
+
+/* ----------------------------------------------------------------
+ *		recathonCacheReserve
+ *
+ *		Sets aside size bytes for a piece of a recommender's
+ *		models, evicting other recommenders if need be. The
+ *		caller fills the space in and then calls
+ *		recathonCacheFinish; until then nobody else will see
+ *		it. The reservation is pinned like a lookup is.
+ *		Returns NULL if the piece won't fit, if another
+ *		backend already has it, or if it's already there from
+ *		a newer version of the models.
+ * ----------------------------------------------------------------
+ */
+char *
+recathonCacheReserve(const char *recname, const char *kind, uint32 version,
+		Size size, int *ret_handle) {
+	int i, slot;
+	Size offset;
+	RecathonCacheEntry *entry;
+
+	if (!RecathonCache || size > RecathonCache->arenaSize)
+		return NULL;
+	registerCallback();
+
+	LWLockAcquire(RecathonCacheLock, LW_EXCLUSIVE);
+	for (i = 0; i < RECATHON_CACHE_ENTRIES; i++) {
+		entry = &RecathonCache->entries[i];
+
+		if (!entry->inUse || entry->stale || !sameKey(entry, recname, kind))
+			continue;
+		if (entry->version != version && !recathonVersionIsNewer(entry->version)) {
+			markStale(i);
+			continue;
+		}
+		LWLockRelease(RecathonCacheLock);
+		return NULL;
+	}
+
+	// We need both a free entry and a gap in the arena.
+	for (;;) {
+		slot = -1;
+		for (i = 0; i < RECATHON_CACHE_ENTRIES; i++) {
+			if (!RecathonCache->entries[i].inUse) {
+				slot = i;
+				break;
+			}
+		}
+		if (slot >= 0 && findSpace(size, &offset))
+			break;
+		if (!evictRecommender()) {
+			LWLockRelease(RecathonCacheLock);
+			return NULL;
+		}
+	}
+
+	entry = &RecathonCache->entries[slot];
+	entry->inUse = true;
+	entry->valid = false;
+	entry->stale = false;
+	entry->databaseid = MyDatabaseId;
+	strlcpy(entry->recname, recname, NAMEDATALEN);
+	strlcpy(entry->kind, kind, RECATHON_CACHE_KINDLEN);
+	entry->version = version;
+	entry->pinCount = 0;
+	entry->offset = offset;
+	entry->size = size;
+	pinEntry(slot);
+	LWLockRelease(RecathonCacheLock);
+
+	(*ret_handle) = slot;
+	return RecathonCacheArena + offset;
+}
+
+/* ----------------------------------------------------------------
+ *		recathonCacheShrink
+ *
+ *		Gives back the end of a reservation that turned out
+ *		bigger than its data, before it's finished, keeping
+ *		its first size bytes.
+ * ----------------------------------------------------------------
+ */
+void
+recathonCacheShrink(int handle, Size size) {
+	RecathonCacheEntry *entry;
+
+	Assert(handle >= 0 && handle < RECATHON_CACHE_ENTRIES && localPins[handle] > 0);
+
+	LWLockAcquire(RecathonCacheLock, LW_EXCLUSIVE);
+	entry = &RecathonCache->entries[handle];
+	Assert(!entry->valid);
+	if (size < entry->size)
+		entry->size = size;
+	LWLockRelease(RecathonCacheLock);
+}
+
+/* ----------------------------------------------------------------
+ *		recathonCacheFinish
+ *
+ *		Makes a reserved piece visible to other backends, once
+ *		its data has been filled in.
+ * ----------------------------------------------------------------
+ */
+void
+recathonCacheFinish(int handle) {
+	Assert(handle >= 0 && handle < RECATHON_CACHE_ENTRIES && localPins[handle] > 0);
+
+	LWLockAcquire(RecathonCacheLock, LW_EXCLUSIVE);
+	RecathonCache->entries[handle].valid = true;
+	LWLockRelease(RecathonCacheLock);
+}
+
+/* ----------------------------------------------------------------
+ *		recathonCacheRelease
+ *
+ *		Drops a pin taken by a lookup or a reservation. A
+ *		reservation released before it's finished is thrown
+ *		away.
+ * ----------------------------------------------------------------
+ */
+void
+recathonCacheRelease(int handle) {
+	Assert(handle >= 0 && handle < RECATHON_CACHE_ENTRIES && localPins[handle] > 0);
+
+	LWLockAcquire(RecathonCacheLock, LW_EXCLUSIVE);
+	unpinEntry(handle);
+	LWLockRelease(RecathonCacheLock);
+}
+
+/* ----------------------------------------------------------------
+ *		recathonCacheDrop
+ *
+ *		Throws out everything cached for a recommender, as
+ *		when it's dropped. Pieces still being read go when
+ *		their readers are done.
+ * ----------------------------------------------------------------
+ */
+void
+recathonCacheDrop(const char *recname) {
+	int i;
+
+	if (!RecathonCache)
+		return;
+
+	LWLockAcquire(RecathonCacheLock, LW_EXCLUSIVE);
+	for (i = 0; i < RECATHON_CACHE_ENTRIES; i++) {
+		if (RecathonCache->entries[i].inUse &&
+		    sameRecommender(&RecathonCache->entries[i], MyDatabaseId, recname))
+			markStale(i);
+	}
+	LWLockRelease(RecathonCacheLock);
+}
+
+/* ----------------------------------------------------------------
+ *		recathonCacheOwns
+ *
+ *		Does this pointer point into the cache? Scans use this
+ *		to tell which of their arrays they mustn't free.
+ * ----------------------------------------------------------------
+ */
+bool
+recathonCacheOwns(const void *ptr) {
+	const char *p = (const char*) ptr;
+
+	if (!RecathonCacheArena || !p)
+		return false;
+	return p >= RecathonCacheArena && p < RecathonCacheArena + RecathonCache->arenaSize;
+}
+
+/* ----------------------------------------------------------------
+ *		recathonCacheXactCallback
+ *
+ *		Scans release their pins when they end, but one that
+ *		errors out never gets the chance, so whatever this
+ *		backend still holds at the end of the transaction is
+ *		released here.
+ * ----------------------------------------------------------------
+ */
+static void
+recathonCacheXactCallback(XactEvent event, void *arg) {
+	int i;
+	bool held;
+
+	if (event != XACT_EVENT_COMMIT && event != XACT_EVENT_ABORT &&
+	    event != XACT_EVENT_PREPARE)
+		return;
+	if (!RecathonCache)
+		return;
+
+	held = false;
+	for (i = 0; i < RECATHON_CACHE_ENTRIES; i++) {
+		if (localPins[i] > 0) {
+			held = true;
+			break;
+		}
+	}
+	if (!held)
+		return;
+
+	LWLockAcquire(RecathonCacheLock, LW_EXCLUSIVE);
+	for (i = 0; i < RECATHON_CACHE_ENTRIES; i++) {
+		while (localPins[i] > 0)
+			unpinEntry(i);
+	}
+	LWLockRelease(RecathonCacheLock);
+}
@@ -0,0 +1,338 @@
+/*-------------------------------------------------------------------------
+ *
+ * recathonevents.c
+ *	  Shared-memory state of the events tables recommenders are built on.
+ *
+ * Every transaction that adds events tells the maintenance process about
+ * it with a notification, and every maintenance pass used to count each
+ * events table from scratch to see how many events had come in. Both
+ * are costly when events arrive quickly: a committing transaction that
+ * has notified takes a lock every other such transaction waits for, and
+ * counting a big table that nothing has been added to is a waste.
+ *
+ * So, for each events table, we keep here whether the maintenance
+ * process has already been told of new events since its last pass, in
+ * which case the next inserting transaction needn't tell it again, and
+ * whether any events have been committed since the table was last
+ * counted, in which case the count has to be taken again. Counts are
+ * also retaken after a DELETE, as the statistics collector sees it, or
+ * after the table is truncated or rewritten.
+ *
+ * Each entry also counts the transactions that have committed events to
+ * it. Models generated on the fly for a query are kept for the next
+ * query until that changes (see generatedModelStamp), so tables these
+ * are generated from get entries too, even with no recommender on them.
+ *
+ * Entries are kept by database and table OID, so that same-named tables
+ * in different databases, or in different schemas, don't share one.
+ *
+ * The state is small and each change is a few instructions, so one
+ * spinlock is enough. If there are more events tables than entries, the
+ * rest are notified about on every transaction and counted every pass,
+ * as before.
+ *
+ * Portions Copyright (c) 2012-2013, University of Minnesota
+ * Portions Copyright (c) 1996-2012, PostgreSQL Global Development Group
+ * Portions Copyright (c) 1994, Regents of the University of California
+ *
+ * IDENTIFICATION
+ *	  src/backend/utils/misc/recathonevents.c
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "miscadmin.h"
+#include "storage/shmem.h"
+#include "storage/spin.h"
+#include "utils/recathonevents.h"
+
+/* What we know of one events table. */
+typedef struct RecathonEventsEntry
+{
+	bool		inUse;			/* does this slot hold a table? */
+	Oid			databaseid;		/* the events table's database */
+	Oid			relid;			/* and the table */
+	bool		notified;		/* told of new events since the last pass? */
+	bool		changed;		/* events committed since the last count? */
+	bool		counted;		/* is count any good? */
+	int			count;			/* the rows it had when last counted */
+	Oid			relfilenode;	/* its storage at the time */
+	int64		deleted;		/* and the rows deleted from it, by then */
+	uint64		generation;		/* transactions that committed events */
+} RecathonEventsEntry;
+
+typedef struct RecathonEventsControl
+{
+	slock_t		mutex;			/* protects everything below */
+	RecathonEventsEntry entries[RECATHON_EVENT_TABLES];
+} RecathonEventsControl;
+
+static RecathonEventsControl *RecathonEvents = NULL;
+
+/* ----------------------------------------------------------------
+ *		RecathonEventsShmemSize
+ *
+ *		Reports the shared memory we need.
+ * ----------------------------------------------------------------
+ */
+Size
+RecathonEventsShmemSize(void) {
+	return MAXALIGN(sizeof(RecathonEventsControl));
+}
+
+/* ----------------------------------------------------------------
+ *		RecathonEventsShmemInit
+ *
+ *		Sets up the table in shared memory, or attaches to it.
+ * ----------------------------------------------------------------
+ */
+void
+RecathonEventsShmemInit(void) {
+	int i;
+	bool found;
+
+	RecathonEvents = (RecathonEventsControl*) ShmemInitStruct("Recathon Events Tables",
+		RecathonEventsShmemSize(), &found);
+
+	if (!found) {
+		SpinLockInit(&RecathonEvents->mutex);
+		for (i = 0; i < RECATHON_EVENT_TABLES; i++)
+			RecathonEvents->entries[i].inUse = false;
+	}
+}
+
+/*
+ * Finds a table's entry, making one if there's room. The caller holds
+ * the spinlock. Returns NULL if the table isn't, and can't be, kept
+ * track of.
+ */
+static RecathonEventsEntry *
+eventsEntry(Oid relid, bool create) {
+	RecathonEventsEntry *entry, *unused = NULL;
+	int i;
+
+	for (i = 0; i < RECATHON_EVENT_TABLES; i++) {
+		entry = &RecathonEvents->entries[i];
+		if (!entry->inUse) {
+			if (!unused)
+				unused = entry;
+			continue;
+		}
+		if (entry->databaseid == MyDatabaseId && entry->relid == relid)
+			return entry;
+	}
+
+	if (!create || !unused || !OidIsValid(relid))
+		return NULL;
+
+	unused->inUse = true;
+	unused->databaseid = MyDatabaseId;
+	unused->relid = relid;
+	unused->notified = false;
+	unused->changed = true;
+	unused->counted = false;
+	unused->generation = 0;
+	return unused;
+}
+
+/* ----------------------------------------------------------------
+ *		recathonEventsClaimNotify
+ *
+ *		Returns true if the caller should notify the maintenance
+ *		process of new events in a table, which it should unless
+ *		someone already has since the last pass. A transaction
+ *		that claims the notification and then aborts has to give
+ *		it back with recathonEventsReleaseNotify.
+ * ----------------------------------------------------------------
+ */
+bool
+recathonEventsClaimNotify(Oid relid) {
+	RecathonEventsEntry *entry;
+	bool claimed = true;
+
+	if (!RecathonEvents)
+		return true;
+
+	SpinLockAcquire(&RecathonEvents->mutex);
+	entry = eventsEntry(relid, true);
+	if (entry) {
+		claimed = !entry->notified;
+		entry->notified = true;
+	}
+	SpinLockRelease(&RecathonEvents->mutex);
+
+	return claimed;
+}
+
+/* ----------------------------------------------------------------
+ *		recathonEventsReleaseNotify
+ *
+ *		Gives back a notification that was never sent, so that
+ *		the next transaction sends it.
+ * ----------------------------------------------------------------
+ */
+void
+recathonEventsReleaseNotify(Oid relid) {
+	RecathonEventsEntry *entry;
+
+	if (!RecathonEvents)
+		return;
+
+	SpinLockAcquire(&RecathonEvents->mutex);
+	entry = eventsEntry(relid, false);
+	if (entry)
+		entry->notified = false;
+	SpinLockRelease(&RecathonEvents->mutex);
+}
+
+/* ----------------------------------------------------------------
+ *		recathonEventsCommitted
+ *
+ *		Notes that events have been committed to a table, so it
+ *		has to be counted again.
+ * ----------------------------------------------------------------
+ */
+void
+recathonEventsCommitted(Oid relid) {
+	RecathonEventsEntry *entry;
+
+	if (!RecathonEvents)
+		return;
+
+	SpinLockAcquire(&RecathonEvents->mutex);
+	entry = eventsEntry(relid, false);
+	if (entry) {
+		entry->changed = true;
+		entry->generation++;
+	}
+	SpinLockRelease(&RecathonEvents->mutex);
+}
+
+/* ----------------------------------------------------------------
+ *		recathonEventsWatch
+ *
+ *		Starts keeping track of a table, if we weren't already,
+ *		and returns how many transactions have committed events
+ *		to it since. Returns false if there's no room.
+ * ----------------------------------------------------------------
+ */
+bool
+recathonEventsWatch(Oid relid, uint64 *ret_generation) {
+	RecathonEventsEntry *entry;
+
+	if (!RecathonEvents)
+		return false;
+
+	SpinLockAcquire(&RecathonEvents->mutex);
+	entry = eventsEntry(relid, true);
+	if (entry)
+		(*ret_generation) = entry->generation;
+	SpinLockRelease(&RecathonEvents->mutex);
+
+	return entry != NULL;
+}
+
+/* ----------------------------------------------------------------
+ *		recathonEventsWatched
+ *
+ *		Are we keeping track of a table?
+ * ----------------------------------------------------------------
+ */
+bool
+recathonEventsWatched(Oid relid) {
+	bool watched;
+
+	if (!RecathonEvents)
+		return false;
+
+	SpinLockAcquire(&RecathonEvents->mutex);
+	watched = (eventsEntry(relid, false) != NULL);
+	SpinLockRelease(&RecathonEvents->mutex);
+
+	return watched;
+}
+
+/* ----------------------------------------------------------------
+ *		recathonEventsPassStart
+ *
+ *		Happens as a maintenance pass over a table starts. Any
+ *		events committed from now on may be missed by it, so
+ *		the next transaction to add some notifies again.
+ * ----------------------------------------------------------------
+ */
+void
+recathonEventsPassStart(Oid relid) {
+	RecathonEventsEntry *entry;
+
+	if (!RecathonEvents)
+		return;
+
+	SpinLockAcquire(&RecathonEvents->mutex);
+	entry = eventsEntry(relid, false);
+	if (entry)
+		entry->notified = false;
+	SpinLockRelease(&RecathonEvents->mutex);
+}
+
+/* ----------------------------------------------------------------
+ *		recathonEventsLookupCount
+ *
+ *		If nothing has been added to or taken out of a table
+ *		since it was last counted, returns true along with
+ *		the count. Otherwise the caller should count it now,
+ *		and hand the count to recathonEventsStoreCount; any
+ *		events committed in the meantime make us count again
+ *		next time.
+ * ----------------------------------------------------------------
+ */
+bool
+recathonEventsLookupCount(Oid relid, Oid relfilenode,
+		int64 deleted, int *ret_count) {
+	RecathonEventsEntry *entry;
+	bool found = false;
+
+	if (!RecathonEvents)
+		return false;
+
+	SpinLockAcquire(&RecathonEvents->mutex);
+	entry = eventsEntry(relid, true);
+	if (entry) {
+		if (entry->counted && !entry->changed &&
+		    entry->relfilenode == relfilenode && entry->deleted == deleted) {
+			(*ret_count) = entry->count;
+			found = true;
+		} else {
+			entry->changed = false;
+			entry->counted = false;
+		}
+	}
+	SpinLockRelease(&RecathonEvents->mutex);
+
+	return found;
+}
+
+/* ----------------------------------------------------------------
+ *		recathonEventsStoreCount
+ *
+ *		Keeps a table's count, taken after a failed lookup.
+ * ----------------------------------------------------------------
+ */
+void
+recathonEventsStoreCount(Oid relid, Oid relfilenode,
+		int64 deleted, int count) {
+	RecathonEventsEntry *entry;
+
+	if (!RecathonEvents)
+		return;
+
+	SpinLockAcquire(&RecathonEvents->mutex);
+	entry = eventsEntry(relid, false);
+	if (entry) {
+		entry->counted = true;
+		entry->count = count;
+		entry->relfilenode = relfilenode;
+		entry->deleted = deleted;
+	}
+	SpinLockRelease(&RecathonEvents->mutex);
+}
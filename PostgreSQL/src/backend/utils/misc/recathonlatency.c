@@ -0,0 +1,350 @@
+/*-------------------------------------------------------------------------
+ *
+ * recathonlatency.c
+ *	  Shared-memory latency histograms of recommenders.
+ *
+ * pg_stat_recommenders has the average and the longest latency of each
+ * recommender's queries, but an average hides the slow tail, and the
+ * longest is just one query. So every RECOMMEND query that finishes
+ * also adds how long it took here, along with how long it spent setting
+ * up, preparing users and scoring items, into histograms kept for the
+ * recommender, and so does every maintenance rebuild. The buckets are
+ * log-linear, eight to a power of two (see recathonlatency.h), so the
+ * percentiles pg_stat_recommender_latency reads off them are within an
+ * eighth of the truth however long the queries take.
+ *
+ * The stats collector would be the obvious home for these, but a
+ * histogram doesn't fit in its messages, and queries would have to
+ * wait for it to hear about them. Here, a query only adds to a few
+ * counters, with atomic adds where the compiler has them, and without
+ * taking any lock: a recommender's entry is looked for without one,
+ * and only made under the spinlock, the first time it's needed.
+ * Entries are given back when their recommender is dropped, and a
+ * query adding to one just then may be lost, or counted for the next
+ * recommender to take it; that's as good as statistics need to be.
+ * When every entry is taken, the rest of the recommenders aren't
+ * tracked. pg_stat_reset() empties the current database's histograms.
+ *
+ * Portions Copyright (c) 2012-2013, University of Minnesota
+ * Portions Copyright (c) 1996-2012, PostgreSQL Global Development Group
+ * Portions Copyright (c) 1994, Regents of the University of California
+ *
+ * IDENTIFICATION
+ *	  src/backend/utils/misc/recathonlatency.c
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include <math.h>
+
+#include "access/hash.h"
+#include "miscadmin.h"
+#include "storage/barrier.h"
+#include "storage/shmem.h"
+#include "storage/spin.h"
+#include "utils/recathonlatency.h"
+
+/* Counters are added to atomically where the compiler can do it. */
+#if defined(HAVE_GCC_INT_ATOMICS) && SIZEOF_VOID_P >= 8
+#define RECATHON_LATENCY_ATOMIC
+#endif
+
+/* One recommender's histograms. */
+typedef struct RecathonLatencyEntry
+{
+	bool		inUse;			/* does this entry belong to anyone? */
+	Oid			databaseid;		/* the recommender's database */
+	uint32		hash;			/* of the name, to compare quickly */
+	char		recname[NAMEDATALEN];
+#ifndef RECATHON_LATENCY_ATOMIC
+	slock_t		mutex;			/* protects the counters */
+#endif
+	uint64		count[RECATHON_LATENCY_PHASES];
+	uint64		total[RECATHON_LATENCY_PHASES];
+	uint64		buckets[RECATHON_LATENCY_PHASES][RECATHON_LATENCY_BUCKETS];
+} RecathonLatencyEntry;
+
+typedef struct RecathonLatencyControl
+{
+	slock_t		mutex;			/* protects which entries are in use */
+	RecathonLatencyEntry entries[RECATHON_LATENCY_RECOMMENDERS];
+} RecathonLatencyControl;
+
+/* GUC variable */
+bool		recathon_track_latency = true;
+
+static RecathonLatencyControl *RecathonLatency = NULL;
+
+/* ----------------------------------------------------------------
+ *		RecathonLatencyShmemSize
+ *
+ *		Reports the shared memory we need.
+ * ----------------------------------------------------------------
+ */
+Size
+RecathonLatencyShmemSize(void) {
+	return MAXALIGN(sizeof(RecathonLatencyControl));
+}
+
+/* ----------------------------------------------------------------
+ *		RecathonLatencyShmemInit
+ *
+ *		Sets up the histograms in shared memory, or attaches
+ *		to them.
+ * ----------------------------------------------------------------
+ */
+void
+RecathonLatencyShmemInit(void) {
+	int i;
+	bool found;
+
+	RecathonLatency = (RecathonLatencyControl*) ShmemInitStruct("Recathon Latency Histograms",
+		RecathonLatencyShmemSize(), &found);
+
+	if (!found) {
+		SpinLockInit(&RecathonLatency->mutex);
+		for (i = 0; i < RECATHON_LATENCY_RECOMMENDERS; i++) {
+			RecathonLatency->entries[i].inUse = false;
+#ifndef RECATHON_LATENCY_ATOMIC
+			SpinLockInit(&RecathonLatency->entries[i].mutex);
+#endif
+		}
+	}
+}
+
+/* The bucket a latency of usecs microseconds goes in. */
+static int
+latencyBucket(uint64 usecs) {
+	int e, bucket;
+
+	if (usecs < 16)
+		return (int) usecs;
+
+	// 2^e <= usecs < 2^(e+1), and its next three bits pick
+	// the eighth of that it's in.
+	for (e = 4; e < 63 && (usecs >> (e+1)) != 0; e++)
+		;
+	bucket = 16 + (e - 4) * 8 + (int) ((usecs >> (e - 3)) & 7);
+	return Min(bucket, RECATHON_LATENCY_BUCKETS - 1);
+}
+
+/* The longest latency, in microseconds, a bucket holds. */
+static double
+latencyBucketBound(int bucket) {
+	int e, eighth;
+
+	if (bucket < 16)
+		return (double) bucket;
+
+	e = 4 + (bucket - 16) / 8;
+	eighth = (bucket - 16) % 8;
+	return ldexp((double) (9 + eighth), e - 3) - 1.0;
+}
+
+/* Adds n to a counter of an entry. */
+static void
+latencyAdd(volatile RecathonLatencyEntry *entry, volatile uint64 *counter, uint64 n) {
+#ifdef RECATHON_LATENCY_ATOMIC
+	(void) __sync_fetch_and_add(counter, n);
+#else
+	SpinLockAcquire(&entry->mutex);
+	*counter += n;
+	SpinLockRelease(&entry->mutex);
+#endif
+}
+
+/* ----------------------------------------------------------------
+ *		latencyEntry
+ *
+ *		Finds a recommender's entry in our database, without
+ *		taking the lock. If it has none and create is true,
+ *		one is made for it, if there's one to spare. Returns
+ *		NULL if there isn't.
+ * ----------------------------------------------------------------
+ */
+static RecathonLatencyEntry *
+latencyEntry(const char *recname, bool create) {
+	int i, slot;
+	uint32 hash;
+	RecathonLatencyEntry *entry;
+
+	hash = DatumGetUInt32(hash_any((const unsigned char *) recname, strlen(recname)));
+	for (i = 0; i < RECATHON_LATENCY_RECOMMENDERS; i++) {
+		entry = &RecathonLatency->entries[i];
+		if (!entry->inUse)
+			continue;
+		pg_read_barrier();
+		if (entry->hash == hash && entry->databaseid == MyDatabaseId &&
+		    strncmp(entry->recname, recname, NAMEDATALEN) == 0)
+			return entry;
+	}
+	if (!create)
+		return NULL;
+
+	// Someone may have made it since we looked, so we look again
+	// while we hold the lock.
+	slot = -1;
+	SpinLockAcquire(&RecathonLatency->mutex);
+	for (i = 0; i < RECATHON_LATENCY_RECOMMENDERS; i++) {
+		entry = &RecathonLatency->entries[i];
+		if (!entry->inUse) {
+			if (slot < 0)
+				slot = i;
+			continue;
+		}
+		if (entry->hash == hash && entry->databaseid == MyDatabaseId &&
+		    strncmp(entry->recname, recname, NAMEDATALEN) == 0) {
+			SpinLockRelease(&RecathonLatency->mutex);
+			return entry;
+		}
+	}
+	if (slot < 0) {
+		SpinLockRelease(&RecathonLatency->mutex);
+		return NULL;
+	}
+
+	// The entry has to be filled in before anyone can find it.
+	entry = &RecathonLatency->entries[slot];
+	entry->databaseid = MyDatabaseId;
+	entry->hash = hash;
+	strlcpy(entry->recname, recname, NAMEDATALEN);
+	MemSet(entry->count, 0, sizeof(entry->count));
+	MemSet(entry->total, 0, sizeof(entry->total));
+	MemSet(entry->buckets, 0, sizeof(entry->buckets));
+	pg_write_barrier();
+	entry->inUse = true;
+	SpinLockRelease(&RecathonLatency->mutex);
+
+	return entry;
+}
+
+/* ----------------------------------------------------------------
+ *		recathonLatencyRecord
+ *
+ *		Adds a latency of usecs microseconds to one of the
+ *		histograms of the recommender named recname, as the
+ *		statistics collector names it.
+ * ----------------------------------------------------------------
+ */
+void
+recathonLatencyRecord(const char *recname, RecathonLatencyPhase phase, uint64 usecs) {
+	RecathonLatencyEntry *entry;
+
+	if (!RecathonLatency || !recathon_track_latency)
+		return;
+
+	entry = latencyEntry(recname, true);
+	if (!entry)
+		return;
+
+	latencyAdd(entry, &entry->count[phase], 1);
+	latencyAdd(entry, &entry->total[phase], usecs);
+	latencyAdd(entry, &entry->buckets[phase][latencyBucket(usecs)], 1);
+}
+
+/* ----------------------------------------------------------------
+ *		recathonLatencyReset
+ *
+ *		Empties the histograms of our database's recommenders.
+ * ----------------------------------------------------------------
+ */
+void
+recathonLatencyReset(void) {
+	int i;
+
+	if (!RecathonLatency)
+		return;
+
+	SpinLockAcquire(&RecathonLatency->mutex);
+	for (i = 0; i < RECATHON_LATENCY_RECOMMENDERS; i++) {
+		RecathonLatencyEntry *entry = &RecathonLatency->entries[i];
+
+		if (entry->inUse && entry->databaseid == MyDatabaseId)
+			entry->inUse = false;
+	}
+	SpinLockRelease(&RecathonLatency->mutex);
+}
+
+/* ----------------------------------------------------------------
+ *		recathonLatencyDrop
+ *
+ *		Gives back the entry of a recommender that's gone.
+ * ----------------------------------------------------------------
+ */
+void
+recathonLatencyDrop(const char *recname) {
+	RecathonLatencyEntry *entry;
+
+	if (!RecathonLatency)
+		return;
+
+	SpinLockAcquire(&RecathonLatency->mutex);
+	entry = latencyEntry(recname, false);
+	if (entry)
+		entry->inUse = false;
+	SpinLockRelease(&RecathonLatency->mutex);
+}
+
+/* ----------------------------------------------------------------
+ *		recathonLatencySnapshot
+ *
+ *		Copies the histograms of our database's recommenders,
+ *		into an array palloc'd for them. Returns how many
+ *		there are. Queries can add to them as we copy, so a
+ *		histogram may be a query or two off its count.
+ * ----------------------------------------------------------------
+ */
+int
+recathonLatencySnapshot(RecathonLatencyStats **ret_stats) {
+	int i, n;
+	RecathonLatencyStats *stats;
+
+	stats = (RecathonLatencyStats*) palloc(RECATHON_LATENCY_RECOMMENDERS*sizeof(RecathonLatencyStats));
+	n = 0;
+	for (i = 0; RecathonLatency && i < RECATHON_LATENCY_RECOMMENDERS; i++) {
+		RecathonLatencyEntry *entry = &RecathonLatency->entries[i];
+
+		if (!entry->inUse || entry->databaseid != MyDatabaseId)
+			continue;
+		pg_read_barrier();
+		strlcpy(stats[n].recname, entry->recname, NAMEDATALEN);
+		memcpy(stats[n].count, entry->count, sizeof(stats[n].count));
+		memcpy(stats[n].total, entry->total, sizeof(stats[n].total));
+		memcpy(stats[n].buckets, entry->buckets, sizeof(stats[n].buckets));
+		n++;
+	}
+
+	(*ret_stats) = stats;
+	return n;
+}
+
+/* ----------------------------------------------------------------
+ *		recathonLatencyPercentile
+ *
+ *		Reads the latency that the given fraction of what a
+ *		histogram counted took at most, in microseconds, off
+ *		its buckets. It's the top of the bucket the latency
+ *		falls in, so it's never less than the true one, and
+ *		never more than an eighth more.
+ * ----------------------------------------------------------------
+ */
+double
+recathonLatencyPercentile(const uint64 *buckets, uint64 count, double fraction) {
+	int b;
+	uint64 rank, seen;
+
+	if (count == 0)
+		return 0.0;
+
+	rank = (uint64) ceil(fraction * count);
+	if (rank < 1)
+		rank = 1;
+	seen = 0;
+	for (b = 0; b < RECATHON_LATENCY_BUCKETS; b++) {
+		seen += buckets[b];
+		if (seen >= rank)
+			return latencyBucketBound(b);
+	}
+	return latencyBucketBound(RECATHON_LATENCY_BUCKETS - 1);
+}
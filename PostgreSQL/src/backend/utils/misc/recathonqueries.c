@@ -0,0 +1,231 @@
+/*-------------------------------------------------------------------------
+ *
+ * recathonqueries.c
+ *	  Shared-memory tally of the users hybrid recommenders are queried for.
+ *
+ * A hybrid recommender materializes the predictions of its heavy users,
+ * the ones most of its queries ask about, so it needs to know who asks.
+ * Noting that down in a table made every RECOMMEND query a write, with a
+ * transaction ID, WAL and a commit flush, which limits a read-only
+ * workload to the rate the disk can sync. So queries add to a tally here
+ * instead, and the maintenance pass drains it into the recommender's
+ * UserQueries table, where the heavy users are worked out.
+ *
+ * Each recommender takes a tally the first time it's queried after a
+ * pass, and gives it back when the pass drains it. A tally holds up to
+ * RECATHON_QUERY_USERS users, in an open-addressed table kept at most
+ * three quarters full; once it's that full, users not in it yet aren't
+ * counted until the next pass. The heavy users are the ones asked about
+ * most, so they're nearly always in by then. Neither are the queries of
+ * a recommender that finds no tally free, and a tally that's drained by
+ * a pass that goes on to fail is lost, which just delays the heavy users
+ * a pass.
+ *
+ * A RECOMMEND query for many users adds them all at once, and a drain
+ * reads every slot of a tally, so the tallies are kept under an LWLock
+ * rather than a spinlock.
+ *
+ * Portions Copyright (c) 2012-2013, University of Minnesota
+ * Portions Copyright (c) 1996-2012, PostgreSQL Global Development Group
+ * Portions Copyright (c) 1994, Regents of the University of California
+ *
+ * IDENTIFICATION
+ *	  src/backend/utils/misc/recathonqueries.c
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "access/hash.h"
+#include "miscadmin.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "utils/recathonqueries.h"
+
+/* How full a tally gets before it stops taking new users. */
+#define RECATHON_QUERY_MAXFILL (RECATHON_QUERY_USERS / 4 * 3)
+
+/* One user's queries, in a slot of a tally. */
+typedef struct RecathonQueryUser
+{
+	int			userID;
+	float		queries;		/* zero for an empty slot */
+} RecathonQueryUser;
+
+/* The users one recommender has been queried for. */
+typedef struct RecathonQueryTally
+{
+	bool		inUse;			/* does this tally belong to anyone? */
+	Oid			databaseid;		/* the recommender's database */
+	uint32		hash;			/* of the name, to compare quickly */
+	char		recindexname[NAMEDATALEN];
+	int			numUsers;		/* the slots in use */
+	RecathonQueryUser users[RECATHON_QUERY_USERS];
+} RecathonQueryTally;
+
+typedef struct RecathonQueriesControl
+{
+	/* RecathonQueriesLock protects everything here */
+	RecathonQueryTally tallies[RECATHON_QUERY_RECOMMENDERS];
+} RecathonQueriesControl;
+
+static RecathonQueriesControl *RecathonQueries = NULL;
+
+/* ----------------------------------------------------------------
+ *		RecathonQueriesShmemSize
+ *
+ *		Reports the shared memory we need.
+ * ----------------------------------------------------------------
+ */
+Size
+RecathonQueriesShmemSize(void) {
+	return MAXALIGN(sizeof(RecathonQueriesControl));
+}
+
+/* ----------------------------------------------------------------
+ *		RecathonQueriesShmemInit
+ *
+ *		Sets up the tallies in shared memory, or attaches to
+ *		them.
+ * ----------------------------------------------------------------
+ */
+void
+RecathonQueriesShmemInit(void) {
+	int i;
+	bool found;
+
+	RecathonQueries = (RecathonQueriesControl*) ShmemInitStruct("Recathon Query Tallies",
+		RecathonQueriesShmemSize(), &found);
+
+	if (!found) {
+		for (i = 0; i < RECATHON_QUERY_RECOMMENDERS; i++)
+			RecathonQueries->tallies[i].inUse = false;
+	}
+}
+
+/* ----------------------------------------------------------------
+ *		findTally
+ *
+ *		Finds the tally of the recommender with the given
+ *		name and hash in this database, or NULL. The caller
+ *		holds RecathonQueriesLock.
+ * ----------------------------------------------------------------
+ */
+static RecathonQueryTally *
+findTally(const char *recindexname, uint32 hash) {
+	int i;
+	RecathonQueryTally *tally;
+
+	for (i = 0; i < RECATHON_QUERY_RECOMMENDERS; i++) {
+		tally = &RecathonQueries->tallies[i];
+		if (tally->inUse && tally->hash == hash &&
+		    tally->databaseid == MyDatabaseId &&
+		    strncmp(tally->recindexname, recindexname, NAMEDATALEN - 1) == 0)
+			return tally;
+	}
+	return NULL;
+}
+
+/* ----------------------------------------------------------------
+ *		userSlot
+ *
+ *		The first slot to look in for a user.
+ * ----------------------------------------------------------------
+ */
+static inline int
+userSlot(int userID) {
+	return (int) (((uint32) userID * 2654435761U) % RECATHON_QUERY_USERS);
+}
+
+/* ----------------------------------------------------------------
+ *		recathonQueriesNote
+ *
+ *		Counts one query for each of the given users of a
+ *		hybrid recommender.
+ * ----------------------------------------------------------------
+ */
+void
+recathonQueriesNote(const char *recindexname, const int *userIDs, int numUsers) {
+	int i, j, pos;
+	uint32 hash;
+	RecathonQueryTally *tally;
+
+	if (!RecathonQueries || numUsers <= 0)
+		return;
+
+	hash = DatumGetUInt32(hash_any((const unsigned char *) recindexname,
+		strlen(recindexname)));
+
+	LWLockAcquire(RecathonQueriesLock, LW_EXCLUSIVE);
+	tally = findTally(recindexname, hash);
+	for (i = 0; !tally && i < RECATHON_QUERY_RECOMMENDERS; i++) {
+		if (RecathonQueries->tallies[i].inUse)
+			continue;
+		tally = &RecathonQueries->tallies[i];
+		tally->inUse = true;
+		tally->databaseid = MyDatabaseId;
+		tally->hash = hash;
+		strlcpy(tally->recindexname, recindexname, NAMEDATALEN);
+		tally->numUsers = 0;
+		for (j = 0; j < RECATHON_QUERY_USERS; j++)
+			tally->users[j].queries = 0.0;
+	}
+	if (!tally) {
+		LWLockRelease(RecathonQueriesLock);
+		return;
+	}
+
+	for (i = 0; i < numUsers; i++) {
+		pos = userSlot(userIDs[i]);
+		while (tally->users[pos].queries > 0.0 &&
+		       tally->users[pos].userID != userIDs[i])
+			pos = (pos + 1) % RECATHON_QUERY_USERS;
+		if (tally->users[pos].queries > 0.0)
+			tally->users[pos].queries += 1.0;
+		else if (tally->numUsers < RECATHON_QUERY_MAXFILL) {
+			tally->users[pos].userID = userIDs[i];
+			tally->users[pos].queries = 1.0;
+			tally->numUsers++;
+		}
+	}
+	LWLockRelease(RecathonQueriesLock);
+}
+
+/* ----------------------------------------------------------------
+ *		recathonQueriesDrain
+ *
+ *		Takes the tally of a recommender, putting its users
+ *		and their queries in the given arrays, which must
+ *		have room for RECATHON_QUERY_USERS, and gives the
+ *		tally back. Returns the number of users.
+ * ----------------------------------------------------------------
+ */
+int
+recathonQueriesDrain(const char *recindexname, int *userIDs, float *queries) {
+	int i, numUsers;
+	uint32 hash;
+	RecathonQueryTally *tally;
+
+	if (!RecathonQueries)
+		return 0;
+
+	hash = DatumGetUInt32(hash_any((const unsigned char *) recindexname,
+		strlen(recindexname)));
+
+	numUsers = 0;
+	LWLockAcquire(RecathonQueriesLock, LW_EXCLUSIVE);
+	tally = findTally(recindexname, hash);
+	if (tally) {
+		for (i = 0; i < RECATHON_QUERY_USERS; i++) {
+			if (tally->users[i].queries <= 0.0)
+				continue;
+			userIDs[numUsers] = tally->users[i].userID;
+			queries[numUsers] = tally->users[i].queries;
+			numUsers++;
+		}
+		tally->inUse = false;
+	}
+	LWLockRelease(RecathonQueriesLock);
+
+	return numUsers;
+}
@@ -0,0 +1,449 @@
+/*-------------------------------------------------------------------------
+ *
+ * recathonresults.c
+ *	  Shared-memory cache of the recommendations handed out to each user.
+ *
+ * Applications tend to ask for the same user's best few items over and
+ * over, and until the model is rebuilt or the user does something new,
+ * the answer doesn't change. So once a top-k query for a single user
+ * has been scored, its list is kept here, and the next query for that
+ * user that wants no more of it is answered without scoring anything.
+ *
+ * A list is keyed by recommender, user, and the version of the models
+ * it was scored from, so a rebuild makes every old list useless. When
+ * new events for a user are committed, that user's lists for the
+ * recommenders on the events table are thrown out. The lists live in
+ * a set-associative table: a user's lists can go in any of the few
+ * slots of one set, chosen by the user ID, and when the set is full
+ * the least recently used list in it goes. Each set also counts its
+ * invalidations, so that a list scored while its user's events were
+ * changing isn't stored afterwards.
+ *
+ * The users whose lists were thrown out are also queued here, so that
+ * recathon_prewarm(), run from the maintenance session, can score them
+ * again before they come back. The queue is a ring; when it's full, the
+ * oldest user waiting is forgotten. It's shared by every database, and
+ * each user is only taken off it by recathon_prewarm() in their own.
+ *
+ * Portions Copyright (c) 2012-2013, University of Minnesota
+ * Portions Copyright (c) 1996-2012, PostgreSQL Global Development Group
+ * Portions Copyright (c) 1994, Regents of the University of California
+ *
+ * IDENTIFICATION
+ *	  src/backend/utils/misc/recathonresults.c
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "access/hash.h"
+#include "miscadmin.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "utils/recathoncache.h"
+#include "utils/recathonresults.h"
+
+/* The lists that share a set. */
+#define RECATHON_RESULT_WAYS 8
+
+/* One user's best predictions from one recommender. */
+typedef struct RecathonResultEntry
+{
+	bool		inUse;			/* does this slot hold a list? */
+	bool		complete;		/* is every prediction for the user in it? */
+	Oid			databaseid;		/* the recommender's database */
+	char		recname[NAMEDATALEN];	/* the recommender it came from */
+	char		eventtable[NAMEDATALEN];	/* the events it was scored from */
+	int			userID;			/* the user it's for */
+	uint32		version;		/* the build of the models it came from */
+	int			count;			/* how many predictions it holds */
+	uint64		lastUsed;		/* clock value at its last use */
+	int			items[RECATHON_RESULT_LENGTH];	/* best first */
+	float		scores[RECATHON_RESULT_LENGTH];	/* and their predictions */
+} RecathonResultEntry;
+
+/* The users waiting to have their lists scored again. */
+#define RECATHON_PREWARM_LENGTH 1024
+
+typedef struct RecathonPrewarmEntry
+{
+	Oid			databaseid;		/* the database of the events table */
+	char		eventtable[NAMEDATALEN];	/* where their new events went */
+	int			userID;			/* the user */
+} RecathonPrewarmEntry;
+
+typedef struct RecathonResultControl
+{
+	uint64		clock;			/* ticks once per use */
+	int			numSets;		/* the number of sets */
+	uint64		prewarmHead;	/* the next user to take off the queue */
+	uint64		prewarmTail;	/* where the next user goes on */
+	RecathonPrewarmEntry prewarm[RECATHON_PREWARM_LENGTH];
+} RecathonResultControl;
+
+/* GUC variable */
+int			recathon_result_cache_size = 0;
+
+static RecathonResultControl *RecathonResults = NULL;
+static uint32 *RecathonResultGenerations = NULL;
+static RecathonResultEntry *RecathonResultEntries = NULL;
+
+static int
+resultCacheSets(void) {
+	return (recathon_result_cache_size + RECATHON_RESULT_WAYS - 1) / RECATHON_RESULT_WAYS;
+}
+
+/* ----------------------------------------------------------------
+ *		RecathonResultCacheShmemSize
+ *
+ *		Reports the shared memory the cache needs, which is
+ *		none at all when it's turned off.
+ * ----------------------------------------------------------------
+ */
+Size
+RecathonResultCacheShmemSize(void) {
+	Size size;
+	int numSets;
+
+	if (recathon_result_cache_size <= 0)
+		return 0;
+
+	numSets = resultCacheSets();
+	size = MAXALIGN(sizeof(RecathonResultControl));
+	size = add_size(size, MAXALIGN(mul_size(numSets, sizeof(uint32))));
+	size = add_size(size, mul_size(mul_size(numSets, RECATHON_RESULT_WAYS),
+		sizeof(RecathonResultEntry)));
+	return size;
+}
+
+/* ----------------------------------------------------------------
+ *		RecathonResultCacheShmemInit
+ *
+ *		Sets up the cache in shared memory, or attaches to it.
+ * ----------------------------------------------------------------
+ */
+void
+RecathonResultCacheShmemInit(void) {
+	int i, numSets;
+	bool found;
+	char *base;
+
+	if (recathon_result_cache_size <= 0)
+		return;
+
+	numSets = resultCacheSets();
+	base = (char*) ShmemInitStruct("Recathon Result Cache",
+		RecathonResultCacheShmemSize(), &found);
+	RecathonResults = (RecathonResultControl*) base;
+	base += MAXALIGN(sizeof(RecathonResultControl));
+	RecathonResultGenerations = (uint32*) base;
+	base += MAXALIGN(mul_size(numSets, sizeof(uint32)));
+	RecathonResultEntries = (RecathonResultEntry*) base;
+
+	if (!found) {
+		RecathonResults->clock = 0;
+		RecathonResults->numSets = numSets;
+		RecathonResults->prewarmHead = 0;
+		RecathonResults->prewarmTail = 0;
+		for (i = 0; i < numSets; i++)
+			RecathonResultGenerations[i] = 0;
+		for (i = 0; i < numSets * RECATHON_RESULT_WAYS; i++)
+			RecathonResultEntries[i].inUse = false;
+	}
+}
+
+/* ----------------------------------------------------------------
+ *		recathonResultCacheEnabled
+ *
+ *		Is there a result cache to use?
+ * ----------------------------------------------------------------
+ */
+bool
+recathonResultCacheEnabled(void) {
+	return RecathonResults != NULL;
+}
+
+/* The set holding a user's lists. */
+static int
+userSet(int userID) {
+	uint32 hash = DatumGetUInt32(hash_uint32((uint32) userID));
+
+	return (int) (hash % (uint32) RecathonResults->numSets);
+}
+
+/* Does a list belong to the recommender or table of that name here? */
+static bool
+sameName(RecathonResultEntry *entry, const char *a, const char *b) {
+	return entry->databaseid == MyDatabaseId &&
+		strncmp(a, b, NAMEDATALEN - 1) == 0;
+}
+
+/* ----------------------------------------------------------------
+ *		recathonResultLookup
+ *
+ *		Looks for a user's list from a given build of a
+ *		recommender's models. If there is one, and it holds at
+ *		least the wanted number of predictions or all that the
+ *		user has, it's copied into items and scores, which must
+ *		have room for RECATHON_RESULT_LENGTH, and we return how
+ *		many there are. Otherwise we return -1, along with the
+ *		set's generation for recathonResultStore. A list from
+ *		an older build is thrown out; one from a build our
+ *		snapshot can't see yet is left alone.
+ * ----------------------------------------------------------------
+ */
+int
+recathonResultLookup(const char *recname, int userID, uint32 version,
+		int wanted, int *items, float *scores, uint32 *ret_generation) {
+	int i, set, count;
+
+	if (!RecathonResults)
+		return -1;
+
+	count = -1;
+	set = userSet(userID);
+	LWLockAcquire(RecathonResultCacheLock, LW_EXCLUSIVE);
+	(*ret_generation) = RecathonResultGenerations[set];
+	for (i = set * RECATHON_RESULT_WAYS; i < (set+1) * RECATHON_RESULT_WAYS; i++) {
+		RecathonResultEntry *entry = &RecathonResultEntries[i];
+
+		if (!entry->inUse || entry->userID != userID ||
+		    !sameName(entry, entry->recname, recname))
+			continue;
+		if (entry->version != version) {
+			if (!recathonVersionIsNewer(entry->version))
+				entry->inUse = false;
+			continue;
+		}
+		if (entry->count < wanted && !entry->complete)
+			continue;
+
+		entry->lastUsed = ++RecathonResults->clock;
+		count = entry->count;
+		memcpy(items, entry->items, count * sizeof(int));
+		memcpy(scores, entry->scores, count * sizeof(float));
+		break;
+	}
+	LWLockRelease(RecathonResultCacheLock);
+
+	return count;
+}
+
+/* ----------------------------------------------------------------
+ *		recathonResultStore
+ *
+ *		Keeps a user's list, best first, in place of any list
+ *		we had for the same recommender and user. complete says
+ *		that these are all of the user's predictions. Nothing
+ *		is kept if the user's set has been invalidated since
+ *		the lookup that gave us the generation, since the list
+ *		may have been scored from events that are gone, or if
+ *		the list there is from a newer build than ours.
+ * ----------------------------------------------------------------
+ */
+void
+recathonResultStore(const char *recname, const char *eventtable, int userID,
+		uint32 version, uint32 generation, int count, bool complete,
+		const int *items, const float *scores) {
+	int i, set, slot;
+	RecathonResultEntry *entry;
+
+	if (!RecathonResults)
+		return;
+	if (count > RECATHON_RESULT_LENGTH) {
+		count = RECATHON_RESULT_LENGTH;
+		complete = false;
+	}
+
+	set = userSet(userID);
+	LWLockAcquire(RecathonResultCacheLock, LW_EXCLUSIVE);
+	if (RecathonResultGenerations[set] != generation) {
+		LWLockRelease(RecathonResultCacheLock);
+		return;
+	}
+
+	// Take the old list's slot if there is one, then a free slot,
+	// and failing that the least recently used.
+	slot = -1;
+	for (i = set * RECATHON_RESULT_WAYS; i < (set+1) * RECATHON_RESULT_WAYS; i++) {
+		entry = &RecathonResultEntries[i];
+
+		if (entry->inUse && entry->userID == userID &&
+		    sameName(entry, entry->recname, recname)) {
+			if (entry->version != version &&
+			    recathonVersionIsNewer(entry->version)) {
+				LWLockRelease(RecathonResultCacheLock);
+				return;
+			}
+			slot = i;
+			break;
+		}
+		if (slot < 0)
+			slot = i;
+		else if (!RecathonResultEntries[slot].inUse)
+			continue;
+		else if (!entry->inUse ||
+		    entry->lastUsed < RecathonResultEntries[slot].lastUsed)
+			slot = i;
+	}
+
+	entry = &RecathonResultEntries[slot];
+	entry->inUse = true;
+	entry->complete = complete;
+	entry->databaseid = MyDatabaseId;
+	strlcpy(entry->recname, recname, NAMEDATALEN);
+	strlcpy(entry->eventtable, eventtable, NAMEDATALEN);
+	entry->userID = userID;
+	entry->version = version;
+	entry->count = count;
+	entry->lastUsed = ++RecathonResults->clock;
+	memcpy(entry->items, items, count * sizeof(int));
+	memcpy(entry->scores, scores, count * sizeof(float));
+	LWLockRelease(RecathonResultCacheLock);
+}
+
+/* ----------------------------------------------------------------
+ *		recathonResultInvalidate
+ *
+ *		Throws out a user's lists from every recommender built
+ *		on the given events table, once new events for them
+ *		have been committed.
+ * ----------------------------------------------------------------
+ */
+void
+recathonResultInvalidate(const char *eventtable, int userID) {
+	int i, set;
+
+	if (!RecathonResults)
+		return;
+
+	set = userSet(userID);
+	LWLockAcquire(RecathonResultCacheLock, LW_EXCLUSIVE);
+	RecathonResultGenerations[set]++;
+	for (i = set * RECATHON_RESULT_WAYS; i < (set+1) * RECATHON_RESULT_WAYS; i++) {
+		RecathonResultEntry *entry = &RecathonResultEntries[i];
+
+		if (entry->inUse && entry->userID == userID &&
+		    sameName(entry, entry->eventtable, eventtable))
+			entry->inUse = false;
+	}
+	LWLockRelease(RecathonResultCacheLock);
+}
+
+/* ----------------------------------------------------------------
+ *		recathonResultInvalidateTable
+ *
+ *		Throws out every list scored from the given events
+ *		table, for when too many users changed to name them.
+ * ----------------------------------------------------------------
+ */
+void
+recathonResultInvalidateTable(const char *eventtable) {
+	int i;
+
+	if (!RecathonResults)
+		return;
+
+	LWLockAcquire(RecathonResultCacheLock, LW_EXCLUSIVE);
+	for (i = 0; i < RecathonResults->numSets; i++)
+		RecathonResultGenerations[i]++;
+	for (i = 0; i < RecathonResults->numSets * RECATHON_RESULT_WAYS; i++) {
+		RecathonResultEntry *entry = &RecathonResultEntries[i];
+
+		if (entry->inUse && sameName(entry, entry->eventtable, eventtable))
+			entry->inUse = false;
+	}
+	LWLockRelease(RecathonResultCacheLock);
+}
+
+/* ----------------------------------------------------------------
+ *		recathonResultDrop
+ *
+ *		Throws out every list from a recommender that's being
+ *		dropped, so a new one by the same name starts clean.
+ * ----------------------------------------------------------------
+ */
+void
+recathonResultDrop(const char *recname) {
+	int i;
+
+	if (!RecathonResults)
+		return;
+
+	LWLockAcquire(RecathonResultCacheLock, LW_EXCLUSIVE);
+	for (i = 0; i < RecathonResults->numSets * RECATHON_RESULT_WAYS; i++) {
+		RecathonResultEntry *entry = &RecathonResultEntries[i];
+
+		if (entry->inUse && sameName(entry, entry->recname, recname))
+			entry->inUse = false;
+	}
+	LWLockRelease(RecathonResultCacheLock);
+}
+
+/* ----------------------------------------------------------------
+ *		recathonPrewarmQueue
+ *
+ *		Queues a user whose lists from the recommenders on the
+ *		given events table were just thrown out.
+ * ----------------------------------------------------------------
+ */
+void
+recathonPrewarmQueue(const char *eventtable, int userID) {
+	RecathonPrewarmEntry *entry;
+
+	if (!RecathonResults)
+		return;
+
+	LWLockAcquire(RecathonResultCacheLock, LW_EXCLUSIVE);
+	if (RecathonResults->prewarmTail - RecathonResults->prewarmHead >=
+	    RECATHON_PREWARM_LENGTH)
+		RecathonResults->prewarmHead++;
+	entry = &RecathonResults->prewarm[RecathonResults->prewarmTail % RECATHON_PREWARM_LENGTH];
+	entry->databaseid = MyDatabaseId;
+	strlcpy(entry->eventtable, eventtable, NAMEDATALEN);
+	entry->userID = userID;
+	RecathonResults->prewarmTail++;
+	LWLockRelease(RecathonResultCacheLock);
+}
+
+/* ----------------------------------------------------------------
+ *		recathonPrewarmNext
+ *
+ *		Takes the user of this database who has been waiting
+ *		longest off the queue, copying the events table's name
+ *		into eventtable, which must have room for NAMEDATALEN.
+ *		The users of other databases keep their places, for
+ *		their own database's maintenance session. Returns
+ *		false if nobody here is waiting.
+ * ----------------------------------------------------------------
+ */
+bool
+recathonPrewarmNext(char *eventtable, int *ret_userID) {
+	RecathonPrewarmEntry *entry;
+	uint64 pos;
+
+	if (!RecathonResults)
+		return false;
+
+	LWLockAcquire(RecathonResultCacheLock, LW_EXCLUSIVE);
+	for (pos = RecathonResults->prewarmHead; pos < RecathonResults->prewarmTail; pos++) {
+		if (RecathonResults->prewarm[pos % RECATHON_PREWARM_LENGTH].databaseid == MyDatabaseId)
+			break;
+	}
+	if (pos == RecathonResults->prewarmTail) {
+		LWLockRelease(RecathonResultCacheLock);
+		return false;
+	}
+	entry = &RecathonResults->prewarm[pos % RECATHON_PREWARM_LENGTH];
+	strlcpy(eventtable, entry->eventtable, NAMEDATALEN);
+	(*ret_userID) = entry->userID;
+
+	// The ones it passed over move up into its place.
+	for (; pos > RecathonResults->prewarmHead; pos--)
+		RecathonResults->prewarm[pos % RECATHON_PREWARM_LENGTH] =
+			RecathonResults->prewarm[(pos - 1) % RECATHON_PREWARM_LENGTH];
+	RecathonResults->prewarmHead++;
+	LWLockRelease(RecathonResultCacheLock);
+
+	return true;
+}
@@ -0,0 +1,312 @@
+/*-------------------------------------------------------------------------
+ *
+ * recathonxlog.c
+ *	  WAL records that ship model files to standbys.
+ *
+ * A model file is written outside the database, so nothing about it
+ * reaches a standby through replication; the standby had to rewrite it
+ * from the replicated model tables, and those tables had to be logged
+ * for that, page by page, though they're only ever derived from the
+ * events. Instead, once a new model file is written and synced, the
+ * primary logs the whole file, in chunks, and then a record saying that
+ * it's complete. Replaying the chunks writes them to the file's
+ * temporary name; replaying the last record syncs it and renames it into
+ * place, just as the primary did, so a standby's queries go on mapping
+ * the old file until the new one has all arrived. The file carries its
+ * model version, and a query only maps a file whose version matches the
+ * catalogue's, so a file that turns up before the commit that made it
+ * is simply ignored. Removing a model file is logged too.
+ *
+ * Nothing is logged under wal_level = minimal, since there's no standby
+ * or archive to ship to. A chunk that can't be written on replay costs
+ * the standby that file, but not the recovery: the file's temporary
+ * name is removed, the rest of its chunks are skipped, and its queries
+ * read the model tables, or wait for another file.
+ *
+ * Portions Copyright (c) 2012-2013, University of Minnesota
+ * Portions Copyright (c) 1996-2012, PostgreSQL Global Development Group
+ * Portions Copyright (c) 1994, Regents of the University of California
+ *
+ * IDENTIFICATION
+ *	  src/backend/utils/misc/recathonxlog.c
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "access/xlogutils.h"
+#include "miscadmin.h"
+#include "storage/fd.h"
+#include "utils/recathon.h"
+#include "utils/recathonxlog.h"
+
+static void modelFileName(char *path, Oid dbId, char *recindexname, bool temporary);
+
+/*
+ * Where a recommender's model file lives, as in recathon.c.
+ */
+static void
+modelFileName(char *path, Oid dbId, char *recindexname, bool temporary) {
+	snprintf(path, MAXPGPATH, "%s/%u_%s.model%s", RECATHON_MODEL_DIR,
+		dbId, recindexname, temporary ? ".tmp" : "");
+}
+
+/* ----------------------------------------------------------------
+ *		logModelFile
+ *
+ *		Logs a model file that's been written and synced at
+ *		tmppath, and is about to be renamed into place, so
+ *		that standbys get it too.
+ * ----------------------------------------------------------------
+ */
+void
+logModelFile(char *recindexname, char *tmppath, uint32 version, uint64 fileSize) {
+	FILE *file;
+	char *buffer;
+	uint64 offset;
+	Size length;
+	xl_recathon_model_chunk chunk;
+	xl_recathon_model_activate activate;
+	XLogRecData rdata[2];
+
+	if (!XLogIsNeeded() || RecoveryInProgress())
+		return;
+
+	file = AllocateFile(tmppath, PG_BINARY_R);
+	if (!file)
+		ereport(ERROR,
+			(errcode_for_file_access(),
+			 errmsg("could not open model file \"%s\": %m", tmppath)));
+	buffer = (char*) palloc(RECATHON_MODEL_WAL_CHUNK);
+
+	memset(&chunk, 0, sizeof(chunk));
+	chunk.dbId = MyDatabaseId;
+	strlcpy(chunk.recindexname, recindexname, NAMEDATALEN);
+	for (offset = 0; offset < fileSize; offset += length) {
+		length = (Size) Min(fileSize - offset, (uint64) RECATHON_MODEL_WAL_CHUNK);
+		if (fread(buffer, 1, length, file) != length)
+			ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not read model file \"%s\": %m", tmppath)));
+		chunk.offset = offset;
+
+		rdata[0].data = (char *) &chunk;
+		rdata[0].len = SizeOfRecathonModelChunk;
+		rdata[0].buffer = InvalidBuffer;
+		rdata[0].next = &(rdata[1]);
+		rdata[1].data = buffer;
+		rdata[1].len = length;
+		rdata[1].buffer = InvalidBuffer;
+		rdata[1].next = NULL;
+		XLogInsert(RM_RECATHON_ID, XLOG_RECATHON_MODEL_CHUNK, rdata);
+
+		CHECK_FOR_INTERRUPTS();
+	}
+
+	pfree(buffer);
+	if (FreeFile(file) != 0)
+		ereport(ERROR,
+			(errcode_for_file_access(),
+			 errmsg("could not close model file \"%s\": %m", tmppath)));
+
+	memset(&activate, 0, sizeof(activate));
+	activate.dbId = MyDatabaseId;
+	strlcpy(activate.recindexname, recindexname, NAMEDATALEN);
+	activate.version = version;
+	activate.fileSize = fileSize;
+	rdata[0].data = (char *) &activate;
+	rdata[0].len = sizeof(xl_recathon_model_activate);
+	rdata[0].buffer = InvalidBuffer;
+	rdata[0].next = NULL;
+	XLogInsert(RM_RECATHON_ID, XLOG_RECATHON_MODEL_ACTIVATE, rdata);
+}
+
+/* ----------------------------------------------------------------
+ *		logModelFileRemoval
+ *
+ *		Logs that a recommender's model file has been removed.
+ * ----------------------------------------------------------------
+ */
+void
+logModelFileRemoval(char *recindexname) {
+	xl_recathon_model_remove xlrec;
+	XLogRecData rdata;
+
+	if (!XLogIsNeeded() || RecoveryInProgress())
+		return;
+
+	memset(&xlrec, 0, sizeof(xlrec));
+	xlrec.dbId = MyDatabaseId;
+	strlcpy(xlrec.recindexname, recindexname, NAMEDATALEN);
+	rdata.data = (char *) &xlrec;
+	rdata.len = sizeof(xl_recathon_model_remove);
+	rdata.buffer = InvalidBuffer;
+	rdata.next = NULL;
+	XLogInsert(RM_RECATHON_ID, XLOG_RECATHON_MODEL_REMOVE, &rdata);
+}
+
+/*
+ * Writes one chunk of a shipped model file. The first chunk starts the
+ * temporary file afresh; the others only go into one that's there, so
+ * that once a chunk is lost, the rest are too.
+ */
+static void
+redoModelChunk(xl_recathon_model_chunk *xlrec, char *data, Size length) {
+	char path[MAXPGPATH];
+	int fd;
+	int flags = O_WRONLY | PG_BINARY;
+
+	modelFileName(path, xlrec->dbId, xlrec->recindexname, true);
+	if (xlrec->offset == 0) {
+		if (mkdir(RECATHON_MODEL_DIR, S_IRWXU) != 0 && errno != EEXIST) {
+			ereport(WARNING,
+				(errcode_for_file_access(),
+				 errmsg("could not create directory \"%s\": %m", RECATHON_MODEL_DIR)));
+			return;
+		}
+		flags |= O_CREAT | O_TRUNC;
+	}
+
+	fd = BasicOpenFile(path, flags, S_IRUSR | S_IWUSR);
+	if (fd < 0) {
+		if (errno != ENOENT || xlrec->offset == 0)
+			ereport(WARNING,
+				(errcode_for_file_access(),
+				 errmsg("could not open model file \"%s\": %m", path)));
+		return;
+	}
+	if (lseek(fd, (off_t) xlrec->offset, SEEK_SET) < 0 ||
+	    write(fd, data, length) != length) {
+		ereport(WARNING,
+			(errcode_for_file_access(),
+			 errmsg("could not write model file \"%s\": %m", path)));
+		close(fd);
+		unlink(path);
+		return;
+	}
+	close(fd);
+}
+
+/*
+ * Puts a shipped model file in place, if all of it arrived.
+ */
+static void
+redoModelActivate(xl_recathon_model_activate *xlrec) {
+	char path[MAXPGPATH], tmppath[MAXPGPATH];
+	struct stat st;
+	int fd;
+
+	modelFileName(path, xlrec->dbId, xlrec->recindexname, false);
+	modelFileName(tmppath, xlrec->dbId, xlrec->recindexname, true);
+
+	if (stat(tmppath, &st) != 0 || (uint64) st.st_size != xlrec->fileSize) {
+		ereport(WARNING,
+			(errmsg("model file \"%s\" version %u was not received in full, so it is not used",
+				path, xlrec->version)));
+		unlink(tmppath);
+		return;
+	}
+
+	fd = BasicOpenFile(tmppath, O_RDWR | PG_BINARY, 0);
+	if (fd < 0 || pg_fsync(fd) != 0) {
+		ereport(WARNING,
+			(errcode_for_file_access(),
+			 errmsg("could not fsync model file \"%s\": %m", tmppath)));
+		if (fd >= 0)
+			close(fd);
+		unlink(tmppath);
+		return;
+	}
+	close(fd);
+
+	if (rename(tmppath, path) != 0) {
+		ereport(WARNING,
+			(errcode_for_file_access(),
+			 errmsg("could not rename model file \"%s\" to \"%s\": %m", tmppath, path)));
+		unlink(tmppath);
+	}
+}
+
+/*
+ * Removes a model file, and any shipped file that hadn't been put in
+ * place yet.
+ */
+static void
+redoModelRemove(xl_recathon_model_remove *xlrec) {
+	char path[MAXPGPATH];
+
+	modelFileName(path, xlrec->dbId, xlrec->recindexname, false);
+	if (unlink(path) != 0 && errno != ENOENT)
+		ereport(WARNING,
+			(errcode_for_file_access(),
+			 errmsg("could not remove model file \"%s\": %m", path)));
+	modelFileName(path, xlrec->dbId, xlrec->recindexname, true);
+	unlink(path);
+}
+
+void
+recathon_redo(XLogRecPtr lsn, XLogRecord *record)
+{
+	uint8		info = record->xl_info & ~XLR_INFO_MASK;
+	char	   *rec = XLogRecGetData(record);
+
+	/* Backup blocks are not used in recathon records */
+	Assert(!(record->xl_info & XLR_BKP_BLOCK_MASK));
+
+	switch (info)
+	{
+		case XLOG_RECATHON_MODEL_CHUNK:
+			redoModelChunk((xl_recathon_model_chunk *) rec,
+						   rec + SizeOfRecathonModelChunk,
+						   record->xl_len - SizeOfRecathonModelChunk);
+			break;
+		case XLOG_RECATHON_MODEL_ACTIVATE:
+			redoModelActivate((xl_recathon_model_activate *) rec);
+			break;
+		case XLOG_RECATHON_MODEL_REMOVE:
+			redoModelRemove((xl_recathon_model_remove *) rec);
+			break;
+		default:
+			elog(PANIC, "recathon_redo: unknown op code %u", info);
+	}
+}
+
+void
+recathon_desc(StringInfo buf, uint8 xl_info, char *rec)
+{
+	uint8		info = xl_info & ~XLR_INFO_MASK;
+
+	switch (info)
+	{
+		case XLOG_RECATHON_MODEL_CHUNK:
+			{
+				xl_recathon_model_chunk *xlrec = (xl_recathon_model_chunk *) rec;
+
+				appendStringInfo(buf, "model chunk: %u/%s offset " UINT64_FORMAT,
+								 xlrec->dbId, xlrec->recindexname, xlrec->offset);
+				break;
+			}
+		case XLOG_RECATHON_MODEL_ACTIVATE:
+			{
+				xl_recathon_model_activate *xlrec = (xl_recathon_model_activate *) rec;
+
+				appendStringInfo(buf, "model activate: %u/%s version %u size " UINT64_FORMAT,
+								 xlrec->dbId, xlrec->recindexname, xlrec->version, xlrec->fileSize);
+				break;
+			}
+		case XLOG_RECATHON_MODEL_REMOVE:
+			{
+				xl_recathon_model_remove *xlrec = (xl_recathon_model_remove *) rec;
+
+				appendStringInfo(buf, "model remove: %u/%s", xlrec->dbId, xlrec->recindexname);
+				break;
+			}
+		default:
+			appendStringInfo(buf, "UNKNOWN");
+			break;
+	}
+}
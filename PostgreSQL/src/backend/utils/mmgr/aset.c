@@ -218,6 +218,7 @@ static void AllocSetDelete(MemoryContext context);
 static Size AllocSetGetChunkSpace(MemoryContext context, void *pointer);
 static bool AllocSetIsEmpty(MemoryContext context);
 static void AllocSetStats(MemoryContext context, int level);
+static Size AllocSetTotalSpace(MemoryContext context);
 
 #ifdef MEMORY_CONTEXT_CHECKING
 static void AllocSetCheck(MemoryContext context);
@@ -235,7 +236,8 @@ static MemoryContextMethods AllocSetMethods = {
 	AllocSetDelete,
 	AllocSetGetChunkSpace,
 	AllocSetIsEmpty,
-	AllocSetStats
+	AllocSetStats,
+	AllocSetTotalSpace
 #ifdef MEMORY_CONTEXT_CHECKING
 	,AllocSetCheck
 #endif
@@ -1093,6 +1095,23 @@ AllocSetStats(MemoryContext context, int level)
 			totalspace - freespace);
 }
 
+/*
+ * AllocSetTotalSpace
+ *		Returns the space allocated to an allocset from malloc, used or not.
+ */
+static Size
+AllocSetTotalSpace(MemoryContext context)
+{
+	AllocSet	set = (AllocSet) context;
+	Size		totalspace = 0;
+	AllocBlock	block;
+
+	for (block = set->blocks; block != NULL; block = block->next)
+		totalspace += block->endptr - ((char *) block);
+
+	return totalspace;
+}
+
 
 #ifdef MEMORY_CONTEXT_CHECKING
 
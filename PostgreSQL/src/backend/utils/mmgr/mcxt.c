@@ -398,6 +398,26 @@ MemoryContextStatsInternal(MemoryContext context, int level)
 		MemoryContextStatsInternal(child, level + 1);
 }
 
+/*
+ * MemoryContextTotalSpace
+ *		Return the space allocated to the named context and all its
+ *		descendants, whether or not it's in use.
+ */
+Size
+MemoryContextTotalSpace(MemoryContext context)
+{
+	MemoryContext child;
+	Size		total;
+
+	AssertArg(MemoryContextIsValid(context));
+
+	total = (*context->methods->total_space) (context);
+	for (child = context->firstchild; child != NULL; child = child->nextchild)
+		total += MemoryContextTotalSpace(child);
+
+	return total;
+}
+
 /*
  * MemoryContextCheck
  *		Check all chunks in the named context.
@@ -661,6 +661,18 @@ restore_toc_entry(ArchiveHandle *AH, TocEntry *te,
 
 					(*AH->PrintTocDataPtr) (AH, te, ropt);
 				}
+				else if (!RestoringToDB(AH) && te->copyStmt &&
+						 strstr(te->copyStmt, "WITH (FORMAT binary)") != NULL)
+				{
+					/*
+					 * Binary COPY data (recommender models) can't be put in
+					 * a script for psql; it has to go straight to a server.
+					 */
+					write_msg(modulename, "WARNING: skipping binary data for table \"%s\"; restore it with -d\n",
+							  te->tag);
+					ahprintf(AH, "-- Binary data for table \"%s\" omitted; restore it directly to a database\n\n",
+							 te->tag);
+				}
 				else
 				{
 					_disableTriggersIfNecessary(AH, te, ropt);
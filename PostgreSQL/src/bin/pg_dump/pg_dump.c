@@ -221,6 +221,10 @@ static void addBoundaryDependencies(DumpableObject **dobjs, int numObjs,
 static void getDomainConstraints(Archive *fout, TypeInfo *tyinfo);
 static void getTableData(TableInfo *tblinfo, int numTables, bool oids);
 static void makeTableDataInfo(TableInfo *tbinfo, bool oids);
+static TableInfo *findTableByNameNoCase(TableInfo *tblinfo, int numTables,
+					  const char *name);
+static void getRecommenderTableData(Archive *fout, TableInfo *tblinfo,
+						int numTables);
 static void getTableDataFKConstraints(void);
 static char *format_function_arguments(FuncInfo *finfo, char *funcargs);
 static char *format_function_arguments_old(Archive *fout,
@@ -690,6 +694,14 @@ main(int argc, char **argv)
 		getTableData(tblinfo, numTables, oids);
 		if (dataOnly)
 			getTableDataFKConstraints();
+
+		/*
+		 * Binary COPY data can only be restored through a connection, so
+		 * don't use it where the archive may be turned into a script.
+		 */
+		if (!dump_inserts &&
+			(archiveFormat == archCustom || archiveFormat == archDirectory))
+			getRecommenderTableData(fout, tblinfo, numTables);
 	}
 
 	if (outputBlobs)
@@ -1269,7 +1281,15 @@ dumpTableData_copy(Archive *fout, void *dcontext)
 	else
 		column_list = "";		/* can't select columns in COPY */
 
-	if (oids && hasoids)
+	if (tdinfo->binary)
+	{
+		appendPQExpBuffer(q, "COPY %s %s TO stdout WITH (FORMAT binary);",
+						  fmtQualifiedId(fout,
+										 tbinfo->dobj.namespace->dobj.name,
+										 classname),
+						  column_list);
+	}
+	else if (oids && hasoids)
 	{
 		appendPQExpBuffer(q, "COPY %s %s WITH OIDS TO stdout;",
 						  fmtQualifiedId(fout,
@@ -1365,7 +1385,9 @@ dumpTableData_copy(Archive *fout, void *dcontext)
 		 * ----------
 		 */
 	}
-	archprintf(fout, "\\.\n\n\n");
+	/* binary COPY data carries its own trailer, and must be left alone */
+	if (!tdinfo->binary)
+		archprintf(fout, "\\.\n\n\n");
 
 	if (ret == -2)
 	{
@@ -1573,8 +1595,12 @@ dumpTableData(Archive *fout, TableDataInfo *tdinfo)
 		/* must use 2 steps here 'cause fmtId is nonreentrant */
 		appendPQExpBuffer(copyBuf, "COPY %s ",
 						  fmtId(tbinfo->dobj.name));
-		appendPQExpBuffer(copyBuf, "%s %sFROM stdin;\n",
-						  fmtCopyColumnList(tbinfo),
+		if (tdinfo->binary)
+			appendPQExpBuffer(copyBuf, "%s FROM stdin WITH (FORMAT binary);\n",
+							  fmtCopyColumnList(tbinfo));
+		else
+			appendPQExpBuffer(copyBuf, "%s %sFROM stdin;\n",
+							  fmtCopyColumnList(tbinfo),
 					  (tdinfo->oids && tbinfo->hasoids) ? "WITH OIDS " : "");
 		copyStmt = copyBuf->data;
 	}
@@ -1672,11 +1698,129 @@ makeTableDataInfo(TableInfo *tbinfo, bool oids)
 	tdinfo->tdtable = tbinfo;
 	tdinfo->oids = oids;
 	tdinfo->filtercond = NULL;	/* might get set later */
+	tdinfo->binary = false;		/* might get set later */
 	addObjectDependency(&tdinfo->dobj, tbinfo->dobj.dumpId);
 
 	tbinfo->dataObj = tdinfo;
 }
 
+/*
+ * findTableByNameNoCase -
+ *	  find a table to be dumped by name, ignoring case
+ *
+ * The recommender catalogues record table names as they were written in
+ * CREATE RECOMMENDER, while the tables themselves were created unquoted.
+ */
+static TableInfo *
+findTableByNameNoCase(TableInfo *tblinfo, int numTables, const char *name)
+{
+	int			i;
+
+	for (i = 0; i < numTables; i++)
+	{
+		if (pg_strcasecmp(tblinfo[i].dobj.name, name) == 0)
+			return &tblinfo[i];
+	}
+	return NULL;
+}
+
+/*
+ * getRecommenderTableData -
+ *	  arrange for the model and view tables of recommenders to be dumped
+ *	  with binary COPY
+ *
+ * These tables hold nothing but integer IDs and real scores, often hundreds
+ * of millions of rows of them, which binary COPY writes and reads back much
+ * faster than it can print and parse them as text.  The recommenders are
+ * found through RecModelsCatalogue, and each one's tables through the
+ * columns of its index table whose names end in "modelname" or "viewname".
+ */
+static void
+getRecommenderTableData(Archive *fout, TableInfo *tblinfo, int numTables)
+{
+	TableInfo  *catalogue;
+	PQExpBuffer query;
+	PGresult   *res;
+	char	  **indexnames;
+	int			numIndexes;
+	int			i;
+
+	catalogue = findTableByNameNoCase(tblinfo, numTables,
+									  "recmodelscatalogue");
+	if (catalogue == NULL || fout->remoteVersion < 90000)
+		return;
+
+	query = createPQExpBuffer();
+
+	appendPQExpBuffer(query, "SELECT recommenderindexname FROM %s",
+					  fmtQualifiedId(fout,
+									 catalogue->dobj.namespace->dobj.name,
+									 catalogue->dobj.name));
+	res = ExecuteSqlQuery(fout, query->data, PGRES_TUPLES_OK);
+
+	numIndexes = PQntuples(res);
+	indexnames = (char **) pg_malloc(Max(numIndexes, 1) * sizeof(char *));
+	for (i = 0; i < numIndexes; i++)
+		indexnames[i] = pg_strdup(PQgetvalue(res, i, 0));
+	PQclear(res);
+
+	for (i = 0; i < numIndexes; i++)
+	{
+		TableInfo  *index;
+		int			ntups;
+		int			nfields;
+		int			tup;
+		int			field;
+
+		index = findTableByNameNoCase(tblinfo, numTables, indexnames[i]);
+		if (index == NULL)
+			continue;
+
+		resetPQExpBuffer(query);
+		appendPQExpBuffer(query, "SELECT * FROM %s",
+						  fmtQualifiedId(fout,
+										 index->dobj.namespace->dobj.name,
+										 index->dobj.name));
+		res = ExecuteSqlQuery(fout, query->data, PGRES_TUPLES_OK);
+
+		ntups = PQntuples(res);
+		nfields = PQnfields(res);
+		for (field = 0; field < nfields; field++)
+		{
+			const char *fname = PQfname(res, field);
+			size_t		len = strlen(fname);
+
+			if (!((len > 9 && strcmp(fname + len - 9, "modelname") == 0) ||
+				  (len > 8 && strcmp(fname + len - 8, "viewname") == 0)))
+				continue;
+
+			for (tup = 0; tup < ntups; tup++)
+			{
+				TableInfo  *tbinfo;
+				TableDataInfo *tdinfo;
+
+				if (PQgetisnull(res, tup, field))
+					continue;
+				tbinfo = findTableByNameNoCase(tblinfo, numTables,
+											   PQgetvalue(res, tup, field));
+				if (tbinfo == NULL || tbinfo->dataObj == NULL)
+					continue;
+
+				tdinfo = tbinfo->dataObj;
+				if ((tdinfo->oids && tbinfo->hasoids) || tdinfo->filtercond)
+					continue;
+				tdinfo->binary = true;
+			}
+		}
+		PQclear(res);
+	}
+
+	for (i = 0; i < numIndexes; i++)
+		free(indexnames[i]);
+	free(indexnames);
+	destroyPQExpBuffer(query);
+}
+
 /*
  * getTableDataFKConstraints -
  *	  add dump-order dependencies reflecting foreign key constraints
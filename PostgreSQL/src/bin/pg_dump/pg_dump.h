@@ -307,6 +307,7 @@ typedef struct _tableDataInfo
 	TableInfo  *tdtable;		/* link to table to dump */
 	bool		oids;			/* include OIDs in data? */
 	char	   *filtercond;		/* WHERE condition to limit rows dumped */
+	bool		binary;			/* dump with binary COPY? */
 } TableDataInfo;
 
 typedef struct _indxInfo
@@ -682,9 +682,13 @@ extern void BTreeShmemInit(void);
  */
 typedef struct BTSpool BTSpool; /* opaque type known only within nbtsort.c */
 
+extern bool bt_build_presorted;
+
 extern BTSpool *_bt_spoolinit(Relation index, bool isunique, bool isdead);
+extern BTSpool *_bt_presortinit(Relation index, bool isunique);
 extern void _bt_spooldestroy(BTSpool *btspool);
 extern void _bt_spool(IndexTuple itup, BTSpool *btspool);
+extern bool _bt_presortdone(BTSpool *btspool, bool giveup);
 extern void _bt_leafbuild(BTSpool *btspool, BTSpool *spool2);
 
 /*
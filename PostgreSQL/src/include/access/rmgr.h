@@ -33,7 +33,8 @@ typedef uint8 RmgrId;
 #define RM_GIST_ID				14
 #define RM_SEQ_ID				15
 #define RM_SPGIST_ID			16
+#define RM_RECATHON_ID			17
 
-#define RM_MAX_ID				RM_SPGIST_ID
+#define RM_MAX_ID				RM_RECATHON_ID
 
 #endif   /* RMGR_H */
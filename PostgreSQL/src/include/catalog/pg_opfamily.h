@@ -74,6 +74,7 @@ DATA(insert OID =  431 (	405		char_ops		PGNSP PGUID ));
 DATA(insert OID =  434 (	403		datetime_ops	PGNSP PGUID ));
 DATA(insert OID =  435 (	405		date_ops		PGNSP PGUID ));
 DATA(insert OID = 1970 (	403		float_ops		PGNSP PGUID ));
+#define FLOAT_BTREE_FAM_OID 1970
 DATA(insert OID = 1971 (	405		float_ops		PGNSP PGUID ));
 DATA(insert OID = 1974 (	403		network_ops		PGNSP PGUID ));
 #define NETWORK_BTREE_FAM_OID 1974
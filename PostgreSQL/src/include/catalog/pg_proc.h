@@ -2604,6 +2604,12 @@ DATA(insert OID = 2022 (  pg_stat_get_activity			PGNSP PGUID 12 1 100 0 0 f f f
 DESCR("statistics: information about currently active backends");
 DATA(insert OID = 3099 (  pg_stat_get_wal_senders	PGNSP PGUID 12 1 10 0 0 f f f f f t s 0 0 2249 "" "{23,25,25,25,25,25,23,25}" "{o,o,o,o,o,o,o,o}" "{pid,state,sent_location,write_location,flush_location,replay_location,sync_priority,sync_state}" _null_ pg_stat_get_wal_senders _null_ _null_ _null_ ));
 DESCR("statistics: information about currently active replication");
+DATA(insert OID = 3167 (  pg_stat_get_recommenders	PGNSP PGUID 12 1 100 0 0 f f f f f t s 0 0 2249 "" "{19,20,20,20,701,701,20,1184,701,20,20,20}" "{o,o,o,o,o,o,o,o,o,o,o,o}" "{recname,queries,predictions,internal_queries,avg_latency,max_latency,rebuilds,last_rebuild,last_rebuild_duration,events_since_rebuild,disk_size,memory_size}" _null_ pg_stat_get_recommenders _null_ _null_ _null_ ));
+DESCR("statistics: information about recommenders");
+DATA(insert OID = 3960 (  pg_stat_get_recommender_progress	PGNSP PGUID 12 1 100 0 0 f f f f f t v 0 0 2249 "" "{23,19,25,20,20,1184,1184,1184}" "{o,o,o,o,o,o,o,o}" "{pid,recname,phase,done,total,build_start,phase_start,phase_eta}" _null_ pg_stat_get_recommender_progress _null_ _null_ _null_ ));
+DESCR("statistics: progress of the recommender builds under way");
+DATA(insert OID = 3966 (  pg_stat_get_recommender_latency	PGNSP PGUID 12 1 100 0 0 f f f f f t v 0 0 2249 "" "{19,25,20,701,701,701,701,701}" "{o,o,o,o,o,o,o,o}" "{recname,phase,count,mean,p50,p90,p99,p999}" _null_ pg_stat_get_recommender_latency _null_ _null_ _null_ ));
+DESCR("statistics: latency percentiles of recommenders, by phase");
 DATA(insert OID = 2026 (  pg_backend_pid				PGNSP PGUID 12 1 0 0 0 f f f f t f s 0 0 23 "" _null_ _null_ _null_ _null_ pg_backend_pid _null_ _null_ _null_ ));
 DESCR("statistics: current backend PID");
 DATA(insert OID = 1937 (  pg_stat_get_backend_pid		PGNSP PGUID 12 1 0 0 0 f f f f t f s 1 0 23 "23" _null_ _null_ _null_ _null_ pg_stat_get_backend_pid _null_ _null_ _null_ ));
@@ -4641,6 +4647,58 @@ DESCR("SP-GiST support for suffix tree over text");
 DATA(insert OID = 4031 (  spg_text_leaf_consistent	PGNSP PGUID 12 1 0 0 0 f f f f t f i 2 0 16 "2281 2281" _null_ _null_ _null_ _null_  spg_text_leaf_consistent _null_ _null_ _null_ ));
 DESCR("SP-GiST support for suffix tree over text");
 
+/* RecDB model maintenance */
+DATA(insert OID = 3947 (  recathon_maintain	PGNSP PGUID 12 1 0 0 0 f f f f f f v 0 0 23 "" _null_ _null_ _null_ _null_ recathon_maintain _null_ _null_ _null_ ));
+DESCR("update counters and rebuild stale models for all recommenders");
+DATA(insert OID = 3948 (  recathon_maintain	PGNSP PGUID 12 1 0 0 0 f f f f f f v 1 0 23 "25" _null_ _null_ _null_ _null_ recathon_maintain _null_ _null_ _null_ ));
+DESCR("update counters and rebuild stale models for recommenders on an events table");
+DATA(insert OID = 3953 (  recathon_prewarm	PGNSP PGUID 12 1 0 0 0 f f f f f f v 0 0 23 "" _null_ _null_ _null_ _null_ recathon_prewarm _null_ _null_ _null_ ));
+DESCR("score cached recommendations again for users with new events");
+DATA(insert OID = 3958 (  recathon_preload	PGNSP PGUID 12 1 0 0 0 f f f f f f v 0 0 23 "" _null_ _null_ _null_ _null_ recathon_preload _null_ _null_ _null_ ));
+DESCR("read the models of recathon_preload_recommenders into memory");
+
+/* RecDB bulk export */
+DATA(insert OID = 3949 (  recathon_export	PGNSP PGUID 12 1 0 0 0 f f f f t f v 3 0 20 "25 25 23" _null_ _null_ _null_ _null_ recathon_export _null_ _null_ _null_ ));
+DESCR("write a recommender's top predictions for every user to a new table");
+DATA(insert OID = 3950 (  recathon_export	PGNSP PGUID 12 1 0 0 0 f f f f t f v 4 0 20 "25 25 23 25" _null_ _null_ _null_ _null_ recathon_export _null_ _null_ _null_ ));
+DESCR("write a recommender's top predictions for matching users to a new table");
+
+/* RecDB similar items */
+DATA(insert OID = 3954 (  recathon_similar_items	PGNSP PGUID 12 1 10 0 0 f f f f t t v 3 0 2249 "25 23 23" "{25,23,23,23,700}" "{i,i,i,o,o}" "{recommender,itemid,k,item,similarity}" _null_ recathon_similar_items _null_ _null_ _null_ ));
+DESCR("the items most similar to an item, from a recommender's model");
+
+/* RecDB direct recommendation lookups */
+DATA(insert OID = 3955 (  recathon_recommend	PGNSP PGUID 12 1 10 0 0 f f f f t t v 3 0 2249 "25 23 23" "{25,23,23,23,700}" "{i,i,i,o,o}" "{recommender,userid,k,item,recscore}" _null_ recathon_recommend _null_ _null_ _null_ ));
+DESCR("a user's best predictions from a recommender");
+DATA(insert OID = 3956 (  recathon_recommend	PGNSP PGUID 12 1 10 0 0 f f f f t t v 4 0 2249 "25 23 23 1007" "{25,23,23,1007,23,700}" "{i,i,i,i,o,o}" "{recommender,userid,k,candidates,item,recscore}" _null_ recathon_recommend _null_ _null_ _null_ ));
+DESCR("a user's best predictions from a recommender, among candidate items");
+DATA(insert OID = 3957 (  recathon_recommend_batch	PGNSP PGUID 12 1 1000 0 0 f f f f t t v 3 0 2249 "25 1007 23" "{25,1007,23,23,23,700}" "{i,i,i,o,o,o}" "{recommender,userids,k,userid,item,recscore}" _null_ recathon_recommend_batch _null_ _null_ _null_ ));
+DESCR("the best predictions for each of a list of users from a recommender");
+DATA(insert OID = 3963 (  recathon_recommend_group	PGNSP PGUID 12 1 10 0 0 f f f f t t v 3 0 2249 "25 1007 23" "{25,1007,23,23,700}" "{i,i,i,o,o}" "{recommender,userids,k,item,recscore}" _null_ recathon_recommend_group _null_ _null_ _null_ ));
+DESCR("the best predictions for a group of users together from a recommender");
+DATA(insert OID = 3964 (  recathon_recommend_group	PGNSP PGUID 12 1 10 0 0 f f f f t t v 4 0 2249 "25 1007 23 25" "{25,1007,23,25,23,700}" "{i,i,i,i,o,o}" "{recommender,userids,k,aggregate,item,recscore}" _null_ recathon_recommend_group _null_ _null_ _null_ ));
+DESCR("the best predictions for a group of users together from a recommender, combined by an aggregate");
+
+/* RecDB offline evaluation */
+DATA(insert OID = 3961 (  recathon_evaluate	PGNSP PGUID 12 1 0 0 0 f f f f t f v 3 0 2249 "25 700 23" "{25,700,23,23,701,701,701,701,20,701}" "{i,i,i,o,o,o,o,o,o,o}" "{recommender,holdout_fraction,k,users,rmse,precision,recall,build_ms,model_bytes,user_ms}" _null_ recathon_evaluate _null_ _null_ _null_ ));
+DESCR("accuracy and speed of a recommender built on part of its events, on the rest");
+DATA(insert OID = 3962 (  recathon_evaluate	PGNSP PGUID 12 1 0 0 0 f f f f t f v 4 0 2249 "25 700 23 25" "{25,700,23,25,23,701,701,701,701,20,701}" "{i,i,i,i,o,o,o,o,o,o,o}" "{recommender,holdout_fraction,k,options,users,rmse,precision,recall,build_ms,model_bytes,user_ms}" _null_ recathon_evaluate _null_ _null_ _null_ ));
+DESCR("accuracy and speed of a recommender built on part of its events with other options, on the rest");
+DATA(insert OID = 3965 (  recathon_model_stats	PGNSP PGUID 12 1 0 0 0 f f f f t f v 1 0 2249 "25" "{25,25,20,20,20,701,20,23,701,20,1016,701,701,701,20,20,25,701,701}" "{i,o,o,o,o,o,o,o,o,o,o,o,o,o,o,o,o,o,o}" "{recommender,method,users,items,events,density,model_rows,features,neighbors_avg,neighbors_max,neighbor_histogram,similarity_min,similarity_avg,similarity_max,disk_bytes,memory_bytes,build_strategy,build_ms,scoring_cost}" _null_ recathon_model_stats _null_ _null_ _null_ ));
+DESCR("shape, size and cost of a recommender's model");
+
+/* RecDB incremental models */
+DATA(insert OID = 3951 (  recathon_record_event	PGNSP PGUID 12 1 0 0 0 f f f f t f v 0 0 2279 "" _null_ _null_ _null_ _null_ recathon_record_event _null_ _null_ _null_ ));
+DESCR("trigger copying new events for an incremental recommender");
+
+/* RecDB bulk event ingestion */
+DATA(insert OID = 3959 (  recathon_ingest	PGNSP PGUID 12 1 0 0 0 f f f f t f v 4 0 20 "2205 1007 1007 1021" _null_ _null_ "{eventtable,users,items,vals}" _null_ recathon_ingest _null_ _null_ _null_ ));
+DESCR("insert a batch of events and record them for the recommenders on the table");
+
+/* RecDB distributed model builds */
+DATA(insert OID = 3952 (  recathon_build_shard	PGNSP PGUID 12 1 0 0 0 f f f f t f v 14 0 20 "25 25 25 25 25 25 23 23 23 23 23 23 23 700" _null_ _null_ _null_ _null_ recathon_build_shard _null_ _null_ _null_ ));
+DESCR("build one shard of a similarity model for another node");
+
 
 /*
  * Symbolic values for provolatile column: these indicate whether the result
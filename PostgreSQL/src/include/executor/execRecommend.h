@@ -23,5 +23,7 @@ extern TupleTableSlot *ExecRecommend(RecScanState *recnode, ExecScanAccessMtd ac
 extern RecScanState *ExecInitRecScan(RecScan *node, EState *estate, int eflags);
 extern TupleTableSlot *ExecRecScan(RecScanState *node);
 extern void ExecEndRecScan(RecScanState *node);
+extern void ExecRecBlankSlot(RecScanState *recnode, TupleTableSlot *slot,
+				 Node *exprs, Index varno);
 
 #endif   /* EXECRECOMMEND_H  */
@@ -1489,20 +1489,28 @@ typedef struct ForeignScanState
  *		RecScan nodes are used for recommend queries and contain another ScanState.
  * ----------------
  */
-typedef struct GenRating
-{
-	int			ID;			/* the user or item ID */
-	int			index;			/* the user or item index */
-	float			score;			/* the tentative score */
-	float			totalSim;		/* the tentative similarity sum */
-	struct GenRating *	next;
-} GenRating;
-
-typedef struct GenHash
-{
-	int		hash;
-	GenRating **	table;
-} GenHash;
+/* A sparse similarity model in compressed sparse row form. Row i
+ * holds the nonzero entries of row i, in order of column index,
+ * in colIndex[rowStart[i]] through colIndex[rowStart[i+1]-1]. A
+ * model from a model file or the shared cache has its rows' column
+ * indexes packed instead, and colIndex is NULL; sparseRowColumns
+ * unpacks them. */
+typedef struct GenSparseModel
+{
+	int		numRows;		/* the number of rows */
+	int		numEntries;		/* the number of stored entries */
+	int		maxEntries;		/* the allocated size of the arrays */
+	int		*rowStart;		/* numRows+1 offsets into the arrays */
+	int		*colIndex;		/* the column index of each entry */
+	float		*values;		/* the value of each entry, if valueBits is 32 */
+	int		valueBits;		/* 32, or 16 or 8 to use qvalues */
+	void		*qvalues;		/* the quantized value of each entry */
+	float		*rowScale;		/* what each row's qvalues are multiplied by */
+	uint8		*packed;		/* the packed column indexes, if colIndex is NULL */
+	int64		*packStart;		/* numRows+1 offsets into packed */
+	int		maxRowLength;		/* the most entries in any row */
+	int		*rowBuf;		/* room to unpack one row */
+} GenSparseModel;
 
 typedef struct RecScanState
 {
@@ -1521,29 +1529,170 @@ typedef struct RecScanState
 	int 		fullTotalItems;		/* the absolute number of items */
 	int		fullItemNum;		/* the current item in the full list */
 	int		*fullItemList;		/* the complete list of items */
+	int		itemMapBase;		/* the smallest item ID */
+	int		itemMapSize;		/* the span of the item IDs */
+	int		*itemMap;		/* item ID - base to index, or NULL to search */
 	/* on-the-fly recommendation data */
-	float		**itemCFmodel;		/* the item-based model */
+	GenSparseModel	*itemCFmodel;		/* the item-based model */
+	bool		itemCFslice;		/* does it only have the rated items' rows, whole? */
+	GenSparseModel	*hotItemSim;		/* the popular items' rows, if the rest are on disk */
+	int		*hotItemRow;		/* each item's row of hotItemSim, or -1 */
 	float		**userCFmodel;		/* the user-based model */
-	float		**SVDusermodel;		/* the SVD-based user model */
-	float		**SVDitemmodel;		/* the SVD-based item model */
+	bool		userCFrows;		/* does it only have the named users' rows, whole? */
+	GenSparseModel	*itemEvents;		/* the users who rated each item, and their events */
+	int		numEventUsers;		/* the number of users in itemEvents */
+	int		*eventUsers;		/* their IDs, sorted */
+	GenSparseModel	*userEvents;		/* the items each user rated, and their events */
+	int		*userEventIDs;		/* the users in it, sorted */
+	float		*SVDusermodel;		/* the SVD-based user model, one row per user */
+	float		*SVDitemmodel;		/* the SVD-based item model, one row per item */
+	uint16		*SVDitemHalf;		/* or the same in half precision */
 	/* FILTERRECOMMEND information */
 	TupleDesc	base_slot;		/* a raw descriptor for us to use */
+	TupleTableSlot	*recSlot;		/* the one slot we build our tuples in */
 	int		useratt;		/* the att number for the user key */
 	int		itematt;		/* the att number for the item key */
 	int		eventatt;		/* the att number for the event val */
 	bool		finished;		/* there are no more tuples to consider */
 	List		*userqual;		/* the WHERE clause pertaining to just the user */
+	/* quals on the item ID and the score, checked without ExecQual */
+	List		*scanQual;		/* the rest, for ExecQual */
+	bool		itemBounded;		/* do the quals limit the item IDs? */
+	int64		itemMin;		/* to this range */
+	int64		itemMax;
+	int		numItemSet;		/* and to these, if itemSet isn't NULL */
+	int		*itemSet;		/* sorted */
+	bool		*itemQualPass;		/* does each item meet them? */
+	bool		scoreBounded;		/* do the quals limit the score? */
+	bool		scoreHasMin;		/* from below? */
+	bool		scoreHasMax;		/* from above? */
+	bool		scoreMinStrict;		/* leaving out the bound itself? */
+	bool		scoreMaxStrict;
+	double		scoreMin;
+	double		scoreMax;
 	/* itemCF recommendation */
+	/* the arrays below are indexed like fullItemList */
 	int		totalRatings;		/* number of rated items */
-	GenHash		*ratedTable;		/* the table of ratings we'll use */
-	GenHash		*pendingTable;		/* the table of ratings we're calculating */
+	int		*ratedItems;		/* the indexes of the rated items */
+	bool		*isRated;		/* has this user rated each item? */
+	bool		excludeRated;		/* do we leave out the items they've rated? */
+	float		*ratedScore;		/* the user's event for each rated item */
+	float		*pendingScore;		/* the tentative score for each item */
+	float		*pendingSim;		/* the tentative similarity sum for each item */
+	/* scoring a block of users at once */
+	int		userBlockSize;		/* rows per block, 0 if undecided, -1 if we don't */
+	int		userBlockFirst;		/* the first userEvents row, or userList place, in it */
+	int		userBlockRows;		/* how many rows it holds */
+	float		*userBlockScore;	/* their pending scores, a row each */
+	float		*userBlockSim;		/* and their similarity sums */
+	bool		*userBlockValid;	/* factor models: did we score each row? */
+	int		userBlockRow;		/* factor models: the current user's row, or -1, once blocked */
+	/* stopping item-based top-k early */
+	bool		thresholdTopK;		/* may we score just the items that could make it? */
+	int		*ratedOrder;		/* each rated item's place in ratedItems */
+	bool		*isSeen;		/* have we worked out each item's prediction? */
+	int		*thresholdItems;	/* the items we have, then the candidates */
+	int		*sortedEntries;		/* each model row's entries, most similar first */
+	bool		*rowSorted;		/* has each row's order been worked out?
+						 * NULL if a model file ranked them all */
 	/* userCF recommendation */
 	float		average;		/* average rating for this user */
-	GenHash		*simTable;		/* the similarities for this user */
+	float		*userSim;		/* the similarities for this user, indexed like eventUsers */
+	int		neighborhood;		/* the most similar users predicted from, or 0 for all */
+	int		numNeighbors;		/* how many this user has */
+	int		*neighbors;		/* their indexes into eventUsers, sorted */
 	/* SVD information */
 	int		userindex;		/* the current user index */
 	int		numFeatures;		/* the number of features */
 	float		*userFeatures;		/* the user feature values */
+	bool		userModelArrays;	/* is the user model stored as real[]s? */
+	/* session cache of prepared users */
+	bool		profileChecked;		/* have we looked up the model version? */
+	uint32		profileVersion;		/* the version, or 0 to cache nothing */
+	/* approximate top-k index */
+	int		numClusters;		/* the number of item clusters */
+	int		*clusterStart;		/* numClusters+1 offsets into clusterItems */
+	int		*clusterItems;		/* item indexes, grouped by cluster */
+	float		*clusterCentroids;	/* the centroids, one row per cluster */
+	int		numCandidates;		/* the number of items to score */
+	int		*itemCandidates;	/* the item indexes to score, in order */
+	/* batched scoring */
+	const struct rec_strategy *strategy;	/* how the method scores items */
+	bool		batchScoring;		/* is every item of a user scored? */
+	int		batchStart;		/* the position of the first item batched */
+	int		batchCount;		/* how many items are batched */
+	int		*batchItems;		/* their item indexes */
+	float		*batchScores;		/* and their scores */
+	int		*batchSurvivors;	/* the batch positions that could make the top k */
+	int		batchNumSurvivors;	/* how many, or -1 if not picked out yet */
+	int		batchSurvivorNext;	/* the next of them to reach */
+	/* popularity fallback */
+	bool		coldStart;		/* has the current user no events? */
+	bool		popularChecked;		/* have we looked for the ranking? */
+	float		*popularScores;		/* its scores, indexed like fullItemList */
+	/* ensembles */
+	List		*ensemble;		/* RecScanStates of the other methods, or NIL */
+	/* candidate generation */
+	struct RecScanState *candidateSource;	/* the method picking the items to score, or NULL */
+	int		numBaseCandidates;	/* the items the WHERE clause allows */
+	int		*baseCandidates;	/* their indexes, or NULL for all items */
+	bool		ordered;		/* must tuples come out by user, then item? */
+	/* top-k pushdown */
+	int		topK;			/* tuples wanted, or 0 for all of them */
+	bool		topKDescending;		/* are the highest scores best? */
+	bool		topKDone;		/* have we collected the best tuples? */
+	int		topKCount;		/* the number of tuples held */
+	int		topKNext;		/* the next tuple to return */
+	float		*topKKeys;		/* heap keys, bigger is better */
+	HeapTuple	*topKTuples;		/* copies of the tuples held */
+	int		*topKItems;		/* the item each of them is for */
+	TupleTableSlot	*topKSlot;		/* the slot we return them in */
+	/* shared model cache and model file */
+	uint32		cacheVersion;		/* the model build we cache, or 0 for none */
+	List		*cachePins;		/* handles of the pieces we're reading */
+	struct model_file_t *modelFile;		/* the mapped model file, or NULL */
+	int		modelPrecision;		/* bits per value of what we cache */
+	bool		modelSymmetric;		/* does the model hold both directions? */
+	int		buildHandle;		/* our on-the-fly build's entry, or -1 */
+	List		*probes;		/* the tables we look rows up in directly */
+	/* materialized RecView */
+	int		viewSize;		/* predictions kept per user */
+	int		numViewRows;		/* how many the current user has */
+	int		viewRowNum;		/* the next one to return */
+	int		viewReturned;		/* how many passed the quals */
+	int		*viewItems;		/* the current user's items, best first */
+	float		*viewScores;		/* and their predictions */
+	/* result cache */
+	bool		useResultCache;		/* are we answering from the result cache? */
+	bool		storeResults;		/* should we keep the top-k there? */
+	uint32		resultVersion;		/* the model build the list goes with */
+	uint32		resultGeneration;	/* what to store it against */
+	int		numCachedResults;	/* how many predictions the list holds */
+	/* sharded serving */
+	bool		useShards;		/* are other nodes answering for us? */
+	char		*serveNodes;		/* which, from serve_nodes */
+	int		*shardStart;		/* where each user's predictions start */
+	/* EXPLAIN ANALYZE instrumentation */
+	MemoryContext	recContext;		/* what the models and user data live in */
+	MemoryContext	userContext;	/* what only the current user needs */
+	Size		peakSpace;		/* the most recContext has held */
+	instr_time	initTime;		/* time spent loading or building the model */
+	instr_time	prepTime;		/* time spent preparing users */
+	instr_time	scoreTime;		/* time spent scoring items */
+	long		usersScored;		/* users prepared for scoring */
+	long		itemsScored;		/* items scored */
+	long		internalQueries;	/* queries we ran on the side */
+	instr_time	startTime;		/* when the executor started us */
+	bool		trackLatency;	/* do we add to the latency histograms? */
+	/* time budget */
+	long		timeBudget;		/* microseconds we may take, or 0 */
+	int		budgetTicks;		/* steps since we last looked at the clock */
+	bool		timedOut;		/* did we stop with what we had? */
+	/* parallel scoring of all users */
+	bool		parallelTried;		/* have we decided whether to use workers? */
+	bool		parallelWorker;		/* are we one of the workers? */
+	bool		deferUser;		/* does the leader have to prepare this user? */
+	struct rec_workers_t *workers;		/* the workers scoring for us, or NULL */
 } RecScanState;
 
 /* ----------------------------------------------------------------
@@ -1679,16 +1828,31 @@ typedef struct HashJoinState
 } HashJoinState;
 
 /* NEW FOR RECATHON */
+
+/* An inner tuple a RecJoin keeps, with the item it stands for. */
+typedef struct RecJoinInner
+{
+	int		itemID;
+	int		itemindex;		/* its place in the recommender's item list */
+	MinimalTuple	tuple;
+} RecJoinInner;
+
 typedef struct RecJoinState
 {
 	JoinState	js;
 	NestLoopState	*subjoin;
 	RecScanState	*recnode;		/* stored to simplify our lives a bit */
 	PlanState	*innerscan;		/* and again */
-	GenHash		*itemTable;		/* a hash table of all the items we need to predict */
 	bool		rj_NeedNewOuter;	/* for loop control */
 	bool		rj_MatchedOuter;	/* for loop control */
 	int		innerTupleAtt;		/* the att number for the key att of the inner tuple */
+	TupleTableSlot	*outerSlot;		/* the one slot we build outer tuples in */
+	bool		innerLoaded;		/* have we read the inner relation yet? */
+	MemoryContext	innerContext;		/* holds the inner tuples we keep */
+	RecJoinInner	*innerItems;		/* those that are items we can score */
+	int		numInner;
+	int		innerPos;		/* the next one to join with this user */
+	TupleTableSlot	*innerSlot;		/* the slot we replay them in */
 } RecJoinState;
 
 
@@ -370,6 +370,7 @@ typedef enum NodeTag
 	T_RecommendInfo,	// NEW FOR RECATHON
 	T_AttributeInfo,
 	T_DropRecStmt,
+	T_AlterRecStmt,
 
 	/*
 	 * TAGS FOR PARSE TREE NODES (parsenodes.h)
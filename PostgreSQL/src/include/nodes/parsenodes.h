@@ -54,7 +54,9 @@ typedef enum SortByNulls
 	SORTBY_NULLS_LAST
 } SortByNulls;
 
-/* Possible cell types for a RECOMMEND query. */
+/* Possible cell types for a RECOMMEND query: how much of the RecView
+ * there is to use. An alpha cell only has its heavy users in it, a
+ * beta cell has no RecView, and a gamma cell has every user. */
 typedef enum {
 	CELL_ALPHA,
 	CELL_BETA,
@@ -1479,10 +1481,18 @@ typedef struct CreateRStmt
 	NodeTag		type;
 	RangeVar	*recname;
 	RangeVar	*eventtable;	/* reference to events table */
+	char		*eventfilter;	/* WHERE condition on the events, or NULL */
 	char		*userkey;	/* users table key */
 	char		*itemkey;	/* items table key */
 	char		*eventval;	/* events table value */
 	char		*method;	/* the method we use for recommendation */
+	char		*timekey;	/* events table time, or NULL for no window */
+	char		*timewindow;	/* how far back the events go, as an interval */
+	char		*halflife;	/* the half-life of an event, or NULL */
+	char		*partitionkey;	/* user attribute to build cells by, or NULL */
+	RangeVar	*partitiontable;	/* table with that attribute, or NULL for
+					 * the events table */
+	List		*options;	/* WITH options, a list of DefElem */
 } CreateRStmt;
 
 /* ----------------------
@@ -1495,6 +1505,23 @@ typedef struct DropRecStmt
 	RangeVar	*recname;	/* the recommender name to drop */
 } DropRecStmt;
 
+/* ----------------------
+ *		Alter Recommender Statement
+ *
+ * Either rebuilds the recommender's models now, or changes the options
+ * that decide when the maintenance process rebuilds them.
+ * ----------------------
+ */
+typedef struct AlterRecStmt
+{
+	NodeTag		type;
+	RangeVar	*recname;	/* the recommender to alter */
+	bool		refresh;	/* REFRESH, rather than SET or RESET */
+	bool		concurrent;	/* REFRESH CONCURRENTLY */
+	List		*options;	/* SET or RESET options, a list of DefElem */
+	bool		reset;		/* RESET, rather than SET */
+} AlterRecStmt;
+
 /* ----------------------
  *		Recommend Operator Information
  * ----------------------
@@ -1515,12 +1542,25 @@ typedef struct AttributeInfo
 	char		*recIndexName;
 	char		*recModelName;
 	char		*recModelName2;
+	char		*recClusterName;
 	char		*recViewName;
 	Node		*userWhereClause;
+	List		*userIDList;	/* user IDs the WHERE clause limits us to, or NIL */
+	List		*userParamList;	/* parameter numbers it limits us to, or NIL */
+	Node		*userWhereQuery;	/* query the WHERE clause limits users to, or NULL */
+	Node		*itemWhereQuery;	/* query the WHERE clause limits items to, or NULL */
 	bool		IDfound;
 	recathon_cell	cellType;
 	recathon_optype	opType;
 	bool		noFilter;
+	List		*ensemble;	/* the other methods blended in, or NIL */
+	double		weight;		/* this method's share of a blended score */
+	struct AttributeInfo *candidates;	/* the method picking the items to score, or NULL */
+	int		candidateLimit;	/* how many items it picks for each user */
+	int		excludeRated;	/* EXCLUDE RATED is 1, INCLUDE RATED 0, neither -1 */
+	bool		canGenerate;	/* could the built model be generated instead? */
+	double		modelCost;	/* the planner's costs of the built model */
+	double		generateCost;	/* and of generating it, if it compared them */
 } AttributeInfo;
 
 typedef struct RecommendInfo
@@ -1530,6 +1570,9 @@ typedef struct RecommendInfo
 	Node			*itemkey;
 	Node			*eventval;
 	char			*strmethod;
+	List			*ensemble;	/* the methods and weights of an ensemble, or NIL */
+	DefElem			*candidates;	/* the method and limit of CANDIDATES FROM, or NULL */
+	int			excludeRated;	/* EXCLUDE RATED is 1, INCLUDE RATED 0, neither -1 */
 	RangeVar		*recommender;
 	AttributeInfo		*attributes;
 	recathon_optype		opType;
@@ -497,8 +497,14 @@ typedef struct RecScan
 	Scan		scan;		/* necessary for compatibility */
 	Node		*recommender;	/* this is a RecommendInfo node */
 	Scan		*subscan;	/* the actual scan */
+	int		topK;		/* only the best topK tuples are needed, if > 0 */
+	bool		topKDescending;	/* are the best tuples the highest scores? */
+	bool		ordered;	/* must tuples come out by user, then item? */
 } RecScan;
 
+/* The most tuples a RecScan will hold on to for a top-k query. */
+#define RECSCAN_MAX_TOPK 100000
+
 /*
  * ==========
  * Join nodes
@@ -49,7 +49,10 @@ typedef enum StatMsgType
 	PGSTAT_MTYPE_FUNCPURGE,
 	PGSTAT_MTYPE_RECOVERYCONFLICT,
 	PGSTAT_MTYPE_TEMPFILE,
-	PGSTAT_MTYPE_DEADLOCK
+	PGSTAT_MTYPE_DEADLOCK,
+	PGSTAT_MTYPE_RECSTAT,
+	PGSTAT_MTYPE_RECMAINT,
+	PGSTAT_MTYPE_RECPURGE
 } StatMsgType;
 
 /* ----------
@@ -467,6 +470,80 @@ typedef struct PgStat_MsgFuncpurge
 	Oid			m_functionid[PGSTAT_NUM_FUNCPURGE];
 } PgStat_MsgFuncpurge;
 
+/* ----------
+ * PgStat_RecommenderCounts	The per-recommender counts kept by a backend
+ *
+ * This struct should contain only actual event counters, because we memcmp
+ * it against zeroes to detect whether there are any counts to transmit,
+ * except that r_max_time and r_memory are the largest and latest values
+ * seen rather than sums.  Times are in microseconds, sizes in bytes.
+ * ----------
+ */
+typedef struct PgStat_RecommenderCounts
+{
+	PgStat_Counter r_queries;
+	PgStat_Counter r_predictions;
+	PgStat_Counter r_internal_queries;
+	PgStat_Counter r_total_time;
+	PgStat_Counter r_max_time;
+	PgStat_Counter r_memory;
+} PgStat_RecommenderCounts;
+
+/* ----------
+ * PgStat_BackendRecEntry		Entry in backend's per-recommender hash table
+ * ----------
+ */
+typedef struct PgStat_BackendRecEntry
+{
+	char		r_name[NAMEDATALEN];
+	PgStat_RecommenderCounts r_counts;
+} PgStat_BackendRecEntry;
+
+/* ----------
+ * PgStat_MsgRecstat			Sent by the backend to report the queries
+ *								its recommenders served.
+ * ----------
+ */
+#define PGSTAT_NUM_RECENTRIES	\
+	((PGSTAT_MSG_PAYLOAD - sizeof(Oid) - sizeof(int))  \
+	 / sizeof(PgStat_BackendRecEntry))
+
+typedef struct PgStat_MsgRecstat
+{
+	PgStat_MsgHdr m_hdr;
+	Oid			m_databaseid;
+	int			m_nentries;
+	PgStat_BackendRecEntry m_entry[PGSTAT_NUM_RECENTRIES];
+} PgStat_MsgRecstat;
+
+/* ----------
+ * PgStat_MsgRecmaint			Sent by model maintenance after it looks
+ *								at a recommender.
+ * ----------
+ */
+typedef struct PgStat_MsgRecmaint
+{
+	PgStat_MsgHdr m_hdr;
+	Oid			m_databaseid;
+	char		m_name[NAMEDATALEN];
+	bool		m_rebuilt;		/* did we rebuild the model? */
+	PgStat_Counter m_rebuild_time;	/* how long it took, in microseconds */
+	PgStat_Counter m_events;	/* events the model hasn't seen */
+	PgStat_Counter m_disk_size;	/* the model's size on disk, in bytes */
+} PgStat_MsgRecmaint;
+
+/* ----------
+ * PgStat_MsgRecpurge			Sent by the backend to tell the collector
+ *								about a dropped recommender.
+ * ----------
+ */
+typedef struct PgStat_MsgRecpurge
+{
+	PgStat_MsgHdr m_hdr;
+	Oid			m_databaseid;
+	char		m_name[NAMEDATALEN];
+} PgStat_MsgRecpurge;
+
 /* ----------
  * PgStat_MsgDeadlock			Sent by the backend to tell the collector
  *								about a deadlock that occurred.
@@ -502,6 +579,9 @@ typedef union PgStat_Msg
 	PgStat_MsgFuncpurge msg_funcpurge;
 	PgStat_MsgRecoveryConflict msg_recoveryconflict;
 	PgStat_MsgDeadlock msg_deadlock;
+	PgStat_MsgRecstat msg_recstat;
+	PgStat_MsgRecmaint msg_recmaint;
+	PgStat_MsgRecpurge msg_recpurge;
 } PgStat_Msg;
 
 
@@ -513,7 +593,7 @@ typedef union PgStat_Msg
  * ------------------------------------------------------------
  */
 
-#define PGSTAT_FILE_FORMAT_ID	0x01A5BC9A
+#define PGSTAT_FILE_FORMAT_ID	0x01A5BC9B
 
 /* ----------
  * PgStat_StatDBEntry			The collector's data per database
@@ -546,11 +626,12 @@ typedef struct PgStat_StatDBEntry
 	TimestampTz stat_reset_timestamp;
 
 	/*
-	 * tables and functions must be last in the struct, because we don't write
-	 * the pointers out to the stats file.
+	 * tables, functions and recommenders must be last in the struct, because
+	 * we don't write the pointers out to the stats file.
 	 */
 	HTAB	   *tables;
 	HTAB	   *functions;
+	HTAB	   *recommenders;
 } PgStat_StatDBEntry;
 
 
@@ -605,6 +686,31 @@ typedef struct PgStat_StatFuncEntry
 } PgStat_StatFuncEntry;
 
 
+/* ----------
+ * PgStat_StatRecEntry			The collector's data per recommender
+ * ----------
+ */
+typedef struct PgStat_StatRecEntry
+{
+	char		recname[NAMEDATALEN];
+
+	PgStat_Counter queries;
+	PgStat_Counter predictions;
+	PgStat_Counter internal_queries;
+
+	PgStat_Counter total_time;	/* times in microseconds */
+	PgStat_Counter max_time;
+
+	PgStat_Counter rebuilds;
+	PgStat_Counter last_rebuild_time;
+	TimestampTz last_rebuild;
+
+	PgStat_Counter events_since_rebuild;
+	PgStat_Counter disk_size;	/* sizes in bytes */
+	PgStat_Counter memory_size;
+} PgStat_StatRecEntry;
+
+
 /*
  * Global statistics kept in the stats collector
  */
@@ -640,6 +746,23 @@ typedef enum BackendState
 	STATE_DISABLED,
 } BackendState;
 
+/* ----------
+ * The phases of a recommender build, as pg_stat_progress_recommender
+ * shows them
+ * ----------
+ */
+typedef enum RecBuildPhase
+{
+	RECBUILD_PHASE_INITIALIZING,
+	RECBUILD_PHASE_LOADING,
+	RECBUILD_PHASE_SIMILARITY,
+	RECBUILD_PHASE_TRAINING,
+	RECBUILD_PHASE_WRITING,
+	RECBUILD_PHASE_INDEXING,
+	RECBUILD_PHASE_STATISTICS,
+	RECBUILD_PHASE_RECVIEW
+} RecBuildPhase;
+
 /* ----------
  * Shared-memory data structures
  * ----------
@@ -694,6 +817,17 @@ typedef struct PgBackendStatus
 
 	/* current command string; MUST be null-terminated */
 	char	   *st_activity;
+
+	/*
+	 * The recommender whose CREATE RECOMMENDER or rebuild is running, or
+	 * an empty string if none is, and how far along it is.
+	 */
+	char		st_progress_recname[NAMEDATALEN];
+	RecBuildPhase st_progress_phase;
+	int64		st_progress_done;		/* units of work the phase has done */
+	int64		st_progress_total;		/* and has to do, 0 if unknown */
+	TimestampTz st_progress_start_timestamp;	/* when the build started */
+	TimestampTz st_progress_phase_timestamp;	/* and its phase */
 } PgBackendStatus;
 
 /*
@@ -784,6 +918,10 @@ extern void pgstat_report_tempfile(size_t filesize);
 extern void pgstat_report_appname(const char *appname);
 extern void pgstat_report_xact_timestamp(TimestampTz tstamp);
 extern void pgstat_report_waiting(bool waiting);
+extern void pgstat_progress_start_recommender(const char *recname);
+extern void pgstat_progress_phase(RecBuildPhase phase, int64 total);
+extern void pgstat_progress_update(int64 done);
+extern void pgstat_progress_end(void);
 extern const char *pgstat_get_backend_current_activity(int pid, bool checkUser);
 extern const char *pgstat_get_crashed_backend_activity(int pid, char *buffer,
 									int buflen);
@@ -840,6 +978,16 @@ extern void pgstat_count_heap_update(Relation rel, bool hot);
 extern void pgstat_count_heap_delete(Relation rel);
 extern void pgstat_update_heap_dead_tuples(Relation rel, int delta);
 
+extern void pgstat_count_recommender_query(const char *recname,
+							   PgStat_Counter predictions,
+							   PgStat_Counter internal_queries,
+							   PgStat_Counter time, PgStat_Counter memory);
+extern void pgstat_report_recommender_maint(const char *recname, bool rebuilt,
+								PgStat_Counter rebuild_time,
+								PgStat_Counter events,
+								PgStat_Counter disk_size);
+extern void pgstat_drop_recommender(const char *recname);
+
 extern void pgstat_init_function_usage(FunctionCallInfoData *fcinfo,
 						   PgStat_FunctionCallUsage *fcu);
 extern void pgstat_end_function_usage(PgStat_FunctionCallUsage *fcu,
@@ -867,6 +1015,8 @@ extern PgStat_StatDBEntry *pgstat_fetch_stat_dbentry(Oid dbid);
 extern PgStat_StatTabEntry *pgstat_fetch_stat_tabentry(Oid relid);
 extern PgBackendStatus *pgstat_fetch_stat_beentry(int beid);
 extern PgStat_StatFuncEntry *pgstat_fetch_stat_funcentry(Oid funcid);
+extern PgStat_StatRecEntry *pgstat_fetch_stat_recentry(const char *recname);
+extern HTAB *pgstat_fetch_stat_recommenders(void);
 extern int	pgstat_fetch_stat_numbackends(void);
 extern PgStat_GlobalStats *pgstat_fetch_global(void);
 
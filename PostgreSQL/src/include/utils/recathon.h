@@ -14,61 +14,459 @@
 #ifndef RECATHON_H
 #define RECATHON_H
 
+#include "access/genam.h"
+#include "access/heapam.h"
+#include "catalog/indexing.h"
 #include "miscadmin.h"
 #include "nodes/execnodes.h"
 #include "tcop/tcopprot.h"
+#include "utils/plancache.h"
 #include "utils/snapmgr.h"
 
+/* The most worker processes a model build may use. */
+#define RECATHON_MAX_WORKERS 64
+
+/* Upper limit on the features option for SVD. */
+#define RECATHON_MAX_FEATURES 1000
+
+/* Upper limit on the neighborhood option for similarity models. */
+#define RECATHON_MAX_NEIGHBORHOOD 1000000
+
+/* Upper limits on the LSH options for approximate similarity models. */
+#define RECATHON_MAX_LSH_BANDS 256
+#define RECATHON_MAX_LSH_ROWS 32
+
+/* Upper limits on the clustering options for user similarity models. */
+#define RECATHON_MAX_USER_CLUSTERS 65536
+#define RECATHON_MAX_CLUSTER_PROBES 64
+
+/* Upper limit on the materialize option, predictions kept per user. */
+#define RECATHON_MAX_MATERIALIZE 10000
+
+/* Upper limit on the cells a partitioned recommender is split into. */
+#define RECATHON_MAX_CELLS 1000
+
+/* How much of a recommender is materialized, for recommenders whose
+ * level the maintenance process picks from their workload. */
+#define RECATHON_LEVEL_MODEL 0		/* models, scored per query */
+#define RECATHON_LEVEL_GENERATE 1	/* nothing, generated per query */
+#define RECATHON_LEVEL_VIEW 2		/* models and the RecView */
+
+/* How far the workload has to move past a level's break-even point
+ * before we switch, so we don't flip back and forth. */
+#define RECATHON_LEVEL_HYSTERESIS 2.0
+
+/* The weight of the latest pass in the smoothed query and update rates. */
+#define RECATHON_RATE_SMOOTHING 0.5
+
+/* When a maintenance pass ranks the rebuilds that are due, a recommender
+ * nobody queries counts as if it had this many queries a second, so the
+ * stalest of them still go first among themselves. */
+#define RECATHON_IDLE_QUERY_RATE 0.001
+
+/* After a rebuild, a RecView is only filled in again for the users whose
+ * lists the new models may change: a similarity or a factor counts as
+ * changed once it moves further than the tolerance. If more than the
+ * share of the view's users have changed, the whole view is refilled. */
+#define RECATHON_VIEW_TOLERANCE 0.001
+#define RECATHON_VIEW_REFILL_SHARE 0.5
+
+/* For hybrid recommenders, the heavy users are the most frequent ones
+ * who between them ask for this share of the queries. Every maintenance
+ * pass, each user's query count is multiplied by the decay, and users
+ * whose count falls below the floor are forgotten. */
+#define RECATHON_HEAVY_SHARE 0.8
+#define RECATHON_QUERY_DECAY 0.5
+#define RECATHON_QUERY_FLOOR 0.01
+
+/* For users with no events, items are ranked by their average,
+ * pulled towards the overall average by this many events. */
+#define RECATHON_POPULAR_DAMPING 10
+
+/* NOTIFY channel used to wake up the model maintenance process. */
+#define RECATHON_MAINTENANCE_CHANNEL "recathon_maintenance"
+
+/* NOTIFY channel on which a recommender built with notify_changes
+ * announces that some users' RecView lists changed. */
+#define RECATHON_CHANGES_CHANNEL "recathon_changes"
+
 /* An enum to list all of our recommendation methods. */
 typedef enum {
 	itemCosCF,
 	itemPearCF,
 	userCosCF,
 	userPearCF,
-	SVD
+	SVD,
+	ALS,
+	itemJaccardCF
 } recMethod;
 
-/* Structures for a linked list of similarity cells. */
-struct sim_node_t {
+/* Methods whose models are a pair of user and item factor
+ * tables, rather than one similarity table. */
+#define FACTOR_METHOD(method) ((method) == SVD || (method) == ALS)
+
+/* Model files are kept in this directory, under the data directory. */
+#define RECATHON_MODEL_DIR "pg_recathon"
+
+/* Model file identification. The format changes with the layout. */
+#define RECATHON_MODEL_MAGIC 0x42444352
+#define RECATHON_MODEL_FORMAT 4
+
+/* Every section of a model file starts on this boundary. */
+#define RECATHON_MODEL_ALIGN 64
+
+/* The sections of a model file, each a plain array. */
+typedef enum {
+	MODEL_FILE_USERS,		/* the user IDs, sorted */
+	MODEL_FILE_ITEMS,		/* the item IDs, sorted */
+	MODEL_FILE_ROWSTART,		/* CSR row offsets, one more than the rows */
+	MODEL_FILE_PACKSTART,		/* each CSR row's int64 offset into the packed columns */
+	MODEL_FILE_COLINDEX,		/* CSR column indexes, packed, the last section */
+	MODEL_FILE_VALUES,		/* CSR similarities, of valueBits each */
+	MODEL_FILE_ROWSCALE,		/* the scale of each quantized CSR row */
+	MODEL_FILE_RANKED,		/* each CSR row's entries, most similar first */
+	MODEL_FILE_USERFACTORS,		/* user factors, one row per user, of factorBits each */
+	MODEL_FILE_ITEMFACTORS,		/* item factors, one row per item, of factorBits each */
+	MODEL_FILE_SECTIONS
+} model_file_section;
+
+/* The header at the start of a model file. Similarity rows and
+ * columns index the item list, or the user list for user-based
+ * methods. */
+typedef struct model_file_header {
+	uint32			magic;
+	uint32			format;
+	uint32			version;	/* the model version written */
+	int32			method;		/* the recMethod */
+	int32			numUsers;
+	int32			numItems;
+	int32			numFeatures;	/* for factor models */
+	int32			numEntries;	/* similarity entries in use */
+	int32			valueBits;	/* 32 for floats, or 16 or 8 quantized */
+	int32			factorBits;	/* 32 for floats, or 16 for halves */
+	int32			maxRowLength;	/* the longest similarity row */
+	uint64			fileSize;
+	uint64			offset[MODEL_FILE_SECTIONS];
+	uint64			length[MODEL_FILE_SECTIONS];	/* in bytes, 0 if absent */
+} model_file_header;
+
+/* The precisions a recommender's shared models can be kept at. Quantized
+ * similarities are scaled so that the largest in their row uses the whole
+ * range; factors are stored as IEEE half-precision floats. */
+#define RECATHON_FULL_PRECISION 32
+#define RECATHON_QUANT_MAX(bits) ((bits) == 8 ? 127 : 32767)
+
+/* Entry j, in row i, of a sparse model, whose values may be quantized. */
+#define sparseValue(model, i, j) \
+	((model)->valueBits == 16 ? (model)->rowScale[i] * ((int16*) (model)->qvalues)[j] : \
+	 (model)->valueBits == 8 ? (model)->rowScale[i] * ((int8*) (model)->qvalues)[j] : \
+	 (model)->values[j])
+
+/* The column indexes of a shared sparse model's rows are sorted and
+ * packed, in blocks of up to RECATHON_PACK_BLOCK. Each block is a byte
+ * saying how many bytes each of its gaps takes, 1, 2 or 4, its first
+ * column in full, and then the gap from each column to the next, less
+ * one. At worst a row takes a byte per block more than plain ints. */
+#define RECATHON_PACK_BLOCK 64
+#define RECATHON_PACKED_SIZE(n) \
+	((Size) (n) * sizeof(int) + ((n) + RECATHON_PACK_BLOCK - 1) / RECATHON_PACK_BLOCK)
+
+/* A model file mapped into this backend. */
+struct model_file_t {
+	char			recname[NAMEDATALEN];
+	uint32			version;
+	char			*base;		/* the mapping */
+	Size			size;
+	int			refcount;	/* scans using it */
+	bool			stale;		/* unmap once nobody is */
+	struct model_file_t	*next;
+};
+typedef struct model_file_t* model_file;
+
+/* Structures for a vector of similarity cells. The IDs and events
+ * are kept in parallel arrays, appended to and then sorted once.
+ * A packed vector has its arrays, and itself, carved out of blocks
+ * shared with a whole set of vectors, made to size, which are freed
+ * together by freeSimVectors. */
+struct sim_vector_t {
+	int			length;
+	int			maxlength;
+	int			*id;
+	float			*event;
+	bool			packed;
+};
+typedef struct sim_vector_t* sim_vector;
+
+/* A single (id, event) pair, used while sorting a sim_vector. */
+typedef struct sim_entry {
 	int			id;
 	float			event;
-	struct sim_node_t	*next;
+} sim_entry;
+
+/* The header of a rating vector in a blocked build's temporary file,
+ * followed by its IDs and then its events. */
+typedef struct sim_spill_row {
+	int			id;
+	int			length;
+	float			norm;		/* vector length, or Pearson */
+	float			avg;		/* average event, for Pearson */
+} sim_spill_row;
+
+/* Roughly how much memory an exact similarity build needs for each
+ * event, and for each row beyond its events, used to decide when a
+ * build has to be done in blocks. */
+#define RECATHON_EVENT_BYTES	32
+#define RECATHON_ROW_BYTES	128
+
+/* A build that isn't told how many processes to use takes up to
+ * recathon_parallel_workers of them once it has about this many
+ * events, below which forking them isn't worth it. */
+#define RECATHON_PARALLEL_MIN_EVENTS	1000000
+
+/* Room for the description of how a model was built. */
+#define RECATHON_STRATEGY_LEN	256
+
+/* A hash table entry, mapping an ID to its rating vector's slot. */
+typedef struct sim_key_slot {
+	int			id;		/* hash key; must be first */
+	int			index;
+} sim_key_slot;
+
+/* State for building a similarity model one row at a time. */
+struct sim_builder_t {
+	int			numVectors;	/* the number of rating vectors */
+	sim_vector		*vectors;	/* the rating vectors, one per row */
+	float			*norms;		/* vector lengths or Pearson values */
+	float			*avgs;		/* average events, NULL for cosine */
+	bool			jaccard;	/* norms are set sizes, for Jaccard */
+	/* co-occurrence build information */
+	int			numCols;	/* the number of distinct column IDs */
+	int			*colIDs;	/* the sorted column IDs */
+	sim_vector		*transpose;	/* the rows having each column */
+	float			*accum;		/* partial dot products for a row */
+	bool			*inRow;		/* which rows we have partials for */
+	int			maxCols;	/* the room in the next three */
+	sim_vector		*colOf;		/* a row's columns, as it's built */
+	int			*colPos;	/* how far along each column we are */
+	float			*colEvent;	/* the row's event in each column */
+	/* dense build information */
+	float			*dense;		/* the rows as a dense matrix, or NULL */
+	uint64			*bits;		/* or for Jaccard, as bitsets */
+	int			bitWords;	/* the words in each bitset */
+	float			*blockSums;	/* dot products for a block of rows */
+	int			blockFirst;	/* the block's first row, or -1 */
+	int			blockRows;	/* the number of rows in the block */
+	bool			blockFull;	/* whether it has the earlier rows too */
+	int			rowStride;	/* how far apart the rows we want are */
+	int			rowEnd;		/* the row past the last one we want */
+	/* pruning information */
+	int			minSupport;	/* the fewest shared columns a pair needs */
+	float			minSimilarity;	/* the smallest similarity kept, in magnitude */
+	int			*support;	/* shared columns for a row, co-occurrence only */
+	float			denseWork;	/* dense cells per co-occurrence multiply-add, or -1 if too big */
+	/* approximate build information */
+	int			lshBands;	/* the number of LSH bands, or 0 for an exact build */
+	int			**lshBucketOf;	/* each row's bucket in each band, or -1 */
+	int			**lshBucketStart;	/* each band's bucket offsets into lshMembers */
+	int			**lshMembers;	/* each band's rows, grouped by bucket */
+	/* clustered build information */
+	int			numClusters;	/* the number of row clusters, or 0 */
+	int			clusterProbes;	/* how many clusters each row is compared with */
+	int			*clusterOf;	/* each row's nearest clusters, nearest first, or -1 */
+	int			*clusterStart;	/* each cluster's offsets into clusterMembers */
+	int			*clusterMembers;	/* the rows, grouped by cluster */
+	/* the most recent row */
+	int			rowLength;	/* the number of neighbors */
+	int			*rowIndex;	/* the row index of each neighbor */
+	float			*rowSim;	/* the similarity to each neighbor */
 };
-typedef struct sim_node_t* sim_node;
-
-/* Structures for a linked list of neighbor nodes.
- * Used when we have a specific neighborhood size. */
-struct nbr_node_t {
-	int			item1;
-	int			item2;
-	float			similarity;
-	struct nbr_node_t	*next;
+typedef struct sim_builder_t* sim_builder;
+
+/* State for inserting tuples straight into a model table. */
+struct model_writer_t {
+	Relation		rel;		/* the open model table */
+	BulkInsertState		bistate;	/* bulk insert buffer state */
+	CommandId		cid;		/* our command ID */
+	int			options;	/* for heap_insert */
+	long			count;		/* tuples inserted so far */
+	/* whether the table holds its tuples in key order */
+	bool			sorted;		/* still in order, into an empty table? */
+	int			lastKey1;	/* the keys of the last tuple */
+	int			lastKey2;
+	/* a model being refreshed in place already has its indexes */
+	CatalogIndexState	indstate;	/* or NULL, for a table with none */
 };
-typedef struct nbr_node_t* nbr_node;
+typedef struct model_writer_t* model_writer;
+
+/* The neighborhood of one row of a similarity model, for recommenders
+ * with a limited neighborhood. It holds the maxsize most similar
+ * neighbors seen so far, as a binary min-heap on similarity, so the
+ * least similar of them is at the top, ready to be replaced. */
+struct nbr_heap_t {
+	int			size;		/* the number of neighbors held */
+	int			maxsize;	/* the neighborhood size */
+	int			*index;		/* the row index of each neighbor */
+	float			*similarity;	/* the similarity to each neighbor */
+};
+typedef struct nbr_heap_t* nbr_heap;
+
+/* A column of a query's results, looked up by name the first time
+ * it's read, and by number after that. Bind it again for each query,
+ * since the lookup is only good for one tuple descriptor. */
+typedef struct tuple_column {
+	char			*attname;	/* the column's name */
+	TupleDesc		tupdesc;	/* the descriptor it was found in */
+	int			attnum;		/* its number there, or 0 if it's missing */
+	Oid			typid;		/* and its type */
+	int			(*readInt) (Datum value);	/* its reader for that type, */
+	float			(*readFloat) (Datum value);	/* as an int or a float */
+} tuple_column;
+
+/* A table kept open for looking rows up by an integer column through
+ * a btree index on it, without a query for each lookup. One with no
+ * heap couldn't be opened that way, and has to be queried. */
+typedef struct recathon_probe {
+	char			*relname;	/* the table asked for */
+	char			*keycol;	/* and the column */
+	Relation		heap;		/* the table, or NULL */
+	Relation		index;		/* the index we scan */
+	IndexScanDesc		scan;
+	ScanKeyData		key;		/* the column equals what's looked up */
+	Snapshot		snapshot;	/* what's visible to the lookups */
+	TupleTableSlot		*slot;		/* the row found */
+} recathon_probe;
+
+/* How one recommender method scores items for the user being
+ * prepared. score does one item; score_batch, if there is one, does n
+ * at once, given their item indexes, without going back through the
+ * dispatch for each. The strategy is picked when the scan starts. */
+#define RECATHON_SCORE_BATCH 1024
+typedef struct rec_strategy {
+	const char		*name;
+	float			(*score) (RecScanState *recnode, int itemid, int itemindex);
+	void			(*score_batch) (RecScanState *recnode, const int *itemindexes,
+					int n, float *scores);
+} rec_strategy;
 
 /* Structure to hold event information for SVD
- * training. Includes space for residual information. */
-struct svd_node_t {
-	int	userid;
-	int	itemid;
-	float	event;
-	float	residual;
+ * training, as parallel arrays so that each pass reads
+ * memory in order. Includes space for residual information:
+ * the sum of the features already trained this epoch, and of
+ * those after the one being trained. */
+struct svd_events_t {
+	int	numEvents;
+	int	*userid;
+	int	*itemid;
+	float	*event;
+	float	*residual;
+	float	*trailing;
 };
-typedef struct svd_node_t* svd_node;
+typedef struct svd_events_t* svd_events;
+
+/* Build parameters for similarity models, from the WITH clause
+ * of CREATE RECOMMENDER. All but the number of workers are kept
+ * in RecModelsCatalogue, so rebuilds use them too; with no number
+ * of workers, the build picks one from its size. With LSH
+ * bands, only the pairs of rows that share a bucket in some band
+ * are compared, each band hashing a row lshRows times. With user
+ * clusters, the users are clustered first, and each is only compared
+ * with the users in its clusterProbes nearest clusters. Pairs with
+ * fewer than minSupport shared columns, or a similarity smaller
+ * than minSimilarity, are never written. */
+typedef struct sim_params {
+	int			numWorkers;
+	int			neighborhood;	/* neighbors kept per row, or 0 for all */
+	int			minSupport;	/* 0 or 1 for any pair with one in common */
+	float			minSimilarity;	/* 0 to keep every nonzero similarity */
+	int			lshBands;	/* 0 for an exact build */
+	int			lshRows;
+	int			userClusters;	/* 0 for an exact build */
+	int			clusterProbes;
+	char	   *buildNodes;	/* other nodes to share the build, or NULL */
+	char	   *vectorStore;	/* the recommender whose stored vectors to read */
+	int			shard;		/* the build only computes every */
+	int			numShards;	/* numShards'th row, from row shard */
+	char		strategy[RECATHON_STRATEGY_LEN];	/* how the build was done, and why */
+} sim_params;
+
+/* Training parameters for SVD models, from the WITH
+ * clause of CREATE RECOMMENDER. A tolerance of zero
+ * means every feature trains for every epoch. A rebuild
+ * can start from the factors of the model it replaces,
+ * which is then nearly trained already. */
+typedef struct svd_params {
+	int			numFeatures;
+	int			maxEpochs;
+	float			learnRate;
+	float			penalty;
+	float			tolerance;
+	char			*warmUserModel;	/* the user model to start from, or NULL */
+	char			*warmItemModel;	/* and its item model */
+	bool			warmStart;	/* did training start from them? */
+} svd_params;
+
+/* The tolerance a warm-started SVD training uses if it
+ * wasn't given one, so that it stops once it's caught up. */
+#define RECATHON_SVD_WARM_TOLERANCE 0.0001
 
 /* Similarity node maintenance. */
-extern sim_node createSimNode(int userid, float event);
-extern sim_node simInsert(sim_node target, sim_node newnode);
-extern void freeSimList(sim_node head);
+extern sim_vector createSimVector(void);
+extern void simVectorAppend(sim_vector vec, int id, float event);
+extern void simVectorSort(sim_vector vec);
+extern void freeSimVector(sim_vector vec);
+
+/* Neighborhood maintenance. */
+extern nbr_heap nbrHeapCreate(int maxsize);
+extern void nbrHeapReset(nbr_heap heap);
+extern void nbrHeapInsert(nbr_heap heap, int index, float similarity);
+extern void nbrHeapInsertBatch(nbr_heap heap, const int *index, const float *similarity, int n);
+extern void nbrHeapFree(nbr_heap heap);
+
+/* Top-k selection over arrays of scores. Once the k best held so far
+ * are known, the rest are picked out this many at a time, so that
+ * only the ones that beat the worst of them go any further. */
+#define RECATHON_SELECT_BLOCK 64
+extern int selectScores(const float *scores, int n, float threshold, bool highest, int *positions);
+
+/* GUC variable: the processes that score all users' recommendations. */
+extern int recathon_parallel_workers;
 
-/* Neighbor node maintenance. */
-extern nbr_node createNbrNode(int item1, int item2, float similarity);
-extern nbr_node nbrInsert(nbr_node target, nbr_node newnode, int maxsize);
-extern void freeNbrList(nbr_node head);
+/* GUC variable: do similarity builds done in blocks keep checkpoints? */
+extern bool recathon_build_checkpoints;
 
-/* Functions for executing queries within the source code. */
+/* GUC variable: milliseconds a top-k query may spend, or zero. */
+extern int recathon_time_budget;
+
+/* GUC variable: rebuilds for new events a maintenance pass does, or zero. */
+extern int recathon_max_rebuilds;
+
+/* GUC variable: the recommenders recathon_preload() loads. */
+extern char *recathon_preload_recommenders;
+
+/* What becomes of a user's repeated events for the same item. */
+typedef enum
+{
+	RECATHON_DUPLICATES_KEEP,	/* every one counts, as read */
+	RECATHON_DUPLICATES_SUM,	/* their events are added up */
+	RECATHON_DUPLICATES_MAX,	/* the largest is kept */
+	RECATHON_DUPLICATES_LAST,	/* the one read last is kept */
+	RECATHON_DUPLICATES_COUNT	/* the event is how many there are */
+} RecathonDuplicateEvents;
+
+/* GUC variable: a RecathonDuplicateEvents. */
+extern int recathon_duplicate_events;
+
+/* Functions for executing queries within the source code. Each one
+ * adds to recathon_query_count. */
+extern long recathon_query_count;
 extern QueryDesc* recathon_queryStart(char *query_string, MemoryContext *recathoncontext);
 extern void recathon_queryEnd(QueryDesc *queryDesc, MemoryContext recathoncontext);
+extern QueryDesc* recathon_queryStartParsed(Query *query, MemoryContext *recathoncontext);
+extern QueryDesc* recathon_queryStartCached(char *query_string, int nparams,
+			Oid *paramtypes, Datum *paramvalues, CachedPlan **cplan,
+			MemoryContext *recathoncontext);
+extern void recathon_queryEndCached(QueryDesc *queryDesc, CachedPlan *cplan,
+			MemoryContext recathoncontext);
 extern void recathon_queryExecute(char *query_string);
 extern void recathon_utilityExecute(char *query_string);
 
@@ -80,89 +478,278 @@ extern RecJoin* make_rec_from_join(Join *subjoin);
 extern int count_rows(char *tablename);
 extern int getTupleInt(TupleTableSlot *slot, char *attname);
 extern float getTupleFloat(TupleTableSlot *slot, char *attname);
+extern int getTupleFloatArray(TupleTableSlot *slot, char *attname, float *dest, int maxlen);
+extern int getTupleIntArray(TupleTableSlot *slot, char *attname, int *dest, int maxlen);
 extern char* getTupleString(TupleTableSlot *slot, char *attname);
+extern void bindColumn(tuple_column *col, char *attname);
+extern int columnInt(TupleTableSlot *slot, tuple_column *col);
+extern float columnFloat(TupleTableSlot *slot, tuple_column *col);
+extern int columnFloatArray(TupleTableSlot *slot, tuple_column *col, float *dest, int maxlen);
+extern int columnIntArray(TupleTableSlot *slot, tuple_column *col, int *dest, int maxlen);
+extern recathon_probe *probeOpen(char *relname, char *keycol);
+extern void probeStart(recathon_probe *probe, int key);
+extern TupleTableSlot *probeNext(recathon_probe *probe);
+extern void probeClose(recathon_probe *probe);
+extern void closeScanProbes(RecScanState *recstate);
 
 /* Functions for checking for existence. */
 extern bool relationExists(RangeVar* relation);
 extern bool columnExistsInRelation(char *colname, RangeVar *relation);
 extern char* retrieveRecommender(char *eventtable, char *method);
+extern List *filteredRecommenders(char *eventtable, char *method, List **ret_filters);
+extern TupleTableSlot *getRecCatalogueSlot(char *recindexname);
+extern TupleTableSlot *getRecIndexSlot(char *recindexname);
+extern void noteCatalogueChange(Relation rel, CmdType operation);
+extern void noteTableInherits(Oid relid);
 
 /* Functions for getting recommender data. */
 extern void getRecInfo(char *recindexname, char **ret_eventtable,
 		char **ret_userkey, char **ret_itemkey,
 		char **ret_eventval, char **ret_method, int *ret_numatts);
+extern void getRecSimParams(char *recindexname, sim_params *params);
+extern int getRecSVDparams(char *recindexname, recMethod method, svd_params *params);
+extern int getRecViewSize(char *recindexname);
+extern int getRecLevel(char *recindexname);
+extern bool getRecHybrid(char *recindexname);
+extern bool getRecIncremental(char *recindexname);
+extern bool getRecUnlogged(char *recindexname);
+extern char *getRecCell(char *recindexname, List *userIDList);
+extern void logUserQueries(char *recindexname, List *userIDList);
 
 /* Functions for parsing CreateRStmt data. */
 extern recMethod validateCreateRStmt(CreateRStmt *recStmt);
+extern bool isRefreshOption(DefElem *def);
+
+/* Functions for ALTER RECOMMENDER. */
+extern void refreshRecommender(char *recname, bool concurrent);
+extern void setRefreshPolicy(char *recname, List *options, bool reset);
 
 /* Functioning for converting a string to a RecMethod. */
+extern int getRecOptionInt(List *options, char *optname, int defaultval);
+extern bool getRecOptionBool(List *options, char *optname, bool defaultval);
+extern float getRecOptionFloat(List *options, char *optname, float defaultval);
+extern char *getRecOptionString(List *options, char *optname, char *defaultval);
+extern void getSimParams(List *options, sim_params *params);
+extern void getSVDparams(List *options, recMethod method, svd_params *params);
 extern recMethod getRecMethod(char *method);
+extern char *recMethodName(recMethod method);
 
 /* Function for updating a RecIndex based on an insert. */
-extern void updateCellCounter(char *eventtable, TupleTableSlot *insertslot);
+extern char* createModelTable(char *recname, recMethod method, bool itemside);
+extern void updateCellCounter(char *eventtable);
+extern void recordEventUser(Relation rel, HeapTuple tuple);
+extern Datum recathon_maintain(PG_FUNCTION_ARGS);
+extern Datum recathon_prewarm(PG_FUNCTION_ARGS);
+extern Datum recathon_preload(PG_FUNCTION_ARGS);
+extern Datum recathon_export(PG_FUNCTION_ARGS);
+extern Datum recathon_similar_items(PG_FUNCTION_ARGS);
+extern Datum recathon_recommend(PG_FUNCTION_ARGS);
+extern Datum recathon_recommend_batch(PG_FUNCTION_ARGS);
+extern Datum recathon_recommend_group(PG_FUNCTION_ARGS);
+extern Datum recathon_evaluate(PG_FUNCTION_ARGS);
+extern Datum recathon_model_stats(PG_FUNCTION_ARGS);
+extern Datum recathon_record_event(PG_FUNCTION_ARGS);
+extern Datum recathon_ingest(PG_FUNCTION_ARGS);
+extern Datum recathon_build_shard(PG_FUNCTION_ARGS);
 
 /* Functions for building a recommender based on itemCosCF. */
 extern int binarySearch(int *array, int value, int lo, int hi);
+extern int intCompare(const void *a, const void *b);
+extern void buildItemMap(RecScanState *recnode);
+extern int itemIndex(RecScanState *recnode, int itemID);
+extern int getListedUsers(List *userIDList, char *userkey, char *eventtable,
+		int **ret_userIDs);
+extern void refreshIDDictionary(char *recindexname, char *eventtable,
+		char *userkey, char *itemkey);
+extern void buildPopularityModel(char *recindexname, char *eventtable,
+		char *itemkey, char *eventval);
+extern int loadIDDictionary(char *recindexname, char *kind, int **ret_IDs);
+extern uint32 modelVersion(char *recindexname);
+extern void storeModelPrecision(char *recindexname, int bits);
+extern int loadModelPrecision(char *recindexname);
+extern bool refreshActiveItems(char *recindexname);
+extern int loadActiveItems(char *recindexname, int **ret_IDs);
+extern bool modelFileExists(char *recindexname);
+extern void recathonStatName(char *recindexname, char *statname);
+extern void removeModelFile(char *recindexname);
+extern void writeModelFile(char *recindexname, recMethod method);
+extern model_file openModelFile(char *recindexname, uint32 version);
+extern void closeModelFile(model_file mf);
+extern bool modelFileUserFactors(RecScanState *recstate, int userID);
+extern bool modelFileUserSim(RecScanState *recstate, int userID);
+extern bool modelDataShared(RecScanState *recstate, void *ptr);
+extern int loadCachedIDDictionary(RecScanState *recstate, char *kind, int **ret_IDs);
 extern int *getAllUsers(int numusers, char* usertable);
-extern float *vector_lengths(char *key, char *eventtable, char *eventval,
-	int *totalNum, int **IDlist);
-extern float dotProduct(sim_node item1, sim_node item2);
-extern float cosineSimilarity(sim_node item1, sim_node item2, float length1, float length2);
-extern int updateItemCosModel(char *eventtable, char *userkey, char *itemkey,
-		char *eventval, char *modelname, int *itemIDs, float *itemLengths,
-		int numItems, bool update);
+extern sim_vector *collectSimVectors(char *key, char *otherkey, char *eventtable,
+	char *eventval, int *totalNum, int **IDlist, int *totalEvents);
+extern sim_vector *createPackedSimVectors(int numVectors, int *lengths);
+extern void freeSimVectors(sim_vector *vectors, int numVectors);
+extern float *vector_lengths(sim_vector *vectors, int numVectors);
+extern float dotProduct(sim_vector item1, sim_vector item2);
+extern float cosineSimilarity(sim_vector item1, sim_vector item2, float length1, float length2);
+extern int updateItemCosModel(char *modelname, sim_vector *itemEvents, int *itemIDs,
+		float *itemLengths, int numItems, bool update, sim_params *params);
+extern int buildSimilarityModel(recMethod method, char *eventtable, char *userkey,
+		char *itemkey, char *eventval, char *modelname, sim_params *params);
+extern void analyzeModel(char *modelname);
+extern void noteBuildStrategy(char *recname, char *recindexname,
+		sim_params *params, int elevel);
+extern void indexSimilarityModel(char *modelname, char *column);
+extern void symmetrizeSimilarityModel(char *modelname, bool itemside);
+extern void ensureEventIndexes(char *eventtable, char *userkey, char *itemkey, char *eventval);
+extern void buildItemCosStats(char *recindexname, char *eventtable, char *userkey,
+		char *itemkey, char *eventval, char *modelname);
+extern int applyItemCosDeltas(char *recindexname, char *eventtable, char *userkey,
+		char *itemkey, char *eventval, char *modelname);
+extern void dropEventDeltas(char *recindexname);
+extern bool getRecPartialRefresh(char *recindexname);
+extern bool getRecOnline(char *recindexname);
+extern bool getRecVectorStore(char *recindexname);
+extern bool getRecSymmetric(char *recindexname);
+extern int getRecNeighborhood(char *recindexname);
+extern bool getRecGeneratable(char *recindexname, char *eventtable);
+extern bool getRecNotifyChanges(char *recindexname);
+extern char *getRecServeNodes(char *recindexname);
+extern char *getRecActiveItems(char *recindexname);
+extern void createEventDeltas(char *recindexname, char *eventtable, char *userkey,
+			char *itemkey, char *eventval);
+extern void clearEventDeltas(char *recindexname);
+extern void createVectorStore(char *recindexname, char *eventtable, char *userkey,
+			char *itemkey, char *eventval);
+extern sim_vector *loadStoredVectors(char *recindexname, char *key, char *otherkey,
+			char *eventtable, char *eventval, int *totalNum, int **IDlist,
+			int *totalEvents);
+extern void dropVectorStore(char *recindexname);
+extern int refreshSimilarityRows(char *recindexname, recMethod method, char *eventtable,
+			char *userkey, char *itemkey, char *eventval, char *modelname);
+extern int applyOnlineDeltas(char *recindexname, char *userkey, char *itemkey,
+			char *eventval, char *usermodelname, char *itemmodelname);
+extern int foldInSimilarityItems(char *recindexname, recMethod method, char *eventtable,
+			char *userkey, char *itemkey, char *eventval, char *modelname);
+extern void createEventFilter(char *recindexname, char *eventtable, char *filter);
+extern void createEventWindow(char *recindexname, char *eventtable, char *userkey,
+			char *itemkey, char *eventval, char *timekey, char *timewindow,
+			char *halflife);
+extern void createEventSample(char *recindexname, char *eventtable, char *userkey,
+			float fraction);
+extern char *getRecEventSource(char *recindexname, char *eventtable);
+extern char *getRecWindowSource(char *recindexname, char *eventtable);
+extern char *getRecFilterSource(char *recindexname, char *eventtable);
+extern int expireWindowEvents(char *recindexname, char *eventtable, char *userkey,
+			char *itemkey, char *eventval, char *modelname, bool incremental,
+			bool partialrefresh);
+extern void dropEventWindow(char *recindexname);
 
 /* Functions for building a recommender based on itemPearCF. */
-extern void pearson_info(char *key, char *eventtable, char *eventval, int *totalNum,
-				int **IDlist, float **avgList, float **pearsonList);
-extern float pearsonDotProduct(sim_node item1, sim_node item2, float avg1, float avg2);
-extern float pearsonSimilarity(sim_node item1, sim_node item2, float avg1, float avg2,
+extern void pearson_info(sim_vector *vectors, int numVectors, float **avgList,
+				float **pearsonList);
+extern float pearsonDotProduct(sim_vector item1, sim_vector item2, float avg1, float avg2);
+extern sim_builder simBuilderCreate(sim_vector *vectors, int numVectors,
+			float *norms, float *avgs, int lshBands, int lshRows);
+extern int distinctVectorIDs(sim_vector *vectors, int numVectors, int **ret_IDs);
+extern int simBuilderRow(sim_builder builder, int i);
+extern int simBuilderFullRow(sim_builder builder, int i);
+extern int simBuilderAgainst(sim_builder builder, sim_vector vec, float norm,
+		float avg, int upto);
+extern void simBuilderSetPruning(sim_builder builder, sim_params *params);
+extern void simBuilderFree(sim_builder builder);
+extern model_writer modelWriterOpen(char *modelname);
+extern void modelWriterInsert(model_writer writer, int key1, int key2, float value);
+extern void modelWriterInsertArray(model_writer writer, int key, float *features, int numFeatures);
+extern void modelWriterInsertVector(model_writer writer, int key, sim_vector vec);
+extern bool modelWriterClose(model_writer writer);
+extern bool writeSimilarityModel(sim_builder builder, int *IDs, char *modelname,
+			sim_params *params);
+extern float pearsonSimilarity(sim_vector item1, sim_vector item2, float avg1, float avg2,
 		float pearson1, float pearson2);
-extern int updateItemPearModel(char *eventtable, char *userkey, char *itemkey,
-		char *eventval, char *modelname, int *itemIDs, float *itemAvgs,
-		float *itemPearsons, int numItems, bool update);
+extern int updateItemPearModel(char *modelname, sim_vector *itemEvents, int *itemIDs,
+		float *itemAvgs, float *itemPearsons, int numItems, bool update,
+		sim_params *params);
+
+/* Functions for building a recommender based on itemJaccardCF. */
+extern float *jaccard_info(sim_vector *vectors, int numVectors);
+extern float jaccardSimilarity(sim_vector item1, sim_vector item2, float size1, float size2);
+extern sim_builder simBuilderCreateJaccard(sim_vector *vectors, int numVectors,
+			float *sizes, int lshBands, int lshRows);
+extern int updateItemJaccardModel(char *modelname, sim_vector *itemEvents, int *itemIDs,
+		float *itemSizes, int numItems, bool update, sim_params *params);
 
 /* Functions for building a user-based recommender. */
-extern int updateUserCosModel(char *eventtable, char *userkey, char *itemkey,
-		char *eventval, char *modelname, int *userIDs, float *userLengths,
-		int numUsers, bool update);
-extern int updateUserPearModel(char *eventtable, char *userkey, char *itemkey,
-		char *eventval, char *modelname, int *userIDs, float *userAvgs,
-		float *userPearsons, int numUsers, bool update);
+extern sim_builder simBuilderCreateClustered(sim_vector *vectors, int numVectors,
+			float *norms, float *avgs, int numClusters, int numProbes);
+extern int updateUserCosModel(char *modelname, sim_vector *userEvents, int *userIDs,
+		float *userLengths, int numUsers, bool update, sim_params *params);
+extern int updateUserPearModel(char *modelname, sim_vector *userEvents, int *userIDs,
+		float *userAvgs, float *userPearsons, int numUsers, bool update,
+		sim_params *params);
 
 /* Functions for building a SVD recommender. */
-extern svd_node createSVDnode(TupleTableSlot *slot, char *userkey, char *itemkey, char *eventval,
-		int *userIDs, int *itemIDs, int numUsers, int numItems);
-extern void SVDlists(char *userkey, char *itemkey, char *eventtable,
+extern svd_events SVDevents(char *userkey, char *itemkey, char *eventtable, char *eventval,
 		int **ret_userIDs, int **ret_itemIDs, int *ret_numUsers, int *ret_numItems);
-extern void SVDaverages(char *userkey, char *itemkey, char *eventtable, char *eventval,
-		int *userIDs, int *itemIDs, int numUsers, int numItems,
+extern void freeSVDevents(svd_events events);
+extern void SVDaverages(svd_events events, int numUsers, int numItems,
 		float **ret_itemAvgs, float **ret_userOffsets);
-extern float predictRating(int featurenum, int numFeatures, int userid, int itemid,
-		float **userFeatures, float **itemFeatures, float redisual);
+extern float predictRating(int featurenum, int numFeatures, float *userVec,
+		float *itemVec, float residual);
 extern int SVDtrain(char *userkey, char *itemkey, char *eventtable, char *eventval,
-		char *usermodelname, char *itemmodelname, bool update);
+		char *usermodelname, char *itemmodelname, bool update, int numWorkers,
+		svd_params *params);
+extern int ALStrain(char *userkey, char *itemkey, char *eventtable, char *eventval,
+		char *usermodelname, char *itemmodelname, int numWorkers,
+		svd_params *params);
+extern bool factorModelHasArrays(char *modelname);
+extern int loadFactorModel(char *modelname, char *keycol, int *IDs, int n,
+		float **ret_features);
+extern int foldInUserModel(char *recindexname, char *eventtable, char *userkey,
+		char *itemkey, char *eventval, char *usermodelname,
+		char *itemmodelname);
+extern int foldInItemModel(char *recindexname, char *eventtable, char *userkey,
+		char *itemkey, char *eventval, char *usermodelname,
+		char *itemmodelname);
+extern char* createClusterModel(char *recname, char *itemmodelname, int numClusters);
+extern int countClusters(char *clustername);
+extern void materializeRecView(char *recname, char *recindexname);
 
 /* Functions for building and querying recommenders on-the-fly. */
+extern GenSparseModel* sparseCreate(int numRows);
+extern void sparseStartRow(GenSparseModel *model, int row);
+extern void sparseAppend(GenSparseModel *model, int col, float value);
+extern void sparseFree(GenSparseModel *model);
+extern void loadItemEvents(RecScanState *recnode);
+extern void loadUserEvents(RecScanState *recnode);
 extern void generateItemCosModel(RecScanState *recnode);
 extern void generateItemPearModel(RecScanState *recnode);
+extern void generateItemJaccardModel(RecScanState *recnode);
 extern void generateUserCosModel(RecScanState *recnode);
 extern void generateUserPearModel(RecScanState *recnode);
 extern void generateSVDmodel(RecScanState *recnode);
+extern void generateALSmodel(RecScanState *recnode);
+extern int admitGeneratedModel(RecScanState *recnode);
 extern float itemCFgenerate(RecScanState *recnode, int itemid, int itemindex);
 extern float userCFgenerate(RecScanState *recnode, int itemid, int itemindex);
 extern float SVDgenerate(RecScanState *recnode, int itemid, int itemindex);
+/* How many model rows or items a query with a time budget goes
+ * through between looks at the clock. */
+#define RECATHON_BUDGET_ROWS 256
+extern bool recPastBudget(RecScanState *recnode, int every);
 extern void applyItemSimGenerate(RecScanState *recnode);
 
 /* Functions for calculating a rating prediction. */
+extern void loadItemClusters(RecScanState *recstate, char *clustername);
+extern void loadItemCandidates(RecScanState *recstate, Query *itemQuery);
+extern List *loadQueryUsers(Query *userQuery);
+extern int loadCachedItemFactors(RecScanState *recstate);
+extern void loadCachedItemSim(RecScanState *recstate);
 extern bool prepUserForRating(RecScanState *recstate, int userID);
-extern GenHash* hashCreate(int totalItems);
-extern void hashAdd(GenHash *table, GenRating *item);
-extern GenRating* hashFind(GenHash *table, int itemID);
-extern void freeHash(GenHash *table);
-extern float itemCFpredict(RecScanState *recnode, char *itemmodel, int itemid);
-extern float userCFpredict(RecScanState *recnode, char *eventval, int itemid);
-extern float SVDpredict(RecScanState *recnode, char *itemmodel, int itemid);
+extern int loadRecViewUser(RecScanState *recstate, int userID);
+extern int loadShardResults(RecScanState *recstate, char *nodelist);
+extern float itemCFpredict(RecScanState *recnode, int itemid, int itemindex);
+extern float itemJaccardScore(RecScanState *recnode, int itemid, int itemindex);
+extern float userCFpredict(RecScanState *recnode, int itemid, int itemindex);
+extern float SVDpredict(RecScanState *recnode, int itemid, int itemindex);
+extern const rec_strategy *recStrategy(recMethod method, bool generate);
+extern const rec_strategy *recModelStrategy(RecScanState *recnode, const rec_strategy *strategy);
+extern void scoreItemBatch(RecScanState *recnode, const int *itemindexes, int n, float *scores);
 extern void applyRecScore(RecScanState *recnode, TupleTableSlot *slot, int itemid, int itemindex);
 extern void applyItemSim(RecScanState *recnode, char *itemmodel);
 
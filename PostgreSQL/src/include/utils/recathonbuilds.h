@@ -0,0 +1,31 @@
+/*-------------------------------------------------------------------------
+ *
+ * recathonbuilds.h
+ *	  Shared-memory admission control for models generated on the fly.
+ *
+ *
+ * Portions Copyright (c) 2012-2013, University of Minnesota
+ * Portions Copyright (c) 1996-2012, PostgreSQL Global Development Group
+ * Portions Copyright (c) 1994, Regents of the University of California
+ *
+ * src/include/utils/recathonbuilds.h
+ *
+ *-------------------------------------------------------------------------
+ */
+#ifndef RECATHONBUILDS_H
+#define RECATHONBUILDS_H
+
+/* The most builds kept track of at once. */
+#define RECATHON_BUILDS 64
+
+/* GUC variable: kilobytes all builds may hold together, zero for no limit. */
+extern int	recathon_build_memory;
+
+extern Size RecathonBuildsShmemSize(void);
+extern void RecathonBuildsShmemInit(void);
+
+extern int	recathonBuildAdmit(const char *key, bool shared, Size estimate);
+extern void recathonBuildFinish(int handle, Size size);
+extern void recathonBuildRelease(int handle);
+
+#endif   /* RECATHONBUILDS_H */
@@ -0,0 +1,49 @@
+/*-------------------------------------------------------------------------
+ *
+ * recathoncache.h
+ *	  Shared-memory cache of decoded recommender models.
+ *
+ *
+ * Portions Copyright (c) 2012-2013, University of Minnesota
+ * Portions Copyright (c) 1996-2012, PostgreSQL Global Development Group
+ * Portions Copyright (c) 1994, Regents of the University of California
+ *
+ * src/include/utils/recathoncache.h
+ *
+ *-------------------------------------------------------------------------
+ */
+#ifndef RECATHONCACHE_H
+#define RECATHONCACHE_H
+
+/* GUC variable: the size of the cache in kilobytes, zero to disable it. */
+extern int	recathon_cache_size;
+
+/* GUC variable: kilobytes for the popular items' rows of a similarity
+ * model too big for the cache, zero to leave them all on disk. */
+extern int	recathon_cache_hot_memory;
+
+/* GUC variable: is shared memory asked for in huge pages, with the cache on? */
+extern bool recathon_cache_huge_pages;
+
+/* GUC variable: is the cache spread evenly over the NUMA nodes? */
+extern bool recathon_cache_interleave;
+
+/* A huge segment's size is rounded up to this, the usual huge page. */
+#define RECATHON_HUGE_PAGE_SIZE (2 * 1024 * 1024L)
+
+extern Size RecathonCacheShmemSize(void);
+extern void RecathonCacheShmemInit(void);
+
+extern bool recathonCacheEnabled(void);
+extern char *recathonCacheLookup(const char *recname, const char *kind,
+					uint32 version, Size *ret_size, int *ret_handle);
+extern char *recathonCacheReserve(const char *recname, const char *kind,
+					 uint32 version, Size size, int *ret_handle);
+extern void recathonCacheShrink(int handle, Size size);
+extern void recathonCacheFinish(int handle);
+extern void recathonCacheRelease(int handle);
+extern void recathonCacheDrop(const char *recname);
+extern bool recathonCacheOwns(const void *ptr);
+extern bool recathonVersionIsNewer(uint32 version);
+
+#endif   /* RECATHONCACHE_H */
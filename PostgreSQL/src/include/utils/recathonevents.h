@@ -0,0 +1,35 @@
+/*-------------------------------------------------------------------------
+ *
+ * recathonevents.h
+ *	  Shared-memory state of the events tables recommenders are built on.
+ *
+ *
+ * Portions Copyright (c) 2012-2013, University of Minnesota
+ * Portions Copyright (c) 1996-2012, PostgreSQL Global Development Group
+ * Portions Copyright (c) 1994, Regents of the University of California
+ *
+ * src/include/utils/recathonevents.h
+ *
+ *-------------------------------------------------------------------------
+ */
+#ifndef RECATHONEVENTS_H
+#define RECATHONEVENTS_H
+
+/* The most events tables kept track of. */
+#define RECATHON_EVENT_TABLES 64
+
+extern Size RecathonEventsShmemSize(void);
+extern void RecathonEventsShmemInit(void);
+
+extern bool recathonEventsClaimNotify(Oid relid);
+extern void recathonEventsReleaseNotify(Oid relid);
+extern void recathonEventsCommitted(Oid relid);
+extern bool recathonEventsWatch(Oid relid, uint64 *ret_generation);
+extern bool recathonEventsWatched(Oid relid);
+extern void recathonEventsPassStart(Oid relid);
+extern bool recathonEventsLookupCount(Oid relid, Oid relfilenode,
+						  int64 deleted, int *ret_count);
+extern void recathonEventsStoreCount(Oid relid, Oid relfilenode,
+						 int64 deleted, int count);
+
+#endif   /* RECATHONEVENTS_H */
@@ -0,0 +1,64 @@
+/*-------------------------------------------------------------------------
+ *
+ * recathonlatency.h
+ *	  Shared-memory latency histograms of recommenders.
+ *
+ *
+ * Portions Copyright (c) 2012-2013, University of Minnesota
+ * Portions Copyright (c) 1996-2012, PostgreSQL Global Development Group
+ * Portions Copyright (c) 1994, Regents of the University of California
+ *
+ * src/include/utils/recathonlatency.h
+ *
+ *-------------------------------------------------------------------------
+ */
+#ifndef RECATHONLATENCY_H
+#define RECATHONLATENCY_H
+
+/* The most recommenders kept track of at once. */
+#define RECATHON_LATENCY_RECOMMENDERS 64
+
+/*
+ * The buckets of a histogram: each of the first 16 microseconds has
+ * its own, and after that each power of two is split into eight, so
+ * a bucket is never more than an eighth wider than what it holds.
+ * The last takes everything from about an hour on.
+ */
+#define RECATHON_LATENCY_BUCKETS 240
+
+/* What a histogram times. */
+typedef enum RecathonLatencyPhase
+{
+	RECATHON_LATENCY_QUERY,		/* a RECOMMEND query, from start to end */
+	RECATHON_LATENCY_INIT,		/* its loading or building the model */
+	RECATHON_LATENCY_PREP,		/* its preparing users */
+	RECATHON_LATENCY_SCORE,		/* its scoring items */
+	RECATHON_LATENCY_REBUILD	/* a maintenance rebuild */
+} RecathonLatencyPhase;
+
+#define RECATHON_LATENCY_PHASES (RECATHON_LATENCY_REBUILD + 1)
+
+/* A copy of one recommender's histograms. */
+typedef struct RecathonLatencyStats
+{
+	char		recname[NAMEDATALEN];
+	uint64		count[RECATHON_LATENCY_PHASES];
+	uint64		total[RECATHON_LATENCY_PHASES];	/* in microseconds */
+	uint64		buckets[RECATHON_LATENCY_PHASES][RECATHON_LATENCY_BUCKETS];
+} RecathonLatencyStats;
+
+/* GUC variable */
+extern bool recathon_track_latency;
+
+extern Size RecathonLatencyShmemSize(void);
+extern void RecathonLatencyShmemInit(void);
+
+extern void recathonLatencyRecord(const char *recname, RecathonLatencyPhase phase,
+					  uint64 usecs);
+extern void recathonLatencyReset(void);
+extern void recathonLatencyDrop(const char *recname);
+extern int	recathonLatencySnapshot(RecathonLatencyStats **ret_stats);
+extern double recathonLatencyPercentile(const uint64 *buckets, uint64 count,
+						  double fraction);
+
+#endif   /* RECATHONLATENCY_H */
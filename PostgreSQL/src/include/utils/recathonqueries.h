@@ -0,0 +1,32 @@
+/*-------------------------------------------------------------------------
+ *
+ * recathonqueries.h
+ *	  Shared-memory tally of the users hybrid recommenders are queried for.
+ *
+ *
+ * Portions Copyright (c) 2012-2013, University of Minnesota
+ * Portions Copyright (c) 1996-2012, PostgreSQL Global Development Group
+ * Portions Copyright (c) 1994, Regents of the University of California
+ *
+ * src/include/utils/recathonqueries.h
+ *
+ *-------------------------------------------------------------------------
+ */
+#ifndef RECATHONQUERIES_H
+#define RECATHONQUERIES_H
+
+/* The most recommenders tallied at once. */
+#define RECATHON_QUERY_RECOMMENDERS 16
+
+/* The most users tallied for each between maintenance passes. */
+#define RECATHON_QUERY_USERS 1024
+
+extern Size RecathonQueriesShmemSize(void);
+extern void RecathonQueriesShmemInit(void);
+
+extern void recathonQueriesNote(const char *recindexname, const int *userIDs,
+					int numUsers);
+extern int	recathonQueriesDrain(const char *recindexname, int *userIDs,
+					 float *queries);
+
+#endif   /* RECATHONQUERIES_H */
@@ -0,0 +1,41 @@
+/*-------------------------------------------------------------------------
+ *
+ * recathonresults.h
+ *	  Shared-memory cache of the recommendations handed out to each user.
+ *
+ *
+ * Portions Copyright (c) 2012-2013, University of Minnesota
+ * Portions Copyright (c) 1996-2012, PostgreSQL Global Development Group
+ * Portions Copyright (c) 1994, Regents of the University of California
+ *
+ * src/include/utils/recathonresults.h
+ *
+ *-------------------------------------------------------------------------
+ */
+#ifndef RECATHONRESULTS_H
+#define RECATHONRESULTS_H
+
+/* The most predictions kept for a user. */
+#define RECATHON_RESULT_LENGTH 100
+
+/* GUC variable: the number of lists kept, zero to disable the cache. */
+extern int	recathon_result_cache_size;
+
+extern Size RecathonResultCacheShmemSize(void);
+extern void RecathonResultCacheShmemInit(void);
+
+extern bool recathonResultCacheEnabled(void);
+extern int recathonResultLookup(const char *recname, int userID,
+					 uint32 version, int wanted, int *items, float *scores,
+					 uint32 *ret_generation);
+extern void recathonResultStore(const char *recname, const char *eventtable,
+					int userID, uint32 version, uint32 generation,
+					int count, bool complete,
+					const int *items, const float *scores);
+extern void recathonResultInvalidate(const char *eventtable, int userID);
+extern void recathonResultInvalidateTable(const char *eventtable);
+extern void recathonResultDrop(const char *recname);
+extern void recathonPrewarmQueue(const char *eventtable, int userID);
+extern bool recathonPrewarmNext(char *eventtable, int *ret_userID);
+
+#endif   /* RECATHONRESULTS_H */
@@ -0,0 +1,62 @@
+/*-------------------------------------------------------------------------
+ *
+ * recathonxlog.h
+ *	  WAL records that ship model files to standbys.
+ *
+ *
+ * Portions Copyright (c) 2012-2013, University of Minnesota
+ * Portions Copyright (c) 1996-2012, PostgreSQL Global Development Group
+ * Portions Copyright (c) 1994, Regents of the University of California
+ *
+ * src/include/utils/recathonxlog.h
+ *
+ *-------------------------------------------------------------------------
+ */
+#ifndef RECATHONXLOG_H
+#define RECATHONXLOG_H
+
+#include "access/xlog.h"
+#include "lib/stringinfo.h"
+
+/* XLOG stuff */
+#define XLOG_RECATHON_MODEL_CHUNK		0x00
+#define XLOG_RECATHON_MODEL_ACTIVATE	0x10
+#define XLOG_RECATHON_MODEL_REMOVE		0x20
+
+/* The most of a model file one record carries. */
+#define RECATHON_MODEL_WAL_CHUNK (32 * BLCKSZ)
+
+/* Part of a new model file, written to its temporary file. */
+typedef struct xl_recathon_model_chunk
+{
+	Oid			dbId;			/* the recommender's database */
+	char		recindexname[NAMEDATALEN];
+	uint64		offset;			/* where the data goes in the file */
+	/* the data follows */
+} xl_recathon_model_chunk;
+
+#define SizeOfRecathonModelChunk	(offsetof(xl_recathon_model_chunk, offset) + sizeof(uint64))
+
+/* A new model file is complete, and takes the place of the old one. */
+typedef struct xl_recathon_model_activate
+{
+	Oid			dbId;			/* the recommender's database */
+	char		recindexname[NAMEDATALEN];
+	uint32		version;		/* the model version it holds */
+	uint64		fileSize;		/* what the chunks should add up to */
+} xl_recathon_model_activate;
+
+/* A recommender's model file is gone. */
+typedef struct xl_recathon_model_remove
+{
+	Oid			dbId;			/* the recommender's database */
+	char		recindexname[NAMEDATALEN];
+} xl_recathon_model_remove;
+
+extern void logModelFile(char *recindexname, char *tmppath, uint32 version, uint64 fileSize);
+extern void logModelFileRemoval(char *recindexname);
+
+extern void recathon_redo(XLogRecPtr lsn, XLogRecord *record);
+extern void recathon_desc(StringInfo buf, uint8 xl_info, char *rec);
+
+#endif   /* RECATHONXLOG_H */
@@ -53,6 +53,7 @@ static bool static_std_strings = false;
 static PGEvent *dupEvents(PGEvent *events, int count);
 static bool pqAddTuple(PGresult *res, PGresAttValue *tup);
 static bool PQsendQueryStart(PGconn *conn);
+static bool PQsendQueryUnbatched(PGconn *conn);
 static int PQsendQueryGuts(PGconn *conn,
 				const char *command,
 				const char *stmtName,
@@ -1110,7 +1111,7 @@ fail:
 int
 PQsendQuery(PGconn *conn, const char *query)
 {
-	if (!PQsendQueryStart(conn))
+	if (!PQsendQueryStart(conn) || !PQsendQueryUnbatched(conn))
 		return 0;
 
 	if (!query)
@@ -1200,7 +1201,7 @@ PQsendPrepare(PGconn *conn,
 			  const char *stmtName, const char *query,
 			  int nParams, const Oid *paramTypes)
 {
-	if (!PQsendQueryStart(conn))
+	if (!PQsendQueryStart(conn) || !PQsendQueryUnbatched(conn))
 		return 0;
 
 	if (!stmtName)
@@ -1354,6 +1355,24 @@ PQsendQueryStart(PGconn *conn)
 	return true;
 }
 
+/*
+ * Check that a command that can't join a batch isn't being sent while
+ * one is being queued.  Only PQsendQueryParams and PQsendQueryPrepared
+ * can join one, since their results are told apart by the messages that
+ * come back for each; the others would have to end it with their Sync.
+ */
+static bool
+PQsendQueryUnbatched(PGconn *conn)
+{
+	if (conn->batching)
+	{
+		printfPQExpBuffer(&conn->errorMessage,
+						  libpq_gettext("only PQsendQueryParams and PQsendQueryPrepared can be used in a batch\n"));
+		return false;
+	}
+	return true;
+}
+
 /*
  * PQsendQueryGuts
  *		Common code for protocol-3.0 query sending
@@ -1494,9 +1513,13 @@ PQsendQueryGuts(PGconn *conn,
 		pqPutMsgEnd(conn) < 0)
 		goto sendFailed;
 
-	/* construct the Sync message */
-	if (pqPutMsgStart('S', false, conn) < 0 ||
-		pqPutMsgEnd(conn) < 0)
+	/*
+	 * construct the Sync message, unless the query is being queued in a
+	 * batch, which PQsendBatch will end with one Sync of its own
+	 */
+	if (!conn->batching &&
+		(pqPutMsgStart('S', false, conn) < 0 ||
+		 pqPutMsgEnd(conn) < 0))
 		goto sendFailed;
 
 	/* remember we are using extended query protocol */
@@ -1511,6 +1534,15 @@ PQsendQueryGuts(PGconn *conn,
 	else
 		conn->last_query = NULL;
 
+	/*
+	 * A queued query waits for the rest of its batch.  Its messages will
+	 * have been sent already if the output buffer filled up, which is
+	 * fine; the server runs them as they come, and holds the results
+	 * until we read them.
+	 */
+	if (conn->batching)
+		return 1;
+
 	/*
 	 * Give the data a push.  In nonblock mode, don't complain if we're unable
 	 * to send it all; PQgetResult() will do any additional flushing needed.
@@ -1527,6 +1559,112 @@ sendFailed:
 	return 0;
 }
 
+/*
+ * PQbeginBatch
+ *	 Start queuing queries to be sent together
+ *
+ * Until PQsendBatch is called, PQsendQueryParams and PQsendQueryPrepared
+ * only add their queries to the output buffer, without the Sync message
+ * that would make the server answer.  PQsendBatch then sends them all,
+ * ending with a single Sync, and PQgetResult returns a result for each
+ * query in the order they were queued, then NULL.  A client that sends
+ * many small queries at once, such as prepared statements for each part
+ * of a page, thus waits for the network once rather than once a query.
+ *
+ * The queries of a batch run one after another in the same implicit
+ * transaction, unless they begin or end transactions themselves.  If
+ * one fails, the server skips the rest, so its error result is the last
+ * one before NULL.
+ *
+ * Returns: 1 if the batch was begun
+ *			0 if error (conn->errorMessage is set)
+ */
+int
+PQbeginBatch(PGconn *conn)
+{
+	if (!PQsendQueryStart(conn) || !PQsendQueryUnbatched(conn))
+		return 0;
+
+	/* This isn't gonna work on a 2.0 server */
+	if (PG_PROTOCOL_MAJOR(conn->pversion) < 3)
+	{
+		printfPQExpBuffer(&conn->errorMessage,
+		 libpq_gettext("function requires at least protocol version 3.0\n"));
+		return 0;
+	}
+
+	conn->batching = true;
+	return 1;
+}
+
+/*
+ * PQsendBatch
+ *	 Send the queries queued since PQbeginBatch, and wait for none of them
+ *
+ * Returns: 1 if successfully submitted
+ *			0 if error (conn->errorMessage is set)
+ */
+int
+PQsendBatch(PGconn *conn)
+{
+	if (!conn)
+		return 0;
+
+	if (!conn->batching)
+	{
+		printfPQExpBuffer(&conn->errorMessage,
+						  libpq_gettext("no batch has been begun\n"));
+		return 0;
+	}
+	conn->batching = false;
+
+	/* Don't try to send if we know there's no live connection. */
+	if (conn->status != CONNECTION_OK)
+	{
+		printfPQExpBuffer(&conn->errorMessage,
+						  libpq_gettext("no connection to the server\n"));
+		return 0;
+	}
+
+	/* construct the Sync message that ends the batch */
+	if (pqPutMsgStart('S', false, conn) < 0 ||
+		pqPutMsgEnd(conn) < 0)
+		goto sendFailed;
+
+	conn->queryclass = PGQUERY_EXTENDED;
+	conn->result = NULL;
+	conn->next_result = NULL;
+	conn->singleRowMode = false;
+
+	/*
+	 * Give the data a push.  In nonblock mode, don't complain if we're unable
+	 * to send it all; PQgetResult() will do any additional flushing needed.
+	 */
+	if (pqFlush(conn) < 0)
+		goto sendFailed;
+
+	/* OK, it's launched! */
+	conn->asyncStatus = PGASYNC_BUSY;
+	return 1;
+
+sendFailed:
+	pqHandleSendFailure(conn);
+	return 0;
+}
+
+/*
+ * PQisBatching
+ *	 Return TRUE if queries are being queued for PQsendBatch
+ */
+int
+PQisBatching(const PGconn *conn)
+{
+	if (!conn)
+		return FALSE;
+
+	return conn->batching;
+}
+
 /*
  * pqHandleSendFailure: try to clean up after failure to send command.
  *
@@ -1622,6 +1760,14 @@ PQconsumeInput(PGconn *conn)
 static void
 parseInput(PGconn *conn)
 {
+	/*
+	 * While a batch is being queued, the server may already be answering
+	 * the part of it we've sent.  Those answers wait until the batch is
+	 * sent, or they'd look like messages that arrived while idle.
+	 */
+	if (conn->batching)
+		return;
+
 	if (PG_PROTOCOL_MAJOR(conn->pversion) >= 3)
 		pqParseInput3(conn);
 	else
@@ -1867,6 +2013,10 @@ PQexecStart(PGconn *conn)
 	if (!conn)
 		return false;
 
+	/* A batch being queued has to be sent first. */
+	if (!PQsendQueryUnbatched(conn))
+		return false;
+
 	/*
 	 * Silently discard any prior query result that application didn't eat.
 	 * This is probably poor design, but it's here for backward compatibility.
@@ -2065,7 +2215,7 @@ PQsendDescribe(PGconn *conn, char desc_type, const char *desc_target)
 	if (!desc_target)
 		desc_target = "";
 
-	if (!PQsendQueryStart(conn))
+	if (!PQsendQueryStart(conn) || !PQsendQueryUnbatched(conn))
 		return 0;
 
 	/* This isn't gonna work on a 2.0 server */
@@ -390,6 +390,9 @@ extern int PQsendQueryPrepared(PGconn *conn,
 					const int *paramFormats,
 					int resultFormat);
 extern int	PQsetSingleRowMode(PGconn *conn);
+extern int	PQbeginBatch(PGconn *conn);
+extern int	PQsendBatch(PGconn *conn);
+extern int	PQisBatching(const PGconn *conn);
 extern PGresult *PQgetResult(PGconn *conn);
 
 /* Routines for managing an asynchronous query */
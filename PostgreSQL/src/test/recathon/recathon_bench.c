@@ -0,0 +1,478 @@
+/*-------------------------------------------------------------------------
+ *
+ * recathon_bench.c
+ *	  Microbenchmarks for the recommender's similarity and scoring kernels.
+ *
+ * Each kernel runs over synthetic rating vectors whose lengths and IDs
+ * follow power laws, as real rating data does: a few items are rated by
+ * most users, and most items by a few. We report the time per call and,
+ * where the kernel allows it, the hardware cache misses per call.
+ *
+ * The kernels are the backend's own, so this is loaded into a running
+ * server; see README.
+ *
+ * Portions Copyright (c) 2012-2013, University of Minnesota
+ * Portions Copyright (c) 1996-2012, PostgreSQL Global Development Group
+ *
+ * src/test/recathon/recathon_bench.c
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include <math.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#include "access/htup.h"
+#include "catalog/pg_type.h"
+#include "fmgr.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "portability/instr_time.h"
+#include "utils/builtins.h"
+#include "utils/recathon.h"
+#include "utils/tuplestore.h"
+
+PG_MODULE_MAGIC;
+
+extern Datum recathon_bench_kernels(PG_FUNCTION_ARGS);
+
+PG_FUNCTION_INFO_V1(recathon_bench_kernels);
+
+/* Features per factor vector, as CREATE RECOMMENDER defaults to. */
+#define BENCH_FEATURES		50
+/* Skew of vector lengths and of ID popularity. */
+#define BENCH_LENGTH_SKEW	0.8
+#define BENCH_ID_SKEW		1.0
+
+/* The data every kernel runs over. */
+typedef struct BenchData
+{
+	int			numVectors;
+	int			numIDs;
+	sim_vector *vectors;
+	float	   *lengths;
+	float	   *avgs;
+	float	   *pearsons;
+	float	   *userFactors;
+	float	   *itemFactors;
+	int		   *probes;			/* item IDs to look up, some missing */
+	int			numProbes;
+} BenchData;
+
+/* One kernel's results. */
+typedef struct BenchResult
+{
+	const char *kernel;
+	long		ops;
+	double		nsPerOp;
+	double		missesPerOp;	/* negative if we couldn't count */
+} BenchResult;
+
+static volatile float benchSink;
+
+/*
+ * A cache miss counter for this thread, or -1 if the platform or its
+ * settings won't give us one.
+ */
+static int
+cacheMissCounter(void)
+{
+#ifdef __linux__
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.size = sizeof(attr);
+	attr.config = PERF_COUNT_HW_CACHE_MISSES;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	return (int) syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+	return -1;
+#endif
+}
+
+static void
+counterStart(int fd)
+{
+#ifdef __linux__
+	if (fd >= 0)
+	{
+		ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+		ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+	}
+#endif
+}
+
+static double
+counterStop(int fd)
+{
+#ifdef __linux__
+	uint64		count;
+
+	if (fd >= 0)
+	{
+		ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+		if (read(fd, &count, sizeof(count)) == sizeof(count))
+			return (double) count;
+	}
+#endif
+	return -1.0;
+}
+
+/* A power-law draw from 0 .. n-1, favoring the low end. */
+static int
+powerLawDraw(unsigned short *seed, int n, double skew)
+{
+	double		u = pg_erand48(seed);
+	double		x;
+
+	/* Inverse of a continuous power law over [1, n+1). */
+	if (skew == 1.0)
+		x = exp(u * log((double) n + 1.0));
+	else
+		x = pow(u * (pow((double) n + 1.0, 1.0 - skew) - 1.0) + 1.0,
+				1.0 / (1.0 - skew));
+	return Min((int) x - 1, n - 1);
+}
+
+static void
+makeBenchData(BenchData *data, int numVectors, int maxLength)
+{
+	int			i, j;
+	unsigned short seed[3] = {0x1234, 0xabcd, 0x330e};
+
+	data->numVectors = numVectors;
+	data->numIDs = numVectors * 4;
+	data->vectors = (sim_vector *) palloc(numVectors * sizeof(sim_vector));
+	data->lengths = (float *) palloc(numVectors * sizeof(float));
+	data->avgs = (float *) palloc(numVectors * sizeof(float));
+	data->pearsons = (float *) palloc(numVectors * sizeof(float));
+
+	for (i = 0; i < numVectors; i++)
+	{
+		sim_vector	vec = createSimVector();
+		int			length;
+		int			prev = -1;
+		float		sum = 0.0,
+					sumsq = 0.0;
+
+		/* The i'th vector gets about maxLength / (i+1)^skew events. */
+		length = Max(1, (int) (maxLength / pow((double) (i + 1), BENCH_LENGTH_SKEW)));
+		for (j = 0; j < length; j++)
+			simVectorAppend(vec, powerLawDraw(seed, data->numIDs, BENCH_ID_SKEW),
+							1.0 + (float) (int) (5.0 * pg_erand48(seed)));
+		simVectorSort(vec);
+
+		/* The draws can repeat; keep one event per ID. */
+		length = 0;
+		for (j = 0; j < vec->length; j++)
+		{
+			if (vec->id[j] == prev)
+				continue;
+			prev = vec->id[j];
+			vec->id[length] = vec->id[j];
+			vec->event[length] = vec->event[j];
+			length++;
+		}
+		vec->length = length;
+
+		for (j = 0; j < length; j++)
+		{
+			sum += vec->event[j];
+			sumsq += vec->event[j] * vec->event[j];
+		}
+		data->vectors[i] = vec;
+		data->lengths[i] = sqrt(sumsq);
+		data->avgs[i] = sum / length;
+		data->pearsons[i] = sqrt(Max(sumsq - length * data->avgs[i] * data->avgs[i], 0.0));
+	}
+
+	data->userFactors = (float *) palloc(numVectors * BENCH_FEATURES * sizeof(float));
+	data->itemFactors = (float *) palloc(numVectors * BENCH_FEATURES * sizeof(float));
+	for (i = 0; i < numVectors * BENCH_FEATURES; i++)
+	{
+		data->userFactors[i] = 0.1 + 0.01 * pg_erand48(seed);
+		data->itemFactors[i] = 0.1 + 0.01 * pg_erand48(seed);
+	}
+
+	/* Half of the probes are for IDs we have, half usually not. */
+	data->numProbes = 4096;
+	data->probes = (int *) palloc(data->numProbes * sizeof(int));
+	for (i = 0; i < data->numProbes; i++)
+		data->probes[i] = (i % 2) ?
+			powerLawDraw(seed, data->numIDs, BENCH_ID_SKEW) :
+			(int) (data->numIDs * pg_erand48(seed));
+}
+
+/* The pairs of vectors the similarity kernels compare. */
+#define PAIR_FIRST(data, p)		((p) % (data)->numVectors)
+#define PAIR_SECOND(data, p)	(((p) * 7 + 1) % (data)->numVectors)
+
+typedef enum
+{
+	KERNEL_DOT,
+	KERNEL_COSINE,
+	KERNEL_PEARSON_DOT,
+	KERNEL_PEARSON,
+	KERNEL_PREDICT,
+	KERNEL_FACTOR_SCALAR,
+	KERNEL_INDEX_MAP,
+	KERNEL_INDEX_SEARCH,
+	KERNEL_ROW_PAIRWISE,
+	KERNEL_ROW_COOCCUR,
+	NUM_KERNELS
+} BenchKernel;
+
+static const char *const kernelNames[NUM_KERNELS] = {
+	"dotProduct",
+	"cosineSimilarity",
+	"pearsonDotProduct",
+	"pearsonSimilarity",
+	"predictRating",
+	"factor dot, scalar",
+	"itemIndex, ID map",
+	"itemIndex, binary search",
+	"similarity row, pairwise",
+	"similarity row, co-occurrence"
+};
+
+/*
+ * Run one kernel, ops times over, and return how many of its
+ * operations actually ran.
+ */
+static long
+runKernel(BenchKernel kernel, BenchData *data, RecScanState *mapped,
+		  RecScanState *searched, sim_builder builder, long ops)
+{
+	long		p;
+	int			j;
+	float		sum = 0.0;
+
+	switch (kernel)
+	{
+		case KERNEL_DOT:
+			for (p = 0; p < ops; p++)
+				sum += dotProduct(data->vectors[PAIR_FIRST(data, p)],
+								  data->vectors[PAIR_SECOND(data, p)]);
+			break;
+		case KERNEL_COSINE:
+			for (p = 0; p < ops; p++)
+			{
+				int			a = PAIR_FIRST(data, p),
+							b = PAIR_SECOND(data, p);
+
+				sum += cosineSimilarity(data->vectors[a], data->vectors[b],
+										data->lengths[a], data->lengths[b]);
+			}
+			break;
+		case KERNEL_PEARSON_DOT:
+			for (p = 0; p < ops; p++)
+			{
+				int			a = PAIR_FIRST(data, p),
+							b = PAIR_SECOND(data, p);
+
+				sum += pearsonDotProduct(data->vectors[a], data->vectors[b],
+										 data->avgs[a], data->avgs[b]);
+			}
+			break;
+		case KERNEL_PEARSON:
+			for (p = 0; p < ops; p++)
+			{
+				int			a = PAIR_FIRST(data, p),
+							b = PAIR_SECOND(data, p);
+
+				sum += pearsonSimilarity(data->vectors[a], data->vectors[b],
+										 data->avgs[a], data->avgs[b],
+										 data->pearsons[a], data->pearsons[b]);
+			}
+			break;
+		case KERNEL_PREDICT:
+			for (p = 0; p < ops; p++)
+				sum += predictRating(0, BENCH_FEATURES,
+									 data->userFactors + PAIR_FIRST(data, p) * BENCH_FEATURES,
+									 data->itemFactors + PAIR_SECOND(data, p) * BENCH_FEATURES,
+									 0.0);
+			break;
+		case KERNEL_FACTOR_SCALAR:
+			/* What predictRating does without vector instructions. */
+			for (p = 0; p < ops; p++)
+			{
+				float	   *u = data->userFactors + PAIR_FIRST(data, p) * BENCH_FEATURES;
+				float	   *v = data->itemFactors + PAIR_SECOND(data, p) * BENCH_FEATURES;
+				float		dot = 0.0;
+
+				for (j = 0; j < BENCH_FEATURES; j++)
+					dot += u[j] * v[j];
+				sum += dot;
+			}
+			break;
+		case KERNEL_INDEX_MAP:
+		case KERNEL_INDEX_SEARCH:
+			{
+				RecScanState *recnode = (kernel == KERNEL_INDEX_MAP) ? mapped : searched;
+
+				if (kernel == KERNEL_INDEX_MAP && !recnode->itemMap)
+					return 0;
+				for (p = 0; p < ops; p++)
+					sum += itemIndex(recnode, data->probes[p % data->numProbes]);
+			}
+			break;
+		case KERNEL_ROW_PAIRWISE:
+			/* The all-pairs build: row i against every later row. */
+			for (p = 0; p < ops; p++)
+			{
+				int			i = p % data->numVectors;
+
+				for (j = i + 1; j < data->numVectors; j++)
+					sum += cosineSimilarity(data->vectors[i], data->vectors[j],
+											data->lengths[i], data->lengths[j]);
+			}
+			break;
+		case KERNEL_ROW_COOCCUR:
+			for (p = 0; p < ops; p++)
+				sum += simBuilderRow(builder, p % data->numVectors);
+			break;
+		default:
+			return 0;
+	}
+
+	benchSink = sum;
+	return ops;
+}
+
+static void
+benchKernels(BenchData *data, long iterations, BenchResult *results)
+{
+	RecScanState *mapped,
+			   *searched;
+	sim_builder builder;
+	int			fd;
+	int			i, k;
+
+	/* Two scan states with the same item list: one that */
+	/* gets an ID map, and one left to binary search. */
+	mapped = (RecScanState *) palloc0(sizeof(RecScanState));
+	mapped->fullTotalItems = 0;
+	mapped->fullItemList = (int *) palloc(data->numIDs * sizeof(int));
+	for (i = 0; i < data->numIDs; i += 2)
+		mapped->fullItemList[mapped->fullTotalItems++] = i;
+	buildItemMap(mapped);
+	searched = (RecScanState *) palloc0(sizeof(RecScanState));
+	searched->fullTotalItems = mapped->fullTotalItems;
+	searched->fullItemList = mapped->fullItemList;
+
+	builder = simBuilderCreate(data->vectors, data->numVectors,
+							   data->lengths, NULL, 0, 0);
+
+	fd = cacheMissCounter();
+	for (k = 0; k < NUM_KERNELS; k++)
+	{
+		instr_time	start,
+					elapsed;
+		long		ops;
+		double		misses;
+
+		/* The row kernels do a whole row per operation. */
+		ops = (k == KERNEL_ROW_PAIRWISE || k == KERNEL_ROW_COOCCUR) ?
+			Max(iterations / 1000, 1) : iterations;
+
+		/* Once untimed, to warm the caches. */
+		runKernel(k, data, mapped, searched, builder, Min(ops, 1000));
+
+		counterStart(fd);
+		INSTR_TIME_SET_CURRENT(start);
+		ops = runKernel(k, data, mapped, searched, builder, ops);
+		INSTR_TIME_SET_CURRENT(elapsed);
+		misses = counterStop(fd);
+		INSTR_TIME_SUBTRACT(elapsed, start);
+
+		results[k].kernel = kernelNames[k];
+		results[k].ops = ops;
+		results[k].nsPerOp = ops > 0 ?
+			INSTR_TIME_GET_DOUBLE(elapsed) * 1.0e9 / ops : 0.0;
+		results[k].missesPerOp = (ops > 0 && misses >= 0.0) ? misses / ops : -1.0;
+
+		CHECK_FOR_INTERRUPTS();
+	}
+	if (fd >= 0)
+		close(fd);
+
+	simBuilderFree(builder);
+}
+
+/*
+ * recathon_bench_kernels(vectors int, iterations int8)
+ *
+ * Builds vectors synthetic rating vectors, runs each kernel iterations
+ * times over them and returns a row per kernel: its name, the calls
+ * made, nanoseconds per call and cache misses per call, or NULL for
+ * the misses if they can't be counted here.
+ */
+Datum
+recathon_bench_kernels(PG_FUNCTION_ARGS)
+{
+	int32		numVectors = PG_GETARG_INT32(0);
+	int64		iterations = PG_GETARG_INT64(1);
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext per_query_ctx;
+	MemoryContext oldcontext;
+	BenchData	data;
+	BenchResult results[NUM_KERNELS];
+	int			k;
+
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo) ||
+		!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not allowed in this context")));
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+	if (numVectors < 2 || iterations < 1)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("need at least two vectors and one iteration")));
+
+	makeBenchData(&data, numVectors, Min(numVectors, 2000));
+	benchKernels(&data, (long) iterations, results);
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+	MemoryContextSwitchTo(oldcontext);
+
+	for (k = 0; k < NUM_KERNELS; k++)
+	{
+		Datum		values[4];
+		bool		nulls[4];
+
+		if (results[k].ops == 0)
+			continue;
+
+		memset(nulls, 0, sizeof(nulls));
+		values[0] = CStringGetTextDatum(results[k].kernel);
+		values[1] = Int64GetDatum((int64) results[k].ops);
+		values[2] = Float8GetDatum(results[k].nsPerOp);
+		if (results[k].missesPerOp >= 0.0)
+			values[3] = Float8GetDatum(results[k].missesPerOp);
+		else
+			nulls[3] = true;
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
+}
@@ -0,0 +1,15 @@
+--
+-- Runs the recommender kernel microbenchmarks. Expects psql variables
+-- module (the path to recathon_bench's shared library), vectors and
+-- iterations; see the Makefile.
+--
+CREATE FUNCTION pg_temp.recathon_bench_kernels(vectors int, iterations int8,
+	OUT kernel text, OUT calls int8, OUT ns_per_call float8,
+	OUT cache_misses_per_call float8)
+	RETURNS SETOF record
+	AS :'module', 'recathon_bench_kernels'
+	LANGUAGE C STRICT;
+
+SELECT kernel, calls, round(ns_per_call::numeric, 1) AS ns_per_call,
+	round(cache_misses_per_call::numeric, 2) AS cache_misses_per_call
+FROM pg_temp.recathon_bench_kernels(:vectors, :iterations);
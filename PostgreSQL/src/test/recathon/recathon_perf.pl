@@ -0,0 +1,216 @@
+#!/usr/bin/perl
+#
+# recathon_perf.pl
+#
+# Performance regression test for recommenders. Loads a synthetic
+# MovieLens-style dataset into a fresh database, then times CREATE
+# RECOMMENDER for each method, single-user RECOMMEND queries with a
+# LIMIT, RecJoin queries, and a burst of inserts big enough to cross
+# the update threshold followed by the maintenance pass that rebuilds.
+# Each step's time is compared with a baseline file from an earlier
+# run, and we exit with status 1 if any step has slowed down by more
+# than the tolerance. See the README.
+#
+# src/test/recathon/recathon_perf.pl
+#
+
+use strict;
+use warnings;
+use Getopt::Long;
+use POSIX qw(ceil);
+use Time::HiRes qw(time);
+
+my $psql      = 'psql';
+my $db        = 'recathon_perf';
+my $scale     = 0.1;
+my $tolerance = 0.25;
+my $baseline  = 'perf_baseline.txt';
+my $update    = 0;
+
+GetOptions(
+	'psql=s'      => \$psql,
+	'db=s'        => \$db,
+	'scale=f'     => \$scale,
+	'tolerance=f' => \$tolerance,
+	'baseline=s'  => \$baseline,
+	'update'      => \$update) or die "usage: $0 [--psql=path] [--db=name] [--scale=N] [--tolerance=F] [--baseline=file] [--update]\n";
+
+# MovieLens 1M, at scale 1.
+my $users   = ceil(6040 * $scale);
+my $items   = ceil(3706 * $scale);
+my $ratings = ceil(1000209 * $scale);
+
+# Queries per timed query step, each for a different user.
+my $queries = 20;
+
+# Steps faster than this are all noise, and never fail.
+my $floor = 0.005;
+
+my @methods = qw(ItemCosCF ItemPearCF ItemJaccardCF UserCosCF UserPearCF SVD ALS);
+
+# Runs SQL in its own psql session, returning how long it took less
+# the cost of starting psql, which $startup holds once it's known.
+my $startup = 0;
+
+sub run_sql
+{
+	my ($dbname, $sql) = @_;
+	my $start = time();
+
+	open(my $fh, '|-', $psql, '-X', '-q', '-v', 'ON_ERROR_STOP=1',
+		'-o', '/dev/null', '-d', $dbname)
+	  or die "could not run $psql: $!\n";
+	print $fh $sql;
+	close($fh) or die "psql failed running:\n$sql\n";
+
+	my $elapsed = time() - $start - $startup;
+	return $elapsed > 0 ? $elapsed : 0;
+}
+
+my (@steps, %seconds);
+
+sub timed
+{
+	my ($step, $sql) = @_;
+
+	$seconds{$step} = run_sql($db, $sql);
+	push @steps, $step;
+	printf "%-32s %10.3f s\n", $step, $seconds{$step};
+}
+
+# A few users spread across the dataset, the same on every run.
+sub query_users
+{
+	return map { 1 + ($_ * 7919) % $users } 1 .. $queries;
+}
+
+# Start from nothing, so each run is the same.
+run_sql('postgres', "DROP DATABASE IF EXISTS $db;\n");
+run_sql('postgres', "CREATE DATABASE $db;\n");
+$startup = run_sql($db, "SELECT 1;\n");
+
+# Ratings are skewed towards a few users and items, as in real data.
+print "loading $ratings ratings of $items items by $users users\n";
+run_sql($db, <<"EOF");
+SELECT setseed(0.42);
+CREATE TABLE perf_ratings AS
+	SELECT DISTINCT ON (userid, itemid) userid, itemid, ratingval
+	FROM (SELECT 1 + floor($users * power(random(), 1.5))::int AS userid,
+			1 + floor($items * power(random(), 2))::int AS itemid,
+			(1 + floor(random() * 5))::real AS ratingval
+		FROM generate_series(1, $ratings)) r
+	ORDER BY userid, itemid;
+CREATE TABLE perf_items AS
+	SELECT i AS itemid, i % 18 AS genre FROM generate_series(1, $items) i;
+ANALYZE perf_ratings;
+ANALYZE perf_items;
+EOF
+
+foreach my $method (@methods)
+{
+	timed("create $method", <<"EOF");
+CREATE RECOMMENDER perf_\L$method\E ON perf_ratings
+USERS FROM userid ITEMS FROM itemid EVENTS FROM ratingval
+USING $method;
+EOF
+}
+
+foreach my $method (@methods)
+{
+	my $sql = '';
+
+	foreach my $user (query_users())
+	{
+		$sql .= "SELECT R.itemid, R.ratingval FROM perf_ratings R "
+		  . "RECOMMEND R.itemid TO R.userid ON R.ratingval USING $method "
+		  . "WHERE R.userid = $user ORDER BY R.ratingval DESC LIMIT 10;\n";
+	}
+	timed("recommend $method", $sql);
+}
+
+foreach my $method (qw(ItemCosCF SVD))
+{
+	my $sql = '';
+
+	foreach my $user (query_users())
+	{
+		$sql .= "SELECT I.itemid, R.ratingval FROM perf_ratings R, perf_items I "
+		  . "RECOMMEND R.itemid TO R.userid ON R.ratingval USING $method "
+		  . "WHERE R.userid = $user AND I.itemid = R.itemid AND I.genre = 3 "
+		  . "ORDER BY R.ratingval DESC LIMIT 10;\n";
+	}
+	timed("recjoin $method", $sql);
+}
+
+# Just enough new ratings for every recommender to be rebuilt.
+timed("insert burst", <<"EOF");
+INSERT INTO perf_ratings
+	SELECT 1 + floor($users * random())::int, 1 + floor($items * random())::int,
+		(1 + floor(random() * 5))::real
+	FROM generate_series(1, (SELECT ceil(update_threshold * $ratings)::int + 1
+		FROM recdbproperties));
+EOF
+timed("maintain", "SELECT recathon_maintain('perf_ratings');\n");
+
+run_sql('postgres', "DROP DATABASE $db;\n");
+
+if ($update)
+{
+	open(my $out, '>', $baseline) or die "could not write $baseline: $!\n";
+	printf $out "# scale %s\n", $scale;
+	printf $out "%s\t%.6f\n", $_, $seconds{$_} foreach @steps;
+	close($out);
+	print "baseline written to $baseline\n";
+	exit 0;
+}
+
+open(my $in, '<', $baseline)
+  or die "could not read $baseline: $!\nRun \"make perf-baseline\" first.\n";
+my %base;
+my $basescale;
+while (<$in>)
+{
+	chomp;
+	if (/^# scale (\S+)/)
+	{
+		$basescale = $1;
+		next;
+	}
+	next if /^#/ || /^\s*$/;
+	my ($step, $secs) = split /\t/;
+	$base{$step} = $secs;
+}
+close($in);
+die "$baseline was taken at scale $basescale, not $scale\n"
+  if defined $basescale && $basescale != $scale;
+
+my $failed = 0;
+print "\n";
+printf "%-32s %10s %10s %8s\n", 'step', 'seconds', 'baseline', 'ratio';
+foreach my $step (@steps)
+{
+	my $secs = $seconds{$step};
+	my $status = '';
+
+	if (!defined $base{$step})
+	{
+		printf "%-32s %10.3f %10s %8s  no baseline\n", $step, $secs, '-', '-';
+		next;
+	}
+	if ($secs > $base{$step} * (1 + $tolerance) && $secs - $base{$step} > $floor)
+	{
+		$status = '  SLOWER';
+		$failed++;
+	}
+	printf "%-32s %10.3f %10.3f %8.2f%s\n", $step, $secs, $base{$step},
+	  $base{$step} > 0 ? $secs / $base{$step} : 0, $status;
+}
+
+if ($failed)
+{
+	printf "\n%d of %d steps are more than %d%% slower than the baseline\n",
+	  $failed, scalar(@steps), $tolerance * 100;
+	exit 1;
+}
+print "\nno step is more than ", $tolerance * 100, "% slower than the baseline\n";
+exit 0;
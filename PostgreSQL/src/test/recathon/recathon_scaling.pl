@@ -0,0 +1,188 @@
+#!/usr/bin/perl
+#
+# recathon_scaling.pl
+#
+# Model build scaling benchmark. Loads each of the datasets bundled under
+# examples/, any given on the command line, and synthetic MovieLens-style
+# datasets at a series of scales, then builds a recommender with every
+# method on each. For every build it records the wall time, the backend's
+# peak resident memory, the bytes written to temporary files and the size
+# of the model tables, and writes them out as CSV. See the README.
+#
+# src/test/recathon/recathon_scaling.pl
+#
+
+use strict;
+use warnings;
+use File::Temp qw(tempdir);
+use Getopt::Long;
+use POSIX qw(ceil);
+
+my $psql      = 'psql';
+my $db        = 'recathon_scaling';
+my $examples  = 'examples';
+my $scales    = '1 2 4';
+my $methods   = 'ItemCosCF ItemPearCF ItemJaccardCF UserCosCF UserPearCF SVD ALS';
+my $output    = '-';
+my (@yelp, @geosocial);
+
+GetOptions(
+	'psql=s'      => \$psql,
+	'db=s'        => \$db,
+	'examples=s'  => \$examples,
+	'scales=s'    => \$scales,
+	'methods=s'   => \$methods,
+	'output=s'    => \$output,
+	'yelp=s'      => \@yelp,
+	'geosocial=s' => \@geosocial) or die "usage: $0 [--psql=path] [--db=name] [--examples=dir] [--scales='1 2 4'] [--methods='...'] [--output=file] [--yelp=file] [--geosocial=file]\n";
+
+my $tmp = tempdir(CLEANUP => 1);
+
+# Runs a script in its own psql session, returning what it printed.
+sub run_sql
+{
+	my ($dbname, $sql) = @_;
+	my $script = "$tmp/script.sql";
+
+	open(my $fh, '>', $script) or die "could not write $script: $!\n";
+	print $fh $sql;
+	close($fh);
+
+	my $out = `"$psql" -X -q -A -t -v ON_ERROR_STOP=1 -d "$dbname" -f "$script" 2>&1`;
+	die "psql failed running:\n$sql\n$out" if $? != 0;
+	return $out;
+}
+
+# A copy of the ratings in a file, with its delimiter and how many
+# columns it has. The first three are the user, the item and the rating.
+sub load_file
+{
+	my ($file, $delimiter, $columns) = @_;
+	my $extra = $columns > 3 ? ', extra BIGINT' : '';
+
+	die "$file is missing\n" unless -r $file;
+	return <<"EOF";
+CREATE TABLE raw_ratings (userid INTEGER, itemid INTEGER, ratingval REAL$extra);
+\\copy raw_ratings FROM '$file' WITH DELIMITER E'$delimiter'
+CREATE TABLE ratings AS SELECT userid, itemid, ratingval FROM raw_ratings;
+DROP TABLE raw_ratings;
+EOF
+}
+
+# MovieLens 1M's shape, at the given scale, skewed towards a few users and
+# items as real ratings are.
+sub load_synthetic
+{
+	my ($scale) = @_;
+	my $users   = ceil(6040 * $scale);
+	my $items   = ceil(3706 * $scale);
+	my $ratings = ceil(1000209 * $scale);
+
+	return <<"EOF";
+SELECT setseed(0.42);
+CREATE TABLE ratings AS
+	SELECT DISTINCT ON (userid, itemid) userid, itemid, ratingval
+	FROM (SELECT 1 + floor($users * power(random(), 1.5))::int AS userid,
+			1 + floor($items * power(random(), 2))::int AS itemid,
+			(1 + floor(random() * 5))::real AS ratingval
+		FROM generate_series(1, $ratings)) r
+	ORDER BY userid, itemid;
+EOF
+}
+
+my @datasets = (
+	[ 'ml-100k',     load_file("$examples/ml-100/ratings.csv", '\t', 4) ],
+	[ 'MovieLens1M', load_file("$examples/MoiveLens/ratings.dat", ';', 4) ],
+	[ 'MovieTweets', load_file("$examples/MoiveTweets/ratings.csv", ':', 3) ]);
+
+# These aren't bundled, so they're only run when given.
+push @datasets, [ 'yelp', load_file($_, ',', 3) ] foreach @yelp;
+push @datasets, [ 'GeoSocial', load_file($_, ',', 3) ] foreach @geosocial;
+push @datasets, [ "synthetic-x$_", load_synthetic($_) ] foreach split ' ', $scales;
+
+# Builds a recommender with the method, returning the build's seconds,
+# the backend's peak resident memory from /proc on Linux, the database's
+# temp file bytes as the statistics collector has them, and the size of
+# the model tables. So that the temp file counter has caught up, we give
+# the collector a moment before each reading.
+sub build
+{
+	my ($method) = @_;
+	my $sql = <<"EOF";
+\\o $tmp/pid
+SELECT pg_backend_pid();
+\\o
+SELECT pg_sleep(1);
+\\o $tmp/tempbefore
+SELECT temp_bytes FROM pg_stat_database WHERE datname = current_database();
+\\o
+\\timing on
+CREATE RECOMMENDER scaling_rec ON ratings
+USERS FROM userid ITEMS FROM itemid EVENTS FROM ratingval
+USING $method;
+\\timing off
+\\! grep VmHWM /proc/`cat $tmp/pid`/status > $tmp/mem 2>/dev/null
+SELECT pg_sleep(1);
+\\o $tmp/tempafter
+SELECT temp_bytes FROM pg_stat_database WHERE datname = current_database();
+\\o $tmp/model
+SELECT coalesce(sum(pg_total_relation_size(oid)), 0) FROM pg_class
+WHERE relkind = 'r' AND relname ~ '^scaling_rec(user|item)?model';
+\\o
+DROP RECOMMENDER scaling_rec;
+EOF
+
+	my $out = run_sql($db, $sql);
+	my ($ms) = $out =~ /Time: ([\d.]+) ms/;
+	my ($kb) = slurp("$tmp/mem") =~ /VmHWM:\s*(\d+)/;
+	my $temp = slurp("$tmp/tempafter") - slurp("$tmp/tempbefore");
+
+	unlink "$tmp/mem";
+	return (defined $ms ? sprintf('%.3f', $ms / 1000) : '',
+		defined $kb ? $kb : '', $temp, slurp("$tmp/model") + 0);
+}
+
+sub slurp
+{
+	my ($file) = @_;
+
+	open(my $fh, '<', $file) or return '';
+	local $/;
+	my $text = <$fh>;
+	close($fh);
+	$text =~ s/\s+$//;
+	return $text eq '' ? 0 : $text;
+}
+
+my $csv;
+if ($output eq '-')
+{
+	$csv = \*STDOUT;
+}
+else
+{
+	open($csv, '>', $output) or die "could not write $output: $!\n";
+}
+select((select($csv), $| = 1)[0]);
+
+print $csv "dataset,events,users,items,method,seconds,peak_rss_kb,temp_bytes,model_bytes\n";
+foreach my $dataset (@datasets)
+{
+	my ($name, $load) = @$dataset;
+
+	run_sql('postgres', "DROP DATABASE IF EXISTS $db;\nCREATE DATABASE $db;\n");
+	run_sql($db, $load . "ANALYZE ratings;\n");
+	my ($events, $users, $items) = split /\|/, run_sql($db,
+		"SELECT count(*), count(DISTINCT userid), count(DISTINCT itemid) FROM ratings;\n");
+	chomp $items;
+
+	foreach my $method (split ' ', $methods)
+	{
+		print $csv join(',', $name, $events, $users, $items, $method,
+			build($method)), "\n";
+	}
+}
+run_sql('postgres', "DROP DATABASE IF EXISTS $db;\n");
+
+close($csv) if $output ne '-';
+exit 0;